@@ -17,6 +17,10 @@
 #include "block/block.h"
 #include "qemu/queue.h"
 #include "qemu/sockets.h"
+#include "qemu/timer.h"
+#ifdef CONFIG_EPOLL
+#include <sys/epoll.h>
+#endif
 
 struct AioHandler
 {
@@ -43,6 +47,149 @@ static AioHandler *find_aio_handler(AioContext *ctx, int fd)
     return NULL;
 }
 
+#ifdef CONFIG_EPOLL
+/* With epoll the handlers stay registered with the kernel between calls to
+ * aio_poll(), and the GSource polls a single file descriptor.  If a file
+ * descriptor cannot be added to epoll the context falls back to polling
+ * each handler.
+ */
+
+#define AIO_EPOLL_MAX_EVENTS 128
+
+static uint32_t aio_epoll_events(int events)
+{
+    return (events & G_IO_IN ? EPOLLIN : 0) |
+           (events & G_IO_OUT ? EPOLLOUT : 0);
+}
+
+static int aio_epoll_revents(uint32_t events)
+{
+    return (events & EPOLLIN ? G_IO_IN : 0) |
+           (events & EPOLLOUT ? G_IO_OUT : 0) |
+           (events & EPOLLHUP ? G_IO_HUP : 0) |
+           (events & EPOLLERR ? G_IO_ERR : 0);
+}
+
+static void aio_epoll_disable(AioContext *ctx)
+{
+    AioHandler *node;
+
+    g_source_remove_poll(&ctx->source, &ctx->epoll_pfd);
+    close(ctx->epollfd);
+    ctx->epollfd = -1;
+    QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+        if (!node->deleted) {
+            g_source_add_poll(&ctx->source, &node->pfd);
+        }
+    }
+}
+
+static void aio_epoll_update(AioContext *ctx, AioHandler *node, bool is_new)
+{
+    struct epoll_event event = {
+        .events = aio_epoll_events(node->pfd.events),
+        .data.ptr = node,
+    };
+    int r;
+
+    r = epoll_ctl(ctx->epollfd, is_new ? EPOLL_CTL_ADD : EPOLL_CTL_MOD,
+                  node->pfd.fd, &event);
+    if (r < 0 && !is_new && errno == ENOENT) {
+        /* The file descriptor was closed and reopened */
+        r = epoll_ctl(ctx->epollfd, EPOLL_CTL_ADD, node->pfd.fd, &event);
+    }
+    if (r < 0) {
+        aio_epoll_disable(ctx);
+    }
+}
+
+static void aio_epoll_remove(AioContext *ctx, AioHandler *node)
+{
+    /* Fails harmlessly if the file descriptor is already closed */
+    epoll_ctl(ctx->epollfd, EPOLL_CTL_DEL, node->pfd.fd, NULL);
+}
+
+/* If the GSource found the epoll file descriptor ready, copy the ready
+ * events into the revents of their handlers, like g_poll() does for
+ * handlers polled one by one.
+ */
+static void aio_epoll_check(AioContext *ctx)
+{
+    struct epoll_event events[AIO_EPOLL_MAX_EVENTS];
+    AioHandler *node;
+    int i, ret;
+
+    if (ctx->epollfd < 0 || !ctx->epoll_pfd.revents) {
+        return;
+    }
+    ctx->epoll_pfd.revents = 0;
+    ret = epoll_wait(ctx->epollfd, events, AIO_EPOLL_MAX_EVENTS, 0);
+    for (i = 0; i < ret; i++) {
+        node = events[i].data.ptr;
+        node->pfd.revents = aio_epoll_revents(events[i].events);
+    }
+}
+
+/* epoll_wait() with a timeout in nanoseconds */
+static int aio_epoll_wait(AioContext *ctx, struct epoll_event *events,
+                          int64_t timeout)
+{
+#ifdef CONFIG_PPOLL
+    if (timeout > 0 && timeout % SCALE_MS) {
+        /* epoll_wait() only counts milliseconds.  Sleep on the epoll file
+         * descriptor itself so that timers do not fire late.
+         */
+        GPollFD pfd = {
+            .fd = ctx->epollfd,
+            .events = G_IO_IN,
+        };
+        int ret = qemu_poll_ns(&pfd, 1, timeout);
+        if (ret <= 0) {
+            return ret;
+        }
+        timeout = 0;
+    }
+#endif
+    return epoll_wait(ctx->epollfd, events, AIO_EPOLL_MAX_EVENTS,
+                      qemu_timeout_ns_to_ms(timeout));
+}
+
+void aio_context_setup(AioContext *ctx)
+{
+#ifdef CONFIG_EPOLL_CREATE1
+    ctx->epollfd = epoll_create1(EPOLL_CLOEXEC);
+#else
+    ctx->epollfd = epoll_create(AIO_EPOLL_MAX_EVENTS);
+    if (ctx->epollfd >= 0) {
+        qemu_set_cloexec(ctx->epollfd);
+    }
+#endif
+    if (ctx->epollfd >= 0) {
+        ctx->epoll_pfd.fd = ctx->epollfd;
+        ctx->epoll_pfd.events = G_IO_IN;
+        ctx->epoll_pfd.revents = 0;
+        g_source_add_poll(&ctx->source, &ctx->epoll_pfd);
+    }
+}
+
+void aio_context_cleanup(AioContext *ctx)
+{
+    if (ctx->epollfd >= 0) {
+        close(ctx->epollfd);
+        ctx->epollfd = -1;
+    }
+}
+#else
+void aio_context_setup(AioContext *ctx)
+{
+    ctx->epollfd = -1;
+}
+
+void aio_context_cleanup(AioContext *ctx)
+{
+}
+#endif
+
 void aio_set_fd_handler(AioContext *ctx,
                         int fd,
                         IOHandler *io_read,
@@ -57,6 +204,11 @@ void aio_set_fd_handler(AioContext *ctx,
     /* Are we deleting the fd handler? */
     if (!io_read && !io_write) {
         if (node) {
+#ifdef CONFIG_EPOLL
+            if (ctx->epollfd >= 0) {
+                aio_epoll_remove(ctx, node);
+            } else
+#endif
             g_source_remove_poll(&ctx->source, &node->pfd);
 
             /* If the lock is held, just mark the node as deleted */
@@ -73,13 +225,17 @@ void aio_set_fd_handler(AioContext *ctx,
             }
         }
     } else {
+        bool is_new = !node;
+
         if (node == NULL) {
             /* Alloc and insert if it's not already there */
             node = g_malloc0(sizeof(AioHandler));
             node->pfd.fd = fd;
             QLIST_INSERT_HEAD(&ctx->aio_handlers, node, node);
 
-            g_source_add_poll(&ctx->source, &node->pfd);
+            if (ctx->epollfd < 0) {
+                g_source_add_poll(&ctx->source, &node->pfd);
+            }
         }
         /* Update handler with latest information */
         node->io_read = io_read;
@@ -90,6 +246,11 @@ void aio_set_fd_handler(AioContext *ctx,
 
         node->pfd.events = (io_read ? G_IO_IN | G_IO_HUP | G_IO_ERR : 0);
         node->pfd.events |= (io_write ? G_IO_OUT | G_IO_ERR : 0);
+#ifdef CONFIG_EPOLL
+        if (ctx->epollfd >= 0) {
+            aio_epoll_update(ctx, node, is_new);
+        }
+#endif
     }
 
     aio_notify(ctx);
@@ -109,6 +270,10 @@ bool aio_pending(AioContext *ctx)
 {
     AioHandler *node;
 
+#ifdef CONFIG_EPOLL
+    aio_epoll_check(ctx);
+#endif
+
     QLIST_FOREACH(node, &ctx->aio_handlers, node) {
         int revents;
 
@@ -124,11 +289,41 @@ bool aio_pending(AioContext *ctx)
     return false;
 }
 
+/* Call the handlers of @node for its revents.  The caller must hold
+ * walking_handlers.
+ */
+static bool aio_dispatch_handler(AioHandler *node)
+{
+    bool progress = false;
+    int revents;
+
+    revents = node->pfd.revents & node->pfd.events;
+    node->pfd.revents = 0;
+
+    if (!node->deleted &&
+        (revents & (G_IO_IN | G_IO_HUP | G_IO_ERR)) &&
+        node->io_read) {
+        node->io_read(node->opaque);
+        progress = true;
+    }
+    if (!node->deleted &&
+        (revents & (G_IO_OUT | G_IO_ERR)) &&
+        node->io_write) {
+        node->io_write(node->opaque);
+        progress = true;
+    }
+    return progress;
+}
+
 static bool aio_dispatch(AioContext *ctx)
 {
     AioHandler *node;
     bool progress = false;
 
+#ifdef CONFIG_EPOLL
+    aio_epoll_check(ctx);
+#endif
+
     /*
      * We have to walk very carefully in case qemu_aio_set_fd_handler is
      * called while we're walking.
@@ -136,23 +331,10 @@ static bool aio_dispatch(AioContext *ctx)
     node = QLIST_FIRST(&ctx->aio_handlers);
     while (node) {
         AioHandler *tmp;
-        int revents;
 
         ctx->walking_handlers++;
 
-        revents = node->pfd.revents & node->pfd.events;
-        node->pfd.revents = 0;
-
-        if (!node->deleted &&
-            (revents & (G_IO_IN | G_IO_HUP | G_IO_ERR)) &&
-            node->io_read) {
-            node->io_read(node->opaque);
-            progress = true;
-        }
-        if (!node->deleted &&
-            (revents & (G_IO_OUT | G_IO_ERR)) &&
-            node->io_write) {
-            node->io_write(node->opaque);
+        if (aio_dispatch_handler(node)) {
             progress = true;
         }
 
@@ -174,6 +356,7 @@ bool aio_poll(AioContext *ctx, bool blocking)
     AioHandler *node;
     int ret;
     bool busy, progress;
+    int64_t timeout;
 
     progress = false;
 
@@ -191,6 +374,10 @@ bool aio_poll(AioContext *ctx, bool blocking)
         progress = true;
     }
 
+    if (aio_run_timers(ctx)) {
+        progress = true;
+    }
+
     if (progress && !blocking) {
         return true;
     }
@@ -214,7 +401,7 @@ bool aio_poll(AioContext *ctx, bool blocking)
             }
             busy = true;
         }
-        if (!node->deleted && node->pfd.events) {
+        if (!node->deleted && node->pfd.events && ctx->epollfd < 0) {
             GPollFD pfd = {
                 .fd = node->pfd.fd,
                 .events = node->pfd.events,
@@ -226,15 +413,49 @@ bool aio_poll(AioContext *ctx, bool blocking)
 
     ctx->walking_handlers--;
 
+    /* A pending timer counts as outstanding work, and bounds the wait */
+    timeout = aio_timer_deadline_ns(ctx);
+    if (timeout >= 0) {
+        busy = true;
+    }
+    if (!blocking) {
+        timeout = 0;
+    }
+
     /* No AIO operations?  Get us out of here */
     if (!busy) {
         return progress;
     }
 
+#ifdef CONFIG_EPOLL
+    if (ctx->epollfd >= 0) {
+        struct epoll_event events[AIO_EPOLL_MAX_EVENTS];
+        int i;
+
+        /* Dispatch the ready handlers directly, without walking the list.
+         * Deleted nodes are only freed by aio_dispatch().
+         */
+        ret = aio_epoll_wait(ctx, events, timeout);
+        ctx->walking_handlers++;
+        for (i = 0; i < ret; i++) {
+            node = events[i].data.ptr;
+            node->pfd.revents = aio_epoll_revents(events[i].events);
+            if (aio_dispatch_handler(node)) {
+                progress = true;
+            }
+        }
+        ctx->walking_handlers--;
+
+        aio_run_timers(ctx);
+        assert(progress || busy);
+        return true;
+    }
+#endif
+
     /* wait until next event */
-    ret = g_poll((GPollFD *)ctx->pollfds->data,
-                 ctx->pollfds->len,
-                 blocking ? -1 : 0);
+    ret = qemu_poll_ns((GPollFD *)ctx->pollfds->data,
+                       ctx->pollfds->len,
+                       timeout);
 
     /* if we have any readable fds, dispatch event */
     if (ret > 0) {
@@ -250,6 +471,7 @@ bool aio_poll(AioContext *ctx, bool blocking)
         }
     }
 
+    aio_run_timers(ctx);
     assert(progress || busy);
     return true;
 }
@@ -19,6 +19,7 @@
 #include "block/block.h"
 #include "qemu/queue.h"
 #include "qemu/sockets.h"
+#include "qemu/timer.h"
 
 struct AioHandler {
     EventNotifier *e;
@@ -79,6 +80,15 @@ void aio_set_event_notifier(AioContext *ctx,
     aio_notify(ctx);
 }
 
+void aio_context_setup(AioContext *ctx)
+{
+    ctx->epollfd = -1;
+}
+
+void aio_context_cleanup(AioContext *ctx)
+{
+}
+
 bool aio_pending(AioContext *ctx)
 {
     AioHandler *node;
@@ -98,6 +108,7 @@ bool aio_poll(AioContext *ctx, bool blocking)
     HANDLE events[MAXIMUM_WAIT_OBJECTS + 1];
     bool busy, progress;
     int count;
+    int64_t deadline;
 
     progress = false;
 
@@ -140,6 +151,10 @@ bool aio_poll(AioContext *ctx, bool blocking)
         }
     }
 
+    if (aio_run_timers(ctx)) {
+        progress = true;
+    }
+
     if (progress && !blocking) {
         return true;
     }
@@ -167,6 +182,12 @@ bool aio_poll(AioContext *ctx, bool blocking)
 
     ctx->walking_handlers--;
 
+    /* A pending timer counts as outstanding work, and bounds the wait */
+    deadline = aio_timer_deadline_ns(ctx);
+    if (deadline >= 0) {
+        busy = true;
+    }
+
     /* No AIO operations?  Get us out of here */
     if (!busy) {
         return progress;
@@ -174,8 +195,14 @@ bool aio_poll(AioContext *ctx, bool blocking)
 
     /* wait until next event */
     while (count > 0) {
-        int timeout = blocking ? INFINITE : 0;
-        int ret = WaitForMultipleObjects(count, events, FALSE, timeout);
+        DWORD timeout = 0;
+        int ret;
+
+        if (blocking) {
+            timeout = deadline < 0 ? INFINITE
+                                   : qemu_timeout_ns_to_ms(deadline);
+        }
+        ret = WaitForMultipleObjects(count, events, FALSE, timeout);
 
         /* if we have any signaled events, dispatch event */
         if ((DWORD) (ret - WAIT_OBJECT_0) >= count) {
@@ -214,6 +241,7 @@ bool aio_poll(AioContext *ctx, bool blocking)
         events[ret - WAIT_OBJECT_0] = events[--count];
     }
 
+    aio_run_timers(ctx);
     assert(progress || busy);
     return true;
 }
@@ -24,6 +24,7 @@
 #include <stdint.h>
 #include <stdarg.h>
 #include <stdlib.h>
+#include <zlib.h>
 #ifndef _WIN32
 #include <sys/types.h>
 #include <sys/mman.h>
@@ -49,6 +50,10 @@
 #include "qmp-commands.h"
 #include "trace.h"
 #include "exec/cpu-all.h"
+#include "qemu/thread.h"
+#include "qemu/atomic.h"
+#include "sysemu/cpus.h"
+#include "migration/postcopy-ram.h"
 
 #ifdef DEBUG_ARCH_INIT
 #define DPRINTF(fmt, ...) \
@@ -113,27 +118,8 @@ const uint32_t arch_type = QEMU_ARCH;
 #define RAM_SAVE_FLAG_EOS      0x10
 #define RAM_SAVE_FLAG_CONTINUE 0x20
 #define RAM_SAVE_FLAG_XBZRLE   0x40
-
-#ifdef __ALTIVEC__
-#include <altivec.h>
-#define VECTYPE        vector unsigned char
-#define SPLAT(p)       vec_splat(vec_ld(0, p), 0)
-#define ALL_EQ(v1, v2) vec_all_eq(v1, v2)
-/* altivec.h may redefine the bool macro as vector type.
- * Reset it to POSIX semantics. */
-#undef bool
-#define bool _Bool
-#elif defined __SSE2__
-#include <emmintrin.h>
-#define VECTYPE        __m128i
-#define SPLAT(p)       _mm_set1_epi8(*(p))
-#define ALL_EQ(v1, v2) (_mm_movemask_epi8(_mm_cmpeq_epi8(v1, v2)) == 0xFFFF)
-#else
-#define VECTYPE        unsigned long
-#define SPLAT(p)       (*(p) * (~0UL / 255))
-#define ALL_EQ(v1, v2) ((v1) == (v2))
-#endif
-
+#define RAM_SAVE_FLAG_ZLIB     0x80
+#define RAM_SAVE_FLAG_DISCARD  0x100
 
 static struct defconfig_file {
     const char *filename;
@@ -166,22 +152,12 @@ int qemu_read_default_config_files(bool userconfig)
 
 static int is_dup_page(uint8_t *page)
 {
-    VECTYPE *p = (VECTYPE *)page;
-    VECTYPE val = SPLAT(page);
-    int i;
-
-    for (i = 0; i < TARGET_PAGE_SIZE / sizeof(VECTYPE); i++) {
-        if (!ALL_EQ(val, p[i])) {
-            return 0;
-        }
-    }
-
-    return 1;
+    return buffer_is_dup(page, TARGET_PAGE_SIZE);
 }
 
 /* struct contains XBZRLE cache and a static page
    used by the compression */
-static struct {
+typedef struct XBZRLEState {
     /* buffer used for XBZRLE encoding */
     uint8_t *encoded_buf;
     /* buffer for storing page content */
@@ -190,22 +166,17 @@ static struct {
     uint8_t *decoded_buf;
     /* Cache for XBZRLE */
     PageCache *cache;
-} XBZRLE = {
+} XBZRLEState;
+
+static XBZRLEState XBZRLE = {
     .encoded_buf = NULL,
     .current_buf = NULL,
     .decoded_buf = NULL,
     .cache = NULL,
 };
 
-
-int64_t xbzrle_cache_resize(int64_t new_size)
-{
-    if (XBZRLE.cache != NULL) {
-        return cache_resize(XBZRLE.cache, new_size / TARGET_PAGE_SIZE) *
-            TARGET_PAGE_SIZE;
-    }
-    return pow2floor(new_size);
-}
+/* buffer used for zlib compression of pages on the single-threaded path */
+static uint8_t *compress_buf;
 
 /* accounting for migration statistics */
 typedef struct AccountingInfo {
@@ -215,11 +186,82 @@ typedef struct AccountingInfo {
     uint64_t xbzrle_bytes;
     uint64_t xbzrle_pages;
     uint64_t xbzrle_cache_miss;
+    uint64_t xbzrle_cache_hit;
+    uint64_t xbzrle_skipped;
     uint64_t xbzrle_overflows;
 } AccountingInfo;
 
 static AccountingInfo acct_info;
 
+/* Multi-thread migration: every worker owns a fixed, word-aligned range of
+ * the migration bitmap, so a page is always encoded by the same worker and
+ * the per-worker XBZRLE caches stay coherent with the destination.  The
+ * migration thread kicks all workers for a round, waits for them and then
+ * copies their output into the stream in worker order.
+ */
+typedef struct RAMSaveWorker {
+    QemuThread thread;
+    QemuSemaphore run_sem;
+    QemuSemaphore done_sem;
+    unsigned int id;
+    bool quit;
+    bool last_stage;
+    /* [start, end) is the ram_addr_t range owned by this worker */
+    ram_addr_t start;
+    ram_addr_t end;
+    ram_addr_t offset;
+    RAMBlock *block;
+    RAMBlock *last_sent_block;
+    /* in-memory file collecting the output of one round */
+    QEMUFile *file;
+    uint8_t *buf;
+    size_t buf_size;
+    size_t buf_capacity;
+    XBZRLEState xbzrle;
+    uint8_t *compress_buf;
+    AccountingInfo acct;
+    uint64_t dirty_cleared;
+} RAMSaveWorker;
+
+/* Worker statistics outlive the workers so that query-migrate can still
+ * report them once migration has completed. */
+typedef struct RAMSaveWorkerStats {
+    uint64_t pages;
+    uint64_t bytes;
+    int64_t busy_ns;
+} RAMSaveWorkerStats;
+
+/* amount of output a worker produces before it yields back to the
+ * migration thread */
+#define RAM_WORKER_ROUND_SIZE (64 * 1024)
+
+static RAMSaveWorker *ram_workers;
+static int nr_ram_workers;
+static RAMSaveWorkerStats ram_worker_stats[MAX_MIGRATE_THREADS];
+static int nr_ram_worker_stats;
+
+int64_t xbzrle_cache_resize(int64_t new_size)
+{
+    int i;
+
+    if (ram_workers) {
+        int64_t cache_pages = new_size / TARGET_PAGE_SIZE / nr_ram_workers;
+        int64_t ret = 0;
+
+        for (i = 0; i < nr_ram_workers; i++) {
+            if (ram_workers[i].xbzrle.cache) {
+                ret = cache_resize(ram_workers[i].xbzrle.cache, cache_pages);
+            }
+        }
+        return ret * nr_ram_workers * TARGET_PAGE_SIZE;
+    }
+    if (XBZRLE.cache != NULL) {
+        return cache_resize(XBZRLE.cache, new_size / TARGET_PAGE_SIZE) *
+            TARGET_PAGE_SIZE;
+    }
+    return pow2floor(new_size);
+}
+
 static void acct_clear(void)
 {
     memset(&acct_info, 0, sizeof(acct_info));
@@ -260,11 +302,45 @@ uint64_t xbzrle_mig_pages_cache_miss(void)
     return acct_info.xbzrle_cache_miss;
 }
 
+uint64_t xbzrle_mig_pages_cache_hit(void)
+{
+    return acct_info.xbzrle_cache_hit;
+}
+
+uint64_t xbzrle_mig_pages_skipped(void)
+{
+    return acct_info.xbzrle_skipped;
+}
+
 uint64_t xbzrle_mig_pages_overflow(void)
 {
     return acct_info.xbzrle_overflows;
 }
 
+MigrationThreadStatsList *ram_mig_thread_stats(void)
+{
+    MigrationThreadStatsList *head = NULL, **tail = &head;
+    int i;
+
+    for (i = 0; i < nr_ram_worker_stats; i++) {
+        RAMSaveWorkerStats *stats = &ram_worker_stats[i];
+        MigrationThreadStatsList *entry = g_malloc0(sizeof(*entry));
+
+        entry->value = g_malloc0(sizeof(*entry->value));
+        entry->value->id = i;
+        entry->value->pages = stats->pages;
+        entry->value->bytes = stats->bytes;
+        entry->value->busy_time = stats->busy_ns / 1000000;
+        if (stats->busy_ns) {
+            entry->value->throughput = stats->bytes * 1000000000ULL /
+                stats->busy_ns;
+        }
+        *tail = entry;
+        tail = &entry->next;
+    }
+    return head;
+}
+
 static size_t save_block_hdr(QEMUFile *f, RAMBlock *block, ram_addr_t offset,
                              int cont, int flag)
 {
@@ -283,57 +359,168 @@ static size_t save_block_hdr(QEMUFile *f, RAMBlock *block, ram_addr_t offset,
 }
 
 #define ENCODING_FLAG_XBZRLE 0x1
+/* pages whose delta did not get below this are not worth encoding again
+ * next time; they are sent as normal pages once */
+#define XBZRLE_SKIP_THRESHOLD (TARGET_PAGE_SIZE / 2)
 
-static int save_xbzrle_page(QEMUFile *f, uint8_t *current_data,
+static int save_xbzrle_page(QEMUFile *f, XBZRLEState *xbzrle,
+                            AccountingInfo *acct, uint8_t *current_data,
                             ram_addr_t current_addr, RAMBlock *block,
                             ram_addr_t offset, int cont, bool last_stage)
 {
     int encoded_len = 0, bytes_sent = -1;
     uint8_t *prev_cached_page;
 
-    if (!cache_is_cached(XBZRLE.cache, current_addr)) {
+    prev_cached_page = cache_lookup(xbzrle->cache, current_addr);
+    if (!prev_cached_page) {
         if (!last_stage) {
-            cache_insert(XBZRLE.cache, current_addr,
+            cache_insert(xbzrle->cache, current_addr,
                          g_memdup(current_data, TARGET_PAGE_SIZE));
         }
-        acct_info.xbzrle_cache_miss++;
+        acct->xbzrle_cache_miss++;
         return -1;
     }
+    acct->xbzrle_cache_hit++;
 
-    prev_cached_page = get_cached_data(XBZRLE.cache, current_addr);
+    /* the delta was too big last time, send this one as a normal page */
+    if (cache_test_and_clear_skip(xbzrle->cache, current_addr)) {
+        acct->xbzrle_skipped++;
+        memcpy(prev_cached_page, current_data, TARGET_PAGE_SIZE);
+        return -1;
+    }
 
     /* save current buffer into memory */
-    memcpy(XBZRLE.current_buf, current_data, TARGET_PAGE_SIZE);
+    memcpy(xbzrle->current_buf, current_data, TARGET_PAGE_SIZE);
 
     /* XBZRLE encoding (if there is no overflow) */
-    encoded_len = xbzrle_encode_buffer(prev_cached_page, XBZRLE.current_buf,
-                                       TARGET_PAGE_SIZE, XBZRLE.encoded_buf,
+    encoded_len = xbzrle_encode_buffer(prev_cached_page, xbzrle->current_buf,
+                                       TARGET_PAGE_SIZE, xbzrle->encoded_buf,
                                        TARGET_PAGE_SIZE);
     if (encoded_len == 0) {
         DPRINTF("Skipping unmodified page\n");
         return 0;
     } else if (encoded_len == -1) {
         DPRINTF("Overflow\n");
-        acct_info.xbzrle_overflows++;
+        acct->xbzrle_overflows++;
         /* update data in the cache */
         memcpy(prev_cached_page, current_data, TARGET_PAGE_SIZE);
+        cache_set_skip(xbzrle->cache, current_addr);
         return -1;
+    } else if (encoded_len > XBZRLE_SKIP_THRESHOLD) {
+        cache_set_skip(xbzrle->cache, current_addr);
     }
 
     /* we need to update the data in the cache, in order to get the same data */
     if (!last_stage) {
-        memcpy(prev_cached_page, XBZRLE.current_buf, TARGET_PAGE_SIZE);
+        memcpy(prev_cached_page, xbzrle->current_buf, TARGET_PAGE_SIZE);
     }
 
     /* Send XBZRLE based compressed page */
     bytes_sent = save_block_hdr(f, block, offset, cont, RAM_SAVE_FLAG_XBZRLE);
     qemu_put_byte(f, ENCODING_FLAG_XBZRLE);
     qemu_put_be16(f, encoded_len);
-    qemu_put_buffer(f, XBZRLE.encoded_buf, encoded_len);
+    qemu_put_buffer(f, xbzrle->encoded_buf, encoded_len);
     bytes_sent += encoded_len + 1 + 2;
-    acct_info.xbzrle_pages++;
-    acct_info.xbzrle_bytes += bytes_sent;
+    acct->xbzrle_pages++;
+    acct->xbzrle_bytes += bytes_sent;
+
+    return bytes_sent;
+}
+
+/* Returns the number of bytes written, or -1 if the page does not compress
+ * below TARGET_PAGE_SIZE and must be sent as a normal page. */
+static int save_zlib_page(QEMUFile *f, uint8_t *zbuf, uint8_t *p,
+                          RAMBlock *block, ram_addr_t offset, int cont)
+{
+    uLongf zlen = compressBound(TARGET_PAGE_SIZE);
+    int bytes_sent;
+
+    if (compress2(zbuf, &zlen, p, TARGET_PAGE_SIZE,
+                  migrate_compress_level()) != Z_OK ||
+        zlen >= TARGET_PAGE_SIZE) {
+        return -1;
+    }
+
+    bytes_sent = save_block_hdr(f, block, offset, cont, RAM_SAVE_FLAG_ZLIB);
+    qemu_put_be16(f, zlen);
+    qemu_put_buffer(f, zbuf, zlen);
+    bytes_sent += zlen + 2;
+
+    return bytes_sent;
+}
+
+/*
+ * ram_save_page: Encodes the page at @offset of @block into @f, trying
+ * duplicate detection, XBZRLE and zlib compression in turn.
+ *
+ * @last_block is the block of the last page header in @f; it is updated
+ * unless the transport took the page out of band.
+ *
+ * Returns:  The number of bytes written.
+ *           0 means the page was unmodified since it was last sent
+ */
+static int ram_save_page(QEMUFile *f, XBZRLEState *xbzrle, uint8_t *zbuf,
+                         AccountingInfo *acct, RAMBlock *block,
+                         ram_addr_t offset, RAMBlock **last_block,
+                         bool last_stage)
+{
+    int cont = (block == *last_block) ? RAM_SAVE_FLAG_CONTINUE : 0;
+    ram_addr_t current_addr;
+    int bytes_sent;
+    uint8_t *p;
+
+    p = memory_region_get_ram_ptr(block->mr) + offset;
+
+    /* In doubt sent page as normal */
+    bytes_sent = -1;
+    if (qemu_ram_page_unpopulated(p) || is_dup_page(p)) {
+        /* Reading an unpopulated page would allocate it */
+        acct->dup_pages++;
+        bytes_sent = save_block_hdr(f, block, offset, cont,
+                                    RAM_SAVE_FLAG_COMPRESS);
+        qemu_put_byte(f, qemu_ram_page_unpopulated(p) ? 0 : *p);
+        bytes_sent += 1;
+    } else if (xbzrle->cache) {
+        current_addr = block->offset + offset;
+        bytes_sent = save_xbzrle_page(f, xbzrle, acct, p, current_addr, block,
+                                      offset, cont, last_stage);
+        if (!last_stage) {
+            p = get_cached_data(xbzrle->cache, current_addr);
+        }
+    }
+
+    if (bytes_sent == -1 && zbuf) {
+        bytes_sent = save_zlib_page(f, zbuf, p, block, offset, cont);
+        if (bytes_sent != -1) {
+            acct->norm_pages++;
+        }
+    }
+
+    /* let the transport place the page itself, e.g. with RDMA */
+    if (bytes_sent == -1 && !xbzrle->cache &&
+        qemu_save_page(f, block->offset, offset, TARGET_PAGE_SIZE)) {
+        acct->norm_pages++;
+        return TARGET_PAGE_SIZE;
+    }
 
+    /* XBZRLE overflow or normal page */
+    if (bytes_sent == -1) {
+        bytes_sent = save_block_hdr(f, block, offset, cont, RAM_SAVE_FLAG_PAGE);
+        if (!xbzrle->cache) {
+            /* send straight from guest RAM; a page redirtied before it
+             * goes out is caught by the next pass */
+            qemu_put_buffer_async(f, p, TARGET_PAGE_SIZE);
+        } else {
+            /* the cache has to match what the destination received */
+            qemu_put_buffer(f, p, TARGET_PAGE_SIZE);
+        }
+        bytes_sent += TARGET_PAGE_SIZE;
+        acct->norm_pages++;
+    }
+
+    if (bytes_sent > 0) {
+        *last_block = block;
+    }
     return bytes_sent;
 }
 
@@ -347,6 +534,26 @@ static ram_addr_t last_offset;
 static unsigned long *migration_bitmap;
 static uint64_t migration_dirty_pages;
 static uint32_t last_version;
+/* Set once ram_save_block() has gone over all of RAM */
+static bool ram_first_pass_done;
+
+/* Post-copy: pages the destination faulted on, sent before anything else */
+typedef struct RAMPageRequest {
+    char *idstr;
+    ram_addr_t offset;
+    ram_addr_t len;
+    QSIMPLEQ_ENTRY(RAMPageRequest) next;
+} RAMPageRequest;
+
+static QemuMutex page_request_mutex;
+static bool page_request_mutex_initialized;
+static QSIMPLEQ_HEAD(, RAMPageRequest) page_requests =
+    QSIMPLEQ_HEAD_INITIALIZER(page_requests);
+/* no XBZRLE once the destination runs, its copy of the page is gone */
+static bool ram_postcopy_active;
+static XBZRLEState no_xbzrle;
+
+#define POSTCOPY_ITERATE_PAGES 64
 
 static inline
 ram_addr_t migration_bitmap_find_and_reset_dirty(MemoryRegion *mr,
@@ -365,53 +572,71 @@ ram_addr_t migration_bitmap_find_and_reset_dirty(MemoryRegion *mr,
     return (next - base) << TARGET_PAGE_BITS;
 }
 
-static inline bool migration_bitmap_set_dirty(MemoryRegion *mr,
-                                              ram_addr_t offset)
-{
-    bool ret;
-    int nr = (mr->ram_addr + offset) >> TARGET_PAGE_BITS;
+/* Auto-converge: once the guest has dirtied more than half of what was
+ * sent for AUTO_CONVERGE_HIGH_PERIODS periods in a row, its vCPUs are
+ * throttled, and further by AUTO_CONVERGE_INCREMENT each time this
+ * happens again. */
+#define AUTO_CONVERGE_HIGH_PERIODS 4
+#define AUTO_CONVERGE_INITIAL_PCT  20
+#define AUTO_CONVERGE_INCREMENT    10
 
-    ret = test_and_set_bit(nr, migration_bitmap);
+static uint64_t bytes_xfer_prev;
+static int dirty_rate_high_cnt;
 
-    if (!ret) {
-        migration_dirty_pages++;
+static void mig_throttle_guest_down(void)
+{
+    if (!cpu_throttle_active()) {
+        cpu_throttle_set(AUTO_CONVERGE_INITIAL_PCT);
+    } else {
+        cpu_throttle_set(cpu_throttle_get_percentage() +
+                         AUTO_CONVERGE_INCREMENT);
     }
-    return ret;
+    DPRINTF("throttling guest down to %d%%\n", cpu_throttle_get_percentage());
 }
 
 static void migration_bitmap_sync(void)
 {
-    RAMBlock *block;
-    ram_addr_t addr;
     uint64_t num_dirty_pages_init = migration_dirty_pages;
     MigrationState *s = migrate_get_current();
     static int64_t start_time;
     static int64_t num_dirty_pages_period;
     int64_t end_time;
+    int64_t sync_start;
 
     if (!start_time) {
         start_time = qemu_get_clock_ms(rt_clock);
     }
 
     trace_migration_bitmap_sync_start();
+    sync_start = qemu_get_clock_ns(rt_clock);
+    /* KVM's log is ORed straight into migration_bitmap */
     memory_global_sync_dirty_bitmap(get_system_memory());
+    cpu_physical_memory_sync_migration_bitmap();
+    s->dirty_sync_time = (qemu_get_clock_ns(rt_clock) - sync_start) / 1000;
+    s->dirty_sync_count++;
 
-    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
-        for (addr = 0; addr < block->length; addr += TARGET_PAGE_SIZE) {
-            if (memory_region_test_and_clear_dirty(block->mr,
-                                                   addr, TARGET_PAGE_SIZE,
-                                                   DIRTY_MEMORY_MIGRATION)) {
-                migration_bitmap_set_dirty(block->mr, addr);
-            }
-        }
-    }
     trace_migration_bitmap_sync_end(migration_dirty_pages
                                     - num_dirty_pages_init);
+    migration_iteration_done(s, migration_dirty_pages - num_dirty_pages_init);
     num_dirty_pages_period += migration_dirty_pages - num_dirty_pages_init;
     end_time = qemu_get_clock_ms(rt_clock);
 
     /* more than 1 second = 1000 millisecons */
     if (end_time > start_time + 1000) {
+        if (migrate_auto_converge()) {
+            uint64_t bytes_xfer_now = ram_bytes_transferred();
+
+            if (num_dirty_pages_period * TARGET_PAGE_SIZE >
+                (bytes_xfer_now - bytes_xfer_prev) / 2) {
+                if (++dirty_rate_high_cnt >= AUTO_CONVERGE_HIGH_PERIODS) {
+                    dirty_rate_high_cnt = 0;
+                    mig_throttle_guest_down();
+                }
+            } else {
+                dirty_rate_high_cnt = 0;
+            }
+            bytes_xfer_prev = bytes_xfer_now;
+        }
         s->dirty_pages_rate = num_dirty_pages_period * 1000
             / (end_time - start_time);
         s->dirty_bytes_rate = s->dirty_pages_rate * TARGET_PAGE_SIZE;
@@ -420,6 +645,94 @@ static void migration_bitmap_sync(void)
     }
 }
 
+bool ram_precopy_pass_done(void)
+{
+    return ram_first_pass_done;
+}
+
+/* Called from the return path thread */
+void ram_save_queue_pages(const char *idstr, uint64_t start, uint64_t len)
+{
+    RAMPageRequest *req;
+
+    qemu_mutex_lock(&page_request_mutex);
+    if (ram_postcopy_active) {
+        req = g_malloc0(sizeof(*req));
+        req->idstr = g_strdup(idstr);
+        req->offset = start & TARGET_PAGE_MASK;
+        req->len = MAX(len, 1);
+        QSIMPLEQ_INSERT_TAIL(&page_requests, req, next);
+    }
+    qemu_mutex_unlock(&page_request_mutex);
+}
+
+static void ram_flush_page_requests(void)
+{
+    RAMPageRequest *req;
+
+    qemu_mutex_lock(&page_request_mutex);
+    while ((req = QSIMPLEQ_FIRST(&page_requests))) {
+        QSIMPLEQ_REMOVE_HEAD(&page_requests, next);
+        g_free(req->idstr);
+        g_free(req);
+    }
+    qemu_mutex_unlock(&page_request_mutex);
+}
+
+static RAMBlock *ram_find_block(const char *idstr)
+{
+    RAMBlock *block;
+
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        if (!strcmp(idstr, block->idstr)) {
+            return block;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * ram_save_requested_page: Sends the first requested page that is still
+ * dirty, requests for pages that were sent already are dropped.
+ *
+ * Returns:  The number of bytes written.
+ *           0 means no requests are pending
+ */
+static int ram_save_requested_page(QEMUFile *f)
+{
+    RAMPageRequest *req;
+    int bytes_sent = 0;
+
+    qemu_mutex_lock(&page_request_mutex);
+    while (!bytes_sent && (req = QSIMPLEQ_FIRST(&page_requests))) {
+        RAMBlock *block = ram_find_block(req->idstr);
+
+        if (block && req->offset < block->length) {
+            unsigned long nr = (block->offset + req->offset) >>
+                TARGET_PAGE_BITS;
+
+            if (test_and_clear_bit(nr, migration_bitmap)) {
+                migration_dirty_pages--;
+                bytes_sent = ram_save_page(f, &no_xbzrle, compress_buf,
+                                           &acct_info, block, req->offset,
+                                           &last_sent_block, false);
+            }
+        }
+
+        if (!block || req->len <= TARGET_PAGE_SIZE) {
+            QSIMPLEQ_REMOVE_HEAD(&page_requests, next);
+            g_free(req->idstr);
+            g_free(req);
+        } else {
+            req->offset += TARGET_PAGE_SIZE;
+            req->len -= TARGET_PAGE_SIZE;
+        }
+    }
+    qemu_mutex_unlock(&page_request_mutex);
+
+    return bytes_sent;
+}
+
 /*
  * ram_save_block: Writes a page of memory to the stream f
  *
@@ -434,7 +747,13 @@ static int ram_save_block(QEMUFile *f, bool last_stage)
     bool complete_round = false;
     int bytes_sent = 0;
     MemoryRegion *mr;
-    ram_addr_t current_addr;
+
+    if (ram_postcopy_active) {
+        bytes_sent = ram_save_requested_page(f);
+        if (bytes_sent) {
+            return bytes_sent;
+        }
+    }
 
     if (!block)
         block = QTAILQ_FIRST(&ram_list.blocks);
@@ -452,42 +771,17 @@ static int ram_save_block(QEMUFile *f, bool last_stage)
             if (!block) {
                 block = QTAILQ_FIRST(&ram_list.blocks);
                 complete_round = true;
+                ram_first_pass_done = true;
             }
         } else {
-            uint8_t *p;
-            int cont = (block == last_sent_block) ?
-                RAM_SAVE_FLAG_CONTINUE : 0;
-
-            p = memory_region_get_ram_ptr(mr) + offset;
-
-            /* In doubt sent page as normal */
-            bytes_sent = -1;
-            if (is_dup_page(p)) {
-                acct_info.dup_pages++;
-                bytes_sent = save_block_hdr(f, block, offset, cont,
-                                            RAM_SAVE_FLAG_COMPRESS);
-                qemu_put_byte(f, *p);
-                bytes_sent += 1;
-            } else if (migrate_use_xbzrle()) {
-                current_addr = block->offset + offset;
-                bytes_sent = save_xbzrle_page(f, p, current_addr, block,
-                                              offset, cont, last_stage);
-                if (!last_stage) {
-                    p = get_cached_data(XBZRLE.cache, current_addr);
-                }
-            }
-
-            /* XBZRLE overflow or normal page */
-            if (bytes_sent == -1) {
-                bytes_sent = save_block_hdr(f, block, offset, cont, RAM_SAVE_FLAG_PAGE);
-                qemu_put_buffer(f, p, TARGET_PAGE_SIZE);
-                bytes_sent += TARGET_PAGE_SIZE;
-                acct_info.norm_pages++;
-            }
+            bytes_sent = ram_save_page(f, ram_postcopy_active ? &no_xbzrle
+                                                              : &XBZRLE,
+                                       compress_buf, &acct_info,
+                                       block, offset, &last_sent_block,
+                                       last_stage);
 
             /* if page is unmodified, continue to the next */
             if (bytes_sent > 0) {
-                last_sent_block = block;
                 break;
             }
         }
@@ -498,6 +792,247 @@ static int ram_save_block(QEMUFile *f, bool last_stage)
     return bytes_sent;
 }
 
+static void acct_merge(AccountingInfo *acct)
+{
+    acct_info.dup_pages += acct->dup_pages;
+    acct_info.norm_pages += acct->norm_pages;
+    acct_info.xbzrle_bytes += acct->xbzrle_bytes;
+    acct_info.xbzrle_pages += acct->xbzrle_pages;
+    acct_info.xbzrle_cache_miss += acct->xbzrle_cache_miss;
+    acct_info.xbzrle_cache_hit += acct->xbzrle_cache_hit;
+    acct_info.xbzrle_skipped += acct->xbzrle_skipped;
+    acct_info.xbzrle_overflows += acct->xbzrle_overflows;
+    memset(acct, 0, sizeof(*acct));
+}
+
+static int ram_worker_put_buffer(void *opaque, const uint8_t *buf,
+                                 int64_t pos, int size)
+{
+    RAMSaveWorker *w = opaque;
+
+    if (w->buf_size + size > w->buf_capacity) {
+        w->buf_capacity = w->buf_size + size + RAM_WORKER_ROUND_SIZE;
+        w->buf = g_realloc(w->buf, w->buf_capacity);
+    }
+    memcpy(w->buf + w->buf_size, buf, size);
+    w->buf_size += size;
+
+    return size;
+}
+
+static const QEMUFileOps ram_worker_file_ops = {
+    .put_buffer = ram_worker_put_buffer,
+};
+
+static RAMBlock *ram_worker_find_block(RAMSaveWorker *w, ram_addr_t addr)
+{
+    RAMBlock *block = w->block;
+
+    if (block && addr - block->offset < block->length) {
+        return block;
+    }
+
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        if (addr - block->offset < block->length) {
+            w->block = block;
+            return block;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * ram_worker_round: Encodes dirty pages of the worker's range until
+ * RAM_WORKER_ROUND_SIZE bytes are produced or no dirty page is left.
+ * The scan resumes where the previous round stopped and wraps around
+ * once, like ram_save_block() does over the whole of RAM.
+ */
+static void ram_worker_round(RAMSaveWorker *w, RAMSaveWorkerStats *stats)
+{
+    unsigned long start = w->start >> TARGET_PAGE_BITS;
+    unsigned long end = w->end >> TARGET_PAGE_BITS;
+    unsigned long first = w->offset >> TARGET_PAGE_BITS;
+    unsigned long cur = first;
+    unsigned long limit = end;
+    size_t produced = 0;
+
+    w->last_sent_block = NULL;
+
+    while (produced < RAM_WORKER_ROUND_SIZE) {
+        unsigned long next = find_next_bit(migration_bitmap, limit, cur);
+        ram_addr_t addr;
+        RAMBlock *block;
+        int bytes_sent;
+
+        if (next >= limit) {
+            if (limit != end || first == start) {
+                break;
+            }
+            /* wrap around and scan up to where this round started */
+            cur = start;
+            limit = first;
+            continue;
+        }
+
+        atomic_fetch_and(&migration_bitmap[BIT_WORD(next)], ~BIT_MASK(next));
+        w->dirty_cleared++;
+        cur = next + 1;
+
+        addr = (ram_addr_t)next << TARGET_PAGE_BITS;
+        block = ram_worker_find_block(w, addr);
+        if (!block) {
+            continue;
+        }
+
+        bytes_sent = ram_save_page(w->file, &w->xbzrle, w->compress_buf,
+                                   &w->acct, block, addr - block->offset,
+                                   &w->last_sent_block, w->last_stage);
+        if (bytes_sent > 0) {
+            produced += bytes_sent;
+            stats->pages++;
+        }
+    }
+
+    w->offset = (cur < end ? cur : start) << TARGET_PAGE_BITS;
+    stats->bytes += produced;
+    qemu_fflush(w->file);
+}
+
+static void *ram_worker_thread(void *opaque)
+{
+    RAMSaveWorker *w = opaque;
+    RAMSaveWorkerStats *stats = &ram_worker_stats[w->id];
+    int64_t t0;
+
+    while (true) {
+        qemu_sem_wait(&w->run_sem);
+        if (w->quit) {
+            break;
+        }
+        t0 = qemu_get_clock_ns(rt_clock);
+        ram_worker_round(w, stats);
+        stats->busy_ns += qemu_get_clock_ns(rt_clock) - t0;
+        qemu_sem_post(&w->done_sem);
+    }
+
+    return NULL;
+}
+
+static void ram_workers_start(void)
+{
+    unsigned long ram_pages = last_ram_offset() >> TARGET_PAGE_BITS;
+    unsigned long chunk;
+    int64_t cache_pages;
+    int i;
+
+    nr_ram_workers = migrate_threads();
+    nr_ram_worker_stats = nr_ram_workers;
+    memset(ram_worker_stats, 0, sizeof(ram_worker_stats));
+
+    /* keep ranges word aligned so that no two workers ever touch the
+     * same long of the migration bitmap */
+    chunk = QEMU_ALIGN_UP(DIV_ROUND_UP(ram_pages, nr_ram_workers),
+                          BITS_PER_LONG);
+    cache_pages = migrate_xbzrle_cache_size() / TARGET_PAGE_SIZE /
+        nr_ram_workers;
+
+    ram_workers = g_new0(RAMSaveWorker, nr_ram_workers);
+    for (i = 0; i < nr_ram_workers; i++) {
+        RAMSaveWorker *w = &ram_workers[i];
+
+        w->id = i;
+        w->start = (ram_addr_t)MIN(i * chunk, ram_pages) << TARGET_PAGE_BITS;
+        w->end = (ram_addr_t)MIN((i + 1) * chunk, ram_pages)
+            << TARGET_PAGE_BITS;
+        w->offset = w->start;
+        w->file = qemu_fopen_ops(w, &ram_worker_file_ops);
+
+        if (migrate_use_xbzrle()) {
+            w->xbzrle.cache = cache_init(cache_pages, TARGET_PAGE_SIZE);
+            w->xbzrle.encoded_buf = g_malloc0(TARGET_PAGE_SIZE);
+            w->xbzrle.current_buf = g_malloc(TARGET_PAGE_SIZE);
+        }
+        if (migrate_use_compress()) {
+            w->compress_buf = g_malloc(compressBound(TARGET_PAGE_SIZE));
+        }
+
+        qemu_sem_init(&w->run_sem, 0);
+        qemu_sem_init(&w->done_sem, 0);
+        qemu_thread_create(&w->thread, ram_worker_thread, w,
+                           QEMU_THREAD_JOINABLE);
+    }
+}
+
+static void ram_workers_stop(void)
+{
+    int i;
+
+    for (i = 0; i < nr_ram_workers; i++) {
+        RAMSaveWorker *w = &ram_workers[i];
+
+        w->quit = true;
+        qemu_sem_post(&w->run_sem);
+        qemu_thread_join(&w->thread);
+
+        qemu_fclose(w->file);
+        g_free(w->buf);
+        if (w->xbzrle.cache) {
+            cache_fini(w->xbzrle.cache);
+            g_free(w->xbzrle.cache);
+        }
+        g_free(w->xbzrle.encoded_buf);
+        g_free(w->xbzrle.current_buf);
+        g_free(w->compress_buf);
+        qemu_sem_destroy(&w->run_sem);
+        qemu_sem_destroy(&w->done_sem);
+    }
+
+    g_free(ram_workers);
+    ram_workers = NULL;
+    nr_ram_workers = 0;
+}
+
+/*
+ * ram_save_workers_round: Runs one round on every worker and appends
+ * their output to the stream f in worker order.
+ *
+ * Returns:  The number of bytes written.
+ *           0 means no dirty pages
+ */
+static int ram_save_workers_round(QEMUFile *f, bool last_stage)
+{
+    int bytes_sent = 0;
+    int i;
+
+    for (i = 0; i < nr_ram_workers; i++) {
+        ram_workers[i].last_stage = last_stage;
+        qemu_sem_post(&ram_workers[i].run_sem);
+    }
+
+    for (i = 0; i < nr_ram_workers; i++) {
+        RAMSaveWorker *w = &ram_workers[i];
+
+        qemu_sem_wait(&w->done_sem);
+        qemu_put_buffer(f, w->buf, w->buf_size);
+        bytes_sent += w->buf_size;
+        w->buf_size = 0;
+
+        migration_dirty_pages -= w->dirty_cleared;
+        w->dirty_cleared = 0;
+        acct_merge(&w->acct);
+    }
+
+    return bytes_sent;
+}
+
+static int ram_save_next(QEMUFile *f, bool last_stage)
+{
+    if (ram_workers) {
+        return ram_save_workers_round(f, last_stage);
+    }
+    return ram_save_block(f, last_stage);
+}
+
 static uint64_t bytes_transferred;
 
 static ram_addr_t ram_save_remaining(void)
@@ -528,7 +1063,10 @@ uint64_t ram_bytes_total(void)
 
 static void migration_end(void)
 {
+    cpu_throttle_stop();
+
     if (migration_bitmap) {
+        cpu_physical_memory_set_migration_bitmap(NULL, 0, NULL);
         memory_global_dirty_log_stop();
         g_free(migration_bitmap);
         migration_bitmap = NULL;
@@ -542,6 +1080,18 @@ static void migration_end(void)
         g_free(XBZRLE.decoded_buf);
         XBZRLE.cache = NULL;
     }
+
+    if (ram_workers) {
+        ram_workers_stop();
+    }
+
+    g_free(compress_buf);
+    compress_buf = NULL;
+
+    qemu_mutex_lock(&page_request_mutex);
+    ram_postcopy_active = false;
+    qemu_mutex_unlock(&page_request_mutex);
+    ram_flush_page_requests();
 }
 
 static void ram_migration_cancel(void *opaque)
@@ -551,10 +1101,16 @@ static void ram_migration_cancel(void *opaque)
 
 static void reset_ram_globals(void)
 {
+    int i;
+
     last_seen_block = NULL;
     last_sent_block = NULL;
     last_offset = 0;
     last_version = ram_list.version;
+
+    for (i = 0; i < nr_ram_workers; i++) {
+        ram_workers[i].block = NULL;
+    }
 }
 
 #define MAX_WAIT 50 /* ms, half buffered_file limit */
@@ -567,12 +1123,25 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
     migration_bitmap = bitmap_new(ram_pages);
     bitmap_set(migration_bitmap, 0, ram_pages);
     migration_dirty_pages = ram_pages;
+    cpu_physical_memory_set_migration_bitmap(migration_bitmap, ram_pages,
+                                             &migration_dirty_pages);
+    bytes_xfer_prev = 0;
+    dirty_rate_high_cnt = 0;
+
+    if (!page_request_mutex_initialized) {
+        qemu_mutex_init(&page_request_mutex);
+        page_request_mutex_initialized = true;
+    }
+    ram_first_pass_done = false;
 
     qemu_mutex_lock_ramlist();
     bytes_transferred = 0;
     reset_ram_globals();
 
-    if (migrate_use_xbzrle()) {
+    if (migrate_use_multi_thread()) {
+        ram_workers_start();
+        acct_clear();
+    } else if (migrate_use_xbzrle()) {
         XBZRLE.cache = cache_init(migrate_xbzrle_cache_size() /
                                   TARGET_PAGE_SIZE,
                                   TARGET_PAGE_SIZE);
@@ -585,6 +1154,10 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
         acct_clear();
     }
 
+    if (!ram_workers && migrate_use_compress()) {
+        compress_buf = g_malloc(compressBound(TARGET_PAGE_SIZE));
+    }
+
     memory_global_dirty_log_start();
     migration_bitmap_sync();
 
@@ -620,13 +1193,17 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
     while ((ret = qemu_file_rate_limit(f)) == 0) {
         int bytes_sent;
 
-        bytes_sent = ram_save_block(f, false);
+        bytes_sent = ram_save_next(f, false);
         /* no more blocks to sent */
         if (bytes_sent == 0) {
             break;
         }
         total_sent += bytes_sent;
         acct_info.iterations++;
+        /* keep the latency of requested pages low */
+        if (ram_postcopy_active && i >= POSTCOPY_ITERATE_PAGES) {
+            break;
+        }
         /* we want to check in the 1st loop, just in case it was the 1st time
            and we had to sync the dirty bitmap.
            qemu_get_clock_ns() is a bit expensive, so we only check each some
@@ -668,7 +1245,7 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
     while (true) {
         int bytes_sent;
 
-        bytes_sent = ram_save_block(f, true);
+        bytes_sent = ram_save_next(f, true);
         /* no more blocks to sent */
         if (bytes_sent == 0) {
             break;
@@ -683,6 +1260,48 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
     return 0;
 }
 
+/*
+ * Called with the guest stopped when switching to post-copy: tells the
+ * destination which pages changed after they were sent, so that it drops
+ * them and faults them in again.
+ */
+static int ram_save_postcopy_start(QEMUFile *f, void *opaque)
+{
+    RAMBlock *block;
+
+    qemu_mutex_lock_ramlist();
+    migration_bitmap_sync();
+
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        unsigned long base = block->offset >> TARGET_PAGE_BITS;
+        unsigned long end = base + (block->length >> TARGET_PAGE_BITS);
+        unsigned long run = find_next_bit(migration_bitmap, end, base);
+
+        while (run < end) {
+            unsigned long stop = find_next_zero_bit(migration_bitmap, end, run);
+            int cont = (block == last_sent_block) ?
+                RAM_SAVE_FLAG_CONTINUE : 0;
+
+            bytes_transferred += save_block_hdr(f, block,
+                                                (run - base) << TARGET_PAGE_BITS,
+                                                cont, RAM_SAVE_FLAG_DISCARD);
+            qemu_put_be64(f, (ram_addr_t)(stop - run) << TARGET_PAGE_BITS);
+            bytes_transferred += 8;
+            last_sent_block = block;
+            run = find_next_bit(migration_bitmap, end, stop);
+        }
+    }
+
+    qemu_mutex_lock(&page_request_mutex);
+    ram_postcopy_active = true;
+    qemu_mutex_unlock(&page_request_mutex);
+
+    qemu_mutex_unlock_ramlist();
+    qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+
+    return 0;
+}
+
 static uint64_t ram_save_pending(QEMUFile *f, void *opaque, uint64_t max_size)
 {
     uint64_t remaining_size;
@@ -696,6 +1315,100 @@ static uint64_t ram_save_pending(QEMUFile *f, void *opaque, uint64_t max_size)
     return remaining_size;
 }
 
+/*
+ * RAM templates (template-save, -machine ram-template=file): each RAM block
+ * is stored at its ram_addr_t offset, so that a new VM can map it from the
+ * file, and is followed by the table of blocks and by the device state.
+ * Blocks that a device provides the memory for are not part of it.
+ */
+off_t ram_template_state_offset(void)
+{
+    return last_ram_offset();
+}
+
+int ram_save_template(int fd, QEMUFile *f)
+{
+    RAMBlock *block;
+    ram_addr_t done;
+    ssize_t len;
+    uint32_t n = 0;
+
+    qemu_mutex_lock_ramlist();
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        if (block->flags & RAM_PREALLOC_MASK) {
+            continue;
+        }
+        for (done = 0; done < block->length; done += len) {
+            len = pwrite(fd, block->host + done, block->length - done,
+                         block->offset + done);
+            if (len < 0 && errno == EINTR) {
+                len = 0;
+            } else if (len < 0) {
+                qemu_mutex_unlock_ramlist();
+                return -errno;
+            }
+        }
+        n++;
+    }
+
+    qemu_put_be32(f, n);
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        if (block->flags & RAM_PREALLOC_MASK) {
+            continue;
+        }
+        qemu_put_byte(f, strlen(block->idstr));
+        qemu_put_buffer(f, (uint8_t *)block->idstr, strlen(block->idstr));
+        qemu_put_be64(f, block->offset);
+        qemu_put_be64(f, block->length);
+    }
+    qemu_mutex_unlock_ramlist();
+
+    return qemu_file_get_error(f);
+}
+
+/* Check that the blocks of the template match those that were mapped */
+int ram_load_template(QEMUFile *f)
+{
+    RAMBlock *block;
+    char id[256];
+    uint64_t offset, length;
+    uint32_t i, n, mapped = 0;
+    uint8_t len;
+
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        if (block->flags & RAM_TEMPLATE_MASK) {
+            mapped++;
+        }
+    }
+    n = qemu_get_be32(f);
+    if (n != mapped) {
+        fprintf(stderr, "ram-template: the template has %u RAM blocks, "
+                "this machine %u\n", n, mapped);
+        return -EINVAL;
+    }
+
+    for (i = 0; i < n; i++) {
+        len = qemu_get_byte(f);
+        qemu_get_buffer(f, (uint8_t *)id, len);
+        id[len] = 0;
+        offset = qemu_get_be64(f);
+        length = qemu_get_be64(f);
+
+        QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+            if (!strncmp(id, block->idstr, sizeof(id))) {
+                break;
+            }
+        }
+        if (!block || !(block->flags & RAM_TEMPLATE_MASK) ||
+            block->offset != offset || block->length != length) {
+            fprintf(stderr, "ram-template: RAM block \"%s\" does not match "
+                    "this machine\n", id);
+            return -EINVAL;
+        }
+    }
+    return qemu_file_get_error(f);
+}
+
 static int load_xbzrle(QEMUFile *f, ram_addr_t addr, void *host)
 {
     int ret, rc = 0;
@@ -737,9 +1450,35 @@ static int load_xbzrle(QEMUFile *f, ram_addr_t addr, void *host)
     return rc;
 }
 
+static int load_zlib(QEMUFile *f, void *host)
+{
+    unsigned int zlen;
+    uLongf len = TARGET_PAGE_SIZE;
+
+    if (!compress_buf) {
+        compress_buf = g_malloc(compressBound(TARGET_PAGE_SIZE));
+    }
+
+    zlen = qemu_get_be16(f);
+    if (zlen > compressBound(TARGET_PAGE_SIZE)) {
+        fprintf(stderr, "Failed to load zlib page - len overflow!\n");
+        return -1;
+    }
+    qemu_get_buffer(f, compress_buf, zlen);
+
+    if (uncompress(host, &len, compress_buf, zlen) != Z_OK ||
+        len != TARGET_PAGE_SIZE) {
+        fprintf(stderr, "Failed to load zlib page - decode error!\n");
+        return -1;
+    }
+
+    return 0;
+}
+
 static inline void *host_from_stream_offset(QEMUFile *f,
                                             ram_addr_t offset,
-                                            int flags)
+                                            int flags,
+                                            RAMBlock **rb)
 {
     static RAMBlock *block = NULL;
     char id[256];
@@ -751,6 +1490,7 @@ static inline void *host_from_stream_offset(QEMUFile *f,
             return NULL;
         }
 
+        *rb = block;
         return memory_region_get_ram_ptr(block->mr) + offset;
     }
 
@@ -759,8 +1499,10 @@ static inline void *host_from_stream_offset(QEMUFile *f,
     id[len] = 0;
 
     QTAILQ_FOREACH(block, &ram_list.blocks, next) {
-        if (!strncmp(id, block->idstr, sizeof(id)))
+        if (!strncmp(id, block->idstr, sizeof(id))) {
+            *rb = block;
             return memory_region_get_ram_ptr(block->mr) + offset;
+        }
     }
 
     fprintf(stderr, "Can't find block %s!\n", id);
@@ -773,6 +1515,8 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
     int flags, ret = 0;
     int error;
     static uint64_t seq_iter;
+    PostcopyState postcopy_state = postcopy_state_get();
+    bool place_page = postcopy_state >= POSTCOPY_INCOMING_LISTENING;
 
     seq_iter++;
 
@@ -824,40 +1568,64 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
             }
         }
 
-        if (flags & RAM_SAVE_FLAG_COMPRESS) {
-            void *host;
-            uint8_t ch;
+        if (flags & (RAM_SAVE_FLAG_COMPRESS | RAM_SAVE_FLAG_PAGE |
+                     RAM_SAVE_FLAG_XBZRLE | RAM_SAVE_FLAG_ZLIB)) {
+            RAMBlock *block;
+            void *host, *page;
 
-            host = host_from_stream_offset(f, addr, flags);
+            host = host_from_stream_offset(f, addr, flags, &block);
             if (!host) {
                 return -EINVAL;
             }
 
-            ch = qemu_get_byte(f);
-            memset(host, ch, TARGET_PAGE_SIZE);
+            /* once the destination listens for faults, pages are decoded
+               aside and mapped atomically */
+            page = place_page ? postcopy_get_tmp_page() : host;
+
+            if (flags & RAM_SAVE_FLAG_COMPRESS) {
+                uint8_t ch = qemu_get_byte(f);
+
+                memset(page, ch, TARGET_PAGE_SIZE);
 #ifndef _WIN32
-            if (ch == 0 &&
-                (!kvm_enabled() || kvm_has_sync_mmu()) &&
-                getpagesize() <= TARGET_PAGE_SIZE) {
-                qemu_madvise(host, TARGET_PAGE_SIZE, QEMU_MADV_DONTNEED);
-            }
+                if (ch == 0 && !place_page &&
+                    (!kvm_enabled() || kvm_has_sync_mmu()) &&
+                    getpagesize() <= TARGET_PAGE_SIZE) {
+                    qemu_madvise(host, TARGET_PAGE_SIZE, QEMU_MADV_DONTNEED);
+                }
 #endif
-        } else if (flags & RAM_SAVE_FLAG_PAGE) {
-            void *host;
+            } else if (flags & RAM_SAVE_FLAG_PAGE) {
+                qemu_get_buffer(f, page, TARGET_PAGE_SIZE);
+            } else if (flags & RAM_SAVE_FLAG_XBZRLE) {
+                if (place_page || load_xbzrle(f, addr, host) < 0) {
+                    ret = -EINVAL;
+                    goto done;
+                }
+            } else if (flags & RAM_SAVE_FLAG_ZLIB) {
+                if (load_zlib(f, page) < 0) {
+                    ret = -EINVAL;
+                    goto done;
+                }
+            }
 
-            host = host_from_stream_offset(f, addr, flags);
-            if (!host) {
-                return -EINVAL;
+            if (place_page) {
+                ret = postcopy_place_page(block, addr);
+                if (ret < 0) {
+                    goto done;
+                }
+            } else if (postcopy_state == POSTCOPY_INCOMING_ADVISE) {
+                postcopy_ram_page_received(block, addr);
             }
+        } else if (flags & RAM_SAVE_FLAG_DISCARD) {
+            RAMBlock *block;
+            ram_addr_t length;
 
-            qemu_get_buffer(f, host, TARGET_PAGE_SIZE);
-        } else if (flags & RAM_SAVE_FLAG_XBZRLE) {
-            void *host = host_from_stream_offset(f, addr, flags);
-            if (!host) {
+            if (!host_from_stream_offset(f, addr, flags, &block)) {
                 return -EINVAL;
             }
 
-            if (load_xbzrle(f, addr, host) < 0) {
+            length = qemu_get_be64(f);
+            if (postcopy_state != POSTCOPY_INCOMING_ADVISE ||
+                postcopy_ram_discard_range(block, addr, length) < 0) {
                 ret = -EINVAL;
                 goto done;
             }
@@ -880,6 +1648,7 @@ SaveVMHandlers savevm_ram_handlers = {
     .save_live_iterate = ram_save_iterate,
     .save_live_complete = ram_save_complete,
     .save_live_pending = ram_save_pending,
+    .save_postcopy_start = ram_save_postcopy_start,
     .load_state = ram_load,
     .cancel = ram_migration_cancel,
 };
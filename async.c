@@ -24,19 +24,35 @@
 
 #include "qemu-common.h"
 #include "block/aio.h"
+#include "block/thread-pool.h"
 #include "qemu/main-loop.h"
+#include "qemu/timer.h"
+#include "qapi-types.h"
 
 /***********************************************************/
 /* bottom halves (can be seen as timers which expire ASAP) */
 
+/* Flags of a QEMUBH, changed atomically by any thread */
+enum {
+    /* In ctx->bh_queue or ctx->bh_ready, waiting for aio_bh_poll() */
+    BH_QUEUED    = 1,
+    BH_SCHEDULED = 2,
+    BH_IDLE      = 4,
+    BH_DELETED   = 8,
+};
+
 struct QEMUBH {
     AioContext *ctx;
     QEMUBHFunc *cb;
     void *opaque;
-    QEMUBH *next;
-    bool scheduled;
-    bool idle;
-    bool deleted;
+    QLIST_ENTRY(QEMUBH) node;
+    QEMUBH *queue_next;
+    unsigned int flags;
+
+    /* Main loop wakeups caused by this bottom half */
+    const char *name;
+    uint64_t wakeups;
+    CallbackStats stats;
 };
 
 QEMUBH *aio_bh_new(AioContext *ctx, QEMUBHFunc *cb, void *opaque)
@@ -46,95 +62,256 @@ QEMUBH *aio_bh_new(AioContext *ctx, QEMUBHFunc *cb, void *opaque)
     bh->ctx = ctx;
     bh->cb = cb;
     bh->opaque = opaque;
-    bh->next = ctx->first_bh;
-    ctx->first_bh = bh;
+    callback_stats_init(&bh->stats);
+    qemu_mutex_lock(&ctx->bh_lock);
+    QLIST_INSERT_HEAD(&ctx->bh_list, bh, node);
+    qemu_mutex_unlock(&ctx->bh_lock);
     return bh;
 }
 
+static void aio_bh_free(AioContext *ctx, QEMUBH *bh)
+{
+    qemu_mutex_lock(&ctx->bh_lock);
+    QLIST_REMOVE(bh, node);
+    qemu_mutex_unlock(&ctx->bh_lock);
+    g_free(bh);
+}
+
+/* Called by the thread that set BH_QUEUED */
+static void aio_bh_push(QEMUBH *bh)
+{
+    AioContext *ctx = bh->ctx;
+    QEMUBH *head;
+
+    do {
+        head = atomic_read(&ctx->bh_queue);
+        bh->queue_next = head;
+    } while (atomic_cmpxchg(&ctx->bh_queue, head, bh) != head);
+}
+
+/* Move the bottom halves pushed since the last call to the end of
+ * ctx->bh_ready, in the order they were pushed.
+ */
+static void aio_bh_dequeue(AioContext *ctx)
+{
+    QEMUBH *bh, *next, *list = NULL;
+    QEMUBH **tail = NULL;
+
+    for (bh = atomic_xchg(&ctx->bh_queue, NULL); bh; bh = next) {
+        next = bh->queue_next;
+        bh->queue_next = list;
+        list = bh;
+        if (!tail) {
+            tail = &bh->queue_next;
+        }
+    }
+    if (list) {
+        *ctx->bh_ready_tail = list;
+        ctx->bh_ready_tail = tail;
+    }
+}
+
 int aio_bh_poll(AioContext *ctx)
 {
-    QEMUBH *bh, **bhp, *next;
+    QEMUBH *bh;
+    unsigned int flags;
+    const char *owner;
+    int64_t start;
     int ret;
 
-    ctx->walking_bh++;
+    aio_bh_dequeue(ctx);
 
+    /* A handler may poll the context again, which then continues with
+     * the rest of bh_ready.
+     */
     ret = 0;
-    for (bh = ctx->first_bh; bh; bh = next) {
-        next = bh->next;
-        if (!bh->deleted && bh->scheduled) {
-            bh->scheduled = 0;
-            if (!bh->idle)
-                ret = 1;
-            bh->idle = 0;
-            bh->cb(bh->opaque);
+    while ((bh = ctx->bh_ready) != NULL) {
+        ctx->bh_ready = bh->queue_next;
+        if (!ctx->bh_ready) {
+            ctx->bh_ready_tail = &ctx->bh_ready;
         }
+
+        /* From here on, scheduling the bottom half queues it again */
+        flags = atomic_fetch_and(&bh->flags,
+                                 ~(BH_QUEUED | BH_SCHEDULED | BH_IDLE));
+        if (flags & BH_DELETED) {
+            aio_bh_free(ctx, bh);
+            continue;
+        }
+        if (!(flags & BH_SCHEDULED)) {
+            continue;
+        }
+        if (!(flags & BH_IDLE)) {
+            ret = 1;
+        }
+        if (ctx == qemu_get_aio_context() && main_loop_claim_wakeup()) {
+            bh->wakeups++;
+        }
+        start = callback_stats_begin(&bh->stats, &owner);
+        bh->cb(bh->opaque);
+        callback_stats_end(&bh->stats, owner, start);
     }
 
-    ctx->walking_bh--;
+    return ret;
+}
 
-    /* remove deleted bhs */
-    if (!ctx->walking_bh) {
-        bhp = &ctx->first_bh;
-        while (*bhp) {
-            bh = *bhp;
-            if (bh->deleted) {
-                *bhp = bh->next;
-                g_free(bh);
-            } else {
-                bhp = &bh->next;
-            }
+void qemu_bh_set_name(QEMUBH *bh, const char *name)
+{
+    bh->name = name;
+}
+
+WakeupSourceList *aio_bh_wakeup_sources(AioContext *ctx,
+                                        WakeupSourceList *list)
+{
+    QEMUBH *bh;
+
+    qemu_mutex_lock(&ctx->bh_lock);
+    QLIST_FOREACH(bh, &ctx->bh_list, node) {
+        WakeupSourceList *entry;
+        WakeupSource *source;
+
+        if ((atomic_read(&bh->flags) & BH_DELETED) || !bh->wakeups) {
+            continue;
         }
+        source = g_new0(WakeupSource, 1);
+        source->kind = g_strdup("bh");
+        source->name = bh->name ? g_strdup(bh->name) :
+                       g_strdup_printf("bh@%p", bh->cb);
+        source->wakeups = bh->wakeups;
+
+        entry = g_new0(WakeupSourceList, 1);
+        entry->value = source;
+        entry->next = list;
+        list = entry;
     }
+    qemu_mutex_unlock(&ctx->bh_lock);
+    return list;
+}
 
-    return ret;
+CallbackAccountingList *aio_bh_cpu_accounting(AioContext *ctx,
+                                              CallbackAccountingList *list)
+{
+    QEMUBH *bh;
+
+    qemu_mutex_lock(&ctx->bh_lock);
+    QLIST_FOREACH(bh, &ctx->bh_list, node) {
+        if (atomic_read(&bh->flags) & BH_DELETED) {
+            continue;
+        }
+        list = callback_stats_list(list, &bh->stats, "bh",
+                                   bh->name ? g_strdup(bh->name) :
+                                   g_strdup_printf("bh@%p", bh->cb));
+    }
+    qemu_mutex_unlock(&ctx->bh_lock);
+    return list;
+}
+
+/* Returns false if @bh was scheduled already */
+static bool aio_bh_try_schedule(QEMUBH *bh, unsigned int idle)
+{
+    unsigned int old;
+
+    do {
+        old = atomic_read(&bh->flags);
+        if (old & BH_SCHEDULED) {
+            return false;
+        }
+    } while (atomic_cmpxchg(&bh->flags, old,
+                            old | BH_QUEUED | BH_SCHEDULED | idle) != old);
+
+    if (!(old & BH_QUEUED)) {
+        aio_bh_push(bh);
+    }
+    return true;
 }
 
 void qemu_bh_schedule_idle(QEMUBH *bh)
 {
-    if (bh->scheduled)
-        return;
-    bh->scheduled = 1;
-    bh->idle = 1;
+    aio_bh_try_schedule(bh, BH_IDLE);
 }
 
 void qemu_bh_schedule(QEMUBH *bh)
 {
-    if (bh->scheduled)
-        return;
-    bh->scheduled = 1;
-    bh->idle = 0;
-    aio_notify(bh->ctx);
+    if (aio_bh_try_schedule(bh, 0)) {
+        aio_notify(bh->ctx);
+    }
 }
 
 void qemu_bh_cancel(QEMUBH *bh)
 {
-    bh->scheduled = 0;
+    atomic_fetch_and(&bh->flags, ~(BH_SCHEDULED | BH_IDLE));
 }
 
+/* aio_bh_poll() frees it when it finds it in the queue */
 void qemu_bh_delete(QEMUBH *bh)
 {
-    bh->scheduled = 0;
-    bh->deleted = 1;
+    unsigned int old;
+
+    atomic_fetch_and(&bh->flags, ~(BH_SCHEDULED | BH_IDLE));
+    old = atomic_fetch_or(&bh->flags, BH_QUEUED | BH_DELETED);
+    if (!(old & BH_QUEUED)) {
+        aio_bh_push(bh);
+    }
+}
+
+/* Returns 0 if a bottom half in @bh's list is scheduled, 10 if only idle
+ * bottom halves are, and @timeout otherwise.
+ */
+static int aio_bh_list_timeout(QEMUBH *bh, int timeout)
+{
+    unsigned int flags;
+
+    for (; bh; bh = bh->queue_next) {
+        flags = atomic_read(&bh->flags);
+        if ((flags & (BH_SCHEDULED | BH_DELETED)) != BH_SCHEDULED) {
+            continue;
+        }
+        if (!(flags & BH_IDLE)) {
+            return 0;
+        }
+        /* idle bottom halves will be polled at least every 10ms */
+        timeout = 10;
+    }
+    return timeout;
+}
+
+static int aio_bh_timeout(AioContext *ctx)
+{
+    int timeout;
+
+    timeout = aio_bh_list_timeout(ctx->bh_ready, -1);
+    if (timeout != 0) {
+        timeout = aio_bh_list_timeout(atomic_read(&ctx->bh_queue), timeout);
+    }
+    return timeout;
 }
 
 static gboolean
 aio_ctx_prepare(GSource *source, gint    *timeout)
 {
     AioContext *ctx = (AioContext *) source;
-    QEMUBH *bh;
+    int64_t deadline;
+    int bh_timeout;
+
+    bh_timeout = aio_bh_timeout(ctx);
+    if (bh_timeout == 0) {
+        /* non-idle bottom halves will be executed immediately */
+        *timeout = 0;
+        return true;
+    }
+    if (bh_timeout > 0) {
+        *timeout = bh_timeout;
+    }
 
-    for (bh = ctx->first_bh; bh; bh = bh->next) {
-        if (!bh->deleted && bh->scheduled) {
-            if (bh->idle) {
-                /* idle bottom halves will be polled at least
-                 * every 10ms */
-                *timeout = 10;
-            } else {
-                /* non-idle bottom halves will be executed
-                 * immediately */
-                *timeout = 0;
-                return true;
-            }
+    deadline = aio_timer_deadline_ns(ctx);
+    if (deadline == 0) {
+        *timeout = 0;
+        return true;
+    }
+    if (deadline > 0) {
+        int ms = qemu_timeout_ns_to_ms(deadline);
+        if (*timeout < 0 || ms < *timeout) {
+            *timeout = ms;
         }
     }
 
@@ -145,12 +322,12 @@ static gboolean
 aio_ctx_check(GSource *source)
 {
     AioContext *ctx = (AioContext *) source;
-    QEMUBH *bh;
 
-    for (bh = ctx->first_bh; bh; bh = bh->next) {
-        if (!bh->deleted && bh->scheduled) {
-            return true;
-	}
+    if (aio_bh_timeout(ctx) >= 0) {
+        return true;
+    }
+    if (aio_timer_deadline_ns(ctx) == 0) {
+        return true;
     }
     return aio_pending(ctx);
 }
@@ -171,10 +348,27 @@ static void
 aio_ctx_finalize(GSource     *source)
 {
     AioContext *ctx = (AioContext *) source;
+    QEMUBH *bh;
+    int i;
 
+    thread_pool_free(ctx->thread_pool);
+    for (i = 0; i < ctx->n_timer_lists; i++) {
+        qemu_timer_list_free(ctx->timer_lists[i]);
+    }
     aio_set_event_notifier(ctx, &ctx->notifier, NULL, NULL);
     event_notifier_cleanup(&ctx->notifier);
+    aio_context_cleanup(ctx);
     g_array_free(ctx->pollfds, TRUE);
+
+    /* Free the bottom halves whose deletion was not polled yet */
+    aio_bh_dequeue(ctx);
+    while ((bh = ctx->bh_ready) != NULL) {
+        ctx->bh_ready = bh->queue_next;
+        if (bh->flags & BH_DELETED) {
+            aio_bh_free(ctx, bh);
+        }
+    }
+    qemu_mutex_destroy(&ctx->bh_lock);
 }
 
 static GSourceFuncs aio_source_funcs = {
@@ -190,16 +384,75 @@ GSource *aio_get_g_source(AioContext *ctx)
     return &ctx->source;
 }
 
+ThreadPool *aio_get_thread_pool(AioContext *ctx)
+{
+    if (!ctx->thread_pool) {
+        ctx->thread_pool = thread_pool_new(ctx);
+    }
+    return ctx->thread_pool;
+}
+
 void aio_notify(AioContext *ctx)
 {
     event_notifier_set(&ctx->notifier);
 }
 
+static void aio_timer_notify(void *opaque)
+{
+    aio_notify(opaque);
+}
+
+QEMUTimer *aio_timer_new(AioContext *ctx, QEMUClock *clock, int scale,
+                         QEMUTimerCB *cb, void *opaque)
+{
+    QEMUTimerList *list;
+    int i;
+
+    for (i = 0; i < ctx->n_timer_lists; i++) {
+        list = ctx->timer_lists[i];
+        if (qemu_timer_list_clock(list) == clock) {
+            return qemu_timer_list_new_timer(list, scale, cb, opaque);
+        }
+    }
+
+    assert(ctx->n_timer_lists < AIO_MAX_TIMER_LISTS);
+    list = qemu_timer_list_new(clock, aio_timer_notify, ctx);
+    ctx->timer_lists[ctx->n_timer_lists++] = list;
+    return qemu_timer_list_new_timer(list, scale, cb, opaque);
+}
+
+int64_t aio_timer_deadline_ns(AioContext *ctx)
+{
+    int64_t deadline = -1;
+    int i;
+
+    for (i = 0; i < ctx->n_timer_lists; i++) {
+        deadline = qemu_soonest_timeout(deadline,
+                       qemu_timer_list_deadline_ns(ctx->timer_lists[i]));
+    }
+    return deadline;
+}
+
+bool aio_run_timers(AioContext *ctx)
+{
+    bool progress = false;
+    int i;
+
+    for (i = 0; i < ctx->n_timer_lists; i++) {
+        progress |= qemu_timer_list_run(ctx->timer_lists[i]);
+    }
+    return progress;
+}
+
 AioContext *aio_context_new(void)
 {
     AioContext *ctx;
     ctx = (AioContext *) g_source_new(&aio_source_funcs, sizeof(AioContext));
     ctx->pollfds = g_array_new(FALSE, FALSE, sizeof(GPollFD));
+    qemu_mutex_init(&ctx->bh_lock);
+    QLIST_INIT(&ctx->bh_list);
+    ctx->bh_ready_tail = &ctx->bh_ready;
+    aio_context_setup(ctx);
     event_notifier_init(&ctx->notifier, false);
     aio_set_event_notifier(ctx, &ctx->notifier, 
                            (EventNotifierHandler *)
@@ -1838,6 +1838,7 @@ static void audio_init (void)
     if (!s->ts) {
         hw_error("Could not create audio timer\n");
     }
+    qemu_timer_set_name(s->ts, "audio");
 
     audio_process_options ("AUDIO", audio_options);
 
@@ -15,9 +15,11 @@
 
 #include "qemu-common.h"
 #include "block/block_int.h"
+#include "block/blockjob.h"
 #include "hw/hw.h"
 #include "qemu/queue.h"
 #include "qemu/timer.h"
+#include "qemu/hbitmap.h"
 #include "migration/block.h"
 #include "migration/migration.h"
 #include "sysemu/blockdev.h"
@@ -29,6 +31,7 @@
 #define BLK_MIG_FLAG_DEVICE_BLOCK       0x01
 #define BLK_MIG_FLAG_EOS                0x02
 #define BLK_MIG_FLAG_PROGRESS           0x04
+#define BLK_MIG_FLAG_ZERO_BLOCK         0x08
 
 #define MAX_IS_ALLOCATED_SEARCH 65536
 
@@ -52,7 +55,11 @@ typedef struct BlkMigDevState {
     int64_t total_sectors;
     int64_t dirty;
     QSIMPLEQ_ENTRY(BlkMigDevState) entry;
-    unsigned long *aio_bitmap;
+    /* chunks with a read in flight */
+    HBitmap *aio_bitmap;
+    int inflight;
+    /* the bulk phase yields to guest I/O on the device */
+    BlockJobSched sched;
 } BlkMigDevState;
 
 typedef struct BlkMigBlock {
@@ -79,6 +86,11 @@ typedef struct BlkMigState {
     int prev_progress;
     int bulk_completed;
     long double prev_time_offset;
+    int nr_devices;
+    /* device served last, devices take turns submitting reads */
+    BlkMigDevState *last_bmds;
+    int max_inflight;
+    bool zero_blocks;
 } BlkMigState;
 
 static BlkMigState block_mig_state;
@@ -86,16 +98,24 @@ static BlkMigState block_mig_state;
 static void blk_send(QEMUFile *f, BlkMigBlock * blk)
 {
     int len;
+    uint64_t flags = BLK_MIG_FLAG_DEVICE_BLOCK;
+
+    if (block_mig_state.zero_blocks &&
+        buffer_is_zero(blk->buf, blk->nr_sectors * BDRV_SECTOR_SIZE)) {
+        flags |= BLK_MIG_FLAG_ZERO_BLOCK;
+    }
 
     /* sector number and flags */
-    qemu_put_be64(f, (blk->sector << BDRV_SECTOR_BITS)
-                     | BLK_MIG_FLAG_DEVICE_BLOCK);
+    qemu_put_be64(f, (blk->sector << BDRV_SECTOR_BITS) | flags);
 
     /* device name */
     len = strlen(blk->bmds->bs->device_name);
     qemu_put_byte(f, len);
     qemu_put_buffer(f, (uint8_t *)blk->bmds->bs->device_name, len);
 
+    if (flags & BLK_MIG_FLAG_ZERO_BLOCK) {
+        return;
+    }
     qemu_put_buffer(f, blk->buf, BLOCK_SIZE);
 }
 
@@ -133,11 +153,8 @@ uint64_t blk_mig_bytes_total(void)
 
 static int bmds_aio_inflight(BlkMigDevState *bmds, int64_t sector)
 {
-    int64_t chunk = sector / (int64_t)BDRV_SECTORS_PER_DIRTY_CHUNK;
-
-    if ((sector << BDRV_SECTOR_BITS) < bdrv_getlength(bmds->bs)) {
-        return !!(bmds->aio_bitmap[chunk / (sizeof(unsigned long) * 8)] &
-            (1UL << (chunk % (sizeof(unsigned long) * 8))));
+    if (sector < bmds->total_sectors) {
+        return hbitmap_get(bmds->aio_bitmap, sector);
     } else {
         return 0;
     }
@@ -146,35 +163,37 @@ static int bmds_aio_inflight(BlkMigDevState *bmds, int64_t sector)
 static void bmds_set_aio_inflight(BlkMigDevState *bmds, int64_t sector_num,
                              int nb_sectors, int set)
 {
-    int64_t start, end;
-    unsigned long val, idx, bit;
-
-    start = sector_num / BDRV_SECTORS_PER_DIRTY_CHUNK;
-    end = (sector_num + nb_sectors - 1) / BDRV_SECTORS_PER_DIRTY_CHUNK;
-
-    for (; start <= end; start++) {
-        idx = start / (sizeof(unsigned long) * 8);
-        bit = start % (sizeof(unsigned long) * 8);
-        val = bmds->aio_bitmap[idx];
-        if (set) {
-            val |= 1UL << bit;
-        } else {
-            val &= ~(1UL << bit);
-        }
-        bmds->aio_bitmap[idx] = val;
+    if (set) {
+        hbitmap_set(bmds->aio_bitmap, sector_num, nb_sectors);
+    } else {
+        hbitmap_reset(bmds->aio_bitmap, sector_num, nb_sectors);
     }
 }
 
 static void alloc_aio_bitmap(BlkMigDevState *bmds)
 {
-    BlockDriverState *bs = bmds->bs;
-    int64_t bitmap_size;
+    bmds->aio_bitmap = hbitmap_alloc(bmds->total_sectors,
+                                     ffs(BDRV_SECTORS_PER_DIRTY_CHUNK) - 1);
+}
 
-    bitmap_size = (bdrv_getlength(bs) >> BDRV_SECTOR_BITS) +
-            BDRV_SECTORS_PER_DIRTY_CHUNK * 8 - 1;
-    bitmap_size /= BDRV_SECTORS_PER_DIRTY_CHUNK * 8;
+/* Hand out the next device in turn that @ready accepts, so that all
+ * devices make progress at the same time */
+static BlkMigDevState *blk_mig_next_device(bool (*ready)(BlkMigDevState *))
+{
+    BlkMigDevState *bmds = block_mig_state.last_bmds;
+    int i;
 
-    bmds->aio_bitmap = g_malloc0(bitmap_size);
+    for (i = 0; i < block_mig_state.nr_devices; i++) {
+        bmds = bmds ? QSIMPLEQ_NEXT(bmds, entry) : NULL;
+        if (!bmds) {
+            bmds = QSIMPLEQ_FIRST(&block_mig_state.bmds_list);
+        }
+        if (ready(bmds)) {
+            block_mig_state.last_bmds = bmds;
+            return bmds;
+        }
+    }
+    return NULL;
 }
 
 static void blk_mig_read_cb(void *opaque, int ret)
@@ -191,9 +210,29 @@ static void blk_mig_read_cb(void *opaque, int ret)
 
     block_mig_state.submitted--;
     block_mig_state.read_done++;
+    blk->bmds->inflight--;
     assert(block_mig_state.submitted >= 0);
 }
 
+static void blk_mig_submit(BlkMigBlock *blk)
+{
+    BlkMigDevState *bmds = blk->bmds;
+
+    blk->iov.iov_base = blk->buf;
+    blk->iov.iov_len = blk->nr_sectors * BDRV_SECTOR_SIZE;
+    qemu_iovec_init_external(&blk->qiov, &blk->iov, 1);
+
+    if (block_mig_state.submitted == 0) {
+        block_mig_state.prev_time_offset = qemu_get_clock_ns(rt_clock);
+    }
+
+    block_mig_state.submitted++;
+    bmds->inflight++;
+    bmds_set_aio_inflight(bmds, blk->sector, blk->nr_sectors, 1);
+    blk->aiocb = bdrv_aio_readv(bmds->bs, blk->sector, &blk->qiov,
+                                blk->nr_sectors, blk_mig_read_cb, blk);
+}
+
 static int mig_save_device_bulk(QEMUFile *f, BlkMigDevState *bmds)
 {
     int64_t total_sectors = bmds->total_sectors;
@@ -231,18 +270,7 @@ static int mig_save_device_bulk(QEMUFile *f, BlkMigDevState *bmds)
     blk->bmds = bmds;
     blk->sector = cur_sector;
     blk->nr_sectors = nr_sectors;
-
-    blk->iov.iov_base = blk->buf;
-    blk->iov.iov_len = nr_sectors * BDRV_SECTOR_SIZE;
-    qemu_iovec_init_external(&blk->qiov, &blk->iov, 1);
-
-    if (block_mig_state.submitted == 0) {
-        block_mig_state.prev_time_offset = qemu_get_clock_ns(rt_clock);
-    }
-
-    blk->aiocb = bdrv_aio_readv(bs, cur_sector, &blk->qiov,
-                                nr_sectors, blk_mig_read_cb, blk);
-    block_mig_state.submitted++;
+    blk_mig_submit(blk);
 
     bdrv_reset_dirty(bs, cur_sector, nr_sectors);
     bmds->cur_sector = cur_sector + nr_sectors;
@@ -276,7 +304,9 @@ static void init_blk_migration_it(void *opaque, BlockDriverState *bs)
         bmds->total_sectors = sectors;
         bmds->completed_sectors = 0;
         bmds->shared_base = block_mig_state.shared_base;
+        block_job_sched_init(&bmds->sched, BLOCK_JOB_PRIORITY_LOW);
         alloc_aio_bitmap(bmds);
+        block_mig_state.nr_devices++;
         drive_get_ref(drive_get_by_blockdev(bs));
         bdrv_set_in_use(bs, 1);
 
@@ -301,10 +331,35 @@ static void init_blk_migration(QEMUFile *f)
     block_mig_state.total_sector_sum = 0;
     block_mig_state.prev_progress = -1;
     block_mig_state.bulk_completed = 0;
+    block_mig_state.nr_devices = 0;
+    block_mig_state.last_bmds = NULL;
+    block_mig_state.max_inflight = migrate_block_inflight();
+    block_mig_state.zero_blocks = migrate_zero_blocks();
 
     bdrv_iterate(init_blk_migration_it, NULL);
 }
 
+static bool bmds_bulk_ready(BlkMigDevState *bmds)
+{
+    return !bmds->bulk_completed &&
+           bmds->inflight < block_mig_state.max_inflight &&
+           block_job_sched_delay(&bmds->sched, bmds->bs, 0) == 0;
+}
+
+static bool bmds_dirty_ready(BlkMigDevState *bmds)
+{
+    return bmds->cur_dirty < bmds->total_sectors &&
+           bmds->inflight < block_mig_state.max_inflight;
+}
+
+/* return value:
+ * 0: bulk phase completed on all devices
+ * 1: a read was submitted
+ * BLK_MIG_BUSY: the devices still in the bulk phase have as many reads in
+ *               flight as they are allowed to
+ */
+#define BLK_MIG_BUSY 2
+
 static int blk_mig_save_bulked_block(QEMUFile *f)
 {
     int64_t completed_sector_sum = 0;
@@ -312,17 +367,19 @@ static int blk_mig_save_bulked_block(QEMUFile *f)
     int progress;
     int ret = 0;
 
+    bmds = blk_mig_next_device(bmds_bulk_ready);
+    if (bmds) {
+        if (mig_save_device_bulk(f, bmds) == 1) {
+            /* completed bulk section for this device */
+            bmds->bulk_completed = 1;
+        }
+        ret = 1;
+    }
+
     QSIMPLEQ_FOREACH(bmds, &block_mig_state.bmds_list, entry) {
-        if (bmds->bulk_completed == 0) {
-            if (mig_save_device_bulk(f, bmds) == 1) {
-                /* completed bulk section for this device */
-                bmds->bulk_completed = 1;
-            }
-            completed_sector_sum += bmds->completed_sectors;
-            ret = 1;
-            break;
-        } else {
-            completed_sector_sum += bmds->completed_sectors;
+        completed_sector_sum += bmds->completed_sectors;
+        if (ret == 0 && !bmds->bulk_completed) {
+            ret = BLK_MIG_BUSY;
         }
     }
 
@@ -351,6 +408,11 @@ static void blk_mig_reset_dirty_cursor(void)
     }
 }
 
+/* return value:
+ * 0: a dirty chunk was submitted (or sent, if !is_async)
+ * 1: no dirty chunk left after the device's cursor
+ * < 0: error
+ */
 static int mig_save_device_dirty(QEMUFile *f, BlkMigDevState *bmds,
                                  int is_async)
 {
@@ -360,55 +422,43 @@ static int mig_save_device_dirty(QEMUFile *f, BlkMigDevState *bmds,
     int nr_sectors;
     int ret = -EIO;
 
-    for (sector = bmds->cur_dirty; sector < bmds->total_sectors;) {
-        if (bmds_aio_inflight(bmds, sector)) {
-            bdrv_drain_all();
-        }
-        if (bdrv_get_dirty(bmds->bs, sector)) {
-
-            if (total_sectors - sector < BDRV_SECTORS_PER_DIRTY_CHUNK) {
-                nr_sectors = total_sectors - sector;
-            } else {
-                nr_sectors = BDRV_SECTORS_PER_DIRTY_CHUNK;
-            }
-            blk = g_malloc(sizeof(BlkMigBlock));
-            blk->buf = g_malloc(BLOCK_SIZE);
-            blk->bmds = bmds;
-            blk->sector = sector;
-            blk->nr_sectors = nr_sectors;
-
-            if (is_async) {
-                blk->iov.iov_base = blk->buf;
-                blk->iov.iov_len = nr_sectors * BDRV_SECTOR_SIZE;
-                qemu_iovec_init_external(&blk->qiov, &blk->iov, 1);
-
-                if (block_mig_state.submitted == 0) {
-                    block_mig_state.prev_time_offset = qemu_get_clock_ns(rt_clock);
-                }
+    sector = bdrv_get_next_dirty(bmds->bs, bmds->cur_dirty);
+    if (sector < 0 || sector >= total_sectors) {
+        bmds->cur_dirty = total_sectors;
+        return 1;
+    }
 
-                blk->aiocb = bdrv_aio_readv(bmds->bs, sector, &blk->qiov,
-                                            nr_sectors, blk_mig_read_cb, blk);
-                block_mig_state.submitted++;
-                bmds_set_aio_inflight(bmds, sector, nr_sectors, 1);
-            } else {
-                ret = bdrv_read(bmds->bs, sector, blk->buf, nr_sectors);
-                if (ret < 0) {
-                    goto error;
-                }
-                blk_send(f, blk);
+    if (bmds_aio_inflight(bmds, sector)) {
+        bdrv_drain_all();
+    }
 
-                g_free(blk->buf);
-                g_free(blk);
-            }
+    if (total_sectors - sector < BDRV_SECTORS_PER_DIRTY_CHUNK) {
+        nr_sectors = total_sectors - sector;
+    } else {
+        nr_sectors = BDRV_SECTORS_PER_DIRTY_CHUNK;
+    }
+    blk = g_malloc(sizeof(BlkMigBlock));
+    blk->buf = g_malloc(BLOCK_SIZE);
+    blk->bmds = bmds;
+    blk->sector = sector;
+    blk->nr_sectors = nr_sectors;
 
-            bdrv_reset_dirty(bmds->bs, sector, nr_sectors);
-            break;
+    if (is_async) {
+        blk_mig_submit(blk);
+    } else {
+        ret = bdrv_read(bmds->bs, sector, blk->buf, nr_sectors);
+        if (ret < 0) {
+            goto error;
         }
-        sector += BDRV_SECTORS_PER_DIRTY_CHUNK;
-        bmds->cur_dirty = sector;
+        blk_send(f, blk);
+
+        g_free(blk->buf);
+        g_free(blk);
     }
 
-    return (bmds->cur_dirty >= bmds->total_sectors);
+    bdrv_reset_dirty(bmds->bs, sector, nr_sectors);
+    bmds->cur_dirty = sector + nr_sectors;
+    return 0;
 
 error:
     DPRINTF("Error reading sector %" PRId64 "\n", sector);
@@ -420,20 +470,27 @@ error:
 /* return value:
  * 0: too much data for max_downtime
  * 1: few enough data for max_downtime
+ * BLK_MIG_BUSY: the devices with dirty chunks left have as many reads in
+ *               flight as they are allowed to
 */
 static int blk_mig_save_dirty_block(QEMUFile *f, int is_async)
 {
     BlkMigDevState *bmds;
-    int ret = 1;
+    int ret;
 
-    QSIMPLEQ_FOREACH(bmds, &block_mig_state.bmds_list, entry) {
+    while ((bmds = blk_mig_next_device(bmds_dirty_ready)) != NULL) {
         ret = mig_save_device_dirty(f, bmds, is_async);
         if (ret <= 0) {
-            break;
+            return ret;
         }
     }
 
-    return ret;
+    QSIMPLEQ_FOREACH(bmds, &block_mig_state.bmds_list, entry) {
+        if (bmds->cur_dirty < bmds->total_sectors) {
+            return BLK_MIG_BUSY;
+        }
+    }
+    return 1;
 }
 
 static int flush_blks(QEMUFile *f)
@@ -495,9 +552,11 @@ static void blk_mig_cleanup(void)
         QSIMPLEQ_REMOVE_HEAD(&block_mig_state.bmds_list, entry);
         bdrv_set_in_use(bmds->bs, 0);
         drive_put_ref(drive_get_by_blockdev(bmds->bs));
-        g_free(bmds->aio_bitmap);
+        hbitmap_free(bmds->aio_bitmap);
         g_free(bmds);
     }
+    block_mig_state.last_bmds = NULL;
+    block_mig_state.nr_devices = 0;
 
     while ((blk = QSIMPLEQ_FIRST(&block_mig_state.blk_list)) != NULL) {
         QSIMPLEQ_REMOVE_HEAD(&block_mig_state.blk_list, entry);
@@ -558,9 +617,13 @@ static int block_save_iterate(QEMUFile *f, void *opaque)
            qemu_file_get_rate_limit(f)) {
         if (block_mig_state.bulk_completed == 0) {
             /* first finish the bulk phase */
-            if (blk_mig_save_bulked_block(f) == 0) {
+            ret = blk_mig_save_bulked_block(f);
+            if (ret == 0) {
                 /* finished saving bulk on all devices */
                 block_mig_state.bulk_completed = 1;
+            } else if (ret == BLK_MIG_BUSY) {
+                /* wait for reads to complete */
+                break;
             }
         } else {
             ret = blk_mig_save_dirty_block(f, 1);
@@ -686,12 +749,15 @@ static int block_load(QEMUFile *f, void *opaque, int version_id)
                 nr_sectors = BDRV_SECTORS_PER_DIRTY_CHUNK;
             }
 
-            buf = g_malloc(BLOCK_SIZE);
-
-            qemu_get_buffer(f, buf, BLOCK_SIZE);
-            ret = bdrv_write(bs, addr, buf, nr_sectors);
+            if (flags & BLK_MIG_FLAG_ZERO_BLOCK) {
+                ret = bdrv_write_zeroes(bs, addr, nr_sectors, 0);
+            } else {
+                buf = g_malloc(BLOCK_SIZE);
+                qemu_get_buffer(f, buf, BLOCK_SIZE);
+                ret = bdrv_write(bs, addr, buf, nr_sectors);
+                g_free(buf);
+            }
 
-            g_free(buf);
             if (ret < 0) {
                 return ret;
             }
@@ -27,6 +27,8 @@
 #include "monitor/monitor.h"
 #include "block/block_int.h"
 #include "block/blockjob.h"
+#include "block/throttle-groups.h"
+#include "block/shared-cache.h"
 #include "qemu/module.h"
 #include "qapi/qmp/qjson.h"
 #include "sysemu/sysemu.h"
@@ -51,11 +53,6 @@
 
 #define NOT_DONE 0x7fffffff /* used while emulated sync operation in progress */
 
-typedef enum {
-    BDRV_REQ_COPY_ON_READ = 0x1,
-    BDRV_REQ_ZERO_WRITE   = 0x2,
-} BdrvRequestFlags;
-
 static void bdrv_dev_change_media_cb(BlockDriverState *bs, bool load);
 static BlockDriverAIOCB *bdrv_aio_readv_em(BlockDriverState *bs,
         int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
@@ -81,17 +78,21 @@ static BlockDriverAIOCB *bdrv_co_aio_rw_vector(BlockDriverState *bs,
                                                int nb_sectors,
                                                BlockDriverCompletionFunc *cb,
                                                void *opaque,
+                                               BdrvRequestFlags flags,
                                                bool is_write);
 static void coroutine_fn bdrv_co_do_rw(void *opaque);
 static int coroutine_fn bdrv_co_do_write_zeroes(BlockDriverState *bs,
-    int64_t sector_num, int nb_sectors);
-
-static bool bdrv_exceed_bps_limits(BlockDriverState *bs, int nb_sectors,
-        bool is_write, double elapsed_time, uint64_t *wait);
-static bool bdrv_exceed_iops_limits(BlockDriverState *bs, bool is_write,
-        double elapsed_time, uint64_t *wait);
-static bool bdrv_exceed_io_limits(BlockDriverState *bs, int nb_sectors,
-        bool is_write, int64_t *wait);
+    int64_t sector_num, int nb_sectors, BdrvRequestFlags flags);
+static void bdrv_merge_flush(BlockDriverState *bs);
+static void bdrv_merge_bh(void *opaque);
+static void block_histogram_free(BlockHistogram *hist);
+static BlockHistogramBinList *block_histogram_query(const BlockHistogram *hist);
+static void bdrv_release_all_dirty_bitmaps(BlockDriverState *bs);
+static void bdrv_mark_named_dirty(BlockDriverState *bs, int64_t cur_sector,
+                                  int64_t nr_sectors);
+static void bdrv_mark_dirty(BlockDriverState *bs, int64_t cur_sector,
+                            int nr_sectors);
+static void bdrv_resize_dirty_bitmaps(BlockDriverState *bs, int64_t old_size);
 
 static QTAILQ_HEAD(, BlockDriverState) bdrv_states =
     QTAILQ_HEAD_INITIALIZER(bdrv_states);
@@ -129,69 +130,39 @@ int is_windows_drive(const char *filename)
 void bdrv_io_limits_disable(BlockDriverState *bs)
 {
     bs->io_limits_enabled = false;
-
-    while (qemu_co_queue_next(&bs->throttled_reqs));
-
-    if (bs->block_timer) {
-        qemu_del_timer(bs->block_timer);
-        qemu_free_timer(bs->block_timer);
-        bs->block_timer = NULL;
-    }
-
-    bs->slice_start = 0;
-    bs->slice_end   = 0;
-    bs->slice_time  = 0;
-    memset(&bs->io_base, 0, sizeof(bs->io_base));
-}
-
-static void bdrv_block_timer(void *opaque)
-{
-    BlockDriverState *bs = opaque;
-
-    qemu_co_queue_next(&bs->throttled_reqs);
+    throttle_group_unregister_bs(bs);
 }
 
-void bdrv_io_limits_enable(BlockDriverState *bs)
+void bdrv_io_limits_enable(BlockDriverState *bs, const char *group)
 {
-    qemu_co_queue_init(&bs->throttled_reqs);
-    bs->block_timer = qemu_new_timer_ns(vm_clock, bdrv_block_timer, bs);
+    assert(!bs->io_limits_enabled);
+    throttle_group_register_bs(bs, group);
     bs->io_limits_enabled = true;
 }
 
-bool bdrv_io_limits_enabled(BlockDriverState *bs)
-{
-    BlockIOLimit *io_limits = &bs->io_limits;
-    return io_limits->bps[BLOCK_IO_LIMIT_READ]
-         || io_limits->bps[BLOCK_IO_LIMIT_WRITE]
-         || io_limits->bps[BLOCK_IO_LIMIT_TOTAL]
-         || io_limits->iops[BLOCK_IO_LIMIT_READ]
-         || io_limits->iops[BLOCK_IO_LIMIT_WRITE]
-         || io_limits->iops[BLOCK_IO_LIMIT_TOTAL];
-}
-
-static void bdrv_io_limits_intercept(BlockDriverState *bs,
-                                     bool is_write, int nb_sectors)
+void bdrv_io_limits_update_group(BlockDriverState *bs, const char *group)
 {
-    int64_t wait_time = -1;
-
-    if (!qemu_co_queue_empty(&bs->throttled_reqs)) {
-        qemu_co_queue_wait(&bs->throttled_reqs);
+    /* this bs is not part of any group */
+    if (!bs->io_limits_enabled) {
+        return;
     }
 
-    /* In fact, we hope to keep each request's timing, in FIFO mode. The next
-     * throttled requests will not be dequeued until the current request is
-     * allowed to be serviced. So if the current request still exceeds the
-     * limits, it will be inserted to the head. All requests followed it will
-     * be still in throttled_reqs queue.
-     */
-
-    while (bdrv_exceed_io_limits(bs, nb_sectors, is_write, &wait_time)) {
-        qemu_mod_timer(bs->block_timer,
-                       wait_time + qemu_get_clock_ns(vm_clock));
-        qemu_co_queue_wait_insert_head(&bs->throttled_reqs);
+    /* this bs is a part of the same group than the one we want */
+    if (!strcmp(throttle_group_get_name(bs), group)) {
+        return;
     }
 
-    qemu_co_queue_next(&bs->throttled_reqs);
+    /* need to change the group this bs belongs to */
+    bdrv_io_limits_disable(bs);
+    bdrv_io_limits_enable(bs, group);
+}
+
+static void coroutine_fn bdrv_io_limits_intercept(BlockDriverState *bs,
+                                                  bool is_write,
+                                                  int nb_sectors)
+{
+    throttle_group_co_io_limits_intercept(bs, nb_sectors * BDRV_SECTOR_SIZE,
+                                          is_write);
 }
 
 /* check if the path starts with "<protocol>:" */
@@ -310,6 +281,9 @@ BlockDriverState *bdrv_new(const char *device_name)
     }
     bdrv_iostatus_disable(bs);
     notifier_list_init(&bs->close_notifiers);
+    QLIST_INIT(&bs->dirty_bitmaps);
+    bs->aio_context = qemu_get_aio_context();
+    bs->request_alignment = BDRV_SECTOR_SIZE;
 
     return bs;
 }
@@ -319,6 +293,104 @@ void bdrv_add_close_notifier(BlockDriverState *bs, Notifier *notify)
     notifier_list_add(&bs->close_notifiers, notify);
 }
 
+AioContext *bdrv_get_aio_context(BlockDriverState *bs)
+{
+    return bs->aio_context;
+}
+
+/* Return true if @bs and the images below it can run in an AioContext other
+ * than the main loop's */
+bool bdrv_can_set_aio_context(BlockDriverState *bs)
+{
+    /* throttling and block jobs use main loop timers */
+    if (bs->io_limits_enabled || bs->job) {
+        return false;
+    }
+    if (bs->drv && bs->drv->bdrv_main_context_only) {
+        return false;
+    }
+    if (bs->file && !bdrv_can_set_aio_context(bs->file)) {
+        return false;
+    }
+    if (bs->backing_hd && !bdrv_can_set_aio_context(bs->backing_hd)) {
+        return false;
+    }
+    return true;
+}
+
+static bool bdrv_requests_pending(BlockDriverState *bs)
+{
+    if (!interval_tree_empty(&bs->tracked_requests) ||
+        bs->nr_empty_requests) {
+        return true;
+    }
+    if (bs->file && bdrv_requests_pending(bs->file)) {
+        return true;
+    }
+    if (bs->backing_hd && bdrv_requests_pending(bs->backing_hd)) {
+        return true;
+    }
+    return false;
+}
+
+static void bdrv_detach_aio_context(BlockDriverState *bs)
+{
+    if (bs->merge_bh) {
+        bdrv_merge_flush(bs);
+        qemu_bh_delete(bs->merge_bh);
+        bs->merge_bh = NULL;
+    }
+    if (bs->drv && bs->drv->bdrv_detach_aio_context) {
+        bs->drv->bdrv_detach_aio_context(bs);
+    }
+    if (bs->file) {
+        bdrv_detach_aio_context(bs->file);
+    }
+    if (bs->backing_hd) {
+        bdrv_detach_aio_context(bs->backing_hd);
+    }
+    bs->aio_context = NULL;
+}
+
+static void bdrv_attach_aio_context(BlockDriverState *bs,
+                                    AioContext *new_context)
+{
+    bs->aio_context = new_context;
+    if (bs->backing_hd) {
+        bdrv_attach_aio_context(bs->backing_hd, new_context);
+    }
+    if (bs->file) {
+        bdrv_attach_aio_context(bs->file, new_context);
+    }
+    if (bs->drv && bs->drv->bdrv_attach_aio_context) {
+        bs->drv->bdrv_attach_aio_context(bs, new_context);
+    }
+    if (bs->merge_requests) {
+        bs->merge_bh = aio_bh_new(new_context, bdrv_merge_bh, bs);
+    }
+}
+
+/*
+ * Move @bs and the images below it to @new_context, after completing the
+ * requests in flight.  Callbacks for @bs then run in whichever thread runs
+ * @new_context, so the caller must make sure that thread does not run yet
+ * and that the thread running the old context, if not the main loop, has
+ * stopped.  The caller must check bdrv_can_set_aio_context() before moving
+ * @bs away from the main loop.
+ */
+void bdrv_set_aio_context(BlockDriverState *bs, AioContext *new_context)
+{
+    AioContext *old_context = bdrv_get_aio_context(bs);
+
+    bdrv_drain_all();
+    while (bdrv_requests_pending(bs)) {
+        aio_poll(old_context, true);
+    }
+
+    bdrv_detach_aio_context(bs);
+    bdrv_attach_aio_context(bs, new_context);
+}
+
 BlockDriver *bdrv_find_format(const char *format_name)
 {
     BlockDriver *drv1;
@@ -679,6 +751,7 @@ static int bdrv_open_common(BlockDriverState *bs, BlockDriverState *file,
 
     bs->open_flags = flags;
     bs->buffer_alignment = 512;
+    bs->request_alignment = BDRV_SECTOR_SIZE;
 
     assert(bs->copy_on_read == 0); /* bdrv_new() and bdrv_close() make it so */
     if ((flags & BDRV_O_RDWR) && (flags & BDRV_O_COPY_ON_READ)) {
@@ -730,6 +803,7 @@ static int bdrv_open_common(BlockDriverState *bs, BlockDriverState *file,
     return 0;
 
 free_and_fail:
+    bdrv_release_all_dirty_bitmaps(bs);
     bs->file = NULL;
     g_free(bs->opaque);
     bs->opaque = NULL;
@@ -788,6 +862,10 @@ int bdrv_open_backing_file(BlockDriverState *bs)
     /* backing files always opened read-only */
     back_flags = bs->open_flags & ~(BDRV_O_RDWR | BDRV_O_SNAPSHOT);
 
+    if (bs->shared_cache) {
+        bs->backing_hd->shared_cache = shared_cache_ref(bs->shared_cache);
+    }
+
     ret = bdrv_open(bs->backing_hd, backing_filename, back_flags, back_drv);
     if (ret < 0) {
         bdrv_delete(bs->backing_hd);
@@ -906,13 +984,12 @@ int bdrv_open(BlockDriverState *bs, const char *filename, int flags,
         }
     }
 
-    if (!bdrv_key_required(bs)) {
-        bdrv_dev_change_media_cb(bs, true);
+    if (bs->shared_cache) {
+        bs->shared_cache_key = shared_cache_image_key(bs);
     }
 
-    /* throttling disk I/O limits */
-    if (bs->io_limits_enabled) {
-        bdrv_io_limits_enable(bs);
+    if (!bdrv_key_required(bs)) {
+        bdrv_dev_change_media_cb(bs, true);
     }
 
     return 0;
@@ -1161,12 +1238,17 @@ void bdrv_reopen_abort(BDRVReopenState *reopen_state)
 
 void bdrv_close(BlockDriverState *bs)
 {
+    /* Let users that run @bs in their own thread hand it back first */
+    notifier_list_notify(&bs->close_notifiers, bs);
+
+    if (bs->merge_requests) {
+        bdrv_merge_flush(bs);
+    }
     bdrv_flush(bs);
     if (bs->job) {
         block_job_cancel_sync(bs->job);
     }
     bdrv_drain_all();
-    notifier_list_notify(&bs->close_notifiers, bs);
 
     if (bs->drv) {
         if (bs == bs_snapshots) {
@@ -1178,6 +1260,7 @@ void bdrv_close(BlockDriverState *bs)
         }
         bs->drv->bdrv_close(bs);
         g_free(bs->opaque);
+        bdrv_release_all_dirty_bitmaps(bs);
 #ifdef _WIN32
         if (bs->is_temporary) {
             unlink(bs->filename);
@@ -1193,6 +1276,8 @@ void bdrv_close(BlockDriverState *bs)
         bs->valid_key = 0;
         bs->sg = 0;
         bs->growable = 0;
+        bs->shared_cache_key = 0;
+        memset(&bs->bl, 0, sizeof(bs->bl));
 
         if (bs->file != NULL) {
             bdrv_delete(bs->file);
@@ -1228,6 +1313,9 @@ void bdrv_close_all(void)
  * can be arbitrarily complex and a constant flow of I/O can come until the
  * coroutine is complete.  Because of this, it is not possible to have a
  * function to drain a single device's I/O queue.
+ *
+ * BlockDriverStates bound to another AioContext are left to the thread
+ * that runs it.
  */
 void bdrv_drain_all(void)
 {
@@ -1241,17 +1329,29 @@ void bdrv_drain_all(void)
          * a busy wait.
          */
         QTAILQ_FOREACH(bs, &bdrv_states, list) {
-            if (!qemu_co_queue_empty(&bs->throttled_reqs)) {
-                qemu_co_queue_restart_all(&bs->throttled_reqs);
-                busy = true;
+            int i;
+
+            if (bdrv_get_aio_context(bs) != qemu_get_aio_context()) {
+                continue;
+            }
+            for (i = 0; i < 2; i++) {
+                if (!qemu_co_queue_empty(&bs->throttled_reqs[i])) {
+                    qemu_co_queue_restart_all(&bs->throttled_reqs[i]);
+                    busy = true;
+                }
             }
         }
     } while (busy);
 
     /* If requests are still pending there is a bug somewhere */
     QTAILQ_FOREACH(bs, &bdrv_states, list) {
-        assert(QLIST_EMPTY(&bs->tracked_requests));
-        assert(qemu_co_queue_empty(&bs->throttled_reqs));
+        if (bdrv_get_aio_context(bs) != qemu_get_aio_context()) {
+            continue;
+        }
+        assert(interval_tree_empty(&bs->tracked_requests));
+        assert(bs->nr_empty_requests == 0);
+        assert(qemu_co_queue_empty(&bs->throttled_reqs[0]));
+        assert(qemu_co_queue_empty(&bs->throttled_reqs[1]));
     }
 }
 
@@ -1283,18 +1383,28 @@ static void bdrv_move_feature_fields(BlockDriverState *bs_dest,
     bs_dest->dev_opaque         = bs_src->dev_opaque;
     bs_dest->dev                = bs_src->dev;
     bs_dest->buffer_alignment   = bs_src->buffer_alignment;
+    bs_dest->l2_cache_coverage  = bs_src->l2_cache_coverage;
     bs_dest->copy_on_read       = bs_src->copy_on_read;
 
     bs_dest->enable_write_cache = bs_src->enable_write_cache;
 
-    /* i/o timing parameters */
-    bs_dest->slice_time         = bs_src->slice_time;
-    bs_dest->slice_start        = bs_src->slice_start;
-    bs_dest->slice_end          = bs_src->slice_end;
-    bs_dest->io_limits          = bs_src->io_limits;
-    bs_dest->io_base            = bs_src->io_base;
-    bs_dest->throttled_reqs     = bs_src->throttled_reqs;
-    bs_dest->block_timer        = bs_src->block_timer;
+    /* request merging */
+    bs_dest->merge_requests     = bs_src->merge_requests;
+    bs_dest->merge_max_sectors  = bs_src->merge_max_sectors;
+    bs_dest->merge_max_segments = bs_src->merge_max_segments;
+    bs_dest->merge_seq          = bs_src->merge_seq;
+    bs_dest->merge_bh           = bs_src->merge_bh;
+    bs_dest->merge_queue        = bs_src->merge_queue;
+
+    /* i/o throttling */
+    bs_dest->throttle_group     = bs_src->throttle_group;
+    bs_dest->round_robin        = bs_src->round_robin;
+    bs_dest->throttled_reqs[0]  = bs_src->throttled_reqs[0];
+    bs_dest->throttled_reqs[1]  = bs_src->throttled_reqs[1];
+    bs_dest->pending_reqs[0]    = bs_src->pending_reqs[0];
+    bs_dest->pending_reqs[1]    = bs_src->pending_reqs[1];
+    bs_dest->throttle_timers[0] = bs_src->throttle_timers[0];
+    bs_dest->throttle_timers[1] = bs_src->throttle_timers[1];
     bs_dest->io_limits_enabled  = bs_src->io_limits_enabled;
 
     /* r/w error */
@@ -1307,10 +1417,12 @@ static void bdrv_move_feature_fields(BlockDriverState *bs_dest,
 
     /* dirty bitmap */
     bs_dest->dirty_bitmap       = bs_src->dirty_bitmap;
+    bs_dest->dirty_bitmaps      = bs_src->dirty_bitmaps;
 
     /* job */
     bs_dest->in_use             = bs_src->in_use;
     bs_dest->job                = bs_src->job;
+    bs_dest->write_interceptor  = bs_src->write_interceptor;
 
     /* keep the same entry in bdrv_states */
     pstrcpy(bs_dest->device_name, sizeof(bs_dest->device_name),
@@ -1337,11 +1449,13 @@ void bdrv_swap(BlockDriverState *bs_new, BlockDriverState *bs_old)
     /* bs_new must be anonymous and shouldn't have anything fancy enabled */
     assert(bs_new->device_name[0] == '\0');
     assert(bs_new->dirty_bitmap == NULL);
+    assert(QLIST_EMPTY(&bs_new->dirty_bitmaps));
     assert(bs_new->job == NULL);
     assert(bs_new->dev == NULL);
     assert(bs_new->in_use == 0);
     assert(bs_new->io_limits_enabled == false);
-    assert(bs_new->block_timer == NULL);
+    assert(bs_new->throttle_group == NULL);
+    assert(bs_new->write_interceptor == NULL);
 
     tmp = *bs_new;
     *bs_new = *bs_old;
@@ -1360,7 +1474,7 @@ void bdrv_swap(BlockDriverState *bs_new, BlockDriverState *bs_old)
     assert(bs_new->job == NULL);
     assert(bs_new->in_use == 0);
     assert(bs_new->io_limits_enabled == false);
-    assert(bs_new->block_timer == NULL);
+    assert(bs_new->throttle_group == NULL);
 
     bdrv_rebind(bs_new);
     bdrv_rebind(bs_old);
@@ -1393,6 +1507,8 @@ void bdrv_append(BlockDriverState *bs_new, BlockDriverState *bs_top)
 
 void bdrv_delete(BlockDriverState *bs)
 {
+    int i;
+
     assert(!bs->dev);
     assert(!bs->job);
     assert(!bs->in_use);
@@ -1401,6 +1517,15 @@ void bdrv_delete(BlockDriverState *bs)
     bdrv_make_anon(bs);
 
     bdrv_close(bs);
+    bdrv_set_request_merging(bs, false, 0, 0);
+    if (bs->shared_cache) {
+        shared_cache_unref(bs->shared_cache);
+        bs->shared_cache = NULL;
+    }
+    for (i = 0; i < BDRV_MAX_IOTYPE; i++) {
+        block_histogram_free(&bs->latency_histogram[i]);
+    }
+    block_histogram_free(&bs->queue_depth_histogram);
 
     assert(bs != bs_snapshots);
     g_free(bs);
@@ -1560,6 +1685,143 @@ int bdrv_check(BlockDriverState *bs, BdrvCheckResult *res, BdrvCheckMode fix)
     return bs->drv->bdrv_check(bs, res, fix);
 }
 
+typedef struct BdrvQueuedRead {
+    BdrvReadQueue *q;
+    uint8_t *buf;
+    QEMUIOVector qiov;
+    struct iovec iov;
+    int64_t offset;
+    uint64_t tag;
+    int ret;
+    bool done;
+} BdrvQueuedRead;
+
+struct BdrvReadQueue {
+    BlockDriverState *bs;
+    int depth;
+    int max_bytes;
+    /* Ring of reads; @head is the oldest, @count are in use */
+    BdrvQueuedRead *reads;
+    int head;
+    int count;
+};
+
+BdrvReadQueue *bdrv_read_queue_new(BlockDriverState *bs, int depth,
+                                   int max_bytes)
+{
+    BdrvReadQueue *q = g_new0(BdrvReadQueue, 1);
+    int i;
+
+    q->bs = bs;
+    q->depth = depth;
+    q->max_bytes = max_bytes;
+    q->reads = g_new0(BdrvQueuedRead, depth);
+    for (i = 0; i < depth; i++) {
+        q->reads[i].q = q;
+        q->reads[i].buf = qemu_blockalign(bs, max_bytes);
+    }
+    return q;
+}
+
+void bdrv_read_queue_free(BdrvReadQueue *q)
+{
+    int i;
+
+    /* The buffers of reads still in flight must stay around */
+    while (!bdrv_read_queue_empty(q)) {
+        bdrv_read_queue_next(q, NULL, NULL, NULL);
+    }
+    for (i = 0; i < q->depth; i++) {
+        qemu_vfree(q->reads[i].buf);
+    }
+    g_free(q->reads);
+    g_free(q);
+}
+
+bool bdrv_read_queue_full(BdrvReadQueue *q)
+{
+    return q->count == q->depth;
+}
+
+bool bdrv_read_queue_empty(BdrvReadQueue *q)
+{
+    return q->count == 0;
+}
+
+static void bdrv_read_queue_cb(void *opaque, int ret)
+{
+    BdrvQueuedRead *r = opaque;
+
+    r->ret = ret;
+    r->done = true;
+}
+
+/*
+ * Start reading @bytes at @offset of @q's image.  @tag is handed back by
+ * bdrv_read_queue_next().  The queue must not be full.
+ */
+void bdrv_read_queue_submit(BdrvReadQueue *q, int64_t offset, int bytes,
+                            uint64_t tag)
+{
+    BdrvQueuedRead *r;
+    BlockDriverAIOCB *acb;
+
+    assert(!bdrv_read_queue_full(q));
+    assert(bytes <= q->max_bytes);
+
+    r = &q->reads[(q->head + q->count) % q->depth];
+    q->count++;
+    r->offset = offset;
+    r->tag = tag;
+    r->done = false;
+
+    /* Offsets taken from corrupted metadata need not be aligned */
+    if ((offset | bytes) & (BDRV_SECTOR_SIZE - 1)) {
+        r->ret = bdrv_pread(q->bs, offset, r->buf, bytes);
+        r->ret = r->ret < 0 ? r->ret : 0;
+        r->done = true;
+        return;
+    }
+
+    r->iov.iov_base = r->buf;
+    r->iov.iov_len = bytes;
+    qemu_iovec_init_external(&r->qiov, &r->iov, 1);
+    acb = bdrv_aio_readv(q->bs, offset >> BDRV_SECTOR_BITS, &r->qiov,
+                         bytes >> BDRV_SECTOR_BITS, bdrv_read_queue_cb, r);
+    if (!acb) {
+        r->ret = -EIO;
+        r->done = true;
+    }
+}
+
+/*
+ * Wait for the oldest read and remove it from @q.  Returns its error, or
+ * 0 on success; the data in *@buf stays valid until the next submission.
+ */
+int bdrv_read_queue_next(BdrvReadQueue *q, void **buf, int64_t *offset,
+                         uint64_t *tag)
+{
+    BdrvQueuedRead *r = &q->reads[q->head];
+
+    assert(!bdrv_read_queue_empty(q));
+    while (!r->done) {
+        aio_poll(bdrv_get_aio_context(q->bs), true);
+    }
+
+    q->head = (q->head + 1) % q->depth;
+    q->count--;
+    if (buf) {
+        *buf = r->buf;
+    }
+    if (offset) {
+        *offset = r->offset;
+    }
+    if (tag) {
+        *tag = r->tag;
+    }
+    return r->ret;
+}
+
 #define COMMIT_BUF_SECTORS 2048
 
 /* commit COW file into the raw image */
@@ -1653,7 +1915,7 @@ struct BdrvTrackedRequest {
     int64_t sector_num;
     int nb_sectors;
     bool is_write;
-    QLIST_ENTRY(BdrvTrackedRequest) list;
+    IntervalTreeNode node; /* keyed by sector range */
     Coroutine *co; /* owner, used for deadlock detection */
     CoQueue wait_queue; /* coroutines blocked on this request */
 };
@@ -1665,7 +1927,11 @@ struct BdrvTrackedRequest {
  */
 static void tracked_request_end(BdrvTrackedRequest *req)
 {
-    QLIST_REMOVE(req, list);
+    if (req->nb_sectors) {
+        interval_tree_remove(&req->bs->tracked_requests, &req->node);
+    } else {
+        req->bs->nr_empty_requests--;
+    }
     qemu_co_queue_restart_all(&req->wait_queue);
 }
 
@@ -1687,7 +1953,14 @@ static void tracked_request_begin(BdrvTrackedRequest *req,
 
     qemu_co_queue_init(&req->wait_queue);
 
-    QLIST_INSERT_HEAD(&bs->tracked_requests, req, list);
+    /* an empty request overlaps nothing, so it stays out of the tree */
+    if (nb_sectors == 0) {
+        bs->nr_empty_requests++;
+        return;
+    }
+    req->node.start = sector_num;
+    req->node.last = sector_num + nb_sectors - 1;
+    interval_tree_insert(&bs->tracked_requests, &req->node);
 }
 
 /**
@@ -1711,26 +1984,15 @@ void bdrv_round_to_clusters(BlockDriverState *bs,
     }
 }
 
-static bool tracked_request_overlaps(BdrvTrackedRequest *req,
-                                     int64_t sector_num, int nb_sectors) {
-    /*        aaaa   bbbb */
-    if (sector_num >= req->sector_num + req->nb_sectors) {
-        return false;
-    }
-    /* bbbb   aaaa        */
-    if (req->sector_num >= sector_num + nb_sectors) {
-        return false;
-    }
-    return true;
-}
-
 static void coroutine_fn wait_for_overlapping_requests(BlockDriverState *bs,
         int64_t sector_num, int nb_sectors)
 {
+    IntervalTreeNode *node;
     BdrvTrackedRequest *req;
     int64_t cluster_sector_num;
     int cluster_nb_sectors;
-    bool retry;
+    int64_t wait_start = 0;
+    int align;
 
     /* If we touch the same cluster it counts as an overlap.  This guarantees
      * that allocating writes will be serialized and not race with each other
@@ -1741,23 +2003,38 @@ static void coroutine_fn wait_for_overlapping_requests(BlockDriverState *bs,
     bdrv_round_to_clusters(bs, sector_num, nb_sectors,
                            &cluster_sector_num, &cluster_nb_sectors);
 
-    do {
-        retry = false;
-        QLIST_FOREACH(req, &bs->tracked_requests, list) {
-            if (tracked_request_overlaps(req, cluster_sector_num,
-                                         cluster_nb_sectors)) {
-                /* Hitting this means there was a reentrant request, for
-                 * example, a block driver issuing nested requests.  This must
-                 * never happen since it means deadlock.
-                 */
-                assert(qemu_coroutine_self() != req->co);
-
-                qemu_co_queue_wait(&req->wait_queue);
-                retry = true;
-                break;
-            }
+    /* The same goes for the blocks a read-modify-write rewrites */
+    align = bs->request_alignment >> BDRV_SECTOR_BITS;
+    if (align > 1) {
+        int64_t end = QEMU_ALIGN_UP(cluster_sector_num + cluster_nb_sectors,
+                                    align);
+
+        cluster_sector_num = QEMU_ALIGN_DOWN(cluster_sector_num, align);
+        cluster_nb_sectors = end - cluster_sector_num;
+    }
+
+    while ((node = interval_tree_iter_first(&bs->tracked_requests,
+                                            cluster_sector_num,
+                                            cluster_sector_num +
+                                            cluster_nb_sectors - 1))) {
+        req = container_of(node, BdrvTrackedRequest, node);
+
+        /* Hitting this means there was a reentrant request, for
+         * example, a block driver issuing nested requests.  This must
+         * never happen since it means deadlock.
+         */
+        assert(qemu_coroutine_self() != req->co);
+
+        if (!wait_start) {
+            wait_start = get_clock();
         }
-    } while (retry);
+        qemu_co_queue_wait(&req->wait_queue);
+    }
+
+    if (wait_start) {
+        bs->nr_serialized++;
+        bs->serialized_time_ns += get_clock() - wait_start;
+    }
 }
 
 /*
@@ -1971,6 +2248,7 @@ typedef struct RwCo {
     QEMUIOVector *qiov;
     bool is_write;
     int ret;
+    BdrvRequestFlags flags;
 } RwCo;
 
 static void coroutine_fn bdrv_rw_co_entry(void *opaque)
@@ -1979,10 +2257,12 @@ static void coroutine_fn bdrv_rw_co_entry(void *opaque)
 
     if (!rwco->is_write) {
         rwco->ret = bdrv_co_do_readv(rwco->bs, rwco->sector_num,
-                                     rwco->nb_sectors, rwco->qiov, 0);
+                                     rwco->nb_sectors, rwco->qiov,
+                                     rwco->flags);
     } else {
         rwco->ret = bdrv_co_do_writev(rwco->bs, rwco->sector_num,
-                                      rwco->nb_sectors, rwco->qiov, 0);
+                                      rwco->nb_sectors, rwco->qiov,
+                                      rwco->flags);
     }
 }
 
@@ -1990,7 +2270,7 @@ static void coroutine_fn bdrv_rw_co_entry(void *opaque)
  * Process a synchronous request using coroutines
  */
 static int bdrv_rw_co(BlockDriverState *bs, int64_t sector_num, uint8_t *buf,
-                      int nb_sectors, bool is_write)
+                      int nb_sectors, bool is_write, BdrvRequestFlags flags)
 {
     QEMUIOVector qiov;
     struct iovec iov = {
@@ -2005,6 +2285,7 @@ static int bdrv_rw_co(BlockDriverState *bs, int64_t sector_num, uint8_t *buf,
         .qiov = &qiov,
         .is_write = is_write,
         .ret = NOT_DONE,
+        .flags = flags,
     };
 
     qemu_iovec_init_external(&qiov, &iov, 1);
@@ -2027,7 +2308,7 @@ static int bdrv_rw_co(BlockDriverState *bs, int64_t sector_num, uint8_t *buf,
         co = qemu_coroutine_create(bdrv_rw_co_entry);
         qemu_coroutine_enter(co, &rwco);
         while (rwco.ret == NOT_DONE) {
-            qemu_aio_wait();
+            aio_poll(bdrv_get_aio_context(bs), true);
         }
     }
     return rwco.ret;
@@ -2037,7 +2318,7 @@ static int bdrv_rw_co(BlockDriverState *bs, int64_t sector_num, uint8_t *buf,
 int bdrv_read(BlockDriverState *bs, int64_t sector_num,
               uint8_t *buf, int nb_sectors)
 {
-    return bdrv_rw_co(bs, sector_num, buf, nb_sectors, false);
+    return bdrv_rw_co(bs, sector_num, buf, nb_sectors, false, 0);
 }
 
 /* Just like bdrv_read(), but with I/O throttling temporarily disabled */
@@ -2063,7 +2344,14 @@ int bdrv_read_unthrottled(BlockDriverState *bs, int64_t sector_num,
 int bdrv_write(BlockDriverState *bs, int64_t sector_num,
                const uint8_t *buf, int nb_sectors)
 {
-    return bdrv_rw_co(bs, sector_num, (uint8_t *)buf, nb_sectors, true);
+    return bdrv_rw_co(bs, sector_num, (uint8_t *)buf, nb_sectors, true, 0);
+}
+
+int bdrv_write_zeroes(BlockDriverState *bs, int64_t sector_num,
+                      int nb_sectors, BdrvRequestFlags flags)
+{
+    return bdrv_rw_co(bs, sector_num, NULL, nb_sectors, true,
+                      BDRV_REQ_ZERO_WRITE | flags);
 }
 
 int bdrv_pread(BlockDriverState *bs, int64_t offset,
@@ -2224,7 +2512,7 @@ static int coroutine_fn bdrv_co_do_copy_on_readv(BlockDriverState *bs,
     if (drv->bdrv_co_write_zeroes &&
         buffer_is_zero(bounce_buffer, iov.iov_len)) {
         ret = bdrv_co_do_write_zeroes(bs, cluster_sector_num,
-                                      cluster_nb_sectors);
+                                      cluster_nb_sectors, 0);
     } else {
         /* This does not change the data on the disk, it is not necessary
          * to flush even in cache=writethrough mode.
@@ -2253,6 +2541,145 @@ err:
 /*
  * Handle a read request in coroutine context
  */
+/*
+ * Pass a read or write to the driver, in pieces of at most
+ * bs->bl.max_transfer_length sectors
+ */
+static int coroutine_fn bdrv_co_driver_rw(BlockDriverState *bs,
+    int64_t sector_num, int nb_sectors, QEMUIOVector *qiov, bool is_write)
+{
+    BlockDriver *drv = bs->drv;
+    int max = bs->bl.max_transfer_length;
+    QEMUIOVector part;
+    size_t offset = 0;
+    int ret = 0;
+
+    if (max == 0 || nb_sectors <= max) {
+        return is_write ? drv->bdrv_co_writev(bs, sector_num, nb_sectors, qiov)
+                        : drv->bdrv_co_readv(bs, sector_num, nb_sectors, qiov);
+    }
+
+    qemu_iovec_init(&part, qiov->niov);
+    while (nb_sectors > 0 && ret >= 0) {
+        int n = MIN(nb_sectors, max);
+
+        qemu_iovec_reset(&part);
+        qemu_iovec_concat(&part, qiov, offset, n * BDRV_SECTOR_SIZE);
+        if (is_write) {
+            ret = drv->bdrv_co_writev(bs, sector_num, n, &part);
+        } else {
+            ret = drv->bdrv_co_readv(bs, sector_num, n, &part);
+        }
+        sector_num += n;
+        nb_sectors -= n;
+        offset += n * BDRV_SECTOR_SIZE;
+    }
+    qemu_iovec_destroy(&part);
+
+    return ret;
+}
+
+static bool bdrv_request_misaligned(BlockDriverState *bs, int64_t sector_num,
+                                    int nb_sectors)
+{
+    int align = bs->request_alignment >> BDRV_SECTOR_BITS;
+
+    return align > 1 && ((sector_num | nb_sectors) & (align - 1));
+}
+
+static int coroutine_fn bdrv_co_read_blocks(BlockDriverState *bs,
+    int64_t sector_num, int nb_sectors, void *buf)
+{
+    QEMUIOVector qiov;
+    struct iovec iov = {
+        .iov_base = buf,
+        .iov_len  = nb_sectors * BDRV_SECTOR_SIZE,
+    };
+
+    qemu_iovec_init_external(&qiov, &iov, 1);
+    return bdrv_co_driver_rw(bs, sector_num, nb_sectors, &qiov, false);
+}
+
+/*
+ * Like bdrv_co_driver_rw(), but the request may be misaligned for the
+ * driver: it is extended to whole blocks of bs->request_alignment, the
+ * sectors around the caller's going to or coming from a bounce buffer.
+ * A write first reads the blocks it covers only partly; the caller must
+ * keep overlapping requests out meanwhile.
+ */
+static int coroutine_fn bdrv_co_aligned_rw(BlockDriverState *bs,
+    int64_t sector_num, int nb_sectors, QEMUIOVector *qiov, bool is_write)
+{
+    int align = bs->request_alignment >> BDRV_SECTOR_BITS;
+    int64_t start = QEMU_ALIGN_DOWN(sector_num, align);
+    int head = sector_num - start;
+    int len = QEMU_ALIGN_UP(head + nb_sectors, align);
+    int tail = len - head - nb_sectors;
+    size_t block = align * BDRV_SECTOR_SIZE;
+    QEMUIOVector padded;
+    uint8_t *pad, *last;
+    int ret = 0;
+
+    if (!bdrv_request_misaligned(bs, sector_num, nb_sectors)) {
+        return bdrv_co_driver_rw(bs, sector_num, nb_sectors, qiov, is_write);
+    }
+
+    /* room for the first block the request touches, and the last one */
+    pad = qemu_blockalign(bs, 2 * block);
+    last = len > align ? pad + block : pad;
+
+    if (is_write) {
+        if (head) {
+            ret = bdrv_co_read_blocks(bs, start, align, pad);
+        }
+        /* unless it is the same block and has just been read */
+        if (ret >= 0 && tail && !(head && last == pad)) {
+            ret = bdrv_co_read_blocks(bs, start + len - align, align, last);
+        }
+        if (ret < 0) {
+            goto out;
+        }
+    }
+
+    qemu_iovec_init(&padded, qiov->niov + 2);
+    if (head) {
+        qemu_iovec_add(&padded, pad, head * BDRV_SECTOR_SIZE);
+    }
+    qemu_iovec_concat(&padded, qiov, 0, nb_sectors * BDRV_SECTOR_SIZE);
+    if (tail) {
+        qemu_iovec_add(&padded, last + (align - tail) * BDRV_SECTOR_SIZE,
+                       tail * BDRV_SECTOR_SIZE);
+    }
+    ret = bdrv_co_driver_rw(bs, start, len, &padded, is_write);
+    qemu_iovec_destroy(&padded);
+
+out:
+    qemu_vfree(pad);
+    return ret;
+}
+
+/*
+ * Length of the next piece of a discard or write zeroes request, split at
+ * @max sectors and, if the request is split anyway, ending on @align
+ */
+static int bdrv_split_length(int64_t sector_num, int nb_sectors,
+                             int max, int align)
+{
+    int num = nb_sectors;
+
+    if (max && num > max) {
+        num = max;
+    }
+    if (align && num < nb_sectors) {
+        int tail = (sector_num + num) % align;
+
+        if (tail < num) {
+            num -= tail;
+        }
+    }
+    return num;
+}
+
 static int coroutine_fn bdrv_co_do_readv(BlockDriverState *bs,
     int64_t sector_num, int nb_sectors, QEMUIOVector *qiov,
     BdrvRequestFlags flags)
@@ -2300,7 +2727,11 @@ static int coroutine_fn bdrv_co_do_readv(BlockDriverState *bs,
         }
     }
 
-    ret = drv->bdrv_co_readv(bs, sector_num, nb_sectors, qiov);
+    if (bs->shared_cache && bs->shared_cache_key && bs->read_only) {
+        ret = shared_cache_co_readv(bs, sector_num, nb_sectors, qiov);
+    } else {
+        ret = bdrv_co_aligned_rw(bs, sector_num, nb_sectors, qiov, false);
+    }
 
 out:
     tracked_request_end(&req);
@@ -2330,7 +2761,7 @@ int coroutine_fn bdrv_co_copy_on_readv(BlockDriverState *bs,
 }
 
 static int coroutine_fn bdrv_co_do_write_zeroes(BlockDriverState *bs,
-    int64_t sector_num, int nb_sectors)
+    int64_t sector_num, int nb_sectors, BdrvRequestFlags flags)
 {
     BlockDriver *drv = bs->drv;
     QEMUIOVector qiov;
@@ -2342,7 +2773,20 @@ static int coroutine_fn bdrv_co_do_write_zeroes(BlockDriverState *bs,
 
     /* First try the efficient write zeroes operation */
     if (drv->bdrv_co_write_zeroes) {
-        ret = drv->bdrv_co_write_zeroes(bs, sector_num, nb_sectors);
+        int64_t sector = sector_num;
+        int remaining = nb_sectors;
+
+        do {
+            int num = bdrv_split_length(sector, remaining,
+                                        bs->bl.max_write_zeroes,
+                                        bs->bl.write_zeroes_alignment);
+
+            ret = drv->bdrv_co_write_zeroes(bs, sector, num, flags);
+            sector += num;
+            remaining -= num;
+        } while (ret == 0 && remaining > 0);
+
+        /* Pieces that were written already are simply written again */
         if (ret != -ENOTSUP) {
             return ret;
         }
@@ -2354,7 +2798,7 @@ static int coroutine_fn bdrv_co_do_write_zeroes(BlockDriverState *bs,
     memset(iov.iov_base, 0, iov.iov_len);
     qemu_iovec_init_external(&qiov, &iov, 1);
 
-    ret = drv->bdrv_co_writev(bs, sector_num, nb_sectors, &qiov);
+    ret = bdrv_co_aligned_rw(bs, sector_num, nb_sectors, &qiov, true);
 
     qemu_vfree(iov.iov_base);
     return ret;
@@ -2367,8 +2811,10 @@ static int coroutine_fn bdrv_co_do_writev(BlockDriverState *bs,
     int64_t sector_num, int nb_sectors, QEMUIOVector *qiov,
     BdrvRequestFlags flags)
 {
-    BlockDriver *drv = bs->drv;
     BdrvTrackedRequest req;
+    BdrvWriteInterceptor *wi;
+    BdrvWriteOp wop;
+    bool rmw;
     int ret;
 
     if (!bs->drv) {
@@ -2386,24 +2832,48 @@ static int coroutine_fn bdrv_co_do_writev(BlockDriverState *bs,
         bdrv_io_limits_intercept(bs, true, nb_sectors);
     }
 
-    if (bs->copy_on_read_in_flight) {
+    /* A misaligned write rewrites the rest of the blocks it touches, so no
+     * overlapping write may start until it is done */
+    rmw = bdrv_request_misaligned(bs, sector_num, nb_sectors);
+    if (rmw) {
+        bs->serialising_in_flight++;
+    }
+
+    if (bs->copy_on_read_in_flight || bs->serialising_in_flight) {
         wait_for_overlapping_requests(bs, sector_num, nb_sectors);
     }
 
     tracked_request_begin(&req, bs, sector_num, nb_sectors, true);
 
+    /* The image no longer matches what its key stands for in the cache */
+    bs->shared_cache_key = 0;
+
+    wi = bs->write_interceptor;
+    if (wi) {
+        wop = (BdrvWriteOp) {
+            .sector_num = sector_num,
+            .nb_sectors = nb_sectors,
+            .qiov       = qiov,
+            .flags      = flags,
+        };
+        wi->before_write(wi, &wop);
+    }
+
     if (flags & BDRV_REQ_ZERO_WRITE) {
-        ret = bdrv_co_do_write_zeroes(bs, sector_num, nb_sectors);
+        ret = bdrv_co_do_write_zeroes(bs, sector_num, nb_sectors, flags);
     } else {
-        ret = drv->bdrv_co_writev(bs, sector_num, nb_sectors, qiov);
+        ret = bdrv_co_aligned_rw(bs, sector_num, nb_sectors, qiov, true);
     }
 
     if (ret == 0 && !bs->enable_write_cache) {
         ret = bdrv_co_flush(bs);
     }
 
-    if (bs->dirty_bitmap) {
-        bdrv_set_dirty(bs, sector_num, nb_sectors);
+    bdrv_mark_dirty(bs, sector_num, nb_sectors);
+
+    if (wi) {
+        wop.ret = ret;
+        wi->after_write(wi, &wop);
     }
 
     if (bs->wr_highest_sector < sector_num + nb_sectors - 1) {
@@ -2412,6 +2882,10 @@ static int coroutine_fn bdrv_co_do_writev(BlockDriverState *bs,
 
     tracked_request_end(&req);
 
+    if (rmw) {
+        bs->serialising_in_flight--;
+    }
+
     return ret;
 }
 
@@ -2424,12 +2898,13 @@ int coroutine_fn bdrv_co_writev(BlockDriverState *bs, int64_t sector_num,
 }
 
 int coroutine_fn bdrv_co_write_zeroes(BlockDriverState *bs,
-                                      int64_t sector_num, int nb_sectors)
+                                      int64_t sector_num, int nb_sectors,
+                                      BdrvRequestFlags flags)
 {
-    trace_bdrv_co_write_zeroes(bs, sector_num, nb_sectors);
+    trace_bdrv_co_write_zeroes(bs, sector_num, nb_sectors, flags);
 
     return bdrv_co_do_writev(bs, sector_num, nb_sectors, NULL,
-                             BDRV_REQ_ZERO_WRITE);
+                             BDRV_REQ_ZERO_WRITE | flags);
 }
 
 /**
@@ -2438,6 +2913,7 @@ int coroutine_fn bdrv_co_write_zeroes(BlockDriverState *bs,
 int bdrv_truncate(BlockDriverState *bs, int64_t offset)
 {
     BlockDriver *drv = bs->drv;
+    int64_t old_size;
     int ret;
     if (!drv)
         return -ENOMEDIUM;
@@ -2451,9 +2927,11 @@ int bdrv_truncate(BlockDriverState *bs, int64_t offset)
     /* There better not be any in-flight IOs when we truncate the device. */
     bdrv_drain_all();
 
+    old_size = bs->total_sectors;
     ret = drv->bdrv_truncate(bs, offset);
     if (ret == 0) {
         ret = refresh_total_sectors(bs, offset >> BDRV_SECTOR_BITS);
+        bdrv_resize_dirty_bitmaps(bs, old_size);
         bdrv_dev_resize_cb(bs);
     }
     return ret;
@@ -2507,12 +2985,15 @@ void bdrv_get_geometry(BlockDriverState *bs, uint64_t *nb_sectors_ptr)
     *nb_sectors_ptr = length;
 }
 
-/* throttling disk io limits */
-void bdrv_set_io_limits(BlockDriverState *bs,
-                        BlockIOLimit *io_limits)
+/* throttling disk io limits, shared by all drives of the throttle group */
+void bdrv_set_io_limits(BlockDriverState *bs, ThrottleConfig *cfg)
 {
-    bs->io_limits = *io_limits;
-    bs->io_limits_enabled = bdrv_io_limits_enabled(bs);
+    throttle_group_config(bs, cfg);
+}
+
+void bdrv_get_io_limits(BlockDriverState *bs, ThrottleConfig *cfg)
+{
+    throttle_group_get_config(bs, cfg);
 }
 
 void bdrv_set_on_error(BlockDriverState *bs, BlockdevOnError on_read_error,
@@ -2714,9 +3195,11 @@ typedef struct BdrvCoIsAllocatedData {
 } BdrvCoIsAllocatedData;
 
 /*
- * Returns true iff the specified sector is present in the disk image. Drivers
- * not implementing the functionality are assumed to not support backing files,
- * hence all their sectors are reported as allocated.
+ * Returns the allocation status of the specified sectors, a combination of
+ * the BDRV_BLOCK_* flags and, with BDRV_BLOCK_OFFSET_VALID, of the offset
+ * where they are stored in bs->file.  Drivers not implementing the
+ * functionality are assumed to not support backing files, hence all their
+ * sectors are reported as allocated data.
  *
  * If 'sector_num' is beyond the end of the disk image the return value is 0
  * and 'pnum' is set to 0.
@@ -2728,10 +3211,11 @@ typedef struct BdrvCoIsAllocatedData {
  * 'nb_sectors' is the max value 'pnum' should be set to.  If nb_sectors goes
  * beyond the end of the disk image it will be clamped.
  */
-int coroutine_fn bdrv_co_is_allocated(BlockDriverState *bs, int64_t sector_num,
-                                      int nb_sectors, int *pnum)
+int64_t coroutine_fn bdrv_co_get_block_status(BlockDriverState *bs,
+                                              int64_t sector_num,
+                                              int nb_sectors, int *pnum)
 {
-    int64_t n;
+    int64_t n, ret;
 
     if (sector_num >= bs->total_sectors) {
         *pnum = 0;
@@ -2743,12 +3227,107 @@ int coroutine_fn bdrv_co_is_allocated(BlockDriverState *bs, int64_t sector_num,
         nb_sectors = n;
     }
 
-    if (!bs->drv->bdrv_co_is_allocated) {
+    if (bs->drv->bdrv_co_get_block_status) {
+        ret = bs->drv->bdrv_co_get_block_status(bs, sector_num, nb_sectors,
+                                                pnum);
+    } else if (bs->drv->bdrv_co_is_allocated) {
+        ret = bs->drv->bdrv_co_is_allocated(bs, sector_num, nb_sectors, pnum);
+        if (ret > 0) {
+            ret = BDRV_BLOCK_DATA;
+        }
+    } else {
         *pnum = nb_sectors;
-        return 1;
+        ret = BDRV_BLOCK_DATA;
+        if (bs->drv->protocol_name) {
+            ret |= BDRV_BLOCK_OFFSET_VALID | (sector_num << BDRV_SECTOR_BITS);
+        }
+    }
+    if (ret < 0) {
+        *pnum = 0;
+        return ret;
+    }
+
+    if (ret & BDRV_BLOCK_RAW) {
+        /* The driver passes the request through to bs->file */
+        assert(ret & BDRV_BLOCK_OFFSET_VALID);
+        return bdrv_co_get_block_status(bs->file, ret >> BDRV_SECTOR_BITS,
+                                        *pnum, pnum);
+    }
+
+    if (ret & (BDRV_BLOCK_DATA | BDRV_BLOCK_ZERO)) {
+        ret |= BDRV_BLOCK_ALLOCATED;
+    } else if (!bs->backing_hd && bdrv_has_zero_init(bs)) {
+        /* Unallocated sectors of an image without backing file read as
+         * zeroes; they are still left unallocated */
+        ret |= BDRV_BLOCK_ZERO;
+    }
+    return ret;
+}
+
+typedef struct BdrvCoGetBlockStatusData {
+    BlockDriverState *bs;
+    int64_t sector_num;
+    int nb_sectors;
+    int *pnum;
+    int64_t ret;
+    bool done;
+} BdrvCoGetBlockStatusData;
+
+/* Coroutine wrapper for bdrv_get_block_status() */
+static void coroutine_fn bdrv_get_block_status_co_entry(void *opaque)
+{
+    BdrvCoGetBlockStatusData *data = opaque;
+
+    data->ret = bdrv_co_get_block_status(data->bs, data->sector_num,
+                                         data->nb_sectors, data->pnum);
+    data->done = true;
+}
+
+/*
+ * Synchronous wrapper around bdrv_co_get_block_status().
+ *
+ * See bdrv_co_get_block_status() for details.
+ */
+int64_t bdrv_get_block_status(BlockDriverState *bs, int64_t sector_num,
+                              int nb_sectors, int *pnum)
+{
+    Coroutine *co;
+    BdrvCoGetBlockStatusData data = {
+        .bs = bs,
+        .sector_num = sector_num,
+        .nb_sectors = nb_sectors,
+        .pnum = pnum,
+        .done = false,
+    };
+
+    if (qemu_in_coroutine()) {
+        /* Fast-path if already in coroutine context */
+        bdrv_get_block_status_co_entry(&data);
+        return data.ret;
+    }
+
+    co = qemu_coroutine_create(bdrv_get_block_status_co_entry);
+    qemu_coroutine_enter(co, &data);
+    while (!data.done) {
+        aio_poll(bdrv_get_aio_context(bs), true);
     }
+    return data.ret;
+}
 
-    return bs->drv->bdrv_co_is_allocated(bs, sector_num, nb_sectors, pnum);
+/*
+ * Returns true iff the specified sector is present in the disk image, that
+ * is if it is not read from the backing file.  See bdrv_co_get_block_status()
+ * for the other arguments.
+ */
+int coroutine_fn bdrv_co_is_allocated(BlockDriverState *bs, int64_t sector_num,
+                                      int nb_sectors, int *pnum)
+{
+    int64_t ret = bdrv_co_get_block_status(bs, sector_num, nb_sectors, pnum);
+
+    if (ret < 0) {
+        return ret;
+    }
+    return !!(ret & BDRV_BLOCK_ALLOCATED);
 }
 
 /* Coroutine wrapper for bdrv_is_allocated() */
@@ -2782,7 +3361,7 @@ int bdrv_is_allocated(BlockDriverState *bs, int64_t sector_num, int nb_sectors,
     co = qemu_coroutine_create(bdrv_is_allocated_co_entry);
     qemu_coroutine_enter(co, &data);
     while (!data.done) {
-        qemu_aio_wait();
+        aio_poll(bdrv_get_aio_context(bs), true);
     }
     return data.ret;
 }
@@ -2838,6 +3417,49 @@ int coroutine_fn bdrv_co_is_allocated_above(BlockDriverState *top,
     return 0;
 }
 
+/*
+ * Like bdrv_co_get_block_status(), but for the image chain from TOP down to
+ * BASE (exclusive).  The status of the first image that has the sectors
+ * allocated is returned; if they are not allocated anywhere above BASE, the
+ * return value is 0.  BASE can be NULL to query the whole chain.
+ *
+ * 'pnum' is set as in bdrv_co_is_allocated_above().
+ */
+int64_t coroutine_fn bdrv_co_get_block_status_above(BlockDriverState *top,
+                                                    BlockDriverState *base,
+                                                    int64_t sector_num,
+                                                    int nb_sectors, int *pnum)
+{
+    BlockDriverState *intermediate;
+    int64_t ret;
+    int n = nb_sectors;
+
+    intermediate = top;
+    while (intermediate && intermediate != base) {
+        int pnum_inter;
+        ret = bdrv_co_get_block_status(intermediate, sector_num, nb_sectors,
+                                       &pnum_inter);
+        if (ret < 0) {
+            *pnum = 0;
+            return ret;
+        } else if (ret & BDRV_BLOCK_ALLOCATED) {
+            *pnum = MIN(n, pnum_inter);
+            return ret;
+        }
+
+        if (n > pnum_inter &&
+            (intermediate == top ||
+             sector_num + pnum_inter < intermediate->total_sectors)) {
+            n = pnum_inter;
+        }
+
+        intermediate = intermediate->backing_hd;
+    }
+
+    *pnum = n;
+    return 0;
+}
+
 /* Coroutine wrapper for bdrv_is_allocated_above() */
 static void coroutine_fn bdrv_is_allocated_above_co_entry(void *opaque)
 {
@@ -2871,7 +3493,7 @@ int bdrv_is_allocated_above(BlockDriverState *top, BlockDriverState *base,
     co = qemu_coroutine_create(bdrv_is_allocated_above_co_entry);
     qemu_coroutine_enter(co, &data);
     while (!data.done) {
-        qemu_aio_wait();
+        aio_poll(bdrv_get_aio_context(top), true);
     }
     return data.ret;
 }
@@ -2902,6 +3524,29 @@ BlockInfo *bdrv_query_info(BlockDriverState *bs)
             ((int64_t) BDRV_SECTOR_SIZE << hbitmap_granularity(bs->dirty_bitmap));
     }
 
+    if (!QLIST_EMPTY(&bs->dirty_bitmaps)) {
+        BlockDirtyInfoList **p_next = &info->dirty_bitmaps;
+        BdrvDirtyBitmap *bitmap;
+
+        info->has_dirty_bitmaps = true;
+        QLIST_FOREACH(bitmap, &bs->dirty_bitmaps, list) {
+            BlockDirtyInfoList *entry = g_malloc0(sizeof(*entry));
+            BlockDirtyInfo *dirty = g_malloc0(sizeof(*dirty));
+
+            dirty->count = hbitmap_count(bitmap->bitmap) * BDRV_SECTOR_SIZE;
+            dirty->granularity = (int64_t) BDRV_SECTOR_SIZE <<
+                                 hbitmap_granularity(bitmap->bitmap);
+            dirty->has_name = true;
+            dirty->name = g_strdup(bitmap->name);
+            dirty->has_persistent = true;
+            dirty->persistent = bitmap->persistent;
+
+            entry->value = dirty;
+            *p_next = entry;
+            p_next = &entry->next;
+        }
+    }
+
     if (bs->drv) {
         info->has_inserted = true;
         info->inserted = g_malloc0(sizeof(*info->inserted));
@@ -2919,18 +3564,34 @@ BlockInfo *bdrv_query_info(BlockDriverState *bs)
         info->inserted->backing_file_depth = bdrv_get_backing_file_depth(bs);
 
         if (bs->io_limits_enabled) {
-            info->inserted->bps =
-                           bs->io_limits.bps[BLOCK_IO_LIMIT_TOTAL];
-            info->inserted->bps_rd =
-                           bs->io_limits.bps[BLOCK_IO_LIMIT_READ];
-            info->inserted->bps_wr =
-                           bs->io_limits.bps[BLOCK_IO_LIMIT_WRITE];
-            info->inserted->iops =
-                           bs->io_limits.iops[BLOCK_IO_LIMIT_TOTAL];
-            info->inserted->iops_rd =
-                           bs->io_limits.iops[BLOCK_IO_LIMIT_READ];
-            info->inserted->iops_wr =
-                           bs->io_limits.iops[BLOCK_IO_LIMIT_WRITE];
+            ThrottleConfig cfg;
+            LeakyBucket *b = cfg.buckets;
+            BlockDeviceInfo *inserted = info->inserted;
+
+            bdrv_get_io_limits(bs, &cfg);
+            inserted->bps     = b[THROTTLE_BPS_TOTAL].avg;
+            inserted->bps_rd  = b[THROTTLE_BPS_READ].avg;
+            inserted->bps_wr  = b[THROTTLE_BPS_WRITE].avg;
+            inserted->iops    = b[THROTTLE_OPS_TOTAL].avg;
+            inserted->iops_rd = b[THROTTLE_OPS_READ].avg;
+            inserted->iops_wr = b[THROTTLE_OPS_WRITE].avg;
+
+            inserted->has_bps_max     = true;
+            inserted->bps_max         = b[THROTTLE_BPS_TOTAL].max;
+            inserted->has_bps_rd_max  = true;
+            inserted->bps_rd_max      = b[THROTTLE_BPS_READ].max;
+            inserted->has_bps_wr_max  = true;
+            inserted->bps_wr_max      = b[THROTTLE_BPS_WRITE].max;
+            inserted->has_iops_max    = true;
+            inserted->iops_max        = b[THROTTLE_OPS_TOTAL].max;
+            inserted->has_iops_rd_max = true;
+            inserted->iops_rd_max     = b[THROTTLE_OPS_READ].max;
+            inserted->has_iops_wr_max = true;
+            inserted->iops_wr_max     = b[THROTTLE_OPS_WRITE].max;
+            inserted->has_iops_size   = true;
+            inserted->iops_size       = cfg.op_size;
+            inserted->has_group       = true;
+            inserted->group           = g_strdup(throttle_group_get_name(bs));
         }
     }
     return info;
@@ -2973,6 +3634,32 @@ BlockStats *bdrv_query_stats(const BlockDriverState *bs)
     s->stats->wr_total_time_ns = bs->total_time_ns[BDRV_ACCT_WRITE];
     s->stats->rd_total_time_ns = bs->total_time_ns[BDRV_ACCT_READ];
     s->stats->flush_total_time_ns = bs->total_time_ns[BDRV_ACCT_FLUSH];
+    s->stats->serialized_operations = bs->nr_serialized;
+    s->stats->serialized_total_time_ns = bs->serialized_time_ns;
+    s->stats->rd_merged = bs->nr_merged[BDRV_ACCT_READ];
+    s->stats->wr_merged = bs->nr_merged[BDRV_ACCT_WRITE];
+    s->stats->in_flight = bs->acct_in_flight;
+
+    if (bs->latency_histogram[BDRV_ACCT_READ].bins) {
+        s->stats->has_rd_latency_histogram = true;
+        s->stats->rd_latency_histogram =
+            block_histogram_query(&bs->latency_histogram[BDRV_ACCT_READ]);
+    }
+    if (bs->latency_histogram[BDRV_ACCT_WRITE].bins) {
+        s->stats->has_wr_latency_histogram = true;
+        s->stats->wr_latency_histogram =
+            block_histogram_query(&bs->latency_histogram[BDRV_ACCT_WRITE]);
+    }
+    if (bs->latency_histogram[BDRV_ACCT_FLUSH].bins) {
+        s->stats->has_flush_latency_histogram = true;
+        s->stats->flush_latency_histogram =
+            block_histogram_query(&bs->latency_histogram[BDRV_ACCT_FLUSH]);
+    }
+    if (bs->queue_depth_histogram.bins) {
+        s->stats->has_queue_depth_histogram = true;
+        s->stats->queue_depth_histogram =
+            block_histogram_query(&bs->queue_depth_histogram);
+    }
 
     if (bs->file) {
         s->has_parent = true;
@@ -3014,20 +3701,84 @@ void bdrv_get_backing_filename(BlockDriverState *bs,
     pstrcpy(filename, filename_size, bs->backing_file);
 }
 
-int bdrv_write_compressed(BlockDriverState *bs, int64_t sector_num,
-                          const uint8_t *buf, int nb_sectors)
+bool bdrv_can_write_compressed(BlockDriver *drv)
+{
+    return drv->bdrv_write_compressed || drv->bdrv_co_write_compressed;
+}
+
+/*
+ * Write one compressed cluster.  A request with nb_sectors == 0 marks the
+ * end of a series of compressed writes.
+ */
+int coroutine_fn bdrv_co_write_compressed(BlockDriverState *bs,
+                                          int64_t sector_num, int nb_sectors,
+                                          QEMUIOVector *qiov)
 {
     BlockDriver *drv = bs->drv;
+    uint8_t *buf;
+    int ret;
+
     if (!drv)
         return -ENOMEDIUM;
-    if (!drv->bdrv_write_compressed)
+    if (!bdrv_can_write_compressed(drv))
         return -ENOTSUP;
     if (bdrv_check_request(bs, sector_num, nb_sectors))
         return -EIO;
 
     assert(!bs->dirty_bitmap);
+    bdrv_mark_named_dirty(bs, sector_num, nb_sectors);
 
-    return drv->bdrv_write_compressed(bs, sector_num, buf, nb_sectors);
+    if (drv->bdrv_co_write_compressed) {
+        return drv->bdrv_co_write_compressed(bs, sector_num, nb_sectors, qiov);
+    }
+
+    if (!nb_sectors) {
+        return drv->bdrv_write_compressed(bs, sector_num, NULL, 0);
+    }
+    buf = qemu_blockalign(bs, qiov->size);
+    qemu_iovec_to_buf(qiov, 0, buf, qiov->size);
+    ret = drv->bdrv_write_compressed(bs, sector_num, buf, nb_sectors);
+    qemu_vfree(buf);
+    return ret;
+}
+
+static void coroutine_fn bdrv_write_compressed_co_entry(void *opaque)
+{
+    RwCo *rwco = opaque;
+
+    rwco->ret = bdrv_co_write_compressed(rwco->bs, rwco->sector_num,
+                                         rwco->nb_sectors, rwco->qiov);
+}
+
+int bdrv_write_compressed(BlockDriverState *bs, int64_t sector_num,
+                          const uint8_t *buf, int nb_sectors)
+{
+    QEMUIOVector qiov;
+    struct iovec iov = {
+        .iov_base = (void *)buf,
+        .iov_len = nb_sectors * BDRV_SECTOR_SIZE,
+    };
+    Coroutine *co;
+    RwCo rwco = {
+        .bs = bs,
+        .sector_num = sector_num,
+        .nb_sectors = nb_sectors,
+        .qiov = &qiov,
+        .ret = NOT_DONE,
+    };
+
+    qemu_iovec_init_external(&qiov, &iov, 1);
+
+    if (qemu_in_coroutine()) {
+        bdrv_write_compressed_co_entry(&rwco);
+    } else {
+        co = qemu_coroutine_create(bdrv_write_compressed_co_entry);
+        qemu_coroutine_enter(co, &rwco);
+        while (rwco.ret == NOT_DONE) {
+            aio_poll(bdrv_get_aio_context(bs), true);
+        }
+    }
+    return rwco.ret;
 }
 
 int bdrv_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
@@ -3182,6 +3933,10 @@ int bdrv_snapshot_goto(BlockDriverState *bs,
 
     if (!drv)
         return -ENOMEDIUM;
+
+    /* the whole image may change, whether or not the switch succeeds */
+    bdrv_mark_named_dirty(bs, 0, bs->total_sectors);
+
     if (drv->bdrv_snapshot_goto)
         return drv->bdrv_snapshot_goto(bs, snapshot_id);
 
@@ -3402,14 +4157,280 @@ char *bdrv_snapshot_dump(char *buf, int buf_size, QEMUSnapshotInfo *sn)
 /**************************************************************/
 /* async I/Os */
 
+/**************************************************************/
+/* request merging */
+
+/*
+ * Device models submit their requests one by one.  When merging is enabled
+ * for a BlockDriverState, AIO reads and writes are queued instead and a
+ * bottom half submits them once the current main loop iteration is done,
+ * after combining requests that are adjacent on disk into one, so that the
+ * format and protocol drivers see fewer, larger requests.  If a merged
+ * request fails, its parts are retried one by one so that each request
+ * completes with its own status.
+ */
+
+struct BdrvMergeAIOCB {
+    BlockDriverAIOCB common;
+    int64_t sector_num;
+    int nb_sectors;
+    QEMUIOVector *qiov;
+    bool is_write;
+    bool queued;
+    unsigned int seq;           /* submission order, keeps sorting stable */
+    bool completed;
+    bool cancelling;            /* bdrv_aio_merge_cancel() releases it */
+    BdrvMergeAIOCB *group_next; /* next request merged with this one */
+    QSIMPLEQ_ENTRY(BdrvMergeAIOCB) next;
+};
+
+typedef struct BdrvMergeGroup {
+    BdrvMergeAIOCB *reqs;
+    QEMUIOVector qiov;
+    bool own_qiov;
+} BdrvMergeGroup;
+
+static void bdrv_aio_merge_cancel(BlockDriverAIOCB *blockacb)
+{
+    BdrvMergeAIOCB *acb = container_of(blockacb, BdrvMergeAIOCB, common);
+
+    if (acb->queued) {
+        QSIMPLEQ_REMOVE(&acb->common.bs->merge_queue, acb, BdrvMergeAIOCB,
+                        next);
+        qemu_aio_release(acb);
+        return;
+    }
+
+    /* already submitted, possibly together with other requests */
+    acb->cancelling = true;
+    while (!acb->completed) {
+        aio_poll(bdrv_get_aio_context(acb->common.bs), true);
+    }
+    qemu_aio_release(acb);
+}
+
+static const AIOCBInfo bdrv_merge_aiocb_info = {
+    .aiocb_size         = sizeof(BdrvMergeAIOCB),
+    .cancel             = bdrv_aio_merge_cancel,
+};
+
+static void bdrv_merge_complete(BdrvMergeAIOCB *acb, int ret)
+{
+    acb->common.cb(acb->common.opaque, ret);
+    acb->completed = true;
+    if (!acb->cancelling) {
+        qemu_aio_release(acb);
+    }
+}
+
+static void bdrv_merge_retry_cb(void *opaque, int ret)
+{
+    bdrv_merge_complete(opaque, ret);
+}
+
+static void bdrv_merge_group_cb(void *opaque, int ret)
+{
+    BdrvMergeGroup *group = opaque;
+    BdrvMergeAIOCB *acb, *next;
+
+    for (acb = group->reqs; acb; acb = next) {
+        next = acb->group_next;
+        if (ret < 0 && group->own_qiov) {
+            /* The error may concern only some of the merged requests; find
+             * out which by submitting each of them on its own */
+            bdrv_co_aio_rw_vector(acb->common.bs, acb->sector_num, acb->qiov,
+                                  acb->nb_sectors, bdrv_merge_retry_cb, acb,
+                                  0, acb->is_write);
+        } else {
+            bdrv_merge_complete(acb, ret);
+        }
+    }
+
+    if (group->own_qiov) {
+        qemu_iovec_destroy(&group->qiov);
+    }
+    g_free(group);
+}
+
+static int bdrv_merge_req_compare(const void *a, const void *b)
+{
+    const BdrvMergeAIOCB *req1 = *(BdrvMergeAIOCB * const *)a;
+    const BdrvMergeAIOCB *req2 = *(BdrvMergeAIOCB * const *)b;
+
+    if (req1->is_write != req2->is_write) {
+        return req1->is_write ? 1 : -1;
+    }
+    if (req1->sector_num != req2->sector_num) {
+        return req1->sector_num < req2->sector_num ? -1 : 1;
+    }
+    return req1->seq < req2->seq ? -1 : 1;
+}
+
+static void bdrv_merge_submit_group(BlockDriverState *bs,
+                                    BdrvMergeAIOCB **reqs, int n,
+                                    int niov)
+{
+    BdrvMergeGroup *group = g_malloc0(sizeof(*group));
+    QEMUIOVector *qiov;
+    int nb_sectors = 0;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        reqs[i]->group_next = i + 1 < n ? reqs[i + 1] : NULL;
+        nb_sectors += reqs[i]->nb_sectors;
+    }
+    group->reqs = reqs[0];
+
+    if (n == 1) {
+        qiov = reqs[0]->qiov;
+    } else {
+        qemu_iovec_init(&group->qiov, niov);
+        for (i = 0; i < n; i++) {
+            qemu_iovec_concat(&group->qiov, reqs[i]->qiov, 0,
+                              reqs[i]->nb_sectors << BDRV_SECTOR_BITS);
+        }
+        group->own_qiov = true;
+        qiov = &group->qiov;
+        bs->nr_merged[reqs[0]->is_write ? BDRV_ACCT_WRITE : BDRV_ACCT_READ] +=
+            n - 1;
+    }
+
+    trace_bdrv_merge_submit(bs, reqs[0]->sector_num, nb_sectors, n,
+                            reqs[0]->is_write);
+    bdrv_co_aio_rw_vector(bs, reqs[0]->sector_num, qiov, nb_sectors,
+                          bdrv_merge_group_cb, group, 0, reqs[0]->is_write);
+}
+
+static void bdrv_merge_flush(BlockDriverState *bs)
+{
+    BdrvMergeAIOCB **reqs, *acb;
+    int n = 0, start, i, niov, nb_sectors;
+
+    QSIMPLEQ_FOREACH(acb, &bs->merge_queue, next) {
+        n++;
+    }
+    if (n == 0) {
+        return;
+    }
+
+    reqs = g_malloc(n * sizeof(*reqs));
+    for (i = 0; i < n; i++) {
+        acb = QSIMPLEQ_FIRST(&bs->merge_queue);
+        QSIMPLEQ_REMOVE_HEAD(&bs->merge_queue, next);
+        acb->queued = false;
+        reqs[i] = acb;
+    }
+
+    /* reads first, then writes, each sorted by start sector */
+    qsort(reqs, n, sizeof(*reqs), bdrv_merge_req_compare);
+
+    start = 0;
+    niov = reqs[0]->qiov->niov;
+    nb_sectors = reqs[0]->nb_sectors;
+    for (i = 1; i <= n; i++) {
+        if (i < n &&
+            reqs[i]->is_write == reqs[start]->is_write &&
+            reqs[i]->sector_num ==
+                reqs[i - 1]->sector_num + reqs[i - 1]->nb_sectors &&
+            nb_sectors + reqs[i]->nb_sectors <= bs->merge_max_sectors &&
+            niov + reqs[i]->qiov->niov <= bs->merge_max_segments) {
+            niov += reqs[i]->qiov->niov;
+            nb_sectors += reqs[i]->nb_sectors;
+            continue;
+        }
+
+        bdrv_merge_submit_group(bs, &reqs[start], i - start, niov);
+
+        if (i < n) {
+            start = i;
+            niov = reqs[i]->qiov->niov;
+            nb_sectors = reqs[i]->nb_sectors;
+        }
+    }
+
+    g_free(reqs);
+}
+
+static void bdrv_merge_bh(void *opaque)
+{
+    bdrv_merge_flush(opaque);
+}
+
+static BlockDriverAIOCB *bdrv_merge_queue_req(BlockDriverState *bs,
+                                              int64_t sector_num,
+                                              QEMUIOVector *qiov,
+                                              int nb_sectors,
+                                              BlockDriverCompletionFunc *cb,
+                                              void *opaque,
+                                              bool is_write)
+{
+    BdrvMergeAIOCB *acb;
+
+    acb = qemu_aio_get(&bdrv_merge_aiocb_info, bs, cb, opaque);
+    acb->sector_num = sector_num;
+    acb->nb_sectors = nb_sectors;
+    acb->qiov = qiov;
+    acb->is_write = is_write;
+    acb->queued = true;
+    acb->seq = bs->merge_seq++;
+    acb->completed = false;
+    acb->cancelling = false;
+    acb->group_next = NULL;
+
+    QSIMPLEQ_INSERT_TAIL(&bs->merge_queue, acb, next);
+    qemu_bh_schedule(bs->merge_bh);
+
+    return &acb->common;
+}
+
+static bool bdrv_merge_wanted(BlockDriverState *bs, int64_t sector_num,
+                              int nb_sectors)
+{
+    /* requests that will fail anyway must not take others down with them,
+     * and requests too large to merge just go through */
+    return bs->merge_requests &&
+           nb_sectors > 0 && nb_sectors < bs->merge_max_sectors &&
+           !bdrv_check_request(bs, sector_num, nb_sectors);
+}
+
+/**
+ * Enable or disable merging of adjacent AIO requests
+ *
+ * Merged requests are at most @max_sectors long and have at most
+ * @max_segments iovec elements.
+ */
+void bdrv_set_request_merging(BlockDriverState *bs, bool enable,
+                              int max_sectors, int max_segments)
+{
+    if (enable) {
+        if (!bs->merge_bh) {
+            QSIMPLEQ_INIT(&bs->merge_queue);
+            bs->merge_bh = aio_bh_new(bdrv_get_aio_context(bs),
+                                      bdrv_merge_bh, bs);
+        }
+        bs->merge_max_sectors = max_sectors;
+        bs->merge_max_segments = MIN(max_segments, IOV_MAX);
+    } else if (bs->merge_bh) {
+        bdrv_merge_flush(bs);
+        qemu_bh_delete(bs->merge_bh);
+        bs->merge_bh = NULL;
+    }
+    bs->merge_requests = enable;
+}
+
 BlockDriverAIOCB *bdrv_aio_readv(BlockDriverState *bs, int64_t sector_num,
                                  QEMUIOVector *qiov, int nb_sectors,
                                  BlockDriverCompletionFunc *cb, void *opaque)
 {
     trace_bdrv_aio_readv(bs, sector_num, nb_sectors, opaque);
 
+    if (bdrv_merge_wanted(bs, sector_num, nb_sectors)) {
+        return bdrv_merge_queue_req(bs, sector_num, qiov, nb_sectors,
+                                    cb, opaque, false);
+    }
+
     return bdrv_co_aio_rw_vector(bs, sector_num, qiov, nb_sectors,
-                                 cb, opaque, false);
+                                 cb, opaque, 0, false);
 }
 
 BlockDriverAIOCB *bdrv_aio_writev(BlockDriverState *bs, int64_t sector_num,
@@ -3418,8 +4439,24 @@ BlockDriverAIOCB *bdrv_aio_writev(BlockDriverState *bs, int64_t sector_num,
 {
     trace_bdrv_aio_writev(bs, sector_num, nb_sectors, opaque);
 
+    if (bdrv_merge_wanted(bs, sector_num, nb_sectors)) {
+        return bdrv_merge_queue_req(bs, sector_num, qiov, nb_sectors,
+                                    cb, opaque, true);
+    }
+
     return bdrv_co_aio_rw_vector(bs, sector_num, qiov, nb_sectors,
-                                 cb, opaque, true);
+                                 cb, opaque, 0, true);
+}
+
+BlockDriverAIOCB *bdrv_aio_write_zeroes(BlockDriverState *bs,
+        int64_t sector_num, int nb_sectors, BdrvRequestFlags flags,
+        BlockDriverCompletionFunc *cb, void *opaque)
+{
+    trace_bdrv_aio_write_zeroes(bs, sector_num, nb_sectors, flags, opaque);
+
+    return bdrv_co_aio_rw_vector(bs, sector_num, NULL, nb_sectors,
+                                 cb, opaque, BDRV_REQ_ZERO_WRITE | flags,
+                                 true);
 }
 
 
@@ -3538,6 +4575,7 @@ static int multiwrite_merge(BlockDriverState *bs, BlockRequest *reqs,
         }
     }
 
+    bs->nr_merged[BDRV_ACCT_WRITE] += num_reqs - (outidx + 1);
     return outidx + 1;
 }
 
@@ -3602,169 +4640,26 @@ void bdrv_aio_cancel(BlockDriverAIOCB *acb)
     acb->aiocb_info->cancel(acb);
 }
 
-/* block I/O throttling */
-static bool bdrv_exceed_bps_limits(BlockDriverState *bs, int nb_sectors,
-                 bool is_write, double elapsed_time, uint64_t *wait)
-{
-    uint64_t bps_limit = 0;
-    double   bytes_limit, bytes_base, bytes_res;
-    double   slice_time, wait_time;
-
-    if (bs->io_limits.bps[BLOCK_IO_LIMIT_TOTAL]) {
-        bps_limit = bs->io_limits.bps[BLOCK_IO_LIMIT_TOTAL];
-    } else if (bs->io_limits.bps[is_write]) {
-        bps_limit = bs->io_limits.bps[is_write];
-    } else {
-        if (wait) {
-            *wait = 0;
-        }
-
-        return false;
-    }
-
-    slice_time = bs->slice_end - bs->slice_start;
-    slice_time /= (NANOSECONDS_PER_SECOND);
-    bytes_limit = bps_limit * slice_time;
-    bytes_base  = bs->nr_bytes[is_write] - bs->io_base.bytes[is_write];
-    if (bs->io_limits.bps[BLOCK_IO_LIMIT_TOTAL]) {
-        bytes_base += bs->nr_bytes[!is_write] - bs->io_base.bytes[!is_write];
-    }
-
-    /* bytes_base: the bytes of data which have been read/written; and
-     *             it is obtained from the history statistic info.
-     * bytes_res: the remaining bytes of data which need to be read/written.
-     * (bytes_base + bytes_res) / bps_limit: used to calcuate
-     *             the total time for completing reading/writting all data.
-     */
-    bytes_res   = (unsigned) nb_sectors * BDRV_SECTOR_SIZE;
-
-    if (bytes_base + bytes_res <= bytes_limit) {
-        if (wait) {
-            *wait = 0;
-        }
-
-        return false;
-    }
-
-    /* Calc approx time to dispatch */
-    wait_time = (bytes_base + bytes_res) / bps_limit - elapsed_time;
-
-    /* When the I/O rate at runtime exceeds the limits,
-     * bs->slice_end need to be extended in order that the current statistic
-     * info can be kept until the timer fire, so it is increased and tuned
-     * based on the result of experiment.
-     */
-    bs->slice_time = wait_time * BLOCK_IO_SLICE_TIME * 10;
-    bs->slice_end += bs->slice_time - 3 * BLOCK_IO_SLICE_TIME;
-    if (wait) {
-        *wait = wait_time * BLOCK_IO_SLICE_TIME * 10;
-    }
-
-    return true;
-}
-
-static bool bdrv_exceed_iops_limits(BlockDriverState *bs, bool is_write,
-                             double elapsed_time, uint64_t *wait)
+void bdrv_io_plug(BlockDriverState *bs)
 {
-    uint64_t iops_limit = 0;
-    double   ios_limit, ios_base;
-    double   slice_time, wait_time;
-
-    if (bs->io_limits.iops[BLOCK_IO_LIMIT_TOTAL]) {
-        iops_limit = bs->io_limits.iops[BLOCK_IO_LIMIT_TOTAL];
-    } else if (bs->io_limits.iops[is_write]) {
-        iops_limit = bs->io_limits.iops[is_write];
-    } else {
-        if (wait) {
-            *wait = 0;
-        }
-
-        return false;
-    }
-
-    slice_time = bs->slice_end - bs->slice_start;
-    slice_time /= (NANOSECONDS_PER_SECOND);
-    ios_limit  = iops_limit * slice_time;
-    ios_base   = bs->nr_ops[is_write] - bs->io_base.ios[is_write];
-    if (bs->io_limits.iops[BLOCK_IO_LIMIT_TOTAL]) {
-        ios_base += bs->nr_ops[!is_write] - bs->io_base.ios[!is_write];
-    }
-
-    if (ios_base + 1 <= ios_limit) {
-        if (wait) {
-            *wait = 0;
-        }
-
-        return false;
-    }
-
-    /* Calc approx time to dispatch */
-    wait_time = (ios_base + 1) / iops_limit;
-    if (wait_time > elapsed_time) {
-        wait_time = wait_time - elapsed_time;
-    } else {
-        wait_time = 0;
-    }
+    BlockDriver *drv = bs->drv;
 
-    bs->slice_time = wait_time * BLOCK_IO_SLICE_TIME * 10;
-    bs->slice_end += bs->slice_time - 3 * BLOCK_IO_SLICE_TIME;
-    if (wait) {
-        *wait = wait_time * BLOCK_IO_SLICE_TIME * 10;
+    if (drv && drv->bdrv_io_plug) {
+        drv->bdrv_io_plug(bs);
+    } else if (bs->file) {
+        bdrv_io_plug(bs->file);
     }
-
-    return true;
 }
 
-static bool bdrv_exceed_io_limits(BlockDriverState *bs, int nb_sectors,
-                           bool is_write, int64_t *wait)
+void bdrv_io_unplug(BlockDriverState *bs)
 {
-    int64_t  now, max_wait;
-    uint64_t bps_wait = 0, iops_wait = 0;
-    double   elapsed_time;
-    int      bps_ret, iops_ret;
-
-    now = qemu_get_clock_ns(vm_clock);
-    if ((bs->slice_start < now)
-        && (bs->slice_end > now)) {
-        bs->slice_end = now + bs->slice_time;
-    } else {
-        bs->slice_time  =  5 * BLOCK_IO_SLICE_TIME;
-        bs->slice_start = now;
-        bs->slice_end   = now + bs->slice_time;
-
-        bs->io_base.bytes[is_write]  = bs->nr_bytes[is_write];
-        bs->io_base.bytes[!is_write] = bs->nr_bytes[!is_write];
-
-        bs->io_base.ios[is_write]    = bs->nr_ops[is_write];
-        bs->io_base.ios[!is_write]   = bs->nr_ops[!is_write];
-    }
-
-    elapsed_time  = now - bs->slice_start;
-    elapsed_time  /= (NANOSECONDS_PER_SECOND);
-
-    bps_ret  = bdrv_exceed_bps_limits(bs, nb_sectors,
-                                      is_write, elapsed_time, &bps_wait);
-    iops_ret = bdrv_exceed_iops_limits(bs, is_write,
-                                      elapsed_time, &iops_wait);
-    if (bps_ret || iops_ret) {
-        max_wait = bps_wait > iops_wait ? bps_wait : iops_wait;
-        if (wait) {
-            *wait = max_wait;
-        }
-
-        now = qemu_get_clock_ns(vm_clock);
-        if (bs->slice_end < now + max_wait) {
-            bs->slice_end = now + max_wait;
-        }
-
-        return true;
-    }
+    BlockDriver *drv = bs->drv;
 
-    if (wait) {
-        *wait = 0;
+    if (drv && drv->bdrv_io_unplug) {
+        drv->bdrv_io_unplug(bs);
+    } else if (bs->file) {
+        bdrv_io_unplug(bs->file);
     }
-
-    return false;
 }
 
 /**************************************************************/
@@ -3822,7 +4717,7 @@ static BlockDriverAIOCB *bdrv_aio_rw_vector(BlockDriverState *bs,
     acb->is_write = is_write;
     acb->qiov = qiov;
     acb->bounce = qemu_blockalign(bs, qiov->size);
-    acb->bh = qemu_bh_new(bdrv_aio_bh_cb, acb);
+    acb->bh = aio_bh_new(bdrv_get_aio_context(bs), bdrv_aio_bh_cb, acb);
 
     if (is_write) {
         qemu_iovec_to_buf(acb->qiov, 0, acb->bounce, qiov->size);
@@ -3855,6 +4750,7 @@ typedef struct BlockDriverAIOCBCoroutine {
     BlockDriverAIOCB common;
     BlockRequest req;
     bool is_write;
+    BdrvRequestFlags flags;
     bool *done;
     QEMUBH* bh;
 } BlockDriverAIOCBCoroutine;
@@ -3867,7 +4763,7 @@ static void bdrv_aio_co_cancel_em(BlockDriverAIOCB *blockacb)
 
     acb->done = &done;
     while (!done) {
-        qemu_aio_wait();
+        aio_poll(bdrv_get_aio_context(blockacb->bs), true);
     }
 }
 
@@ -3898,13 +4794,13 @@ static void coroutine_fn bdrv_co_do_rw(void *opaque)
 
     if (!acb->is_write) {
         acb->req.error = bdrv_co_do_readv(bs, acb->req.sector,
-            acb->req.nb_sectors, acb->req.qiov, 0);
+            acb->req.nb_sectors, acb->req.qiov, acb->flags);
     } else {
         acb->req.error = bdrv_co_do_writev(bs, acb->req.sector,
-            acb->req.nb_sectors, acb->req.qiov, 0);
+            acb->req.nb_sectors, acb->req.qiov, acb->flags);
     }
 
-    acb->bh = qemu_bh_new(bdrv_co_em_bh, acb);
+    acb->bh = aio_bh_new(bdrv_get_aio_context(bs), bdrv_co_em_bh, acb);
     qemu_bh_schedule(acb->bh);
 }
 
@@ -3914,6 +4810,7 @@ static BlockDriverAIOCB *bdrv_co_aio_rw_vector(BlockDriverState *bs,
                                                int nb_sectors,
                                                BlockDriverCompletionFunc *cb,
                                                void *opaque,
+                                               BdrvRequestFlags flags,
                                                bool is_write)
 {
     Coroutine *co;
@@ -3924,6 +4821,7 @@ static BlockDriverAIOCB *bdrv_co_aio_rw_vector(BlockDriverState *bs,
     acb->req.nb_sectors = nb_sectors;
     acb->req.qiov = qiov;
     acb->is_write = is_write;
+    acb->flags = flags;
     acb->done = NULL;
 
     co = qemu_coroutine_create(bdrv_co_do_rw);
@@ -3938,7 +4836,7 @@ static void coroutine_fn bdrv_aio_flush_co_entry(void *opaque)
     BlockDriverState *bs = acb->common.bs;
 
     acb->req.error = bdrv_co_flush(bs);
-    acb->bh = qemu_bh_new(bdrv_co_em_bh, acb);
+    acb->bh = aio_bh_new(bdrv_get_aio_context(bs), bdrv_co_em_bh, acb);
     qemu_bh_schedule(acb->bh);
 }
 
@@ -3965,7 +4863,7 @@ static void coroutine_fn bdrv_aio_discard_co_entry(void *opaque)
     BlockDriverState *bs = acb->common.bs;
 
     acb->req.error = bdrv_co_discard(bs, acb->req.sector, acb->req.nb_sectors);
-    acb->bh = qemu_bh_new(bdrv_co_em_bh, acb);
+    acb->bh = aio_bh_new(bdrv_get_aio_context(bs), bdrv_co_em_bh, acb);
     qemu_bh_schedule(acb->bh);
 }
 
@@ -3988,6 +4886,39 @@ BlockDriverAIOCB *bdrv_aio_discard(BlockDriverState *bs,
     return &acb->common;
 }
 
+static void coroutine_fn bdrv_aio_write_compressed_co_entry(void *opaque)
+{
+    BlockDriverAIOCBCoroutine *acb = opaque;
+    BlockDriverState *bs = acb->common.bs;
+
+    acb->req.error = bdrv_co_write_compressed(bs, acb->req.sector,
+                                              acb->req.nb_sectors,
+                                              acb->req.qiov);
+    acb->bh = aio_bh_new(bdrv_get_aio_context(bs), bdrv_co_em_bh, acb);
+    qemu_bh_schedule(acb->bh);
+}
+
+/* Submitting several requests lets the driver compress them in parallel */
+BlockDriverAIOCB *bdrv_aio_write_compressed(BlockDriverState *bs,
+                                            int64_t sector_num,
+                                            QEMUIOVector *qiov, int nb_sectors,
+                                            BlockDriverCompletionFunc *cb,
+                                            void *opaque)
+{
+    Coroutine *co;
+    BlockDriverAIOCBCoroutine *acb;
+
+    acb = qemu_aio_get(&bdrv_em_co_aiocb_info, bs, cb, opaque);
+    acb->req.sector = sector_num;
+    acb->req.nb_sectors = nb_sectors;
+    acb->req.qiov = qiov;
+    acb->done = NULL;
+    co = qemu_coroutine_create(bdrv_aio_write_compressed_co_entry);
+    qemu_coroutine_enter(co, acb);
+
+    return &acb->common;
+}
+
 void bdrv_init(void)
 {
     module_call_init(MODULE_INIT_BLOCK);
@@ -4182,7 +5113,7 @@ int bdrv_flush(BlockDriverState *bs)
         co = qemu_coroutine_create(bdrv_flush_co_entry);
         qemu_coroutine_enter(co, &rwco);
         while (rwco.ret == NOT_DONE) {
-            qemu_aio_wait();
+            aio_poll(bdrv_get_aio_context(bs), true);
         }
     }
 
@@ -4210,31 +5141,49 @@ int coroutine_fn bdrv_co_discard(BlockDriverState *bs, int64_t sector_num,
     if (bs->dirty_bitmap) {
         bdrv_reset_dirty(bs, sector_num, nb_sectors);
     }
+    /* the contents change, so the named bitmaps must copy them again */
+    bdrv_mark_named_dirty(bs, sector_num, nb_sectors);
 
-    /* Do nothing if disabled.  */
-    if (!(bs->open_flags & BDRV_O_UNMAP)) {
+    /* Do nothing if disabled.  Write interceptors only see writes, so keep
+     * the old contents while one is installed.  */
+    if (!(bs->open_flags & BDRV_O_UNMAP) || bs->write_interceptor) {
         return 0;
     }
 
-    if (bs->drv->bdrv_co_discard) {
-        return bs->drv->bdrv_co_discard(bs, sector_num, nb_sectors);
-    } else if (bs->drv->bdrv_aio_discard) {
-        BlockDriverAIOCB *acb;
-        CoroutineIOCompletion co = {
-            .coroutine = qemu_coroutine_self(),
-        };
+    if (!bs->drv->bdrv_co_discard && !bs->drv->bdrv_aio_discard) {
+        return 0;
+    }
 
-        acb = bs->drv->bdrv_aio_discard(bs, sector_num, nb_sectors,
-                                        bdrv_co_io_em_complete, &co);
-        if (acb == NULL) {
-            return -EIO;
+    while (nb_sectors > 0) {
+        int ret;
+        int num = bdrv_split_length(sector_num, nb_sectors,
+                                    bs->bl.max_discard,
+                                    bs->bl.discard_alignment);
+
+        if (bs->drv->bdrv_co_discard) {
+            ret = bs->drv->bdrv_co_discard(bs, sector_num, num);
         } else {
+            BlockDriverAIOCB *acb;
+            CoroutineIOCompletion co = {
+                .coroutine = qemu_coroutine_self(),
+            };
+
+            acb = bs->drv->bdrv_aio_discard(bs, sector_num, num,
+                                            bdrv_co_io_em_complete, &co);
+            if (acb == NULL) {
+                return -EIO;
+            }
             qemu_coroutine_yield();
-            return co.ret;
+            ret = co.ret;
         }
-    } else {
-        return 0;
+        if (ret < 0) {
+            return ret;
+        }
+
+        sector_num += num;
+        nb_sectors -= num;
     }
+    return 0;
 }
 
 int bdrv_discard(BlockDriverState *bs, int64_t sector_num, int nb_sectors)
@@ -4254,7 +5203,7 @@ int bdrv_discard(BlockDriverState *bs, int64_t sector_num, int nb_sectors)
         co = qemu_coroutine_create(bdrv_discard_co_entry);
         qemu_coroutine_enter(co, &rwco);
         while (rwco.ret == NOT_DONE) {
-            qemu_aio_wait();
+            aio_poll(bdrv_get_aio_context(bs), true);
         }
     }
 
@@ -4350,9 +5299,28 @@ void bdrv_set_buffer_alignment(BlockDriverState *bs, int align)
     bs->buffer_alignment = align;
 }
 
+/* The largest request alignment of @bs and of the protocol under it;
+ * requests aligned to it reach the storage without read-modify-write */
+int bdrv_get_request_alignment(BlockDriverState *bs)
+{
+    int align = bs->request_alignment;
+
+    if (bs->file) {
+        align = MAX(align, bdrv_get_request_alignment(bs->file));
+    }
+    return align;
+}
+
+/* O_DIRECT wants the buffers aligned like the requests */
+static int bdrv_mem_alignment(BlockDriverState *bs)
+{
+    return MAX(bs->buffer_alignment ? bs->buffer_alignment : 512,
+               bs->request_alignment);
+}
+
 void *qemu_blockalign(BlockDriverState *bs, size_t size)
 {
-    return qemu_memalign((bs && bs->buffer_alignment) ? bs->buffer_alignment : 512, size);
+    return qemu_memalign(bs ? bdrv_mem_alignment(bs) : 512, size);
 }
 
 /*
@@ -4360,10 +5328,12 @@ void *qemu_blockalign(BlockDriverState *bs, size_t size)
  */
 bool bdrv_qiov_is_aligned(BlockDriverState *bs, QEMUIOVector *qiov)
 {
+    int align = bdrv_mem_alignment(bs);
     int i;
 
     for (i = 0; i < qiov->niov; i++) {
-        if ((uintptr_t) qiov->iov[i].iov_base % bs->buffer_alignment) {
+        if ((uintptr_t) qiov->iov[i].iov_base % align ||
+            qiov->iov[i].iov_len % bs->request_alignment) {
             return false;
         }
     }
@@ -4404,6 +5374,25 @@ void bdrv_dirty_iter_init(BlockDriverState *bs, HBitmapIter *hbi)
     hbitmap_iter_init(hbi, bs->dirty_bitmap, 0);
 }
 
+/* Return the first dirty sector at or after @sector, or -1 if none */
+int64_t bdrv_get_next_dirty(BlockDriverState *bs, int64_t sector)
+{
+    HBitmapIter hbi;
+
+    if (!bs->dirty_bitmap) {
+        return -1;
+    }
+    hbitmap_iter_init(&hbi, bs->dirty_bitmap, sector);
+    return hbitmap_iter_next(&hbi);
+}
+
+void bdrv_set_write_interceptor(BlockDriverState *bs,
+                                BdrvWriteInterceptor *wi)
+{
+    assert(!wi || !bs->write_interceptor);
+    bs->write_interceptor = wi;
+}
+
 void bdrv_set_dirty(BlockDriverState *bs, int64_t cur_sector,
                     int nr_sectors)
 {
@@ -4425,6 +5414,142 @@ int64_t bdrv_get_dirty_count(BlockDriverState *bs)
     }
 }
 
+BdrvDirtyBitmap *bdrv_find_dirty_bitmap(BlockDriverState *bs,
+                                        const char *name)
+{
+    BdrvDirtyBitmap *bitmap;
+
+    QLIST_FOREACH(bitmap, &bs->dirty_bitmaps, list) {
+        if (!strcmp(bitmap->name, name)) {
+            return bitmap;
+        }
+    }
+    return NULL;
+}
+
+/* @granularity is in bytes and must be a power of two of at least
+ * BDRV_SECTOR_SIZE */
+BdrvDirtyBitmap *bdrv_create_dirty_bitmap(BlockDriverState *bs,
+                                          const char *name,
+                                          int64_t granularity,
+                                          Error **errp)
+{
+    BdrvDirtyBitmap *bitmap;
+    int64_t length;
+
+    if (granularity < BDRV_SECTOR_SIZE ||
+        (granularity & (granularity - 1)) != 0) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "granularity",
+                  "a power of 2 of at least 512");
+        return NULL;
+    }
+    if (bdrv_find_dirty_bitmap(bs, name)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "name",
+                  "a name that is not used by another bitmap");
+        return NULL;
+    }
+
+    length = bdrv_getlength(bs);
+    if (length < 0) {
+        error_set(errp, QERR_IO_ERROR);
+        return NULL;
+    }
+
+    bitmap = g_malloc0(sizeof(*bitmap));
+    bitmap->name = g_strdup(name);
+    bitmap->bitmap = hbitmap_alloc(DIV_ROUND_UP(length, BDRV_SECTOR_SIZE),
+                                   ffs(granularity >> BDRV_SECTOR_BITS) - 1);
+    QLIST_INSERT_HEAD(&bs->dirty_bitmaps, bitmap, list);
+    return bitmap;
+}
+
+void bdrv_release_dirty_bitmap(BlockDriverState *bs, BdrvDirtyBitmap *bitmap)
+{
+    assert(!bitmap->busy);
+    QLIST_REMOVE(bitmap, list);
+    hbitmap_free(bitmap->bitmap);
+    g_free(bitmap->name);
+    g_free(bitmap);
+}
+
+static void bdrv_release_all_dirty_bitmaps(BlockDriverState *bs)
+{
+    BdrvDirtyBitmap *bitmap, *next;
+
+    QLIST_FOREACH_SAFE(bitmap, &bs->dirty_bitmaps, list, next) {
+        bitmap->busy = false;
+        bdrv_release_dirty_bitmap(bs, bitmap);
+    }
+}
+
+void bdrv_clear_dirty_bitmap(BlockDriverState *bs, BdrvDirtyBitmap *bitmap)
+{
+    if (bs->total_sectors) {
+        hbitmap_reset(bitmap->bitmap, 0, bs->total_sectors);
+    }
+}
+
+void bdrv_dirty_bitmap_set(BdrvDirtyBitmap *bitmap, int64_t cur_sector,
+                           int nr_sectors)
+{
+    hbitmap_set(bitmap->bitmap, cur_sector, nr_sectors);
+}
+
+void bdrv_dirty_bitmap_reset(BdrvDirtyBitmap *bitmap, int64_t cur_sector,
+                             int nr_sectors)
+{
+    hbitmap_reset(bitmap->bitmap, cur_sector, nr_sectors);
+}
+
+static void bdrv_mark_named_dirty(BlockDriverState *bs, int64_t cur_sector,
+                                  int64_t nr_sectors)
+{
+    BdrvDirtyBitmap *bitmap;
+
+    if (nr_sectors <= 0) {
+        return;
+    }
+    QLIST_FOREACH(bitmap, &bs->dirty_bitmaps, list) {
+        hbitmap_set(bitmap->bitmap, cur_sector, nr_sectors);
+    }
+}
+
+static void bdrv_mark_dirty(BlockDriverState *bs, int64_t cur_sector,
+                            int nr_sectors)
+{
+    if (bs->dirty_bitmap) {
+        bdrv_set_dirty(bs, cur_sector, nr_sectors);
+    }
+    bdrv_mark_named_dirty(bs, cur_sector, nr_sectors);
+}
+
+/* Give the named bitmaps the new size of the device; the sectors that
+ * were added count as dirty */
+static void bdrv_resize_dirty_bitmaps(BlockDriverState *bs, int64_t old_size)
+{
+    BdrvDirtyBitmap *bitmap;
+    HBitmap *old;
+    HBitmapIter hbi;
+    int64_t sector;
+
+    QLIST_FOREACH(bitmap, &bs->dirty_bitmaps, list) {
+        old = bitmap->bitmap;
+        bitmap->bitmap = hbitmap_alloc(bs->total_sectors,
+                                       hbitmap_granularity(old));
+
+        hbitmap_iter_init(&hbi, old, 0);
+        while ((sector = hbitmap_iter_next(&hbi)) >= 0 &&
+               sector < bs->total_sectors) {
+            hbitmap_set(bitmap->bitmap, sector, 1);
+        }
+        if (old_size < bs->total_sectors) {
+            hbitmap_set(bitmap->bitmap, old_size,
+                        bs->total_sectors - old_size);
+        }
+        hbitmap_free(old);
+    }
+}
+
 void bdrv_set_in_use(BlockDriverState *bs, int in_use)
 {
     assert(bs->in_use != in_use);
@@ -4476,6 +5601,108 @@ void bdrv_iostatus_set_err(BlockDriverState *bs, int error)
     }
 }
 
+/* 1-2-5 steps from 10us to 10s */
+static const uint64_t bdrv_latency_default_boundaries[] = {
+    10000ULL, 20000ULL, 50000ULL,
+    100000ULL, 200000ULL, 500000ULL,
+    1000000ULL, 2000000ULL, 5000000ULL,
+    10000000ULL, 20000000ULL, 50000000ULL,
+    100000000ULL, 200000000ULL, 500000000ULL,
+    1000000000ULL, 2000000000ULL, 5000000000ULL,
+    10000000000ULL,
+};
+
+static const uint64_t bdrv_queue_depth_boundaries[] = {
+    2, 4, 8, 16, 32, 64, 128, 256,
+};
+
+static void block_histogram_set(BlockHistogram *hist,
+                                const uint64_t *boundaries, int nb_boundaries)
+{
+    g_free(hist->boundaries);
+    g_free(hist->bins);
+
+    hist->nb_bins = nb_boundaries + 1;
+    hist->boundaries = g_malloc(nb_boundaries * sizeof(*boundaries));
+    memcpy(hist->boundaries, boundaries, nb_boundaries * sizeof(*boundaries));
+    hist->bins = g_malloc0(hist->nb_bins * sizeof(*hist->bins));
+}
+
+static void block_histogram_free(BlockHistogram *hist)
+{
+    g_free(hist->boundaries);
+    g_free(hist->bins);
+    memset(hist, 0, sizeof(*hist));
+}
+
+static void block_histogram_account(BlockHistogram *hist, uint64_t value)
+{
+    int lo = 0, hi = hist->nb_bins - 1;
+
+    /* find the first boundary above value */
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+
+        if (value < hist->boundaries[mid]) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    hist->bins[lo]++;
+}
+
+static BlockHistogramBinList *block_histogram_query(const BlockHistogram *hist)
+{
+    BlockHistogramBinList *head = NULL, **p_next = &head;
+    int i;
+
+    for (i = 0; i < hist->nb_bins; i++) {
+        BlockHistogramBinList *bin = g_malloc0(sizeof(*bin));
+
+        bin->value = g_malloc0(sizeof(*bin->value));
+        bin->value->start = i ? hist->boundaries[i - 1] : 0;
+        bin->value->count = hist->bins[i];
+
+        *p_next = bin;
+        p_next = &bin->next;
+    }
+
+    return head;
+}
+
+/**
+ * Set the latency histogram boundaries for one type of request, in ns.
+ * The counts start again from zero.  Passing NULL restores the default
+ * log-scale boundaries.
+ */
+void bdrv_set_latency_histogram(BlockDriverState *bs, enum BlockAcctType type,
+                                const uint64_t *boundaries, int nb_boundaries)
+{
+    assert(type < BDRV_MAX_IOTYPE);
+
+    if (!boundaries) {
+        boundaries = bdrv_latency_default_boundaries;
+        nb_boundaries = ARRAY_SIZE(bdrv_latency_default_boundaries);
+    }
+    block_histogram_set(&bs->latency_histogram[type], boundaries,
+                        nb_boundaries);
+}
+
+void bdrv_reset_latency_histograms(BlockDriverState *bs)
+{
+    BlockHistogram *hist;
+    int i;
+
+    for (i = 0; i <= BDRV_MAX_IOTYPE; i++) {
+        hist = i < BDRV_MAX_IOTYPE ? &bs->latency_histogram[i]
+                                   : &bs->queue_depth_histogram;
+        if (hist->bins) {
+            memset(hist->bins, 0, hist->nb_bins * sizeof(*hist->bins));
+        }
+    }
+}
+
 void
 bdrv_acct_start(BlockDriverState *bs, BlockAcctCookie *cookie, int64_t bytes,
         enum BlockAcctType type)
@@ -4485,16 +5712,36 @@ bdrv_acct_start(BlockDriverState *bs, BlockAcctCookie *cookie, int64_t bytes,
     cookie->bytes = bytes;
     cookie->start_time_ns = get_clock();
     cookie->type = type;
+
+    if (!bs->queue_depth_histogram.bins) {
+        block_histogram_set(&bs->queue_depth_histogram,
+                            bdrv_queue_depth_boundaries,
+                            ARRAY_SIZE(bdrv_queue_depth_boundaries));
+    }
+    block_histogram_account(&bs->queue_depth_histogram, ++bs->acct_in_flight);
 }
 
 void
 bdrv_acct_done(BlockDriverState *bs, BlockAcctCookie *cookie)
 {
+    BlockHistogram *hist = &bs->latency_histogram[cookie->type];
+    int64_t latency_ns;
+
     assert(cookie->type < BDRV_MAX_IOTYPE);
 
+    latency_ns = get_clock() - cookie->start_time_ns;
     bs->nr_bytes[cookie->type] += cookie->bytes;
     bs->nr_ops[cookie->type]++;
-    bs->total_time_ns[cookie->type] += get_clock() - cookie->start_time_ns;
+    bs->total_time_ns[cookie->type] += latency_ns;
+
+    if (!hist->bins) {
+        bdrv_set_latency_histogram(bs, cookie->type, NULL, 0);
+    }
+    block_histogram_account(hist, latency_ns);
+
+    if (bs->acct_in_flight) {
+        bs->acct_in_flight--;
+    }
 }
 
 void bdrv_img_create(const char *filename, const char *fmt,
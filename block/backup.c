@@ -0,0 +1,391 @@
+/*
+ * Point-in-time backup with copy-before-write
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "trace.h"
+#include "block/block_int.h"
+#include "block/blockjob.h"
+#include "qemu/host-utils.h"
+
+enum {
+    /* Maximum length of a run of dirty sectors copied in one request */
+    BACKUP_BUFFER_SIZE = 1024 * 1024, /* in bytes */
+
+    /* Unit of copy-before-write for a full backup */
+    BACKUP_CLUSTER_SIZE = 64 * 1024, /* in bytes */
+};
+
+typedef struct BackupBlockJob {
+    BlockJob common;
+    BlockDriverState *target;
+    BdrvDirtyBitmap *bitmap;    /* NULL for a full backup */
+    int64_t end;
+    int64_t granularity;        /* in sectors */
+
+    /* the granules that still have to be copied to the target */
+    HBitmap *copy;
+    /* the granules that were copied, dirty again if the job fails */
+    HBitmap *copied;
+    /* the granules being copied, by the job or before a guest write */
+    HBitmap *in_flight;
+    CoQueue in_flight_queue;
+
+    BdrvWriteInterceptor write_interceptor;
+    int active_writes;
+    /* Only guest writes may resume the job while this is set */
+    bool waiting_for_io;
+    /* first copy-before-write error; the backup cannot be completed */
+    int cow_ret;
+
+    BlockdevOnError on_source_error, on_target_error;
+} BackupBlockJob;
+
+static BlockErrorAction backup_error_action(BackupBlockJob *s, bool read,
+                                            int error)
+{
+    if (read) {
+        return block_job_error_action(&s->common, s->common.bs,
+                                      s->on_source_error, true, error);
+    } else {
+        return block_job_error_action(&s->common, s->target,
+                                      s->on_target_error, false, error);
+    }
+}
+
+/* Return the number of sectors starting at @sector_num, which is the first
+ * sector of a granule that is still to be copied, that are also still to be
+ * copied; at most @max and never beyond @end */
+static int backup_copy_run(BackupBlockJob *s, int64_t sector_num,
+                           int64_t end, int64_t max)
+{
+    int64_t n = s->granularity;
+
+    while (n + s->granularity <= max && sector_num + n < end &&
+           hbitmap_get(s->copy, sector_num + n)) {
+        n += s->granularity;
+    }
+    return MIN(n, end - sector_num);
+}
+
+static int coroutine_fn backup_copy(BackupBlockJob *s, int64_t sector_num,
+                                    int nb_sectors, bool *read)
+{
+    QEMUIOVector qiov;
+    struct iovec iov;
+    int ret;
+
+    iov.iov_len = nb_sectors * BDRV_SECTOR_SIZE;
+    iov.iov_base = qemu_blockalign(s->common.bs, iov.iov_len);
+    qemu_iovec_init_external(&qiov, &iov, 1);
+
+    *read = true;
+    ret = bdrv_co_readv(s->common.bs, sector_num, nb_sectors, &qiov);
+    if (ret >= 0) {
+        *read = false;
+        if (buffer_is_zero(iov.iov_base, iov.iov_len)) {
+            ret = bdrv_co_write_zeroes(s->target, sector_num, nb_sectors, 0);
+        } else {
+            ret = bdrv_co_writev(s->target, sector_num, nb_sectors, &qiov);
+        }
+    }
+
+    qemu_vfree(iov.iov_base);
+    return ret;
+}
+
+/* Copy the granules covering [@sector_num, @sector_num + @nb_sectors) that
+ * have not reached the target yet.  This is called both by the job and
+ * before guest writes; the granules are locked in s->in_flight meanwhile, so
+ * that guest writes cannot change them before they are copied. */
+static int coroutine_fn backup_do_cow(BackupBlockJob *s, int64_t sector_num,
+                                      int nb_sectors, bool *read)
+{
+    int64_t start, end, sector;
+    int ret = 0;
+    int n;
+
+    start = QEMU_ALIGN_DOWN(sector_num, s->granularity);
+    end = MIN(QEMU_ALIGN_UP(sector_num + nb_sectors, s->granularity), s->end);
+    *read = false;
+
+retry:
+    for (sector = start; sector < end; sector += s->granularity) {
+        if (hbitmap_get(s->in_flight, sector)) {
+            qemu_co_queue_wait(&s->in_flight_queue);
+            goto retry;
+        }
+    }
+    hbitmap_set(s->in_flight, start, end - start);
+
+    for (sector = start; sector < end; sector += n) {
+        if (!hbitmap_get(s->copy, sector)) {
+            n = s->granularity;
+            continue;
+        }
+
+        n = backup_copy_run(s, sector, end, BACKUP_BUFFER_SIZE >>
+                                            BDRV_SECTOR_BITS);
+        trace_backup_do_cow(s, sector, n);
+        hbitmap_reset(s->copy, sector, n);
+        ret = backup_copy(s, sector, n, read);
+        if (ret < 0) {
+            /* the sectors were not copied, whatever the action */
+            hbitmap_set(s->copy, sector, n);
+            break;
+        }
+        hbitmap_set(s->copied, sector, n);
+
+        /* Publish progress */
+        s->common.offset += n * BDRV_SECTOR_SIZE;
+        s->common.len = MAX(s->common.len, s->common.offset);
+    }
+
+    hbitmap_reset(s->in_flight, start, end - start);
+    qemu_co_queue_restart_all(&s->in_flight_queue);
+    return ret;
+}
+
+static void coroutine_fn backup_before_write(BdrvWriteInterceptor *wi,
+                                             BdrvWriteOp *op)
+{
+    BackupBlockJob *s = container_of(wi, BackupBlockJob, write_interceptor);
+    bool read;
+    int ret;
+
+    s->active_writes++;
+    if (op->nb_sectors == 0 || s->cow_ret < 0) {
+        return;
+    }
+
+    ret = backup_do_cow(s, op->sector_num, op->nb_sectors, &read);
+    if (ret < 0) {
+        /* The guest write cannot wait for the error to be fixed, so the
+         * old data is lost for the backup and the job fails */
+        bdrv_emit_qmp_error_event(s->common.bs, QEVENT_BLOCK_JOB_ERROR,
+                                  BDRV_ACTION_REPORT, read);
+        s->cow_ret = ret;
+    }
+}
+
+static void coroutine_fn backup_after_write(BdrvWriteInterceptor *wi,
+                                            BdrvWriteOp *op)
+{
+    BackupBlockJob *s = container_of(wi, BackupBlockJob, write_interceptor);
+
+    s->active_writes--;
+    if (s->waiting_for_io) {
+        qemu_coroutine_enter(s->common.co, NULL);
+    }
+}
+
+static void coroutine_fn backup_wait_for_io(BackupBlockJob *s)
+{
+    assert(!s->waiting_for_io);
+    s->waiting_for_io = true;
+    qemu_coroutine_yield();
+    s->waiting_for_io = false;
+}
+
+static void coroutine_fn backup_run(void *opaque)
+{
+    BackupBlockJob *s = opaque;
+    BlockDriverState *bs = s->common.bs;
+    HBitmapIter hbi;
+    uint64_t delay_ns = 0;
+    int64_t sector_num = 0, end;
+    int granularity_bits;
+    int error = 0;
+    int ret = 0;
+    bool read;
+    int n;
+
+    end = bdrv_getlength(bs);
+    if (end < 0) {
+        ret = end;
+        goto out;
+    }
+    end >>= BDRV_SECTOR_BITS;
+    s->end = end;
+
+    /* Take the snapshot: from here on, the old contents of every granule
+     * in s->copy reach the target before a guest write overwrites them.
+     * Nothing yields until the write interceptor is installed. */
+    if (s->bitmap) {
+        HBitmap *dirty = s->bitmap->bitmap;
+        int64_t sector;
+
+        granularity_bits = hbitmap_granularity(dirty);
+        s->copy = hbitmap_alloc(end, granularity_bits);
+        hbitmap_iter_init(&hbi, dirty, 0);
+        while ((sector = hbitmap_iter_next(&hbi)) >= 0) {
+            hbitmap_set(s->copy, sector, 1);
+        }
+
+        /* writes from now on go in the next backup */
+        hbitmap_reset(dirty, 0, end);
+    } else {
+        granularity_bits = ctz32(BACKUP_CLUSTER_SIZE >> BDRV_SECTOR_BITS);
+        s->copy = hbitmap_alloc(end, granularity_bits);
+        hbitmap_set(s->copy, 0, end);
+    }
+    s->granularity = 1LL << granularity_bits;
+    s->copied = hbitmap_alloc(end, granularity_bits);
+    s->in_flight = hbitmap_alloc(end, granularity_bits);
+    qemu_co_queue_init(&s->in_flight_queue);
+    s->common.len = hbitmap_count(s->copy) * BDRV_SECTOR_SIZE;
+
+    s->write_interceptor.before_write = backup_before_write;
+    s->write_interceptor.after_write = backup_after_write;
+    bdrv_set_write_interceptor(bs, &s->write_interceptor);
+
+    /* A single pass over the snapshot; granules that a guest write copied
+     * first are skipped. */
+    for (;;) {
+        /* Note that even when no rate limit is applied we need to yield
+         * with no pending I/O here so that bdrv_drain_all() returns.
+         */
+        block_job_sleep_ns(&s->common, rt_clock, delay_ns);
+        delay_ns = 0;
+        if (block_job_is_cancelled(&s->common) || s->cow_ret < 0) {
+            break;
+        }
+
+        if (sector_num >= end) {
+            break;
+        }
+        hbitmap_iter_init(&hbi, s->copy, sector_num);
+        sector_num = hbitmap_iter_next(&hbi);
+        if (sector_num < 0 || sector_num >= end) {
+            break;
+        }
+
+        n = backup_copy_run(s, sector_num, end,
+                            BACKUP_BUFFER_SIZE >> BDRV_SECTOR_BITS);
+        delay_ns = block_job_throttle(&s->common, n);
+        if (delay_ns > 0) {
+            continue;
+        }
+        trace_backup_one_iteration(s, sector_num, n);
+
+        ret = backup_do_cow(s, sector_num, n, &read);
+        if (ret < 0) {
+            BlockErrorAction action = backup_error_action(s, read, -ret);
+
+            if (action == BDRV_ACTION_STOP) {
+                continue;
+            }
+            if (error == 0) {
+                error = ret;
+            }
+            if (action == BDRV_ACTION_REPORT) {
+                break;
+            }
+        }
+        sector_num += n;
+    }
+
+    bdrv_set_write_interceptor(bs, NULL);
+    while (s->active_writes > 0) {
+        backup_wait_for_io(s);
+    }
+
+    if (error == 0) {
+        error = s->cow_ret;
+    }
+    if (error == 0) {
+        error = bdrv_co_flush(s->target);
+    }
+    if (s->bitmap && (error < 0 || block_job_is_cancelled(&s->common))) {
+        HBitmap *dirty = s->bitmap->bitmap;
+        int64_t sector;
+
+        /* the target is not usable, everything this backup was meant to
+         * copy must go in the next one as well */
+        hbitmap_iter_init(&hbi, s->copied, 0);
+        while ((sector = hbitmap_iter_next(&hbi)) >= 0) {
+            hbitmap_set(dirty, sector, 1);
+        }
+        hbitmap_iter_init(&hbi, s->copy, 0);
+        while ((sector = hbitmap_iter_next(&hbi)) >= 0) {
+            hbitmap_set(dirty, sector, 1);
+        }
+    }
+    hbitmap_free(s->copy);
+    hbitmap_free(s->copied);
+    hbitmap_free(s->in_flight);
+    ret = error;
+
+out:
+    if (s->bitmap) {
+        s->bitmap->busy = false;
+    }
+    bdrv_iostatus_disable(s->target);
+    bdrv_delete(s->target);
+    block_job_completed(&s->common, ret);
+}
+
+static void backup_iostatus_reset(BlockJob *job)
+{
+    BackupBlockJob *s = container_of(job, BackupBlockJob, common);
+
+    bdrv_iostatus_reset(s->target);
+}
+
+static BlockJobType backup_job_type = {
+    .instance_size = sizeof(BackupBlockJob),
+    .job_type      = "backup",
+    .iostatus_reset = backup_iostatus_reset,
+};
+
+void backup_start(BlockDriverState *bs, BlockDriverState *target,
+                  BdrvDirtyBitmap *bitmap, int64_t speed,
+                  BlockdevOnError on_source_error,
+                  BlockdevOnError on_target_error,
+                  BlockDriverCompletionFunc *cb, void *opaque,
+                  Error **errp)
+{
+    BackupBlockJob *s;
+
+    if ((on_source_error == BLOCKDEV_ON_ERROR_STOP ||
+         on_source_error == BLOCKDEV_ON_ERROR_ENOSPC) &&
+        !bdrv_iostatus_is_enabled(bs)) {
+        error_set(errp, QERR_INVALID_PARAMETER, "on-source-error");
+        return;
+    }
+
+    if (bitmap && bitmap->busy) {
+        error_set(errp, QERR_DEVICE_IN_USE, bitmap->name);
+        return;
+    }
+
+    /* Copy-before-write reads the source from inside the guest write, which
+     * copy-on-read would serialize against the write itself */
+    if (bs->copy_on_read) {
+        error_setg(errp, "Backup is not supported with copy-on-read");
+        return;
+    }
+
+    s = block_job_create(&backup_job_type, bs, speed, cb, opaque, errp);
+    if (!s) {
+        return;
+    }
+
+    s->on_source_error = on_source_error;
+    s->on_target_error = on_target_error;
+    s->target = target;
+    s->bitmap = bitmap;
+    if (bitmap) {
+        bitmap->busy = true;
+    }
+
+    bdrv_set_enable_write_cache(target, true);
+    bdrv_set_on_error(target, on_target_error, on_target_error);
+    bdrv_iostatus_enable(target);
+    s->common.co = qemu_coroutine_create(backup_run);
+    trace_backup_start(bs, s, s->common.co, opaque);
+    qemu_coroutine_enter(s->common.co, s);
+}
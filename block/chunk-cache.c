@@ -0,0 +1,306 @@
+/*
+ * Cache of decompressed chunks for read-only compressed image formats
+ *
+ * Formats such as dmg and cloop store the image as independently compressed
+ * chunks, so a read must inflate a whole chunk.  The cache keeps the most
+ * recently used chunks decompressed, lets concurrent readers of one chunk
+ * share a single load, and reads ahead of sequential readers with several
+ * chunks in flight so that decompression overlaps with I/O.
+ *
+ * Everything here runs in the image's AioContext; only the inflate itself
+ * is handed over to the thread pool.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu-common.h"
+#include "block/block_int.h"
+#include "block/coroutine.h"
+#include "block/chunk-cache.h"
+#include "block/thread-pool.h"
+#include <zlib.h>
+
+typedef struct ChunkCacheEntry {
+    int64_t index;              /* -1 if unused */
+    uint8_t *buf;
+    int ref;                    /* loader and readers */
+    bool loading;
+    uint64_t lru;
+    CoQueue waiters;            /* for the load to finish */
+} ChunkCacheEntry;
+
+struct ChunkCache {
+    BlockDriverState *bs;
+    ChunkCacheLoadFunc *load;
+    size_t chunk_size;
+    int nb_entries;
+    ChunkCacheEntry *entries;
+    uint64_t lru_counter;
+    CoQueue free_waiters;       /* for an idle entry */
+    int64_t last_index;         /* chunk of the last read */
+    int64_t prefetched;         /* readahead was issued up to here */
+    int in_flight;              /* readahead coroutines */
+};
+
+typedef struct ChunkCacheReadahead {
+    ChunkCache *c;
+    int64_t index;
+} ChunkCacheReadahead;
+
+typedef struct ChunkCacheInflate {
+    const uint8_t *in;
+    size_t in_len;
+    uint8_t *out;
+    size_t out_len;
+} ChunkCacheInflate;
+
+ChunkCache *chunk_cache_new(BlockDriverState *bs, size_t chunk_size,
+                            ChunkCacheLoadFunc *load)
+{
+    ChunkCache *c = g_malloc0(sizeof(*c));
+    int nb_entries;
+    int i;
+
+    nb_entries = MIN(CHUNK_CACHE_MAX_ENTRIES,
+                     MAX(2, CHUNK_CACHE_SIZE / MAX(chunk_size, 1)));
+
+    c->bs = bs;
+    c->load = load;
+    c->chunk_size = chunk_size;
+    c->nb_entries = nb_entries;
+    c->entries = g_malloc0(sizeof(c->entries[0]) * nb_entries);
+    for (i = 0; i < nb_entries; i++) {
+        c->entries[i].index = -1;
+        qemu_co_queue_init(&c->entries[i].waiters);
+    }
+    qemu_co_queue_init(&c->free_waiters);
+    c->last_index = -1;
+    c->prefetched = -1;
+
+    return c;
+}
+
+void chunk_cache_free(ChunkCache *c)
+{
+    int i;
+
+    while (c->in_flight > 0) {
+        aio_poll(bdrv_get_aio_context(c->bs), true);
+    }
+
+    for (i = 0; i < c->nb_entries; i++) {
+        assert(c->entries[i].ref == 0);
+        g_free(c->entries[i].buf);
+    }
+    g_free(c->entries);
+    g_free(c);
+}
+
+static ChunkCacheEntry *chunk_cache_find(ChunkCache *c, int64_t index)
+{
+    int i;
+
+    for (i = 0; i < c->nb_entries; i++) {
+        if (c->entries[i].index == index) {
+            return &c->entries[i];
+        }
+    }
+    return NULL;
+}
+
+/* Return the least recently used idle entry, or NULL if all are busy */
+static ChunkCacheEntry *chunk_cache_victim(ChunkCache *c)
+{
+    ChunkCacheEntry *victim = NULL;
+    int i;
+
+    for (i = 0; i < c->nb_entries; i++) {
+        ChunkCacheEntry *e = &c->entries[i];
+
+        if (e->ref == 0 && (victim == NULL || e->lru < victim->lru)) {
+            victim = e;
+        }
+    }
+    return victim;
+}
+
+static void chunk_cache_unref(ChunkCache *c, ChunkCacheEntry *e)
+{
+    assert(e->ref > 0);
+    e->lru = ++c->lru_counter;
+    if (--e->ref == 0) {
+        qemu_co_queue_next(&c->free_waiters);
+    }
+}
+
+/*
+ * Load chunk @index into the idle entry @e.  On success the caller holds a
+ * reference to @e; on failure the entry is unused again.
+ */
+static int coroutine_fn chunk_cache_fill(ChunkCache *c, ChunkCacheEntry *e,
+                                         int64_t index)
+{
+    int ret;
+
+    assert(e->ref == 0);
+    e->index = index;
+    e->ref = 1;
+    e->loading = true;
+    if (e->buf == NULL) {
+        e->buf = g_malloc(c->chunk_size);
+    }
+
+    ret = c->load(c->bs, index, e->buf);
+
+    e->loading = false;
+    if (ret < 0) {
+        e->index = -1;
+        e->lru = 0;
+    }
+    qemu_co_queue_restart_all(&e->waiters);
+    if (ret < 0) {
+        chunk_cache_unref(c, e);
+    }
+    return ret;
+}
+
+int coroutine_fn chunk_cache_get(ChunkCache *c, int64_t index,
+                                 const uint8_t **buf)
+{
+    ChunkCacheEntry *e;
+    int ret;
+
+    for (;;) {
+        e = chunk_cache_find(c, index);
+        if (e && e->loading) {
+            /* The loader may fail and give the entry up, so look again */
+            qemu_co_queue_wait(&e->waiters);
+            continue;
+        }
+        if (e) {
+            e->ref++;
+            break;
+        }
+
+        e = chunk_cache_victim(c);
+        if (e) {
+            ret = chunk_cache_fill(c, e, index);
+            if (ret < 0) {
+                return ret;
+            }
+            break;
+        }
+        qemu_co_queue_wait(&c->free_waiters);
+    }
+
+    *buf = e->buf;
+    return 0;
+}
+
+void chunk_cache_put(ChunkCache *c, const uint8_t *buf)
+{
+    int i;
+
+    for (i = 0; i < c->nb_entries; i++) {
+        if (c->entries[i].buf == buf) {
+            chunk_cache_unref(c, &c->entries[i]);
+            return;
+        }
+    }
+    abort();
+}
+
+static void coroutine_fn chunk_cache_readahead_entry(void *opaque)
+{
+    ChunkCacheReadahead *ra = opaque;
+    ChunkCache *c = ra->c;
+    ChunkCacheEntry *e;
+
+    /* Claimed before the first yield, so the next readahead coroutine
+     * sees the entry as busy */
+    e = chunk_cache_find(c, ra->index) ? NULL : chunk_cache_victim(c);
+    if (e && chunk_cache_fill(c, e, ra->index) == 0) {
+        chunk_cache_unref(c, e);
+    }
+
+    c->in_flight--;
+    g_free(ra);
+}
+
+void chunk_cache_readahead(ChunkCache *c, int64_t index, int64_t nb_chunks)
+{
+    int64_t i, end;
+    bool sequential;
+
+    sequential = index == c->last_index || index == c->last_index + 1;
+    c->last_index = index;
+    if (!sequential) {
+        c->prefetched = index;
+        return;
+    }
+
+    /* Never read ahead more than half of the cache */
+    end = MIN(index + 1 + MIN(CHUNK_CACHE_READAHEAD, c->nb_entries / 2),
+              nb_chunks);
+    for (i = MAX(c->prefetched, index) + 1; i < end; i++) {
+        ChunkCacheReadahead *ra;
+        Coroutine *co;
+
+        if (chunk_cache_find(c, i)) {
+            continue;
+        }
+        if (chunk_cache_victim(c) == NULL) {
+            break;
+        }
+
+        ra = g_malloc(sizeof(*ra));
+        ra->c = c;
+        ra->index = i;
+        c->in_flight++;
+        co = qemu_coroutine_create(chunk_cache_readahead_entry);
+        qemu_coroutine_enter(co, ra);
+    }
+    c->prefetched = MAX(c->prefetched, i - 1);
+}
+
+/* Called in a thread pool worker */
+static int chunk_cache_inflate_worker(void *opaque)
+{
+    ChunkCacheInflate *data = opaque;
+    z_stream strm;
+    int ret;
+
+    memset(&strm, 0, sizeof(strm));
+    strm.next_in = (uint8_t *)data->in;
+    strm.avail_in = data->in_len;
+    strm.next_out = data->out;
+    strm.avail_out = data->out_len;
+
+    if (inflateInit(&strm) != Z_OK) {
+        return -EIO;
+    }
+    ret = inflate(&strm, Z_FINISH);
+    if (ret != Z_STREAM_END || strm.total_out != data->out_len) {
+        ret = -EIO;
+    } else {
+        ret = 0;
+    }
+    inflateEnd(&strm);
+    return ret;
+}
+
+int coroutine_fn chunk_cache_inflate(BlockDriverState *bs,
+                                     const uint8_t *in, size_t in_len,
+                                     uint8_t *out, size_t out_len)
+{
+    ChunkCacheInflate data = {
+        .in         = in,
+        .in_len     = in_len,
+        .out        = out,
+        .out_len    = out_len,
+    };
+
+    return thread_pool_submit_co(aio_get_thread_pool(bdrv_get_aio_context(bs)),
+                                 chunk_cache_inflate_worker, &data);
+}
@@ -23,19 +23,15 @@
  */
 #include "qemu-common.h"
 #include "block/block_int.h"
+#include "block/chunk-cache.h"
 #include "qemu/module.h"
-#include <zlib.h>
 
 typedef struct BDRVCloopState {
-    CoMutex lock;
     uint32_t block_size;
     uint32_t n_blocks;
     uint64_t *offsets;
     uint32_t sectors_per_block;
-    uint32_t current_block;
-    uint8_t *compressed_block;
-    uint8_t *uncompressed_block;
-    z_stream zstream;
+    ChunkCache *cache;
 } BDRVCloopState;
 
 static int cloop_probe(const uint8_t *buf, int buf_size, const char *filename)
@@ -53,10 +49,29 @@ static int cloop_probe(const uint8_t *buf, int buf_size, const char *filename)
     return 0;
 }
 
+static int coroutine_fn cloop_load_block(BlockDriverState *bs,
+                                         int64_t block_num, uint8_t *buf)
+{
+    BDRVCloopState *s = bs->opaque;
+    uint32_t bytes = s->offsets[block_num + 1] - s->offsets[block_num];
+    uint8_t *compressed_block;
+    int ret;
+
+    compressed_block = g_malloc(bytes);
+    ret = bdrv_pread(bs->file, s->offsets[block_num], compressed_block,
+                     bytes);
+    if (ret >= 0) {
+        ret = chunk_cache_inflate(bs, compressed_block, bytes,
+                                  buf, s->block_size);
+    }
+    g_free(compressed_block);
+    return ret;
+}
+
 static int cloop_open(BlockDriverState *bs, int flags)
 {
     BDRVCloopState *s = bs->opaque;
-    uint32_t offsets_size, max_compressed_block_size = 1, i;
+    uint32_t offsets_size, i;
     int ret;
 
     bs->read_only = 1;
@@ -85,106 +100,54 @@ static int cloop_open(BlockDriverState *bs, int flags)
 
     for(i=0;i<s->n_blocks;i++) {
         s->offsets[i] = be64_to_cpu(s->offsets[i]);
-        if (i > 0) {
-            uint32_t size = s->offsets[i] - s->offsets[i - 1];
-            if (size > max_compressed_block_size) {
-                max_compressed_block_size = size;
-            }
-        }
     }
 
-    /* initialize zlib engine */
-    s->compressed_block = g_malloc(max_compressed_block_size + 1);
-    s->uncompressed_block = g_malloc(s->block_size);
-    if (inflateInit(&s->zstream) != Z_OK) {
-        ret = -EINVAL;
-        goto fail;
-    }
-    s->current_block = s->n_blocks;
+    s->cache = chunk_cache_new(bs, s->block_size, cloop_load_block);
 
     s->sectors_per_block = s->block_size/512;
     bs->total_sectors = s->n_blocks * s->sectors_per_block;
-    qemu_co_mutex_init(&s->lock);
     return 0;
 
 fail:
     g_free(s->offsets);
-    g_free(s->compressed_block);
-    g_free(s->uncompressed_block);
     return ret;
 }
 
-static inline int cloop_read_block(BlockDriverState *bs, int block_num)
+static coroutine_fn int cloop_co_read(BlockDriverState *bs, int64_t sector_num,
+                                      uint8_t *buf, int nb_sectors)
 {
     BDRVCloopState *s = bs->opaque;
+    const uint8_t *block;
+    int ret;
 
-    if (s->current_block != block_num) {
-        int ret;
-        uint32_t bytes = s->offsets[block_num + 1] - s->offsets[block_num];
+    while (nb_sectors > 0) {
+        uint32_t block_num = sector_num / s->sectors_per_block;
+        uint32_t sector_offset_in_block = sector_num % s->sectors_per_block;
+        int n = MIN(nb_sectors, s->sectors_per_block - sector_offset_in_block);
 
-        ret = bdrv_pread(bs->file, s->offsets[block_num], s->compressed_block,
-                         bytes);
-        if (ret != bytes) {
-            return -1;
+        chunk_cache_readahead(s->cache, block_num, s->n_blocks);
+        ret = chunk_cache_get(s->cache, block_num, &block);
+        if (ret < 0) {
+            return ret;
         }
+        memcpy(buf, block + sector_offset_in_block * 512, n * 512);
+        chunk_cache_put(s->cache, block);
 
-        s->zstream.next_in = s->compressed_block;
-        s->zstream.avail_in = bytes;
-        s->zstream.next_out = s->uncompressed_block;
-        s->zstream.avail_out = s->block_size;
-        ret = inflateReset(&s->zstream);
-        if (ret != Z_OK) {
-            return -1;
-        }
-        ret = inflate(&s->zstream, Z_FINISH);
-        if (ret != Z_STREAM_END || s->zstream.total_out != s->block_size) {
-            return -1;
-        }
-
-        s->current_block = block_num;
+        buf += n * 512;
+        sector_num += n;
+        nb_sectors -= n;
     }
     return 0;
 }
 
-static int cloop_read(BlockDriverState *bs, int64_t sector_num,
-                    uint8_t *buf, int nb_sectors)
-{
-    BDRVCloopState *s = bs->opaque;
-    int i;
-
-    for (i = 0; i < nb_sectors; i++) {
-        uint32_t sector_offset_in_block =
-            ((sector_num + i) % s->sectors_per_block),
-            block_num = (sector_num + i) / s->sectors_per_block;
-        if (cloop_read_block(bs, block_num) != 0) {
-            return -1;
-        }
-        memcpy(buf + i * 512,
-            s->uncompressed_block + sector_offset_in_block * 512, 512);
-    }
-    return 0;
-}
-
-static coroutine_fn int cloop_co_read(BlockDriverState *bs, int64_t sector_num,
-                                      uint8_t *buf, int nb_sectors)
-{
-    int ret;
-    BDRVCloopState *s = bs->opaque;
-    qemu_co_mutex_lock(&s->lock);
-    ret = cloop_read(bs, sector_num, buf, nb_sectors);
-    qemu_co_mutex_unlock(&s->lock);
-    return ret;
-}
-
 static void cloop_close(BlockDriverState *bs)
 {
     BDRVCloopState *s = bs->opaque;
+
+    chunk_cache_free(s->cache);
     if (s->n_blocks > 0) {
         g_free(s->offsets);
     }
-    g_free(s->compressed_block);
-    g_free(s->uncompressed_block);
-    inflateEnd(&s->zstream);
 }
 
 static BlockDriver bdrv_cloop = {
@@ -15,7 +15,6 @@
 #include "trace.h"
 #include "block/block_int.h"
 #include "block/blockjob.h"
-#include "qemu/ratelimit.h"
 
 enum {
     /*
@@ -26,32 +25,59 @@ enum {
     COMMIT_BUFFER_SIZE = 512 * 1024, /* in bytes */
 };
 
-#define SLICE_TIME 100000000ULL /* ns */
+#define COMMIT_CHUNK_SECTORS (COMMIT_BUFFER_SIZE / BDRV_SECTOR_SIZE)
+
+/* Sectors covered by a single allocation query */
+#define COMMIT_QUERY_SECTORS (1 << 21)
+
+#define COMMIT_DEFAULT_IN_FLIGHT 4
+#define COMMIT_MAX_IN_FLIGHT     64
 
 typedef struct CommitBlockJob {
     BlockJob common;
-    RateLimit limit;
     BlockDriverState *active;
     BlockDriverState *top;
     BlockDriverState *base;
     BlockdevOnError on_error;
     int base_flags;
     int orig_overlay_flags;
+
+    int max_in_flight;
+    int in_flight;
+    /* Only completions may resume the job while this is set */
+    bool waiting_for_io;
+    void **buf_free;
+    int buf_free_count;
+    int ret;
 } CommitBlockJob;
 
+typedef struct CommitOp {
+    CommitBlockJob *s;
+    int64_t sector_num;
+    int nb_sectors;
+    bool zero;
+} CommitOp;
+
 static int coroutine_fn commit_populate(BlockDriverState *bs,
                                         BlockDriverState *base,
                                         int64_t sector_num, int nb_sectors,
                                         void *buf)
 {
+    struct iovec iov = {
+        .iov_base = buf,
+        .iov_len  = nb_sectors * BDRV_SECTOR_SIZE,
+    };
+    QEMUIOVector qiov;
     int ret = 0;
 
-    ret = bdrv_read(bs, sector_num, buf, nb_sectors);
+    qemu_iovec_init_external(&qiov, &iov, 1);
+
+    ret = bdrv_co_readv(bs, sector_num, nb_sectors, &qiov);
     if (ret) {
         return ret;
     }
 
-    ret = bdrv_write(base, sector_num, buf, nb_sectors);
+    ret = bdrv_co_writev(base, sector_num, nb_sectors, &qiov);
     if (ret) {
         return ret;
     }
@@ -59,6 +85,73 @@ static int coroutine_fn commit_populate(BlockDriverState *bs,
     return 0;
 }
 
+static void coroutine_fn commit_wait_for_io(CommitBlockJob *s)
+{
+    assert(!s->waiting_for_io);
+    s->waiting_for_io = true;
+    qemu_coroutine_yield();
+    s->waiting_for_io = false;
+}
+
+static bool commit_error_is_fatal(CommitBlockJob *s, int ret)
+{
+    return s->on_error == BLOCKDEV_ON_ERROR_STOP ||
+           s->on_error == BLOCKDEV_ON_ERROR_REPORT ||
+           (s->on_error == BLOCKDEV_ON_ERROR_ENOSPC && ret == -ENOSPC);
+}
+
+static void coroutine_fn commit_co_copy(void *opaque)
+{
+    CommitOp *op = opaque;
+    CommitBlockJob *s = op->s;
+    int ret;
+
+    if (op->zero) {
+        ret = bdrv_co_write_zeroes(s->base, op->sector_num, op->nb_sectors, 0);
+    } else {
+        void *buf;
+
+        assert(s->buf_free_count > 0);
+        buf = s->buf_free[--s->buf_free_count];
+        ret = commit_populate(s->top, s->base, op->sector_num,
+                              op->nb_sectors, buf);
+        s->buf_free[s->buf_free_count++] = buf;
+    }
+    trace_commit_copy_done(s, op->sector_num, op->nb_sectors, op->zero, ret);
+
+    if (ret < 0 && commit_error_is_fatal(s, ret)) {
+        if (s->ret == 0) {
+            s->ret = ret;
+        }
+    } else {
+        /* Publish progress */
+        s->common.offset += op->nb_sectors * BDRV_SECTOR_SIZE;
+    }
+
+    g_slice_free(CommitOp, op);
+    s->in_flight--;
+    if (s->waiting_for_io) {
+        qemu_coroutine_enter(s->common.co, NULL);
+    }
+}
+
+static void commit_start_copy(CommitBlockJob *s, int64_t sector_num,
+                              int nb_sectors, bool zero)
+{
+    CommitOp *op;
+    Coroutine *co;
+
+    op = g_slice_new(CommitOp);
+    op->s = s;
+    op->sector_num = sector_num;
+    op->nb_sectors = nb_sectors;
+    op->zero = zero;
+
+    s->in_flight++;
+    co = qemu_coroutine_create(commit_co_copy);
+    qemu_coroutine_enter(co, op);
+}
+
 static void coroutine_fn commit_run(void *opaque)
 {
     CommitBlockJob *s = opaque;
@@ -67,10 +160,11 @@ static void coroutine_fn commit_run(void *opaque)
     BlockDriverState *base = s->base;
     BlockDriverState *overlay_bs;
     int64_t sector_num, end;
+    int64_t run_end = 0;
+    int64_t status = 0;
     int ret = 0;
     int n = 0;
-    void *buf;
-    int bytes_written = 0;
+    int i;
     int64_t base_len;
 
     ret = s->common.len = bdrv_getlength(top);
@@ -93,59 +187,84 @@ static void coroutine_fn commit_run(void *opaque)
     }
 
     end = s->common.len >> BDRV_SECTOR_BITS;
-    buf = qemu_blockalign(top, COMMIT_BUFFER_SIZE);
+    s->buf_free = g_new(void *, s->max_in_flight);
+    for (i = 0; i < s->max_in_flight; i++) {
+        s->buf_free[i] = qemu_blockalign(top, COMMIT_BUFFER_SIZE);
+    }
+    s->buf_free_count = s->max_in_flight;
 
     for (sector_num = 0; sector_num < end; sector_num += n) {
         uint64_t delay_ns = 0;
-        bool copy;
 
 wait:
         /* Note that even when no rate limit is applied we need to yield
          * with no pending I/O here so that bdrv_drain_all() returns.
          */
         block_job_sleep_ns(&s->common, rt_clock, delay_ns);
-        if (block_job_is_cancelled(&s->common)) {
+        if (block_job_is_cancelled(&s->common) || s->ret < 0) {
             break;
         }
-        /* Copy if allocated above the base */
-        ret = bdrv_co_is_allocated_above(top, base, sector_num,
-                                         COMMIT_BUFFER_SIZE / BDRV_SECTOR_SIZE,
-                                         &n);
-        copy = (ret == 1);
-        trace_commit_one_iteration(s, sector_num, n, ret);
-        if (copy) {
-            if (s->common.speed) {
-                delay_ns = ratelimit_calculate_delay(&s->limit, n);
-                if (delay_ns > 0) {
-                    goto wait;
+
+        if (sector_num >= run_end) {
+            /* Copy if allocated above the base.  A large range is queried
+             * at once and then copied in chunks below.  */
+            status = bdrv_co_get_block_status_above(top, base, sector_num,
+                                                    MIN(end - sector_num,
+                                                        COMMIT_QUERY_SECTORS),
+                                                    &n);
+            ret = status < 0 ? status : !!status;
+            trace_commit_one_iteration(s, sector_num, n, ret);
+            if (ret < 0) {
+                if (commit_error_is_fatal(s, ret)) {
+                    s->ret = ret;
+                    break;
                 }
-            }
-            ret = commit_populate(top, base, sector_num, n, buf);
-            bytes_written += n * BDRV_SECTOR_SIZE;
-        }
-        if (ret < 0) {
-            if (s->on_error == BLOCKDEV_ON_ERROR_STOP ||
-                s->on_error == BLOCKDEV_ON_ERROR_REPORT||
-                (s->on_error == BLOCKDEV_ON_ERROR_ENOSPC && ret == -ENOSPC)) {
-                goto exit_free_buf;
-            } else {
                 n = 0;
                 continue;
             }
+            run_end = sector_num + n;
         }
-        /* Publish progress */
-        s->common.offset += n * BDRV_SECTOR_SIZE;
+
+        if (!status) {
+            n = run_end - sector_num;
+
+            /* Publish progress */
+            s->common.offset += n * BDRV_SECTOR_SIZE;
+            continue;
+        }
+
+        n = MIN(run_end - sector_num, COMMIT_CHUNK_SECTORS);
+        if (s->in_flight >= s->max_in_flight) {
+            commit_wait_for_io(s);
+            delay_ns = 0;
+            goto wait;
+        }
+        /* Zero ranges are not read and only cost a write zeroes request,
+         * so they are not rate limited.  */
+        delay_ns = block_job_throttle(&s->common,
+                                      status & BDRV_BLOCK_ZERO ? 0 : n);
+        if (delay_ns > 0) {
+            goto wait;
+        }
+        commit_start_copy(s, sector_num, n, status & BDRV_BLOCK_ZERO);
     }
 
-    ret = 0;
+    while (s->in_flight > 0) {
+        commit_wait_for_io(s);
+    }
+
+    ret = s->ret;
 
-    if (!block_job_is_cancelled(&s->common) && sector_num == end) {
+    if (!block_job_is_cancelled(&s->common) && sector_num == end &&
+        ret == 0) {
         /* success */
         ret = bdrv_drop_intermediate(active, top, base);
     }
 
-exit_free_buf:
-    qemu_vfree(buf);
+    for (i = 0; i < s->max_in_flight; i++) {
+        qemu_vfree(s->buf_free[i]);
+    }
+    g_free(s->buf_free);
 
 exit_restore_reopen:
     /* restore base open flags here if appropriate (e.g., change the base back
@@ -162,25 +281,13 @@ exit_restore_reopen:
     block_job_completed(&s->common, ret);
 }
 
-static void commit_set_speed(BlockJob *job, int64_t speed, Error **errp)
-{
-    CommitBlockJob *s = container_of(job, CommitBlockJob, common);
-
-    if (speed < 0) {
-        error_set(errp, QERR_INVALID_PARAMETER, "speed");
-        return;
-    }
-    ratelimit_set_speed(&s->limit, speed / BDRV_SECTOR_SIZE, SLICE_TIME);
-}
-
 static BlockJobType commit_job_type = {
     .instance_size = sizeof(CommitBlockJob),
     .job_type      = "commit",
-    .set_speed     = commit_set_speed,
 };
 
 void commit_start(BlockDriverState *bs, BlockDriverState *base,
-                  BlockDriverState *top, int64_t speed,
+                  BlockDriverState *top, int64_t speed, int max_in_flight,
                   BlockdevOnError on_error, BlockDriverCompletionFunc *cb,
                   void *opaque, Error **errp)
 {
@@ -205,6 +312,11 @@ void commit_start(BlockDriverState *bs, BlockDriverState *base,
         return;
     }
 
+    if (max_in_flight < 0 || max_in_flight > COMMIT_MAX_IN_FLIGHT) {
+        error_set(errp, QERR_INVALID_PARAMETER, "max-in-flight");
+        return;
+    }
+
     if (top == base) {
         error_setg(errp, "Invalid files for merge: top and base are the same");
         return;
@@ -251,6 +363,7 @@ void commit_start(BlockDriverState *bs, BlockDriverState *base,
     s->orig_overlay_flags  = orig_overlay_flags;
 
     s->on_error = on_error;
+    s->max_in_flight = max_in_flight ?: COMMIT_DEFAULT_IN_FLIGHT;
     s->common.co = qemu_coroutine_create(commit_run);
 
     trace_commit_start(bs, base, top, s, s->common.co, opaque);
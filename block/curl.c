@@ -23,6 +23,7 @@
  */
 #include "qemu-common.h"
 #include "block/block_int.h"
+#include "qemu/timer.h"
 #include <curl/curl.h>
 
 // #define DEBUG
@@ -39,9 +40,13 @@
                    CURLPROTO_TFTP)
 
 #define CURL_NUM_STATES 8
+#define CURL_MAX_STATES 64
 #define CURL_NUM_ACB    8
 #define SECTOR_SIZE     512
 #define READ_AHEAD_SIZE (256 * 1024)
+#define CURL_PART_SIZE  (256 * 1024)
+#define CURL_TIMEOUT    5
+#define CURL_RETRIES    2
 
 #define FIND_RET_NONE   0
 #define FIND_RET_OK     1
@@ -57,14 +62,24 @@ typedef struct CURLAIOCB {
     int64_t sector_num;
     int nb_sectors;
 
-    size_t start;
-    size_t end;
+    size_t issued;      /* bytes of the request already served or in flight */
+    int pending;        /* parts in flight */
+    int ret;
+    QSIMPLEQ_ENTRY(CURLAIOCB) next;
 } CURLAIOCB;
 
+/* The piece of a request that waits for data in one CURLState */
+typedef struct CURLPart {
+    CURLAIOCB *acb;
+    size_t start;       /* in the state's buffer */
+    size_t end;
+    size_t qiov_offset;
+} CURLPart;
+
 typedef struct CURLState
 {
     struct BDRVCURLState *s;
-    CURLAIOCB *acb[CURL_NUM_ACB];
+    CURLPart acb[CURL_NUM_ACB];
     CURL *curl;
     char *orig_buf;
     size_t buf_start;
@@ -73,14 +88,21 @@ typedef struct CURLState
     char range[128];
     char errmsg[CURL_ERROR_SIZE];
     char in_use;
+    int retries;
 } CURLState;
 
 typedef struct BDRVCURLState {
     CURLM *multi;
+    QEMUTimer *timer;
     size_t len;
-    CURLState states[CURL_NUM_STATES];
+    CURLState *states;
+    int num_states;
+    int next_state;
+    QSIMPLEQ_HEAD(, CURLAIOCB) waiting;     /* for a free state */
     char *url;
     size_t readahead_size;
+    size_t timeout;
+    size_t retries;
 } BDRVCURLState;
 
 static void curl_clean_state(CURLState *s);
@@ -110,6 +132,21 @@ static int curl_sock_cb(CURL *curl, curl_socket_t fd, int action,
     return 0;
 }
 
+/* libcurl asks to be called back after @timeout_ms for its own timeouts
+ * and retransmissions, and with 0 to get newly added handles going */
+static int curl_timer_cb(CURLM *multi, long timeout_ms, void *opaque)
+{
+    BDRVCURLState *s = opaque;
+
+    DPRINTF("CURL: timer callback timeout_ms %ld\n", timeout_ms);
+    if (timeout_ms < 0) {
+        qemu_del_timer(s->timer);
+    } else {
+        qemu_mod_timer(s->timer, qemu_get_clock_ms(rt_clock) + timeout_ms);
+    }
+    return 0;
+}
+
 static size_t curl_size_cb(void *ptr, size_t size, size_t nmemb, void *opaque)
 {
     CURLState *s = ((CURLState*)opaque);
@@ -123,6 +160,19 @@ static size_t curl_size_cb(void *ptr, size_t size, size_t nmemb, void *opaque)
     return realsize;
 }
 
+static void curl_part_done(CURLAIOCB *acb, int ret)
+{
+    if (ret < 0) {
+        acb->ret = ret;
+    }
+
+    assert(acb->pending > 0);
+    if (--acb->pending == 0 && acb->issued == acb->nb_sectors * SECTOR_SIZE) {
+        acb->common.cb(acb->common.opaque, acb->ret);
+        qemu_aio_release(acb);
+    }
+}
+
 static size_t curl_read_cb(void *ptr, size_t size, size_t nmemb, void *opaque)
 {
     CURLState *s = ((CURLState*)opaque);
@@ -134,21 +184,24 @@ static size_t curl_read_cb(void *ptr, size_t size, size_t nmemb, void *opaque)
     if (!s || !s->orig_buf)
         goto read_end;
 
-    memcpy(s->orig_buf + s->buf_off, ptr, realsize);
-    s->buf_off += realsize;
+    /* Don't trust the server to stick to the range */
+    memcpy(s->orig_buf + s->buf_off, ptr,
+           MIN(realsize, s->buf_len - s->buf_off));
+    s->buf_off += MIN(realsize, s->buf_len - s->buf_off);
 
     for(i=0; i<CURL_NUM_ACB; i++) {
-        CURLAIOCB *acb = s->acb[i];
+        CURLPart *part = &s->acb[i];
+        CURLAIOCB *acb = part->acb;
 
         if (!acb)
             continue;
 
-        if ((s->buf_off >= acb->end)) {
-            qemu_iovec_from_buf(acb->qiov, 0, s->orig_buf + acb->start,
-                                acb->end - acb->start);
-            acb->common.cb(acb->common.opaque, 0);
-            qemu_aio_release(acb);
-            s->acb[i] = NULL;
+        if ((s->buf_off >= part->end)) {
+            qemu_iovec_from_buf(acb->qiov, part->qiov_offset,
+                                s->orig_buf + part->start,
+                                part->end - part->start);
+            part->acb = NULL;
+            curl_part_done(acb, 0);
         }
     }
 
@@ -156,13 +209,15 @@ read_end:
     return realsize;
 }
 
+/* Serve @len bytes at @start, which go to @qiov_offset in the request,
+ * from data that is or will soon be in one of the states' buffers */
 static int curl_find_buf(BDRVCURLState *s, size_t start, size_t len,
-                         CURLAIOCB *acb)
+                         CURLAIOCB *acb, size_t qiov_offset)
 {
     int i;
     size_t end = start + len;
 
-    for (i=0; i<CURL_NUM_STATES; i++) {
+    for (i=0; i<s->num_states; i++) {
         CURLState *state = &s->states[i];
         size_t buf_end = (state->buf_start + state->buf_off);
         size_t buf_fend = (state->buf_start + state->buf_len);
@@ -180,26 +235,28 @@ static int curl_find_buf(BDRVCURLState *s, size_t start, size_t len,
         {
             char *buf = state->orig_buf + (start - state->buf_start);
 
-            qemu_iovec_from_buf(acb->qiov, 0, buf, len);
-            acb->common.cb(acb->common.opaque, 0);
-
+            qemu_iovec_from_buf(acb->qiov, qiov_offset, buf, len);
             return FIND_RET_OK;
         }
 
         // Wait for unfinished chunks
-        if ((start >= state->buf_start) &&
+        if (state->in_use &&
+            (start >= state->buf_start) &&
             (start <= buf_fend) &&
             (end >= state->buf_start) &&
             (end <= buf_fend))
         {
             int j;
 
-            acb->start = start - state->buf_start;
-            acb->end = acb->start + len;
-
             for (j=0; j<CURL_NUM_ACB; j++) {
-                if (!state->acb[j]) {
-                    state->acb[j] = acb;
+                if (!state->acb[j].acb) {
+                    state->acb[j] = (CURLPart) {
+                        .acb            = acb,
+                        .start          = start - state->buf_start,
+                        .end            = end - state->buf_start,
+                        .qiov_offset    = qiov_offset,
+                    };
+                    acb->pending++;
                     return FIND_RET_WAIT;
                 }
             }
@@ -209,19 +266,32 @@ static int curl_find_buf(BDRVCURLState *s, size_t start, size_t len,
     return FIND_RET_NONE;
 }
 
-static void curl_multi_do(void *arg)
+/* Retry a failed transfer, asking only for the data still missing */
+static bool curl_retry(CURLState *state)
 {
-    BDRVCURLState *s = (BDRVCURLState *)arg;
-    int running;
-    int r;
-    int msgs_in_queue;
+    BDRVCURLState *s = state->s;
+    size_t end;
 
-    if (!s->multi)
-        return;
+    if (state->retries >= s->retries) {
+        return false;
+    }
+    state->retries++;
 
-    do {
-        r = curl_multi_socket_all(s->multi, &running);
-    } while(r == CURLM_CALL_MULTI_PERFORM);
+    end = MIN(state->buf_start + state->buf_len, s->len) - 1;
+    snprintf(state->range, 127, "%zd-%zd",
+             state->buf_start + state->buf_off, end);
+    DPRINTF("CURL: Retrying %s after: %s\n", state->range, state->errmsg);
+    curl_easy_setopt(state->curl, CURLOPT_RANGE, state->range);
+    curl_multi_add_handle(s->multi, state->curl);
+    return true;
+}
+
+static bool curl_submit(CURLAIOCB *acb);
+
+static void curl_multi_check_completion(BDRVCURLState *s)
+{
+    int msgs_in_queue;
+    CURLAIOCB *acb;
 
     /* Try to find done transfers, so we can free the easy
      * handle again. */
@@ -238,25 +308,29 @@ static void curl_multi_do(void *arg)
             case CURLMSG_DONE:
             {
                 CURLState *state = NULL;
+                CURLcode result = msg->data.result;
+                int i;
+
                 curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char**)&state);
+                curl_clean_state(state);
 
-                /* ACBs for successful messages get completed in curl_read_cb */
-                if (msg->data.result != CURLE_OK) {
-                    int i;
-                    for (i = 0; i < CURL_NUM_ACB; i++) {
-                        CURLAIOCB *acb = state->acb[i];
+                if (result != CURLE_OK && curl_retry(state)) {
+                    state->in_use = 1;
+                    break;
+                }
 
-                        if (acb == NULL) {
-                            continue;
-                        }
+                /* ACBs for successful messages get completed in
+                 * curl_read_cb, anything left did not get its data */
+                for (i = 0; i < CURL_NUM_ACB; i++) {
+                    CURLAIOCB *acb = state->acb[i].acb;
 
-                        acb->common.cb(acb->common.opaque, -EIO);
-                        qemu_aio_release(acb);
-                        state->acb[i] = NULL;
+                    if (acb == NULL) {
+                        continue;
                     }
-                }
 
-                curl_clean_state(state);
+                    state->acb[i].acb = NULL;
+                    curl_part_done(acb, -EIO);
+                }
                 break;
             }
             default:
@@ -264,39 +338,52 @@ static void curl_multi_do(void *arg)
                 break;
         }
     } while(msgs_in_queue);
+
+    /* Requests that found no free state can go on now */
+    while ((acb = QSIMPLEQ_FIRST(&s->waiting)) != NULL) {
+        QSIMPLEQ_REMOVE_HEAD(&s->waiting, next);
+        if (!curl_submit(acb)) {
+            QSIMPLEQ_INSERT_HEAD(&s->waiting, acb, next);
+            break;
+        }
+    }
 }
 
-static CURLState *curl_init_state(BDRVCURLState *s)
+static void curl_multi_do(void *arg)
 {
-    CURLState *state = NULL;
-    int i, j;
+    BDRVCURLState *s = (BDRVCURLState *)arg;
+    int running;
+    int r;
+
+    if (!s->multi)
+        return;
 
     do {
-        for (i=0; i<CURL_NUM_STATES; i++) {
-            for (j=0; j<CURL_NUM_ACB; j++)
-                if (s->states[i].acb[j])
-                    continue;
-            if (s->states[i].in_use)
-                continue;
-
-            state = &s->states[i];
-            state->in_use = 1;
-            break;
-        }
-        if (!state) {
-            g_usleep(100);
-            curl_multi_do(s);
-        }
-    } while(!state);
+        r = curl_multi_socket_all(s->multi, &running);
+    } while(r == CURLM_CALL_MULTI_PERFORM);
+
+    curl_multi_check_completion(s);
+}
+
+static void curl_multi_timeout_do(void *arg)
+{
+    BDRVCURLState *s = (BDRVCURLState *)arg;
+    int running;
+
+    if (!s->multi)
+        return;
 
-    if (state->curl)
-        goto has_curl;
+    curl_multi_socket_action(s->multi, CURL_SOCKET_TIMEOUT, 0, &running);
+    curl_multi_check_completion(s);
+}
 
+static int curl_init_state(BDRVCURLState *s, CURLState *state)
+{
     state->curl = curl_easy_init();
     if (!state->curl)
-        return NULL;
+        return -EIO;
     curl_easy_setopt(state->curl, CURLOPT_URL, s->url);
-    curl_easy_setopt(state->curl, CURLOPT_TIMEOUT, 5);
+    curl_easy_setopt(state->curl, CURLOPT_TIMEOUT, (long)s->timeout);
     curl_easy_setopt(state->curl, CURLOPT_WRITEFUNCTION, (void *)curl_read_cb);
     curl_easy_setopt(state->curl, CURLOPT_WRITEDATA, (void *)state);
     curl_easy_setopt(state->curl, CURLOPT_PRIVATE, (void *)state);
@@ -317,15 +404,26 @@ static CURLState *curl_init_state(BDRVCURLState *s)
     curl_easy_setopt(state->curl, CURLOPT_REDIR_PROTOCOLS, PROTOCOLS);
 #endif
 
+    /* Keep idle connections open between requests */
+#if LIBCURL_VERSION_NUM >= 0x071900
+    curl_easy_setopt(state->curl, CURLOPT_TCP_KEEPALIVE, 1L);
+#endif
+
+    /* With HTTP/2 all states share one connection, each request is a
+     * stream of its own */
+#if LIBCURL_VERSION_NUM >= 0x072f00
+    curl_easy_setopt(state->curl, CURLOPT_HTTP_VERSION,
+                     CURL_HTTP_VERSION_2TLS);
+    curl_easy_setopt(state->curl, CURLOPT_PIPEWAIT, 1L);
+#endif
+
 #ifdef DEBUG_VERBOSE
     curl_easy_setopt(state->curl, CURLOPT_VERBOSE, 1);
 #endif
 
-has_curl:
-
     state->s = s;
 
-    return state;
+    return 0;
 }
 
 static void curl_clean_state(CURLState *s)
@@ -335,47 +433,150 @@ static void curl_clean_state(CURLState *s)
     s->in_use = 0;
 }
 
+/* Pick a free state, round robin so that recently filled buffers stay
+ * around for reads that follow */
+static CURLState *curl_find_state(BDRVCURLState *s)
+{
+    int i;
+
+    for (i = 0; i < s->num_states; i++) {
+        CURLState *state = &s->states[(s->next_state + i) % s->num_states];
+
+        if (!state->in_use) {
+            s->next_state = (state - s->states + 1) % s->num_states;
+            return state;
+        }
+    }
+    return NULL;
+}
+
+/* Start a range GET for @len bytes at @start, plus @readahead more */
+static void curl_start_part(BDRVCURLState *s, CURLState *state,
+                            CURLAIOCB *acb, size_t start, size_t len,
+                            size_t qiov_offset, size_t readahead)
+{
+    size_t end;
+
+    state->in_use = 1;
+    state->retries = 0;
+    state->buf_off = 0;
+    if (state->orig_buf)
+        g_free(state->orig_buf);
+    state->buf_start = start;
+    state->buf_len = len + readahead;
+    end = MIN(start + state->buf_len, s->len) - 1;
+    state->orig_buf = g_malloc(state->buf_len);
+    state->acb[0] = (CURLPart) {
+        .acb            = acb,
+        .start          = 0,
+        .end            = len,
+        .qiov_offset    = qiov_offset,
+    };
+    acb->pending++;
+
+    snprintf(state->range, 127, "%zd-%zd", start, end);
+    DPRINTF("CURL (AIO): Reading %zd at %zd (%s)\n", len, start, state->range);
+    curl_easy_setopt(state->curl, CURLOPT_RANGE, state->range);
+
+    /* libcurl gets it going from curl_timer_cb */
+    curl_multi_add_handle(s->multi, state->curl);
+}
+
+/*
+ * Issue the parts of @acb that are not in flight yet.  Large reads are
+ * split into CURL_PART_SIZE pieces, each a range GET on a state of its own
+ * so that they are fetched in parallel; only the last one reads ahead.
+ * Already read data is used where possible.
+ *
+ * Returns false if @acb has to wait for a free state; it then continues
+ * from where it stopped.
+ */
+static bool curl_submit(CURLAIOCB *acb)
+{
+    BDRVCURLState *s = acb->common.bs->opaque;
+    size_t start = acb->sector_num * SECTOR_SIZE;
+    size_t total = acb->nb_sectors * SECTOR_SIZE;
+
+    while (acb->issued < total) {
+        size_t len = MIN(total - acb->issued, CURL_PART_SIZE);
+        CURLState *state;
+
+        // In case we have the requested data already (e.g. read-ahead),
+        // we can just copy it.
+        if (curl_find_buf(s, start + acb->issued, len, acb,
+                          acb->issued) != FIND_RET_NONE) {
+            acb->issued += len;
+            continue;
+        }
+
+        state = curl_find_state(s);
+        if (!state) {
+            return false;
+        }
+        curl_start_part(s, state, acb, start + acb->issued, len, acb->issued,
+                        acb->issued + len == total ? s->readahead_size : 0);
+        acb->issued += len;
+    }
+
+    if (acb->pending == 0) {
+        acb->common.cb(acb->common.opaque, acb->ret);
+        qemu_aio_release(acb);
+    }
+    return true;
+}
+
+/* Strip a trailing ":<name>=<number>:" from @file */
+static bool curl_parse_opt(char *file, const char *name, size_t *val)
+{
+    size_t len = strlen(file);
+    size_t name_len = strlen(name);
+    char *end, *num, *opt;
+
+    if (len == 0 || file[len - 1] != ':') {
+        return false;
+    }
+    end = file + len - 1;
+    for (num = end; num > file && qemu_isdigit(num[-1]); num--) {
+        /* nothing */
+    }
+    if (num == end) {
+        return false;
+    }
+
+    opt = num - name_len - 2;
+    if (opt <= file || opt[0] != ':' || num[-1] != '=' ||
+        strncmp(opt + 1, name, name_len) != 0) {
+        return false;
+    }
+
+    *val = strtoull(num, NULL, 10);
+    *opt = '\0';
+    return true;
+}
+
 static int curl_open(BlockDriverState *bs, const char *filename, int flags)
 {
     BDRVCURLState *s = bs->opaque;
     CURLState *state = NULL;
     double d;
-
-    #define RA_OPTSTR ":readahead="
     char *file;
-    char *ra;
-    const char *ra_val;
-    int parse_state = 0;
+    size_t num_states = CURL_NUM_STATES;
+    int i;
 
     static int inited = 0;
 
     file = g_strdup(filename);
     s->readahead_size = READ_AHEAD_SIZE;
-
-    /* Parse a trailing ":readahead=#:" param, if present. */
-    ra = file + strlen(file) - 1;
-    while (ra >= file) {
-        if (parse_state == 0) {
-            if (*ra == ':')
-                parse_state++;
-            else
-                break;
-        } else if (parse_state == 1) {
-            if (*ra > '9' || *ra < '0') {
-                char *opt_start = ra - strlen(RA_OPTSTR) + 1;
-                if (opt_start > file &&
-                    strncmp(opt_start, RA_OPTSTR, strlen(RA_OPTSTR)) == 0) {
-                    ra_val = ra + 1;
-                    ra -= strlen(RA_OPTSTR) - 1;
-                    *ra = '\0';
-                    s->readahead_size = atoi(ra_val);
-                    break;
-                } else {
-                    break;
-                }
-            }
-        }
-        ra--;
+    s->timeout = CURL_TIMEOUT;
+    s->retries = CURL_RETRIES;
+
+    /* Parse trailing ":readahead=#:", ":connections=#:", ":timeout=#:" and
+     * ":retries=#:" params, in any order. */
+    while (curl_parse_opt(file, "readahead", &s->readahead_size) ||
+           curl_parse_opt(file, "connections", &num_states) ||
+           curl_parse_opt(file, "timeout", &s->timeout) ||
+           curl_parse_opt(file, "retries", &s->retries)) {
+        /* nothing */
     }
 
     if ((s->readahead_size & 0x1ff) != 0) {
@@ -384,6 +585,12 @@ static int curl_open(BlockDriverState *bs, const char *filename, int flags)
         goto out_noclean;
     }
 
+    if (num_states < 1 || num_states > CURL_MAX_STATES) {
+        fprintf(stderr, "CURL: connections must be between 1 and %d\n",
+                CURL_MAX_STATES);
+        goto out_noclean;
+    }
+
     if (!inited) {
         curl_global_init(CURL_GLOBAL_ALL);
         inited = 1;
@@ -391,9 +598,15 @@ static int curl_open(BlockDriverState *bs, const char *filename, int flags)
 
     DPRINTF("CURL: Opening %s\n", file);
     s->url = file;
-    state = curl_init_state(s);
-    if (!state)
-        goto out_noclean;
+    s->num_states = num_states;
+    s->states = g_malloc0(sizeof(CURLState) * s->num_states);
+    QSIMPLEQ_INIT(&s->waiting);
+    for (i = 0; i < s->num_states; i++) {
+        if (curl_init_state(s, &s->states[i]) < 0) {
+            goto out_states;
+        }
+    }
+    state = &s->states[0];
 
     // Get file size
 
@@ -410,24 +623,34 @@ static int curl_open(BlockDriverState *bs, const char *filename, int flags)
         goto out;
     DPRINTF("CURL: Size = %zd\n", s->len);
 
-    curl_clean_state(state);
-    curl_easy_cleanup(state->curl);
-    state->curl = NULL;
-
     // Now we know the file exists and its size, so let's
     // initialize the multi interface!
 
+    s->timer = aio_timer_new(bdrv_get_aio_context(bs), rt_clock, SCALE_MS,
+                             curl_multi_timeout_do, s);
     s->multi = curl_multi_init();
-    curl_multi_setopt( s->multi, CURLMOPT_SOCKETDATA, s); 
-    curl_multi_setopt( s->multi, CURLMOPT_SOCKETFUNCTION, curl_sock_cb ); 
+    curl_multi_setopt( s->multi, CURLMOPT_SOCKETDATA, s);
+    curl_multi_setopt( s->multi, CURLMOPT_SOCKETFUNCTION, curl_sock_cb );
+    curl_multi_setopt(s->multi, CURLMOPT_TIMERDATA, s);
+    curl_multi_setopt(s->multi, CURLMOPT_TIMERFUNCTION, curl_timer_cb);
+    curl_multi_setopt(s->multi, CURLMOPT_MAXCONNECTS, (long)s->num_states);
+#if LIBCURL_VERSION_NUM >= 0x072b00
+    curl_multi_setopt(s->multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+#endif
     curl_multi_do(s);
 
     return 0;
 
 out:
     fprintf(stderr, "CURL: Error opening file: %s\n", state->errmsg);
-    curl_easy_cleanup(state->curl);
-    state->curl = NULL;
+out_states:
+    for (i = 0; i < s->num_states; i++) {
+        if (s->states[i].curl) {
+            curl_easy_cleanup(s->states[i].curl);
+        }
+    }
+    g_free(s->states);
+    s->states = NULL;
 out_noclean:
     g_free(file);
     return -EINVAL;
@@ -436,13 +659,14 @@ out_noclean:
 static int curl_aio_flush(void *opaque)
 {
     BDRVCURLState *s = opaque;
-    int i, j;
+    int i;
 
-    for (i=0; i < CURL_NUM_STATES; i++) {
-        for(j=0; j < CURL_NUM_ACB; j++) {
-            if (s->states[i].acb[j]) {
-                return 1;
-            }
+    if (!QSIMPLEQ_EMPTY(&s->waiting)) {
+        return 1;
+    }
+    for (i=0; i < s->num_states; i++) {
+        if (s->states[i].in_use) {
+            return 1;
         }
     }
     return 0;
@@ -461,57 +685,16 @@ static const AIOCBInfo curl_aiocb_info = {
 
 static void curl_readv_bh_cb(void *p)
 {
-    CURLState *state;
-
     CURLAIOCB *acb = p;
     BDRVCURLState *s = acb->common.bs->opaque;
 
     qemu_bh_delete(acb->bh);
     acb->bh = NULL;
 
-    size_t start = acb->sector_num * SECTOR_SIZE;
-    size_t end;
-
-    // In case we have the requested data already (e.g. read-ahead),
-    // we can just call the callback and be done.
-    switch (curl_find_buf(s, start, acb->nb_sectors * SECTOR_SIZE, acb)) {
-        case FIND_RET_OK:
-            qemu_aio_release(acb);
-            // fall through
-        case FIND_RET_WAIT:
-            return;
-        default:
-            break;
-    }
-
-    // No cache found, so let's start a new request
-    state = curl_init_state(s);
-    if (!state) {
-        acb->common.cb(acb->common.opaque, -EIO);
-        qemu_aio_release(acb);
-        return;
+    /* Queue behind earlier requests that wait for a state */
+    if (!QSIMPLEQ_EMPTY(&s->waiting) || !curl_submit(acb)) {
+        QSIMPLEQ_INSERT_TAIL(&s->waiting, acb, next);
     }
-
-    acb->start = 0;
-    acb->end = (acb->nb_sectors * SECTOR_SIZE);
-
-    state->buf_off = 0;
-    if (state->orig_buf)
-        g_free(state->orig_buf);
-    state->buf_start = start;
-    state->buf_len = acb->end + s->readahead_size;
-    end = MIN(start + state->buf_len, s->len) - 1;
-    state->orig_buf = g_malloc(state->buf_len);
-    state->acb[0] = acb;
-
-    snprintf(state->range, 127, "%zd-%zd", start, end);
-    DPRINTF("CURL (AIO): Reading %d at %zd (%s)\n",
-            (acb->nb_sectors * SECTOR_SIZE), start, state->range);
-    curl_easy_setopt(state->curl, CURLOPT_RANGE, state->range);
-
-    curl_multi_add_handle(s->multi, state->curl);
-    curl_multi_do(s);
-
 }
 
 static BlockDriverAIOCB *curl_aio_readv(BlockDriverState *bs,
@@ -525,6 +708,9 @@ static BlockDriverAIOCB *curl_aio_readv(BlockDriverState *bs,
     acb->qiov = qiov;
     acb->sector_num = sector_num;
     acb->nb_sectors = nb_sectors;
+    acb->issued = 0;
+    acb->pending = 0;
+    acb->ret = 0;
 
     acb->bh = qemu_bh_new(curl_readv_bh_cb, acb);
 
@@ -543,7 +729,7 @@ static void curl_close(BlockDriverState *bs)
     int i;
 
     DPRINTF("CURL: Close\n");
-    for (i=0; i<CURL_NUM_STATES; i++) {
+    for (i=0; i<s->num_states; i++) {
         if (s->states[i].in_use)
             curl_clean_state(&s->states[i]);
         if (s->states[i].curl) {
@@ -555,8 +741,13 @@ static void curl_close(BlockDriverState *bs)
             s->states[i].orig_buf = NULL;
         }
     }
+    g_free(s->states);
     if (s->multi)
         curl_multi_cleanup(s->multi);
+    if (s->timer) {
+        qemu_del_timer(s->timer);
+        qemu_free_timer(s->timer);
+    }
     g_free(s->url);
 }
 
@@ -571,6 +762,7 @@ static BlockDriver bdrv_http = {
     .protocol_name   = "http",
 
     .instance_size   = sizeof(BDRVCURLState),
+    .bdrv_main_context_only = true,
     .bdrv_file_open  = curl_open,
     .bdrv_close      = curl_close,
     .bdrv_getlength  = curl_getlength,
@@ -583,6 +775,7 @@ static BlockDriver bdrv_https = {
     .protocol_name   = "https",
 
     .instance_size   = sizeof(BDRVCURLState),
+    .bdrv_main_context_only = true,
     .bdrv_file_open  = curl_open,
     .bdrv_close      = curl_close,
     .bdrv_getlength  = curl_getlength,
@@ -595,6 +788,7 @@ static BlockDriver bdrv_ftp = {
     .protocol_name   = "ftp",
 
     .instance_size   = sizeof(BDRVCURLState),
+    .bdrv_main_context_only = true,
     .bdrv_file_open  = curl_open,
     .bdrv_close      = curl_close,
     .bdrv_getlength  = curl_getlength,
@@ -607,6 +801,7 @@ static BlockDriver bdrv_ftps = {
     .protocol_name   = "ftps",
 
     .instance_size   = sizeof(BDRVCURLState),
+    .bdrv_main_context_only = true,
     .bdrv_file_open  = curl_open,
     .bdrv_close      = curl_close,
     .bdrv_getlength  = curl_getlength,
@@ -619,6 +814,7 @@ static BlockDriver bdrv_tftp = {
     .protocol_name   = "tftp",
 
     .instance_size   = sizeof(BDRVCURLState),
+    .bdrv_main_context_only = true,
     .bdrv_file_open  = curl_open,
     .bdrv_close      = curl_close,
     .bdrv_getlength  = curl_getlength,
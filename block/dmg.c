@@ -24,11 +24,10 @@
 #include "qemu-common.h"
 #include "block/block_int.h"
 #include "qemu/bswap.h"
+#include "block/chunk-cache.h"
 #include "qemu/module.h"
-#include <zlib.h>
 
 typedef struct BDRVDMGState {
-    CoMutex lock;
     /* each chunk contains a certain number of sectors,
      * offsets[i] is the offset in the .dmg file,
      * lengths[i] is the length of the compressed chunk,
@@ -43,10 +42,7 @@ typedef struct BDRVDMGState {
     uint64_t* lengths;
     uint64_t* sectors;
     uint64_t* sectorcounts;
-    uint32_t current_chunk;
-    uint8_t *compressed_chunk;
-    uint8_t *uncompressed_chunk;
-    z_stream zstream;
+    ChunkCache *cache;
 } BDRVDMGState;
 
 static int dmg_probe(const uint8_t *buf, int buf_size, const char *filename)
@@ -85,12 +81,45 @@ static int read_uint32(BlockDriverState *bs, int64_t offset, uint32_t *result)
     return 0;
 }
 
+/* Reads only use the cache for zlib compressed chunks, but readahead
+ * may load any kind */
+static int coroutine_fn dmg_load_chunk(BlockDriverState *bs, int64_t chunk,
+                                       uint8_t *buf)
+{
+    BDRVDMGState *s = bs->opaque;
+    uint8_t *compressed_chunk;
+    int ret;
+
+    switch (s->types[chunk]) {
+    case 0x80000005: /* zlib compressed */
+        /* we need to buffer, because only the chunk as whole can be
+         * inflated. */
+        compressed_chunk = g_malloc(s->lengths[chunk]);
+        ret = bdrv_pread(bs->file, s->offsets[chunk], compressed_chunk,
+                         s->lengths[chunk]);
+        if (ret >= 0) {
+            ret = chunk_cache_inflate(bs, compressed_chunk, s->lengths[chunk],
+                                      buf, 512 * s->sectorcounts[chunk]);
+        }
+        g_free(compressed_chunk);
+        return ret;
+    case 1: /* copy */
+        ret = bdrv_pread(bs->file, s->offsets[chunk], buf,
+                         512 * s->sectorcounts[chunk]);
+        return ret < 0 ? ret : 0;
+    case 2: /* zero */
+        memset(buf, 0, 512 * s->sectorcounts[chunk]);
+        return 0;
+    }
+    return -EIO;
+}
+
 static int dmg_open(BlockDriverState *bs, int flags)
 {
     BDRVDMGState *s = bs->opaque;
     uint64_t info_begin,info_end,last_in_offset,last_out_offset;
     uint32_t count, tmp;
-    uint32_t max_compressed_size=1,max_sectors_per_chunk=1,i;
+    uint32_t max_sectors_per_chunk=1,i;
     int64_t offset;
     int ret;
 
@@ -210,8 +239,6 @@ static int dmg_open(BlockDriverState *bs, int flags)
                 }
                 offset += 8;
 
-		if(s->lengths[i]>max_compressed_size)
-		    max_compressed_size = s->lengths[i];
 		if(s->sectorcounts[i]>max_sectors_per_chunk)
 		    max_sectors_per_chunk = s->sectorcounts[i];
 	    }
@@ -219,17 +246,8 @@ static int dmg_open(BlockDriverState *bs, int flags)
 	}
     }
 
-    /* initialize zlib engine */
-    s->compressed_chunk = g_malloc(max_compressed_size+1);
-    s->uncompressed_chunk = g_malloc(512*max_sectors_per_chunk);
-    if(inflateInit(&s->zstream) != Z_OK) {
-        ret = -EINVAL;
-        goto fail;
-    }
-
-    s->current_chunk = s->n_chunks;
-
-    qemu_co_mutex_init(&s->lock);
+    s->cache = chunk_cache_new(bs, 512 * max_sectors_per_chunk,
+                               dmg_load_chunk);
     return 0;
 
 fail:
@@ -238,21 +256,9 @@ fail:
     g_free(s->lengths);
     g_free(s->sectors);
     g_free(s->sectorcounts);
-    g_free(s->compressed_chunk);
-    g_free(s->uncompressed_chunk);
     return ret;
 }
 
-static inline int is_sector_in_chunk(BDRVDMGState* s,
-		uint32_t chunk_num,int sector_num)
-{
-    if(chunk_num>=s->n_chunks || s->sectors[chunk_num]>sector_num ||
-	    s->sectors[chunk_num]+s->sectorcounts[chunk_num]<=sector_num)
-	return 0;
-    else
-	return -1;
-}
-
 static inline uint32_t search_chunk(BDRVDMGState* s,int sector_num)
 {
     /* binary search */
@@ -269,102 +275,64 @@ static inline uint32_t search_chunk(BDRVDMGState* s,int sector_num)
     return s->n_chunks; /* error */
 }
 
-static inline int dmg_read_chunk(BlockDriverState *bs, int sector_num)
+static coroutine_fn int dmg_co_read(BlockDriverState *bs, int64_t sector_num,
+                                    uint8_t *buf, int nb_sectors)
 {
     BDRVDMGState *s = bs->opaque;
+    const uint8_t *data;
+    int ret;
 
-    if(!is_sector_in_chunk(s,s->current_chunk,sector_num)) {
-	int ret;
-	uint32_t chunk = search_chunk(s,sector_num);
-
-	if(chunk>=s->n_chunks)
-	    return -1;
-
-	s->current_chunk = s->n_chunks;
-	switch(s->types[chunk]) {
-	case 0x80000005: { /* zlib compressed */
-	    int i;
-
-	    /* we need to buffer, because only the chunk as whole can be
-	     * inflated. */
-	    i=0;
-	    do {
-                ret = bdrv_pread(bs->file, s->offsets[chunk] + i,
-                                 s->compressed_chunk+i, s->lengths[chunk]-i);
-		if(ret<0 && errno==EINTR)
-		    ret=0;
-		i+=ret;
-	    } while(ret>=0 && ret+i<s->lengths[chunk]);
-
-	    if (ret != s->lengths[chunk])
-		return -1;
-
-	    s->zstream.next_in = s->compressed_chunk;
-	    s->zstream.avail_in = s->lengths[chunk];
-	    s->zstream.next_out = s->uncompressed_chunk;
-	    s->zstream.avail_out = 512*s->sectorcounts[chunk];
-	    ret = inflateReset(&s->zstream);
-	    if(ret != Z_OK)
-		return -1;
-	    ret = inflate(&s->zstream, Z_FINISH);
-	    if(ret != Z_STREAM_END || s->zstream.total_out != 512*s->sectorcounts[chunk])
-		return -1;
-	    break; }
-	case 1: /* copy */
-	    ret = bdrv_pread(bs->file, s->offsets[chunk],
-                             s->uncompressed_chunk, s->lengths[chunk]);
-	    if (ret != s->lengths[chunk])
-		return -1;
-	    break;
-	case 2: /* zero */
-	    memset(s->uncompressed_chunk, 0, 512*s->sectorcounts[chunk]);
-	    break;
-	}
-	s->current_chunk = chunk;
-    }
-    return 0;
-}
+    while (nb_sectors > 0) {
+        uint32_t chunk = search_chunk(s, sector_num);
+        uint32_t sector_offset_in_chunk;
+        int n;
 
-static int dmg_read(BlockDriverState *bs, int64_t sector_num,
-                    uint8_t *buf, int nb_sectors)
-{
-    BDRVDMGState *s = bs->opaque;
-    int i;
-
-    for(i=0;i<nb_sectors;i++) {
-	uint32_t sector_offset_in_chunk;
-	if(dmg_read_chunk(bs, sector_num+i) != 0)
-	    return -1;
-	sector_offset_in_chunk = sector_num+i-s->sectors[s->current_chunk];
-	memcpy(buf+i*512,s->uncompressed_chunk+sector_offset_in_chunk*512,512);
+        if (chunk >= s->n_chunks) {
+            return -EIO;
+        }
+        sector_offset_in_chunk = sector_num - s->sectors[chunk];
+        n = MIN(nb_sectors, s->sectorcounts[chunk] - sector_offset_in_chunk);
+
+        switch (s->types[chunk]) {
+        case 0x80000005: /* zlib compressed */
+            chunk_cache_readahead(s->cache, chunk, s->n_chunks);
+            ret = chunk_cache_get(s->cache, chunk, &data);
+            if (ret < 0) {
+                return ret;
+            }
+            memcpy(buf, data + sector_offset_in_chunk * 512, n * 512);
+            chunk_cache_put(s->cache, data);
+            break;
+        case 1: /* copy */
+            ret = bdrv_pread(bs->file,
+                             s->offsets[chunk] + sector_offset_in_chunk * 512,
+                             buf, n * 512);
+            if (ret < 0) {
+                return ret;
+            }
+            break;
+        case 2: /* zero */
+            memset(buf, 0, n * 512);
+            break;
+        }
+
+        buf += n * 512;
+        sector_num += n;
+        nb_sectors -= n;
     }
     return 0;
 }
 
-static coroutine_fn int dmg_co_read(BlockDriverState *bs, int64_t sector_num,
-                                    uint8_t *buf, int nb_sectors)
-{
-    int ret;
-    BDRVDMGState *s = bs->opaque;
-    qemu_co_mutex_lock(&s->lock);
-    ret = dmg_read(bs, sector_num, buf, nb_sectors);
-    qemu_co_mutex_unlock(&s->lock);
-    return ret;
-}
-
 static void dmg_close(BlockDriverState *bs)
 {
     BDRVDMGState *s = bs->opaque;
 
+    chunk_cache_free(s->cache);
     g_free(s->types);
     g_free(s->offsets);
     g_free(s->lengths);
     g_free(s->sectors);
     g_free(s->sectorcounts);
-    g_free(s->compressed_chunk);
-    g_free(s->uncompressed_chunk);
-
-    inflateEnd(&s->zstream);
 }
 
 static BlockDriver bdrv_dmg = {
@@ -3,7 +3,7 @@
  *
  * Copyright (C) 2012 Bharata B Rao <bharata@linux.vnet.ibm.com>
  *
- * Pipe handling mechanism in AIO implementation is derived from
+ * Completion handling mechanism in AIO implementation is derived from
  * block/rbd.c. Hence,
  *
  * Copyright (C) 2010-2011 Christian Brunner <chb@muc.de>,
@@ -17,7 +17,10 @@
  */
 #include <glusterfs/api/glfs.h>
 #include "block/block_int.h"
+#include "block/coroutine.h"
+#include "qemu/event_notifier.h"
 #include "qemu/sockets.h"
+#include "qemu/thread.h"
 #include "qemu/uri.h"
 
 typedef struct GlusterAIOCB {
@@ -25,20 +28,22 @@ typedef struct GlusterAIOCB {
     int64_t size;
     int ret;
     bool *finished;
-    QEMUBH *bh;
+    QSIMPLEQ_ENTRY(GlusterAIOCB) next;
 } GlusterAIOCB;
 
 typedef struct BDRVGlusterState {
     struct glfs *glfs;
-    int fds[2];
     struct glfs_fd *fd;
     int qemu_aio_count;
-    int event_reader_pos;
-    GlusterAIOCB *event_acb;
-} BDRVGlusterState;
 
-#define GLUSTER_FD_READ  0
-#define GLUSTER_FD_WRITE 1
+    /* Requests completed by gluster threads, protected by lock.  The event
+     * notifier is only set when the queue goes from empty to non-empty, so
+     * a burst of completions costs a single wakeup of the AioContext.
+     */
+    EventNotifier e;
+    QemuMutex lock;
+    QSIMPLEQ_HEAD(, GlusterAIOCB) completed;
+} BDRVGlusterState;
 
 typedef struct GlusterConf {
     char *server;
@@ -255,33 +260,48 @@ static void qemu_gluster_complete_aio(GlusterAIOCB *acb, BDRVGlusterState *s)
     }
 }
 
-static void qemu_gluster_aio_event_reader(void *opaque)
+static void qemu_gluster_aio_event_reader(EventNotifier *e)
 {
-    BDRVGlusterState *s = opaque;
-    ssize_t ret;
-
-    do {
-        char *p = (char *)&s->event_acb;
-
-        ret = read(s->fds[GLUSTER_FD_READ], p + s->event_reader_pos,
-                   sizeof(s->event_acb) - s->event_reader_pos);
-        if (ret > 0) {
-            s->event_reader_pos += ret;
-            if (s->event_reader_pos == sizeof(s->event_acb)) {
-                s->event_reader_pos = 0;
-                qemu_gluster_complete_aio(s->event_acb, s);
-            }
-        }
-    } while (ret < 0 && errno == EINTR);
+    BDRVGlusterState *s = container_of(e, BDRVGlusterState, e);
+    QSIMPLEQ_HEAD(, GlusterAIOCB) completed;
+    GlusterAIOCB *acb;
+
+    event_notifier_test_and_clear(e);
+
+    QSIMPLEQ_INIT(&completed);
+    qemu_mutex_lock(&s->lock);
+    QSIMPLEQ_CONCAT(&completed, &s->completed);
+    qemu_mutex_unlock(&s->lock);
+
+    while ((acb = QSIMPLEQ_FIRST(&completed)) != NULL) {
+        QSIMPLEQ_REMOVE_HEAD(&completed, next);
+        qemu_gluster_complete_aio(acb, s);
+    }
 }
 
-static int qemu_gluster_aio_flush_cb(void *opaque)
+static int qemu_gluster_aio_flush_cb(EventNotifier *e)
 {
-    BDRVGlusterState *s = opaque;
+    BDRVGlusterState *s = container_of(e, BDRVGlusterState, e);
 
     return (s->qemu_aio_count > 0);
 }
 
+static void qemu_gluster_detach_aio_context(BlockDriverState *bs)
+{
+    BDRVGlusterState *s = bs->opaque;
+
+    aio_set_event_notifier(bdrv_get_aio_context(bs), &s->e, NULL, NULL);
+}
+
+static void qemu_gluster_attach_aio_context(BlockDriverState *bs,
+                                            AioContext *new_context)
+{
+    BDRVGlusterState *s = bs->opaque;
+
+    aio_set_event_notifier(new_context, &s->e, qemu_gluster_aio_event_reader,
+                           qemu_gluster_aio_flush_cb);
+}
+
 static int qemu_gluster_open(BlockDriverState *bs, const char *filename,
     int bdrv_flags)
 {
@@ -312,14 +332,13 @@ static int qemu_gluster_open(BlockDriverState *bs, const char *filename,
         goto out;
     }
 
-    ret = qemu_pipe(s->fds);
+    ret = event_notifier_init(&s->e, false);
     if (ret < 0) {
-        ret = -errno;
         goto out;
     }
-    fcntl(s->fds[GLUSTER_FD_READ], F_SETFL, O_NONBLOCK);
-    qemu_aio_set_fd_handler(s->fds[GLUSTER_FD_READ],
-        qemu_gluster_aio_event_reader, NULL, qemu_gluster_aio_flush_cb, s);
+    qemu_mutex_init(&s->lock);
+    QSIMPLEQ_INIT(&s->completed);
+    qemu_gluster_attach_aio_context(bs, bdrv_get_aio_context(bs));
 
 out:
     qemu_gluster_gconf_free(gconf);
@@ -380,11 +399,12 @@ out:
 static void qemu_gluster_aio_cancel(BlockDriverAIOCB *blockacb)
 {
     GlusterAIOCB *acb = (GlusterAIOCB *)blockacb;
+    AioContext *ctx = bdrv_get_aio_context(acb->common.bs);
     bool finished = false;
 
     acb->finished = &finished;
     while (!finished) {
-        qemu_aio_wait();
+        aio_poll(ctx, true);
     }
 }
 
@@ -393,38 +413,51 @@ static const AIOCBInfo gluster_aiocb_info = {
     .cancel = qemu_gluster_aio_cancel,
 };
 
+/* Runs in a gluster thread; the completion itself is done by
+ * qemu_gluster_aio_event_reader() in the AioContext of the image.
+ */
 static void gluster_finish_aiocb(struct glfs_fd *fd, ssize_t ret, void *arg)
 {
     GlusterAIOCB *acb = (GlusterAIOCB *)arg;
-    BlockDriverState *bs = acb->common.bs;
-    BDRVGlusterState *s = bs->opaque;
-    int retval;
+    BDRVGlusterState *s = acb->common.bs->opaque;
+    bool kick;
 
     acb->ret = ret;
-    retval = qemu_write_full(s->fds[GLUSTER_FD_WRITE], &acb, sizeof(acb));
-    if (retval != sizeof(acb)) {
-        /*
-         * Gluster AIO callback thread failed to notify the waiting
-         * QEMU thread about IO completion.
-         *
-         * Complete this IO request and make the disk inaccessible for
-         * subsequent reads and writes.
-         */
-        error_report("Gluster failed to notify QEMU about IO completion");
-
-        qemu_mutex_lock_iothread(); /* We are in gluster thread context */
-        acb->common.cb(acb->common.opaque, -EIO);
-        qemu_aio_release(acb);
-        s->qemu_aio_count--;
-        close(s->fds[GLUSTER_FD_READ]);
-        close(s->fds[GLUSTER_FD_WRITE]);
-        qemu_aio_set_fd_handler(s->fds[GLUSTER_FD_READ], NULL, NULL, NULL,
-            NULL);
-        bs->drv = NULL; /* Make the disk inaccessible */
-        qemu_mutex_unlock_iothread();
+
+    qemu_mutex_lock(&s->lock);
+    kick = QSIMPLEQ_EMPTY(&s->completed);
+    QSIMPLEQ_INSERT_TAIL(&s->completed, acb, next);
+    qemu_mutex_unlock(&s->lock);
+
+    if (kick) {
+        event_notifier_set(&s->e);
     }
 }
 
+static GlusterAIOCB *qemu_gluster_aio_get(BlockDriverState *bs,
+        int64_t size, BlockDriverCompletionFunc *cb, void *opaque)
+{
+    BDRVGlusterState *s = bs->opaque;
+    GlusterAIOCB *acb;
+
+    acb = qemu_aio_get(&gluster_aiocb_info, bs, cb, opaque);
+    acb->size = size;
+    acb->ret = 0;
+    acb->finished = NULL;
+    s->qemu_aio_count++;
+    return acb;
+}
+
+/* Release a request that could not be submitted */
+static BlockDriverAIOCB *qemu_gluster_aio_fail(GlusterAIOCB *acb)
+{
+    BDRVGlusterState *s = acb->common.bs->opaque;
+
+    s->qemu_aio_count--;
+    qemu_aio_release(acb);
+    return NULL;
+}
+
 static BlockDriverAIOCB *qemu_gluster_aio_rw(BlockDriverState *bs,
         int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
         BlockDriverCompletionFunc *cb, void *opaque, int write)
@@ -437,13 +470,8 @@ static BlockDriverAIOCB *qemu_gluster_aio_rw(BlockDriverState *bs,
 
     offset = sector_num * BDRV_SECTOR_SIZE;
     size = nb_sectors * BDRV_SECTOR_SIZE;
-    s->qemu_aio_count++;
-
-    acb = qemu_aio_get(&gluster_aiocb_info, bs, cb, opaque);
-    acb->size = size;
-    acb->ret = 0;
-    acb->finished = NULL;
 
+    acb = qemu_gluster_aio_get(bs, size, cb, opaque);
     if (write) {
         ret = glfs_pwritev_async(s->fd, qiov->iov, qiov->niov, offset, 0,
             &gluster_finish_aiocb, acb);
@@ -453,14 +481,9 @@ static BlockDriverAIOCB *qemu_gluster_aio_rw(BlockDriverState *bs,
     }
 
     if (ret < 0) {
-        goto out;
+        return qemu_gluster_aio_fail(acb);
     }
     return &acb->common;
-
-out:
-    s->qemu_aio_count--;
-    qemu_aio_release(acb);
-    return NULL;
 }
 
 static BlockDriverAIOCB *qemu_gluster_aio_readv(BlockDriverState *bs,
@@ -484,23 +507,70 @@ static BlockDriverAIOCB *qemu_gluster_aio_flush(BlockDriverState *bs,
     GlusterAIOCB *acb;
     BDRVGlusterState *s = bs->opaque;
 
-    acb = qemu_aio_get(&gluster_aiocb_info, bs, cb, opaque);
-    acb->size = 0;
-    acb->ret = 0;
-    acb->finished = NULL;
-    s->qemu_aio_count++;
-
+    acb = qemu_gluster_aio_get(bs, 0, cb, opaque);
     ret = glfs_fsync_async(s->fd, &gluster_finish_aiocb, acb);
     if (ret < 0) {
-        goto out;
+        return qemu_gluster_aio_fail(acb);
     }
     return &acb->common;
+}
 
-out:
-    s->qemu_aio_count--;
-    qemu_aio_release(acb);
-    return NULL;
+#ifdef CONFIG_GLUSTERFS_DISCARD
+static BlockDriverAIOCB *qemu_gluster_aio_discard(BlockDriverState *bs,
+        int64_t sector_num, int nb_sectors, BlockDriverCompletionFunc *cb,
+        void *opaque)
+{
+    int ret;
+    GlusterAIOCB *acb;
+    BDRVGlusterState *s = bs->opaque;
+    size_t size = nb_sectors * BDRV_SECTOR_SIZE;
+    off_t offset = sector_num * BDRV_SECTOR_SIZE;
+
+    /* discard returns 0 on success, so the size is not checked */
+    acb = qemu_gluster_aio_get(bs, 0, cb, opaque);
+    ret = glfs_discard_async(s->fd, offset, size, &gluster_finish_aiocb, acb);
+    if (ret < 0) {
+        return qemu_gluster_aio_fail(acb);
+    }
+    return &acb->common;
+}
+#endif
+
+#ifdef CONFIG_GLUSTERFS_ZEROFILL
+typedef struct GlusterCoData {
+    Coroutine *co;
+    int ret;
+} GlusterCoData;
+
+static void qemu_gluster_co_complete(void *opaque, int ret)
+{
+    GlusterCoData *data = opaque;
+
+    data->ret = ret;
+    qemu_coroutine_enter(data->co, NULL);
+}
+
+static int coroutine_fn qemu_gluster_co_write_zeroes(BlockDriverState *bs,
+        int64_t sector_num, int nb_sectors, BdrvRequestFlags flags)
+{
+    int ret;
+    GlusterAIOCB *acb;
+    BDRVGlusterState *s = bs->opaque;
+    GlusterCoData data = { .co = qemu_coroutine_self() };
+    off_t size = nb_sectors * BDRV_SECTOR_SIZE;
+    off_t offset = sector_num * BDRV_SECTOR_SIZE;
+
+    acb = qemu_gluster_aio_get(bs, 0, qemu_gluster_co_complete, &data);
+    ret = glfs_zerofill_async(s->fd, offset, size, &gluster_finish_aiocb, acb);
+    if (ret < 0) {
+        qemu_gluster_aio_fail(acb);
+        return -errno;
+    }
+
+    qemu_coroutine_yield();
+    return data.ret;
 }
+#endif
 
 static int64_t qemu_gluster_getlength(BlockDriverState *bs)
 {
@@ -533,9 +603,9 @@ static void qemu_gluster_close(BlockDriverState *bs)
 {
     BDRVGlusterState *s = bs->opaque;
 
-    close(s->fds[GLUSTER_FD_READ]);
-    close(s->fds[GLUSTER_FD_WRITE]);
-    qemu_aio_set_fd_handler(s->fds[GLUSTER_FD_READ], NULL, NULL, NULL, NULL);
+    qemu_gluster_detach_aio_context(bs);
+    event_notifier_cleanup(&s->e);
+    qemu_mutex_destroy(&s->lock);
 
     if (s->fd) {
         glfs_close(s->fd);
@@ -565,6 +635,14 @@ static BlockDriver bdrv_gluster = {
     .bdrv_aio_readv               = qemu_gluster_aio_readv,
     .bdrv_aio_writev              = qemu_gluster_aio_writev,
     .bdrv_aio_flush               = qemu_gluster_aio_flush,
+#ifdef CONFIG_GLUSTERFS_DISCARD
+    .bdrv_aio_discard             = qemu_gluster_aio_discard,
+#endif
+#ifdef CONFIG_GLUSTERFS_ZEROFILL
+    .bdrv_co_write_zeroes         = qemu_gluster_co_write_zeroes,
+#endif
+    .bdrv_detach_aio_context      = qemu_gluster_detach_aio_context,
+    .bdrv_attach_aio_context      = qemu_gluster_attach_aio_context,
     .create_options               = qemu_gluster_create_options,
 };
 
@@ -580,6 +658,14 @@ static BlockDriver bdrv_gluster_tcp = {
     .bdrv_aio_readv               = qemu_gluster_aio_readv,
     .bdrv_aio_writev              = qemu_gluster_aio_writev,
     .bdrv_aio_flush               = qemu_gluster_aio_flush,
+#ifdef CONFIG_GLUSTERFS_DISCARD
+    .bdrv_aio_discard             = qemu_gluster_aio_discard,
+#endif
+#ifdef CONFIG_GLUSTERFS_ZEROFILL
+    .bdrv_co_write_zeroes         = qemu_gluster_co_write_zeroes,
+#endif
+    .bdrv_detach_aio_context      = qemu_gluster_detach_aio_context,
+    .bdrv_attach_aio_context      = qemu_gluster_attach_aio_context,
     .create_options               = qemu_gluster_create_options,
 };
 
@@ -595,6 +681,14 @@ static BlockDriver bdrv_gluster_unix = {
     .bdrv_aio_readv               = qemu_gluster_aio_readv,
     .bdrv_aio_writev              = qemu_gluster_aio_writev,
     .bdrv_aio_flush               = qemu_gluster_aio_flush,
+#ifdef CONFIG_GLUSTERFS_DISCARD
+    .bdrv_aio_discard             = qemu_gluster_aio_discard,
+#endif
+#ifdef CONFIG_GLUSTERFS_ZEROFILL
+    .bdrv_co_write_zeroes         = qemu_gluster_co_write_zeroes,
+#endif
+    .bdrv_detach_aio_context      = qemu_gluster_detach_aio_context,
+    .bdrv_attach_aio_context      = qemu_gluster_attach_aio_context,
     .create_options               = qemu_gluster_create_options,
 };
 
@@ -610,6 +704,14 @@ static BlockDriver bdrv_gluster_rdma = {
     .bdrv_aio_readv               = qemu_gluster_aio_readv,
     .bdrv_aio_writev              = qemu_gluster_aio_writev,
     .bdrv_aio_flush               = qemu_gluster_aio_flush,
+#ifdef CONFIG_GLUSTERFS_DISCARD
+    .bdrv_aio_discard             = qemu_gluster_aio_discard,
+#endif
+#ifdef CONFIG_GLUSTERFS_ZEROFILL
+    .bdrv_co_write_zeroes         = qemu_gluster_co_write_zeroes,
+#endif
+    .bdrv_detach_aio_context      = qemu_gluster_detach_aio_context,
+    .bdrv_attach_aio_context      = qemu_gluster_attach_aio_context,
     .create_options               = qemu_gluster_create_options,
 };
 
@@ -0,0 +1,430 @@
+/*
+ * Linux io_uring support.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu-common.h"
+#include "block/aio.h"
+#include "block/block.h"
+#include "qemu/queue.h"
+#include "qemu/atomic.h"
+#include "block/raw-aio.h"
+#include "qemu/event_notifier.h"
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+/*
+ * Ring size (per-device), which is also the number of requests that can be
+ * in flight at a time.  Requests beyond that wait in LuringState.queue until
+ * completions free some room.  The completion ring is twice as large, so it
+ * cannot overflow.
+ */
+#define MAX_ENTRIES 128
+
+typedef struct LuringAIOCB {
+    BlockDriverAIOCB common;
+    struct LuringState *s;
+    QEMUIOVector *qiov;
+    int fd;
+    int type;
+    off_t offset;
+    size_t nbytes;
+    ssize_t ret;
+    bool cancelled;             /* luring_cancel() waits for it */
+    bool done;
+    QSIMPLEQ_ENTRY(LuringAIOCB) next;
+} LuringAIOCB;
+
+typedef struct LuringState {
+    int ring_fd;
+    EventNotifier e;            /* signalled by the kernel on completion */
+    int count;                  /* requests queued or in flight */
+    unsigned int in_flight;     /* requests in the submission ring or kernel */
+    unsigned int sq_pending;    /* entries not yet passed to io_uring_enter */
+    int plugged;                /* nesting depth of luring_io_plug() */
+
+    /* Requests waiting for room in the ring */
+    QSIMPLEQ_HEAD(, LuringAIOCB) queue;
+
+    /* Submission ring, shared with the kernel */
+    void *sq_ring;
+    size_t sq_ring_size;
+    volatile unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_array;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned int sq_local_tail;
+
+    /* Completion ring, shared with the kernel */
+    void *cq_ring;
+    size_t cq_ring_size;
+    volatile unsigned int *cq_head;
+    volatile unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    struct io_uring_cqe *cqes;
+} LuringState;
+
+static int luring_enter(LuringState *s, unsigned int to_submit,
+                        unsigned int min_complete, unsigned int flags)
+{
+    int ret;
+
+    do {
+        ret = syscall(__NR_io_uring_enter, s->ring_fd, to_submit,
+                      min_complete, flags, NULL, 0);
+    } while (ret < 0 && errno == EINTR);
+
+    return ret < 0 ? -errno : ret;
+}
+
+/* Publish the new submission ring entries and hand them to the kernel */
+static void luring_submit_pending(LuringState *s)
+{
+    int ret;
+
+    if (s->sq_pending == 0) {
+        return;
+    }
+
+    smp_wmb();
+    *s->sq_tail = s->sq_local_tail;
+
+    ret = luring_enter(s, s->sq_pending, 0, 0);
+    if (ret == -EAGAIN || ret == -EBUSY) {
+        /* Retried from the completion handler */
+        if (s->in_flight == s->sq_pending) {
+            event_notifier_set(&s->e);
+        }
+        return;
+    }
+    if (ret < 0) {
+        fprintf(stderr, "io_uring_enter failed: %s\n", strerror(-ret));
+        abort();
+    }
+    s->sq_pending -= ret;
+}
+
+static void luring_prep_sqe(LuringState *s, LuringAIOCB *acb)
+{
+    unsigned int idx = s->sq_local_tail & *s->sq_mask;
+    struct io_uring_sqe *sqe = &s->sqes[idx];
+
+    memset(sqe, 0, sizeof(*sqe));
+    switch (acb->type) {
+    case QEMU_AIO_WRITE:
+        sqe->opcode = IORING_OP_WRITEV;
+        sqe->addr = (uintptr_t)acb->qiov->iov;
+        sqe->len = acb->qiov->niov;
+        break;
+    case QEMU_AIO_READ:
+        sqe->opcode = IORING_OP_READV;
+        sqe->addr = (uintptr_t)acb->qiov->iov;
+        sqe->len = acb->qiov->niov;
+        break;
+    case QEMU_AIO_FLUSH:
+        sqe->opcode = IORING_OP_FSYNC;
+        sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+        break;
+    default:
+        abort();
+    }
+    sqe->fd = acb->fd;
+    sqe->off = acb->offset;
+    sqe->user_data = (uintptr_t)acb;
+
+    s->sq_array[idx] = idx;
+    s->sq_local_tail++;
+    s->sq_pending++;
+    s->in_flight++;
+}
+
+/* Move waiting requests into the ring as long as there is room */
+static void luring_fill_ring(LuringState *s)
+{
+    LuringAIOCB *acb;
+
+    while (s->in_flight < MAX_ENTRIES &&
+           (acb = QSIMPLEQ_FIRST(&s->queue)) != NULL) {
+        QSIMPLEQ_REMOVE_HEAD(&s->queue, next);
+        luring_prep_sqe(s, acb);
+    }
+}
+
+static void luring_queue_plug(LuringState *s)
+{
+    s->plugged++;
+}
+
+static void luring_queue_unplug(LuringState *s)
+{
+    assert(s->plugged > 0);
+    if (--s->plugged == 0) {
+        luring_fill_ring(s);
+        luring_submit_pending(s);
+    }
+}
+
+/*
+ * Completes an AIO request (calls the callback and frees the ACB).
+ */
+static void luring_process_completion(LuringState *s, LuringAIOCB *acb)
+{
+    int ret;
+
+    s->count--;
+
+    if (acb->cancelled) {
+        /* luring_cancel() releases it */
+        acb->done = true;
+        return;
+    }
+
+    ret = acb->ret;
+    if (ret == acb->nbytes) {
+        ret = 0;
+    } else if (ret >= 0) {
+        /* Short reads mean EOF, pad with zeros. */
+        if (acb->type == QEMU_AIO_READ) {
+            qemu_iovec_memset(acb->qiov, ret, 0, acb->qiov->size - ret);
+            ret = 0;
+        } else {
+            ret = -EINVAL;
+        }
+    }
+
+    acb->common.cb(acb->common.opaque, ret);
+    qemu_aio_release(acb);
+}
+
+static void luring_reap(LuringState *s)
+{
+    unsigned int head;
+    struct io_uring_cqe *cqe;
+    LuringAIOCB *acb;
+
+    /* Callbacks may cancel other requests, which reaps from here as well */
+    while ((head = *s->cq_head) != *s->cq_tail) {
+        smp_rmb();
+        cqe = &s->cqes[head & *s->cq_mask];
+        acb = (LuringAIOCB *)(uintptr_t)cqe->user_data;
+        acb->ret = cqe->res;
+
+        /* Give the entry back before the callback can submit more */
+        smp_mb();
+        *s->cq_head = ++head;
+        s->in_flight--;
+
+        luring_process_completion(s, acb);
+    }
+}
+
+static void luring_completion_cb(EventNotifier *e)
+{
+    LuringState *s = container_of(e, LuringState, e);
+
+    /* Requests submitted by the callbacks go out in a single system call,
+     * together with those that waited for room in the ring
+     */
+    luring_queue_plug(s);
+    while (event_notifier_test_and_clear(&s->e)) {
+        luring_reap(s);
+    }
+    luring_queue_unplug(s);
+}
+
+static int luring_flush_cb(EventNotifier *e)
+{
+    LuringState *s = container_of(e, LuringState, e);
+
+    /* Somebody waits for I/O, do not keep requests back for batching */
+    luring_fill_ring(s);
+    luring_submit_pending(s);
+    return (s->count > 0) ? 1 : 0;
+}
+
+static void luring_cancel(BlockDriverAIOCB *blockacb)
+{
+    LuringAIOCB *acb = (LuringAIOCB *)blockacb;
+    LuringState *s = acb->s;
+    LuringAIOCB *p;
+
+    QSIMPLEQ_FOREACH(p, &s->queue, next) {
+        if (p == acb) {
+            QSIMPLEQ_REMOVE(&s->queue, acb, LuringAIOCB, next);
+            s->count--;
+            qemu_aio_release(acb);
+            return;
+        }
+    }
+
+    /*
+     * The request is in the ring already, wait for it to finish.  Its
+     * callback is not called.
+     */
+    acb->cancelled = true;
+    while (!acb->done) {
+        luring_submit_pending(s);
+        if (s->in_flight > s->sq_pending) {
+            luring_enter(s, 0, 1, IORING_ENTER_GETEVENTS);
+        }
+        luring_reap(s);
+    }
+    qemu_aio_release(acb);
+}
+
+static const AIOCBInfo luring_aiocb_info = {
+    .aiocb_size         = sizeof(LuringAIOCB),
+    .cancel             = luring_cancel,
+};
+
+BlockDriverAIOCB *luring_submit(BlockDriverState *bs, void *aio_ctx, int fd,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque, int type)
+{
+    LuringState *s = aio_ctx;
+    LuringAIOCB *acb;
+
+    acb = qemu_aio_get(&luring_aiocb_info, bs, cb, opaque);
+    acb->s = s;
+    acb->fd = fd;
+    acb->type = type;
+    acb->qiov = qiov;
+    acb->offset = sector_num * BDRV_SECTOR_SIZE;
+    acb->nbytes = nb_sectors * BDRV_SECTOR_SIZE;
+    acb->ret = -EINPROGRESS;
+    acb->cancelled = false;
+    acb->done = false;
+    s->count++;
+
+    QSIMPLEQ_INSERT_TAIL(&s->queue, acb, next);
+    if (!s->plugged) {
+        luring_fill_ring(s);
+        luring_submit_pending(s);
+    }
+    return &acb->common;
+}
+
+void luring_io_plug(BlockDriverState *bs, void *aio_ctx)
+{
+    luring_queue_plug(aio_ctx);
+}
+
+void luring_io_unplug(BlockDriverState *bs, void *aio_ctx)
+{
+    luring_queue_unplug(aio_ctx);
+}
+
+void luring_detach_aio_context(void *s_, AioContext *old_context)
+{
+    LuringState *s = s_;
+
+    aio_set_event_notifier(old_context, &s->e, NULL, NULL);
+}
+
+void luring_attach_aio_context(void *s_, AioContext *new_context)
+{
+    LuringState *s = s_;
+
+    aio_set_event_notifier(new_context, &s->e, luring_completion_cb,
+                           luring_flush_cb);
+}
+
+static void luring_unmap(LuringState *s)
+{
+    if (s->sq_ring) {
+        munmap(s->sq_ring, s->sq_ring_size);
+    }
+    if (s->sqes) {
+        munmap(s->sqes, s->sqes_size);
+    }
+    if (s->cq_ring) {
+        munmap(s->cq_ring, s->cq_ring_size);
+    }
+}
+
+static void *luring_map(LuringState *s, size_t size, off_t offset)
+{
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, s->ring_fd, offset);
+
+    return p == MAP_FAILED ? NULL : p;
+}
+
+/* The completion notifier is registered in the main loop, use
+ * luring_attach_aio_context() to move it elsewhere */
+void *luring_init(void)
+{
+    struct io_uring_params p;
+    LuringState *s;
+    int efd;
+
+    s = g_malloc0(sizeof(*s));
+    QSIMPLEQ_INIT(&s->queue);
+
+    memset(&p, 0, sizeof(p));
+    s->ring_fd = syscall(__NR_io_uring_setup, MAX_ENTRIES, &p);
+    if (s->ring_fd < 0) {
+        goto out_free_state;
+    }
+
+    s->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    s->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    s->cq_ring_size = p.cq_off.cqes +
+                      p.cq_entries * sizeof(struct io_uring_cqe);
+
+    s->sq_ring = luring_map(s, s->sq_ring_size, IORING_OFF_SQ_RING);
+    s->sqes = luring_map(s, s->sqes_size, IORING_OFF_SQES);
+    s->cq_ring = luring_map(s, s->cq_ring_size, IORING_OFF_CQ_RING);
+    if (!s->sq_ring || !s->sqes || !s->cq_ring) {
+        goto out_unmap;
+    }
+
+    s->sq_tail = s->sq_ring + p.sq_off.tail;
+    s->sq_mask = s->sq_ring + p.sq_off.ring_mask;
+    s->sq_array = s->sq_ring + p.sq_off.array;
+    s->sq_local_tail = *s->sq_tail;
+    s->cq_head = s->cq_ring + p.cq_off.head;
+    s->cq_tail = s->cq_ring + p.cq_off.tail;
+    s->cq_mask = s->cq_ring + p.cq_off.ring_mask;
+    s->cqes = s->cq_ring + p.cq_off.cqes;
+
+    if (event_notifier_init(&s->e, false) < 0) {
+        goto out_unmap;
+    }
+
+    efd = event_notifier_get_fd(&s->e);
+    if (syscall(__NR_io_uring_register, s->ring_fd, IORING_REGISTER_EVENTFD,
+                &efd, 1) < 0) {
+        goto out_close_efd;
+    }
+
+    qemu_aio_set_event_notifier(&s->e, luring_completion_cb,
+                                luring_flush_cb);
+
+    return s;
+
+out_close_efd:
+    event_notifier_cleanup(&s->e);
+out_unmap:
+    luring_unmap(s);
+    close(s->ring_fd);
+out_free_state:
+    g_free(s);
+    return NULL;
+}
+
+void luring_cleanup(void *s_, AioContext *ctx)
+{
+    LuringState *s = s_;
+
+    assert(s->count == 0);
+    aio_set_event_notifier(ctx, &s->e, NULL, NULL);
+    event_notifier_cleanup(&s->e);
+    luring_unmap(s);
+    close(s->ring_fd);
+    g_free(s);
+}
@@ -41,21 +41,42 @@
 #include <hw/scsi-defs.h>
 #endif
 
-typedef struct IscsiLun {
+#define ISCSI_MAX_SESSIONS 8
+
+typedef struct IscsiLun IscsiLun;
+
+typedef struct IscsiSession {
+    IscsiLun *iscsilun;
+    struct iscsi_context *iscsi;
+    int events;
+} IscsiSession;
+
+struct IscsiLun {
+    /* the first session, used for everything but data transfers */
     struct iscsi_context *iscsi;
     int lun;
     enum scsi_inquiry_peripheral_device_type type;
     int block_size;
     uint64_t num_blocks;
-    int events;
     QEMUTimer *nop_timer;
-} IscsiLun;
+    bool lbpme;
+    bool lbprz;
+    bool has_write_same;
+
+    /* requests are spread over the sessions by queue length */
+    IscsiSession sessions[ISCSI_MAX_SESSIONS];
+    int nb_sessions;
+
+    /* while plugged, the fd handlers are only updated at unplug time */
+    int plugged;
+};
 
 typedef struct IscsiAIOCB {
     BlockDriverAIOCB common;
     QEMUIOVector *qiov;
     QEMUBH *bh;
     IscsiLun *iscsilun;
+    IscsiSession *session;
     struct scsi_task *task;
     uint8_t *buf;
     int status;
@@ -126,7 +147,7 @@ iscsi_aio_cancel(BlockDriverAIOCB *blockacb)
     acb->canceled = 1;
 
     /* send a task mgmt call to the target to cancel the task on the target */
-    iscsi_task_mgmt_abort_task_async(iscsilun->iscsi, acb->task,
+    iscsi_task_mgmt_abort_task_async(acb->session->iscsi, acb->task,
                                      iscsi_abort_task_cb, acb);
 
     while (acb->status == -EINPROGRESS) {
@@ -145,50 +166,99 @@ static void iscsi_process_write(void *arg);
 
 static int iscsi_process_flush(void *arg)
 {
-    IscsiLun *iscsilun = arg;
+    IscsiSession *session = arg;
 
-    return iscsi_queue_length(iscsilun->iscsi) > 0;
+    return iscsi_queue_length(session->iscsi) > 0;
 }
 
 static void
-iscsi_set_events(IscsiLun *iscsilun)
+iscsi_set_events(IscsiSession *session)
 {
-    struct iscsi_context *iscsi = iscsilun->iscsi;
+    struct iscsi_context *iscsi = session->iscsi;
     int ev;
 
     /* We always register a read handler.  */
     ev = POLLIN;
     ev |= iscsi_which_events(iscsi);
-    if (ev != iscsilun->events) {
+    if (ev != session->events) {
         qemu_aio_set_fd_handler(iscsi_get_fd(iscsi),
                       iscsi_process_read,
                       (ev & POLLOUT) ? iscsi_process_write : NULL,
                       iscsi_process_flush,
-                      iscsilun);
+                      session);
 
     }
 
-    iscsilun->events = ev;
+    session->events = ev;
+}
+
+/* Called after queueing a command; libiscsi sends it once the fd is
+ * writable, so all commands queued while plugged go out together.
+ */
+static void
+iscsi_submitted(IscsiSession *session)
+{
+    if (!session->iscsilun->plugged) {
+        iscsi_set_events(session);
+    }
+}
+
+/* Pick the session with the fewest commands in flight */
+static IscsiSession *
+iscsi_get_session(IscsiLun *iscsilun)
+{
+    IscsiSession *best = &iscsilun->sessions[0];
+    int i;
+
+    for (i = 1; i < iscsilun->nb_sessions; i++) {
+        IscsiSession *session = &iscsilun->sessions[i];
+
+        if (iscsi_queue_length(session->iscsi) <
+            iscsi_queue_length(best->iscsi)) {
+            best = session;
+        }
+    }
+    return best;
 }
 
 static void
 iscsi_process_read(void *arg)
 {
-    IscsiLun *iscsilun = arg;
-    struct iscsi_context *iscsi = iscsilun->iscsi;
+    IscsiSession *session = arg;
+    struct iscsi_context *iscsi = session->iscsi;
 
     iscsi_service(iscsi, POLLIN);
-    iscsi_set_events(iscsilun);
+    iscsi_set_events(session);
 }
 
 static void
 iscsi_process_write(void *arg)
 {
-    IscsiLun *iscsilun = arg;
-    struct iscsi_context *iscsi = iscsilun->iscsi;
+    IscsiSession *session = arg;
+    struct iscsi_context *iscsi = session->iscsi;
 
     iscsi_service(iscsi, POLLOUT);
-    iscsi_set_events(iscsilun);
+    iscsi_set_events(session);
+}
+
+static void iscsi_io_plug(BlockDriverState *bs)
+{
+    IscsiLun *iscsilun = bs->opaque;
+
+    iscsilun->plugged++;
+}
+
+static void iscsi_io_unplug(BlockDriverState *bs)
+{
+    IscsiLun *iscsilun = bs->opaque;
+    int i;
+
+    assert(iscsilun->plugged > 0);
+    if (--iscsilun->plugged == 0) {
+        for (i = 0; i < iscsilun->nb_sessions; i++) {
+            iscsi_set_events(&iscsilun->sessions[i]);
+        }
+    }
 }
 
 
@@ -222,6 +292,11 @@ static int64_t sector_qemu2lun(int64_t sector, IscsiLun *iscsilun)
     return sector * BDRV_SECTOR_SIZE / iscsilun->block_size;
 }
 
+static int64_t sector_lun2qemu(int64_t lba, IscsiLun *iscsilun)
+{
+    return lba * iscsilun->block_size / BDRV_SECTOR_SIZE;
+}
+
 static BlockDriverAIOCB *
 iscsi_aio_writev(BlockDriverState *bs, int64_t sector_num,
                  QEMUIOVector *qiov, int nb_sectors,
@@ -229,7 +304,8 @@ iscsi_aio_writev(BlockDriverState *bs, int64_t sector_num,
                  void *opaque)
 {
     IscsiLun *iscsilun = bs->opaque;
-    struct iscsi_context *iscsi = iscsilun->iscsi;
+    IscsiSession *session = iscsi_get_session(iscsilun);
+    struct iscsi_context *iscsi = session->iscsi;
     IscsiAIOCB *acb;
     size_t size;
     uint32_t num_sectors;
@@ -243,6 +319,7 @@ iscsi_aio_writev(BlockDriverState *bs, int64_t sector_num,
     trace_iscsi_aio_writev(iscsi, sector_num, nb_sectors, opaque, acb);
 
     acb->iscsilun = iscsilun;
+    acb->session  = session;
     acb->qiov     = qiov;
 
     acb->canceled   = 0;
@@ -307,7 +384,7 @@ iscsi_aio_writev(BlockDriverState *bs, int64_t sector_num,
     scsi_task_set_iov_out(acb->task, (struct scsi_iovec*) acb->qiov->iov, acb->qiov->niov);
 #endif
 
-    iscsi_set_events(iscsilun);
+    iscsi_submitted(session);
 
     return &acb->common;
 }
@@ -341,7 +418,8 @@ iscsi_aio_readv(BlockDriverState *bs, int64_t sector_num,
                 void *opaque)
 {
     IscsiLun *iscsilun = bs->opaque;
-    struct iscsi_context *iscsi = iscsilun->iscsi;
+    IscsiSession *session = iscsi_get_session(iscsilun);
+    struct iscsi_context *iscsi = session->iscsi;
     IscsiAIOCB *acb;
     size_t qemu_read_size;
 #if !defined(LIBISCSI_FEATURE_IOVECTOR)
@@ -357,6 +435,7 @@ iscsi_aio_readv(BlockDriverState *bs, int64_t sector_num,
     trace_iscsi_aio_readv(iscsi, sector_num, nb_sectors, opaque, acb);
 
     acb->iscsilun = iscsilun;
+    acb->session  = session;
     acb->qiov     = qiov;
 
     acb->canceled    = 0;
@@ -429,7 +508,7 @@ iscsi_aio_readv(BlockDriverState *bs, int64_t sector_num,
     }
 #endif
 
-    iscsi_set_events(iscsilun);
+    iscsi_submitted(session);
 
     return &acb->common;
 }
@@ -460,12 +539,14 @@ iscsi_aio_flush(BlockDriverState *bs,
                 BlockDriverCompletionFunc *cb, void *opaque)
 {
     IscsiLun *iscsilun = bs->opaque;
-    struct iscsi_context *iscsi = iscsilun->iscsi;
+    IscsiSession *session = iscsi_get_session(iscsilun);
+    struct iscsi_context *iscsi = session->iscsi;
     IscsiAIOCB *acb;
 
     acb = qemu_aio_get(&iscsi_aiocb_info, bs, cb, opaque);
 
     acb->iscsilun = iscsilun;
+    acb->session  = session;
     acb->canceled   = 0;
     acb->bh         = NULL;
     acb->status     = -EINPROGRESS;
@@ -482,7 +563,7 @@ iscsi_aio_flush(BlockDriverState *bs,
         return NULL;
     }
 
-    iscsi_set_events(iscsilun);
+    iscsi_submitted(session);
 
     return &acb->common;
 }
@@ -513,13 +594,15 @@ iscsi_aio_discard(BlockDriverState *bs,
                   BlockDriverCompletionFunc *cb, void *opaque)
 {
     IscsiLun *iscsilun = bs->opaque;
-    struct iscsi_context *iscsi = iscsilun->iscsi;
+    IscsiSession *session = iscsi_get_session(iscsilun);
+    struct iscsi_context *iscsi = session->iscsi;
     IscsiAIOCB *acb;
     struct unmap_list list[1];
 
     acb = qemu_aio_get(&iscsi_aiocb_info, bs, cb, opaque);
 
     acb->iscsilun = iscsilun;
+    acb->session  = session;
     acb->canceled   = 0;
     acb->bh         = NULL;
     acb->status     = -EINPROGRESS;
@@ -539,11 +622,174 @@ iscsi_aio_discard(BlockDriverState *bs,
         return NULL;
     }
 
-    iscsi_set_events(iscsilun);
+    iscsi_submitted(session);
 
     return &acb->common;
 }
 
+#if defined(SCSI_SENSE_ASCQ_CAPACITY_DATA_HAS_CHANGED)
+/* libiscsi is recent enough for WRITE SAME(16) and the LBP fields */
+typedef struct IscsiCoTask {
+    Coroutine *co;
+    int status;
+    bool complete;
+    struct scsi_task *task;
+    QEMUBH *bh;
+} IscsiCoTask;
+
+static void iscsi_co_task_bh(void *opaque)
+{
+    IscsiCoTask *iTask = opaque;
+
+    qemu_bh_delete(iTask->bh);
+    qemu_coroutine_enter(iTask->co, NULL);
+}
+
+/* Runs inside iscsi_service(), so resume the coroutine from a bottom half */
+static void
+iscsi_co_task_cb(struct iscsi_context *iscsi, int status,
+                 void *command_data, void *opaque)
+{
+    IscsiCoTask *iTask = opaque;
+
+    iTask->status = status;
+    iTask->complete = true;
+    iTask->bh = qemu_bh_new(iscsi_co_task_bh, iTask);
+    qemu_bh_schedule(iTask->bh);
+}
+
+static int coroutine_fn
+iscsi_co_write_zeroes(BlockDriverState *bs, int64_t sector_num,
+                      int nb_sectors, BdrvRequestFlags flags)
+{
+    IscsiLun *iscsilun = bs->opaque;
+    IscsiSession *session = iscsi_get_session(iscsilun);
+    struct iscsi_context *iscsi = session->iscsi;
+    IscsiCoTask iTask = { .co = qemu_coroutine_self() };
+    uint8_t *zero_block;
+    uint64_t lba;
+    uint32_t nb_blocks;
+    int unmap;
+    int ret;
+
+    if (!iscsilun->has_write_same) {
+        return -ENOTSUP;
+    }
+    if ((sector_num * BDRV_SECTOR_SIZE) % iscsilun->block_size ||
+        (nb_sectors * BDRV_SECTOR_SIZE) % iscsilun->block_size) {
+        return -ENOTSUP;
+    }
+
+    lba = sector_qemu2lun(sector_num, iscsilun);
+    nb_blocks = nb_sectors * BDRV_SECTOR_SIZE / iscsilun->block_size;
+
+    /* Only unmap when unmapped blocks are known to read as zeroes */
+    unmap = (flags & BDRV_REQ_MAY_UNMAP) && iscsilun->lbpme &&
+            iscsilun->lbprz;
+
+    zero_block = g_malloc0(iscsilun->block_size);
+    iTask.task = iscsi_writesame16_task(iscsi, iscsilun->lun, lba,
+                                        zero_block, iscsilun->block_size,
+                                        nb_blocks, 0, unmap, 0, 0,
+                                        iscsi_co_task_cb, &iTask);
+    if (iTask.task == NULL) {
+        g_free(zero_block);
+        return -ENOMEM;
+    }
+
+    while (!iTask.complete) {
+        iscsi_set_events(session);
+        qemu_coroutine_yield();
+    }
+
+    if (iTask.status == SCSI_STATUS_GOOD) {
+        ret = 0;
+    } else if (iTask.task->status == SCSI_STATUS_CHECK_CONDITION &&
+               iTask.task->sense.key == SCSI_SENSE_ILLEGAL_REQUEST &&
+               iTask.task->sense.ascq ==
+                   SCSI_SENSE_ASCQ_INVALID_OPERATION_CODE) {
+        /* WRITE SAME is not supported by the target */
+        iscsilun->has_write_same = false;
+        ret = -ENOTSUP;
+    } else {
+        error_report("iSCSI: Failed to write same on iSCSI lun. %s",
+                     iscsi_get_error(iscsi));
+        ret = -EIO;
+    }
+
+    scsi_free_scsi_task(iTask.task);
+    g_free(zero_block);
+    return ret;
+}
+
+#if defined(LIBISCSI_FEATURE_IOVECTOR)
+static int64_t coroutine_fn
+iscsi_co_get_block_status(BlockDriverState *bs, int64_t sector_num,
+                          int nb_sectors, int *pnum)
+{
+    IscsiLun *iscsilun = bs->opaque;
+    IscsiSession *session = iscsi_get_session(iscsilun);
+    struct iscsi_context *iscsi = session->iscsi;
+    IscsiCoTask iTask = { .co = qemu_coroutine_self() };
+    struct scsi_get_lba_status *lbas;
+    struct scsi_lba_status_descriptor *lbasd;
+    int64_t ret, end;
+    uint64_t lba;
+
+    /* Without thin provisioning everything is mapped */
+    ret = BDRV_BLOCK_DATA | BDRV_BLOCK_OFFSET_VALID |
+          (sector_num << BDRV_SECTOR_BITS);
+    *pnum = nb_sectors;
+    if (!iscsilun->lbpme) {
+        return ret;
+    }
+
+    lba = sector_qemu2lun(sector_num, iscsilun);
+    iTask.task = iscsi_get_lba_status_task(iscsi, iscsilun->lun, lba,
+                                           8 + 16, iscsi_co_task_cb, &iTask);
+    if (iTask.task == NULL) {
+        return -ENOMEM;
+    }
+
+    while (!iTask.complete) {
+        iscsi_set_events(session);
+        qemu_coroutine_yield();
+    }
+
+    if (iTask.status != SCSI_STATUS_GOOD) {
+        /* Not supported by the target, or failed; report the range mapped */
+        goto out;
+    }
+
+    lbas = scsi_datain_unmarshall(iTask.task);
+    if (lbas == NULL || lbas->num_descriptors == 0) {
+        goto out;
+    }
+
+    lbasd = &lbas->descriptors[0];
+    if (lbasd->lba > lba) {
+        goto out;
+    }
+
+    end = sector_lun2qemu(lbasd->lba + lbasd->num_blocks, iscsilun);
+    if (end <= sector_num) {
+        goto out;
+    }
+    *pnum = MIN(end - sector_num, nb_sectors);
+
+    /* Deallocated blocks only have known contents if they read as zeroes */
+    if (lbasd->provisioning != SCSI_PROVISIONING_TYPE_MAPPED &&
+        iscsilun->lbprz) {
+        ret = BDRV_BLOCK_ZERO;
+    }
+
+out:
+    scsi_free_scsi_task(iTask.task);
+    return ret;
+}
+#endif
+#endif
+
 #ifdef __linux__
 static void
 iscsi_aio_ioctl_cb(struct iscsi_context *iscsi, int status,
@@ -587,7 +833,8 @@ static BlockDriverAIOCB *iscsi_aio_ioctl(BlockDriverState *bs,
         BlockDriverCompletionFunc *cb, void *opaque)
 {
     IscsiLun *iscsilun = bs->opaque;
-    struct iscsi_context *iscsi = iscsilun->iscsi;
+    IscsiSession *session = &iscsilun->sessions[0];
+    struct iscsi_context *iscsi = session->iscsi;
     struct iscsi_data data;
     IscsiAIOCB *acb;
 
@@ -596,6 +843,7 @@ static BlockDriverAIOCB *iscsi_aio_ioctl(BlockDriverState *bs,
     acb = qemu_aio_get(&iscsi_aiocb_info, bs, cb, opaque);
 
     acb->iscsilun = iscsilun;
+    acb->session  = session;
     acb->canceled    = 0;
     acb->bh          = NULL;
     acb->status      = -EINPROGRESS;
@@ -648,7 +896,7 @@ static BlockDriverAIOCB *iscsi_aio_ioctl(BlockDriverState *bs,
                                      acb->ioh->dxferp);
     }
 
-    iscsi_set_events(iscsilun);
+    iscsi_submitted(session);
 
     return &acb->common;
 }
@@ -807,76 +1055,137 @@ static char *parse_initiator_name(const char *target)
 static void iscsi_nop_timed_event(void *opaque)
 {
     IscsiLun *iscsilun = opaque;
+    int i;
 
-    if (iscsi_get_nops_in_flight(iscsilun->iscsi) > MAX_NOP_FAILURES) {
-        error_report("iSCSI: NOP timeout. Reconnecting...");
-        iscsi_reconnect(iscsilun->iscsi);
-    }
+    for (i = 0; i < iscsilun->nb_sessions; i++) {
+        IscsiSession *session = &iscsilun->sessions[i];
 
-    if (iscsi_nop_out_async(iscsilun->iscsi, NULL, NULL, 0, NULL) != 0) {
-        error_report("iSCSI: failed to sent NOP-Out. Disabling NOP messages.");
-        return;
+        if (iscsi_get_nops_in_flight(session->iscsi) > MAX_NOP_FAILURES) {
+            error_report("iSCSI: NOP timeout. Reconnecting...");
+            iscsi_reconnect(session->iscsi);
+        }
+
+        if (iscsi_nop_out_async(session->iscsi, NULL, NULL, 0, NULL) != 0) {
+            error_report("iSCSI: failed to sent NOP-Out. "
+                         "Disabling NOP messages.");
+            return;
+        }
+        iscsi_set_events(session);
     }
 
     qemu_mod_timer(iscsilun->nop_timer, qemu_get_clock_ms(rt_clock) + NOP_INTERVAL);
-    iscsi_set_events(iscsilun);
 }
 #endif
 
-/*
- * We support iscsi url's on the form
- * iscsi://[<username>%<password>@]<host>[:<port>]/<targetname>/<lun>
- */
-static int iscsi_open(BlockDriverState *bs, const char *filename, int flags)
+#if defined(SCSI_SENSE_ASCQ_CAPACITY_DATA_HAS_CHANGED)
+/* Convert a limit in LUN blocks to sectors, 0 meaning no limit */
+static int iscsi_limit_to_sectors(IscsiLun *iscsilun, uint32_t blocks)
 {
-    IscsiLun *iscsilun = bs->opaque;
-    struct iscsi_context *iscsi = NULL;
-    struct iscsi_url *iscsi_url = NULL;
-    struct scsi_task *task = NULL;
-    struct scsi_inquiry_standard *inq = NULL;
-    struct scsi_readcapacity10 *rc10 = NULL;
-    struct scsi_readcapacity16 *rc16 = NULL;
-    char *initiator_name = NULL;
-    int ret;
+    int64_t sectors;
 
-    if ((BDRV_SECTOR_SIZE % 512) != 0) {
-        error_report("iSCSI: Invalid BDRV_SECTOR_SIZE. "
-                     "BDRV_SECTOR_SIZE(%lld) is not a multiple "
-                     "of 512", BDRV_SECTOR_SIZE);
-        return -EINVAL;
+    if (blocks == 0xffffffff) {
+        return 0;
     }
+    sectors = sector_lun2qemu(blocks, iscsilun);
+    return MIN(sectors, INT_MAX >> BDRV_SECTOR_BITS);
+}
 
-    iscsi_url = iscsi_parse_full_url(iscsi, filename);
-    if (iscsi_url == NULL) {
-        error_report("Failed to parse URL : %s", filename);
-        ret = -EINVAL;
+/* Pass the Block Limits VPD page of the LUN on to the block layer */
+static void iscsi_read_block_limits(BlockDriverState *bs)
+{
+    IscsiLun *iscsilun = bs->opaque;
+    struct scsi_task *task;
+    struct scsi_inquiry_block_limits *inq_bl;
+    int unmap_gran;
+
+    task = iscsi_inquiry_sync(iscsilun->iscsi, iscsilun->lun, 1,
+                              SCSI_INQUIRY_PAGECODE_BLOCK_LIMITS, 64);
+    if (task == NULL || task->status != SCSI_STATUS_GOOD) {
+        /* The page is optional, so there are just no limits */
+        goto out;
+    }
+    inq_bl = scsi_datain_unmarshall(task);
+    if (inq_bl == NULL) {
         goto out;
     }
 
-    memset(iscsilun, 0, sizeof(IscsiLun));
+    bs->bl.max_transfer_length = iscsi_limit_to_sectors(iscsilun,
+                                                        inq_bl->max_xfer_len);
+    bs->bl.opt_transfer_length = iscsi_limit_to_sectors(iscsilun,
+                                                        inq_bl->opt_xfer_len);
 
-    initiator_name = parse_initiator_name(iscsi_url->target);
+    unmap_gran = iscsi_limit_to_sectors(iscsilun, inq_bl->opt_unmap_gran);
+    if (iscsilun->lbpme) {
+        bs->bl.max_discard = iscsi_limit_to_sectors(iscsilun,
+                                                    inq_bl->max_unmap);
+        bs->bl.discard_alignment = unmap_gran;
+    }
+    bs->bl.max_write_zeroes = iscsi_limit_to_sectors(iscsilun,
+                                                     inq_bl->max_ws_len);
+    bs->bl.write_zeroes_alignment = unmap_gran;
+
+out:
+    if (task != NULL) {
+        scsi_free_scsi_task(task);
+    }
+}
+#endif
+
+static int parse_sessions(const char *target)
+{
+    QemuOptsList *list;
+    QemuOpts *opts;
+    uint64_t sessions;
+
+    list = qemu_find_opts("iscsi");
+    if (!list) {
+        return 1;
+    }
+
+    opts = qemu_opts_find(list, target);
+    if (opts == NULL) {
+        opts = QTAILQ_FIRST(&list->head);
+        if (!opts) {
+            return 1;
+        }
+    }
+
+    sessions = qemu_opt_get_number(opts, "sessions", 1);
+    if (sessions < 1 || sessions > ISCSI_MAX_SESSIONS) {
+        error_report("Invalid sessions setting : %" PRIu64
+                     ", must be 1 to %d", sessions, ISCSI_MAX_SESSIONS);
+        return 1;
+    }
+    return sessions;
+}
+
+/* Create a context for @session and log in to the target of @iscsi_url */
+static int iscsi_session_open(IscsiSession *session, IscsiLun *iscsilun,
+                              struct iscsi_url *iscsi_url,
+                              const char *initiator_name)
+{
+    struct iscsi_context *iscsi;
+    int ret;
 
     iscsi = iscsi_create_context(initiator_name);
     if (iscsi == NULL) {
         error_report("iSCSI: Failed to create iSCSI context.");
         ret = -ENOMEM;
-        goto out;
+        goto fail;
     }
 
     if (iscsi_set_targetname(iscsi, iscsi_url->target)) {
         error_report("iSCSI: Failed to set target name.");
         ret = -EINVAL;
-        goto out;
+        goto fail;
     }
 
     if (iscsi_url->user != NULL) {
-        ret = iscsi_set_initiator_username_pwd(iscsi, iscsi_url->user,
-                                              iscsi_url->passwd);
-        if (ret != 0) {
+        if (iscsi_set_initiator_username_pwd(iscsi, iscsi_url->user,
+                                             iscsi_url->passwd) != 0) {
             error_report("Failed to set initiator username and password");
             ret = -EINVAL;
-            goto out;
+            goto fail;
         }
     }
 
@@ -884,13 +1193,13 @@ static int iscsi_open(BlockDriverState *bs, const char *filename, int flags)
     if (parse_chap(iscsi, iscsi_url->target) != 0) {
         error_report("iSCSI: Failed to set CHAP user/password");
         ret = -EINVAL;
-        goto out;
+        goto fail;
     }
 
     if (iscsi_set_session_type(iscsi, ISCSI_SESSION_NORMAL) != 0) {
         error_report("iSCSI: Failed to set session type to normal.");
         ret = -EINVAL;
-        goto out;
+        goto fail;
     }
 
     iscsi_set_header_digest(iscsi, ISCSI_HEADER_DIGEST_NONE_CRC32C);
@@ -902,9 +1211,64 @@ static int iscsi_open(BlockDriverState *bs, const char *filename, int flags)
         error_report("iSCSI: Failed to connect to LUN : %s",
             iscsi_get_error(iscsi));
         ret = -EINVAL;
+        goto fail;
+    }
+
+    session->iscsilun = iscsilun;
+    session->iscsi    = iscsi;
+    session->events   = 0;
+    return 0;
+
+fail:
+    if (iscsi != NULL) {
+        iscsi_destroy_context(iscsi);
+    }
+    return ret;
+}
+
+/*
+ * We support iscsi url's on the form
+ * iscsi://[<username>%<password>@]<host>[:<port>]/<targetname>/<lun>
+ */
+static int iscsi_open(BlockDriverState *bs, const char *filename, int flags)
+{
+    IscsiLun *iscsilun = bs->opaque;
+    struct iscsi_context *iscsi = NULL;
+    struct iscsi_url *iscsi_url = NULL;
+    struct scsi_task *task = NULL;
+    struct scsi_inquiry_standard *inq = NULL;
+    struct scsi_readcapacity10 *rc10 = NULL;
+    struct scsi_readcapacity16 *rc16 = NULL;
+    char *initiator_name = NULL;
+    int nb_sessions;
+    int i, ret;
+
+    if ((BDRV_SECTOR_SIZE % 512) != 0) {
+        error_report("iSCSI: Invalid BDRV_SECTOR_SIZE. "
+                     "BDRV_SECTOR_SIZE(%lld) is not a multiple "
+                     "of 512", BDRV_SECTOR_SIZE);
+        return -EINVAL;
+    }
+
+    iscsi_url = iscsi_parse_full_url(iscsi, filename);
+    if (iscsi_url == NULL) {
+        error_report("Failed to parse URL : %s", filename);
+        ret = -EINVAL;
         goto out;
     }
 
+    memset(iscsilun, 0, sizeof(IscsiLun));
+
+    initiator_name = parse_initiator_name(iscsi_url->target);
+
+    ret = iscsi_session_open(&iscsilun->sessions[0], iscsilun, iscsi_url,
+                             initiator_name);
+    if (ret != 0) {
+        goto out;
+    }
+    iscsilun->nb_sessions = 1;
+    iscsi = iscsilun->sessions[0].iscsi;
+
     iscsilun->iscsi = iscsi;
     iscsilun->lun   = iscsi_url->lun;
 
@@ -926,6 +1290,7 @@ static int iscsi_open(BlockDriverState *bs, const char *filename, int flags)
     iscsilun->type = inq->periperal_device_type;
 
     scsi_free_scsi_task(task);
+    task = NULL;
 
     switch (iscsilun->type) {
     case TYPE_DISK:
@@ -943,6 +1308,11 @@ static int iscsi_open(BlockDriverState *bs, const char *filename, int flags)
         }
         iscsilun->block_size = rc16->block_length;
         iscsilun->num_blocks = rc16->returned_lba + 1;
+#if defined(SCSI_SENSE_ASCQ_CAPACITY_DATA_HAS_CHANGED)
+        iscsilun->lbpme = rc16->lbpme;
+        iscsilun->lbprz = rc16->lbprz;
+        iscsilun->has_write_same = true;
+#endif
         break;
     case TYPE_ROM:
         task = iscsi_readcapacity10_sync(iscsi, iscsilun->lun, 0, 0);
@@ -972,6 +1342,12 @@ static int iscsi_open(BlockDriverState *bs, const char *filename, int flags)
     bs->total_sectors    = iscsilun->num_blocks *
                            iscsilun->block_size / BDRV_SECTOR_SIZE ;
 
+#if defined(SCSI_SENSE_ASCQ_CAPACITY_DATA_HAS_CHANGED)
+    if (iscsilun->type == TYPE_DISK) {
+        iscsi_read_block_limits(bs);
+    }
+#endif
+
     /* Medium changer or tape. We dont have any emulation for this so this must
      * be sg ioctl compatible. We force it to be sg, otherwise qemu will try
      * to read from the device to guess the image format.
@@ -981,6 +1357,18 @@ static int iscsi_open(BlockDriverState *bs, const char *filename, int flags)
         bs->sg = 1;
     }
 
+    /* Reads and writes may use more sessions.  SG_IO commands always go
+     * through the first one, and sg devices keep a single session.  */
+    nb_sessions = bs->sg ? 1 : parse_sessions(iscsi_url->target);
+    for (i = 1; i < nb_sessions; i++) {
+        ret = iscsi_session_open(&iscsilun->sessions[i], iscsilun, iscsi_url,
+                                 initiator_name);
+        if (ret != 0) {
+            goto out;
+        }
+        iscsilun->nb_sessions++;
+    }
+
     ret = 0;
 
 #if defined(LIBISCSI_FEATURE_NOP_COUNTER)
@@ -1001,8 +1389,8 @@ out:
     }
 
     if (ret) {
-        if (iscsi != NULL) {
-            iscsi_destroy_context(iscsi);
+        for (i = 0; i < iscsilun->nb_sessions; i++) {
+            iscsi_destroy_context(iscsilun->sessions[i].iscsi);
         }
         memset(iscsilun, 0, sizeof(IscsiLun));
     }
@@ -1012,14 +1400,18 @@ out:
 static void iscsi_close(BlockDriverState *bs)
 {
     IscsiLun *iscsilun = bs->opaque;
-    struct iscsi_context *iscsi = iscsilun->iscsi;
+    int i;
 
     if (iscsilun->nop_timer) {
         qemu_del_timer(iscsilun->nop_timer);
         qemu_free_timer(iscsilun->nop_timer);
     }
-    qemu_aio_set_fd_handler(iscsi_get_fd(iscsi), NULL, NULL, NULL, NULL);
-    iscsi_destroy_context(iscsi);
+    for (i = 0; i < iscsilun->nb_sessions; i++) {
+        struct iscsi_context *iscsi = iscsilun->sessions[i].iscsi;
+
+        qemu_aio_set_fd_handler(iscsi_get_fd(iscsi), NULL, NULL, NULL, NULL);
+        iscsi_destroy_context(iscsi);
+    }
     memset(iscsilun, 0, sizeof(IscsiLun));
 }
 
@@ -1052,10 +1444,6 @@ static int iscsi_create(const char *filename, QEMUOptionParameter *options)
     if (ret != 0) {
         goto out;
     }
-    if (iscsilun->nop_timer) {
-        qemu_del_timer(iscsilun->nop_timer);
-        qemu_free_timer(iscsilun->nop_timer);
-    }
     if (iscsilun->type != TYPE_DISK) {
         ret = -ENODEV;
         goto out;
@@ -1067,7 +1455,7 @@ static int iscsi_create(const char *filename, QEMUOptionParameter *options)
     ret = 0;
 out:
     if (iscsilun->iscsi != NULL) {
-        iscsi_destroy_context(iscsilun->iscsi);
+        iscsi_close(&bs);
     }
     g_free(bs.opaque);
     return ret;
@@ -1087,6 +1475,7 @@ static BlockDriver bdrv_iscsi = {
     .protocol_name   = "iscsi",
 
     .instance_size   = sizeof(IscsiLun),
+    .bdrv_main_context_only = true,
     .bdrv_file_open  = iscsi_open,
     .bdrv_close      = iscsi_close,
     .bdrv_create     = iscsi_create,
@@ -1099,12 +1488,21 @@ static BlockDriver bdrv_iscsi = {
     .bdrv_aio_flush  = iscsi_aio_flush,
 
     .bdrv_aio_discard = iscsi_aio_discard,
+#if defined(SCSI_SENSE_ASCQ_CAPACITY_DATA_HAS_CHANGED)
+    .bdrv_co_write_zeroes = iscsi_co_write_zeroes,
+#if defined(LIBISCSI_FEATURE_IOVECTOR)
+    .bdrv_co_get_block_status = iscsi_co_get_block_status,
+#endif
+#endif
     .bdrv_has_zero_init = iscsi_has_zero_init,
 
 #ifdef __linux__
     .bdrv_ioctl       = iscsi_ioctl,
     .bdrv_aio_ioctl   = iscsi_aio_ioctl,
 #endif
+
+    .bdrv_io_plug     = iscsi_io_plug,
+    .bdrv_io_unplug   = iscsi_io_unplug,
 };
 
 static QemuOptsList qemu_iscsi_opts = {
@@ -1128,6 +1526,12 @@ static QemuOptsList qemu_iscsi_opts = {
             .name = "initiator-name",
             .type = QEMU_OPT_STRING,
             .help = "Initiator iqn name to use when connecting",
+        },{
+            .name = "sessions",
+            .type = QEMU_OPT_NUMBER,
+            .help = "Number of sessions used for reads and writes "
+                    "(1 to 8, default 1; not for guests that use "
+                    "reservations)",
         },
         { /* end of list */ }
     },
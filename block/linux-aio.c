@@ -25,6 +25,9 @@
  */
 #define MAX_EVENTS 128
 
+/* Maximum number of requests queued while plugged */
+#define MAX_QUEUED_IO 128
+
 struct qemu_laiocb {
     BlockDriverAIOCB common;
     struct qemu_laio_state *ctx;
@@ -36,10 +39,22 @@ struct qemu_laiocb {
     QLIST_ENTRY(qemu_laiocb) node;
 };
 
+typedef struct {
+    struct iocb *iocbs[MAX_QUEUED_IO];
+    int plugged;                /* nesting depth of laio_io_plug() */
+    unsigned int idx;           /* number of queued iocbs */
+} LaioQueue;
+
 struct qemu_laio_state {
     io_context_t ctx;
     EventNotifier e;
-    int count;
+    int count;                  /* requests queued, in flight or failed */
+
+    /* Requests not yet passed to io_submit(), sent together on unplug */
+    LaioQueue io_q;
+
+    /* Requests that io_submit() refused, completed from the notifier */
+    QLIST_HEAD(, qemu_laiocb) failed;
 };
 
 static inline ssize_t io_event_ret(struct io_event *ev)
@@ -77,45 +92,109 @@ static void qemu_laio_process_completion(struct qemu_laio_state *s,
     qemu_aio_release(laiocb);
 }
 
+static void ioq_submit(struct qemu_laio_state *s);
+
+static void laio_queue_plug(struct qemu_laio_state *s)
+{
+    s->io_q.plugged++;
+}
+
+static void laio_queue_unplug(struct qemu_laio_state *s)
+{
+    assert(s->io_q.plugged > 0);
+    if (--s->io_q.plugged == 0 && s->io_q.idx > 0) {
+        ioq_submit(s);
+    }
+}
+
 static void qemu_laio_completion_cb(EventNotifier *e)
 {
     struct qemu_laio_state *s = container_of(e, struct qemu_laio_state, e);
+    struct qemu_laiocb *laiocb;
+
+    /* Requests submitted by the callbacks go out in a single io_submit() */
+    laio_queue_plug(s);
 
     while (event_notifier_test_and_clear(&s->e)) {
         struct io_event events[MAX_EVENTS];
         struct timespec ts = { 0 };
         int nevents, i;
 
+        /* The eventfd counter was reset above, so reap everything that
+         * has completed and not only the first MAX_EVENTS events.
+         */
         do {
-            nevents = io_getevents(s->ctx, MAX_EVENTS, MAX_EVENTS, events, &ts);
-        } while (nevents == -EINTR);
+            do {
+                nevents = io_getevents(s->ctx, 0, MAX_EVENTS, events, &ts);
+            } while (nevents == -EINTR);
 
-        for (i = 0; i < nevents; i++) {
-            struct iocb *iocb = events[i].obj;
-            struct qemu_laiocb *laiocb =
-                    container_of(iocb, struct qemu_laiocb, iocb);
+            for (i = 0; i < nevents; i++) {
+                struct iocb *iocb = events[i].obj;
 
-            laiocb->ret = io_event_ret(&events[i]);
+                laiocb = container_of(iocb, struct qemu_laiocb, iocb);
+                laiocb->ret = io_event_ret(&events[i]);
+                qemu_laio_process_completion(s, laiocb);
+            }
+        } while (nevents == MAX_EVENTS);
+
+        while ((laiocb = QLIST_FIRST(&s->failed))) {
+            QLIST_REMOVE(laiocb, node);
             qemu_laio_process_completion(s, laiocb);
         }
     }
+
+    /* Completions made room for requests that got -EAGAIN earlier */
+    laio_queue_unplug(s);
 }
 
 static int qemu_laio_flush_cb(EventNotifier *e)
 {
     struct qemu_laio_state *s = container_of(e, struct qemu_laio_state, e);
 
+    /* Somebody waits for I/O, do not keep requests back for batching */
+    if (s->io_q.idx > 0) {
+        ioq_submit(s);
+    }
     return (s->count > 0) ? 1 : 0;
 }
 
+/* Remove @laiocb from the queue of requests not yet submitted */
+static bool laio_dequeue(struct qemu_laio_state *s, struct qemu_laiocb *laiocb)
+{
+    unsigned int i;
+
+    for (i = 0; i < s->io_q.idx; i++) {
+        if (s->io_q.iocbs[i] == &laiocb->iocb) {
+            memmove(&s->io_q.iocbs[i], &s->io_q.iocbs[i + 1],
+                    (s->io_q.idx - i - 1) * sizeof(s->io_q.iocbs[0]));
+            s->io_q.idx--;
+            return true;
+        }
+    }
+    return false;
+}
+
 static void laio_cancel(BlockDriverAIOCB *blockacb)
 {
     struct qemu_laiocb *laiocb = (struct qemu_laiocb *)blockacb;
     struct io_event event;
     int ret;
 
-    if (laiocb->ret != -EINPROGRESS)
+    if (laiocb->ret != -EINPROGRESS) {
+        if (laiocb->ret != -ECANCELED) {
+            /* failed submission, the callback is still pending */
+            QLIST_REMOVE(laiocb, node);
+            laiocb->ctx->count--;
+            qemu_aio_release(laiocb);
+        }
+        return;
+    }
+
+    if (laio_dequeue(laiocb->ctx, laiocb)) {
+        laiocb->ctx->count--;
+        qemu_aio_release(laiocb);
         return;
+    }
 
     /*
      * Note that as of Linux 2.6.31 neither the block device code nor any
@@ -145,6 +224,44 @@ static const AIOCBInfo laio_aiocb_info = {
     .cancel             = laio_cancel,
 };
 
+/* Send the queued requests.  When the kernel accepts only part of them, the
+ * tail stays queued and is sent again once completions free some slots; if
+ * nothing is in flight to make room, or on other errors, the first queued
+ * request fails.
+ */
+static void ioq_submit(struct qemu_laio_state *s)
+{
+    struct qemu_laiocb *laiocb;
+    int ret;
+
+    while (s->io_q.idx > 0) {
+        ret = io_submit(s->ctx, s->io_q.idx, s->io_q.iocbs);
+        if (ret == -EAGAIN && s->count > s->io_q.idx) {
+            return;
+        }
+        if (ret < 0) {
+            laiocb = container_of(s->io_q.iocbs[0], struct qemu_laiocb, iocb);
+            laiocb->ret = ret;
+            QLIST_INSERT_HEAD(&s->failed, laiocb, node);
+            event_notifier_set(&s->e);
+            ret = 1;
+        }
+        s->io_q.idx -= ret;
+        memmove(s->io_q.iocbs, &s->io_q.iocbs[ret],
+                s->io_q.idx * sizeof(s->io_q.iocbs[0]));
+    }
+}
+
+void laio_io_plug(BlockDriverState *bs, void *aio_ctx)
+{
+    laio_queue_plug(aio_ctx);
+}
+
+void laio_io_unplug(BlockDriverState *bs, void *aio_ctx)
+{
+    laio_queue_unplug(aio_ctx);
+}
+
 BlockDriverAIOCB *laio_submit(BlockDriverState *bs, void *aio_ctx, int fd,
         int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
         BlockDriverCompletionFunc *cb, void *opaque, int type)
@@ -179,22 +296,40 @@ BlockDriverAIOCB *laio_submit(BlockDriverState *bs, void *aio_ctx, int fd,
     io_set_eventfd(&laiocb->iocb, event_notifier_get_fd(&s->e));
     s->count++;
 
-    if (io_submit(s->ctx, 1, &iocbs) < 0)
-        goto out_dec_count;
+    s->io_q.iocbs[s->io_q.idx++] = iocbs;
+    if (!s->io_q.plugged || s->io_q.idx == MAX_QUEUED_IO) {
+        ioq_submit(s);
+    }
     return &laiocb->common;
 
-out_dec_count:
-    s->count--;
 out_free_aiocb:
     qemu_aio_release(laiocb);
     return NULL;
 }
 
+void laio_detach_aio_context(void *s_, AioContext *old_context)
+{
+    struct qemu_laio_state *s = s_;
+
+    aio_set_event_notifier(old_context, &s->e, NULL, NULL);
+}
+
+void laio_attach_aio_context(void *s_, AioContext *new_context)
+{
+    struct qemu_laio_state *s = s_;
+
+    aio_set_event_notifier(new_context, &s->e, qemu_laio_completion_cb,
+                           qemu_laio_flush_cb);
+}
+
+/* The completion notifier is registered in the main loop, use
+ * laio_attach_aio_context() to move it elsewhere */
 void *laio_init(void)
 {
     struct qemu_laio_state *s;
 
     s = g_malloc0(sizeof(*s));
+    QLIST_INIT(&s->failed);
     if (event_notifier_init(&s->e, false) < 0) {
         goto out_free_state;
     }
@@ -14,10 +14,8 @@
 #include "trace.h"
 #include "block/blockjob.h"
 #include "block/block_int.h"
-#include "qemu/ratelimit.h"
 #include "qemu/bitmap.h"
 
-#define SLICE_TIME    100000000ULL /* ns */
 #define MAX_IN_FLIGHT 16
 
 /* The mirroring buffer is a list of granularity-sized chunks.
@@ -29,9 +27,9 @@ typedef struct MirrorBuffer {
 
 typedef struct MirrorBlockJob {
     BlockJob common;
-    RateLimit limit;
     BlockDriverState *target;
     MirrorSyncMode mode;
+    MirrorCopyMode copy_mode;
     BlockdevOnError on_source_error, on_target_error;
     bool synced;
     bool should_complete;
@@ -46,7 +44,17 @@ typedef struct MirrorBlockJob {
 
     unsigned long *in_flight_bitmap;
     int in_flight;
+    /* Only completions may resume the job while this is set; elsewhere
+     * it can be yielding inside the block layer */
+    bool waiting_for_io;
     int ret;
+
+    /* In write-blocking mode, guest writes lock their chunks in
+     * in_flight_bitmap while they are being written to source and target */
+    BdrvWriteInterceptor write_interceptor;
+    bool intercepting;
+    int active_writes;
+    CoQueue chunk_queue;
 } MirrorBlockJob;
 
 typedef struct MirrorOp {
@@ -95,7 +103,18 @@ static void mirror_iteration_done(MirrorOp *op, int ret)
     }
 
     g_slice_free(MirrorOp, op);
-    qemu_coroutine_enter(s->common.co, NULL);
+    qemu_co_queue_restart_all(&s->chunk_queue);
+    if (s->waiting_for_io) {
+        qemu_coroutine_enter(s->common.co, NULL);
+    }
+}
+
+static void coroutine_fn mirror_wait_for_io(MirrorBlockJob *s)
+{
+    assert(!s->waiting_for_io);
+    s->waiting_for_io = true;
+    qemu_coroutine_yield();
+    s->waiting_for_io = false;
 }
 
 static void mirror_write_complete(void *opaque, int ret)
@@ -139,8 +158,9 @@ static void mirror_read_complete(void *opaque, int ret)
 static void coroutine_fn mirror_iteration(MirrorBlockJob *s)
 {
     BlockDriverState *source = s->common.bs;
-    int nb_sectors, sectors_per_chunk, nb_chunks;
+    int nb_sectors, sectors_per_chunk, nb_chunks, pnum;
     int64_t end, sector_num, next_chunk, next_sector, hbitmap_next_sector;
+    int64_t status;
     MirrorOp *op;
 
     s->sector_num = hbitmap_iter_next(&s->hbi);
@@ -177,7 +197,12 @@ static void coroutine_fn mirror_iteration(MirrorBlockJob *s)
     /* Wait for I/O to this cluster (from a previous iteration) to be done.  */
     while (test_bit(next_chunk, s->in_flight_bitmap)) {
         trace_mirror_yield_in_flight(s, sector_num, s->in_flight);
-        qemu_coroutine_yield();
+        mirror_wait_for_io(s);
+    }
+
+    /* A guest write may have copied the chunk to the target meanwhile */
+    if (!bdrv_get_dirty(source, sector_num)) {
+        return;
     }
 
     do {
@@ -213,7 +238,7 @@ static void coroutine_fn mirror_iteration(MirrorBlockJob *s)
          */
         while (nb_chunks == 0 && s->buf_free_count < added_chunks) {
             trace_mirror_yield_buf_busy(s, nb_chunks, s->in_flight);
-            qemu_coroutine_yield();
+            mirror_wait_for_io(s);
         }
         if (s->buf_free_count < nb_chunks + added_chunks) {
             trace_mirror_break_buf_busy(s, nb_chunks, s->in_flight);
@@ -261,10 +286,141 @@ static void coroutine_fn mirror_iteration(MirrorBlockJob *s)
     /* Copy the dirty cluster.  */
     s->in_flight++;
     trace_mirror_one_iteration(s, sector_num, nb_sectors);
+
+    /* Ranges that read as zeroes need not go through the buffer; the
+     * target may even deallocate them.  The buffers are still taken so
+     * that completion is the same for both kinds of operation.
+     */
+    status = bdrv_co_get_block_status(source, sector_num, nb_sectors, &pnum);
+    if (status >= 0 && (status & BDRV_BLOCK_ZERO) && pnum == nb_sectors) {
+        trace_mirror_write_zeroes(s, sector_num, nb_sectors);
+        bdrv_aio_write_zeroes(s->target, sector_num, nb_sectors,
+                              BDRV_REQ_MAY_UNMAP, mirror_write_complete, op);
+        return;
+    }
+
     bdrv_aio_readv(source, sector_num, &op->qiov, nb_sectors,
                    mirror_read_complete, op);
 }
 
+static void mirror_active_chunks(MirrorBlockJob *s, BdrvWriteOp *op,
+                                 int64_t *chunk_num, int *nb_chunks)
+{
+    int64_t sectors_per_chunk = s->granularity >> BDRV_SECTOR_BITS;
+    int64_t end = op->sector_num + MAX(op->nb_sectors, 1);
+
+    *chunk_num = op->sector_num / sectors_per_chunk;
+    *nb_chunks = DIV_ROUND_UP(end, sectors_per_chunk) - *chunk_num;
+}
+
+static void coroutine_fn mirror_before_write(BdrvWriteInterceptor *wi,
+                                             BdrvWriteOp *op)
+{
+    MirrorBlockJob *s = container_of(wi, MirrorBlockJob, write_interceptor);
+    int64_t chunk_num;
+    int nb_chunks;
+
+    mirror_active_chunks(s, op, &chunk_num, &nb_chunks);
+    s->active_writes++;
+
+    /* Background copies and other guest writes to the same chunks must
+     * reach the target in the same order as they reach the source. */
+    while (find_next_bit(s->in_flight_bitmap, chunk_num + nb_chunks,
+                         chunk_num) < chunk_num + nb_chunks) {
+        trace_mirror_yield_in_flight(s, op->sector_num, s->in_flight);
+        qemu_co_queue_wait(&s->chunk_queue);
+    }
+    bitmap_set(s->in_flight_bitmap, chunk_num, nb_chunks);
+}
+
+/* Copy the chunks touched by a guest write from the source to the target.
+ * The chunks are locked, so their contents on the source are what the
+ * guest just wrote plus data that nobody is changing meanwhile. */
+static int coroutine_fn mirror_active_copy(MirrorBlockJob *s,
+                                           int64_t sector_num,
+                                           int nb_sectors)
+{
+    QEMUIOVector qiov;
+    struct iovec iov;
+    int ret;
+
+    iov.iov_len = nb_sectors * BDRV_SECTOR_SIZE;
+    iov.iov_base = qemu_blockalign(s->common.bs, iov.iov_len);
+    qemu_iovec_init_external(&qiov, &iov, 1);
+
+    ret = bdrv_co_readv(s->common.bs, sector_num, nb_sectors, &qiov);
+    if (ret < 0) {
+        if (mirror_error_action(s, true, -ret) == BDRV_ACTION_REPORT &&
+            s->ret >= 0) {
+            s->ret = ret;
+        }
+        goto out;
+    }
+
+    ret = bdrv_co_writev(s->target, sector_num, nb_sectors, &qiov);
+    if (ret < 0) {
+        if (mirror_error_action(s, false, -ret) == BDRV_ACTION_REPORT &&
+            s->ret >= 0) {
+            s->ret = ret;
+        }
+    }
+
+out:
+    qemu_vfree(iov.iov_base);
+    return ret;
+}
+
+static void coroutine_fn mirror_after_write(BdrvWriteInterceptor *wi,
+                                            BdrvWriteOp *op)
+{
+    MirrorBlockJob *s = container_of(wi, MirrorBlockJob, write_interceptor);
+    BlockDriverState *source = s->common.bs;
+    int64_t sectors_per_chunk = s->granularity >> BDRV_SECTOR_BITS;
+    int64_t chunk_num, sector_num, end;
+    int nb_chunks, nb_sectors;
+    int ret = op->ret;
+
+    mirror_active_chunks(s, op, &chunk_num, &nb_chunks);
+    sector_num = chunk_num * sectors_per_chunk;
+    end = MIN((chunk_num + nb_chunks) * sectors_per_chunk,
+              s->common.len >> BDRV_SECTOR_BITS);
+    nb_sectors = end - sector_num;
+
+    /* A failed write stays dirty and is left to the background copy */
+    if (ret >= 0 && op->nb_sectors > 0) {
+        if (op->sector_num != sector_num ||
+            op->sector_num + op->nb_sectors != end) {
+            /* Write whole chunks, the target may not be able to fill in
+             * the rest of a partially written cluster by itself */
+            ret = mirror_active_copy(s, sector_num, nb_sectors);
+        } else {
+            if (op->qiov) {
+                ret = bdrv_co_writev(s->target, sector_num, nb_sectors,
+                                     op->qiov);
+            } else {
+                ret = bdrv_co_write_zeroes(s->target, sector_num, nb_sectors,
+                                           op->flags & BDRV_REQ_MAY_UNMAP);
+            }
+            if (ret < 0 &&
+                mirror_error_action(s, false, -ret) == BDRV_ACTION_REPORT &&
+                s->ret >= 0) {
+                s->ret = ret;
+            }
+        }
+        if (ret >= 0) {
+            bdrv_reset_dirty(source, sector_num, nb_sectors);
+        }
+    }
+    trace_mirror_active_write(s, op->sector_num, op->nb_sectors, ret);
+
+    bitmap_clear(s->in_flight_bitmap, chunk_num, nb_chunks);
+    qemu_co_queue_restart_all(&s->chunk_queue);
+    s->active_writes--;
+    if (s->waiting_for_io) {
+        qemu_coroutine_enter(s->common.co, NULL);
+    }
+}
+
 static void mirror_free_init(MirrorBlockJob *s)
 {
     int granularity = s->granularity;
@@ -282,10 +438,22 @@ static void mirror_free_init(MirrorBlockJob *s)
     }
 }
 
-static void mirror_drain(MirrorBlockJob *s)
+static void coroutine_fn mirror_drain(MirrorBlockJob *s)
 {
     while (s->in_flight > 0) {
-        qemu_coroutine_yield();
+        mirror_wait_for_io(s);
+    }
+}
+
+static void coroutine_fn mirror_stop_intercepting(MirrorBlockJob *s)
+{
+    if (!s->intercepting) {
+        return;
+    }
+    bdrv_set_write_interceptor(s->common.bs, NULL);
+    s->intercepting = false;
+    while (s->active_writes > 0) {
+        mirror_wait_for_io(s);
     }
 }
 
@@ -332,6 +500,17 @@ static void coroutine_fn mirror_run(void *opaque)
     sectors_per_chunk = s->granularity >> BDRV_SECTOR_BITS;
     mirror_free_init(s);
 
+    /* From now on guest writes only dirty the source if they fail to reach
+     * the target.  Without the background copy doing COW for the target,
+     * there is no safe way to write them early, so stay in background mode.
+     */
+    if (s->copy_mode == MIRROR_COPY_MODE_WRITE_BLOCKING && !s->cow_bitmap) {
+        s->write_interceptor.before_write = mirror_before_write;
+        s->write_interceptor.after_write = mirror_after_write;
+        bdrv_set_write_interceptor(bs, &s->write_interceptor);
+        s->intercepting = true;
+    }
+
     if (s->mode != MIRROR_SYNC_MODE_NONE) {
         /* First part, loop on the sectors and initialize the dirty bitmap.  */
         BlockDriverState *base;
@@ -371,17 +550,24 @@ static void coroutine_fn mirror_run(void *opaque)
 
         /* Note that even when no rate limit is applied we need to yield
          * periodically with no pending I/O so that qemu_aio_flush() returns.
-         * We do so every SLICE_TIME nanoseconds, or when there is an error,
-         * or when the source is clean, whichever comes first.
+         * We do so every BLOCK_JOB_SLICE_TIME nanoseconds, or when there is
+         * an error, or when the source is clean, whichever comes first.
          */
-        if (qemu_get_clock_ns(rt_clock) - last_pause_ns < SLICE_TIME &&
+        if (qemu_get_clock_ns(rt_clock) - last_pause_ns <
+                BLOCK_JOB_SLICE_TIME &&
             s->common.iostatus == BLOCK_DEVICE_IO_STATUS_OK) {
             if (s->in_flight == MAX_IN_FLIGHT || s->buf_free_count == 0 ||
                 (cnt == 0 && s->in_flight > 0)) {
                 trace_mirror_yield(s, s->in_flight, s->buf_free_count, cnt);
-                qemu_coroutine_yield();
+                mirror_wait_for_io(s);
                 continue;
             } else if (cnt != 0) {
+                /* Let busy guest I/O on the source go first */
+                delay_ns = block_job_throttle(&s->common, 0);
+                if (delay_ns > 0) {
+                    block_job_sleep_ns(&s->common, rt_clock, delay_ns);
+                    continue;
+                }
                 mirror_iteration(s);
                 continue;
             }
@@ -433,24 +619,22 @@ static void coroutine_fn mirror_run(void *opaque)
             /* Publish progress */
             s->common.offset = (end - cnt) * BDRV_SECTOR_SIZE;
 
-            if (s->common.speed) {
-                delay_ns = ratelimit_calculate_delay(&s->limit, sectors_per_chunk);
-            } else {
-                delay_ns = 0;
-            }
+            delay_ns = block_job_throttle(&s->common, sectors_per_chunk);
 
             block_job_sleep_ns(&s->common, rt_clock, delay_ns);
             if (block_job_is_cancelled(&s->common)) {
                 break;
             }
         } else if (!should_complete) {
-            delay_ns = (s->in_flight == 0 && cnt == 0 ? SLICE_TIME : 0);
+            delay_ns = (s->in_flight == 0 && cnt == 0 ?
+                        BLOCK_JOB_SLICE_TIME : 0);
             block_job_sleep_ns(&s->common, rt_clock, delay_ns);
         } else if (cnt == 0) {
             /* The two disks are in sync.  Exit and report successful
              * completion.
              */
-            assert(QLIST_EMPTY(&bs->tracked_requests));
+            assert(interval_tree_empty(&bs->tracked_requests));
+            assert(bs->nr_empty_requests == 0);
             s->common.cancelled = false;
             break;
         }
@@ -458,6 +642,7 @@ static void coroutine_fn mirror_run(void *opaque)
     }
 
 immediate_exit:
+    mirror_stop_intercepting(s);
     if (s->in_flight > 0) {
         /* We get here only if something went wrong.  Either the job failed,
          * or it was cancelled prematurely so that we do not guarantee that
@@ -484,17 +669,6 @@ immediate_exit:
     block_job_completed(&s->common, ret);
 }
 
-static void mirror_set_speed(BlockJob *job, int64_t speed, Error **errp)
-{
-    MirrorBlockJob *s = container_of(job, MirrorBlockJob, common);
-
-    if (speed < 0) {
-        error_set(errp, QERR_INVALID_PARAMETER, "speed");
-        return;
-    }
-    ratelimit_set_speed(&s->limit, speed / BDRV_SECTOR_SIZE, SLICE_TIME);
-}
-
 static void mirror_iostatus_reset(BlockJob *job)
 {
     MirrorBlockJob *s = container_of(job, MirrorBlockJob, common);
@@ -527,14 +701,14 @@ static void mirror_complete(BlockJob *job, Error **errp)
 static BlockJobType mirror_job_type = {
     .instance_size = sizeof(MirrorBlockJob),
     .job_type      = "mirror",
-    .set_speed     = mirror_set_speed,
     .iostatus_reset= mirror_iostatus_reset,
     .complete      = mirror_complete,
 };
 
 void mirror_start(BlockDriverState *bs, BlockDriverState *target,
                   int64_t speed, int64_t granularity, int64_t buf_size,
-                  MirrorSyncMode mode, BlockdevOnError on_source_error,
+                  MirrorSyncMode mode, MirrorCopyMode copy_mode,
+                  BlockdevOnError on_source_error,
                   BlockdevOnError on_target_error,
                   BlockDriverCompletionFunc *cb,
                   void *opaque, Error **errp)
@@ -571,6 +745,8 @@ void mirror_start(BlockDriverState *bs, BlockDriverState *target,
     s->on_target_error = on_target_error;
     s->target = target;
     s->mode = mode;
+    s->copy_mode = copy_mode;
+    qemu_co_queue_init(&s->chunk_queue);
     s->granularity = granularity;
     s->buf_size = MAX(buf_size, granularity);
 
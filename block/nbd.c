@@ -47,15 +47,31 @@
 #define logout(fmt, ...) ((void)0)
 #endif
 
-#define MAX_NBD_REQUESTS	16
+/* NBD has no way to negotiate the queue depth.  If the server takes fewer
+ * requests at a time, it stops reading the socket and the send side waits.
+ */
+#define MAX_NBD_REQUESTS	64
+/* Servers that do not tell their limit may take slightly less than 1M per
+ * request, as older versions of qemu-nbd did.  Try to remain aligned to 4K.
+ */
+#define NBD_MAX_SECTORS 2040
+
 #define HANDLE_TO_INDEX(bs, handle) ((handle) ^ ((uint64_t)(intptr_t)bs))
 #define INDEX_TO_HANDLE(bs, index)  ((index)  ^ ((uint64_t)(intptr_t)bs))
 
+/* First extent of a reply to NBD_CMD_BLOCK_STATUS */
+typedef struct NBDExtent {
+    uint32_t length;
+    uint32_t flags;
+} NBDExtent;
+
 typedef struct BDRVNBDState {
     int sock;
     uint32_t nbdflags;
     off_t size;
     size_t blocksize;
+    NBDExportInfo info;
+    int max_sectors;        /* Largest request sent to the server */
 
     CoMutex send_mutex;
     CoMutex free_sema;
@@ -260,53 +276,190 @@ static void nbd_restart_write(void *opaque)
     qemu_coroutine_enter(s->send_coroutine, NULL);
 }
 
-static int nbd_co_send_request(BDRVNBDState *s, struct nbd_request *request,
+static int nbd_co_send_request(BlockDriverState *bs,
+                               struct nbd_request *request,
                                QEMUIOVector *qiov, int offset)
 {
-    int rc, ret;
+    BDRVNBDState *s = bs->opaque;
+    AioContext *aio_context = bdrv_get_aio_context(bs);
+    uint8_t buf[NBD_REQUEST_SIZE];
+    QEMUIOVector send_qiov;
+    int rc = 0;
+
+    /* The header and the guest buffers go out in a single sendmsg() */
+    nbd_encode_request(buf, request);
+    qemu_iovec_init(&send_qiov, 1 + (qiov ? qiov->niov : 0));
+    qemu_iovec_add(&send_qiov, buf, sizeof(buf));
+    if (qiov) {
+        qemu_iovec_concat(&send_qiov, qiov, offset, request->len);
+    }
 
     qemu_co_mutex_lock(&s->send_mutex);
     s->send_coroutine = qemu_coroutine_self();
-    qemu_aio_set_fd_handler(s->sock, nbd_reply_ready, nbd_restart_write,
-                            nbd_have_request, s);
-    rc = nbd_send_request(s->sock, request);
-    if (rc >= 0 && qiov) {
-        ret = qemu_co_sendv(s->sock, qiov->iov, qiov->niov,
-                            offset, request->len);
-        if (ret != request->len) {
-            return -EIO;
-        }
-    }
-    qemu_aio_set_fd_handler(s->sock, nbd_reply_ready, NULL,
-                            nbd_have_request, s);
+    aio_set_fd_handler(aio_context, s->sock, nbd_reply_ready,
+                       nbd_restart_write, nbd_have_request, s);
+    if (qemu_co_sendv(s->sock, send_qiov.iov, send_qiov.niov, 0,
+                      send_qiov.size) != send_qiov.size) {
+        rc = -EIO;
+    }
+    aio_set_fd_handler(aio_context, s->sock, nbd_reply_ready, NULL,
+                       nbd_have_request, s);
     s->send_coroutine = NULL;
     qemu_co_mutex_unlock(&s->send_mutex);
+    qemu_iovec_destroy(&send_qiov);
     return rc;
 }
 
+static int nbd_co_drop_payload(BDRVNBDState *s, uint32_t len)
+{
+    char buf[256];
+
+    while (len > 0) {
+        uint32_t n = MIN(len, sizeof(buf));
+        if (qemu_co_recv(s->sock, buf, n) != n) {
+            return -EIO;
+        }
+        len -= n;
+    }
+    return 0;
+}
+
+/* Check that [chunk_offset, chunk_offset + len) is within the request */
+static bool nbd_chunk_in_request(struct nbd_request *request,
+                                 uint64_t chunk_offset, uint32_t len)
+{
+    return chunk_offset >= request->from &&
+           chunk_offset + len >= chunk_offset &&
+           chunk_offset + len <= request->from + request->len;
+}
+
+/* Process the payload of a structured reply chunk.  Errors reported by the
+ * server go to *error; a negative return value means that the stream can
+ * not be parsed anymore.
+ */
+static int nbd_co_receive_chunk(BDRVNBDState *s, struct nbd_request *request,
+                                struct nbd_reply *chunk, uint32_t *error,
+                                QEMUIOVector *qiov, int offset,
+                                NBDExtent *extent)
+{
+    uint8_t buf[8 + 4 + 4 + 4];
+    uint64_t chunk_offset;
+    uint32_t len;
+    int ret;
+
+    switch (chunk->type) {
+    case NBD_REPLY_TYPE_NONE:
+        return chunk->length == 0 ? 0 : -EIO;
+
+    case NBD_REPLY_TYPE_OFFSET_DATA:
+        if (!qiov || chunk->length < 8 ||
+            qemu_co_recv(s->sock, buf, 8) != 8) {
+            return -EIO;
+        }
+        chunk_offset = be64_to_cpup((uint64_t *)buf);
+        len = chunk->length - 8;
+        if (!nbd_chunk_in_request(request, chunk_offset, len)) {
+            return -EIO;
+        }
+        ret = qemu_co_recvv(s->sock, qiov->iov, qiov->niov,
+                            offset + chunk_offset - request->from, len);
+        return ret == len ? 0 : -EIO;
+
+    case NBD_REPLY_TYPE_OFFSET_HOLE:
+        if (!qiov || chunk->length != 12 ||
+            qemu_co_recv(s->sock, buf, 12) != 12) {
+            return -EIO;
+        }
+        chunk_offset = be64_to_cpup((uint64_t *)buf);
+        len = be32_to_cpup((uint32_t *)(buf + 8));
+        if (!nbd_chunk_in_request(request, chunk_offset, len)) {
+            return -EIO;
+        }
+        qemu_iovec_memset(qiov, offset + chunk_offset - request->from, 0, len);
+        return 0;
+
+    case NBD_REPLY_TYPE_BLOCK_STATUS:
+        /* Only the first extent is used, the rest is skipped */
+        if (!extent || chunk->length < 12 || (chunk->length - 4) % 8 ||
+            qemu_co_recv(s->sock, buf, 12) != 12) {
+            return -EIO;
+        }
+        if (be32_to_cpup((uint32_t *)buf) != s->info.meta_context_id) {
+            return -EIO;
+        }
+        extent->length = be32_to_cpup((uint32_t *)(buf + 4));
+        extent->flags = be32_to_cpup((uint32_t *)(buf + 8));
+        return nbd_co_drop_payload(s, chunk->length - 12);
+
+    default:
+        if (!NBD_REPLY_TYPE_IS_ERROR(chunk->type)) {
+            /* Unknown chunks cannot be interpreted, so fail the request */
+            *error = EIO;
+            return nbd_co_drop_payload(s, chunk->length);
+        }
+        if (chunk->length < 6 || qemu_co_recv(s->sock, buf, 6) != 6) {
+            return -EIO;
+        }
+        if (*error == 0) {
+            *error = be32_to_cpup((uint32_t *)buf);
+            if (*error == 0) {
+                *error = EIO;
+            }
+        }
+        return nbd_co_drop_payload(s, chunk->length - 6);
+    }
+}
+
 static void nbd_co_receive_reply(BDRVNBDState *s, struct nbd_request *request,
                                  struct nbd_reply *reply,
-                                 QEMUIOVector *qiov, int offset)
+                                 QEMUIOVector *qiov, int offset,
+                                 NBDExtent *extent)
 {
+    struct nbd_reply chunk;
+    uint32_t error;
     int ret;
 
-    /* Wait until we're woken up by the read handler.  TODO: perhaps
-     * peek at the next reply and avoid yielding if it's ours?  */
-    qemu_coroutine_yield();
-    *reply = s->reply;
-    if (reply->handle != request->handle) {
-        reply->error = EIO;
-    } else {
-        if (qiov && reply->error == 0) {
-            ret = qemu_co_recvv(s->sock, qiov->iov, qiov->niov,
-                                offset, request->len);
-            if (ret != request->len) {
-                reply->error = EIO;
+    reply->error = 0;
+    for (;;) {
+        /* Wait until we're woken up by the read handler.  TODO: perhaps
+         * peek at the next reply and avoid yielding if it's ours?  */
+        qemu_coroutine_yield();
+        if (s->reply.handle != request->handle) {
+            reply->error = EIO;
+            return;
+        }
+
+        if (!nbd_reply_is_structured(&s->reply)) {
+            *reply = s->reply;
+            if (qiov && reply->error == 0) {
+                ret = qemu_co_recvv(s->sock, qiov->iov, qiov->niov,
+                                    offset, request->len);
+                if (ret != request->len) {
+                    reply->error = EIO;
+                }
             }
+
+            /* Tell the read handler to read another header.  */
+            s->reply.handle = 0;
+            return;
         }
 
-        /* Tell the read handler to read another header.  */
+        /* A structured reply can have several chunks, each with its own
+         * header.
+         */
+        chunk = s->reply;
+        error = reply->error;
+        ret = nbd_co_receive_chunk(s, request, &chunk, &error,
+                                   qiov, offset, extent);
+        reply->error = error;
         s->reply.handle = 0;
+        if (ret < 0) {
+            reply->error = EIO;
+            return;
+        }
+        if (chunk.flags & NBD_REPLY_FLAG_DONE) {
+            return;
+        }
     }
 }
 
@@ -341,7 +494,7 @@ static int nbd_establish_connection(BlockDriverState *bs)
 
     /* NBD handshake */
     ret = nbd_receive_negotiate(sock, s->export_name, &s->nbdflags, &size,
-                                &blocksize);
+                                &blocksize, &s->info);
     if (ret < 0) {
         logout("Failed to negotiate with the NBD server\n");
         closesocket(sock);
@@ -351,12 +504,16 @@ static int nbd_establish_connection(BlockDriverState *bs)
     /* Now that we're connected, set the socket to be non-blocking and
      * kick the reply mechanism.  */
     socket_set_nonblock(sock);
-    qemu_aio_set_fd_handler(sock, nbd_reply_ready, NULL,
-                            nbd_have_request, s);
+    aio_set_fd_handler(bdrv_get_aio_context(bs), sock, nbd_reply_ready, NULL,
+                       nbd_have_request, s);
 
     s->sock = sock;
     s->size = size;
     s->blocksize = blocksize;
+    s->max_sectors = NBD_MAX_SECTORS;
+    if (s->info.max_block >= 512) {
+        s->max_sectors = MIN(s->info.max_block, NBD_MAX_BUFFER_SIZE) / 512;
+    }
 
     logout("Established connection with NBD server\n");
     return 0;
@@ -372,7 +529,8 @@ static void nbd_teardown_connection(BlockDriverState *bs)
     request.len = 0;
     nbd_send_request(s->sock, &request);
 
-    qemu_aio_set_fd_handler(s->sock, NULL, NULL, NULL, NULL);
+    aio_set_fd_handler(bdrv_get_aio_context(bs), s->sock,
+                       NULL, NULL, NULL, NULL);
     closesocket(s->sock);
 }
 
@@ -412,11 +570,11 @@ static int nbd_co_readv_1(BlockDriverState *bs, int64_t sector_num,
     request.len = nb_sectors * 512;
 
     nbd_coroutine_start(s, &request);
-    ret = nbd_co_send_request(s, &request, NULL, 0);
+    ret = nbd_co_send_request(bs, &request, NULL, 0);
     if (ret < 0) {
         reply.error = -ret;
     } else {
-        nbd_co_receive_reply(s, &request, &reply, qiov, offset);
+        nbd_co_receive_reply(s, &request, &reply, qiov, offset, NULL);
     }
     nbd_coroutine_end(s, &request);
     return -reply.error;
@@ -441,52 +599,107 @@ static int nbd_co_writev_1(BlockDriverState *bs, int64_t sector_num,
     request.len = nb_sectors * 512;
 
     nbd_coroutine_start(s, &request);
-    ret = nbd_co_send_request(s, &request, qiov, offset);
+    ret = nbd_co_send_request(bs, &request, qiov, offset);
     if (ret < 0) {
         reply.error = -ret;
     } else {
-        nbd_co_receive_reply(s, &request, &reply, NULL, 0);
+        nbd_co_receive_reply(s, &request, &reply, NULL, 0, NULL);
     }
     nbd_coroutine_end(s, &request);
     return -reply.error;
 }
 
-/* qemu-nbd has a limit of slightly less than 1M per request.  Try to
- * remain aligned to 4K. */
-#define NBD_MAX_SECTORS 2040
+/* A request larger than max_sectors is split, and the parts are sent
+ * without waiting for the earlier ones to complete.
+ */
+typedef struct NBDSplitRequest {
+    BlockDriverState *bs;
+    Coroutine *co;          /* waits for the parts in nbd_co_rw() */
+    QEMUIOVector *qiov;
+    bool is_write;
+    int64_t sector_num;     /* next part */
+    int nb_sectors;
+    int offset;
+    int in_flight;
+    int ret;
+} NBDSplitRequest;
 
-static int nbd_co_readv(BlockDriverState *bs, int64_t sector_num,
-                        int nb_sectors, QEMUIOVector *qiov)
+static int nbd_co_rw_1(NBDSplitRequest *split, int64_t sector_num,
+                       int nb_sectors, int offset)
 {
-    int offset = 0;
+    if (split->is_write) {
+        return nbd_co_writev_1(split->bs, sector_num, nb_sectors,
+                               split->qiov, offset);
+    } else {
+        return nbd_co_readv_1(split->bs, sector_num, nb_sectors,
+                              split->qiov, offset);
+    }
+}
+
+static void coroutine_fn nbd_co_rw_part_entry(void *opaque)
+{
+    NBDSplitRequest *split = opaque;
+    BDRVNBDState *s = split->bs->opaque;
+    int64_t sector_num = split->sector_num;
+    int nb_sectors = MIN(split->nb_sectors, s->max_sectors);
+    int offset = split->offset;
     int ret;
-    while (nb_sectors > NBD_MAX_SECTORS) {
-        ret = nbd_co_readv_1(bs, sector_num, NBD_MAX_SECTORS, qiov, offset);
-        if (ret < 0) {
-            return ret;
-        }
-        offset += NBD_MAX_SECTORS * 512;
-        sector_num += NBD_MAX_SECTORS;
-        nb_sectors -= NBD_MAX_SECTORS;
+
+    split->sector_num += nb_sectors;
+    split->nb_sectors -= nb_sectors;
+    split->offset += nb_sectors * 512;
+
+    ret = nbd_co_rw_1(split, sector_num, nb_sectors, offset);
+    if (ret < 0 && split->ret == 0) {
+        split->ret = ret;
+    }
+    if (--split->in_flight == 0) {
+        qemu_coroutine_enter(split->co, NULL);
     }
-    return nbd_co_readv_1(bs, sector_num, nb_sectors, qiov, offset);
+}
+
+static int nbd_co_rw(BlockDriverState *bs, int64_t sector_num,
+                     int nb_sectors, QEMUIOVector *qiov, bool is_write)
+{
+    BDRVNBDState *s = bs->opaque;
+    NBDSplitRequest split = {
+        .bs         = bs,
+        .co         = qemu_coroutine_self(),
+        .qiov       = qiov,
+        .is_write   = is_write,
+        .sector_num = sector_num,
+        .nb_sectors = nb_sectors,
+    };
+
+    if (nb_sectors <= s->max_sectors) {
+        return nbd_co_rw_1(&split, sector_num, nb_sectors, 0);
+    }
+
+    /* Each part runs until it waits for its reply, so all the requests are
+     * sent before the first reply is processed.
+     */
+    split.in_flight = 1;
+    while (split.nb_sectors > 0) {
+        split.in_flight++;
+        qemu_coroutine_enter(qemu_coroutine_create(nbd_co_rw_part_entry),
+                             &split);
+    }
+    if (--split.in_flight > 0) {
+        qemu_coroutine_yield();
+    }
+    return split.ret;
+}
+
+static int nbd_co_readv(BlockDriverState *bs, int64_t sector_num,
+                        int nb_sectors, QEMUIOVector *qiov)
+{
+    return nbd_co_rw(bs, sector_num, nb_sectors, qiov, false);
 }
 
 static int nbd_co_writev(BlockDriverState *bs, int64_t sector_num,
                          int nb_sectors, QEMUIOVector *qiov)
 {
-    int offset = 0;
-    int ret;
-    while (nb_sectors > NBD_MAX_SECTORS) {
-        ret = nbd_co_writev_1(bs, sector_num, NBD_MAX_SECTORS, qiov, offset);
-        if (ret < 0) {
-            return ret;
-        }
-        offset += NBD_MAX_SECTORS * 512;
-        sector_num += NBD_MAX_SECTORS;
-        nb_sectors -= NBD_MAX_SECTORS;
-    }
-    return nbd_co_writev_1(bs, sector_num, nb_sectors, qiov, offset);
+    return nbd_co_rw(bs, sector_num, nb_sectors, qiov, true);
 }
 
 static int nbd_co_flush(BlockDriverState *bs)
@@ -509,11 +722,11 @@ static int nbd_co_flush(BlockDriverState *bs)
     request.len = 0;
 
     nbd_coroutine_start(s, &request);
-    ret = nbd_co_send_request(s, &request, NULL, 0);
+    ret = nbd_co_send_request(bs, &request, NULL, 0);
     if (ret < 0) {
         reply.error = -ret;
     } else {
-        nbd_co_receive_reply(s, &request, &reply, NULL, 0);
+        nbd_co_receive_reply(s, &request, &reply, NULL, 0, NULL);
     }
     nbd_coroutine_end(s, &request);
     return -reply.error;
@@ -535,16 +748,64 @@ static int nbd_co_discard(BlockDriverState *bs, int64_t sector_num,
     request.len = nb_sectors * 512;
 
     nbd_coroutine_start(s, &request);
-    ret = nbd_co_send_request(s, &request, NULL, 0);
+    ret = nbd_co_send_request(bs, &request, NULL, 0);
     if (ret < 0) {
         reply.error = -ret;
     } else {
-        nbd_co_receive_reply(s, &request, &reply, NULL, 0);
+        nbd_co_receive_reply(s, &request, &reply, NULL, 0, NULL);
     }
     nbd_coroutine_end(s, &request);
     return -reply.error;
 }
 
+/* Servers that support the "base:allocation" context tell which ranges
+ * read as zeroes, so that mirror and convert need not copy them.
+ */
+static int64_t coroutine_fn nbd_co_get_block_status(BlockDriverState *bs,
+                                                    int64_t sector_num,
+                                                    int nb_sectors, int *pnum)
+{
+    BDRVNBDState *s = bs->opaque;
+    struct nbd_request request;
+    struct nbd_reply reply;
+    NBDExtent extent = { 0, 0 };
+    ssize_t ret;
+
+    if (!s->info.base_allocation) {
+        *pnum = nb_sectors;
+        return BDRV_BLOCK_DATA;
+    }
+
+    nb_sectors = MIN(nb_sectors, UINT32_MAX >> BDRV_SECTOR_BITS);
+    request.type = NBD_CMD_BLOCK_STATUS;
+    request.from = sector_num * 512;
+    request.len = nb_sectors * 512;
+
+    nbd_coroutine_start(s, &request);
+    ret = nbd_co_send_request(bs, &request, NULL, 0);
+    if (ret < 0) {
+        reply.error = -ret;
+    } else {
+        nbd_co_receive_reply(s, &request, &reply, NULL, 0, &extent);
+    }
+    nbd_coroutine_end(s, &request);
+    if (reply.error) {
+        return -reply.error;
+    }
+
+    if (extent.length < 512) {
+        /* The server did not describe a whole sector */
+        *pnum = 1;
+        return BDRV_BLOCK_DATA;
+    }
+    *pnum = MIN(extent.length / 512, nb_sectors);
+    if (!(extent.flags & NBD_STATE_ZERO)) {
+        return BDRV_BLOCK_DATA;
+    }
+    return (extent.flags & NBD_STATE_HOLE) ? BDRV_BLOCK_ZERO
+                                           : BDRV_BLOCK_DATA | BDRV_BLOCK_ZERO;
+}
+
 static void nbd_close(BlockDriverState *bs)
 {
     BDRVNBDState *s = bs->opaque;
@@ -561,6 +822,23 @@ static int64_t nbd_getlength(BlockDriverState *bs)
     return s->size;
 }
 
+static void nbd_detach_aio_context(BlockDriverState *bs)
+{
+    BDRVNBDState *s = bs->opaque;
+
+    aio_set_fd_handler(bdrv_get_aio_context(bs), s->sock,
+                       NULL, NULL, NULL, NULL);
+}
+
+static void nbd_attach_aio_context(BlockDriverState *bs,
+                                   AioContext *new_context)
+{
+    BDRVNBDState *s = bs->opaque;
+
+    aio_set_fd_handler(new_context, s->sock, nbd_reply_ready, NULL,
+                       nbd_have_request, s);
+}
+
 static BlockDriver bdrv_nbd = {
     .format_name         = "nbd",
     .protocol_name       = "nbd",
@@ -571,7 +849,10 @@ static BlockDriver bdrv_nbd = {
     .bdrv_close          = nbd_close,
     .bdrv_co_flush_to_os = nbd_co_flush,
     .bdrv_co_discard     = nbd_co_discard,
+    .bdrv_co_get_block_status = nbd_co_get_block_status,
     .bdrv_getlength      = nbd_getlength,
+    .bdrv_detach_aio_context = nbd_detach_aio_context,
+    .bdrv_attach_aio_context = nbd_attach_aio_context,
 };
 
 static BlockDriver bdrv_nbd_tcp = {
@@ -584,7 +865,10 @@ static BlockDriver bdrv_nbd_tcp = {
     .bdrv_close          = nbd_close,
     .bdrv_co_flush_to_os = nbd_co_flush,
     .bdrv_co_discard     = nbd_co_discard,
+    .bdrv_co_get_block_status = nbd_co_get_block_status,
     .bdrv_getlength      = nbd_getlength,
+    .bdrv_detach_aio_context = nbd_detach_aio_context,
+    .bdrv_attach_aio_context = nbd_attach_aio_context,
 };
 
 static BlockDriver bdrv_nbd_unix = {
@@ -597,7 +881,10 @@ static BlockDriver bdrv_nbd_unix = {
     .bdrv_close          = nbd_close,
     .bdrv_co_flush_to_os = nbd_co_flush,
     .bdrv_co_discard     = nbd_co_discard,
+    .bdrv_co_get_block_status = nbd_co_get_block_status,
     .bdrv_getlength      = nbd_getlength,
+    .bdrv_detach_aio_context = nbd_detach_aio_context,
+    .bdrv_attach_aio_context = nbd_attach_aio_context,
 };
 
 static void bdrv_nbd_init(void)
@@ -0,0 +1,376 @@
+/*
+ * Persistent dirty bitmaps for the QCOW version 2 format
+ *
+ * The named dirty bitmaps that are marked persistent are written to the
+ * image when it is closed, and listed in a header extension.  The
+ * extension is only valid as long as the autoclear bit
+ * QCOW2_AUTOCLEAR_DIRTY_BITMAPS is set: an older QEMU that writes to the
+ * image clears the bit, and the bitmaps are dropped on the next open.
+ *
+ * When opened read-write, the bitmaps are loaded and removed from the
+ * image at once, so that a crash cannot leave stale bitmaps behind.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu-common.h"
+#include "block/block_int.h"
+#include "block/qcow2.h"
+
+typedef struct Qcow2BitmapExtHeader {
+    uint32_t nb_bitmaps;
+    uint32_t reserved;
+} Qcow2BitmapExtHeader;
+
+typedef struct Qcow2BitmapEntry {
+    uint64_t offset;
+    uint64_t size;
+    uint32_t granularity_bits;
+    uint16_t name_size;
+    uint16_t flags;
+    /* followed by the name, padded to a multiple of 8 bytes */
+} Qcow2BitmapEntry;
+
+#define QCOW2_BITMAP_MIN_GRANULARITY_BITS   BDRV_SECTOR_BITS
+#define QCOW2_BITMAP_MAX_GRANULARITY_BITS   31
+
+static uint64_t bitmap_data_size(BlockDriverState *bs, int granularity_bits)
+{
+    uint64_t nb_bits = DIV_ROUND_UP(bs->total_sectors,
+        1ULL << (granularity_bits - BDRV_SECTOR_BITS));
+
+    return DIV_ROUND_UP(nb_bits, 8);
+}
+
+/*
+ * Walk the entries of the extension.  Returns the entry at @offset in the
+ * extension, converted to host endianness, and the offset of the next one
+ * in @next, or false if the entry is truncated.
+ */
+static bool bitmap_ext_entry(BDRVQcowState *s, uint32_t offset,
+                             Qcow2BitmapEntry *entry, char **name,
+                             uint32_t *next)
+{
+    uint8_t *ext = s->dirty_bitmaps_ext;
+
+    if (offset + sizeof(*entry) > s->dirty_bitmaps_ext_len) {
+        return false;
+    }
+    memcpy(entry, ext + offset, sizeof(*entry));
+    be64_to_cpus(&entry->offset);
+    be64_to_cpus(&entry->size);
+    be32_to_cpus(&entry->granularity_bits);
+    be16_to_cpus(&entry->name_size);
+    be16_to_cpus(&entry->flags);
+
+    offset += sizeof(*entry);
+    if (entry->name_size == 0 ||
+        offset + entry->name_size > s->dirty_bitmaps_ext_len) {
+        return false;
+    }
+    *name = g_strndup((char *) ext + offset, entry->name_size);
+    *next = offset + align_offset(entry->name_size, 8);
+    return true;
+}
+
+/*
+ * Return in @offset and @size the area of the image file used by bitmap
+ * @index of the extension, or false if there is no such bitmap.  Used by
+ * the refcount check while the extension is still in the header.
+ */
+bool qcow2_dirty_bitmap_area(BlockDriverState *bs, int index,
+                             uint64_t *offset, uint64_t *size)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2BitmapExtHeader header;
+    Qcow2BitmapEntry entry;
+    uint32_t pos, next;
+    char *name;
+    int i;
+
+    if (!s->dirty_bitmaps_ext || s->dirty_bitmaps_ext_len < sizeof(header)) {
+        return false;
+    }
+    memcpy(&header, s->dirty_bitmaps_ext, sizeof(header));
+    if (index >= be32_to_cpu(header.nb_bitmaps)) {
+        return false;
+    }
+
+    pos = sizeof(header);
+    for (i = 0; i <= index; i++) {
+        if (!bitmap_ext_entry(s, pos, &entry, &name, &next)) {
+            return false;
+        }
+        g_free(name);
+        pos = next;
+    }
+
+    *offset = entry.offset;
+    *size = entry.size;
+    return true;
+}
+
+static int load_bitmap(BlockDriverState *bs, Qcow2BitmapEntry *entry,
+                       const char *name)
+{
+    BDRVQcowState *s = bs->opaque;
+    BdrvDirtyBitmap *bitmap;
+    Error *local_err = NULL;
+    uint8_t *data;
+    uint64_t i;
+    int ret;
+
+    if (entry->granularity_bits < QCOW2_BITMAP_MIN_GRANULARITY_BITS ||
+        entry->granularity_bits > QCOW2_BITMAP_MAX_GRANULARITY_BITS ||
+        entry->size != bitmap_data_size(bs, entry->granularity_bits) ||
+        (entry->offset & (s->cluster_size - 1)) ||
+        (entry->size && !entry->offset)) {
+        error_report("qcow2: invalid dirty bitmap '%s' dropped", name);
+        return 0;
+    }
+
+    /* after qcow2_invalidate_cache() the bitmap is still there */
+    if (bdrv_find_dirty_bitmap(bs, name)) {
+        return 0;
+    }
+
+    data = g_malloc(entry->size);
+    ret = bdrv_pread(bs->file, entry->offset, data, entry->size);
+    if (ret < 0) {
+        g_free(data);
+        return ret;
+    }
+
+    bitmap = bdrv_create_dirty_bitmap(bs, name, 1LL << entry->granularity_bits,
+                                      &local_err);
+    if (!bitmap) {
+        error_report("qcow2: dirty bitmap '%s': %s", name,
+                     error_get_pretty(local_err));
+        error_free(local_err);
+        g_free(data);
+        return 0;
+    }
+    bitmap->persistent = true;
+
+    for (i = 0; i < entry->size * 8; i++) {
+        int64_t sector = i << (entry->granularity_bits - BDRV_SECTOR_BITS);
+
+        if (sector >= bs->total_sectors) {
+            break;
+        }
+        if (data[i / 8] & (1 << (i % 8))) {
+            bdrv_dirty_bitmap_set(bitmap, sector, 1);
+        }
+    }
+
+    g_free(data);
+    return 0;
+}
+
+/*
+ * Called at the end of a read-write open.  Loads the bitmaps listed in
+ * the extension if it is still valid, then removes the extension from the
+ * header and frees the clusters of the bitmaps.
+ */
+int qcow2_load_dirty_bitmaps(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2BitmapExtHeader header;
+    Qcow2BitmapEntry entry;
+    uint32_t offset, next;
+    uint8_t *ext;
+    bool valid;
+    char *name;
+    int ret;
+    uint32_t i;
+
+    if (!s->dirty_bitmaps_ext) {
+        return 0;
+    }
+
+    valid = s->autoclear_features & QCOW2_AUTOCLEAR_DIRTY_BITMAPS;
+    if (s->dirty_bitmaps_ext_len < sizeof(header)) {
+        valid = false;
+        header.nb_bitmaps = 0;
+    } else {
+        memcpy(&header, s->dirty_bitmaps_ext, sizeof(header));
+        be32_to_cpus(&header.nb_bitmaps);
+    }
+
+    if (valid) {
+        offset = sizeof(header);
+        for (i = 0; i < header.nb_bitmaps; i++) {
+            if (!bitmap_ext_entry(s, offset, &entry, &name, &next)) {
+                break;
+            }
+            ret = load_bitmap(bs, &entry, name);
+            g_free(name);
+            if (ret < 0) {
+                return ret;
+            }
+            offset = next;
+        }
+    }
+
+    /* Drop the extension before its clusters can be reused */
+    ext = s->dirty_bitmaps_ext;
+    s->dirty_bitmaps_ext = NULL;
+    s->autoclear_features &= ~QCOW2_AUTOCLEAR_DIRTY_BITMAPS;
+    ret = qcow2_update_header(bs);
+    if (ret < 0) {
+        s->dirty_bitmaps_ext = ext;
+        return ret;
+    }
+
+    /* The clusters were allocated by this driver even if the extension is
+     * stale; an older QEMU does not know about them and leaves them alone */
+    s->dirty_bitmaps_ext = ext;
+    offset = sizeof(header);
+    for (i = 0; i < header.nb_bitmaps; i++) {
+        if (!bitmap_ext_entry(s, offset, &entry, &name, &next)) {
+            break;
+        }
+        g_free(name);
+        if (entry.size && entry.offset &&
+            !(entry.offset & (s->cluster_size - 1))) {
+            qcow2_free_clusters(bs, entry.offset, entry.size);
+        }
+        offset = next;
+    }
+
+    g_free(s->dirty_bitmaps_ext);
+    s->dirty_bitmaps_ext = NULL;
+    s->dirty_bitmaps_ext_len = 0;
+    return 0;
+}
+
+static int store_bitmap(BlockDriverState *bs, BdrvDirtyBitmap *bitmap,
+                        Qcow2BitmapEntry *entry)
+{
+    int granularity = hbitmap_granularity(bitmap->bitmap);
+    uint64_t size = bitmap_data_size(bs, granularity + BDRV_SECTOR_BITS);
+    HBitmapIter hbi;
+    int64_t sector, offset = 0;
+    uint8_t *data;
+    int ret;
+
+    if (size) {
+        data = g_malloc0(size);
+        hbitmap_iter_init(&hbi, bitmap->bitmap, 0);
+        while ((sector = hbitmap_iter_next(&hbi)) >= 0 &&
+               sector < bs->total_sectors) {
+            uint64_t bit = sector >> granularity;
+            data[bit / 8] |= 1 << (bit % 8);
+        }
+
+        offset = qcow2_alloc_clusters(bs, size);
+        if (offset < 0) {
+            g_free(data);
+            return offset;
+        }
+
+        ret = bdrv_pwrite(bs->file, offset, data, size);
+        g_free(data);
+        if (ret < 0) {
+            qcow2_free_clusters(bs, offset, size);
+            return ret;
+        }
+    }
+
+    entry->offset = cpu_to_be64(offset);
+    entry->size = cpu_to_be64(size);
+    entry->granularity_bits = cpu_to_be32(granularity + BDRV_SECTOR_BITS);
+    entry->name_size = cpu_to_be16(strlen(bitmap->name));
+    entry->flags = 0;
+    return 0;
+}
+
+/*
+ * Called when an image that was opened read-write is closed.  Writes the
+ * persistent bitmaps of @bs and lists them in the header.
+ */
+int qcow2_store_dirty_bitmaps(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    BdrvDirtyBitmap *bitmap;
+    Qcow2BitmapExtHeader *header;
+    Qcow2BitmapEntry *entry;
+    uint32_t nb_bitmaps = 0, len, offset;
+    uint8_t *ext;
+    int ret;
+
+    /* only version 3 has the autoclear bits that keep them consistent */
+    if (s->qcow_version < 3) {
+        return 0;
+    }
+
+    len = sizeof(*header);
+    QLIST_FOREACH(bitmap, &bs->dirty_bitmaps, list) {
+        if (bitmap->persistent && strlen(bitmap->name) <= UINT16_MAX) {
+            nb_bitmaps++;
+            len += sizeof(*entry) + align_offset(strlen(bitmap->name), 8);
+        }
+    }
+    if (nb_bitmaps == 0) {
+        return 0;
+    }
+
+    ext = g_malloc0(len);
+    header = (Qcow2BitmapExtHeader *) ext;
+    header->nb_bitmaps = cpu_to_be32(nb_bitmaps);
+
+    offset = sizeof(*header);
+    QLIST_FOREACH(bitmap, &bs->dirty_bitmaps, list) {
+        if (!bitmap->persistent || strlen(bitmap->name) > UINT16_MAX) {
+            continue;
+        }
+        entry = (Qcow2BitmapEntry *) (ext + offset);
+        ret = store_bitmap(bs, bitmap, entry);
+        if (ret < 0) {
+            goto fail;
+        }
+        offset += sizeof(*entry);
+        memcpy(ext + offset, bitmap->name, strlen(bitmap->name));
+        offset += align_offset(strlen(bitmap->name), 8);
+    }
+
+    /* The bitmaps and their refcounts must be stable before the header
+     * points to them */
+    ret = qcow2_cache_flush(bs, s->refcount_block_cache);
+    if (ret < 0) {
+        goto fail;
+    }
+    ret = bdrv_flush(bs->file);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    s->dirty_bitmaps_ext = ext;
+    s->dirty_bitmaps_ext_len = len;
+    s->autoclear_features |= QCOW2_AUTOCLEAR_DIRTY_BITMAPS;
+    ret = qcow2_update_header(bs);
+    if (ret < 0) {
+        s->autoclear_features &= ~QCOW2_AUTOCLEAR_DIRTY_BITMAPS;
+        s->dirty_bitmaps_ext = NULL;
+        s->dirty_bitmaps_ext_len = 0;
+        offset = len;
+        goto fail;
+    }
+    return 0;
+
+fail:
+    /* free the clusters of the bitmaps that were written */
+    len = offset;
+    offset = sizeof(*header);
+    while (offset + sizeof(*entry) <= len) {
+        entry = (Qcow2BitmapEntry *) (ext + offset);
+        if (entry->size) {
+            qcow2_free_clusters(bs, be64_to_cpu(entry->offset),
+                                be64_to_cpu(entry->size));
+        }
+        offset += sizeof(*entry) + align_offset(be16_to_cpu(entry->name_size), 8);
+    }
+    g_free(ext);
+    return ret;
+}
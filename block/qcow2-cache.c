@@ -27,33 +27,87 @@
 #include "qcow2.h"
 #include "trace.h"
 
+/*
+ * Each cache entry holds one table of c->table_size bytes: a whole refcount
+ * block, or a slice of an L2 table.  Lookups go through a hash table keyed
+ * by the offset of the table in the image file; entries that nobody holds a
+ * reference to are kept on a LRU list, whose head is replaced first.
+ *
+ * Readers look up tables with s->lock held shared, so several coroutines can
+ * miss at the same time.  An entry is taken off the LRU list before it is
+ * written back and loaded, and is marked as loading while the read is in
+ * flight; lookups that find it wait for the read to complete instead of
+ * loading the same table into a second entry.
+ */
 typedef struct Qcow2CachedTable {
-    void*   table;
     int64_t offset;
     bool    dirty;
-    int     cache_hits;
+    bool    loading;
     int     ref;
+    QTAILQ_ENTRY(Qcow2CachedTable) lru;
 } Qcow2CachedTable;
 
 struct Qcow2Cache {
     Qcow2CachedTable*       entries;
     struct Qcow2Cache*      depends;
     int                     size;
+    int                     table_size;
     bool                    depends_on_flush;
+    void*                   table_array;
+    GHashTable*             lookup;
+    QTAILQ_HEAD(, Qcow2CachedTable) lru_list;
+    CoQueue                 waiters;
+    uint64_t                hits;
+    uint64_t                misses;
 };
 
-Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables)
+static inline void *qcow2_cache_get_table_addr(Qcow2Cache *c, int i)
+{
+    return (uint8_t *) c->table_array + (size_t) i * c->table_size;
+}
+
+static inline int qcow2_cache_get_table_idx(Qcow2Cache *c, void *table)
+{
+    ptrdiff_t table_offset = (uint8_t *) table - (uint8_t *) c->table_array;
+    int idx = table_offset / c->table_size;
+
+    assert(idx >= 0 && idx < c->size && table_offset % c->table_size == 0);
+    return idx;
+}
+
+/* g_int64_hash() needs a newer glib than we require */
+static guint qcow2_cache_offset_hash(gconstpointer key)
+{
+    uint64_t offset = *(const int64_t *) key;
+
+    return (guint) (offset >> 9) ^ (guint) (offset >> 32);
+}
+
+static gboolean qcow2_cache_offset_equal(gconstpointer a, gconstpointer b)
+{
+    return *(const int64_t *) a == *(const int64_t *) b;
+}
+
+Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
+                               int table_size)
 {
-    BDRVQcowState *s = bs->opaque;
     Qcow2Cache *c;
     int i;
 
+    assert(num_tables > 0 && table_size >= 512);
+
     c = g_malloc0(sizeof(*c));
     c->size = num_tables;
+    c->table_size = table_size;
     c->entries = g_malloc0(sizeof(*c->entries) * num_tables);
+    c->table_array = qemu_blockalign(bs, (size_t) num_tables * table_size);
+    c->lookup = g_hash_table_new(qcow2_cache_offset_hash,
+                                 qcow2_cache_offset_equal);
 
+    QTAILQ_INIT(&c->lru_list);
+    qemu_co_queue_init(&c->waiters);
     for (i = 0; i < c->size; i++) {
-        c->entries[i].table = qemu_blockalign(bs, s->cluster_size);
+        QTAILQ_INSERT_TAIL(&c->lru_list, &c->entries[i], lru);
     }
 
     return c;
@@ -61,13 +115,17 @@ Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables)
 
 int qcow2_cache_destroy(BlockDriverState* bs, Qcow2Cache *c)
 {
+    BDRVQcowState *s = bs->opaque;
     int i;
 
+    trace_qcow2_cache_stats(c == s->l2_table_cache, c->hits, c->misses);
+
     for (i = 0; i < c->size; i++) {
         assert(c->entries[i].ref == 0);
-        qemu_vfree(c->entries[i].table);
     }
 
+    g_hash_table_destroy(c->lookup);
+    qemu_vfree(c->table_array);
     g_free(c->entries);
     g_free(c);
 
@@ -120,8 +178,8 @@ static int qcow2_cache_entry_flush(BlockDriverState *bs, Qcow2Cache *c, int i)
         BLKDBG_EVENT(bs->file, BLKDBG_L2_UPDATE);
     }
 
-    ret = bdrv_pwrite(bs->file, c->entries[i].offset, c->entries[i].table,
-        s->cluster_size);
+    ret = bdrv_pwrite(bs->file, c->entries[i].offset,
+                      qcow2_cache_get_table_addr(c, i), c->table_size);
     if (ret < 0) {
         return ret;
     }
@@ -157,6 +215,31 @@ int qcow2_cache_flush(BlockDriverState *bs, Qcow2Cache *c)
     return result;
 }
 
+/*
+ * Like qcow2_cache_flush(), but only write back the tables that lie in
+ * [offset, offset + size) of the image file, so that making one table
+ * stable does not wait for the dirty tables of unrelated requests.
+ */
+int qcow2_cache_flush_range(BlockDriverState *bs, Qcow2Cache *c,
+                            uint64_t offset, uint64_t size)
+{
+    Qcow2CachedTable *t;
+    int64_t key;
+    int ret;
+
+    for (key = offset; key < offset + size; key += c->table_size) {
+        t = g_hash_table_lookup(c->lookup, &key);
+        if (t) {
+            ret = qcow2_cache_entry_flush(bs, c, t - c->entries);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+    }
+
+    return bdrv_flush(bs->file);
+}
+
 int qcow2_cache_set_dependency(BlockDriverState *bs, Qcow2Cache *c,
     Qcow2Cache *dependency)
 {
@@ -185,51 +268,76 @@ void qcow2_cache_depends_on_flush(Qcow2Cache *c)
     c->depends_on_flush = true;
 }
 
+/* Take the least recently used entry that nobody holds a reference to, or
+ * return -1 if all of them are in use
+ */
 static int qcow2_cache_find_entry_to_replace(Qcow2Cache *c)
 {
-    int i;
-    int min_count = INT_MAX;
-    int min_index = -1;
-
+    Qcow2CachedTable *t = QTAILQ_FIRST(&c->lru_list);
 
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].ref) {
-            continue;
-        }
+    if (!t) {
+        return -1;
+    }
+    return t - c->entries;
+}
 
-        if (c->entries[i].cache_hits < min_count) {
-            min_index = i;
-            min_count = c->entries[i].cache_hits;
-        }
+static void qcow2_cache_ref(Qcow2Cache *c, int i)
+{
+    if (c->entries[i].ref++ == 0) {
+        QTAILQ_REMOVE(&c->lru_list, &c->entries[i], lru);
+    }
+}
 
-        /* Give newer hits priority */
-        /* TODO Check how to optimize the replacement strategy */
-        c->entries[i].cache_hits /= 2;
+static void qcow2_cache_unref(Qcow2Cache *c, int i)
+{
+    c->entries[i].ref--;
+    assert(c->entries[i].ref >= 0);
+    if (c->entries[i].ref == 0) {
+        QTAILQ_INSERT_TAIL(&c->lru_list, &c->entries[i], lru);
+        qemu_co_queue_restart_all(&c->waiters);
     }
+}
+
+static void qcow2_cache_set_offset(Qcow2Cache *c, int i, int64_t offset)
+{
+    Qcow2CachedTable *t = &c->entries[i];
 
-    if (min_index == -1) {
-        /* This can't happen in current synchronous code, but leave the check
-         * here as a reminder for whoever starts using AIO with the cache */
-        abort();
+    /* the key points into the entry, so it must leave the table first */
+    if (t->offset) {
+        g_hash_table_remove(c->lookup, &t->offset);
+    }
+    t->offset = offset;
+    if (offset) {
+        g_hash_table_insert(c->lookup, &t->offset, t);
     }
-    return min_index;
 }
 
 static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
     uint64_t offset, void **table, bool read_from_disk)
 {
     BDRVQcowState *s = bs->opaque;
+    Qcow2CachedTable *t;
+    int64_t key = offset;
     int i;
     int ret;
 
     trace_qcow2_cache_get(qemu_coroutine_self(), c == s->l2_table_cache,
                           offset, read_from_disk);
 
+    assert(offset != 0);
+
+retry:
     /* Check if the table is already cached */
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].offset == offset) {
-            goto found;
+    t = g_hash_table_lookup(c->lookup, &key);
+    if (t) {
+        if (t->loading) {
+            qemu_co_queue_wait(&c->waiters);
+            goto retry;
         }
+        i = t - c->entries;
+        c->hits++;
+        qcow2_cache_ref(c, i);
+        goto found;
     }
 
     /* If not, write a table back and replace it */
@@ -237,43 +345,62 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
     trace_qcow2_cache_get_replace_entry(qemu_coroutine_self(),
                                         c == s->l2_table_cache, i);
     if (i < 0) {
-        return i;
+        /* every entry is being loaded or used by another request */
+        qemu_co_queue_wait(&c->waiters);
+        goto retry;
     }
 
+    /* Keep other requests from picking the same entry, or from using the
+     * table that it still holds, while we yield
+     */
+    qcow2_cache_ref(c, i);
+    c->entries[i].loading = true;
     ret = qcow2_cache_entry_flush(bs, c, i);
     if (ret < 0) {
-        return ret;
+        goto fail;
+    }
+
+    /* somebody may have loaded the table while we were flushing */
+    if (g_hash_table_lookup(c->lookup, &key)) {
+        c->entries[i].loading = false;
+        qemu_co_queue_restart_all(&c->waiters);
+        qcow2_cache_unref(c, i);
+        goto retry;
     }
 
     trace_qcow2_cache_get_read(qemu_coroutine_self(),
                                c == s->l2_table_cache, i);
-    c->entries[i].offset = 0;
+    qcow2_cache_set_offset(c, i, offset);
     if (read_from_disk) {
         if (c == s->l2_table_cache) {
             BLKDBG_EVENT(bs->file, BLKDBG_L2_LOAD);
         }
 
-        ret = bdrv_pread(bs->file, offset, c->entries[i].table, s->cluster_size);
+        c->misses++;
+        ret = bdrv_pread(bs->file, offset, qcow2_cache_get_table_addr(c, i),
+                         c->table_size);
         if (ret < 0) {
-            return ret;
+            qcow2_cache_set_offset(c, i, 0);
+            goto fail;
         }
     }
-
-    /* Give the table some hits for the start so that it won't be replaced
-     * immediately. The number 32 is completely arbitrary. */
-    c->entries[i].cache_hits = 32;
-    c->entries[i].offset = offset;
+    c->entries[i].loading = false;
+    qemu_co_queue_restart_all(&c->waiters);
 
     /* And return the right table */
 found:
-    c->entries[i].cache_hits++;
-    c->entries[i].ref++;
-    *table = c->entries[i].table;
+    *table = qcow2_cache_get_table_addr(c, i);
 
     trace_qcow2_cache_get_done(qemu_coroutine_self(),
                                c == s->l2_table_cache, i);
 
     return 0;
+
+fail:
+    c->entries[i].loading = false;
+    qemu_co_queue_restart_all(&c->waiters);
+    qcow2_cache_unref(c, i);
+    return ret;
 }
 
 int qcow2_cache_get(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
@@ -290,34 +417,16 @@ int qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
 
 int qcow2_cache_put(BlockDriverState *bs, Qcow2Cache *c, void **table)
 {
-    int i;
+    int i = qcow2_cache_get_table_idx(c, *table);
 
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].table == *table) {
-            goto found;
-        }
-    }
-    return -ENOENT;
-
-found:
-    c->entries[i].ref--;
+    qcow2_cache_unref(c, i);
     *table = NULL;
-
-    assert(c->entries[i].ref >= 0);
     return 0;
 }
 
 void qcow2_cache_entry_mark_dirty(Qcow2Cache *c, void *table)
 {
-    int i;
+    int i = qcow2_cache_get_table_idx(c, table);
 
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].table == table) {
-            goto found;
-        }
-    }
-    abort();
-
-found:
     c->entries[i].dirty = true;
 }
@@ -27,6 +27,7 @@
 #include "qemu-common.h"
 #include "block/block_int.h"
 #include "block/qcow2.h"
+#include "block/thread-pool.h"
 #include "trace.h"
 
 int qcow2_grow_l1_table(BlockDriverState *bs, int min_size, bool exact_size)
@@ -106,20 +107,23 @@ int qcow2_grow_l1_table(BlockDriverState *bs, int min_size, bool exact_size)
 /*
  * l2_load
  *
- * Loads a L2 table into memory. If the table is in the cache, the cache
- * is used; otherwise the L2 table is loaded from the image file.
+ * Loads the slice of the L2 table at @l2_offset that maps the guest
+ * @offset into memory. If the slice is in the cache, the cache is used;
+ * otherwise it is loaded from the image file.
  *
- * Returns a pointer to the L2 table on success, or NULL if the read from
- * the image file failed.
+ * Returns 0 and stores the slice in *l2_slice on success, -errno if the
+ * read from the image file failed.
  */
 
-static int l2_load(BlockDriverState *bs, uint64_t l2_offset,
-    uint64_t **l2_table)
+static int l2_load(BlockDriverState *bs, uint64_t offset,
+    uint64_t l2_offset, uint64_t **l2_slice)
 {
     BDRVQcowState *s = bs->opaque;
     int ret;
 
-    ret = qcow2_cache_get(bs, s->l2_table_cache, l2_offset, (void**) l2_table);
+    ret = qcow2_cache_get(bs, s->l2_table_cache,
+                          l2_slice_offset(s, l2_offset, offset),
+                          (void**) l2_slice);
 
     return ret;
 }
@@ -159,15 +163,19 @@ static int write_l1_entry(BlockDriverState *bs, int l1_index)
  * table) copy the contents of the old L2 table into the newly allocated one.
  * Otherwise the new table is initialized with zeros.
  *
+ * The table is written slice by slice through the L2 cache; the caller
+ * loads the slice it needs afterwards.
  */
 
-static int l2_allocate(BlockDriverState *bs, int l1_index, uint64_t **table)
+static int l2_allocate(BlockDriverState *bs, int l1_index)
 {
     BDRVQcowState *s = bs->opaque;
     uint64_t old_l2_offset;
-    uint64_t *l2_table;
+    uint64_t *l2_slice = NULL;
     int64_t l2_offset;
-    int ret;
+    int slice_bytes = s->l2_slice_size * sizeof(uint64_t);
+    int n_slices = s->cluster_size / slice_bytes;
+    int ret, slice;
 
     old_l2_offset = s->l1_table[l1_index];
 
@@ -180,39 +188,53 @@ static int l2_allocate(BlockDriverState *bs, int l1_index, uint64_t **table)
         return l2_offset;
     }
 
-    ret = qcow2_cache_flush(bs, s->refcount_block_cache);
-    if (ret < 0) {
-        goto fail;
+    /* With lazy refcounts, the refcount blocks are written back on flush
+     * like the rest of the metadata; the dirty bit covers a crash */
+    if (s->compatible_features & QCOW2_COMPAT_LAZY_REFCOUNTS) {
+        qcow2_mark_dirty(bs);
     }
-
-    /* allocate a new entry in the l2 cache */
-
-    trace_qcow2_l2_allocate_get_empty(bs, l1_index);
-    ret = qcow2_cache_get_empty(bs, s->l2_table_cache, l2_offset, (void**) table);
-    if (ret < 0) {
-        return ret;
+    if (qcow2_need_accurate_refcounts(s)) {
+        ret = qcow2_cache_flush(bs, s->refcount_block_cache);
+        if (ret < 0) {
+            goto fail;
+        }
     }
 
-    l2_table = *table;
-
-    if ((old_l2_offset & L1E_OFFSET_MASK) == 0) {
-        /* if there was no old l2 table, clear the new table */
-        memset(l2_table, 0, s->l2_size * sizeof(uint64_t));
-    } else {
-        uint64_t* old_table;
-
-        /* if there was an old l2 table, read it from the disk */
-        BLKDBG_EVENT(bs->file, BLKDBG_L2_ALLOC_COW_READ);
-        ret = qcow2_cache_get(bs, s->l2_table_cache,
-            old_l2_offset & L1E_OFFSET_MASK,
-            (void**) &old_table);
+    for (slice = 0; slice < n_slices; slice++) {
+        /* allocate a new entry in the l2 cache */
+        trace_qcow2_l2_allocate_get_empty(bs, l1_index);
+        ret = qcow2_cache_get_empty(bs, s->l2_table_cache,
+                                    l2_offset + slice * slice_bytes,
+                                    (void**) &l2_slice);
         if (ret < 0) {
             goto fail;
         }
 
-        memcpy(l2_table, old_table, s->cluster_size);
+        if ((old_l2_offset & L1E_OFFSET_MASK) == 0) {
+            /* if there was no old l2 table, clear the new table */
+            memset(l2_slice, 0, slice_bytes);
+        } else {
+            uint64_t* old_slice;
+
+            /* if there was an old l2 table, read it from the disk */
+            BLKDBG_EVENT(bs->file, BLKDBG_L2_ALLOC_COW_READ);
+            ret = qcow2_cache_get(bs, s->l2_table_cache,
+                (old_l2_offset & L1E_OFFSET_MASK) + slice * slice_bytes,
+                (void**) &old_slice);
+            if (ret < 0) {
+                goto fail;
+            }
+
+            memcpy(l2_slice, old_slice, slice_bytes);
 
-        ret = qcow2_cache_put(bs, s->l2_table_cache, (void**) &old_table);
+            ret = qcow2_cache_put(bs, s->l2_table_cache, (void**) &old_slice);
+            if (ret < 0) {
+                goto fail;
+            }
+        }
+
+        qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_slice);
+        ret = qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_slice);
         if (ret < 0) {
             goto fail;
         }
@@ -222,8 +244,8 @@ static int l2_allocate(BlockDriverState *bs, int l1_index, uint64_t **table)
     BLKDBG_EVENT(bs->file, BLKDBG_L2_ALLOC_WRITE);
 
     trace_qcow2_l2_allocate_write_l2(bs, l1_index);
-    qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_table);
-    ret = qcow2_cache_flush(bs, s->l2_table_cache);
+    ret = qcow2_cache_flush_range(bs, s->l2_table_cache, l2_offset,
+                                  s->cluster_size);
     if (ret < 0) {
         goto fail;
     }
@@ -236,13 +258,14 @@ static int l2_allocate(BlockDriverState *bs, int l1_index, uint64_t **table)
         goto fail;
     }
 
-    *table = l2_table;
     trace_qcow2_l2_allocate_done(bs, l1_index, 0);
     return 0;
 
 fail:
     trace_qcow2_l2_allocate_done(bs, l1_index, ret);
-    qcow2_cache_put(bs, s->l2_table_cache, (void**) table);
+    if (l2_slice) {
+        qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_slice);
+    }
     s->l1_table[l1_index] = old_l2_offset;
     return ret;
 }
@@ -314,6 +337,62 @@ void qcow2_encrypt_sectors(BDRVQcowState *s, int64_t sector_num,
     }
 }
 
+/*
+ * Batches of at least this many sectors are encrypted in the thread pool,
+ * where they don't hold up the main loop; smaller ones are not worth the
+ * round trip.
+ */
+#define QCOW2_CRYPT_THREAD_SECTORS 128
+
+typedef struct Qcow2CryptData {
+    BDRVQcowState *s;
+    int64_t sector_num;
+    uint8_t *out_buf;
+    const uint8_t *in_buf;
+    int nb_sectors;
+    int enc;
+    const AES_KEY *key;
+} Qcow2CryptData;
+
+static int qcow2_crypt_worker(void *opaque)
+{
+    Qcow2CryptData *data = opaque;
+
+    qcow2_encrypt_sectors(data->s, data->sector_num, data->out_buf,
+                          data->in_buf, data->nb_sectors, data->enc,
+                          data->key);
+    return 0;
+}
+
+/* Like qcow2_encrypt_sectors(), but yields to the thread pool for large
+ * batches.  The caller must keep the buffers alive but need not hold
+ * s->lock: the keys do not change while the image is open. */
+void coroutine_fn qcow2_co_encrypt_sectors(BlockDriverState *bs,
+                                           int64_t sector_num,
+                                           uint8_t *out_buf,
+                                           const uint8_t *in_buf,
+                                           int nb_sectors, int enc,
+                                           const AES_KEY *key)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2CryptData data = {
+        .s          = s,
+        .sector_num = sector_num,
+        .out_buf    = out_buf,
+        .in_buf     = in_buf,
+        .nb_sectors = nb_sectors,
+        .enc        = enc,
+        .key        = key,
+    };
+
+    if (nb_sectors < QCOW2_CRYPT_THREAD_SECTORS) {
+        qcow2_crypt_worker(&data);
+        return;
+    }
+    thread_pool_submit_co(aio_get_thread_pool(bdrv_get_aio_context(bs)),
+                          qcow2_crypt_worker, &data);
+}
+
 static int coroutine_fn copy_sectors(BlockDriverState *bs,
                                      uint64_t start_sect,
                                      uint64_t cluster_offset,
@@ -355,9 +434,9 @@ static int coroutine_fn copy_sectors(BlockDriverState *bs,
     }
 
     if (s->crypt_method) {
-        qcow2_encrypt_sectors(s, start_sect + n_start,
-                        iov.iov_base, iov.iov_base, n, 1,
-                        &s->aes_encrypt_key);
+        qcow2_co_encrypt_sectors(bs, start_sect + n_start,
+                                 iov.iov_base, iov.iov_base, n, 1,
+                                 &s->aes_encrypt_key);
     }
 
     BLKDBG_EVENT(bs->file, BLKDBG_COW_WRITE);
@@ -395,19 +474,20 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
     uint64_t l2_offset, *l2_table;
     int l1_bits, c;
     unsigned int index_in_cluster, nb_clusters;
-    uint64_t nb_available, nb_needed;
+    uint64_t nb_available, nb_needed, slice_coverage;
     int ret;
 
     index_in_cluster = (offset >> 9) & (s->cluster_sectors - 1);
     nb_needed = *num + index_in_cluster;
 
     l1_bits = s->l2_bits + s->cluster_bits;
+    slice_coverage = (uint64_t) s->l2_slice_size << s->cluster_bits;
 
     /* compute how many bytes there are between the offset and
-     * the end of the l1 entry
+     * the end of the l2 slice that maps it
      */
 
-    nb_available = (1ULL << l1_bits) - (offset & ((1ULL << l1_bits) - 1));
+    nb_available = slice_coverage - (offset & (slice_coverage - 1));
 
     /* compute the number of available sectors */
 
@@ -433,16 +513,16 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
         goto out;
     }
 
-    /* load the l2 table in memory */
+    /* load the l2 slice in memory */
 
-    ret = l2_load(bs, l2_offset, &l2_table);
+    ret = l2_load(bs, offset, l2_offset, &l2_table);
     if (ret < 0) {
         return ret;
     }
 
     /* find the cluster offset for the given disk offset */
 
-    l2_index = (offset >> s->cluster_bits) & (s->l2_size - 1);
+    l2_index = offset_to_l2_slice_index(s, offset);
     *cluster_offset = be64_to_cpu(l2_table[l2_index]);
     nb_clusters = size_to_clusters(s, nb_needed << 9);
 
@@ -492,10 +572,10 @@ out:
  * get_cluster_table
  *
  * for a given disk offset, load (and allocate if needed)
- * the l2 table.
+ * the slice of the l2 table that maps it.
  *
- * the l2 table offset in the qcow2 file and the cluster index
- * in the l2 table are given to the caller.
+ * the l2 slice and the index of the cluster in the slice are
+ * given to the caller.
  *
  * Returns 0 on success, -errno in failure case
  */
@@ -523,15 +603,9 @@ static int get_cluster_table(BlockDriverState *bs, uint64_t offset,
 
     /* seek the l2 table of the given l2 offset */
 
-    if (s->l1_table[l1_index] & QCOW_OFLAG_COPIED) {
-        /* load the l2 table in memory */
-        ret = l2_load(bs, l2_offset, &l2_table);
-        if (ret < 0) {
-            return ret;
-        }
-    } else {
+    if (!(s->l1_table[l1_index] & QCOW_OFLAG_COPIED)) {
         /* First allocate a new L2 table (and do COW if needed) */
-        ret = l2_allocate(bs, l1_index, &l2_table);
+        ret = l2_allocate(bs, l1_index);
         if (ret < 0) {
             return ret;
         }
@@ -540,11 +614,19 @@ static int get_cluster_table(BlockDriverState *bs, uint64_t offset,
         if (l2_offset) {
             qcow2_free_clusters(bs, l2_offset, s->l2_size * sizeof(uint64_t));
         }
+
+        l2_offset = s->l1_table[l1_index] & L1E_OFFSET_MASK;
+    }
+
+    /* load the l2 slice in memory */
+    ret = l2_load(bs, offset, l2_offset, &l2_table);
+    if (ret < 0) {
+        return ret;
     }
 
     /* find the cluster offset for the given disk offset */
 
-    l2_index = (offset >> s->cluster_bits) & (s->l2_size - 1);
+    l2_index = offset_to_l2_slice_index(s, offset);
 
     *new_l2_table = l2_table;
     *new_l2_index = l2_index;
@@ -624,11 +706,11 @@ static int perform_cow(BlockDriverState *bs, QCowL2Meta *m, Qcow2COWRegion *r)
         return 0;
     }
 
-    qemu_co_mutex_unlock(&s->lock);
+    qemu_co_rwlock_unlock(&s->lock);
     ret = copy_sectors(bs, m->offset / BDRV_SECTOR_SIZE, m->alloc_offset,
                        r->offset / BDRV_SECTOR_SIZE,
                        r->offset / BDRV_SECTOR_SIZE + r->nb_sectors);
-    qemu_co_mutex_lock(&s->lock);
+    qemu_co_rwlock_wrlock(&s->lock);
 
     if (ret < 0) {
         return ret;
@@ -783,9 +865,9 @@ static int handle_dependencies(BlockDriverState *bs, uint64_t guest_offset,
             if (*nb_clusters == 0) {
                 /* Wait for the dependency to complete. We need to recheck
                  * the free/allocated clusters when we continue. */
-                qemu_co_mutex_unlock(&s->lock);
+                qemu_co_rwlock_unlock(&s->lock);
                 qemu_co_queue_wait(&old_alloc->dependent_requests);
-                qemu_co_mutex_lock(&s->lock);
+                qemu_co_rwlock_wrlock(&s->lock);
                 return -EAGAIN;
             }
         }
@@ -820,8 +902,8 @@ static int handle_dependencies(BlockDriverState *bs, uint64_t guest_offset,
 static int do_alloc_cluster_offset(BlockDriverState *bs, uint64_t guest_offset,
     uint64_t *host_offset, unsigned int *nb_clusters)
 {
-    BDRVQcowState *s = bs->opaque;
-    int ret;
+    int64_t cluster_offset;
+    int n, ret;
 
     trace_qcow2_do_alloc_clusters_offset(qemu_coroutine_self(), guest_offset,
                                          *host_offset, *nb_clusters);
@@ -833,22 +915,15 @@ static int do_alloc_cluster_offset(BlockDriverState *bs, uint64_t guest_offset,
 
     /* Allocate new clusters */
     trace_qcow2_cluster_alloc_phys(qemu_coroutine_self());
-    if (*host_offset == 0) {
-        int64_t cluster_offset =
-            qcow2_alloc_clusters(bs, *nb_clusters * s->cluster_size);
-        if (cluster_offset < 0) {
-            return cluster_offset;
-        }
-        *host_offset = cluster_offset;
-        return 0;
-    } else {
-        ret = qcow2_alloc_clusters_at(bs, *host_offset, *nb_clusters);
-        if (ret < 0) {
-            return ret;
-        }
-        *nb_clusters = ret;
-        return 0;
+    n = *nb_clusters;
+    cluster_offset = qcow2_alloc_data_clusters(bs, *host_offset, &n);
+    if (cluster_offset < 0) {
+        return cluster_offset;
     }
+
+    *host_offset = cluster_offset;
+    *nb_clusters = n;
+    return 0;
 }
 
 /*
@@ -890,11 +965,11 @@ again:
     }
 
     /*
-     * Calculate the number of clusters to look for. We stop at L2 table
+     * Calculate the number of clusters to look for. We stop at L2 slice
      * boundaries to keep things simple.
      */
     nb_clusters = MIN(size_to_clusters(s, n_end << BDRV_SECTOR_BITS),
-                      s->l2_size - l2_index);
+                      s->l2_slice_size - l2_index);
 
     cluster_offset = be64_to_cpu(l2_table[l2_index]);
 
@@ -1031,61 +1106,101 @@ fail:
     return ret;
 }
 
-static int decompress_buffer(uint8_t *out_buf, int out_buf_size,
-                             const uint8_t *buf, int buf_size)
+typedef struct Qcow2DecompressData {
+    uint8_t *out_buf;
+    int out_buf_size;
+    const uint8_t *buf;
+    int buf_size;
+} Qcow2DecompressData;
+
+/* Called in a thread pool worker */
+static int decompress_buffer(void *opaque)
 {
+    Qcow2DecompressData *data = opaque;
     z_stream strm1, *strm = &strm1;
     int ret, out_len;
 
     memset(strm, 0, sizeof(*strm));
 
-    strm->next_in = (uint8_t *)buf;
-    strm->avail_in = buf_size;
-    strm->next_out = out_buf;
-    strm->avail_out = out_buf_size;
+    strm->next_in = (uint8_t *)data->buf;
+    strm->avail_in = data->buf_size;
+    strm->next_out = data->out_buf;
+    strm->avail_out = data->out_buf_size;
 
     ret = inflateInit2(strm, -12);
     if (ret != Z_OK)
-        return -1;
+        return -EIO;
     ret = inflate(strm, Z_FINISH);
-    out_len = strm->next_out - out_buf;
+    out_len = strm->next_out - data->out_buf;
     if ((ret != Z_STREAM_END && ret != Z_BUF_ERROR) ||
-        out_len != out_buf_size) {
+        out_len != data->out_buf_size) {
         inflateEnd(strm);
-        return -1;
+        return -EIO;
     }
     inflateEnd(strm);
     return 0;
 }
 
-int qcow2_decompress_cluster(BlockDriverState *bs, uint64_t cluster_offset)
+/*
+ * Load the compressed cluster at @cluster_offset into s->cluster_cache.
+ *
+ * Must be called with s->lock held exclusively.  The lock is dropped while
+ * the data is read and inflated in the thread pool, so that several
+ * compressed clusters can be decompressed at the same time; s->cluster_cache
+ * is only replaced once the lock has been taken again.
+ */
+int coroutine_fn qcow2_decompress_cluster(BlockDriverState *bs,
+                                          uint64_t cluster_offset)
 {
     BDRVQcowState *s = bs->opaque;
+    Qcow2DecompressData data;
     int ret, csize, nb_csectors, sector_offset;
     uint64_t coffset;
+    uint8_t *cluster_data, *cluster_cache;
 
     coffset = cluster_offset & s->cluster_offset_mask;
-    if (s->cluster_cache_offset != coffset) {
-        nb_csectors = ((cluster_offset >> s->csize_shift) & s->csize_mask) + 1;
-        sector_offset = coffset & 511;
-        csize = nb_csectors * 512 - sector_offset;
-        BLKDBG_EVENT(bs->file, BLKDBG_READ_COMPRESSED);
-        ret = bdrv_read(bs->file, coffset >> 9, s->cluster_data, nb_csectors);
-        if (ret < 0) {
-            return ret;
-        }
-        if (decompress_buffer(s->cluster_cache, s->cluster_size,
-                              s->cluster_data + sector_offset, csize) < 0) {
-            return -EIO;
-        }
-        s->cluster_cache_offset = coffset;
+    if (s->cluster_cache_offset == coffset) {
+        return 0;
+    }
+
+    nb_csectors = ((cluster_offset >> s->csize_shift) & s->csize_mask) + 1;
+    sector_offset = coffset & 511;
+    csize = nb_csectors * 512 - sector_offset;
+
+    cluster_data = qemu_blockalign(bs, nb_csectors * 512);
+    cluster_cache = g_malloc(s->cluster_size);
+
+    qemu_co_rwlock_unlock(&s->lock);
+    BLKDBG_EVENT(bs->file, BLKDBG_READ_COMPRESSED);
+    ret = bdrv_read(bs->file, coffset >> 9, cluster_data, nb_csectors);
+    if (ret >= 0) {
+        data = (Qcow2DecompressData) {
+            .out_buf        = cluster_cache,
+            .out_buf_size   = s->cluster_size,
+            .buf            = cluster_data + sector_offset,
+            .buf_size       = csize,
+        };
+        ret = thread_pool_submit_co(
+            aio_get_thread_pool(bdrv_get_aio_context(bs)),
+            decompress_buffer, &data);
+    }
+    qemu_co_rwlock_wrlock(&s->lock);
+
+    qemu_vfree(cluster_data);
+    if (ret < 0) {
+        g_free(cluster_cache);
+        return ret;
     }
+
+    g_free(s->cluster_cache);
+    s->cluster_cache = cluster_cache;
+    s->cluster_cache_offset = coffset;
     return 0;
 }
 
 /*
  * This discards as many clusters of nb_clusters as possible at once (i.e.
- * all clusters in the same L2 table) and returns the number of discarded
+ * all clusters in the same L2 slice) and returns the number of discarded
  * clusters.
  */
 static int discard_single_l2(BlockDriverState *bs, uint64_t offset,
@@ -1102,8 +1217,8 @@ static int discard_single_l2(BlockDriverState *bs, uint64_t offset,
         return ret;
     }
 
-    /* Limit nb_clusters to one L2 table */
-    nb_clusters = MIN(nb_clusters, s->l2_size - l2_index);
+    /* Limit nb_clusters to one L2 slice */
+    nb_clusters = MIN(nb_clusters, s->l2_slice_size - l2_index);
 
     for (i = 0; i < nb_clusters; i++) {
         uint64_t old_offset;
@@ -1149,7 +1264,7 @@ int qcow2_discard_clusters(BlockDriverState *bs, uint64_t offset,
 
     nb_clusters = size_to_clusters(s, end_offset - offset);
 
-    /* Each L2 table is handled by its own loop iteration */
+    /* Each L2 slice is handled by its own loop iteration */
     while (nb_clusters > 0) {
         ret = discard_single_l2(bs, offset, nb_clusters);
         if (ret < 0) {
@@ -1165,11 +1280,12 @@ int qcow2_discard_clusters(BlockDriverState *bs, uint64_t offset,
 
 /*
  * This zeroes as many clusters of nb_clusters as possible at once (i.e.
- * all clusters in the same L2 table) and returns the number of zeroed
- * clusters.
+ * all clusters in the same L2 slice) and returns the number of zeroed
+ * clusters.  With BDRV_REQ_MAY_UNMAP the host clusters are freed as well,
+ * otherwise they stay allocated so that a later write can reuse them.
  */
 static int zero_single_l2(BlockDriverState *bs, uint64_t offset,
-    unsigned int nb_clusters)
+    unsigned int nb_clusters, BdrvRequestFlags flags)
 {
     BDRVQcowState *s = bs->opaque;
     uint64_t *l2_table;
@@ -1182,8 +1298,8 @@ static int zero_single_l2(BlockDriverState *bs, uint64_t offset,
         return ret;
     }
 
-    /* Limit nb_clusters to one L2 table */
-    nb_clusters = MIN(nb_clusters, s->l2_size - l2_index);
+    /* Limit nb_clusters to one L2 slice */
+    nb_clusters = MIN(nb_clusters, s->l2_slice_size - l2_index);
 
     for (i = 0; i < nb_clusters; i++) {
         uint64_t old_offset;
@@ -1195,6 +1311,11 @@ static int zero_single_l2(BlockDriverState *bs, uint64_t offset,
         if (old_offset & QCOW_OFLAG_COMPRESSED) {
             l2_table[l2_index + i] = cpu_to_be64(QCOW_OFLAG_ZERO);
             qcow2_free_any_clusters(bs, old_offset, 1);
+        } else if ((flags & BDRV_REQ_MAY_UNMAP) &&
+                   (old_offset & L2E_OFFSET_MASK)) {
+            l2_table[l2_index + i] = cpu_to_be64(QCOW_OFLAG_ZERO);
+            qcow2_free_clusters(bs, old_offset & L2E_OFFSET_MASK,
+                                s->cluster_size);
         } else {
             l2_table[l2_index + i] |= cpu_to_be64(QCOW_OFLAG_ZERO);
         }
@@ -1208,7 +1329,8 @@ static int zero_single_l2(BlockDriverState *bs, uint64_t offset,
     return nb_clusters;
 }
 
-int qcow2_zero_clusters(BlockDriverState *bs, uint64_t offset, int nb_sectors)
+int qcow2_zero_clusters(BlockDriverState *bs, uint64_t offset, int nb_sectors,
+    BdrvRequestFlags flags)
 {
     BDRVQcowState *s = bs->opaque;
     unsigned int nb_clusters;
@@ -1219,11 +1341,11 @@ int qcow2_zero_clusters(BlockDriverState *bs, uint64_t offset, int nb_sectors)
         return -ENOTSUP;
     }
 
-    /* Each L2 table is handled by its own loop iteration */
+    /* Each L2 slice is handled by its own loop iteration */
     nb_clusters = size_to_clusters(s, nb_sectors << BDRV_SECTOR_BITS);
 
     while (nb_clusters > 0) {
-        ret = zero_single_l2(bs, offset, nb_clusters);
+        ret = zero_single_l2(bs, offset, nb_clusters, flags);
         if (ret < 0) {
             return ret;
         }
@@ -60,6 +60,11 @@ void qcow2_refcount_close(BlockDriverState *bs)
 {
     BDRVQcowState *s = bs->opaque;
     g_free(s->refcount_table);
+
+    if (s->free_bitmap) {
+        hbitmap_free(s->free_bitmap);
+        s->free_bitmap = NULL;
+    }
 }
 
 
@@ -117,6 +122,173 @@ static int get_refcount(BlockDriverState *bs, int64_t cluster_index)
     return refcount;
 }
 
+/*********************************************************/
+/* free cluster bitmap */
+
+/*
+ * Without the bitmap, alloc_clusters_noref() looks at the refcount of every
+ * cluster from free_cluster_index on until it finds a free one; right after
+ * opening an image, or whenever a discard moves free_cluster_index back,
+ * that walks over all allocated clusters again.
+ *
+ * The bitmap has a bit set for each free cluster of the image file as it
+ * was at open time.  It is filled one refcount block at a time, as far as
+ * the allocator gets, and kept up to date by update_refcount().  Clusters
+ * beyond it are looked up in the refcount blocks as before.
+ *
+ * The bitmap only lives in memory and is built from the refcounts, which
+ * qcow2_open() repairs first if a lazy refcounts image was not closed
+ * cleanly, so a crash never leaves it stale.
+ */
+
+/* Scan the next refcount block into the free bitmap */
+static int free_bitmap_extend(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    int64_t first = s->free_bitmap_valid;
+    int64_t table_index = first >> (s->cluster_bits - REFCOUNT_SHIFT);
+    int64_t block_offset = 0;
+    uint16_t *refcount_block;
+    int i, start, n, ret;
+
+    assert(first < s->free_bitmap_size);
+    n = MIN(1 << (s->cluster_bits - REFCOUNT_SHIFT),
+            s->free_bitmap_size - first);
+
+    if (table_index < s->refcount_table_size) {
+        block_offset = s->refcount_table[table_index];
+    }
+
+    if (!block_offset) {
+        hbitmap_set(s->free_bitmap, first, n);
+    } else {
+        ret = load_refcount_block(bs, block_offset, (void**) &refcount_block);
+        if (ret < 0) {
+            return ret;
+        }
+
+        /* Set runs of free clusters at once */
+        i = 0;
+        while (i < n) {
+            if (refcount_block[i]) {
+                i++;
+                continue;
+            }
+            start = i;
+            while (i < n && !refcount_block[i]) {
+                i++;
+            }
+            hbitmap_set(s->free_bitmap, first + start, i - start);
+        }
+
+        ret = qcow2_cache_put(bs, s->refcount_block_cache,
+                              (void**) &refcount_block);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    s->free_bitmap_valid = first + n;
+    return 0;
+}
+
+/*
+ * Returns the first cluster from @cluster_index on that can be free, which
+ * is @cluster_index itself for clusters beyond the bitmap, or -errno.
+ */
+static int64_t free_bitmap_next(BlockDriverState *bs, int64_t cluster_index)
+{
+    BDRVQcowState *s = bs->opaque;
+    HBitmapIter hbi;
+    int64_t next;
+    int ret;
+
+    if (!s->free_bitmap) {
+        return cluster_index;
+    }
+
+    for (;;) {
+        /* no bits are set beyond free_bitmap_valid */
+        if (cluster_index < s->free_bitmap_valid) {
+            hbitmap_iter_init(&hbi, s->free_bitmap, cluster_index);
+            next = hbitmap_iter_next(&hbi);
+            if (next >= 0) {
+                return next;
+            }
+            cluster_index = s->free_bitmap_valid;
+        }
+
+        if (s->free_bitmap_valid == s->free_bitmap_size) {
+            return cluster_index;
+        }
+
+        ret = free_bitmap_extend(bs);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+}
+
+/*
+ * Like get_refcount(), but for clusters that the free bitmap covers, only
+ * tells used (1) from free (0) without looking at the refcount blocks.
+ */
+static int get_refcount_hint(BlockDriverState *bs, int64_t cluster_index)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    if (cluster_index < s->free_bitmap_valid) {
+        return !hbitmap_get(s->free_bitmap, cluster_index);
+    }
+    return get_refcount(bs, cluster_index);
+}
+
+/*
+ * For refcounts that are written without update_refcount(): the new
+ * refcount blocks and tables in alloc_refcount_block() describe themselves.
+ */
+static void free_bitmap_mark_used(BlockDriverState *bs, int64_t cluster_index,
+                                  int64_t nb_clusters)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    if (cluster_index < s->free_bitmap_valid) {
+        hbitmap_reset(s->free_bitmap, cluster_index,
+                      MIN(nb_clusters, s->free_bitmap_valid - cluster_index));
+    }
+}
+
+void qcow2_free_bitmap_init(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    int64_t file_size, nb_clusters;
+
+    file_size = bdrv_getlength(bs->file);
+    if (file_size <= 0) {
+        return;
+    }
+
+    nb_clusters = size_to_clusters(s, file_size);
+    if (nb_clusters > QCOW2_FREE_BITMAP_MAX_CLUSTERS) {
+        return;
+    }
+
+    s->free_bitmap = hbitmap_alloc(nb_clusters, 0);
+    s->free_bitmap_size = nb_clusters;
+    s->free_bitmap_valid = 0;
+
+    /* Small images are cheap enough to scan right away */
+    if ((nb_clusters >> (s->cluster_bits - REFCOUNT_SHIFT)) <
+        QCOW2_FREE_BITMAP_OPEN_BLOCKS) {
+        while (s->free_bitmap_valid < s->free_bitmap_size) {
+            if (free_bitmap_extend(bs) < 0) {
+                /* leave the rest to the allocator */
+                break;
+            }
+        }
+    }
+}
+
 /*
  * Rounds the refcount table size up to avoid growing the table for each single
  * refcount block that is allocated.
@@ -229,6 +401,7 @@ static int alloc_refcount_block(BlockDriverState *bs,
         int block_index = (new_block >> s->cluster_bits) &
             ((1 << (s->cluster_bits - REFCOUNT_SHIFT)) - 1);
         (*refcount_block)[block_index] = cpu_to_be16(1);
+        free_bitmap_mark_used(bs, new_block >> s->cluster_bits, 1);
     } else {
         /* Described somewhere else. This can recurse at most twice before we
          * arrive at a block that describes itself. */
@@ -345,6 +518,8 @@ static int alloc_refcount_block(BlockDriverState *bs,
     for (i = 0; i < table_clusters + blocks_clusters; i++) {
         new_blocks[block++] = cpu_to_be16(1);
     }
+    free_bitmap_mark_used(bs, meta_offset >> s->cluster_bits,
+                          table_clusters + blocks_clusters);
 
     /* Write refcount blocks to disk */
     BLKDBG_EVENT(bs->file, BLKDBG_REFBLOCK_ALLOC_WRITE_BLOCKS);
@@ -442,7 +617,7 @@ static int QEMU_WARN_UNUSED_RESULT update_refcount(BlockDriverState *bs,
     for(cluster_offset = start; cluster_offset <= last;
         cluster_offset += s->cluster_size)
     {
-        int block_index, refcount;
+        int block_index, refcount, old_refcount;
         int64_t cluster_index = cluster_offset >> s->cluster_bits;
         int64_t table_index =
             cluster_index >> (s->cluster_bits - REFCOUNT_SHIFT);
@@ -470,8 +645,8 @@ static int QEMU_WARN_UNUSED_RESULT update_refcount(BlockDriverState *bs,
         block_index = cluster_index &
             ((1 << (s->cluster_bits - REFCOUNT_SHIFT)) - 1);
 
-        refcount = be16_to_cpu(refcount_block[block_index]);
-        refcount += addend;
+        old_refcount = be16_to_cpu(refcount_block[block_index]);
+        refcount = old_refcount + addend;
         if (refcount < 0 || refcount > 0xffff) {
             ret = -EINVAL;
             goto fail;
@@ -480,6 +655,14 @@ static int QEMU_WARN_UNUSED_RESULT update_refcount(BlockDriverState *bs,
             s->free_cluster_index = cluster_index;
         }
         refcount_block[block_index] = cpu_to_be16(refcount);
+
+        if (cluster_index < s->free_bitmap_valid) {
+            if (refcount == 0) {
+                hbitmap_set(s->free_bitmap, cluster_index, 1);
+            } else if (old_refcount == 0) {
+                hbitmap_reset(s->free_bitmap, cluster_index, 1);
+            }
+        }
     }
 
     ret = 0;
@@ -543,12 +726,19 @@ static int64_t alloc_clusters_noref(BlockDriverState *bs, int64_t size)
 {
     BDRVQcowState *s = bs->opaque;
     int i, nb_clusters, refcount;
+    int64_t next;
 
     nb_clusters = size_to_clusters(s, size);
 retry:
+    next = free_bitmap_next(bs, s->free_cluster_index);
+    if (next < 0) {
+        return next;
+    }
+    s->free_cluster_index = next;
+
     for(i = 0; i < nb_clusters; i++) {
         int64_t next_cluster_index = s->free_cluster_index++;
-        refcount = get_refcount(bs, next_cluster_index);
+        refcount = get_refcount_hint(bs, next_cluster_index);
 
         if (refcount < 0) {
             return refcount;
@@ -594,7 +784,7 @@ int qcow2_alloc_clusters_at(BlockDriverState *bs, uint64_t offset,
     /* Check how many clusters there are free */
     cluster_index = offset >> s->cluster_bits;
     for(i = 0; i < nb_clusters; i++) {
-        refcount = get_refcount(bs, cluster_index++);
+        refcount = get_refcount_hint(bs, cluster_index++);
 
         if (refcount < 0) {
             return refcount;
@@ -617,6 +807,74 @@ int qcow2_alloc_clusters_at(BlockDriverState *bs, uint64_t offset,
     return i;
 }
 
+/*
+ * Allocate up to *nb_clusters contiguous clusters for guest data, starting
+ * at @offset if it is non-zero, and store the number of clusters that were
+ * allocated in *nb_clusters.
+ *
+ * Refcounts are taken for at least QCOW2_ALLOC_BATCH clusters at once and
+ * the clusters that are left over serve the next allocations, so a stream
+ * of small allocating writes updates the refcount blocks once per batch and
+ * still gets contiguous clusters.  If qemu is killed, the unused part of a
+ * batch leaks like any cluster that was allocated but not yet linked.
+ *
+ * Returns the offset of the first cluster, or -errno.
+ */
+int64_t qcow2_alloc_data_clusters(BlockDriverState *bs, uint64_t offset,
+                                  int *nb_clusters)
+{
+    BDRVQcowState *s = bs->opaque;
+    int64_t cluster_offset;
+    int n, ret;
+
+    /* Continuing a run of clusters that did not come from the batch */
+    if (offset && offset != s->reserved_cluster_offset) {
+        ret = qcow2_alloc_clusters_at(bs, offset, *nb_clusters);
+        if (ret < 0) {
+            return ret;
+        }
+        *nb_clusters = ret;
+        return offset;
+    }
+
+    if (s->reserved_clusters == 0) {
+        n = MAX(*nb_clusters, QCOW2_ALLOC_BATCH);
+        cluster_offset = qcow2_alloc_clusters(bs,
+                                              (int64_t) n << s->cluster_bits);
+        if (cluster_offset < 0) {
+            return cluster_offset;
+        }
+        s->reserved_cluster_offset = cluster_offset;
+        s->reserved_clusters = n;
+    }
+
+    n = MIN(*nb_clusters, s->reserved_clusters);
+    cluster_offset = s->reserved_cluster_offset;
+
+    s->reserved_clusters -= n;
+    if (s->reserved_clusters) {
+        s->reserved_cluster_offset += (int64_t) n << s->cluster_bits;
+    } else {
+        s->reserved_cluster_offset = 0;
+    }
+
+    *nb_clusters = n;
+    return cluster_offset;
+}
+
+/* Give back the clusters that qcow2_alloc_data_clusters() did not use */
+void qcow2_release_reserved_clusters(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    if (s->reserved_clusters) {
+        qcow2_free_clusters(bs, s->reserved_cluster_offset,
+                            (int64_t) s->reserved_clusters << s->cluster_bits);
+        s->reserved_cluster_offset = 0;
+        s->reserved_clusters = 0;
+    }
+}
+
 /* only used to allocate compressed sectors. We try to allocate
    contiguous sectors. size must be <= cluster_size */
 int64_t qcow2_alloc_bytes(BlockDriverState *bs, int size)
@@ -727,6 +985,8 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
     uint64_t *l1_table, *l2_table, l2_offset, offset, l1_size2, l1_allocated;
     int64_t old_offset, old_l2_offset;
     int i, j, l1_modified = 0, nb_csectors, refcount;
+    int slice, slice_bytes = s->l2_slice_size * sizeof(uint64_t);
+    int n_slices = s->cluster_size / slice_bytes;
     int ret;
 
     l2_table = NULL;
@@ -760,66 +1020,69 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
             old_l2_offset = l2_offset;
             l2_offset &= L1E_OFFSET_MASK;
 
-            ret = qcow2_cache_get(bs, s->l2_table_cache, l2_offset,
-                (void**) &l2_table);
-            if (ret < 0) {
-                goto fail;
-            }
+            for (slice = 0; slice < n_slices; slice++) {
+                ret = qcow2_cache_get(bs, s->l2_table_cache,
+                    l2_offset + slice * slice_bytes, (void**) &l2_table);
+                if (ret < 0) {
+                    goto fail;
+                }
 
-            for(j = 0; j < s->l2_size; j++) {
-                offset = be64_to_cpu(l2_table[j]);
-                if (offset != 0) {
-                    old_offset = offset;
-                    offset &= ~QCOW_OFLAG_COPIED;
-                    if (offset & QCOW_OFLAG_COMPRESSED) {
-                        nb_csectors = ((offset >> s->csize_shift) &
-                                       s->csize_mask) + 1;
-                        if (addend != 0) {
-                            int ret;
-                            ret = update_refcount(bs,
-                                (offset & s->cluster_offset_mask) & ~511,
-                                nb_csectors * 512, addend);
-                            if (ret < 0) {
-                                goto fail;
+                for(j = 0; j < s->l2_slice_size; j++) {
+                    offset = be64_to_cpu(l2_table[j]);
+                    if (offset != 0) {
+                        old_offset = offset;
+                        offset &= ~QCOW_OFLAG_COPIED;
+                        if (offset & QCOW_OFLAG_COMPRESSED) {
+                            nb_csectors = ((offset >> s->csize_shift) &
+                                           s->csize_mask) + 1;
+                            if (addend != 0) {
+                                int ret;
+                                ret = update_refcount(bs,
+                                    (offset & s->cluster_offset_mask) & ~511,
+                                    nb_csectors * 512, addend);
+                                if (ret < 0) {
+                                    goto fail;
+                                }
+
+                                /* TODO Flushing once for the whole function
+                                 * should be enough */
+                                bdrv_flush(bs->file);
                             }
-
-                            /* TODO Flushing once for the whole function should
-                             * be enough */
-                            bdrv_flush(bs->file);
-                        }
-                        /* compressed clusters are never modified */
-                        refcount = 2;
-                    } else {
-                        uint64_t cluster_index = (offset & L2E_OFFSET_MASK) >> s->cluster_bits;
-                        if (addend != 0) {
-                            refcount = update_cluster_refcount(bs, cluster_index, addend);
+                            /* compressed clusters are never modified */
+                            refcount = 2;
                         } else {
-                            refcount = get_refcount(bs, cluster_index);
-                        }
+                            uint64_t cluster_index = (offset & L2E_OFFSET_MASK) >> s->cluster_bits;
+                            if (addend != 0) {
+                                refcount = update_cluster_refcount(bs, cluster_index, addend);
+                            } else {
+                                refcount = get_refcount(bs, cluster_index);
+                            }
 
-                        if (refcount < 0) {
-                            ret = -EIO;
-                            goto fail;
+                            if (refcount < 0) {
+                                ret = -EIO;
+                                goto fail;
+                            }
                         }
-                    }
 
-                    if (refcount == 1) {
-                        offset |= QCOW_OFLAG_COPIED;
-                    }
-                    if (offset != old_offset) {
-                        if (addend > 0) {
-                            qcow2_cache_set_dependency(bs, s->l2_table_cache,
-                                s->refcount_block_cache);
+                        if (refcount == 1) {
+                            offset |= QCOW_OFLAG_COPIED;
+                        }
+                        if (offset != old_offset) {
+                            if (addend > 0) {
+                                qcow2_cache_set_dependency(bs,
+                                    s->l2_table_cache, s->refcount_block_cache);
+                            }
+                            l2_table[j] = cpu_to_be64(offset);
+                            qcow2_cache_entry_mark_dirty(s->l2_table_cache,
+                                                         l2_table);
                         }
-                        l2_table[j] = cpu_to_be64(offset);
-                        qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_table);
                     }
                 }
-            }
 
-            ret = qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
-            if (ret < 0) {
-                goto fail;
+                ret = qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
+                if (ret < 0) {
+                    goto fail;
+                }
             }
 
 
@@ -918,31 +1181,57 @@ static void inc_refcounts(BlockDriverState *bs,
 enum {
     CHECK_OFLAG_COPIED = 0x1,   /* check QCOW_OFLAG_COPIED matches refcount */
     CHECK_FRAG_INFO = 0x2,      /* update BlockFragInfo counters */
+    CHECK_SCRUB = 0x4,          /* read back the data clusters */
 };
 
+/* Number of L2 table and scrub reads kept in flight */
+#define CHECK_QUEUE_DEPTH 64
+
+/* State shared by the L1 tables of one qcow2_check_refcounts() run */
+typedef struct CheckPipeline {
+    BdrvReadQueue *scrub;       /* NULL unless scrubbing */
+    int64_t l1_done;            /* L1 entries processed, for progress */
+    int64_t l1_total;
+} CheckPipeline;
+
+static void check_scrub_complete(BdrvCheckResult *res, BdrvReadQueue *scrub)
+{
+    int64_t offset;
+    int ret;
+
+    ret = bdrv_read_queue_next(scrub, NULL, &offset, NULL);
+    if (ret < 0) {
+        fprintf(stderr, "ERROR cluster at offset=0x%" PRIx64 " cannot be "
+            "read: %s\n", offset, strerror(-ret));
+        res->check_errors++;
+    }
+}
+
+static void check_scrub_submit(BdrvCheckResult *res, BdrvReadQueue *scrub,
+                               int64_t offset, int bytes)
+{
+    if (bdrv_read_queue_full(scrub)) {
+        check_scrub_complete(res, scrub);
+    }
+    bdrv_read_queue_submit(scrub, offset, bytes, 0);
+}
+
 /*
  * Increases the refcount in the given refcount table for the all clusters
- * referenced in the L2 table. While doing so, performs some checks on L2
- * entries.
+ * referenced in the L2 table, which the caller has read. While doing so,
+ * performs some checks on L2 entries.
  *
  * Returns the number of errors found by the checks or -errno if an internal
  * error occurred.
  */
 static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
-    uint16_t *refcount_table, int refcount_table_size, int64_t l2_offset,
-    int flags)
+    uint16_t *refcount_table, int refcount_table_size, uint64_t *l2_table,
+    int flags, CheckPipeline *p)
 {
     BDRVQcowState *s = bs->opaque;
-    uint64_t *l2_table, l2_entry;
+    uint64_t l2_entry;
     uint64_t next_contiguous_offset = 0;
-    int i, l2_size, nb_csectors, refcount;
-
-    /* Read L2 table from disk */
-    l2_size = s->l2_size * sizeof(uint64_t);
-    l2_table = g_malloc(l2_size);
-
-    if (bdrv_pread(bs->file, l2_offset, l2_table, l2_size) != l2_size)
-        goto fail;
+    int i, nb_csectors, refcount;
 
     /* Do the actual checks */
     for(i = 0; i < s->l2_size; i++) {
@@ -965,6 +1254,10 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
             l2_entry &= s->cluster_offset_mask;
             inc_refcounts(bs, res, refcount_table, refcount_table_size,
                 l2_entry & ~511, nb_csectors * 512);
+            if (flags & CHECK_SCRUB) {
+                check_scrub_submit(res, p->scrub, l2_entry & ~511,
+                                   nb_csectors * 512);
+            }
 
             if (flags & CHECK_FRAG_INFO) {
                 res->bfi.allocated_clusters++;
@@ -1004,6 +1297,12 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
                 }
             }
 
+            /* Zero clusters read as zeroes, whatever their host cluster has */
+            if ((flags & CHECK_SCRUB) &&
+                qcow2_get_cluster_type(l2_entry) == QCOW2_CLUSTER_NORMAL) {
+                check_scrub_submit(res, p->scrub, offset, s->cluster_size);
+            }
+
             if (flags & CHECK_FRAG_INFO) {
                 res->bfi.allocated_clusters++;
                 if (next_contiguous_offset &&
@@ -1034,12 +1333,10 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
         }
     }
 
-    g_free(l2_table);
     return 0;
 
 fail:
     fprintf(stderr, "ERROR: I/O error in check_refcounts_l2\n");
-    g_free(l2_table);
     return -EIO;
 }
 
@@ -1048,6 +1345,9 @@ fail:
  * clusters in the given refcount table. While doing so, performs some checks
  * on L1 and L2 entries.
  *
+ * The L2 tables are read ahead, CHECK_QUEUE_DEPTH at a time, and checked
+ * in L1 order as the reads complete.
+ *
  * Returns the number of errors found by the checks or -errno if an internal
  * error occurred.
  */
@@ -1056,11 +1356,13 @@ static int check_refcounts_l1(BlockDriverState *bs,
                               uint16_t *refcount_table,
                               int refcount_table_size,
                               int64_t l1_table_offset, int l1_size,
-                              int flags)
+                              int flags, CheckPipeline *p)
 {
     BDRVQcowState *s = bs->opaque;
-    uint64_t *l1_table, l2_offset, l1_size2;
-    int i, refcount, ret;
+    uint64_t *l1_table, *l2_table, l2_offset, l1_size2;
+    BdrvReadQueue *l2_queue = NULL;
+    int i, next_read, refcount, ret;
+    uint64_t tag;
 
     l1_size2 = l1_size * sizeof(uint64_t);
 
@@ -1081,51 +1383,79 @@ static int check_refcounts_l1(BlockDriverState *bs,
     }
 
     /* Do the actual checks */
-    for(i = 0; i < l1_size; i++) {
-        l2_offset = l1_table[i];
-        if (l2_offset) {
-            /* QCOW_OFLAG_COPIED must be set iff refcount == 1 */
-            if (flags & CHECK_OFLAG_COPIED) {
-                refcount = get_refcount(bs, (l2_offset & ~QCOW_OFLAG_COPIED)
-                    >> s->cluster_bits);
-                if (refcount < 0) {
-                    fprintf(stderr, "Can't get refcount for l2_offset %"
-                        PRIx64 ": %s\n", l2_offset, strerror(-refcount));
-                    goto fail;
-                }
-                if ((refcount == 1) != ((l2_offset & QCOW_OFLAG_COPIED) != 0)) {
-                    fprintf(stderr, "ERROR OFLAG_COPIED: l2_offset=%" PRIx64
-                        " refcount=%d\n", l2_offset, refcount);
-                    res->corruptions++;
-                }
+    l2_queue = bdrv_read_queue_new(bs->file, CHECK_QUEUE_DEPTH,
+                                   s->l2_size * sizeof(uint64_t));
+    next_read = 0;
+    for (;;) {
+        while (next_read < l1_size && !bdrv_read_queue_full(l2_queue)) {
+            l2_offset = l1_table[next_read] & L1E_OFFSET_MASK;
+            if (l2_offset) {
+                bdrv_read_queue_submit(l2_queue, l2_offset,
+                                       s->l2_size * sizeof(uint64_t),
+                                       next_read);
             }
+            next_read++;
+        }
+        if (bdrv_read_queue_empty(l2_queue)) {
+            break;
+        }
 
-            /* Mark L2 table as used */
-            l2_offset &= L1E_OFFSET_MASK;
-            inc_refcounts(bs, res, refcount_table, refcount_table_size,
-                l2_offset, s->cluster_size);
+        ret = bdrv_read_queue_next(l2_queue, (void **) &l2_table, NULL, &tag);
+        if (ret < 0) {
+            fprintf(stderr, "ERROR: I/O error in check_refcounts_l2\n");
+            goto fail;
+        }
 
-            /* L2 tables are cluster aligned */
-            if (l2_offset & (s->cluster_size - 1)) {
-                fprintf(stderr, "ERROR l2_offset=%" PRIx64 ": Table is not "
-                    "cluster aligned; L1 entry corrupted\n", l2_offset);
-                res->corruptions++;
-            }
+        i = tag;
+        l2_offset = l1_table[i];
+        qemu_progress_print(100.0 * (p->l1_done + i + 1) / p->l1_total, 0);
 
-            /* Process and check L2 entries */
-            ret = check_refcounts_l2(bs, res, refcount_table,
-                                     refcount_table_size, l2_offset, flags);
-            if (ret < 0) {
+        /* QCOW_OFLAG_COPIED must be set iff refcount == 1 */
+        if (flags & CHECK_OFLAG_COPIED) {
+            refcount = get_refcount(bs, (l2_offset & ~QCOW_OFLAG_COPIED)
+                >> s->cluster_bits);
+            if (refcount < 0) {
+                fprintf(stderr, "Can't get refcount for l2_offset %"
+                    PRIx64 ": %s\n", l2_offset, strerror(-refcount));
                 goto fail;
             }
+            if ((refcount == 1) != ((l2_offset & QCOW_OFLAG_COPIED) != 0)) {
+                fprintf(stderr, "ERROR OFLAG_COPIED: l2_offset=%" PRIx64
+                    " refcount=%d\n", l2_offset, refcount);
+                res->corruptions++;
+            }
+        }
+
+        /* Mark L2 table as used */
+        l2_offset &= L1E_OFFSET_MASK;
+        inc_refcounts(bs, res, refcount_table, refcount_table_size,
+            l2_offset, s->cluster_size);
+
+        /* L2 tables are cluster aligned */
+        if (l2_offset & (s->cluster_size - 1)) {
+            fprintf(stderr, "ERROR l2_offset=%" PRIx64 ": Table is not "
+                "cluster aligned; L1 entry corrupted\n", l2_offset);
+            res->corruptions++;
+        }
+
+        /* Process and check L2 entries */
+        ret = check_refcounts_l2(bs, res, refcount_table,
+                                 refcount_table_size, l2_table, flags, p);
+        if (ret < 0) {
+            goto fail;
         }
     }
+    bdrv_read_queue_free(l2_queue);
+    p->l1_done += l1_size;
     g_free(l1_table);
     return 0;
 
 fail:
     fprintf(stderr, "ERROR: I/O error in check_refcounts_l1\n");
     res->check_errors++;
+    if (l2_queue) {
+        bdrv_read_queue_free(l2_queue);
+    }
     g_free(l1_table);
     return -EIO;
 }
@@ -1144,6 +1474,8 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
     int nb_clusters, refcount1, refcount2;
     QCowSnapshot *sn;
     uint16_t *refcount_table;
+    CheckPipeline p = { .l1_total = s->l1_size };
+    int flags = CHECK_OFLAG_COPIED | CHECK_FRAG_INFO;
     int ret;
 
     size = bdrv_getlength(bs->file);
@@ -1151,14 +1483,31 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
     res->bfi.total_clusters = nb_clusters;
     refcount_table = g_malloc0(nb_clusters * sizeof(uint16_t));
 
+    for (i = 0; i < s->nb_snapshots; i++) {
+        p.l1_total += s->snapshots[i].l1_size;
+    }
+
+    /* Only the clusters of the active image are read back.  The size field
+     * of a compressed cluster allows for up to twice the cluster size. */
+    if (fix & BDRV_CHECK_SCRUB) {
+        p.scrub = bdrv_read_queue_new(bs->file, CHECK_QUEUE_DEPTH,
+                                      2 * s->cluster_size);
+        flags |= CHECK_SCRUB;
+    }
+
     /* header */
     inc_refcounts(bs, res, refcount_table, nb_clusters,
         0, s->cluster_size);
 
     /* current L1 table */
     ret = check_refcounts_l1(bs, res, refcount_table, nb_clusters,
-                             s->l1_table_offset, s->l1_size,
-                             CHECK_OFLAG_COPIED | CHECK_FRAG_INFO);
+                             s->l1_table_offset, s->l1_size, flags, &p);
+    if (p.scrub) {
+        while (!bdrv_read_queue_empty(p.scrub)) {
+            check_scrub_complete(res, p.scrub);
+        }
+        bdrv_read_queue_free(p.scrub);
+    }
     if (ret < 0) {
         goto fail;
     }
@@ -1167,7 +1516,7 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
     for(i = 0; i < s->nb_snapshots; i++) {
         sn = s->snapshots + i;
         ret = check_refcounts_l1(bs, res, refcount_table, nb_clusters,
-            sn->l1_table_offset, sn->l1_size, 0);
+            sn->l1_table_offset, sn->l1_size, 0, &p);
         if (ret < 0) {
             goto fail;
         }
@@ -1175,6 +1524,17 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
     inc_refcounts(bs, res, refcount_table, nb_clusters,
         s->snapshots_offset, s->snapshots_size);
 
+    /* dirty bitmaps that are still listed in the header */
+    for (i = 0; ; i++) {
+        uint64_t bitmap_offset, bitmap_size;
+
+        if (!qcow2_dirty_bitmap_area(bs, i, &bitmap_offset, &bitmap_size)) {
+            break;
+        }
+        inc_refcounts(bs, res, refcount_table, nb_clusters,
+                      bitmap_offset, bitmap_size);
+    }
+
     /* refcount data */
     inc_refcounts(bs, res, refcount_table, nb_clusters,
         s->refcount_table_offset,
@@ -1263,6 +1623,7 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
     }
 
     res->image_end_offset = (highest_cluster + 1) * s->cluster_size;
+    qemu_progress_print(100, 0);
     ret = 0;
 
 fail:
@@ -27,6 +27,7 @@
 #include <zlib.h>
 #include "block/aes.h"
 #include "block/qcow2.h"
+#include "block/thread-pool.h"
 #include "qemu/error-report.h"
 #include "qapi/qmp/qerror.h"
 #include "trace.h"
@@ -56,6 +57,7 @@ typedef struct {
 #define  QCOW2_EXT_MAGIC_END 0
 #define  QCOW2_EXT_MAGIC_BACKING_FORMAT 0xE2792ACA
 #define  QCOW2_EXT_MAGIC_FEATURE_TABLE 0x6803f857
+#define  QCOW2_EXT_MAGIC_DIRTY_BITMAPS 0x23852875
 
 static int qcow2_probe(const uint8_t *buf, int buf_size, const char *filename)
 {
@@ -148,6 +150,16 @@ static int qcow2_read_extensions(BlockDriverState *bs, uint64_t start_offset,
             }
             break;
 
+        case QCOW2_EXT_MAGIC_DIRTY_BITMAPS:
+            g_free(s->dirty_bitmaps_ext);
+            s->dirty_bitmaps_ext = g_malloc(ext.len);
+            s->dirty_bitmaps_ext_len = ext.len;
+            ret = bdrv_pread(bs->file, offset, s->dirty_bitmaps_ext, ext.len);
+            if (ret < 0) {
+                return ret;
+            }
+            break;
+
         default:
             /* unknown magic - save it in case we need to rewrite the header */
             {
@@ -279,12 +291,40 @@ static int qcow2_check(BlockDriverState *bs, BdrvCheckResult *result,
         return ret;
     }
 
-    if (fix && result->check_errors == 0 && result->corruptions == 0) {
+    if ((fix & BDRV_FIX_MASK) && result->check_errors == 0 &&
+        result->corruptions == 0) {
         return qcow2_mark_clean(bs);
     }
     return ret;
 }
 
+/*
+ * Number of L2 slices to cache so that @bs->l2_cache_coverage bytes of the
+ * virtual disk are mapped from memory.  Without an explicit coverage, the
+ * cache covers the whole disk but stays within DEFAULT_L2_CACHE_MAX_SIZE.
+ */
+static int l2_cache_entries(BlockDriverState *bs, uint64_t disk_size)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t coverage = disk_size;
+    uint64_t max_size = DEFAULT_L2_CACHE_MAX_SIZE;
+    uint64_t cache_size, slice_bytes;
+
+    if (bs->l2_cache_coverage > 0) {
+        coverage = MIN(bs->l2_cache_coverage, disk_size);
+        max_size = UINT64_MAX;
+    }
+
+    /* one 8 byte L2 entry per cluster */
+    cache_size = (coverage + s->cluster_size - 1) / s->cluster_size *
+                 sizeof(uint64_t);
+    cache_size = MIN(cache_size, max_size);
+    cache_size = MAX(cache_size, MIN_L2_CACHE_TABLES * s->cluster_size);
+
+    slice_bytes = s->l2_slice_size * sizeof(uint64_t);
+    return MIN((cache_size + slice_bytes - 1) / slice_bytes, INT_MAX);
+}
+
 static int qcow2_open(BlockDriverState *bs, int flags)
 {
     BDRVQcowState *s = bs->opaque;
@@ -430,13 +470,15 @@ static int qcow2_open(BlockDriverState *bs, int flags)
     }
 
     /* alloc L2 table/refcount block cache */
-    s->l2_table_cache = qcow2_cache_create(bs, L2_CACHE_SIZE);
-    s->refcount_block_cache = qcow2_cache_create(bs, REFCOUNT_CACHE_SIZE);
+    s->l2_slice_size = MIN(L2_CACHE_SLICE_SIZE, s->cluster_size) /
+                       sizeof(uint64_t);
+    s->l2_table_cache = qcow2_cache_create(bs,
+                                           l2_cache_entries(bs, header.size),
+                                           s->l2_slice_size * sizeof(uint64_t));
+    s->refcount_block_cache = qcow2_cache_create(bs, REFCOUNT_CACHE_SIZE,
+                                                 s->cluster_size);
 
     s->cluster_cache = g_malloc(s->cluster_size);
-    /* one more sector for decompressed data alignment */
-    s->cluster_data = qemu_blockalign(bs, QCOW_MAX_CRYPT_CLUSTERS * s->cluster_size
-                                  + 512);
     s->cluster_cache_offset = -1;
     s->flags = flags;
 
@@ -473,8 +515,8 @@ static int qcow2_open(BlockDriverState *bs, int flags)
     }
 
     /* Clear unknown autoclear feature bits */
-    if (!bs->read_only && s->autoclear_features != 0) {
-        s->autoclear_features = 0;
+    if (!bs->read_only && (s->autoclear_features & ~QCOW2_AUTOCLEAR_MASK)) {
+        s->autoclear_features &= QCOW2_AUTOCLEAR_MASK;
         ret = qcow2_update_header(bs);
         if (ret < 0) {
             goto fail;
@@ -482,7 +524,8 @@ static int qcow2_open(BlockDriverState *bs, int flags)
     }
 
     /* Initialise locks */
-    qemu_co_mutex_init(&s->lock);
+    qemu_co_rwlock_init(&s->lock);
+    qemu_co_queue_init(&s->compress_queue);
 
     /* Repair image if dirty */
     if (!(flags & BDRV_O_CHECK) && !bs->read_only &&
@@ -495,6 +538,15 @@ static int qcow2_open(BlockDriverState *bs, int flags)
         }
     }
 
+    if (!bs->read_only) {
+        qcow2_free_bitmap_init(bs);
+
+        ret = qcow2_load_dirty_bitmaps(bs);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
 #ifdef DEBUG_ALLOC
     {
         BdrvCheckResult result = {0};
@@ -506,6 +558,7 @@ static int qcow2_open(BlockDriverState *bs, int flags)
  fail:
     g_free(s->unknown_header_fields);
     cleanup_unknown_header_ext(bs);
+    g_free(s->dirty_bitmaps_ext);
     qcow2_free_snapshots(bs);
     qcow2_refcount_close(bs);
     g_free(s->l1_table);
@@ -513,7 +566,6 @@ static int qcow2_open(BlockDriverState *bs, int flags)
         qcow2_cache_destroy(bs, s->l2_table_cache);
     }
     g_free(s->cluster_cache);
-    qemu_vfree(s->cluster_data);
     return ret;
 }
 
@@ -567,24 +619,35 @@ static int qcow2_reopen_prepare(BDRVReopenState *state,
     return 0;
 }
 
-static int coroutine_fn qcow2_co_is_allocated(BlockDriverState *bs,
+static int64_t coroutine_fn qcow2_co_get_block_status(BlockDriverState *bs,
         int64_t sector_num, int nb_sectors, int *pnum)
 {
     BDRVQcowState *s = bs->opaque;
     uint64_t cluster_offset;
+    int64_t status = 0;
     int ret;
 
     *pnum = nb_sectors;
-    /* FIXME We can get errors here, but the bdrv_co_is_allocated interface
-     * can't pass them on today */
-    qemu_co_mutex_lock(&s->lock);
+    qemu_co_rwlock_rdlock(&s->lock);
     ret = qcow2_get_cluster_offset(bs, sector_num << 9, pnum, &cluster_offset);
-    qemu_co_mutex_unlock(&s->lock);
+    qemu_co_rwlock_unlock(&s->lock);
     if (ret < 0) {
-        *pnum = 0;
+        return ret;
     }
 
-    return (cluster_offset != 0);
+    if (cluster_offset != 0 && ret != QCOW2_CLUSTER_COMPRESSED &&
+        !s->crypt_method) {
+        uint64_t index_in_cluster = sector_num & (s->cluster_sectors - 1);
+
+        status |= BDRV_BLOCK_OFFSET_VALID |
+                  (cluster_offset + (index_in_cluster << BDRV_SECTOR_BITS));
+    }
+    if (ret == QCOW2_CLUSTER_ZERO) {
+        status |= BDRV_BLOCK_ZERO;
+    } else if (ret != QCOW2_CLUSTER_UNALLOCATED) {
+        status |= BDRV_BLOCK_DATA;
+    }
+    return status;
 }
 
 /* handle reading after the end of the backing file */
@@ -618,7 +681,7 @@ static coroutine_fn int qcow2_co_readv(BlockDriverState *bs, int64_t sector_num,
 
     qemu_iovec_init(&hd_qiov, qiov->niov);
 
-    qemu_co_mutex_lock(&s->lock);
+    qemu_co_rwlock_rdlock(&s->lock);
 
     while (remaining_sectors != 0) {
 
@@ -637,8 +700,7 @@ static coroutine_fn int qcow2_co_readv(BlockDriverState *bs, int64_t sector_num,
 
         index_in_cluster = sector_num & (s->cluster_sectors - 1);
 
-        qemu_iovec_reset(&hd_qiov);
-        qemu_iovec_concat(&hd_qiov, qiov, bytes_done,
+        qemu_iovec_slice(&hd_qiov, qiov, bytes_done,
             cur_nr_sectors * 512);
 
         switch (ret) {
@@ -650,10 +712,10 @@ static coroutine_fn int qcow2_co_readv(BlockDriverState *bs, int64_t sector_num,
                     sector_num, cur_nr_sectors);
                 if (n1 > 0) {
                     BLKDBG_EVENT(bs->file, BLKDBG_READ_BACKING_AIO);
-                    qemu_co_mutex_unlock(&s->lock);
+                    qemu_co_rwlock_unlock(&s->lock);
                     ret = bdrv_co_readv(bs->backing_hd, sector_num,
                                         n1, &hd_qiov);
-                    qemu_co_mutex_lock(&s->lock);
+                    qemu_co_rwlock_rdlock(&s->lock);
                     if (ret < 0) {
                         goto fail;
                     }
@@ -673,15 +735,21 @@ static coroutine_fn int qcow2_co_readv(BlockDriverState *bs, int64_t sector_num,
             break;
 
         case QCOW2_CLUSTER_COMPRESSED:
-            /* add AIO support for compressed blocks ? */
+            /* s->cluster_cache is shared by all requests, so it must be
+             * filled and copied out with the lock held exclusively */
+            qemu_co_rwlock_unlock(&s->lock);
+            qemu_co_rwlock_wrlock(&s->lock);
             ret = qcow2_decompress_cluster(bs, cluster_offset);
+            if (ret >= 0) {
+                qemu_iovec_from_buf(&hd_qiov, 0,
+                    s->cluster_cache + index_in_cluster * 512,
+                    512 * cur_nr_sectors);
+            }
+            qemu_co_rwlock_unlock(&s->lock);
+            qemu_co_rwlock_rdlock(&s->lock);
             if (ret < 0) {
                 goto fail;
             }
-
-            qemu_iovec_from_buf(&hd_qiov, 0,
-                s->cluster_cache + index_in_cluster * 512,
-                512 * cur_nr_sectors);
             break;
 
         case QCOW2_CLUSTER_NORMAL:
@@ -708,17 +776,19 @@ static coroutine_fn int qcow2_co_readv(BlockDriverState *bs, int64_t sector_num,
             }
 
             BLKDBG_EVENT(bs->file, BLKDBG_READ_AIO);
-            qemu_co_mutex_unlock(&s->lock);
+            qemu_co_rwlock_unlock(&s->lock);
             ret = bdrv_co_readv(bs->file,
                                 (cluster_offset >> 9) + index_in_cluster,
                                 cur_nr_sectors, &hd_qiov);
-            qemu_co_mutex_lock(&s->lock);
+            if (ret >= 0 && s->crypt_method) {
+                qcow2_co_encrypt_sectors(bs, sector_num, cluster_data,
+                    cluster_data, cur_nr_sectors, 0, &s->aes_decrypt_key);
+            }
+            qemu_co_rwlock_rdlock(&s->lock);
             if (ret < 0) {
                 goto fail;
             }
             if (s->crypt_method) {
-                qcow2_encrypt_sectors(s, sector_num,  cluster_data,
-                    cluster_data, cur_nr_sectors, 0, &s->aes_decrypt_key);
                 qemu_iovec_from_buf(qiov, bytes_done,
                     cluster_data, 512 * cur_nr_sectors);
             }
@@ -737,7 +807,7 @@ static coroutine_fn int qcow2_co_readv(BlockDriverState *bs, int64_t sector_num,
     ret = 0;
 
 fail:
-    qemu_co_mutex_unlock(&s->lock);
+    qemu_co_rwlock_unlock(&s->lock);
 
     qemu_iovec_destroy(&hd_qiov);
     qemu_vfree(cluster_data);
@@ -768,7 +838,7 @@ static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
 
     s->cluster_cache_offset = -1; /* disable compressed cache */
 
-    qemu_co_mutex_lock(&s->lock);
+    qemu_co_rwlock_wrlock(&s->lock);
 
     while (remaining_sectors != 0) {
 
@@ -790,10 +860,12 @@ static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
 
         assert((cluster_offset & 511) == 0);
 
-        qemu_iovec_reset(&hd_qiov);
-        qemu_iovec_concat(&hd_qiov, qiov, bytes_done,
+        qemu_iovec_slice(&hd_qiov, qiov, bytes_done,
             cur_nr_sectors * 512);
 
+        /* the cluster is allocated; its data is private to this request */
+        qemu_co_rwlock_unlock(&s->lock);
+
         if (s->crypt_method) {
             if (!cluster_data) {
                 cluster_data = qemu_blockalign(bs, QCOW_MAX_CRYPT_CLUSTERS *
@@ -804,7 +876,7 @@ static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
                    QCOW_MAX_CRYPT_CLUSTERS * s->cluster_size);
             qemu_iovec_to_buf(&hd_qiov, 0, cluster_data, hd_qiov.size);
 
-            qcow2_encrypt_sectors(s, sector_num, cluster_data,
+            qcow2_co_encrypt_sectors(bs, sector_num, cluster_data,
                 cluster_data, cur_nr_sectors, 1, &s->aes_encrypt_key);
 
             qemu_iovec_reset(&hd_qiov);
@@ -812,14 +884,13 @@ static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
                 cur_nr_sectors * 512);
         }
 
-        qemu_co_mutex_unlock(&s->lock);
         BLKDBG_EVENT(bs->file, BLKDBG_WRITE_AIO);
         trace_qcow2_writev_data(qemu_coroutine_self(),
                                 (cluster_offset >> 9) + index_in_cluster);
         ret = bdrv_co_writev(bs->file,
                              (cluster_offset >> 9) + index_in_cluster,
                              cur_nr_sectors, &hd_qiov);
-        qemu_co_mutex_lock(&s->lock);
+        qemu_co_rwlock_wrlock(&s->lock);
         if (ret < 0) {
             goto fail;
         }
@@ -835,9 +906,9 @@ static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
                 QLIST_REMOVE(l2meta, next_in_flight);
             }
 
-            qemu_co_mutex_unlock(&s->lock);
+            qemu_co_rwlock_unlock(&s->lock);
             qemu_co_queue_restart_all(&l2meta->dependent_requests);
-            qemu_co_mutex_lock(&s->lock);
+            qemu_co_rwlock_wrlock(&s->lock);
 
             g_free(l2meta);
             l2meta = NULL;
@@ -851,7 +922,7 @@ static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
     ret = 0;
 
 fail:
-    qemu_co_mutex_unlock(&s->lock);
+    qemu_co_rwlock_unlock(&s->lock);
 
     if (l2meta != NULL) {
         if (l2meta->nb_clusters != 0) {
@@ -873,6 +944,11 @@ static void qcow2_close(BlockDriverState *bs)
     BDRVQcowState *s = bs->opaque;
     g_free(s->l1_table);
 
+    qcow2_release_reserved_clusters(bs);
+    if (!bs->read_only && qcow2_store_dirty_bitmaps(bs) < 0) {
+        error_report("qcow2: could not store the dirty bitmaps of '%s'",
+                     bs->filename);
+    }
     qcow2_cache_flush(bs, s->l2_table_cache);
     qcow2_cache_flush(bs, s->refcount_block_cache);
 
@@ -883,9 +959,9 @@ static void qcow2_close(BlockDriverState *bs)
 
     g_free(s->unknown_header_fields);
     cleanup_unknown_header_ext(bs);
+    g_free(s->dirty_bitmaps_ext);
 
     g_free(s->cluster_cache);
-    qemu_vfree(s->cluster_data);
     qcow2_refcount_close(bs);
     qcow2_free_snapshots(bs);
 }
@@ -1052,6 +1128,11 @@ int qcow2_update_header(BlockDriverState *bs)
             .bit  = QCOW2_COMPAT_LAZY_REFCOUNTS_BITNR,
             .name = "lazy refcounts",
         },
+        {
+            .type = QCOW2_FEAT_TYPE_AUTOCLEAR,
+            .bit  = QCOW2_AUTOCLEAR_DIRTY_BITMAPS_BITNR,
+            .name = "dirty bitmaps",
+        },
     };
 
     ret = header_ext_add(buf, QCOW2_EXT_MAGIC_FEATURE_TABLE,
@@ -1062,6 +1143,19 @@ int qcow2_update_header(BlockDriverState *bs)
     buf += ret;
     buflen -= ret;
 
+    /* Dirty bitmaps header extension */
+    if (s->dirty_bitmaps_ext) {
+        ret = header_ext_add(buf, QCOW2_EXT_MAGIC_DIRTY_BITMAPS,
+                             s->dirty_bitmaps_ext, s->dirty_bitmaps_ext_len,
+                             buflen);
+        if (ret < 0) {
+            goto fail;
+        }
+
+        buf += ret;
+        buflen -= ret;
+    }
+
     /* Keep unknown header extensions */
     QLIST_FOREACH(uext, &s->unknown_header_ext, next) {
         ret = header_ext_add(buf, uext->magic, uext->data, uext->len, buflen);
@@ -1297,9 +1391,9 @@ static int qcow2_create2(const char *filename, int64_t total_size,
     /* And if we're supposed to preallocate metadata, do that now */
     if (prealloc) {
         BDRVQcowState *s = bs->opaque;
-        qemu_co_mutex_lock(&s->lock);
+        qemu_co_rwlock_wrlock(&s->lock);
         ret = preallocate(bs);
-        qemu_co_mutex_unlock(&s->lock);
+        qemu_co_rwlock_unlock(&s->lock);
         if (ret < 0) {
             goto out;
         }
@@ -1398,7 +1492,7 @@ static int qcow2_make_empty(BlockDriverState *bs)
 }
 
 static coroutine_fn int qcow2_co_write_zeroes(BlockDriverState *bs,
-    int64_t sector_num, int nb_sectors)
+    int64_t sector_num, int nb_sectors, BdrvRequestFlags flags)
 {
     int ret;
     BDRVQcowState *s = bs->opaque;
@@ -1409,10 +1503,18 @@ static coroutine_fn int qcow2_co_write_zeroes(BlockDriverState *bs,
     }
 
     /* Whatever is left can use real zero clusters */
-    qemu_co_mutex_lock(&s->lock);
-    ret = qcow2_zero_clusters(bs, sector_num << BDRV_SECTOR_BITS,
-        nb_sectors);
-    qemu_co_mutex_unlock(&s->lock);
+    qemu_co_rwlock_wrlock(&s->lock);
+    if (s->qcow_version < 3 && (flags & BDRV_REQ_MAY_UNMAP) &&
+        !bs->backing_hd) {
+        /* Without zero clusters, unallocated clusters read as zeroes as
+         * long as there is no backing file */
+        ret = qcow2_discard_clusters(bs, sector_num << BDRV_SECTOR_BITS,
+            nb_sectors);
+    } else {
+        ret = qcow2_zero_clusters(bs, sector_num << BDRV_SECTOR_BITS,
+            nb_sectors, flags);
+    }
+    qemu_co_rwlock_unlock(&s->lock);
 
     return ret;
 }
@@ -1423,10 +1525,10 @@ static coroutine_fn int qcow2_co_discard(BlockDriverState *bs,
     int ret;
     BDRVQcowState *s = bs->opaque;
 
-    qemu_co_mutex_lock(&s->lock);
+    qemu_co_rwlock_wrlock(&s->lock);
     ret = qcow2_discard_clusters(bs, sector_num << BDRV_SECTOR_BITS,
         nb_sectors);
-    qemu_co_mutex_unlock(&s->lock);
+    qemu_co_rwlock_unlock(&s->lock);
     return ret;
 }
 
@@ -1470,81 +1572,144 @@ static int qcow2_truncate(BlockDriverState *bs, int64_t offset)
     return 0;
 }
 
+typedef struct Qcow2CompressData {
+    uint8_t *out_buf;
+    int out_buf_size;
+    const uint8_t *buf;
+    int buf_size;
+} Qcow2CompressData;
+
+/*
+ * Called in a thread pool worker.  Returns the compressed size, or -ENOSPC
+ * if the data does not fit in out_buf_size bytes.
+ */
+static int compress_buffer(void *opaque)
+{
+    Qcow2CompressData *data = opaque;
+    z_stream strm;
+    int ret, out_len;
+
+    /* best compression, small window, no zlib header */
+    memset(&strm, 0, sizeof(strm));
+    ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION,
+                       Z_DEFLATED, -12,
+                       9, Z_DEFAULT_STRATEGY);
+    if (ret != 0) {
+        return -EINVAL;
+    }
+
+    strm.avail_in = data->buf_size;
+    strm.next_in = (uint8_t *)data->buf;
+    strm.avail_out = data->out_buf_size;
+    strm.next_out = data->out_buf;
+
+    ret = deflate(&strm, Z_FINISH);
+    out_len = strm.next_out - data->out_buf;
+    deflateEnd(&strm);
+
+    if (ret != Z_STREAM_END && ret != Z_OK) {
+        return -EINVAL;
+    }
+    if (ret != Z_STREAM_END || out_len >= data->out_buf_size) {
+        return -ENOSPC;
+    }
+    return out_len;
+}
+
+/*
+ * Compressed writes are deflated in parallel, but the clusters are
+ * allocated and written one at a time in submission order, so that the
+ * image file is laid out in guest order and bdrv_pwrite() does not race
+ * with itself on sectors that two compressed clusters share.
+ */
+static void coroutine_fn qcow2_compress_wait_turn(BDRVQcowState *s,
+                                                  uint64_t ticket)
+{
+    while (s->compress_serving != ticket) {
+        qemu_co_queue_wait(&s->compress_queue);
+    }
+}
+
+static void coroutine_fn qcow2_compress_end_turn(BDRVQcowState *s)
+{
+    s->compress_serving++;
+    qemu_co_queue_restart_all(&s->compress_queue);
+}
+
 /* XXX: put compressed sectors first, then all the cluster aligned
    tables to avoid losing bytes in alignment */
-static int qcow2_write_compressed(BlockDriverState *bs, int64_t sector_num,
-                                  const uint8_t *buf, int nb_sectors)
+static coroutine_fn int qcow2_co_write_compressed(BlockDriverState *bs,
+                                                  int64_t sector_num,
+                                                  int nb_sectors,
+                                                  QEMUIOVector *qiov)
 {
     BDRVQcowState *s = bs->opaque;
-    z_stream strm;
-    int ret, out_len;
-    uint8_t *out_buf;
+    Qcow2CompressData data;
+    uint64_t ticket = s->compress_next_ticket++;
+    uint8_t *buf = NULL, *out_buf = NULL;
     uint64_t cluster_offset;
+    int ret, out_len;
 
     if (nb_sectors == 0) {
         /* align end of file to a sector boundary to ease reading with
            sector based I/Os */
+        qcow2_compress_wait_turn(s, ticket);
         cluster_offset = bdrv_getlength(bs->file);
         cluster_offset = (cluster_offset + 511) & ~511;
         bdrv_truncate(bs->file, cluster_offset);
-        return 0;
+        ret = 0;
+        goto out;
     }
 
-    if (nb_sectors != s->cluster_sectors)
-        return -EINVAL;
-
-    out_buf = g_malloc(s->cluster_size + (s->cluster_size / 1000) + 128);
-
-    /* best compression, small window, no zlib header */
-    memset(&strm, 0, sizeof(strm));
-    ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION,
-                       Z_DEFLATED, -12,
-                       9, Z_DEFAULT_STRATEGY);
-    if (ret != 0) {
+    if (nb_sectors != s->cluster_sectors) {
         ret = -EINVAL;
-        goto fail;
+        qcow2_compress_wait_turn(s, ticket);
+        goto out;
     }
 
-    strm.avail_in = s->cluster_size;
-    strm.next_in = (uint8_t *)buf;
-    strm.avail_out = s->cluster_size;
-    strm.next_out = out_buf;
-
-    ret = deflate(&strm, Z_FINISH);
-    if (ret != Z_STREAM_END && ret != Z_OK) {
-        deflateEnd(&strm);
-        ret = -EINVAL;
-        goto fail;
+    if (qiov->niov == 1) {
+        data.buf = qiov->iov[0].iov_base;
+    } else {
+        buf = qemu_blockalign(bs, s->cluster_size);
+        qemu_iovec_to_buf(qiov, 0, buf, s->cluster_size);
+        data.buf = buf;
     }
-    out_len = strm.next_out - out_buf;
+    data.buf_size = s->cluster_size;
 
-    deflateEnd(&strm);
+    out_buf = g_malloc(s->cluster_size + (s->cluster_size / 1000) + 128);
+    data.out_buf = out_buf;
+    data.out_buf_size = s->cluster_size;
 
-    if (ret != Z_STREAM_END || out_len >= s->cluster_size) {
+    ret = thread_pool_submit_co(aio_get_thread_pool(bdrv_get_aio_context(bs)),
+                                compress_buffer, &data);
+    qcow2_compress_wait_turn(s, ticket);
+
+    if (ret == -ENOSPC) {
         /* could not compress: write normal cluster */
-        ret = bdrv_write(bs, sector_num, buf, s->cluster_sectors);
-        if (ret < 0) {
-            goto fail;
-        }
-    } else {
-        cluster_offset = qcow2_alloc_compressed_cluster_offset(bs,
-            sector_num << 9, out_len);
-        if (!cluster_offset) {
-            ret = -EIO;
-            goto fail;
-        }
-        cluster_offset &= s->cluster_offset_mask;
-        BLKDBG_EVENT(bs->file, BLKDBG_WRITE_COMPRESSED);
-        ret = bdrv_pwrite(bs->file, cluster_offset, out_buf, out_len);
-        if (ret < 0) {
-            goto fail;
-        }
+        ret = bdrv_co_writev(bs, sector_num, s->cluster_sectors, qiov);
+        goto out;
+    } else if (ret < 0) {
+        goto out;
     }
+    out_len = ret;
 
-    ret = 0;
-fail:
+    qemu_co_rwlock_wrlock(&s->lock);
+    cluster_offset = qcow2_alloc_compressed_cluster_offset(bs,
+        sector_num << 9, out_len);
+    qemu_co_rwlock_unlock(&s->lock);
+    if (!cluster_offset) {
+        ret = -EIO;
+        goto out;
+    }
+    cluster_offset &= s->cluster_offset_mask;
+    BLKDBG_EVENT(bs->file, BLKDBG_WRITE_COMPRESSED);
+    ret = bdrv_pwrite(bs->file, cluster_offset, out_buf, out_len);
+
+out:
+    qcow2_compress_end_turn(s);
+    qemu_vfree(buf);
     g_free(out_buf);
-    return ret;
+    return ret < 0 ? ret : 0;
 }
 
 static coroutine_fn int qcow2_co_flush_to_os(BlockDriverState *bs)
@@ -1552,21 +1717,21 @@ static coroutine_fn int qcow2_co_flush_to_os(BlockDriverState *bs)
     BDRVQcowState *s = bs->opaque;
     int ret;
 
-    qemu_co_mutex_lock(&s->lock);
+    qemu_co_rwlock_wrlock(&s->lock);
     ret = qcow2_cache_flush(bs, s->l2_table_cache);
     if (ret < 0) {
-        qemu_co_mutex_unlock(&s->lock);
+        qemu_co_rwlock_unlock(&s->lock);
         return ret;
     }
 
     if (qcow2_need_accurate_refcounts(s)) {
         ret = qcow2_cache_flush(bs, s->refcount_block_cache);
         if (ret < 0) {
-            qemu_co_mutex_unlock(&s->lock);
+            qemu_co_rwlock_unlock(&s->lock);
             return ret;
         }
     }
-    qemu_co_mutex_unlock(&s->lock);
+    qemu_co_rwlock_unlock(&s->lock);
 
     return 0;
 }
@@ -1576,6 +1741,14 @@ static int64_t qcow2_vm_state_offset(BDRVQcowState *s)
 	return (int64_t)s->l1_vm_state_index << (s->cluster_bits + s->l2_bits);
 }
 
+static bool qcow2_can_store_dirty_bitmaps(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    /* version 2 images have no autoclear bits to invalidate the bitmaps */
+    return s->qcow_version >= 3;
+}
+
 static int qcow2_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
 {
     BDRVQcowState *s = bs->opaque;
@@ -1688,7 +1861,7 @@ static BlockDriver bdrv_qcow2 = {
     .bdrv_close         = qcow2_close,
     .bdrv_reopen_prepare  = qcow2_reopen_prepare,
     .bdrv_create        = qcow2_create,
-    .bdrv_co_is_allocated = qcow2_co_is_allocated,
+    .bdrv_co_get_block_status = qcow2_co_get_block_status,
     .bdrv_set_key       = qcow2_set_key,
     .bdrv_make_empty    = qcow2_make_empty,
 
@@ -1699,7 +1872,7 @@ static BlockDriver bdrv_qcow2 = {
     .bdrv_co_write_zeroes   = qcow2_co_write_zeroes,
     .bdrv_co_discard        = qcow2_co_discard,
     .bdrv_truncate          = qcow2_truncate,
-    .bdrv_write_compressed  = qcow2_write_compressed,
+    .bdrv_co_write_compressed = qcow2_co_write_compressed,
 
     .bdrv_snapshot_create   = qcow2_snapshot_create,
     .bdrv_snapshot_goto     = qcow2_snapshot_goto,
@@ -1714,6 +1887,7 @@ static BlockDriver bdrv_qcow2 = {
     .bdrv_change_backing_file   = qcow2_change_backing_file,
 
     .bdrv_invalidate_cache      = qcow2_invalidate_cache,
+    .bdrv_can_store_dirty_bitmaps = qcow2_can_store_dirty_bitmaps,
 
     .create_options = qcow2_create_options,
     .bdrv_check = qcow2_check,
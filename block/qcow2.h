@@ -27,6 +27,7 @@
 
 #include "block/aes.h"
 #include "block/coroutine.h"
+#include "qemu/hbitmap.h"
 
 //#define DEBUG_ALLOC
 //#define DEBUG_ALLOC2
@@ -51,7 +52,26 @@
 #define MIN_CLUSTER_BITS 9
 #define MAX_CLUSTER_BITS 21
 
-#define L2_CACHE_SIZE 16
+/* L2 tables are cached in slices of this many bytes (at most a cluster) */
+#define L2_CACHE_SLICE_SIZE 4096
+
+/* Unless the user asks for a coverage, the L2 cache covers the whole disk
+ * but takes no more memory than this (enough for 8 GB with 64k clusters) */
+#define DEFAULT_L2_CACHE_MAX_SIZE (1024 * 1024)
+
+/* l2_allocate() holds slices of two tables at once */
+#define MIN_L2_CACHE_TABLES 2
+
+/* Data clusters are reserved in the refcount blocks this many at a time */
+#define QCOW2_ALLOC_BATCH 16
+
+/* Images with more clusters than this go without a free cluster bitmap,
+ * which would take more than 16 MB */
+#define QCOW2_FREE_BITMAP_MAX_CLUSTERS (1LL << 27)
+
+/* The free cluster bitmap is built at open time if the image has at most
+ * this many refcount blocks, and as the allocator needs it otherwise */
+#define QCOW2_FREE_BITMAP_OPEN_BLOCKS 8
 
 /* Must be at least 4 to cover all cases of refcount table growth */
 #define REFCOUNT_CACHE_SIZE 4
@@ -126,6 +146,15 @@ enum {
     QCOW2_COMPAT_FEAT_MASK            = QCOW2_COMPAT_LAZY_REFCOUNTS,
 };
 
+/* Autoclear feature bits */
+enum {
+    QCOW2_AUTOCLEAR_DIRTY_BITMAPS_BITNR = 0,
+    QCOW2_AUTOCLEAR_DIRTY_BITMAPS       =
+        1 << QCOW2_AUTOCLEAR_DIRTY_BITMAPS_BITNR,
+
+    QCOW2_AUTOCLEAR_MASK                = QCOW2_AUTOCLEAR_DIRTY_BITMAPS,
+};
+
 typedef struct Qcow2Feature {
     uint8_t type;
     uint8_t bit;
@@ -138,6 +167,7 @@ typedef struct BDRVQcowState {
     int cluster_sectors;
     int l2_bits;
     int l2_size;
+    int l2_slice_size; /* entries per cached L2 slice */
     int l1_size;
     int l1_vm_state_index;
     int csize_shift;
@@ -150,7 +180,6 @@ typedef struct BDRVQcowState {
     Qcow2Cache* refcount_block_cache;
 
     uint8_t *cluster_cache;
-    uint8_t *cluster_data;
     uint64_t cluster_cache_offset;
     QLIST_HEAD(QCowClusterAlloc, QCowL2Meta) cluster_allocs;
 
@@ -160,7 +189,28 @@ typedef struct BDRVQcowState {
     int64_t free_cluster_index;
     int64_t free_byte_offset;
 
-    CoMutex lock;
+    /* one bit per free cluster of the image file, accurate for the
+     * clusters below free_bitmap_valid */
+    HBitmap *free_bitmap;
+    int64_t free_bitmap_size;
+    int64_t free_bitmap_valid;
+
+    /* data clusters whose refcount is already taken but that are not
+     * referenced yet, see qcow2_alloc_data_clusters() */
+    int64_t reserved_cluster_offset;
+    int reserved_clusters;
+
+    /* Protects the metadata.  Cluster lookups on the read path take it
+     * shared; anything that can allocate or modify metadata takes it
+     * exclusive.
+     */
+    CoRwlock lock;
+
+    /* Compressed writes are deflated in the thread pool, but allocate and
+     * write their clusters in the order they were submitted */
+    uint64_t compress_next_ticket;
+    uint64_t compress_serving;
+    CoQueue compress_queue;
 
     uint32_t crypt_method; /* current crypt method, 0 if no key yet */
     uint32_t crypt_method_header;
@@ -181,6 +231,10 @@ typedef struct BDRVQcowState {
     size_t unknown_header_fields_size;
     void* unknown_header_fields;
     QLIST_HEAD(, Qcow2UnknownHeaderExtension) unknown_header_ext;
+
+    /* the dirty bitmaps header extension, in big endian */
+    void *dirty_bitmaps_ext;
+    uint32_t dirty_bitmaps_ext_len;
 } BDRVQcowState;
 
 /* XXX: use std qcow open function ? */
@@ -273,6 +327,23 @@ static inline int size_to_l1(BDRVQcowState *s, int64_t size)
     return (size + (1ULL << shift) - 1) >> shift;
 }
 
+/* Index of the L2 entry for @offset within its cached L2 slice */
+static inline int offset_to_l2_slice_index(BDRVQcowState *s, int64_t offset)
+{
+    return (offset >> s->cluster_bits) & (s->l2_slice_size - 1);
+}
+
+/* Offset in the image file of the slice of the L2 table at @l2_offset that
+ * maps @offset */
+static inline uint64_t l2_slice_offset(BDRVQcowState *s, uint64_t l2_offset,
+                                       int64_t offset)
+{
+    int l2_index = (offset >> s->cluster_bits) & (s->l2_size - 1);
+
+    return l2_offset +
+        (l2_index & ~(s->l2_slice_size - 1)) * sizeof(uint64_t);
+}
+
 static inline int64_t align_offset(int64_t offset, int n)
 {
     offset = (offset + n - 1) & ~(n - 1);
@@ -310,11 +381,15 @@ int qcow2_update_header(BlockDriverState *bs);
 /* qcow2-refcount.c functions */
 int qcow2_refcount_init(BlockDriverState *bs);
 void qcow2_refcount_close(BlockDriverState *bs);
+void qcow2_free_bitmap_init(BlockDriverState *bs);
 
 int64_t qcow2_alloc_clusters(BlockDriverState *bs, int64_t size);
 int qcow2_alloc_clusters_at(BlockDriverState *bs, uint64_t offset,
     int nb_clusters);
 int64_t qcow2_alloc_bytes(BlockDriverState *bs, int size);
+int64_t qcow2_alloc_data_clusters(BlockDriverState *bs, uint64_t offset,
+                                  int *nb_clusters);
+void qcow2_release_reserved_clusters(BlockDriverState *bs);
 void qcow2_free_clusters(BlockDriverState *bs,
     int64_t offset, int64_t size);
 void qcow2_free_any_clusters(BlockDriverState *bs,
@@ -329,11 +404,18 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
 /* qcow2-cluster.c functions */
 int qcow2_grow_l1_table(BlockDriverState *bs, int min_size, bool exact_size);
 void qcow2_l2_cache_reset(BlockDriverState *bs);
-int qcow2_decompress_cluster(BlockDriverState *bs, uint64_t cluster_offset);
+int coroutine_fn qcow2_decompress_cluster(BlockDriverState *bs,
+                                         uint64_t cluster_offset);
 void qcow2_encrypt_sectors(BDRVQcowState *s, int64_t sector_num,
                      uint8_t *out_buf, const uint8_t *in_buf,
                      int nb_sectors, int enc,
                      const AES_KEY *key);
+void coroutine_fn qcow2_co_encrypt_sectors(BlockDriverState *bs,
+                                           int64_t sector_num,
+                                           uint8_t *out_buf,
+                                           const uint8_t *in_buf,
+                                           int nb_sectors, int enc,
+                                           const AES_KEY *key);
 
 int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
     int *num, uint64_t *cluster_offset);
@@ -346,7 +428,8 @@ uint64_t qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs,
 int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m);
 int qcow2_discard_clusters(BlockDriverState *bs, uint64_t offset,
     int nb_sectors);
-int qcow2_zero_clusters(BlockDriverState *bs, uint64_t offset, int nb_sectors);
+int qcow2_zero_clusters(BlockDriverState *bs, uint64_t offset, int nb_sectors,
+    BdrvRequestFlags flags);
 
 /* qcow2-snapshot.c functions */
 int qcow2_snapshot_create(BlockDriverState *bs, QEMUSnapshotInfo *sn_info);
@@ -358,12 +441,21 @@ int qcow2_snapshot_load_tmp(BlockDriverState *bs, const char *snapshot_name);
 void qcow2_free_snapshots(BlockDriverState *bs);
 int qcow2_read_snapshots(BlockDriverState *bs);
 
+/* qcow2-bitmap.c functions */
+int qcow2_load_dirty_bitmaps(BlockDriverState *bs);
+int qcow2_store_dirty_bitmaps(BlockDriverState *bs);
+bool qcow2_dirty_bitmap_area(BlockDriverState *bs, int index,
+                             uint64_t *offset, uint64_t *size);
+
 /* qcow2-cache.c functions */
-Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables);
+Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
+                               int table_size);
 int qcow2_cache_destroy(BlockDriverState* bs, Qcow2Cache *c);
 
 void qcow2_cache_entry_mark_dirty(Qcow2Cache *c, void *table);
 int qcow2_cache_flush(BlockDriverState *bs, Qcow2Cache *c);
+int qcow2_cache_flush_range(BlockDriverState *bs, Qcow2Cache *c,
+                            uint64_t offset, uint64_t size);
 int qcow2_cache_set_dependency(BlockDriverState *bs, Qcow2Cache *c,
     Qcow2Cache *dependency);
 void qcow2_cache_depends_on_flush(Qcow2Cache *c);
@@ -13,6 +13,9 @@
 
 #include "qed.h"
 
+/* Number of L2 table and scrub reads kept in flight */
+#define QED_CHECK_QUEUE_DEPTH 64
+
 typedef struct {
     BDRVQEDState *s;
     BdrvCheckResult *result;
@@ -22,6 +25,7 @@ typedef struct {
     uint32_t *used_clusters;            /* referenced cluster bitmap */
 
     QEDRequest request;
+    BdrvReadQueue *scrub;               /* data cluster reads, or NULL */
 } QEDCheck;
 
 static bool qed_test_bit(uint32_t *bitmap, uint64_t n) {
@@ -59,6 +63,28 @@ static bool qed_set_used_clusters(QEDCheck *check, uint64_t offset,
     return corruptions == 0;
 }
 
+static void qed_check_scrub_complete(QEDCheck *check)
+{
+    int64_t offset;
+    int ret;
+
+    ret = bdrv_read_queue_next(check->scrub, NULL, &offset, NULL);
+    if (ret < 0) {
+        fprintf(stderr, "ERROR cluster at offset=0x%" PRIx64 " cannot be "
+                "read: %s\n", offset, strerror(-ret));
+        check->result->check_errors++;
+    }
+}
+
+static void qed_check_scrub_submit(QEDCheck *check, uint64_t offset)
+{
+    if (bdrv_read_queue_full(check->scrub)) {
+        qed_check_scrub_complete(check);
+    }
+    bdrv_read_queue_submit(check->scrub, offset,
+                           check->s->header.cluster_size, 0);
+}
+
 /**
  * Check an L2 table
  *
@@ -97,6 +123,9 @@ static unsigned int qed_check_l2_table(QEDCheck *check, QEDTable *table)
         }
 
         qed_set_used_clusters(check, offset, 1);
+        if (check->scrub) {
+            qed_check_scrub_submit(check, offset);
+        }
     }
 
     return num_invalid;
@@ -104,20 +133,45 @@ static unsigned int qed_check_l2_table(QEDCheck *check, QEDTable *table)
 
 /**
  * Descend tables and check each cluster is referenced once only
+ *
+ * The L2 tables are read ahead, QED_CHECK_QUEUE_DEPTH at a time, and
+ * checked in L1 order.
  */
 static int qed_check_l1_table(QEDCheck *check, QEDTable *table)
 {
     BDRVQEDState *s = check->s;
-    unsigned int i, num_invalid_l1 = 0;
+    size_t table_bytes = s->header.cluster_size * s->header.table_size;
+    BdrvReadQueue *l2_queue;
+    unsigned int i, next_read, num_invalid_l1 = 0;
     int ret, last_error = 0;
 
     /* Mark L1 table clusters used */
     qed_set_used_clusters(check, s->header.l1_table_offset,
                           s->header.table_size);
 
+    l2_queue = bdrv_read_queue_new(s->bs->file, QED_CHECK_QUEUE_DEPTH,
+                                   table_bytes);
+    next_read = 0;
     for (i = 0; i < s->table_nelems; i++) {
-        unsigned int num_invalid_l2;
+        unsigned int num_invalid_l2, j;
         uint64_t offset = table->offsets[i];
+        QEDTable *l2_table;
+
+        qemu_progress_print(100.0 * i / s->table_nelems, 0);
+
+        /* Start reading the valid L2 tables that come next */
+        next_read = MAX(next_read, i);
+        while (next_read < s->table_nelems &&
+               !bdrv_read_queue_full(l2_queue)) {
+            uint64_t next_offset = table->offsets[next_read];
+
+            if (!qed_offset_is_unalloc_cluster(next_offset) &&
+                qed_check_table_offset(s, next_offset)) {
+                bdrv_read_queue_submit(l2_queue, next_offset, table_bytes,
+                                       next_read);
+            }
+            next_read++;
+        }
 
         if (qed_offset_is_unalloc_cluster(offset)) {
             continue;
@@ -137,24 +191,32 @@ static int qed_check_l1_table(QEDCheck *check, QEDTable *table)
             continue;
         }
 
+        /* Every valid table was submitted, so this is its read */
+        ret = bdrv_read_queue_next(l2_queue, (void **) &l2_table, NULL, NULL);
         if (!qed_set_used_clusters(check, offset, s->header.table_size)) {
             continue; /* skip an invalid table */
         }
-
-        ret = qed_read_l2_table_sync(s, &check->request, offset);
-        if (ret) {
+        if (ret < 0) {
             check->result->check_errors++;
             last_error = ret;
             continue;
         }
 
-        num_invalid_l2 = qed_check_l2_table(check,
-                                            check->request.l2_table->table);
+        for (j = 0; j < s->table_nelems; j++) {
+            l2_table->offsets[j] = le64_to_cpu(l2_table->offsets[j]);
+        }
+        num_invalid_l2 = qed_check_l2_table(check, l2_table);
 
-        /* Write out fixed L2 table */
+        /* Write out fixed L2 table, through the cache */
         if (num_invalid_l2 > 0 && check->fix) {
-            ret = qed_write_l2_table_sync(s, &check->request, 0,
-                                          s->table_nelems, false);
+            ret = qed_read_l2_table_sync(s, &check->request, offset);
+            if (ret == 0) {
+                memcpy(check->request.l2_table->table->offsets,
+                       l2_table->offsets,
+                       s->table_nelems * sizeof(uint64_t));
+                ret = qed_write_l2_table_sync(s, &check->request, 0,
+                                              s->table_nelems, false);
+            }
             if (ret) {
                 check->result->check_errors++;
                 last_error = ret;
@@ -162,6 +224,8 @@ static int qed_check_l1_table(QEDCheck *check, QEDTable *table)
             }
         }
     }
+    bdrv_read_queue_free(l2_queue);
+    qemu_progress_print(100, 0);
 
     /* Drop reference to final table */
     qed_unref_l2_cache_entry(check->request.l2_table);
@@ -216,7 +280,8 @@ static void qed_check_mark_clean(BDRVQEDState *s, BdrvCheckResult *result)
     qed_write_header_sync(s);
 }
 
-int qed_check(BDRVQEDState *s, BdrvCheckResult *result, bool fix)
+int qed_check(BDRVQEDState *s, BdrvCheckResult *result, bool fix,
+              bool scrub)
 {
     QEDCheck check = {
         .s = s,
@@ -233,7 +298,17 @@ int qed_check(BDRVQEDState *s, BdrvCheckResult *result, bool fix)
     check.result->bfi.total_clusters =
         (s->header.image_size + s->header.cluster_size - 1) /
             s->header.cluster_size;
+    if (scrub) {
+        check.scrub = bdrv_read_queue_new(s->bs->file, QED_CHECK_QUEUE_DEPTH,
+                                          s->header.cluster_size);
+    }
     ret = qed_check_l1_table(&check, s->l1_table);
+    if (check.scrub) {
+        while (!bdrv_read_queue_empty(check.scrub)) {
+            qed_check_scrub_complete(&check);
+        }
+        bdrv_read_queue_free(check.scrub);
+    }
     if (ret == 0) {
         /* Only check for leaks if entire image was scanned successfully */
         qed_check_for_leaks(&check);
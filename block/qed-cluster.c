@@ -86,6 +86,16 @@ static void qed_find_cluster_cb(void *opaque, int ret)
         goto out;
     }
 
+    /* A sequential walk reaches the next L2 table soon, start reading it */
+    if (request->l2_table->readahead) {
+        unsigned int l1_index = qed_l1_index(s, find_cluster_cb->pos) + 1;
+
+        request->l2_table->readahead = false;
+        if (l1_index < s->table_nelems) {
+            qed_prefetch_l2_table(s, s->l1_table->offsets[l1_index]);
+        }
+    }
+
     index = qed_l2_index(s, find_cluster_cb->pos);
     n = qed_bytes_to_clusters(s,
                               qed_offset_into_cluster(s, find_cluster_cb->pos) +
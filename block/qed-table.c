@@ -221,6 +221,7 @@ static void qed_read_l2_table_cb(void *opaque, int ret)
         request->l2_table = NULL;
     } else {
         l2_table->offset = l2_offset;
+        l2_table->readahead = true;
 
         qed_commit_l2_cache_entry(&s->l2_cache, l2_table);
 
@@ -278,6 +279,7 @@ void qed_write_l2_table(BDRVQEDState *s, QEDRequest *request,
                         BlockDriverCompletionFunc *cb, void *opaque)
 {
     BLKDBG_EVENT(s->bs->file, BLKDBG_L2_UPDATE);
+    s->l2_write_gen++;
     qed_write_table(s, request->l2_table->offset,
                     request->l2_table->table, index, n, flush, cb, opaque);
 }
@@ -294,3 +296,72 @@ int qed_write_l2_table_sync(BDRVQEDState *s, QEDRequest *request,
 
     return ret;
 }
+
+typedef struct {
+    BDRVQEDState *s;
+    CachedL2Table *l2_table;
+    uint64_t write_gen;
+} QEDPrefetchL2TableCB;
+
+static void qed_prefetch_l2_table_cb(void *opaque, int ret)
+{
+    QEDPrefetchL2TableCB *prefetch_cb = opaque;
+    BDRVQEDState *s = prefetch_cb->s;
+    CachedL2Table *l2_table = prefetch_cb->l2_table;
+
+    trace_qed_prefetch_l2_table_cb(s, s->l2_prefetch_offset, ret);
+
+    /* An L2 table written meanwhile may have been evicted already, in which
+     * case the table that was read could be stale.
+     */
+    if (ret || prefetch_cb->write_gen != s->l2_write_gen) {
+        qed_unref_l2_cache_entry(l2_table);
+    } else {
+        l2_table->offset = s->l2_prefetch_offset;
+        l2_table->readahead = true;
+        qed_commit_l2_cache_entry(&s->l2_cache, l2_table);
+    }
+
+    s->l2_prefetch_offset = 0;
+    g_free(prefetch_cb);
+}
+
+/**
+ * Read an L2 table into the cache ahead of its use
+ *
+ * Nothing is done if the table is already cached or if another read-ahead is
+ * in flight.  The table is committed to the cache like any other table that
+ * was read, and then triggers the read-ahead of the next one on first use.
+ */
+void qed_prefetch_l2_table(BDRVQEDState *s, uint64_t offset)
+{
+    QEDPrefetchL2TableCB *prefetch_cb;
+    CachedL2Table *l2_table;
+
+    if (s->l2_prefetch_offset ||
+        qed_offset_is_unalloc_cluster(offset) ||
+        !qed_check_table_offset(s, offset)) {
+        return;
+    }
+
+    l2_table = qed_find_l2_cache_entry(&s->l2_cache, offset);
+    if (l2_table) {
+        qed_unref_l2_cache_entry(l2_table);
+        return;
+    }
+
+    trace_qed_prefetch_l2_table(s, offset);
+
+    l2_table = qed_alloc_l2_cache_entry(&s->l2_cache);
+    l2_table->table = qed_alloc_table(s);
+
+    prefetch_cb = g_malloc(sizeof(*prefetch_cb));
+    prefetch_cb->s = s;
+    prefetch_cb->l2_table = l2_table;
+    prefetch_cb->write_gen = s->l2_write_gen;
+    s->l2_prefetch_offset = offset;
+
+    BLKDBG_EVENT(s->bs->file, BLKDBG_L2_LOAD);
+    qed_read_table(s, offset, l2_table->table,
+                   qed_prefetch_l2_table_cb, prefetch_cb);
+}
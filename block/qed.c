@@ -382,6 +382,8 @@ static int bdrv_qed_open(BlockDriverState *bs, int flags)
 
     s->bs = bs;
     QSIMPLEQ_INIT(&s->allocating_write_reqs);
+    QSIMPLEQ_INIT(&s->l2_update_reqs);
+    QSIMPLEQ_INIT(&s->l2_pending_reqs);
 
     ret = bdrv_pread(bs->file, 0, &le_header, sizeof(le_header));
     if (ret < 0) {
@@ -487,7 +489,7 @@ static int bdrv_qed_open(BlockDriverState *bs, int flags)
             !(flags & BDRV_O_INCOMING)) {
             BdrvCheckResult result = {0};
 
-            ret = qed_check(s, &result, true);
+            ret = qed_check(s, &result, true, false);
             if (ret) {
                 goto out;
             }
@@ -652,45 +654,67 @@ static int bdrv_qed_create(const char *filename, QEMUOptionParameter *options)
 }
 
 typedef struct {
+    BlockDriverState *bs;
     Coroutine *co;
-    int is_allocated;
+    uint64_t pos;
+    int64_t status;
     int *pnum;
 } QEDIsAllocatedCB;
 
 static void qed_is_allocated_cb(void *opaque, int ret, uint64_t offset, size_t len)
 {
     QEDIsAllocatedCB *cb = opaque;
+    BDRVQEDState *s = cb->bs->opaque;
     *cb->pnum = len / BDRV_SECTOR_SIZE;
-    cb->is_allocated = (ret == QED_CLUSTER_FOUND || ret == QED_CLUSTER_ZERO);
+    switch (ret) {
+    case QED_CLUSTER_FOUND:
+        offset |= qed_offset_into_cluster(s, cb->pos);
+        cb->status = BDRV_BLOCK_DATA | BDRV_BLOCK_OFFSET_VALID | offset;
+        break;
+    case QED_CLUSTER_ZERO:
+        cb->status = BDRV_BLOCK_ZERO;
+        break;
+    case QED_CLUSTER_L2:
+    case QED_CLUSTER_L1:
+        cb->status = 0;
+        break;
+    default:
+        assert(ret < 0);
+        cb->status = ret;
+        break;
+    }
+
     if (cb->co) {
         qemu_coroutine_enter(cb->co, NULL);
     }
 }
 
-static int coroutine_fn bdrv_qed_co_is_allocated(BlockDriverState *bs,
-                                                 int64_t sector_num,
-                                                 int nb_sectors, int *pnum)
+static int64_t coroutine_fn bdrv_qed_co_get_block_status(BlockDriverState *bs,
+                                                         int64_t sector_num,
+                                                         int nb_sectors,
+                                                         int *pnum)
 {
     BDRVQEDState *s = bs->opaque;
-    uint64_t pos = (uint64_t)sector_num * BDRV_SECTOR_SIZE;
     size_t len = (size_t)nb_sectors * BDRV_SECTOR_SIZE;
     QEDIsAllocatedCB cb = {
-        .is_allocated = -1,
+        .bs = bs,
+        .pos = (uint64_t)sector_num * BDRV_SECTOR_SIZE,
+        .status = BDRV_BLOCK_OFFSET_MASK,
         .pnum = pnum,
     };
     QEDRequest request = { .l2_table = NULL };
 
-    qed_find_cluster(s, &request, pos, len, qed_is_allocated_cb, &cb);
+    qed_find_cluster(s, &request, cb.pos, len, qed_is_allocated_cb, &cb);
 
     /* Now sleep if the callback wasn't invoked immediately */
-    while (cb.is_allocated == -1) {
+    while (cb.status == BDRV_BLOCK_OFFSET_MASK) {
         cb.co = qemu_coroutine_self();
         qemu_coroutine_yield();
     }
 
     qed_unref_l2_cache_entry(request.l2_table);
 
-    return cb.is_allocated;
+    return cb.status;
 }
 
 static int bdrv_qed_make_empty(BlockDriverState *bs)
@@ -844,6 +868,23 @@ static void qed_update_l2_table(BDRVQEDState *s, QEDTable *table, int index,
     }
 }
 
+/**
+ * Start the allocating write request queued behind the current one
+ */
+static void qed_next_allocating_write_req(BDRVQEDState *s)
+{
+    QEDAIOCB *acb;
+
+    QSIMPLEQ_REMOVE_HEAD(&s->allocating_write_reqs, next);
+    acb = QSIMPLEQ_FIRST(&s->allocating_write_reqs);
+    if (acb) {
+        qed_aio_next_io(acb, 0);
+    } else if ((s->header.features & QED_F_NEED_CHECK) &&
+               !s->l2_update_in_flight) {
+        qed_start_need_check_timer(s);
+    }
+}
+
 static void qed_aio_complete_bh(void *opaque)
 {
     QEDAIOCB *acb = opaque;
@@ -892,13 +933,7 @@ static void qed_aio_complete(QEDAIOCB *acb, int ret)
      * requests multiple times but rather finish one at a time completely.
      */
     if (acb == QSIMPLEQ_FIRST(&s->allocating_write_reqs)) {
-        QSIMPLEQ_REMOVE_HEAD(&s->allocating_write_reqs, next);
-        acb = QSIMPLEQ_FIRST(&s->allocating_write_reqs);
-        if (acb) {
-            qed_aio_next_io(acb, 0);
-        } else if (s->header.features & QED_F_NEED_CHECK) {
-            qed_start_need_check_timer(s);
-        }
+        qed_next_allocating_write_req(s);
     }
 }
 
@@ -943,6 +978,91 @@ static void qed_aio_write_l1_update(void *opaque, int ret)
     qed_write_l1_table(s, index, 1, qed_commit_l2_update, acb);
 }
 
+static void qed_aio_write_l2_commit(QEDAIOCB *acb);
+
+/**
+ * Complete the requests covered by an L2 update and start the next one
+ */
+static void qed_aio_write_l2_commit_cb(void *opaque, int ret)
+{
+    BDRVQEDState *s = opaque;
+    QSIMPLEQ_HEAD(, QEDAIOCB) reqs = QSIMPLEQ_HEAD_INITIALIZER(reqs);
+    QEDAIOCB *acb;
+
+    QSIMPLEQ_CONCAT(&reqs, &s->l2_update_reqs);
+    s->l2_update_in_flight = false;
+
+    if (s->l2_pending_table) {
+        acb = QSIMPLEQ_FIRST(&s->l2_pending_reqs);
+        QSIMPLEQ_CONCAT(&s->l2_update_reqs, &s->l2_pending_reqs);
+        s->l2_update_in_flight = true;
+        s->l2_pending_table = NULL;
+        qed_write_l2_table(s, &acb->request, s->l2_pending_start,
+                           s->l2_pending_end - s->l2_pending_start, false,
+                           qed_aio_write_l2_commit_cb, s);
+    }
+
+    acb = s->l2_blocked_req;
+    if (acb) {
+        s->l2_blocked_req = NULL;
+        qed_aio_write_l2_commit(acb);
+    }
+
+    while ((acb = QSIMPLEQ_FIRST(&reqs))) {
+        QSIMPLEQ_REMOVE_HEAD(&reqs, l2_next);
+        qed_aio_next_io(acb, ret);
+    }
+
+    if (!s->l2_update_in_flight &&
+        QSIMPLEQ_EMPTY(&s->allocating_write_reqs) &&
+        (s->header.features & QED_F_NEED_CHECK)) {
+        qed_start_need_check_timer(s);
+    }
+}
+
+/**
+ * Write out the updated part of an existing L2 table
+ *
+ * Only one partial L2 write is in flight at a time.  Updates that come in
+ * meanwhile for the same table are merged into a single write, issued when
+ * the current one completes.  Since allocating writes are serialized, a
+ * request whose last cluster this was lets the next allocating write run
+ * right away, and only completes once its own L2 update is on disk.
+ */
+static void qed_aio_write_l2_commit(QEDAIOCB *acb)
+{
+    BDRVQEDState *s = acb_to_s(acb);
+    CachedL2Table *l2_table = acb->request.l2_table;
+    unsigned int index = qed_l2_index(s, acb->cur_pos);
+    unsigned int end = index + acb->cur_nclusters;
+
+    if (!s->l2_update_in_flight) {
+        s->l2_update_in_flight = true;
+        QSIMPLEQ_INSERT_TAIL(&s->l2_update_reqs, acb, l2_next);
+        qed_write_l2_table(s, &acb->request, index, end - index, false,
+                           qed_aio_write_l2_commit_cb, s);
+    } else if (!s->l2_pending_table) {
+        s->l2_pending_table = l2_table;
+        s->l2_pending_start = index;
+        s->l2_pending_end = end;
+        QSIMPLEQ_INSERT_TAIL(&s->l2_pending_reqs, acb, l2_next);
+    } else if (s->l2_pending_table == l2_table) {
+        s->l2_pending_start = MIN(s->l2_pending_start, index);
+        s->l2_pending_end = MAX(s->l2_pending_end, end);
+        QSIMPLEQ_INSERT_TAIL(&s->l2_pending_reqs, acb, l2_next);
+    } else {
+        /* Retried once the pending write is issued */
+        assert(!s->l2_blocked_req);
+        s->l2_blocked_req = acb;
+        return;
+    }
+
+    if (acb->cur_pos + acb->cur_qiov.size >= acb->end_pos) {
+        assert(acb == QSIMPLEQ_FIRST(&s->allocating_write_reqs));
+        qed_next_allocating_write_req(s);
+    }
+}
+
 /**
  * Update L2 table with new cluster offsets and write them out
  */
@@ -971,8 +1091,7 @@ static void qed_aio_write_l2_update(QEDAIOCB *acb, int ret, uint64_t offset)
                             qed_aio_write_l1_update, acb);
     } else {
         /* Write out only the updated part of the L2 table */
-        qed_write_l2_table(s, &acb->request, index, acb->cur_nclusters, false,
-                            qed_aio_next_io, acb);
+        qed_aio_write_l2_commit(acb);
     }
     return;
 
@@ -1081,13 +1200,23 @@ static void qed_aio_write_prefill(void *opaque, int ret)
 /**
  * Check if the QED_F_NEED_CHECK bit should be set during allocating write
  */
-static bool qed_should_set_need_check(BDRVQEDState *s)
+static bool qed_should_set_need_check(QEDAIOCB *acb)
 {
+    BDRVQEDState *s = acb_to_s(acb);
+
     /* The flush before L2 update path ensures consistency */
     if (s->bs->backing_hd) {
         return false;
     }
 
+    /* Zero clusters do not point into the image file, so the L2 update can
+     * never refer to data that did not reach the disk.  New L2 tables are
+     * flushed before the L1 table points to them.
+     */
+    if (acb->flags & QED_AIOCB_ZERO) {
+        return false;
+    }
+
     return !(s->header.features & QED_F_NEED_CHECK);
 }
 
@@ -1147,7 +1276,7 @@ static void qed_aio_write_alloc(QEDAIOCB *acb, size_t len)
         acb->cur_cluster = qed_alloc_clusters(s, acb->cur_nclusters);
     }
 
-    if (qed_should_set_need_check(s)) {
+    if (qed_should_set_need_check(acb)) {
         s->header.features |= QED_F_NEED_CHECK;
         qed_write_header(s, cb, acb);
     } else {
@@ -1368,7 +1497,8 @@ static void coroutine_fn qed_co_write_zeroes_cb(void *opaque, int ret)
 
 static int coroutine_fn bdrv_qed_co_write_zeroes(BlockDriverState *bs,
                                                  int64_t sector_num,
-                                                 int nb_sectors)
+                                                 int nb_sectors,
+                                                 BdrvRequestFlags flags)
 {
     BlockDriverAIOCB *blockacb;
     BDRVQEDState *s = bs->opaque;
@@ -1534,7 +1664,8 @@ static int bdrv_qed_check(BlockDriverState *bs, BdrvCheckResult *result,
 {
     BDRVQEDState *s = bs->opaque;
 
-    return qed_check(s, result, !!fix);
+    return qed_check(s, result, !!(fix & BDRV_FIX_MASK),
+                     !!(fix & BDRV_CHECK_SCRUB));
 }
 
 static QEMUOptionParameter qed_create_options[] = {
@@ -1566,6 +1697,7 @@ static QEMUOptionParameter qed_create_options[] = {
 static BlockDriver bdrv_qed = {
     .format_name              = "qed",
     .instance_size            = sizeof(BDRVQEDState),
+    .bdrv_main_context_only   = true,
     .create_options           = qed_create_options,
 
     .bdrv_probe               = bdrv_qed_probe,
@@ -1574,7 +1706,7 @@ static BlockDriver bdrv_qed = {
     .bdrv_close               = bdrv_qed_close,
     .bdrv_reopen_prepare      = bdrv_qed_reopen_prepare,
     .bdrv_create              = bdrv_qed_create,
-    .bdrv_co_is_allocated     = bdrv_qed_co_is_allocated,
+    .bdrv_co_get_block_status = bdrv_qed_co_get_block_status,
     .bdrv_make_empty          = bdrv_qed_make_empty,
     .bdrv_aio_readv           = bdrv_qed_aio_readv,
     .bdrv_aio_writev          = bdrv_qed_aio_writev,
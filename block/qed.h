@@ -112,6 +112,7 @@ typedef struct CachedL2Table {
     uint64_t offset;    /* offset=0 indicates an invalidate entry */
     QTAILQ_ENTRY(CachedL2Table) node;
     int ref;
+    bool readahead;     /* read ahead the next table on first use */
 } CachedL2Table;
 
 typedef struct {
@@ -133,6 +134,7 @@ typedef struct QEDAIOCB {
     QEMUBH *bh;
     int bh_ret;                     /* final return status for completion bh */
     QSIMPLEQ_ENTRY(QEDAIOCB) next;  /* next request */
+    QSIMPLEQ_ENTRY(QEDAIOCB) l2_next; /* next request in an L2 update batch */
     int flags;                      /* QED_AIOCB_* bits ORed together */
     bool *finished;                 /* signal for cancel completion */
     uint64_t end_pos;               /* request end on block device, in bytes */
@@ -169,6 +171,19 @@ typedef struct {
 
     /* Periodic flush and clear need check flag */
     QEMUTimer *need_check_timer;
+
+    /* L2 table read-ahead, see qed_prefetch_l2_table() */
+    uint64_t l2_prefetch_offset;    /* 0 if no read-ahead is in flight */
+    uint64_t l2_write_gen;          /* bumped on every L2 table write */
+
+    /* Combined L2 table updates, see qed_aio_write_l2_commit() */
+    bool l2_update_in_flight;
+    QSIMPLEQ_HEAD(, QEDAIOCB) l2_update_reqs;   /* covered by that write */
+    CachedL2Table *l2_pending_table;            /* next write, if any */
+    unsigned int l2_pending_start;
+    unsigned int l2_pending_end;
+    QSIMPLEQ_HEAD(, QEDAIOCB) l2_pending_reqs;  /* covered by next write */
+    QEDAIOCB *l2_blocked_req;       /* update to yet another table */
 } BDRVQEDState;
 
 enum {
@@ -240,6 +255,7 @@ void qed_read_l2_table(BDRVQEDState *s, QEDRequest *request, uint64_t offset,
 void qed_write_l2_table(BDRVQEDState *s, QEDRequest *request,
                         unsigned int index, unsigned int n, bool flush,
                         BlockDriverCompletionFunc *cb, void *opaque);
+void qed_prefetch_l2_table(BDRVQEDState *s, uint64_t offset);
 int qed_write_l2_table_sync(BDRVQEDState *s, QEDRequest *request,
                             unsigned int index, unsigned int n, bool flush);
 
@@ -252,7 +268,8 @@ void qed_find_cluster(BDRVQEDState *s, QEDRequest *request, uint64_t pos,
 /**
  * Consistency check
  */
-int qed_check(BDRVQEDState *s, BdrvCheckResult *result, bool fix);
+int qed_check(BDRVQEDState *s, BdrvCheckResult *result, bool fix,
+              bool scrub);
 
 QEDTable *qed_alloc_table(BDRVQEDState *s);
 
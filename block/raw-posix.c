@@ -59,7 +59,7 @@
 #ifdef CONFIG_FIEMAP
 #include <linux/fiemap.h>
 #endif
-#ifdef CONFIG_FALLOCATE_PUNCH_HOLE
+#if defined(CONFIG_FALLOCATE_PUNCH_HOLE) || defined(CONFIG_FALLOCATE_ZERO_RANGE)
 #include <linux/falloc.h>
 #endif
 #if defined (__FreeBSD__) || defined(__FreeBSD_kernel__)
@@ -138,10 +138,15 @@ typedef struct BDRVRawState {
     int use_aio;
     void *aio_ctx;
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    int use_io_uring;
+    void *io_uring;
+#endif
 #ifdef CONFIG_XFS
     bool is_xfs : 1;
 #endif
     bool has_discard : 1;
+    bool has_write_zeroes : 1;
 } BDRVRawState;
 
 typedef struct BDRVRawReopenState {
@@ -150,6 +155,9 @@ typedef struct BDRVRawReopenState {
 #ifdef CONFIG_LINUX_AIO
     int use_aio;
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    int use_io_uring;
+#endif
 } BDRVRawReopenState;
 
 static int fd_open(BlockDriverState *bs);
@@ -262,6 +270,62 @@ error:
 }
 #endif
 
+#ifdef CONFIG_LINUX_IO_URING
+/* Unlike Linux AIO, io_uring does not need O_DIRECT to be asynchronous */
+static int raw_set_io_uring(void **io_uring, int *use_io_uring, int bdrv_flags)
+{
+    if (bdrv_flags & BDRV_O_IO_URING) {
+        /* if non-NULL, luring_init() has already been run */
+        if (*io_uring == NULL) {
+            *io_uring = luring_init();
+            if (!*io_uring) {
+                return -1;
+            }
+        }
+        *use_io_uring = 1;
+    } else {
+        *use_io_uring = 0;
+    }
+    return 0;
+}
+#endif
+
+/*
+ * With O_DIRECT the offset, length and memory of requests must be aligned
+ * to the logical block size of the storage, 4k on 4k-native disks.  Find
+ * it out, so that block.c aligns requests instead of the kernel failing
+ * them; a file only tells by which reads it refuses.
+ */
+static void raw_probe_alignment(BlockDriverState *bs)
+{
+    BDRVRawState *s = bs->opaque;
+    int sector_size = 0;
+    size_t align;
+    char *buf;
+
+    bs->request_alignment = BDRV_SECTOR_SIZE;
+    if (!(s->open_flags & O_DIRECT)) {
+        return;
+    }
+
+#ifdef BLKSSZGET
+    if (ioctl(s->fd, BLKSSZGET, &sector_size) >= 0 &&
+        sector_size >= BDRV_SECTOR_SIZE) {
+        bs->request_alignment = sector_size;
+        return;
+    }
+#endif
+
+    buf = qemu_memalign(MAX_BLOCKSIZE, MAX_BLOCKSIZE);
+    for (align = BDRV_SECTOR_SIZE; align <= MAX_BLOCKSIZE; align <<= 1) {
+        if (pread(s->fd, buf, align, 0) >= 0) {
+            bs->request_alignment = align;
+            break;
+        }
+    }
+    qemu_vfree(buf);
+}
+
 static int raw_open_common(BlockDriverState *bs, const char *filename,
                            int bdrv_flags, int open_flags)
 {
@@ -292,14 +356,23 @@ static int raw_open_common(BlockDriverState *bs, const char *filename,
         return -errno;
     }
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    if (raw_set_io_uring(&s->io_uring, &s->use_io_uring, bdrv_flags)) {
+        qemu_close(fd);
+        return -errno;
+    }
+#endif
 
     s->has_discard = 1;
+    s->has_write_zeroes = 1;
 #ifdef CONFIG_XFS
     if (platform_test_xfs_fd(s->fd)) {
         s->is_xfs = 1;
     }
 #endif
 
+    raw_probe_alignment(bs);
+
     return 0;
 }
 
@@ -336,6 +409,12 @@ static int raw_reopen_prepare(BDRVReopenState *state,
         return -1;
     }
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    raw_s->use_io_uring = s->use_io_uring;
+    if (raw_set_io_uring(&s->io_uring, &raw_s->use_io_uring, state->flags)) {
+        return -1;
+    }
+#endif
 
     if (s->type == FTYPE_FD || s->type == FTYPE_CD) {
         raw_s->open_flags |= O_NONBLOCK;
@@ -403,6 +482,12 @@ static void raw_reopen_commit(BDRVReopenState *state)
 #ifdef CONFIG_LINUX_AIO
     s->use_aio = raw_s->use_aio;
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    s->use_io_uring = raw_s->use_io_uring;
+#endif
+
+    /* the cache mode, and with it O_DIRECT, may have changed */
+    raw_probe_alignment(state->bs);
 
     g_free(state->opaque);
     state->opaque = NULL;
@@ -698,6 +783,72 @@ static ssize_t handle_aiocb_discard(RawPosixAIOData *aiocb)
     return ret;
 }
 
+/*
+ * Zero a range without a bounce buffer.  Returns -ENOTSUP if the host
+ * cannot do it, so that the block layer writes zeroes instead.
+ */
+static ssize_t handle_aiocb_write_zeroes(RawPosixAIOData *aiocb)
+{
+    BDRVRawState *s = aiocb->bs->opaque;
+    int ret = -ENOTSUP;
+
+    if (!s->has_write_zeroes) {
+        return -ENOTSUP;
+    }
+
+    if (aiocb->aio_type & QEMU_AIO_BLKDEV) {
+#ifdef BLKZEROOUT
+        do {
+            uint64_t range[2] = { aiocb->aio_offset, aiocb->aio_nbytes };
+            if (ioctl(aiocb->aio_fildes, BLKZEROOUT, range) == 0) {
+                return 0;
+            }
+        } while (errno == EINTR);
+
+        ret = -errno;
+#endif
+    } else {
+#ifdef CONFIG_FALLOCATE_PUNCH_HOLE
+        struct stat st;
+
+        /* A hole reads as zeroes, but punching one never extends the
+         * file, so leave ranges beyond the end to FALLOC_FL_ZERO_RANGE.
+         */
+        if ((aiocb->aio_type & QEMU_AIO_MAY_UNMAP) && s->has_discard &&
+            fstat(aiocb->aio_fildes, &st) == 0 &&
+            aiocb->aio_offset + aiocb->aio_nbytes <= st.st_size) {
+            do {
+                if (fallocate(aiocb->aio_fildes,
+                              FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                              aiocb->aio_offset, aiocb->aio_nbytes) == 0) {
+                    return 0;
+                }
+            } while (errno == EINTR);
+        }
+#endif
+#ifdef CONFIG_FALLOCATE_ZERO_RANGE
+        do {
+            if (fallocate(aiocb->aio_fildes, FALLOC_FL_ZERO_RANGE,
+                          aiocb->aio_offset, aiocb->aio_nbytes) == 0) {
+                return 0;
+            }
+        } while (errno == EINTR);
+
+        ret = -errno;
+#endif
+    }
+
+    if (ret == -ENODEV || ret == -ENOSYS || ret == -EOPNOTSUPP ||
+        ret == -ENOTTY) {
+        s->has_write_zeroes = 0;
+        ret = -ENOTSUP;
+    } else if (ret == -EINVAL) {
+        /* e.g. a request that is not aligned to the logical block size */
+        ret = -ENOTSUP;
+    }
+    return ret;
+}
+
 static int aio_worker(void *arg)
 {
     RawPosixAIOData *aiocb = arg;
@@ -735,6 +886,9 @@ static int aio_worker(void *arg)
     case QEMU_AIO_DISCARD:
         ret = handle_aiocb_discard(aiocb);
         break;
+    case QEMU_AIO_WRITE_ZEROES:
+        ret = handle_aiocb_write_zeroes(aiocb);
+        break;
     default:
         fprintf(stderr, "invalid aio request (0x%x)\n", aiocb->aio_type);
         ret = -EINVAL;
@@ -750,6 +904,7 @@ static BlockDriverAIOCB *paio_submit(BlockDriverState *bs, int fd,
         BlockDriverCompletionFunc *cb, void *opaque, int type)
 {
     RawPosixAIOData *acb = g_slice_new(RawPosixAIOData);
+    ThreadPool *pool;
 
     acb->bs = bs;
     acb->aio_type = type;
@@ -763,7 +918,25 @@ static BlockDriverAIOCB *paio_submit(BlockDriverState *bs, int fd,
     acb->aio_offset = sector_num * 512;
 
     trace_paio_submit(acb, opaque, sector_num, nb_sectors, type);
-    return thread_pool_submit_aio(aio_worker, acb, cb, opaque);
+    pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+    return thread_pool_submit_aio(pool, aio_worker, acb, cb, opaque);
+}
+
+static int coroutine_fn paio_submit_co(BlockDriverState *bs, int fd,
+        int64_t sector_num, int nb_sectors, int type)
+{
+    RawPosixAIOData *acb = g_slice_new(RawPosixAIOData);
+    ThreadPool *pool;
+
+    acb->bs = bs;
+    acb->aio_type = type;
+    acb->aio_fildes = fd;
+    acb->aio_nbytes = nb_sectors * 512;
+    acb->aio_offset = sector_num * 512;
+
+    trace_paio_submit_co(sector_num, nb_sectors, type);
+    pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+    return thread_pool_submit_co(pool, aio_worker, acb);
 }
 
 static BlockDriverAIOCB *raw_aio_submit(BlockDriverState *bs,
@@ -783,12 +956,22 @@ static BlockDriverAIOCB *raw_aio_submit(BlockDriverState *bs,
     if ((bs->open_flags & BDRV_O_NOCACHE)) {
         if (!bdrv_qiov_is_aligned(bs, qiov)) {
             type |= QEMU_AIO_MISALIGNED;
+#ifdef CONFIG_LINUX_IO_URING
+        } else if (s->use_io_uring) {
+            return luring_submit(bs, s->io_uring, s->fd, sector_num, qiov,
+                                 nb_sectors, cb, opaque, type);
+#endif
 #ifdef CONFIG_LINUX_AIO
         } else if (s->use_aio) {
             return laio_submit(bs, s->aio_ctx, s->fd, sector_num, qiov,
                                nb_sectors, cb, opaque, type);
 #endif
         }
+#ifdef CONFIG_LINUX_IO_URING
+    } else if (s->use_io_uring) {
+        return luring_submit(bs, s->io_uring, s->fd, sector_num, qiov,
+                             nb_sectors, cb, opaque, type);
+#endif
     }
 
     return paio_submit(bs, s->fd, sector_num, qiov, nb_sectors,
@@ -819,12 +1002,97 @@ static BlockDriverAIOCB *raw_aio_flush(BlockDriverState *bs,
     if (fd_open(bs) < 0)
         return NULL;
 
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_io_uring) {
+        return luring_submit(bs, s->io_uring, s->fd, 0, NULL, 0,
+                             cb, opaque, QEMU_AIO_FLUSH);
+    }
+#endif
     return paio_submit(bs, s->fd, 0, NULL, 0, cb, opaque, QEMU_AIO_FLUSH);
 }
 
+static void raw_detach_aio_context(BlockDriverState *bs)
+{
+#if defined(CONFIG_LINUX_AIO) || defined(CONFIG_LINUX_IO_URING)
+    BDRVRawState *s = bs->opaque;
+#endif
+
+#ifdef CONFIG_LINUX_AIO
+    if (s->use_aio) {
+        laio_detach_aio_context(s->aio_ctx, bdrv_get_aio_context(bs));
+    }
+#endif
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->io_uring) {
+        luring_detach_aio_context(s->io_uring, bdrv_get_aio_context(bs));
+    }
+#endif
+}
+
+static void raw_attach_aio_context(BlockDriverState *bs,
+                                   AioContext *new_context)
+{
+#if defined(CONFIG_LINUX_AIO) || defined(CONFIG_LINUX_IO_URING)
+    BDRVRawState *s = bs->opaque;
+#endif
+
+#ifdef CONFIG_LINUX_AIO
+    if (s->use_aio) {
+        laio_attach_aio_context(s->aio_ctx, new_context);
+    }
+#endif
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->io_uring) {
+        luring_attach_aio_context(s->io_uring, new_context);
+    }
+#endif
+}
+
+static void raw_aio_plug(BlockDriverState *bs)
+{
+#if defined(CONFIG_LINUX_AIO) || defined(CONFIG_LINUX_IO_URING)
+    BDRVRawState *s = bs->opaque;
+#endif
+
+#ifdef CONFIG_LINUX_AIO
+    if (s->use_aio) {
+        laio_io_plug(bs, s->aio_ctx);
+    }
+#endif
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_io_uring) {
+        luring_io_plug(bs, s->io_uring);
+    }
+#endif
+}
+
+static void raw_aio_unplug(BlockDriverState *bs)
+{
+#if defined(CONFIG_LINUX_AIO) || defined(CONFIG_LINUX_IO_URING)
+    BDRVRawState *s = bs->opaque;
+#endif
+
+#ifdef CONFIG_LINUX_AIO
+    if (s->use_aio) {
+        laio_io_unplug(bs, s->aio_ctx);
+    }
+#endif
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_io_uring) {
+        luring_io_unplug(bs, s->io_uring);
+    }
+#endif
+}
+
 static void raw_close(BlockDriverState *bs)
 {
     BDRVRawState *s = bs->opaque;
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->io_uring) {
+        luring_cleanup(s->io_uring, bdrv_get_aio_context(bs));
+        s->io_uring = NULL;
+    }
+#endif
     if (s->fd >= 0) {
         qemu_close(s->fd);
         s->fd = -1;
@@ -1036,36 +1304,51 @@ static int raw_create(const char *filename, QEMUOptionParameter *options)
 }
 
 /*
- * Returns true iff the specified sector is present in the disk image. Drivers
- * not implementing the functionality are assumed to not support backing files,
- * hence all their sectors are reported as allocated.
- *
- * If 'sector_num' is beyond the end of the disk image the return value is 0
- * and 'pnum' is set to 0.
- *
- * 'pnum' is set to the number of sectors (including and immediately following
- * the specified sector) that are known to be in the same
- * allocated/unallocated state.
- *
- * 'nb_sectors' is the max value 'pnum' should be set to.  If nb_sectors goes
- * beyond the end of the disk image it will be clamped.
+ * Find the data extent or the hole at @start with lseek(SEEK_HOLE/SEEK_DATA).
+ * These see data that is still in the page cache, so they are tried first.
+ * Returns 0 and sets *@data and *@hole, or -errno.
  */
-static int coroutine_fn raw_co_is_allocated(BlockDriverState *bs,
-                                            int64_t sector_num,
-                                            int nb_sectors, int *pnum)
+static int try_seek_hole(BlockDriverState *bs, off_t start, off_t *data,
+                         off_t *hole)
 {
-    off_t start, data, hole;
-    int ret;
+#if defined SEEK_HOLE && defined SEEK_DATA
+    BDRVRawState *s = bs->opaque;
 
-    ret = fd_open(bs);
-    if (ret < 0) {
-        return ret;
+    *hole = lseek(s->fd, start, SEEK_HOLE);
+    if (*hole == -1) {
+        /* -ENXIO indicates that sector_num was past the end of the file.
+         * There is a virtual hole there.  */
+        assert(errno != -ENXIO);
+
+        /* Most likely EINVAL.  */
+        return -errno;
     }
 
-    start = sector_num * BDRV_SECTOR_SIZE;
+    if (*hole > start) {
+        *data = start;
+    } else {
+        /* On a hole.  We need another syscall to find its end.  */
+        *data = lseek(s->fd, start, SEEK_DATA);
+        if (*data == -1) {
+            *data = lseek(s->fd, 0, SEEK_END);
+        }
+    }
+    return 0;
+#else
+    return -ENOTSUP;
+#endif
+}
 
+/*
+ * Same as try_seek_hole(), with the FIEMAP ioctl.  FIEMAP_FLAG_SYNC flushes
+ * the file first, or dirty pages could be reported as a hole.  Returns
+ * BDRV_BLOCK_ZERO for unwritten (preallocated) extents, 0 for other extents
+ * and holes, or -errno.
+ */
+static int try_fiemap(BlockDriverState *bs, off_t start, off_t *data,
+                      off_t *hole, int nb_sectors)
+{
 #ifdef CONFIG_FIEMAP
-
     BDRVRawState *s = bs->opaque;
     struct {
         struct fiemap fm;
@@ -1074,13 +1357,11 @@ static int coroutine_fn raw_co_is_allocated(BlockDriverState *bs,
 
     f.fm.fm_start = start;
     f.fm.fm_length = (int64_t)nb_sectors * BDRV_SECTOR_SIZE;
-    f.fm.fm_flags = 0;
+    f.fm.fm_flags = FIEMAP_FLAG_SYNC;
     f.fm.fm_extent_count = 1;
     f.fm.fm_reserved = 0;
     if (ioctl(s->fd, FS_IOC_FIEMAP, &f) == -1) {
-        /* Assume everything is allocated.  */
-        *pnum = nb_sectors;
-        return 1;
+        return -errno;
     }
 
     if (f.fm.fm_mapped_extents == 0) {
@@ -1088,50 +1369,58 @@ static int coroutine_fn raw_co_is_allocated(BlockDriverState *bs,
          * f.fm.fm_start + f.fm.fm_length must be clamped to the file size!
          */
         off_t length = lseek(s->fd, 0, SEEK_END);
-        hole = f.fm.fm_start;
-        data = MIN(f.fm.fm_start + f.fm.fm_length, length);
+        *hole = f.fm.fm_start;
+        *data = MIN(f.fm.fm_start + f.fm.fm_length, length);
     } else {
-        data = f.fe.fe_logical;
-        hole = f.fe.fe_logical + f.fe.fe_length;
+        *data = f.fe.fe_logical;
+        *hole = f.fe.fe_logical + f.fe.fe_length;
+        if (f.fe.fe_flags & FIEMAP_EXTENT_UNWRITTEN) {
+            return BDRV_BLOCK_ZERO;
+        }
     }
+    return 0;
+#else
+    return -ENOTSUP;
+#endif
+}
 
-#elif defined SEEK_HOLE && defined SEEK_DATA
+/*
+ * Holes of the file read as zeroes and are reported as BDRV_BLOCK_ZERO,
+ * everything else as BDRV_BLOCK_DATA.  See bdrv_co_get_block_status().
+ */
+static int64_t coroutine_fn raw_co_get_block_status(BlockDriverState *bs,
+                                                    int64_t sector_num,
+                                                    int nb_sectors, int *pnum)
+{
+    off_t start, data = 0, hole = 0;
+    int64_t ret;
 
-    BDRVRawState *s = bs->opaque;
+    ret = fd_open(bs);
+    if (ret < 0) {
+        return ret;
+    }
 
-    hole = lseek(s->fd, start, SEEK_HOLE);
-    if (hole == -1) {
-        /* -ENXIO indicates that sector_num was past the end of the file.
-         * There is a virtual hole there.  */
-        assert(errno != -ENXIO);
+    start = sector_num * BDRV_SECTOR_SIZE;
 
-        /* Most likely EINVAL.  Assume everything is allocated.  */
-        *pnum = nb_sectors;
-        return 1;
+    ret = try_seek_hole(bs, start, &data, &hole);
+    if (ret < 0) {
+        ret = try_fiemap(bs, start, &data, &hole, nb_sectors);
     }
-
-    if (hole > start) {
-        data = start;
-    } else {
-        /* On a hole.  We need another syscall to find its end.  */
-        data = lseek(s->fd, start, SEEK_DATA);
-        if (data == -1) {
-            data = lseek(s->fd, 0, SEEK_END);
-        }
+    if (ret < 0) {
+        /* Assume everything is allocated.  */
+        *pnum = nb_sectors;
+        return BDRV_BLOCK_DATA | BDRV_BLOCK_OFFSET_VALID | start;
     }
-#else
-    *pnum = nb_sectors;
-    return 1;
-#endif
+    ret |= BDRV_BLOCK_OFFSET_VALID | start;
 
     if (data <= start) {
         /* On a data extent, compute sectors to the end of the extent.  */
         *pnum = MIN(nb_sectors, (hole - start) / BDRV_SECTOR_SIZE);
-        return 1;
+        return ret | BDRV_BLOCK_DATA;
     } else {
         /* On a hole, compute sectors to the beginning of the next extent.  */
         *pnum = MIN(nb_sectors, (data - start) / BDRV_SECTOR_SIZE);
-        return 0;
+        return ret | BDRV_BLOCK_ZERO;
     }
 }
 
@@ -1145,6 +1434,21 @@ static coroutine_fn BlockDriverAIOCB *raw_aio_discard(BlockDriverState *bs,
                        cb, opaque, QEMU_AIO_DISCARD);
 }
 
+static int coroutine_fn raw_co_write_zeroes(BlockDriverState *bs,
+    int64_t sector_num, int nb_sectors, BdrvRequestFlags flags)
+{
+    BDRVRawState *s = bs->opaque;
+    int type = QEMU_AIO_WRITE_ZEROES;
+
+    if (!s->has_write_zeroes) {
+        return -ENOTSUP;
+    }
+    if (flags & BDRV_REQ_MAY_UNMAP) {
+        type |= QEMU_AIO_MAY_UNMAP;
+    }
+    return paio_submit_co(bs, s->fd, sector_num, nb_sectors, type);
+}
+
 static QEMUOptionParameter raw_create_options[] = {
     {
         .name = BLOCK_OPT_SIZE,
@@ -1164,8 +1468,13 @@ static BlockDriver bdrv_file = {
     .bdrv_reopen_commit = raw_reopen_commit,
     .bdrv_reopen_abort = raw_reopen_abort,
     .bdrv_close = raw_close,
+    .bdrv_detach_aio_context = raw_detach_aio_context,
+    .bdrv_attach_aio_context = raw_attach_aio_context,
+    .bdrv_io_plug = raw_aio_plug,
+    .bdrv_io_unplug = raw_aio_unplug,
     .bdrv_create = raw_create,
-    .bdrv_co_is_allocated = raw_co_is_allocated,
+    .bdrv_co_get_block_status = raw_co_get_block_status,
+    .bdrv_co_write_zeroes = raw_co_write_zeroes,
 
     .bdrv_aio_readv = raw_aio_readv,
     .bdrv_aio_writev = raw_aio_writev,
@@ -1413,6 +1722,7 @@ static BlockDriverAIOCB *hdev_aio_ioctl(BlockDriverState *bs,
 {
     BDRVRawState *s = bs->opaque;
     RawPosixAIOData *acb;
+    ThreadPool *pool;
 
     if (fd_open(bs) < 0)
         return NULL;
@@ -1424,7 +1734,8 @@ static BlockDriverAIOCB *hdev_aio_ioctl(BlockDriverState *bs,
     acb->aio_offset = 0;
     acb->aio_ioctl_buf = buf;
     acb->aio_ioctl_cmd = req;
-    return thread_pool_submit_aio(aio_worker, acb, cb, opaque);
+    pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+    return thread_pool_submit_aio(pool, aio_worker, acb, cb, opaque);
 }
 
 #elif defined(__FreeBSD__) || defined(__FreeBSD_kernel__)
@@ -1459,6 +1770,24 @@ static coroutine_fn BlockDriverAIOCB *hdev_aio_discard(BlockDriverState *bs,
                        cb, opaque, QEMU_AIO_DISCARD|QEMU_AIO_BLKDEV);
 }
 
+static int coroutine_fn hdev_co_write_zeroes(BlockDriverState *bs,
+    int64_t sector_num, int nb_sectors, BdrvRequestFlags flags)
+{
+    BDRVRawState *s = bs->opaque;
+    int ret;
+
+    ret = fd_open(bs);
+    if (ret < 0) {
+        return ret;
+    }
+    if (!s->has_write_zeroes) {
+        return -ENOTSUP;
+    }
+    /* BLKZEROOUT already unmaps where the device guarantees zeroes */
+    return paio_submit_co(bs, s->fd, sector_num, nb_sectors,
+                          QEMU_AIO_WRITE_ZEROES|QEMU_AIO_BLKDEV);
+}
+
 static int hdev_create(const char *filename, QEMUOptionParameter *options)
 {
     int fd;
@@ -1501,12 +1830,17 @@ static BlockDriver bdrv_host_device = {
     .bdrv_probe_device  = hdev_probe_device,
     .bdrv_file_open     = hdev_open,
     .bdrv_close         = raw_close,
+    .bdrv_detach_aio_context = raw_detach_aio_context,
+    .bdrv_attach_aio_context = raw_attach_aio_context,
+    .bdrv_io_plug = raw_aio_plug,
+    .bdrv_io_unplug = raw_aio_unplug,
     .bdrv_reopen_prepare = raw_reopen_prepare,
     .bdrv_reopen_commit  = raw_reopen_commit,
     .bdrv_reopen_abort   = raw_reopen_abort,
     .bdrv_create        = hdev_create,
     .create_options     = raw_create_options,
     .bdrv_has_zero_init = hdev_has_zero_init,
+    .bdrv_co_write_zeroes = hdev_co_write_zeroes,
 
     .bdrv_aio_readv	= raw_aio_readv,
     .bdrv_aio_writev	= raw_aio_writev,
@@ -1626,6 +1960,10 @@ static BlockDriver bdrv_host_floppy = {
     .bdrv_probe_device	= floppy_probe_device,
     .bdrv_file_open     = floppy_open,
     .bdrv_close         = raw_close,
+    .bdrv_detach_aio_context = raw_detach_aio_context,
+    .bdrv_attach_aio_context = raw_attach_aio_context,
+    .bdrv_io_plug = raw_aio_plug,
+    .bdrv_io_unplug = raw_aio_unplug,
     .bdrv_reopen_prepare = raw_reopen_prepare,
     .bdrv_reopen_commit  = raw_reopen_commit,
     .bdrv_reopen_abort   = raw_reopen_abort,
@@ -1728,6 +2066,10 @@ static BlockDriver bdrv_host_cdrom = {
     .bdrv_probe_device	= cdrom_probe_device,
     .bdrv_file_open     = cdrom_open,
     .bdrv_close         = raw_close,
+    .bdrv_detach_aio_context = raw_detach_aio_context,
+    .bdrv_attach_aio_context = raw_attach_aio_context,
+    .bdrv_io_plug = raw_aio_plug,
+    .bdrv_io_unplug = raw_aio_unplug,
     .bdrv_reopen_prepare = raw_reopen_prepare,
     .bdrv_reopen_commit  = raw_reopen_commit,
     .bdrv_reopen_abort   = raw_reopen_abort,
@@ -1850,6 +2192,10 @@ static BlockDriver bdrv_host_cdrom = {
     .bdrv_probe_device	= cdrom_probe_device,
     .bdrv_file_open     = cdrom_open,
     .bdrv_close         = raw_close,
+    .bdrv_detach_aio_context = raw_detach_aio_context,
+    .bdrv_attach_aio_context = raw_attach_aio_context,
+    .bdrv_io_plug = raw_aio_plug,
+    .bdrv_io_unplug = raw_aio_unplug,
     .bdrv_reopen_prepare = raw_reopen_prepare,
     .bdrv_reopen_commit  = raw_reopen_commit,
     .bdrv_reopen_abort   = raw_reopen_abort,
@@ -16,6 +16,8 @@
 #include "qemu-common.h"
 #include "qemu/error-report.h"
 #include "block/block_int.h"
+#include "qemu/event_notifier.h"
+#include "qemu/thread.h"
 
 #include <rbd/librbd.h>
 
@@ -51,6 +53,13 @@
 #undef LIBRBD_SUPPORTS_DISCARD
 #endif
 
+/*
+ * rbd_aio_readv/rbd_aio_writev and rbd_aio_flush are announced by librbd.h
+ * itself through LIBRBD_SUPPORTS_IOVEC and LIBRBD_SUPPORTS_AIO_FLUSH.
+ * Without vectored I/O, requests with more than one iovec element go
+ * through a bounce buffer.
+ */
+
 #define OBJ_MAX_SIZE (1UL << OBJ_DEFAULT_OBJ_ORDER)
 
 #define RBD_MAX_CONF_NAME_SIZE 128
@@ -63,12 +72,12 @@
 typedef enum {
     RBD_AIO_READ,
     RBD_AIO_WRITE,
-    RBD_AIO_DISCARD
+    RBD_AIO_DISCARD,
+    RBD_AIO_FLUSH
 } RBDAIOCmd;
 
 typedef struct RBDAIOCB {
     BlockDriverAIOCB common;
-    QEMUBH *bh;
     int64_t ret;
     QEMUIOVector *qiov;
     char *bounce;
@@ -88,24 +97,25 @@ typedef struct RADOSCB {
     int64_t size;
     char *buf;
     int64_t ret;
+    QSIMPLEQ_ENTRY(RADOSCB) next;
 } RADOSCB;
 
-#define RBD_FD_READ 0
-#define RBD_FD_WRITE 1
-
 typedef struct BDRVRBDState {
-    int fds[2];
     rados_t cluster;
     rados_ioctx_t io_ctx;
     rbd_image_t image;
     char name[RBD_MAX_IMAGE_NAME_SIZE];
     int qemu_aio_count;
     char *snap;
-    int event_reader_pos;
-    RADOSCB *event_rcb;
-} BDRVRBDState;
 
-static void rbd_aio_bh_cb(void *opaque);
+    /* Completions queued by librbd threads, protected by lock.  The event
+     * notifier is only set when the queue goes from empty to non-empty, so
+     * a burst of completions costs a single wakeup of the main loop.
+     */
+    EventNotifier e;
+    QemuMutex lock;
+    QSIMPLEQ_HEAD(, RADOSCB) completed;
+} BDRVRBDState;
 
 static int qemu_rbd_next_tok(char *dst, int dst_len,
                              char *src, char delim,
@@ -367,10 +377,35 @@ static int qemu_rbd_create(const char *filename, QEMUOptionParameter *options)
     return ret;
 }
 
+static void rbd_aio_complete(RBDAIOCB *acb)
+{
+    if (acb->cmd == RBD_AIO_READ && acb->bounce) {
+        qemu_iovec_from_buf(acb->qiov, 0, acb->bounce, acb->qiov->size);
+    }
+    qemu_vfree(acb->bounce);
+    acb->common.cb(acb->common.opaque, (acb->ret > 0 ? 0 : acb->ret));
+    acb->status = 0;
+
+    if (!acb->cancelled) {
+        qemu_aio_release(acb);
+    }
+}
+
+/* Zero the part of a read that librbd did not fill in */
+static void qemu_rbd_clear_read(RADOSCB *rcb, int64_t offset)
+{
+    RBDAIOCB *acb = rcb->acb;
+
+    if (rcb->buf) {
+        memset(rcb->buf + offset, 0, rcb->size - offset);
+    } else {
+        qemu_iovec_memset(acb->qiov, offset, 0, rcb->size - offset);
+    }
+}
+
 /*
  * This aio completion is being called from qemu_rbd_aio_event_reader()
- * and runs in qemu context. It schedules a bh, but just in case the aio
- * was not cancelled before.
+ * and runs in qemu context.
  */
 static void qemu_rbd_complete_aio(RADOSCB *rcb)
 {
@@ -379,8 +414,7 @@ static void qemu_rbd_complete_aio(RADOSCB *rcb)
 
     r = rcb->ret;
 
-    if (acb->cmd == RBD_AIO_WRITE ||
-        acb->cmd == RBD_AIO_DISCARD) {
+    if (acb->cmd != RBD_AIO_READ) {
         if (r < 0) {
             acb->ret = r;
             acb->error = 1;
@@ -389,11 +423,11 @@ static void qemu_rbd_complete_aio(RADOSCB *rcb)
         }
     } else {
         if (r < 0) {
-            memset(rcb->buf, 0, rcb->size);
+            qemu_rbd_clear_read(rcb, 0);
             acb->ret = r;
             acb->error = 1;
         } else if (r < rcb->size) {
-            memset(rcb->buf + r, 0, rcb->size - r);
+            qemu_rbd_clear_read(rcb, r);
             if (!acb->error) {
                 acb->ret = rcb->size;
             }
@@ -401,42 +435,37 @@ static void qemu_rbd_complete_aio(RADOSCB *rcb)
             acb->ret = r;
         }
     }
-    /* Note that acb->bh can be NULL in case where the aio was cancelled */
-    acb->bh = qemu_bh_new(rbd_aio_bh_cb, acb);
-    qemu_bh_schedule(acb->bh);
     g_free(rcb);
+    rbd_aio_complete(acb);
 }
 
 /*
- * aio fd read handler. It runs in the qemu context and calls the
- * completion handling of completed rados aio operations.
+ * Event notifier handler. It runs in the qemu context and completes all
+ * rados aio operations that were queued by librbd since the last call.
  */
-static void qemu_rbd_aio_event_reader(void *opaque)
+static void qemu_rbd_aio_event_reader(EventNotifier *e)
 {
-    BDRVRBDState *s = opaque;
+    BDRVRBDState *s = container_of(e, BDRVRBDState, e);
+    QSIMPLEQ_HEAD(, RADOSCB) completed;
+    RADOSCB *rcb;
 
-    ssize_t ret;
+    event_notifier_test_and_clear(e);
 
-    do {
-        char *p = (char *)&s->event_rcb;
-
-        /* now read the rcb pointer that was sent from a non qemu thread */
-        ret = read(s->fds[RBD_FD_READ], p + s->event_reader_pos,
-                   sizeof(s->event_rcb) - s->event_reader_pos);
-        if (ret > 0) {
-            s->event_reader_pos += ret;
-            if (s->event_reader_pos == sizeof(s->event_rcb)) {
-                s->event_reader_pos = 0;
-                qemu_rbd_complete_aio(s->event_rcb);
-                s->qemu_aio_count--;
-            }
-        }
-    } while (ret < 0 && errno == EINTR);
+    QSIMPLEQ_INIT(&completed);
+    qemu_mutex_lock(&s->lock);
+    QSIMPLEQ_CONCAT(&completed, &s->completed);
+    qemu_mutex_unlock(&s->lock);
+
+    while ((rcb = QSIMPLEQ_FIRST(&completed)) != NULL) {
+        QSIMPLEQ_REMOVE_HEAD(&completed, next);
+        s->qemu_aio_count--;
+        qemu_rbd_complete_aio(rcb);
+    }
 }
 
-static int qemu_rbd_aio_flush_cb(void *opaque)
+static int qemu_rbd_aio_flush_cb(EventNotifier *e)
 {
-    BDRVRBDState *s = opaque;
+    BDRVRBDState *s = container_of(e, BDRVRBDState, e);
 
     return (s->qemu_aio_count > 0);
 }
@@ -476,11 +505,23 @@ static int qemu_rbd_open(BlockDriverState *bs, const char *filename, int flags)
      * only possible error is that the option does not exist, and
      * librbd defaults to no caching. If write through caching cannot
      * be set up, fall back to no caching.
+     *
+     * With cache=writeback the guest sees a volatile cache and sends
+     * flushes, so librbd need not stay in writethrough mode until the
+     * first one.  Without BDRV_O_CACHE_WB, keep no dirty data in librbd.
      */
     if (flags & BDRV_O_NOCACHE) {
         rados_conf_set(s->cluster, "rbd_cache", "false");
-    } else {
+    } else if (flags & BDRV_O_CACHE_WB) {
         rados_conf_set(s->cluster, "rbd_cache", "true");
+        rados_conf_set(s->cluster, "rbd_cache_writethrough_until_flush",
+                       "false");
+    } else {
+        if (rados_conf_set(s->cluster, "rbd_cache_max_dirty", "0") < 0) {
+            rados_conf_set(s->cluster, "rbd_cache", "false");
+        } else {
+            rados_conf_set(s->cluster, "rbd_cache", "true");
+        }
     }
 
     if (strstr(conf, "conf=") == NULL) {
@@ -516,17 +557,15 @@ static int qemu_rbd_open(BlockDriverState *bs, const char *filename, int flags)
 
     bs->read_only = (s->snap != NULL);
 
-    s->event_reader_pos = 0;
-    r = qemu_pipe(s->fds);
+    r = event_notifier_init(&s->e, false);
     if (r < 0) {
         error_report("error opening eventfd");
         goto failed;
     }
-    fcntl(s->fds[0], F_SETFL, O_NONBLOCK);
-    fcntl(s->fds[1], F_SETFL, O_NONBLOCK);
-    qemu_aio_set_fd_handler(s->fds[RBD_FD_READ], qemu_rbd_aio_event_reader,
-                            NULL, qemu_rbd_aio_flush_cb, s);
-
+    qemu_mutex_init(&s->lock);
+    QSIMPLEQ_INIT(&s->completed);
+    qemu_aio_set_event_notifier(&s->e, qemu_rbd_aio_event_reader,
+                                qemu_rbd_aio_flush_cb);
 
     return 0;
 
@@ -544,9 +583,9 @@ static void qemu_rbd_close(BlockDriverState *bs)
 {
     BDRVRBDState *s = bs->opaque;
 
-    close(s->fds[0]);
-    close(s->fds[1]);
-    qemu_aio_set_fd_handler(s->fds[RBD_FD_READ], NULL, NULL, NULL, NULL);
+    qemu_aio_set_event_notifier(&s->e, NULL, NULL);
+    event_notifier_cleanup(&s->e);
+    qemu_mutex_destroy(&s->lock);
 
     rbd_close(s->image);
     rados_ioctx_destroy(s->io_ctx);
@@ -575,74 +614,30 @@ static const AIOCBInfo rbd_aiocb_info = {
     .cancel = qemu_rbd_aio_cancel,
 };
 
-static int qemu_rbd_send_pipe(BDRVRBDState *s, RADOSCB *rcb)
-{
-    int ret = 0;
-    while (1) {
-        fd_set wfd;
-        int fd = s->fds[RBD_FD_WRITE];
-
-        /* send the op pointer to the qemu thread that is responsible
-           for the aio/op completion. Must do it in a qemu thread context */
-        ret = write(fd, (void *)&rcb, sizeof(rcb));
-        if (ret >= 0) {
-            break;
-        }
-        if (errno == EINTR) {
-            continue;
-        }
-        if (errno != EAGAIN) {
-            break;
-        }
-
-        FD_ZERO(&wfd);
-        FD_SET(fd, &wfd);
-        do {
-            ret = select(fd + 1, NULL, &wfd, NULL, NULL);
-        } while (ret < 0 && errno == EINTR);
-    }
-
-    return ret;
-}
-
 /*
- * This is the callback function for rbd_aio_read and _write
+ * This is the callback function for all rbd_aio_* requests
  *
  * Note: this function is being called from a non qemu thread so
  * we need to be careful about what we do here. Generally we only
- * write to the block notification pipe, and do the rest of the
- * io completion handling from qemu_rbd_aio_event_reader() which
+ * queue the request and kick the event notifier, and do the rest of
+ * the io completion handling from qemu_rbd_aio_event_reader() which
  * runs in a qemu context.
  */
 static void rbd_finish_aiocb(rbd_completion_t c, RADOSCB *rcb)
 {
-    int ret;
+    BDRVRBDState *s = rcb->s;
+    bool kick;
+
     rcb->ret = rbd_aio_get_return_value(c);
     rbd_aio_release(c);
-    ret = qemu_rbd_send_pipe(rcb->s, rcb);
-    if (ret < 0) {
-        error_report("failed writing to acb->s->fds");
-        g_free(rcb);
-    }
-}
 
-/* Callback when all queued rbd_aio requests are complete */
-
-static void rbd_aio_bh_cb(void *opaque)
-{
-    RBDAIOCB *acb = opaque;
-
-    if (acb->cmd == RBD_AIO_READ) {
-        qemu_iovec_from_buf(acb->qiov, 0, acb->bounce, acb->qiov->size);
-    }
-    qemu_vfree(acb->bounce);
-    acb->common.cb(acb->common.opaque, (acb->ret > 0 ? 0 : acb->ret));
-    qemu_bh_delete(acb->bh);
-    acb->bh = NULL;
-    acb->status = 0;
+    qemu_mutex_lock(&s->lock);
+    kick = QSIMPLEQ_EMPTY(&s->completed);
+    QSIMPLEQ_INSERT_TAIL(&s->completed, rcb, next);
+    qemu_mutex_unlock(&s->lock);
 
-    if (!acb->cancelled) {
-        qemu_aio_release(acb);
+    if (kick) {
+        event_notifier_set(&s->e);
     }
 }
 
@@ -658,6 +653,16 @@ static int rbd_aio_discard_wrapper(rbd_image_t image,
 #endif
 }
 
+static int rbd_aio_flush_wrapper(rbd_image_t image,
+                                 rbd_completion_t comp)
+{
+#ifdef LIBRBD_SUPPORTS_AIO_FLUSH
+    return rbd_aio_flush(image, comp);
+#else
+    return -ENOTSUP;
+#endif
+}
+
 static BlockDriverAIOCB *rbd_start_aio(BlockDriverState *bs,
                                        int64_t sector_num,
                                        QEMUIOVector *qiov,
@@ -678,24 +683,31 @@ static BlockDriverAIOCB *rbd_start_aio(BlockDriverState *bs,
     acb = qemu_aio_get(&rbd_aiocb_info, bs, cb, opaque);
     acb->cmd = cmd;
     acb->qiov = qiov;
-    if (cmd == RBD_AIO_DISCARD) {
-        acb->bounce = NULL;
-    } else {
-        acb->bounce = qemu_blockalign(bs, qiov->size);
-    }
+    acb->bounce = NULL;
     acb->ret = 0;
     acb->error = 0;
     acb->s = s;
     acb->cancelled = 0;
-    acb->bh = NULL;
     acb->status = -EINPROGRESS;
 
-    if (cmd == RBD_AIO_WRITE) {
-        qemu_iovec_to_buf(acb->qiov, 0, acb->bounce, qiov->size);
+    /* Data goes straight from and to guest memory when librbd can take the
+     * iovec, or when there is only one element anyway.
+     */
+    buf = NULL;
+    if (cmd == RBD_AIO_READ || cmd == RBD_AIO_WRITE) {
+        if (qiov->niov == 1) {
+            buf = qiov->iov[0].iov_base;
+        } else {
+#ifndef LIBRBD_SUPPORTS_IOVEC
+            acb->bounce = qemu_blockalign(bs, qiov->size);
+            if (cmd == RBD_AIO_WRITE) {
+                qemu_iovec_to_buf(qiov, 0, acb->bounce, qiov->size);
+            }
+            buf = acb->bounce;
+#endif
+        }
     }
 
-    buf = acb->bounce;
-
     off = sector_num * BDRV_SECTOR_SIZE;
     size = nb_sectors * BDRV_SECTOR_SIZE;
 
@@ -714,19 +726,35 @@ static BlockDriverAIOCB *rbd_start_aio(BlockDriverState *bs,
 
     switch (cmd) {
     case RBD_AIO_WRITE:
+#ifdef LIBRBD_SUPPORTS_IOVEC
+        if (!buf) {
+            r = rbd_aio_writev(s->image, qiov->iov, qiov->niov, off, c);
+            break;
+        }
+#endif
         r = rbd_aio_write(s->image, off, size, buf, c);
         break;
     case RBD_AIO_READ:
+#ifdef LIBRBD_SUPPORTS_IOVEC
+        if (!buf) {
+            r = rbd_aio_readv(s->image, qiov->iov, qiov->niov, off, c);
+            break;
+        }
+#endif
         r = rbd_aio_read(s->image, off, size, buf, c);
         break;
     case RBD_AIO_DISCARD:
         r = rbd_aio_discard_wrapper(s->image, off, size, c);
         break;
+    case RBD_AIO_FLUSH:
+        r = rbd_aio_flush_wrapper(s->image, c);
+        break;
     default:
         r = -EINVAL;
     }
 
     if (r < 0) {
+        rbd_aio_release(c);
         goto failed;
     }
 
@@ -735,6 +763,7 @@ static BlockDriverAIOCB *rbd_start_aio(BlockDriverState *bs,
 failed:
     g_free(rcb);
     s->qemu_aio_count--;
+    qemu_vfree(acb->bounce);
     qemu_aio_release(acb);
     return NULL;
 }
@@ -761,6 +790,14 @@ static BlockDriverAIOCB *qemu_rbd_aio_writev(BlockDriverState *bs,
                          RBD_AIO_WRITE);
 }
 
+#ifdef LIBRBD_SUPPORTS_AIO_FLUSH
+static BlockDriverAIOCB *qemu_rbd_aio_flush(BlockDriverState *bs,
+                                            BlockDriverCompletionFunc *cb,
+                                            void *opaque)
+{
+    return rbd_start_aio(bs, 0, NULL, 0, cb, opaque, RBD_AIO_FLUSH);
+}
+#else
 static int qemu_rbd_co_flush(BlockDriverState *bs)
 {
 #if LIBRBD_VERSION_CODE >= LIBRBD_VERSION(0, 1, 1)
@@ -771,6 +808,7 @@ static int qemu_rbd_co_flush(BlockDriverState *bs)
     return 0;
 #endif
 }
+#endif
 
 static int qemu_rbd_getinfo(BlockDriverState *bs, BlockDriverInfo *bdi)
 {
@@ -937,6 +975,7 @@ static QEMUOptionParameter qemu_rbd_create_options[] = {
 static BlockDriver bdrv_rbd = {
     .format_name        = "rbd",
     .instance_size      = sizeof(BDRVRBDState),
+    .bdrv_main_context_only = true,
     .bdrv_file_open     = qemu_rbd_open,
     .bdrv_close         = qemu_rbd_close,
     .bdrv_create        = qemu_rbd_create,
@@ -948,7 +987,12 @@ static BlockDriver bdrv_rbd = {
 
     .bdrv_aio_readv         = qemu_rbd_aio_readv,
     .bdrv_aio_writev        = qemu_rbd_aio_writev,
+
+#ifdef LIBRBD_SUPPORTS_AIO_FLUSH
+    .bdrv_aio_flush         = qemu_rbd_aio_flush,
+#else
     .bdrv_co_flush_to_disk  = qemu_rbd_co_flush,
+#endif
 
 #ifdef LIBRBD_SUPPORTS_DISCARD
     .bdrv_aio_discard       = qemu_rbd_aio_discard,
@@ -0,0 +1,667 @@
+/*
+ * Readahead and data cache filter for remote images
+ *
+ * Sits on top of any protocol driver and keeps recently read data in an LRU
+ * cache of fixed-size chunks.  Sequential readers are detected per stream;
+ * once a stream is confirmed, the data following it is fetched in the
+ * background with a window that doubles on every sequential hit.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu-common.h"
+#include "block/block_int.h"
+#include "block/coroutine.h"
+#include "qemu/module.h"
+#include "qemu/option.h"
+#include "qemu/error-report.h"
+#include "trace.h"
+
+#define READAHEAD_CHUNK_SIZE        (64 * 1024)
+#define READAHEAD_CHUNK_SECTORS     (READAHEAD_CHUNK_SIZE >> BDRV_SECTOR_BITS)
+#define READAHEAD_DEFAULT_CACHE     (32 * 1024 * 1024)
+#define READAHEAD_DEFAULT_WINDOW    (2 * 1024 * 1024)
+#define READAHEAD_MIN_WINDOW        2           /* in chunks */
+#define READAHEAD_STREAMS           8
+
+typedef struct ReadaheadChunk {
+    int64_t index;              /* chunk number in the image */
+    uint8_t *buf;
+    bool valid;                 /* buf holds the image data */
+    bool stale;                 /* dropped from the lookup table */
+    int ref;                    /* filler and readers waiting for it */
+    CoQueue waiters;
+    QTAILQ_ENTRY(ReadaheadChunk) lru;
+} ReadaheadChunk;
+
+typedef struct ReadaheadStream {
+    int64_t next_sector;        /* where a sequential reader continues */
+    int64_t prefetched;         /* end of the data already read ahead */
+    int window;                 /* in chunks, 0 until confirmed */
+} ReadaheadStream;
+
+typedef struct BDRVReadaheadState {
+    GHashTable *lookup;
+    QTAILQ_HEAD(, ReadaheadChunk) lru_list;     /* idle chunks */
+    int nb_chunks;
+    int max_chunks;
+    int max_window;             /* in chunks */
+    ReadaheadStream streams[READAHEAD_STREAMS];
+    unsigned int next_stream;
+    int in_flight;              /* prefetch coroutines */
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t prefetched;
+} BDRVReadaheadState;
+
+typedef struct ReadaheadPrefetch {
+    BlockDriverState *bs;
+    int64_t first;
+    int64_t last;
+} ReadaheadPrefetch;
+
+static QemuOptsList readahead_opts = {
+    .name = "readahead",
+    .head = QTAILQ_HEAD_INITIALIZER(readahead_opts.head),
+    .desc = {
+        {
+            .name = "cache-size",
+            .type = QEMU_OPT_SIZE,
+            .help = "Size of the data cache",
+        },
+        {
+            .name = "max-window",
+            .type = QEMU_OPT_SIZE,
+            .help = "Maximum readahead for one sequential stream",
+        },
+        { /* end of list */ }
+    },
+};
+
+/* g_int64_hash() needs a newer glib than we require */
+static guint readahead_index_hash(gconstpointer key)
+{
+    uint64_t index = *(const int64_t *) key;
+
+    return (guint) index ^ (guint) (index >> 32);
+}
+
+static gboolean readahead_index_equal(gconstpointer a, gconstpointer b)
+{
+    return *(const int64_t *) a == *(const int64_t *) b;
+}
+
+static ReadaheadChunk *readahead_chunk_find(BDRVReadaheadState *s,
+                                            int64_t index)
+{
+    return g_hash_table_lookup(s->lookup, &index);
+}
+
+static void readahead_chunk_free(BDRVReadaheadState *s, ReadaheadChunk *c)
+{
+    qemu_vfree(c->buf);
+    g_free(c);
+    s->nb_chunks--;
+}
+
+/*
+ * Return a new chunk for @index with a reference held by the caller, who is
+ * responsible for filling it.  Recycles the least recently used idle chunk
+ * once the cache is full, and returns NULL if every chunk is busy.
+ */
+static ReadaheadChunk *readahead_chunk_new(BlockDriverState *bs,
+                                           int64_t index)
+{
+    BDRVReadaheadState *s = bs->opaque;
+    ReadaheadChunk *c;
+
+    if (s->nb_chunks < s->max_chunks) {
+        c = g_malloc0(sizeof(*c));
+        c->buf = qemu_blockalign(bs, READAHEAD_CHUNK_SIZE);
+        s->nb_chunks++;
+    } else {
+        c = QTAILQ_FIRST(&s->lru_list);
+        if (c == NULL) {
+            return NULL;
+        }
+        QTAILQ_REMOVE(&s->lru_list, c, lru);
+        g_hash_table_remove(s->lookup, &c->index);
+    }
+
+    c->index = index;
+    c->valid = false;
+    c->stale = false;
+    c->ref = 1;
+    qemu_co_queue_init(&c->waiters);
+    g_hash_table_insert(s->lookup, &c->index, c);
+
+    return c;
+}
+
+static void readahead_chunk_unref(BDRVReadaheadState *s, ReadaheadChunk *c)
+{
+    assert(c->ref > 0);
+    if (--c->ref > 0) {
+        return;
+    }
+
+    if (c->valid) {
+        QTAILQ_INSERT_TAIL(&s->lru_list, c, lru);
+    } else {
+        assert(c->stale);
+        readahead_chunk_free(s, c);
+    }
+}
+
+/* Drop a chunk from the lookup table; busy chunks go away on last unref */
+static void readahead_chunk_drop(BDRVReadaheadState *s, ReadaheadChunk *c)
+{
+    c->valid = false;
+    c->stale = true;
+    if (c->ref == 0) {
+        QTAILQ_REMOVE(&s->lru_list, c, lru);
+        readahead_chunk_free(s, c);
+    }
+}
+
+typedef struct ReadaheadInvalidate {
+    BDRVReadaheadState *s;
+    int64_t first;
+    int64_t last;
+    QTAILQ_HEAD(, ReadaheadChunk) dropped;
+} ReadaheadInvalidate;
+
+static gboolean readahead_invalidate_one(gpointer key, gpointer value,
+                                         gpointer opaque)
+{
+    ReadaheadInvalidate *inv = opaque;
+    ReadaheadChunk *c = value;
+
+    if (c->index < inv->first || c->index > inv->last) {
+        return FALSE;
+    }
+
+    /* The key lives in the chunk, so free it only after the removal */
+    c->valid = false;
+    c->stale = true;
+    if (c->ref == 0) {
+        QTAILQ_REMOVE(&inv->s->lru_list, c, lru);
+        QTAILQ_INSERT_TAIL(&inv->dropped, c, lru);
+    }
+    return TRUE;
+}
+
+static void readahead_invalidate(BDRVReadaheadState *s, int64_t sector_num,
+                                 int64_t nb_sectors)
+{
+    int64_t first = sector_num / READAHEAD_CHUNK_SECTORS;
+    int64_t last = (sector_num + nb_sectors - 1) / READAHEAD_CHUNK_SECTORS;
+    ReadaheadInvalidate inv;
+    ReadaheadChunk *c, *next;
+    int64_t i;
+
+    if (nb_sectors <= 0) {
+        return;
+    }
+
+    if (last - first < s->nb_chunks) {
+        for (i = first; i <= last; i++) {
+            c = readahead_chunk_find(s, i);
+            if (c) {
+                g_hash_table_remove(s->lookup, &c->index);
+                readahead_chunk_drop(s, c);
+            }
+        }
+        return;
+    }
+
+    /* Large discards and truncation: walk the cache instead of the range */
+    inv.s = s;
+    inv.first = first;
+    inv.last = last;
+    QTAILQ_INIT(&inv.dropped);
+    g_hash_table_foreach_remove(s->lookup, readahead_invalidate_one, &inv);
+    QTAILQ_FOREACH_SAFE(c, &inv.dropped, lru, next) {
+        readahead_chunk_free(s, c);
+    }
+}
+
+/*
+ * Fill up to @n chunks starting at @index with a single request to the
+ * protocol.  Fewer chunks are used if the cache has no more to give.
+ *
+ * Returns the number of chunks that were read, or -errno.
+ */
+static int coroutine_fn readahead_fill(BlockDriverState *bs, int64_t index,
+                                       int n)
+{
+    BDRVReadaheadState *s = bs->opaque;
+    ReadaheadChunk **chunks;
+    QEMUIOVector qiov;
+    int64_t sector_num = index * READAHEAD_CHUNK_SECTORS;
+    int64_t nb_sectors;
+    int i, ret;
+
+    chunks = g_malloc(sizeof(chunks[0]) * n);
+    for (i = 0; i < n; i++) {
+        chunks[i] = readahead_chunk_new(bs, index + i);
+        if (chunks[i] == NULL) {
+            break;
+        }
+    }
+    n = i;
+    if (n == 0) {
+        g_free(chunks);
+        return 0;
+    }
+
+    /* The last chunk of the image may be short */
+    nb_sectors = MIN((int64_t) n * READAHEAD_CHUNK_SECTORS,
+                     bs->total_sectors - sector_num);
+
+    qemu_iovec_init(&qiov, n);
+    for (i = 0; i < n; i++) {
+        int64_t len = MIN(READAHEAD_CHUNK_SECTORS,
+                          nb_sectors - i * READAHEAD_CHUNK_SECTORS);
+        qemu_iovec_add(&qiov, chunks[i]->buf, len << BDRV_SECTOR_BITS);
+    }
+
+    ret = bdrv_co_readv(bs->file, sector_num, nb_sectors, &qiov);
+    qemu_iovec_destroy(&qiov);
+
+    for (i = 0; i < n; i++) {
+        ReadaheadChunk *c = chunks[i];
+
+        if (ret < 0 && !c->stale) {
+            g_hash_table_remove(s->lookup, &c->index);
+            c->stale = true;
+        }
+        c->valid = !c->stale;
+        qemu_co_queue_restart_all(&c->waiters);
+        readahead_chunk_unref(s, c);
+    }
+    g_free(chunks);
+
+    return ret < 0 ? ret : n;
+}
+
+static void coroutine_fn readahead_prefetch_entry(void *opaque)
+{
+    ReadaheadPrefetch *p = opaque;
+    BlockDriverState *bs = p->bs;
+    BDRVReadaheadState *s = bs->opaque;
+    int64_t index = p->first;
+    int n, ret;
+
+    while (index <= p->last) {
+        if (readahead_chunk_find(s, index)) {
+            index++;
+            continue;
+        }
+        for (n = 1; index + n <= p->last; n++) {
+            if (readahead_chunk_find(s, index + n)) {
+                break;
+            }
+        }
+
+        ret = readahead_fill(bs, index, n);
+        if (ret <= 0) {
+            break;
+        }
+        s->prefetched += ret;
+        index += ret;
+    }
+
+    s->in_flight--;
+    g_free(p);
+}
+
+/*
+ * Match the request against the tracked streams and start reading ahead of
+ * a confirmed sequential stream.  A new prefetch is only issued once the
+ * reader has consumed half of the previous window, so a sequential stream
+ * costs one background request per window instead of one per read.
+ */
+static void readahead_detect(BlockDriverState *bs, int64_t sector_num,
+                             int nb_sectors)
+{
+    BDRVReadaheadState *s = bs->opaque;
+    ReadaheadStream *st = NULL;
+    ReadaheadPrefetch *p;
+    Coroutine *co;
+    int64_t end = sector_num + nb_sectors;
+    int64_t window_end, start;
+    int i;
+
+    for (i = 0; i < READAHEAD_STREAMS; i++) {
+        if (s->streams[i].next_sector == sector_num) {
+            st = &s->streams[i];
+            break;
+        }
+    }
+
+    if (st == NULL) {
+        st = &s->streams[s->next_stream++ % READAHEAD_STREAMS];
+        st->next_sector = end;
+        st->prefetched = end;
+        st->window = 0;
+        return;
+    }
+
+    st->next_sector = end;
+    st->window = MIN(MAX(st->window * 2, READAHEAD_MIN_WINDOW),
+                     s->max_window);
+    if (st->window == 0) {
+        return;
+    }
+
+    window_end = end + (int64_t) st->window * READAHEAD_CHUNK_SECTORS;
+    window_end = MIN(window_end, bs->total_sectors);
+    start = MAX(st->prefetched, end);
+    if (st->prefetched - end >= (window_end - end) / 2 || start >= window_end) {
+        return;
+    }
+    st->prefetched = window_end;
+
+    trace_readahead_prefetch(bs, start, window_end - start);
+
+    p = g_malloc(sizeof(*p));
+    p->bs = bs;
+    p->first = start / READAHEAD_CHUNK_SECTORS;
+    p->last = (window_end - 1) / READAHEAD_CHUNK_SECTORS;
+
+    s->in_flight++;
+    co = qemu_coroutine_create(readahead_prefetch_entry);
+    qemu_coroutine_enter(co, p);
+}
+
+static int coroutine_fn readahead_read_direct(BlockDriverState *bs,
+                                              int64_t sector_num,
+                                              int nb_sectors,
+                                              QEMUIOVector *qiov,
+                                              size_t qiov_offset)
+{
+    QEMUIOVector local_qiov;
+    int ret;
+
+    qemu_iovec_init(&local_qiov, qiov->niov);
+    qemu_iovec_concat(&local_qiov, qiov, qiov_offset,
+                      nb_sectors << BDRV_SECTOR_BITS);
+    ret = bdrv_co_readv(bs->file, sector_num, nb_sectors, &local_qiov);
+    qemu_iovec_destroy(&local_qiov);
+
+    return ret;
+}
+
+static int coroutine_fn readahead_co_readv(BlockDriverState *bs,
+                                           int64_t sector_num, int nb_sectors,
+                                           QEMUIOVector *qiov)
+{
+    BDRVReadaheadState *s = bs->opaque;
+    int64_t end = sector_num + nb_sectors;
+    int64_t index, last;
+    int ret;
+
+    readahead_detect(bs, sector_num, nb_sectors);
+
+    /* Don't let a single large request wipe out the cache */
+    if (nb_sectors > (int64_t) s->max_chunks * READAHEAD_CHUNK_SECTORS / 4) {
+        s->misses++;
+        return bdrv_co_readv(bs->file, sector_num, nb_sectors, qiov);
+    }
+
+    index = sector_num / READAHEAD_CHUNK_SECTORS;
+    last = (end - 1) / READAHEAD_CHUNK_SECTORS;
+    while (index <= last) {
+        ReadaheadChunk *c = readahead_chunk_find(s, index);
+        int64_t chunk_start = index * READAHEAD_CHUNK_SECTORS;
+        int64_t start = MAX(sector_num, chunk_start);
+        int n = MIN(end, chunk_start + READAHEAD_CHUNK_SECTORS) - start;
+        size_t qiov_offset = (start - sector_num) << BDRV_SECTOR_BITS;
+        size_t buf_offset = (start - chunk_start) << BDRV_SECTOR_BITS;
+
+        if (c == NULL) {
+            int run;
+
+            for (run = 1; index + run <= last; run++) {
+                if (readahead_chunk_find(s, index + run)) {
+                    break;
+                }
+            }
+
+            s->misses += run;
+            ret = readahead_fill(bs, index, run);
+            if (ret < 0) {
+                return ret;
+            } else if (ret == 0) {
+                /* Everything is busy, bypass the cache for this chunk */
+                ret = readahead_read_direct(bs, start, n, qiov, qiov_offset);
+                if (ret < 0) {
+                    return ret;
+                }
+                index++;
+            }
+            /* Pick up the chunks we just filled on the next iterations */
+            continue;
+        }
+
+        if (!c->valid) {
+            c->ref++;
+            qemu_co_queue_wait(&c->waiters);
+            if (c->valid) {
+                qemu_iovec_from_buf(qiov, qiov_offset, c->buf + buf_offset,
+                                    n << BDRV_SECTOR_BITS);
+                readahead_chunk_unref(s, c);
+            } else {
+                readahead_chunk_unref(s, c);
+                ret = readahead_read_direct(bs, start, n, qiov, qiov_offset);
+                if (ret < 0) {
+                    return ret;
+                }
+            }
+            index++;
+            continue;
+        }
+
+        s->hits++;
+        if (c->ref == 0) {
+            QTAILQ_REMOVE(&s->lru_list, c, lru);
+            QTAILQ_INSERT_TAIL(&s->lru_list, c, lru);
+        }
+        qemu_iovec_from_buf(qiov, qiov_offset, c->buf + buf_offset,
+                            n << BDRV_SECTOR_BITS);
+        index++;
+    }
+
+    return 0;
+}
+
+/*
+ * Writes go straight to the protocol.  The range is invalidated both before,
+ * so that later reads miss, and after completion, so that data read in
+ * concurrently with the write is not kept around.
+ */
+static int coroutine_fn readahead_co_writev(BlockDriverState *bs,
+                                            int64_t sector_num, int nb_sectors,
+                                            QEMUIOVector *qiov)
+{
+    BDRVReadaheadState *s = bs->opaque;
+    int ret;
+
+    readahead_invalidate(s, sector_num, nb_sectors);
+    ret = bdrv_co_writev(bs->file, sector_num, nb_sectors, qiov);
+    readahead_invalidate(s, sector_num, nb_sectors);
+
+    return ret;
+}
+
+static int coroutine_fn readahead_co_write_zeroes(BlockDriverState *bs,
+                                                  int64_t sector_num,
+                                                  int nb_sectors,
+                                                  BdrvRequestFlags flags)
+{
+    BDRVReadaheadState *s = bs->opaque;
+    int ret;
+
+    readahead_invalidate(s, sector_num, nb_sectors);
+    ret = bdrv_co_write_zeroes(bs->file, sector_num, nb_sectors, flags);
+    readahead_invalidate(s, sector_num, nb_sectors);
+
+    return ret;
+}
+
+static int coroutine_fn readahead_co_discard(BlockDriverState *bs,
+                                             int64_t sector_num,
+                                             int nb_sectors)
+{
+    BDRVReadaheadState *s = bs->opaque;
+    int ret;
+
+    readahead_invalidate(s, sector_num, nb_sectors);
+    ret = bdrv_co_discard(bs->file, sector_num, nb_sectors);
+    readahead_invalidate(s, sector_num, nb_sectors);
+
+    return ret;
+}
+
+static int64_t coroutine_fn readahead_co_get_block_status(BlockDriverState *bs,
+                                                          int64_t sector_num,
+                                                          int nb_sectors,
+                                                          int *pnum)
+{
+    *pnum = nb_sectors;
+    return BDRV_BLOCK_RAW | BDRV_BLOCK_OFFSET_VALID |
+           (sector_num << BDRV_SECTOR_BITS);
+}
+
+static int64_t readahead_getlength(BlockDriverState *bs)
+{
+    return bdrv_getlength(bs->file);
+}
+
+static int readahead_truncate(BlockDriverState *bs, int64_t offset)
+{
+    BDRVReadaheadState *s = bs->opaque;
+    int ret;
+
+    ret = bdrv_truncate(bs->file, offset);
+    readahead_invalidate(s, 0, INT64_MAX / BDRV_SECTOR_SIZE);
+    memset(s->streams, 0, sizeof(s->streams));
+
+    return ret;
+}
+
+static int readahead_has_zero_init(BlockDriverState *bs)
+{
+    return bdrv_has_zero_init(bs->file);
+}
+
+/*
+ * Valid filenames look like readahead:[OPTIONS:]FILENAME, where OPTIONS is
+ * a comma-separated list of cache-size=SIZE and max-window=SIZE.  The
+ * options field is recognized by its '=', so protocol filenames with colons
+ * of their own, like nbd:host:port, can follow the prefix directly.
+ */
+static int readahead_open(BlockDriverState *bs, const char *filename, int flags)
+{
+    BDRVReadaheadState *s = bs->opaque;
+    QemuOpts *opts;
+    uint64_t cache_size, max_window;
+    const char *c, *eq;
+    int ret;
+
+    /* Parse the readahead: prefix */
+    if (strncmp(filename, "readahead:", strlen("readahead:"))) {
+        return -EINVAL;
+    }
+    filename += strlen("readahead:");
+
+    opts = qemu_opts_create_nofail(&readahead_opts);
+    c = strchr(filename, ':');
+    eq = strchr(filename, '=');
+    if (c && eq && eq < c) {
+        char *params = g_strndup(filename, c - filename);
+
+        ret = qemu_opts_do_parse(opts, params, NULL);
+        g_free(params);
+        if (ret < 0) {
+            qemu_opts_del(opts);
+            return -EINVAL;
+        }
+        filename = c + 1;
+    }
+
+    cache_size = qemu_opt_get_size(opts, "cache-size",
+                                   READAHEAD_DEFAULT_CACHE);
+    max_window = qemu_opt_get_size(opts, "max-window",
+                                   READAHEAD_DEFAULT_WINDOW);
+    qemu_opts_del(opts);
+
+    if (cache_size < READAHEAD_CHUNK_SIZE * 4 || cache_size > INT_MAX) {
+        error_report("readahead: cache-size must be between %d and %d bytes",
+                     READAHEAD_CHUNK_SIZE * 4, INT_MAX);
+        return -EINVAL;
+    }
+
+    s->max_chunks = cache_size / READAHEAD_CHUNK_SIZE;
+    /* Keep at least three quarters of the cache for already read data */
+    s->max_window = MIN(max_window / READAHEAD_CHUNK_SIZE, s->max_chunks / 4);
+    s->lookup = g_hash_table_new(readahead_index_hash, readahead_index_equal);
+    QTAILQ_INIT(&s->lru_list);
+
+    ret = bdrv_file_open(&bs->file, filename, flags);
+    if (ret < 0) {
+        g_hash_table_destroy(s->lookup);
+        return ret;
+    }
+
+    return 0;
+}
+
+static void readahead_close(BlockDriverState *bs)
+{
+    BDRVReadaheadState *s = bs->opaque;
+    ReadaheadChunk *c, *next;
+
+    while (s->in_flight > 0) {
+        aio_poll(bdrv_get_aio_context(bs), true);
+    }
+
+    trace_readahead_stats(bs, s->hits, s->misses, s->prefetched);
+
+    QTAILQ_FOREACH_SAFE(c, &s->lru_list, lru, next) {
+        g_hash_table_remove(s->lookup, &c->index);
+        QTAILQ_REMOVE(&s->lru_list, c, lru);
+        readahead_chunk_free(s, c);
+    }
+    assert(s->nb_chunks == 0);
+    g_hash_table_destroy(s->lookup);
+}
+
+static BlockDriver bdrv_readahead = {
+    .format_name        = "readahead",
+    .protocol_name      = "readahead",
+
+    .instance_size      = sizeof(BDRVReadaheadState),
+
+    .bdrv_file_open     = readahead_open,
+    .bdrv_close         = readahead_close,
+
+    .bdrv_co_readv          = readahead_co_readv,
+    .bdrv_co_writev         = readahead_co_writev,
+    .bdrv_co_write_zeroes   = readahead_co_write_zeroes,
+    .bdrv_co_discard        = readahead_co_discard,
+    .bdrv_co_get_block_status = readahead_co_get_block_status,
+
+    .bdrv_getlength     = readahead_getlength,
+    .bdrv_truncate      = readahead_truncate,
+    .bdrv_has_zero_init = readahead_has_zero_init,
+};
+
+static void bdrv_readahead_init(void)
+{
+    bdrv_register(&bdrv_readahead);
+}
+
+block_init(bdrv_readahead_init);
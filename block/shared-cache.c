@@ -0,0 +1,505 @@
+/*
+ * Cluster cache for read-only images, shared between QEMU processes
+ *
+ * Many guests started from the same base image each read the same clusters
+ * from it.  This cache lives in a file that every QEMU process maps, so a
+ * cluster that one process has read is served from memory to all others.
+ *
+ * The file holds a header, a table of slots and one data cluster per slot.
+ * Slots are grouped in small sets indexed by a hash of image key and
+ * cluster number.  Each slot is protected by a sequence count that is odd
+ * while a writer fills it, so readers never take a lock: they copy the data
+ * out and retry from the image if the count changed meanwhile.  Writers
+ * claim a slot with a compare-and-swap and simply skip it if another process
+ * got there first.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu-common.h"
+#include "block/block_int.h"
+#include "block/shared-cache.h"
+#include "qemu/atomic.h"
+#include "qemu/queue.h"
+#include "trace.h"
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/file.h>
+#endif
+
+#define SHARED_CACHE_MAGIC          0x51534343  /* "QSCC" */
+#define SHARED_CACHE_VERSION        1
+#define SHARED_CACHE_CLUSTER_SIZE   (64 * 1024)
+#define SHARED_CACHE_WAYS           4
+#define SHARED_CACHE_SLOTS_OFFSET   64
+
+typedef struct SharedCacheHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t cluster_size;
+    uint32_t ways;
+    uint64_t nb_sets;
+    uint64_t data_offset;
+    uint32_t clock;             /* advanced on every use of a slot */
+} SharedCacheHeader;
+
+typedef struct SharedCacheSlot {
+    uint32_t seq;               /* odd while the slot is being written */
+    uint32_t last_used;
+    uint64_t image;             /* 0 for an empty slot */
+    uint64_t cluster;
+    uint64_t reserved;
+} SharedCacheSlot;
+
+struct SharedCache {
+    char *path;
+    int refcount;
+    void *map;
+    size_t map_size;
+    SharedCacheHeader *header;
+    SharedCacheSlot *slots;
+    uint8_t *data;
+    uint64_t nb_sets;
+    size_t cluster_size;
+    uint64_t hits;
+    uint64_t misses;
+    QLIST_ENTRY(SharedCache) next;
+};
+
+static QLIST_HEAD(, SharedCache) shared_caches =
+    QLIST_HEAD_INITIALIZER(shared_caches);
+
+/* 64-bit FNV-1a, the key must be the same in every process */
+static uint64_t shared_cache_hash(uint64_t hash, const void *buf, size_t len)
+{
+    const uint8_t *p = buf;
+
+    while (len--) {
+        hash ^= *p++;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+#define SHARED_CACHE_HASH_INIT  0xcbf29ce484222325ULL
+
+static inline uint8_t *shared_cache_slot_data(SharedCache *c,
+                                              SharedCacheSlot *slot)
+{
+    return c->data + (size_t) (slot - c->slots) * c->cluster_size;
+}
+
+static SharedCacheSlot *shared_cache_find_set(SharedCache *c, uint64_t image,
+                                              uint64_t cluster)
+{
+    uint64_t hash = image ^ (cluster * 0x9e3779b97f4a7c15ULL);
+
+    hash ^= hash >> 29;
+    return &c->slots[(hash % c->nb_sets) * SHARED_CACHE_WAYS];
+}
+
+/*
+ * Copy @bytes at @offset of a cached cluster into @qiov.  With a NULL @qiov,
+ * only check whether the cluster is cached.
+ *
+ * Returns true on a hit.  On a miss @qiov may have been partially
+ * overwritten and must be filled from the image.
+ */
+static bool shared_cache_lookup(SharedCache *c, uint64_t image,
+                                uint64_t cluster, size_t offset, size_t bytes,
+                                QEMUIOVector *qiov, size_t qiov_offset)
+{
+    SharedCacheSlot *set = shared_cache_find_set(c, image, cluster);
+    int i;
+
+    for (i = 0; i < SHARED_CACHE_WAYS; i++) {
+        SharedCacheSlot *slot = &set[i];
+        uint32_t seq = atomic_read(&slot->seq);
+
+        smp_rmb();
+        if ((seq & 1) || atomic_read(&slot->image) != image ||
+            atomic_read(&slot->cluster) != cluster) {
+            continue;
+        }
+        if (qiov == NULL) {
+            return true;
+        }
+
+        qemu_iovec_from_buf(qiov, qiov_offset,
+                            shared_cache_slot_data(c, slot) + offset, bytes);
+        smp_rmb();
+        if (atomic_read(&slot->seq) != seq) {
+            /* Replaced while we were copying */
+            return false;
+        }
+
+        slot->last_used = atomic_fetch_add(&c->header->clock, 1);
+        return true;
+    }
+    return false;
+}
+
+static void shared_cache_insert(SharedCache *c, uint64_t image,
+                                uint64_t cluster, const uint8_t *buf)
+{
+    SharedCacheSlot *set = shared_cache_find_set(c, image, cluster);
+    SharedCacheSlot *victim = NULL;
+    uint32_t victim_seq = 0;
+    int i;
+
+    for (i = 0; i < SHARED_CACHE_WAYS; i++) {
+        SharedCacheSlot *slot = &set[i];
+        uint32_t seq = atomic_read(&slot->seq);
+
+        /* Skip slots that another process is writing */
+        if (seq & 1) {
+            continue;
+        }
+        if (slot->image == image && slot->cluster == cluster) {
+            return;
+        }
+        if (victim == NULL || slot->image == 0 ||
+            (victim->image != 0 &&
+             (int32_t) (slot->last_used - victim->last_used) < 0)) {
+            victim = slot;
+            victim_seq = seq;
+        }
+    }
+
+    if (victim == NULL ||
+        atomic_cmpxchg(&victim->seq, victim_seq, victim_seq + 1) != victim_seq) {
+        return;
+    }
+
+    victim->image = image;
+    victim->cluster = cluster;
+    memcpy(shared_cache_slot_data(c, victim), buf, c->cluster_size);
+    victim->last_used = atomic_fetch_add(&c->header->clock, 1);
+
+    /* Publish the new contents, this is a full barrier */
+    atomic_fetch_add(&victim->seq, 1);
+}
+
+/*
+ * Read @nb_clusters clusters starting at @cluster from the image, add them
+ * to the cache and copy the part that overlaps the request into @qiov.
+ */
+static int coroutine_fn shared_cache_fill(BlockDriverState *bs,
+                                          int64_t cluster, int nb_clusters,
+                                          int64_t sector_num, int nb_sectors,
+                                          QEMUIOVector *qiov)
+{
+    SharedCache *c = bs->shared_cache;
+    int64_t cluster_sectors = c->cluster_size >> BDRV_SECTOR_BITS;
+    int64_t fill_start = cluster * cluster_sectors;
+    int64_t fill_end = MIN(fill_start + nb_clusters * cluster_sectors,
+                           bs->total_sectors);
+    int64_t start = MAX(sector_num, fill_start);
+    int64_t end = MIN(sector_num + nb_sectors, fill_end);
+    size_t len = nb_clusters * c->cluster_size;
+    size_t bytes = (fill_end - fill_start) << BDRV_SECTOR_BITS;
+    QEMUIOVector local_qiov;
+    struct iovec iov;
+    uint8_t *buf;
+    int i, ret;
+
+    buf = qemu_blockalign(bs, len);
+    iov.iov_base = buf;
+    iov.iov_len = bytes;
+    qemu_iovec_init_external(&local_qiov, &iov, 1);
+
+    ret = bs->drv->bdrv_co_readv(bs, fill_start, fill_end - fill_start,
+                                 &local_qiov);
+    if (ret < 0) {
+        goto out;
+    }
+
+    /* The last cluster of the image may be short */
+    memset(buf + bytes, 0, len - bytes);
+
+    /* The image may have been reopened read-write meanwhile */
+    if (bs->read_only && bs->shared_cache_key) {
+        for (i = 0; i < nb_clusters; i++) {
+            shared_cache_insert(c, bs->shared_cache_key, cluster + i,
+                                buf + i * c->cluster_size);
+        }
+    }
+
+    qemu_iovec_from_buf(qiov, (start - sector_num) << BDRV_SECTOR_BITS,
+                        buf + ((start - fill_start) << BDRV_SECTOR_BITS),
+                        (end - start) << BDRV_SECTOR_BITS);
+out:
+    qemu_vfree(buf);
+    return ret;
+}
+
+int coroutine_fn shared_cache_co_readv(BlockDriverState *bs,
+                                       int64_t sector_num, int nb_sectors,
+                                       QEMUIOVector *qiov)
+{
+    SharedCache *c = bs->shared_cache;
+    uint64_t image = bs->shared_cache_key;
+    int64_t cluster_sectors = c->cluster_size >> BDRV_SECTOR_BITS;
+    int64_t end = sector_num + nb_sectors;
+    int64_t cluster = sector_num / cluster_sectors;
+    int64_t last = (end - 1) / cluster_sectors;
+    int run, ret;
+
+    while (cluster <= last) {
+        int64_t cluster_start = cluster * cluster_sectors;
+        int64_t start = MAX(sector_num, cluster_start);
+        int64_t n = MIN(end, cluster_start + cluster_sectors) - start;
+
+        if (shared_cache_lookup(c, image, cluster,
+                                (start - cluster_start) << BDRV_SECTOR_BITS,
+                                n << BDRV_SECTOR_BITS, qiov,
+                                (start - sector_num) << BDRV_SECTOR_BITS)) {
+            c->hits++;
+            cluster++;
+            continue;
+        }
+
+        /* Read adjacent misses with a single request */
+        for (run = 1; cluster + run <= last; run++) {
+            if (shared_cache_lookup(c, image, cluster + run, 0, 0, NULL, 0)) {
+                break;
+            }
+        }
+
+        c->misses += run;
+        ret = shared_cache_fill(bs, cluster, run, sector_num, nb_sectors,
+                                qiov);
+        if (ret < 0) {
+            return ret;
+        }
+        cluster += run;
+    }
+
+    return 0;
+}
+
+uint64_t shared_cache_image_key(BlockDriverState *bs)
+{
+#ifdef _WIN32
+    return 0;
+#else
+    BlockDriverState *file = bs->file;
+    struct stat st;
+    uint64_t hash = SHARED_CACHE_HASH_INIT;
+    uint64_t fields[6];
+
+    /* Only local files have an identity and a modification time */
+    if (!bs->drv || !file || !file->drv || !file->drv->protocol_name ||
+        strcmp(file->drv->protocol_name, "file") ||
+        stat(file->filename, &st) < 0 || !S_ISREG(st.st_mode)) {
+        return 0;
+    }
+
+    fields[0] = st.st_dev;
+    fields[1] = st.st_ino;
+    fields[2] = st.st_size;
+    fields[3] = st.st_mtime;
+    fields[4] = st.st_ctime;
+    fields[5] = bs->total_sectors;
+    hash = shared_cache_hash(hash, fields, sizeof(fields));
+    hash = shared_cache_hash(hash, bs->drv->format_name,
+                             strlen(bs->drv->format_name));
+
+    /* Data read from the image includes data from its backing files */
+    if (bs->backing_hd) {
+        uint64_t backing = bs->backing_hd->shared_cache_key;
+
+        if (backing == 0) {
+            return 0;
+        }
+        hash = shared_cache_hash(hash, &backing, sizeof(backing));
+    }
+
+    return hash ? hash : 1;
+#endif
+}
+
+#ifndef _WIN32
+static int shared_cache_format(SharedCache *c, int fd, int64_t size,
+                               Error **errp)
+{
+    SharedCacheHeader h;
+    uint64_t nb_slots;
+    int ret;
+
+    nb_slots = (size - SHARED_CACHE_SLOTS_OFFSET) /
+               (SHARED_CACHE_CLUSTER_SIZE + sizeof(SharedCacheSlot));
+    memset(&h, 0, sizeof(h));
+    h.magic = SHARED_CACHE_MAGIC;
+    h.version = SHARED_CACHE_VERSION;
+    h.cluster_size = SHARED_CACHE_CLUSTER_SIZE;
+    h.ways = SHARED_CACHE_WAYS;
+    h.nb_sets = nb_slots / SHARED_CACHE_WAYS;
+    if (size <= SHARED_CACHE_SLOTS_OFFSET || h.nb_sets == 0) {
+        error_setg(errp, "Shared cache size %" PRId64 " is too small", size);
+        return -EINVAL;
+    }
+    h.data_offset = QEMU_ALIGN_UP(SHARED_CACHE_SLOTS_OFFSET +
+                                  h.nb_sets * SHARED_CACHE_WAYS *
+                                  sizeof(SharedCacheSlot), getpagesize());
+
+    if (ftruncate(fd, h.data_offset +
+                  h.nb_sets * SHARED_CACHE_WAYS * SHARED_CACHE_CLUSTER_SIZE)) {
+        ret = -errno;
+        error_setg_errno(errp, -ret, "Could not resize shared cache '%s'",
+                         c->path);
+        return ret;
+    }
+
+    if (pwrite(fd, &h, sizeof(h), 0) != sizeof(h)) {
+        error_setg(errp, "Could not write shared cache '%s'", c->path);
+        return -EIO;
+    }
+
+    return 0;
+}
+
+static int shared_cache_map(SharedCache *c, int fd, int64_t size, Error **errp)
+{
+    SharedCacheHeader h;
+    struct stat st;
+    int ret;
+
+    /* Serialize formatting against other processes opening the cache */
+    if (flock(fd, LOCK_EX) < 0) {
+        ret = -errno;
+        error_setg_errno(errp, -ret, "Could not lock shared cache '%s'",
+                         c->path);
+        return ret;
+    }
+
+    if (fstat(fd, &st) < 0) {
+        ret = -errno;
+        error_setg_errno(errp, -ret, "Could not stat shared cache '%s'",
+                         c->path);
+        goto out;
+    }
+    if (st.st_size == 0) {
+        ret = shared_cache_format(c, fd, size, errp);
+        if (ret < 0) {
+            goto out;
+        }
+        if (fstat(fd, &st) < 0) {
+            ret = -errno;
+            error_setg_errno(errp, -ret, "Could not stat shared cache '%s'",
+                             c->path);
+            goto out;
+        }
+    }
+
+    /* Never format a file that has contents, it might not be ours */
+    if (pread(fd, &h, sizeof(h), 0) != sizeof(h) ||
+        h.magic != SHARED_CACHE_MAGIC) {
+        error_setg(errp, "'%s' is not a shared cache", c->path);
+        ret = -EINVAL;
+        goto out;
+    }
+    if (h.version != SHARED_CACHE_VERSION ||
+        h.cluster_size != SHARED_CACHE_CLUSTER_SIZE ||
+        h.ways != SHARED_CACHE_WAYS || h.nb_sets == 0) {
+        error_setg(errp, "Shared cache '%s' has an unsupported format",
+                   c->path);
+        ret = -EINVAL;
+        goto out;
+    }
+
+    c->nb_sets = h.nb_sets;
+    c->cluster_size = h.cluster_size;
+    c->map_size = h.data_offset + h.nb_sets * h.ways * h.cluster_size;
+    if (st.st_size < c->map_size) {
+        error_setg(errp, "Shared cache '%s' is truncated", c->path);
+        ret = -EINVAL;
+        goto out;
+    }
+
+    c->map = mmap(NULL, c->map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                  fd, 0);
+    if (c->map == MAP_FAILED) {
+        ret = -errno;
+        error_setg_errno(errp, -ret, "Could not map shared cache '%s'",
+                         c->path);
+        c->map = NULL;
+        goto out;
+    }
+
+    c->header = c->map;
+    c->slots = (SharedCacheSlot *) ((uint8_t *) c->map +
+                                    SHARED_CACHE_SLOTS_OFFSET);
+    c->data = (uint8_t *) c->map + h.data_offset;
+    ret = 0;
+
+out:
+    flock(fd, LOCK_UN);
+    return ret;
+}
+#endif
+
+SharedCache *shared_cache_open(const char *path, int64_t size, Error **errp)
+{
+#ifdef _WIN32
+    error_setg(errp, "Shared caches are not supported on this host");
+    return NULL;
+#else
+    SharedCache *c;
+    int fd, ret;
+
+    QLIST_FOREACH(c, &shared_caches, next) {
+        if (!strcmp(c->path, path)) {
+            return shared_cache_ref(c);
+        }
+    }
+
+    c = g_malloc0(sizeof(*c));
+    c->path = g_strdup(path);
+    c->refcount = 1;
+
+    fd = qemu_open(path, O_RDWR | O_CREAT, 0600);
+    if (fd < 0) {
+        error_setg_errno(errp, errno, "Could not open shared cache '%s'",
+                         path);
+        goto fail;
+    }
+
+    ret = shared_cache_map(c, fd, size, errp);
+    qemu_close(fd);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    QLIST_INSERT_HEAD(&shared_caches, c, next);
+    return c;
+
+fail:
+    g_free(c->path);
+    g_free(c);
+    return NULL;
+#endif
+}
+
+SharedCache *shared_cache_ref(SharedCache *c)
+{
+    c->refcount++;
+    return c;
+}
+
+void shared_cache_unref(SharedCache *c)
+{
+    if (--c->refcount > 0) {
+        return;
+    }
+
+    trace_shared_cache_stats(c, c->hits, c->misses);
+
+    QLIST_REMOVE(c, next);
+#ifndef _WIN32
+    munmap(c->map, c->map_size);
+#endif
+    g_free(c->path);
+    g_free(c);
+}
@@ -16,6 +16,7 @@
 #include "qemu/error-report.h"
 #include "qemu/sockets.h"
 #include "block/block_int.h"
+#include "block/coroutine.h"
 #include "qemu/bitops.h"
 
 #define SD_PROTO_VER 0x01
@@ -90,6 +91,8 @@
 #define SD_INODE_SIZE (sizeof(SheepdogInode))
 #define CURRENT_VDI_ID 0
 
+#define SD_MAX_CONNS 8
+
 typedef struct SheepdogReq {
     uint8_t proto_ver;
     uint8_t opcode;
@@ -248,9 +251,23 @@ static inline bool is_snapshot(struct SheepdogInode *inode)
 #endif
 
 typedef struct SheepdogAIOCB SheepdogAIOCB;
+typedef struct BDRVSheepdogState BDRVSheepdogState;
+
+/* A connection to a gateway, with its own stream of pipelined requests */
+typedef struct SheepdogConn {
+    BDRVSheepdogState *s;
+    const char *addr;
+    int fd;
+    unsigned int nr_inflight;
+
+    CoMutex lock;
+    Coroutine *co_send;
+    Coroutine *co_recv;
+} SheepdogConn;
 
 typedef struct AIOReq {
     SheepdogAIOCB *aiocb;
+    SheepdogConn *conn;
     unsigned int iov_offset;
 
     uint64_t oid;
@@ -287,7 +304,7 @@ struct SheepdogAIOCB {
     int nr_pending;
 };
 
-typedef struct BDRVSheepdogState {
+struct BDRVSheepdogState {
     SheepdogInode inode;
 
     uint32_t min_dirty_data_idx;
@@ -299,16 +316,25 @@ typedef struct BDRVSheepdogState {
 
     char *addr;
     char *port;
-    int fd;
 
-    CoMutex lock;
-    Coroutine *co_send;
-    Coroutine *co_recv;
+    /*
+     * One connection per gateway.  Requests to a data object always use
+     * the same connection, chosen by object index, so that they go through
+     * the object cache of the same gateway.
+     */
+    SheepdogConn conns[SD_MAX_CONNS];
+    int nr_conns;
+
+    /* writes completed so far, and how many of them a flush has covered */
+    uint64_t write_gen;
+    uint64_t flushed_gen;
+    bool flush_in_flight;
+    CoQueue flush_queue;
 
     uint32_t aioreq_seq_num;
     QLIST_HEAD(inflight_aio_head, AIOReq) inflight_aio_head;
     QLIST_HEAD(pending_aio_head, AIOReq) pending_aio_head;
-} BDRVSheepdogState;
+};
 
 static const char * sd_strerror(int err)
 {
@@ -367,8 +393,20 @@ static const char * sd_strerror(int err)
  *    the write request to the vdi object in sd_write_done, the write
  *    completion function.  We switch back to sd_co_readv/writev after
  *    all the requests belonging to the AIOCB are finished.
+ *
+ * Each connection pipelines any number of requests.  Data object index
+ * idx is always sent on connection idx % nr_conns, and all other objects
+ * on the first connection.
  */
 
+static SheepdogConn *sd_conn_for_oid(BDRVSheepdogState *s, uint64_t oid)
+{
+    if (is_data_obj(oid)) {
+        return &s->conns[data_oid_to_idx(oid) % s->nr_conns];
+    }
+    return &s->conns[0];
+}
+
 static inline AIOReq *alloc_aio_req(BDRVSheepdogState *s, SheepdogAIOCB *acb,
                                     uint64_t oid, unsigned int data_len,
                                     uint64_t offset, uint8_t flags,
@@ -378,6 +416,7 @@ static inline AIOReq *alloc_aio_req(BDRVSheepdogState *s, SheepdogAIOCB *acb,
 
     aio_req = g_malloc(sizeof(*aio_req));
     aio_req->aiocb = acb;
+    aio_req->conn = sd_conn_for_oid(s, oid);
     aio_req->iov_offset = iov_offset;
     aio_req->oid = oid;
     aio_req->base_oid = base_oid;
@@ -661,19 +700,20 @@ static void coroutine_fn send_pending_req(BDRVSheepdogState *s, uint64_t oid)
  * Receive responses of the I/O requests.
  *
  * This function is registered as a fd handler, and called from the
- * main loop when s->fd is ready for reading responses.
+ * main loop when conn->fd is ready for reading responses.
  */
 static void coroutine_fn aio_read_response(void *opaque)
 {
     SheepdogObjRsp rsp;
-    BDRVSheepdogState *s = opaque;
-    int fd = s->fd;
+    SheepdogConn *conn = opaque;
+    BDRVSheepdogState *s = conn->s;
+    int fd = conn->fd;
     int ret;
     AIOReq *aio_req = NULL;
     SheepdogAIOCB *acb;
     unsigned long idx;
 
-    if (QLIST_EMPTY(&s->inflight_aio_head)) {
+    if (!conn->nr_inflight) {
         goto out;
     }
 
@@ -690,7 +730,7 @@ static void coroutine_fn aio_read_response(void *opaque)
             break;
         }
     }
-    if (!aio_req) {
+    if (!aio_req || aio_req->conn != conn) {
         error_report("cannot find aio_req %x", rsp.id);
         goto out;
     }
@@ -701,7 +741,7 @@ static void coroutine_fn aio_read_response(void *opaque)
     case AIOCB_WRITE_UDATA:
         /* this coroutine context is no longer suitable for co_recv
          * because we may send data to update vdi objects */
-        s->co_recv = NULL;
+        conn->co_recv = NULL;
         if (!is_data_obj(aio_req->oid)) {
             break;
         }
@@ -749,6 +789,7 @@ static void coroutine_fn aio_read_response(void *opaque)
         error_report("%s", sd_strerror(rsp.result));
     }
 
+    conn->nr_inflight--;
     free_aio_req(s, aio_req);
     if (!acb->nr_pending) {
         /*
@@ -758,33 +799,33 @@ static void coroutine_fn aio_read_response(void *opaque)
         acb->aio_done_func(acb);
     }
 out:
-    s->co_recv = NULL;
+    conn->co_recv = NULL;
 }
 
 static void co_read_response(void *opaque)
 {
-    BDRVSheepdogState *s = opaque;
+    SheepdogConn *conn = opaque;
 
-    if (!s->co_recv) {
-        s->co_recv = qemu_coroutine_create(aio_read_response);
+    if (!conn->co_recv) {
+        conn->co_recv = qemu_coroutine_create(aio_read_response);
     }
 
-    qemu_coroutine_enter(s->co_recv, opaque);
+    qemu_coroutine_enter(conn->co_recv, opaque);
 }
 
 static void co_write_request(void *opaque)
 {
-    BDRVSheepdogState *s = opaque;
+    SheepdogConn *conn = opaque;
 
-    qemu_coroutine_enter(s->co_send, NULL);
+    qemu_coroutine_enter(conn->co_send, NULL);
 }
 
+/* Requests on the pending list wait for a request in flight somewhere */
 static int aio_flush_request(void *opaque)
 {
-    BDRVSheepdogState *s = opaque;
+    SheepdogConn *conn = opaque;
 
-    return !QLIST_EMPTY(&s->inflight_aio_head) ||
-        !QLIST_EMPTY(&s->pending_aio_head);
+    return conn->nr_inflight > 0;
 }
 
 static int set_nodelay(int fd)
@@ -802,11 +843,11 @@ static int set_nodelay(int fd)
  * We cannot use this discriptor for other operations because
  * the block driver may be on waiting response from the server.
  */
-static int get_sheep_fd(BDRVSheepdogState *s)
+static int get_sheep_fd(SheepdogConn *conn)
 {
     int ret, fd;
 
-    fd = connect_to_sdog(s->addr, s->port);
+    fd = connect_to_sdog(conn->addr, conn->s->port);
     if (fd < 0) {
         error_report("%s", strerror(errno));
         return fd;
@@ -821,7 +862,8 @@ static int get_sheep_fd(BDRVSheepdogState *s)
         return -errno;
     }
 
-    qemu_aio_set_fd_handler(fd, co_read_response, NULL, aio_flush_request, s);
+    qemu_aio_set_fd_handler(fd, co_read_response, NULL, aio_flush_request,
+                            conn);
     return fd;
 }
 
@@ -840,7 +882,9 @@ static int get_sheep_fd(BDRVSheepdogState *s)
  * `tag'.
  *
  * You can run VMs outside the Sheepdog cluster by specifying
- * `hostname' and `port' (experimental).
+ * `hostname' and `port' (experimental).  `hostname' may be a list of up
+ * to SD_MAX_CONNS gateways separated by '/', e.g. `gw1/gw2:7000:vdi';
+ * I/O requests are spread over one connection to each of them.
  */
 static int parse_vdiname(BDRVSheepdogState *s, const char *filename,
                          char *vdi, uint32_t *snapid, char *tag)
@@ -874,6 +918,31 @@ static int parse_vdiname(BDRVSheepdogState *s, const char *filename,
         s->port = 0;
     }
 
+    /* split the gateway list; s->addr is left pointing to the first one */
+    s->nr_conns = 0;
+    if (s->addr) {
+        char *gw = s->addr, *next;
+
+        do {
+            next = strchr(gw, '/');
+            if (next) {
+                *next++ = '\0';
+            }
+            if (s->nr_conns == SD_MAX_CONNS) {
+                error_report("too many gateways, at most %d are supported",
+                             SD_MAX_CONNS);
+                s->addr = NULL;
+                s->nr_conns = 0;
+                g_free(q);
+                return -EINVAL;
+            }
+            s->conns[s->nr_conns++].addr = gw;
+            gw = next;
+        } while (gw);
+    } else {
+        s->conns[s->nr_conns++].addr = NULL;
+    }
+
     pstrcpy(vdi, SD_MAX_VDI_LEN, p);
 
     p = strchr(vdi, ':');
@@ -894,6 +963,43 @@ static int parse_vdiname(BDRVSheepdogState *s, const char *filename,
     return 0;
 }
 
+static void sd_close_conns(BDRVSheepdogState *s)
+{
+    int i;
+
+    for (i = 0; i < s->nr_conns; i++) {
+        SheepdogConn *conn = &s->conns[i];
+
+        if (conn->fd >= 0) {
+            qemu_aio_set_fd_handler(conn->fd, NULL, NULL, NULL, NULL);
+            closesocket(conn->fd);
+            conn->fd = -1;
+        }
+    }
+}
+
+static int sd_open_conns(BDRVSheepdogState *s)
+{
+    int i;
+
+    for (i = 0; i < s->nr_conns; i++) {
+        SheepdogConn *conn = &s->conns[i];
+
+        conn->s = s;
+        conn->nr_inflight = 0;
+        conn->co_send = NULL;
+        conn->co_recv = NULL;
+        qemu_co_mutex_init(&conn->lock);
+        conn->fd = get_sheep_fd(conn);
+        if (conn->fd < 0) {
+            int ret = conn->fd;
+            sd_close_conns(s);
+            return ret;
+        }
+    }
+    return 0;
+}
+
 static int find_vdi_name(BDRVSheepdogState *s, char *filename, uint32_t snapid,
                          char *tag, uint32_t *vid, int for_snapshot)
 {
@@ -955,6 +1061,7 @@ static int coroutine_fn add_aio_request(BDRVSheepdogState *s, AIOReq *aio_req,
                            enum AIOCBState aiocb_type)
 {
     int nr_copies = s->inode.nr_copies;
+    SheepdogConn *conn = aio_req->conn;
     SheepdogObjReq hdr;
     unsigned int wlen = 0;
     int ret;
@@ -1002,35 +1109,41 @@ static int coroutine_fn add_aio_request(BDRVSheepdogState *s, AIOReq *aio_req,
 
     hdr.id = aio_req->id;
 
-    qemu_co_mutex_lock(&s->lock);
-    s->co_send = qemu_coroutine_self();
-    qemu_aio_set_fd_handler(s->fd, co_read_response, co_write_request,
-                            aio_flush_request, s);
-    socket_set_cork(s->fd, 1);
+    qemu_co_mutex_lock(&conn->lock);
+    conn->co_send = qemu_coroutine_self();
+    qemu_aio_set_fd_handler(conn->fd, co_read_response, co_write_request,
+                            aio_flush_request, conn);
+    socket_set_cork(conn->fd, 1);
+    conn->nr_inflight++;
 
     /* send a header */
-    ret = qemu_co_send(s->fd, &hdr, sizeof(hdr));
+    ret = qemu_co_send(conn->fd, &hdr, sizeof(hdr));
     if (ret < 0) {
-        qemu_co_mutex_unlock(&s->lock);
+        ret = -errno;
         error_report("failed to send a req, %s", strerror(errno));
-        return -errno;
+        goto fail;
     }
 
     if (wlen) {
-        ret = qemu_co_sendv(s->fd, iov, niov, aio_req->iov_offset, wlen);
+        ret = qemu_co_sendv(conn->fd, iov, niov, aio_req->iov_offset, wlen);
         if (ret < 0) {
-            qemu_co_mutex_unlock(&s->lock);
+            ret = -errno;
             error_report("failed to send a data, %s", strerror(errno));
-            return -errno;
+            goto fail;
         }
     }
 
-    socket_set_cork(s->fd, 0);
-    qemu_aio_set_fd_handler(s->fd, co_read_response, NULL,
-                            aio_flush_request, s);
-    qemu_co_mutex_unlock(&s->lock);
+    socket_set_cork(conn->fd, 0);
+    qemu_aio_set_fd_handler(conn->fd, co_read_response, NULL,
+                            aio_flush_request, conn);
+    qemu_co_mutex_unlock(&conn->lock);
 
     return 0;
+
+fail:
+    conn->nr_inflight--;
+    qemu_co_mutex_unlock(&conn->lock);
+    return ret;
 }
 
 static int read_write_object(int fd, char *buf, uint64_t oid, int copies,
@@ -1099,7 +1212,7 @@ static int write_object(int fd, char *buf, uint64_t oid, int copies,
 
 static int sd_open(BlockDriverState *bs, const char *filename, int flags)
 {
-    int ret, fd;
+    int i, ret, fd;
     uint32_t vid = 0;
     BDRVSheepdogState *s = bs->opaque;
     char vdi[SD_MAX_VDI_LEN], tag[SD_MAX_VDI_TAG_LEN];
@@ -1110,7 +1223,12 @@ static int sd_open(BlockDriverState *bs, const char *filename, int flags)
 
     QLIST_INIT(&s->inflight_aio_head);
     QLIST_INIT(&s->pending_aio_head);
-    s->fd = -1;
+    for (i = 0; i < SD_MAX_CONNS; i++) {
+        s->conns[i].fd = -1;
+    }
+    qemu_co_queue_init(&s->flush_queue);
+    s->write_gen = s->flushed_gen = 0;
+    s->flush_in_flight = false;
 
     memset(vdi, 0, sizeof(vdi));
     memset(tag, 0, sizeof(tag));
@@ -1118,9 +1236,8 @@ static int sd_open(BlockDriverState *bs, const char *filename, int flags)
         ret = -EINVAL;
         goto out;
     }
-    s->fd = get_sheep_fd(s);
-    if (s->fd < 0) {
-        ret = s->fd;
+    ret = sd_open_conns(s);
+    if (ret < 0) {
         goto out;
     }
 
@@ -1166,14 +1283,10 @@ static int sd_open(BlockDriverState *bs, const char *filename, int flags)
 
     bs->total_sectors = s->inode.vdi_size / SECTOR_SIZE;
     pstrcpy(s->name, sizeof(s->name), vdi);
-    qemu_co_mutex_init(&s->lock);
     g_free(buf);
     return 0;
 out:
-    qemu_aio_set_fd_handler(s->fd, NULL, NULL, NULL, NULL);
-    if (s->fd >= 0) {
-        closesocket(s->fd);
-    }
+    sd_close_conns(s);
     g_free(buf);
     return ret;
 }
@@ -1398,8 +1511,7 @@ static void sd_close(BlockDriverState *bs)
         error_report("%s, %s", sd_strerror(rsp->result), s->name);
     }
 
-    qemu_aio_set_fd_handler(s->fd, NULL, NULL, NULL, NULL);
-    closesocket(s->fd);
+    sd_close_conns(s);
     g_free(s->addr);
 }
 
@@ -1661,6 +1773,7 @@ out:
 static coroutine_fn int sd_co_writev(BlockDriverState *bs, int64_t sector_num,
                         int nb_sectors, QEMUIOVector *qiov)
 {
+    BDRVSheepdogState *s = bs->opaque;
     SheepdogAIOCB *acb;
     int ret;
 
@@ -1679,12 +1792,17 @@ static coroutine_fn int sd_co_writev(BlockDriverState *bs, int64_t sector_num,
     ret = sd_co_rw_vector(acb);
     if (ret <= 0) {
         qemu_aio_release(acb);
-        return ret;
+        goto out;
     }
 
     qemu_coroutine_yield();
+    ret = acb->ret;
 
-    return acb->ret;
+out:
+    if (ret == 0) {
+        s->write_gen++;
+    }
+    return ret;
 }
 
 static coroutine_fn int sd_co_readv(BlockDriverState *bs, int64_t sector_num,
@@ -1708,34 +1826,73 @@ static coroutine_fn int sd_co_readv(BlockDriverState *bs, int64_t sector_num,
     return acb->ret;
 }
 
+/*
+ * Flush the object cache of every gateway.  Each SD_OP_FLUSH_VDI covers all
+ * writes that completed before it was sent, so a flush that finds another one
+ * in flight waits for it and only sends its own if writes completed in the
+ * meantime.
+ */
 static int coroutine_fn sd_co_flush_to_disk(BlockDriverState *bs)
 {
     BDRVSheepdogState *s = bs->opaque;
     SheepdogAIOCB *acb;
     AIOReq *aio_req;
-    int ret;
+    uint64_t target;
+    int i, ret;
 
     if (s->cache_flags != SD_FLAG_CMD_CACHE) {
         return 0;
     }
 
+    while (s->flush_in_flight) {
+        qemu_co_queue_wait(&s->flush_queue);
+    }
+    if (s->flushed_gen == s->write_gen) {
+        return 0;
+    }
+
+    s->flush_in_flight = true;
+    target = s->write_gen;
+
     acb = sd_aio_setup(bs, NULL, 0, 0);
     acb->aiocb_type = AIOCB_FLUSH_CACHE;
     acb->aio_done_func = sd_finish_aiocb;
 
-    aio_req = alloc_aio_req(s, acb, vid_to_vdi_oid(s->inode.vdi_id),
-                            0, 0, 0, 0, 0);
-    QLIST_INSERT_HEAD(&s->inflight_aio_head, aio_req, aio_siblings);
-    ret = add_aio_request(s, aio_req, NULL, 0, false, acb->aiocb_type);
-    if (ret < 0) {
-        error_report("add_aio_request is failed");
-        free_aio_req(s, aio_req);
+    /* hold a reference so that the AIOCB survives until all are sent */
+    acb->nr_pending++;
+    ret = 0;
+    for (i = 0; i < s->nr_conns; i++) {
+        aio_req = alloc_aio_req(s, acb, vid_to_vdi_oid(s->inode.vdi_id),
+                                0, 0, 0, 0, 0);
+        aio_req->conn = &s->conns[i];
+        QLIST_INSERT_HEAD(&s->inflight_aio_head, aio_req, aio_siblings);
+        ret = add_aio_request(s, aio_req, NULL, 0, false, acb->aiocb_type);
+        if (ret < 0) {
+            error_report("add_aio_request is failed");
+            free_aio_req(s, aio_req);
+            break;
+        }
+    }
+
+    if (--acb->nr_pending) {
+        /* sd_finish_aiocb releases the AIOCB once we return */
+        qemu_coroutine_yield();
+        if (ret == 0) {
+            ret = acb->ret;
+        }
+    } else {
+        if (ret == 0) {
+            ret = acb->ret;
+        }
         qemu_aio_release(acb);
-        return ret;
     }
 
-    qemu_coroutine_yield();
-    return acb->ret;
+    if (ret == 0) {
+        s->flushed_gen = target;
+    }
+    s->flush_in_flight = false;
+    qemu_co_queue_restart_all(&s->flush_queue);
+    return ret;
 }
 
 static int sd_snapshot_create(BlockDriverState *bs, QEMUSnapshotInfo *sn_info)
@@ -2067,6 +2224,7 @@ BlockDriver bdrv_sheepdog = {
     .format_name    = "sheepdog",
     .protocol_name  = "sheepdog",
     .instance_size  = sizeof(BDRVSheepdogState),
+    .bdrv_main_context_only = true,
     .bdrv_file_open = sd_open,
     .bdrv_close     = sd_close,
     .bdrv_create    = sd_create,
@@ -14,7 +14,6 @@
 #include "trace.h"
 #include "block/block_int.h"
 #include "block/blockjob.h"
-#include "qemu/ratelimit.h"
 
 enum {
     /*
@@ -25,16 +24,36 @@ enum {
     STREAM_BUFFER_SIZE = 512 * 1024, /* in bytes */
 };
 
-#define SLICE_TIME 100000000ULL /* ns */
+#define STREAM_CHUNK_SECTORS (STREAM_BUFFER_SIZE / BDRV_SECTOR_SIZE)
+
+/* Sectors covered by a single allocation query */
+#define STREAM_QUERY_SECTORS (1 << 21)
+
+#define STREAM_DEFAULT_IN_FLIGHT 4
+#define STREAM_MAX_IN_FLIGHT     64
 
 typedef struct StreamBlockJob {
     BlockJob common;
-    RateLimit limit;
     BlockDriverState *base;
     BlockdevOnError on_error;
     char backing_file_id[1024];
+
+    int max_in_flight;
+    int in_flight;
+    /* Only completions may resume the job while this is set */
+    bool waiting_for_io;
+    void **buf_free;
+    int buf_free_count;
+    int error;
+    bool report_error;
 } StreamBlockJob;
 
+typedef struct StreamOp {
+    StreamBlockJob *s;
+    int64_t sector_num;
+    int nb_sectors;
+} StreamOp;
+
 static int coroutine_fn stream_populate(BlockDriverState *bs,
                                         int64_t sector_num, int nb_sectors,
                                         void *buf)
@@ -51,6 +70,86 @@ static int coroutine_fn stream_populate(BlockDriverState *bs,
     return bdrv_co_copy_on_readv(bs, sector_num, nb_sectors, &qiov);
 }
 
+static void coroutine_fn stream_wait_for_io(StreamBlockJob *s)
+{
+    assert(!s->waiting_for_io);
+    s->waiting_for_io = true;
+    qemu_coroutine_yield();
+    s->waiting_for_io = false;
+}
+
+static void coroutine_fn stream_co_copy(void *opaque)
+{
+    StreamOp *op = opaque;
+    StreamBlockJob *s = op->s;
+    BlockDriverState *bs = s->common.bs;
+    void *buf;
+    int ret;
+
+    assert(s->buf_free_count > 0);
+    buf = s->buf_free[--s->buf_free_count];
+
+    for (;;) {
+        BlockErrorAction action;
+
+        ret = stream_populate(bs, op->sector_num, op->nb_sectors, buf);
+        trace_stream_copy_done(s, op->sector_num, op->nb_sectors, ret);
+        if (ret >= 0) {
+            break;
+        }
+
+        action = block_job_error_action(&s->common, bs, s->on_error,
+                                        true, -ret);
+        if (action == BDRV_ACTION_STOP) {
+            /* The job is paused now; retry once it is resumed */
+            while (block_job_is_paused(&s->common) &&
+                   !block_job_is_cancelled(&s->common)) {
+                co_sleep_ns(rt_clock, BLOCK_JOB_SLICE_TIME);
+            }
+            if (!block_job_is_cancelled(&s->common)) {
+                continue;
+            }
+            ret = 0;
+            break;
+        }
+        if (s->error == 0) {
+            s->error = ret;
+        }
+        if (action == BDRV_ACTION_REPORT) {
+            s->report_error = true;
+        }
+        break;
+    }
+
+    /* Publish progress */
+    if (!s->report_error) {
+        s->common.offset += op->nb_sectors * BDRV_SECTOR_SIZE;
+    }
+
+    s->buf_free[s->buf_free_count++] = buf;
+    g_slice_free(StreamOp, op);
+    s->in_flight--;
+    if (s->waiting_for_io) {
+        qemu_coroutine_enter(s->common.co, NULL);
+    }
+}
+
+static void stream_start_copy(StreamBlockJob *s, int64_t sector_num,
+                              int nb_sectors)
+{
+    StreamOp *op;
+    Coroutine *co;
+
+    op = g_slice_new(StreamOp);
+    op->s = s;
+    op->sector_num = sector_num;
+    op->nb_sectors = nb_sectors;
+
+    s->in_flight++;
+    co = qemu_coroutine_create(stream_co_copy);
+    qemu_coroutine_enter(co, op);
+}
+
 static void close_unused_images(BlockDriverState *top, BlockDriverState *base,
                                 const char *base_id)
 {
@@ -79,10 +178,12 @@ static void coroutine_fn stream_run(void *opaque)
     BlockDriverState *bs = s->common.bs;
     BlockDriverState *base = s->base;
     int64_t sector_num, end;
-    int error = 0;
+    int64_t run_end = 0;
+    bool copy = false;
+    int64_t status;
     int ret = 0;
     int n = 0;
-    void *buf;
+    int i;
 
     s->common.len = bdrv_getlength(bs);
     if (s->common.len < 0) {
@@ -91,7 +192,11 @@ static void coroutine_fn stream_run(void *opaque)
     }
 
     end = s->common.len >> BDRV_SECTOR_BITS;
-    buf = qemu_blockalign(bs, STREAM_BUFFER_SIZE);
+    s->buf_free = g_new(void *, s->max_in_flight);
+    for (i = 0; i < s->max_in_flight; i++) {
+        s->buf_free[i] = qemu_blockalign(bs, STREAM_BUFFER_SIZE);
+    }
+    s->buf_free_count = s->max_in_flight;
 
     /* Turn on copy-on-read for the whole block device so that guest read
      * requests help us make progress.  Only do this when copying the entire
@@ -104,64 +209,89 @@ static void coroutine_fn stream_run(void *opaque)
 
     for (sector_num = 0; sector_num < end; sector_num += n) {
         uint64_t delay_ns = 0;
-        bool copy;
 
 wait:
         /* Note that even when no rate limit is applied we need to yield
          * with no pending I/O here so that bdrv_drain_all() returns.
          */
         block_job_sleep_ns(&s->common, rt_clock, delay_ns);
-        if (block_job_is_cancelled(&s->common)) {
+        if (block_job_is_cancelled(&s->common) || s->report_error) {
             break;
         }
 
-        ret = bdrv_co_is_allocated(bs, sector_num,
-                                   STREAM_BUFFER_SIZE / BDRV_SECTOR_SIZE, &n);
-        if (ret == 1) {
-            /* Allocated in the top, no need to copy.  */
-            copy = false;
-        } else {
-            /* Copy if allocated in the intermediate images.  Limit to the
-             * known-unallocated area [sector_num, sector_num+n).  */
-            ret = bdrv_co_is_allocated_above(bs->backing_hd, base,
-                                             sector_num, n, &n);
-
-            /* Finish early if end of backing file has been reached */
-            if (ret == 0 && n == 0) {
-                n = end - sector_num;
-            }
+        if (sector_num >= run_end) {
+            /* Query a large range at once, it is copied in chunks below */
+            ret = bdrv_co_is_allocated(bs, sector_num,
+                                       MIN(end - sector_num,
+                                           STREAM_QUERY_SECTORS), &n);
+            if (ret == 1) {
+                /* Allocated in the top, no need to copy.  */
+                copy = false;
+            } else if (ret == 0) {
+                /* Copy if allocated in the intermediate images.  Limit to
+                 * the known-unallocated area [sector_num, sector_num+n).  */
+                status = bdrv_co_get_block_status_above(bs->backing_hd, base,
+                                                        sector_num, n, &n);
+                ret = status < 0 ? status : !!status;
+
+                /* Finish early if end of backing file has been reached */
+                if (ret == 0 && n == 0) {
+                    n = end - sector_num;
+                }
 
-            copy = (ret == 1);
-        }
-        trace_stream_one_iteration(s, sector_num, n, ret);
-        if (ret >= 0 && copy) {
-            if (s->common.speed) {
-                delay_ns = ratelimit_calculate_delay(&s->limit, n);
-                if (delay_ns > 0) {
-                    goto wait;
+                /* Zeroes need not be copied if the image will read them from
+                 * its own unallocated clusters once the chain is dropped.  */
+                copy = (ret == 1);
+                if (copy && !base && (status & BDRV_BLOCK_ZERO) &&
+                    bdrv_has_zero_init(bs)) {
+                    copy = false;
                 }
             }
-            ret = stream_populate(bs, sector_num, n, buf);
-        }
-        if (ret < 0) {
-            BlockErrorAction action =
-                block_job_error_action(&s->common, s->common.bs, s->on_error,
-                                       true, -ret);
-            if (action == BDRV_ACTION_STOP) {
-                n = 0;
-                continue;
-            }
-            if (error == 0) {
-                error = ret;
-            }
-            if (action == BDRV_ACTION_REPORT) {
-                break;
+            trace_stream_one_iteration(s, sector_num, n, ret);
+            if (ret < 0) {
+                BlockErrorAction action =
+                    block_job_error_action(&s->common, s->common.bs,
+                                           s->on_error, true, -ret);
+                if (action == BDRV_ACTION_STOP) {
+                    n = 0;
+                    continue;
+                }
+                if (s->error == 0) {
+                    s->error = ret;
+                }
+                if (action == BDRV_ACTION_REPORT) {
+                    break;
+                }
+                /* Let copy-on-read sort out what needs copying */
+                n = MIN(end - sector_num, STREAM_CHUNK_SECTORS);
+                copy = true;
             }
+            run_end = sector_num + n;
+        }
+
+        if (!copy) {
+            n = run_end - sector_num;
+
+            /* Publish progress */
+            s->common.offset += n * BDRV_SECTOR_SIZE;
+            continue;
+        }
+
+        n = MIN(run_end - sector_num, STREAM_CHUNK_SECTORS);
+        if (s->in_flight >= s->max_in_flight) {
+            stream_wait_for_io(s);
+            delay_ns = 0;
+            goto wait;
         }
-        ret = 0;
+        delay_ns = block_job_throttle(&s->common, n);
+        if (delay_ns > 0) {
+            goto wait;
+        }
+        stream_start_copy(s, sector_num, n);
+    }
 
-        /* Publish progress */
-        s->common.offset += n * BDRV_SECTOR_SIZE;
+    while (s->in_flight > 0) {
+        stream_wait_for_io(s);
     }
 
     if (!base) {
@@ -169,7 +299,7 @@ wait:
     }
 
     /* Do not remove the backing file if an error was there but ignored.  */
-    ret = error;
+    ret = s->error;
 
     if (!block_job_is_cancelled(&s->common) && sector_num == end && ret == 0) {
         const char *base_id = NULL, *base_fmt = NULL;
@@ -183,29 +313,20 @@ wait:
         close_unused_images(bs, base, base_id);
     }
 
-    qemu_vfree(buf);
-    block_job_completed(&s->common, ret);
-}
-
-static void stream_set_speed(BlockJob *job, int64_t speed, Error **errp)
-{
-    StreamBlockJob *s = container_of(job, StreamBlockJob, common);
-
-    if (speed < 0) {
-        error_set(errp, QERR_INVALID_PARAMETER, "speed");
-        return;
+    for (i = 0; i < s->max_in_flight; i++) {
+        qemu_vfree(s->buf_free[i]);
     }
-    ratelimit_set_speed(&s->limit, speed / BDRV_SECTOR_SIZE, SLICE_TIME);
+    g_free(s->buf_free);
+    block_job_completed(&s->common, ret);
 }
 
 static BlockJobType stream_job_type = {
     .instance_size = sizeof(StreamBlockJob),
     .job_type      = "stream",
-    .set_speed     = stream_set_speed,
 };
 
 void stream_start(BlockDriverState *bs, BlockDriverState *base,
-                  const char *base_id, int64_t speed,
+                  const char *base_id, int64_t speed, int max_in_flight,
                   BlockdevOnError on_error,
                   BlockDriverCompletionFunc *cb,
                   void *opaque, Error **errp)
@@ -219,6 +340,11 @@ void stream_start(BlockDriverState *bs, BlockDriverState *base,
         return;
     }
 
+    if (max_in_flight < 0 || max_in_flight > STREAM_MAX_IN_FLIGHT) {
+        error_set(errp, QERR_INVALID_PARAMETER, "max-in-flight");
+        return;
+    }
+
     s = block_job_create(&stream_job_type, bs, speed, cb, opaque, errp);
     if (!s) {
         return;
@@ -230,6 +356,7 @@ void stream_start(BlockDriverState *bs, BlockDriverState *base,
     }
 
     s->on_error = on_error;
+    s->max_in_flight = max_in_flight ?: STREAM_DEFAULT_IN_FLIGHT;
     s->common.co = qemu_coroutine_create(stream_run);
     trace_stream_start(bs, base, s, s->common.co, opaque);
     qemu_coroutine_enter(s->common.co, s);
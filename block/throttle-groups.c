@@ -0,0 +1,268 @@
+/*
+ * Throttle groups: drives that share one set of I/O limits
+ *
+ * All members of a group account their requests against the same
+ * ThrottleState.  When the group runs out of budget, only one timer per
+ * direction is armed for the whole group; when it fires, or when a request
+ * is admitted, the next member that has requests waiting gets its turn, so
+ * a busy drive cannot starve the other drives of the group.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "block/throttle-groups.h"
+
+/* Throttled requests of the whole host may as well wake up together */
+#define THROTTLE_TIMER_SLACK SCALE_MS
+
+struct ThrottleGroup {
+    char *name;
+    ThrottleState ts;
+    QLIST_HEAD(, BlockDriverState) head;
+    /* the member whose turn it is, per direction */
+    BlockDriverState *tokens[2];
+    /* whether one of the members has its timer armed, per direction */
+    bool any_timer_armed[2];
+    unsigned int refcount;
+    QTAILQ_ENTRY(ThrottleGroup) list;
+};
+
+static QTAILQ_HEAD(, ThrottleGroup) throttle_groups =
+    QTAILQ_HEAD_INITIALIZER(throttle_groups);
+
+static ThrottleGroup *throttle_group_incref(const char *name)
+{
+    ThrottleGroup *tg;
+
+    QTAILQ_FOREACH(tg, &throttle_groups, list) {
+        if (!strcmp(name, tg->name)) {
+            tg->refcount++;
+            return tg;
+        }
+    }
+
+    tg = g_malloc0(sizeof(*tg));
+    tg->name = g_strdup(name);
+    throttle_init(&tg->ts, qemu_get_clock_ns(vm_clock));
+    QLIST_INIT(&tg->head);
+    tg->refcount = 1;
+    QTAILQ_INSERT_TAIL(&throttle_groups, tg, list);
+
+    return tg;
+}
+
+static void throttle_group_unref(ThrottleGroup *tg)
+{
+    if (--tg->refcount == 0) {
+        QTAILQ_REMOVE(&throttle_groups, tg, list);
+        g_free(tg->name);
+        g_free(tg);
+    }
+}
+
+static BlockDriverState *throttle_group_next_bs(BlockDriverState *bs)
+{
+    BlockDriverState *next = QLIST_NEXT(bs, round_robin);
+
+    return next ? next : QLIST_FIRST(&bs->throttle_group->head);
+}
+
+/* Return the member that gets the next turn: the first one after the
+ * current token that has requests waiting, or @bs if nobody is waiting */
+static BlockDriverState *next_throttle_token(BlockDriverState *bs,
+                                             bool is_write)
+{
+    ThrottleGroup *tg = bs->throttle_group;
+    BlockDriverState *start, *token;
+
+    start = token = tg->tokens[is_write];
+    do {
+        token = throttle_group_next_bs(token);
+    } while (token != start && !token->pending_reqs[is_write]);
+
+    if (token == start && !token->pending_reqs[is_write]) {
+        token = bs;
+    }
+
+    return token;
+}
+
+/* Arm the timer of @bs if the group is over its limits.  Returns true if
+ * a request in that direction has to wait. */
+static bool throttle_group_schedule_timer(BlockDriverState *bs,
+                                          bool is_write)
+{
+    ThrottleGroup *tg = bs->throttle_group;
+    int64_t now = qemu_get_clock_ns(vm_clock);
+    int64_t wait;
+
+    if (tg->any_timer_armed[is_write]) {
+        return true;
+    }
+
+    wait = throttle_compute_wait_for(&tg->ts, is_write, now);
+    if (!wait) {
+        return false;
+    }
+
+    qemu_mod_timer(bs->throttle_timers[is_write], now + wait);
+    tg->any_timer_armed[is_write] = true;
+    return true;
+}
+
+/* Hand the turn to the next member with a request waiting, and wake that
+ * request up if the group has budget for it */
+static void schedule_next_request(BlockDriverState *bs, bool is_write)
+{
+    ThrottleGroup *tg = bs->throttle_group;
+    BlockDriverState *token;
+
+    token = next_throttle_token(bs, is_write);
+    if (!token->pending_reqs[is_write]) {
+        return;
+    }
+
+    if (!throttle_group_schedule_timer(token, is_write)) {
+        qemu_co_queue_next(&token->throttled_reqs[is_write]);
+    }
+    tg->tokens[is_write] = token;
+}
+
+static void throttle_group_timer_cb(BlockDriverState *bs, bool is_write)
+{
+    ThrottleGroup *tg = bs->throttle_group;
+
+    tg->any_timer_armed[is_write] = false;
+
+    /* the queue may have been restarted by bdrv_drain_all() meanwhile */
+    if (!qemu_co_queue_next(&bs->throttled_reqs[is_write])) {
+        schedule_next_request(bs, is_write);
+    }
+}
+
+static void throttle_group_read_timer_cb(void *opaque)
+{
+    throttle_group_timer_cb(opaque, false);
+}
+
+static void throttle_group_write_timer_cb(void *opaque)
+{
+    throttle_group_timer_cb(opaque, true);
+}
+
+void throttle_group_register_bs(BlockDriverState *bs, const char *groupname)
+{
+    ThrottleGroup *tg = throttle_group_incref(groupname);
+    int i;
+
+    bs->throttle_group = tg;
+    QLIST_INSERT_HEAD(&tg->head, bs, round_robin);
+
+    for (i = 0; i < 2; i++) {
+        if (!tg->tokens[i]) {
+            tg->tokens[i] = bs;
+        }
+        qemu_co_queue_init(&bs->throttled_reqs[i]);
+    }
+
+    bs->throttle_timers[0] = qemu_new_timer_ns(vm_clock,
+                                               throttle_group_read_timer_cb,
+                                               bs);
+    bs->throttle_timers[1] = qemu_new_timer_ns(vm_clock,
+                                               throttle_group_write_timer_cb,
+                                               bs);
+    qemu_timer_set_slack(bs->throttle_timers[0], THROTTLE_TIMER_SLACK);
+    qemu_timer_set_slack(bs->throttle_timers[1], THROTTLE_TIMER_SLACK);
+}
+
+void throttle_group_unregister_bs(BlockDriverState *bs)
+{
+    ThrottleGroup *tg = bs->throttle_group;
+    bool was_armed[2];
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        if (tg->tokens[i] == bs) {
+            BlockDriverState *token = throttle_group_next_bs(bs);
+            tg->tokens[i] = token == bs ? NULL : token;
+        }
+
+        was_armed[i] = qemu_timer_pending(bs->throttle_timers[i]);
+        if (was_armed[i]) {
+            tg->any_timer_armed[i] = false;
+        }
+        qemu_del_timer(bs->throttle_timers[i]);
+        qemu_free_timer(bs->throttle_timers[i]);
+        bs->throttle_timers[i] = NULL;
+
+        qemu_co_queue_restart_all(&bs->throttled_reqs[i]);
+    }
+
+    QLIST_REMOVE(bs, round_robin);
+    bs->throttle_group = NULL;
+
+    /* the other members may have been waiting for our timer */
+    for (i = 0; i < 2; i++) {
+        if (was_armed[i] && tg->tokens[i]) {
+            schedule_next_request(tg->tokens[i], i);
+        }
+    }
+
+    throttle_group_unref(tg);
+}
+
+const char *throttle_group_get_name(BlockDriverState *bs)
+{
+    return bs->throttle_group->name;
+}
+
+void throttle_group_config(BlockDriverState *bs, ThrottleConfig *cfg)
+{
+    ThrottleGroup *tg = bs->throttle_group;
+    int64_t now = qemu_get_clock_ns(vm_clock);
+    BlockDriverState *member;
+    int i;
+
+    throttle_config(&tg->ts, cfg, now);
+
+    /* apply the new limits to the requests that are already waiting */
+    QLIST_FOREACH(member, &tg->head, round_robin) {
+        for (i = 0; i < 2; i++) {
+            if (qemu_timer_pending(member->throttle_timers[i])) {
+                qemu_mod_timer(member->throttle_timers[i], now);
+            }
+        }
+    }
+}
+
+void throttle_group_get_config(BlockDriverState *bs, ThrottleConfig *cfg)
+{
+    throttle_get_config(&bs->throttle_group->ts, cfg);
+}
+
+void coroutine_fn throttle_group_co_io_limits_intercept(BlockDriverState *bs,
+                                                        unsigned int bytes,
+                                                        bool is_write)
+{
+    ThrottleGroup *tg = bs->throttle_group;
+    bool must_wait;
+
+    /* Keep the requests of each drive in FIFO order: if some are already
+     * waiting, queue behind them even if there is budget left. */
+    must_wait = throttle_group_schedule_timer(bs, is_write);
+    if (must_wait || bs->pending_reqs[is_write]) {
+        bs->pending_reqs[is_write]++;
+        qemu_co_queue_wait(&bs->throttled_reqs[is_write]);
+        bs->pending_reqs[is_write]--;
+
+        /* throttling may have been turned off while we were waiting */
+        tg = bs->throttle_group;
+        if (!tg) {
+            return;
+        }
+    }
+
+    throttle_account(&tg->ts, is_write, bytes);
+    schedule_next_request(bs, is_write);
+}
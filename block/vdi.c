@@ -284,7 +284,7 @@ static int vdi_check(BlockDriverState *bs, BdrvCheckResult *res,
     uint32_t *bmap;
     logout("\n");
 
-    if (fix) {
+    if (fix & BDRV_FIX_MASK) {
         return -ENOTSUP;
     }
 
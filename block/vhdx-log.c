@@ -0,0 +1,316 @@
+/*
+ * Block driver for Hyper-V VHDX images: log replay
+ *
+ * Metadata updates are written to a circular log before they are applied
+ * in place.  If the image was not closed cleanly, the header still names a
+ * log GUID and the active sequence of log entries must be replayed before
+ * any metadata is read.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu-common.h"
+#include "block/block_int.h"
+#include "block/vhdx.h"
+
+typedef struct VHDXLogEntryInfo {
+    uint32_t offset;            /* within the log */
+    uint32_t length;
+    uint64_t sequence_number;
+} VHDXLogEntryInfo;
+
+static void vhdx_log_entry_hdr_le_import(VHDXLogEntryHeader *hdr)
+{
+    hdr->signature = le32_to_cpu(hdr->signature);
+    hdr->checksum = le32_to_cpu(hdr->checksum);
+    hdr->entry_length = le32_to_cpu(hdr->entry_length);
+    hdr->tail = le32_to_cpu(hdr->tail);
+    hdr->sequence_number = le64_to_cpu(hdr->sequence_number);
+    hdr->descriptor_count = le32_to_cpu(hdr->descriptor_count);
+    leguid_to_cpus(&hdr->log_guid);
+    hdr->flushed_file_offset = le64_to_cpu(hdr->flushed_file_offset);
+    hdr->last_file_offset = le64_to_cpu(hdr->last_file_offset);
+}
+
+static void vhdx_log_desc_le_import(VHDXLogDescriptor *desc)
+{
+    desc->signature = le32_to_cpu(desc->signature);
+    desc->trailing_bytes = le32_to_cpu(desc->trailing_bytes);
+    desc->leading_bytes = le64_to_cpu(desc->leading_bytes);
+    desc->file_offset = le64_to_cpu(desc->file_offset);
+    desc->sequence_number = le64_to_cpu(desc->sequence_number);
+}
+
+static uint32_t vhdx_log_desc_sectors(uint32_t descriptor_count)
+{
+    return DIV_ROUND_UP(VHDX_LOG_HDR_SIZE +
+                        descriptor_count * VHDX_LOG_DESC_SIZE,
+                        VHDX_LOG_SECTOR_SIZE);
+}
+
+/*
+ * Check the log entry at @offset of the log, which is held twice in a row in
+ * @log so that entries that wrap around its end are contiguous.
+ */
+static bool vhdx_log_entry_is_valid(BDRVVHDXState *s, uint8_t *log,
+                                    uint32_t log_length, uint32_t offset,
+                                    VHDXLogEntryHeader *hdr)
+{
+    uint32_t data_sectors = 0, i;
+
+    memcpy(hdr, log + offset, sizeof(*hdr));
+    vhdx_log_entry_hdr_le_import(hdr);
+
+    if (hdr->signature != VHDX_LOG_SIGNATURE ||
+        hdr->entry_length == 0 ||
+        hdr->entry_length % VHDX_LOG_SECTOR_SIZE ||
+        hdr->entry_length > log_length ||
+        hdr->tail % VHDX_LOG_SECTOR_SIZE ||
+        hdr->tail >= log_length ||
+        memcmp(&hdr->log_guid, &s->headers[s->curr_header].log_guid,
+               sizeof(MSGUID))) {
+        return false;
+    }
+
+    if ((uint64_t)vhdx_log_desc_sectors(hdr->descriptor_count) *
+        VHDX_LOG_SECTOR_SIZE > hdr->entry_length) {
+        return false;
+    }
+    for (i = 0; i < hdr->descriptor_count; i++) {
+        VHDXLogDescriptor desc;
+
+        memcpy(&desc, log + offset + VHDX_LOG_HDR_SIZE +
+               i * VHDX_LOG_DESC_SIZE, sizeof(desc));
+        if (le32_to_cpu(desc.signature) == VHDX_LOG_DESC_SIGNATURE) {
+            data_sectors++;
+        }
+    }
+    if ((uint64_t)(vhdx_log_desc_sectors(hdr->descriptor_count) +
+                   data_sectors) * VHDX_LOG_SECTOR_SIZE !=
+        hdr->entry_length) {
+        return false;
+    }
+
+    return vhdx_checksum_is_valid(log + offset, hdr->entry_length,
+                                  offsetof(VHDXLogEntryHeader, checksum));
+}
+
+/*
+ * Find the active sequence: the valid entry with the highest sequence number
+ * whose tail starts a chain of valid entries with consecutive sequence
+ * numbers that ends in the entry itself.  Returns the number of entries in
+ * the sequence, stored in @seq, or 0 if there is none.  @tmp has room for
+ * as many entries as @seq and holds the candidates.
+ */
+static int vhdx_log_search(BDRVVHDXState *s, uint8_t *log,
+                           uint32_t log_length, VHDXLogEntryInfo *seq,
+                           VHDXLogEntryInfo *tmp)
+{
+    uint32_t max_entries = log_length / VHDX_LOG_SECTOR_SIZE;
+    VHDXLogEntryHeader hdr, head;
+    uint32_t offset, pos;
+    uint64_t best_seq = 0;
+    int best = 0, n;
+
+    for (offset = 0; offset < log_length; offset += VHDX_LOG_SECTOR_SIZE) {
+        if (!vhdx_log_entry_is_valid(s, log, log_length, offset, &head)) {
+            continue;
+        }
+        if (best && head.sequence_number <= best_seq) {
+            continue;
+        }
+
+        /* walk from the tail of this entry up to the entry itself */
+        pos = head.tail;
+        n = 0;
+        while (n < max_entries &&
+               vhdx_log_entry_is_valid(s, log, log_length, pos, &hdr)) {
+            if (n && hdr.sequence_number != tmp[n - 1].sequence_number + 1) {
+                break;
+            }
+            tmp[n].offset = pos;
+            tmp[n].length = hdr.entry_length;
+            tmp[n].sequence_number = hdr.sequence_number;
+            n++;
+            if (pos == offset) {
+                break;
+            }
+            pos = (pos + hdr.entry_length) % log_length;
+        }
+        if (n && tmp[n - 1].offset == offset &&
+            tmp[n - 1].sequence_number == head.sequence_number) {
+            memcpy(seq, tmp, n * sizeof(*seq));
+            best = n;
+            best_seq = head.sequence_number;
+        }
+    }
+
+    return best;
+}
+
+/* Apply the descriptors of one log entry to the image file */
+static int vhdx_log_replay_entry(BlockDriverState *bs, uint8_t *entry,
+                                 uint64_t sequence_number, uint8_t *buf)
+{
+    VHDXLogEntryHeader hdr;
+    VHDXLogDescriptor desc;
+    VHDXLogDataSector *sector;
+    uint8_t *desc_raw;
+    uint32_t i, data_idx = 0, data_start;
+    uint64_t seq, off;
+    int ret;
+
+    memcpy(&hdr, entry, sizeof(hdr));
+    vhdx_log_entry_hdr_le_import(&hdr);
+    data_start = vhdx_log_desc_sectors(hdr.descriptor_count);
+
+    for (i = 0; i < hdr.descriptor_count; i++) {
+        desc_raw = entry + VHDX_LOG_HDR_SIZE + i * VHDX_LOG_DESC_SIZE;
+        memcpy(&desc, desc_raw, sizeof(desc));
+        vhdx_log_desc_le_import(&desc);
+
+        if (desc.sequence_number != sequence_number ||
+            desc.file_offset % VHDX_LOG_SECTOR_SIZE) {
+            return -EINVAL;
+        }
+
+        if (desc.signature == VHDX_LOG_DESC_SIGNATURE) {
+            sector = (VHDXLogDataSector *)(entry + (data_start + data_idx++) *
+                                           VHDX_LOG_SECTOR_SIZE);
+            seq = ((uint64_t)le32_to_cpu(sector->sequence_high) << 32) |
+                  le32_to_cpu(sector->sequence_low);
+            if (le32_to_cpu(sector->data_signature) !=
+                VHDX_LOG_DATA_SIGNATURE || seq != sequence_number) {
+                return -EINVAL;
+            }
+
+            /* the descriptor holds the first 8 and the last 4 bytes */
+            memcpy(buf, desc_raw + offsetof(VHDXLogDescriptor, leading_bytes),
+                   8);
+            memcpy(buf + 8, sector->data, sizeof(sector->data));
+            memcpy(buf + 8 + sizeof(sector->data),
+                   desc_raw + offsetof(VHDXLogDescriptor, trailing_bytes), 4);
+            ret = bdrv_pwrite(bs->file, desc.file_offset, buf,
+                              VHDX_LOG_SECTOR_SIZE);
+            if (ret < 0) {
+                return ret;
+            }
+        } else if (desc.signature == VHDX_LOG_ZERO_SIGNATURE) {
+            if (desc.zero_length % VHDX_LOG_SECTOR_SIZE) {
+                return -EINVAL;
+            }
+            memset(buf, 0, VHDX_LOG_SECTOR_SIZE);
+            for (off = 0; off < desc.zero_length;
+                 off += VHDX_LOG_SECTOR_SIZE) {
+                ret = bdrv_pwrite(bs->file, desc.file_offset + off, buf,
+                                  VHDX_LOG_SECTOR_SIZE);
+                if (ret < 0) {
+                    return ret;
+                }
+            }
+        } else {
+            return -EINVAL;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Replay the log if the current header names one.  This writes to the image
+ * file, so an image with a log that must be replayed cannot be opened
+ * read-only.  On success the log is marked empty in both headers.
+ */
+int vhdx_parse_log(BlockDriverState *bs, BDRVVHDXState *s, bool *replayed)
+{
+    VHDXHeader *hdr = &s->headers[s->curr_header];
+    VHDXLogEntryInfo *seq = NULL, *tmp = NULL;
+    VHDXLogEntryHeader head;
+    uint8_t *log = NULL, *buf = NULL;
+    int64_t file_length;
+    int i, n, ret;
+
+    *replayed = false;
+
+    if (vhdx_guid_is_zero(&hdr->log_guid)) {
+        return 0;
+    }
+
+    if (hdr->log_version != 0 || hdr->log_length == 0 ||
+        hdr->log_offset % MiB || hdr->log_length % MiB) {
+        error_report("vhdx: invalid log in image header");
+        return -EINVAL;
+    }
+
+    if (!(bs->open_flags & BDRV_O_RDWR)) {
+        error_report("vhdx: image '%s' has a log that must be replayed; "
+                     "open it read-write once, e.g. with "
+                     "'qemu-img check -r all'", bs->filename);
+        return -EPERM;
+    }
+
+    file_length = bdrv_getlength(bs->file);
+    if (file_length < 0) {
+        return file_length;
+    }
+    if (hdr->log_offset + hdr->log_length > file_length) {
+        return -EINVAL;
+    }
+
+    /* read the log twice in a row, so that no entry wraps around */
+    log = qemu_blockalign(bs, 2 * (size_t)hdr->log_length);
+    ret = bdrv_pread(bs->file, hdr->log_offset, log, hdr->log_length);
+    if (ret < 0) {
+        goto out;
+    }
+    memcpy(log + hdr->log_length, log, hdr->log_length);
+
+    seq = g_new(VHDXLogEntryInfo, hdr->log_length / VHDX_LOG_SECTOR_SIZE);
+    tmp = g_new(VHDXLogEntryInfo, hdr->log_length / VHDX_LOG_SECTOR_SIZE);
+    n = vhdx_log_search(s, log, hdr->log_length, seq, tmp);
+    if (n == 0) {
+        /* nothing was committed to the log */
+        ret = 0;
+        goto clear;
+    }
+
+    memcpy(&head, log + seq[n - 1].offset, sizeof(head));
+    vhdx_log_entry_hdr_le_import(&head);
+    if (file_length < head.flushed_file_offset) {
+        error_report("vhdx: image file is shorter than the log requires");
+        ret = -EINVAL;
+        goto out;
+    }
+
+    buf = qemu_blockalign(bs, VHDX_LOG_SECTOR_SIZE);
+    for (i = 0; i < n; i++) {
+        ret = vhdx_log_replay_entry(bs, log + seq[i].offset,
+                                    seq[i].sequence_number, buf);
+        if (ret < 0) {
+            error_report("vhdx: log replay failed: %s", strerror(-ret));
+            goto out;
+        }
+    }
+
+    if (head.last_file_offset > file_length) {
+        ret = bdrv_truncate(bs->file, head.last_file_offset);
+        if (ret < 0) {
+            goto out;
+        }
+    }
+    ret = bdrv_flush(bs->file);
+    if (ret < 0) {
+        goto out;
+    }
+    *replayed = true;
+
+clear:
+    ret = vhdx_update_headers(bs, s, NULL);
+
+out:
+    qemu_vfree(buf);
+    qemu_vfree(log);
+    g_free(seq);
+    g_free(tmp);
+    return ret;
+}
@@ -0,0 +1,719 @@
+/*
+ * Block driver for Hyper-V VHDX images
+ *
+ * Images are read-only for now: dynamic and fixed images can be read, and a
+ * log left behind by an interrupted update is replayed when the image is
+ * opened read-write.  Differencing images are not supported.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu-common.h"
+#include "block/block_int.h"
+#include "qemu/module.h"
+#include "qemu/crc32c.h"
+#include "qemu/host-utils.h"
+#include "migration/migration.h"
+#include "block/vhdx.h"
+#if defined(CONFIG_UUID)
+#include <uuid/uuid.h>
+#endif
+
+/* Region table entries */
+static const MSGUID bat_guid = { .data1 = 0x2dc27766, .data2 = 0xf623,
+                                 .data3 = 0x4200, .data4 = { 0x9d, 0x64, 0x11,
+                                 0x5e, 0x9b, 0xfd, 0x4a, 0x08 } };
+static const MSGUID metadata_guid = { .data1 = 0x8b7ca206, .data2 = 0x4790,
+                                      .data3 = 0x4b9a, .data4 = { 0xb8, 0xfe,
+                                      0x57, 0x5f, 0x05, 0x0f, 0x88, 0x6e } };
+
+/* Metadata items */
+static const MSGUID file_param_guid = { .data1 = 0xcaa16737, .data2 = 0xfa36,
+                                        .data3 = 0x4d43, .data4 = { 0xb3, 0xb6,
+                                        0x33, 0xf0, 0xaa, 0x44, 0xe7, 0x6b } };
+static const MSGUID virtual_size_guid = { .data1 = 0x2fa54224, .data2 = 0xcd1b,
+                                          .data3 = 0x4876, .data4 = { 0xb2,
+                                          0x11, 0x5d, 0xbe, 0xd8, 0x3b, 0xf4,
+                                          0xb8 } };
+static const MSGUID page83_guid = { .data1 = 0xbeca12ab, .data2 = 0xb2e6,
+                                    .data3 = 0x4523, .data4 = { 0x93, 0xef,
+                                    0xc3, 0x09, 0xe0, 0x00, 0xc7, 0x46 } };
+static const MSGUID logical_sector_guid = { .data1 = 0x8141bf1d,
+                                            .data2 = 0xa96f, .data3 = 0x4709,
+                                            .data4 = { 0xba, 0x47, 0xf2, 0x33,
+                                            0xa8, 0xfa, 0xab, 0x5f } };
+static const MSGUID physical_sector_guid = { .data1 = 0xcda348c7,
+                                             .data2 = 0x445d, .data3 = 0x4471,
+                                             .data4 = { 0x9c, 0xc9, 0xe9, 0x88,
+                                             0x52, 0x51, 0xc5, 0x56 } };
+static const MSGUID parent_locator_guid = { .data1 = 0xa8d35f2d,
+                                            .data2 = 0xb30b, .data3 = 0x454d,
+                                            .data4 = { 0xab, 0xf7, 0xd3, 0xd8,
+                                            0x48, 0x34, 0xab, 0x0c } };
+
+#define VHDX_MAX_DISK_SIZE  (64ULL * 1024 * 1024 * 1024 * 1024)
+
+/*
+ * Check the CRC32C of @buf.  The checksum is stored little-endian at
+ * @crc_offset and is computed with that field zeroed.
+ */
+bool vhdx_checksum_is_valid(uint8_t *buf, size_t size, int crc_offset)
+{
+    uint32_t crc_orig, crc;
+
+    memcpy(&crc_orig, buf + crc_offset, sizeof(crc_orig));
+    memset(buf + crc_offset, 0, sizeof(crc_orig));
+    crc = ~crc32c(0xffffffff, buf, size);
+    memcpy(buf + crc_offset, &crc_orig, sizeof(crc_orig));
+
+    return crc == le32_to_cpu(crc_orig);
+}
+
+/* Store the CRC32C of @buf at @crc_offset */
+static void vhdx_update_checksum(uint8_t *buf, size_t size, int crc_offset)
+{
+    uint32_t crc;
+
+    memset(buf + crc_offset, 0, sizeof(crc));
+    crc = cpu_to_le32(~crc32c(0xffffffff, buf, size));
+    memcpy(buf + crc_offset, &crc, sizeof(crc));
+}
+
+void vhdx_guid_generate(MSGUID *guid)
+{
+#if defined(CONFIG_UUID)
+    uuid_t uuid;
+
+    uuid_generate(uuid);
+    memcpy(guid, uuid, sizeof(*guid));
+#else
+    uint32_t *p = (uint32_t *)guid;
+    int i;
+
+    for (i = 0; i < sizeof(*guid) / sizeof(*p); i++) {
+        p[i] = g_random_int();
+    }
+#endif
+}
+
+bool vhdx_guid_is_zero(const MSGUID *guid)
+{
+    static const MSGUID zero;
+
+    return !memcmp(guid, &zero, sizeof(zero));
+}
+
+static bool guid_eq(const MSGUID *a, const MSGUID *b)
+{
+    return !memcmp(a, b, sizeof(MSGUID));
+}
+
+static int vhdx_probe(const uint8_t *buf, int buf_size, const char *filename)
+{
+    if (buf_size >= 8 && !memcmp(buf, VHDX_FILE_SIGNATURE, 8)) {
+        return 100;
+    }
+    return 0;
+}
+
+static void vhdx_header_le_import(VHDXHeader *h)
+{
+    h->signature = le32_to_cpu(h->signature);
+    h->checksum = le32_to_cpu(h->checksum);
+    h->sequence_number = le64_to_cpu(h->sequence_number);
+    leguid_to_cpus(&h->file_write_guid);
+    leguid_to_cpus(&h->data_write_guid);
+    leguid_to_cpus(&h->log_guid);
+    h->log_version = le16_to_cpu(h->log_version);
+    h->version = le16_to_cpu(h->version);
+    h->log_length = le32_to_cpu(h->log_length);
+    h->log_offset = le64_to_cpu(h->log_offset);
+}
+
+static void vhdx_header_le_export(VHDXHeader *h)
+{
+    h->signature = cpu_to_le32(h->signature);
+    h->checksum = cpu_to_le32(h->checksum);
+    h->sequence_number = cpu_to_le64(h->sequence_number);
+    cpu_to_leguids(&h->file_write_guid);
+    cpu_to_leguids(&h->data_write_guid);
+    cpu_to_leguids(&h->log_guid);
+    h->log_version = cpu_to_le16(h->log_version);
+    h->version = cpu_to_le16(h->version);
+    h->log_length = cpu_to_le32(h->log_length);
+    h->log_offset = cpu_to_le64(h->log_offset);
+}
+
+/*
+ * Write the inactive header from a copy of the current one, with a higher
+ * sequence number and the given log GUID (NULL for an empty log), and make
+ * it the current header.
+ */
+static int vhdx_update_header(BlockDriverState *bs, BDRVVHDXState *s,
+                              MSGUID *log_guid)
+{
+    int hdr_idx = !s->curr_header;
+    VHDXHeader *active = &s->headers[s->curr_header];
+    VHDXHeader *inactive = &s->headers[hdr_idx];
+    VHDXHeader *buf;
+    int ret;
+
+    *inactive = *active;
+    inactive->sequence_number = active->sequence_number + 1;
+    vhdx_guid_generate(&inactive->file_write_guid);
+    if (log_guid) {
+        inactive->log_guid = *log_guid;
+    } else {
+        memset(&inactive->log_guid, 0, sizeof(inactive->log_guid));
+    }
+
+    buf = qemu_blockalign(bs, sizeof(*buf));
+    *buf = *inactive;
+    vhdx_header_le_export(buf);
+    vhdx_update_checksum((uint8_t *)buf, VHDX_HEADER_SIZE,
+                         offsetof(VHDXHeader, checksum));
+    ret = bdrv_pwrite_sync(bs->file,
+                           hdr_idx ? VHDX_HEADER2_OFFSET : VHDX_HEADER1_OFFSET,
+                           buf, sizeof(*buf));
+    qemu_vfree(buf);
+    if (ret < 0) {
+        return ret;
+    }
+
+    s->curr_header = hdr_idx;
+    return 0;
+}
+
+/* Update both headers, so that an old copy can never become current again */
+int vhdx_update_headers(BlockDriverState *bs, BDRVVHDXState *s,
+                        MSGUID *log_guid)
+{
+    int ret;
+
+    ret = vhdx_update_header(bs, s, log_guid);
+    if (ret < 0) {
+        return ret;
+    }
+    return vhdx_update_header(bs, s, log_guid);
+}
+
+/* Use the valid header with the higher sequence number */
+static int vhdx_parse_header(BlockDriverState *bs, BDRVVHDXState *s)
+{
+    static const uint64_t offsets[2] = {
+        VHDX_HEADER1_OFFSET, VHDX_HEADER2_OFFSET,
+    };
+    bool valid[2];
+    uint8_t *buf;
+    int i, ret;
+
+    buf = qemu_blockalign(bs, VHDX_HEADER_SIZE);
+
+    ret = bdrv_pread(bs->file, VHDX_FILE_ID_OFFSET, buf, 8);
+    if (ret < 0) {
+        goto out;
+    }
+    if (memcmp(buf, VHDX_FILE_SIGNATURE, 8)) {
+        ret = -EINVAL;
+        goto out;
+    }
+
+    for (i = 0; i < 2; i++) {
+        VHDXHeader *h = &s->headers[i];
+
+        ret = bdrv_pread(bs->file, offsets[i], buf, VHDX_HEADER_SIZE);
+        if (ret < 0) {
+            goto out;
+        }
+        valid[i] = vhdx_checksum_is_valid(buf, VHDX_HEADER_SIZE,
+                                          offsetof(VHDXHeader, checksum));
+        memcpy(h, buf, sizeof(*h));
+        vhdx_header_le_import(h);
+        valid[i] = valid[i] && h->signature == VHDX_HEADER_SIGNATURE &&
+                   h->version == 1;
+    }
+
+    if (valid[0] && valid[1]) {
+        s->curr_header =
+            s->headers[1].sequence_number > s->headers[0].sequence_number;
+    } else if (valid[0] || valid[1]) {
+        s->curr_header = valid[1];
+    } else {
+        error_report("vhdx: no valid image header found");
+        ret = -EINVAL;
+        goto out;
+    }
+    ret = 0;
+
+out:
+    qemu_vfree(buf);
+    return ret;
+}
+
+static int vhdx_read_region_table(BlockDriverState *bs, BDRVVHDXState *s,
+                                  uint64_t offset, uint8_t *buf)
+{
+    VHDXRegionTableHeader hdr;
+    VHDXRegionTableEntry entry;
+    bool bat_found = false, metadata_found = false;
+    int i, ret;
+
+    ret = bdrv_pread(bs->file, offset, buf, VHDX_REGION_TABLE_SIZE);
+    if (ret < 0) {
+        return ret;
+    }
+    memcpy(&hdr, buf, sizeof(hdr));
+    hdr.signature = le32_to_cpu(hdr.signature);
+    hdr.entry_count = le32_to_cpu(hdr.entry_count);
+    if (hdr.signature != VHDX_REGION_SIGNATURE ||
+        hdr.entry_count > VHDX_REGION_MAX_ENTRIES ||
+        !vhdx_checksum_is_valid(buf, VHDX_REGION_TABLE_SIZE,
+                                offsetof(VHDXRegionTableHeader, checksum))) {
+        return -EINVAL;
+    }
+
+    for (i = 0; i < hdr.entry_count; i++) {
+        memcpy(&entry, buf + sizeof(hdr) + i * sizeof(entry), sizeof(entry));
+        leguid_to_cpus(&entry.guid);
+        entry.file_offset = le64_to_cpu(entry.file_offset);
+        entry.length = le32_to_cpu(entry.length);
+        entry.data_bits = le32_to_cpu(entry.data_bits);
+
+        if (guid_eq(&entry.guid, &bat_guid) && !bat_found) {
+            s->bat_offset = entry.file_offset;
+            s->bat_length = entry.length;
+            bat_found = true;
+        } else if (guid_eq(&entry.guid, &metadata_guid) && !metadata_found) {
+            s->metadata_offset = entry.file_offset;
+            s->metadata_length = entry.length;
+            metadata_found = true;
+        } else if (entry.data_bits & VHDX_REGION_ENTRY_REQUIRED) {
+            /* a region we do not know, but must understand */
+            return -ENOTSUP;
+        }
+    }
+
+    if (!bat_found || !metadata_found) {
+        return -EINVAL;
+    }
+    return 0;
+}
+
+/* The second copy of the region table is only used if the first is bad */
+static int vhdx_parse_region_table(BlockDriverState *bs, BDRVVHDXState *s)
+{
+    uint8_t *buf;
+    int ret;
+
+    buf = qemu_blockalign(bs, VHDX_REGION_TABLE_SIZE);
+    ret = vhdx_read_region_table(bs, s, VHDX_REGION_TABLE_OFFSET, buf);
+    if (ret == -EINVAL) {
+        ret = vhdx_read_region_table(bs, s, VHDX_REGION_TABLE2_OFFSET, buf);
+    }
+    qemu_vfree(buf);
+
+    if (ret == -ENOTSUP) {
+        error_report("vhdx: image has an unsupported required region");
+    } else if (ret < 0) {
+        error_report("vhdx: no valid region table found");
+    }
+    return ret;
+}
+
+static int vhdx_read_metadata_item(BlockDriverState *bs, BDRVVHDXState *s,
+                                   VHDXMetadataTableEntry *entry,
+                                   void *buf, uint32_t size)
+{
+    int ret;
+
+    if (entry->length != size ||
+        (uint64_t)entry->offset + size > s->metadata_length) {
+        return -EINVAL;
+    }
+    ret = bdrv_pread(bs->file, s->metadata_offset + entry->offset, buf, size);
+    return ret < 0 ? ret : 0;
+}
+
+static int vhdx_parse_metadata(BlockDriverState *bs, BDRVVHDXState *s)
+{
+    VHDXMetadataTableHeader hdr;
+    VHDXMetadataTableEntry entry;
+    VHDXFileParameters params;
+    bool have_params = false, have_size = false;
+    bool have_logical = false, have_physical = false;
+    uint8_t *buf;
+    int i, ret;
+
+    buf = qemu_blockalign(bs, VHDX_METADATA_TABLE_SIZE);
+    ret = bdrv_pread(bs->file, s->metadata_offset, buf,
+                     VHDX_METADATA_TABLE_SIZE);
+    if (ret < 0) {
+        goto out;
+    }
+    memcpy(&hdr, buf, sizeof(hdr));
+    hdr.signature = le64_to_cpu(hdr.signature);
+    hdr.entry_count = le16_to_cpu(hdr.entry_count);
+    if (hdr.signature != VHDX_METADATA_SIGNATURE ||
+        hdr.entry_count > VHDX_METADATA_MAX_ENTRIES ||
+        s->metadata_length < VHDX_METADATA_TABLE_SIZE) {
+        ret = -EINVAL;
+        goto out;
+    }
+
+    for (i = 0; i < hdr.entry_count; i++) {
+        memcpy(&entry, buf + sizeof(hdr) + i * sizeof(entry), sizeof(entry));
+        leguid_to_cpus(&entry.item_id);
+        entry.offset = le32_to_cpu(entry.offset);
+        entry.length = le32_to_cpu(entry.length);
+        entry.data_bits = le32_to_cpu(entry.data_bits);
+
+        if (guid_eq(&entry.item_id, &file_param_guid)) {
+            ret = vhdx_read_metadata_item(bs, s, &entry, &params,
+                                          sizeof(params));
+            params.block_size = le32_to_cpu(params.block_size);
+            params.data_bits = le32_to_cpu(params.data_bits);
+            have_params = true;
+        } else if (guid_eq(&entry.item_id, &virtual_size_guid)) {
+            ret = vhdx_read_metadata_item(bs, s, &entry,
+                                          &s->virtual_disk_size,
+                                          sizeof(s->virtual_disk_size));
+            le64_to_cpus(&s->virtual_disk_size);
+            have_size = true;
+        } else if (guid_eq(&entry.item_id, &logical_sector_guid)) {
+            ret = vhdx_read_metadata_item(bs, s, &entry,
+                                          &s->logical_sector_size,
+                                          sizeof(s->logical_sector_size));
+            le32_to_cpus(&s->logical_sector_size);
+            have_logical = true;
+        } else if (guid_eq(&entry.item_id, &physical_sector_guid)) {
+            ret = vhdx_read_metadata_item(bs, s, &entry,
+                                          &s->physical_sector_size,
+                                          sizeof(s->physical_sector_size));
+            le32_to_cpus(&s->physical_sector_size);
+            have_physical = true;
+        } else if (guid_eq(&entry.item_id, &page83_guid) ||
+                   guid_eq(&entry.item_id, &parent_locator_guid)) {
+            /* not needed to read the image */
+        } else if (entry.data_bits & VHDX_META_FLAGS_IS_REQUIRED) {
+            error_report("vhdx: image has an unsupported required "
+                         "metadata item");
+            ret = -ENOTSUP;
+        }
+        if (ret < 0) {
+            goto out;
+        }
+    }
+
+    if (!have_params || !have_size || !have_logical || !have_physical) {
+        error_report("vhdx: required metadata item missing");
+        ret = -EINVAL;
+        goto out;
+    }
+
+    if (params.data_bits & VHDX_PARAMS_HAS_PARENT) {
+        error_report("vhdx: differencing images are not supported");
+        ret = -ENOTSUP;
+        goto out;
+    }
+
+    s->block_size = params.block_size;
+    if (s->block_size < VHDX_BLOCK_SIZE_MIN ||
+        s->block_size > VHDX_BLOCK_SIZE_MAX ||
+        (s->block_size & (s->block_size - 1))) {
+        ret = -EINVAL;
+        goto out;
+    }
+    if (s->logical_sector_size != 512 && s->logical_sector_size != 4096) {
+        ret = -EINVAL;
+        goto out;
+    }
+    if (s->virtual_disk_size == 0 ||
+        s->virtual_disk_size > VHDX_MAX_DISK_SIZE ||
+        s->virtual_disk_size % s->logical_sector_size) {
+        ret = -EINVAL;
+        goto out;
+    }
+
+    s->block_size_bits = ctz32(s->block_size);
+    s->sectors_per_block_bits = s->block_size_bits - BDRV_SECTOR_BITS;
+    s->chunk_ratio = (VHDX_MAX_SECTORS_PER_BLOCK *
+                      (uint64_t)s->logical_sector_size) / s->block_size;
+    s->chunk_ratio_bits = ctz32(s->chunk_ratio);
+    s->data_blocks_cnt = DIV_ROUND_UP(s->virtual_disk_size, s->block_size);
+    ret = 0;
+
+out:
+    qemu_vfree(buf);
+    return ret;
+}
+
+/*
+ * Load the Block Allocation Table.  Payload block entries are interleaved
+ * with one sector bitmap entry after every chunk_ratio of them.
+ */
+static int vhdx_load_bat(BlockDriverState *bs, BDRVVHDXState *s)
+{
+    uint64_t i;
+    int ret;
+
+    s->bat_entries = s->data_blocks_cnt +
+                     ((s->data_blocks_cnt - 1) >> s->chunk_ratio_bits);
+    if (s->bat_entries * sizeof(uint64_t) > s->bat_length ||
+        s->bat_entries * sizeof(uint64_t) > INT_MAX) {
+        error_report("vhdx: block allocation table is too small");
+        return -EINVAL;
+    }
+
+    s->bat = qemu_blockalign(bs, s->bat_entries * sizeof(uint64_t));
+    ret = bdrv_pread(bs->file, s->bat_offset, s->bat,
+                     s->bat_entries * sizeof(uint64_t));
+    if (ret < 0) {
+        return ret;
+    }
+    for (i = 0; i < s->bat_entries; i++) {
+        le64_to_cpus(&s->bat[i]);
+    }
+    return 0;
+}
+
+static int vhdx_open(BlockDriverState *bs, int flags)
+{
+    BDRVVHDXState *s = bs->opaque;
+    bool replayed;
+    int ret;
+
+    s->bat = NULL;
+
+    ret = vhdx_parse_header(bs, s);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    ret = vhdx_parse_log(bs, s, &replayed);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    ret = vhdx_parse_region_table(bs, s);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    ret = vhdx_parse_metadata(bs, s);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    ret = vhdx_load_bat(bs, s);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    bs->total_sectors = s->virtual_disk_size >> BDRV_SECTOR_BITS;
+
+    /* Disable migration when VHDX images are used */
+    error_set(&s->migration_blocker,
+              QERR_BLOCK_FORMAT_FEATURE_NOT_SUPPORTED,
+              "vhdx", bs->device_name, "live migration");
+    migrate_add_blocker(s->migration_blocker);
+
+    return 0;
+
+fail:
+    qemu_vfree(s->bat);
+    s->bat = NULL;
+    return ret;
+}
+
+static int vhdx_reopen_prepare(BDRVReopenState *state,
+                               BlockReopenQueue *queue, Error **errp)
+{
+    return 0;
+}
+
+/*
+ * Map @sector_num to its payload block.  Returns the number of sectors,
+ * at most @nb_sectors, that are in the same state and, for present blocks,
+ * contiguous in the image file.  Because the BAT is kept in memory, long
+ * sequential reads from an image whose blocks were allocated in order turn
+ * into a single request to the image file.
+ */
+static int vhdx_block_translate(BDRVVHDXState *s, int64_t sector_num,
+                                int nb_sectors, int *state,
+                                uint64_t *file_offset)
+{
+    uint64_t block = sector_num >> s->sectors_per_block_bits;
+    uint32_t sectors_per_block = 1 << s->sectors_per_block_bits;
+    uint32_t sector_in_block = sector_num & (sectors_per_block - 1);
+    uint64_t entry, next_offset;
+    int n;
+
+    entry = s->bat[block + (block >> s->chunk_ratio_bits)];
+    *state = entry & VHDX_BAT_STATE_BIT_MASK;
+    *file_offset = (entry & VHDX_BAT_FILE_OFF_MASK) +
+                   ((uint64_t)sector_in_block << BDRV_SECTOR_BITS);
+    next_offset = (entry & VHDX_BAT_FILE_OFF_MASK) + s->block_size;
+    n = MIN(nb_sectors, sectors_per_block - sector_in_block);
+
+    while (n < nb_sectors && ++block < s->data_blocks_cnt) {
+        entry = s->bat[block + (block >> s->chunk_ratio_bits)];
+        if ((entry & VHDX_BAT_STATE_BIT_MASK) != *state) {
+            break;
+        }
+        if (*state == PAYLOAD_BLOCK_FULLY_PRESENT) {
+            if ((entry & VHDX_BAT_FILE_OFF_MASK) != next_offset) {
+                break;
+            }
+            next_offset += s->block_size;
+        }
+        n = MIN(nb_sectors, n + sectors_per_block);
+    }
+    return n;
+}
+
+static coroutine_fn int vhdx_co_readv(BlockDriverState *bs, int64_t sector_num,
+                                      int nb_sectors, QEMUIOVector *qiov)
+{
+    BDRVVHDXState *s = bs->opaque;
+    QEMUIOVector hd_qiov;
+    uint64_t bytes_done = 0, file_offset;
+    int n, state, ret = 0;
+
+    qemu_iovec_init(&hd_qiov, qiov->niov);
+
+    while (nb_sectors > 0) {
+        n = vhdx_block_translate(s, sector_num, nb_sectors, &state,
+                                 &file_offset);
+
+        switch (state) {
+        case PAYLOAD_BLOCK_NOT_PRESENT:
+        case PAYLOAD_BLOCK_UNDEFINED:
+        case PAYLOAD_BLOCK_UNMAPPED:
+        case PAYLOAD_BLOCK_ZERO:
+            /* no parent, so these all read as zeroes */
+            qemu_iovec_memset(qiov, bytes_done, 0, n * BDRV_SECTOR_SIZE);
+            break;
+        case PAYLOAD_BLOCK_FULLY_PRESENT:
+            qemu_iovec_slice(&hd_qiov, qiov, bytes_done,
+                             n * BDRV_SECTOR_SIZE);
+            ret = bdrv_co_readv(bs->file, file_offset >> BDRV_SECTOR_BITS, n,
+                                &hd_qiov);
+            if (ret < 0) {
+                goto out;
+            }
+            break;
+        case PAYLOAD_BLOCK_PARTIALLY_PRESENT:
+            /* only valid in differencing images */
+        default:
+            ret = -EIO;
+            goto out;
+        }
+
+        nb_sectors -= n;
+        sector_num += n;
+        bytes_done += n * BDRV_SECTOR_SIZE;
+    }
+
+out:
+    qemu_iovec_destroy(&hd_qiov);
+    return ret;
+}
+
+static coroutine_fn int vhdx_co_writev(BlockDriverState *bs, int64_t sector_num,
+                                       int nb_sectors, QEMUIOVector *qiov)
+{
+    return -ENOTSUP;
+}
+
+static int64_t coroutine_fn vhdx_co_get_block_status(BlockDriverState *bs,
+        int64_t sector_num, int nb_sectors, int *pnum)
+{
+    BDRVVHDXState *s = bs->opaque;
+    uint64_t file_offset;
+    int state;
+
+    *pnum = vhdx_block_translate(s, sector_num, nb_sectors, &state,
+                                 &file_offset);
+    switch (state) {
+    case PAYLOAD_BLOCK_FULLY_PRESENT:
+        return BDRV_BLOCK_DATA | BDRV_BLOCK_OFFSET_VALID | file_offset;
+    case PAYLOAD_BLOCK_ZERO:
+        return BDRV_BLOCK_ZERO;
+    default:
+        return 0;
+    }
+}
+
+static int vhdx_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
+{
+    BDRVVHDXState *s = bs->opaque;
+
+    bdi->cluster_size = s->block_size;
+    return 0;
+}
+
+/*
+ * A log that needed replay was replayed when the image was opened, so only
+ * the BAT is checked here: present blocks must lie within the image file.
+ */
+static int vhdx_check(BlockDriverState *bs, BdrvCheckResult *result,
+                      BdrvCheckMode fix)
+{
+    BDRVVHDXState *s = bs->opaque;
+    int64_t file_length, end;
+    uint64_t block, entry;
+
+    file_length = bdrv_getlength(bs->file);
+    if (file_length < 0) {
+        result->check_errors++;
+        return file_length;
+    }
+
+    result->image_end_offset = 0;
+    for (block = 0; block < s->data_blocks_cnt; block++) {
+        entry = s->bat[block + (block >> s->chunk_ratio_bits)];
+        if ((entry & VHDX_BAT_STATE_BIT_MASK) != PAYLOAD_BLOCK_FULLY_PRESENT) {
+            continue;
+        }
+        end = (entry & VHDX_BAT_FILE_OFF_MASK) + s->block_size;
+        if (end > file_length) {
+            fprintf(stderr, "ERROR block %" PRIu64 " at offset 0x%" PRIx64
+                    " is beyond the end of the image file\n", block,
+                    entry & VHDX_BAT_FILE_OFF_MASK);
+            result->corruptions++;
+        }
+        result->image_end_offset = MAX(result->image_end_offset, end);
+    }
+    return 0;
+}
+
+static void vhdx_close(BlockDriverState *bs)
+{
+    BDRVVHDXState *s = bs->opaque;
+
+    qemu_vfree(s->bat);
+    migrate_del_blocker(s->migration_blocker);
+    error_free(s->migration_blocker);
+}
+
+static BlockDriver bdrv_vhdx = {
+    .format_name            = "vhdx",
+    .instance_size          = sizeof(BDRVVHDXState),
+    .bdrv_probe             = vhdx_probe,
+    .bdrv_open              = vhdx_open,
+    .bdrv_close             = vhdx_close,
+    .bdrv_reopen_prepare    = vhdx_reopen_prepare,
+    .bdrv_co_readv          = vhdx_co_readv,
+    .bdrv_co_writev         = vhdx_co_writev,
+    .bdrv_co_get_block_status = vhdx_co_get_block_status,
+    .bdrv_get_info          = vhdx_get_info,
+    .bdrv_check             = vhdx_check,
+};
+
+static void bdrv_vhdx_init(void)
+{
+    bdrv_register(&bdrv_vhdx);
+}
+
+block_init(bdrv_vhdx_init);
@@ -0,0 +1,222 @@
+/*
+ * Block driver for Hyper-V VHDX images
+ *
+ * The on-disk structures follow the VHDX Format Specification v1.00 that
+ * Microsoft published in August 2012.  All fields are little-endian.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef BLOCK_VHDX_H
+#define BLOCK_VHDX_H
+
+#include "block/block_int.h"
+
+#define KiB     (1 * 1024)
+#define MiB     (KiB * 1024)
+
+/*
+ * Layout of the start of the file:
+ *
+ *  0       64K     128K    192K    256K    320K    1M
+ *  +-------+-------+-------+-------+-------+-------+----- -
+ *  | ident | hdr 1 | hdr 2 | reg 1 | reg 2 | unused| log, BAT, metadata,
+ *  +-------+-------+-------+-------+-------+-------+----- - payload blocks
+ */
+#define VHDX_FILE_ID_OFFSET         0
+#define VHDX_HEADER1_OFFSET         (64 * KiB)
+#define VHDX_HEADER2_OFFSET         (128 * KiB)
+#define VHDX_REGION_TABLE_OFFSET    (192 * KiB)
+#define VHDX_REGION_TABLE2_OFFSET   (256 * KiB)
+
+#define VHDX_HEADER_SIZE            (4 * KiB)
+#define VHDX_REGION_TABLE_SIZE      (64 * KiB)
+#define VHDX_METADATA_TABLE_SIZE    (64 * KiB)
+
+#define VHDX_FILE_SIGNATURE         "vhdxfile"
+#define VHDX_HEADER_SIGNATURE       0x64616568      /* "head" */
+#define VHDX_REGION_SIGNATURE       0x69676572      /* "regi" */
+#define VHDX_METADATA_SIGNATURE     0x617461646174656dULL /* "metadata" */
+#define VHDX_LOG_SIGNATURE          0x65676f6c      /* "loge" */
+#define VHDX_LOG_DESC_SIGNATURE     0x63736564      /* "desc" */
+#define VHDX_LOG_ZERO_SIGNATURE     0x6f72657a      /* "zero" */
+#define VHDX_LOG_DATA_SIGNATURE     0x61746164      /* "data" */
+
+typedef struct QEMU_PACKED MSGUID {
+    uint32_t data1;
+    uint16_t data2;
+    uint16_t data3;
+    uint8_t  data4[8];
+} MSGUID;
+
+typedef struct QEMU_PACKED VHDXHeader {
+    uint32_t signature;
+    uint32_t checksum;
+    uint64_t sequence_number;
+    MSGUID   file_write_guid;
+    MSGUID   data_write_guid;
+    /* a log must be replayed if log_guid is not zero */
+    MSGUID   log_guid;
+    uint16_t log_version;
+    uint16_t version;
+    uint32_t log_length;
+    uint64_t log_offset;
+    uint8_t  reserved[4016];
+} VHDXHeader;
+
+typedef struct QEMU_PACKED VHDXRegionTableHeader {
+    uint32_t signature;
+    uint32_t checksum;
+    uint32_t entry_count;
+    uint32_t reserved;
+} VHDXRegionTableHeader;
+
+#define VHDX_REGION_ENTRY_REQUIRED  0x01
+#define VHDX_REGION_MAX_ENTRIES     2047
+
+typedef struct QEMU_PACKED VHDXRegionTableEntry {
+    MSGUID   guid;
+    uint64_t file_offset;
+    uint32_t length;
+    uint32_t data_bits;
+} VHDXRegionTableEntry;
+
+typedef struct QEMU_PACKED VHDXMetadataTableHeader {
+    uint64_t signature;
+    uint16_t reserved;
+    uint16_t entry_count;
+    uint32_t reserved2[5];
+} VHDXMetadataTableHeader;
+
+#define VHDX_META_FLAGS_IS_USER         0x01
+#define VHDX_META_FLAGS_IS_VIRTUAL_DISK 0x02
+#define VHDX_META_FLAGS_IS_REQUIRED     0x04
+#define VHDX_METADATA_MAX_ENTRIES       2047
+
+typedef struct QEMU_PACKED VHDXMetadataTableEntry {
+    MSGUID   item_id;
+    /* relative to the start of the metadata region */
+    uint32_t offset;
+    uint32_t length;
+    uint32_t data_bits;
+    uint32_t reserved2;
+} VHDXMetadataTableEntry;
+
+#define VHDX_PARAMS_LEAVE_BLOCKS_ALLOCED    0x01
+#define VHDX_PARAMS_HAS_PARENT              0x02
+
+typedef struct QEMU_PACKED VHDXFileParameters {
+    uint32_t block_size;
+    uint32_t data_bits;
+} VHDXFileParameters;
+
+/* Block Allocation Table entries */
+#define VHDX_BAT_STATE_BIT_MASK     0x07
+#define VHDX_BAT_FILE_OFF_MASK      UINT64_C(0xfffffffffff00000)
+
+#define PAYLOAD_BLOCK_NOT_PRESENT       0
+#define PAYLOAD_BLOCK_UNDEFINED         1
+#define PAYLOAD_BLOCK_ZERO              2
+#define PAYLOAD_BLOCK_UNMAPPED          3
+#define PAYLOAD_BLOCK_FULLY_PRESENT     6
+#define PAYLOAD_BLOCK_PARTIALLY_PRESENT 7
+
+/* each sector bitmap block describes this many sectors */
+#define VHDX_MAX_SECTORS_PER_BLOCK  (1 << 23)
+
+#define VHDX_BLOCK_SIZE_MIN         (1 * MiB)
+#define VHDX_BLOCK_SIZE_MAX         (256 * MiB)
+
+/* Log */
+#define VHDX_LOG_SECTOR_SIZE        (4 * KiB)
+#define VHDX_LOG_HDR_SIZE           64
+#define VHDX_LOG_DESC_SIZE          32
+
+typedef struct QEMU_PACKED VHDXLogEntryHeader {
+    uint32_t signature;
+    /* CRC32C of the whole entry, with this field zeroed */
+    uint32_t checksum;
+    uint32_t entry_length;
+    /* offset of the first entry of the active sequence in the log */
+    uint32_t tail;
+    uint64_t sequence_number;
+    uint32_t descriptor_count;
+    uint32_t reserved;
+    MSGUID   log_guid;
+    uint64_t flushed_file_offset;
+    uint64_t last_file_offset;
+} VHDXLogEntryHeader;
+
+typedef struct QEMU_PACKED VHDXLogDescriptor {
+    uint32_t signature;
+    union {
+        uint32_t reserved;
+        uint32_t trailing_bytes;
+    };
+    union {
+        uint64_t zero_length;
+        uint64_t leading_bytes;
+    };
+    uint64_t file_offset;
+    uint64_t sequence_number;
+} VHDXLogDescriptor;
+
+typedef struct QEMU_PACKED VHDXLogDataSector {
+    uint32_t data_signature;
+    uint32_t sequence_high;
+    uint8_t  data[4084];
+    uint32_t sequence_low;
+} VHDXLogDataSector;
+
+typedef struct BDRVVHDXState {
+    int curr_header;
+    VHDXHeader headers[2];
+
+    uint64_t bat_offset;
+    uint32_t bat_length;
+    uint64_t metadata_offset;
+    uint32_t metadata_length;
+
+    uint32_t block_size;
+    uint32_t logical_sector_size;
+    uint32_t physical_sector_size;
+    uint64_t virtual_disk_size;
+
+    int block_size_bits;
+    int sectors_per_block_bits;
+    uint32_t chunk_ratio;
+    int chunk_ratio_bits;
+    uint64_t data_blocks_cnt;
+
+    /* the whole Block Allocation Table, in host byte order */
+    uint64_t *bat;
+    uint64_t bat_entries;
+
+    Error *migration_blocker;
+} BDRVVHDXState;
+
+bool vhdx_checksum_is_valid(uint8_t *buf, size_t size, int crc_offset);
+void vhdx_guid_generate(MSGUID *guid);
+bool vhdx_guid_is_zero(const MSGUID *guid);
+int vhdx_update_headers(BlockDriverState *bs, BDRVVHDXState *s,
+                        MSGUID *log_guid);
+
+/* vhdx-log.c */
+int vhdx_parse_log(BlockDriverState *bs, BDRVVHDXState *s, bool *replayed);
+
+static inline void leguid_to_cpus(MSGUID *guid)
+{
+    guid->data1 = le32_to_cpu(guid->data1);
+    guid->data2 = le16_to_cpu(guid->data2);
+    guid->data3 = le16_to_cpu(guid->data3);
+}
+
+static inline void cpu_to_leguids(MSGUID *guid)
+{
+    guid->data1 = cpu_to_le32(guid->data1);
+    guid->data2 = cpu_to_le16(guid->data2);
+    guid->data3 = cpu_to_le16(guid->data3);
+}
+
+#endif
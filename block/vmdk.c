@@ -25,6 +25,7 @@
 
 #include "qemu-common.h"
 #include "block/block_int.h"
+#include "block/thread-pool.h"
 #include "qemu/module.h"
 #include "migration/migration.h"
 #include <zlib.h>
@@ -66,7 +67,13 @@ typedef struct {
     uint16_t compressAlgorithm;
 } QEMU_PACKED VMDK4Header;
 
-#define L2_CACHE_SIZE 16
+/* grain tables cached per extent: at least the minimum, and by default as
+ * many as needed to map the whole extent within the maximum memory size */
+#define VMDK_MIN_L2_CACHE_TABLES 16
+#define VMDK_DEFAULT_L2_CACHE_MAX_SIZE (1024 * 1024)
+
+/* compressed grains, or extents, read at the same time for one request */
+#define VMDK_MAX_PARALLEL_READS 16
 
 typedef struct VmdkExtent {
     BlockDriverState *file;
@@ -84,9 +91,13 @@ typedef struct VmdkExtent {
     uint32_t l1_entry_sectors;
 
     unsigned int l2_size;
+    unsigned int l2_cache_tables;
     uint32_t *l2_cache;
-    uint32_t l2_cache_offsets[L2_CACHE_SIZE];
-    uint32_t l2_cache_counts[L2_CACHE_SIZE];
+    /* cache slot holding the grain table of each L1 entry, or -1 */
+    int *l2_cache_slot;
+    /* L1 entry whose grain table is held in each slot */
+    unsigned int *l2_cache_l1_index;
+    uint32_t *l2_cache_counts;
 
     unsigned int cluster_sectors;
 } VmdkExtent;
@@ -196,6 +207,9 @@ static void vmdk_free_extents(BlockDriverState *bs)
         e = &s->extents[i];
         g_free(e->l1_table);
         g_free(e->l2_cache);
+        g_free(e->l2_cache_slot);
+        g_free(e->l2_cache_l1_index);
+        g_free(e->l2_cache_counts);
         g_free(e->l1_backup_table);
         if (e->file != bs->file) {
             bdrv_delete(e->file);
@@ -402,6 +416,32 @@ static VmdkExtent *vmdk_add_extent(BlockDriverState *bs,
     return extent;
 }
 
+/*
+ * Number of grain tables to cache so that @bs->l2_cache_coverage bytes of
+ * the extent are mapped from memory.  Without an explicit coverage, the
+ * cache covers the whole extent but stays within
+ * VMDK_DEFAULT_L2_CACHE_MAX_SIZE.
+ */
+static unsigned int vmdk_l2_cache_tables(BlockDriverState *bs,
+                                         VmdkExtent *extent)
+{
+    uint64_t coverage = extent->sectors * BDRV_SECTOR_SIZE;
+    uint64_t table_coverage = (uint64_t)extent->l1_entry_sectors *
+                              BDRV_SECTOR_SIZE;
+    uint64_t table_size = extent->l2_size * sizeof(uint32_t);
+    uint64_t tables;
+
+    if (bs->l2_cache_coverage > 0) {
+        coverage = MIN(bs->l2_cache_coverage, coverage);
+    }
+    tables = (coverage + table_coverage - 1) / table_coverage;
+    if (bs->l2_cache_coverage <= 0) {
+        tables = MIN(tables, VMDK_DEFAULT_L2_CACHE_MAX_SIZE / table_size);
+    }
+    tables = MIN(tables, extent->l1_size);
+    return MAX(tables, VMDK_MIN_L2_CACHE_TABLES);
+}
+
 static int vmdk_init_tables(BlockDriverState *bs, VmdkExtent *extent)
 {
     int ret;
@@ -435,8 +475,16 @@ static int vmdk_init_tables(BlockDriverState *bs, VmdkExtent *extent)
         }
     }
 
-    extent->l2_cache =
-        g_malloc(extent->l2_size * L2_CACHE_SIZE * sizeof(uint32_t));
+    extent->l2_cache_tables = vmdk_l2_cache_tables(bs, extent);
+    extent->l2_cache = g_malloc(extent->l2_size * extent->l2_cache_tables *
+                                sizeof(uint32_t));
+    extent->l2_cache_slot = g_new(int, extent->l1_size);
+    for (i = 0; i < extent->l1_size; i++) {
+        extent->l2_cache_slot[i] = -1;
+    }
+    extent->l2_cache_l1_index = g_new0(unsigned int,
+                                       extent->l2_cache_tables);
+    extent->l2_cache_counts = g_new0(uint32_t, extent->l2_cache_tables);
     return 0;
  fail_l1b:
     g_free(extent->l1_backup_table);
@@ -829,7 +877,7 @@ static int get_cluster_offset(BlockDriverState *bs,
                                     uint64_t *cluster_offset)
 {
     unsigned int l1_index, l2_offset, l2_index;
-    int min_index, i, j;
+    int min_index, i;
     uint32_t min_count, *l2_table, tmp = 0;
 
     if (m_data) {
@@ -849,27 +897,31 @@ static int get_cluster_offset(BlockDriverState *bs,
     if (!l2_offset) {
         return -1;
     }
-    for (i = 0; i < L2_CACHE_SIZE; i++) {
-        if (l2_offset == extent->l2_cache_offsets[i]) {
-            /* increment the hit count */
-            if (++extent->l2_cache_counts[i] == 0xffffffff) {
-                for (j = 0; j < L2_CACHE_SIZE; j++) {
-                    extent->l2_cache_counts[j] >>= 1;
-                }
+    i = extent->l2_cache_slot[l1_index];
+    if (i >= 0) {
+        /* increment the hit count */
+        if (++extent->l2_cache_counts[i] == 0xffffffff) {
+            int j;
+            for (j = 0; j < extent->l2_cache_tables; j++) {
+                extent->l2_cache_counts[j] >>= 1;
             }
-            l2_table = extent->l2_cache + (i * extent->l2_size);
-            goto found;
         }
+        l2_table = extent->l2_cache + (i * extent->l2_size);
+        goto found;
     }
     /* not found: load a new entry in the least used one */
     min_index = 0;
     min_count = 0xffffffff;
-    for (i = 0; i < L2_CACHE_SIZE; i++) {
+    for (i = 0; i < extent->l2_cache_tables; i++) {
         if (extent->l2_cache_counts[i] < min_count) {
             min_count = extent->l2_cache_counts[i];
             min_index = i;
         }
     }
+    if (extent->l2_cache_slot[extent->l2_cache_l1_index[min_index]] ==
+        min_index) {
+        extent->l2_cache_slot[extent->l2_cache_l1_index[min_index]] = -1;
+    }
     l2_table = extent->l2_cache + (min_index * extent->l2_size);
     if (bdrv_pread(
                 extent->file,
@@ -880,7 +932,8 @@ static int get_cluster_offset(BlockDriverState *bs,
         return -1;
     }
 
-    extent->l2_cache_offsets[min_index] = l2_offset;
+    extent->l2_cache_slot[l1_index] = min_index;
+    extent->l2_cache_l1_index[min_index] = l1_index;
     extent->l2_cache_counts[min_index] = 1;
  found:
     l2_index = ((offset >> 9) / extent->cluster_sectors) % extent->l2_size;
@@ -1012,9 +1065,30 @@ static int vmdk_write_extent(VmdkExtent *extent, int64_t cluster_offset,
     return ret;
 }
 
-static int vmdk_read_extent(VmdkExtent *extent, int64_t cluster_offset,
-                            int64_t offset_in_cluster, uint8_t *buf,
-                            int nb_sectors)
+typedef struct VmdkInflateData {
+    uint8_t *out_buf;
+    uLongf out_len;
+    const uint8_t *buf;
+    uint32_t buf_len;
+} VmdkInflateData;
+
+/* Called in a thread pool worker */
+static int vmdk_inflate(void *opaque)
+{
+    VmdkInflateData *data = opaque;
+
+    if (uncompress(data->out_buf, &data->out_len,
+                   data->buf, data->buf_len) != Z_OK) {
+        return -EINVAL;
+    }
+    return 0;
+}
+
+static int coroutine_fn vmdk_read_extent(BlockDriverState *bs,
+                                         VmdkExtent *extent,
+                                         int64_t cluster_offset,
+                                         int64_t offset_in_cluster,
+                                         uint8_t *buf, int nb_sectors)
 {
     int ret;
     int cluster_bytes, buf_bytes;
@@ -1022,7 +1096,7 @@ static int vmdk_read_extent(VmdkExtent *extent, int64_t cluster_offset,
     uint8_t *uncomp_buf;
     uint32_t data_len;
     VmdkGrainMarker *marker;
-    uLongf buf_len;
+    VmdkInflateData data;
 
 
     if (!extent->compressed) {
@@ -1047,7 +1121,6 @@ static int vmdk_read_extent(VmdkExtent *extent, int64_t cluster_offset,
         goto out;
     }
     compressed_data = cluster_buf;
-    buf_len = cluster_bytes;
     data_len = cluster_bytes;
     if (extent->has_marker) {
         marker = (VmdkGrainMarker *)cluster_buf;
@@ -1058,14 +1131,19 @@ static int vmdk_read_extent(VmdkExtent *extent, int64_t cluster_offset,
         ret = -EINVAL;
         goto out;
     }
-    ret = uncompress(uncomp_buf, &buf_len, compressed_data, data_len);
-    if (ret != Z_OK) {
-        ret = -EINVAL;
+    data = (VmdkInflateData) {
+        .out_buf    = uncomp_buf,
+        .out_len    = cluster_bytes,
+        .buf        = compressed_data,
+        .buf_len    = data_len,
+    };
+    ret = thread_pool_submit_co(aio_get_thread_pool(bdrv_get_aio_context(bs)),
+                                vmdk_inflate, &data);
+    if (ret < 0) {
         goto out;
-
     }
     if (offset_in_cluster < 0 ||
-            offset_in_cluster + nb_sectors * 512 > buf_len) {
+            offset_in_cluster + nb_sectors * 512 > data.out_len) {
         ret = -EINVAL;
         goto out;
     }
@@ -1078,57 +1156,214 @@ static int vmdk_read_extent(VmdkExtent *extent, int64_t cluster_offset,
     return ret;
 }
 
-static int vmdk_read(BlockDriverState *bs, int64_t sector_num,
-                    uint8_t *buf, int nb_sectors)
+/*
+ * A set of reads running in their own coroutines for one request.  The
+ * coroutine issuing them waits in vmdk_parallel_wait() until no more than
+ * @max are left in flight.
+ */
+typedef struct VmdkParallel {
+    Coroutine *waiting;
+    int in_flight;
+    int ret;
+} VmdkParallel;
+
+typedef struct VmdkReadTask {
+    VmdkParallel *parallel;
+    BlockDriverState *bs;
+    VmdkExtent *extent;
+    int64_t sector_num;
+    uint64_t cluster_offset;
+    int64_t offset_in_cluster;
+    uint8_t *buf;
+    int nb_sectors;
+} VmdkReadTask;
+
+static void coroutine_fn vmdk_parallel_wait(VmdkParallel *p, int max)
 {
-    BDRVVmdkState *s = bs->opaque;
+    while (p->in_flight > max) {
+        p->waiting = qemu_coroutine_self();
+        qemu_coroutine_yield();
+    }
+}
+
+static void vmdk_parallel_done(VmdkParallel *p, int ret)
+{
+    if (ret < 0 && p->ret == 0) {
+        p->ret = ret;
+    }
+    p->in_flight--;
+    if (p->waiting) {
+        Coroutine *co = p->waiting;
+        p->waiting = NULL;
+        qemu_coroutine_enter(co, NULL);
+    }
+}
+
+static void coroutine_fn vmdk_parallel_start(VmdkParallel *p,
+                                             CoroutineEntry *entry,
+                                             VmdkReadTask *task)
+{
+    VmdkReadTask *t = g_memdup(task, sizeof(*task));
+
+    t->parallel = p;
+    vmdk_parallel_wait(p, VMDK_MAX_PARALLEL_READS - 1);
+    p->in_flight++;
+    qemu_coroutine_enter(qemu_coroutine_create(entry), t);
+}
+
+static void coroutine_fn vmdk_read_grain_entry(void *opaque)
+{
+    VmdkReadTask *t = opaque;
+    int ret;
+
+    ret = vmdk_read_extent(t->bs, t->extent, t->cluster_offset,
+                           t->offset_in_cluster, t->buf, t->nb_sectors);
+    vmdk_parallel_done(t->parallel, ret);
+    g_free(t);
+}
+
+/*
+ * Read a range that lies in a single extent.  Runs of unallocated grains and
+ * of grains that are contiguous in the extent file are handled with one
+ * request each; compressed grains are read and inflated in parallel.
+ */
+static int coroutine_fn vmdk_read_range(BlockDriverState *bs,
+                                        VmdkExtent *extent,
+                                        int64_t sector_num,
+                                        uint8_t *buf, int nb_sectors)
+{
+    VmdkParallel grains = { .ret = 0 };
+    VmdkReadTask task;
     int ret;
-    uint64_t n, index_in_cluster;
+    uint64_t n, next, index_in_cluster;
     uint64_t extent_begin_sector, extent_relative_sector_num;
-    VmdkExtent *extent = NULL;
-    uint64_t cluster_offset;
+    uint64_t cluster_offset, next_offset;
 
-    while (nb_sectors > 0) {
-        extent = find_extent(s, sector_num, extent);
-        if (!extent) {
-            return -EIO;
-        }
+    extent_begin_sector = extent->end_sector - extent->sectors;
+    while (nb_sectors > 0 && grains.ret == 0) {
         ret = get_cluster_offset(
                             bs, extent, NULL,
                             sector_num << 9, 0, &cluster_offset);
-        extent_begin_sector = extent->end_sector - extent->sectors;
         extent_relative_sector_num = sector_num - extent_begin_sector;
         index_in_cluster = extent_relative_sector_num % extent->cluster_sectors;
         n = extent->cluster_sectors - index_in_cluster;
         if (n > nb_sectors) {
             n = nb_sectors;
         }
+
+        /* extend the run while the next grains are mapped the same way */
+        while (n < nb_sectors && !extent->flat &&
+               !(extent->compressed && !ret)) {
+            next = MIN(extent->cluster_sectors, nb_sectors - n);
+            if (get_cluster_offset(bs, extent, NULL, (sector_num + n) << 9,
+                                   0, &next_offset)) {
+                if (!ret) {
+                    break;
+                }
+            } else if (ret || next_offset != cluster_offset +
+                       (index_in_cluster + n) * 512) {
+                break;
+            }
+            n += next;
+        }
+
         if (ret) {
             /* if not allocated, try to read from parent image, if exist */
             if (bs->backing_hd) {
                 if (!vmdk_is_cid_valid(bs)) {
-                    return -EINVAL;
+                    ret = -EINVAL;
+                    goto out;
                 }
                 ret = bdrv_read(bs->backing_hd, sector_num, buf, n);
                 if (ret < 0) {
-                    return ret;
+                    goto out;
                 }
             } else {
                 memset(buf, 0, 512 * n);
             }
+        } else if (extent->compressed) {
+            task = (VmdkReadTask) {
+                .bs                 = bs,
+                .extent             = extent,
+                .cluster_offset     = cluster_offset,
+                .offset_in_cluster  = index_in_cluster * 512,
+                .buf                = buf,
+                .nb_sectors         = n,
+            };
+            vmdk_parallel_start(&grains, vmdk_read_grain_entry, &task);
         } else {
-            ret = vmdk_read_extent(extent,
+            ret = vmdk_read_extent(bs, extent,
                             cluster_offset, index_in_cluster * 512,
                             buf, n);
             if (ret) {
-                return ret;
+                goto out;
             }
         }
         nb_sectors -= n;
         sector_num += n;
         buf += n * 512;
     }
-    return 0;
+    ret = 0;
+
+out:
+    vmdk_parallel_wait(&grains, 0);
+    return ret ? ret : grains.ret;
+}
+
+static void coroutine_fn vmdk_read_range_entry(void *opaque)
+{
+    VmdkReadTask *t = opaque;
+    int ret;
+
+    ret = vmdk_read_range(t->bs, t->extent, t->sector_num, t->buf,
+                          t->nb_sectors);
+    vmdk_parallel_done(t->parallel, ret);
+    g_free(t);
+}
+
+/*
+ * Requests that span several extents are split, and the extents are read at
+ * the same time.  Every extent has its own grain table cache, so the reads
+ * do not interfere with each other.
+ */
+static int coroutine_fn vmdk_read(BlockDriverState *bs, int64_t sector_num,
+                                  uint8_t *buf, int nb_sectors)
+{
+    BDRVVmdkState *s = bs->opaque;
+    VmdkParallel extents = { .ret = 0 };
+    VmdkReadTask task;
+    VmdkExtent *extent = NULL;
+    int64_t n;
+
+    extent = find_extent(s, sector_num, extent);
+    if (extent && sector_num + nb_sectors <= extent->end_sector) {
+        return vmdk_read_range(bs, extent, sector_num, buf, nb_sectors);
+    }
+
+    while (nb_sectors > 0 && extents.ret == 0) {
+        extent = find_extent(s, sector_num, extent);
+        if (!extent) {
+            extents.ret = -EIO;
+            break;
+        }
+        n = MIN(nb_sectors, extent->end_sector - sector_num);
+
+        task = (VmdkReadTask) {
+            .bs         = bs,
+            .extent     = extent,
+            .sector_num = sector_num,
+            .buf        = buf,
+            .nb_sectors = n,
+        };
+        vmdk_parallel_start(&extents, vmdk_read_range_entry, &task);
+
+        nb_sectors -= n;
+        sector_num += n;
+        buf += n * 512;
+    }
+
+    vmdk_parallel_wait(&extents, 0);
+    return extents.ret;
 }
 
 static coroutine_fn int vmdk_co_read(BlockDriverState *bs, int64_t sector_num,
@@ -17,6 +17,7 @@
 #include "qapi/qmp/types.h"
 #include "sysemu/sysemu.h"
 #include "block/block_int.h"
+#include "block/shared-cache.h"
 #include "qmp-commands.h"
 #include "trace.h"
 #include "sysemu/arch_init.h"
@@ -255,32 +256,18 @@ static int parse_block_error_action(const char *buf, bool is_read)
     }
 }
 
-static bool do_check_io_limits(BlockIOLimit *io_limits, Error **errp)
+static bool do_check_io_limits(ThrottleConfig *cfg, Error **errp)
 {
-    bool bps_flag;
-    bool iops_flag;
-
-    assert(io_limits);
-
-    bps_flag  = (io_limits->bps[BLOCK_IO_LIMIT_TOTAL] != 0)
-                 && ((io_limits->bps[BLOCK_IO_LIMIT_READ] != 0)
-                 || (io_limits->bps[BLOCK_IO_LIMIT_WRITE] != 0));
-    iops_flag = (io_limits->iops[BLOCK_IO_LIMIT_TOTAL] != 0)
-                 && ((io_limits->iops[BLOCK_IO_LIMIT_READ] != 0)
-                 || (io_limits->iops[BLOCK_IO_LIMIT_WRITE] != 0));
-    if (bps_flag || iops_flag) {
-        error_setg(errp, "bps(iops) and bps_rd/bps_wr(iops_rd/iops_wr) "
-                         "cannot be used at the same time");
+    if (throttle_conflicting(cfg)) {
+        error_setg(errp, "bps/iops/bps_max/iops_max and their read/write "
+                         "variants cannot be used at the same time");
         return false;
     }
 
-    if (io_limits->bps[BLOCK_IO_LIMIT_TOTAL] < 0 ||
-        io_limits->bps[BLOCK_IO_LIMIT_WRITE] < 0 ||
-        io_limits->bps[BLOCK_IO_LIMIT_READ] < 0 ||
-        io_limits->iops[BLOCK_IO_LIMIT_TOTAL] < 0 ||
-        io_limits->iops[BLOCK_IO_LIMIT_WRITE] < 0 ||
-        io_limits->iops[BLOCK_IO_LIMIT_READ] < 0) {
-        error_setg(errp, "bps and iops values must be 0 or greater");
+    if (!throttle_is_valid(cfg)) {
+        error_setg(errp, "bps and iops values must be 0 or greater, and a "
+                         "bps_max/iops_max burst needs the matching average "
+                         "limit");
         return false;
     }
 
@@ -305,7 +292,8 @@ DriveInfo *drive_init(QemuOpts *opts, BlockInterfaceType block_default_type)
     int on_read_error, on_write_error;
     const char *devaddr;
     DriveInfo *dinfo;
-    BlockIOLimit io_limits;
+    ThrottleConfig cfg;
+    const char *throttling_group;
     int snapshot = 0;
     bool copy_on_read;
     int ret;
@@ -406,10 +394,14 @@ DriveInfo *drive_init(QemuOpts *opts, BlockInterfaceType block_default_type)
         }
     }
 
-#ifdef CONFIG_LINUX_AIO
+#if defined(CONFIG_LINUX_AIO) || defined(CONFIG_LINUX_IO_URING)
     if ((buf = qemu_opt_get(opts, "aio")) != NULL) {
         if (!strcmp(buf, "native")) {
             bdrv_flags |= BDRV_O_NATIVE_AIO;
+#ifdef CONFIG_LINUX_IO_URING
+        } else if (!strcmp(buf, "io_uring")) {
+            bdrv_flags |= BDRV_O_IO_URING;
+#endif
         } else if (!strcmp(buf, "threads")) {
             /* this is the default */
         } else {
@@ -434,20 +426,37 @@ DriveInfo *drive_init(QemuOpts *opts, BlockInterfaceType block_default_type)
     }
 
     /* disk I/O throttling */
-    io_limits.bps[BLOCK_IO_LIMIT_TOTAL]  =
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.buckets[THROTTLE_BPS_TOTAL].avg =
                            qemu_opt_get_number(opts, "bps", 0);
-    io_limits.bps[BLOCK_IO_LIMIT_READ]   =
+    cfg.buckets[THROTTLE_BPS_READ].avg  =
                            qemu_opt_get_number(opts, "bps_rd", 0);
-    io_limits.bps[BLOCK_IO_LIMIT_WRITE]  =
+    cfg.buckets[THROTTLE_BPS_WRITE].avg =
                            qemu_opt_get_number(opts, "bps_wr", 0);
-    io_limits.iops[BLOCK_IO_LIMIT_TOTAL] =
+    cfg.buckets[THROTTLE_OPS_TOTAL].avg =
                            qemu_opt_get_number(opts, "iops", 0);
-    io_limits.iops[BLOCK_IO_LIMIT_READ]  =
+    cfg.buckets[THROTTLE_OPS_READ].avg  =
                            qemu_opt_get_number(opts, "iops_rd", 0);
-    io_limits.iops[BLOCK_IO_LIMIT_WRITE] =
+    cfg.buckets[THROTTLE_OPS_WRITE].avg =
                            qemu_opt_get_number(opts, "iops_wr", 0);
 
-    if (!do_check_io_limits(&io_limits, &error)) {
+    cfg.buckets[THROTTLE_BPS_TOTAL].max =
+                           qemu_opt_get_number(opts, "bps_max", 0);
+    cfg.buckets[THROTTLE_BPS_READ].max  =
+                           qemu_opt_get_number(opts, "bps_rd_max", 0);
+    cfg.buckets[THROTTLE_BPS_WRITE].max =
+                           qemu_opt_get_number(opts, "bps_wr_max", 0);
+    cfg.buckets[THROTTLE_OPS_TOTAL].max =
+                           qemu_opt_get_number(opts, "iops_max", 0);
+    cfg.buckets[THROTTLE_OPS_READ].max  =
+                           qemu_opt_get_number(opts, "iops_rd_max", 0);
+    cfg.buckets[THROTTLE_OPS_WRITE].max =
+                           qemu_opt_get_number(opts, "iops_wr_max", 0);
+
+    cfg.op_size = qemu_opt_get_number(opts, "iops_size", 0);
+    throttling_group = qemu_opt_get(opts, "group");
+
+    if (!do_check_io_limits(&cfg, &error)) {
         error_report("%s", error_get_pretty(error));
         error_free(error);
         return NULL;
@@ -571,8 +580,34 @@ DriveInfo *drive_init(QemuOpts *opts, BlockInterfaceType block_default_type)
 
     bdrv_set_on_error(dinfo->bdrv, on_read_error, on_write_error);
 
-    /* disk I/O throttling */
-    bdrv_set_io_limits(dinfo->bdrv, &io_limits);
+    dinfo->bdrv->l2_cache_coverage = qemu_opt_get_size(opts,
+                                                       "l2-cache-coverage", 0);
+
+    if ((buf = qemu_opt_get(opts, "shared-cache")) != NULL) {
+        dinfo->bdrv->shared_cache = shared_cache_open(buf,
+            qemu_opt_get_size(opts, "shared-cache-size",
+                              SHARED_CACHE_DEFAULT_SIZE), &error);
+        if (!dinfo->bdrv->shared_cache) {
+            error_report("%s", error_get_pretty(error));
+            error_free(error);
+            goto err;
+        }
+    }
+
+    if (qemu_opt_get_bool(opts, "merge", false)) {
+        bdrv_set_request_merging(dinfo->bdrv, true,
+                                 BDRV_MERGE_DEFAULT_MAX_SECTORS, IOV_MAX);
+    }
+
+    /* disk I/O throttling, a drive without a group gets its own one */
+    if (throttle_enabled(&cfg)) {
+        bdrv_io_limits_enable(dinfo->bdrv, throttling_group ?
+                              throttling_group : dinfo->id);
+        bdrv_set_io_limits(dinfo->bdrv, &cfg);
+    } else if (throttling_group) {
+        /* share the limits that the group already has */
+        bdrv_io_limits_enable(dinfo->bdrv, throttling_group);
+    }
 
     switch(type) {
     case IF_IDE:
@@ -977,9 +1012,18 @@ void qmp_change_blockdev(const char *device, const char *filename,
 /* throttling disk I/O limits */
 void qmp_block_set_io_throttle(const char *device, int64_t bps, int64_t bps_rd,
                                int64_t bps_wr, int64_t iops, int64_t iops_rd,
-                               int64_t iops_wr, Error **errp)
+                               int64_t iops_wr,
+                               bool has_bps_max, int64_t bps_max,
+                               bool has_bps_rd_max, int64_t bps_rd_max,
+                               bool has_bps_wr_max, int64_t bps_wr_max,
+                               bool has_iops_max, int64_t iops_max,
+                               bool has_iops_rd_max, int64_t iops_rd_max,
+                               bool has_iops_wr_max, int64_t iops_wr_max,
+                               bool has_iops_size, int64_t iops_size,
+                               bool has_group, const char *group,
+                               Error **errp)
 {
-    BlockIOLimit io_limits;
+    ThrottleConfig cfg;
     BlockDriverState *bs;
 
     bs = bdrv_find(device);
@@ -988,28 +1032,63 @@ void qmp_block_set_io_throttle(const char *device, int64_t bps, int64_t bps_rd,
         return;
     }
 
-    io_limits.bps[BLOCK_IO_LIMIT_TOTAL] = bps;
-    io_limits.bps[BLOCK_IO_LIMIT_READ]  = bps_rd;
-    io_limits.bps[BLOCK_IO_LIMIT_WRITE] = bps_wr;
-    io_limits.iops[BLOCK_IO_LIMIT_TOTAL]= iops;
-    io_limits.iops[BLOCK_IO_LIMIT_READ] = iops_rd;
-    io_limits.iops[BLOCK_IO_LIMIT_WRITE]= iops_wr;
-
-    if (!do_check_io_limits(&io_limits, errp)) {
+    /* Throttling timers run in the main loop */
+    if (bdrv_get_aio_context(bs) != qemu_get_aio_context()) {
+        error_set(errp, QERR_DEVICE_IN_USE, device);
         return;
     }
 
-    bs->io_limits = io_limits;
-    bs->slice_time = BLOCK_IO_SLICE_TIME;
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.buckets[THROTTLE_BPS_TOTAL].avg = bps;
+    cfg.buckets[THROTTLE_BPS_READ].avg  = bps_rd;
+    cfg.buckets[THROTTLE_BPS_WRITE].avg = bps_wr;
+    cfg.buckets[THROTTLE_OPS_TOTAL].avg = iops;
+    cfg.buckets[THROTTLE_OPS_READ].avg  = iops_rd;
+    cfg.buckets[THROTTLE_OPS_WRITE].avg = iops_wr;
 
-    if (!bs->io_limits_enabled && bdrv_io_limits_enabled(bs)) {
-        bdrv_io_limits_enable(bs);
-    } else if (bs->io_limits_enabled && !bdrv_io_limits_enabled(bs)) {
-        bdrv_io_limits_disable(bs);
-    } else {
-        if (bs->block_timer) {
-            qemu_mod_timer(bs->block_timer, qemu_get_clock_ns(vm_clock));
+    if (has_bps_max) {
+        cfg.buckets[THROTTLE_BPS_TOTAL].max = bps_max;
+    }
+    if (has_bps_rd_max) {
+        cfg.buckets[THROTTLE_BPS_READ].max = bps_rd_max;
+    }
+    if (has_bps_wr_max) {
+        cfg.buckets[THROTTLE_BPS_WRITE].max = bps_wr_max;
+    }
+    if (has_iops_max) {
+        cfg.buckets[THROTTLE_OPS_TOTAL].max = iops_max;
+    }
+    if (has_iops_rd_max) {
+        cfg.buckets[THROTTLE_OPS_READ].max = iops_rd_max;
+    }
+    if (has_iops_wr_max) {
+        cfg.buckets[THROTTLE_OPS_WRITE].max = iops_wr_max;
+    }
+    if (has_iops_size) {
+        if (iops_size < 0) {
+            error_set(errp, QERR_INVALID_PARAMETER_VALUE, "iops_size",
+                      "a value of 0 or greater");
+            return;
+        }
+        cfg.op_size = iops_size;
+    }
+
+    if (!do_check_io_limits(&cfg, errp)) {
+        return;
+    }
+
+    if (throttle_enabled(&cfg)) {
+        /* enable I/O limits if they are disabled, else move to the group */
+        if (!bs->io_limits_enabled) {
+            bdrv_io_limits_enable(bs, has_group ? group : device);
+        } else if (has_group) {
+            bdrv_io_limits_update_group(bs, group);
         }
+        /* set the new limits, they apply to the whole group */
+        bdrv_set_io_limits(bs, &cfg);
+    } else if (bs->io_limits_enabled) {
+        /* disable I/O limits if they are enabled */
+        bdrv_io_limits_disable(bs);
     }
 }
 
@@ -1047,6 +1126,108 @@ int do_drive_del(Monitor *mon, const QDict *qdict, QObject **ret_data)
     return 0;
 }
 
+/* Convert a list of boundaries to an array, checking that it ascends */
+static uint64_t *histogram_boundaries(BlockHistogramBoundaryList *list,
+                                      int *nb_boundaries, Error **errp)
+{
+    BlockHistogramBoundaryList *e;
+    uint64_t *boundaries;
+    int n = 0;
+
+    for (e = list; e; e = e->next) {
+        n++;
+    }
+
+    boundaries = g_new(uint64_t, n);
+    n = 0;
+    for (e = list; e; e = e->next) {
+        if (e->value->ns <= 0 ||
+            (n && e->value->ns <= boundaries[n - 1])) {
+            error_set(errp, QERR_INVALID_PARAMETER_VALUE, "boundaries",
+                      "a list of strictly increasing positive values");
+            g_free(boundaries);
+            return NULL;
+        }
+        boundaries[n++] = e->value->ns;
+    }
+
+    *nb_boundaries = n;
+    return boundaries;
+}
+
+void qmp_block_latency_histogram_set(const char *device,
+                                     bool has_boundaries,
+                                     BlockHistogramBoundaryList *boundaries,
+                                     bool has_boundaries_read,
+                                     BlockHistogramBoundaryList *boundaries_read,
+                                     bool has_boundaries_write,
+                                     BlockHistogramBoundaryList *boundaries_write,
+                                     bool has_boundaries_flush,
+                                     BlockHistogramBoundaryList *boundaries_flush,
+                                     Error **errp)
+{
+    BlockHistogramBoundaryList *lists[BDRV_MAX_IOTYPE];
+    uint64_t *arrays[BDRV_MAX_IOTYPE] = { NULL };
+    int nb[BDRV_MAX_IOTYPE] = { 0 };
+    BlockDriverState *bs;
+    int i;
+
+    bs = bdrv_find(device);
+    if (!bs) {
+        error_set(errp, QERR_DEVICE_NOT_FOUND, device);
+        return;
+    }
+
+    for (i = 0; i < BDRV_MAX_IOTYPE; i++) {
+        lists[i] = has_boundaries ? boundaries : NULL;
+    }
+    if (has_boundaries_read) {
+        lists[BDRV_ACCT_READ] = boundaries_read;
+    }
+    if (has_boundaries_write) {
+        lists[BDRV_ACCT_WRITE] = boundaries_write;
+    }
+    if (has_boundaries_flush) {
+        lists[BDRV_ACCT_FLUSH] = boundaries_flush;
+    }
+
+    /* Validate everything before changing anything */
+    for (i = 0; i < BDRV_MAX_IOTYPE; i++) {
+        if (lists[i]) {
+            arrays[i] = histogram_boundaries(lists[i], &nb[i], errp);
+            if (!arrays[i]) {
+                goto out;
+            }
+        }
+    }
+
+    /* Without any list, every request type goes back to the defaults */
+    for (i = 0; i < BDRV_MAX_IOTYPE; i++) {
+        if (lists[i] || (!has_boundaries && !has_boundaries_read &&
+                         !has_boundaries_write && !has_boundaries_flush)) {
+            bdrv_set_latency_histogram(bs, i, arrays[i], nb[i]);
+        }
+    }
+
+out:
+    for (i = 0; i < BDRV_MAX_IOTYPE; i++) {
+        g_free(arrays[i]);
+    }
+}
+
+void qmp_block_latency_histogram_reset(const char *device, Error **errp)
+{
+    BlockDriverState *bs;
+
+    bs = bdrv_find(device);
+    if (!bs) {
+        error_set(errp, QERR_DEVICE_NOT_FOUND, device);
+        return;
+    }
+
+    bdrv_reset_latency_histograms(bs);
+}
+
 void qmp_block_resize(const char *device, int64_t size, Error **errp)
 {
     BlockDriverState *bs;
@@ -1110,6 +1291,7 @@ static void block_job_cb(void *opaque, int ret)
 void qmp_block_stream(const char *device, bool has_base,
                       const char *base, bool has_speed, int64_t speed,
                       bool has_on_error, BlockdevOnError on_error,
+                      bool has_max_in_flight, int64_t max_in_flight,
                       Error **errp)
 {
     BlockDriverState *bs;
@@ -1134,7 +1316,13 @@ void qmp_block_stream(const char *device, bool has_base,
         }
     }
 
+    if (has_max_in_flight && (max_in_flight < 1 || max_in_flight > INT_MAX)) {
+        error_set(errp, QERR_INVALID_PARAMETER, "max-in-flight");
+        return;
+    }
+
     stream_start(bs, base_bs, base, has_speed ? speed : 0,
+                 has_max_in_flight ? max_in_flight : 0,
                  on_error, block_job_cb, bs, &local_err);
     if (error_is_set(&local_err)) {
         error_propagate(errp, local_err);
@@ -1152,6 +1340,7 @@ void qmp_block_stream(const char *device, bool has_base,
 void qmp_block_commit(const char *device,
                       bool has_base, const char *base, const char *top,
                       bool has_speed, int64_t speed,
+                      bool has_max_in_flight, int64_t max_in_flight,
                       Error **errp)
 {
     BlockDriverState *bs;
@@ -1196,8 +1385,14 @@ void qmp_block_commit(const char *device,
         return;
     }
 
-    commit_start(bs, base_bs, top_bs, speed, on_error, block_job_cb, bs,
-                &local_err);
+    if (has_max_in_flight && (max_in_flight < 1 || max_in_flight > INT_MAX)) {
+        error_set(errp, QERR_INVALID_PARAMETER, "max-in-flight");
+        return;
+    }
+
+    commit_start(bs, base_bs, top_bs, speed,
+                 has_max_in_flight ? max_in_flight : 0,
+                 on_error, block_job_cb, bs, &local_err);
     if (local_err != NULL) {
         error_propagate(errp, local_err);
         return;
@@ -1219,6 +1414,7 @@ void qmp_drive_mirror(const char *device, const char *target,
                       bool has_buf_size, int64_t buf_size,
                       bool has_on_source_error, BlockdevOnError on_source_error,
                       bool has_on_target_error, BlockdevOnError on_target_error,
+                      bool has_copy_mode, MirrorCopyMode copy_mode,
                       Error **errp)
 {
     BlockDriverState *bs;
@@ -1339,6 +1535,7 @@ void qmp_drive_mirror(const char *device, const char *target,
     }
 
     mirror_start(bs, target_bs, speed, granularity, buf_size, sync,
+                 has_copy_mode ? copy_mode : MIRROR_COPY_MODE_BACKGROUND,
                  on_source_error, on_target_error,
                  block_job_cb, bs, &local_err);
     if (local_err != NULL) {
@@ -1353,6 +1550,220 @@ void qmp_drive_mirror(const char *device, const char *target,
     drive_get_ref(drive_get_by_blockdev(bs));
 }
 
+static BdrvDirtyBitmap *find_dirty_bitmap(const char *device,
+                                          const char *name,
+                                          BlockDriverState **pbs,
+                                          Error **errp)
+{
+    BlockDriverState *bs;
+    BdrvDirtyBitmap *bitmap;
+
+    bs = bdrv_find(device);
+    if (!bs) {
+        error_set(errp, QERR_DEVICE_NOT_FOUND, device);
+        return NULL;
+    }
+
+    bitmap = bdrv_find_dirty_bitmap(bs, name);
+    if (!bitmap) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "name",
+                  "the name of a dirty bitmap of the device");
+        return NULL;
+    }
+
+    if (pbs) {
+        *pbs = bs;
+    }
+    return bitmap;
+}
+
+void qmp_block_dirty_bitmap_add(const char *device, const char *name,
+                                bool has_granularity, uint32_t granularity,
+                                bool has_persistent, bool persistent,
+                                Error **errp)
+{
+    BlockDriverState *bs;
+    BdrvDirtyBitmap *bitmap;
+
+    if (!has_granularity) {
+        granularity = 65536;
+    }
+    if (!has_persistent) {
+        persistent = false;
+    }
+
+    bs = bdrv_find(device);
+    if (!bs) {
+        error_set(errp, QERR_DEVICE_NOT_FOUND, device);
+        return;
+    }
+
+    if (!bdrv_is_inserted(bs)) {
+        error_set(errp, QERR_DEVICE_HAS_NO_MEDIUM, device);
+        return;
+    }
+
+    if (persistent && (!bs->drv->bdrv_can_store_dirty_bitmaps ||
+                       !bs->drv->bdrv_can_store_dirty_bitmaps(bs))) {
+        error_set(errp, QERR_BLOCK_FORMAT_FEATURE_NOT_SUPPORTED,
+                  bs->drv->format_name, device, "persistent dirty bitmaps");
+        return;
+    }
+
+    bitmap = bdrv_create_dirty_bitmap(bs, name, granularity, errp);
+    if (bitmap) {
+        bitmap->persistent = persistent;
+    }
+}
+
+void qmp_block_dirty_bitmap_remove(const char *device, const char *name,
+                                   Error **errp)
+{
+    BlockDriverState *bs;
+    BdrvDirtyBitmap *bitmap;
+
+    bitmap = find_dirty_bitmap(device, name, &bs, errp);
+    if (!bitmap) {
+        return;
+    }
+
+    if (bitmap->busy) {
+        error_set(errp, QERR_DEVICE_IN_USE, name);
+        return;
+    }
+    bdrv_release_dirty_bitmap(bs, bitmap);
+}
+
+void qmp_block_dirty_bitmap_clear(const char *device, const char *name,
+                                  Error **errp)
+{
+    BlockDriverState *bs;
+    BdrvDirtyBitmap *bitmap;
+
+    bitmap = find_dirty_bitmap(device, name, &bs, errp);
+    if (!bitmap) {
+        return;
+    }
+
+    if (bitmap->busy) {
+        error_set(errp, QERR_DEVICE_IN_USE, name);
+        return;
+    }
+    bdrv_clear_dirty_bitmap(bs, bitmap);
+}
+
+void qmp_drive_backup(const char *device, const char *target,
+                      bool has_format, const char *format,
+                      bool has_mode, enum NewImageMode mode,
+                      bool has_bitmap, const char *bitmap_name,
+                      bool has_speed, int64_t speed,
+                      bool has_on_source_error, BlockdevOnError on_source_error,
+                      bool has_on_target_error, BlockdevOnError on_target_error,
+                      Error **errp)
+{
+    BlockDriverState *bs;
+    BlockDriverState *target_bs;
+    BlockDriver *drv = NULL;
+    BdrvDirtyBitmap *bitmap = NULL;
+    Error *local_err = NULL;
+    int flags;
+    uint64_t size;
+    int ret;
+
+    if (!has_speed) {
+        speed = 0;
+    }
+    if (!has_on_source_error) {
+        on_source_error = BLOCKDEV_ON_ERROR_REPORT;
+    }
+    if (!has_on_target_error) {
+        on_target_error = BLOCKDEV_ON_ERROR_REPORT;
+    }
+    if (!has_mode) {
+        mode = NEW_IMAGE_MODE_ABSOLUTE_PATHS;
+    }
+
+    if (has_bitmap) {
+        bitmap = find_dirty_bitmap(device, bitmap_name, &bs, errp);
+        if (!bitmap) {
+            return;
+        }
+    } else {
+        bs = bdrv_find(device);
+        if (!bs) {
+            error_set(errp, QERR_DEVICE_NOT_FOUND, device);
+            return;
+        }
+    }
+
+    if (!bdrv_is_inserted(bs)) {
+        error_set(errp, QERR_DEVICE_HAS_NO_MEDIUM, device);
+        return;
+    }
+
+    if (!has_format) {
+        format = mode == NEW_IMAGE_MODE_EXISTING ? NULL : bs->drv->format_name;
+    }
+    if (format) {
+        drv = bdrv_find_format(format);
+        if (!drv) {
+            error_set(errp, QERR_INVALID_BLOCK_FORMAT, format);
+            return;
+        }
+    }
+
+    if (bdrv_in_use(bs)) {
+        error_set(errp, QERR_DEVICE_IN_USE, device);
+        return;
+    }
+    if (bitmap && bitmap->busy) {
+        error_set(errp, QERR_DEVICE_IN_USE, bitmap_name);
+        return;
+    }
+
+    flags = bs->open_flags | BDRV_O_RDWR;
+
+    if (mode != NEW_IMAGE_MODE_EXISTING) {
+        /* create new image w/o backing file */
+        assert(format && drv);
+        bdrv_get_geometry(bs, &size);
+        bdrv_img_create(target, format, NULL, NULL, NULL,
+                        size * BDRV_SECTOR_SIZE, flags, &local_err, false);
+        if (error_is_set(&local_err)) {
+            error_propagate(errp, local_err);
+            return;
+        }
+    }
+
+    /* An existing target keeps its backing file, normally the previous
+     * backup, because an incremental backup only writes the dirty sectors.
+     */
+    target_bs = bdrv_new("");
+    ret = bdrv_open(target_bs, target, flags, drv);
+    if (ret < 0) {
+        bdrv_delete(target_bs);
+        error_set(errp, QERR_OPEN_FILE_FAILED, target);
+        return;
+    }
+
+    /* The point in time of the backup is when the job starts; writes that
+     * are in flight must be part of it, or not at all */
+    bdrv_drain_all();
+
+    backup_start(bs, target_bs, bitmap, speed, on_source_error,
+                 on_target_error, block_job_cb, bs, &local_err);
+    if (local_err != NULL) {
+        bdrv_delete(target_bs);
+        error_propagate(errp, local_err);
+        return;
+    }
+
+    /* Grab a reference so hotplug does not delete the BlockDriverState from
+     * underneath us.
+     */
+    drive_get_ref(drive_get_by_blockdev(bs));
+}
+
 static BlockJob *find_block_job(const char *device)
 {
     BlockDriverState *bs;
@@ -1364,16 +1775,26 @@ static BlockJob *find_block_job(const char *device)
     return bs->job;
 }
 
-void qmp_block_job_set_speed(const char *device, int64_t speed, Error **errp)
+void qmp_block_job_set_speed(const char *device, int64_t speed,
+                             bool has_priority, BlockJobPriority priority,
+                             Error **errp)
 {
     BlockJob *job = find_block_job(device);
+    Error *local_err = NULL;
 
     if (!job) {
         error_set(errp, QERR_BLOCK_JOB_NOT_ACTIVE, device);
         return;
     }
 
-    block_job_set_speed(job, speed, errp);
+    block_job_set_speed(job, speed, &local_err);
+    if (error_is_set(&local_err)) {
+        error_propagate(errp, local_err);
+        return;
+    }
+    if (has_priority) {
+        block_job_set_priority(job, priority);
+    }
 }
 
 void qmp_block_job_cancel(const char *device,
@@ -1568,10 +1989,58 @@ QemuOptsList qemu_drive_opts = {
             .name = "bps_wr",
             .type = QEMU_OPT_NUMBER,
             .help = "limit write bytes per second",
+        },{
+            .name = "iops_max",
+            .type = QEMU_OPT_NUMBER,
+            .help = "I/O operations burst",
+        },{
+            .name = "iops_rd_max",
+            .type = QEMU_OPT_NUMBER,
+            .help = "read operations burst",
+        },{
+            .name = "iops_wr_max",
+            .type = QEMU_OPT_NUMBER,
+            .help = "write operations burst",
+        },{
+            .name = "bps_max",
+            .type = QEMU_OPT_NUMBER,
+            .help = "total bytes burst",
+        },{
+            .name = "bps_rd_max",
+            .type = QEMU_OPT_NUMBER,
+            .help = "read bytes burst",
+        },{
+            .name = "bps_wr_max",
+            .type = QEMU_OPT_NUMBER,
+            .help = "write bytes burst",
+        },{
+            .name = "iops_size",
+            .type = QEMU_OPT_NUMBER,
+            .help = "when limiting by iops max size of an I/O in bytes",
+        },{
+            .name = "group",
+            .type = QEMU_OPT_STRING,
+            .help = "name of the throttle group the drive shares limits with",
         },{
             .name = "copy-on-read",
             .type = QEMU_OPT_BOOL,
             .help = "copy read data from backing file into image file",
+        },{
+            .name = "merge",
+            .type = QEMU_OPT_BOOL,
+            .help = "merge adjacent requests before submitting them",
+        },{
+            .name = "l2-cache-coverage",
+            .type = QEMU_OPT_SIZE,
+            .help = "virtual disk size whose mapping is cached in memory",
+        },{
+            .name = "shared-cache",
+            .type = QEMU_OPT_STRING,
+            .help = "file that caches read-only images for all processes",
+        },{
+            .name = "shared-cache-size",
+            .type = QEMU_OPT_SIZE,
+            .help = "size of the shared cache file when it is created",
         },{
             .name = "boot",
             .type = QEMU_OPT_BOOL,
@@ -35,6 +35,13 @@
 #include "qmp-commands.h"
 #include "qemu/timer.h"
 
+/* Guest requests are sampled at this interval */
+#define SCHED_SAMPLE_NS   10000000LL
+/* How long background I/O waits while the guest is busy */
+#define SCHED_BACKOFF_NS  10000000LL
+/* Guest queue depth at which low priority I/O backs off */
+#define SCHED_GUEST_DEPTH 4
+
 void *block_job_create(const BlockJobType *job_type, BlockDriverState *bs,
                        int64_t speed, BlockDriverCompletionFunc *cb,
                        void *opaque, Error **errp)
@@ -54,6 +61,7 @@ void *block_job_create(const BlockJobType *job_type, BlockDriverState *bs,
     job->opaque        = opaque;
     job->busy          = true;
     bs->job = job;
+    block_job_sched_init(&job->sched, BLOCK_JOB_PRIORITY_LOW);
 
     /* Only set speed when necessary to avoid NotSupported error */
     if (speed != 0) {
@@ -84,19 +92,113 @@ void block_job_completed(BlockJob *job, int ret)
 
 void block_job_set_speed(BlockJob *job, int64_t speed, Error **errp)
 {
-    Error *local_err = NULL;
-
-    if (!job->job_type->set_speed) {
-        error_set(errp, QERR_NOT_SUPPORTED);
+    if (speed < 0) {
+        error_set(errp, QERR_INVALID_PARAMETER, "speed");
         return;
     }
-    job->job_type->set_speed(job, speed, &local_err);
-    if (error_is_set(&local_err)) {
-        error_propagate(errp, local_err);
+    block_job_sched_set_speed(&job->sched, speed);
+    job->speed = speed;
+}
+
+void block_job_set_priority(BlockJob *job, BlockJobPriority priority)
+{
+    job->sched.priority = priority;
+    job->sched.backoff_start_ns = 0;
+}
+
+void block_job_sched_init(BlockJobSched *sched, BlockJobPriority priority)
+{
+    memset(sched, 0, sizeof(*sched));
+    sched->priority = priority;
+}
+
+void block_job_sched_set_speed(BlockJobSched *sched, int64_t speed)
+{
+    sched->speed = speed;
+    ratelimit_set_speed(&sched->limit, speed / BDRV_SECTOR_SIZE,
+                        BLOCK_JOB_SLICE_TIME);
+}
+
+static void block_job_sched_sample(BlockJobSched *sched, BlockDriverState *bs,
+                                   int64_t now)
+{
+    uint64_t ops = 0, time_ns = 0;
+    int i;
+
+    if (sched->sample_start_ns &&
+        now - sched->sample_start_ns < SCHED_SAMPLE_NS) {
         return;
     }
 
-    job->speed = speed;
+    for (i = 0; i < BDRV_MAX_IOTYPE; i++) {
+        ops += bs->nr_ops[i];
+        time_ns += bs->total_time_ns[i];
+    }
+
+    if (!sched->sample_start_ns || ops <= sched->sample_ops) {
+        sched->latency_ns = 0;
+    } else {
+        sched->latency_ns = (time_ns - sched->sample_time_ns) /
+                            (ops - sched->sample_ops);
+        if (!sched->baseline_ns || sched->latency_ns < sched->baseline_ns) {
+            sched->baseline_ns = sched->latency_ns;
+        } else {
+            sched->baseline_ns += (sched->latency_ns - sched->baseline_ns) / 64;
+        }
+    }
+
+    sched->sample_start_ns = now;
+    sched->sample_ops = ops;
+    sched->sample_time_ns = time_ns;
+}
+
+static bool block_job_sched_guest_busy(BlockJobSched *sched,
+                                       BlockDriverState *bs)
+{
+    switch (sched->priority) {
+    case BLOCK_JOB_PRIORITY_IDLE:
+        return bs->acct_in_flight > 0 || sched->latency_ns > 0;
+    case BLOCK_JOB_PRIORITY_LOW:
+        return bs->acct_in_flight >= SCHED_GUEST_DEPTH ||
+               sched->latency_ns > 2 * sched->baseline_ns;
+    default:
+        return false;
+    }
+}
+
+int64_t block_job_sched_delay(BlockJobSched *sched, BlockDriverState *bs,
+                              uint64_t n)
+{
+    int64_t now = qemu_get_clock_ns(rt_clock);
+
+    if (sched->priority != BLOCK_JOB_PRIORITY_NORMAL) {
+        block_job_sched_sample(sched, bs, now);
+        if (block_job_sched_guest_busy(sched, bs)) {
+            if (!sched->backoff_start_ns) {
+                sched->backoff_start_ns = now;
+            }
+            /* Low priority I/O gets through once per slice, so that it
+             * still makes progress under constant guest load.  */
+            if (sched->priority == BLOCK_JOB_PRIORITY_IDLE ||
+                now - sched->backoff_start_ns < BLOCK_JOB_SLICE_TIME) {
+                trace_block_job_sched_backoff(sched, bs, bs->acct_in_flight,
+                                              sched->latency_ns,
+                                              sched->baseline_ns);
+                return SCHED_BACKOFF_NS;
+            }
+        }
+        sched->backoff_start_ns = 0;
+    }
+
+    if (sched->speed && n) {
+        return ratelimit_calculate_delay(&sched->limit, n);
+    }
+    return 0;
+}
+
+int64_t block_job_throttle(BlockJob *job, uint64_t n)
+{
+    return block_job_sched_delay(&job->sched, job->bs, n);
 }
 
 void block_job_complete(BlockJob *job, Error **errp)
@@ -215,6 +317,7 @@ BlockJobInfo *block_job_query(BlockJob *job)
     info->paused    = job->paused;
     info->offset    = job->offset;
     info->speed     = job->speed;
+    info->priority  = job->sched.priority;
     info->io_status = job->iostatus;
     return info;
 }
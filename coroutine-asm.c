@@ -0,0 +1,289 @@
+/*
+ * Coroutine context switch in assembly
+ *
+ * Only the callee-saved registers are saved, on the stack of the
+ * coroutine that is left, and no signal mask is touched.  Supported on
+ * x86-64 and AArch64 ELF hosts; other hosts use coroutine-ucontext.c.
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "qemu-common.h"
+#include "block/coroutine_int.h"
+
+#ifdef CONFIG_VALGRIND_H
+#include <valgrind/valgrind.h>
+#endif
+
+typedef struct {
+    Coroutine base;
+    void *stack;
+    /* Stack pointer saved by coroutine_asm_swap() while not running */
+    void *sp;
+
+#ifdef CONFIG_VALGRIND_H
+    unsigned int valgrind_stack_id;
+#endif
+
+} CoroutineAsm;
+
+/**
+ * Per-thread coroutine bookkeeping
+ */
+typedef struct {
+    /** Currently executing coroutine */
+    Coroutine *current;
+
+    /** The default coroutine */
+    CoroutineAsm leader;
+
+    /** Stacks mapped by qemu_alloc_stacks() but not used yet */
+    void *stacks[COROUTINE_STACK_BATCH];
+    int n_stacks;
+} CoroutineThreadState;
+
+static pthread_key_t thread_state_key;
+
+/*
+ * Save the callee-saved registers on the current stack, store the stack
+ * pointer in *@from_sp and resume the coroutine that saved @to_sp.
+ * There, the call returns @action.
+ */
+CoroutineAction coroutine_asm_swap(void **from_sp, void *to_sp,
+                                   CoroutineAction action);
+
+/* First code run by a coroutine, called by coroutine_asm_start */
+void coroutine_asm_trampoline(CoroutineAsm *self) QEMU_NORETURN;
+
+#if defined(__x86_64__)
+
+/* Frame popped by coroutine_asm_swap: r15, r14, r13, r12, rbx, rbp and
+ * the return address.  rbx holds the coroutine when it first starts.
+ */
+#define FRAME_WORDS 7
+#define FRAME_SELF  4
+#define FRAME_PC    6
+
+asm(".text\n"
+    ".globl coroutine_asm_swap\n"
+    ".hidden coroutine_asm_swap\n"
+    ".type coroutine_asm_swap, @function\n"
+    "coroutine_asm_swap:\n"
+    "    pushq %rbp\n"
+    "    pushq %rbx\n"
+    "    pushq %r12\n"
+    "    pushq %r13\n"
+    "    pushq %r14\n"
+    "    pushq %r15\n"
+    "    movq %rsp, (%rdi)\n"
+    "    movq %rsi, %rsp\n"
+    "    popq %r15\n"
+    "    popq %r14\n"
+    "    popq %r13\n"
+    "    popq %r12\n"
+    "    popq %rbx\n"
+    "    popq %rbp\n"
+    "    movl %edx, %eax\n"
+    "    ret\n"
+    ".size coroutine_asm_swap, .-coroutine_asm_swap\n"
+    "\n"
+    ".globl coroutine_asm_start\n"
+    ".hidden coroutine_asm_start\n"
+    ".type coroutine_asm_start, @function\n"
+    "coroutine_asm_start:\n"
+    "    movq %rbx, %rdi\n"
+    "    call coroutine_asm_trampoline\n"
+    "    ud2\n"
+    ".size coroutine_asm_start, .-coroutine_asm_start\n");
+
+#elif defined(__aarch64__)
+
+/* Frame popped by coroutine_asm_swap: x19-x28, x29, x30 and d8-d15.
+ * x19 holds the coroutine when it first starts, x30 is the return
+ * address.
+ */
+#define FRAME_WORDS 20
+#define FRAME_SELF  0
+#define FRAME_PC    11
+
+asm(".text\n"
+    ".globl coroutine_asm_swap\n"
+    ".hidden coroutine_asm_swap\n"
+    ".type coroutine_asm_swap, %function\n"
+    "coroutine_asm_swap:\n"
+    "    sub sp, sp, #160\n"
+    "    stp x19, x20, [sp, #0]\n"
+    "    stp x21, x22, [sp, #16]\n"
+    "    stp x23, x24, [sp, #32]\n"
+    "    stp x25, x26, [sp, #48]\n"
+    "    stp x27, x28, [sp, #64]\n"
+    "    stp x29, x30, [sp, #80]\n"
+    "    stp d8, d9, [sp, #96]\n"
+    "    stp d10, d11, [sp, #112]\n"
+    "    stp d12, d13, [sp, #128]\n"
+    "    stp d14, d15, [sp, #144]\n"
+    "    mov x3, sp\n"
+    "    str x3, [x0]\n"
+    "    mov sp, x1\n"
+    "    ldp x19, x20, [sp, #0]\n"
+    "    ldp x21, x22, [sp, #16]\n"
+    "    ldp x23, x24, [sp, #32]\n"
+    "    ldp x25, x26, [sp, #48]\n"
+    "    ldp x27, x28, [sp, #64]\n"
+    "    ldp x29, x30, [sp, #80]\n"
+    "    ldp d8, d9, [sp, #96]\n"
+    "    ldp d10, d11, [sp, #112]\n"
+    "    ldp d12, d13, [sp, #128]\n"
+    "    ldp d14, d15, [sp, #144]\n"
+    "    add sp, sp, #160\n"
+    "    mov w0, w2\n"
+    "    ret\n"
+    ".size coroutine_asm_swap, .-coroutine_asm_swap\n"
+    "\n"
+    ".globl coroutine_asm_start\n"
+    ".hidden coroutine_asm_start\n"
+    ".type coroutine_asm_start, %function\n"
+    "coroutine_asm_start:\n"
+    "    mov x0, x19\n"
+    "    bl coroutine_asm_trampoline\n"
+    "    brk #0\n"
+    ".size coroutine_asm_start, .-coroutine_asm_start\n");
+
+#else
+#error "coroutine-asm.c does not support this host"
+#endif
+
+extern const char coroutine_asm_start[];
+
+static CoroutineThreadState *coroutine_get_thread_state(void)
+{
+    CoroutineThreadState *s = pthread_getspecific(thread_state_key);
+
+    if (!s) {
+        s = g_malloc0(sizeof(*s));
+        s->current = &s->leader.base;
+        pthread_setspecific(thread_state_key, s);
+    }
+    return s;
+}
+
+static void qemu_coroutine_thread_cleanup(void *opaque)
+{
+    CoroutineThreadState *s = opaque;
+
+    while (s->n_stacks) {
+        qemu_free_stack(s->stacks[--s->n_stacks], COROUTINE_STACK_SIZE);
+    }
+    g_free(s);
+}
+
+static void *coroutine_stack_alloc(CoroutineThreadState *s)
+{
+    if (!s->n_stacks) {
+        qemu_alloc_stacks(s->stacks, COROUTINE_STACK_BATCH,
+                          COROUTINE_STACK_SIZE);
+        s->n_stacks = COROUTINE_STACK_BATCH;
+    }
+    return s->stacks[--s->n_stacks];
+}
+
+static void __attribute__((constructor)) coroutine_init(void)
+{
+    int ret;
+
+    ret = pthread_key_create(&thread_state_key, qemu_coroutine_thread_cleanup);
+    if (ret != 0) {
+        fprintf(stderr, "unable to create leader key: %s\n", strerror(errno));
+        abort();
+    }
+}
+
+void coroutine_asm_trampoline(CoroutineAsm *self)
+{
+    Coroutine *co = &self->base;
+
+    while (true) {
+        co->entry(co->entry_arg);
+        qemu_coroutine_switch(co, co->caller, COROUTINE_TERMINATE);
+    }
+}
+
+Coroutine *qemu_coroutine_new(void)
+{
+    CoroutineAsm *co;
+    uintptr_t *frame;
+
+    co = g_malloc0(sizeof(*co));
+    co->stack = coroutine_stack_alloc(coroutine_get_thread_state());
+
+#ifdef CONFIG_VALGRIND_H
+    co->valgrind_stack_id =
+        VALGRIND_STACK_REGISTER(co->stack, co->stack + COROUTINE_STACK_SIZE);
+#endif
+
+    /* The top of the stack is page aligned, so the stack pointer is
+     * 16-byte aligned when coroutine_asm_start calls the trampoline.
+     */
+    frame = (uintptr_t *)(co->stack + COROUTINE_STACK_SIZE) - FRAME_WORDS;
+    memset(frame, 0, FRAME_WORDS * sizeof(*frame));
+    frame[FRAME_SELF] = (uintptr_t)co;
+    frame[FRAME_PC] = (uintptr_t)coroutine_asm_start;
+    co->sp = frame;
+
+    return &co->base;
+}
+
+#ifdef CONFIG_VALGRIND_H
+#ifdef CONFIG_PRAGMA_DIAGNOSTIC_AVAILABLE
+/* Work around an unused variable in the valgrind.h macro... */
+#pragma GCC diagnostic ignored "-Wunused-but-set-variable"
+#endif
+static inline void valgrind_stack_deregister(CoroutineAsm *co)
+{
+    VALGRIND_STACK_DEREGISTER(co->valgrind_stack_id);
+}
+#ifdef CONFIG_PRAGMA_DIAGNOSTIC_AVAILABLE
+#pragma GCC diagnostic error "-Wunused-but-set-variable"
+#endif
+#endif
+
+void qemu_coroutine_delete(Coroutine *co_)
+{
+    CoroutineAsm *co = DO_UPCAST(CoroutineAsm, base, co_);
+
+#ifdef CONFIG_VALGRIND_H
+    valgrind_stack_deregister(co);
+#endif
+
+    qemu_free_stack(co->stack, COROUTINE_STACK_SIZE);
+    g_free(co);
+}
+
+CoroutineAction qemu_coroutine_switch(Coroutine *from_, Coroutine *to_,
+                                      CoroutineAction action)
+{
+    CoroutineAsm *from = DO_UPCAST(CoroutineAsm, base, from_);
+    CoroutineAsm *to = DO_UPCAST(CoroutineAsm, base, to_);
+    CoroutineThreadState *s = coroutine_get_thread_state();
+
+    s->current = to_;
+    return coroutine_asm_swap(&from->sp, to->sp, action);
+}
+
+Coroutine *qemu_coroutine_self(void)
+{
+    CoroutineThreadState *s = coroutine_get_thread_state();
+
+    return s->current;
+}
+
+bool qemu_in_coroutine(void)
+{
+    CoroutineThreadState *s = pthread_getspecific(thread_state_key);
+
+    return s && s->current->caller;
+}
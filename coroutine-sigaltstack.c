@@ -49,6 +49,10 @@ typedef struct {
     /** The default coroutine */
     CoroutineUContext leader;
 
+    /** Stacks mapped by qemu_alloc_stacks() but not used yet */
+    void *stacks[COROUTINE_STACK_BATCH];
+    int n_stacks;
+
     /** Information for the signal handler (trampoline) */
     sigjmp_buf tr_reenter;
     volatile sig_atomic_t tr_called;
@@ -73,9 +77,22 @@ static void qemu_coroutine_thread_cleanup(void *opaque)
 {
     CoroutineThreadState *s = opaque;
 
+    while (s->n_stacks) {
+        qemu_free_stack(s->stacks[--s->n_stacks], COROUTINE_STACK_SIZE);
+    }
     g_free(s);
 }
 
+static void *coroutine_stack_alloc(CoroutineThreadState *s)
+{
+    if (!s->n_stacks) {
+        qemu_alloc_stacks(s->stacks, COROUTINE_STACK_BATCH,
+                          COROUTINE_STACK_SIZE);
+        s->n_stacks = COROUTINE_STACK_BATCH;
+    }
+    return s->stacks[--s->n_stacks];
+}
+
 static void __attribute__((constructor)) coroutine_init(void)
 {
     int ret;
@@ -146,7 +163,7 @@ static void coroutine_trampoline(int signal)
 
 Coroutine *qemu_coroutine_new(void)
 {
-    const size_t stack_size = 1 << 20;
+    const size_t stack_size = COROUTINE_STACK_SIZE;
     CoroutineUContext *co;
     CoroutineThreadState *coTS;
     struct sigaction sa;
@@ -166,11 +183,11 @@ Coroutine *qemu_coroutine_new(void)
      * sigaltstack way of manipulating stacks.
      */
 
+    coTS = coroutine_get_thread_state();
     co = g_malloc0(sizeof(*co));
-    co->stack = g_malloc(stack_size);
+    co->stack = coroutine_stack_alloc(coTS);
     co->base.entry_arg = &old_env; /* stash away our jmp_buf */
 
-    coTS = coroutine_get_thread_state();
     coTS->tr_handler = co;
 
     /*
@@ -256,7 +273,7 @@ void qemu_coroutine_delete(Coroutine *co_)
 {
     CoroutineUContext *co = DO_UPCAST(CoroutineUContext, base, co_);
 
-    g_free(co->stack);
+    qemu_free_stack(co->stack, COROUTINE_STACK_SIZE);
     g_free(co);
 }
 
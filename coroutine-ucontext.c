@@ -54,6 +54,10 @@ typedef struct {
 
     /** The default coroutine */
     CoroutineUContext leader;
+
+    /** Stacks mapped by qemu_alloc_stacks() but not used yet */
+    void *stacks[COROUTINE_STACK_BATCH];
+    int n_stacks;
 } CoroutineThreadState;
 
 static pthread_key_t thread_state_key;
@@ -84,9 +88,22 @@ static void qemu_coroutine_thread_cleanup(void *opaque)
 {
     CoroutineThreadState *s = opaque;
 
+    while (s->n_stacks) {
+        qemu_free_stack(s->stacks[--s->n_stacks], COROUTINE_STACK_SIZE);
+    }
     g_free(s);
 }
 
+static void *coroutine_stack_alloc(CoroutineThreadState *s)
+{
+    if (!s->n_stacks) {
+        qemu_alloc_stacks(s->stacks, COROUTINE_STACK_BATCH,
+                          COROUTINE_STACK_SIZE);
+        s->n_stacks = COROUTINE_STACK_BATCH;
+    }
+    return s->stacks[--s->n_stacks];
+}
+
 static void __attribute__((constructor)) coroutine_init(void)
 {
     int ret;
@@ -122,7 +139,7 @@ static void coroutine_trampoline(int i0, int i1)
 
 Coroutine *qemu_coroutine_new(void)
 {
-    const size_t stack_size = 1 << 20;
+    const size_t stack_size = COROUTINE_STACK_SIZE;
     CoroutineUContext *co;
     ucontext_t old_uc, uc;
     sigjmp_buf old_env;
@@ -141,7 +158,7 @@ Coroutine *qemu_coroutine_new(void)
     }
 
     co = g_malloc0(sizeof(*co));
-    co->stack = g_malloc(stack_size);
+    co->stack = coroutine_stack_alloc(coroutine_get_thread_state());
     co->base.entry_arg = &old_env; /* stash away our jmp_buf */
 
     uc.uc_link = &old_uc;
@@ -188,7 +205,7 @@ void qemu_coroutine_delete(Coroutine *co_)
     valgrind_stack_deregister(co);
 #endif
 
-    g_free(co->stack);
+    qemu_free_stack(co->stack, COROUTINE_STACK_SIZE);
     g_free(co);
 }
 
@@ -21,10 +21,56 @@
 #include "disas/disas.h"
 #include "tcg.h"
 #include "qemu/atomic.h"
+#include "qemu/timer.h"
 #include "sysemu/qtest.h"
+#include "sysemu/cpus.h"
+#include "qemu/main-loop.h"
+#include "qemu/rcu.h"
+#if defined(CONFIG_SOFTMMU)
+#include "exec/address-spaces.h"
+#endif
 
 //#define CONFIG_DEBUG_EXEC
 
+#if !defined(CONFIG_USER_ONLY)
+/* With multi-threaded TCG the vCPU runs translated code without the
+   iothread lock; it is only taken to deliver interrupts, which talks
+   to the interrupt controllers.  */
+static inline void cpu_exec_lock_iothread(void)
+{
+    if (mttcg_enabled) {
+        qemu_mutex_lock_iothread();
+    }
+}
+
+static inline void cpu_exec_unlock_iothread(void)
+{
+    if (mttcg_enabled) {
+        qemu_mutex_unlock_iothread();
+    }
+}
+
+/* drop the iothread lock if a longjmp left it taken */
+static inline void cpu_exec_reset_iothread(void)
+{
+    if (mttcg_enabled && qemu_mutex_iothread_locked()) {
+        qemu_mutex_unlock_iothread();
+    }
+}
+#else
+static inline void cpu_exec_lock_iothread(void)
+{
+}
+
+static inline void cpu_exec_unlock_iothread(void)
+{
+}
+
+static inline void cpu_exec_reset_iothread(void)
+{
+}
+#endif
+
 bool qemu_cpu_has_work(CPUState *cpu)
 {
     return cpu_has_work(cpu);
@@ -81,57 +127,100 @@ static void cpu_exec_nocache(CPUArchState *env, int max_cycles,
     tb_free(tb);
 }
 
+/* With -machine tcg-profile, TBs are not chained: each one is run on its
+   own and charged the host ticks that it took.  */
+static tcg_target_ulong cpu_exec_profile(CPUArchState *env,
+                                         TranslationBlock *tb)
+{
+    int64_t start = cpu_get_real_ticks();
+    tcg_target_ulong next_tb;
+
+    tcg_helper_ticks = 0;
+    next_tb = tcg_qemu_tb_exec(env, tb->tc_ptr);
+    /* a TB left before its first instruction did not run */
+    if ((next_tb & 3) != 3) {
+        tcg_ctx.tb_ctx.tb_prof_exec_count++;
+        tcg_ctx.tb_ctx.tb_prof_exec_insns += tb->icount;
+        tb->prof_count++;
+        tb->prof_ticks += cpu_get_real_ticks() - start;
+        tb->prof_helper_ticks += tcg_helper_ticks;
+    }
+    return next_tb;
+}
+
+typedef struct TBLookupDesc {
+    CPUArchState *env;
+    target_ulong pc;
+    target_ulong cs_base;
+    uint64_t flags;
+    tb_page_addr_t phys_page1;
+} TBLookupDesc;
+
+static bool tb_lookup_cmp(const void *p, const void *userp)
+{
+    const TranslationBlock *tb = p;
+    const TBLookupDesc *desc = userp;
+
+    if (tb->pc == desc->pc &&
+        tb->page_addr[0] == desc->phys_page1 &&
+        tb->cs_base == desc->cs_base &&
+        tb->flags == desc->flags) {
+        /* check next page if needed */
+        if (tb->page_addr[1] != -1) {
+            target_ulong virt_page2;
+
+            virt_page2 = (desc->pc & TARGET_PAGE_MASK) + TARGET_PAGE_SIZE;
+            return tb->page_addr[1] == get_page_addr_code(desc->env,
+                                                          virt_page2);
+        }
+        return true;
+    }
+    return false;
+}
+
 static TranslationBlock *tb_find_slow(CPUArchState *env,
                                       target_ulong pc,
                                       target_ulong cs_base,
                                       uint64_t flags)
 {
-    TranslationBlock *tb, **ptb1;
-    unsigned int h;
-    tb_page_addr_t phys_pc, phys_page1;
-    target_ulong virt_page2;
+    TranslationBlock *tb;
+    TBLookupDesc desc;
+    tb_page_addr_t phys_pc;
 
     tcg_ctx.tb_ctx.tb_invalidated_flag = 0;
 
     /* find translated block using physical mappings */
     phys_pc = get_page_addr_code(env, pc);
-    phys_page1 = phys_pc & TARGET_PAGE_MASK;
-    h = tb_phys_hash_func(phys_pc);
-    ptb1 = &tcg_ctx.tb_ctx.tb_phys_hash[h];
-    for(;;) {
-        tb = *ptb1;
-        if (!tb)
-            goto not_found;
-        if (tb->pc == pc &&
-            tb->page_addr[0] == phys_page1 &&
-            tb->cs_base == cs_base &&
-            tb->flags == flags) {
-            /* check next page if needed */
-            if (tb->page_addr[1] != -1) {
-                tb_page_addr_t phys_page2;
-
-                virt_page2 = (pc & TARGET_PAGE_MASK) +
-                    TARGET_PAGE_SIZE;
-                phys_page2 = get_page_addr_code(env, virt_page2);
-                if (tb->page_addr[1] == phys_page2)
-                    goto found;
-            } else {
-                goto found;
-            }
+    desc.env = env;
+    desc.pc = pc;
+    desc.cs_base = cs_base;
+    desc.flags = flags;
+    desc.phys_page1 = phys_pc & TARGET_PAGE_MASK;
+    tb = qht_lookup(&tcg_ctx.tb_ctx.htable, tb_lookup_cmp, &desc,
+                    tb_hash_func(phys_pc, pc, flags));
+    tcg_ctx.tb_ctx.tb_lookup_count++;
+    if (tb) {
+        tcg_ctx.tb_ctx.tb_lookup_hit_count++;
+    } else {
+#if defined(CONFIG_USER_ONLY)
+        spin_lock(&tcg_ctx.tb_ctx.tb_lock);
+        /* another thread may have translated it meanwhile */
+        tb = qht_lookup(&tcg_ctx.tb_ctx.htable, tb_lookup_cmp, &desc,
+                        tb_hash_func(phys_pc, pc, flags));
+        if (!tb) {
+            /* an earlier run may have translated it already */
+            tb = tb_cache_find(env, pc, cs_base, flags);
         }
-        ptb1 = &tb->phys_hash_next;
-    }
- not_found:
-   /* if no translated code available, then translate it now */
-    tb = tb_gen_code(env, pc, cs_base, flags, 0);
-
- found:
-    /* Move the last found TB to the head of the list */
-    if (likely(*ptb1)) {
-        *ptb1 = tb->phys_hash_next;
-        tb->phys_hash_next = tcg_ctx.tb_ctx.tb_phys_hash[h];
-        tcg_ctx.tb_ctx.tb_phys_hash[h] = tb;
+#endif
+        /* if no translated code available, then translate it now */
+        if (!tb) {
+            tb = tb_gen_code(env, pc, cs_base, flags, 0);
+        }
+#if defined(CONFIG_USER_ONLY)
+        spin_unlock(&tcg_ctx.tb_ctx.tb_lock);
+#endif
     }
+
     /* we add the TB in the virtual pc hash table */
     env->tb_jmp_cache[tb_jmp_cache_hash_func(pc)] = tb;
     return tb;
@@ -155,6 +244,56 @@ static inline TranslationBlock *tb_find_fast(CPUArchState *env)
     return tb;
 }
 
+/* Return the host code of the TB for the current state of @env if it is
+   in tb_jmp_cache, else tcg_ctx.code_gen_epilogue so that cpu_exec()
+   looks it up.  Targets call this from their lookup_tb_ptr helper, at
+   the end of TBs that jump to a computed address.  */
+void *tb_lookup_ptr(CPUArchState *env)
+{
+    TranslationBlock *tb;
+    target_ulong cs_base, pc;
+    int flags;
+
+    if (unlikely(tcg_tb_profile)) {
+        /* every TB must be entered from cpu_exec_profile() */
+        return tcg_ctx.code_gen_epilogue;
+    }
+    cpu_get_tb_cpu_state(env, &pc, &cs_base, &flags);
+    tb = env->tb_jmp_cache[tb_jmp_cache_hash_func(pc)];
+    if (unlikely(!tb || tb->pc != pc || tb->cs_base != cs_base ||
+                 tb->flags != flags)) {
+        return tcg_ctx.code_gen_epilogue;
+    }
+    return tb->tc_ptr;
+}
+
+#if defined(CONFIG_USER_ONLY)
+/* Threads of a guest process find their TBs without any lock, since
+   tb_jmp_cache is per CPU and the hash table has lock-free lookups.
+   tb_lock is only taken to translate and to patch jumps.  */
+#define tb_gen_lock()   spin_lock(&tcg_ctx.tb_ctx.tb_lock)
+#define tb_gen_unlock() spin_unlock(&tcg_ctx.tb_ctx.tb_lock)
+#else
+#define tb_gen_lock()   tb_lock()
+#define tb_gen_unlock() tb_unlock()
+#endif
+
+/* Changes whenever TBs are freed and reused */
+static inline unsigned int tb_generation(void)
+{
+    return atomic_read(&tcg_ctx.tb_ctx.tb_flush_count) +
+           atomic_read(&tcg_ctx.tb_ctx.tb_evict_count);
+}
+
+/* Whether @from, which was found while tb_generation() was @gen, may
+   jump directly to @to.  Must be called under tb_gen_lock().  */
+static inline bool tb_can_chain(TranslationBlock *from, TranslationBlock *to,
+                                unsigned int gen)
+{
+    return tb_generation() == gen &&
+           !((from->cflags | to->cflags) & CF_INVALID);
+}
+
 static CPUDebugExcpHandler *debug_excp_handler;
 
 void cpu_set_debug_excp_handler(CPUDebugExcpHandler *handler)
@@ -187,6 +326,7 @@ int cpu_exec(CPUArchState *env)
     TranslationBlock *tb;
     uint8_t *tc_ptr;
     tcg_target_ulong next_tb;
+    unsigned int tb_gen, last_tb_gen = 0;
 
     if (env->halted) {
         if (!cpu_has_work(cpu)) {
@@ -198,6 +338,18 @@ int cpu_exec(CPUArchState *env)
 
     cpu_single_env = env;
 
+#if defined(CONFIG_SOFTMMU)
+    /* The iotlb entries index into env->memory_dispatch, which must stay
+     * alive while translated code runs.  Switch to the current memory map
+     * if it changed since the last flush.
+     */
+    rcu_read_lock();
+    if (env->memory_dispatch !=
+        atomic_rcu_read(&address_space_memory.dispatch)) {
+        tlb_flush(env, 1);
+    }
+#endif
+
     if (unlikely(exit_request)) {
         cpu->exit_request = 1;
     }
@@ -263,8 +415,16 @@ int cpu_exec(CPUArchState *env)
 
             next_tb = 0; /* force lookup of first TB */
             for(;;) {
+                if (mttcg_enabled) {
+                    /* see cpu_unlink_tb(): clear the exit request
+                       before looking at what was requested */
+                    env->tcg_exit_req = 0;
+                    smp_mb();
+                }
                 interrupt_request = env->interrupt_request;
                 if (unlikely(interrupt_request)) {
+                    cpu_exec_lock_iothread();
+                    interrupt_request = env->interrupt_request;
                     if (unlikely(env->singlestep_enabled & SSTEP_NOIRQ)) {
                         /* Mask out external interrupts for this step. */
                         interrupt_request &= ~CPU_INTERRUPT_SSTEP_MASK;
@@ -539,6 +699,7 @@ int cpu_exec(CPUArchState *env)
                            the program flow was changed */
                         next_tb = 0;
                     }
+                    cpu_exec_unlock_iothread();
                 }
                 if (unlikely(cpu->exit_request)) {
                     cpu->exit_request = 0;
@@ -564,8 +725,18 @@ int cpu_exec(CPUArchState *env)
 #endif
                 }
 #endif /* DEBUG_DISAS || CONFIG_DEBUG_EXEC */
-                spin_lock(&tcg_ctx.tb_ctx.tb_lock);
+                tb_lock();
+                tb_gen = tb_generation();
                 tb = tb_find_fast(env);
+                if (unlikely(tb_is_hot(tb))) {
+                    tb_gen_lock();
+                    /* another thread may have promoted it meanwhile */
+                    if (tb_is_hot(tb)) {
+                        tb = tb_gen_superblock(env, tb);
+                    }
+                    tb_gen_unlock();
+                }
+#if !defined(CONFIG_USER_ONLY)
                 /* Note: we do it here to avoid a gcc bug on Mac OS X when
                    doing it in tb_find_slow */
                 if (tcg_ctx.tb_ctx.tb_invalidated_flag) {
@@ -575,6 +746,10 @@ int cpu_exec(CPUArchState *env)
                     next_tb = 0;
                     tcg_ctx.tb_ctx.tb_invalidated_flag = 0;
                 }
+#endif
+                /* keeps the hot regions of the code buffer alive */
+                tcg_ctx.tb_ctx.regions[tb->region].exec_count++;
+                tcg_ctx.tb_ctx.tb_dispatch_count++;
 #ifdef CONFIG_DEBUG_EXEC
                 qemu_log_mask(CPU_LOG_EXEC, "Trace %p [" TARGET_FMT_lx "] %s\n",
                              tb->tc_ptr, tb->pc,
@@ -583,10 +758,18 @@ int cpu_exec(CPUArchState *env)
                 /* see if we can patch the calling TB. When the TB
                    spans two pages, we cannot safely do a direct
                    jump. */
-                if (next_tb != 0 && tb->page_addr[1] == -1) {
-                    tb_add_jump((TranslationBlock *)(next_tb & ~3), next_tb & 3, tb);
+                if (next_tb != 0 && tb->page_addr[1] == -1 &&
+                    !tcg_tb_profile) {
+                    tb_gen_lock();
+                    if (tb_can_chain((TranslationBlock *)(next_tb & ~3), tb,
+                                     last_tb_gen)) {
+                        tb_add_jump((TranslationBlock *)(next_tb & ~3),
+                                    next_tb & 3, tb);
+                    }
+                    tb_gen_unlock();
                 }
-                spin_unlock(&tcg_ctx.tb_ctx.tb_lock);
+                tb_unlock();
+                last_tb_gen = tb_gen;
 
                 /* cpu_interrupt might be called while translating the
                    TB, but before it is linked into a potentially
@@ -597,8 +780,18 @@ int cpu_exec(CPUArchState *env)
                 if (likely(!cpu->exit_request)) {
                     tc_ptr = tb->tc_ptr;
                     /* execute the generated code */
-                    next_tb = tcg_qemu_tb_exec(env, tc_ptr);
-                    if ((next_tb & 3) == 2) {
+                    if (unlikely(tcg_tb_profile)) {
+                        next_tb = cpu_exec_profile(env, tb);
+                    } else {
+                        next_tb = tcg_qemu_tb_exec(env, tc_ptr);
+                    }
+                    if ((next_tb & 3) == 3) {
+                        /* tcg_exit_req was set, the TB was left before
+                           its first instruction.  */
+                        tb = (TranslationBlock *)(next_tb & ~3);
+                        cpu_pc_from_tb(env, tb);
+                        next_tb = 0;
+                    } else if ((next_tb & 3) == 2) {
                         /* Instruction counter expired.  */
                         int insns_left;
                         tb = (TranslationBlock *)(next_tb & ~3);
@@ -634,6 +827,8 @@ int cpu_exec(CPUArchState *env)
             /* Reload env after longjmp - the compiler may have smashed all
              * local variables as longjmp is marked 'noreturn'. */
             env = cpu_single_env;
+            tb_lock_reset();
+            cpu_exec_reset_iothread();
         }
     } /* for(;;) */
 
@@ -666,6 +861,10 @@ int cpu_exec(CPUArchState *env)
 #error unsupported target CPU
 #endif
 
+#if defined(CONFIG_SOFTMMU)
+    rcu_read_unlock();
+#endif
+
     /* fail safe : never use cpu_single_env outside cpu_exec() */
     cpu_single_env = NULL;
     return ret;
@@ -34,9 +34,13 @@
 
 #include "qemu/thread.h"
 #include "sysemu/cpus.h"
+#include "tcg.h"
 #include "sysemu/qtest.h"
 #include "qemu/main-loop.h"
 #include "qemu/bitmap.h"
+#include "qemu/tls.h"
+#include "qemu/atomic.h"
+#include "qemu/host-utils.h"
 
 #ifndef _WIN32
 #include "qemu/compatfd.h"
@@ -45,6 +49,7 @@
 #ifdef CONFIG_LINUX
 
 #include <sys/prctl.h>
+#include <sched.h>
 
 #ifndef PR_MCE_KILL
 #define PR_MCE_KILL 33
@@ -112,6 +117,8 @@ typedef struct TimersState {
     int64_t cpu_clock_offset;
     int32_t cpu_ticks_enabled;
     int64_t dummy;
+    /* odd while cpu_clock_offset and cpu_ticks_enabled are updated */
+    unsigned clock_seq;
 } TimersState;
 
 TimersState timers_state;
@@ -157,12 +164,32 @@ int64_t cpu_get_ticks(void)
 int64_t cpu_get_clock(void)
 {
     int64_t ti;
-    if (!timers_state.cpu_ticks_enabled) {
-        return timers_state.cpu_clock_offset;
-    } else {
-        ti = get_clock();
-        return ti + timers_state.cpu_clock_offset;
-    }
+    unsigned seq;
+
+    /* vCPUs may read vm_clock without the iothread lock */
+    do {
+        seq = atomic_read(&timers_state.clock_seq);
+        smp_rmb();
+        if (!timers_state.cpu_ticks_enabled) {
+            ti = timers_state.cpu_clock_offset;
+        } else {
+            ti = get_clock() + timers_state.cpu_clock_offset;
+        }
+        smp_rmb();
+    } while ((seq & 1) || seq != atomic_read(&timers_state.clock_seq));
+    return ti;
+}
+
+static void cpu_clock_write_begin(void)
+{
+    timers_state.clock_seq++;
+    smp_wmb();
+}
+
+static void cpu_clock_write_end(void)
+{
+    smp_wmb();
+    timers_state.clock_seq++;
 }
 
 /* enable cpu_get_ticks() */
@@ -170,8 +197,10 @@ void cpu_enable_ticks(void)
 {
     if (!timers_state.cpu_ticks_enabled) {
         timers_state.cpu_ticks_offset -= cpu_get_real_ticks();
+        cpu_clock_write_begin();
         timers_state.cpu_clock_offset -= get_clock();
         timers_state.cpu_ticks_enabled = 1;
+        cpu_clock_write_end();
     }
 }
 
@@ -180,9 +209,13 @@ void cpu_enable_ticks(void)
 void cpu_disable_ticks(void)
 {
     if (timers_state.cpu_ticks_enabled) {
+        int64_t clock = cpu_get_clock();
+
         timers_state.cpu_ticks_offset = cpu_get_ticks();
-        timers_state.cpu_clock_offset = cpu_get_clock();
+        cpu_clock_write_begin();
+        timers_state.cpu_clock_offset = clock;
         timers_state.cpu_ticks_enabled = 0;
+        cpu_clock_write_end();
     }
 }
 
@@ -385,6 +418,142 @@ void configure_icount(const char *option)
                    qemu_get_clock_ns(vm_clock) + get_ticks_per_sec() / 10);
 }
 
+/***********************************************************/
+/* multi-threaded TCG */
+
+bool mttcg_enabled;
+
+int configure_tcg_threads(const char *mode)
+{
+    if (!mode || !strcmp(mode, "single")) {
+        return 0;
+    }
+    if (strcmp(mode, "multi") != 0) {
+        fprintf(stderr, "Invalid tcg-threads value '%s'\n", mode);
+        return -1;
+    }
+    if (!tcg_enabled()) {
+        fprintf(stderr, "tcg-threads=multi requires the TCG accelerator\n");
+        return -1;
+    }
+    if (use_icount) {
+        fprintf(stderr, "-icount is not allowed with tcg-threads=multi\n");
+        return -1;
+    }
+#if !defined(__linux__) || !(defined(__i386__) || defined(__x86_64__))
+    /* we need real thread-local variables and TB jumps that can be
+       patched atomically */
+    fprintf(stderr, "tcg-threads=multi is not supported on this host\n");
+    return -1;
+#else
+    mttcg_enabled = true;
+    return 0;
+#endif
+}
+
+int configure_tcg_superblocks(uint64_t threshold)
+{
+    if (!threshold) {
+        return 0;
+    }
+    if (!tcg_enabled()) {
+        fprintf(stderr, "tcg-superblocks requires the TCG accelerator\n");
+        return -1;
+    }
+    if (use_icount) {
+        fprintf(stderr, "-icount is not allowed with tcg-superblocks\n");
+        return -1;
+    }
+    if (threshold > UINT32_MAX) {
+        fprintf(stderr, "tcg-superblocks threshold too large\n");
+        return -1;
+    }
+    tcg_superblock_threshold = threshold;
+    return 0;
+}
+
+int configure_tcg_profile(bool enable)
+{
+    if (!enable) {
+        return 0;
+    }
+    if (!tcg_enabled()) {
+        fprintf(stderr, "tcg-profile requires the TCG accelerator\n");
+        return -1;
+    }
+    if (mttcg_enabled) {
+        fprintf(stderr, "tcg-profile is not supported with "
+                "tcg-threads=multi\n");
+        return -1;
+    }
+    tcg_tb_profile = true;
+    return 0;
+}
+
+static bool bql_profile;
+
+int configure_bql_profile(bool enable)
+{
+    bql_profile = enable;
+    return 0;
+}
+
+/* Longest a halted vCPU thread spins before it sleeps, 0 to never spin */
+static int64_t halt_poll_max_ns;
+/* First window of a vCPU that starts polling */
+#define HALT_POLL_NS_START  10000
+
+int configure_halt_poll(int64_t max_ns)
+{
+    if (max_ns < 0) {
+        fprintf(stderr, "halt-poll-ns must not be negative\n");
+        return -1;
+    }
+    halt_poll_max_ns = max_ns;
+    return 0;
+}
+
+void dump_halt_poll_stats(FILE *f, fprintf_function cpu_fprintf)
+{
+    CPUArchState *env;
+
+    if (!halt_poll_max_ns) {
+        cpu_fprintf(f, "halt polling is disabled\n");
+        return;
+    }
+    cpu_fprintf(f, "max window %" PRId64 " ns\n", halt_poll_max_ns);
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        CPUState *cpu = ENV_GET_CPU(env);
+
+        cpu_fprintf(f, "CPU #%d: window %" PRId64 " ns, "
+                    "%" PRIu64 " polls woken in %" PRIu64 " us, "
+                    "%" PRIu64 " polls failed in %" PRIu64 " us\n",
+                    cpu->cpu_index, cpu->halt_poll_ns,
+                    cpu->halt_poll_success, cpu->halt_poll_success_ns / 1000,
+                    cpu->halt_poll_fail, cpu->halt_poll_fail_ns / 1000);
+    }
+}
+
+int configure_tcg_opt(const char *passes)
+{
+    int mask;
+
+    if (!passes) {
+        return 0;
+    }
+    if (!strcmp(passes, "help")) {
+        tcg_opt_print_passes(stdout);
+        exit(0);
+    }
+    mask = tcg_opt_parse(passes);
+    if (mask < 0) {
+        fprintf(stderr, "Invalid tcg-opt value '%s'\n", passes);
+        return -1;
+    }
+    tcg_opt_flags = mask;
+    return 0;
+}
+
 /***********************************************************/
 void hw_error(const char *fmt, ...)
 {
@@ -618,9 +787,161 @@ static void qemu_tcg_init_cpu_signals(void)
 static QemuMutex qemu_global_mutex;
 static QemuCond qemu_io_proceeded_cond;
 static bool iothread_requesting_mutex;
+static DEFINE_TLS(bool, iothread_locked);
+
+/* Lock accounting for query-cpu-accounting.  Each thread that takes the
+ * iothread lock gets a BqlStats, which only that thread updates.
+ */
+typedef struct BqlStats {
+    int thread_id;
+    const char *name;
+    uint64_t acquisitions;
+    uint64_t wait_ns;
+    uint64_t hold_ns;
+    int64_t locked_at;
+    int64_t site_start;
+    QLIST_ENTRY(BqlStats) next;
+} BqlStats;
+
+/* Protected by the iothread lock */
+static QLIST_HEAD(, BqlStats) bql_stats_list =
+    QLIST_HEAD_INITIALIZER(bql_stats_list);
+static DEFINE_TLS(BqlStats *, bql_stats);
+
+/* -machine bql-profile=on: histograms of the wait and hold times of the
+ * iothread lock, by the site that the thread tagged itself with.  Bucket
+ * 0 counts times below 1 us, bucket n times from 2^(n-1) to 2^n us; the
+ * last bucket also counts anything longer.
+ */
+#define BQL_HIST_BUCKETS 24
+
+typedef struct BqlSiteStats {
+    uint64_t acquisitions;
+    uint64_t wait_ns;
+    uint64_t max_wait_ns;
+    uint64_t wait_hist[BQL_HIST_BUCKETS];
+    uint64_t holds;
+    uint64_t hold_ns;
+    uint64_t max_hold_ns;
+    uint64_t hold_hist[BQL_HIST_BUCKETS];
+} BqlSiteStats;
+
+/* Updated with the lock held, so that no atomics are needed */
+static BqlSiteStats bql_site_stats[BQL_SITE_MAX];
+static DEFINE_TLS(BqlSite, bql_site);
+
+static int bql_hist_bucket(int64_t ns)
+{
+    uint64_t us = ns / 1000;
+
+    return us ? MIN(64 - clz64(us), BQL_HIST_BUCKETS - 1) : 0;
+}
+
+static void bql_profile_wait(int64_t ns)
+{
+    BqlSiteStats *st = &bql_site_stats[tls_var(bql_site)];
+
+    st->acquisitions++;
+    st->wait_ns += ns;
+    st->max_wait_ns = MAX(st->max_wait_ns, ns);
+    st->wait_hist[bql_hist_bucket(ns)]++;
+}
+
+/* End the current hold of the thread's site */
+static void bql_profile_hold(BqlStats *s, int64_t now)
+{
+    BqlSiteStats *st = &bql_site_stats[tls_var(bql_site)];
+    int64_t ns = now - s->site_start;
+
+    st->holds++;
+    st->hold_ns += ns;
+    st->max_hold_ns = MAX(st->max_hold_ns, ns);
+    st->hold_hist[bql_hist_bucket(ns)]++;
+}
 
 static QemuThread io_thread;
 
+/* Called once the lock is taken, @start is when the thread asked for it */
+static void qemu_bql_locked(int64_t start)
+{
+    BqlStats *s = tls_var(bql_stats);
+    int64_t now = get_clock();
+
+    if (!s) {
+        s = g_new0(BqlStats, 1);
+        s->thread_id = qemu_get_thread_id();
+        if (qemu_thread_is_self(&io_thread)) {
+            s->name = "main";
+        }
+        QLIST_INSERT_HEAD(&bql_stats_list, s, next);
+        tls_var(bql_stats) = s;
+    }
+    s->acquisitions++;
+    s->wait_ns += now - start;
+    s->locked_at = now;
+    s->site_start = now;
+    tls_var(iothread_locked) = true;
+    if (bql_profile) {
+        bql_profile_wait(now - start);
+    }
+}
+
+static void qemu_bql_lock(void)
+{
+    int64_t start = get_clock();
+
+    qemu_mutex_lock(&qemu_global_mutex);
+    qemu_bql_locked(start);
+}
+
+static void qemu_bql_unlock(void)
+{
+    BqlStats *s = tls_var(bql_stats);
+    int64_t now = get_clock();
+
+    s->hold_ns += now - s->locked_at;
+    if (bql_profile) {
+        bql_profile_hold(s, now);
+    }
+    tls_var(iothread_locked) = false;
+    qemu_mutex_unlock(&qemu_global_mutex);
+}
+
+/* The time spent waiting for @cond counts neither as holding the lock nor
+ * as waiting for it.
+ */
+static void qemu_bql_cond_wait(QemuCond *cond)
+{
+    BqlStats *s = tls_var(bql_stats);
+    int64_t now = get_clock();
+
+    s->hold_ns += now - s->locked_at;
+    if (bql_profile) {
+        bql_profile_hold(s, now);
+    }
+    qemu_cond_wait(cond, &qemu_global_mutex);
+    s->locked_at = s->site_start = get_clock();
+}
+
+BqlSite qemu_bql_set_site(BqlSite site)
+{
+    BqlSite old = tls_var(bql_site);
+    BqlStats *s = tls_var(bql_stats);
+
+    if (site == old) {
+        return old;
+    }
+    if (bql_profile && tls_var(iothread_locked)) {
+        int64_t now = get_clock();
+
+        /* the rest of this hold belongs to the new site */
+        bql_profile_hold(s, now);
+        s->site_start = now;
+    }
+    tls_var(bql_site) = site;
+    return old;
+}
+
 static QemuThread *tcg_cpu_thread;
 static QemuCond *tcg_halt_cond;
 
@@ -630,6 +951,25 @@ static QemuCond qemu_cpu_cond;
 static QemuCond qemu_pause_cond;
 static QemuCond qemu_work_cond;
 
+/* Exclusive sections, as in linux-user.  The iothread lock protects
+ * pending_cpus and cpu->running, which is true while an MTTCG vCPU
+ * thread is inside cpu_exec().
+ */
+static int pending_cpus;
+static QemuCond exclusive_cond;
+static QemuCond exclusive_resume;
+
+/* Threads other than vCPUs that can be placed with set-thread-affinity */
+typedef struct NamedThread {
+    char *name;
+    int thread_id;
+    QLIST_ENTRY(NamedThread) next;
+} NamedThread;
+
+static QLIST_HEAD(, NamedThread) named_threads =
+    QLIST_HEAD_INITIALIZER(named_threads);
+static QemuMutex named_threads_lock;
+
 void qemu_init_cpu_loop(void)
 {
     qemu_init_sigbus();
@@ -637,11 +977,60 @@ void qemu_init_cpu_loop(void)
     qemu_cond_init(&qemu_pause_cond);
     qemu_cond_init(&qemu_work_cond);
     qemu_cond_init(&qemu_io_proceeded_cond);
+    qemu_cond_init(&exclusive_cond);
+    qemu_cond_init(&exclusive_resume);
     qemu_mutex_init(&qemu_global_mutex);
+    qemu_mutex_init(&named_threads_lock);
 
     qemu_thread_get_self(&io_thread);
 }
 
+void cpu_exclusive_start(void)
+{
+    CPUArchState *env;
+
+    while (pending_cpus) {
+        qemu_bql_cond_wait(&exclusive_resume);
+    }
+    pending_cpus = 1;
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        CPUState *cpu = ENV_GET_CPU(env);
+
+        if (cpu->running) {
+            pending_cpus++;
+            cpu_exit(env);
+        }
+    }
+    while (pending_cpus > 1) {
+        qemu_bql_cond_wait(&exclusive_cond);
+    }
+}
+
+void cpu_exclusive_end(void)
+{
+    pending_cpus = 0;
+    qemu_cond_broadcast(&exclusive_resume);
+}
+
+static void qemu_tcg_exec_start(CPUState *cpu)
+{
+    while (pending_cpus) {
+        qemu_bql_cond_wait(&exclusive_resume);
+    }
+    cpu->running = true;
+}
+
+static void qemu_tcg_exec_end(CPUState *cpu)
+{
+    cpu->running = false;
+    if (pending_cpus > 1) {
+        pending_cpus--;
+        if (pending_cpus == 1) {
+            qemu_cond_signal(&exclusive_cond);
+        }
+    }
+}
+
 void run_on_cpu(CPUState *cpu, void (*func)(void *data), void *data)
 {
     struct qemu_work_item wi;
@@ -666,11 +1055,36 @@ void run_on_cpu(CPUState *cpu, void (*func)(void *data), void *data)
     while (!wi.done) {
         CPUArchState *self_env = cpu_single_env;
 
-        qemu_cond_wait(&qemu_work_cond, &qemu_global_mutex);
+        qemu_bql_cond_wait(&qemu_work_cond);
         cpu_single_env = self_env;
     }
 }
 
+void async_run_on_cpu(CPUState *cpu, void (*func)(void *data), void *data)
+{
+    struct qemu_work_item *wi;
+
+    if (qemu_cpu_is_self(cpu)) {
+        func(data);
+        return;
+    }
+
+    wi = g_malloc0(sizeof(struct qemu_work_item));
+    wi->func = func;
+    wi->data = data;
+    wi->free = true;
+    if (cpu->queued_work_first == NULL) {
+        cpu->queued_work_first = wi;
+    } else {
+        cpu->queued_work_last->next = wi;
+    }
+    cpu->queued_work_last = wi;
+    wi->next = NULL;
+    wi->done = false;
+
+    qemu_cpu_kick(cpu);
+}
+
 static void flush_queued_work(CPUState *cpu)
 {
     struct qemu_work_item *wi;
@@ -683,11 +1097,99 @@ static void flush_queued_work(CPUState *cpu)
         cpu->queued_work_first = wi->next;
         wi->func(wi->data);
         wi->done = true;
+        if (wi->free) {
+            g_free(wi);
+        }
     }
     cpu->queued_work_last = NULL;
     qemu_cond_broadcast(&qemu_work_cond);
 }
 
+/* vCPU throttling: every timeslice each vCPU is made to sleep for
+ * percentage / (100 - percentage) of it, so that it only runs
+ * (100 - percentage)% of the time.
+ */
+#define CPU_THROTTLE_TIMESLICE_NS 10000000
+
+static QEMUTimer *throttle_timer;
+static unsigned int throttle_percentage;
+
+static void cpu_throttle_thread(void *opaque)
+{
+    CPUState *cpu = opaque;
+    unsigned int pct = throttle_percentage;
+    int64_t sleeptime_ns;
+
+    cpu->throttle_thread_scheduled = false;
+    if (!pct) {
+        return;
+    }
+
+    sleeptime_ns = CPU_THROTTLE_TIMESLICE_NS * pct / (100 - pct);
+    qemu_mutex_unlock_iothread();
+    g_usleep(sleeptime_ns / 1000);
+    qemu_mutex_lock_iothread();
+}
+
+static void cpu_throttle_timer_tick(void *opaque)
+{
+    CPUArchState *env;
+    unsigned int pct = throttle_percentage;
+
+    if (!pct) {
+        return;
+    }
+
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        CPUState *cpu = ENV_GET_CPU(env);
+
+        if (!cpu->throttle_thread_scheduled) {
+            cpu->throttle_thread_scheduled = true;
+            async_run_on_cpu(cpu, cpu_throttle_thread, cpu);
+        }
+        /* a single thread runs all TCG vCPUs */
+        if (!kvm_enabled() && !mttcg_enabled) {
+            break;
+        }
+    }
+
+    qemu_mod_timer(throttle_timer, qemu_get_clock_ns(rt_clock) +
+                   CPU_THROTTLE_TIMESLICE_NS * 100 / (100 - pct));
+}
+
+void cpu_throttle_set(int new_throttle_pct)
+{
+    new_throttle_pct = MAX(new_throttle_pct, CPU_THROTTLE_PCT_MIN);
+    new_throttle_pct = MIN(new_throttle_pct, CPU_THROTTLE_PCT_MAX);
+
+    if (!throttle_timer) {
+        throttle_timer = qemu_new_timer_ns(rt_clock, cpu_throttle_timer_tick,
+                                           NULL);
+    }
+
+    throttle_percentage = new_throttle_pct;
+    qemu_mod_timer(throttle_timer, qemu_get_clock_ns(rt_clock) +
+                   CPU_THROTTLE_TIMESLICE_NS);
+}
+
+void cpu_throttle_stop(void)
+{
+    throttle_percentage = 0;
+    if (throttle_timer) {
+        qemu_del_timer(throttle_timer);
+    }
+}
+
+bool cpu_throttle_active(void)
+{
+    return throttle_percentage != 0;
+}
+
+int cpu_throttle_get_percentage(void)
+{
+    return throttle_percentage;
+}
+
 static void qemu_wait_io_event_common(CPUState *cpu)
 {
     if (cpu->stop) {
@@ -699,19 +1201,112 @@ static void qemu_wait_io_event_common(CPUState *cpu)
     cpu->thread_kicked = false;
 }
 
+/*
+ * Before a halted vCPU thread goes to sleep, it spins with the iothread
+ * lock released for up to its polling window, so that an interrupt that
+ * comes soon after the halt doesn't pay for a sleep and a wakeup.  The
+ * state is read without the lock here; the callers check it again with
+ * the lock held.  Returns true if the thread doesn't need to sleep.
+ */
+static bool qemu_halt_poll(CPUState *cpu, bool (*idle)(CPUState *cpu))
+{
+    int64_t start, now;
+    bool woken = false;
+
+    if (!cpu->halt_poll_ns) {
+        return false;
+    }
+
+    qemu_bql_unlock();
+
+    now = start = get_clock();
+    while (now - start < cpu->halt_poll_ns) {
+        if (!idle(cpu)) {
+            woken = true;
+            break;
+        }
+        barrier();
+        now = get_clock();
+    }
+
+    qemu_bql_lock();
+
+    now = get_clock();
+    if (woken) {
+        cpu->halt_poll_success++;
+        cpu->halt_poll_success_ns += now - start;
+    } else {
+        cpu->halt_poll_fail++;
+        cpu->halt_poll_fail_ns += now - start;
+    }
+    return woken;
+}
+
+/*
+ * Adapt the window to a halt that lasted @halt_ns, polling included: grow
+ * it while wakeups come within the maximum, drop it when they don't, as
+ * polling would only have burnt host CPU time.
+ */
+static void qemu_halt_poll_adjust(CPUState *cpu, int64_t halt_ns)
+{
+    if (halt_ns > halt_poll_max_ns) {
+        cpu->halt_poll_ns = 0;
+    } else if (cpu->halt_poll_ns < halt_poll_max_ns) {
+        cpu->halt_poll_ns = cpu->halt_poll_ns ?
+                            cpu->halt_poll_ns * 2 : HALT_POLL_NS_START;
+        cpu->halt_poll_ns = MIN(cpu->halt_poll_ns, halt_poll_max_ns);
+    }
+}
+
+static bool qemu_cpu_idle(CPUState *cpu)
+{
+    return cpu_thread_is_idle(cpu->env_ptr);
+}
+
+static bool qemu_all_cpus_idle(CPUState *cpu)
+{
+    return all_cpu_threads_idle();
+}
+
+/* Wait on @cond until @idle is false, polling first if enabled */
+static void qemu_halt_wait(CPUState *cpu, QemuCond *cond,
+                           bool (*idle)(CPUState *cpu), bool warp)
+{
+    int64_t start = 0;
+    bool slept = false;
+
+    if (halt_poll_max_ns && idle(cpu)) {
+        start = get_clock();
+        if (qemu_halt_poll(cpu, idle)) {
+            return;
+        }
+    }
+
+    while (idle(cpu)) {
+        if (warp) {
+            /* Start accounting real time to the virtual clock if the CPUs
+               are idle.  */
+            qemu_clock_warp(vm_clock);
+        }
+        qemu_bql_cond_wait(cond);
+        slept = true;
+    }
+
+    if (halt_poll_max_ns && slept) {
+        qemu_halt_poll_adjust(cpu, get_clock() - start);
+    }
+}
+
 static void qemu_tcg_wait_io_event(void)
 {
     CPUArchState *env;
 
-    while (all_cpu_threads_idle()) {
-       /* Start accounting real time to the virtual clock if the CPUs
-          are idle.  */
-        qemu_clock_warp(vm_clock);
-        qemu_cond_wait(tcg_halt_cond, &qemu_global_mutex);
-    }
+    /* The single TCG thread keeps its polling state in the first CPU */
+    qemu_halt_wait(ENV_GET_CPU(first_cpu), tcg_halt_cond,
+                   qemu_all_cpus_idle, true);
 
     while (iothread_requesting_mutex) {
-        qemu_cond_wait(&qemu_io_proceeded_cond, &qemu_global_mutex);
+        qemu_bql_cond_wait(&qemu_io_proceeded_cond);
     }
 
     for (env = first_cpu; env != NULL; env = env->next_cpu) {
@@ -719,13 +1314,18 @@ static void qemu_tcg_wait_io_event(void)
     }
 }
 
+static void qemu_tcg_mt_wait_io_event(CPUState *cpu)
+{
+    qemu_halt_wait(cpu, cpu->halt_cond, qemu_cpu_idle, false);
+
+    qemu_wait_io_event_common(cpu);
+}
+
 static void qemu_kvm_wait_io_event(CPUArchState *env)
 {
     CPUState *cpu = ENV_GET_CPU(env);
 
-    while (cpu_thread_is_idle(env)) {
-        qemu_cond_wait(cpu->halt_cond, &qemu_global_mutex);
-    }
+    qemu_halt_wait(cpu, cpu->halt_cond, qemu_cpu_idle, false);
 
     qemu_kvm_eat_signals(cpu);
     qemu_wait_io_event_common(cpu);
@@ -737,7 +1337,8 @@ static void *qemu_kvm_cpu_thread_fn(void *arg)
     CPUState *cpu = ENV_GET_CPU(env);
     int r;
 
-    qemu_mutex_lock(&qemu_global_mutex);
+    qemu_bql_set_site(BQL_SITE_VCPU);
+    qemu_bql_lock();
     qemu_thread_get_self(cpu->thread);
     cpu->thread_id = qemu_get_thread_id();
     cpu_single_env = env;
@@ -778,6 +1379,7 @@ static void *qemu_dummy_cpu_thread_fn(void *arg)
     sigset_t waitset;
     int r;
 
+    qemu_bql_set_site(BQL_SITE_VCPU);
     qemu_mutex_lock_iothread();
     qemu_thread_get_self(cpu->thread);
     cpu->thread_id = qemu_get_thread_id();
@@ -821,7 +1423,8 @@ static void *qemu_tcg_cpu_thread_fn(void *arg)
     qemu_thread_get_self(cpu->thread);
 
     /* signal CPU creation */
-    qemu_mutex_lock(&qemu_global_mutex);
+    qemu_bql_set_site(BQL_SITE_VCPU);
+    qemu_bql_lock();
     for (env = first_cpu; env != NULL; env = env->next_cpu) {
         cpu = ENV_GET_CPU(env);
         cpu->thread_id = qemu_get_thread_id();
@@ -831,7 +1434,7 @@ static void *qemu_tcg_cpu_thread_fn(void *arg)
 
     /* wait for initial kick-off after machine start */
     while (ENV_GET_CPU(first_cpu)->stopped) {
-        qemu_cond_wait(tcg_halt_cond, &qemu_global_mutex);
+        qemu_bql_cond_wait(tcg_halt_cond);
 
         /* process any pending work */
         for (env = first_cpu; env != NULL; env = env->next_cpu) {
@@ -850,6 +1453,42 @@ static void *qemu_tcg_cpu_thread_fn(void *arg)
     return NULL;
 }
 
+/* Multi-threaded TCG: each vCPU has its own thread, which only holds the
+ * iothread lock while it is outside translated code.
+ */
+static void *qemu_tcg_mt_cpu_thread_fn(void *arg)
+{
+    CPUState *cpu = arg;
+    CPUArchState *env = cpu->env_ptr;
+    int r;
+
+    qemu_bql_set_site(BQL_SITE_VCPU);
+    qemu_bql_lock();
+    qemu_thread_get_self(cpu->thread);
+    cpu->thread_id = qemu_get_thread_id();
+
+    /* signal CPU creation */
+    cpu->created = true;
+    qemu_cond_signal(&qemu_cpu_cond);
+
+    while (1) {
+        if (cpu_can_run(cpu)) {
+            qemu_tcg_exec_start(cpu);
+            qemu_mutex_unlock_iothread();
+            r = cpu_exec(env);
+            qemu_mutex_lock_iothread();
+            qemu_tcg_exec_end(cpu);
+            if (r == EXCP_DEBUG) {
+                cpu_handle_guest_debug(env);
+            }
+            tb_flush_if_pending(env);
+        }
+        qemu_tcg_mt_wait_io_event(cpu);
+    }
+
+    return NULL;
+}
+
 static void qemu_cpu_kick_thread(CPUState *cpu)
 {
 #ifndef _WIN32
@@ -872,6 +1511,11 @@ static void qemu_cpu_kick_thread(CPUState *cpu)
 void qemu_cpu_kick(CPUState *cpu)
 {
     qemu_cond_broadcast(cpu->halt_cond);
+    if (tcg_enabled() && mttcg_enabled) {
+        /* no signal needed, the vCPU polls tcg_exit_req */
+        cpu_exit(cpu->env_ptr);
+        return;
+    }
     if (!tcg_enabled() && !cpu->thread_kicked) {
         qemu_cpu_kick_thread(cpu);
         cpu->thread_kicked = true;
@@ -905,14 +1549,17 @@ static bool qemu_in_vcpu_thread(void)
 
 void qemu_mutex_lock_iothread(void)
 {
-    if (!tcg_enabled()) {
-        qemu_mutex_lock(&qemu_global_mutex);
+    if (!tcg_enabled() || mttcg_enabled) {
+        qemu_bql_lock();
     } else {
+        int64_t start = get_clock();
+
         iothread_requesting_mutex = true;
         if (qemu_mutex_trylock(&qemu_global_mutex)) {
             qemu_cpu_kick_thread(ENV_GET_CPU(first_cpu));
             qemu_mutex_lock(&qemu_global_mutex);
         }
+        qemu_bql_locked(start);
         iothread_requesting_mutex = false;
         qemu_cond_broadcast(&qemu_io_proceeded_cond);
     }
@@ -920,7 +1567,12 @@ void qemu_mutex_lock_iothread(void)
 
 void qemu_mutex_unlock_iothread(void)
 {
-    qemu_mutex_unlock(&qemu_global_mutex);
+    qemu_bql_unlock();
+}
+
+bool qemu_mutex_iothread_locked(void)
+{
+    return tls_var(iothread_locked);
 }
 
 static int all_vcpus_paused(void)
@@ -952,7 +1604,7 @@ void pause_all_vcpus(void)
 
     if (qemu_in_vcpu_thread()) {
         cpu_stop_current();
-        if (!kvm_enabled()) {
+        if (!kvm_enabled() && !mttcg_enabled) {
             while (penv) {
                 CPUState *pcpu = ENV_GET_CPU(penv);
                 pcpu->stop = 0;
@@ -964,7 +1616,7 @@ void pause_all_vcpus(void)
     }
 
     while (!all_vcpus_paused()) {
-        qemu_cond_wait(&qemu_pause_cond, &qemu_global_mutex);
+        qemu_bql_cond_wait(&qemu_pause_cond);
         penv = first_cpu;
         while (penv) {
             qemu_cpu_kick(ENV_GET_CPU(penv));
@@ -989,6 +1641,18 @@ void resume_all_vcpus(void)
 
 static void qemu_tcg_init_vcpu(CPUState *cpu)
 {
+    if (mttcg_enabled) {
+        cpu->thread = g_malloc0(sizeof(QemuThread));
+        cpu->halt_cond = g_malloc0(sizeof(QemuCond));
+        qemu_cond_init(cpu->halt_cond);
+        qemu_thread_create(cpu->thread, qemu_tcg_mt_cpu_thread_fn, cpu,
+                           QEMU_THREAD_JOINABLE);
+        while (!cpu->created) {
+            qemu_bql_cond_wait(&qemu_cpu_cond);
+        }
+        return;
+    }
+
     /* share a single thread for all cpus with TCG */
     if (!tcg_cpu_thread) {
         cpu->thread = g_malloc0(sizeof(QemuThread));
@@ -1001,7 +1665,7 @@ static void qemu_tcg_init_vcpu(CPUState *cpu)
         cpu->hThread = qemu_thread_get_handle(cpu->thread);
 #endif
         while (!cpu->created) {
-            qemu_cond_wait(&qemu_cpu_cond, &qemu_global_mutex);
+            qemu_bql_cond_wait(&qemu_cpu_cond);
         }
         tcg_cpu_thread = cpu->thread;
     } else {
@@ -1020,7 +1684,7 @@ static void qemu_kvm_start_vcpu(CPUArchState *env)
     qemu_thread_create(cpu->thread, qemu_kvm_cpu_thread_fn, env,
                        QEMU_THREAD_JOINABLE);
     while (!cpu->created) {
-        qemu_cond_wait(&qemu_cpu_cond, &qemu_global_mutex);
+        qemu_bql_cond_wait(&qemu_cpu_cond);
     }
 }
 
@@ -1034,7 +1698,7 @@ static void qemu_dummy_start_vcpu(CPUArchState *env)
     qemu_thread_create(cpu->thread, qemu_dummy_cpu_thread_fn, env,
                        QEMU_THREAD_JOINABLE);
     while (!cpu->created) {
-        qemu_cond_wait(&qemu_cpu_cond, &qemu_global_mutex);
+        qemu_bql_cond_wait(&qemu_cpu_cond);
     }
 }
 
@@ -1159,11 +1823,82 @@ static void tcg_exec_all(void)
     exit_request = 0;
 }
 
+void qemu_register_thread(const char *name, int thread_id)
+{
+    NamedThread *t = g_new0(NamedThread, 1);
+
+    t->name = g_strdup(name);
+    t->thread_id = thread_id;
+    qemu_mutex_lock(&named_threads_lock);
+    QLIST_INSERT_HEAD(&named_threads, t, next);
+    qemu_mutex_unlock(&named_threads_lock);
+}
+
+void qemu_unregister_thread(int thread_id)
+{
+    NamedThread *t;
+
+    qemu_mutex_lock(&named_threads_lock);
+    QLIST_FOREACH(t, &named_threads, next) {
+        if (t->thread_id == thread_id) {
+            QLIST_REMOVE(t, next);
+            g_free(t->name);
+            g_free(t);
+            break;
+        }
+    }
+    qemu_mutex_unlock(&named_threads_lock);
+}
+
+static bool qemu_thread_id_is_known(int thread_id)
+{
+    CPUArchState *env;
+    NamedThread *t;
+    bool found = false;
+
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        if (ENV_GET_CPU(env)->thread_id == thread_id) {
+            return true;
+        }
+    }
+    qemu_mutex_lock(&named_threads_lock);
+    QLIST_FOREACH(t, &named_threads, next) {
+        if (t->thread_id == thread_id) {
+            found = true;
+            break;
+        }
+    }
+    qemu_mutex_unlock(&named_threads_lock);
+    return found;
+}
+
+/* Restrict thread @thread_id to the host CPUs set in @cpus */
+static int qemu_set_thread_affinity(int thread_id, const unsigned long *cpus)
+{
+#ifdef CONFIG_LINUX
+    cpu_set_t set;
+    int cpu;
+
+    CPU_ZERO(&set);
+    for (cpu = find_first_bit(cpus, MAX_HOST_CPUMASK_BITS);
+         cpu < MAX_HOST_CPUMASK_BITS;
+         cpu = find_next_bit(cpus, MAX_HOST_CPUMASK_BITS, cpu + 1)) {
+        CPU_SET(cpu, &set);
+    }
+    if (sched_setaffinity(thread_id, sizeof(set), &set) < 0) {
+        return -errno;
+    }
+    return 0;
+#else
+    return -ENOSYS;
+#endif
+}
+
 void set_numa_modes(void)
 {
     CPUArchState *env;
     CPUState *cpu;
-    int i;
+    int i, ret;
 
     for (env = first_cpu; env != NULL; env = env->next_cpu) {
         cpu = ENV_GET_CPU(env);
@@ -1172,6 +1907,19 @@ void set_numa_modes(void)
                 cpu->numa_node = i;
             }
         }
+
+        /* vCPU threads were started by machine init and know their ID */
+        if (nb_numa_nodes > 0 &&
+            !bitmap_empty(node_host_cpus[cpu->numa_node],
+                          MAX_HOST_CPUMASK_BITS)) {
+            ret = qemu_set_thread_affinity(cpu->thread_id,
+                                           node_host_cpus[cpu->numa_node]);
+            if (ret < 0) {
+                fprintf(stderr, "qemu: failed to bind VCPU %d to the host "
+                        "CPUs of node %d: %s\n", cpu->cpu_index,
+                        cpu->numa_node, strerror(-ret));
+            }
+        }
     }
 }
 
@@ -1307,6 +2055,185 @@ exit:
     fclose(f);
 }
 
+ThreadInfoList *qmp_query_threads(Error **errp)
+{
+    ThreadInfoList *head = NULL, *info;
+    CPUArchState *env;
+    NamedThread *t;
+
+    qemu_mutex_lock(&named_threads_lock);
+    QLIST_FOREACH(t, &named_threads, next) {
+        info = g_malloc0(sizeof(*info));
+        info->value = g_malloc0(sizeof(*info->value));
+        info->value->name = g_strdup(t->name);
+        info->value->thread_id = t->thread_id;
+        info->next = head;
+        head = info;
+    }
+    qemu_mutex_unlock(&named_threads_lock);
+
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        CPUState *cpu = ENV_GET_CPU(env);
+
+        info = g_malloc0(sizeof(*info));
+        info->value = g_malloc0(sizeof(*info->value));
+        info->value->name = g_strdup_printf("vcpu%d", cpu->cpu_index);
+        info->value->thread_id = cpu->thread_id;
+        info->value->has_numa_node = nb_numa_nodes > 0;
+        info->value->numa_node = cpu->numa_node;
+        info->next = head;
+        head = info;
+    }
+
+    return head;
+}
+
+static char *bql_stats_thread_name(BqlStats *s)
+{
+    CPUArchState *env;
+    NamedThread *t;
+    char *name = NULL;
+
+    if (s->name) {
+        return g_strdup(s->name);
+    }
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        CPUState *cpu = ENV_GET_CPU(env);
+
+        if (cpu->thread_id == s->thread_id) {
+            return g_strdup_printf("vcpu%d", cpu->cpu_index);
+        }
+    }
+    qemu_mutex_lock(&named_threads_lock);
+    QLIST_FOREACH(t, &named_threads, next) {
+        if (t->thread_id == s->thread_id) {
+            name = g_strdup(t->name);
+            break;
+        }
+    }
+    qemu_mutex_unlock(&named_threads_lock);
+    return name;
+}
+
+CpuAccountingInfo *qmp_query_cpu_accounting(Error **errp)
+{
+    CpuAccountingInfo *info = g_new0(CpuAccountingInfo, 1);
+    BqlAccountingList *entry;
+    BqlStats *s;
+
+    info->callbacks = main_loop_cpu_accounting();
+    QLIST_FOREACH(s, &bql_stats_list, next) {
+        BqlAccounting *t = g_new0(BqlAccounting, 1);
+
+        t->thread_id = s->thread_id;
+        t->name = bql_stats_thread_name(s);
+        t->has_name = t->name != NULL;
+        t->acquisitions = s->acquisitions;
+        t->wait_ns = s->wait_ns;
+        t->hold_ns = s->hold_ns;
+        if (s == tls_var(bql_stats)) {
+            /* we are holding the lock right now */
+            t->hold_ns += get_clock() - s->locked_at;
+        }
+
+        entry = g_new0(BqlAccountingList, 1);
+        entry->value = t;
+        entry->next = info->threads;
+        info->threads = entry;
+    }
+    return info;
+}
+
+static BqlHistogramBucketList *bql_hist_list(const uint64_t *hist)
+{
+    BqlHistogramBucketList *list = NULL, *entry;
+    int i;
+
+    for (i = BQL_HIST_BUCKETS - 1; i >= 0; i--) {
+        entry = g_new0(BqlHistogramBucketList, 1);
+        entry->value = g_new0(BqlHistogramBucket, 1);
+        entry->value->count = hist[i];
+        entry->next = list;
+        list = entry;
+    }
+    return list;
+}
+
+BqlInfo *qmp_query_bql(Error **errp)
+{
+    BqlInfo *info = g_new0(BqlInfo, 1);
+    BqlSiteInfoList *entry;
+    int i;
+
+    info->enabled = bql_profile;
+    if (!bql_profile) {
+        return info;
+    }
+    for (i = BQL_SITE_MAX - 1; i >= 0; i--) {
+        BqlSiteStats *st = &bql_site_stats[i];
+        BqlSiteInfo *site;
+
+        if (!st->acquisitions && !st->holds) {
+            continue;
+        }
+        site = g_new0(BqlSiteInfo, 1);
+        site->site = i;
+        site->acquisitions = st->acquisitions;
+        site->wait_ns = st->wait_ns;
+        site->max_wait_ns = st->max_wait_ns;
+        site->wait_histogram = bql_hist_list(st->wait_hist);
+        site->holds = st->holds;
+        site->hold_ns = st->hold_ns;
+        site->max_hold_ns = st->max_hold_ns;
+        site->hold_histogram = bql_hist_list(st->hold_hist);
+
+        entry = g_new0(BqlSiteInfoList, 1);
+        entry->value = site;
+        entry->next = info->sites;
+        info->sites = entry;
+    }
+    return info;
+}
+
+void qmp_set_thread_affinity(int64_t thread_id, ThreadCpuList *cpus,
+                             Error **errp)
+{
+    unsigned long *set;
+    ThreadCpuList *c;
+    int ret;
+
+    if (!qemu_thread_id_is_known(thread_id)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "thread-id",
+                  "a thread listed by query-threads");
+        return;
+    }
+
+    set = bitmap_new(MAX_HOST_CPUMASK_BITS);
+    for (c = cpus; c; c = c->next) {
+        if (c->value->cpu < 0 || c->value->cpu >= MAX_HOST_CPUMASK_BITS) {
+            error_set(errp, QERR_INVALID_PARAMETER_VALUE, "cpus",
+                      "a list of host CPU numbers");
+            goto out;
+        }
+        set_bit(c->value->cpu, set);
+    }
+    if (bitmap_empty(set, MAX_HOST_CPUMASK_BITS)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "cpus",
+                  "a non-empty list of host CPU numbers");
+        goto out;
+    }
+
+    ret = qemu_set_thread_affinity(thread_id, set);
+    if (ret == -ENOSYS) {
+        error_set(errp, QERR_UNSUPPORTED);
+    } else if (ret < 0) {
+        error_setg_errno(errp, -ret, "cannot bind thread %" PRId64,
+                         thread_id);
+    }
+out:
+    g_free(set);
+}
+
 void qmp_inject_nmi(Error **errp)
 {
 #if defined(TARGET_I386)
@@ -22,10 +22,13 @@
 #include "exec/exec-all.h"
 #include "exec/memory.h"
 #include "exec/address-spaces.h"
+#include "sysemu/cpus.h"
 
 #include "exec/cputlb.h"
 
 #include "exec/memory-internal.h"
+#include "qemu/bitops.h"
+#include "qemu/rcu.h"
 
 //#define DEBUG_TLB
 //#define DEBUG_TLB_CHECK
@@ -40,6 +43,28 @@ static const CPUTLBEntry s_cputlb_empty_entry = {
     .addend     = -1,
 };
 
+#define TLB_ALL_MMUIDX ((1 << NB_MMU_MODES) - 1)
+
+/* Clear the entries of one MMU mode.  Only those filled since the last
+   flush need to be cleared; a zeroed CPU state has no bit set in
+   tlb_empty, so the first flush after a reset clears the whole table.  */
+static void tlb_flush_mmu(CPUArchState *env, int mmu_idx)
+{
+    int i;
+
+    for (i = find_first_zero_bit(env->tlb_empty[mmu_idx], CPU_TLB_SIZE);
+         i < CPU_TLB_SIZE;
+         i = find_next_zero_bit(env->tlb_empty[mmu_idx], CPU_TLB_SIZE,
+                                i + 1)) {
+        env->tlb_table[mmu_idx][i] = s_cputlb_empty_entry;
+        env->tlb_flush_entries++;
+    }
+    for (i = 0; i < CPU_VTLB_SIZE; i++) {
+        env->tlb_v_table[mmu_idx][i] = s_cputlb_empty_entry;
+    }
+    memset(env->tlb_empty[mmu_idx], 0xff, sizeof(env->tlb_empty[mmu_idx]));
+}
+
 /* NOTE:
  * If flush_global is true (the usual case), flush all tlb entries.
  * If flush_global is false, flush (at least) all tlb entries not
@@ -55,7 +80,7 @@ static const CPUTLBEntry s_cputlb_empty_entry = {
 void tlb_flush(CPUArchState *env, int flush_global)
 {
     CPUState *cpu = ENV_GET_CPU(env);
-    int i;
+    int mmu_idx;
 
 #if defined(DEBUG_TLB)
     printf("tlb_flush:\n");
@@ -64,21 +89,65 @@ void tlb_flush(CPUArchState *env, int flush_global)
        links while we are modifying them */
     cpu->current_tb = NULL;
 
-    for (i = 0; i < CPU_TLB_SIZE; i++) {
-        int mmu_idx;
-
-        for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
-            env->tlb_table[mmu_idx][i] = s_cputlb_empty_entry;
-        }
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        tlb_flush_mmu(env, mmu_idx);
     }
 
     memset(env->tb_jmp_cache, 0, TB_JMP_CACHE_SIZE * sizeof (void *));
 
     env->tlb_flush_addr = -1;
     env->tlb_flush_mask = 0;
+    /* The TLB is empty, so it can move on to the current memory map */
+    env->memory_dispatch = atomic_rcu_read(&address_space_memory.dispatch);
     tlb_flush_count++;
 }
 
+/* Flush the TLBs of the MMU modes whose bit is set in IDXMAP.  */
+void tlb_flush_by_mmuidx(CPUArchState *env, uint16_t idxmap)
+{
+    CPUState *cpu = ENV_GET_CPU(env);
+    int mmu_idx;
+
+    if ((idxmap & TLB_ALL_MMUIDX) == TLB_ALL_MMUIDX) {
+        tlb_flush(env, 1);
+        return;
+    }
+    env->tlb_flush_avoided++;
+    if (!idxmap) {
+        return;
+    }
+
+    cpu->current_tb = NULL;
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        if (idxmap & (1 << mmu_idx)) {
+            tlb_flush_mmu(env, mmu_idx);
+        }
+    }
+    /* the large page area may still be mapped in the other modes, so
+       leave tlb_flush_addr and tlb_flush_mask alone */
+    memset(env->tb_jmp_cache, 0, TB_JMP_CACHE_SIZE * sizeof (void *));
+}
+
+static void tlb_flush_work(void *opaque)
+{
+    tlb_flush(opaque, 1);
+}
+
+/* Flush the TLB of a cpu that may be running on another thread.  With
+   multi-threaded TCG the flush is queued for the cpu's own thread, which
+   does it before executing any more code; until then the cpu may still
+   use its old mappings.  */
+void tlb_flush_async(CPUArchState *env)
+{
+    CPUState *cpu = ENV_GET_CPU(env);
+
+    if (mttcg_enabled && cpu->created) {
+        async_run_on_cpu(cpu, tlb_flush_work, env);
+    } else {
+        tlb_flush(env, 1);
+    }
+}
+
 static inline void tlb_flush_entry(CPUTLBEntry *tlb_entry, target_ulong addr)
 {
     if (addr == (tlb_entry->addr_read &
@@ -91,7 +160,8 @@ static inline void tlb_flush_entry(CPUTLBEntry *tlb_entry, target_ulong addr)
     }
 }
 
-void tlb_flush_page(CPUArchState *env, target_ulong addr)
+static void tlb_flush_page_mmu(CPUArchState *env, target_ulong addr,
+                               uint16_t idxmap)
 {
     CPUState *cpu = ENV_GET_CPU(env);
     int i;
@@ -107,7 +177,7 @@ void tlb_flush_page(CPUArchState *env, target_ulong addr)
                TARGET_FMT_lx "/" TARGET_FMT_lx ")\n",
                env->tlb_flush_addr, env->tlb_flush_mask);
 #endif
-        tlb_flush(env, 1);
+        tlb_flush_by_mmuidx(env, idxmap);
         return;
     }
     /* must reset current TB so that interrupts cannot modify the
@@ -117,12 +187,111 @@ void tlb_flush_page(CPUArchState *env, target_ulong addr)
     addr &= TARGET_PAGE_MASK;
     i = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        int k;
+
+        if (!(idxmap & (1 << mmu_idx))) {
+            continue;
+        }
         tlb_flush_entry(&env->tlb_table[mmu_idx][i], addr);
+        for (k = 0; k < CPU_VTLB_SIZE; k++) {
+            tlb_flush_entry(&env->tlb_v_table[mmu_idx][k], addr);
+        }
     }
 
     tb_flush_jmp_cache(env, addr);
 }
 
+void tlb_flush_page(CPUArchState *env, target_ulong addr)
+{
+    tlb_flush_page_mmu(env, addr, TLB_ALL_MMUIDX);
+}
+
+void tlb_flush_page_by_mmuidx(CPUArchState *env, target_ulong addr,
+                              uint16_t idxmap)
+{
+    tlb_flush_page_mmu(env, addr, idxmap & TLB_ALL_MMUIDX);
+}
+
+static inline void tlb_flush_entry_range(CPUTLBEntry *tlb_entry,
+                                         target_ulong start, target_ulong len)
+{
+    if ((tlb_entry->addr_read & TARGET_PAGE_MASK) - start < len ||
+        (tlb_entry->addr_write & TARGET_PAGE_MASK) - start < len ||
+        (tlb_entry->addr_code & TARGET_PAGE_MASK) - start < len) {
+        *tlb_entry = s_cputlb_empty_entry;
+    }
+}
+
+/* Flush the pages that intersect [START, START + LEN) from the TLBs of
+   the MMU modes in IDXMAP.  Small ranges are flushed page by page,
+   larger ones by scanning the entries in use, so that the cost never
+   exceeds that of a full flush.  */
+void tlb_flush_range_by_mmuidx(CPUArchState *env, target_ulong start,
+                               target_ulong len, uint16_t idxmap)
+{
+    CPUState *cpu = ENV_GET_CPU(env);
+    target_ulong addr;
+    int i, mmu_idx;
+
+    if (!len) {
+        return;
+    }
+    len += start & ~TARGET_PAGE_MASK;
+    start &= TARGET_PAGE_MASK;
+    len = TARGET_PAGE_ALIGN(len);
+    if (len == 0) {
+        /* the range covers the whole address space */
+        tlb_flush_by_mmuidx(env, idxmap);
+        return;
+    }
+    if ((len >> TARGET_PAGE_BITS) < CPU_TLB_SIZE / 2) {
+        for (addr = start; addr - start < len; addr += TARGET_PAGE_SIZE) {
+            tlb_flush_page_mmu(env, addr, idxmap & TLB_ALL_MMUIDX);
+        }
+        env->tlb_flush_avoided++;
+        return;
+    }
+
+    if (env->tlb_flush_addr != (target_ulong)-1 &&
+        (env->tlb_flush_addr - start < len ||
+         start - env->tlb_flush_addr <= (target_ulong)~env->tlb_flush_mask)) {
+        tlb_flush_by_mmuidx(env, idxmap);
+        return;
+    }
+
+    cpu->current_tb = NULL;
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        if (!(idxmap & (1 << mmu_idx))) {
+            continue;
+        }
+        for (i = find_first_zero_bit(env->tlb_empty[mmu_idx], CPU_TLB_SIZE);
+             i < CPU_TLB_SIZE;
+             i = find_next_zero_bit(env->tlb_empty[mmu_idx], CPU_TLB_SIZE,
+                                    i + 1)) {
+            tlb_flush_entry_range(&env->tlb_table[mmu_idx][i], start, len);
+        }
+        for (i = 0; i < CPU_VTLB_SIZE; i++) {
+            tlb_flush_entry_range(&env->tlb_v_table[mmu_idx][i], start, len);
+        }
+    }
+
+    /* a TB can start on the page before the range and run into it */
+    for (i = 0; i < TB_JMP_CACHE_SIZE; i++) {
+        TranslationBlock *tb = env->tb_jmp_cache[i];
+
+        if (tb && tb->pc - (start - TARGET_PAGE_SIZE) <
+            len + TARGET_PAGE_SIZE) {
+            env->tb_jmp_cache[i] = NULL;
+        }
+    }
+    env->tlb_flush_avoided++;
+}
+
+void tlb_flush_range(CPUArchState *env, target_ulong start, target_ulong len)
+{
+    tlb_flush_range_by_mmuidx(env, start, len, TLB_ALL_MMUIDX);
+}
+
 /* update the TLBs so that writes to code in the virtual page 'addr'
    can be detected */
 void tlb_protect_code(ram_addr_t ram_addr)
@@ -183,10 +352,18 @@ void cpu_tlb_reset_dirty_all(ram_addr_t start1, ram_addr_t length)
         for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
             unsigned int i;
 
-            for (i = 0; i < CPU_TLB_SIZE; i++) {
+            for (i = find_first_zero_bit(env->tlb_empty[mmu_idx],
+                                         CPU_TLB_SIZE);
+                 i < CPU_TLB_SIZE;
+                 i = find_next_zero_bit(env->tlb_empty[mmu_idx],
+                                        CPU_TLB_SIZE, i + 1)) {
                 tlb_reset_dirty_range(&env->tlb_table[mmu_idx][i],
                                       start1, length);
             }
+            for (i = 0; i < CPU_VTLB_SIZE; i++) {
+                tlb_reset_dirty_range(&env->tlb_v_table[mmu_idx][i],
+                                      start1, length);
+            }
         }
     }
 }
@@ -208,7 +385,12 @@ void tlb_set_dirty(CPUArchState *env, target_ulong vaddr)
     vaddr &= TARGET_PAGE_MASK;
     i = (vaddr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        int k;
+
         tlb_set_dirty1(&env->tlb_table[mmu_idx][i], vaddr);
+        for (k = 0; k < CPU_VTLB_SIZE; k++) {
+            tlb_set_dirty1(&env->tlb_v_table[mmu_idx][k], vaddr);
+        }
     }
 }
 
@@ -235,6 +417,53 @@ static void tlb_add_large_page(CPUArchState *env, target_ulong vaddr,
     env->tlb_flush_mask = mask;
 }
 
+static inline bool tlb_entry_is_empty(CPUTLBEntry *te)
+{
+    return te->addr_read == -1 && te->addr_write == -1 &&
+           te->addr_code == -1;
+}
+
+static inline bool tlb_entry_is_page(CPUTLBEntry *te, target_ulong page)
+{
+    return page == (te->addr_read & (TARGET_PAGE_MASK | TLB_INVALID_MASK)) ||
+           page == (te->addr_write & (TARGET_PAGE_MASK | TLB_INVALID_MASK)) ||
+           page == (te->addr_code & (TARGET_PAGE_MASK | TLB_INVALID_MASK));
+}
+
+/* Look for the page of ADDR in the victim TLB, comparing the field at
+   ELT_OFS of the entries (addr_read, addr_write or addr_code).  On a hit
+   the entry is swapped with the one at INDEX in tlb_table, so that the
+   access can be retried without calling tlb_fill().  */
+bool tlb_victim_hit(CPUArchState *env, int mmu_idx, int index,
+                    size_t elt_ofs, target_ulong addr)
+{
+    target_ulong page = addr & TARGET_PAGE_MASK;
+    int vidx;
+
+    for (vidx = 0; vidx < CPU_VTLB_SIZE; vidx++) {
+        CPUTLBEntry *ve = &env->tlb_v_table[mmu_idx][vidx];
+        target_ulong cmp = *(target_ulong *)((uintptr_t)ve + elt_ofs);
+
+        if (page == (cmp & (TARGET_PAGE_MASK | TLB_INVALID_MASK))) {
+            CPUTLBEntry *te = &env->tlb_table[mmu_idx][index];
+            CPUTLBEntry tmp;
+            hwaddr iotlb;
+
+            tmp = *te;
+            *te = *ve;
+            *ve = tmp;
+            iotlb = env->iotlb[mmu_idx][index];
+            env->iotlb[mmu_idx][index] = env->iotlb_v[mmu_idx][vidx];
+            env->iotlb_v[mmu_idx][vidx] = iotlb;
+            clear_bit(index, env->tlb_empty[mmu_idx]);
+            env->tlb_victim_hit_count++;
+            return true;
+        }
+    }
+    env->tlb_fill_count++;
+    return false;
+}
+
 /* Add a new TLB entry. At most one entry for a given virtual address
    is permitted. Only a single TARGET_PAGE_SIZE region is mapped, the
    supplied size is only used by tlb_flush_page.  */
@@ -242,6 +471,7 @@ void tlb_set_page(CPUArchState *env, target_ulong vaddr,
                   hwaddr paddr, int prot,
                   int mmu_idx, target_ulong size)
 {
+    AddressSpaceDispatch *d;
     MemoryRegionSection *section;
     unsigned int index;
     target_ulong address;
@@ -254,7 +484,13 @@ void tlb_set_page(CPUArchState *env, target_ulong vaddr,
     if (size != TARGET_PAGE_SIZE) {
         tlb_add_large_page(env, vaddr, size);
     }
-    section = phys_page_find(address_space_memory.dispatch, paddr >> TARGET_PAGE_BITS);
+    rcu_read_lock();
+    d = env->memory_dispatch;
+    if (!d) {
+        d = env->memory_dispatch =
+            atomic_rcu_read(&address_space_memory.dispatch);
+    }
+    section = phys_page_find(d, paddr >> TARGET_PAGE_BITS);
 #if defined(DEBUG_TLB)
     printf("tlb_set_page: vaddr=" TARGET_FMT_lx " paddr=0x" TARGET_FMT_plx
            " prot=%x idx=%d pd=0x%08lx\n",
@@ -276,12 +512,24 @@ void tlb_set_page(CPUArchState *env, target_ulong vaddr,
     }
 
     code_address = address;
-    iotlb = memory_region_section_get_iotlb(env, section, vaddr, paddr, prot,
-                                            &address);
+    iotlb = memory_region_section_get_iotlb(env, d, section, vaddr, paddr,
+                                            prot, &address);
 
     index = (vaddr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
-    env->iotlb[mmu_idx][index] = iotlb - vaddr;
     te = &env->tlb_table[mmu_idx][index];
+
+    /* Keep the entry that we replace in the victim TLB, unless it is
+       empty or maps the same page.  */
+    if (!tlb_entry_is_empty(te) &&
+        !tlb_entry_is_page(te, vaddr & TARGET_PAGE_MASK)) {
+        unsigned int vidx = env->vtlb_index++ % CPU_VTLB_SIZE;
+
+        env->tlb_v_table[mmu_idx][vidx] = *te;
+        env->iotlb_v[mmu_idx][vidx] = env->iotlb[mmu_idx][index];
+    }
+    clear_bit(index, env->tlb_empty[mmu_idx]);
+
+    env->iotlb[mmu_idx][index] = iotlb - vaddr;
     te->addend = addend - vaddr;
     if (prot & PAGE_READ) {
         te->addr_read = address;
@@ -310,6 +558,7 @@ void tlb_set_page(CPUArchState *env, target_ulong vaddr,
     } else {
         te->addr_write = -1;
     }
+    rcu_read_unlock();
 }
 
 /* NOTE: this function can trigger an exception */
@@ -330,7 +579,7 @@ tb_page_addr_t get_page_addr_code(CPUArchState *env1, target_ulong addr)
         cpu_ldub_code(env1, addr);
     }
     pd = env1->iotlb[mmu_idx][page_index] & ~TARGET_PAGE_MASK;
-    mr = iotlb_to_region(pd);
+    mr = iotlb_to_region(env1, pd);
     if (memory_region_is_unassigned(mr)) {
 #if defined(TARGET_ALPHA) || defined(TARGET_MIPS) || defined(TARGET_SPARC)
         cpu_unassigned_access(env1, addr, 0, 1, 0, 4);
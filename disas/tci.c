@@ -43,7 +43,22 @@ int print_insn_tci(bfd_vma addr, disassemble_info *info)
     }
     length = byte;
 
-    if (op >= tcg_op_defs_max) {
+    if ((int)op >= TCI_OP_FIRST) {
+        static const char *const names[] = {
+            [TCI_OP_brcondi_i32 - TCI_OP_FIRST] = "brcondi_i32",
+            [TCI_OP_brcondi_i64 - TCI_OP_FIRST] = "brcondi_i64",
+            [TCI_OP_ld_add_st_i32 - TCI_OP_FIRST] = "ld_add_st_i32",
+            [TCI_OP_ld_add_st_i64 - TCI_OP_FIRST] = "ld_add_st_i64",
+        };
+        int i = (int)op - TCI_OP_FIRST;
+        const char *name = i < ARRAY_SIZE(names) ? names[i] : NULL;
+
+        if (name) {
+            info->fprintf_func(info->stream, "%s", name);
+        } else {
+            info->fprintf_func(info->stream, "illegal opcode %d", op);
+        }
+    } else if (op >= tcg_op_defs_max) {
         info->fprintf_func(info->stream, "illegal opcode %d", op);
     } else {
         const TCGOpDef *def = &tcg_op_defs[op];
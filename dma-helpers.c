@@ -169,7 +169,8 @@ static void dma_bdrv_cb(void *opaque, int ret)
 
     if (dbs->iov.size == 0) {
         trace_dma_map_wait(dbs);
-        cpu_register_map_client(dbs, continue_after_map_failure);
+        address_space_register_map_client(dbs->sg->dma->as, dbs,
+                                          continue_after_map_failure);
         return;
     }
 
@@ -289,6 +290,7 @@ bool iommu_dma_memory_valid(DMAContext *dma, dma_addr_t addr, dma_addr_t len,
 #endif
 
     while (len) {
+        plen = len;
         if (dma->translate(dma, addr, &paddr, &plen, dir) != 0) {
             return false;
         }
@@ -317,6 +319,7 @@ int iommu_dma_memory_rw(DMAContext *dma, dma_addr_t addr,
 #endif
 
     while (len) {
+        plen = len;
         err = dma->translate(dma, addr, &paddr, &plen, dir);
         if (err) {
 	    /*
@@ -355,6 +358,7 @@ int iommu_dma_memory_set(DMAContext *dma, dma_addr_t addr, uint8_t c,
 #endif
 
     while (len) {
+        plen = len;
         err = dma->translate(dma, addr, &paddr, &plen,
                              DMA_DIRECTION_FROM_DEVICE);
         if (err) {
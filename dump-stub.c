@@ -19,11 +19,18 @@
 /* we need this function in hmp.c */
 void qmp_dump_guest_memory(bool paging, const char *file, bool has_begin,
                            int64_t begin, bool has_length, int64_t length,
-                           Error **errp)
+                           bool has_format, DumpGuestMemoryFormat format,
+                           bool has_detach, bool detach, Error **errp)
 {
     error_set(errp, QERR_UNSUPPORTED);
 }
 
+DumpQueryResult *qmp_query_dump(Error **errp)
+{
+    error_set(errp, QERR_UNSUPPORTED);
+    return NULL;
+}
+
 int cpu_write_elf64_note(write_core_dump_function f,
                                        CPUArchState *env, int cpuid,
                                        void *opaque)
@@ -18,13 +18,35 @@
 #include "exec/hwaddr.h"
 #include "monitor/monitor.h"
 #include "sysemu/kvm.h"
+#include "sysemu/cpus.h"
 #include "sysemu/dump.h"
 #include "sysemu/sysemu.h"
 #include "sysemu/memory_mapping.h"
 #include "qapi/error.h"
+#include "qapi/qmp/qjson.h"
+#include "qapi/qmp/qstring.h"
+#include "qemu/thread.h"
+#include "qemu/atomic.h"
 #include "qmp-commands.h"
 #include "exec/gdbstub.h"
 
+#include <zlib.h>
+#ifdef CONFIG_LZO
+#include <lzo/lzo1x.h>
+#endif
+#ifdef CONFIG_SNAPPY
+#include <snappy-c.h>
+#endif
+
+/* the ELF format writes runs of populated pages of up to this size at once */
+#define DUMP_WRITE_CHUNK        (1024 * 1024)
+
+/* pages handed to a compression thread at a time */
+#define KDUMP_BATCH_PAGES       256
+#define KDUMP_MAX_THREADS       8
+
+static const uint8_t zero_page[TARGET_PAGE_SIZE];
+
 static uint16_t cpu_convert_to_target16(uint16_t val, int endian)
 {
     if (endian == ELFDATA2LSB) {
@@ -58,6 +80,43 @@ static uint64_t cpu_convert_to_target64(uint64_t val, int endian)
     return val;
 }
 
+/* a RAM block, as a run of guest page frames */
+typedef struct DumpRange {
+    uint64_t pfn;
+    uint64_t nr_pages;
+    uint8_t *host;
+} DumpRange;
+
+typedef struct KdumpBatch {
+    int nr_pages;
+    bool done;
+    /* NULL for a page that background preallocation has not reached */
+    uint8_t *pages[KDUMP_BATCH_PAGES];
+    /* filled in by the compression thread; a size of 0 is a zero page */
+    uint32_t size[KDUMP_BATCH_PAGES];
+    uint32_t flags[KDUMP_BATCH_PAGES];
+    uint8_t *data;
+    size_t data_len;
+} KdumpBatch;
+
+/*
+ * Batches go round a ring: the dump thread fills and queues them in page
+ * order, the compression threads take them in the same order, and the dump
+ * thread writes them out in order once they are done.
+ */
+typedef struct KdumpWork {
+    QemuMutex lock;
+    QemuCond work_cond;
+    QemuCond done_cond;
+    KdumpBatch *batches;
+    int nr_batches;
+    uint64_t queued;
+    uint64_t taken;
+    bool quit;
+    QemuThread *threads;
+    int nr_threads;
+} KdumpWork;
+
 typedef struct DumpState {
     ArchDumpInfo dump_info;
     MemoryMappingList list;
@@ -75,13 +134,47 @@ typedef struct DumpState {
     int64_t begin;
     int64_t length;
     Error **errp;
+
+    DumpGuestMemoryFormat format;
+    QemuThread thread;
+    QEMUBH *bh;
+    int ret;
+    const char *error;
+
+    /* bytes of guest memory to dump, and dumped so far */
+    int64_t total_size;
+    int64_t written_size;
+
+    /* kdump-compressed format */
+    DumpRange *ranges;
+    int nr_ranges;
+    int cur_range;
+    uint64_t cur_page;
+    uint64_t max_mapnr;
+    uint64_t nr_pages;
+    uint32_t flag_compress;
+    size_t compress_bound;
+    uint8_t *note_buf;
+    size_t note_buf_offset;
+    size_t len_dump_bitmap;
+    off_t offset_dump_bitmap;
+    off_t offset_page;
+    off_t offset_data;
+    KdumpWork work;
 } DumpState;
 
+/* the detached dump being written, if any */
+static DumpState *dump_current;
+static DumpStatus dump_last_status;
+static int64_t dump_last_completed;
+static int64_t dump_last_total;
+
 static int dump_cleanup(DumpState *s)
 {
     int ret = 0;
 
     memory_mapping_list_free(&s->list);
+    g_free(s->ranges);
     if (s->fd != -1) {
         close(s->fd);
     }
@@ -94,7 +187,9 @@ static int dump_cleanup(DumpState *s)
 
 static void dump_error(DumpState *s, const char *reason)
 {
-    dump_cleanup(s);
+    if (!s->error) {
+        s->error = reason;
+    }
 }
 
 static int fd_write_vmcore(void *buf, size_t size, void *opaque)
@@ -110,6 +205,15 @@ static int fd_write_vmcore(void *buf, size_t size, void *opaque)
     return 0;
 }
 
+static int fd_write_vmcore_at(DumpState *s, const void *buf, size_t size,
+                              off_t offset)
+{
+    if (lseek(s->fd, offset, SEEK_SET) != offset) {
+        return -1;
+    }
+    return fd_write_vmcore((void *)buf, size, s);
+}
+
 static int write_elf64_header(DumpState *s)
 {
     Elf64_Ehdr elf_header;
@@ -141,7 +245,7 @@ static int write_elf64_header(DumpState *s)
 
     ret = fd_write_vmcore(&elf_header, sizeof(elf_header), s);
     if (ret < 0) {
-        dump_error(s, "dump: failed to write elf header.\n");
+        dump_error(s, "dump: failed to write elf header");
         return -1;
     }
 
@@ -179,7 +283,7 @@ static int write_elf32_header(DumpState *s)
 
     ret = fd_write_vmcore(&elf_header, sizeof(elf_header), s);
     if (ret < 0) {
-        dump_error(s, "dump: failed to write elf header.\n");
+        dump_error(s, "dump: failed to write elf header");
         return -1;
     }
 
@@ -208,7 +312,7 @@ static int write_elf64_load(DumpState *s, MemoryMapping *memory_mapping,
 
     ret = fd_write_vmcore(&phdr, sizeof(Elf64_Phdr), s);
     if (ret < 0) {
-        dump_error(s, "dump: failed to write program header table.\n");
+        dump_error(s, "dump: failed to write program header table");
         return -1;
     }
 
@@ -237,7 +341,7 @@ static int write_elf32_load(DumpState *s, MemoryMapping *memory_mapping,
 
     ret = fd_write_vmcore(&phdr, sizeof(Elf32_Phdr), s);
     if (ret < 0) {
-        dump_error(s, "dump: failed to write program header table.\n");
+        dump_error(s, "dump: failed to write program header table");
         return -1;
     }
 
@@ -261,14 +365,14 @@ static int write_elf64_note(DumpState *s)
 
     ret = fd_write_vmcore(&phdr, sizeof(Elf64_Phdr), s);
     if (ret < 0) {
-        dump_error(s, "dump: failed to write program header table.\n");
+        dump_error(s, "dump: failed to write program header table");
         return -1;
     }
 
     return 0;
 }
 
-static int write_elf64_notes(DumpState *s)
+static int write_elf64_notes(write_core_dump_function f, DumpState *s)
 {
     CPUArchState *env;
     CPUState *cpu;
@@ -278,17 +382,17 @@ static int write_elf64_notes(DumpState *s)
     for (env = first_cpu; env != NULL; env = env->next_cpu) {
         cpu = ENV_GET_CPU(env);
         id = cpu_index(cpu);
-        ret = cpu_write_elf64_note(fd_write_vmcore, env, id, s);
+        ret = cpu_write_elf64_note(f, env, id, s);
         if (ret < 0) {
-            dump_error(s, "dump: failed to write elf notes.\n");
+            dump_error(s, "dump: failed to write elf notes");
             return -1;
         }
     }
 
     for (env = first_cpu; env != NULL; env = env->next_cpu) {
-        ret = cpu_write_elf64_qemunote(fd_write_vmcore, env, s);
+        ret = cpu_write_elf64_qemunote(f, env, s);
         if (ret < 0) {
-            dump_error(s, "dump: failed to write CPU status.\n");
+            dump_error(s, "dump: failed to write CPU status");
             return -1;
         }
     }
@@ -313,7 +417,7 @@ static int write_elf32_note(DumpState *s)
 
     ret = fd_write_vmcore(&phdr, sizeof(Elf32_Phdr), s);
     if (ret < 0) {
-        dump_error(s, "dump: failed to write program header table.\n");
+        dump_error(s, "dump: failed to write program header table");
         return -1;
     }
 
@@ -332,7 +436,7 @@ static int write_elf32_notes(DumpState *s)
         id = cpu_index(cpu);
         ret = cpu_write_elf32_note(fd_write_vmcore, env, id, s);
         if (ret < 0) {
-            dump_error(s, "dump: failed to write elf notes.\n");
+            dump_error(s, "dump: failed to write elf notes");
             return -1;
         }
     }
@@ -340,7 +444,7 @@ static int write_elf32_notes(DumpState *s)
     for (env = first_cpu; env != NULL; env = env->next_cpu) {
         ret = cpu_write_elf32_qemunote(fd_write_vmcore, env, s);
         if (ret < 0) {
-            dump_error(s, "dump: failed to write CPU status.\n");
+            dump_error(s, "dump: failed to write CPU status");
             return -1;
         }
     }
@@ -371,7 +475,7 @@ static int write_elf_section(DumpState *s, int type)
 
     ret = fd_write_vmcore(&shdr, shdr_size, s);
     if (ret < 0) {
-        dump_error(s, "dump: failed to write section header table.\n");
+        dump_error(s, "dump: failed to write section header table");
         return -1;
     }
 
@@ -384,34 +488,41 @@ static int write_data(DumpState *s, void *buf, int length)
 
     ret = fd_write_vmcore(buf, length, s);
     if (ret < 0) {
-        dump_error(s, "dump: failed to save memory.\n");
+        dump_error(s, "dump: failed to save memory");
         return -1;
     }
 
     return 0;
 }
 
-/* write the memroy to vmcore. 1 page per I/O. */
+/* write the memory to vmcore, as many pages per I/O as possible */
 static int write_memory(DumpState *s, RAMBlock *block, ram_addr_t start,
                         int64_t size)
 {
-    int64_t i;
+    uint8_t *p = block->host + start;
+    int64_t done = 0, len;
     int ret;
 
-    for (i = 0; i < size / TARGET_PAGE_SIZE; i++) {
-        ret = write_data(s, block->host + start + i * TARGET_PAGE_SIZE,
-                         TARGET_PAGE_SIZE);
-        if (ret < 0) {
-            return ret;
+    while (done < size) {
+        /* Do not allocate pages that background preallocation has not
+         * reached yet
+         */
+        if (qemu_ram_page_unpopulated(p + done)) {
+            len = MIN(TARGET_PAGE_SIZE, size - done);
+            ret = write_data(s, (void *)zero_page, len);
+        } else {
+            len = 0;
+            do {
+                len += MIN(TARGET_PAGE_SIZE, size - done - len);
+            } while (done + len < size && len < DUMP_WRITE_CHUNK &&
+                     !qemu_ram_page_unpopulated(p + done + len));
+            ret = write_data(s, p + done, len);
         }
-    }
-
-    if ((size % TARGET_PAGE_SIZE) != 0) {
-        ret = write_data(s, block->host + start + i * TARGET_PAGE_SIZE,
-                         size % TARGET_PAGE_SIZE);
         if (ret < 0) {
             return ret;
         }
+        done += len;
+        s->written_size += len;
     }
 
     return 0;
@@ -557,7 +668,7 @@ static int dump_begin(DumpState *s)
         }
 
         /* write notes to vmcore */
-        if (write_elf64_notes(s) < 0) {
+        if (write_elf64_notes(fd_write_vmcore, s) < 0) {
             return -1;
         }
 
@@ -588,13 +699,6 @@ static int dump_begin(DumpState *s)
     return 0;
 }
 
-/* write PT_LOAD to vmcore */
-static int dump_completed(DumpState *s)
-{
-    dump_cleanup(s);
-    return 0;
-}
-
 static int get_next_block(DumpState *s, RAMBlock *block)
 {
     while (1) {
@@ -646,27 +750,478 @@ static int dump_iterate(DumpState *s)
 
         ret = get_next_block(s, block);
         if (ret == 1) {
-            dump_completed(s);
             return 0;
         }
     }
 }
 
-static int create_vmcore(DumpState *s)
+static bool dump_is_kdump(DumpState *s)
+{
+    return s->format != DUMP_GUEST_MEMORY_FORMAT_ELF;
+}
+
+static int buf_write_note(void *buf, size_t size, void *opaque)
+{
+    DumpState *s = opaque;
+
+    if (s->note_buf_offset + size > s->note_size) {
+        return -1;
+    }
+    memcpy(s->note_buf + s->note_buf_offset, buf, size);
+    s->note_buf_offset += size;
+
+    return 0;
+}
+
+/* write the disk dump header, the kdump sub header and the elf notes */
+static int write_kdump_header(DumpState *s)
 {
+    int endian = s->dump_info.d_endian;
+    uint32_t block_size = TARGET_PAGE_SIZE;
+    uint32_t sub_hdr_size;
+    DiskDumpHeader64 *dh;
+    KdumpSubHeader64 *kh;
+    CPUArchState *env;
+    uint32_t nr_cpus = 0;
+    size_t size;
+    uint8_t *buf;
     int ret;
 
-    ret = dump_begin(s);
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        nr_cpus++;
+    }
+
+    sub_hdr_size = DIV_ROUND_UP(sizeof(KdumpSubHeader64) + s->note_size,
+                                block_size);
+    size = (KDUMP_HEADER_BLOCKS + sub_hdr_size) * block_size;
+    buf = g_malloc0(size);
+
+    dh = (DiskDumpHeader64 *)buf;
+    memcpy(dh->signature, KDUMP_SIGNATURE, KDUMP_SIG_LEN);
+    dh->header_version = cpu_convert_to_target32(KDUMP_HEADER_VERSION,
+                                                 endian);
+    if (s->dump_info.d_machine == EM_X86_64) {
+        pstrcpy(dh->utsname.machine, sizeof(dh->utsname.machine), "x86_64");
+    }
+    dh->status = cpu_convert_to_target32(s->flag_compress, endian);
+    dh->block_size = cpu_convert_to_target32(block_size, endian);
+    dh->sub_hdr_size = cpu_convert_to_target32(sub_hdr_size, endian);
+    dh->bitmap_blocks = cpu_convert_to_target32(s->len_dump_bitmap /
+                                                block_size, endian);
+    dh->max_mapnr = cpu_convert_to_target32(MIN(s->max_mapnr, UINT32_MAX),
+                                            endian);
+    dh->nr_cpus = cpu_convert_to_target32(nr_cpus, endian);
+
+    kh = (KdumpSubHeader64 *)(buf + KDUMP_HEADER_BLOCKS * block_size);
+    kh->dump_level = cpu_convert_to_target32(KDUMP_DUMP_LEVEL, endian);
+    kh->max_mapnr_64 = cpu_convert_to_target64(s->max_mapnr, endian);
+    kh->offset_note = cpu_convert_to_target64(KDUMP_HEADER_BLOCKS *
+                                              block_size + sizeof(*kh),
+                                              endian);
+    kh->size_note = cpu_convert_to_target64(s->note_size, endian);
+
+    s->note_buf = (uint8_t *)(kh + 1);
+    s->note_buf_offset = 0;
+    ret = write_elf64_notes(buf_write_note, s);
+    s->note_buf = NULL;
     if (ret < 0) {
-        return -1;
+        goto out;
     }
 
-    ret = dump_iterate(s);
+    s->offset_dump_bitmap = size;
+    s->offset_page = s->offset_dump_bitmap + s->len_dump_bitmap;
+    s->offset_data = s->offset_page + s->nr_pages * sizeof(PageDescriptor);
+
+    ret = fd_write_vmcore_at(s, buf, size, 0);
+    if (ret < 0) {
+        dump_error(s, "dump: failed to write kdump header");
+    }
+
+out:
+    g_free(buf);
+    return ret;
+}
+
+/*
+ * Both bitmaps hold every page frame of guest RAM: zero pages are dumped
+ * too, but they all share the descriptor of a single zero page.
+ */
+static int write_kdump_bitmap(DumpState *s)
+{
+    size_t half = s->len_dump_bitmap / 2;
+    uint8_t *bitmap = g_malloc0(half);
+    uint64_t pfn, end;
+    int i, ret;
+
+    for (i = 0; i < s->nr_ranges; i++) {
+        end = s->ranges[i].pfn + s->ranges[i].nr_pages;
+        for (pfn = s->ranges[i].pfn; pfn < end; pfn++) {
+            bitmap[pfn >> 3] |= 1 << (pfn & 7);
+        }
+    }
+
+    ret = fd_write_vmcore_at(s, bitmap, half, s->offset_dump_bitmap);
+    if (ret == 0) {
+        ret = fd_write_vmcore_at(s, bitmap, half,
+                                 s->offset_dump_bitmap + half);
+    }
     if (ret < 0) {
+        dump_error(s, "dump: failed to write kdump bitmap");
+    }
+
+    g_free(bitmap);
+    return ret;
+}
+
+/* Returns the compressed size, or 0 if the page does not compress */
+static size_t kdump_compress_page(DumpState *s, uint8_t *out,
+                                  const uint8_t *page, void *wrkmem)
+{
+    switch (s->format) {
+    case DUMP_GUEST_MEMORY_FORMAT_KDUMP_ZLIB: {
+        uLongf len = s->compress_bound;
+
+        if (compress2(out, &len, page, TARGET_PAGE_SIZE,
+                      Z_BEST_SPEED) != Z_OK) {
+            return 0;
+        }
+        return len;
+    }
+#ifdef CONFIG_LZO
+    case DUMP_GUEST_MEMORY_FORMAT_KDUMP_LZO: {
+        lzo_uint len = s->compress_bound;
+
+        if (lzo1x_1_compress(page, TARGET_PAGE_SIZE, out, &len,
+                             wrkmem) != LZO_E_OK) {
+            return 0;
+        }
+        return len;
+    }
+#endif
+#ifdef CONFIG_SNAPPY
+    case DUMP_GUEST_MEMORY_FORMAT_KDUMP_SNAPPY: {
+        size_t len = s->compress_bound;
+
+        if (snappy_compress((const char *)page, TARGET_PAGE_SIZE,
+                            (char *)out, &len) != SNAPPY_OK) {
+            return 0;
+        }
+        return len;
+    }
+#endif
+    default:
+        abort();
+    }
+}
+
+static void kdump_compress_batch(DumpState *s, KdumpBatch *b, void *wrkmem)
+{
+    uint8_t *out;
+    size_t len;
+    int i;
+
+    b->data_len = 0;
+    for (i = 0; i < b->nr_pages; i++) {
+        if (!b->pages[i] || buffer_is_zero(b->pages[i], TARGET_PAGE_SIZE)) {
+            b->size[i] = 0;
+            continue;
+        }
+
+        out = b->data + b->data_len;
+        len = kdump_compress_page(s, out, b->pages[i], wrkmem);
+        if (len && len < TARGET_PAGE_SIZE) {
+            b->size[i] = len;
+            b->flags[i] = s->flag_compress;
+        } else {
+            memcpy(out, b->pages[i], TARGET_PAGE_SIZE);
+            b->size[i] = TARGET_PAGE_SIZE;
+            b->flags[i] = 0;
+        }
+        b->data_len += b->size[i];
+    }
+}
+
+static void *kdump_compress_thread(void *opaque)
+{
+    DumpState *s = opaque;
+    KdumpWork *w = &s->work;
+    void *wrkmem = NULL;
+    KdumpBatch *b;
+
+#ifdef CONFIG_LZO
+    if (s->format == DUMP_GUEST_MEMORY_FORMAT_KDUMP_LZO) {
+        wrkmem = g_malloc(LZO1X_1_MEM_COMPRESS);
+    }
+#endif
+    qemu_register_thread("dump/compress", qemu_get_thread_id());
+
+    qemu_mutex_lock(&w->lock);
+    for (;;) {
+        while (!w->quit && w->taken == w->queued) {
+            qemu_cond_wait(&w->work_cond, &w->lock);
+        }
+        if (w->quit) {
+            break;
+        }
+        b = &w->batches[w->taken++ % w->nr_batches];
+        qemu_mutex_unlock(&w->lock);
+
+        kdump_compress_batch(s, b, wrkmem);
+
+        qemu_mutex_lock(&w->lock);
+        b->done = true;
+        qemu_cond_signal(&w->done_cond);
+    }
+    qemu_mutex_unlock(&w->lock);
+
+    qemu_unregister_thread(qemu_get_thread_id());
+    g_free(wrkmem);
+    return NULL;
+}
+
+/* Take the next pages of guest RAM; returns false once there are none */
+static bool kdump_fill_batch(DumpState *s, KdumpBatch *b)
+{
+    DumpRange *r;
+    uint8_t *p;
+
+    b->nr_pages = 0;
+    while (b->nr_pages < KDUMP_BATCH_PAGES && s->cur_range < s->nr_ranges) {
+        r = &s->ranges[s->cur_range];
+        p = r->host + s->cur_page * TARGET_PAGE_SIZE;
+        b->pages[b->nr_pages++] = qemu_ram_page_unpopulated(p) ? NULL : p;
+        if (++s->cur_page == r->nr_pages) {
+            s->cur_range++;
+            s->cur_page = 0;
+        }
+    }
+
+    return b->nr_pages > 0;
+}
+
+static void kdump_queue_batch(KdumpWork *w, KdumpBatch *b)
+{
+    qemu_mutex_lock(&w->lock);
+    b->done = false;
+    w->queued++;
+    qemu_cond_signal(&w->work_cond);
+    qemu_mutex_unlock(&w->lock);
+}
+
+static int kdump_nr_threads(void)
+{
+    long n = 1;
+
+#ifdef _SC_NPROCESSORS_ONLN
+    n = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    return MAX(1, MIN(n, KDUMP_MAX_THREADS));
+}
+
+static void kdump_start_threads(DumpState *s)
+{
+    KdumpWork *w = &s->work;
+    int i;
+
+    qemu_mutex_init(&w->lock);
+    qemu_cond_init(&w->work_cond);
+    qemu_cond_init(&w->done_cond);
+    w->queued = w->taken = 0;
+    w->quit = false;
+
+    w->nr_threads = kdump_nr_threads();
+    w->nr_batches = 2 * w->nr_threads;
+    w->batches = g_new0(KdumpBatch, w->nr_batches);
+    for (i = 0; i < w->nr_batches; i++) {
+        w->batches[i].data = g_malloc(KDUMP_BATCH_PAGES *
+                                      MAX(s->compress_bound,
+                                          TARGET_PAGE_SIZE));
+    }
+
+    w->threads = g_new0(QemuThread, w->nr_threads);
+    for (i = 0; i < w->nr_threads; i++) {
+        qemu_thread_create(&w->threads[i], kdump_compress_thread, s,
+                           QEMU_THREAD_JOINABLE);
+    }
+}
+
+static void kdump_stop_threads(DumpState *s)
+{
+    KdumpWork *w = &s->work;
+    int i;
+
+    qemu_mutex_lock(&w->lock);
+    w->quit = true;
+    qemu_cond_broadcast(&w->work_cond);
+    qemu_mutex_unlock(&w->lock);
+
+    for (i = 0; i < w->nr_threads; i++) {
+        qemu_thread_join(&w->threads[i]);
+    }
+    for (i = 0; i < w->nr_batches; i++) {
+        g_free(w->batches[i].data);
+    }
+    g_free(w->batches);
+    g_free(w->threads);
+
+    qemu_cond_destroy(&w->done_cond);
+    qemu_cond_destroy(&w->work_cond);
+    qemu_mutex_destroy(&w->lock);
+}
+
+/* write the page descriptors and the page data, in page frame order */
+static int write_kdump_pages(DumpState *s)
+{
+    int endian = s->dump_info.d_endian;
+    KdumpWork *w = &s->work;
+    PageDescriptor pd_zero, *pd;
+    off_t desc_off = s->offset_page, data_off = s->offset_data;
+    uint64_t seq, pos;
+    KdumpBatch *b;
+    int i, ret;
+
+    /* every zero page refers to this one */
+    ret = fd_write_vmcore_at(s, zero_page, TARGET_PAGE_SIZE, data_off);
+    if (ret < 0) {
+        dump_error(s, "dump: failed to save memory");
+        return ret;
+    }
+    memset(&pd_zero, 0, sizeof(pd_zero));
+    pd_zero.offset = cpu_convert_to_target64(data_off, endian);
+    pd_zero.size = cpu_convert_to_target32(TARGET_PAGE_SIZE, endian);
+    data_off += TARGET_PAGE_SIZE;
+
+    pd = g_new(PageDescriptor, KDUMP_BATCH_PAGES);
+    kdump_start_threads(s);
+
+    s->cur_range = 0;
+    s->cur_page = 0;
+    for (i = 0; i < w->nr_batches; i++) {
+        if (!kdump_fill_batch(s, &w->batches[i])) {
+            break;
+        }
+        kdump_queue_batch(w, &w->batches[i]);
+    }
+
+    for (seq = 0; seq < w->queued; seq++) {
+        b = &w->batches[seq % w->nr_batches];
+
+        qemu_mutex_lock(&w->lock);
+        while (!b->done) {
+            qemu_cond_wait(&w->done_cond, &w->lock);
+        }
+        qemu_mutex_unlock(&w->lock);
+
+        pos = data_off;
+        for (i = 0; i < b->nr_pages; i++) {
+            if (!b->size[i]) {
+                pd[i] = pd_zero;
+                continue;
+            }
+            pd[i].offset = cpu_convert_to_target64(pos, endian);
+            pd[i].size = cpu_convert_to_target32(b->size[i], endian);
+            pd[i].flags = cpu_convert_to_target32(b->flags[i], endian);
+            pd[i].page_flags = 0;
+            pos += b->size[i];
+        }
+
+        ret = fd_write_vmcore_at(s, b->data, b->data_len, data_off);
+        if (ret == 0) {
+            ret = fd_write_vmcore_at(s, pd, b->nr_pages * sizeof(*pd),
+                                     desc_off);
+        }
+        if (ret < 0) {
+            dump_error(s, "dump: failed to save memory");
+            break;
+        }
+        data_off += b->data_len;
+        desc_off += b->nr_pages * sizeof(*pd);
+        s->written_size += (int64_t)b->nr_pages * TARGET_PAGE_SIZE;
+
+        if (kdump_fill_batch(s, b)) {
+            kdump_queue_batch(w, b);
+        }
+    }
+
+    kdump_stop_threads(s);
+    g_free(pd);
+    return ret;
+}
+
+/* everything that needs the CPU state is written here, under the BQL */
+static int dump_headers(DumpState *s)
+{
+    if (!dump_is_kdump(s)) {
+        return dump_begin(s);
+    }
+    if (write_kdump_header(s) < 0) {
         return -1;
     }
+    return write_kdump_bitmap(s);
+}
 
-    return 0;
+/* write the guest memory; may run outside the BQL */
+static int dump_memory(DumpState *s)
+{
+    int ret;
+
+    /* keep the RAM blocks from going away under us */
+    qemu_mutex_lock_ramlist();
+    if (dump_is_kdump(s)) {
+        ret = write_kdump_pages(s);
+    } else {
+        ret = dump_iterate(s);
+    }
+    qemu_mutex_unlock_ramlist();
+
+    return ret;
+}
+
+static void dump_finish(DumpState *s, int ret)
+{
+    QObject *data;
+
+    dump_cleanup(s);
+
+    dump_last_status = ret < 0 ? DUMP_STATUS_FAILED : DUMP_STATUS_COMPLETED;
+    dump_last_completed = s->written_size;
+    dump_last_total = s->total_size;
+
+    if (s == dump_current) {
+        data = qobject_from_jsonf("{ 'status': %s, 'total': %" PRId64 " }",
+                                  DumpStatus_lookup[dump_last_status],
+                                  s->total_size);
+        if (ret < 0) {
+            qdict_put(qobject_to_qdict(data), "error",
+                      qstring_from_str(s->error ? s->error :
+                                       "dump: I/O error"));
+        }
+        monitor_protocol_event(QEVENT_DUMP_COMPLETED, data);
+        qobject_decref(data);
+        dump_current = NULL;
+    }
+}
+
+static void dump_bh(void *opaque)
+{
+    DumpState *s = opaque;
+
+    qemu_thread_join(&s->thread);
+    qemu_bh_delete(s->bh);
+    dump_finish(s, s->ret);
+    g_free(s);
+}
+
+static void *dump_thread(void *opaque)
+{
+    DumpState *s = opaque;
+
+    qemu_register_thread("dump", qemu_get_thread_id());
+    s->ret = dump_memory(s);
+    qemu_unregister_thread(qemu_get_thread_id());
+
+    qemu_bh_schedule(s->bh);
+    return NULL;
 }
 
 static ram_addr_t get_start_block(DumpState *s)
@@ -697,8 +1252,109 @@ static ram_addr_t get_start_block(DumpState *s)
     return -1;
 }
 
+static int dump_range_compare(const void *a, const void *b)
+{
+    const DumpRange *ra = a, *rb = b;
+
+    return ra->pfn < rb->pfn ? -1 : ra->pfn > rb->pfn;
+}
+
+static int64_t dump_total_size(DumpState *s)
+{
+    RAMBlock *block;
+    int64_t start, end, total = 0;
+
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        start = block->offset;
+        end = block->offset + block->length;
+        if (s->has_filter) {
+            start = MAX(start, s->begin);
+            end = MIN(end, s->begin + s->length);
+        }
+        if (start < end) {
+            total += end - start;
+        }
+    }
+
+    return total;
+}
+
+/* the kdump format lists page frames in order, unlike ram_list */
+static void kdump_init_ranges(DumpState *s)
+{
+    RAMBlock *block;
+    DumpRange *r;
+
+    s->nr_ranges = 0;
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        s->nr_ranges++;
+    }
+    s->ranges = g_new0(DumpRange, s->nr_ranges);
+
+    r = s->ranges;
+    s->max_mapnr = 0;
+    s->nr_pages = 0;
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        r->pfn = block->offset >> TARGET_PAGE_BITS;
+        r->nr_pages = block->length >> TARGET_PAGE_BITS;
+        r->host = block->host;
+        s->max_mapnr = MAX(s->max_mapnr, r->pfn + r->nr_pages);
+        s->nr_pages += r->nr_pages;
+        r++;
+    }
+    qsort(s->ranges, s->nr_ranges, sizeof(DumpRange), dump_range_compare);
+
+    /* two bitmaps, each a whole number of blocks */
+    s->len_dump_bitmap = 2 * QEMU_ALIGN_UP(DIV_ROUND_UP(s->max_mapnr, 8),
+                                           TARGET_PAGE_SIZE);
+}
+
+static bool kdump_format_supported(DumpGuestMemoryFormat format)
+{
+    switch (format) {
+    case DUMP_GUEST_MEMORY_FORMAT_KDUMP_ZLIB:
+        return true;
+#ifdef CONFIG_LZO
+    case DUMP_GUEST_MEMORY_FORMAT_KDUMP_LZO:
+        return lzo_init() == LZO_E_OK;
+#endif
+#ifdef CONFIG_SNAPPY
+    case DUMP_GUEST_MEMORY_FORMAT_KDUMP_SNAPPY:
+        return true;
+#endif
+    default:
+        return false;
+    }
+}
+
+static void kdump_init_compression(DumpState *s)
+{
+    switch (s->format) {
+    case DUMP_GUEST_MEMORY_FORMAT_KDUMP_ZLIB:
+        s->flag_compress = DUMP_DH_COMPRESSED_ZLIB;
+        s->compress_bound = compressBound(TARGET_PAGE_SIZE);
+        break;
+#ifdef CONFIG_LZO
+    case DUMP_GUEST_MEMORY_FORMAT_KDUMP_LZO:
+        s->flag_compress = DUMP_DH_COMPRESSED_LZO;
+        /* the worst case of lzo1x_1, from the lzo FAQ */
+        s->compress_bound = TARGET_PAGE_SIZE + TARGET_PAGE_SIZE / 16 + 64 + 3;
+        break;
+#endif
+#ifdef CONFIG_SNAPPY
+    case DUMP_GUEST_MEMORY_FORMAT_KDUMP_SNAPPY:
+        s->flag_compress = DUMP_DH_COMPRESSED_SNAPPY;
+        s->compress_bound = snappy_max_compressed_length(TARGET_PAGE_SIZE);
+        break;
+#endif
+    default:
+        abort();
+    }
+}
+
 static int dump_init(DumpState *s, int fd, bool paging, bool has_filter,
-                     int64_t begin, int64_t length, Error **errp)
+                     int64_t begin, int64_t length,
+                     DumpGuestMemoryFormat format, Error **errp)
 {
     CPUArchState *env;
     int nr_cpus;
@@ -716,11 +1372,13 @@ static int dump_init(DumpState *s, int fd, bool paging, bool has_filter,
     s->has_filter = has_filter;
     s->begin = begin;
     s->length = length;
+    s->format = format;
     s->start = get_start_block(s);
     if (s->start == -1) {
         error_set(errp, QERR_INVALID_PARAMETER, "begin");
         goto cleanup;
     }
+    s->total_size = dump_total_size(s);
 
     /*
      * get dump info: endian, class and architecture.
@@ -749,6 +1407,21 @@ static int dump_init(DumpState *s, int fd, bool paging, bool has_filter,
         goto cleanup;
     }
 
+    if (dump_is_kdump(s)) {
+        if (s->dump_info.d_class != ELFCLASS64) {
+            error_setg(errp, "The kdump-compressed format needs a 64-bit "
+                       "guest");
+            goto cleanup;
+        }
+        if (lseek(fd, 0, SEEK_CUR) < 0) {
+            error_setg(errp, "The kdump-compressed format needs a seekable "
+                       "file");
+            goto cleanup;
+        }
+        kdump_init_compression(s);
+        kdump_init_ranges(s);
+    }
+
     /* get memory mapping */
     memory_mapping_list_init(&s->list);
     if (paging) {
@@ -815,13 +1488,38 @@ cleanup:
 
 void qmp_dump_guest_memory(bool paging, const char *file, bool has_begin,
                            int64_t begin, bool has_length, int64_t length,
-                           Error **errp)
+                           bool has_format, DumpGuestMemoryFormat format,
+                           bool has_detach, bool detach, Error **errp)
 {
     const char *p;
     int fd = -1;
     DumpState *s;
     int ret;
 
+    if (!has_format) {
+        format = DUMP_GUEST_MEMORY_FORMAT_ELF;
+    }
+    if (!has_detach) {
+        detach = false;
+    }
+
+    if (dump_current) {
+        error_setg(errp, "A guest memory dump is already in progress");
+        return;
+    }
+    if (format != DUMP_GUEST_MEMORY_FORMAT_ELF) {
+        if (paging || has_begin || has_length) {
+            error_setg(errp, "The kdump-compressed format supports neither "
+                       "paging nor begin and length");
+            return;
+        }
+        if (!kdump_format_supported(format)) {
+            error_set(errp, QERR_INVALID_PARAMETER_VALUE, "format",
+                      "a format that this QEMU was built with");
+            return;
+        }
+    }
+
     if (has_begin && !has_length) {
         error_set(errp, QERR_MISSING_PARAMETER, "length");
         return;
@@ -853,17 +1551,46 @@ void qmp_dump_guest_memory(bool paging, const char *file, bool has_begin,
         return;
     }
 
-    s = g_malloc(sizeof(DumpState));
+    s = g_malloc0(sizeof(DumpState));
 
-    ret = dump_init(s, fd, paging, has_begin, begin, length, errp);
+    ret = dump_init(s, fd, paging, has_begin, begin, length, format, errp);
     if (ret < 0) {
         g_free(s);
         return;
     }
 
-    if (create_vmcore(s) < 0 && !error_is_set(s->errp)) {
+    ret = dump_headers(s);
+    if (ret == 0 && detach) {
+        /* the guest stays stopped, but the monitor goes on */
+        dump_current = s;
+        s->bh = qemu_bh_new(dump_bh, s);
+        qemu_thread_create(&s->thread, dump_thread, s, QEMU_THREAD_JOINABLE);
+        return;
+    }
+    if (ret == 0) {
+        ret = dump_memory(s);
+    }
+    if (ret < 0 && !error_is_set(s->errp)) {
         error_set(errp, QERR_IO_ERROR);
     }
 
+    dump_finish(s, ret);
     g_free(s);
 }
+
+DumpQueryResult *qmp_query_dump(Error **errp)
+{
+    DumpQueryResult *result = g_new0(DumpQueryResult, 1);
+
+    if (dump_current) {
+        result->status = DUMP_STATUS_ACTIVE;
+        result->completed = atomic_read(&dump_current->written_size);
+        result->total = dump_current->total_size;
+    } else {
+        result->status = dump_last_status;
+        result->completed = dump_last_completed;
+        result->total = dump_last_total;
+    }
+
+    return result;
+}
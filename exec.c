@@ -30,6 +30,9 @@
 #include "hw/hw.h"
 #include "hw/qdev.h"
 #include "qemu/osdep.h"
+#include "qemu/atomic.h"
+#include "qemu/bitops.h"
+#include "qemu/bitmap.h"
 #include "sysemu/kvm.h"
 #include "hw/xen.h"
 #include "qemu/timer.h"
@@ -37,10 +40,14 @@
 #include "exec/memory.h"
 #include "sysemu/dma.h"
 #include "exec/address-spaces.h"
+#include "sysemu/cpus.h"
+#include "qemu/rcu.h"
 #if defined(CONFIG_USER_ONLY)
 #include <qemu.h>
 #else /* !CONFIG_USER_ONLY */
 #include "sysemu/xen-mapcache.h"
+#include "sysemu/sysemu.h"
+#include "qmp-commands.h"
 #include "trace.h"
 #endif
 #include "exec/cpu-all.h"
@@ -82,18 +89,54 @@ int use_icount;
 
 #if !defined(CONFIG_USER_ONLY)
 
-static MemoryRegionSection *phys_sections;
-static unsigned phys_sections_nb, phys_sections_nb_alloc;
-static uint16_t phys_section_unassigned;
-static uint16_t phys_section_notdirty;
-static uint16_t phys_section_rom;
-static uint16_t phys_section_watch;
+#define PHYS_MAP_NODE_NIL (((uint16_t)~0) >> 1)
+#define PHYS_FLAT_SPLIT   ((uint16_t)~0)
 
-/* Simple allocator for PhysPageEntry nodes */
-static PhysPageEntry (*phys_map_nodes)[L2_SIZE];
-static unsigned phys_map_nodes_nb, phys_map_nodes_nb_alloc;
+/* Every PhysPageMap starts with these sections */
+#define PHYS_SECTION_UNASSIGNED 0
+#define PHYS_SECTION_NOTDIRTY   1
+#define PHYS_SECTION_ROM        2
+#define PHYS_SECTION_WATCH      3
 
-#define PHYS_MAP_NODE_NIL (((uint16_t)~0) >> 1)
+/* The pages below 4 GB are also mapped by a two-level table, so that
+ * looking them up takes two loads instead of a walk of phys_map.
+ */
+#define PHYS_FLAT_L2_BITS 10
+#define PHYS_FLAT_L2_SIZE (1 << PHYS_FLAT_L2_BITS)
+#define PHYS_FLAT_L1_SIZE (1 << (32 - TARGET_PAGE_BITS - PHYS_FLAT_L2_BITS))
+#define PHYS_FLAT_PAGES   ((hwaddr)PHYS_FLAT_L1_SIZE << PHYS_FLAT_L2_BITS)
+
+typedef PhysPageEntry Node[L2_SIZE];
+
+/* The sections and the nodes of phys_map of one AddressSpaceDispatch */
+typedef struct PhysPageMap {
+    unsigned sections_nb;
+    unsigned sections_nb_alloc;
+    unsigned nodes_nb;
+    unsigned nodes_nb_alloc;
+    Node *nodes;
+    MemoryRegionSection *sections;
+} PhysPageMap;
+
+/* A dispatch is built from scratch on every memory map change and then
+ * published in AddressSpace.dispatch, which readers look up with RCU.
+ * After publication only mru_section changes.
+ */
+struct AddressSpaceDispatch {
+    struct rcu_head rcu;
+    /* This is a multi-level map on the physical address space.
+     * The bottom level has pointers to MemoryRegionSections.
+     */
+    PhysPageEntry phys_map;
+    PhysPageMap map;
+    /* Section of each chunk of PHYS_FLAT_L2_SIZE pages, or PHYS_FLAT_SPLIT
+     * if the chunk is looked up in flat_l2.
+     */
+    uint16_t flat_leaf[PHYS_FLAT_L1_SIZE];
+    uint16_t *flat_l2[PHYS_FLAT_L1_SIZE];
+    /* Last section found in phys_map, for pages above the flat table */
+    uint16_t mru_section;
+};
 
 static void io_mem_init(void);
 static void memory_map_init(void);
@@ -104,41 +147,33 @@ static MemoryRegion io_mem_watch;
 
 #if !defined(CONFIG_USER_ONLY)
 
-static void phys_map_node_reserve(unsigned nodes)
+static void phys_map_node_reserve(PhysPageMap *map, unsigned nodes)
 {
-    if (phys_map_nodes_nb + nodes > phys_map_nodes_nb_alloc) {
-        typedef PhysPageEntry Node[L2_SIZE];
-        phys_map_nodes_nb_alloc = MAX(phys_map_nodes_nb_alloc * 2, 16);
-        phys_map_nodes_nb_alloc = MAX(phys_map_nodes_nb_alloc,
-                                      phys_map_nodes_nb + nodes);
-        phys_map_nodes = g_renew(Node, phys_map_nodes,
-                                 phys_map_nodes_nb_alloc);
+    if (map->nodes_nb + nodes > map->nodes_nb_alloc) {
+        map->nodes_nb_alloc = MAX(map->nodes_nb_alloc * 2, 16);
+        map->nodes_nb_alloc = MAX(map->nodes_nb_alloc,
+                                  map->nodes_nb + nodes);
+        map->nodes = g_renew(Node, map->nodes, map->nodes_nb_alloc);
     }
 }
 
-static uint16_t phys_map_node_alloc(void)
+static uint16_t phys_map_node_alloc(PhysPageMap *map)
 {
     unsigned i;
     uint16_t ret;
 
-    ret = phys_map_nodes_nb++;
+    ret = map->nodes_nb++;
     assert(ret != PHYS_MAP_NODE_NIL);
-    assert(ret != phys_map_nodes_nb_alloc);
+    assert(ret != map->nodes_nb_alloc);
     for (i = 0; i < L2_SIZE; ++i) {
-        phys_map_nodes[ret][i].is_leaf = 0;
-        phys_map_nodes[ret][i].ptr = PHYS_MAP_NODE_NIL;
+        map->nodes[ret][i].is_leaf = 0;
+        map->nodes[ret][i].ptr = PHYS_MAP_NODE_NIL;
     }
     return ret;
 }
 
-static void phys_map_nodes_reset(void)
-{
-    phys_map_nodes_nb = 0;
-}
-
-
-static void phys_page_set_level(PhysPageEntry *lp, hwaddr *index,
-                                hwaddr *nb, uint16_t leaf,
+static void phys_page_set_level(PhysPageMap *map, PhysPageEntry *lp,
+                                hwaddr *index, hwaddr *nb, uint16_t leaf,
                                 int level)
 {
     PhysPageEntry *p;
@@ -146,16 +181,16 @@ static void phys_page_set_level(PhysPageEntry *lp, hwaddr *index,
     hwaddr step = (hwaddr)1 << (level * L2_BITS);
 
     if (!lp->is_leaf && lp->ptr == PHYS_MAP_NODE_NIL) {
-        lp->ptr = phys_map_node_alloc();
-        p = phys_map_nodes[lp->ptr];
+        lp->ptr = phys_map_node_alloc(map);
+        p = map->nodes[lp->ptr];
         if (level == 0) {
             for (i = 0; i < L2_SIZE; i++) {
                 p[i].is_leaf = 1;
-                p[i].ptr = phys_section_unassigned;
+                p[i].ptr = PHYS_SECTION_UNASSIGNED;
             }
         }
     } else {
-        p = phys_map_nodes[lp->ptr];
+        p = map->nodes[lp->ptr];
     }
     lp = &p[(*index >> (level * L2_BITS)) & (L2_SIZE - 1)];
 
@@ -166,40 +201,110 @@ static void phys_page_set_level(PhysPageEntry *lp, hwaddr *index,
             *index += step;
             *nb -= step;
         } else {
-            phys_page_set_level(lp, index, nb, leaf, level - 1);
+            phys_page_set_level(map, lp, index, nb, leaf, level - 1);
         }
         ++lp;
     }
 }
 
+static void phys_flat_set(AddressSpaceDispatch *d,
+                          hwaddr index, hwaddr nb,
+                          uint16_t leaf)
+{
+    while (nb && index < PHYS_FLAT_PAGES) {
+        unsigned l1 = index >> PHYS_FLAT_L2_BITS;
+        unsigned l2 = index & (PHYS_FLAT_L2_SIZE - 1);
+        unsigned n = MIN(nb, PHYS_FLAT_L2_SIZE - l2);
+        uint16_t *p;
+        unsigned i;
+
+        if (n == PHYS_FLAT_L2_SIZE) {
+            d->flat_leaf[l1] = leaf;
+        } else {
+            if (d->flat_leaf[l1] != PHYS_FLAT_SPLIT) {
+                uint16_t old = d->flat_leaf[l1];
+
+                if (!d->flat_l2[l1]) {
+                    d->flat_l2[l1] = g_new(uint16_t, PHYS_FLAT_L2_SIZE);
+                }
+                p = d->flat_l2[l1];
+                for (i = 0; i < PHYS_FLAT_L2_SIZE; i++) {
+                    p[i] = old;
+                }
+                d->flat_leaf[l1] = PHYS_FLAT_SPLIT;
+            }
+            p = d->flat_l2[l1];
+            for (i = l2; i < l2 + n; i++) {
+                p[i] = leaf;
+            }
+        }
+        index += n;
+        nb -= n;
+    }
+}
+
 static void phys_page_set(AddressSpaceDispatch *d,
                           hwaddr index, hwaddr nb,
                           uint16_t leaf)
 {
+    phys_flat_set(d, index, nb, leaf);
+
     /* Wildly overreserve - it doesn't matter much. */
-    phys_map_node_reserve(3 * P_L2_LEVELS);
+    phys_map_node_reserve(&d->map, 3 * P_L2_LEVELS);
 
-    phys_page_set_level(&d->phys_map, &index, &nb, leaf, P_L2_LEVELS - 1);
+    phys_page_set_level(&d->map, &d->phys_map, &index, &nb, leaf,
+                        P_L2_LEVELS - 1);
 }
 
-MemoryRegionSection *phys_page_find(AddressSpaceDispatch *d, hwaddr index)
+static uint16_t phys_page_find_map(AddressSpaceDispatch *d, hwaddr index)
 {
     PhysPageEntry lp = d->phys_map;
     PhysPageEntry *p;
     int i;
-    uint16_t s_index = phys_section_unassigned;
 
     for (i = P_L2_LEVELS - 1; i >= 0 && !lp.is_leaf; i--) {
         if (lp.ptr == PHYS_MAP_NODE_NIL) {
-            goto not_found;
+            return PHYS_SECTION_UNASSIGNED;
         }
-        p = phys_map_nodes[lp.ptr];
+        p = d->map.nodes[lp.ptr];
         lp = p[(index >> (i * L2_BITS)) & (L2_SIZE - 1)];
     }
+    return lp.ptr;
+}
 
-    s_index = lp.ptr;
-not_found:
-    return &phys_sections[s_index];
+/* The caller must be in an RCU critical section, or hold the iothread
+   lock, for as long as it uses the result.  */
+MemoryRegionSection *phys_page_find(AddressSpaceDispatch *d, hwaddr index)
+{
+    MemoryRegionSection *sections = d->map.sections;
+    MemoryRegionSection *section;
+    uint16_t s_index;
+
+    if (index < PHYS_FLAT_PAGES) {
+        s_index = d->flat_leaf[index >> PHYS_FLAT_L2_BITS];
+        if (s_index == PHYS_FLAT_SPLIT) {
+            s_index = d->flat_l2[index >> PHYS_FLAT_L2_BITS]
+                                [index & (PHYS_FLAT_L2_SIZE - 1)];
+        }
+        return &sections[s_index];
+    }
+
+    /* Every page of a section other than the unassigned one maps to it,
+       so a section found once can be matched by its address range.  */
+    s_index = d->mru_section;
+    if (s_index != PHYS_MAP_NODE_NIL) {
+        section = &sections[s_index];
+        if (index - (section->offset_within_address_space >> TARGET_PAGE_BITS)
+            < (section->size >> TARGET_PAGE_BITS)) {
+            return section;
+        }
+    }
+
+    s_index = phys_page_find_map(d, index);
+    if (s_index != PHYS_SECTION_UNASSIGNED) {
+        d->mru_section = s_index;
+    }
+    return &sections[s_index];
 }
 
 bool memory_region_is_unassigned(MemoryRegion *mr)
@@ -600,6 +705,193 @@ void cpu_physical_memory_reset_dirty(ram_addr_t start, ram_addr_t end,
     }
 }
 
+/* While migration runs, the dirty log of the migration client goes
+ * straight into its bitmap (indexed by ram_addr >> TARGET_PAGE_BITS)
+ * instead of through phys_dirty.  Bits are set with atomic ORs and the
+ * migration workers clear them with atomic ANDs, so neither side needs
+ * the iothread lock to keep the other's updates.
+ */
+static unsigned long *migration_dirty_bitmap;
+static ram_addr_t migration_dirty_bitmap_pages;
+/* number of bits set in migration_dirty_bitmap, owned by the caller */
+static uint64_t *migration_dirty_count;
+
+void cpu_physical_memory_set_migration_bitmap(unsigned long *bitmap,
+                                              ram_addr_t pages,
+                                              uint64_t *dirty_count)
+{
+    migration_dirty_bitmap = bitmap;
+    migration_dirty_bitmap_pages = bitmap ? pages : 0;
+    migration_dirty_count = dirty_count;
+}
+
+/* OR BITS_PER_LONG bits starting at page @nr into the migration bitmap */
+static void migration_dirty_or(ram_addr_t nr, unsigned long bits)
+{
+    unsigned long *p = migration_dirty_bitmap + BIT_WORD(nr);
+    unsigned int shift = nr % BITS_PER_LONG;
+    unsigned long lo, hi, old;
+
+    if (nr >= migration_dirty_bitmap_pages) {
+        return;
+    }
+    if (migration_dirty_bitmap_pages - nr < BITS_PER_LONG) {
+        bits &= (1UL << (migration_dirty_bitmap_pages - nr)) - 1;
+    }
+
+    lo = bits << shift;
+    if (lo) {
+        old = atomic_fetch_or(p, lo);
+        *migration_dirty_count += ctpopl(lo & ~old);
+    }
+    if (shift) {
+        hi = bits >> (BITS_PER_LONG - shift);
+        if (hi) {
+            old = atomic_fetch_or(p + 1, hi);
+            *migration_dirty_count += ctpopl(hi & ~old);
+        }
+    }
+}
+
+/* Drop the pages in [@start, @start + @length) from the migration bitmap
+ * and from the migration dirty flags that have not been synced into it
+ * yet, so that they are not sent unless they are dirtied again.  Used for
+ * memory the guest reported as free.  Partial pages are kept.
+ */
+void cpu_physical_memory_discard_migration_range(ram_addr_t start,
+                                                 ram_addr_t length)
+{
+    ram_addr_t nr = TARGET_PAGE_ALIGN(start) >> TARGET_PAGE_BITS;
+    ram_addr_t end = (start + length) >> TARGET_PAGE_BITS;
+
+    if (!migration_dirty_bitmap || nr >= end) {
+        return;
+    }
+    end = MIN(end, migration_dirty_bitmap_pages);
+    cpu_physical_memory_mask_dirty_range(nr << TARGET_PAGE_BITS,
+                                         (end - nr) << TARGET_PAGE_BITS,
+                                         MIGRATION_DIRTY_FLAG);
+
+    while (nr < end) {
+        unsigned long mask = ~0UL << (nr % BITS_PER_LONG);
+        unsigned long old;
+
+        if (BIT_WORD(nr) == BIT_WORD(end - 1)) {
+            mask &= BITMAP_LAST_WORD_MASK(end);
+        }
+        old = atomic_fetch_and(&migration_dirty_bitmap[BIT_WORD(nr)], ~mask);
+        *migration_dirty_count -= ctpopl(old & mask);
+        nr = (nr | (BITS_PER_LONG - 1)) + 1;
+    }
+}
+
+/* Mark as dirty the pages set in a little-endian bitmap such as the one
+ * KVM_GET_DIRTY_LOG returns, one word at a time. */
+void cpu_physical_memory_set_dirty_lebitmap(unsigned long *bitmap,
+                                            ram_addr_t start,
+                                            ram_addr_t pages)
+{
+    ram_addr_t page = start >> TARGET_PAGE_BITS;
+    ram_addr_t i, len = BITS_TO_LONGS(pages);
+    int flags = 0xff;
+
+    if (migration_dirty_bitmap) {
+        flags &= ~MIGRATION_DIRTY_FLAG;
+    }
+
+    for (i = 0; i < len; i++) {
+        ram_addr_t base = page + i * BITS_PER_LONG;
+        unsigned long c;
+
+        if (!bitmap[i]) {
+            continue;
+        }
+        c = leul_to_cpu(bitmap[i]);
+        if (i == len - 1 && pages % BITS_PER_LONG) {
+            c &= (1UL << (pages % BITS_PER_LONG)) - 1;
+        }
+        if (migration_dirty_bitmap) {
+            migration_dirty_or(base, c);
+        }
+        while (c) {
+            ram_list.phys_dirty[base + ctzl(c)] |= flags;
+            c &= c - 1;
+        }
+    }
+    xen_modified_memory(start, pages << TARGET_PAGE_BITS);
+}
+
+/* Same as above for one page, for dirty logs that list pages */
+void cpu_physical_memory_set_dirty_log_page(ram_addr_t addr)
+{
+    ram_addr_t page = addr >> TARGET_PAGE_BITS;
+    int flags = 0xff;
+
+    if (migration_dirty_bitmap) {
+        flags &= ~MIGRATION_DIRTY_FLAG;
+        migration_dirty_or(page, 1);
+    }
+    ram_list.phys_dirty[page] |= flags;
+    xen_modified_memory(addr & TARGET_PAGE_MASK, TARGET_PAGE_SIZE);
+}
+
+#define MIGRATION_DIRTY_FLAG_X8 (MIGRATION_DIRTY_FLAG * 0x0101010101010101ULL)
+
+/* Move the migration dirty flags of one RAM block into the bitmap */
+static bool migration_dirty_sync_block(RAMBlock *block)
+{
+    uint8_t *flags = ram_list.phys_dirty;
+    ram_addr_t first = block->offset >> TARGET_PAGE_BITS;
+    ram_addr_t end = first + (block->length >> TARGET_PAGE_BITS);
+    ram_addr_t base, i;
+    bool cleared = false;
+
+    for (base = first; base < end; base += BITS_PER_LONG) {
+        ram_addr_t n = MIN(BITS_PER_LONG, end - base);
+        unsigned long bits = 0;
+
+        for (i = 0; i < n; i++) {
+            if (!((base + i) & 7) && n - i >= 8) {
+                uint64_t word;
+
+                memcpy(&word, flags + base + i, sizeof(word));
+                if (!(word & MIGRATION_DIRTY_FLAG_X8)) {
+                    i += 7;
+                    continue;
+                }
+            }
+            if (flags[base + i] & MIGRATION_DIRTY_FLAG) {
+                flags[base + i] &= ~MIGRATION_DIRTY_FLAG;
+                bits |= 1UL << i;
+            }
+        }
+        if (bits) {
+            migration_dirty_or(base, bits);
+            cleared = true;
+        }
+    }
+    return cleared;
+}
+
+/* Merge the dirty flags set since the last call into the migration
+ * bitmap.  Called with the iothread lock held. */
+void cpu_physical_memory_sync_migration_bitmap(void)
+{
+    RAMBlock *block;
+
+    if (!migration_dirty_bitmap) {
+        return;
+    }
+
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        if (migration_dirty_sync_block(block) && tcg_enabled()) {
+            tlb_reset_dirty_range_all(block->offset,
+                                      block->offset + block->length,
+                                      block->length);
+        }
+    }
+}
+
 static int cpu_physical_memory_set_dirty_tracking(int enable)
 {
     int ret = 0;
@@ -608,7 +900,8 @@ static int cpu_physical_memory_set_dirty_tracking(int enable)
 }
 
 hwaddr memory_region_section_get_iotlb(CPUArchState *env,
-                                                   MemoryRegionSection *section,
+                                       AddressSpaceDispatch *d,
+                                       MemoryRegionSection *section,
                                                    target_ulong vaddr,
                                                    hwaddr paddr,
                                                    int prot,
@@ -622,9 +915,9 @@ hwaddr memory_region_section_get_iotlb(CPUArchState *env,
         iotlb = (memory_region_get_ram_addr(section->mr) & TARGET_PAGE_MASK)
             + memory_region_section_addr(section, paddr);
         if (!section->readonly) {
-            iotlb |= phys_section_notdirty;
+            iotlb |= PHYS_SECTION_NOTDIRTY;
         } else {
-            iotlb |= phys_section_rom;
+            iotlb |= PHYS_SECTION_ROM;
         }
     } else {
         /* IO handlers are currently passed a physical address.
@@ -633,7 +926,7 @@ hwaddr memory_region_section_get_iotlb(CPUArchState *env,
            and avoid full address decoding in every device.
            We can't use the high bits of pd for this because
            IO_MEM_ROMD uses these as a ram address.  */
-        iotlb = section - phys_sections;
+        iotlb = section - d->map.sections;
         iotlb += memory_region_section_addr(section, paddr);
     }
 
@@ -643,7 +936,7 @@ hwaddr memory_region_section_get_iotlb(CPUArchState *env,
         if (vaddr == (wp->vaddr & TARGET_PAGE_MASK)) {
             /* Avoid trapping reads of pages with a write breakpoint. */
             if ((prot & PAGE_WRITE) || (wp->flags & BP_MEM_READ)) {
-                iotlb = phys_section_watch + paddr;
+                iotlb = PHYS_SECTION_WATCH + paddr;
                 *address |= TLB_MMIO;
                 break;
             }
@@ -659,66 +952,47 @@ hwaddr memory_region_section_get_iotlb(CPUArchState *env,
 #define SUBPAGE_IDX(addr) ((addr) & ~TARGET_PAGE_MASK)
 typedef struct subpage_t {
     MemoryRegion iomem;
+    AddressSpaceDispatch *d;
     hwaddr base;
     uint16_t sub_section[TARGET_PAGE_SIZE];
 } subpage_t;
 
 static int subpage_register (subpage_t *mmio, uint32_t start, uint32_t end,
                              uint16_t section);
-static subpage_t *subpage_init(hwaddr base);
-static void destroy_page_desc(uint16_t section_index)
+static subpage_t *subpage_init(AddressSpaceDispatch *d, hwaddr base);
+
+static uint16_t phys_section_add(PhysPageMap *map,
+                                 MemoryRegionSection *section)
 {
-    MemoryRegionSection *section = &phys_sections[section_index];
-    MemoryRegion *mr = section->mr;
+    /* PhysPageEntry.ptr must be able to hold the index */
+    assert(map->sections_nb < PHYS_MAP_NODE_NIL);
 
-    if (mr->subpage) {
-        subpage_t *subpage = container_of(mr, subpage_t, iomem);
-        memory_region_destroy(&subpage->iomem);
-        g_free(subpage);
+    if (map->sections_nb == map->sections_nb_alloc) {
+        map->sections_nb_alloc = MAX(map->sections_nb_alloc * 2, 16);
+        map->sections = g_renew(MemoryRegionSection, map->sections,
+                                map->sections_nb_alloc);
     }
+    map->sections[map->sections_nb] = *section;
+    return map->sections_nb++;
 }
 
-static void destroy_l2_mapping(PhysPageEntry *lp, unsigned level)
+/* Each subpage is referenced by a single section of the map it was
+   created for.  */
+static void phys_sections_free(PhysPageMap *map)
 {
     unsigned i;
-    PhysPageEntry *p;
 
-    if (lp->ptr == PHYS_MAP_NODE_NIL) {
-        return;
-    }
+    for (i = 0; i < map->sections_nb; i++) {
+        MemoryRegion *mr = map->sections[i].mr;
 
-    p = phys_map_nodes[lp->ptr];
-    for (i = 0; i < L2_SIZE; ++i) {
-        if (!p[i].is_leaf) {
-            destroy_l2_mapping(&p[i], level - 1);
-        } else {
-            destroy_page_desc(p[i].ptr);
+        if (mr->subpage) {
+            subpage_t *subpage = container_of(mr, subpage_t, iomem);
+            memory_region_destroy(&subpage->iomem);
+            g_free(subpage);
         }
     }
-    lp->is_leaf = 0;
-    lp->ptr = PHYS_MAP_NODE_NIL;
-}
-
-static void destroy_all_mappings(AddressSpaceDispatch *d)
-{
-    destroy_l2_mapping(&d->phys_map, P_L2_LEVELS - 1);
-    phys_map_nodes_reset();
-}
-
-static uint16_t phys_section_add(MemoryRegionSection *section)
-{
-    if (phys_sections_nb == phys_sections_nb_alloc) {
-        phys_sections_nb_alloc = MAX(phys_sections_nb_alloc * 2, 16);
-        phys_sections = g_renew(MemoryRegionSection, phys_sections,
-                                phys_sections_nb_alloc);
-    }
-    phys_sections[phys_sections_nb] = *section;
-    return phys_sections_nb++;
-}
-
-static void phys_sections_clear(void)
-{
-    phys_sections_nb = 0;
+    g_free(map->sections);
+    g_free(map->nodes);
 }
 
 static void register_subpage(AddressSpaceDispatch *d, MemoryRegionSection *section)
@@ -736,16 +1010,16 @@ static void register_subpage(AddressSpaceDispatch *d, MemoryRegionSection *secti
     assert(existing->mr->subpage || existing->mr == &io_mem_unassigned);
 
     if (!(existing->mr->subpage)) {
-        subpage = subpage_init(base);
+        subpage = subpage_init(d, base);
         subsection.mr = &subpage->iomem;
         phys_page_set(d, base >> TARGET_PAGE_BITS, 1,
-                      phys_section_add(&subsection));
+                      phys_section_add(&d->map, &subsection));
     } else {
         subpage = container_of(existing->mr, subpage_t, iomem);
     }
     start = section->offset_within_address_space & ~TARGET_PAGE_MASK;
     end = start + section->size - 1;
-    subpage_register(subpage, start, end, phys_section_add(section));
+    subpage_register(subpage, start, end, phys_section_add(&d->map, section));
 }
 
 
@@ -754,7 +1028,7 @@ static void register_multipage(AddressSpaceDispatch *d, MemoryRegionSection *sec
     hwaddr start_addr = section->offset_within_address_space;
     ram_addr_t size = section->size;
     hwaddr addr;
-    uint16_t section_index = phys_section_add(section);
+    uint16_t section_index = phys_section_add(&d->map, section);
 
     assert(size);
 
@@ -765,7 +1039,7 @@ static void register_multipage(AddressSpaceDispatch *d, MemoryRegionSection *sec
 
 static void mem_add(MemoryListener *listener, MemoryRegionSection *section)
 {
-    AddressSpaceDispatch *d = container_of(listener, AddressSpaceDispatch, listener);
+    AddressSpaceDispatch *d = listener->address_space_filter->next_dispatch;
     MemoryRegionSection now = *section, remain = *section;
 
     if ((now.offset_within_address_space & ~TARGET_PAGE_MASK)
@@ -813,9 +1087,27 @@ void qemu_mutex_unlock_ramlist(void)
     qemu_mutex_unlock(&ram_list.mutex);
 }
 
+static int memory_try_enable_merging(void *addr, size_t len)
+{
+    QemuOpts *opts;
+
+    opts = qemu_opts_find(qemu_find_opts("machine"), 0);
+    if (opts && !qemu_opt_get_bool(opts, "mem-merge", true)) {
+        /* disabled by the user */
+        return 0;
+    }
+
+    return qemu_madvise(addr, len, QEMU_MADV_MERGEABLE);
+}
+
 #if defined(__linux__) && !defined(TARGET_S390X)
 
 #include <sys/vfs.h>
+#include <sched.h>
+#ifdef CONFIG_NUMA
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#endif
 
 #define HUGETLBFS_MAGIC       0x958458f6
 
@@ -839,16 +1131,226 @@ static long gethugepagesize(const char *path)
     return fs.f_bsize;
 }
 
+/* Preallocation touches the pages from this many threads at most */
+#define RAM_PREALLOC_MAX_THREADS 16
+
+typedef struct RAMPreallocJob {
+    QemuThread thread;
+    char *start;
+    size_t size;
+    size_t pagesize;
+    /* Host node whose CPUs run the thread, or -1 */
+    int host_node;
+    /* Bytes from @start that the thread has touched */
+    size_t done;
+    struct RAMPreallocJob *next;
+} RAMPreallocJob;
+
+/* All jobs since startup, for query-mem-prealloc */
+static RAMPreallocJob *ram_prealloc_jobs;
+static int ram_prealloc_running;
+
+/* Set the bits of a sysfs list like "0-3,8-11" in @bitmap */
+static bool read_host_list(const char *path, unsigned long *bitmap,
+                           unsigned long nbits)
+{
+    gchar *contents;
+    char *p, *endptr;
+    unsigned long start, end;
+    bool found = false;
+
+    if (!g_file_get_contents(path, &contents, NULL, NULL)) {
+        return false;
+    }
+    for (p = contents; ; p = endptr + 1) {
+        start = end = strtoul(p, &endptr, 10);
+        if (endptr == p) {
+            break;
+        }
+        if (*endptr == '-') {
+            p = endptr + 1;
+            end = strtoul(p, &endptr, 10);
+        }
+        if (end < start || end >= nbits) {
+            break;
+        }
+        bitmap_set(bitmap, start, end - start + 1);
+        found = true;
+        if (*endptr != ',') {
+            break;
+        }
+    }
+    g_free(contents);
+    return found;
+}
+
+static void ram_prealloc_bind_thread(int node)
+{
+    unsigned long *cpus = bitmap_new(CPU_SETSIZE);
+    char *path;
+    cpu_set_t set;
+    int cpu;
+
+    path = g_strdup_printf("/sys/devices/system/node/node%d/cpulist", node);
+    if (read_host_list(path, cpus, CPU_SETSIZE)) {
+        CPU_ZERO(&set);
+        for (cpu = find_first_bit(cpus, CPU_SETSIZE); cpu < CPU_SETSIZE;
+             cpu = find_next_bit(cpus, CPU_SETSIZE, cpu + 1)) {
+            CPU_SET(cpu, &set);
+        }
+        sched_setaffinity(0, sizeof(set), &set);
+    }
+    g_free(path);
+    g_free(cpus);
+}
+
+static void *ram_prealloc_thread(void *opaque)
+{
+    RAMPreallocJob *job = opaque;
+    size_t offset;
+
+    if (job->host_node >= 0) {
+        ram_prealloc_bind_thread(job->host_node);
+    }
+    for (offset = 0; offset < job->size; offset += job->pagesize) {
+        /* The guest may run already, so do not change the contents */
+        atomic_fetch_add((int *)(job->start + offset), 0);
+        job->done = offset + job->pagesize;
+    }
+    atomic_fetch_sub(&ram_prealloc_running, 1);
+    return NULL;
+}
+
+/* Fault in [@area, @area + @size) from several threads, which is much
+ * faster than MAP_POPULATE for big guests.  On a NUMA host there is one
+ * thread on each host node, of @host_nodes if it is not empty.  With
+ * -machine mem-prealloc-background=on the guest starts without waiting
+ * for them.
+ */
+static void ram_prealloc(void *area, size_t size, size_t pagesize,
+                         const unsigned long *host_nodes)
+{
+    RAMPreallocJob *jobs[MAX(MAX_NODES, RAM_PREALLOC_MAX_THREADS)];
+    unsigned long *nodes = bitmap_new(MAX_NODES);
+    size_t pages = size / pagesize;
+    size_t offset = 0;
+    QemuOpts *opts;
+    bool background;
+    int node = -1;
+    long n;
+    int i;
+
+    if (host_nodes) {
+        bitmap_copy(nodes, host_nodes, MAX_NODES);
+    }
+    if (bitmap_empty(nodes, MAX_NODES)) {
+        read_host_list("/sys/devices/system/node/online", nodes, MAX_NODES);
+    }
+    n = 0;
+    for (i = find_first_bit(nodes, MAX_NODES); i < MAX_NODES;
+         i = find_next_bit(nodes, MAX_NODES, i + 1)) {
+        n++;
+    }
+    if (n < 2) {
+        n = sysconf(_SC_NPROCESSORS_ONLN);
+        n = MIN(n, RAM_PREALLOC_MAX_THREADS);
+        bitmap_zero(nodes, MAX_NODES);
+    }
+    n = MAX(1, MIN(n, pages));
+
+    opts = qemu_opts_find(qemu_find_opts("machine"), 0);
+    background = opts && qemu_opt_get_bool(opts, "mem-prealloc-background",
+                                           false);
+
+    for (i = 0; i < n; i++) {
+        size_t npages = pages / n + (i < pages % n);
+        RAMPreallocJob *job = g_new0(RAMPreallocJob, 1);
+
+        if (!bitmap_empty(nodes, MAX_NODES)) {
+            node = find_next_bit(nodes, MAX_NODES, node + 1);
+        }
+        job->start = area + offset;
+        job->size = npages * pagesize;
+        job->pagesize = pagesize;
+        job->host_node = node;
+        job->next = ram_prealloc_jobs;
+        ram_prealloc_jobs = job;
+        offset += job->size;
+
+        jobs[i] = job;
+        atomic_fetch_add(&ram_prealloc_running, 1);
+        qemu_thread_create(&job->thread, ram_prealloc_thread, job,
+                           background ? QEMU_THREAD_DETACHED
+                                      : QEMU_THREAD_JOINABLE);
+    }
+    if (!background) {
+        for (i = 0; i < n; i++) {
+            qemu_thread_join(&jobs[i]->thread);
+        }
+    }
+    g_free(nodes);
+}
+
+bool qemu_ram_page_unpopulated(void *host)
+{
+    RAMPreallocJob *job;
+    char *p = host;
+    size_t pagesize;
+    unsigned char vec;
+
+    if (!atomic_read(&ram_prealloc_running)) {
+        return false;
+    }
+    for (job = ram_prealloc_jobs; job; job = job->next) {
+        if (p >= job->start + atomic_read(&job->done) &&
+            p < job->start + job->size) {
+            /* The guest may have touched it before the thread did */
+            pagesize = getpagesize();
+            p = (char *)((uintptr_t)p & ~(uintptr_t)(pagesize - 1));
+            return mincore(p, pagesize, &vec) == 0 && !(vec & 1);
+        }
+    }
+    return false;
+}
+
+MemPreallocInfo *qmp_query_mem_prealloc(Error **errp)
+{
+    MemPreallocInfo *info = g_new0(MemPreallocInfo, 1);
+    RAMPreallocJob *job;
+
+    info->threads = atomic_read(&ram_prealloc_running);
+    info->active = info->threads > 0;
+    for (job = ram_prealloc_jobs; job; job = job->next) {
+        info->total += job->size;
+        info->done += atomic_read(&job->done);
+    }
+    return info;
+}
+
+/* Returns an unlinked file in @path, or -1 */
+static int ram_backing_file(const char *path)
+{
+    char *filename;
+    int fd;
+
+    filename = g_strdup_printf("%s/qemu_back_mem.XXXXXX", path);
+    fd = mkstemp(filename);
+    if (fd < 0) {
+        perror("unable to create backing store for hugepages");
+    } else {
+        unlink(filename);
+    }
+    g_free(filename);
+    return fd;
+}
+
 static void *file_ram_alloc(RAMBlock *block,
                             ram_addr_t memory,
                             const char *path)
 {
-    char *filename;
     void *area;
     int fd;
-#ifdef MAP_POPULATE
     int flags;
-#endif
     unsigned long hpagesize;
 
     hpagesize = gethugepagesize(path);
@@ -865,16 +1367,10 @@ static void *file_ram_alloc(RAMBlock *block,
         return NULL;
     }
 
-    filename = g_strdup_printf("%s/qemu_back_mem.XXXXXX", path);
-
-    fd = mkstemp(filename);
+    fd = ram_backing_file(path);
     if (fd < 0) {
-        perror("unable to create backing store for hugepages");
-        g_free(filename);
         return NULL;
     }
-    unlink(filename);
-    g_free(filename);
 
     memory = (memory+hpagesize-1) & ~(hpagesize-1);
 
@@ -887,24 +1383,211 @@ static void *file_ram_alloc(RAMBlock *block,
     if (ftruncate(fd, memory))
         perror("ftruncate");
 
-#ifdef MAP_POPULATE
-    /* NB: MAP_POPULATE won't exhaustively alloc all phys pages in the case
-     * MAP_PRIVATE is requested.  For mem_prealloc we mmap as MAP_SHARED
-     * to sidestep this quirk.
+    /* For mem_prealloc we mmap as MAP_SHARED, so that touching the pages
+     * allocates them in the file; qemu_ram_remap() does the same.
      */
-    flags = mem_prealloc ? MAP_POPULATE | MAP_SHARED : MAP_PRIVATE;
+    flags = mem_prealloc ? MAP_SHARED : MAP_PRIVATE;
     area = mmap(0, memory, PROT_READ | PROT_WRITE, flags, fd, 0);
-#else
-    area = mmap(0, memory, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
-#endif
     if (area == MAP_FAILED) {
         perror("file_ram_alloc: can't mmap RAM pages");
         close(fd);
         return (NULL);
     }
+    if (mem_prealloc) {
+        ram_prealloc(area, memory, hpagesize, NULL);
+    }
     block->fd = fd;
     return area;
 }
+
+/* -machine ram-template=file, or NULL */
+static const char *ram_template_path(void)
+{
+    QemuOpts *opts = qemu_opts_find(qemu_find_opts("machine"), 0);
+
+    return opts ? qemu_opt_get(opts, "ram-template") : NULL;
+}
+
+/*
+ * Map a block copy-on-write from the RAM template, which holds it at the
+ * block's ram_addr_t offset.  Pages are read from the file when the guest
+ * first touches them, and stay shared in the page cache among the VMs
+ * started from the same template until they are written.
+ */
+static void *template_ram_alloc(RAMBlock *block, ram_addr_t memory,
+                                const char *path)
+{
+    struct stat st;
+    void *area;
+    int fd;
+
+    if (block->offset & (getpagesize() - 1)) {
+        fprintf(stderr, "ram-template: RAM block at " RAM_ADDR_FMT
+                " is not page aligned\n", block->offset);
+        return NULL;
+    }
+
+    fd = qemu_open(path, O_RDONLY);
+    if (fd < 0) {
+        perror(path);
+        return NULL;
+    }
+    if (fstat(fd, &st) < 0 || st.st_size < block->offset + memory) {
+        fprintf(stderr, "ram-template: %s does not match this machine\n",
+                path);
+        close(fd);
+        return NULL;
+    }
+
+    area = mmap(0, memory, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd,
+                block->offset);
+    if (area == MAP_FAILED) {
+        perror("template_ram_alloc: can't mmap RAM pages");
+        close(fd);
+        return NULL;
+    }
+    block->fd = fd;
+    block->flags |= RAM_TEMPLATE_MASK;
+    return area;
+}
+
+static bool numa_ram_allocated;
+
+/* Whether the RAM block of @size is the guest RAM that -numa places on
+ * the host.  That is the first block of exactly ram_size bytes, which the
+ * boards lay out in the order of the nodes.
+ */
+static bool numa_ram_wanted(ram_addr_t size)
+{
+    int i;
+
+    if (numa_ram_allocated || !nb_numa_nodes || size != ram_size) {
+        return false;
+    }
+    for (i = 0; i < nb_numa_nodes; i++) {
+        if (node_mem_path[i] || node_host_policy[i] != NUMA_POLICY_DEFAULT) {
+            return true;
+        }
+    }
+    return false;
+}
+
+#ifdef CONFIG_NUMA
+static void numa_ram_bind(void *area, size_t size, int nodenr)
+{
+    static const int mode[] = {
+        [NUMA_POLICY_DEFAULT] = MPOL_DEFAULT,
+        [NUMA_POLICY_PREFERRED] = MPOL_PREFERRED,
+        [NUMA_POLICY_BIND] = MPOL_BIND,
+        [NUMA_POLICY_INTERLEAVE] = MPOL_INTERLEAVE,
+    };
+    int policy = node_host_policy[nodenr];
+
+    if (policy == NUMA_POLICY_DEFAULT) {
+        return;
+    }
+    /* The kernel ignores the last bit of maxnode */
+    if (syscall(SYS_mbind, area, size, mode[policy], node_host_nodes[nodenr],
+                MAX_NODES + 1, 0)) {
+        perror("mbind");
+        exit(1);
+    }
+}
+#endif
+
+/* Map the memory of every NUMA node at consecutive addresses, each from
+ * its own file or anonymous memory, and apply the node's memory policy.
+ * The mapping is never unmapped, so the block is marked preallocated.
+ */
+static void *numa_ram_alloc(RAMBlock *block, ram_addr_t size)
+{
+    size_t pagesize[MAX_NODES];
+    size_t align = getpagesize();
+    ram_addr_t offset, total = 0;
+    void *area;
+    char *host;
+    int i;
+
+    for (i = 0; i < nb_numa_nodes; i++) {
+        const char *path = node_mem_path[i] ? node_mem_path[i] : mem_path;
+
+        pagesize[i] = path ? gethugepagesize(path) : getpagesize();
+        if (!pagesize[i]) {
+            exit(1);
+        }
+        if (node_mem[i] & (pagesize[i] - 1)) {
+            fprintf(stderr, "NUMA node %d: memory size is not a multiple "
+                    "of the page size %zu\n", i, pagesize[i]);
+            exit(1);
+        }
+        align = MAX(align, pagesize[i]);
+        total += node_mem[i];
+    }
+    if (total != size) {
+        fprintf(stderr, "NUMA node memory sizes do not add up to the "
+                "RAM size\n");
+        exit(1);
+    }
+
+    /* Reserve the whole range aligned to the biggest page size */
+    area = mmap(0, size + align, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (area == MAP_FAILED) {
+        perror("numa_ram_alloc: can't reserve RAM");
+        exit(1);
+    }
+    host = (char *)(((uintptr_t)area + align - 1) & ~(uintptr_t)(align - 1));
+    if (host != area) {
+        munmap(area, host - (char *)area);
+    }
+    munmap(host + size, align - (host - (char *)area));
+
+    for (i = 0, offset = 0; i < nb_numa_nodes; offset += node_mem[i++]) {
+        const char *path = node_mem_path[i] ? node_mem_path[i] : mem_path;
+
+        if (!node_mem[i]) {
+            continue;
+        }
+        if (path) {
+            int fd = ram_backing_file(path);
+            int flags = mem_prealloc ? MAP_SHARED : MAP_PRIVATE;
+
+            if (fd < 0 || ftruncate(fd, node_mem[i]) ||
+                mmap(host + offset, node_mem[i], PROT_READ | PROT_WRITE,
+                     flags | MAP_FIXED, fd, 0) == MAP_FAILED) {
+                perror("numa_ram_alloc: can't mmap RAM pages");
+                exit(1);
+            }
+            /* The mapping keeps the file */
+            close(fd);
+        } else {
+            memory_try_enable_merging(host + offset, node_mem[i]);
+        }
+#ifdef CONFIG_NUMA
+        numa_ram_bind(host + offset, node_mem[i], i);
+#endif
+        if (mem_prealloc) {
+            ram_prealloc(host + offset, node_mem[i], pagesize[i],
+                         node_host_policy[i] == NUMA_POLICY_DEFAULT ?
+                         NULL : node_host_nodes[i]);
+        }
+    }
+
+    numa_ram_allocated = true;
+    block->flags |= RAM_PREALLOC_MASK;
+    return host;
+}
+
+#else
+bool qemu_ram_page_unpopulated(void *host)
+{
+    return false;
+}
+
+MemPreallocInfo *qmp_query_mem_prealloc(Error **errp)
+{
+    return g_new0(MemPreallocInfo, 1);
+}
 #endif
 
 static ram_addr_t find_ram_offset(ram_addr_t size)
@@ -1004,19 +1687,6 @@ void qemu_ram_set_idstr(ram_addr_t addr, const char *name, DeviceState *dev)
     qemu_mutex_unlock_ramlist();
 }
 
-static int memory_try_enable_merging(void *addr, size_t len)
-{
-    QemuOpts *opts;
-
-    opts = qemu_opts_find(qemu_find_opts("machine"), 0);
-    if (opts && !qemu_opt_get_bool(opts, "mem-merge", true)) {
-        /* disabled by the user */
-        return 0;
-    }
-
-    return qemu_madvise(addr, len, QEMU_MADV_MERGEABLE);
-}
-
 ram_addr_t qemu_ram_alloc_from_ptr(ram_addr_t size, void *host,
                                    MemoryRegion *mr)
 {
@@ -1032,6 +1702,16 @@ ram_addr_t qemu_ram_alloc_from_ptr(ram_addr_t size, void *host,
     if (host) {
         new_block->host = host;
         new_block->flags |= RAM_PREALLOC_MASK;
+#if defined(__linux__) && !defined(TARGET_S390X)
+    } else if (!xen_enabled() && ram_template_path()) {
+        new_block->host = template_ram_alloc(new_block, size,
+                                             ram_template_path());
+        if (!new_block->host) {
+            exit(1);
+        }
+    } else if (!xen_enabled() && numa_ram_wanted(size)) {
+        new_block->host = numa_ram_alloc(new_block, size);
+#endif
     } else {
         if (mem_path) {
 #if defined (__linux__) && !defined(TARGET_S390X)
@@ -1125,6 +1805,13 @@ void qemu_ram_free(ram_addr_t addr)
             ram_list.version++;
             if (block->flags & RAM_PREALLOC_MASK) {
                 ;
+            } else if (block->flags & RAM_TEMPLATE_MASK) {
+#if defined(__linux__) && !defined(TARGET_S390X)
+                munmap(block->host, block->length);
+                close(block->fd);
+#else
+                abort();
+#endif
             } else if (mem_path) {
 #if defined (__linux__) && !defined(TARGET_S390X)
                 if (block->fd) {
@@ -1172,7 +1859,14 @@ void qemu_ram_remap(ram_addr_t addr, ram_addr_t length)
             } else {
                 flags = MAP_FIXED;
                 munmap(vaddr, length);
-                if (mem_path) {
+                if (block->flags & RAM_TEMPLATE_MASK) {
+#if defined(__linux__) && !defined(TARGET_S390X)
+                    area = mmap(vaddr, length, PROT_READ | PROT_WRITE,
+                                flags | MAP_PRIVATE, block->fd, addr);
+#else
+                    abort();
+#endif
+                } else if (mem_path) {
 #if defined(__linux__) && !defined(TARGET_S390X)
                     if (block->fd) {
 #ifdef MAP_POPULATE
@@ -1348,6 +2042,37 @@ int qemu_ram_addr_from_host(void *ptr, ram_addr_t *ram_addr)
     return -1;
 }
 
+/* Return the file descriptor backing the RAM block that contains @ptr,
+ * and the offset of @ptr within that file, or -1 if the block is not
+ * backed by a file (i.e. -mem-path was not used).
+ */
+int qemu_ram_get_fd(void *ptr, ram_addr_t *offset)
+{
+#if defined(__linux__) && !defined(TARGET_S390X)
+    RAMBlock *block;
+    uint8_t *host = ptr;
+
+    if (xen_enabled()) {
+        return -1;
+    }
+
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        if (block->host == NULL) {
+            continue;
+        }
+        if (host - block->host < block->length) {
+            if (block->fd <= 0) {
+                return -1;
+            }
+            *offset = host - block->host;
+            return block->fd;
+        }
+    }
+#endif
+
+    return -1;
+}
+
 /* Some of the softmmu routines need to translate from a host pointer
    (typically a TLB entry) back to a ram offset.  */
 ram_addr_t qemu_ram_addr_from_host_nofail(void *ptr)
@@ -1414,8 +2139,11 @@ static const MemoryRegionOps rom_mem_ops = {
     .endianness = DEVICE_NATIVE_ENDIAN,
 };
 
-static void notdirty_mem_write(void *opaque, hwaddr ram_addr,
-                               uint64_t val, unsigned size)
+/* Write to a RAM page whose TLB entries are marked TLB_NOTDIRTY, because
+   it may hold translated code or have clean dirty bits.  @host is the
+   host address of @ram_addr.  */
+static void notdirty_write(CPUArchState *env, ram_addr_t ram_addr, void *host,
+                           uint64_t val, unsigned size)
 {
     int dirty_flags;
     dirty_flags = cpu_physical_memory_get_dirty_flags(ram_addr);
@@ -1427,13 +2155,16 @@ static void notdirty_mem_write(void *opaque, hwaddr ram_addr,
     }
     switch (size) {
     case 1:
-        stb_p(qemu_get_ram_ptr(ram_addr), val);
+        stb_p(host, val);
         break;
     case 2:
-        stw_p(qemu_get_ram_ptr(ram_addr), val);
+        stw_p(host, val);
         break;
     case 4:
-        stl_p(qemu_get_ram_ptr(ram_addr), val);
+        stl_p(host, val);
+        break;
+    case 8:
+        stq_p(host, val);
         break;
     default:
         abort();
@@ -1442,8 +2173,35 @@ static void notdirty_mem_write(void *opaque, hwaddr ram_addr,
     cpu_physical_memory_set_dirty_flags(ram_addr, dirty_flags);
     /* we remove the notdirty callback only if the code has been
        flushed */
-    if (dirty_flags == 0xff)
-        tlb_set_dirty(cpu_single_env, cpu_single_env->mem_io_vaddr);
+    if (dirty_flags == 0xff) {
+        tlb_set_dirty(env, env->mem_io_vaddr);
+    }
+}
+
+static void notdirty_mem_write(void *opaque, hwaddr ram_addr,
+                               uint64_t val, unsigned size)
+{
+    notdirty_write(cpu_single_env, ram_addr, qemu_get_ram_ptr(ram_addr),
+                   val, size);
+}
+
+/* Called by the softmmu helpers instead of io_mem_write() for writes
+   through a TLB_NOTDIRTY entry.  The TLB entry already has the host
+   address, so this skips the RAM block lookup and the MemoryRegion
+   dispatch.  */
+void notdirty_mem_write_host(CPUArchState *env, ram_addr_t ram_addr,
+                             void *host, uint64_t val, unsigned size)
+{
+    bool unlocked = mttcg_enabled && !qemu_mutex_iothread_locked();
+
+    /* The dirty bits are shared with migration and display code.  */
+    if (unlocked) {
+        qemu_mutex_lock_iothread();
+    }
+    notdirty_write(env, ram_addr, host, val, size);
+    if (unlocked) {
+        qemu_mutex_unlock_iothread();
+    }
 }
 
 static const MemoryRegionOps notdirty_mem_ops = {
@@ -1541,7 +2299,7 @@ static uint64_t subpage_read(void *opaque, hwaddr addr,
            mmio, len, addr, idx);
 #endif
 
-    section = &phys_sections[mmio->sub_section[idx]];
+    section = &mmio->d->map.sections[mmio->sub_section[idx]];
     addr += mmio->base;
     addr -= section->offset_within_address_space;
     addr += section->offset_within_region;
@@ -1560,17 +2318,19 @@ static void subpage_write(void *opaque, hwaddr addr,
            __func__, mmio, len, addr, idx, value);
 #endif
 
-    section = &phys_sections[mmio->sub_section[idx]];
+    section = &mmio->d->map.sections[mmio->sub_section[idx]];
     addr += mmio->base;
     addr -= section->offset_within_address_space;
     addr += section->offset_within_region;
     io_mem_write(section->mr, addr, value, len);
 }
 
+/* The target region's locking is left to io_mem_read/io_mem_write */
 static const MemoryRegionOps subpage_ops = {
     .read = subpage_read,
     .write = subpage_write,
     .endianness = DEVICE_NATIVE_ENDIAN,
+    .thread_safe = true,
 };
 
 static uint64_t subpage_ram_read(void *opaque, hwaddr addr,
@@ -1618,10 +2378,10 @@ static int subpage_register (subpage_t *mmio, uint32_t start, uint32_t end,
     printf("%s: %p start %08x end %08x idx %08x eidx %08x mem %ld\n", __func__,
            mmio, start, end, idx, eidx, memory);
 #endif
-    if (memory_region_is_ram(phys_sections[section].mr)) {
-        MemoryRegionSection new_section = phys_sections[section];
+    if (memory_region_is_ram(mmio->d->map.sections[section].mr)) {
+        MemoryRegionSection new_section = mmio->d->map.sections[section];
         new_section.mr = &io_mem_subpage_ram;
-        section = phys_section_add(&new_section);
+        section = phys_section_add(&mmio->d->map, &new_section);
     }
     for (; idx <= eidx; idx++) {
         mmio->sub_section[idx] = section;
@@ -1630,12 +2390,13 @@ static int subpage_register (subpage_t *mmio, uint32_t start, uint32_t end,
     return 0;
 }
 
-static subpage_t *subpage_init(hwaddr base)
+static subpage_t *subpage_init(AddressSpaceDispatch *d, hwaddr base)
 {
     subpage_t *mmio;
 
     mmio = g_malloc0(sizeof(subpage_t));
 
+    mmio->d = d;
     mmio->base = base;
     memory_region_init_io(&mmio->iomem, &subpage_ops, mmio,
                           "subpage", TARGET_PAGE_SIZE);
@@ -1644,12 +2405,12 @@ static subpage_t *subpage_init(hwaddr base)
     printf("%s: %p base " TARGET_FMT_plx " len %08x %d\n", __func__,
            mmio, base, TARGET_PAGE_SIZE, subpage_memory);
 #endif
-    subpage_register(mmio, 0, TARGET_PAGE_SIZE-1, phys_section_unassigned);
+    subpage_register(mmio, 0, TARGET_PAGE_SIZE-1, PHYS_SECTION_UNASSIGNED);
 
     return mmio;
 }
 
-static uint16_t dummy_section(MemoryRegion *mr)
+static uint16_t dummy_section(PhysPageMap *map, MemoryRegion *mr)
 {
     MemoryRegionSection section = {
         .mr = mr,
@@ -1658,12 +2419,12 @@ static uint16_t dummy_section(MemoryRegion *mr)
         .size = UINT64_MAX,
     };
 
-    return phys_section_add(&section);
+    return phys_section_add(map, &section);
 }
 
-MemoryRegion *iotlb_to_region(hwaddr index)
+MemoryRegion *iotlb_to_region(CPUArchState *env, hwaddr index)
 {
-    return phys_sections[index & ~TARGET_PAGE_MASK].mr;
+    return env->memory_dispatch->map.sections[index & ~TARGET_PAGE_MASK].mr;
 }
 
 static void io_mem_init(void)
@@ -1680,21 +2441,59 @@ static void io_mem_init(void)
                           "watch", UINT64_MAX);
 }
 
+static AddressSpaceDispatch *address_space_dispatch_new(void)
+{
+    AddressSpaceDispatch *d = g_new0(AddressSpaceDispatch, 1);
+    uint16_t n;
+
+    d->phys_map = (PhysPageEntry) { .ptr = PHYS_MAP_NODE_NIL, .is_leaf = 0 };
+    d->mru_section = PHYS_MAP_NODE_NIL;
+    n = dummy_section(&d->map, &io_mem_unassigned);
+    assert(n == PHYS_SECTION_UNASSIGNED);
+    n = dummy_section(&d->map, &io_mem_notdirty);
+    assert(n == PHYS_SECTION_NOTDIRTY);
+    n = dummy_section(&d->map, &io_mem_rom);
+    assert(n == PHYS_SECTION_ROM);
+    n = dummy_section(&d->map, &io_mem_watch);
+    assert(n == PHYS_SECTION_WATCH);
+    return d;
+}
+
+static void address_space_dispatch_free(AddressSpaceDispatch *d)
+{
+    unsigned i;
+
+    phys_sections_free(&d->map);
+    for (i = 0; i < PHYS_FLAT_L1_SIZE; i++) {
+        g_free(d->flat_l2[i]);
+    }
+    g_free(d);
+}
+
+static void address_space_dispatch_free_rcu(struct rcu_head *head)
+{
+    address_space_dispatch_free(container_of(head, AddressSpaceDispatch,
+                                             rcu));
+}
+
 static void mem_begin(MemoryListener *listener)
 {
-    AddressSpaceDispatch *d = container_of(listener, AddressSpaceDispatch, listener);
+    AddressSpace *as = listener->address_space_filter;
 
-    destroy_all_mappings(d);
-    d->phys_map.ptr = PHYS_MAP_NODE_NIL;
+    assert(!as->next_dispatch);
+    as->next_dispatch = address_space_dispatch_new();
 }
 
-static void core_begin(MemoryListener *listener)
+static void mem_commit(MemoryListener *listener)
 {
-    phys_sections_clear();
-    phys_section_unassigned = dummy_section(&io_mem_unassigned);
-    phys_section_notdirty = dummy_section(&io_mem_notdirty);
-    phys_section_rom = dummy_section(&io_mem_rom);
-    phys_section_watch = dummy_section(&io_mem_watch);
+    AddressSpace *as = listener->address_space_filter;
+    AddressSpaceDispatch *old = as->dispatch;
+
+    atomic_rcu_set(&as->dispatch, as->next_dispatch);
+    as->next_dispatch = NULL;
+    if (old) {
+        call_rcu1(&old->rcu, address_space_dispatch_free_rcu);
+    }
 }
 
 static void tcg_commit(MemoryListener *listener)
@@ -1705,7 +2504,7 @@ static void tcg_commit(MemoryListener *listener)
        reset the modified entries */
     /* XXX: slow ! */
     for(env = first_cpu; env != NULL; env = env->next_cpu) {
-        tlb_flush(env, 1);
+        tlb_flush_async(env);
     }
 }
 
@@ -1738,7 +2537,6 @@ static void io_region_del(MemoryListener *listener,
 }
 
 static MemoryListener core_memory_listener = {
-    .begin = core_begin,
     .log_global_start = core_log_global_start,
     .log_global_stop = core_log_global_stop,
     .priority = 1,
@@ -1756,27 +2554,31 @@ static MemoryListener tcg_memory_listener = {
 
 void address_space_init_dispatch(AddressSpace *as)
 {
-    AddressSpaceDispatch *d = g_new(AddressSpaceDispatch, 1);
+    MemoryListener *listener = g_new(MemoryListener, 1);
 
-    d->phys_map  = (PhysPageEntry) { .ptr = PHYS_MAP_NODE_NIL, .is_leaf = 0 };
-    d->listener = (MemoryListener) {
+    *listener = (MemoryListener) {
         .begin = mem_begin,
         .region_add = mem_add,
         .region_nop = mem_add,
+        .commit = mem_commit,
         .priority = 0,
     };
-    as->dispatch = d;
-    memory_listener_register(&d->listener, as);
+    as->dispatch_listener = listener;
+    /* Registering replays the current map into a new dispatch */
+    as->next_dispatch = address_space_dispatch_new();
+    memory_listener_register(listener, as);
+    mem_commit(listener);
 }
 
 void address_space_destroy_dispatch(AddressSpace *as)
 {
     AddressSpaceDispatch *d = as->dispatch;
 
-    memory_listener_unregister(&d->listener);
-    destroy_l2_mapping(&d->phys_map, P_L2_LEVELS - 1);
-    g_free(d);
-    as->dispatch = NULL;
+    memory_listener_unregister(as->dispatch_listener);
+    g_free(as->dispatch_listener);
+    as->dispatch_listener = NULL;
+    atomic_rcu_set(&as->dispatch, NULL);
+    call_rcu1(&d->rcu, address_space_dispatch_free_rcu);
 }
 
 static void memory_map_init(void)
@@ -1854,14 +2656,54 @@ int cpu_memory_rw_debug(CPUArchState *env, target_ulong addr,
 
 #else
 
+#define CODE_DIRTY_FLAG_X8 (CODE_DIRTY_FLAG * 0x0101010101010101ULL)
+#define WRITE_DIRTY_FLAGS_X8 \
+    ((0xff & ~CODE_DIRTY_FLAG) * 0x0101010101010101ULL)
+
+/* Mark [addr, addr + length) dirty after a write that did not go through
+ * the TLB, and invalidate the code translated from it.  The flags are
+ * looked at eight pages at a time.  A page whose CODE_DIRTY_FLAG is set
+ * holds no TBs, and without TCG none does, so such runs of pages are
+ * only marked dirty.
+ */
 static void invalidate_and_set_dirty(hwaddr addr,
                                      hwaddr length)
 {
-    if (!cpu_physical_memory_is_dirty(addr)) {
-        /* invalidate code */
-        tb_invalidate_phys_page_range(addr, addr + length, 0);
-        /* set dirty bit */
-        cpu_physical_memory_set_dirty_flags(addr, (0xff & ~CODE_DIRTY_FLAG));
+    uint8_t *flags = ram_list.phys_dirty;
+    ram_addr_t page = addr >> TARGET_PAGE_BITS;
+    ram_addr_t end = TARGET_PAGE_ALIGN(addr + length) >> TARGET_PAGE_BITS;
+    bool tcg = tcg_enabled();
+
+    while (page < end) {
+        hwaddr start;
+
+        if (!(page & 7) && end - page >= 8) {
+            uint64_t word;
+
+            memcpy(&word, flags + page, sizeof(word));
+            if (!tcg || (word & CODE_DIRTY_FLAG_X8) == CODE_DIRTY_FLAG_X8) {
+                /* atomic, so as not to lose updates to the neighbours of
+                 * the pages written, which other threads may be making */
+                if ((word & WRITE_DIRTY_FLAGS_X8) != WRITE_DIRTY_FLAGS_X8) {
+                    atomic_fetch_or((uint64_t *)(flags + page),
+                                    WRITE_DIRTY_FLAGS_X8);
+                }
+                page += 8;
+                continue;
+            }
+        }
+        if (flags[page] != 0xff) {
+            if (tcg && !(flags[page] & CODE_DIRTY_FLAG)) {
+                /* invalidate code */
+                start = MAX(addr, (hwaddr)page << TARGET_PAGE_BITS);
+                tb_invalidate_phys_page_range(start,
+                    MIN(addr + length, (hwaddr)(page + 1) << TARGET_PAGE_BITS),
+                    0);
+            }
+            /* set dirty bit */
+            flags[page] |= 0xff & ~CODE_DIRTY_FLAG;
+        }
+        page++;
     }
     xen_modified_memory(addr, length);
 }
@@ -1869,7 +2711,6 @@ static void invalidate_and_set_dirty(hwaddr addr,
 void address_space_rw(AddressSpace *as, hwaddr addr, uint8_t *buf,
                       int len, bool is_write)
 {
-    AddressSpaceDispatch *d = as->dispatch;
     int l;
     uint8_t *ptr;
     uint32_t val;
@@ -1881,7 +2722,9 @@ void address_space_rw(AddressSpace *as, hwaddr addr, uint8_t *buf,
         l = (page + TARGET_PAGE_SIZE) - addr;
         if (l > len)
             l = len;
-        section = phys_page_find(d, page >> TARGET_PAGE_BITS);
+        rcu_read_lock();
+        section = phys_page_find(atomic_rcu_read(&as->dispatch),
+                                 page >> TARGET_PAGE_BITS);
 
         if (is_write) {
             if (!memory_region_is_ram(section->mr)) {
@@ -1946,12 +2789,31 @@ void address_space_rw(AddressSpace *as, hwaddr addr, uint8_t *buf,
                 qemu_put_ram_ptr(ptr);
             }
         }
+        rcu_read_unlock();
         len -= l;
         buf += l;
         addr += l;
     }
 }
 
+bool address_space_access_thread_safe(AddressSpace *as, hwaddr addr, int len)
+{
+    MemoryRegionSection *section;
+
+    section = phys_page_find(atomic_rcu_read(&as->dispatch),
+                             addr >> TARGET_PAGE_BITS);
+    if (section->mr->ops == &subpage_ops) {
+        subpage_t *mmio = container_of(section->mr, subpage_t, iomem);
+
+        section = &mmio->d->map.sections[mmio->sub_section[SUBPAGE_IDX(addr)]];
+    }
+    if (memory_region_is_ram(section->mr) || !section->mr->ops ||
+        !section->mr->ops->thread_safe) {
+        return false;
+    }
+    return addr - section->offset_within_address_space + len <= section->size;
+}
+
 void address_space_write(AddressSpace *as, hwaddr addr,
                          const uint8_t *buf, int len)
 {
@@ -1981,7 +2843,6 @@ void cpu_physical_memory_rw(hwaddr addr, uint8_t *buf,
 void cpu_physical_memory_write_rom(hwaddr addr,
                                    const uint8_t *buf, int len)
 {
-    AddressSpaceDispatch *d = address_space_memory.dispatch;
     int l;
     uint8_t *ptr;
     hwaddr page;
@@ -1992,7 +2853,9 @@ void cpu_physical_memory_write_rom(hwaddr addr,
         l = (page + TARGET_PAGE_SIZE) - addr;
         if (l > len)
             l = len;
-        section = phys_page_find(d, page >> TARGET_PAGE_BITS);
+        rcu_read_lock();
+        section = phys_page_find(atomic_rcu_read(&address_space_memory.dispatch),
+                                 page >> TARGET_PAGE_BITS);
 
         if (!(memory_region_is_ram(section->mr) ||
               memory_region_is_romd(section->mr))) {
@@ -2007,39 +2870,50 @@ void cpu_physical_memory_write_rom(hwaddr addr,
             invalidate_and_set_dirty(addr1, l);
             qemu_put_ram_ptr(ptr);
         }
+        rcu_read_unlock();
         len -= l;
         buf += l;
         addr += l;
     }
 }
 
-typedef struct {
+/* Bytes of bounce buffers that may be in use at once in one AddressSpace */
+#define BOUNCE_BUFFER_BUDGET (1024 * 1024)
+
+typedef struct BounceBuffer BounceBuffer;
+typedef struct MapClient MapClient;
+
+struct BounceBuffer {
     void *buffer;
     hwaddr addr;
     hwaddr len;
-} BounceBuffer;
-
-static BounceBuffer bounce;
+    QLIST_ENTRY(BounceBuffer) link;
+};
 
-typedef struct MapClient {
+struct MapClient {
     void *opaque;
     void (*callback)(void *opaque);
     QLIST_ENTRY(MapClient) link;
-} MapClient;
-
-static QLIST_HEAD(map_client_list, MapClient) map_client_list
-    = QLIST_HEAD_INITIALIZER(map_client_list);
+};
 
-void *cpu_register_map_client(void *opaque, void (*callback)(void *opaque))
+void *address_space_register_map_client(AddressSpace *as, void *opaque,
+                                        void (*callback)(void *opaque))
 {
     MapClient *client = g_malloc(sizeof(*client));
 
     client->opaque = opaque;
     client->callback = callback;
-    QLIST_INSERT_HEAD(&map_client_list, client, link);
+    QLIST_INSERT_HEAD(&as->map_clients, client, link);
+    as->map_waits++;
     return client;
 }
 
+void *cpu_register_map_client(void *opaque, void (*callback)(void *opaque))
+{
+    return address_space_register_map_client(&address_space_memory,
+                                             opaque, callback);
+}
+
 static void cpu_unregister_map_client(void *_client)
 {
     MapClient *client = (MapClient *)_client;
@@ -2048,30 +2922,63 @@ static void cpu_unregister_map_client(void *_client)
     g_free(client);
 }
 
-static void cpu_notify_map_clients(void)
+static void address_space_notify_map_clients(AddressSpace *as)
 {
     MapClient *client;
 
-    while (!QLIST_EMPTY(&map_client_list)) {
-        client = QLIST_FIRST(&map_client_list);
+    while (!QLIST_EMPTY(&as->map_clients)) {
+        client = QLIST_FIRST(&as->map_clients);
         client->callback(client->opaque);
         cpu_unregister_map_client(client);
     }
 }
 
+/* Map [addr, addr + len) through a bounce buffer, or as much of it as the
+ * budget of @as allows.
+ */
+static void *address_space_map_bounce(AddressSpace *as, hwaddr addr,
+                                      hwaddr len, hwaddr *plen, bool is_write)
+{
+    BounceBuffer *bounce;
+
+    if (as->bounce_in_use >= BOUNCE_BUFFER_BUDGET) {
+        *plen = 0;
+        return NULL;
+    }
+    len = MIN(len, BOUNCE_BUFFER_BUDGET - as->bounce_in_use);
+
+    bounce = g_malloc(sizeof(*bounce));
+    bounce->buffer = qemu_memalign(TARGET_PAGE_SIZE, len);
+    bounce->addr = addr;
+    bounce->len = len;
+    QLIST_INSERT_HEAD(&as->bounce_buffers, bounce, link);
+    as->bounce_in_use += len;
+    as->bounce_maps++;
+    as->bounce_bytes += len;
+
+    if (!is_write) {
+        address_space_read(as, addr, bounce->buffer, len);
+    }
+    *plen = len;
+    return bounce->buffer;
+}
+
 /* Map a physical memory region into a host virtual address.
  * May map a subset of the requested range, given by and returned in *plen.
  * May return NULL if resources needed to perform the mapping are exhausted.
  * Use only for reads OR writes - not for read-modify-write operations.
- * Use cpu_register_map_client() to know when retrying the map operation is
- * likely to succeed.
+ * Use address_space_register_map_client() to know when retrying the map
+ * operation is likely to succeed.
+ *
+ * Regions that are not RAM are accessed through bounce buffers.  Several
+ * of them can be in use at the same time, up to BOUNCE_BUFFER_BUDGET bytes
+ * per address space.
  */
 void *address_space_map(AddressSpace *as,
                         hwaddr addr,
                         hwaddr *plen,
                         bool is_write)
 {
-    AddressSpaceDispatch *d = as->dispatch;
     hwaddr len = *plen;
     hwaddr todo = 0;
     int l;
@@ -2086,26 +2993,22 @@ void *address_space_map(AddressSpace *as,
         l = (page + TARGET_PAGE_SIZE) - addr;
         if (l > len)
             l = len;
-        section = phys_page_find(d, page >> TARGET_PAGE_BITS);
+        rcu_read_lock();
+        section = phys_page_find(atomic_rcu_read(&as->dispatch),
+                                 page >> TARGET_PAGE_BITS);
 
         if (!(memory_region_is_ram(section->mr) && !section->readonly)) {
-            if (todo || bounce.buffer) {
+            rcu_read_unlock();
+            if (todo) {
                 break;
             }
-            bounce.buffer = qemu_memalign(TARGET_PAGE_SIZE, TARGET_PAGE_SIZE);
-            bounce.addr = addr;
-            bounce.len = l;
-            if (!is_write) {
-                address_space_read(as, addr, bounce.buffer, l);
-            }
-
-            *plen = l;
-            return bounce.buffer;
+            return address_space_map_bounce(as, addr, len, plen, is_write);
         }
         if (!todo) {
             raddr = memory_region_get_ram_addr(section->mr)
                 + memory_region_section_addr(section, addr);
         }
+        rcu_read_unlock();
 
         len -= l;
         addr += l;
@@ -2124,18 +3027,17 @@ void *address_space_map(AddressSpace *as,
 void address_space_unmap(AddressSpace *as, void *buffer, hwaddr len,
                          int is_write, hwaddr access_len)
 {
-    if (buffer != bounce.buffer) {
+    BounceBuffer *bounce;
+
+    QLIST_FOREACH(bounce, &as->bounce_buffers, link) {
+        if (bounce->buffer == buffer) {
+            break;
+        }
+    }
+    if (!bounce) {
         if (is_write) {
             ram_addr_t addr1 = qemu_ram_addr_from_host_nofail(buffer);
-            while (access_len) {
-                unsigned l;
-                l = TARGET_PAGE_SIZE;
-                if (l > access_len)
-                    l = access_len;
-                invalidate_and_set_dirty(addr1, l);
-                addr1 += l;
-                access_len -= l;
-            }
+            invalidate_and_set_dirty(addr1, access_len);
         }
         if (xen_enabled()) {
             xen_invalidate_map_cache_entry(buffer);
@@ -2143,11 +3045,13 @@ void address_space_unmap(AddressSpace *as, void *buffer, hwaddr len,
         return;
     }
     if (is_write) {
-        address_space_write(as, bounce.addr, bounce.buffer, access_len);
+        address_space_write(as, bounce->addr, bounce->buffer, access_len);
     }
-    qemu_vfree(bounce.buffer);
-    bounce.buffer = NULL;
-    cpu_notify_map_clients();
+    QLIST_REMOVE(bounce, link);
+    as->bounce_in_use -= bounce->len;
+    qemu_vfree(bounce->buffer);
+    g_free(bounce);
+    address_space_notify_map_clients(as);
 }
 
 void *cpu_physical_memory_map(hwaddr addr,
@@ -2170,8 +3074,11 @@ static inline uint32_t ldl_phys_internal(hwaddr addr,
     uint8_t *ptr;
     uint32_t val;
     MemoryRegionSection *section;
+    AddressSpaceDispatch *d;
 
-    section = phys_page_find(address_space_memory.dispatch, addr >> TARGET_PAGE_BITS);
+    rcu_read_lock();
+    d = atomic_rcu_read(&address_space_memory.dispatch);
+    section = phys_page_find(d, addr >> TARGET_PAGE_BITS);
 
     if (!(memory_region_is_ram(section->mr) ||
           memory_region_is_romd(section->mr))) {
@@ -2204,6 +3111,7 @@ static inline uint32_t ldl_phys_internal(hwaddr addr,
             break;
         }
     }
+    rcu_read_unlock();
     return val;
 }
 
@@ -2229,8 +3137,11 @@ static inline uint64_t ldq_phys_internal(hwaddr addr,
     uint8_t *ptr;
     uint64_t val;
     MemoryRegionSection *section;
+    AddressSpaceDispatch *d;
 
-    section = phys_page_find(address_space_memory.dispatch, addr >> TARGET_PAGE_BITS);
+    rcu_read_lock();
+    d = atomic_rcu_read(&address_space_memory.dispatch);
+    section = phys_page_find(d, addr >> TARGET_PAGE_BITS);
 
     if (!(memory_region_is_ram(section->mr) ||
           memory_region_is_romd(section->mr))) {
@@ -2263,6 +3174,7 @@ static inline uint64_t ldq_phys_internal(hwaddr addr,
             break;
         }
     }
+    rcu_read_unlock();
     return val;
 }
 
@@ -2296,8 +3208,11 @@ static inline uint32_t lduw_phys_internal(hwaddr addr,
     uint8_t *ptr;
     uint64_t val;
     MemoryRegionSection *section;
+    AddressSpaceDispatch *d;
 
-    section = phys_page_find(address_space_memory.dispatch, addr >> TARGET_PAGE_BITS);
+    rcu_read_lock();
+    d = atomic_rcu_read(&address_space_memory.dispatch);
+    section = phys_page_find(d, addr >> TARGET_PAGE_BITS);
 
     if (!(memory_region_is_ram(section->mr) ||
           memory_region_is_romd(section->mr))) {
@@ -2330,6 +3245,7 @@ static inline uint32_t lduw_phys_internal(hwaddr addr,
             break;
         }
     }
+    rcu_read_unlock();
     return val;
 }
 
@@ -2355,13 +3271,16 @@ void stl_phys_notdirty(hwaddr addr, uint32_t val)
 {
     uint8_t *ptr;
     MemoryRegionSection *section;
+    AddressSpaceDispatch *d;
 
-    section = phys_page_find(address_space_memory.dispatch, addr >> TARGET_PAGE_BITS);
+    rcu_read_lock();
+    d = atomic_rcu_read(&address_space_memory.dispatch);
+    section = phys_page_find(d, addr >> TARGET_PAGE_BITS);
 
     if (!memory_region_is_ram(section->mr) || section->readonly) {
         addr = memory_region_section_addr(section, addr);
         if (memory_region_is_ram(section->mr)) {
-            section = &phys_sections[phys_section_rom];
+            section = &d->map.sections[PHYS_SECTION_ROM];
         }
         io_mem_write(section->mr, addr, val, 4);
     } else {
@@ -2381,19 +3300,23 @@ void stl_phys_notdirty(hwaddr addr, uint32_t val)
             }
         }
     }
+    rcu_read_unlock();
 }
 
 void stq_phys_notdirty(hwaddr addr, uint64_t val)
 {
     uint8_t *ptr;
     MemoryRegionSection *section;
+    AddressSpaceDispatch *d;
 
-    section = phys_page_find(address_space_memory.dispatch, addr >> TARGET_PAGE_BITS);
+    rcu_read_lock();
+    d = atomic_rcu_read(&address_space_memory.dispatch);
+    section = phys_page_find(d, addr >> TARGET_PAGE_BITS);
 
     if (!memory_region_is_ram(section->mr) || section->readonly) {
         addr = memory_region_section_addr(section, addr);
         if (memory_region_is_ram(section->mr)) {
-            section = &phys_sections[phys_section_rom];
+            section = &d->map.sections[PHYS_SECTION_ROM];
         }
 #ifdef TARGET_WORDS_BIGENDIAN
         io_mem_write(section->mr, addr, val >> 32, 4);
@@ -2408,6 +3331,7 @@ void stq_phys_notdirty(hwaddr addr, uint64_t val)
                                + memory_region_section_addr(section, addr));
         stq_p(ptr, val);
     }
+    rcu_read_unlock();
 }
 
 /* warning: addr must be aligned */
@@ -2416,13 +3340,16 @@ static inline void stl_phys_internal(hwaddr addr, uint32_t val,
 {
     uint8_t *ptr;
     MemoryRegionSection *section;
+    AddressSpaceDispatch *d;
 
-    section = phys_page_find(address_space_memory.dispatch, addr >> TARGET_PAGE_BITS);
+    rcu_read_lock();
+    d = atomic_rcu_read(&address_space_memory.dispatch);
+    section = phys_page_find(d, addr >> TARGET_PAGE_BITS);
 
     if (!memory_region_is_ram(section->mr) || section->readonly) {
         addr = memory_region_section_addr(section, addr);
         if (memory_region_is_ram(section->mr)) {
-            section = &phys_sections[phys_section_rom];
+            section = &d->map.sections[PHYS_SECTION_ROM];
         }
 #if defined(TARGET_WORDS_BIGENDIAN)
         if (endian == DEVICE_LITTLE_ENDIAN) {
@@ -2453,6 +3380,7 @@ static inline void stl_phys_internal(hwaddr addr, uint32_t val,
         }
         invalidate_and_set_dirty(addr1, 4);
     }
+    rcu_read_unlock();
 }
 
 void stl_phys(hwaddr addr, uint32_t val)
@@ -2483,13 +3411,16 @@ static inline void stw_phys_internal(hwaddr addr, uint32_t val,
 {
     uint8_t *ptr;
     MemoryRegionSection *section;
+    AddressSpaceDispatch *d;
 
-    section = phys_page_find(address_space_memory.dispatch, addr >> TARGET_PAGE_BITS);
+    rcu_read_lock();
+    d = atomic_rcu_read(&address_space_memory.dispatch);
+    section = phys_page_find(d, addr >> TARGET_PAGE_BITS);
 
     if (!memory_region_is_ram(section->mr) || section->readonly) {
         addr = memory_region_section_addr(section, addr);
         if (memory_region_is_ram(section->mr)) {
-            section = &phys_sections[phys_section_rom];
+            section = &d->map.sections[PHYS_SECTION_ROM];
         }
 #if defined(TARGET_WORDS_BIGENDIAN)
         if (endian == DEVICE_LITTLE_ENDIAN) {
@@ -2520,6 +3451,7 @@ static inline void stw_phys_internal(hwaddr addr, uint32_t val,
         }
         invalidate_and_set_dirty(addr1, 2);
     }
+    rcu_read_unlock();
 }
 
 void stw_phys(hwaddr addr, uint32_t val)
@@ -2608,11 +3540,14 @@ bool virtio_is_big_endian(void)
 bool cpu_physical_memory_is_io(hwaddr phys_addr)
 {
     MemoryRegionSection *section;
+    bool ret;
 
-    section = phys_page_find(address_space_memory.dispatch,
+    rcu_read_lock();
+    section = phys_page_find(atomic_rcu_read(&address_space_memory.dispatch),
                              phys_addr >> TARGET_PAGE_BITS);
-
-    return !(memory_region_is_ram(section->mr) ||
-             memory_region_is_romd(section->mr));
+    ret = !(memory_region_is_ram(section->mr) ||
+            memory_region_is_romd(section->mr));
+    rcu_read_unlock();
+    return ret;
 }
 #endif
@@ -40,6 +40,9 @@ these four paragraphs for those parts of this code that are retained.
  */
 #include "config.h"
 
+#include <float.h>
+#include <math.h>
+
 #include "fpu/softfloat.h"
 
 /*----------------------------------------------------------------------------
@@ -433,6 +436,251 @@ static float64 float64_squash_input_denormal(float64 a STATUS_PARAM)
     return a;
 }
 
+/*----------------------------------------------------------------------------
+| Host FPU fast path.  With --enable-hardfloat, float32 and float64 add, sub,
+| mul, div, sqrt and fused multiply-add are computed by the host FPU whenever
+| the answer is guaranteed to be bit-identical to softfloat's, including the
+| exception flags:
+|  - the rounding mode is round-to-nearest-even, which is what the host FPU
+|    is left in;
+|  - the inexact flag is already set, so whether this operation was exact
+|    does not matter.  Guest code accumulates it quickly, so this holds for
+|    nearly all operations of targets that do not clear the flags before
+|    every instruction;
+|  - all inputs are zero or normal, so no NaN handling, input flushing or
+|    invalid/divide-by-zero exception can come up;
+|  - the result is normal and larger than the smallest normal, so it neither
+|    overflowed nor is tiny, whatever the target's tininess detection.
+| Everything else falls back to the software implementation, which computes
+| the operation again from scratch.  Hosts that evaluate in extended
+| precision (x87) would round twice and never take the fast path.
+*----------------------------------------------------------------------------*/
+#if defined(CONFIG_HARDFLOAT) && defined(FLT_EVAL_METHOD) && FLT_EVAL_METHOD == 0
+#define USE_HARDFLOAT 1
+#else
+#define USE_HARDFLOAT 0
+#endif
+
+enum {
+    hardfloat_add,
+    hardfloat_sub,
+    hardfloat_mul,
+    hardfloat_div,
+};
+
+typedef union {
+    uint32_t s;
+    float h;
+} HardFloat32;
+
+typedef union {
+    uint64_t s;
+    double h;
+} HardFloat64;
+
+INLINE bool hardfloat_usable(float_status *status)
+{
+    return USE_HARDFLOAT &&
+           STATUS(float_rounding_mode) == float_round_nearest_even &&
+           (STATUS(float_exception_flags) & float_flag_inexact);
+}
+
+INLINE bool float32_hard_input(float32 a)
+{
+    int_fast16_t aExp = extractFloat32Exp(a);
+
+    return (aExp != 0 && aExp != 0xFF) || !(float32_val(a) & 0x7FFFFFFF);
+}
+
+INLINE bool float64_hard_input(float64 a)
+{
+    int_fast16_t aExp = extractFloat64Exp(a);
+
+    return (aExp != 0 && aExp != 0x7FF) ||
+           !(float64_val(a) & LIT64(0x7FFFFFFFFFFFFFFF));
+}
+
+INLINE bool float32_hard_result(HardFloat32 r)
+{
+    int_fast16_t zExp = (r.s >> 23) & 0xFF;
+
+    return zExp > 1 && zExp != 0xFF;
+}
+
+INLINE bool float64_hard_result(HardFloat64 r)
+{
+    int_fast16_t zExp = (r.s >> 52) & 0x7FF;
+
+    return zExp > 1 && zExp != 0x7FF;
+}
+
+INLINE bool float32_hard_op(int op, float32 a, float32 b, float32 *z
+                            STATUS_PARAM)
+{
+    HardFloat32 ua, ub, ur;
+
+    if (!hardfloat_usable(status) ||
+        !float32_hard_input(a) || !float32_hard_input(b) ||
+        (op == hardfloat_div && float32_is_zero(b))) {
+        return false;
+    }
+    ua.s = float32_val(a);
+    ub.s = float32_val(b);
+    switch (op) {
+    case hardfloat_add:
+        ur.h = ua.h + ub.h;
+        break;
+    case hardfloat_sub:
+        ur.h = ua.h - ub.h;
+        break;
+    case hardfloat_mul:
+        ur.h = ua.h * ub.h;
+        break;
+    default:
+        ur.h = ua.h / ub.h;
+        break;
+    }
+    if (!float32_hard_result(ur)) {
+        return false;
+    }
+    *z = make_float32(ur.s);
+    return true;
+}
+
+INLINE bool float64_hard_op(int op, float64 a, float64 b, float64 *z
+                            STATUS_PARAM)
+{
+    HardFloat64 ua, ub, ur;
+
+    if (!hardfloat_usable(status) ||
+        !float64_hard_input(a) || !float64_hard_input(b) ||
+        (op == hardfloat_div && float64_is_zero(b))) {
+        return false;
+    }
+    ua.s = float64_val(a);
+    ub.s = float64_val(b);
+    switch (op) {
+    case hardfloat_add:
+        ur.h = ua.h + ub.h;
+        break;
+    case hardfloat_sub:
+        ur.h = ua.h - ub.h;
+        break;
+    case hardfloat_mul:
+        ur.h = ua.h * ub.h;
+        break;
+    default:
+        ur.h = ua.h / ub.h;
+        break;
+    }
+    if (!float64_hard_result(ur)) {
+        return false;
+    }
+    *z = make_float64(ur.s);
+    return true;
+}
+
+INLINE bool float32_hard_sqrt(float32 a, float32 *z STATUS_PARAM)
+{
+    HardFloat32 ua, ur;
+
+    if (!hardfloat_usable(status) ||
+        !float32_hard_input(a) || extractFloat32Sign(a)) {
+        return false;
+    }
+    ua.s = float32_val(a);
+    ur.h = sqrtf(ua.h);
+    if (!float32_hard_result(ur)) {
+        return false;
+    }
+    *z = make_float32(ur.s);
+    return true;
+}
+
+INLINE bool float64_hard_sqrt(float64 a, float64 *z STATUS_PARAM)
+{
+    HardFloat64 ua, ur;
+
+    if (!hardfloat_usable(status) ||
+        !float64_hard_input(a) || extractFloat64Sign(a)) {
+        return false;
+    }
+    ua.s = float64_val(a);
+    ur.h = sqrt(ua.h);
+    if (!float64_hard_result(ur)) {
+        return false;
+    }
+    *z = make_float64(ur.s);
+    return true;
+}
+
+/* fmaf() and fma() are only worth it when the host has the instruction */
+INLINE bool float32_hard_muladd(float32 a, float32 b, float32 c, int flags,
+                                float32 *z STATUS_PARAM)
+{
+#ifdef FP_FAST_FMAF
+    HardFloat32 ua, ub, uc, ur;
+
+    if (!hardfloat_usable(status) || !float32_hard_input(a) ||
+        !float32_hard_input(b) || !float32_hard_input(c)) {
+        return false;
+    }
+    ua.s = float32_val(a);
+    ub.s = float32_val(b);
+    uc.s = float32_val(c);
+    if (flags & float_muladd_negate_product) {
+        ua.s ^= 0x80000000;
+    }
+    if (flags & float_muladd_negate_c) {
+        uc.s ^= 0x80000000;
+    }
+    ur.h = fmaf(ua.h, ub.h, uc.h);
+    if (!float32_hard_result(ur)) {
+        return false;
+    }
+    if (flags & float_muladd_negate_result) {
+        ur.s ^= 0x80000000;
+    }
+    *z = make_float32(ur.s);
+    return true;
+#else
+    return false;
+#endif
+}
+
+INLINE bool float64_hard_muladd(float64 a, float64 b, float64 c, int flags,
+                                float64 *z STATUS_PARAM)
+{
+#ifdef FP_FAST_FMA
+    HardFloat64 ua, ub, uc, ur;
+
+    if (!hardfloat_usable(status) || !float64_hard_input(a) ||
+        !float64_hard_input(b) || !float64_hard_input(c)) {
+        return false;
+    }
+    ua.s = float64_val(a);
+    ub.s = float64_val(b);
+    uc.s = float64_val(c);
+    if (flags & float_muladd_negate_product) {
+        ua.s ^= 1ULL << 63;
+    }
+    if (flags & float_muladd_negate_c) {
+        uc.s ^= 1ULL << 63;
+    }
+    ur.h = fma(ua.h, ub.h, uc.h);
+    if (!float64_hard_result(ur)) {
+        return false;
+    }
+    if (flags & float_muladd_negate_result) {
+        ur.s ^= 1ULL << 63;
+    }
+    *z = make_float64(ur.s);
+    return true;
+#else
+    return false;
+#endif
+}
+
 /*----------------------------------------------------------------------------
 | Normalizes the subnormal double-precision floating-point value represented
 | by the denormalized significand `aSig'.  The normalized exponent and
@@ -1867,6 +2115,12 @@ static float32 subFloat32Sigs( float32 a, float32 b, flag zSign STATUS_PARAM)
 float32 float32_add( float32 a, float32 b STATUS_PARAM )
 {
     flag aSign, bSign;
+    float32 z;
+
+    if (float32_hard_op(hardfloat_add, a, b, &z STATUS_VAR)) {
+        return z;
+    }
+
     a = float32_squash_input_denormal(a STATUS_VAR);
     b = float32_squash_input_denormal(b STATUS_VAR);
 
@@ -1890,6 +2144,12 @@ float32 float32_add( float32 a, float32 b STATUS_PARAM )
 float32 float32_sub( float32 a, float32 b STATUS_PARAM )
 {
     flag aSign, bSign;
+    float32 z;
+
+    if (float32_hard_op(hardfloat_sub, a, b, &z STATUS_VAR)) {
+        return z;
+    }
+
     a = float32_squash_input_denormal(a STATUS_VAR);
     b = float32_squash_input_denormal(b STATUS_VAR);
 
@@ -1917,6 +2177,11 @@ float32 float32_mul( float32 a, float32 b STATUS_PARAM )
     uint32_t aSig, bSig;
     uint64_t zSig64;
     uint32_t zSig;
+    float32 z;
+
+    if (float32_hard_op(hardfloat_mul, a, b, &z STATUS_VAR)) {
+        return z;
+    }
 
     a = float32_squash_input_denormal(a STATUS_VAR);
     b = float32_squash_input_denormal(b STATUS_VAR);
@@ -1978,6 +2243,12 @@ float32 float32_div( float32 a, float32 b STATUS_PARAM )
     flag aSign, bSign, zSign;
     int_fast16_t aExp, bExp, zExp;
     uint32_t aSig, bSig, zSig;
+    float32 z;
+
+    if (float32_hard_op(hardfloat_div, a, b, &z STATUS_VAR)) {
+        return z;
+    }
+
     a = float32_squash_input_denormal(a STATUS_VAR);
     b = float32_squash_input_denormal(b STATUS_VAR);
 
@@ -2153,6 +2424,11 @@ float32 float32_muladd(float32 a, float32 b, float32 c, int flags STATUS_PARAM)
     uint32_t pSig;
     int shiftcount;
     flag signflip, infzero;
+    float32 z;
+
+    if (float32_hard_muladd(a, b, c, flags, &z STATUS_VAR)) {
+        return z;
+    }
 
     a = float32_squash_input_denormal(a STATUS_VAR);
     b = float32_squash_input_denormal(b STATUS_VAR);
@@ -2351,6 +2627,11 @@ float32 float32_sqrt( float32 a STATUS_PARAM )
     int_fast16_t aExp, zExp;
     uint32_t aSig, zSig;
     uint64_t rem, term;
+    float32 z;
+
+    if (float32_hard_sqrt(a, &z STATUS_VAR)) {
+        return z;
+    }
     a = float32_squash_input_denormal(a STATUS_VAR);
 
     aSig = extractFloat32Frac( a );
@@ -3430,6 +3711,12 @@ static float64 subFloat64Sigs( float64 a, float64 b, flag zSign STATUS_PARAM )
 float64 float64_add( float64 a, float64 b STATUS_PARAM )
 {
     flag aSign, bSign;
+    float64 z;
+
+    if (float64_hard_op(hardfloat_add, a, b, &z STATUS_VAR)) {
+        return z;
+    }
+
     a = float64_squash_input_denormal(a STATUS_VAR);
     b = float64_squash_input_denormal(b STATUS_VAR);
 
@@ -3453,6 +3740,12 @@ float64 float64_add( float64 a, float64 b STATUS_PARAM )
 float64 float64_sub( float64 a, float64 b STATUS_PARAM )
 {
     flag aSign, bSign;
+    float64 z;
+
+    if (float64_hard_op(hardfloat_sub, a, b, &z STATUS_VAR)) {
+        return z;
+    }
+
     a = float64_squash_input_denormal(a STATUS_VAR);
     b = float64_squash_input_denormal(b STATUS_VAR);
 
@@ -3478,6 +3771,11 @@ float64 float64_mul( float64 a, float64 b STATUS_PARAM )
     flag aSign, bSign, zSign;
     int_fast16_t aExp, bExp, zExp;
     uint64_t aSig, bSig, zSig0, zSig1;
+    float64 z;
+
+    if (float64_hard_op(hardfloat_mul, a, b, &z STATUS_VAR)) {
+        return z;
+    }
 
     a = float64_squash_input_denormal(a STATUS_VAR);
     b = float64_squash_input_denormal(b STATUS_VAR);
@@ -3541,6 +3839,12 @@ float64 float64_div( float64 a, float64 b STATUS_PARAM )
     uint64_t aSig, bSig, zSig;
     uint64_t rem0, rem1;
     uint64_t term0, term1;
+    float64 z;
+
+    if (float64_hard_op(hardfloat_div, a, b, &z STATUS_VAR)) {
+        return z;
+    }
+
     a = float64_squash_input_denormal(a STATUS_VAR);
     b = float64_squash_input_denormal(b STATUS_VAR);
 
@@ -3706,6 +4010,11 @@ float64 float64_muladd(float64 a, float64 b, float64 c, int flags STATUS_PARAM)
     uint64_t pSig0, pSig1, cSig0, cSig1, zSig0, zSig1;
     int shiftcount;
     flag signflip, infzero;
+    float64 z;
+
+    if (float64_hard_muladd(a, b, c, flags, &z STATUS_VAR)) {
+        return z;
+    }
 
     a = float64_squash_input_denormal(a STATUS_VAR);
     b = float64_squash_input_denormal(b STATUS_VAR);
@@ -3918,6 +4227,11 @@ float64 float64_sqrt( float64 a STATUS_PARAM )
     int_fast16_t aExp, zExp;
     uint64_t aSig, zSig, doubleZSig;
     uint64_t rem0, rem1, term0, term1;
+    float64 z;
+
+    if (float64_hard_sqrt(a, &z STATUS_VAR)) {
+        return z;
+    }
     a = float64_squash_input_denormal(a STATUS_VAR);
 
     aSig = extractFloat64Frac( a );
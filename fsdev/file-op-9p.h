@@ -75,6 +75,10 @@ typedef struct FsDriverEntry {
     char *fsdev_id;
     char *path;
     int export_flags;
+    /* 0 lets the worker pool grow on demand */
+    int threads;
+    /* milliseconds that the local driver may cache lstat() results */
+    int attr_timeout;
     FileOperations *ops;
 } FsDriverEntry;
 
@@ -83,6 +87,7 @@ typedef struct FsContext
     uid_t uid;
     char *fs_root;
     int export_flags;
+    int attr_timeout;
     struct xattr_operations **xops;
     struct extended_ops exops;
     /* fs driver specific data */
@@ -38,6 +38,7 @@ int qemu_fsdev_add(QemuOpts *opts)
     const char *fsdriver = qemu_opt_get(opts, "fsdriver");
     const char *writeout = qemu_opt_get(opts, "writeout");
     bool ro = qemu_opt_get_bool(opts, "readonly", 0);
+    int64_t threads = qemu_opt_get_number(opts, "threads", 0);
 
     if (!fsdev_id) {
         fprintf(stderr, "fsdev: No id specified\n");
@@ -60,7 +61,13 @@ int qemu_fsdev_add(QemuOpts *opts)
         return -1;
     }
 
+    if (threads < 0 || threads > 1024) {
+        fprintf(stderr, "fsdev: threads must be between 0 and 1024\n");
+        return -1;
+    }
+
     fsle = g_malloc0(sizeof(*fsle));
+    fsle->fse.threads = threads;
     fsle->fse.fsdev_id = g_strdup(fsdev_id);
     fsle->fse.ops = FsDrivers[i].ops;
     if (writeout) {
@@ -307,19 +307,24 @@ ETEXI
 
     {
         .name       = "savevm",
-        .args_type  = "name:s?",
-        .params     = "[tag|id]",
-        .help       = "save a VM snapshot. If no tag or id are provided, a new snapshot is created",
+        .args_type  = "live:-l,name:s?",
+        .params     = "[-l] [tag|id]",
+        .help       = "save a VM snapshot. If no tag or id are provided, a new snapshot is created"
+                      "\n\t\t\t -l: write RAM while the guest runs",
         .mhandler.cmd = do_savevm,
     },
 
 STEXI
-@item savevm [@var{tag}|@var{id}]
+@item savevm [-l] [@var{tag}|@var{id}]
 @findex savevm
 Create a snapshot of the whole virtual machine. If @var{tag} is
 provided, it is used as human readable identifier. If there is already
 a snapshot with the same tag or ID, it is replaced. More info at
 @ref{vm_snapshots}.
+
+With @option{-l}, RAM is written while the guest keeps running, and the
+guest is only stopped for the last pass and the device state.  The command
+returns at once; use @code{info savevm} to follow the snapshot.
 ETEXI
 
     {
@@ -930,6 +935,38 @@ STEXI
 @item migrate_set_cache_size @var{value}
 @findex migrate_set_cache_size
 Set cache size to @var{value} (in bytes) for xbzrle migrations.
+ETEXI
+
+    {
+        .name       = "migrate_set_threads",
+        .args_type  = "threads:i,level:i?",
+        .params     = "threads [level]",
+        .help       = "set the number of worker threads for multi-thread "
+                      "migrations and the zlib level for compressed "
+                      "migrations",
+        .mhandler.cmd = hmp_migrate_set_threads,
+    },
+
+STEXI
+@item migrate_set_threads @var{threads} [@var{level}]
+@findex migrate_set_threads
+Use @var{threads} worker threads for multi-thread migrations and zlib level
+@var{level} for compressed migrations.
+ETEXI
+
+    {
+        .name       = "migrate_set_block_inflight",
+        .args_type  = "value:i",
+        .params     = "value",
+        .help       = "set the number of reads block migration keeps in "
+                      "flight on each device",
+        .mhandler.cmd = hmp_migrate_set_block_inflight,
+    },
+
+STEXI
+@item migrate_set_block_inflight @var{value}
+@findex migrate_set_block_inflight
+Keep up to @var{value} reads in flight on each device during block migration.
 ETEXI
 
     {
@@ -996,9 +1033,13 @@ ETEXI
 #if defined(CONFIG_HAVE_CORE_DUMP)
     {
         .name       = "dump-guest-memory",
-        .args_type  = "paging:-p,filename:F,begin:i?,length:i?",
-        .params     = "[-p] filename [begin] [length]",
+        .args_type  = "paging:-p,detach:-d,zlib:-z,lzo:-l,snappy:-s,"
+                      "filename:F,begin:i?,length:i?",
+        .params     = "[-p] [-d] [-z|-l|-s] filename [begin] [length]",
         .help       = "dump guest memory to file"
+                      "\n\t\t\t -d: dump from a separate thread"
+                      "\n\t\t\t -z|-l|-s: use the kdump-compressed format,"
+                      "\n\t\t\t compressed by zlib, lzo or snappy"
                       "\n\t\t\t begin(optional): the starting physical address"
                       "\n\t\t\t length(optional): the memory size, in bytes",
         .mhandler.cmd = hmp_dump_guest_memory,
@@ -1006,12 +1047,16 @@ ETEXI
 
 
 STEXI
-@item dump-guest-memory [-p] @var{protocol} @var{begin} @var{length}
+@item dump-guest-memory [-p] [-d] [-z|-l|-s] @var{protocol} @var{begin} @var{length}
 @findex dump-guest-memory
 Dump guest memory to @var{protocol}. The file can be processed with crash or
 gdb.
   filename: dump file name
     paging: do paging to get guest's memory mapping
+        -d: return at once and dump from a separate thread; see info dump
+  -z|-l|-s: write the kdump-compressed format, with zero pages stored once
+            and the others compressed by zlib, lzo or snappy.  Cannot be
+            combined with paging, begin and length.
      begin: the starting physical address. It's optional, and should be
             specified with length together.
     length: the memory size, in bytes. It's optional, and should be specified
@@ -1237,6 +1282,23 @@ STEXI
 @item balloon @var{value}
 @findex balloon
 Request VM to change its memory allocation to @var{value} (in MB).
+ETEXI
+
+    {
+        .name       = "ram_reclaim",
+        .args_type  = "enable:b,rate:o?",
+        .params     = "on|off [rate]",
+        .help       = "start or stop giving zero pages of guest RAM back to "
+                      "the host, scanning rate bytes per second",
+        .mhandler.cmd = hmp_ram_reclaim,
+    },
+
+STEXI
+@item ram_reclaim on|off [@var{rate}]
+@findex ram_reclaim
+Start or stop the background scanner that gives zero pages of guest RAM
+back to the host.  @var{rate} is the number of bytes scanned per second and
+accepts the suffixes k, M and G.
 ETEXI
 
     {
@@ -1598,16 +1660,34 @@ show virtual to physical memory mappings (i386, SH4, SPARC, PPC, and Xtensa only
 show the active virtual memory mappings (i386 only)
 @item info jit
 show dynamic compiler info
+@item info tb-profile [@var{count}]
+show the @var{count} (default 20) translation blocks that took the most
+host time, with their execution counts and the share of the time spent
+in helpers; needs @code{-machine tcg-profile=on}
+@item info halt-poll
+show the halt polling window of each vCPU and how many polls saw the vCPU
+woken or ended in a sleep
 @item info numa
 show NUMA information
 @item info kvm
 show KVM information
+@item info kvm-exits [@var{N}]
+show the vCPU exits by reason, and the @var{N} MMIO and PIO addresses that
+cause the most exits, with their memory region and handling time
 @item info usb
 show USB devices plugged on the virtual USB hub
 @item info usbhost
 show all USB host devices
 @item info profile
 show profiling information
+@item info wakeups
+show which timers and bottom halves woke up the main loop, and how often
+@item info cpu-accounting
+show the time spent in each main loop callback, and how long each thread
+waited for and held the iothread lock
+@item info bql
+show histograms of the iothread lock wait and hold times by site
+(needs @option{-machine bql-profile=on})
 @item info capture
 show information about active capturing
 @item info snapshots
@@ -1634,8 +1714,16 @@ show migration status
 show current migration capabilities
 @item info migrate_cache_size
 show current migration XBZRLE cache size
+@item info migrate_iterations
+show the most recent iterations of the current or last migration
+@item info dump
+show the progress of the last guest memory dump
+@item info savevm
+show the progress of the last live snapshot
 @item info balloon
 show balloon information
+@item info ram-reclaim
+show the state and statistics of the zero page scanner
 @item info qtree
 show device tree
 @item info qdm
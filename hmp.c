@@ -70,6 +70,148 @@ void hmp_info_kvm(Monitor *mon, const QDict *qdict)
     qapi_free_KvmInfo(info);
 }
 
+void hmp_info_kvm_exits(Monitor *mon, const QDict *qdict)
+{
+    KvmExitInfo *info;
+    KvmVcpuExitsList *v;
+    KvmExitCountList *c;
+    KvmExitAddressList *a;
+    Error *err = NULL;
+
+    info = qmp_query_kvm_exits(qdict_haskey(qdict, "top"),
+                               qdict_get_try_int(qdict, "top", 10), &err);
+    if (error_is_set(&err)) {
+        hmp_handle_error(mon, &err);
+        return;
+    }
+
+    for (v = info->vcpus; v; v = v->next) {
+        monitor_printf(mon, "CPU #%" PRId64 ": %" PRId64 " exits, %" PRId64
+                       " interrupted\n", v->value->cpu, v->value->exits,
+                       v->value->interrupted);
+        for (c = v->value->reasons; c; c = c->next) {
+            monitor_printf(mon, "    %-16s %12" PRId64 "\n",
+                           c->value->reason, c->value->count);
+        }
+    }
+
+    monitor_printf(mon, "\nsampled 1/%" PRId64 " of MMIO and PIO exits:\n",
+                   info->sample_period);
+    monitor_printf(mon, "%-5s %-18s %-24s %10s %10s %10s\n", "space",
+                   "address", "region", "reads", "writes", "avg (ns)");
+    for (a = info->addresses; a; a = a->next) {
+        monitor_printf(mon, "%-5s 0x%016" PRIx64 " %-24s %10" PRId64
+                       " %10" PRId64 " %10" PRId64 "\n", a->value->space,
+                       a->value->addr,
+                       a->value->has_region ? a->value->region : "-",
+                       a->value->reads, a->value->writes, a->value->avg_ns);
+    }
+
+    qapi_free_KvmExitInfo(info);
+}
+
+void hmp_info_wakeups(Monitor *mon, const QDict *qdict)
+{
+    WakeupInfo *info;
+    WakeupSourceList *s;
+
+    info = qmp_query_wakeups(NULL);
+    monitor_printf(mon, "%" PRId64 " wakeups, %" PRId64 " by I/O\n",
+                   info->total, info->io);
+    for (s = info->sources; s; s = s->next) {
+        monitor_printf(mon, "%-5s %-32s %10" PRId64, s->value->kind,
+                       s->value->name, s->value->wakeups);
+        if (s->value->has_clock) {
+            monitor_printf(mon, "  %s clock", s->value->clock);
+        }
+        if (s->value->has_slack_ns) {
+            monitor_printf(mon, ", slack %" PRId64 " ns", s->value->slack_ns);
+        }
+        monitor_printf(mon, "\n");
+    }
+
+    qapi_free_WakeupInfo(info);
+}
+
+void hmp_info_cpu_accounting(Monitor *mon, const QDict *qdict)
+{
+    CpuAccountingInfo *info;
+    CallbackAccountingList *c;
+    BqlAccountingList *t;
+
+    info = qmp_query_cpu_accounting(NULL);
+    monitor_printf(mon, "%-5s %-32s %-16s %10s %12s\n",
+                   "kind", "name", "owner", "calls", "time (us)");
+    for (c = info->callbacks; c; c = c->next) {
+        monitor_printf(mon, "%-5s %-32s %-16s %10" PRId64 " %12" PRId64 "\n",
+                       c->value->kind, c->value->name,
+                       c->value->has_owner ? c->value->owner : "-",
+                       c->value->calls, c->value->time_ns / 1000);
+    }
+    monitor_printf(mon, "\n%-16s %8s %12s %12s %12s\n",
+                   "thread", "tid", "locks", "wait (us)", "hold (us)");
+    for (t = info->threads; t; t = t->next) {
+        monitor_printf(mon, "%-16s %8" PRId64 " %12" PRId64 " %12" PRId64
+                       " %12" PRId64 "\n",
+                       t->value->has_name ? t->value->name : "-",
+                       t->value->thread_id, t->value->acquisitions,
+                       t->value->wait_ns / 1000, t->value->hold_ns / 1000);
+    }
+
+    qapi_free_CpuAccountingInfo(info);
+}
+
+static void hmp_print_bql_histogram(Monitor *mon, const char *what,
+                                    BqlHistogramBucketList *hist)
+{
+    int i;
+
+    monitor_printf(mon, "    %s:", what);
+    for (i = 0; hist; hist = hist->next, i++) {
+        int64_t count = hist->value->count;
+
+        if (!count) {
+            continue;
+        }
+        if (!i) {
+            monitor_printf(mon, " <1us:%" PRId64, count);
+        } else if (!hist->next) {
+            monitor_printf(mon, " >=%dus:%" PRId64, 1 << (i - 1), count);
+        } else {
+            monitor_printf(mon, " <%dus:%" PRId64, 1 << i, count);
+        }
+    }
+    monitor_printf(mon, "\n");
+}
+
+void hmp_info_bql(Monitor *mon, const QDict *qdict)
+{
+    BqlInfo *info;
+    BqlSiteInfoList *s;
+
+    info = qmp_query_bql(NULL);
+    if (!info->enabled) {
+        monitor_printf(mon, "not collected, use -machine bql-profile=on\n");
+        qapi_free_BqlInfo(info);
+        return;
+    }
+    for (s = info->sites; s; s = s->next) {
+        BqlSiteInfo *site = s->value;
+
+        monitor_printf(mon, "%s: %" PRId64 " acquisitions, wait %" PRId64
+                       " us (max %" PRId64 " us), %" PRId64 " holds, "
+                       "hold %" PRId64 " us (max %" PRId64 " us)\n",
+                       BqlSite_lookup[site->site], site->acquisitions,
+                       site->wait_ns / 1000, site->max_wait_ns / 1000,
+                       site->holds, site->hold_ns / 1000,
+                       site->max_hold_ns / 1000);
+        hmp_print_bql_histogram(mon, "wait", site->wait_histogram);
+        hmp_print_bql_histogram(mon, "hold", site->hold_histogram);
+    }
+
+    qapi_free_BqlInfo(info);
+}
+
 void hmp_info_status(Monitor *mon, const QDict *qdict)
 {
     StatusInfo *info;
@@ -181,6 +323,23 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
             monitor_printf(mon, "dirty pages rate: %" PRIu64 " pages\n",
                            info->ram->dirty_pages_rate);
         }
+        if (info->ram->has_postcopy_requests) {
+            monitor_printf(mon, "postcopy requests: %" PRIu64 "\n",
+                           info->ram->postcopy_requests);
+        }
+        if (info->ram->has_sent_bytes && info->ram->sent_bytes) {
+            monitor_printf(mon, "copied bytes: %" PRIu64 " kbytes"
+                           " (%" PRIu64 "%% of sent)\n",
+                           info->ram->copied_bytes >> 10,
+                           info->ram->copied_bytes * 100 /
+                           info->ram->sent_bytes);
+        }
+        if (info->ram->has_dirty_sync_count && info->ram->dirty_sync_count) {
+            monitor_printf(mon, "dirty sync count: %" PRIu64 "\n",
+                           info->ram->dirty_sync_count);
+            monitor_printf(mon, "dirty sync time: %" PRIu64
+                           " microseconds\n", info->ram->dirty_sync_time);
+        }
     }
 
     if (info->has_disk) {
@@ -203,6 +362,26 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->xbzrle_cache->cache_miss);
         monitor_printf(mon, "xbzrle overflow : %" PRIu64 "\n",
                        info->xbzrle_cache->overflow);
+        monitor_printf(mon, "xbzrle cache hit: %" PRIu64 "\n",
+                       info->xbzrle_cache->cache_hit);
+        monitor_printf(mon, "xbzrle skipped: %" PRIu64 "\n",
+                       info->xbzrle_cache->skipped);
+    }
+
+    if (info->has_cpu_throttle_percentage) {
+        monitor_printf(mon, "cpu throttle percentage: %" PRIu64 "\n",
+                       info->cpu_throttle_percentage);
+    }
+
+    if (info->has_threads) {
+        MigrationThreadStatsList *t;
+
+        for (t = info->threads; t; t = t->next) {
+            monitor_printf(mon, "thread %" PRId64 ": %" PRIu64 " pages, %"
+                           PRIu64 " kbytes, %" PRIu64 " kbytes/s\n",
+                           t->value->id, t->value->pages,
+                           t->value->bytes >> 10, t->value->throughput >> 10);
+        }
     }
 
     qapi_free_MigrationInfo(info);
@@ -234,6 +413,29 @@ void hmp_info_migrate_cache_size(Monitor *mon, const QDict *qdict)
                    qmp_query_migrate_cache_size(NULL) >> 10);
 }
 
+void hmp_info_migrate_iterations(Monitor *mon, const QDict *qdict)
+{
+    MigrationIterationInfoList *list, *it;
+
+    list = qmp_query_migrate_iterations(NULL);
+
+    for (it = list; it; it = it->next) {
+        MigrationIterationInfo *info = it->value;
+
+        monitor_printf(mon, "iteration %" PRId64 ": %" PRId64 " ms, "
+                       "dirtied %" PRId64 " sent %" PRId64 " zero %" PRId64
+                       " xbzrle %" PRId64 " (hits %" PRId64 ") pages, "
+                       "%" PRId64 " kbytes, sync %" PRId64 " us, "
+                       "blocked %" PRId64 " us\n",
+                       info->iteration, info->duration, info->dirtied_pages,
+                       info->sent_pages, info->zero_pages, info->xbzrle_pages,
+                       info->xbzrle_cache_hits, info->bytes >> 10,
+                       info->sync_time, info->blocked_time);
+    }
+
+    qapi_free_MigrationIterationInfoList(list);
+}
+
 void hmp_info_cpus(Monitor *mon, const QDict *qdict)
 {
     CpuInfoList *cpu_list, *cpu;
@@ -316,6 +518,21 @@ void hmp_info_block(Monitor *mon, const QDict *qdict)
                             info->value->inserted->iops,
                             info->value->inserted->iops_rd,
                             info->value->inserted->iops_wr);
+
+            if (info->value->inserted->has_group) {
+                monitor_printf(mon, " bps_max=%" PRId64 " bps_rd_max=%" PRId64
+                                " bps_wr_max=%" PRId64 " iops_max=%" PRId64
+                                " iops_rd_max=%" PRId64 " iops_wr_max=%" PRId64
+                                " iops_size=%" PRId64 " group=%s",
+                                info->value->inserted->bps_max,
+                                info->value->inserted->bps_rd_max,
+                                info->value->inserted->bps_wr_max,
+                                info->value->inserted->iops_max,
+                                info->value->inserted->iops_rd_max,
+                                info->value->inserted->iops_wr_max,
+                                info->value->inserted->iops_size,
+                                info->value->inserted->group);
+            }
         } else {
             monitor_printf(mon, " [not inserted]");
         }
@@ -346,6 +563,11 @@ void hmp_info_blockstats(Monitor *mon, const QDict *qdict)
                        " wr_total_time_ns=%" PRId64
                        " rd_total_time_ns=%" PRId64
                        " flush_total_time_ns=%" PRId64
+                       " serialized_operations=%" PRId64
+                       " serialized_total_time_ns=%" PRId64
+                       " rd_merged=%" PRId64
+                       " wr_merged=%" PRId64
+                       " in_flight=%" PRId64
                        "\n",
                        stats->value->stats->rd_bytes,
                        stats->value->stats->wr_bytes,
@@ -354,7 +576,12 @@ void hmp_info_blockstats(Monitor *mon, const QDict *qdict)
                        stats->value->stats->flush_operations,
                        stats->value->stats->wr_total_time_ns,
                        stats->value->stats->rd_total_time_ns,
-                       stats->value->stats->flush_total_time_ns);
+                       stats->value->stats->flush_total_time_ns,
+                       stats->value->stats->serialized_operations,
+                       stats->value->stats->serialized_total_time_ns,
+                       stats->value->stats->rd_merged,
+                       stats->value->stats->wr_merged,
+                       stats->value->stats->in_flight);
     }
 
     qapi_free_BlockStatsList(stats_list);
@@ -399,6 +626,10 @@ void hmp_info_vnc(Monitor *mon, const QDict *qdict)
             monitor_printf(mon, "    username: %s\n",
                            client->value->has_sasl_username ?
                            client->value->sasl_username : "none");
+            if (client->value->has_encode_time) {
+                monitor_printf(mon, " encode time: %" PRId64 " ms\n",
+                               client->value->encode_time);
+            }
         }
     }
 
@@ -470,6 +701,23 @@ void hmp_info_balloon(Monitor *mon, const QDict *qdict)
     qapi_free_BalloonInfo(info);
 }
 
+void hmp_info_ram_reclaim(Monitor *mon, const QDict *qdict)
+{
+    RamReclaimInfo *info;
+
+    info = qmp_query_ram_reclaim(NULL);
+    monitor_printf(mon, "ram-reclaim: %s%s, rate %" PRId64 " kbytes/s\n",
+                   info->enabled ? "on" : "off",
+                   info->inhibited ? " (inhibited)" : "", info->rate >> 10);
+    monitor_printf(mon, "passes: %" PRId64 "\n", info->passes);
+    monitor_printf(mon, "scanned: %" PRId64 " kbytes\n", info->scanned >> 10);
+    monitor_printf(mon, "reclaimed: %" PRId64 " kbytes\n",
+                   info->reclaimed >> 10);
+    monitor_printf(mon, "vcpu pauses: %" PRId64 "\n", info->pauses);
+
+    qapi_free_RamReclaimInfo(info);
+}
+
 static void hmp_info_pci_device(Monitor *mon, const PciDeviceInfo *dev)
 {
     PciMemoryRegionList *region;
@@ -782,6 +1030,17 @@ void hmp_balloon(Monitor *mon, const QDict *qdict)
     }
 }
 
+void hmp_ram_reclaim(Monitor *mon, const QDict *qdict)
+{
+    bool enable = qdict_get_bool(qdict, "enable");
+    bool has_rate = qdict_haskey(qdict, "rate");
+    int64_t rate = qdict_get_try_int(qdict, "rate", 0);
+    Error *errp = NULL;
+
+    qmp_ram_reclaim_set(enable, has_rate, rate, &errp);
+    hmp_handle_error(mon, &errp);
+}
+
 void hmp_block_resize(Monitor *mon, const QDict *qdict)
 {
     const char *device = qdict_get_str(qdict, "device");
@@ -817,7 +1076,7 @@ void hmp_drive_mirror(Monitor *mon, const QDict *qdict)
     qmp_drive_mirror(device, filename, !!format, format,
                      full ? MIRROR_SYNC_MODE_FULL : MIRROR_SYNC_MODE_TOP,
                      true, mode, false, 0, false, 0, false, 0,
-                     false, 0, false, 0, &errp);
+                     false, 0, false, 0, false, 0, &errp);
     hmp_handle_error(mon, &errp);
 }
 
@@ -868,6 +1127,33 @@ void hmp_migrate_set_cache_size(Monitor *mon, const QDict *qdict)
     }
 }
 
+void hmp_migrate_set_threads(Monitor *mon, const QDict *qdict)
+{
+    int64_t threads = qdict_get_int(qdict, "threads");
+    bool has_level = qdict_haskey(qdict, "level");
+    int64_t level = qdict_get_try_int(qdict, "level", 0);
+    Error *err = NULL;
+
+    qmp_migrate_set_threads(threads, has_level, level, &err);
+    if (err) {
+        monitor_printf(mon, "%s\n", error_get_pretty(err));
+        error_free(err);
+        return;
+    }
+}
+
+void hmp_migrate_set_block_inflight(Monitor *mon, const QDict *qdict)
+{
+    int64_t value = qdict_get_int(qdict, "value");
+    Error *err = NULL;
+
+    qmp_migrate_set_block_inflight(value, &err);
+    if (err) {
+        monitor_printf(mon, "%s\n", error_get_pretty(err));
+        error_free(err);
+    }
+}
+
 void hmp_migrate_set_speed(Monitor *mon, const QDict *qdict)
 {
     int64_t value = qdict_get_int(qdict, "value");
@@ -980,7 +1266,10 @@ void hmp_block_set_io_throttle(Monitor *mon, const QDict *qdict)
                               qdict_get_int(qdict, "bps_wr"),
                               qdict_get_int(qdict, "iops"),
                               qdict_get_int(qdict, "iops_rd"),
-                              qdict_get_int(qdict, "iops_wr"), &err);
+                              qdict_get_int(qdict, "iops_wr"),
+                              false, 0, false, 0, false, 0,
+                              false, 0, false, 0, false, 0,
+                              false, 0, false, NULL, &err);
     hmp_handle_error(mon, &err);
 }
 
@@ -993,7 +1282,7 @@ void hmp_block_stream(Monitor *mon, const QDict *qdict)
 
     qmp_block_stream(device, base != NULL, base,
                      qdict_haskey(qdict, "speed"), speed,
-                     BLOCKDEV_ON_ERROR_REPORT, true, &error);
+                     BLOCKDEV_ON_ERROR_REPORT, true, false, 0, &error);
 
     hmp_handle_error(mon, &error);
 }
@@ -1004,7 +1293,7 @@ void hmp_block_job_set_speed(Monitor *mon, const QDict *qdict)
     const char *device = qdict_get_str(qdict, "device");
     int64_t value = qdict_get_int(qdict, "speed");
 
-    qmp_block_job_set_speed(device, value, &error);
+    qmp_block_job_set_speed(device, value, false, 0, &error);
 
     hmp_handle_error(mon, &error);
 }
@@ -1136,13 +1425,30 @@ void hmp_dump_guest_memory(Monitor *mon, const QDict *qdict)
 {
     Error *errp = NULL;
     int paging = qdict_get_try_bool(qdict, "paging", 0);
+    int detach = qdict_get_try_bool(qdict, "detach", 0);
+    int zlib = qdict_get_try_bool(qdict, "zlib", 0);
+    int lzo = qdict_get_try_bool(qdict, "lzo", 0);
+    int snappy = qdict_get_try_bool(qdict, "snappy", 0);
     const char *file = qdict_get_str(qdict, "filename");
     bool has_begin = qdict_haskey(qdict, "begin");
     bool has_length = qdict_haskey(qdict, "length");
+    DumpGuestMemoryFormat format = DUMP_GUEST_MEMORY_FORMAT_ELF;
     int64_t begin = 0;
     int64_t length = 0;
     char *prot;
 
+    if (zlib + lzo + snappy > 1) {
+        monitor_printf(mon, "only one of '-z|-l|-s' can be set\n");
+        return;
+    }
+    if (zlib) {
+        format = DUMP_GUEST_MEMORY_FORMAT_KDUMP_ZLIB;
+    } else if (lzo) {
+        format = DUMP_GUEST_MEMORY_FORMAT_KDUMP_LZO;
+    } else if (snappy) {
+        format = DUMP_GUEST_MEMORY_FORMAT_KDUMP_SNAPPY;
+    }
+
     if (has_begin) {
         begin = qdict_get_int(qdict, "begin");
     }
@@ -1153,11 +1459,65 @@ void hmp_dump_guest_memory(Monitor *mon, const QDict *qdict)
     prot = g_strconcat("file:", file, NULL);
 
     qmp_dump_guest_memory(paging, prot, has_begin, begin, has_length, length,
-                          &errp);
+                          true, format, true, detach, &errp);
     hmp_handle_error(mon, &errp);
     g_free(prot);
 }
 
+void hmp_info_dump(Monitor *mon, const QDict *qdict)
+{
+    DumpQueryResult *result;
+    Error *errp = NULL;
+
+    result = qmp_query_dump(&errp);
+    if (error_is_set(&errp)) {
+        hmp_handle_error(mon, &errp);
+        return;
+    }
+
+    monitor_printf(mon, "Status: %s\n", DumpStatus_lookup[result->status]);
+    if (result->status != DUMP_STATUS_NONE) {
+        monitor_printf(mon, "Dumped: %" PRId64 " of %" PRId64 " kbytes",
+                       result->completed >> 10, result->total >> 10);
+        if (result->total) {
+            monitor_printf(mon, " (%" PRId64 "%%)",
+                           result->completed * 100 / result->total);
+        }
+        monitor_printf(mon, "\n");
+    }
+
+    qapi_free_DumpQueryResult(result);
+}
+
+void hmp_info_savevm(Monitor *mon, const QDict *qdict)
+{
+    SaveVMInfo *info;
+
+    info = qmp_query_savevm(NULL);
+
+    monitor_printf(mon, "Status: %s\n", SavevmStatus_lookup[info->status]);
+    if (info->has_name) {
+        monitor_printf(mon, "Name: %s\n", info->name);
+    }
+    if (info->has_vmstate_size) {
+        monitor_printf(mon, "VM state: %" PRId64 " kbytes\n",
+                       info->vmstate_size >> 10);
+    }
+    if (info->has_total_time) {
+        monitor_printf(mon, "Total time: %" PRId64 " milliseconds\n",
+                       info->total_time);
+    }
+    if (info->has_downtime) {
+        monitor_printf(mon, "Downtime: %" PRId64 " milliseconds\n",
+                       info->downtime);
+    }
+    if (info->has_error) {
+        monitor_printf(mon, "Error: %s\n", info->error);
+    }
+
+    qapi_free_SaveVMInfo(info);
+}
+
 void hmp_netdev_add(Monitor *mon, const QDict *qdict)
 {
     Error *err = NULL;
@@ -15,10 +15,12 @@
 #include "fsdev/qemu-fsdev.h"
 #include "qemu/thread.h"
 #include "block/coroutine.h"
+#include "sysemu/cpus.h"
 #include "virtio-9p-coth.h"
 
 /* v9fs glib thread pool */
 static V9fsThPool v9fs_pool;
+static __thread bool v9fs_worker_registered;
 
 void co_run_in_worker_bh(void *opaque)
 {
@@ -47,6 +49,12 @@ static void v9fs_thread_routine(gpointer data, gpointer user_data)
     char byte = 0;
     Coroutine *co = data;
 
+    /* Threads of a fixed size pool live as long as QEMU does */
+    if (v9fs_pool.exclusive && !v9fs_worker_registered) {
+        qemu_register_thread("virtio-9p/worker", qemu_get_thread_id());
+        v9fs_worker_registered = true;
+    }
+
     qemu_coroutine_enter(co, NULL);
 
     g_async_queue_push(v9fs_pool.completed, co);
@@ -55,13 +63,25 @@ static void v9fs_thread_routine(gpointer data, gpointer user_data)
     } while (len == -1 && errno == EINTR);
 }
 
-int v9fs_init_worker_threads(void)
+/*
+ * All exports share one pool.  With @threads == 0 it grows on demand;
+ * otherwise it has a fixed number of threads, the largest number that any
+ * export asked for, which query-threads lists so that they can be pinned.
+ */
+int v9fs_init_worker_threads(int threads)
 {
     int ret = 0;
     int notifier_fds[2];
     V9fsThPool *p = &v9fs_pool;
     sigset_t set, oldset;
 
+    if (p->pool) {
+        if (p->exclusive && threads > g_thread_pool_get_max_threads(p->pool)) {
+            g_thread_pool_set_max_threads(p->pool, threads, NULL);
+        }
+        return 0;
+    }
+
     sigfillset(&set);
     /* Leave signal handling to the iothread.  */
     pthread_sigmask(SIG_SETMASK, &set, &oldset);
@@ -70,7 +90,10 @@ int v9fs_init_worker_threads(void)
         ret = -1;
         goto err_out;
     }
-    p->pool = g_thread_pool_new(v9fs_thread_routine, p, -1, FALSE, NULL);
+    p->exclusive = threads > 0;
+    p->pool = g_thread_pool_new(v9fs_thread_routine, p,
+                                p->exclusive ? threads : -1, p->exclusive,
+                                NULL);
     if (!p->pool) {
         ret = -1;
         goto err_out;
@@ -24,6 +24,7 @@ typedef struct V9fsThPool {
     int rfd;
     int wfd;
     GThreadPool *pool;
+    bool exclusive;
     GAsyncQueue *completed;
 } V9fsThPool;
 
@@ -55,7 +56,7 @@ typedef struct V9fsThPool {
     } while (0)
 
 extern void co_run_in_worker_bh(void *);
-extern int v9fs_init_worker_threads(void);
+extern int v9fs_init_worker_threads(int threads);
 extern int v9fs_co_readlink(V9fsPDU *, V9fsPath *, V9fsString *);
 extern int v9fs_co_readdir_r(V9fsPDU *, V9fsFidState *,
                            struct dirent *, struct dirent **result);
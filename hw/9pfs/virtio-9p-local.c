@@ -20,6 +20,8 @@
 #include <sys/socket.h>
 #include <sys/un.h>
 #include "qemu/xattr.h"
+#include "qemu/thread.h"
+#include "qemu/timer.h"
 #include <libgen.h>
 #include <linux/fs.h>
 #ifdef CONFIG_LINUX_MAGIC_H
@@ -42,6 +44,28 @@
 
 #define VIRTFS_META_DIR ".virtfs_metadata"
 
+/* upper bound on the number of paths held by the attribute cache */
+#define LOCAL_ATTR_CACHE_MAX 8192
+
+/*
+ * lstat() results by path, including the overrides of the mapped security
+ * models, kept for attr_timeout ms.  Anything that changes the export
+ * through this fsdev drops the whole cache once it is done, so only
+ * changes made on the host behind QEMU's back can be seen late.
+ */
+typedef struct LocalAttrCache {
+    QemuMutex lock;
+    GHashTable *entries;
+    int64_t timeout;
+    /* bumped by every flush; lstat() results older than that are dropped */
+    unsigned int generation;
+} LocalAttrCache;
+
+typedef struct LocalAttrCacheEntry {
+    struct stat stbuf;
+    int64_t expires;
+} LocalAttrCacheEntry;
+
 static const char *local_mapped_attr_path(FsContext *ctx,
                                           const char *path, char *buffer)
 {
@@ -88,7 +112,8 @@ static void local_mapped_file_attr(FsContext *ctx, const char *path,
     fclose(fp);
 }
 
-static int local_lstat(FsContext *fs_ctx, V9fsPath *fs_path, struct stat *stbuf)
+static int local_do_lstat(FsContext *fs_ctx, V9fsPath *fs_path,
+                          struct stat *stbuf)
 {
     int err;
     char buffer[PATH_MAX];
@@ -126,6 +151,61 @@ static int local_lstat(FsContext *fs_ctx, V9fsPath *fs_path, struct stat *stbuf)
     return err;
 }
 
+static int local_lstat(FsContext *fs_ctx, V9fsPath *fs_path, struct stat *stbuf)
+{
+    LocalAttrCache *cache = fs_ctx->private;
+    LocalAttrCacheEntry *e;
+    unsigned int generation;
+    int64_t now;
+    int err;
+
+    if (!cache) {
+        return local_do_lstat(fs_ctx, fs_path, stbuf);
+    }
+
+    now = get_clock();
+    qemu_mutex_lock(&cache->lock);
+    e = g_hash_table_lookup(cache->entries, fs_path->data);
+    if (e && now < e->expires) {
+        *stbuf = e->stbuf;
+        qemu_mutex_unlock(&cache->lock);
+        return 0;
+    }
+    generation = cache->generation;
+    qemu_mutex_unlock(&cache->lock);
+
+    err = local_do_lstat(fs_ctx, fs_path, stbuf);
+    if (err) {
+        return err;
+    }
+
+    qemu_mutex_lock(&cache->lock);
+    if (generation == cache->generation) {
+        if (g_hash_table_size(cache->entries) >= LOCAL_ATTR_CACHE_MAX) {
+            g_hash_table_remove_all(cache->entries);
+        }
+        e = g_new(LocalAttrCacheEntry, 1);
+        e->stbuf = *stbuf;
+        e->expires = now + cache->timeout;
+        g_hash_table_replace(cache->entries, g_strdup(fs_path->data), e);
+    }
+    qemu_mutex_unlock(&cache->lock);
+    return 0;
+}
+
+static void local_attr_cache_flush(FsContext *fs_ctx)
+{
+    LocalAttrCache *cache = fs_ctx->private;
+
+    if (!cache) {
+        return;
+    }
+    qemu_mutex_lock(&cache->lock);
+    g_hash_table_remove_all(cache->entries);
+    cache->generation++;
+    qemu_mutex_unlock(&cache->lock);
+}
+
 static int local_create_mapped_attr_dir(FsContext *ctx, const char *path)
 {
     int err;
@@ -1057,6 +1137,139 @@ static int local_ioc_getversion(FsContext *ctx, V9fsPath *path,
     return err;
 }
 
+/*
+ * Operations that modify the export, wrapped to drop the attribute cache
+ * after the change is made.
+ */
+static ssize_t local_pwritev_flush(FsContext *ctx, V9fsFidOpenState *fs,
+                                   const struct iovec *iov,
+                                   int iovcnt, off_t offset)
+{
+    ssize_t ret = local_pwritev(ctx, fs, iov, iovcnt, offset);
+    local_attr_cache_flush(ctx);
+    return ret;
+}
+
+static int local_chmod_flush(FsContext *ctx, V9fsPath *fs_path, FsCred *credp)
+{
+    int ret = local_chmod(ctx, fs_path, credp);
+    local_attr_cache_flush(ctx);
+    return ret;
+}
+
+static int local_mknod_flush(FsContext *ctx, V9fsPath *dir_path,
+                             const char *name, FsCred *credp)
+{
+    int ret = local_mknod(ctx, dir_path, name, credp);
+    local_attr_cache_flush(ctx);
+    return ret;
+}
+
+static int local_mkdir_flush(FsContext *ctx, V9fsPath *dir_path,
+                             const char *name, FsCred *credp)
+{
+    int ret = local_mkdir(ctx, dir_path, name, credp);
+    local_attr_cache_flush(ctx);
+    return ret;
+}
+
+static int local_open2_flush(FsContext *ctx, V9fsPath *dir_path,
+                             const char *name, int flags, FsCred *credp,
+                             V9fsFidOpenState *fs)
+{
+    int ret = local_open2(ctx, dir_path, name, flags, credp, fs);
+    local_attr_cache_flush(ctx);
+    return ret;
+}
+
+static int local_symlink_flush(FsContext *ctx, const char *oldpath,
+                               V9fsPath *dir_path, const char *name,
+                               FsCred *credp)
+{
+    int ret = local_symlink(ctx, oldpath, dir_path, name, credp);
+    local_attr_cache_flush(ctx);
+    return ret;
+}
+
+static int local_link_flush(FsContext *ctx, V9fsPath *oldpath,
+                            V9fsPath *dirpath, const char *name)
+{
+    int ret = local_link(ctx, oldpath, dirpath, name);
+    local_attr_cache_flush(ctx);
+    return ret;
+}
+
+static int local_truncate_flush(FsContext *ctx, V9fsPath *fs_path, off_t size)
+{
+    int ret = local_truncate(ctx, fs_path, size);
+    local_attr_cache_flush(ctx);
+    return ret;
+}
+
+static int local_rename_flush(FsContext *ctx, const char *oldpath,
+                              const char *newpath)
+{
+    int ret = local_rename(ctx, oldpath, newpath);
+    local_attr_cache_flush(ctx);
+    return ret;
+}
+
+static int local_chown_flush(FsContext *ctx, V9fsPath *fs_path, FsCred *credp)
+{
+    int ret = local_chown(ctx, fs_path, credp);
+    local_attr_cache_flush(ctx);
+    return ret;
+}
+
+static int local_utimensat_flush(FsContext *ctx, V9fsPath *fs_path,
+                                 const struct timespec *buf)
+{
+    int ret = local_utimensat(ctx, fs_path, buf);
+    local_attr_cache_flush(ctx);
+    return ret;
+}
+
+static int local_remove_flush(FsContext *ctx, const char *path)
+{
+    int ret = local_remove(ctx, path);
+    local_attr_cache_flush(ctx);
+    return ret;
+}
+
+static int local_lsetxattr_flush(FsContext *ctx, V9fsPath *fs_path,
+                                 const char *name, void *value, size_t size,
+                                 int flags)
+{
+    int ret = local_lsetxattr(ctx, fs_path, name, value, size, flags);
+    local_attr_cache_flush(ctx);
+    return ret;
+}
+
+static int local_lremovexattr_flush(FsContext *ctx, V9fsPath *fs_path,
+                                    const char *name)
+{
+    int ret = local_lremovexattr(ctx, fs_path, name);
+    local_attr_cache_flush(ctx);
+    return ret;
+}
+
+static int local_renameat_flush(FsContext *ctx, V9fsPath *olddir,
+                                const char *old_name, V9fsPath *newdir,
+                                const char *new_name)
+{
+    int ret = local_renameat(ctx, olddir, old_name, newdir, new_name);
+    local_attr_cache_flush(ctx);
+    return ret;
+}
+
+static int local_unlinkat_flush(FsContext *ctx, V9fsPath *dir,
+                                const char *name, int flags)
+{
+    int ret = local_unlinkat(ctx, dir, name, flags);
+    local_attr_cache_flush(ctx);
+    return ret;
+}
+
 static int local_init(FsContext *ctx)
 {
     int err = 0;
@@ -1076,6 +1289,16 @@ static int local_init(FsContext *ctx)
         ctx->xops = passthrough_xattr_ops;
     }
     ctx->export_flags |= V9FS_PATHNAME_FSCONTEXT;
+
+    if (ctx->attr_timeout > 0) {
+        LocalAttrCache *cache = g_new0(LocalAttrCache, 1);
+
+        qemu_mutex_init(&cache->lock);
+        cache->entries = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                               g_free, g_free);
+        cache->timeout = (int64_t)ctx->attr_timeout * SCALE_MS;
+        ctx->private = cache;
+    }
 #ifdef FS_IOC_GETVERSION
     /*
      * use ioc_getversion only if the iocl is definied
@@ -1099,6 +1322,7 @@ static int local_parse_opts(QemuOpts *opts, struct FsDriverEntry *fse)
 {
     const char *sec_model = qemu_opt_get(opts, "security_model");
     const char *path = qemu_opt_get(opts, "path");
+    int64_t attr_timeout;
 
     if (!sec_model) {
         fprintf(stderr, "security model not specified, "
@@ -1129,6 +1353,14 @@ static int local_parse_opts(QemuOpts *opts, struct FsDriverEntry *fse)
     }
     fse->path = g_strdup(path);
 
+    attr_timeout = qemu_opt_get_number(opts, "attr_timeout", 0);
+    if (attr_timeout < 0 || attr_timeout > INT_MAX) {
+        fprintf(stderr, "fsdev: invalid attr_timeout %" PRId64 "\n",
+                attr_timeout);
+        return -1;
+    }
+    fse->attr_timeout = attr_timeout;
+
     return 0;
 }
 
@@ -1146,26 +1378,26 @@ FileOperations local_ops = {
     .readdir_r = local_readdir_r,
     .seekdir = local_seekdir,
     .preadv = local_preadv,
-    .pwritev = local_pwritev,
-    .chmod = local_chmod,
-    .mknod = local_mknod,
-    .mkdir = local_mkdir,
+    .pwritev = local_pwritev_flush,
+    .chmod = local_chmod_flush,
+    .mknod = local_mknod_flush,
+    .mkdir = local_mkdir_flush,
     .fstat = local_fstat,
-    .open2 = local_open2,
-    .symlink = local_symlink,
-    .link = local_link,
-    .truncate = local_truncate,
-    .rename = local_rename,
-    .chown = local_chown,
-    .utimensat = local_utimensat,
-    .remove = local_remove,
+    .open2 = local_open2_flush,
+    .symlink = local_symlink_flush,
+    .link = local_link_flush,
+    .truncate = local_truncate_flush,
+    .rename = local_rename_flush,
+    .chown = local_chown_flush,
+    .utimensat = local_utimensat_flush,
+    .remove = local_remove_flush,
     .fsync = local_fsync,
     .statfs = local_statfs,
     .lgetxattr = local_lgetxattr,
     .llistxattr = local_llistxattr,
-    .lsetxattr = local_lsetxattr,
-    .lremovexattr = local_lremovexattr,
+    .lsetxattr = local_lsetxattr_flush,
+    .lremovexattr = local_lremovexattr_flush,
     .name_to_path = local_name_to_path,
-    .renameat  = local_renameat,
-    .unlinkat = local_unlinkat,
+    .renameat  = local_renameat_flush,
+    .unlinkat = local_unlinkat_flush,
 };
@@ -16,6 +16,7 @@
 #include "virtio-9p.h"
 #include "virtio-9p-xattr.h"
 #include "fsdev/qemu-fsdev.h"
+#include "qemu/rcu.h"
 #include "virtio-9p-synth.h"
 
 #include <sys/stat.h>
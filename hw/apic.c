@@ -419,6 +419,30 @@ static void apic_eoi(APICCommonState *s)
     apic_update_irq(s);
 }
 
+/*
+ * With paravirtual EOI the guest acknowledges the interrupt in service by
+ * clearing a flag in its own memory instead of writing the EOI register.
+ * That is only allowed for an edge-triggered vector with nothing else
+ * pending, because otherwise the EOI has side effects that cannot wait
+ * until the next exit.
+ */
+bool apic_pv_eoi_possible(DeviceState *d)
+{
+    APICCommonState *s = APIC_COMMON(d);
+    int isrv;
+
+    isrv = get_highest_priority_int(s->isr);
+    if (isrv < 0 || get_bit(s->tmr, isrv)) {
+        return false;
+    }
+    return get_highest_priority_int(s->irr) < 0;
+}
+
+void apic_pv_eoi(DeviceState *d)
+{
+    apic_eoi(APIC_COMMON(d));
+}
+
 static int apic_find_dest(uint8_t dest)
 {
     APICCommonState *apic = local_apics[dest];
@@ -22,6 +22,8 @@ void apic_handle_tpr_access_report(DeviceState *d, target_ulong ip,
                                    TPRAccess access);
 void apic_poll_irq(DeviceState *d);
 void apic_designate_bsp(DeviceState *d);
+bool apic_pv_eoi_possible(DeviceState *d);
+void apic_pv_eoi(DeviceState *d);
 
 /* pc.c */
 DeviceState *cpu_get_current_apic(void);
@@ -22,6 +22,20 @@ void blkconf_serial(BlockConf *conf, char **serial)
     }
 }
 
+/* Advertise the block size the host storage wants as the physical block
+ * size, when that is larger, so that the guest aligns its requests to it
+ * and they reach the storage without read-modify-write.  The logical block
+ * size stays as configured: it changes how the guest lays out the disk.
+ */
+void blkconf_blocksizes(BlockConf *conf)
+{
+    int align = bdrv_get_request_alignment(conf->bs);
+
+    if (align > conf->physical_block_size && align <= 32768) {
+        conf->physical_block_size = align;
+    }
+}
+
 int blkconf_geometry(BlockConf *conf, int *ptrans,
                      unsigned cyls_max, unsigned heads_max, unsigned secs_max)
 {
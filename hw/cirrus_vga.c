@@ -2911,6 +2911,7 @@ static int vga_initfn(ISADevice *dev)
     s->ds = graphic_console_init(s->update, s->invalidate,
                                  s->screen_dump, s->text_update,
                                  s);
+    vga_display_idle_init(s);
     rom_add_vga(VGABIOS_CIRRUS_FILENAME);
     /* XXX ISA-LFB support */
     /* FIXME not qdev yet */
@@ -2960,6 +2961,7 @@ static int pci_cirrus_vga_initfn(PCIDevice *dev)
      s->vga.ds = graphic_console_init(s->vga.update, s->vga.invalidate,
                                       s->vga.screen_dump, s->vga.text_update,
                                       &s->vga);
+     vga_display_idle_init(&s->vga);
 
      /* setup PCI */
 
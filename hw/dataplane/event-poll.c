@@ -13,8 +13,14 @@
  */
 
 #include <sys/epoll.h>
+#include "trace.h"
+#include "qemu/timer.h"
 #include "hw/dataplane/event-poll.h"
 
+enum {
+    POLL_GROW_START_NS = 4000,      /* first spin budget after growing */
+};
+
 /* Add an event notifier and its callback for polling */
 void event_poll_add(EventPoll *poll, EventHandler *handler,
                     EventNotifier *notifier, EventCallback *callback)
@@ -40,6 +46,15 @@ static void handle_stop(EventHandler *handler)
 
 void event_poll_init(EventPoll *poll)
 {
+    poll->poll_fn = NULL;
+    poll->poll_opaque = NULL;
+    poll->poll_max_ns = 0;
+    poll->poll_ns = 0;
+    poll->polling_ns = 0;
+    poll->blocked_ns = 0;
+    poll->poll_hits = 0;
+    poll->poll_misses = 0;
+
     /* Create epoll file descriptor */
     poll->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
     if (poll->epoll_fd < 0) {
@@ -56,20 +71,89 @@ void event_poll_init(EventPoll *poll)
                    &poll->stop_notifier, handle_stop);
 }
 
+/* Install a busy-wait callback that event_poll() tries for up to @max_ns
+ * before blocking.  A @max_ns of zero disables polling.
+ */
+void event_poll_set_poll_handler(EventPoll *poll, EventPollFn *poll_fn,
+                                 void *opaque, int64_t max_ns)
+{
+    poll->poll_fn = poll_fn;
+    poll->poll_opaque = opaque;
+    poll->poll_max_ns = poll_fn ? max_ns : 0;
+    poll->poll_ns = 0;
+}
+
 void event_poll_cleanup(EventPoll *poll)
 {
+    trace_event_poll_stats(poll, poll->polling_ns, poll->blocked_ns,
+                           poll->poll_hits, poll->poll_misses);
     event_notifier_cleanup(&poll->stop_notifier);
     close(poll->epoll_fd);
     poll->epoll_fd = -1;
 }
 
+/* Spin on the busy-wait callback for the current budget */
+static bool run_poll_handler(EventPoll *poll, int64_t start)
+{
+    int64_t now;
+    bool progress;
+
+    do {
+        progress = poll->poll_fn(poll->poll_opaque);
+        now = get_clock();
+    } while (!progress && now - start < poll->poll_ns);
+
+    poll->polling_ns += now - start;
+    return progress;
+}
+
+/* Adjust the spin budget after blocking for @block_ns, including the time
+ * that was spent spinning before blocking
+ */
+static void adjust_poll_ns(EventPoll *poll, int64_t block_ns)
+{
+    int64_t old = poll->poll_ns;
+
+    if (block_ns <= poll->poll_ns) {
+        /* the event came in just after we stopped spinning */
+        return;
+    }
+
+    if (block_ns > poll->poll_max_ns) {
+        /* polling would not have helped, stop wasting CPU time */
+        poll->poll_ns = 0;
+    } else if (poll->poll_ns < poll->poll_max_ns) {
+        poll->poll_ns = poll->poll_ns ? poll->poll_ns * 2 : POLL_GROW_START_NS;
+        if (poll->poll_ns > poll->poll_max_ns) {
+            poll->poll_ns = poll->poll_max_ns;
+        }
+    }
+
+    if (poll->poll_ns != old) {
+        trace_event_poll_adjust(poll, old, poll->poll_ns);
+    }
+}
+
 /* Block until the next event and invoke its callback */
 void event_poll(EventPoll *poll)
 {
     EventHandler *handler;
     struct epoll_event event;
+    int64_t start = 0, blocked = 0;
     int nevents;
 
+    if (poll->poll_max_ns) {
+        start = get_clock();
+        if (poll->poll_ns && run_poll_handler(poll, start)) {
+            poll->poll_hits++;
+            return;
+        }
+        if (poll->poll_ns) {
+            poll->poll_misses++;
+        }
+        blocked = get_clock();
+    }
+
     /* Wait for the next event.  Only do one event per call to keep the
      * function simple, this could be changed later. */
     do {
@@ -80,6 +164,13 @@ void event_poll(EventPoll *poll)
         exit(1); /* should never happen */
     }
 
+    if (poll->poll_max_ns) {
+        int64_t now = get_clock();
+
+        poll->blocked_ns += now - blocked;
+        adjust_poll_ns(poll, now - start);
+    }
+
     /* Find out which event handler has become active */
     handler = event.data.ptr;
 
@@ -24,15 +24,35 @@ struct EventHandler {
     EventCallback *callback;        /* callback function */
 };
 
+/* Busy-wait callback, returns true if it found and handled work */
+typedef bool EventPollFn(void *opaque);
+
 typedef struct {
     int epoll_fd;                   /* epoll(2) file descriptor */
     EventNotifier stop_notifier;    /* stop poll notifier */
     EventHandler stop_handler;      /* stop poll handler */
+
+    /* Adaptive polling: spin for up to poll_ns before blocking in
+     * epoll_wait(), growing poll_ns when events arrive shortly after
+     * blocking and dropping it when they do not.
+     */
+    EventPollFn *poll_fn;           /* busy-wait callback, or NULL */
+    void *poll_opaque;
+    int64_t poll_max_ns;            /* upper bound of poll_ns, 0 disables */
+    int64_t poll_ns;                /* current spin budget */
+
+    /* Statistics */
+    int64_t polling_ns;             /* total time spent spinning */
+    int64_t blocked_ns;             /* total time spent in epoll_wait() */
+    uint64_t poll_hits;             /* events found by spinning */
+    uint64_t poll_misses;           /* spins that ended in epoll_wait() */
 } EventPoll;
 
 void event_poll_add(EventPoll *poll, EventHandler *handler,
                     EventNotifier *notifier, EventCallback *callback);
 void event_poll_init(EventPoll *poll);
+void event_poll_set_poll_handler(EventPoll *poll, EventPollFn *poll_fn,
+                                 void *opaque, int64_t max_ns);
 void event_poll_cleanup(EventPoll *poll);
 void event_poll(EventPoll *poll);
 void event_poll_notify(EventPoll *poll);
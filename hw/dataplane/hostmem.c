@@ -12,8 +12,13 @@
  */
 
 #include "exec/address-spaces.h"
+#include "qemu/atomic.h"
 #include "hostmem.h"
 
+/* Size limit of the flat lookup table, chunks get larger for bigger guests */
+#define HOSTMEM_FLAT_MAX_ENTRIES 4096
+#define HOSTMEM_FLAT_MIN_SHIFT   21
+
 static int hostmem_lookup_cmp(const void *phys_, const void *region_)
 {
     hwaddr phys = *(const hwaddr *)phys_;
@@ -28,34 +33,153 @@ static int hostmem_lookup_cmp(const void *phys_, const void *region_)
     }
 }
 
+static const HostMemRegion *hostmem_table_find(HostMemTable *table,
+                                               hwaddr phys)
+{
+    hwaddr chunk = phys >> table->flat_shift;
+
+    if (chunk < table->num_flat && table->flat[chunk]) {
+        return &table->regions[table->flat[chunk] - 1];
+    }
+    return bsearch(&phys, table->regions, table->num_regions,
+                   sizeof(table->regions[0]), hostmem_lookup_cmp);
+}
+
+/**
+ * Get the current table and make sure the listener does not free it
+ */
+static HostMemTable *hostmem_get_table(HostMem *hostmem)
+{
+    HostMemTable *table = hostmem->current;
+
+    /* Fast path: the listener never frees the table in in_use */
+    if (likely(table == hostmem->in_use)) {
+        return table;
+    }
+
+    do {
+        table = hostmem->current;
+        hostmem->in_use = table;
+        hostmem->last_region = NULL;
+        /* Write in_use before reading current, pairs with
+         * hostmem_listener_commit().
+         */
+        smp_mb();
+    } while (table != hostmem->current);
+    return table;
+}
+
 /**
  * Map guest physical address to host pointer
  */
 void *hostmem_lookup(HostMem *hostmem, hwaddr phys, hwaddr len, bool is_write)
 {
-    HostMemRegion *region;
-    void *host_addr = NULL;
+    HostMemTable *table = hostmem_get_table(hostmem);
+    const HostMemRegion *region;
     hwaddr offset_within_region;
 
-    qemu_mutex_lock(&hostmem->current_regions_lock);
-    region = bsearch(&phys, hostmem->current_regions,
-                     hostmem->num_current_regions,
-                     sizeof(hostmem->current_regions[0]),
-                     hostmem_lookup_cmp);
-    if (!region) {
-        goto out;
+    if (!table) {
+        return NULL;
+    }
+
+    region = hostmem->last_region;
+    if (!region || phys - region->guest_addr >= region->size) {
+        region = hostmem_table_find(table, phys);
+        if (!region) {
+            return NULL;
+        }
+        hostmem->last_region = region;
     }
     if (is_write && region->readonly) {
-        goto out;
+        return NULL;
     }
     offset_within_region = phys - region->guest_addr;
-    if (len <= region->size - offset_within_region) {
-        host_addr = region->host_addr + offset_within_region;
+    if (len > region->size - offset_within_region) {
+        return NULL;
+    }
+    return region->host_addr + offset_within_region;
+}
+
+static HostMemTable *hostmem_table_new(HostMemRegion *regions, size_t num)
+{
+    HostMemTable *table = g_new0(HostMemTable, 1);
+    hwaddr end;
+    size_t i;
+
+    table->regions = regions;
+    table->num_regions = num;
+    table->flat_shift = HOSTMEM_FLAT_MIN_SHIFT;
+
+    if (num == 0 || num >= UINT16_MAX) {
+        return table;
+    }
+
+    end = regions[num - 1].guest_addr + regions[num - 1].size;
+    while ((end >> table->flat_shift) >= HOSTMEM_FLAT_MAX_ENTRIES) {
+        table->flat_shift++;
+    }
+    table->num_flat = (end >> table->flat_shift) + 1;
+    table->flat = g_new0(uint16_t, table->num_flat);
+
+    /* Only chunks that lie entirely within one region get an entry */
+    for (i = 0; i < num; i++) {
+        hwaddr chunk_size = (hwaddr)1 << table->flat_shift;
+        hwaddr first = DIV_ROUND_UP(regions[i].guest_addr, chunk_size);
+        hwaddr last = (regions[i].guest_addr + regions[i].size) >>
+                      table->flat_shift;
+        hwaddr c;
+
+        for (c = first; c < last; c++) {
+            table->flat[c] = i + 1;
+        }
     }
-out:
-    qemu_mutex_unlock(&hostmem->current_regions_lock);
+    return table;
+}
+
+static void hostmem_table_free(HostMemTable *table)
+{
+    g_free(table->flat);
+    g_free(table->regions);
+    g_free(table);
+}
+
+static bool hostmem_regions_equal(HostMemTable *table,
+                                  HostMemRegion *regions, size_t num)
+{
+    size_t i;
+
+    if (!table || table->num_regions != num) {
+        return false;
+    }
+    for (i = 0; i < num; i++) {
+        const HostMemRegion *a = &table->regions[i];
+        const HostMemRegion *b = &regions[i];
 
-    return host_addr;
+        if (a->host_addr != b->host_addr || a->guest_addr != b->guest_addr ||
+            a->size != b->size || a->readonly != b->readonly) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Free retired tables that the reader no longer uses
+ */
+static void hostmem_free_retired(HostMem *hostmem, bool all)
+{
+    HostMemTable **p = &hostmem->retired;
+
+    while (*p) {
+        HostMemTable *table = *p;
+
+        if (!all && table == hostmem->in_use) {
+            p = &table->next_retired;
+            continue;
+        }
+        *p = table->next_retired;
+        hostmem_table_free(table);
+    }
 }
 
 /**
@@ -64,16 +188,31 @@ out:
 static void hostmem_listener_commit(MemoryListener *listener)
 {
     HostMem *hostmem = container_of(listener, HostMem, listener);
-
-    qemu_mutex_lock(&hostmem->current_regions_lock);
-    g_free(hostmem->current_regions);
-    hostmem->current_regions = hostmem->new_regions;
-    hostmem->num_current_regions = hostmem->num_new_regions;
-    qemu_mutex_unlock(&hostmem->current_regions_lock);
+    HostMemRegion *regions = hostmem->new_regions;
+    size_t num = hostmem->num_new_regions;
+    HostMemTable *old = hostmem->current;
 
     /* Reset new regions list */
     hostmem->new_regions = NULL;
     hostmem->num_new_regions = 0;
+
+    /* Most commits do not touch RAM, keep the table and the readers' caches */
+    if (hostmem_regions_equal(old, regions, num)) {
+        g_free(regions);
+        return;
+    }
+
+    /* Initialize the table before publishing it */
+    smp_wmb();
+    hostmem->current = hostmem_table_new(regions, num);
+    if (old) {
+        old->next_retired = hostmem->retired;
+        hostmem->retired = old;
+    }
+
+    /* Write current before reading in_use, pairs with hostmem_get_table() */
+    smp_mb();
+    hostmem_free_retired(hostmem, false);
 }
 
 /**
@@ -141,8 +280,6 @@ void hostmem_init(HostMem *hostmem)
 {
     memset(hostmem, 0, sizeof(*hostmem));
 
-    qemu_mutex_init(&hostmem->current_regions_lock);
-
     hostmem->listener = (MemoryListener){
         .begin = hostmem_listener_dummy,
         .commit = hostmem_listener_commit,
@@ -171,6 +308,8 @@ void hostmem_finalize(HostMem *hostmem)
 {
     memory_listener_unregister(&hostmem->listener);
     g_free(hostmem->new_regions);
-    g_free(hostmem->current_regions);
-    qemu_mutex_destroy(&hostmem->current_regions_lock);
+    hostmem_free_retired(hostmem, true);
+    if (hostmem->current) {
+        hostmem_table_free(hostmem->current);
+    }
 }
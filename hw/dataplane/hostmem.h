@@ -24,6 +24,23 @@ typedef struct {
     bool readonly;
 } HostMemRegion;
 
+/* An immutable snapshot of the regions, replaced as a whole on changes */
+typedef struct HostMemTable HostMemTable;
+struct HostMemTable {
+    HostMemRegion *regions;
+    size_t num_regions;
+
+    /* Flat lookup table for address chunks of (1 << flat_shift) bytes that
+     * are covered by a single region.  Entries hold the region index plus
+     * one, or zero when the regions must be searched.
+     */
+    uint16_t *flat;
+    size_t num_flat;
+    unsigned int flat_shift;
+
+    HostMemTable *next_retired;
+};
+
 typedef struct {
     /* The listener is invoked when regions change and a new list of regions is
      * built up completely before they are installed.
@@ -32,13 +49,18 @@ typedef struct {
     HostMemRegion *new_regions;
     size_t num_new_regions;
 
-    /* Current regions are accessed from multiple threads either to lookup
-     * addresses or to install a new list of regions.  The lock protects the
-     * pointer and the regions.
+    /* The listener publishes new tables with memory barriers, so lookups do
+     * not take a lock.  A replaced table is only freed once the reader has
+     * moved to a newer one.
      */
-    QemuMutex current_regions_lock;
-    HostMemRegion *current_regions;
-    size_t num_current_regions;
+    HostMemTable *current;
+    HostMemTable *retired;
+
+    /* Written only by the thread doing lookups.  in_use is the table that the
+     * reader may still be looking at, last_region the last region it hit.
+     */
+    HostMemTable *in_use;
+    const HostMemRegion *last_region;
 } HostMem;
 
 void hostmem_init(HostMem *hostmem);
@@ -47,6 +69,9 @@ void hostmem_finalize(HostMem *hostmem);
 /**
  * Map a guest physical address to a pointer
  *
+ * Lookups do not take locks, but only one thread at a time may do lookups on
+ * a given HostMem.
+ *
  * Note that there is map/unmap mechanism here.  The caller must ensure that
  * mapped memory is no longer used across events like hot memory unplug.  This
  * can be done with other mechanisms like bdrv_drain_all() that quiesce
@@ -12,6 +12,7 @@
  *
  */
 
+#include "trace.h"
 #include "hw/dataplane/ioq.h"
 
 void ioq_init(IOQueue *ioq, int fd, unsigned int max_reqs)
@@ -39,10 +40,18 @@ void ioq_init(IOQueue *ioq, int fd, unsigned int max_reqs)
 
     ioq->queue = g_malloc0(sizeof ioq->queue[0] * max_reqs);
     ioq->queue_idx = 0;
+
+    ioq->submit_calls = 0;
+    ioq->submitted = 0;
+    ioq->completion_calls = 0;
+    ioq->completed = 0;
 }
 
 void ioq_cleanup(IOQueue *ioq)
 {
+    trace_ioq_stats(ioq, ioq->submit_calls, ioq->submitted,
+                    ioq->completion_calls, ioq->completed);
+
     g_free(ioq->freelist);
     g_free(ioq->queue);
 
@@ -73,24 +82,35 @@ void ioq_put_iocb(IOQueue *ioq, struct iocb *iocb)
     ioq->freelist[ioq->freelist_idx++] = iocb;
 }
 
-struct iocb *ioq_rdwr(IOQueue *ioq, bool read, struct iovec *iov,
-                      unsigned int count, long long offset)
+/* Queue a request on @fd, for queues shared by several files */
+struct iocb *ioq_rdwr_fd(IOQueue *ioq, int fd, bool read, struct iovec *iov,
+                         unsigned int count, long long offset)
 {
     struct iocb *iocb = ioq_get_iocb(ioq);
 
     if (read) {
-        io_prep_preadv(iocb, ioq->fd, iov, count, offset);
+        io_prep_preadv(iocb, fd, iov, count, offset);
     } else {
-        io_prep_pwritev(iocb, ioq->fd, iov, count, offset);
+        io_prep_pwritev(iocb, fd, iov, count, offset);
     }
     io_set_eventfd(iocb, event_notifier_get_fd(&ioq->io_notifier));
     return iocb;
 }
 
+struct iocb *ioq_rdwr(IOQueue *ioq, bool read, struct iovec *iov,
+                      unsigned int count, long long offset)
+{
+    return ioq_rdwr_fd(ioq, ioq->fd, read, iov, count, offset);
+}
+
 int ioq_submit(IOQueue *ioq)
 {
     int rc = io_submit(ioq->io_ctx, ioq->queue_idx, ioq->queue);
     ioq->queue_idx = 0; /* reset */
+    if (rc > 0) {
+        ioq->submit_calls++;
+        ioq->submitted += rc;
+    }
     return rc;
 }
 
@@ -103,9 +123,11 @@ int ioq_run_completion(IOQueue *ioq, IOQueueCompletion *completion,
     do {
         nevents = io_getevents(ioq->io_ctx, 0, ioq->max_reqs, events, NULL);
     } while (nevents < 0 && errno == EINTR);
-    if (nevents < 0) {
+    if (nevents <= 0) {
         return nevents;
     }
+    ioq->completion_calls++;
+    ioq->completed += nevents;
 
     for (i = 0; i < nevents; i++) {
         ssize_t ret = ((uint64_t)events[i].res2 << 32) | events[i].res;
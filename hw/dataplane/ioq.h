@@ -34,6 +34,13 @@ typedef struct {
     /* Multiple requests are queued up before submitting them all in one go */
     struct iocb **queue;            /* queued iocbs */
     unsigned int queue_idx;
+
+    /* Statistics, the average batch sizes are submitted / submit_calls and
+     * completed / completion_calls */
+    uint64_t submit_calls;          /* successful io_submit() calls */
+    uint64_t submitted;             /* iocbs accepted by io_submit() */
+    uint64_t completion_calls;      /* io_getevents() calls that reaped */
+    uint64_t completed;             /* iocbs reaped by io_getevents() */
 } IOQueue;
 
 void ioq_init(IOQueue *ioq, int fd, unsigned int max_reqs);
@@ -43,6 +50,8 @@ struct iocb *ioq_get_iocb(IOQueue *ioq);
 void ioq_put_iocb(IOQueue *ioq, struct iocb *iocb);
 struct iocb *ioq_rdwr(IOQueue *ioq, bool read, struct iovec *iov,
                       unsigned int count, long long offset);
+struct iocb *ioq_rdwr_fd(IOQueue *ioq, int fd, bool read, struct iovec *iov,
+                         unsigned int count, long long offset);
 int ioq_submit(IOQueue *ioq);
 
 static inline unsigned int ioq_num_queued(IOQueue *ioq)
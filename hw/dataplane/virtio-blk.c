@@ -12,15 +12,19 @@
  *
  */
 
+#include <sched.h>
 #include "trace.h"
 #include "qemu/iov.h"
 #include "event-poll.h"
 #include "qemu/thread.h"
+#include "block/aio.h"
 #include "vring.h"
 #include "ioq.h"
 #include "migration/migration.h"
 #include "hw/virtio-blk.h"
 #include "hw/dataplane/virtio-blk.h"
+#include "sysemu/cpus.h"
+#include "sysemu/ram-reclaim.h"
 
 enum {
     SEG_MAX = 126,                  /* maximum number of I/O segments */
@@ -38,46 +42,106 @@ typedef struct {
     QEMUIOVector *read_qiov;        /* for read completion /w bounce buffer */
 } VirtIOBlockRequest;
 
-struct VirtIOBlockDataPlane {
-    bool started;
+/* A request submitted through the block layer, when the image does not
+ * support Linux AIO directly
+ */
+typedef struct {
+    struct VirtIOBlockDataPlaneQueue *q;
+    QEMUIOVector qiov;              /* guest buffers, copied from the vring */
+    QEMUIOVector *inhdr;            /* iovecs for virtio_blk_inhdr */
+    unsigned int head;              /* vring descriptor index */
+} VirtIOBlockBdrvRequest;
+
+/* Each virtqueue is served by its own thread, with its own vring, Linux AIO
+ * context and irqfd, so that queues never share state on the fast path.
+ */
+typedef struct VirtIOBlockDataPlaneQueue {
+    VirtIOBlockDataPlane *dataplane;
+    unsigned int index;             /* virtqueue number */
+    int cpu;                        /* host CPU affinity, or -1 */
+
     bool stopping;
     QEMUBH *start_bh;
     QemuThread thread;
 
-    VirtIOBlkConf *blk;
-    int fd;                         /* image file descriptor */
-
-    VirtIODevice *vdev;
     Vring vring;                    /* virtqueue vring */
     EventNotifier *guest_notifier;  /* irq */
+    EventNotifier *host_notifier;   /* virtqueue kick */
+    QEMUBH *completion_bh;          /* block layer mode only */
 
     EventPoll event_poll;           /* event poller */
     EventHandler io_handler;        /* Linux AIO completion handler */
     EventHandler notify_handler;    /* virtqueue notify handler */
 
-    IOQueue ioqueue;                /* Linux AIO queue (should really be per
-                                       dataplane thread) */
+    IOQueue ioqueue;                /* Linux AIO queue */
     VirtIOBlockRequest requests[REQ_MAX]; /* pool of requests, managed by the
                                              queue */
 
     unsigned int num_reqs;
+    unsigned int num_completed;     /* used ring entries not yet flushed */
+} VirtIOBlockDataPlaneQueue;
+
+struct VirtIOBlockDataPlane {
+    bool started;
+    bool stopping;
+
+    VirtIOBlkConf *blk;
+    int fd;                         /* image file descriptor */
+
+    /* When the image cannot be driven with Linux AIO, I/O goes through the
+     * block layer instead and the BlockDriverState is moved to this
+     * AioContext for as long as the thread runs.  NULL in Linux AIO mode.
+     */
+    AioContext *ctx;
+
+    VirtIODevice *vdev;
+    unsigned int num_queues;
+    VirtIOBlockDataPlaneQueue *queues;
 
     Error *migration_blocker;
 };
 
 /* Raise an interrupt to signal guest, if necessary */
-static void notify_guest(VirtIOBlockDataPlane *s)
+static void notify_guest(VirtIOBlockDataPlaneQueue *q)
 {
-    if (!vring_should_notify(s->vdev, &s->vring)) {
+    if (!vring_should_notify(q->dataplane->vdev, &q->vring)) {
         return;
     }
 
-    event_notifier_set(s->guest_notifier);
+    event_notifier_set(q->guest_notifier);
+}
+
+/* Publish the completions of this batch and interrupt the guest once */
+static void flush_completions(VirtIOBlockDataPlaneQueue *q)
+{
+    if (q->num_completed == 0) {
+        return;
+    }
+
+    vring_flush(&q->vring, q->num_completed);
+    q->num_completed = 0;
+    notify_guest(q);
+}
+
+/* Hand the queued requests to the kernel */
+static void submit_requests(VirtIOBlockDataPlaneQueue *q)
+{
+    int rc;
+
+    if (ioq_num_queued(&q->ioqueue) == 0) {
+        return;
+    }
+
+    rc = ioq_submit(&q->ioqueue);
+    if (unlikely(rc < 0)) {
+        fprintf(stderr, "ioq_submit failed %d\n", rc);
+        exit(1);
+    }
 }
 
 static void complete_request(struct iocb *iocb, ssize_t ret, void *opaque)
 {
-    VirtIOBlockDataPlane *s = opaque;
+    VirtIOBlockDataPlaneQueue *q = opaque;
     VirtIOBlockRequest *req = container_of(iocb, VirtIOBlockRequest, iocb);
     struct virtio_blk_inhdr hdr;
     int len;
@@ -90,7 +154,7 @@ static void complete_request(struct iocb *iocb, ssize_t ret, void *opaque)
         len = 0;
     }
 
-    trace_virtio_blk_data_plane_complete_request(s, req->head, ret);
+    trace_virtio_blk_data_plane_complete_request(q, req->head, ret);
 
     if (req->read_qiov) {
         assert(req->bounce_iov);
@@ -112,13 +176,14 @@ static void complete_request(struct iocb *iocb, ssize_t ret, void *opaque)
      * written to, but for virtio-blk it seems to be the number of bytes
      * transferred plus the status bytes.
      */
-    vring_push(&s->vring, req->head, len + sizeof(hdr));
+    vring_fill(&q->vring, req->head, len + sizeof(hdr), q->num_completed++);
 
-    s->num_reqs--;
+    q->num_reqs--;
 }
 
-static void complete_request_early(VirtIOBlockDataPlane *s, unsigned int head,
-                                   QEMUIOVector *inhdr, unsigned char status)
+static void complete_request_early(VirtIOBlockDataPlaneQueue *q,
+                                   unsigned int head, QEMUIOVector *inhdr,
+                                   unsigned char status)
 {
     struct virtio_blk_inhdr hdr = {
         .status = status,
@@ -128,33 +193,108 @@ static void complete_request_early(VirtIOBlockDataPlane *s, unsigned int head,
     qemu_iovec_destroy(inhdr);
     g_slice_free(QEMUIOVector, inhdr);
 
-    vring_push(&s->vring, head, sizeof(hdr));
-    notify_guest(s);
+    vring_fill(&q->vring, head, sizeof(hdr), q->num_completed++);
 }
 
 /* Get disk serial number */
-static void do_get_id_cmd(VirtIOBlockDataPlane *s,
+static void do_get_id_cmd(VirtIOBlockDataPlaneQueue *q,
                           struct iovec *iov, unsigned int iov_cnt,
                           unsigned int head, QEMUIOVector *inhdr)
 {
+    VirtIOBlockDataPlane *s = q->dataplane;
     char id[VIRTIO_BLK_ID_BYTES];
 
     /* Serial number not NUL-terminated when shorter than buffer */
     strncpy(id, s->blk->serial ? s->blk->serial : "", sizeof(id));
     iov_from_buf(iov, iov_cnt, 0, id, sizeof(id));
-    complete_request_early(s, head, inhdr, VIRTIO_BLK_S_OK);
+    complete_request_early(q, head, inhdr, VIRTIO_BLK_S_OK);
+}
+
+static void complete_bdrv_request(void *opaque, int ret)
+{
+    VirtIOBlockBdrvRequest *req = opaque;
+    VirtIOBlockDataPlaneQueue *q = req->q;
+    struct virtio_blk_inhdr hdr;
+    int len;
+
+    if (likely(ret == 0)) {
+        hdr.status = VIRTIO_BLK_S_OK;
+        len = req->qiov.size;
+    } else {
+        hdr.status = VIRTIO_BLK_S_IOERR;
+        len = 0;
+    }
+
+    trace_virtio_blk_data_plane_complete_request(q, req->head, ret);
+
+    qemu_iovec_from_buf(req->inhdr, 0, &hdr, sizeof(hdr));
+    qemu_iovec_destroy(req->inhdr);
+    g_slice_free(QEMUIOVector, req->inhdr);
+
+    vring_fill(&q->vring, req->head, len + sizeof(hdr), q->num_completed++);
+
+    qemu_iovec_destroy(&req->qiov);
+    g_slice_free(VirtIOBlockBdrvRequest, req);
+    q->num_reqs--;
+
+    /* Completions of the same aio_poll() round are flushed together */
+    qemu_bh_schedule(q->completion_bh);
+}
+
+/* Submit a read, write or flush through the block layer */
+static void do_bdrv_cmd(VirtIOBlockDataPlaneQueue *q, uint32_t type,
+                        struct iovec *iov, unsigned int iov_cnt,
+                        long long offset, unsigned int head,
+                        QEMUIOVector *inhdr)
+{
+    BlockDriverState *bs = q->dataplane->blk->conf.bs;
+    VirtIOBlockBdrvRequest *req = g_slice_new(VirtIOBlockBdrvRequest);
+    int64_t sector_num = offset >> BDRV_SECTOR_BITS;
+    int nb_sectors;
+
+    req->q = q;
+    req->head = head;
+    req->inhdr = inhdr;
+    qemu_iovec_init(&req->qiov, iov_cnt);
+    qemu_iovec_concat_iov(&req->qiov, iov, iov_cnt, 0,
+                          iov_size(iov, iov_cnt));
+    nb_sectors = req->qiov.size >> BDRV_SECTOR_BITS;
+    q->num_reqs++;
+
+    switch (type) {
+    case VIRTIO_BLK_T_IN:
+        bdrv_aio_readv(bs, sector_num, &req->qiov, nb_sectors,
+                       complete_bdrv_request, req);
+        break;
+    case VIRTIO_BLK_T_OUT:
+        bdrv_aio_writev(bs, sector_num, &req->qiov, nb_sectors,
+                        complete_bdrv_request, req);
+        break;
+    case VIRTIO_BLK_T_FLUSH:
+        bdrv_aio_flush(bs, complete_bdrv_request, req);
+        break;
+    default:
+        abort();
+    }
 }
 
-static int do_rdwr_cmd(VirtIOBlockDataPlane *s, bool read,
+static int do_rdwr_cmd(VirtIOBlockDataPlaneQueue *q, bool read,
                        struct iovec *iov, unsigned int iov_cnt,
                        long long offset, unsigned int head,
                        QEMUIOVector *inhdr)
 {
+    VirtIOBlockDataPlane *s = q->dataplane;
     struct iocb *iocb;
     QEMUIOVector qiov;
     struct iovec *bounce_iov = NULL;
     QEMUIOVector *read_qiov = NULL;
 
+    if (s->ctx) {
+        do_bdrv_cmd(q, read ? VIRTIO_BLK_T_IN : VIRTIO_BLK_T_OUT,
+                    iov, iov_cnt, offset, head, inhdr);
+        return 0;
+    }
+
     qemu_iovec_init_external(&qiov, iov, iov_cnt);
     if (!bdrv_qiov_is_aligned(s->blk->conf.bs, &qiov)) {
         void *bounce_buffer = qemu_blockalign(s->blk->conf.bs, qiov.size);
@@ -176,7 +316,8 @@ static int do_rdwr_cmd(VirtIOBlockDataPlane *s, bool read,
         iov_cnt = 1;
     }
 
-    iocb = ioq_rdwr(&s->ioqueue, read, iov, iov_cnt, offset);
+    iocb = ioq_rdwr(&q->ioqueue, read, iov, iov_cnt, offset);
+    q->num_reqs++;
 
     /* Fill in virtio block metadata needed for completion */
     VirtIOBlockRequest *req = container_of(iocb, VirtIOBlockRequest, iocb);
@@ -191,7 +332,9 @@ static int process_request(IOQueue *ioq, struct iovec iov[],
                            unsigned int out_num, unsigned int in_num,
                            unsigned int head)
 {
-    VirtIOBlockDataPlane *s = container_of(ioq, VirtIOBlockDataPlane, ioqueue);
+    VirtIOBlockDataPlaneQueue *q = container_of(ioq, VirtIOBlockDataPlaneQueue,
+                                                ioqueue);
+    VirtIOBlockDataPlane *s = q->dataplane;
     struct iovec *in_iov = &iov[out_num];
     struct virtio_blk_outhdr outhdr;
     QEMUIOVector *inhdr;
@@ -223,29 +366,34 @@ static int process_request(IOQueue *ioq, struct iovec iov[],
 
     switch (outhdr.type) {
     case VIRTIO_BLK_T_IN:
-        do_rdwr_cmd(s, true, in_iov, in_num, outhdr.sector * 512, head, inhdr);
+        do_rdwr_cmd(q, true, in_iov, in_num, outhdr.sector * 512, head, inhdr);
         return 0;
 
     case VIRTIO_BLK_T_OUT:
-        do_rdwr_cmd(s, false, iov, out_num, outhdr.sector * 512, head, inhdr);
+        do_rdwr_cmd(q, false, iov, out_num, outhdr.sector * 512, head, inhdr);
         return 0;
 
     case VIRTIO_BLK_T_SCSI_CMD:
         /* TODO support SCSI commands */
-        complete_request_early(s, head, inhdr, VIRTIO_BLK_S_UNSUPP);
+        complete_request_early(q, head, inhdr, VIRTIO_BLK_S_UNSUPP);
         return 0;
 
     case VIRTIO_BLK_T_FLUSH:
+        if (s->ctx) {
+            do_bdrv_cmd(q, VIRTIO_BLK_T_FLUSH, NULL, 0, 0, head, inhdr);
+            return 0;
+        }
+
         /* TODO fdsync not supported by Linux AIO, do it synchronously here! */
         if (qemu_fdatasync(s->fd) < 0) {
-            complete_request_early(s, head, inhdr, VIRTIO_BLK_S_IOERR);
+            complete_request_early(q, head, inhdr, VIRTIO_BLK_S_IOERR);
         } else {
-            complete_request_early(s, head, inhdr, VIRTIO_BLK_S_OK);
+            complete_request_early(q, head, inhdr, VIRTIO_BLK_S_OK);
         }
         return 0;
 
     case VIRTIO_BLK_T_GET_ID:
-        do_get_id_cmd(s, in_iov, in_num, head, inhdr);
+        do_get_id_cmd(q, in_iov, in_num, head, inhdr);
         return 0;
 
     default:
@@ -256,10 +404,9 @@ static int process_request(IOQueue *ioq, struct iovec iov[],
     }
 }
 
-static void handle_notify(EventHandler *handler)
+static void process_vring(VirtIOBlockDataPlaneQueue *q)
 {
-    VirtIOBlockDataPlane *s = container_of(handler, VirtIOBlockDataPlane,
-                                           notify_handler);
+    VirtIODevice *vdev = q->dataplane->vdev;
 
     /* There is one array of iovecs into which all new requests are extracted
      * from the vring.  Requests are read from the vring and the translated
@@ -284,23 +431,29 @@ static void handle_notify(EventHandler *handler)
      */
     int head;
     unsigned int out_num = 0, in_num = 0;
-    unsigned int num_queued;
+
+    /* In block layer mode, everything popped below reaches the host in as
+     * few submissions as the image format allows
+     */
+    if (q->dataplane->ctx) {
+        bdrv_io_plug(q->dataplane->blk->conf.bs);
+    }
 
     for (;;) {
         /* Disable guest->host notifies to avoid unnecessary vmexits */
-        vring_disable_notification(s->vdev, &s->vring);
+        vring_disable_notification(vdev, &q->vring);
 
         for (;;) {
-            head = vring_pop(s->vdev, &s->vring, iov, end, &out_num, &in_num);
+            head = vring_pop(vdev, &q->vring, iov, end, &out_num, &in_num);
             if (head < 0) {
                 break; /* no more requests */
             }
 
-            trace_virtio_blk_data_plane_process_request(s, out_num, in_num,
+            trace_virtio_blk_data_plane_process_request(q, out_num, in_num,
                                                         head);
 
-            if (process_request(&s->ioqueue, iov, out_num, in_num, head) < 0) {
-                vring_set_broken(&s->vring);
+            if (process_request(&q->ioqueue, iov, out_num, in_num, head) < 0) {
+                vring_set_broken(&q->vring);
                 break;
             }
             iov += out_num + in_num;
@@ -310,7 +463,7 @@ static void handle_notify(EventHandler *handler)
             /* Re-enable guest->host notifies and stop processing the vring.
              * But if the guest has snuck in more descriptors, keep processing.
              */
-            if (vring_enable_notification(s->vdev, &s->vring)) {
+            if (vring_enable_notification(vdev, &q->vring)) {
                 break;
             }
         } else { /* head == -ENOBUFS or fatal error, iovecs[] is depleted */
@@ -322,60 +475,180 @@ static void handle_notify(EventHandler *handler)
         }
     }
 
-    num_queued = ioq_num_queued(&s->ioqueue);
-    if (num_queued > 0) {
-        s->num_reqs += num_queued;
+    /* One io_submit() for everything popped in all rounds above, and one
+     * interrupt for the requests that completed without I/O */
+    if (!q->dataplane->ctx) {
+        submit_requests(q);
+    } else {
+        bdrv_io_unplug(q->dataplane->blk->conf.bs);
+    }
+    flush_completions(q);
+}
 
-        int rc = ioq_submit(&s->ioqueue);
-        if (unlikely(rc < 0)) {
-            fprintf(stderr, "ioq_submit failed %d\n", rc);
-            exit(1);
-        }
+static void handle_notify(EventHandler *handler)
+{
+    VirtIOBlockDataPlaneQueue *q = container_of(handler,
+                                                VirtIOBlockDataPlaneQueue,
+                                                notify_handler);
+
+    process_vring(q);
+}
+
+/* Block layer mode: virtqueue kick */
+static void handle_notify_bdrv(void *opaque)
+{
+    VirtIOBlockDataPlaneQueue *q = opaque;
+
+    event_notifier_test_and_clear(q->host_notifier);
+    process_vring(q);
+}
+
+/* Keep aio_poll() blocking for kicks even when no I/O is in flight */
+static int flush_notify_bdrv(void *opaque)
+{
+    return 1;
+}
+
+/* Block layer mode: publish the completions of the last aio_poll() round */
+static void completion_bh(void *opaque)
+{
+    VirtIOBlockDataPlaneQueue *q = opaque;
+
+    flush_completions(q);
+
+    /* See handle_io() */
+    if (unlikely(vring_more_avail(&q->vring))) {
+        process_vring(q);
     }
 }
 
 static void handle_io(EventHandler *handler)
 {
-    VirtIOBlockDataPlane *s = container_of(handler, VirtIOBlockDataPlane,
-                                           io_handler);
+    VirtIOBlockDataPlaneQueue *q = container_of(handler,
+                                                VirtIOBlockDataPlaneQueue,
+                                                io_handler);
 
-    if (ioq_run_completion(&s->ioqueue, complete_request, s) > 0) {
-        notify_guest(s);
-    }
+    ioq_run_completion(&q->ioqueue, complete_request, q);
+    flush_completions(q);
 
     /* If there were more requests than iovecs, the vring will not be empty yet
      * so check again.  There should now be enough resources to process more
      * requests.
      */
-    if (unlikely(vring_more_avail(&s->vring))) {
-        handle_notify(&s->notify_handler);
+    if (unlikely(vring_more_avail(&q->vring))) {
+        process_vring(q);
+    }
+}
+
+/* Busy-wait for new requests and for completions without going through the
+ * eventfds, which saves a wakeup at low queue depth
+ */
+static bool poll_queue(void *opaque)
+{
+    VirtIOBlockDataPlaneQueue *q = opaque;
+    bool progress = false;
+
+    if (q->num_reqs > 0 &&
+        ioq_run_completion(&q->ioqueue, complete_request, q) > 0) {
+        event_notifier_test_and_clear(ioq_get_notifier(&q->ioqueue));
+        flush_completions(q);
+        progress = true;
+    }
+
+    if (vring_more_avail(&q->vring)) {
+        VirtQueue *vq = virtio_get_queue(q->dataplane->vdev, q->index);
+
+        event_notifier_test_and_clear(virtio_queue_get_host_notifier(vq));
+        process_vring(q);
+        progress = true;
     }
+    return progress;
 }
 
 static void *data_plane_thread(void *opaque)
 {
-    VirtIOBlockDataPlane *s = opaque;
+    VirtIOBlockDataPlaneQueue *q = opaque;
+    int thread_id = qemu_get_thread_id();
+    char *name;
+
+    name = g_strdup_printf("virtio-blk/%s/queue%u",
+                           bdrv_get_device_name(q->dataplane->blk->conf.bs),
+                           q->index);
+    qemu_register_thread(name, thread_id);
+    g_free(name);
+
+    if (q->cpu >= 0) {
+        cpu_set_t cpus;
+
+        CPU_ZERO(&cpus);
+        CPU_SET(q->cpu, &cpus);
+        if (sched_setaffinity(0, sizeof(cpus), &cpus) < 0) {
+            error_report("virtio-blk queue %u failed to bind to host CPU %d",
+                         q->index, q->cpu);
+        }
+    }
+
+    if (q->dataplane->ctx) {
+        do {
+            aio_poll(q->dataplane->ctx, true);
+        } while (!q->stopping || q->num_reqs > 0);
+    } else {
+        do {
+            event_poll(&q->event_poll);
+        } while (!q->stopping || q->num_reqs > 0);
+    }
 
-    do {
-        event_poll(&s->event_poll);
-    } while (!s->stopping || s->num_reqs > 0);
+    qemu_unregister_thread(thread_id);
     return NULL;
 }
 
 static void start_data_plane_bh(void *opaque)
 {
-    VirtIOBlockDataPlane *s = opaque;
+    VirtIOBlockDataPlaneQueue *q = opaque;
+
+    qemu_bh_delete(q->start_bh);
+    q->start_bh = NULL;
+    qemu_thread_create(&q->thread, data_plane_thread,
+                       q, QEMU_THREAD_JOINABLE);
+}
+
+/* Parse a comma-separated list of host CPUs.  Queue n runs on the n-th CPU
+ * of the list, wrapping around if there are more queues than CPUs, so that
+ * completions can be delivered near the vCPU that the guest associates with
+ * the queue's interrupt vector.
+ */
+static bool set_queue_cpus(VirtIOBlockDataPlane *s, const char *str)
+{
+    int cpus[VIRTIO_PCI_QUEUE_MAX];
+    unsigned int num_cpus = 0;
+    unsigned int i;
+    const char *p = str;
+    char *end;
+    long cpu;
+
+    while (*p) {
+        if (num_cpus == ARRAY_SIZE(cpus) || !qemu_isdigit(*p)) {
+            return false;
+        }
+        cpu = strtol(p, &end, 10);
+        if (cpu >= CPU_SETSIZE || (*end && *end != ',')) {
+            return false;
+        }
+        cpus[num_cpus++] = cpu;
+        p = *end ? end + 1 : end;
+    }
 
-    qemu_bh_delete(s->start_bh);
-    s->start_bh = NULL;
-    qemu_thread_create(&s->thread, data_plane_thread,
-                       s, QEMU_THREAD_JOINABLE);
+    for (i = 0; i < s->num_queues; i++) {
+        s->queues[i].cpu = num_cpus ? cpus[i % num_cpus] : -1;
+    }
+    return true;
 }
 
 bool virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *blk,
                                   VirtIOBlockDataPlane **dataplane)
 {
     VirtIOBlockDataPlane *s;
+    unsigned int i;
     int fd;
 
     *dataplane = NULL;
@@ -395,17 +668,48 @@ bool virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *blk,
         return false;
     }
 
+    /* Images that Linux AIO can drive directly take the fast path, anything
+     * else goes through the block layer in the data plane thread.
+     */
     fd = raw_get_aio_fd(blk->conf.bs);
     if (fd < 0) {
-        error_report("drive is incompatible with x-data-plane, "
-                     "use format=raw,cache=none,aio=native");
-        return false;
+        if (!bdrv_can_set_aio_context(blk->conf.bs)) {
+            error_report("drive is incompatible with x-data-plane, "
+                         "disable I/O throttling or use a local image");
+            return false;
+        }
+        if (blk->num_queues > 1) {
+            error_report("x-data-plane with num-queues > 1 needs "
+                         "format=raw,cache=none,aio=native");
+            return false;
+        }
     }
 
     s = g_new0(VirtIOBlockDataPlane, 1);
     s->vdev = vdev;
     s->fd = fd;
     s->blk = blk;
+    if (fd < 0) {
+        s->ctx = aio_context_new();
+    }
+    s->num_queues = blk->num_queues;
+    s->queues = g_new0(VirtIOBlockDataPlaneQueue, s->num_queues);
+    for (i = 0; i < s->num_queues; i++) {
+        s->queues[i].dataplane = s;
+        s->queues[i].index = i;
+        s->queues[i].cpu = -1;
+    }
+
+    if (blk->data_plane_cpus && !set_queue_cpus(s, blk->data_plane_cpus)) {
+        error_report("invalid host CPU list '%s' for x-data-plane-cpus",
+                     blk->data_plane_cpus);
+        if (s->ctx) {
+            aio_context_unref(s->ctx);
+        }
+        g_free(s->queues);
+        g_free(s);
+        return false;
+    }
 
     /* Prevent block operations that conflict with data plane thread */
     bdrv_set_in_use(blk->conf.bs, 1);
@@ -428,90 +732,176 @@ void virtio_blk_data_plane_destroy(VirtIOBlockDataPlane *s)
     migrate_del_blocker(s->migration_blocker);
     error_free(s->migration_blocker);
     bdrv_set_in_use(s->blk->conf.bs, 0);
+    if (s->ctx) {
+        aio_context_unref(s->ctx);
+    }
+    g_free(s->queues);
     g_free(s);
 }
 
-void virtio_blk_data_plane_start(VirtIOBlockDataPlane *s)
+/* Linux AIO mode: wire the vring and the ioqueue to the event poller */
+static void start_queue_ioq(VirtIOBlockDataPlaneQueue *q)
 {
-    VirtQueue *vq;
+    VirtIOBlockDataPlane *s = q->dataplane;
     int i;
 
+    event_poll_init(&q->event_poll);
+    event_poll_set_poll_handler(&q->event_poll, poll_queue, q,
+                                s->blk->data_plane_poll_max_ns);
+    event_poll_add(&q->event_poll, &q->notify_handler,
+                   q->host_notifier, handle_notify);
+
+    /* Set up ioqueue */
+    ioq_init(&q->ioqueue, s->fd, REQ_MAX);
+    for (i = 0; i < ARRAY_SIZE(q->requests); i++) {
+        ioq_put_iocb(&q->ioqueue, &q->requests[i].iocb);
+    }
+    event_poll_add(&q->event_poll, &q->io_handler,
+                   ioq_get_notifier(&q->ioqueue), handle_io);
+}
+
+static void start_queue(VirtIOBlockDataPlaneQueue *q)
+{
+    VirtIOBlockDataPlane *s = q->dataplane;
+    VirtQueue *vq = virtio_get_queue(s->vdev, q->index);
+
+    q->guest_notifier = virtio_queue_get_guest_notifier(vq);
+    q->host_notifier = virtio_queue_get_host_notifier(vq);
+
+    /* Set up virtqueue notify */
+    if (s->vdev->binding->set_host_notifier(s->vdev->binding_opaque,
+                                            q->index, true) != 0) {
+        fprintf(stderr, "virtio-blk failed to set host notifier\n");
+        exit(1);
+    }
+
+    if (s->ctx) {
+        q->completion_bh = aio_bh_new(s->ctx, completion_bh, q);
+        aio_set_fd_handler(s->ctx, event_notifier_get_fd(q->host_notifier),
+                           handle_notify_bdrv, NULL, flush_notify_bdrv, q);
+    } else {
+        start_queue_ioq(q);
+    }
+
+    /* Kick right away to begin processing requests already in vring */
+    event_notifier_set(q->host_notifier);
+
+    /* Spawn thread in BH so it inherits iothread cpusets */
+    q->start_bh = qemu_bh_new(start_data_plane_bh, q);
+    qemu_bh_schedule(q->start_bh);
+}
+
+void virtio_blk_data_plane_start(VirtIOBlockDataPlane *s)
+{
+    unsigned int i;
+
     if (s->started) {
         return;
     }
 
-    vq = virtio_get_queue(s->vdev, 0);
-    if (!vring_setup(&s->vring, s->vdev, 0)) {
+    /* I/O throttling may have been enabled since the device was created */
+    if (s->ctx && !bdrv_can_set_aio_context(s->blk->conf.bs)) {
+        error_report("x-data-plane cannot start, the drive uses I/O "
+                     "throttling or a block job");
         return;
     }
 
-    event_poll_init(&s->event_poll);
+    for (i = 0; i < s->num_queues; i++) {
+        if (!vring_setup(&s->queues[i].vring, s->vdev, i)) {
+            while (i-- > 0) {
+                vring_teardown(&s->queues[i].vring);
+            }
+            return;
+        }
+    }
 
-    /* Set up guest notifier (irq) */
-    if (s->vdev->binding->set_guest_notifiers(s->vdev->binding_opaque, 1,
-                                              true) != 0) {
+    /* Set up guest notifiers (irq) */
+    if (s->vdev->binding->set_guest_notifiers(s->vdev->binding_opaque,
+                                              s->num_queues, true) != 0) {
         fprintf(stderr, "virtio-blk failed to set guest notifier, "
                 "ensure -enable-kvm is set\n");
         exit(1);
     }
-    s->guest_notifier = virtio_queue_get_guest_notifier(vq);
 
-    /* Set up virtqueue notify */
-    if (s->vdev->binding->set_host_notifier(s->vdev->binding_opaque,
-                                            0, true) != 0) {
-        fprintf(stderr, "virtio-blk failed to set host notifier\n");
-        exit(1);
+    if (s->ctx) {
+        bdrv_set_aio_context(s->blk->conf.bs, s->ctx);
     }
-    event_poll_add(&s->event_poll, &s->notify_handler,
-                   virtio_queue_get_host_notifier(vq),
-                   handle_notify);
 
-    /* Set up ioqueue */
-    ioq_init(&s->ioqueue, s->fd, REQ_MAX);
-    for (i = 0; i < ARRAY_SIZE(s->requests); i++) {
-        ioq_put_iocb(&s->ioqueue, &s->requests[i].iocb);
+    for (i = 0; i < s->num_queues; i++) {
+        start_queue(&s->queues[i]);
     }
-    event_poll_add(&s->event_poll, &s->io_handler,
-                   ioq_get_notifier(&s->ioqueue), handle_io);
 
     s->started = true;
+    ram_reclaim_inhibit(true);
     trace_virtio_blk_data_plane_start(s);
+}
 
-    /* Kick right away to begin processing requests already in vring */
-    event_notifier_set(virtio_queue_get_host_notifier(vq));
+static void stop_queue(VirtIOBlockDataPlaneQueue *q)
+{
+    VirtIOBlockDataPlane *s = q->dataplane;
 
-    /* Spawn thread in BH so it inherits iothread cpusets */
-    s->start_bh = qemu_bh_new(start_data_plane_bh, s);
-    qemu_bh_schedule(s->start_bh);
+    q->stopping = true;
+
+    /* Stop thread or cancel pending thread creation BH */
+    if (q->start_bh) {
+        qemu_bh_delete(q->start_bh);
+        q->start_bh = NULL;
+    } else {
+        if (s->ctx) {
+            aio_notify(s->ctx);
+        } else {
+            event_poll_notify(&q->event_poll);
+        }
+        qemu_thread_join(&q->thread);
+    }
+
+    if (s->ctx) {
+        aio_set_fd_handler(s->ctx, event_notifier_get_fd(q->host_notifier),
+                           NULL, NULL, NULL, NULL);
+
+        /* The last completions may not have reached the BH yet */
+        flush_completions(q);
+        qemu_bh_delete(q->completion_bh);
+        q->completion_bh = NULL;
+    } else {
+        ioq_cleanup(&q->ioqueue);
+    }
+
+    s->vdev->binding->set_host_notifier(s->vdev->binding_opaque, q->index,
+                                        false);
+
+    if (!s->ctx) {
+        event_poll_cleanup(&q->event_poll);
+    }
+    q->stopping = false;
 }
 
 void virtio_blk_data_plane_stop(VirtIOBlockDataPlane *s)
 {
+    unsigned int i;
+
     if (!s->started || s->stopping) {
         return;
     }
     s->stopping = true;
     trace_virtio_blk_data_plane_stop(s);
 
-    /* Stop thread or cancel pending thread creation BH */
-    if (s->start_bh) {
-        qemu_bh_delete(s->start_bh);
-        s->start_bh = NULL;
-    } else {
-        event_poll_notify(&s->event_poll);
-        qemu_thread_join(&s->thread);
+    for (i = 0; i < s->num_queues; i++) {
+        stop_queue(&s->queues[i]);
     }
 
-    ioq_cleanup(&s->ioqueue);
-
-    s->vdev->binding->set_host_notifier(s->vdev->binding_opaque, 0, false);
-
-    event_poll_cleanup(&s->event_poll);
+    if (s->ctx) {
+        bdrv_set_aio_context(s->blk->conf.bs, qemu_get_aio_context());
+    }
 
-    /* Clean up guest notifier (irq) */
-    s->vdev->binding->set_guest_notifiers(s->vdev->binding_opaque, 1, false);
+    /* Clean up guest notifiers (irq) */
+    s->vdev->binding->set_guest_notifiers(s->vdev->binding_opaque,
+                                          s->num_queues, false);
 
-    vring_teardown(&s->vring);
+    for (i = 0; i < s->num_queues; i++) {
+        vring_teardown(&s->queues[i].vring);
+    }
     s->started = false;
     s->stopping = false;
+    ram_reclaim_inhibit(false);
 }
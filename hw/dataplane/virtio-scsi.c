@@ -0,0 +1,783 @@
+/*
+ * Dedicated threads for virtio-scsi command queues
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "trace.h"
+#include "qemu/iov.h"
+#include "qemu/thread.h"
+#include "event-poll.h"
+#include "block/aio.h"
+#include "vring.h"
+#include "ioq.h"
+#include "migration/migration.h"
+#include "hw/scsi-defs.h"
+#include "hw/dataplane/virtio-scsi.h"
+#include "sysemu/cpus.h"
+
+enum {
+    REQ_MAX = VIRTIO_SCSI_VQ_SIZE,  /* maximum number of requests in a vring */
+    CDB_MIN = 16,                   /* shortest CDB the fast path can parse */
+};
+
+typedef struct VirtIOSCSIDataPlaneQueue VirtIOSCSIDataPlaneQueue;
+
+/* A command popped from the vring.  READ and WRITE commands for a LUN in the
+ * table are submitted with Linux AIO by the queue thread, everything else is
+ * handed to the SCSI layer in the main loop.
+ */
+typedef struct VirtIOSCSIDataPlaneReq {
+    VirtIOSCSIDataPlaneQueue *q;
+    VirtQueueElement elem;
+    size_t size;                    /* data bytes, fast path only */
+    QSIMPLEQ_ENTRY(VirtIOSCSIDataPlaneReq) next;
+} VirtIOSCSIDataPlaneReq;
+
+typedef struct {
+    struct iocb iocb;               /* Linux AIO control block */
+    VirtIOSCSIDataPlaneReq *req;
+} VirtIOSCSIDataPlaneIocb;
+
+/* A used ring entry produced by the SCSI layer in the main loop */
+typedef struct VirtIOSCSIDataPlaneCompletion {
+    unsigned int head;              /* vring descriptor index */
+    unsigned int len;
+    QSIMPLEQ_ENTRY(VirtIOSCSIDataPlaneCompletion) next;
+} VirtIOSCSIDataPlaneCompletion;
+
+/* A LUN whose READ and WRITE commands are served without the SCSI layer */
+typedef struct VirtIOSCSIDataPlaneLun {
+    SCSIDevice *dev;
+    int fd;                         /* image file descriptor */
+    QTAILQ_ENTRY(VirtIOSCSIDataPlaneLun) next;
+} VirtIOSCSIDataPlaneLun;
+
+struct VirtIOSCSIDataPlaneQueue {
+    VirtIOSCSIDataPlane *dataplane;
+    unsigned int index;             /* command queue number, from 0 */
+
+    bool stopping;
+    QEMUBH *start_bh;
+    QemuThread thread;
+
+    Vring vring;                    /* virtqueue vring */
+    EventNotifier *guest_notifier;  /* irq */
+    EventNotifier *host_notifier;   /* virtqueue kick */
+
+    EventPoll event_poll;           /* event poller */
+    EventHandler notify_handler;    /* virtqueue notify handler */
+    EventHandler io_handler;        /* Linux AIO completion handler */
+    EventHandler completion_handler; /* SCSI layer completion handler */
+
+    IOQueue ioqueue;                /* Linux AIO queue, shared by all LUNs */
+    VirtIOSCSIDataPlaneIocb iocbs[REQ_MAX];
+
+    unsigned int num_reqs;          /* popped and not yet in the used ring */
+    unsigned int num_completed;     /* used ring entries not yet flushed */
+
+    /* Hand-off between the queue thread and the main loop */
+    QemuMutex lock;
+    QSIMPLEQ_HEAD(, VirtIOSCSIDataPlaneReq) slow_reqs;
+    QSIMPLEQ_HEAD(, VirtIOSCSIDataPlaneCompletion) completions;
+    EventNotifier slow_notifier;    /* main loop: slow_reqs or thread exit */
+    EventNotifier completion_notifier; /* queue thread: completions */
+    bool exited;
+};
+
+struct VirtIOSCSIDataPlane {
+    bool started;
+    bool stopping;
+
+    VirtIODevice *vdev;
+    SCSIBus *bus;
+    unsigned int num_queues;
+    VirtIOSCSIDataPlaneQueue *queues;
+
+    /* Looked up by the queue threads, updated by the main loop */
+    QemuMutex lun_lock;
+    QTAILQ_HEAD(, VirtIOSCSIDataPlaneLun) luns;
+
+    Error *migration_blocker;
+};
+
+/* Raise an interrupt to signal guest, if necessary */
+static void notify_guest(VirtIOSCSIDataPlaneQueue *q)
+{
+    if (!vring_should_notify(q->dataplane->vdev, &q->vring)) {
+        return;
+    }
+
+    event_notifier_set(q->guest_notifier);
+}
+
+/* Publish the completions of this batch and interrupt the guest once */
+static void flush_completions(VirtIOSCSIDataPlaneQueue *q)
+{
+    if (q->num_completed == 0) {
+        return;
+    }
+
+    vring_flush(&q->vring, q->num_completed);
+    q->num_completed = 0;
+    notify_guest(q);
+}
+
+/* Hand the queued requests to the kernel */
+static void submit_requests(VirtIOSCSIDataPlaneQueue *q)
+{
+    int rc;
+
+    if (ioq_num_queued(&q->ioqueue) == 0) {
+        return;
+    }
+
+    rc = ioq_submit(&q->ioqueue);
+    if (unlikely(rc < 0)) {
+        fprintf(stderr, "ioq_submit failed %d\n", rc);
+        exit(1);
+    }
+}
+
+/* Give a request to the SCSI layer in the main loop */
+static void hand_off_request(VirtIOSCSIDataPlaneQueue *q,
+                             VirtIOSCSIDataPlaneReq *req)
+{
+    trace_virtio_scsi_data_plane_hand_off(q, req->elem.index);
+
+    qemu_mutex_lock(&q->lock);
+    QSIMPLEQ_INSERT_TAIL(&q->slow_reqs, req, next);
+    qemu_mutex_unlock(&q->lock);
+    event_notifier_set(&q->slow_notifier);
+}
+
+static void complete_request(struct iocb *iocb, ssize_t ret, void *opaque)
+{
+    VirtIOSCSIDataPlaneQueue *q = opaque;
+    VirtIOSCSIDataPlaneIocb *dpiocb = container_of(iocb,
+                                                   VirtIOSCSIDataPlaneIocb,
+                                                   iocb);
+    VirtIOSCSIDataPlaneReq *req = dpiocb->req;
+    VirtIOSCSICmdResp *resp = req->elem.in_sg[0].iov_base;
+
+    trace_virtio_scsi_data_plane_complete_request(q, req->elem.index, ret);
+
+    /* Errors and short transfers are retried by the SCSI layer, which
+     * builds the sense data and applies the rerror/werror policy.
+     */
+    if (unlikely(ret < 0 || ret != req->size)) {
+        hand_off_request(q, req);
+        return;
+    }
+
+    memset(resp, 0, sizeof(*resp));
+    resp->response = VIRTIO_SCSI_S_OK;
+    resp->status = GOOD;
+
+    vring_fill(&q->vring, req->elem.index,
+               req->size + req->elem.in_sg[0].iov_len, q->num_completed++);
+    g_free(req);
+    q->num_reqs--;
+}
+
+/* Decode a READ or WRITE command that needs neither forced unit access nor
+ * protection information, the only ones the fast path knows to complete
+ */
+static bool parse_rdwr_cdb(const uint8_t *cdb, bool *read,
+                           uint64_t *lba, uint32_t *len)
+{
+    switch (cdb[0]) {
+    case READ_6:
+    case WRITE_6:
+        *lba = ldl_be_p(&cdb[0]) & 0x1fffff;
+        *len = cdb[4] ? cdb[4] : 256;
+        break;
+    case READ_10:
+    case WRITE_10:
+        *lba = ldl_be_p(&cdb[2]);
+        *len = lduw_be_p(&cdb[7]);
+        break;
+    case READ_12:
+    case WRITE_12:
+        *lba = ldl_be_p(&cdb[2]);
+        *len = ldl_be_p(&cdb[6]);
+        break;
+    case READ_16:
+    case WRITE_16:
+        *lba = ldq_be_p(&cdb[2]);
+        *len = ldl_be_p(&cdb[10]);
+        break;
+    default:
+        return false;
+    }
+
+    /* RDPROTECT/WRPROTECT and FUA */
+    if (cdb[0] != READ_6 && cdb[0] != WRITE_6 && (cdb[1] & 0xe8)) {
+        return false;
+    }
+
+    *read = cdb[0] == READ_6 || cdb[0] == READ_10 ||
+            cdb[0] == READ_12 || cdb[0] == READ_16;
+    return *len > 0;
+}
+
+/* Return the image file descriptor if the command can bypass the SCSI
+ * layer, or -1.  The unit attention, throttling and write cache checks race
+ * with the main loop; a unit attention raised meanwhile is reported on the
+ * next command that goes through the SCSI layer.
+ */
+static int lookup_lun(VirtIOSCSIDataPlane *s, uint8_t *lun, bool read,
+                      uint64_t lba, uint32_t len, QEMUIOVector *qiov)
+{
+    VirtIOSCSIDataPlaneLun *l;
+    SCSIDevice *d;
+    BlockDriverState *bs;
+    int fd = -1;
+
+    if (lun[0] != 1 || (lun[2] != 0 && !(lun[2] >= 0x40 && lun[2] < 0x80))) {
+        return -1;
+    }
+
+    qemu_mutex_lock(&s->lun_lock);
+    QTAILQ_FOREACH(l, &s->luns, next) {
+        if (l->dev->id == lun[1] && l->dev->lun == virtio_scsi_get_lun(lun)) {
+            break;
+        }
+    }
+    if (!l) {
+        goto out;
+    }
+
+    d = l->dev;
+    bs = d->conf.bs;
+    if (d->unit_attention.key == UNIT_ATTENTION ||
+        s->bus->unit_attention.key == UNIT_ATTENTION ||
+        !bdrv_can_set_aio_context(bs)) {
+        goto out;
+    }
+    if (!read && (bdrv_is_read_only(bs) || !bdrv_enable_write_cache(bs))) {
+        goto out;
+    }
+    if (lba > d->max_lba || len > d->max_lba - lba + 1 ||
+        qiov->size != (uint64_t)len * d->blocksize ||
+        !bdrv_qiov_is_aligned(bs, qiov)) {
+        goto out;
+    }
+    fd = l->fd;
+
+out:
+    qemu_mutex_unlock(&s->lun_lock);
+    return fd;
+}
+
+/* Submit a READ or WRITE with Linux AIO, return false if the request must
+ * go through the SCSI layer
+ */
+static bool submit_fast_request(VirtIOSCSIDataPlaneQueue *q,
+                                VirtIOSCSIDataPlaneReq *req)
+{
+    VirtQueueElement *elem = &req->elem;
+    VirtIOSCSICmdReq *cmd;
+    VirtIOSCSIDataPlaneIocb *dpiocb;
+    QEMUIOVector qiov;
+    struct iocb *iocb;
+    uint64_t lba;
+    uint32_t len;
+    bool read;
+    int fd;
+
+    if (elem->out_num < 1 || elem->in_num < 1 ||
+        elem->out_sg[0].iov_len < sizeof(VirtIOSCSICmdReq) + CDB_MIN ||
+        elem->in_sg[0].iov_len < sizeof(VirtIOSCSICmdResp)) {
+        return false;
+    }
+
+    cmd = elem->out_sg[0].iov_base;
+    if (!parse_rdwr_cdb(cmd->cdb, &read, &lba, &len)) {
+        return false;
+    }
+
+    if (read) {
+        if (elem->out_num != 1 || elem->in_num < 2) {
+            return false;
+        }
+        qemu_iovec_init_external(&qiov, &elem->in_sg[1], elem->in_num - 1);
+    } else {
+        if (elem->in_num != 1 || elem->out_num < 2) {
+            return false;
+        }
+        qemu_iovec_init_external(&qiov, &elem->out_sg[1], elem->out_num - 1);
+    }
+
+    fd = lookup_lun(q->dataplane, cmd->lun, read, lba, len, &qiov);
+    if (fd < 0) {
+        return false;
+    }
+
+    trace_virtio_scsi_data_plane_fast_request(q, elem->index, read, lba, len);
+
+    req->size = qiov.size;
+    iocb = ioq_rdwr_fd(&q->ioqueue, fd, read, qiov.iov, qiov.niov,
+                       lba * (qiov.size / len));
+    dpiocb = container_of(iocb, VirtIOSCSIDataPlaneIocb, iocb);
+    dpiocb->req = req;
+    return true;
+}
+
+static void process_vring(VirtIOSCSIDataPlaneQueue *q)
+{
+    VirtIODevice *vdev = q->dataplane->vdev;
+    VirtIOSCSIDataPlaneReq *req;
+    int head;
+
+    /* Once stopping, the vring is left to the virtqueue code */
+    if (q->stopping) {
+        return;
+    }
+
+    for (;;) {
+        /* Disable guest->host notifies to avoid unnecessary vmexits */
+        vring_disable_notification(vdev, &q->vring);
+
+        for (;;) {
+            req = g_malloc(sizeof(*req));
+            head = vring_pop_elem(vdev, &q->vring, &req->elem);
+            if (head < 0) {
+                g_free(req);
+                break; /* no more requests */
+            }
+
+            trace_virtio_scsi_data_plane_process_request(q, req->elem.out_num,
+                                                         req->elem.in_num,
+                                                         head);
+            req->q = q;
+            q->num_reqs++;
+            if (!submit_fast_request(q, req)) {
+                hand_off_request(q, req);
+            }
+        }
+
+        if (likely(head == -EAGAIN)) { /* vring emptied */
+            /* Re-enable guest->host notifies and stop processing the vring.
+             * But if the guest has snuck in more descriptors, keep processing.
+             */
+            if (vring_enable_notification(vdev, &q->vring)) {
+                break;
+            }
+        } else { /* fatal error */
+            if (head == -ENOBUFS) {
+                error_report("virtio-scsi queue %u: too many descriptors",
+                             q->index);
+                vring_set_broken(&q->vring);
+            }
+            break;
+        }
+    }
+
+    /* One io_submit() for everything popped in all rounds above */
+    submit_requests(q);
+}
+
+static void handle_notify(EventHandler *handler)
+{
+    VirtIOSCSIDataPlaneQueue *q = container_of(handler,
+                                               VirtIOSCSIDataPlaneQueue,
+                                               notify_handler);
+
+    process_vring(q);
+}
+
+static void handle_io(EventHandler *handler)
+{
+    VirtIOSCSIDataPlaneQueue *q = container_of(handler,
+                                               VirtIOSCSIDataPlaneQueue,
+                                               io_handler);
+
+    ioq_run_completion(&q->ioqueue, complete_request, q);
+    flush_completions(q);
+}
+
+/* Fill the used ring entries that the SCSI layer produced, called in the
+ * queue thread or, once it has exited, in the main loop
+ */
+static void run_completions(VirtIOSCSIDataPlaneQueue *q)
+{
+    QSIMPLEQ_HEAD(, VirtIOSCSIDataPlaneCompletion) completions;
+    VirtIOSCSIDataPlaneCompletion *c;
+
+    qemu_mutex_lock(&q->lock);
+    QSIMPLEQ_INIT(&completions);
+    QSIMPLEQ_CONCAT(&completions, &q->completions);
+    qemu_mutex_unlock(&q->lock);
+
+    while ((c = QSIMPLEQ_FIRST(&completions))) {
+        QSIMPLEQ_REMOVE_HEAD(&completions, next);
+        vring_fill(&q->vring, c->head, c->len, q->num_completed++);
+        g_slice_free(VirtIOSCSIDataPlaneCompletion, c);
+        q->num_reqs--;
+    }
+    flush_completions(q);
+}
+
+static void handle_completions(EventHandler *handler)
+{
+    VirtIOSCSIDataPlaneQueue *q = container_of(handler,
+                                               VirtIOSCSIDataPlaneQueue,
+                                               completion_handler);
+
+    run_completions(q);
+}
+
+/* Main loop: run the commands handed off by the queue thread */
+static void handle_slow_requests(EventNotifier *e)
+{
+    VirtIOSCSIDataPlaneQueue *q = container_of(e, VirtIOSCSIDataPlaneQueue,
+                                               slow_notifier);
+    QSIMPLEQ_HEAD(, VirtIOSCSIDataPlaneReq) reqs;
+    VirtIOSCSIDataPlaneReq *req;
+
+    event_notifier_test_and_clear(e);
+
+    qemu_mutex_lock(&q->lock);
+    QSIMPLEQ_INIT(&reqs);
+    QSIMPLEQ_CONCAT(&reqs, &q->slow_reqs);
+    qemu_mutex_unlock(&q->lock);
+
+    while ((req = QSIMPLEQ_FIRST(&reqs))) {
+        QSIMPLEQ_REMOVE_HEAD(&reqs, next);
+        virtio_scsi_handle_dataplane_cmd(q->dataplane->vdev, q->index,
+                                         &req->elem);
+        g_free(req);
+    }
+}
+
+/* While stopping, keep aio_poll() blocking until the thread has exited */
+static int flush_slow_requests(EventNotifier *e)
+{
+    VirtIOSCSIDataPlaneQueue *q = container_of(e, VirtIOSCSIDataPlaneQueue,
+                                               slow_notifier);
+    int busy;
+
+    qemu_mutex_lock(&q->lock);
+    busy = !QSIMPLEQ_EMPTY(&q->slow_reqs) || (q->stopping && !q->exited);
+    qemu_mutex_unlock(&q->lock);
+    return busy;
+}
+
+void virtio_scsi_data_plane_complete(VirtIOSCSIDataPlane *s,
+                                     unsigned int queue, unsigned int head,
+                                     unsigned int len)
+{
+    VirtIOSCSIDataPlaneQueue *q = &s->queues[queue];
+    VirtIOSCSIDataPlaneCompletion *c;
+
+    trace_virtio_scsi_data_plane_complete_slow(q, head, len);
+
+    c = g_slice_new(VirtIOSCSIDataPlaneCompletion);
+    c->head = head;
+    c->len = len;
+
+    qemu_mutex_lock(&q->lock);
+    QSIMPLEQ_INSERT_TAIL(&q->completions, c, next);
+    qemu_mutex_unlock(&q->lock);
+    event_notifier_set(&q->completion_notifier);
+}
+
+static void *data_plane_thread(void *opaque)
+{
+    VirtIOSCSIDataPlaneQueue *q = opaque;
+    int thread_id = qemu_get_thread_id();
+    char *name;
+
+    name = g_strdup_printf("virtio-scsi/queue%u", q->index);
+    qemu_register_thread(name, thread_id);
+    g_free(name);
+
+    /* Requests handed to the SCSI layer must come back before the vring
+     * can be torn down
+     */
+    do {
+        event_poll(&q->event_poll);
+    } while (!q->stopping || q->num_reqs > 0);
+    qemu_unregister_thread(thread_id);
+
+    qemu_mutex_lock(&q->lock);
+    q->exited = true;
+    qemu_mutex_unlock(&q->lock);
+    event_notifier_set(&q->slow_notifier);
+    return NULL;
+}
+
+static void start_data_plane_bh(void *opaque)
+{
+    VirtIOSCSIDataPlaneQueue *q = opaque;
+
+    qemu_bh_delete(q->start_bh);
+    q->start_bh = NULL;
+    qemu_thread_create(&q->thread, data_plane_thread,
+                       q, QEMU_THREAD_JOINABLE);
+}
+
+static bool lun_is_eligible(SCSIDevice *dev)
+{
+    BlockDriverState *bs = dev->conf.bs;
+
+    /* Only scsi-hd maps READ and WRITE straight to the image */
+    if (!object_dynamic_cast(OBJECT(dev), "scsi-hd")) {
+        return false;
+    }
+    return raw_get_aio_fd(bs) >= 0 && !bdrv_dev_has_removable_media(bs) &&
+           bdrv_can_set_aio_context(bs) && !bdrv_in_use(bs);
+}
+
+void virtio_scsi_data_plane_add_lun(VirtIOSCSIDataPlane *s, SCSIDevice *dev)
+{
+    VirtIOSCSIDataPlaneLun *l;
+
+    if (!s->started || !lun_is_eligible(dev)) {
+        return;
+    }
+
+    /* Prevent block operations that conflict with the queue threads */
+    bdrv_set_in_use(dev->conf.bs, 1);
+
+    l = g_new0(VirtIOSCSIDataPlaneLun, 1);
+    l->dev = dev;
+    l->fd = raw_get_aio_fd(dev->conf.bs);
+
+    qemu_mutex_lock(&s->lun_lock);
+    QTAILQ_INSERT_TAIL(&s->luns, l, next);
+    qemu_mutex_unlock(&s->lun_lock);
+    trace_virtio_scsi_data_plane_add_lun(s, dev, l->fd);
+}
+
+/* Commands already submitted for @dev complete normally, the kernel keeps a
+ * reference to the file while they are in flight
+ */
+void virtio_scsi_data_plane_remove_lun(VirtIOSCSIDataPlane *s,
+                                       SCSIDevice *dev)
+{
+    VirtIOSCSIDataPlaneLun *l;
+
+    qemu_mutex_lock(&s->lun_lock);
+    QTAILQ_FOREACH(l, &s->luns, next) {
+        if (l->dev == dev) {
+            QTAILQ_REMOVE(&s->luns, l, next);
+            break;
+        }
+    }
+    qemu_mutex_unlock(&s->lun_lock);
+
+    if (l) {
+        bdrv_set_in_use(dev->conf.bs, 0);
+        g_free(l);
+    }
+}
+
+bool virtio_scsi_data_plane_create(VirtIODevice *vdev, VirtIOSCSIConf *conf,
+                                   SCSIBus *bus,
+                                   VirtIOSCSIDataPlane **dataplane)
+{
+    VirtIOSCSIDataPlane *s;
+    unsigned int i;
+
+    *dataplane = NULL;
+
+    if (!conf->data_plane) {
+        return true;
+    }
+
+    s = g_new0(VirtIOSCSIDataPlane, 1);
+    s->vdev = vdev;
+    s->bus = bus;
+    s->num_queues = conf->num_queues;
+    s->queues = g_new0(VirtIOSCSIDataPlaneQueue, s->num_queues);
+    for (i = 0; i < s->num_queues; i++) {
+        VirtIOSCSIDataPlaneQueue *q = &s->queues[i];
+
+        q->dataplane = s;
+        q->index = i;
+        qemu_mutex_init(&q->lock);
+        QSIMPLEQ_INIT(&q->slow_reqs);
+        QSIMPLEQ_INIT(&q->completions);
+    }
+    qemu_mutex_init(&s->lun_lock);
+    QTAILQ_INIT(&s->luns);
+
+    error_setg(&s->migration_blocker,
+            "x-data-plane does not support migration");
+    migrate_add_blocker(s->migration_blocker);
+
+    *dataplane = s;
+    return true;
+}
+
+void virtio_scsi_data_plane_destroy(VirtIOSCSIDataPlane *s)
+{
+    unsigned int i;
+
+    if (!s) {
+        return;
+    }
+
+    virtio_scsi_data_plane_stop(s);
+    migrate_del_blocker(s->migration_blocker);
+    error_free(s->migration_blocker);
+    for (i = 0; i < s->num_queues; i++) {
+        qemu_mutex_destroy(&s->queues[i].lock);
+    }
+    qemu_mutex_destroy(&s->lun_lock);
+    g_free(s->queues);
+    g_free(s);
+}
+
+static void start_queue(VirtIOSCSIDataPlaneQueue *q)
+{
+    VirtIOSCSIDataPlane *s = q->dataplane;
+    VirtQueue *vq = virtio_get_queue(s->vdev, q->index + 2);
+    int i;
+
+    q->guest_notifier = virtio_queue_get_guest_notifier(vq);
+    q->host_notifier = virtio_queue_get_host_notifier(vq);
+    q->exited = false;
+
+    /* Set up virtqueue notify */
+    if (s->vdev->binding->set_host_notifier(s->vdev->binding_opaque,
+                                            q->index + 2, true) != 0) {
+        fprintf(stderr, "virtio-scsi failed to set host notifier\n");
+        exit(1);
+    }
+
+    event_poll_init(&q->event_poll);
+    event_poll_add(&q->event_poll, &q->notify_handler,
+                   q->host_notifier, handle_notify);
+
+    /* Set up ioqueue, the file descriptor is chosen per request */
+    ioq_init(&q->ioqueue, -1, REQ_MAX);
+    for (i = 0; i < ARRAY_SIZE(q->iocbs); i++) {
+        ioq_put_iocb(&q->ioqueue, &q->iocbs[i].iocb);
+    }
+    event_poll_add(&q->event_poll, &q->io_handler,
+                   ioq_get_notifier(&q->ioqueue), handle_io);
+
+    /* Set up the hand-off in both directions */
+    event_notifier_init(&q->completion_notifier, 0);
+    event_poll_add(&q->event_poll, &q->completion_handler,
+                   &q->completion_notifier, handle_completions);
+    event_notifier_init(&q->slow_notifier, 0);
+    aio_set_event_notifier(qemu_get_aio_context(), &q->slow_notifier,
+                           handle_slow_requests, flush_slow_requests);
+
+    /* Kick right away to begin processing requests already in vring */
+    event_notifier_set(q->host_notifier);
+
+    /* Spawn thread in BH so it inherits iothread cpusets */
+    q->start_bh = qemu_bh_new(start_data_plane_bh, q);
+    qemu_bh_schedule(q->start_bh);
+}
+
+void virtio_scsi_data_plane_start(VirtIOSCSIDataPlane *s)
+{
+    BusChild *kid;
+    unsigned int i;
+
+    if (s->started) {
+        return;
+    }
+
+    for (i = 0; i < s->num_queues; i++) {
+        if (!vring_setup(&s->queues[i].vring, s->vdev, i + 2)) {
+            while (i-- > 0) {
+                vring_teardown(&s->queues[i].vring);
+            }
+            return;
+        }
+    }
+
+    /* Set up guest notifiers (irq) for the control, event and command
+     * queues, the first two stay with the main loop
+     */
+    if (s->vdev->binding->set_guest_notifiers(s->vdev->binding_opaque,
+                                              s->num_queues + 2, true) != 0) {
+        fprintf(stderr, "virtio-scsi failed to set guest notifier, "
+                "ensure -enable-kvm is set\n");
+        exit(1);
+    }
+
+    s->started = true;
+    QTAILQ_FOREACH(kid, &s->bus->qbus.children, sibling) {
+        virtio_scsi_data_plane_add_lun(s, DO_UPCAST(SCSIDevice, qdev,
+                                                    kid->child));
+    }
+
+    for (i = 0; i < s->num_queues; i++) {
+        start_queue(&s->queues[i]);
+    }
+    trace_virtio_scsi_data_plane_start(s);
+}
+
+static void stop_queue(VirtIOSCSIDataPlaneQueue *q)
+{
+    VirtIOSCSIDataPlane *s = q->dataplane;
+    AioContext *ctx = qemu_get_aio_context();
+
+    q->stopping = true;
+
+    /* Stop thread or cancel pending thread creation BH */
+    if (q->start_bh) {
+        qemu_bh_delete(q->start_bh);
+        q->start_bh = NULL;
+    } else {
+        /* The thread waits for the commands it handed to the SCSI layer,
+         * which need the main loop to make progress
+         */
+        event_poll_notify(&q->event_poll);
+        while (flush_slow_requests(&q->slow_notifier)) {
+            aio_poll(ctx, true);
+        }
+        qemu_thread_join(&q->thread);
+    }
+
+    aio_set_event_notifier(ctx, &q->slow_notifier, NULL, NULL);
+    event_notifier_cleanup(&q->slow_notifier);
+    event_notifier_cleanup(&q->completion_notifier);
+    ioq_cleanup(&q->ioqueue);
+
+    s->vdev->binding->set_host_notifier(s->vdev->binding_opaque, q->index + 2,
+                                        false);
+
+    event_poll_cleanup(&q->event_poll);
+    q->stopping = false;
+}
+
+void virtio_scsi_data_plane_stop(VirtIOSCSIDataPlane *s)
+{
+    VirtIOSCSIDataPlaneLun *l;
+    unsigned int i;
+
+    if (!s->started || s->stopping) {
+        return;
+    }
+    s->stopping = true;
+    trace_virtio_scsi_data_plane_stop(s);
+
+    for (i = 0; i < s->num_queues; i++) {
+        stop_queue(&s->queues[i]);
+    }
+
+    while ((l = QTAILQ_FIRST(&s->luns))) {
+        virtio_scsi_data_plane_remove_lun(s, l->dev);
+    }
+
+    /* Clean up guest notifiers (irq) */
+    s->vdev->binding->set_guest_notifiers(s->vdev->binding_opaque,
+                                          s->num_queues + 2, false);
+
+    for (i = 0; i < s->num_queues; i++) {
+        vring_teardown(&s->queues[i].vring);
+    }
+    s->started = false;
+    s->stopping = false;
+}
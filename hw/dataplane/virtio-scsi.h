@@ -0,0 +1,37 @@
+/*
+ * Dedicated threads for virtio-scsi command queues
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef HW_DATAPLANE_VIRTIO_SCSI_H
+#define HW_DATAPLANE_VIRTIO_SCSI_H
+
+#include "hw/virtio.h"
+#include "hw/scsi.h"
+#include "hw/virtio-scsi.h"
+
+typedef struct VirtIOSCSIDataPlane VirtIOSCSIDataPlane;
+
+bool virtio_scsi_data_plane_create(VirtIODevice *vdev, VirtIOSCSIConf *conf,
+                                   SCSIBus *bus,
+                                   VirtIOSCSIDataPlane **dataplane);
+void virtio_scsi_data_plane_destroy(VirtIOSCSIDataPlane *s);
+void virtio_scsi_data_plane_start(VirtIOSCSIDataPlane *s);
+void virtio_scsi_data_plane_stop(VirtIOSCSIDataPlane *s);
+
+/* Return a command that went through the SCSI layer to its queue's vring,
+ * may be called from any thread holding the global mutex
+ */
+void virtio_scsi_data_plane_complete(VirtIOSCSIDataPlane *s,
+                                     unsigned int queue, unsigned int head,
+                                     unsigned int len);
+
+/* Keep the LUNs served by the fast path in sync with the bus */
+void virtio_scsi_data_plane_add_lun(VirtIOSCSIDataPlane *s, SCSIDevice *dev);
+void virtio_scsi_data_plane_remove_lun(VirtIOSCSIDataPlane *s,
+                                       SCSIDevice *dev);
+
+#endif /* HW_DATAPLANE_VIRTIO_SCSI_H */
@@ -39,6 +39,7 @@ bool vring_setup(Vring *vring, VirtIODevice *vdev, int n)
     vring_init(&vring->vr, virtio_queue_get_num(vdev, n), vring_ptr, 4096);
 
     vring->last_avail_idx = 0;
+    vring->shadow_avail_idx = 0;
     vring->last_used_idx = 0;
     vring->signalled_used = 0;
     vring->signalled_used_valid = false;
@@ -109,6 +110,7 @@ bool vring_should_notify(VirtIODevice *vdev, Vring *vring)
 /* This is stolen from linux/drivers/vhost/vhost.c. */
 static int get_indirect(Vring *vring,
                         struct iovec iov[], struct iovec *iov_end,
+                        hwaddr addr[],
                         unsigned int *out_num, unsigned int *in_num,
                         struct vring_desc *indirect)
 {
@@ -182,6 +184,9 @@ static int get_indirect(Vring *vring,
         }
         iov->iov_len = desc.len;
         iov++;
+        if (addr) {
+            *addr++ = desc.addr;
+        }
 
         /* If this is an input descriptor, increment that count. */
         if (desc.flags & VRING_DESC_F_WRITE) {
@@ -213,9 +218,10 @@ static int get_indirect(Vring *vring,
  *
  * Stolen from linux/drivers/vhost/vhost.c.
  */
-int vring_pop(VirtIODevice *vdev, Vring *vring,
-              struct iovec iov[], struct iovec *iov_end,
-              unsigned int *out_num, unsigned int *in_num)
+static int do_vring_pop(VirtIODevice *vdev, Vring *vring,
+                        struct iovec iov[], struct iovec *iov_end,
+                        hwaddr addr[],
+                        unsigned int *out_num, unsigned int *in_num)
 {
     struct vring_desc desc;
     unsigned int i, head, found = 0, num = vring->vr.num;
@@ -226,10 +232,16 @@ int vring_pop(VirtIODevice *vdev, Vring *vring,
         return -EFAULT;
     }
 
-    /* Check it isn't doing very strange things with descriptor numbers. */
+    /* The avail index shares a cache line with the entries the guest is
+     * adding, only read it again once we have caught up with it. */
     last_avail_idx = vring->last_avail_idx;
-    avail_idx = vring->vr.avail->idx;
-    barrier(); /* load indices now and not again later */
+    avail_idx = vring->shadow_avail_idx;
+    if (avail_idx == last_avail_idx) {
+        avail_idx = vring->shadow_avail_idx = vring->vr.avail->idx;
+        barrier(); /* load indices now and not again later */
+    }
+
+    /* Check it isn't doing very strange things with descriptor numbers. */
 
     if (unlikely((uint16_t)(avail_idx - last_avail_idx) > num)) {
         error_report("Guest moved used index from %u to %u",
@@ -257,8 +269,9 @@ int vring_pop(VirtIODevice *vdev, Vring *vring,
         return -EFAULT;
     }
 
+    /* Stale is fine: notifications come back on when the ring is empty */
     if (vdev->guest_features & (1 << VIRTIO_RING_F_EVENT_IDX)) {
-        vring_avail_event(&vring->vr) = vring->vr.avail->idx;
+        vring_avail_event(&vring->vr) = avail_idx;
     }
 
     /* When we start there are none of either input nor output. */
@@ -283,7 +296,8 @@ int vring_pop(VirtIODevice *vdev, Vring *vring,
         barrier();
 
         if (desc.flags & VRING_DESC_F_INDIRECT) {
-            int ret = get_indirect(vring, iov, iov_end, out_num, in_num, &desc);
+            int ret = get_indirect(vring, iov, iov_end, addr,
+                                   out_num, in_num, &desc);
             if (ret < 0) {
                 return ret;
             }
@@ -309,6 +323,9 @@ int vring_pop(VirtIODevice *vdev, Vring *vring,
         }
         iov->iov_len  = desc.len;
         iov++;
+        if (addr) {
+            *addr++ = desc.addr;
+        }
 
         if (desc.flags & VRING_DESC_F_WRITE) {
             /* If this is an input descriptor,
@@ -332,14 +349,52 @@ int vring_pop(VirtIODevice *vdev, Vring *vring,
     return head;
 }
 
+int vring_pop(VirtIODevice *vdev, Vring *vring,
+              struct iovec iov[], struct iovec *iov_end,
+              unsigned int *out_num, unsigned int *in_num)
+{
+    return do_vring_pop(vdev, vring, iov, iov_end, NULL, out_num, in_num);
+}
+
+/* Like vring_pop(), but fill in a VirtQueueElement including the guest
+ * physical addresses, for devices that hand some requests to code written
+ * against the VirtQueue API.  The buffers are not mapped with
+ * cpu_physical_memory_map(), so the element must be returned with
+ * vring_fill() rather than virtqueue_push().
+ */
+int vring_pop_elem(VirtIODevice *vdev, Vring *vring, VirtQueueElement *elem)
+{
+    struct iovec iov[VIRTQUEUE_MAX_SIZE];
+    hwaddr addr[VIRTQUEUE_MAX_SIZE];
+    unsigned int out_num, in_num;
+    int head;
+
+    head = do_vring_pop(vdev, vring, iov, &iov[VIRTQUEUE_MAX_SIZE], addr,
+                        &out_num, &in_num);
+    if (head < 0) {
+        return head;
+    }
+
+    elem->index = head;
+    elem->out_num = out_num;
+    elem->in_num = in_num;
+    memcpy(elem->out_sg, iov, out_num * sizeof(iov[0]));
+    memcpy(elem->out_addr, addr, out_num * sizeof(addr[0]));
+    memcpy(elem->in_sg, &iov[out_num], in_num * sizeof(iov[0]));
+    memcpy(elem->in_addr, &addr[out_num], in_num * sizeof(addr[0]));
+    return head;
+}
+
 /* After we've used one of their buffers, we tell them about it.
  *
  * Stolen from linux/drivers/vhost/vhost.c.
  */
-void vring_push(Vring *vring, unsigned int head, int len)
+/* Fill the @idx-th used ring entry after the last published one.  The entry
+ * becomes visible to the guest with vring_flush().
+ */
+void vring_fill(Vring *vring, unsigned int head, int len, unsigned int idx)
 {
     struct vring_used_elem *used;
-    uint16_t new;
 
     /* Don't touch vring if a fatal error occurred */
     if (vring->broken) {
@@ -348,15 +403,34 @@ void vring_push(Vring *vring, unsigned int head, int len)
 
     /* The virtqueue contains a ring of used buffers.  Get a pointer to the
      * next entry in that used ring. */
-    used = &vring->vr.used->ring[vring->last_used_idx % vring->vr.num];
+    used = &vring->vr.used->ring[(uint16_t)(vring->last_used_idx + idx) %
+                                 vring->vr.num];
     used->id = head;
     used->len = len;
+}
 
-    /* Make sure buffer is written before we update index. */
+/* Publish @count entries filled with vring_fill(), with a single barrier */
+void vring_flush(Vring *vring, unsigned int count)
+{
+    uint16_t old, new;
+
+    if (vring->broken) {
+        return;
+    }
+
+    /* Make sure buffers are written before we update index. */
     smp_wmb();
 
-    new = vring->vr.used->idx = ++vring->last_used_idx;
-    if (unlikely((int16_t)(new - vring->signalled_used) < (uint16_t)1)) {
+    old = vring->last_used_idx;
+    new = vring->vr.used->idx = vring->last_used_idx = old + count;
+    if (unlikely((int16_t)(new - vring->signalled_used) <
+                 (uint16_t)(new - old))) {
         vring->signalled_used_valid = false;
     }
 }
+
+void vring_push(Vring *vring, unsigned int head, int len)
+{
+    vring_fill(vring, head, len, 0);
+    vring_flush(vring, 1);
+}
@@ -26,6 +26,7 @@ typedef struct {
     HostMem hostmem;                /* guest memory mapper */
     struct vring vr;                /* virtqueue vring mapped to host memory */
     uint16_t last_avail_idx;        /* last processed avail ring index */
+    uint16_t shadow_avail_idx;      /* last avail ring index read */
     uint16_t last_used_idx;         /* last processed used ring index */
     uint16_t signalled_used;        /* EVENT_IDX state */
     bool signalled_used_valid;
@@ -40,7 +41,11 @@ static inline unsigned int vring_get_num(Vring *vring)
 /* Are there more descriptors available? */
 static inline bool vring_more_avail(Vring *vring)
 {
-    return vring->vr.avail->idx != vring->last_avail_idx;
+    if (vring->shadow_avail_idx != vring->last_avail_idx) {
+        return true;
+    }
+    vring->shadow_avail_idx = vring->vr.avail->idx;
+    return vring->shadow_avail_idx != vring->last_avail_idx;
 }
 
 /* Fail future vring_pop() and vring_push() calls until reset */
@@ -57,6 +62,9 @@ bool vring_should_notify(VirtIODevice *vdev, Vring *vring);
 int vring_pop(VirtIODevice *vdev, Vring *vring,
               struct iovec iov[], struct iovec *iov_end,
               unsigned int *out_num, unsigned int *in_num);
+int vring_pop_elem(VirtIODevice *vdev, Vring *vring, VirtQueueElement *elem);
+void vring_fill(Vring *vring, unsigned int head, int len, unsigned int idx);
+void vring_flush(Vring *vring, unsigned int count);
 void vring_push(Vring *vring, unsigned int head, int len);
 
 #endif /* VRING_H */
@@ -131,8 +131,39 @@ typedef struct E1000State_st {
     } eecd_state;
 
     QEMUTimer *autoneg_timer;
+
+    /* Writes to TCTL and TDT only latch the register; the ring is walked
+     * from a bottom half so that the vcpu returns to the guest at once.
+     */
+    QEMUBH *tx_bh;
+    VMChangeStateEntry *vmstate;
+
+    /* Interrupt moderation: RXT0 and TXDW are held back for the packet
+     * timers (RDTR, TIDV) capped by the absolute ones (RADV, TADV), and a
+     * new interrupt is asserted at most once per ITR interval.  A zero
+     * deadline means nothing is pending.
+     */
+    QEMUTimer *mit_timer;
+    struct e1000_mit_delay {
+        int64_t deadline;
+        int64_t abs_deadline;
+    } mit_rx, mit_tx;
+    int64_t mit_itr_end;
+    bool mit_irq_level;
+
+    /* Inside a receive batch, causes are posted once at its end */
+    bool rx_batch;
+    uint32_t rx_batch_cause;
+
+    uint32_t compat_flags;
 } E1000State;
 
+#define E1000_FLAG_MIT_BIT 0
+#define E1000_FLAG_MIT (1 << E1000_FLAG_MIT_BIT)
+
+/* Descriptors read and written back with one DMA access by start_xmit() */
+#define E1000_TX_BATCH 32
+
 #define	defreg(x)	x = (E1000_##x>>2)
 enum {
     defreg(CTRL),	defreg(EECD),	defreg(EERD),	defreg(GPRC),
@@ -145,7 +176,8 @@ enum {
     defreg(TORH),	defreg(TORL),	defreg(TOTH),	defreg(TOTL),
     defreg(TPR),	defreg(TPT),	defreg(TXDCTL),	defreg(WUFC),
     defreg(RA),		defreg(MTA),	defreg(CRCERRS),defreg(VFTA),
-    defreg(VET),
+    defreg(VET),	defreg(ITR),	defreg(RDTR),	defreg(RADV),
+    defreg(TIDV),	defreg(TADV),
 };
 
 static void
@@ -224,9 +256,51 @@ static const uint32_t mac_reg_init[] = {
                 E1000_MANC_RMCP_EN,
 };
 
+static void
+e1000_mit_rearm(E1000State *s)
+{
+    int64_t next = INT64_MAX;
+
+    if (s->mit_rx.deadline) {
+        next = MIN(next, s->mit_rx.deadline);
+    }
+    if (s->mit_tx.deadline) {
+        next = MIN(next, s->mit_tx.deadline);
+    }
+    if (s->mit_itr_end) {
+        next = MIN(next, s->mit_itr_end);
+    }
+
+    if (next == INT64_MAX) {
+        qemu_del_timer(s->mit_timer);
+    } else {
+        qemu_mod_timer(s->mit_timer, next);
+    }
+}
+
+/* Start or restart a packet timer of @delay units of 1.024 us, without
+ * going past @abs_delay units after the first packet it covers.
+ */
+static void
+e1000_mit_defer(E1000State *s, struct e1000_mit_delay *d, uint32_t delay,
+                uint32_t abs_delay)
+{
+    int64_t now = qemu_get_clock_ns(vm_clock);
+
+    delay &= E1000_RDT_DELAY;
+    abs_delay &= E1000_RDT_DELAY;
+    if (!d->deadline) {
+        d->abs_deadline = abs_delay ? now + abs_delay * 1024 : INT64_MAX;
+    }
+    d->deadline = MIN(now + delay * 1024, d->abs_deadline);
+    e1000_mit_rearm(s);
+}
+
 static void
 set_interrupt_cause(E1000State *s, int index, uint32_t val)
 {
+    uint32_t pending;
+
     if (val && (E1000_DEVID >= E1000_DEV_ID_82547EI_MOBILE)) {
         /* Only for 8257x */
         val |= E1000_ICR_INT_ASSERTED;
@@ -243,7 +317,23 @@ set_interrupt_cause(E1000State *s, int index, uint32_t val)
      */
     s->mac_reg[ICS] = val;
 
-    qemu_set_irq(s->dev.irq[0], (s->mac_reg[IMS] & s->mac_reg[ICR]) != 0);
+    pending = s->mac_reg[IMS] & s->mac_reg[ICR];
+    if (pending && !s->mit_irq_level) {
+        /* Within the ITR interval the interrupt is asserted only when
+         * e1000_mit_timer() runs. */
+        if (s->mit_itr_end) {
+            return;
+        }
+        if ((s->compat_flags & E1000_FLAG_MIT) &&
+            (s->mac_reg[ITR] & 0xffff)) {
+            s->mit_itr_end = qemu_get_clock_ns(vm_clock) +
+                             (s->mac_reg[ITR] & 0xffff) * 256;
+            e1000_mit_rearm(s);
+        }
+    }
+
+    s->mit_irq_level = pending != 0;
+    qemu_set_irq(s->dev.irq[0], s->mit_irq_level);
 }
 
 static void
@@ -254,6 +344,50 @@ set_ics(E1000State *s, int index, uint32_t val)
     set_interrupt_cause(s, 0, val | s->mac_reg[ICR]);
 }
 
+static void
+e1000_mit_timer(void *opaque)
+{
+    E1000State *s = opaque;
+    int64_t now = qemu_get_clock_ns(vm_clock);
+    uint32_t cause = 0;
+
+    if (s->mit_rx.deadline && s->mit_rx.deadline <= now) {
+        s->mit_rx.deadline = 0;
+        cause |= E1000_ICS_RXT0;
+    }
+    if (s->mit_tx.deadline && s->mit_tx.deadline <= now) {
+        s->mit_tx.deadline = 0;
+        cause |= E1000_ICS_TXDW;
+    }
+    if (s->mit_itr_end && s->mit_itr_end <= now) {
+        s->mit_itr_end = 0;
+    }
+
+    /* Also asserts an interrupt that the ITR interval held back */
+    set_ics(s, 0, cause);
+    e1000_mit_rearm(s);
+}
+
+/* Post the causes held back by the packet timers right away */
+static void
+e1000_mit_flush(E1000State *s, bool rx, bool tx)
+{
+    uint32_t cause = 0;
+
+    if (rx && s->mit_rx.deadline) {
+        s->mit_rx.deadline = 0;
+        cause |= E1000_ICS_RXT0;
+    }
+    if (tx && s->mit_tx.deadline) {
+        s->mit_tx.deadline = 0;
+        cause |= E1000_ICS_TXDW;
+    }
+    if (cause) {
+        set_ics(s, 0, cause);
+        e1000_mit_rearm(s);
+    }
+}
+
 static int
 rxbufsize(uint32_t v)
 {
@@ -284,6 +418,13 @@ static void e1000_reset(void *opaque)
     int i;
 
     qemu_del_timer(d->autoneg_timer);
+    qemu_del_timer(d->mit_timer);
+    qemu_bh_cancel(d->tx_bh);
+    memset(&d->mit_rx, 0, sizeof d->mit_rx);
+    memset(&d->mit_tx, 0, sizeof d->mit_tx);
+    d->mit_itr_end = 0;
+    d->mit_irq_level = false;
+    d->rx_batch_cause = 0;
     memset(d->phy_reg, 0, sizeof d->phy_reg);
     memmove(d->phy_reg, phy_reg_init, sizeof phy_reg_init);
     memset(d->mac_reg, 0, sizeof d->mac_reg);
@@ -629,18 +770,40 @@ process_tx_desc(E1000State *s, struct e1000_tx_desc *dp)
     tp->cptse = 0;
 }
 
+/* Report the @n descriptors at @base done, with one DMA write covering the
+ * ones that asked for a status write-back
+ */
 static uint32_t
-txdesc_writeback(E1000State *s, dma_addr_t base, struct e1000_tx_desc *dp)
+txdesc_writeback(E1000State *s, dma_addr_t base, struct e1000_tx_desc *dp,
+                 unsigned int n)
 {
-    uint32_t txd_upper, txd_lower = le32_to_cpu(dp->lower.data);
+    uint32_t txd_upper, txd_lower;
+    unsigned int i, first = n, last = 0;
+
+    for (i = 0; i < n; i++) {
+        txd_lower = le32_to_cpu(dp[i].lower.data);
+        if (!(txd_lower & (E1000_TXD_CMD_RS|E1000_TXD_CMD_RPS))) {
+            continue;
+        }
+        txd_upper = (le32_to_cpu(dp[i].upper.data) | E1000_TXD_STAT_DD) &
+                    ~(E1000_TXD_STAT_EC | E1000_TXD_STAT_LC |
+                      E1000_TXD_STAT_TU);
+        dp[i].upper.data = cpu_to_le32(txd_upper);
+        first = MIN(first, i);
+        last = i;
+    }
 
-    if (!(txd_lower & (E1000_TXD_CMD_RS|E1000_TXD_CMD_RPS)))
+    if (first == n) {
         return 0;
-    txd_upper = (le32_to_cpu(dp->upper.data) | E1000_TXD_STAT_DD) &
-                ~(E1000_TXD_STAT_EC | E1000_TXD_STAT_LC | E1000_TXD_STAT_TU);
-    dp->upper.data = cpu_to_le32(txd_upper);
-    pci_dma_write(&s->dev, base + ((char *)&dp->upper - (char *)dp),
-                  &dp->upper, sizeof(dp->upper));
+    }
+    if (first == last) {
+        pci_dma_write(&s->dev, base + first * sizeof(*dp) +
+                      ((char *)&dp->upper - (char *)dp),
+                      &dp[first].upper, sizeof(dp->upper));
+    } else {
+        pci_dma_write(&s->dev, base + first * sizeof(*dp), &dp[first],
+                      (last - first + 1) * sizeof(*dp));
+    }
     return E1000_ICR_TXDW;
 }
 
@@ -656,8 +819,11 @@ static void
 start_xmit(E1000State *s)
 {
     dma_addr_t base;
-    struct e1000_tx_desc desc;
+    struct e1000_tx_desc desc[E1000_TX_BATCH];
     uint32_t tdh_start = s->mac_reg[TDH], cause = E1000_ICS_TXQE;
+    uint32_t ring_size = s->mac_reg[TDLEN] / sizeof(desc[0]);
+    uint32_t tdh, n, i;
+    bool ide = false;
 
     if (!(s->mac_reg[TCTL] & E1000_TCTL_EN)) {
         DBGOUT(TX, "tx disabled\n");
@@ -665,18 +831,35 @@ start_xmit(E1000State *s)
     }
 
     while (s->mac_reg[TDH] != s->mac_reg[TDT]) {
-        base = tx_desc_base(s) +
-               sizeof(struct e1000_tx_desc) * s->mac_reg[TDH];
-        pci_dma_read(&s->dev, base, &desc, sizeof(desc));
+        /* Take the descriptors up to TDT, the end of the ring or the
+         * starting point, whichever comes first */
+        tdh = s->mac_reg[TDH];
+        if (tdh < ring_size) {
+            n = (s->mac_reg[TDT] > tdh ? s->mac_reg[TDT] : ring_size) - tdh;
+            n = MIN(n, ring_size - tdh);
+            if (tdh < tdh_start) {
+                n = MIN(n, tdh_start - tdh);
+            }
+            n = MIN(n, E1000_TX_BATCH);
+        } else {
+            n = 1;
+        }
+
+        base = tx_desc_base(s) + sizeof(desc[0]) * tdh;
+        pci_dma_read(&s->dev, base, desc, n * sizeof(desc[0]));
 
-        DBGOUT(TX, "index %d: %p : %x %x\n", s->mac_reg[TDH],
-               (void *)(intptr_t)desc.buffer_addr, desc.lower.data,
-               desc.upper.data);
+        for (i = 0; i < n; i++) {
+            DBGOUT(TX, "index %d: %p : %x %x\n", tdh + i,
+                   (void *)(intptr_t)desc[i].buffer_addr, desc[i].lower.data,
+                   desc[i].upper.data);
 
-        process_tx_desc(s, &desc);
-        cause |= txdesc_writeback(s, base, &desc);
+            process_tx_desc(s, &desc[i]);
+            ide |= !!(le32_to_cpu(desc[i].lower.data) & E1000_TXD_CMD_IDE);
+        }
+        cause |= txdesc_writeback(s, base, desc, n);
 
-        if (++s->mac_reg[TDH] * sizeof(desc) >= s->mac_reg[TDLEN])
+        s->mac_reg[TDH] = tdh + n;
+        if (s->mac_reg[TDH] * sizeof(desc[0]) >= s->mac_reg[TDLEN])
             s->mac_reg[TDH] = 0;
         /*
          * the following could happen only if guest sw assigns
@@ -689,6 +872,13 @@ start_xmit(E1000State *s)
             break;
         }
     }
+
+    if ((cause & E1000_ICR_TXDW) && ide &&
+        (s->compat_flags & E1000_FLAG_MIT) &&
+        (s->mac_reg[TIDV] & E1000_RDT_DELAY)) {
+        cause &= ~E1000_ICR_TXDW;
+        e1000_mit_defer(s, &s->mit_tx, s->mac_reg[TIDV], s->mac_reg[TADV]);
+    }
     set_ics(s, 0, cause);
 }
 
@@ -914,11 +1104,33 @@ e1000_receive(NetClientState *nc, const uint8_t *buf, size_t size)
         s->rxbuf_min_shift)
         n |= E1000_ICS_RXDMT0;
 
-    set_ics(s, 0, n);
+    if ((s->compat_flags & E1000_FLAG_MIT) &&
+        (s->mac_reg[RDTR] & E1000_RDT_DELAY)) {
+        n &= ~E1000_ICS_RXT0;
+        e1000_mit_defer(s, &s->mit_rx, s->mac_reg[RDTR], s->mac_reg[RADV]);
+    }
+
+    if (s->rx_batch) {
+        s->rx_batch_cause |= n;
+    } else if (n) {
+        set_ics(s, 0, n);
+    }
 
     return size;
 }
 
+static void
+e1000_receive_batch(NetClientState *nc, bool start)
+{
+    E1000State *s = qemu_get_nic_opaque(nc);
+
+    s->rx_batch = start;
+    if (!start && s->rx_batch_cause) {
+        set_ics(s, 0, s->rx_batch_cause);
+        s->rx_batch_cause = 0;
+    }
+}
+
 static uint32_t
 mac_readreg(E1000State *s, int index)
 {
@@ -975,6 +1187,24 @@ set_16bit(E1000State *s, int index, uint32_t val)
     s->mac_reg[index] = val & 0xffff;
 }
 
+static void
+set_rdtr(E1000State *s, int index, uint32_t val)
+{
+    s->mac_reg[index] = val & E1000_RDT_DELAY;
+    if (val & E1000_RDT_FPDB) {
+        e1000_mit_flush(s, true, false);
+    }
+}
+
+static void
+set_tidv(E1000State *s, int index, uint32_t val)
+{
+    s->mac_reg[index] = val & E1000_RDT_DELAY;
+    if (val & E1000_TIDV_FPD) {
+        e1000_mit_flush(s, false, true);
+    }
+}
+
 static void
 set_dlen(E1000State *s, int index, uint32_t val)
 {
@@ -986,9 +1216,31 @@ set_tctl(E1000State *s, int index, uint32_t val)
 {
     s->mac_reg[index] = val;
     s->mac_reg[TDT] &= 0xffff;
+    qemu_bh_schedule(s->tx_bh);
+}
+
+static void
+e1000_tx_bh(void *opaque)
+{
+    E1000State *s = opaque;
+
+    /* Picked up again by e1000_vm_state_change() when the VM resumes */
+    if (!runstate_is_running()) {
+        return;
+    }
     start_xmit(s);
 }
 
+static void
+e1000_vm_state_change(void *opaque, int running, RunState state)
+{
+    E1000State *s = opaque;
+
+    if (running) {
+        qemu_bh_schedule(s->tx_bh);
+    }
+}
+
 static void
 set_icr(E1000State *s, int index, uint32_t val)
 {
@@ -1018,7 +1270,8 @@ static uint32_t (*macreg_readops[])(E1000State *, int) = {
     getreg(TORL),	getreg(TOTL),	getreg(IMS),	getreg(TCTL),
     getreg(RDH),	getreg(RDT),	getreg(VET),	getreg(ICS),
     getreg(TDBAL),	getreg(TDBAH),	getreg(RDBAH),	getreg(RDBAL),
-    getreg(TDLEN),	getreg(RDLEN),
+    getreg(TDLEN),	getreg(RDLEN),	getreg(RDTR),	getreg(RADV),
+    getreg(TIDV),	getreg(TADV),	getreg(ITR),
 
     [TOTH] = mac_read_clr8,	[TORH] = mac_read_clr8,	[GPRC] = mac_read_clr4,
     [GPTC] = mac_read_clr4,	[TPR] = mac_read_clr4,	[TPT] = mac_read_clr4,
@@ -1040,6 +1293,8 @@ static void (*macreg_writeops[])(E1000State *, int, uint32_t) = {
     [TDH] = set_16bit,	[RDH] = set_16bit,	[RDT] = set_rdt,
     [IMC] = set_imc,	[IMS] = set_ims,	[ICR] = set_icr,
     [EECD] = set_eecd,	[RCTL] = set_rx_control, [CTRL] = set_ctrl,
+    [RDTR] = set_rdtr,	[TIDV] = set_tidv,	[RADV] = set_16bit,
+    [TADV] = set_16bit,	[ITR] = set_16bit,
     [RA ... RA+31] = &mac_writereg,
     [MTA ... MTA+127] = &mac_writereg,
     [VFTA ... VFTA+127] = &mac_writereg,
@@ -1130,6 +1385,14 @@ static void e1000_pre_save(void *opaque)
         s->phy_reg[PHY_CTRL] & MII_CR_RESTART_AUTO_NEG) {
          s->phy_reg[PHY_STATUS] |= MII_SR_AUTONEG_COMPLETE;
     }
+
+    /* The moderation timers are not migrated, deliver what they hold */
+    e1000_mit_flush(s, true, true);
+    if (s->mit_itr_end) {
+        s->mit_itr_end = 0;
+        set_ics(s, 0, 0);
+        e1000_mit_rearm(s);
+    }
 }
 
 static int e1000_post_load(void *opaque, int version_id)
@@ -1141,6 +1404,7 @@ static int e1000_post_load(void *opaque, int version_id)
      * to link status bit in mac_reg[STATUS].
      * Alternatively, restart link negotiation if it was in progress. */
     nc->link_down = (s->mac_reg[STATUS] & E1000_STATUS_LU) == 0;
+    s->mit_irq_level = (s->mac_reg[IMS] & s->mac_reg[ICR]) != 0;
     if (s->phy_reg[PHY_CTRL] & MII_CR_AUTO_NEG_EN &&
         s->phy_reg[PHY_CTRL] & MII_CR_RESTART_AUTO_NEG &&
         !(s->phy_reg[PHY_STATUS] & MII_SR_AUTONEG_COMPLETE)) {
@@ -1151,6 +1415,28 @@ static int e1000_post_load(void *opaque, int version_id)
     return 0;
 }
 
+static bool e1000_mit_state_needed(void *opaque)
+{
+    E1000State *s = opaque;
+
+    return s->compat_flags & E1000_FLAG_MIT;
+}
+
+static const VMStateDescription vmstate_e1000_mit_state = {
+    .name = "e1000/mit_state",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .minimum_version_id_old = 1,
+    .fields    = (VMStateField[]) {
+        VMSTATE_UINT32(mac_reg[RDTR], E1000State),
+        VMSTATE_UINT32(mac_reg[RADV], E1000State),
+        VMSTATE_UINT32(mac_reg[TIDV], E1000State),
+        VMSTATE_UINT32(mac_reg[TADV], E1000State),
+        VMSTATE_UINT32(mac_reg[ITR], E1000State),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static const VMStateDescription vmstate_e1000 = {
     .name = "e1000",
     .version_id = 2,
@@ -1228,6 +1514,14 @@ static const VMStateDescription vmstate_e1000 = {
         VMSTATE_UINT32_SUB_ARRAY(mac_reg, E1000State, MTA, 128),
         VMSTATE_UINT32_SUB_ARRAY(mac_reg, E1000State, VFTA, 128),
         VMSTATE_END_OF_LIST()
+    },
+    .subsections = (VMStateSubsection[]) {
+        {
+            .vmsd = &vmstate_e1000_mit_state,
+            .needed = e1000_mit_state_needed,
+        }, {
+            /* empty */
+        }
     }
 };
 
@@ -1277,6 +1571,10 @@ pci_e1000_uninit(PCIDevice *dev)
 
     qemu_del_timer(d->autoneg_timer);
     qemu_free_timer(d->autoneg_timer);
+    qemu_del_timer(d->mit_timer);
+    qemu_free_timer(d->mit_timer);
+    qemu_bh_delete(d->tx_bh);
+    qemu_del_vm_change_state_handler(d->vmstate);
     memory_region_destroy(&d->mmio);
     memory_region_destroy(&d->io);
     qemu_del_nic(d->nic);
@@ -1287,6 +1585,7 @@ static NetClientInfo net_e1000_info = {
     .size = sizeof(NICState),
     .can_receive = e1000_can_receive,
     .receive = e1000_receive,
+    .receive_batch = e1000_receive_batch,
     .cleanup = e1000_cleanup,
     .link_status_changed = e1000_set_link_status,
 };
@@ -1331,6 +1630,9 @@ static int pci_e1000_init(PCIDevice *pci_dev)
     add_boot_device_path(d->conf.bootindex, &pci_dev->qdev, "/ethernet-phy@0");
 
     d->autoneg_timer = qemu_new_timer_ms(vm_clock, e1000_autoneg_timer, d);
+    d->mit_timer = qemu_new_timer_ns(vm_clock, e1000_mit_timer, d);
+    d->tx_bh = qemu_bh_new(e1000_tx_bh, d);
+    d->vmstate = qemu_add_vm_change_state_handler(e1000_vm_state_change, d);
 
     return 0;
 }
@@ -1343,6 +1645,8 @@ static void qdev_e1000_reset(DeviceState *dev)
 
 static Property e1000_properties[] = {
     DEFINE_NIC_PROPERTIES(E1000State, conf),
+    DEFINE_PROP_BIT("mitigation", E1000State,
+                    compat_flags, E1000_FLAG_MIT_BIT, true),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -696,6 +696,11 @@
 #define E1000_EEPROM_CFG_DONE         0x00040000   /* MNG config cycle done */
 #define E1000_EEPROM_CFG_DONE_PORT_1  0x00080000   /* ...for second port */
 
+/* Interrupt Delay Timer (RDTR, TIDV) bit definitions */
+#define E1000_RDT_DELAY      0x0000FFFF /* Delay timer (1=1.024us) */
+#define E1000_RDT_FPDB       0x80000000 /* Flush descriptor block */
+#define E1000_TIDV_FPD       0x80000000 /* Flush partial descriptor block */
+
 /* Transmit Descriptor */
 struct e1000_tx_desc {
     uint64_t buffer_addr;       /* Address of the descriptor's data buffer */
@@ -29,9 +29,13 @@
 #include "trace.h"
 #include "qemu/error-report.h"
 #include "qemu/config-file.h"
+#include "qemu/bitops.h"
 
 #define FW_CFG_SIZE 2
 #define FW_CFG_DATA_SIZE 1
+#define FW_CFG_DMA_SIZE 8
+
+#define FW_CFG_DMA_ENABLED_BIT 0
 
 typedef struct FWCfgEntry {
     uint32_t len;
@@ -43,11 +47,14 @@ typedef struct FWCfgEntry {
 struct FWCfgState {
     SysBusDevice busdev;
     MemoryRegion ctl_iomem, data_iomem, comb_iomem;
-    uint32_t ctl_iobase, data_iobase;
+    MemoryRegion dma_iomem;
+    uint32_t ctl_iobase, data_iobase, dma_iobase;
+    uint32_t flags;
     FWCfgEntry entries[2][FW_CFG_MAX_ENTRY];
     FWCfgFiles *files;
     uint16_t cur_entry;
     uint32_t cur_offset;
+    uint64_t dma_addr;
     Notifier machine_ready;
 };
 
@@ -249,6 +256,110 @@ static uint8_t fw_cfg_read(FWCfgState *s)
     return ret;
 }
 
+static bool fw_cfg_dma_enabled(FWCfgState *s)
+{
+    return (s->flags & (1 << FW_CFG_DMA_ENABLED_BIT)) && s->dma_iobase;
+}
+
+/*
+ * Copy (or skip) a whole item at once, instead of one byte per exit of
+ * the data register.  Like the data register, reads past the end of the
+ * item return zeroes.
+ */
+static void fw_cfg_dma_transfer(FWCfgState *s)
+{
+    static const uint8_t zero[256];
+    FWCfgDmaAccess dma;
+    FWCfgEntry *e;
+    hwaddr dma_addr;
+    uint32_t len;
+    bool read;
+    int arch;
+
+    /* The next access starts over from the high half */
+    dma_addr = s->dma_addr;
+    s->dma_addr = 0;
+
+    cpu_physical_memory_read(dma_addr, &dma, sizeof(dma));
+    dma.control = be32_to_cpu(dma.control);
+    dma.length = be32_to_cpu(dma.length);
+    dma.address = be64_to_cpu(dma.address);
+
+    trace_fw_cfg_dma_transfer(s, dma_addr, dma.control, dma.length,
+                              dma.address);
+
+    if (dma.control & FW_CFG_DMA_CTL_SELECT) {
+        fw_cfg_select(s, dma.control >> 16);
+    }
+
+    arch = !!(s->cur_entry & FW_CFG_ARCH_LOCAL);
+    e = &s->entries[arch][s->cur_entry & FW_CFG_ENTRY_MASK];
+
+    if (dma.control & FW_CFG_DMA_CTL_READ) {
+        read = true;
+    } else if (dma.control & FW_CFG_DMA_CTL_SKIP) {
+        read = false;
+    } else {
+        /* Writes go through the data register only */
+        read = false;
+        dma.length = 0;
+    }
+
+    while (dma.length > 0) {
+        if (s->cur_entry == FW_CFG_INVALID || !e->data ||
+            s->cur_offset >= e->len) {
+            len = dma.length;
+            if (read) {
+                len = MIN(len, sizeof(zero));
+                cpu_physical_memory_write(dma.address, zero, len);
+            }
+        } else {
+            len = MIN(dma.length, e->len - s->cur_offset);
+            if (read) {
+                cpu_physical_memory_write(dma.address,
+                                          &e->data[s->cur_offset], len);
+            }
+            s->cur_offset += len;
+        }
+
+        dma.address += len;
+        dma.length -= len;
+    }
+
+    stl_be_phys(dma_addr + offsetof(FWCfgDmaAccess, control), 0);
+}
+
+static uint64_t fw_cfg_dma_mem_read(void *opaque, hwaddr addr,
+                                    unsigned size)
+{
+    return extract64(FW_CFG_DMA_SIGNATURE, (8 - addr - size) * 8, size * 8);
+}
+
+static void fw_cfg_dma_mem_write(void *opaque, hwaddr addr,
+                                 uint64_t value, unsigned size)
+{
+    FWCfgState *s = opaque;
+
+    if (size == 4) {
+        if (addr == 0) {
+            s->dma_addr = value << 32;
+        } else {
+            s->dma_addr |= value;
+            fw_cfg_dma_transfer(s);
+        }
+    } else {
+        s->dma_addr = value;
+        fw_cfg_dma_transfer(s);
+    }
+}
+
+static bool fw_cfg_dma_mem_valid(void *opaque, hwaddr addr,
+                                 unsigned size, bool is_write)
+{
+    return !is_write || (addr == 0 && (size == 4 || size == 8)) ||
+           (addr == 4 && size == 4);
+}
+
 static uint64_t fw_cfg_data_mem_read(void *opaque, hwaddr addr,
                                      unsigned size)
 {
@@ -321,11 +432,21 @@ static const MemoryRegionOps fw_cfg_comb_mem_ops = {
     .valid.accepts = fw_cfg_comb_valid,
 };
 
+static const MemoryRegionOps fw_cfg_dma_mem_ops = {
+    .read = fw_cfg_dma_mem_read,
+    .write = fw_cfg_dma_mem_write,
+    .endianness = DEVICE_BIG_ENDIAN,
+    .valid.accepts = fw_cfg_dma_mem_valid,
+    .valid.max_access_size = 8,
+    .impl.max_access_size = 8,
+};
+
 static void fw_cfg_reset(DeviceState *d)
 {
     FWCfgState *s = DO_UPCAST(FWCfgState, busdev.qdev, d);
 
     fw_cfg_select(s, 0);
+    s->dma_addr = 0;
 }
 
 /* Save restore 32 bit int as uint16_t
@@ -361,6 +482,24 @@ static bool is_version_1(void *opaque, int version_id)
     return version_id == 1;
 }
 
+static bool fw_cfg_dma_addr_needed(void *opaque)
+{
+    FWCfgState *s = opaque;
+
+    return s->dma_addr != 0;
+}
+
+static const VMStateDescription vmstate_fw_cfg_dma = {
+    .name = "fw_cfg/dma",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .minimum_version_id_old = 1,
+    .fields      = (VMStateField []) {
+        VMSTATE_UINT64(dma_addr, FWCfgState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static const VMStateDescription vmstate_fw_cfg = {
     .name = "fw_cfg",
     .version_id = 2,
@@ -371,6 +510,14 @@ static const VMStateDescription vmstate_fw_cfg = {
         VMSTATE_UINT16_HACK(cur_offset, FWCfgState, is_version_1),
         VMSTATE_UINT32_V(cur_offset, FWCfgState, 2),
         VMSTATE_END_OF_LIST()
+    },
+    .subsections = (VMStateSubsection []) {
+        {
+            .vmsd = &vmstate_fw_cfg_dma,
+            .needed = fw_cfg_dma_addr_needed,
+        } , {
+            /* empty */
+        }
     }
 };
 
@@ -479,16 +626,19 @@ static void fw_cfg_machine_ready(struct Notifier *n, void *data)
     fw_cfg_add_file(s, "bootorder", (uint8_t*)bootindex, len);
 }
 
-FWCfgState *fw_cfg_init(uint32_t ctl_port, uint32_t data_port,
-                        hwaddr ctl_addr, hwaddr data_addr)
+static FWCfgState *fw_cfg_init1_dma(uint32_t ctl_port, uint32_t data_port,
+                                   uint32_t dma_port, hwaddr ctl_addr,
+                                   hwaddr data_addr)
 {
     DeviceState *dev;
     SysBusDevice *d;
     FWCfgState *s;
+    uint32_t version = FW_CFG_VERSION;
 
     dev = qdev_create(NULL, "fw_cfg");
     qdev_prop_set_uint32(dev, "ctl_iobase", ctl_port);
     qdev_prop_set_uint32(dev, "data_iobase", data_port);
+    qdev_prop_set_uint32(dev, "dma_iobase", dma_port);
     qdev_init_nofail(dev);
     d = SYS_BUS_DEVICE(dev);
 
@@ -500,7 +650,11 @@ FWCfgState *fw_cfg_init(uint32_t ctl_port, uint32_t data_port,
     if (data_addr) {
         sysbus_mmio_map(d, 1, data_addr);
     }
+    if (fw_cfg_dma_enabled(s)) {
+        version |= FW_CFG_VERSION_DMA;
+    }
     fw_cfg_add_bytes(s, FW_CFG_SIGNATURE, (char *)"QEMU", 4);
+    fw_cfg_add_i32(s, FW_CFG_ID, version);
     fw_cfg_add_bytes(s, FW_CFG_UUID, qemu_uuid, 16);
     fw_cfg_add_i16(s, FW_CFG_NOGRAPHIC, (uint16_t)(display_type == DT_NOGRAPHIC));
     fw_cfg_add_i16(s, FW_CFG_NB_CPUS, (uint16_t)smp_cpus);
@@ -514,6 +668,22 @@ FWCfgState *fw_cfg_init(uint32_t ctl_port, uint32_t data_port,
     return s;
 }
 
+FWCfgState *fw_cfg_init(uint32_t ctl_port, uint32_t data_port,
+                        hwaddr ctl_addr, hwaddr data_addr)
+{
+    return fw_cfg_init1_dma(ctl_port, data_port, 0, ctl_addr, data_addr);
+}
+
+/*
+ * Like fw_cfg_init() with I/O ports, plus the 8 byte DMA address register
+ * at @dma_port.  Guests find out whether it is there from FW_CFG_ID.
+ */
+FWCfgState *fw_cfg_init_dma(uint32_t ctl_port, uint32_t data_port,
+                            uint32_t dma_port)
+{
+    return fw_cfg_init1_dma(ctl_port, data_port, dma_port, 0, 0);
+}
+
 static int fw_cfg_init1(SysBusDevice *dev)
 {
     FWCfgState *s = FROM_SYSBUS(FWCfgState, dev);
@@ -538,12 +708,21 @@ static int fw_cfg_init1(SysBusDevice *dev)
             sysbus_add_io(dev, s->data_iobase, &s->data_iomem);
         }
     }
+
+    if (fw_cfg_dma_enabled(s)) {
+        memory_region_init_io(&s->dma_iomem, &fw_cfg_dma_mem_ops, s,
+                              "fwcfg.dma", FW_CFG_DMA_SIZE);
+        sysbus_add_io(dev, s->dma_iobase, &s->dma_iomem);
+    }
     return 0;
 }
 
 static Property fw_cfg_properties[] = {
     DEFINE_PROP_HEX32("ctl_iobase", FWCfgState, ctl_iobase, -1),
     DEFINE_PROP_HEX32("data_iobase", FWCfgState, data_iobase, -1),
+    DEFINE_PROP_HEX32("dma_iobase", FWCfgState, dma_iobase, 0),
+    DEFINE_PROP_BIT("dma_enabled", FWCfgState, flags,
+                    FW_CFG_DMA_ENABLED_BIT, true),
     DEFINE_PROP_END_OF_LIST(),
 };
 
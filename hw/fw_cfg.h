@@ -38,6 +38,19 @@
 
 #define FW_CFG_INVALID          0xffff
 
+/* FW_CFG_ID bits */
+#define FW_CFG_VERSION          0x01
+#define FW_CFG_VERSION_DMA      0x02
+
+/* FWCfgDmaAccess control bits */
+#define FW_CFG_DMA_CTL_ERROR    0x01
+#define FW_CFG_DMA_CTL_READ     0x02
+#define FW_CFG_DMA_CTL_SKIP     0x04
+#define FW_CFG_DMA_CTL_SELECT   0x08
+
+/* What the DMA address register reads as, big-endian */
+#define FW_CFG_DMA_SIGNATURE    0x51454d5520434647ULL /* "QEMU CFG" */
+
 #ifndef NO_QEMU_PROTOS
 typedef struct FWCfgFile {
     uint32_t  size;        /* file size */
@@ -51,6 +64,18 @@ typedef struct FWCfgFiles {
     FWCfgFile f[];
 } FWCfgFiles;
 
+/*
+ * The guest writes the physical address of one of these, big-endian, to
+ * the DMA address register: the high 32 bits first, then the low 32 bits,
+ * which start the transfer.  When it is done, the control field is zero,
+ * or has FW_CFG_DMA_CTL_ERROR set.  All fields are big-endian.
+ */
+typedef struct FWCfgDmaAccess {
+    uint32_t control;
+    uint32_t length;
+    uint64_t address;
+} QEMU_PACKED FWCfgDmaAccess;
+
 typedef void (*FWCfgCallback)(void *opaque, uint8_t *data);
 
 typedef struct FWCfgState FWCfgState;
@@ -65,6 +90,8 @@ void fw_cfg_add_file(FWCfgState *s, const char *filename, void *data,
                      size_t len);
 FWCfgState *fw_cfg_init(uint32_t ctl_port, uint32_t data_port,
                         hwaddr crl_addr, hwaddr data_addr);
+FWCfgState *fw_cfg_init_dma(uint32_t ctl_port, uint32_t data_port,
+                            uint32_t dma_port);
 
 #endif /* NO_QEMU_PROTOS */
 
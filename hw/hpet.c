@@ -28,6 +28,7 @@
 #include "pc.h"
 #include "ui/console.h"
 #include "qemu/timer.h"
+#include "qemu/atomic.h"
 #include "hpet_emul.h"
 #include "sysbus.h"
 #include "mc146818rtc.h"
@@ -61,6 +62,7 @@ typedef struct HPETTimer {  /* timers */
 typedef struct HPETState {
     SysBusDevice busdev;
     MemoryRegion iomem;
+    MemoryRegion counter_iomem;
     uint64_t hpet_offset;
     qemu_irq irqs[HPET_NUM_IRQ_ROUTES];
     uint32_t flags;
@@ -557,11 +559,21 @@ static void hpet_ram_write(void *opaque, hwaddr addr,
             return;
         case HPET_CFG:
             val = hpet_fixup_reg(new_val, old_val, HPET_CFG_WRITE_MASK);
-            s->config = (s->config & 0xffffffff00000000ULL) | val;
+            /*
+             * hpet_counter_read() runs without the iothread lock and picks
+             * hpet_offset or hpet_counter by the enable bit, so the one it
+             * will use has to be in place before the bit flips.
+             */
             if (activating_bit(old_val, new_val, HPET_CFG_ENABLE)) {
-                /* Enable main counter and interrupt generation. */
                 s->hpet_offset =
                     ticks_to_ns(s->hpet_counter) - qemu_get_clock_ns(vm_clock);
+            } else if (deactivating_bit(old_val, new_val, HPET_CFG_ENABLE)) {
+                s->hpet_counter = hpet_get_ticks(s);
+            }
+            smp_wmb();
+            s->config = (s->config & 0xffffffff00000000ULL) | val;
+            if (activating_bit(old_val, new_val, HPET_CFG_ENABLE)) {
+                /* Enable main counter and interrupt generation. */
                 for (i = 0; i < s->num_timers; i++) {
                     if ((&s->timer[i])->cmp != ~0ULL) {
                         hpet_set_timer(&s->timer[i]);
@@ -569,7 +581,6 @@ static void hpet_ram_write(void *opaque, hwaddr addr,
                 }
             } else if (deactivating_bit(old_val, new_val, HPET_CFG_ENABLE)) {
                 /* Halt main counter and disable interrupt generation. */
-                s->hpet_counter = hpet_get_ticks(s);
                 for (i = 0; i < s->num_timers; i++) {
                     hpet_del_timer(&s->timer[i]);
                 }
@@ -632,6 +643,44 @@ static const MemoryRegionOps hpet_ram_ops = {
     .endianness = DEVICE_NATIVE_ENDIAN,
 };
 
+/*
+ * The main counter has its own region so that guests polling it do not
+ * serialize on the iothread lock.  Writes only land in hpet_counter, which
+ * guests program while the counter is halted.
+ */
+static uint64_t hpet_counter_read(void *opaque, hwaddr addr, unsigned size)
+{
+    HPETState *s = opaque;
+    uint64_t cur_tick;
+
+    if (atomic_read(&s->config) & HPET_CFG_ENABLE) {
+        smp_rmb();
+        cur_tick = hpet_get_ticks(s);
+    } else {
+        smp_rmb();
+        cur_tick = s->hpet_counter;
+    }
+    DPRINTF("qemu: reading counter + %d = %" PRIx64 "\n", (int)addr, cur_tick);
+    return addr ? cur_tick >> 32 : cur_tick;
+}
+
+static void hpet_counter_write(void *opaque, hwaddr addr,
+                               uint64_t value, unsigned size)
+{
+    hpet_ram_write(opaque, HPET_COUNTER + addr, value, size);
+}
+
+static const MemoryRegionOps hpet_counter_ops = {
+    .read = hpet_counter_read,
+    .write = hpet_counter_write,
+    .valid = {
+        .min_access_size = 4,
+        .max_access_size = 4,
+    },
+    .endianness = DEVICE_NATIVE_ENDIAN,
+    .thread_safe = true,
+};
+
 static void hpet_reset(DeviceState *d)
 {
     HPETState *s = FROM_SYSBUS(HPETState, SYS_BUS_DEVICE(d));
@@ -709,6 +758,7 @@ static int hpet_init(SysBusDevice *dev)
     for (i = 0; i < HPET_MAX_TIMERS; i++) {
         timer = &s->timer[i];
         timer->qemu_timer = qemu_new_timer_ns(vm_clock, hpet_timer, timer);
+        qemu_timer_set_name(timer->qemu_timer, "hpet");
         timer->tn = i;
         timer->state = s;
     }
@@ -723,6 +773,9 @@ static int hpet_init(SysBusDevice *dev)
 
     /* HPET Area */
     memory_region_init_io(&s->iomem, &hpet_ram_ops, s, "hpet", 0x400);
+    memory_region_init_io(&s->counter_iomem, &hpet_counter_ops, s,
+                          "hpet-counter", 8);
+    memory_region_add_subregion(&s->iomem, HPET_COUNTER, &s->counter_iomem);
     sysbus_init_mmio(dev, &s->iomem);
     return 0;
 }
@@ -30,6 +30,7 @@
 #include "monitor/monitor.h"
 #include "sysemu/dma.h"
 #include "exec/cpu-common.h"
+#include "qemu/host-utils.h"
 #include "internal.h"
 #include <hw/ide/pci.h>
 #include <hw/ide/ahci.h>
@@ -45,6 +46,7 @@ do { fprintf(stderr, "ahci: %s: [%d] ", __FUNCTION__, port); \
 #endif
 
 static void check_cmd(AHCIState *s, int port);
+static void ahci_submit_ncq(AHCIDevice *ad);
 static int handle_cmd(AHCIState *s,int port,int slot);
 static void ahci_reset_port(AHCIState *s, int port);
 static void ahci_write_fis_d2h(AHCIDevice *ad, uint8_t *cmd_fis);
@@ -140,6 +142,17 @@ static void ahci_irq_lower(AHCIState *s, AHCIDevice *dev)
     }
 }
 
+/* Command completions that are coalesced on ports in CCC_PORTS */
+#define AHCI_CCC_IRQ_MASK (PORT_IRQ_STAT_DHRS | PORT_IRQ_STAT_PSS | \
+                           PORT_IRQ_STAT_DSS | PORT_IRQ_STAT_SDBS | \
+                           PORT_IRQ_STAT_DPS)
+
+static bool ahci_ccc_port(AHCIState *s, int port)
+{
+    return (s->control_regs.ccc_ctl & HOST_CCC_CTL_EN) &&
+           (s->control_regs.ccc_ports & (1 << port));
+}
+
 static void ahci_check_irq(AHCIState *s)
 {
     int i;
@@ -149,10 +162,19 @@ static void ahci_check_irq(AHCIState *s)
     s->control_regs.irqstatus = 0;
     for (i = 0; i < s->ports; i++) {
         AHCIPortRegs *pr = &s->dev[i].port_regs;
-        if (pr->irq_stat & pr->irq_mask) {
+        uint32_t stat = pr->irq_stat & pr->irq_mask;
+
+        if (ahci_ccc_port(s, i)) {
+            stat &= ~AHCI_CCC_IRQ_MASK;
+        }
+        if (stat) {
             s->control_regs.irqstatus |= (1 << i);
         }
     }
+    if (s->ccc_irq) {
+        s->control_regs.irqstatus |=
+            (1 << HOST_CCC_CTL_INT(s->control_regs.ccc_ctl));
+    }
 
     if (s->control_regs.irqstatus &&
         (s->control_regs.ghc & HOST_CTL_IRQ_EN)) {
@@ -172,6 +194,77 @@ static void ahci_trigger_irq(AHCIState *s, AHCIDevice *d,
     ahci_check_irq(s);
 }
 
+static void ahci_ccc_fire(AHCIState *s)
+{
+    s->ccc_count = 0;
+    qemu_del_timer(s->ccc_timer);
+    s->ccc_irq = true;
+    ahci_check_irq(s);
+}
+
+static void ahci_ccc_timer(void *opaque)
+{
+    ahci_ccc_fire(opaque);
+}
+
+/*
+ * Count @n command completions on @port.  CCC_CTL.INT is raised after
+ * CCC_CTL.CC completions, or CCC_CTL.TV milliseconds after the first one,
+ * whichever comes first.  A zero CC disables the count.
+ */
+static void ahci_ccc_complete(AHCIState *s, int port, int n)
+{
+    uint32_t ctl = s->control_regs.ccc_ctl;
+
+    if (!ahci_ccc_port(s, port)) {
+        return;
+    }
+
+    s->ccc_count += n;
+    if ((HOST_CCC_CTL_CC(ctl) && s->ccc_count >= HOST_CCC_CTL_CC(ctl)) ||
+        !HOST_CCC_CTL_TV(ctl)) {
+        ahci_ccc_fire(s);
+    } else if (!qemu_timer_pending(s->ccc_timer)) {
+        qemu_mod_timer(s->ccc_timer,
+                       qemu_get_clock_ms(vm_clock) + HOST_CCC_CTL_TV(ctl));
+    }
+}
+
+static void ahci_ccc_reset(AHCIState *s)
+{
+    /* INT is the first interrupt after the ports, CC and TV default to 1 */
+    s->control_regs.ccc_ctl = (1 << 16) | (1 << 8) | (s->ports << 3);
+    s->control_regs.ccc_ports = 0;
+    s->ccc_count = 0;
+    s->ccc_irq = false;
+    if (s->ccc_timer) {
+        qemu_del_timer(s->ccc_timer);
+    }
+}
+
+static void ahci_write_ccc_ctl(AHCIState *s, uint32_t val)
+{
+    uint32_t ctl = s->control_regs.ccc_ctl;
+
+    if (!(s->control_regs.cap & HOST_CAP_CCCS)) {
+        return;
+    }
+
+    /* TV and CC may only change while coalescing is disabled */
+    if (ctl & HOST_CCC_CTL_EN) {
+        ctl = (ctl & ~HOST_CCC_CTL_EN) | (val & HOST_CCC_CTL_EN);
+    } else {
+        ctl = (val & 0xffffff01) | (ctl & 0xf8);
+    }
+    s->control_regs.ccc_ctl = ctl;
+
+    if (!(ctl & HOST_CCC_CTL_EN)) {
+        s->ccc_count = 0;
+        qemu_del_timer(s->ccc_timer);
+    }
+    ahci_check_irq(s);
+}
+
 static void map_page(uint8_t **ptr, uint64_t addr, uint32_t wanted)
 {
     hwaddr len = wanted;
@@ -302,6 +395,12 @@ static uint64_t ahci_mem_read(void *opaque, hwaddr addr,
         case HOST_VERSION:
             val = s->control_regs.version;
             break;
+        case HOST_CCC_CTL:
+            val = s->control_regs.ccc_ctl;
+            break;
+        case HOST_CCC_PORTS:
+            val = s->control_regs.ccc_ports;
+            break;
         }
 
         DPRINTF(-1, "(addr 0x%08X), val 0x%08X\n", (unsigned) addr, val);
@@ -347,6 +446,9 @@ static void ahci_mem_write(void *opaque, hwaddr addr,
                 break;
             case HOST_IRQ_STAT: /* R/WC, RO */
                 s->control_regs.irqstatus &= ~val;
+                if (val & (1 << HOST_CCC_CTL_INT(s->control_regs.ccc_ctl))) {
+                    s->ccc_irq = false;
+                }
                 ahci_check_irq(s);
                 break;
             case HOST_PORTS_IMPL: /* R/WO, RO */
@@ -355,6 +457,13 @@ static void ahci_mem_write(void *opaque, hwaddr addr,
             case HOST_VERSION: /* RO */
                 /* FIXME report write? */
                 break;
+            case HOST_CCC_CTL: /* R/W */
+                ahci_write_ccc_ctl(s, val);
+                break;
+            case HOST_CCC_PORTS: /* R/W */
+                s->control_regs.ccc_ports = val & s->control_regs.impl;
+                ahci_check_irq(s);
+                break;
             default:
                 DPRINTF(-1, "write to unknown register 0x%x\n", (unsigned)addr);
         }
@@ -418,6 +527,10 @@ static void ahci_reg_init(AHCIState *s)
                           (AHCI_NUM_COMMAND_SLOTS << 8) |
                           (AHCI_SUPPORTED_SPEED_GEN1 << AHCI_SUPPORTED_SPEED) |
                           HOST_CAP_NCQ | HOST_CAP_AHCI;
+    /* the coalescing interrupt needs a free bit in HOST_IRQ_STAT */
+    if (s->ports < AHCI_MAX_PORTS) {
+        s->control_regs.cap |= HOST_CAP_CCCS;
+    }
 
     s->control_regs.impl = (1 << s->ports) - 1;
 
@@ -428,9 +541,15 @@ static void ahci_reg_init(AHCIState *s)
     }
 }
 
+/*
+ * Handle all slots set in PxCI in one pass.  NCQ commands are only parsed
+ * by handle_cmd() and submitted together afterwards, with the block layer
+ * plugged.
+ */
 static void check_cmd(AHCIState *s, int port)
 {
     AHCIPortRegs *pr = &s->dev[port].port_regs;
+    BlockDriverState *bs = s->dev[port].port.ifs[0].bs;
     int slot;
 
     if ((pr->cmd & PORT_CMD_START) && pr->cmd_issue) {
@@ -441,6 +560,12 @@ static void check_cmd(AHCIState *s, int port)
             }
         }
     }
+
+    if (s->dev[port].ncq_pending && bs) {
+        bdrv_io_plug(bs);
+        ahci_submit_ncq(&s->dev[port]);
+        bdrv_io_unplug(bs);
+    }
 }
 
 static void ahci_check_cmd_bh(void *opaque)
@@ -495,6 +620,7 @@ static void ahci_reset_port(AHCIState *s, int port)
     pr->scr_act = 0;
     d->busy_slot = -1;
     d->init_d2h_sent = false;
+    d->ncq_pending = 0;
 
     ide_state = &s->dev[port].port.ifs[0];
     if (!ide_state->bs) {
@@ -522,6 +648,13 @@ static void ahci_reset_port(AHCIState *s, int port)
         ncq_tfs->used = 0;
     }
 
+    /* Drop completions that cancelled requests may have queued */
+    d->ncq_done = 0;
+    d->ncq_err = false;
+    if (d->sdb_bh) {
+        qemu_bh_cancel(d->sdb_bh);
+    }
+
     s->dev[port].port_state = STATE_RUN;
     if (!ide_state->bs) {
         s->dev[port].port_regs.sig = 0;
@@ -581,6 +714,7 @@ static void ahci_write_fis_sdb(AHCIState *s, int port, uint32_t finished)
     *(uint32_t*)(sdb_fis + 4) = cpu_to_le32(s->dev[port].finished);
 
     ahci_trigger_irq(s, &s->dev[port], PORT_IRQ_STAT_SDBS);
+    ahci_ccc_complete(s, port, ctpop32(finished));
 }
 
 static void ahci_write_fis_d2h(AHCIDevice *ad, uint8_t *cmd_fis)
@@ -629,6 +763,9 @@ static void ahci_write_fis_d2h(AHCIDevice *ad, uint8_t *cmd_fis)
     }
 
     ahci_trigger_irq(ad->hba, ad, PORT_IRQ_D2H_REG_FIS);
+    if (cmd_mapped) {
+        ahci_ccc_complete(ad->hba, ad->port_no, 1);
+    }
 
     if (cmd_mapped) {
         dma_memory_unmap(ad->hba->dma, cmd_fis, cmd_len,
@@ -709,32 +846,135 @@ out:
     return r;
 }
 
-static void ncq_cb(void *opaque, int ret)
+/*
+ * Report all NCQ commands that finished since the last call in a single
+ * Set Device Bits FIS, so that completions landing in the same main loop
+ * iteration raise one interrupt.
+ */
+static void ahci_flush_ncq_completions(AHCIDevice *ad)
 {
-    NCQTransferState *ncq_tfs = (NCQTransferState *)opaque;
-    IDEState *ide_state = &ncq_tfs->drive->port.ifs[0];
+    IDEState *ide_state = &ad->port.ifs[0];
+    uint32_t done = ad->ncq_done;
 
-    /* Clear bit for this tag in SActive */
-    ncq_tfs->drive->port_regs.scr_act &= ~(1 << ncq_tfs->tag);
+    if (!done) {
+        return;
+    }
 
-    if (ret < 0) {
-        /* error */
+    /* Clear bits for these tags in SActive */
+    ad->port_regs.scr_act &= ~done;
+
+    if (ad->ncq_err) {
         ide_state->error = ABRT_ERR;
         ide_state->status = READY_STAT | ERR_STAT;
-        ncq_tfs->drive->port_regs.scr_err |= (1 << ncq_tfs->tag);
     } else {
         ide_state->status = READY_STAT | SEEK_STAT;
     }
+    ad->ncq_done = 0;
+    ad->ncq_err = false;
+
+    ahci_write_fis_sdb(ad->hba, ad->port_no, done);
+}
+
+static void ahci_sdb_bh(void *opaque)
+{
+    ahci_flush_ncq_completions(opaque);
+}
+
+static void ncq_cb(void *opaque, int ret)
+{
+    NCQTransferState *ncq_tfs = (NCQTransferState *)opaque;
+    AHCIDevice *ad = ncq_tfs->drive;
+    uint32_t merged = ncq_tfs->merged;
+    int tag;
+
+    bdrv_acct_done(ad->port.ifs[0].bs, &ncq_tfs->acct);
+    ncq_tfs->aiocb = NULL;
+
+    for (tag = 0; tag < AHCI_MAX_CMDS; tag++) {
+        if (!(merged & (1U << tag))) {
+            continue;
+        }
+        if (ret < 0) {
+            ad->port_regs.scr_err |= (1U << tag);
+        }
+        DPRINTF(ad->port_no, "NCQ transfer tag %d finished\n", tag);
+        qemu_sglist_destroy(&ad->ncq_tfs[tag].sglist);
+        ad->ncq_tfs[tag].used = 0;
+    }
+
+    if (ret < 0) {
+        ad->ncq_err = true;
+    }
+    ad->ncq_done |= merged;
+    qemu_bh_schedule(ad->sdb_bh);
+}
+
+static void ahci_start_ncq(NCQTransferState *ncq_tfs)
+{
+    BlockDriverState *bs = ncq_tfs->drive->port.ifs[0].bs;
+
+    if (ncq_tfs->is_write) {
+        DPRINTF(ncq_tfs->drive->port_no, "tag %d aio write %"PRId64
+                " tags %#x\n", ncq_tfs->tag, ncq_tfs->lba, ncq_tfs->merged);
+        dma_acct_start(bs, &ncq_tfs->acct, &ncq_tfs->sglist, BDRV_ACCT_WRITE);
+        ncq_tfs->aiocb = dma_bdrv_write(bs, &ncq_tfs->sglist, ncq_tfs->lba,
+                                        ncq_cb, ncq_tfs);
+    } else {
+        DPRINTF(ncq_tfs->drive->port_no, "tag %d aio read %"PRId64
+                " tags %#x\n", ncq_tfs->tag, ncq_tfs->lba, ncq_tfs->merged);
+        dma_acct_start(bs, &ncq_tfs->acct, &ncq_tfs->sglist, BDRV_ACCT_READ);
+        ncq_tfs->aiocb = dma_bdrv_read(bs, &ncq_tfs->sglist, ncq_tfs->lba,
+                                       ncq_cb, ncq_tfs);
+    }
+}
+
+/*
+ * Submit the NCQ commands parsed by process_ncq_command().  They are
+ * sorted by LBA, and a command that continues the previous one in the
+ * same direction has its scatter/gather list appended to it, so the run
+ * goes out as a single request; the lead request completes all of them.
+ */
+static void ahci_submit_ncq(AHCIDevice *ad)
+{
+    NCQTransferState *lead, *next;
+    int tags[AHCI_MAX_CMDS];
+    int n = 0, i, j, k, t;
 
-    ahci_write_fis_sdb(ncq_tfs->drive->hba, ncq_tfs->drive->port_no,
-                       (1 << ncq_tfs->tag));
+    for (i = 0; i < AHCI_MAX_CMDS; i++) {
+        if (ad->ncq_pending & (1U << i)) {
+            tags[n++] = i;
+        }
+    }
+    ad->ncq_pending = 0;
 
-    DPRINTF(ncq_tfs->drive->port_no, "NCQ transfer tag %d finished\n",
-            ncq_tfs->tag);
+    for (i = 1; i < n; i++) {
+        t = tags[i];
+        for (j = i; j > 0 && ad->ncq_tfs[tags[j - 1]].lba > ad->ncq_tfs[t].lba;
+             j--) {
+            tags[j] = tags[j - 1];
+        }
+        tags[j] = t;
+    }
 
-    bdrv_acct_done(ncq_tfs->drive->port.ifs[0].bs, &ncq_tfs->acct);
-    qemu_sglist_destroy(&ncq_tfs->sglist);
-    ncq_tfs->used = 0;
+    for (i = 0; i < n; i = j) {
+        lead = &ad->ncq_tfs[tags[i]];
+        lead->merged = 1U << lead->tag;
+        for (j = i + 1; j < n; j++) {
+            next = &ad->ncq_tfs[tags[j]];
+            if (next->is_write != lead->is_write ||
+                lead->sglist.size % BDRV_SECTOR_SIZE ||
+                lead->lba + lead->sglist.size / BDRV_SECTOR_SIZE != next->lba ||
+                lead->sglist.nsg + next->sglist.nsg > IOV_MAX) {
+                break;
+            }
+            for (k = 0; k < next->sglist.nsg; k++) {
+                qemu_sglist_add(&lead->sglist, next->sglist.sg[k].base,
+                                next->sglist.sg[k].len);
+            }
+            lead->merged |= 1U << next->tag;
+        }
+        ahci_start_ncq(lead);
+    }
 }
 
 static void process_ncq_command(AHCIState *s, int port, uint8_t *cmd_fis,
@@ -778,32 +1018,19 @@ static void process_ncq_command(AHCIState *s, int port, uint8_t *cmd_fis,
             DPRINTF(port, "NCQ reading %d sectors from LBA %"PRId64", "
                     "tag %d\n",
                     ncq_tfs->sector_count-1, ncq_tfs->lba, ncq_tfs->tag);
-
-            DPRINTF(port, "tag %d aio read %"PRId64"\n",
-                    ncq_tfs->tag, ncq_tfs->lba);
-
-            dma_acct_start(ncq_tfs->drive->port.ifs[0].bs, &ncq_tfs->acct,
-                           &ncq_tfs->sglist, BDRV_ACCT_READ);
-            ncq_tfs->aiocb = dma_bdrv_read(ncq_tfs->drive->port.ifs[0].bs,
-                                           &ncq_tfs->sglist, ncq_tfs->lba,
-                                           ncq_cb, ncq_tfs);
+            ncq_tfs->is_write = false;
+            s->dev[port].ncq_pending |= 1U << tag;
             break;
         case WRITE_FPDMA_QUEUED:
             DPRINTF(port, "NCQ writing %d sectors to LBA %"PRId64", tag %d\n",
                     ncq_tfs->sector_count-1, ncq_tfs->lba, ncq_tfs->tag);
-
-            DPRINTF(port, "tag %d aio write %"PRId64"\n",
-                    ncq_tfs->tag, ncq_tfs->lba);
-
-            dma_acct_start(ncq_tfs->drive->port.ifs[0].bs, &ncq_tfs->acct,
-                           &ncq_tfs->sglist, BDRV_ACCT_WRITE);
-            ncq_tfs->aiocb = dma_bdrv_write(ncq_tfs->drive->port.ifs[0].bs,
-                                            &ncq_tfs->sglist, ncq_tfs->lba,
-                                            ncq_cb, ncq_tfs);
+            ncq_tfs->is_write = true;
+            s->dev[port].ncq_pending |= 1U << tag;
             break;
         default:
             DPRINTF(port, "error: tried to process non-NCQ command as NCQ\n");
             qemu_sglist_destroy(&ncq_tfs->sglist);
+            ncq_tfs->used = 0;
             break;
     }
 }
@@ -1171,11 +1398,21 @@ void ahci_init(AHCIState *s, DeviceState *qdev, DMAContext *dma, int ports)
         ad->port_no = i;
         ad->port.dma = &ad->dma;
         ad->port.dma->ops = &ahci_dma_ops;
+        ad->sdb_bh = qemu_bh_new(ahci_sdb_bh, ad);
     }
+
+    s->ccc_timer = qemu_new_timer_ms(vm_clock, ahci_ccc_timer, s);
 }
 
 void ahci_uninit(AHCIState *s)
 {
+    int i;
+
+    for (i = 0; i < s->ports; i++) {
+        qemu_bh_delete(s->dev[i].sdb_bh);
+    }
+    qemu_del_timer(s->ccc_timer);
+    qemu_free_timer(s->ccc_timer);
     memory_region_destroy(&s->mem);
     memory_region_destroy(&s->idp);
     g_free(s->dev);
@@ -1188,6 +1425,7 @@ void ahci_reset(AHCIState *s)
 
     s->control_regs.irqstatus = 0;
     s->control_regs.ghc = 0;
+    ahci_ccc_reset(s);
 
     for (i = 0; i < s->ports; i++) {
         pr = &s->dev[i].port_regs;
@@ -1257,9 +1495,21 @@ static int ahci_state_post_load(void *opaque, int version_id)
     return 0;
 }
 
+static void ahci_state_pre_save(void *opaque)
+{
+    AHCIState *s = opaque;
+    int i;
+
+    /* SDB FIS updates may still be waiting for their bottom half */
+    for (i = 0; i < s->ports; i++) {
+        ahci_flush_ncq_completions(&s->dev[i]);
+    }
+}
+
 const VMStateDescription vmstate_ahci = {
     .name = "ahci",
-    .version_id = 1,
+    .version_id = 2,
+    .pre_save = ahci_state_pre_save,
     .post_load = ahci_state_post_load,
     .fields = (VMStateField []) {
         VMSTATE_STRUCT_VARRAY_POINTER_INT32(dev, AHCIState, ports,
@@ -1271,6 +1521,9 @@ const VMStateDescription vmstate_ahci = {
         VMSTATE_UINT32(control_regs.version, AHCIState),
         VMSTATE_UINT32(idp_index, AHCIState),
         VMSTATE_INT32(ports, AHCIState),
+        VMSTATE_UINT32_V(control_regs.ccc_ctl, AHCIState, 2),
+        VMSTATE_UINT32_V(control_regs.ccc_ports, AHCIState, 2),
+        VMSTATE_BOOL_V(ccc_irq, AHCIState, 2),
         VMSTATE_END_OF_LIST()
     },
 };
@@ -57,13 +57,22 @@
 #define HOST_IRQ_STAT             0x08 /* interrupt status */
 #define HOST_PORTS_IMPL           0x0c /* bitmap of implemented ports */
 #define HOST_VERSION              0x10 /* AHCI spec. version compliancy */
+#define HOST_CCC_CTL              0x14 /* command completion coalescing ctl */
+#define HOST_CCC_PORTS            0x18 /* command completion coalescing ports */
 
 /* HOST_CTL bits */
 #define HOST_CTL_RESET            (1 << 0)  /* reset controller; self-clear */
 #define HOST_CTL_IRQ_EN           (1 << 1)  /* global IRQ enable */
 #define HOST_CTL_AHCI_EN          (1 << 31) /* AHCI enabled */
 
+/* HOST_CCC_CTL bits */
+#define HOST_CCC_CTL_EN           (1 << 0)  /* enable */
+#define HOST_CCC_CTL_INT(ctl)     (((ctl) >> 3) & 0x1f) /* interrupt, RO */
+#define HOST_CCC_CTL_CC(ctl)      (((ctl) >> 8) & 0xff) /* completions */
+#define HOST_CCC_CTL_TV(ctl)      (((ctl) >> 16) & 0xffff) /* timeout (ms) */
+
 /* HOST_CAP bits */
+#define HOST_CAP_CCCS             (1 << 7)  /* Command Completion Coalescing */
 #define HOST_CAP_SSC              (1 << 14) /* Slumber capable */
 #define HOST_CAP_AHCI             (1 << 18) /* AHCI only */
 #define HOST_CAP_CLO              (1 << 24) /* Command List Override support */
@@ -222,6 +231,8 @@ typedef struct AHCIControlRegs {
     uint32_t    irqstatus;
     uint32_t    impl;
     uint32_t    version;
+    uint32_t    ccc_ctl;
+    uint32_t    ccc_ports;
 } AHCIControlRegs;
 
 typedef struct AHCIPortRegs {
@@ -268,6 +279,9 @@ typedef struct NCQTransferState {
     uint8_t tag;
     int slot;
     int used;
+    bool is_write;
+    /* tags whose data this request carries, merged with the request ones */
+    uint32_t merged;
 } NCQTransferState;
 
 struct AHCIDevice {
@@ -286,6 +300,10 @@ struct AHCIDevice {
     bool init_d2h_sent;
     AHCICmdHdr *cur_cmd;
     NCQTransferState ncq_tfs[AHCI_MAX_CMDS];
+    uint32_t ncq_pending;   /* parsed, not yet submitted */
+    uint32_t ncq_done;      /* finished, not yet reported in an SDB FIS */
+    bool ncq_err;
+    QEMUBH *sdb_bh;
 };
 
 typedef struct AHCIState {
@@ -298,6 +316,9 @@ typedef struct AHCIState {
     int32_t ports;
     qemu_irq irq;
     DMAContext *dma;
+    QEMUTimer *ccc_timer;
+    uint32_t ccc_count;     /* completions since the last CCC interrupt */
+    bool ccc_irq;           /* IS bit CCC_CTL.INT is set */
 } AHCIState;
 
 typedef struct AHCIPCIState {
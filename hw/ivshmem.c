@@ -19,6 +19,7 @@
 #include "hw.h"
 #include "pc.h"
 #include "pci/pci.h"
+#include "pci/msi.h"
 #include "pci/msix.h"
 #include "sysemu/kvm.h"
 #include "migration/migration.h"
@@ -56,6 +57,8 @@ typedef struct Peer {
 typedef struct EventfdEntry {
     PCIDevice *pdev;
     int vector;
+    int virq;       /* KVM MSI route, or -1 */
+    bool irqfd;     /* the eventfd is delivered by KVM, not by the chardev */
 } EventfdEntry;
 
 typedef struct IVShmemState {
@@ -269,6 +272,14 @@ static void ivshmem_event(void *opaque, int event)
     IVSHMEM_DPRINTF("ivshmem_event %d\n", event);
 }
 
+static int ivshmem_vector_can_receive(void *opaque)
+{
+    EventfdEntry *entry = opaque;
+
+    /* leave the eventfd to KVM while it injects the interrupt itself */
+    return entry->irqfd ? 0 : 8;
+}
+
 static void fake_irqfd(void *opaque, const uint8_t *buf, int size) {
 
     EventfdEntry *entry = opaque;
@@ -298,7 +309,7 @@ static CharDriverState* create_eventfd_chr_device(void * opaque, EventNotifier *
         s->eventfd_table[vector].pdev = &s->dev;
         s->eventfd_table[vector].vector = vector;
 
-        qemu_chr_add_handlers(chr, ivshmem_can_receive, fake_irqfd,
+        qemu_chr_add_handlers(chr, ivshmem_vector_can_receive, fake_irqfd,
                       ivshmem_event, &s->eventfd_table[vector]);
     } else {
         qemu_chr_add_handlers(chr, ivshmem_can_receive, ivshmem_receive,
@@ -411,6 +422,59 @@ static void increase_dynamic_storage(IVShmemState *s, int new_min_size) {
     }
 }
 
+/*
+ * With MSI-X and KVM, the eventfds that the peers signal are connected
+ * to KVM irqfds while their vector is unmasked, so that a doorbell rung
+ * by a peer (with ioeventfd or not) is injected without going through
+ * our main loop.  While the vector is masked, the chardev reads the
+ * eventfd again and msix_notify() sets the pending bit.
+ */
+static int ivshmem_vector_unmask(PCIDevice *dev, unsigned vector,
+                                 MSIMessage msg)
+{
+    IVShmemState *s = DO_UPCAST(IVShmemState, dev, dev);
+    EventfdEntry *entry = &s->eventfd_table[vector];
+    EventNotifier *n;
+    int ret;
+
+    if (s->vm_id < 0 || vector >= s->peers[s->vm_id].nb_eventfds) {
+        /* the server did not send this eventfd yet */
+        return 0;
+    }
+    n = &s->peers[s->vm_id].eventfds[vector];
+
+    if (entry->virq < 0) {
+        ret = kvm_irqchip_add_msi_route(kvm_state, msg);
+        if (ret < 0) {
+            return 0; /* fall back to the chardev */
+        }
+        entry->virq = ret;
+    } else if (kvm_irqchip_update_msi_route(kvm_state, entry->virq,
+                                            msg) < 0) {
+        return 0;
+    }
+
+    if (kvm_irqchip_add_irqfd_notifier(kvm_state, n, entry->virq) < 0) {
+        return 0;
+    }
+    entry->irqfd = true;
+    return 0;
+}
+
+static void ivshmem_vector_mask(PCIDevice *dev, unsigned vector)
+{
+    IVShmemState *s = DO_UPCAST(IVShmemState, dev, dev);
+    EventfdEntry *entry = &s->eventfd_table[vector];
+
+    if (!entry->irqfd) {
+        return;
+    }
+    kvm_irqchip_remove_irqfd_notifier(kvm_state,
+                                      &s->peers[s->vm_id].eventfds[vector],
+                                      entry->virq);
+    entry->irqfd = false;
+}
+
 static void ivshmem_read(void *opaque, const uint8_t * buf, int flags)
 {
     IVShmemState *s = opaque;
@@ -508,6 +572,15 @@ static void ivshmem_read(void *opaque, const uint8_t * buf, int flags)
         s->eventfd_chr[guest_max_eventfd] = create_eventfd_chr_device(s,
                    &s->peers[s->vm_id].eventfds[guest_max_eventfd],
                    guest_max_eventfd);
+
+        /* the vector may have been unmasked before the eventfd came */
+        if (s->dev.msix_vector_use_notifier &&
+            guest_max_eventfd < s->vectors &&
+            !msix_is_masked(&s->dev, guest_max_eventfd)) {
+            ivshmem_vector_unmask(&s->dev, guest_max_eventfd,
+                                  msix_get_message(&s->dev,
+                                                   guest_max_eventfd));
+        }
     }
 
     if (ivshmem_has_feature(s, IVSHMEM_IOEVENTFD)) {
@@ -568,6 +641,8 @@ static uint64_t ivshmem_get_size(IVShmemState * s) {
 
 static void ivshmem_setup_msi(IVShmemState * s)
 {
+    int i;
+
     if (msix_init_exclusive_bar(&s->dev, s->vectors, 1)) {
         IVSHMEM_DPRINTF("msix initialization failed\n");
         exit(1);
@@ -577,8 +652,17 @@ static void ivshmem_setup_msi(IVShmemState * s)
 
     /* allocate QEMU char devices for receiving interrupts */
     s->eventfd_table = g_malloc0(s->vectors * sizeof(EventfdEntry));
+    for (i = 0; i < s->vectors; i++) {
+        s->eventfd_table[i].virq = -1;
+    }
 
     ivshmem_use_msix(s);
+
+    if (kvm_msi_via_irqfd_enabled() &&
+        msix_set_vector_notifiers(&s->dev, ivshmem_vector_unmask,
+                                  ivshmem_vector_mask, NULL)) {
+        IVSHMEM_DPRINTF("msix vector notifiers failed\n");
+    }
 }
 
 static void ivshmem_save(QEMUFile* f, void *opaque)
@@ -776,6 +860,17 @@ static void pci_ivshmem_uninit(PCIDevice *dev)
         error_free(s->migration_blocker);
     }
 
+    if (s->dev.msix_vector_use_notifier) {
+        int i;
+
+        msix_unset_vector_notifiers(&s->dev);
+        for (i = 0; i < s->vectors; i++) {
+            if (s->eventfd_table[i].virq >= 0) {
+                kvm_irqchip_release_virq(kvm_state, s->eventfd_table[i].virq);
+            }
+        }
+    }
+
     memory_region_destroy(&s->ivshmem_mmio);
     memory_region_del_subregion(&s->bar, &s->ivshmem);
     vmstate_unregister_ram(&s->ivshmem, &s->dev.qdev);
@@ -53,8 +53,12 @@
 #include "exec/address-spaces.h"
 
 #include <zlib.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
 
 static int roms_loaded;
+static bool roms_preloaded;
 
 /* return the size or -1 if error */
 int get_image_size(const char *filename)
@@ -86,6 +90,61 @@ int load_image(const char *filename, uint8_t *addr)
     return size;
 }
 
+/*
+ * Map @size bytes of @fd copy-on-write.  Pages are only read from the file
+ * when they are first touched, and stay shared with the page cache until
+ * they are written.  Returns NULL if the file cannot be mapped.
+ */
+static void *map_image_fd(int fd, size_t size)
+{
+#ifndef _WIN32
+    void *ptr;
+
+    if (size == 0) {
+        return NULL;
+    }
+    ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    return ptr == MAP_FAILED ? NULL : ptr;
+#else
+    return NULL;
+#endif
+}
+
+/*
+ * Return the whole of @filename in memory, mapped where possible, and its
+ * size in @sizep.  The buffer is writable but changes do not reach the
+ * file; it is meant for images like -kernel and -initrd that are handed to
+ * fw_cfg for good and is never freed.  Returns NULL on error.
+ */
+void *load_image_mapped(const char *filename, int *sizep)
+{
+    void *ptr;
+    int fd, size;
+
+    fd = open(filename, O_RDONLY | O_BINARY);
+    if (fd < 0) {
+        return NULL;
+    }
+    size = lseek(fd, 0, SEEK_END);
+    if (size < 0) {
+        close(fd);
+        return NULL;
+    }
+    ptr = map_image_fd(fd, size);
+    if (!ptr) {
+        ptr = g_malloc(size);
+        lseek(fd, 0, SEEK_SET);
+        if (read(fd, ptr, size) != size) {
+            g_free(ptr);
+            close(fd);
+            return NULL;
+        }
+    }
+    close(fd);
+    *sizep = size;
+    return ptr;
+}
+
 /* read()-like version */
 ssize_t read_targphys(const char *name,
                       int fd, hwaddr dst_addr, size_t nbytes)
@@ -535,6 +594,7 @@ struct Rom {
     char *path;
     size_t romsize;
     uint8_t *data;
+    bool mapped;            /* data is a private mapping of the file */
     int isrom;
     char *fw_dir;
     char *fw_file;
@@ -546,6 +606,19 @@ struct Rom {
 static FWCfgState *fw_cfg;
 static QTAILQ_HEAD(, Rom) roms = QTAILQ_HEAD_INITIALIZER(roms);
 
+static void rom_free_data(Rom *rom)
+{
+#ifndef _WIN32
+    if (rom->mapped) {
+        munmap(rom->data, rom->romsize);
+        rom->data = NULL;
+        return;
+    }
+#endif
+    g_free(rom->data);
+    rom->data = NULL;
+}
+
 static void rom_insert(Rom *rom)
 {
     Rom *item;
@@ -591,13 +664,19 @@ int rom_add_file(const char *file, const char *fw_dir,
     }
     rom->addr    = addr;
     rom->romsize = lseek(fd, 0, SEEK_END);
-    rom->data    = g_malloc0(rom->romsize);
-    lseek(fd, 0, SEEK_SET);
-    rc = read(fd, rom->data, rom->romsize);
-    if (rc != rom->romsize) {
-        fprintf(stderr, "rom: file %-20s: read error: rc=%d (expected %zd)\n",
-                rom->name, rc, rom->romsize);
-        goto err;
+    rom->data    = map_image_fd(fd, rom->romsize);
+    if (rom->data) {
+        rom->mapped = true;
+    } else {
+        rom->data = g_malloc0(rom->romsize);
+        lseek(fd, 0, SEEK_SET);
+        rc = read(fd, rom->data, rom->romsize);
+        if (rc != rom->romsize) {
+            fprintf(stderr,
+                    "rom: file %-20s: read error: rc=%d (expected %zd)\n",
+                    rom->name, rc, rom->romsize);
+            goto err;
+        }
     }
     close(fd);
     rom_insert(rom);
@@ -625,7 +704,7 @@ int rom_add_file(const char *file, const char *fw_dir,
 err:
     if (fd != -1)
         close(fd);
-    g_free(rom->data);
+    rom_free_data(rom);
     g_free(rom->path);
     g_free(rom->name);
     g_free(rom);
@@ -661,6 +740,11 @@ static void rom_reset(void *unused)
 {
     Rom *rom;
 
+    if (roms_preloaded) {
+        roms_preloaded = false;
+        return;
+    }
+
     QTAILQ_FOREACH(rom, &roms, next) {
         if (rom->fw_file) {
             continue;
@@ -671,8 +755,7 @@ static void rom_reset(void *unused)
         cpu_physical_memory_write_rom(rom->addr, rom->data, rom->romsize);
         if (rom->isrom) {
             /* rom needs to be written only once */
-            g_free(rom->data);
-            rom->data = NULL;
+            rom_free_data(rom);
         }
     }
 }
@@ -704,6 +787,12 @@ int rom_load_all(void)
     return 0;
 }
 
+/* The next reset finds the ROM contents in guest memory already */
+void rom_set_ram_preloaded(void)
+{
+    roms_preloaded = true;
+}
+
 void rom_set_fw(void *f)
 {
     fw_cfg = f;
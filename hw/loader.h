@@ -5,6 +5,7 @@
 /* loader.c */
 int get_image_size(const char *filename);
 int load_image(const char *filename, uint8_t *addr); /* deprecated */
+void *load_image_mapped(const char *filename, int *sizep);
 int load_image_targphys(const char *filename, hwaddr,
                         uint64_t max_sz);
 int load_elf(const char *filename, uint64_t (*translate_fn)(void *, uint64_t),
@@ -29,6 +30,7 @@ int rom_add_blob(const char *name, const void *blob, size_t len,
                  hwaddr addr);
 int rom_load_all(void);
 void rom_set_fw(void *f);
+void rom_set_ram_preloaded(void);
 int rom_copy(uint8_t *dest, hwaddr addr, size_t size);
 void *rom_ptr(hwaddr addr);
 void do_info_roms(Monitor *mon, const QDict *qdict);
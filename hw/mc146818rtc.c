@@ -834,6 +834,7 @@ static int rtc_initfn(ISADevice *dev)
     case LOST_TICK_SLEW:
         s->coalesced_timer =
             qemu_new_timer_ns(rtc_clock, rtc_coalesced_timer, s);
+        qemu_timer_set_name(s->coalesced_timer, "rtc-coalesced");
         break;
     case LOST_TICK_DISCARD:
         break;
@@ -844,6 +845,8 @@ static int rtc_initfn(ISADevice *dev)
 
     s->periodic_timer = qemu_new_timer_ns(rtc_clock, rtc_periodic_timer, s);
     s->update_timer = qemu_new_timer_ns(rtc_clock, rtc_update_timer, s);
+    qemu_timer_set_name(s->periodic_timer, "rtc-periodic");
+    qemu_timer_set_name(s->update_timer, "rtc-update");
     check_update_timer(s);
 
     s->clock_reset_notifier.notify = rtc_notify_clock_reset;
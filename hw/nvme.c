@@ -0,0 +1,1284 @@
+/*
+ * QEMU NVM Express Controller
+ *
+ * Copyright (c) 2013 QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+/*
+ * Usage: add options:
+ *      -drive file=<file>,if=none,id=<drive_id>
+ *      -device nvme,drive=<drive_id>,serial=<serial>,id=<id[optional]>
+ *
+ * The controller exposes a single namespace backed by the drive, up to
+ * num_queues - 1 I/O queue pairs and one MSI-X vector per queue.
+ *
+ * Submission queue tail doorbells are plain MMIO writes by default.  If
+ * the guest driver supports the Doorbell Buffer Config command (Linux
+ * does since 4.12), the doorbell values are shadowed in guest memory and
+ * the I/O queue doorbells are bound to ioeventfds, so that ringing them
+ * does not return to userspace.
+ */
+
+#include "hw.h"
+#include "pci/pci.h"
+#include "pci/msix.h"
+#include "sysemu/dma.h"
+#include "sysemu/kvm.h"
+#include "sysemu/blockdev.h"
+#include "hw/block-common.h"
+#include "qemu/error-report.h"
+#include "qemu/event_notifier.h"
+#include "qemu/atomic.h"
+#include "trace.h"
+
+#include "nvme.h"
+
+#define NVME_MAX_QS             64
+#define NVME_MAX_QUEUE_ENTRIES  0x7ff
+#define NVME_MAX_TRANSFER_BITS  7       /* 2^7 pages, 512 KiB */
+#define NVME_PAGE_BITS          12
+#define NVME_PAGE_SIZE          (1 << NVME_PAGE_BITS)
+#define NVME_MAX_PRP_ENTS       (NVME_PAGE_SIZE / sizeof(uint64_t))
+#define NVME_SQE_BITS           6
+#define NVME_CQE_BITS           4
+
+#define NVME_FLAG_USE_IOEVENTFD_BIT 0
+#define NVME_FLAG_USE_IOEVENTFD     (1 << NVME_FLAG_USE_IOEVENTFD_BIT)
+
+struct NvmeCtrl;
+struct NvmeSQueue;
+
+typedef struct NvmeRequest {
+    struct NvmeSQueue       *sq;
+    BlockDriverAIOCB        *aiocb;
+    uint16_t                status;
+    bool                    has_sg;
+    NvmeCqe                 cqe;
+    BlockAcctCookie         acct;
+    QEMUSGList              qsg;
+    QTAILQ_ENTRY(NvmeRequest) entry;
+} NvmeRequest;
+
+typedef struct NvmeSQueue {
+    struct NvmeCtrl *ctrl;
+    uint16_t        sqid;
+    uint16_t        cqid;
+    uint32_t        head;
+    uint32_t        tail;
+    uint32_t        size;
+    uint64_t        dma_addr;
+    QEMUBH          *bh;
+    NvmeRequest     *io_req;
+    QTAILQ_HEAD(, NvmeRequest) req_list;
+    QTAILQ_HEAD(, NvmeRequest) out_req_list;
+    QTAILQ_ENTRY(NvmeSQueue) entry;
+
+    /* Shadow doorbell and event index, set by Doorbell Buffer Config */
+    uint64_t        db_addr;
+    uint64_t        ei_addr;
+    EventNotifier   notifier;
+    bool            ioeventfd;
+} NvmeSQueue;
+
+typedef struct NvmeCQueue {
+    struct NvmeCtrl *ctrl;
+    uint8_t         phase;
+    uint16_t        cqid;
+    uint16_t        irq_enabled;
+    uint32_t        head;
+    uint32_t        tail;
+    uint32_t        vector;
+    uint32_t        size;
+    uint64_t        dma_addr;
+    QEMUBH          *bh;
+    QTAILQ_HEAD(, NvmeSQueue) sq_list;
+    QTAILQ_HEAD(, NvmeRequest) req_list;
+
+    uint64_t        db_addr;
+    uint64_t        ei_addr;
+} NvmeCQueue;
+
+typedef struct NvmeCtrl {
+    PCIDevice       dev;
+    MemoryRegion    iomem;
+    NvmeBar         bar;
+    BlockConf       conf;
+
+    uint32_t        reg_size;
+    uint32_t        num_queues;
+    uint32_t        flags;
+    uint32_t        lba_bits;
+    uint64_t        ns_blocks;
+    uint64_t        irq_status;
+    char            *serial;
+
+    bool            dbbuf_enabled;
+    uint64_t        dbbuf_dbs;
+    uint64_t        dbbuf_eis;
+
+    NvmeSQueue      **sq;
+    NvmeCQueue      **cq;
+    NvmeSQueue      admin_sq;
+    NvmeCQueue      admin_cq;
+    NvmeIdCtrl      id_ctrl;
+    NvmeIdNs        id_ns;
+} NvmeCtrl;
+
+static void nvme_process_sq(void *opaque);
+
+static int nvme_check_sqid(NvmeCtrl *n, uint16_t sqid)
+{
+    return sqid < n->num_queues && n->sq[sqid] != NULL ? 0 : -1;
+}
+
+static int nvme_check_cqid(NvmeCtrl *n, uint16_t cqid)
+{
+    return cqid < n->num_queues && n->cq[cqid] != NULL ? 0 : -1;
+}
+
+static void nvme_inc_cq_tail(NvmeCQueue *cq)
+{
+    cq->tail++;
+    if (cq->tail >= cq->size) {
+        cq->tail = 0;
+        cq->phase = !cq->phase;
+    }
+}
+
+static void nvme_inc_sq_head(NvmeSQueue *sq)
+{
+    sq->head = (sq->head + 1) % sq->size;
+}
+
+static uint8_t nvme_cq_full(NvmeCQueue *cq)
+{
+    return (cq->tail + 1) % cq->size == cq->head;
+}
+
+static uint8_t nvme_sq_empty(NvmeSQueue *sq)
+{
+    return sq->head == sq->tail;
+}
+
+/* Shadow doorbells: used only after Doorbell Buffer Config */
+
+static void nvme_update_sq_tail(NvmeSQueue *sq)
+{
+    uint32_t tail;
+
+    if (sq->db_addr) {
+        tail = ldl_le_pci_dma(&sq->ctrl->dev, sq->db_addr);
+        if (tail < sq->size) {
+            sq->tail = tail;
+        }
+    }
+}
+
+static void nvme_update_sq_eventidx(NvmeSQueue *sq)
+{
+    if (sq->ei_addr) {
+        stl_le_pci_dma(&sq->ctrl->dev, sq->ei_addr, sq->tail);
+    }
+}
+
+static void nvme_update_cq_head(NvmeCQueue *cq)
+{
+    uint32_t head;
+
+    if (cq->db_addr) {
+        head = ldl_le_pci_dma(&cq->ctrl->dev, cq->db_addr);
+        if (head < cq->size) {
+            cq->head = head;
+        }
+    }
+}
+
+static void nvme_update_cq_eventidx(NvmeCQueue *cq)
+{
+    if (cq->ei_addr) {
+        stl_le_pci_dma(&cq->ctrl->dev, cq->ei_addr, cq->head);
+    }
+}
+
+/*
+ * With pin-based interrupts all completion queues share INTx; it is
+ * asserted while any of them holds entries the guest has not consumed.
+ */
+static void nvme_irq_check(NvmeCtrl *n)
+{
+    if (msix_enabled(&n->dev)) {
+        return;
+    }
+    qemu_set_irq(n->dev.irq[0], n->irq_status && !(n->bar.intms & 1));
+}
+
+static void nvme_irq_assert(NvmeCtrl *n, NvmeCQueue *cq)
+{
+    if (!cq->irq_enabled) {
+        return;
+    }
+    if (msix_enabled(&n->dev)) {
+        trace_nvme_irq_msix(cq->vector);
+        msix_notify(&n->dev, cq->vector);
+    } else {
+        trace_nvme_irq_pin(cq->cqid);
+        n->irq_status |= 1ULL << cq->cqid;
+        nvme_irq_check(n);
+    }
+}
+
+static void nvme_irq_deassert(NvmeCtrl *n, NvmeCQueue *cq)
+{
+    if (!cq->irq_enabled || msix_enabled(&n->dev)) {
+        return;
+    }
+    n->irq_status &= ~(1ULL << cq->cqid);
+    nvme_irq_check(n);
+}
+
+static uint16_t nvme_map_prp(QEMUSGList *qsg, uint64_t prp1, uint64_t prp2,
+                             uint32_t len, NvmeCtrl *n)
+{
+    uint64_t prp_list[NVME_MAX_PRP_ENTS];
+    uint32_t trans_len = NVME_PAGE_SIZE - (prp1 % NVME_PAGE_SIZE);
+    uint32_t list_ents, nents, prp_trans;
+    uint64_t prp_ent;
+    int i;
+
+    if (!prp1) {
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+
+    trans_len = MIN(len, trans_len);
+    pci_dma_sglist_init(qsg, &n->dev, (len >> NVME_PAGE_BITS) + 1);
+    qemu_sglist_add(qsg, prp1, trans_len);
+    len -= trans_len;
+    if (!len) {
+        return NVME_SUCCESS;
+    }
+    if (len <= NVME_PAGE_SIZE) {
+        if (!prp2 || prp2 & (NVME_PAGE_SIZE - 1)) {
+            goto unmap;
+        }
+        qemu_sglist_add(qsg, prp2, len);
+        return NVME_SUCCESS;
+    }
+    if (!prp2 || prp2 & (sizeof(uint64_t) - 1)) {
+        goto unmap;
+    }
+
+    /*
+     * prp2 points to a list that ends at a page boundary; if more entries
+     * are needed its last entry chains to the next, page-aligned list.
+     */
+    list_ents = (NVME_PAGE_SIZE - (prp2 & (NVME_PAGE_SIZE - 1))) >> 3;
+    nents = DIV_ROUND_UP(len, NVME_PAGE_SIZE);
+    prp_trans = MIN(list_ents, nents) * sizeof(uint64_t);
+    pci_dma_read(&n->dev, prp2, prp_list, prp_trans);
+    i = 0;
+    while (len) {
+        prp_ent = le64_to_cpu(prp_list[i]);
+        if (i == list_ents - 1 && len > NVME_PAGE_SIZE) {
+            if (!prp_ent || prp_ent & (NVME_PAGE_SIZE - 1)) {
+                goto unmap;
+            }
+            list_ents = NVME_MAX_PRP_ENTS;
+            nents = DIV_ROUND_UP(len, NVME_PAGE_SIZE);
+            prp_trans = MIN(list_ents, nents) * sizeof(uint64_t);
+            pci_dma_read(&n->dev, prp_ent, prp_list, prp_trans);
+            i = 0;
+            prp_ent = le64_to_cpu(prp_list[i]);
+        }
+        if (!prp_ent || prp_ent & (NVME_PAGE_SIZE - 1)) {
+            goto unmap;
+        }
+        trans_len = MIN(len, NVME_PAGE_SIZE);
+        qemu_sglist_add(qsg, prp_ent, trans_len);
+        len -= trans_len;
+        i++;
+    }
+    return NVME_SUCCESS;
+
+unmap:
+    qemu_sglist_destroy(qsg);
+    return NVME_INVALID_FIELD | NVME_DNR;
+}
+
+static uint16_t nvme_dma_read_prp(NvmeCtrl *n, uint8_t *ptr, uint32_t len,
+                                  uint64_t prp1, uint64_t prp2)
+{
+    QEMUSGList qsg;
+    uint16_t status;
+
+    status = nvme_map_prp(&qsg, prp1, prp2, len, n);
+    if (status) {
+        return status;
+    }
+    if (dma_buf_read(ptr, len, &qsg)) {
+        status = NVME_INVALID_FIELD | NVME_DNR;
+    }
+    qemu_sglist_destroy(&qsg);
+    return status;
+}
+
+static void nvme_post_cqes(void *opaque)
+{
+    NvmeCQueue *cq = opaque;
+    NvmeCtrl *n = cq->ctrl;
+    NvmeRequest *req, *next;
+    NvmeSQueue *sq;
+    hwaddr addr;
+    bool posted = false;
+
+    nvme_update_cq_head(cq);
+    QTAILQ_FOREACH_SAFE(req, &cq->req_list, entry, next) {
+        if (nvme_cq_full(cq)) {
+            /* ask for a doorbell write once the guest makes room */
+            nvme_update_cq_eventidx(cq);
+            smp_mb();
+            nvme_update_cq_head(cq);
+            if (nvme_cq_full(cq)) {
+                break;
+            }
+        }
+        QTAILQ_REMOVE(&cq->req_list, req, entry);
+        sq = req->sq;
+        req->cqe.status = cpu_to_le16((req->status << 1) | cq->phase);
+        req->cqe.sq_id = cpu_to_le16(sq->sqid);
+        req->cqe.sq_head = cpu_to_le16(sq->head);
+        addr = cq->dma_addr + (cq->tail << NVME_CQE_BITS);
+        nvme_inc_cq_tail(cq);
+        pci_dma_write(&n->dev, addr, &req->cqe, sizeof(req->cqe));
+        QTAILQ_INSERT_TAIL(&sq->req_list, req, entry);
+        posted = true;
+    }
+
+    if (posted) {
+        /* submission queues may have stalled for lack of free requests */
+        QTAILQ_FOREACH(sq, &cq->sq_list, entry) {
+            if (!nvme_sq_empty(sq)) {
+                qemu_bh_schedule(sq->bh);
+            }
+        }
+    }
+    if (cq->tail != cq->head) {
+        nvme_irq_assert(n, cq);
+    }
+}
+
+static void nvme_enqueue_req_completion(NvmeCQueue *cq, NvmeRequest *req)
+{
+    assert(cq->cqid == req->sq->cqid);
+    QTAILQ_REMOVE(&req->sq->out_req_list, req, entry);
+    QTAILQ_INSERT_TAIL(&cq->req_list, req, entry);
+    qemu_bh_schedule(cq->bh);
+}
+
+static void nvme_rw_cb(void *opaque, int ret)
+{
+    NvmeRequest *req = opaque;
+    NvmeSQueue *sq = req->sq;
+    NvmeCtrl *n = sq->ctrl;
+    NvmeCQueue *cq = n->cq[sq->cqid];
+
+    bdrv_acct_done(n->conf.bs, &req->acct);
+    if (req->has_sg) {
+        qemu_sglist_destroy(&req->qsg);
+        req->has_sg = false;
+    }
+    req->aiocb = NULL;
+    req->status = ret ? NVME_INTERNAL_DEV_ERROR : NVME_SUCCESS;
+    trace_nvme_rw_done(sq->sqid, le16_to_cpu(req->cqe.cid), ret);
+    nvme_enqueue_req_completion(cq, req);
+}
+
+static uint16_t nvme_flush(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
+{
+    bdrv_acct_start(n->conf.bs, &req->acct, 0, BDRV_ACCT_FLUSH);
+    req->aiocb = bdrv_aio_flush(n->conf.bs, nvme_rw_cb, req);
+    return NVME_NO_COMPLETE;
+}
+
+static uint16_t nvme_rw(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
+{
+    NvmeRwCmd *rw = (NvmeRwCmd *)cmd;
+    uint32_t nlb = le16_to_cpu(rw->nlb) + 1;
+    uint64_t slba = le64_to_cpu(rw->slba);
+    uint64_t data_size = (uint64_t)nlb << n->lba_bits;
+    uint64_t sector = slba << (n->lba_bits - BDRV_SECTOR_BITS);
+    bool is_write = rw->opcode == NVME_CMD_WRITE;
+    uint16_t status;
+
+    trace_nvme_rw(req->sq->sqid, le16_to_cpu(cmd->cid), is_write, slba, nlb);
+
+    if (slba >= n->ns_blocks || nlb > n->ns_blocks - slba) {
+        return NVME_LBA_RANGE | NVME_DNR;
+    }
+    if (data_size > (NVME_PAGE_SIZE << NVME_MAX_TRANSFER_BITS)) {
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+
+    status = nvme_map_prp(&req->qsg, le64_to_cpu(rw->prp1),
+                          le64_to_cpu(rw->prp2), data_size, n);
+    if (status) {
+        return status;
+    }
+    req->has_sg = true;
+
+    dma_acct_start(n->conf.bs, &req->acct, &req->qsg,
+                   is_write ? BDRV_ACCT_WRITE : BDRV_ACCT_READ);
+    if (is_write) {
+        req->aiocb = dma_bdrv_write(n->conf.bs, &req->qsg, sector,
+                                    nvme_rw_cb, req);
+    } else {
+        req->aiocb = dma_bdrv_read(n->conf.bs, &req->qsg, sector,
+                                   nvme_rw_cb, req);
+    }
+    return NVME_NO_COMPLETE;
+}
+
+static uint16_t nvme_io_cmd(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
+{
+    if (le32_to_cpu(cmd->nsid) != 1) {
+        return NVME_INVALID_NSID | NVME_DNR;
+    }
+
+    switch (cmd->opcode) {
+    case NVME_CMD_FLUSH:
+        return nvme_flush(n, cmd, req);
+    case NVME_CMD_WRITE:
+    case NVME_CMD_READ:
+        return nvme_rw(n, cmd, req);
+    default:
+        return NVME_INVALID_OPCODE | NVME_DNR;
+    }
+}
+
+static void nvme_sq_notifier(EventNotifier *e)
+{
+    NvmeSQueue *sq = container_of(e, NvmeSQueue, notifier);
+
+    if (event_notifier_test_and_clear(e)) {
+        nvme_process_sq(sq);
+    }
+}
+
+/* Bind the tail doorbell of an I/O submission queue to an ioeventfd */
+static void nvme_init_sq_ioeventfd(NvmeSQueue *sq)
+{
+    NvmeCtrl *n = sq->ctrl;
+    int ret;
+
+    if (!(n->flags & NVME_FLAG_USE_IOEVENTFD) || sq->ioeventfd) {
+        return;
+    }
+
+    ret = event_notifier_init(&sq->notifier, 0);
+    if (ret < 0) {
+        error_report("nvme: unable to init event notifier: %d", ret);
+        return;
+    }
+    event_notifier_set_handler(&sq->notifier, nvme_sq_notifier);
+    memory_region_add_eventfd(&n->iomem, NVME_DB_OFFSET + (sq->sqid << 3), 4,
+                              false, 0, &sq->notifier);
+    sq->ioeventfd = true;
+}
+
+static void nvme_cleanup_sq_ioeventfd(NvmeSQueue *sq)
+{
+    NvmeCtrl *n = sq->ctrl;
+
+    if (!sq->ioeventfd) {
+        return;
+    }
+    memory_region_del_eventfd(&n->iomem, NVME_DB_OFFSET + (sq->sqid << 3), 4,
+                              false, 0, &sq->notifier);
+    event_notifier_set_handler(&sq->notifier, NULL);
+    event_notifier_cleanup(&sq->notifier);
+    sq->ioeventfd = false;
+}
+
+static void nvme_sq_set_dbbuf(NvmeCtrl *n, NvmeSQueue *sq)
+{
+    sq->db_addr = n->dbbuf_dbs + (sq->sqid << 3);
+    sq->ei_addr = n->dbbuf_eis + (sq->sqid << 3);
+    nvme_init_sq_ioeventfd(sq);
+}
+
+static void nvme_cq_set_dbbuf(NvmeCtrl *n, NvmeCQueue *cq)
+{
+    cq->db_addr = n->dbbuf_dbs + (cq->cqid << 3) + 4;
+    cq->ei_addr = n->dbbuf_eis + (cq->cqid << 3) + 4;
+}
+
+static void nvme_free_sq(NvmeSQueue *sq, NvmeCtrl *n)
+{
+    NvmeRequest *req, *next;
+    NvmeCQueue *cq;
+
+    nvme_cleanup_sq_ioeventfd(sq);
+    qemu_bh_delete(sq->bh);
+
+    /* cancelled requests do not see their completion callback */
+    while (!QTAILQ_EMPTY(&sq->out_req_list)) {
+        req = QTAILQ_FIRST(&sq->out_req_list);
+        if (req->aiocb) {
+            bdrv_aio_cancel(req->aiocb);
+            req->aiocb = NULL;
+        }
+        if (req->has_sg) {
+            qemu_sglist_destroy(&req->qsg);
+            req->has_sg = false;
+        }
+        QTAILQ_REMOVE(&sq->out_req_list, req, entry);
+        QTAILQ_INSERT_TAIL(&sq->req_list, req, entry);
+    }
+
+    if (!nvme_check_cqid(n, sq->cqid)) {
+        cq = n->cq[sq->cqid];
+        QTAILQ_REMOVE(&cq->sq_list, sq, entry);
+        QTAILQ_FOREACH_SAFE(req, &cq->req_list, entry, next) {
+            if (req->sq == sq) {
+                QTAILQ_REMOVE(&cq->req_list, req, entry);
+            }
+        }
+    }
+
+    n->sq[sq->sqid] = NULL;
+    g_free(sq->io_req);
+    if (sq->sqid) {
+        g_free(sq);
+    }
+}
+
+static void nvme_init_sq(NvmeSQueue *sq, NvmeCtrl *n, uint64_t dma_addr,
+                         uint16_t sqid, uint16_t cqid, uint16_t size)
+{
+    NvmeCQueue *cq;
+    int i;
+
+    memset(sq, 0, sizeof(*sq));
+    sq->ctrl = n;
+    sq->dma_addr = dma_addr;
+    sq->sqid = sqid;
+    sq->size = size;
+    sq->cqid = cqid;
+    sq->io_req = g_new0(NvmeRequest, sq->size);
+
+    QTAILQ_INIT(&sq->req_list);
+    QTAILQ_INIT(&sq->out_req_list);
+    for (i = 0; i < sq->size; i++) {
+        sq->io_req[i].sq = sq;
+        QTAILQ_INSERT_TAIL(&sq->req_list, &sq->io_req[i], entry);
+    }
+    sq->bh = qemu_bh_new(nvme_process_sq, sq);
+
+    cq = n->cq[cqid];
+    QTAILQ_INSERT_TAIL(&cq->sq_list, sq, entry);
+    n->sq[sqid] = sq;
+
+    if (n->dbbuf_enabled && sqid) {
+        nvme_sq_set_dbbuf(n, sq);
+    }
+}
+
+static uint16_t nvme_create_sq(NvmeCtrl *n, NvmeCmd *cmd)
+{
+    NvmeCreateSq *c = (NvmeCreateSq *)cmd;
+    uint16_t cqid = le16_to_cpu(c->cqid);
+    uint16_t sqid = le16_to_cpu(c->sqid);
+    uint16_t qsize = le16_to_cpu(c->qsize);
+    uint16_t qflags = le16_to_cpu(c->sq_flags);
+    uint64_t prp1 = le64_to_cpu(c->prp1);
+
+    if (!cqid || nvme_check_cqid(n, cqid)) {
+        return NVME_INVALID_CQID | NVME_DNR;
+    }
+    if (!sqid || sqid >= n->num_queues || n->sq[sqid] != NULL) {
+        return NVME_INVALID_QID | NVME_DNR;
+    }
+    if (!qsize || qsize > NVME_CAP_MQES(n->bar.cap)) {
+        return NVME_MAX_QSIZE_EXCEEDED | NVME_DNR;
+    }
+    if (!prp1 || prp1 & (NVME_PAGE_SIZE - 1)) {
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+    if (!NVME_SQ_FLAGS_PC(qflags) ||
+        NVME_CC_IOSQES(n->bar.cc) != NVME_SQE_BITS) {
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+
+    nvme_init_sq(g_new0(NvmeSQueue, 1), n, prp1, sqid, cqid, qsize + 1);
+    return NVME_SUCCESS;
+}
+
+static uint16_t nvme_del_sq(NvmeCtrl *n, NvmeCmd *cmd)
+{
+    NvmeDeleteQ *c = (NvmeDeleteQ *)cmd;
+    uint16_t qid = le16_to_cpu(c->qid);
+
+    if (!qid || nvme_check_sqid(n, qid)) {
+        return NVME_INVALID_QID | NVME_DNR;
+    }
+    nvme_free_sq(n->sq[qid], n);
+    return NVME_SUCCESS;
+}
+
+static void nvme_free_cq(NvmeCQueue *cq, NvmeCtrl *n)
+{
+    nvme_irq_deassert(n, cq);
+    qemu_bh_delete(cq->bh);
+    n->cq[cq->cqid] = NULL;
+    if (cq->cqid) {
+        g_free(cq);
+    }
+}
+
+static void nvme_init_cq(NvmeCQueue *cq, NvmeCtrl *n, uint64_t dma_addr,
+                         uint16_t cqid, uint16_t vector, uint16_t size,
+                         uint16_t irq_enabled)
+{
+    memset(cq, 0, sizeof(*cq));
+    cq->ctrl = n;
+    cq->cqid = cqid;
+    cq->size = size;
+    cq->dma_addr = dma_addr;
+    cq->phase = 1;
+    cq->irq_enabled = irq_enabled;
+    cq->vector = vector;
+    QTAILQ_INIT(&cq->req_list);
+    QTAILQ_INIT(&cq->sq_list);
+    cq->bh = qemu_bh_new(nvme_post_cqes, cq);
+    n->cq[cqid] = cq;
+
+    if (n->dbbuf_enabled && cqid) {
+        nvme_cq_set_dbbuf(n, cq);
+    }
+}
+
+static uint16_t nvme_create_cq(NvmeCtrl *n, NvmeCmd *cmd)
+{
+    NvmeCreateCq *c = (NvmeCreateCq *)cmd;
+    uint16_t cqid = le16_to_cpu(c->cqid);
+    uint16_t vector = le16_to_cpu(c->irq_vector);
+    uint16_t qsize = le16_to_cpu(c->qsize);
+    uint16_t qflags = le16_to_cpu(c->cq_flags);
+    uint64_t prp1 = le64_to_cpu(c->prp1);
+
+    if (!cqid || cqid >= n->num_queues || n->cq[cqid] != NULL) {
+        return NVME_INVALID_CQID | NVME_DNR;
+    }
+    if (!qsize || qsize > NVME_CAP_MQES(n->bar.cap)) {
+        return NVME_MAX_QSIZE_EXCEEDED | NVME_DNR;
+    }
+    if (!prp1 || prp1 & (NVME_PAGE_SIZE - 1)) {
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+    if (vector >= n->num_queues) {
+        return NVME_INVALID_IRQ_VECTOR | NVME_DNR;
+    }
+    if (!NVME_CQ_FLAGS_PC(qflags) ||
+        NVME_CC_IOCQES(n->bar.cc) != NVME_CQE_BITS) {
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+
+    nvme_init_cq(g_new0(NvmeCQueue, 1), n, prp1, cqid, vector, qsize + 1,
+                 NVME_CQ_FLAGS_IEN(qflags));
+    return NVME_SUCCESS;
+}
+
+static uint16_t nvme_del_cq(NvmeCtrl *n, NvmeCmd *cmd)
+{
+    NvmeDeleteQ *c = (NvmeDeleteQ *)cmd;
+    uint16_t qid = le16_to_cpu(c->qid);
+    NvmeCQueue *cq;
+
+    if (!qid || nvme_check_cqid(n, qid)) {
+        return NVME_INVALID_CQID | NVME_DNR;
+    }
+    cq = n->cq[qid];
+    if (!QTAILQ_EMPTY(&cq->sq_list)) {
+        return NVME_INVALID_QUEUE_DEL;
+    }
+    nvme_free_cq(cq, n);
+    return NVME_SUCCESS;
+}
+
+static uint16_t nvme_identify(NvmeCtrl *n, NvmeCmd *cmd)
+{
+    NvmeIdentify *c = (NvmeIdentify *)cmd;
+    uint32_t cns = le32_to_cpu(c->cns);
+    uint32_t nsid = le32_to_cpu(c->nsid);
+    uint64_t prp1 = le64_to_cpu(c->prp1);
+    uint64_t prp2 = le64_to_cpu(c->prp2);
+    uint32_t list[1024];
+
+    switch (cns) {
+    case NVME_ID_CNS_NS:
+        if (nsid != 1) {
+            return NVME_INVALID_NSID | NVME_DNR;
+        }
+        return nvme_dma_read_prp(n, (uint8_t *)&n->id_ns, sizeof(n->id_ns),
+                                 prp1, prp2);
+    case NVME_ID_CNS_CTRL:
+        return nvme_dma_read_prp(n, (uint8_t *)&n->id_ctrl,
+                                 sizeof(n->id_ctrl), prp1, prp2);
+    case NVME_ID_CNS_NS_ACTIVE_LIST:
+        memset(list, 0, sizeof(list));
+        if (nsid < 1) {
+            list[0] = cpu_to_le32(1);
+        }
+        return nvme_dma_read_prp(n, (uint8_t *)list, sizeof(list),
+                                 prp1, prp2);
+    default:
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+}
+
+static uint16_t nvme_get_feature(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
+{
+    uint32_t dw10 = le32_to_cpu(cmd->cdw10);
+
+    switch (dw10 & 0xff) {
+    case NVME_VOLATILE_WRITE_CACHE:
+        req->cqe.result = cpu_to_le32(bdrv_enable_write_cache(n->conf.bs));
+        break;
+    case NVME_NUMBER_OF_QUEUES:
+        /* zero-based, and not counting the admin queue pair */
+        req->cqe.result = cpu_to_le32((n->num_queues - 2) |
+                                      ((n->num_queues - 2) << 16));
+        break;
+    default:
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+    return NVME_SUCCESS;
+}
+
+static uint16_t nvme_set_feature(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
+{
+    uint32_t dw10 = le32_to_cpu(cmd->cdw10);
+    uint32_t dw11 = le32_to_cpu(cmd->cdw11);
+
+    switch (dw10 & 0xff) {
+    case NVME_VOLATILE_WRITE_CACHE:
+        bdrv_set_enable_write_cache(n->conf.bs, dw11 & 1);
+        break;
+    case NVME_NUMBER_OF_QUEUES:
+        /* the number of queues is fixed, report what is available */
+        req->cqe.result = cpu_to_le32((n->num_queues - 2) |
+                                      ((n->num_queues - 2) << 16));
+        break;
+    default:
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+    return NVME_SUCCESS;
+}
+
+/*
+ * Doorbell Buffer Config: prp1 is a page that shadows the doorbells and
+ * prp2 a page that receives the event indexes, both with the doorbell
+ * register layout.  From now on the queue heads and tails are read from
+ * guest memory, which lets ioeventfd carry the I/O doorbell writes.
+ */
+static uint16_t nvme_dbbuf_config(NvmeCtrl *n, NvmeCmd *cmd)
+{
+    uint64_t dbs_addr = le64_to_cpu(cmd->prp1);
+    uint64_t eis_addr = le64_to_cpu(cmd->prp2);
+    int i;
+
+    if (!dbs_addr || dbs_addr & (NVME_PAGE_SIZE - 1) ||
+        !eis_addr || eis_addr & (NVME_PAGE_SIZE - 1)) {
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+
+    n->dbbuf_dbs = dbs_addr;
+    n->dbbuf_eis = eis_addr;
+    n->dbbuf_enabled = true;
+
+    /* drivers keep ringing the admin queue doorbells, see nvme_init_sq */
+    for (i = 1; i < n->num_queues; i++) {
+        if (n->sq[i]) {
+            nvme_sq_set_dbbuf(n, n->sq[i]);
+        }
+        if (n->cq[i]) {
+            nvme_cq_set_dbbuf(n, n->cq[i]);
+        }
+    }
+    return NVME_SUCCESS;
+}
+
+static uint16_t nvme_admin_cmd(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
+{
+    trace_nvme_admin_cmd(le16_to_cpu(cmd->cid), cmd->opcode);
+
+    switch (cmd->opcode) {
+    case NVME_ADM_CMD_DELETE_SQ:
+        return nvme_del_sq(n, cmd);
+    case NVME_ADM_CMD_CREATE_SQ:
+        return nvme_create_sq(n, cmd);
+    case NVME_ADM_CMD_DELETE_CQ:
+        return nvme_del_cq(n, cmd);
+    case NVME_ADM_CMD_CREATE_CQ:
+        return nvme_create_cq(n, cmd);
+    case NVME_ADM_CMD_IDENTIFY:
+        return nvme_identify(n, cmd);
+    case NVME_ADM_CMD_ABORT:
+        /* commands are not aborted, bit 0 of the result says so */
+        req->cqe.result = cpu_to_le32(1);
+        return NVME_SUCCESS;
+    case NVME_ADM_CMD_SET_FEATURES:
+        return nvme_set_feature(n, cmd, req);
+    case NVME_ADM_CMD_GET_FEATURES:
+        return nvme_get_feature(n, cmd, req);
+    case NVME_ADM_CMD_DBBUF_CONFIG:
+        return nvme_dbbuf_config(n, cmd);
+    default:
+        return NVME_INVALID_OPCODE | NVME_DNR;
+    }
+}
+
+static void nvme_process_sq(void *opaque)
+{
+    NvmeSQueue *sq = opaque;
+    NvmeCtrl *n = sq->ctrl;
+    NvmeCQueue *cq = n->cq[sq->cqid];
+    NvmeRequest *req;
+    NvmeCmd cmd;
+    uint16_t status;
+    hwaddr addr;
+
+    nvme_update_sq_tail(sq);
+    bdrv_io_plug(n->conf.bs);
+    while (!nvme_sq_empty(sq) && !QTAILQ_EMPTY(&sq->req_list)) {
+        addr = sq->dma_addr + (sq->head << NVME_SQE_BITS);
+        pci_dma_read(&n->dev, addr, &cmd, sizeof(cmd));
+        nvme_inc_sq_head(sq);
+
+        req = QTAILQ_FIRST(&sq->req_list);
+        QTAILQ_REMOVE(&sq->req_list, req, entry);
+        QTAILQ_INSERT_TAIL(&sq->out_req_list, req, entry);
+        memset(&req->cqe, 0, sizeof(req->cqe));
+        req->cqe.cid = cmd.cid;
+        req->aiocb = NULL;
+
+        status = sq->sqid ? nvme_io_cmd(n, &cmd, req) :
+            nvme_admin_cmd(n, &cmd, req);
+        if (status != NVME_NO_COMPLETE) {
+            req->status = status;
+            nvme_enqueue_req_completion(cq, req);
+        }
+
+        if (sq->db_addr) {
+            /* publish what was consumed, then look for new entries */
+            nvme_update_sq_eventidx(sq);
+            smp_mb();
+            nvme_update_sq_tail(sq);
+        }
+    }
+    bdrv_io_unplug(n->conf.bs);
+}
+
+static void nvme_clear_ctrl(NvmeCtrl *n)
+{
+    int i;
+
+    for (i = 0; i < n->num_queues; i++) {
+        if (n->sq[i] != NULL) {
+            nvme_free_sq(n->sq[i], n);
+        }
+    }
+    for (i = 0; i < n->num_queues; i++) {
+        if (n->cq[i] != NULL) {
+            nvme_free_cq(n->cq[i], n);
+        }
+    }
+
+    bdrv_flush(n->conf.bs);
+    n->dbbuf_enabled = false;
+    n->dbbuf_dbs = 0;
+    n->dbbuf_eis = 0;
+    n->irq_status = 0;
+    nvme_irq_check(n);
+    n->bar.cc = 0;
+}
+
+static int nvme_start_ctrl(NvmeCtrl *n)
+{
+    uint32_t mps = NVME_CC_MPS(n->bar.cc);
+
+    if (n->cq[0] || n->sq[0] ||
+        !n->bar.asq || n->bar.asq & (NVME_PAGE_SIZE - 1) ||
+        !n->bar.acq || n->bar.acq & (NVME_PAGE_SIZE - 1) ||
+        mps < NVME_CAP_MPSMIN(n->bar.cap) ||
+        mps > NVME_CAP_MPSMAX(n->bar.cap) ||
+        !NVME_AQA_ASQS(n->bar.aqa) || !NVME_AQA_ACQS(n->bar.aqa)) {
+        return -1;
+    }
+
+    nvme_init_cq(&n->admin_cq, n, n->bar.acq, 0, 0,
+                 NVME_AQA_ACQS(n->bar.aqa) + 1, 1);
+    nvme_init_sq(&n->admin_sq, n, n->bar.asq, 0, 0,
+                 NVME_AQA_ASQS(n->bar.aqa) + 1);
+    return 0;
+}
+
+static void nvme_write_bar(NvmeCtrl *n, hwaddr offset, uint32_t data)
+{
+    switch (offset) {
+    case NVME_REG_INTMS:
+        n->bar.intms |= data;
+        n->bar.intmc = n->bar.intms;
+        nvme_irq_check(n);
+        break;
+    case NVME_REG_INTMC:
+        n->bar.intms &= ~data;
+        n->bar.intmc = n->bar.intms;
+        nvme_irq_check(n);
+        break;
+    case NVME_REG_CC:
+        if (NVME_CC_EN(data) && !NVME_CC_EN(n->bar.cc)) {
+            n->bar.cc = data;
+            if (nvme_start_ctrl(n)) {
+                trace_nvme_start_failed(n->bar.asq, n->bar.acq, n->bar.aqa);
+                n->bar.csts = NVME_CSTS_FAILED;
+            } else {
+                n->bar.csts = NVME_CSTS_RDY;
+            }
+        } else if (!NVME_CC_EN(data) && NVME_CC_EN(n->bar.cc)) {
+            nvme_clear_ctrl(n);
+            n->bar.csts &= ~NVME_CSTS_RDY;
+        }
+        if (NVME_CC_SHN(data) && !NVME_CC_SHN(n->bar.cc)) {
+            nvme_clear_ctrl(n);
+            n->bar.cc = data;
+            n->bar.csts |= NVME_CSTS_SHST_COMPLETE;
+        } else if (!NVME_CC_SHN(data) && NVME_CC_SHN(n->bar.cc)) {
+            n->bar.csts &= ~NVME_CSTS_SHST_COMPLETE;
+            n->bar.cc = data;
+        } else {
+            n->bar.cc = data;
+        }
+        break;
+    case NVME_REG_AQA:
+        n->bar.aqa = data & 0x0fff0fff;
+        break;
+    case NVME_REG_ASQ:
+        n->bar.asq = (n->bar.asq & 0xffffffff00000000ULL) | data;
+        break;
+    case NVME_REG_ASQ + 4:
+        n->bar.asq = (n->bar.asq & 0xffffffff) | ((uint64_t)data << 32);
+        break;
+    case NVME_REG_ACQ:
+        n->bar.acq = (n->bar.acq & 0xffffffff00000000ULL) | data;
+        break;
+    case NVME_REG_ACQ + 4:
+        n->bar.acq = (n->bar.acq & 0xffffffff) | ((uint64_t)data << 32);
+        break;
+    default:
+        break;
+    }
+}
+
+static uint32_t nvme_read_bar(NvmeCtrl *n, hwaddr offset)
+{
+    switch (offset) {
+    case NVME_REG_CAP:
+        return n->bar.cap;
+    case NVME_REG_CAP + 4:
+        return n->bar.cap >> 32;
+    case NVME_REG_VS:
+        return n->bar.vs;
+    case NVME_REG_INTMS:
+        return n->bar.intms;
+    case NVME_REG_INTMC:
+        return n->bar.intmc;
+    case NVME_REG_CC:
+        return n->bar.cc;
+    case NVME_REG_CSTS:
+        return n->bar.csts;
+    case NVME_REG_AQA:
+        return n->bar.aqa;
+    case NVME_REG_ASQ:
+        return n->bar.asq;
+    case NVME_REG_ASQ + 4:
+        return n->bar.asq >> 32;
+    case NVME_REG_ACQ:
+        return n->bar.acq;
+    case NVME_REG_ACQ + 4:
+        return n->bar.acq >> 32;
+    default:
+        return 0;
+    }
+}
+
+static uint64_t nvme_mmio_read(void *opaque, hwaddr addr, unsigned size)
+{
+    NvmeCtrl *n = opaque;
+    uint64_t val;
+
+    if (addr & (size - 1) || addr >= NVME_REG_SIZE) {
+        return 0;
+    }
+    val = nvme_read_bar(n, addr);
+    if (size == 8) {
+        val |= (uint64_t)nvme_read_bar(n, addr + 4) << 32;
+    }
+    return val;
+}
+
+static void nvme_process_db(NvmeCtrl *n, hwaddr addr, uint32_t val)
+{
+    NvmeSQueue *sq;
+    NvmeCQueue *cq;
+    uint32_t qid;
+    bool start_sqs;
+
+    if (addr & 3) {
+        return;
+    }
+
+    qid = (addr - NVME_DB_OFFSET) >> 3;
+    if (((addr - NVME_DB_OFFSET) >> 2) & 1) {
+        if (nvme_check_cqid(n, qid)) {
+            trace_nvme_bad_doorbell(qid, 1, val);
+            return;
+        }
+        cq = n->cq[qid];
+        if (val >= cq->size) {
+            trace_nvme_bad_doorbell(qid, 1, val);
+            return;
+        }
+        start_sqs = nvme_cq_full(cq);
+        cq->head = val;
+        if (start_sqs || !QTAILQ_EMPTY(&cq->req_list)) {
+            qemu_bh_schedule(cq->bh);
+        }
+        if (cq->tail == cq->head) {
+            nvme_irq_deassert(n, cq);
+        }
+    } else {
+        if (nvme_check_sqid(n, qid)) {
+            trace_nvme_bad_doorbell(qid, 0, val);
+            return;
+        }
+        sq = n->sq[qid];
+        if (val >= sq->size) {
+            trace_nvme_bad_doorbell(qid, 0, val);
+            return;
+        }
+        sq->tail = val;
+        nvme_process_sq(sq);
+    }
+}
+
+static void nvme_mmio_write(void *opaque, hwaddr addr, uint64_t data,
+                            unsigned size)
+{
+    NvmeCtrl *n = opaque;
+
+    if (addr < NVME_REG_SIZE) {
+        if (addr & (size - 1)) {
+            return;
+        }
+        nvme_write_bar(n, addr, data);
+        if (size == 8) {
+            nvme_write_bar(n, addr + 4, data >> 32);
+        }
+    } else if (addr >= NVME_DB_OFFSET) {
+        nvme_process_db(n, addr, data);
+    }
+}
+
+static const MemoryRegionOps nvme_mmio_ops = {
+    .read = nvme_mmio_read,
+    .write = nvme_mmio_write,
+    .endianness = DEVICE_LITTLE_ENDIAN,
+    .impl = {
+        .min_access_size = 4,
+        .max_access_size = 8,
+    },
+};
+
+static void nvme_init_identify(NvmeCtrl *n)
+{
+    NvmeIdCtrl *id = &n->id_ctrl;
+    NvmeIdNs *ns = &n->id_ns;
+    uint64_t nsze = cpu_to_le64(n->ns_blocks);
+
+    memset(id, 0, sizeof(*id));
+    id->vid = cpu_to_le16(pci_get_word(n->dev.config + PCI_VENDOR_ID));
+    id->ssvid = cpu_to_le16(pci_get_word(n->dev.config +
+                                         PCI_SUBSYSTEM_VENDOR_ID));
+    memset(id->sn, ' ', sizeof(id->sn));
+    memcpy(id->sn, n->serial, MIN(strlen(n->serial), sizeof(id->sn)));
+    memset(id->mn, ' ', sizeof(id->mn));
+    memcpy(id->mn, "QEMU NVMe Ctrl", strlen("QEMU NVMe Ctrl"));
+    memset(id->fr, ' ', sizeof(id->fr));
+    memcpy(id->fr, "1.0", strlen("1.0"));
+    id->rab = 6;
+    id->ieee[0] = 0x00;
+    id->ieee[1] = 0x02;
+    id->ieee[2] = 0xb3;
+    id->mdts = NVME_MAX_TRANSFER_BITS;
+    id->ver = cpu_to_le32(0x00010200);
+    id->oacs = cpu_to_le16(NVME_OACS_DBBUF);
+    id->acl = 3;
+    id->frmw = 7 << 1;
+    id->sqes = (NVME_SQE_BITS << 4) | NVME_SQE_BITS;
+    id->cqes = (NVME_CQE_BITS << 4) | NVME_CQE_BITS;
+    id->nn = cpu_to_le32(1);
+    id->vwc = 1;
+    id->psd[0].mp = cpu_to_le16(0x9c4);
+    id->psd[0].enlat = cpu_to_le32(0x10);
+    id->psd[0].exlat = cpu_to_le32(0x4);
+
+    memset(ns, 0, sizeof(*ns));
+    ns->nsze = nsze;
+    ns->ncap = nsze;
+    ns->nuse = nsze;
+    ns->nlbaf = 0;
+    ns->flbas = 0;
+    ns->lbaf[0].ds = n->lba_bits;
+}
+
+static void nvme_init_bar(NvmeCtrl *n)
+{
+    memset(&n->bar, 0, sizeof(n->bar));
+    n->bar.cap = NVME_MAX_QUEUE_ENTRIES | NVME_CAP_CQR | NVME_CAP_TO(0xf) |
+        NVME_CAP_CSS_NVM;
+    n->bar.vs = 0x00010200;
+}
+
+static void nvme_reset(DeviceState *dev)
+{
+    NvmeCtrl *n = DO_UPCAST(NvmeCtrl, dev.qdev, dev);
+
+    nvme_clear_ctrl(n);
+    nvme_init_bar(n);
+}
+
+static int nvme_init(PCIDevice *pci_dev)
+{
+    NvmeCtrl *n = DO_UPCAST(NvmeCtrl, dev, pci_dev);
+    uint8_t *pci_conf;
+    int64_t bs_size;
+    int i;
+
+    nvme_check_size();
+
+    if (!n->conf.bs) {
+        error_report("nvme: drive property not set");
+        return -1;
+    }
+    if (!bdrv_is_inserted(n->conf.bs)) {
+        error_report("nvme: device needs media, but drive is empty");
+        return -1;
+    }
+    if (n->num_queues < 2 || n->num_queues > NVME_MAX_QS) {
+        error_report("nvme: num_queues must be between 2 and %d",
+                     NVME_MAX_QS);
+        return -1;
+    }
+    bs_size = bdrv_getlength(n->conf.bs);
+    if (bs_size < 0) {
+        error_report("nvme: could not get drive size");
+        return -1;
+    }
+
+    blkconf_serial(&n->conf, &n->serial);
+    if (!n->serial) {
+        error_report("nvme: serial property not set");
+        return -1;
+    }
+    bdrv_set_buffer_alignment(n->conf.bs, n->conf.logical_block_size);
+
+    n->lba_bits = ffs(n->conf.logical_block_size) - 1;
+    n->ns_blocks = bs_size >> n->lba_bits;
+    n->reg_size = 1 << qemu_fls(NVME_DB_OFFSET + n->num_queues * 8 - 1);
+    n->sq = g_new0(NvmeSQueue *, n->num_queues);
+    n->cq = g_new0(NvmeCQueue *, n->num_queues);
+
+    if (!kvm_has_many_ioeventfds()) {
+        n->flags &= ~NVME_FLAG_USE_IOEVENTFD;
+    }
+
+    pci_conf = n->dev.config;
+    pci_conf[PCI_INTERRUPT_PIN] = 1;
+    pci_config_set_prog_interface(pci_conf, 0x2);
+    pci_config_set_class(pci_conf, PCI_CLASS_STORAGE_EXPRESS);
+
+    memory_region_init_io(&n->iomem, &nvme_mmio_ops, n, "nvme", n->reg_size);
+    pci_register_bar(&n->dev, 0,
+                     PCI_BASE_ADDRESS_SPACE_MEMORY |
+                     PCI_BASE_ADDRESS_MEM_TYPE_64,
+                     &n->iomem);
+    if (msix_init_exclusive_bar(&n->dev, n->num_queues, 4) == 0) {
+        for (i = 0; i < n->num_queues; i++) {
+            msix_vector_use(&n->dev, i);
+        }
+    }
+
+    nvme_init_bar(n);
+    nvme_init_identify(n);
+    return 0;
+}
+
+static void nvme_exit(PCIDevice *pci_dev)
+{
+    NvmeCtrl *n = DO_UPCAST(NvmeCtrl, dev, pci_dev);
+
+    nvme_clear_ctrl(n);
+    g_free(n->sq);
+    g_free(n->cq);
+    msix_uninit_exclusive_bar(pci_dev);
+    memory_region_destroy(&n->iomem);
+}
+
+static Property nvme_props[] = {
+    DEFINE_BLOCK_PROPERTIES(NvmeCtrl, conf),
+    DEFINE_PROP_STRING("serial", NvmeCtrl, serial),
+    DEFINE_PROP_UINT32("num_queues", NvmeCtrl, num_queues, 64),
+    DEFINE_PROP_BIT("ioeventfd", NvmeCtrl, flags,
+                    NVME_FLAG_USE_IOEVENTFD_BIT, true),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
+static const VMStateDescription nvme_vmstate = {
+    .name = "nvme",
+    .unmigratable = 1,
+};
+
+static void nvme_class_init(ObjectClass *oc, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(oc);
+    PCIDeviceClass *pc = PCI_DEVICE_CLASS(oc);
+
+    pc->init = nvme_init;
+    pc->exit = nvme_exit;
+    pc->class_id = PCI_CLASS_STORAGE_EXPRESS;
+    pc->vendor_id = PCI_VENDOR_ID_INTEL;
+    pc->device_id = 0x5845;
+    pc->revision = 1;
+
+    dc->desc = "Non-Volatile Memory Express";
+    dc->reset = nvme_reset;
+    dc->props = nvme_props;
+    dc->vmsd = &nvme_vmstate;
+}
+
+static const TypeInfo nvme_info = {
+    .name          = "nvme",
+    .parent        = TYPE_PCI_DEVICE,
+    .instance_size = sizeof(NvmeCtrl),
+    .class_init    = nvme_class_init,
+};
+
+static void nvme_register_types(void)
+{
+    type_register_static(&nvme_info);
+}
+
+type_init(nvme_register_types)
@@ -0,0 +1,311 @@
+/*
+ * QEMU NVM Express Controller
+ *
+ * Register, command and data structure layouts from the NVM Express
+ * Specification, revision 1.2, plus the Doorbell Buffer Config command
+ * of revision 1.3.  All fields are little-endian.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef HW_NVME_H
+#define HW_NVME_H
+
+#include "qemu-common.h"
+
+/* Controller registers */
+enum NvmeRegs {
+    NVME_REG_CAP    = 0x00,
+    NVME_REG_VS     = 0x08,
+    NVME_REG_INTMS  = 0x0c,
+    NVME_REG_INTMC  = 0x10,
+    NVME_REG_CC     = 0x14,
+    NVME_REG_CSTS   = 0x1c,
+    NVME_REG_NSSR   = 0x20,
+    NVME_REG_AQA    = 0x24,
+    NVME_REG_ASQ    = 0x28,
+    NVME_REG_ACQ    = 0x30,
+    NVME_REG_SIZE   = 0x38,
+};
+
+/* Doorbells start here; with CAP.DSTRD = 0 each queue pair takes 8 bytes */
+#define NVME_DB_OFFSET          0x1000
+
+typedef struct NvmeBar {
+    uint64_t    cap;
+    uint32_t    vs;
+    uint32_t    intms;
+    uint32_t    intmc;
+    uint32_t    cc;
+    uint32_t    csts;
+    uint32_t    aqa;
+    uint64_t    asq;
+    uint64_t    acq;
+} NvmeBar;
+
+#define NVME_CAP_MQES(cap)      ((cap) & 0xffff)
+#define NVME_CAP_MPSMIN(cap)    (((cap) >> 48) & 0xf)
+#define NVME_CAP_MPSMAX(cap)    (((cap) >> 52) & 0xf)
+
+#define NVME_CAP_CQR            (1ULL << 16)
+#define NVME_CAP_TO(to)         ((uint64_t)(to) << 24)
+#define NVME_CAP_CSS_NVM        (1ULL << 37)
+
+#define NVME_CC_EN(cc)          ((cc) & 0x1)
+#define NVME_CC_CSS(cc)         (((cc) >> 4) & 0x7)
+#define NVME_CC_MPS(cc)         (((cc) >> 7) & 0xf)
+#define NVME_CC_AMS(cc)         (((cc) >> 11) & 0x7)
+#define NVME_CC_SHN(cc)         (((cc) >> 14) & 0x3)
+#define NVME_CC_IOSQES(cc)      (((cc) >> 16) & 0xf)
+#define NVME_CC_IOCQES(cc)      (((cc) >> 20) & 0xf)
+
+#define NVME_CSTS_RDY           (1 << 0)
+#define NVME_CSTS_FAILED        (1 << 1)
+#define NVME_CSTS_SHST_COMPLETE (2 << 2)
+
+#define NVME_AQA_ASQS(aqa)      ((aqa) & 0xfff)
+#define NVME_AQA_ACQS(aqa)      (((aqa) >> 16) & 0xfff)
+
+typedef struct NvmeCmd {
+    uint8_t     opcode;
+    uint8_t     fuse;
+    uint16_t    cid;
+    uint32_t    nsid;
+    uint64_t    res1;
+    uint64_t    mptr;
+    uint64_t    prp1;
+    uint64_t    prp2;
+    uint32_t    cdw10;
+    uint32_t    cdw11;
+    uint32_t    cdw12;
+    uint32_t    cdw13;
+    uint32_t    cdw14;
+    uint32_t    cdw15;
+} NvmeCmd;
+
+enum NvmeAdminCommands {
+    NVME_ADM_CMD_DELETE_SQ      = 0x00,
+    NVME_ADM_CMD_CREATE_SQ      = 0x01,
+    NVME_ADM_CMD_GET_LOG_PAGE   = 0x02,
+    NVME_ADM_CMD_DELETE_CQ      = 0x04,
+    NVME_ADM_CMD_CREATE_CQ      = 0x05,
+    NVME_ADM_CMD_IDENTIFY       = 0x06,
+    NVME_ADM_CMD_ABORT          = 0x08,
+    NVME_ADM_CMD_SET_FEATURES   = 0x09,
+    NVME_ADM_CMD_GET_FEATURES   = 0x0a,
+    NVME_ADM_CMD_ASYNC_EV_REQ   = 0x0c,
+    NVME_ADM_CMD_DBBUF_CONFIG   = 0x7c,
+};
+
+enum NvmeIoCommands {
+    NVME_CMD_FLUSH              = 0x00,
+    NVME_CMD_WRITE              = 0x01,
+    NVME_CMD_READ               = 0x02,
+};
+
+typedef struct NvmeDeleteQ {
+    uint8_t     opcode;
+    uint8_t     flags;
+    uint16_t    cid;
+    uint32_t    rsvd1[9];
+    uint16_t    qid;
+    uint16_t    rsvd10;
+    uint32_t    rsvd11[5];
+} NvmeDeleteQ;
+
+typedef struct NvmeCreateCq {
+    uint8_t     opcode;
+    uint8_t     flags;
+    uint16_t    cid;
+    uint32_t    rsvd1[5];
+    uint64_t    prp1;
+    uint64_t    rsvd8;
+    uint16_t    cqid;
+    uint16_t    qsize;
+    uint16_t    cq_flags;
+    uint16_t    irq_vector;
+    uint32_t    rsvd12[4];
+} NvmeCreateCq;
+
+#define NVME_CQ_FLAGS_PC(cq_flags)  ((cq_flags) & 0x1)
+#define NVME_CQ_FLAGS_IEN(cq_flags) (((cq_flags) >> 1) & 0x1)
+
+typedef struct NvmeCreateSq {
+    uint8_t     opcode;
+    uint8_t     flags;
+    uint16_t    cid;
+    uint32_t    rsvd1[5];
+    uint64_t    prp1;
+    uint64_t    rsvd8;
+    uint16_t    sqid;
+    uint16_t    qsize;
+    uint16_t    sq_flags;
+    uint16_t    cqid;
+    uint32_t    rsvd12[4];
+} NvmeCreateSq;
+
+#define NVME_SQ_FLAGS_PC(sq_flags)  ((sq_flags) & 0x1)
+
+typedef struct NvmeIdentify {
+    uint8_t     opcode;
+    uint8_t     flags;
+    uint16_t    cid;
+    uint32_t    nsid;
+    uint64_t    rsvd2[2];
+    uint64_t    prp1;
+    uint64_t    prp2;
+    uint32_t    cns;
+    uint32_t    rsvd11[5];
+} NvmeIdentify;
+
+enum NvmeIdCns {
+    NVME_ID_CNS_NS              = 0x00,
+    NVME_ID_CNS_CTRL            = 0x01,
+    NVME_ID_CNS_NS_ACTIVE_LIST  = 0x02,
+};
+
+typedef struct NvmeRwCmd {
+    uint8_t     opcode;
+    uint8_t     flags;
+    uint16_t    cid;
+    uint32_t    nsid;
+    uint64_t    rsvd2;
+    uint64_t    mptr;
+    uint64_t    prp1;
+    uint64_t    prp2;
+    uint64_t    slba;
+    uint16_t    nlb;
+    uint16_t    control;
+    uint32_t    dsmgmt;
+    uint32_t    reftag;
+    uint16_t    apptag;
+    uint16_t    appmask;
+} NvmeRwCmd;
+
+typedef struct NvmeCqe {
+    uint32_t    result;
+    uint32_t    rsvd;
+    uint16_t    sq_head;
+    uint16_t    sq_id;
+    uint16_t    cid;
+    uint16_t    status;
+} NvmeCqe;
+
+/*
+ * Status codes: the status code type in bits 8-10, the status code in
+ * bits 0-7.  They are shifted left by one in the completion entry to make
+ * room for the phase tag.
+ */
+enum NvmeStatusCodes {
+    NVME_SUCCESS                = 0x0000,
+    NVME_INVALID_OPCODE         = 0x0001,
+    NVME_INVALID_FIELD          = 0x0002,
+    NVME_DATA_TRAS_ERROR        = 0x0004,
+    NVME_INTERNAL_DEV_ERROR     = 0x0006,
+    NVME_INVALID_NSID           = 0x000b,
+    NVME_LBA_RANGE              = 0x0080,
+    NVME_INVALID_CQID           = 0x0100,
+    NVME_INVALID_QID            = 0x0101,
+    NVME_MAX_QSIZE_EXCEEDED     = 0x0102,
+    NVME_INVALID_IRQ_VECTOR     = 0x0108,
+    NVME_INVALID_QUEUE_DEL      = 0x010c,
+    NVME_DNR                    = 0x4000,
+    NVME_NO_COMPLETE            = 0xffff,
+};
+
+typedef struct NvmePSD {
+    uint16_t    mp;
+    uint16_t    reserved;
+    uint32_t    enlat;
+    uint32_t    exlat;
+    uint8_t     rrt;
+    uint8_t     rrl;
+    uint8_t     rwt;
+    uint8_t     rwl;
+    uint8_t     resv[16];
+} NvmePSD;
+
+typedef struct NvmeIdCtrl {
+    uint16_t    vid;
+    uint16_t    ssvid;
+    uint8_t     sn[20];
+    uint8_t     mn[40];
+    uint8_t     fr[8];
+    uint8_t     rab;
+    uint8_t     ieee[3];
+    uint8_t     cmic;
+    uint8_t     mdts;
+    uint16_t    cntlid;
+    uint32_t    ver;
+    uint8_t     rsvd84[172];
+    uint16_t    oacs;
+    uint8_t     acl;
+    uint8_t     aerl;
+    uint8_t     frmw;
+    uint8_t     lpa;
+    uint8_t     elpe;
+    uint8_t     npss;
+    uint8_t     rsvd264[248];
+    uint8_t     sqes;
+    uint8_t     cqes;
+    uint16_t    rsvd514;
+    uint32_t    nn;
+    uint16_t    oncs;
+    uint16_t    fuses;
+    uint8_t     fna;
+    uint8_t     vwc;
+    uint16_t    awun;
+    uint16_t    awupf;
+    uint8_t     rsvd530[1518];
+    NvmePSD     psd[32];
+    uint8_t     vs[1024];
+} NvmeIdCtrl;
+
+#define NVME_OACS_DBBUF         (1 << 8)
+
+#define NVME_CTRL_SQES_MIN(sqes) ((sqes) & 0xf)
+#define NVME_CTRL_CQES_MIN(cqes) ((cqes) & 0xf)
+
+enum NvmeFeatureIds {
+    NVME_VOLATILE_WRITE_CACHE   = 0x06,
+    NVME_NUMBER_OF_QUEUES       = 0x07,
+};
+
+typedef struct NvmeLBAF {
+    uint16_t    ms;
+    uint8_t     ds;
+    uint8_t     rp;
+} NvmeLBAF;
+
+typedef struct NvmeIdNs {
+    uint64_t    nsze;
+    uint64_t    ncap;
+    uint64_t    nuse;
+    uint8_t     nsfeat;
+    uint8_t     nlbaf;
+    uint8_t     flbas;
+    uint8_t     mc;
+    uint8_t     dpc;
+    uint8_t     dps;
+    uint8_t     res30[98];
+    NvmeLBAF    lbaf[16];
+    uint8_t     res192[192];
+    uint8_t     vs[3712];
+} NvmeIdNs;
+
+static inline void nvme_check_size(void)
+{
+    QEMU_BUILD_BUG_ON(sizeof(NvmeCmd) != 64);
+    QEMU_BUILD_BUG_ON(sizeof(NvmeDeleteQ) != 64);
+    QEMU_BUILD_BUG_ON(sizeof(NvmeCreateCq) != 64);
+    QEMU_BUILD_BUG_ON(sizeof(NvmeCreateSq) != 64);
+    QEMU_BUILD_BUG_ON(sizeof(NvmeIdentify) != 64);
+    QEMU_BUILD_BUG_ON(sizeof(NvmeRwCmd) != 64);
+    QEMU_BUILD_BUG_ON(sizeof(NvmeCqe) != 16);
+    QEMU_BUILD_BUG_ON(sizeof(NvmePSD) != 32);
+    QEMU_BUILD_BUG_ON(sizeof(NvmeIdCtrl) != 4096);
+    QEMU_BUILD_BUG_ON(sizeof(NvmeIdNs) != 4096);
+}
+
+#endif
@@ -216,6 +216,18 @@ int e820_add_entry(uint64_t, uint64_t, uint32_t);
             .driver   = "virtio-blk-pci",\
             .property = "discard_granularity",\
             .value    = stringify(0),\
+	},{\
+            .driver   = "e1000",\
+            .property = "mitigation",\
+            .value    = "off",\
+	},{\
+            .driver   = "virtio-net-pci",\
+            .property = "sw_offload",\
+            .value    = "off",\
+	},{\
+            .driver   = "fw_cfg",\
+            .property = "dma_enabled",\
+            .value    = "off",\
 	}
 
 #endif
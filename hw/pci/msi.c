@@ -20,6 +20,7 @@
 
 #include "hw/pci/msi.h"
 #include "qemu/range.h"
+#include "sysemu/kvm.h"
 
 /* Eventually those constants should go to Linux pci_regs.h */
 #define PCI_MSI_PENDING_32      0x10
@@ -122,6 +123,90 @@ void msi_set_message(PCIDevice *dev, MSIMessage msg)
     pci_set_word(dev->config + msi_data_off(dev, msi64bit), msg.data);
 }
 
+/*
+ * With KVM, a vector that fired once gets an MSI route with an irqfd bound
+ * to it, so later notifications are a write to the eventfd instead of an
+ * ioctl on the MSI window.  The route follows the message when the guest
+ * reprograms it.  Routes are created and updated under the iothread lock;
+ * once a route exists, signalling it is safe from any thread.
+ *
+ * Returns false if the message must be delivered the slow way.
+ */
+bool msi_route_notify(MSIRoute *route, MSIMessage msg)
+{
+    int virq;
+
+    if (!kvm_msi_via_irqfd_enabled() || route->virq == MSI_ROUTE_FAILED) {
+        return false;
+    }
+
+    if (route->virq == MSI_ROUTE_NONE) {
+        /* GSIs are a limited resource, don't retry until the next reset */
+        route->virq = MSI_ROUTE_FAILED;
+        if (event_notifier_init(&route->notifier, 0) < 0) {
+            return false;
+        }
+        virq = kvm_irqchip_add_msi_route(kvm_state, msg);
+        if (virq < 0) {
+            event_notifier_cleanup(&route->notifier);
+            return false;
+        }
+        if (kvm_irqchip_add_irqfd_notifier(kvm_state, &route->notifier,
+                                           virq) < 0) {
+            kvm_irqchip_release_virq(kvm_state, virq);
+            event_notifier_cleanup(&route->notifier);
+            return false;
+        }
+        route->virq = virq;
+        route->msg = msg;
+    } else if (route->msg.address != msg.address ||
+               route->msg.data != msg.data) {
+        if (kvm_irqchip_update_msi_route(kvm_state, route->virq, msg) < 0) {
+            msi_route_release(route);
+            return false;
+        }
+        route->msg = msg;
+    }
+
+    event_notifier_set(&route->notifier);
+    return true;
+}
+
+void msi_route_release(MSIRoute *route)
+{
+    if (route->virq >= 0) {
+        kvm_irqchip_remove_irqfd_notifier(kvm_state, &route->notifier,
+                                          route->virq);
+        kvm_irqchip_release_virq(kvm_state, route->virq);
+        event_notifier_cleanup(&route->notifier);
+    }
+    route->virq = MSI_ROUTE_NONE;
+}
+
+MSIRoute *msi_routes_new(unsigned int nr_vectors)
+{
+    MSIRoute *routes = g_new0(MSIRoute, nr_vectors);
+    unsigned int i;
+
+    for (i = 0; i < nr_vectors; i++) {
+        routes[i].virq = MSI_ROUTE_NONE;
+    }
+    return routes;
+}
+
+void msi_routes_free(MSIRoute *routes, unsigned int nr_vectors)
+{
+    unsigned int i;
+
+    if (!routes) {
+        return;
+    }
+    for (i = 0; i < nr_vectors; i++) {
+        msi_route_release(&routes[i]);
+    }
+    g_free(routes);
+}
+
 MSIMessage msi_get_message(PCIDevice *dev, unsigned int vector)
 {
     uint16_t flags = pci_get_word(dev->config + msi_flags_off(dev));
@@ -193,6 +278,7 @@ int msi_init(struct PCIDevice *dev, uint8_t offset,
 
     dev->msi_cap = config_offset;
     dev->cap_present |= QEMU_PCI_CAP_MSI;
+    dev->msi_routes = msi_routes_new(PCI_MSI_VECTORS_MAX);
 
     pci_set_word(dev->config + msi_flags_off(dev), flags);
     pci_set_word(dev->wmask + msi_flags_off(dev),
@@ -224,6 +310,8 @@ void msi_uninit(struct PCIDevice *dev)
     cap_size = msi_cap_sizeof(flags);
     pci_del_capability(dev, PCI_CAP_ID_MSI, cap_size);
     dev->cap_present &= ~QEMU_PCI_CAP_MSI;
+    msi_routes_free(dev->msi_routes, PCI_MSI_VECTORS_MAX);
+    dev->msi_routes = NULL;
 
     MSI_DEV_PRINTF(dev, "uninit\n");
 }
@@ -232,11 +320,16 @@ void msi_reset(PCIDevice *dev)
 {
     uint16_t flags;
     bool msi64bit;
+    unsigned int vector;
 
     if (!msi_present(dev)) {
         return;
     }
 
+    for (vector = 0; vector < PCI_MSI_VECTORS_MAX; vector++) {
+        msi_route_release(&dev->msi_routes[vector]);
+    }
+
     flags = pci_get_word(dev->config + msi_flags_off(dev));
     flags &= ~(PCI_MSI_FLAGS_QSIZE | PCI_MSI_FLAGS_ENABLE);
     msi64bit = flags & PCI_MSI_FLAGS_64BIT;
@@ -291,6 +384,9 @@ void msi_notify(PCIDevice *dev, unsigned int vector)
                    "notify vector 0x%x"
                    " address: 0x%"PRIx64" data: 0x%"PRIx32"\n",
                    vector, msg.address, msg.data);
+    if (msi_route_notify(&dev->msi_routes[vector], msg)) {
+        return;
+    }
     stl_le_phys(msg.address, msg.data);
 }
 
@@ -23,12 +23,23 @@
 
 #include "qemu-common.h"
 #include "hw/pci/pci.h"
+#include "qemu/event_notifier.h"
 
 struct MSIMessage {
     uint64_t address;
     uint32_t data;
 };
 
+/* Cached KVM route of one vector, see msi_route_notify() */
+#define MSI_ROUTE_NONE      -1
+#define MSI_ROUTE_FAILED    -2
+
+struct MSIRoute {
+    EventNotifier notifier;
+    MSIMessage msg;
+    int virq;
+};
+
 extern bool msi_supported;
 
 void msi_set_message(PCIDevice *dev, MSIMessage msg);
@@ -42,6 +53,11 @@ void msi_notify(PCIDevice *dev, unsigned int vector);
 void msi_write_config(PCIDevice *dev, uint32_t addr, uint32_t val, int len);
 unsigned int msi_nr_vectors_allocated(const PCIDevice *dev);
 
+MSIRoute *msi_routes_new(unsigned int nr_vectors);
+void msi_routes_free(MSIRoute *routes, unsigned int nr_vectors);
+bool msi_route_notify(MSIRoute *route, MSIMessage msg);
+void msi_route_release(MSIRoute *route);
+
 static inline bool msi_present(const PCIDevice *dev)
 {
     return dev->cap_present & QEMU_PCI_CAP_MSI;
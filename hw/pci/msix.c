@@ -277,6 +277,7 @@ int msix_init(struct PCIDevice *dev, unsigned short nentries,
     dev->msix_table = g_malloc0(table_size);
     dev->msix_pba = g_malloc0(pba_size);
     dev->msix_entry_used = g_malloc0(nentries * sizeof *dev->msix_entry_used);
+    dev->msix_routes = msi_routes_new(nentries);
 
     msix_mask_all(dev, nentries);
 
@@ -336,6 +337,7 @@ static void msix_free_irq_entries(PCIDevice *dev)
     for (vector = 0; vector < dev->msix_entries_nr; ++vector) {
         dev->msix_entry_used[vector] = 0;
         msix_clr_pending(dev, vector);
+        msi_route_release(&dev->msix_routes[vector]);
     }
 }
 
@@ -345,6 +347,7 @@ static void msix_clear_all_vectors(PCIDevice *dev)
 
     for (vector = 0; vector < dev->msix_entries_nr; ++vector) {
         msix_clr_pending(dev, vector);
+        msi_route_release(&dev->msix_routes[vector]);
     }
 }
 
@@ -357,6 +360,8 @@ void msix_uninit(PCIDevice *dev, MemoryRegion *table_bar, MemoryRegion *pba_bar)
     pci_del_capability(dev, PCI_CAP_ID_MSIX, MSIX_CAP_LENGTH);
     dev->msix_cap = 0;
     msix_free_irq_entries(dev);
+    msi_routes_free(dev->msix_routes, dev->msix_entries_nr);
+    dev->msix_routes = NULL;
     dev->msix_entries_nr = 0;
     memory_region_del_subregion(pba_bar, &dev->msix_pba_mmio);
     memory_region_destroy(&dev->msix_pba_mmio);
@@ -439,6 +444,11 @@ void msix_notify(PCIDevice *dev, unsigned vector)
 
     msg = msix_get_message(dev, vector);
 
+    /* Devices with vector notifiers set up their own irqfds */
+    if (!dev->msix_vector_use_notifier &&
+        msi_route_notify(&dev->msix_routes[vector], msg)) {
+        return;
+    }
     stl_le_phys(msg.address, msg.data);
 }
 
@@ -482,6 +492,7 @@ void msix_vector_unuse(PCIDevice *dev, unsigned vector)
         return;
     }
     msix_clr_pending(dev, vector);
+    msi_route_release(&dev->msix_routes[vector]);
 }
 
 void msix_unuse_all_vectors(PCIDevice *dev)
@@ -525,6 +536,11 @@ int msix_set_vector_notifiers(PCIDevice *dev,
 
     assert(use_notifier && release_notifier);
 
+    /* The device takes over, don't hold GSIs for the generic routes */
+    for (vector = 0; vector < dev->msix_entries_nr; vector++) {
+        msi_route_release(&dev->msix_routes[vector]);
+    }
+
     dev->msix_vector_use_notifier = use_notifier;
     dev->msix_vector_release_notifier = release_notifier;
     dev->msix_vector_poll_notifier = poll_notifier;
@@ -30,6 +30,7 @@
 #include "sysemu/sysemu.h"
 #include "hw/loader.h"
 #include "qemu/range.h"
+#include "qemu/bitmap.h"
 #include "qmp-commands.h"
 #include "hw/pci/msi.h"
 #include "hw/pci/msix.h"
@@ -68,10 +69,18 @@ static void pci_bus_class_init(ObjectClass *klass, void *data)
     k->reset = pcibus_reset;
 }
 
+static void pci_bus_finalize(Object *obj)
+{
+    PCIBus *bus = PCI_BUS(obj);
+
+    g_free(bus->nr_cache);
+}
+
 static const TypeInfo pci_bus_info = {
     .name = TYPE_PCI_BUS,
     .parent = TYPE_BUS,
     .instance_size = sizeof(PCIBus),
+    .instance_finalize = pci_bus_finalize,
     .class_init = pci_bus_class_init,
 };
 
@@ -375,6 +384,7 @@ static int get_pci_config_device(QEMUFile *f, void *pv, size_t size)
     memcpy(s->config, config, size);
 
     pci_update_mappings(s);
+    pci_bus_nr_changed();
 
     memory_region_set_enabled(&s->bus_master_enable_region,
                               pci_get_word(s->config + PCI_COMMAND)
@@ -1568,13 +1578,29 @@ static bool pci_secondary_bus_in_range(PCIDevice *dev, int bus_num)
         bus_num <= dev->config[PCI_SUBORDINATE_BUS];
 }
 
-static PCIBus *pci_find_bus_nr(PCIBus *bus, int bus_num)
+/*
+ * Every config space access looks up the target bus by number, and walking
+ * the bridges for it gets slow when all devices sit behind PCIe root ports
+ * or when the guest probes the buses that do not exist.  Each host bridge
+ * bus keeps a table of the lookups, which is thrown away whenever a
+ * bridge's bus numbers or secondary bus reset bit may have changed.
+ */
+typedef struct PCIBusNrCache {
+    unsigned gen;
+    DECLARE_BITMAP(valid, 256);
+    PCIBus *bus[256];
+} PCIBusNrCache;
+
+static unsigned pci_bus_nr_gen;
+
+void pci_bus_nr_changed(void)
 {
-    PCIBus *sec;
+    pci_bus_nr_gen++;
+}
 
-    if (!bus) {
-        return NULL;
-    }
+static PCIBus *pci_walk_bus_nr(PCIBus *bus, int bus_num)
+{
+    PCIBus *sec;
 
     if (pci_bus_num(bus) == bus_num) {
         return bus;
@@ -1602,6 +1628,33 @@ static PCIBus *pci_find_bus_nr(PCIBus *bus, int bus_num)
     return NULL;
 }
 
+static PCIBus *pci_find_bus_nr(PCIBus *bus, int bus_num)
+{
+    PCIBusNrCache *c;
+
+    if (!bus) {
+        return NULL;
+    }
+    if (bus->parent_dev || bus_num < 0 || bus_num > 255) {
+        return pci_walk_bus_nr(bus, bus_num);
+    }
+
+    c = bus->nr_cache;
+    if (!c) {
+        c = bus->nr_cache = g_malloc0(sizeof(*c));
+        c->gen = pci_bus_nr_gen - 1;
+    }
+    if (c->gen != pci_bus_nr_gen) {
+        bitmap_zero(c->valid, 256);
+        c->gen = pci_bus_nr_gen;
+    }
+    if (!test_bit(bus_num, c->valid)) {
+        c->bus[bus_num] = pci_walk_bus_nr(bus, bus_num);
+        set_bit(bus_num, c->valid);
+    }
+    return c->bus[bus_num];
+}
+
 PCIDevice *pci_find_device(PCIBus *bus, int bus_num, uint8_t devfn)
 {
     bus = pci_find_bus_nr(bus, bus_num);
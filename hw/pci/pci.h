@@ -263,6 +263,9 @@ struct PCIDevice {
 
     /* Offset of MSI capability in config space */
     uint8_t msi_cap;
+    /* KVM routes of the MSI and MSI-X vectors */
+    MSIRoute *msi_routes;
+    MSIRoute *msix_routes;
 
     /* PCI Express */
     PCIExpressDevice exp;
@@ -362,6 +365,7 @@ void pci_for_each_device(PCIBus *bus, int bus_num,
 PCIBus *pci_find_root_bus(int domain);
 int pci_find_domain(const PCIBus *bus);
 PCIDevice *pci_find_device(PCIBus *bus, int bus_num, uint8_t devfn);
+void pci_bus_nr_changed(void);
 int pci_qdev_find_device(const char *id, PCIDevice **pdev);
 PCIBus *pci_get_bus_devfn(int *devfnp, const char *devaddr);
 
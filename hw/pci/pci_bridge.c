@@ -231,6 +231,11 @@ void pci_bridge_write_config(PCIDevice *d,
         pci_bridge_update_mappings(s);
     }
 
+    if (ranges_overlap(address, len, PCI_PRIMARY_BUS, 3) ||
+        ranges_overlap(address, len, PCI_BRIDGE_CONTROL, 2)) {
+        pci_bus_nr_changed();
+    }
+
     newctl = pci_get_word(d->config + PCI_BRIDGE_CONTROL);
     if (~oldctl & newctl & PCI_BRIDGE_CTL_BUS_RESET) {
         /* Trigger hot reset on 0->1 transition. */
@@ -295,6 +300,7 @@ void pci_bridge_reset(DeviceState *qdev)
     pci_set_long(conf + PCI_PREF_LIMIT_UPPER32, 0);
 
     pci_set_word(conf + PCI_BRIDGE_CONTROL, 0);
+    pci_bus_nr_changed();
 }
 
 /* default qdev initialization function for PCI-to-PCI bridge */
@@ -334,6 +340,7 @@ int pci_bridge_initfn(PCIDevice *dev)
     br->windows = pci_bridge_region_init(br);
     QLIST_INIT(&sec_bus->child);
     QLIST_INSERT_HEAD(&parent->child, sec_bus, sibling);
+    pci_bus_nr_changed();
     return 0;
 }
 
@@ -343,6 +350,7 @@ void pci_bridge_exitfn(PCIDevice *pci_dev)
     PCIBridge *s = DO_UPCAST(PCIBridge, dev, pci_dev);
     assert(QLIST_EMPTY(&s->sec_bus.child));
     QLIST_REMOVE(&s->sec_bus, sibling);
+    pci_bus_nr_changed();
     pci_bridge_region_del(s, s->windows);
     pci_bridge_region_cleanup(s, s->windows);
     memory_region_destroy(&s->address_space_mem);
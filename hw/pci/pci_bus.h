@@ -30,6 +30,9 @@ struct PCIBus {
     QLIST_HEAD(, PCIBus) child; /* this will be replaced by qdev later */
     QLIST_ENTRY(PCIBus) sibling;/* this will be replaced by qdev later */
 
+    /* Host bridge buses only: the buses below, by bus number */
+    struct PCIBusNrCache *nr_cache;
+
     /* The bus IRQ state is the logical OR of the connected devices.
        Keep a count of the number of devices with raised IRQs.  */
     int nirq;
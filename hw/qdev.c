@@ -670,7 +670,14 @@ static void device_set_realized(Object *obj, bool value, Error **err)
 
     if (value && !dev->realized) {
         if (dc->realize) {
+            const char *owner;
+
+            /* Attribute the timers, bottom halves and fd handlers that
+             * the device creates */
+            owner = qemu_set_callback_owner(dev->id ? dev->id :
+                                            object_get_typename(obj));
             dc->realize(dev, &local_err);
+            qemu_set_callback_owner(owner);
         }
 
         if (!obj->parent && local_err == NULL) {
@@ -23,6 +23,7 @@
 #include "qemu-common.h"
 #include "qemu/timer.h"
 #include "qemu/queue.h"
+#include "qemu/atomic.h"
 #include "monitor/monitor.h"
 #include "sysemu/sysemu.h"
 #include "trace.h"
@@ -588,6 +589,9 @@ static int interface_get_command(QXLInstance *sin, struct QXLCommandExt *ext)
 
     trace_qxl_ring_command_check(qxl->id, qxl_mode_to_string(qxl->mode));
 
+    /* pairs with the atomic_xchg() for QXL_IO_NOTIFY_CMD */
+    atomic_xchg(&qxl->cmd_wakeup_pending, 0);
+
     switch (qxl->mode) {
     case QXL_MODE_VGA:
         ret = false;
@@ -619,7 +623,16 @@ static int interface_get_command(QXLInstance *sin, struct QXLCommandExt *ext)
         ext->group_id = MEMSLOT_GROUP_GUEST;
         ext->flags    = qxl->cmdflags;
         SPICE_RING_POP(ring, notify);
-        qxl_ring_set_dirty(qxl);
+        /*
+         * The consumer index only needs to reach the dirty log by the time
+         * the guest waits on it or migration reads it, so mark the ring
+         * dirty once per batch of commands rather than for every one.
+         */
+        if (notify || SPICE_RING_IS_EMPTY(ring) || !runstate_is_running() ||
+            ++qxl->cmd_ring_batch >= QXL_CMD_BATCH) {
+            qxl->cmd_ring_batch = 0;
+            qxl_ring_set_dirty(qxl);
+        }
         if (notify) {
             qxl_send_events(qxl, QXL_INTERRUPT_DISPLAY);
         }
@@ -889,14 +902,6 @@ static void interface_update_area_complete(QXLInstance *sin,
     trace_qxl_interface_update_area_complete(qxl->id, surface_id, dirty->left,
             dirty->right, dirty->top, dirty->bottom);
     trace_qxl_interface_update_area_complete_rest(qxl->id, num_updated_rects);
-    if (qxl->num_dirty_rects + num_updated_rects > QXL_NUM_DIRTY_RECTS) {
-        /*
-         * overflow - treat this as a full update. Not expected to be common.
-         */
-        trace_qxl_interface_update_area_complete_overflow(qxl->id,
-                                                          QXL_NUM_DIRTY_RECTS);
-        qxl->guest_primary.resized = 1;
-    }
     if (qxl->guest_primary.resized) {
         /*
          * Don't bother copying or scheduling the bh since we will flip
@@ -905,11 +910,30 @@ static void interface_update_area_complete(QXLInstance *sin,
         qemu_mutex_unlock(&qxl->ssd.lock);
         return;
     }
-    qxl_i = qxl->num_dirty_rects;
-    for (i = 0; i < num_updated_rects; i++) {
-        qxl->dirty[qxl_i++] = dirty[i];
+    if (qxl->num_dirty_rects + num_updated_rects > QXL_NUM_DIRTY_RECTS) {
+        /*
+         * overflow - collapse everything into the bounding rectangle, which
+         * still copies less than a full update and keeps the surface.
+         */
+        trace_qxl_interface_update_area_complete_overflow(qxl->id,
+                                                          QXL_NUM_DIRTY_RECTS);
+        if (qxl->num_dirty_rects == 0) {
+            memset(&qxl->dirty[0], 0, sizeof(qxl->dirty[0]));
+        }
+        for (i = 1; i < qxl->num_dirty_rects; i++) {
+            qemu_spice_rect_union(&qxl->dirty[0], &qxl->dirty[i]);
+        }
+        for (i = 0; i < num_updated_rects; i++) {
+            qemu_spice_rect_union(&qxl->dirty[0], &dirty[i]);
+        }
+        qxl->num_dirty_rects = 1;
+    } else {
+        qxl_i = qxl->num_dirty_rects;
+        for (i = 0; i < num_updated_rects; i++) {
+            qxl->dirty[qxl_i++] = dirty[i];
+        }
+        qxl->num_dirty_rects += num_updated_rects;
     }
-    qxl->num_dirty_rects += num_updated_rects;
     trace_qxl_interface_update_area_complete_schedule_bh(qxl->id,
                                                          qxl->num_dirty_rects);
     qemu_bh_schedule(qxl->update_area_bh);
@@ -1118,6 +1142,8 @@ static void qxl_reset_state(PCIQXLDevice *d)
     init_qxl_ram(d);
     d->num_free_res = 0;
     d->last_release = NULL;
+    d->cmd_ring_batch = 0;
+    d->cmd_wakeup_pending = 0;
     memset(&d->ssd.dirty, 0, sizeof(d->ssd.dirty));
 }
 
@@ -1564,7 +1590,13 @@ async_common:
         break;
     }
     case QXL_IO_NOTIFY_CMD:
-        qemu_spice_wakeup(&d->ssd);
+        /*
+         * Until the worker polls the ring again it will see the new
+         * commands anyway, so further kicks are not worth the round trip.
+         */
+        if (!atomic_xchg(&d->cmd_wakeup_pending, 1)) {
+            qemu_spice_wakeup(&d->ssd);
+        }
         break;
     case QXL_IO_NOTIFY_CURSOR:
         qemu_spice_wakeup(&d->ssd);
@@ -1858,7 +1890,12 @@ static void qxl_vm_change_state_handler(void *opaque, int running,
          * called
          */
          qxl_update_irq(qxl);
+         /* the worker may have been stopped with a kick in flight */
+         qxl->cmd_wakeup_pending = 0;
     } else {
+        /* flush the command ring batch, further pops mark it right away */
+        qxl->cmd_ring_batch = 0;
+        qxl_ring_set_dirty(qxl);
         /* make sure surfaces are saved before migration */
         qxl_dirty_surfaces(qxl);
     }
@@ -1885,6 +1922,8 @@ static void display_refresh(struct DisplayState *ds)
     if (qxl0->mode == QXL_MODE_VGA) {
         qemu_spice_display_refresh(&qxl0->ssd);
     } else {
+        /* native mode updates are not polled for */
+        display_listener.gui_timer_interval = 0;
         qemu_mutex_lock(&qxl0->ssd.lock);
         qemu_spice_cursor_refresh_unlocked(&qxl0->ssd);
         qemu_mutex_unlock(&qxl0->ssd.lock);
@@ -2068,6 +2107,7 @@ static int qxl_init_primary(PCIDevice *dev)
     vga->ds = graphic_console_init(qxl_hw_update, qxl_hw_invalidate,
                                    qxl_hw_screen_dump, qxl_hw_text_update, qxl);
     qemu_spice_display_init_common(&qxl->ssd, vga->ds);
+    vga_display_idle_init(vga);
 
     qxl0 = qxl;
 
@@ -2076,6 +2116,7 @@ static int qxl_init_primary(PCIDevice *dev)
         return rc;
     }
 
+    qxl->ssd.dcl = &display_listener;
     register_displaychangelistener(vga->ds, &display_listener);
     return rc;
 }
@@ -26,6 +26,7 @@ enum qxl_mode {
 #define QXL_UNDEFINED_IO UINT32_MAX
 
 #define QXL_NUM_DIRTY_RECTS 64
+#define QXL_CMD_BATCH 16
 
 typedef struct PCIQXLDevice {
     PCIDevice          pci;
@@ -39,6 +40,11 @@ typedef struct PCIQXLDevice {
 
     enum qxl_mode      mode;
     uint32_t           cmdflags;
+
+    /* commands popped since the command ring was last marked dirty */
+    uint32_t           cmd_ring_batch;
+    /* a wakeup was sent and the worker has not polled the ring since */
+    int                cmd_wakeup_pending;
     int                generation;
     uint32_t           revision;
 
@@ -407,6 +407,8 @@ static Property s390_virtio_net_properties[] = {
     DEFINE_PROP_INT32("x-txburst", VirtIOS390Device,
                       net.txburst, TX_BURST),
     DEFINE_PROP_STRING("tx", VirtIOS390Device, net.tx),
+    DEFINE_PROP_STRING("vhost-cpus", VirtIOS390Device, net.vhost_cpus),
+    DEFINE_PROP_BIT("sw_offload", VirtIOS390Device, net.sw_offload, 0, true),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -708,6 +708,8 @@ static Property virtio_ccw_net_properties[] = {
     DEFINE_PROP_INT32("x-txburst", VirtioCcwDevice,
                       net.txburst, TX_BURST),
     DEFINE_PROP_STRING("tx", VirtioCcwDevice, net.tx),
+    DEFINE_PROP_STRING("vhost-cpus", VirtioCcwDevice, net.vhost_cpus),
+    DEFINE_PROP_BIT("sw_offload", VirtioCcwDevice, net.sw_offload, 0, true),
     DEFINE_PROP_END_OF_LIST(),
 };
 
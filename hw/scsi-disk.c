@@ -2060,6 +2060,7 @@ static int scsi_initfn(SCSIDevice *dev)
         && blkconf_geometry(&dev->conf, NULL, 65535, 255, 255) < 0) {
         return -1;
     }
+    blkconf_blocksizes(&dev->conf);
 
     if (s->qdev.conf.discard_granularity == -1) {
         s->qdev.conf.discard_granularity =
@@ -73,7 +73,8 @@ static int spapr_tce_translate(DMAContext *dma,
     sPAPRTCETable *tcet = DO_UPCAST(sPAPRTCETable, dma, dma);
     enum sPAPRTCEAccess access = (dir == DMA_DIRECTION_FROM_DEVICE)
         ? SPAPR_TCE_WO : SPAPR_TCE_RO;
-    uint64_t tce;
+    uint64_t tce, entry, last;
+    hwaddr want;
 
 #ifdef DEBUG_TCE
     fprintf(stderr, "spapr_tce_translate liobn=0x%" PRIx32 " addr=0x"
@@ -94,7 +95,8 @@ static int spapr_tce_translate(DMAContext *dma,
         return -EFAULT;
     }
 
-    tce = tcet->table[addr >> SPAPR_TCE_PAGE_SHIFT].tce;
+    entry = addr >> SPAPR_TCE_PAGE_SHIFT;
+    tce = tcet->table[entry].tce;
 
     /* Check TCE */
     if (!(tce & access)) {
@@ -102,12 +104,30 @@ static int spapr_tce_translate(DMAContext *dma,
     }
 
     /* How much til end of page ? */
+    want = *len;
     *len = ((~addr) & SPAPR_TCE_PAGE_MASK) + 1;
 
     /* Translate */
     *paddr = (tce & ~SPAPR_TCE_PAGE_MASK) |
         (addr & SPAPR_TCE_PAGE_MASK);
 
+    /* Guests usually map a buffer with consecutive TCEs pointing at
+     * consecutive pages; extend the translation over them so that the
+     * caller can access or map the whole run at once. */
+    last = MIN(tcet->window_size >> SPAPR_TCE_PAGE_SHIFT,
+               entry + (want >> SPAPR_TCE_PAGE_SHIFT) + 1);
+    while (*len < want && ++entry < last) {
+        uint64_t next = tcet->table[entry].tce;
+
+        if (!(next & access) ||
+            (next & ~SPAPR_TCE_PAGE_MASK) !=
+            (tce & ~SPAPR_TCE_PAGE_MASK) + SPAPR_TCE_PAGE_SIZE) {
+            break;
+        }
+        *len += SPAPR_TCE_PAGE_SIZE;
+        tce = next;
+    }
+
 #ifdef DEBUG_TCE
     fprintf(stderr, " ->  *paddr=0x" TARGET_FMT_plx ", *len=0x"
             TARGET_FMT_plx "\n", *paddr, *len);
@@ -210,20 +230,101 @@ static target_ulong put_tce_emu(sPAPRTCETable *tcet, target_ulong ioba,
     return H_SUCCESS;
 }
 
-static target_ulong h_put_tce(PowerPCCPU *cpu, sPAPREnvironment *spapr,
-                              target_ulong opcode, target_ulong *args)
+static sPAPRTCETable *spapr_tce_hcall_table(target_ulong liobn)
+{
+    if (liobn & 0xFFFFFFFF00000000ULL) {
+        hcall_dprintf("TCE hcall on out-of-bounds LIOBN "
+                      TARGET_FMT_lx "\n", liobn);
+        return NULL;
+    }
+
+    return spapr_tce_find_by_liobn(liobn);
+}
+
+/* Check that @npages TCEs from @ioba are all inside the window */
+static bool spapr_tce_range_valid(sPAPRTCETable *tcet, target_ulong ioba,
+                                  target_ulong npages)
+{
+    target_ulong entries = tcet->window_size >> SPAPR_TCE_PAGE_SHIFT;
+
+    return ioba < tcet->window_size &&
+        npages <= entries - (ioba >> SPAPR_TCE_PAGE_SHIFT);
+}
+
+static target_ulong h_put_tce_indirect(PowerPCCPU *cpu,
+                                       sPAPREnvironment *spapr,
+                                       target_ulong opcode, target_ulong *args)
 {
     target_ulong liobn = args[0];
     target_ulong ioba = args[1];
-    target_ulong tce = args[2];
-    sPAPRTCETable *tcet = spapr_tce_find_by_liobn(liobn);
+    target_ulong tce_list = args[2];
+    target_ulong npages = args[3];
+    sPAPRTCETable *tcet = spapr_tce_hcall_table(liobn);
+    target_ulong i;
 
-    if (liobn & 0xFFFFFFFF00000000ULL) {
-        hcall_dprintf("spapr_vio_put_tce on out-of-boundsw LIOBN "
-                      TARGET_FMT_lx "\n", liobn);
+    if (!tcet) {
+        return H_PARAMETER;
+    }
+
+    /* The list is one 4k page of TCEs at most */
+    if (npages > SPAPR_TCE_PAGE_SIZE / sizeof(uint64_t) ||
+        (tce_list & SPAPR_TCE_PAGE_MASK)) {
+        return H_PARAMETER;
+    }
+
+    ioba &= ~SPAPR_TCE_PAGE_MASK;
+    if (!spapr_tce_range_valid(tcet, ioba, npages)) {
+        hcall_dprintf("H_PUT_TCE_INDIRECT out of the window, IOBA 0x"
+                      TARGET_FMT_lx " npages " TARGET_FMT_lu "\n",
+                      ioba, npages);
+        return H_PARAMETER;
+    }
+
+    for (i = 0; i < npages; i++) {
+        tcet->table[(ioba >> SPAPR_TCE_PAGE_SHIFT) + i].tce =
+            ldq_phys(tce_list + i * sizeof(uint64_t));
+    }
+
+    return H_SUCCESS;
+}
+
+static target_ulong h_stuff_tce(PowerPCCPU *cpu, sPAPREnvironment *spapr,
+                                target_ulong opcode, target_ulong *args)
+{
+    target_ulong liobn = args[0];
+    target_ulong ioba = args[1];
+    target_ulong tce_value = args[2];
+    target_ulong npages = args[3];
+    sPAPRTCETable *tcet = spapr_tce_hcall_table(liobn);
+    target_ulong i;
+
+    if (!tcet) {
         return H_PARAMETER;
     }
 
+    ioba &= ~SPAPR_TCE_PAGE_MASK;
+    if (!spapr_tce_range_valid(tcet, ioba, npages)) {
+        hcall_dprintf("H_STUFF_TCE out of the window, IOBA 0x"
+                      TARGET_FMT_lx " npages " TARGET_FMT_lu "\n",
+                      ioba, npages);
+        return H_PARAMETER;
+    }
+
+    for (i = 0; i < npages; i++) {
+        tcet->table[(ioba >> SPAPR_TCE_PAGE_SHIFT) + i].tce = tce_value;
+    }
+
+    return H_SUCCESS;
+}
+
+static target_ulong h_put_tce(PowerPCCPU *cpu, sPAPREnvironment *spapr,
+                              target_ulong opcode, target_ulong *args)
+{
+    target_ulong liobn = args[0];
+    target_ulong ioba = args[1];
+    target_ulong tce = args[2];
+    sPAPRTCETable *tcet = spapr_tce_hcall_table(liobn);
+
     ioba &= ~(SPAPR_TCE_PAGE_SIZE - 1);
 
     if (tcet) {
@@ -238,12 +339,40 @@ static target_ulong h_put_tce(PowerPCCPU *cpu, sPAPREnvironment *spapr,
     return H_PARAMETER;
 }
 
+static target_ulong h_get_tce(PowerPCCPU *cpu, sPAPREnvironment *spapr,
+                              target_ulong opcode, target_ulong *args)
+{
+    target_ulong liobn = args[0];
+    target_ulong ioba = args[1];
+    sPAPRTCETable *tcet = spapr_tce_hcall_table(liobn);
+
+    if (!tcet || ioba >= tcet->window_size) {
+        return H_PARAMETER;
+    }
+
+    args[0] = tcet->table[ioba >> SPAPR_TCE_PAGE_SHIFT].tce;
+    return H_SUCCESS;
+}
+
+bool spapr_iommu_multitce(void)
+{
+    /* With in-kernel tables, KVM handles H_PUT_TCE itself but sends the
+     * multi-TCE calls to us unless it knows them as well; one exit per
+     * call would then be slower than the in-kernel single calls. */
+    return !kvm_enabled() || kvmppc_spapr_use_multitce();
+}
+
 void spapr_iommu_init(void)
 {
     QLIST_INIT(&spapr_tce_tables);
 
     /* hcall-tce */
     spapr_register_hypercall(H_PUT_TCE, h_put_tce);
+    spapr_register_hypercall(H_GET_TCE, h_get_tce);
+
+    /* hcall-multi-tce */
+    spapr_register_hypercall(H_PUT_TCE_INDIRECT, h_put_tce_indirect);
+    spapr_register_hypercall(H_STUFF_TCE, h_stuff_tce);
 }
 
 int spapr_dma_dt(void *fdt, int node_off, const char *propname,
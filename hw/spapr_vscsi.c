@@ -39,6 +39,7 @@
 #include "hw/spapr.h"
 #include "hw/spapr_vio.h"
 #include "hw/ppc-viosrp.h"
+#include "sysemu/dma.h"
 
 #include <libfdt.h>
 
@@ -89,6 +90,10 @@ typedef struct vscsi_req {
     struct srp_indirect_buf *ind_desc;
     int                     local_desc;
     int                     total_desc;
+
+    /* Scatter/gather list handed to the SCSI layer, if any */
+    QEMUSGList              qsg;
+    bool                    has_qsg;
 } vscsi_req;
 
 
@@ -121,6 +126,10 @@ static void vscsi_put_req(vscsi_req *req)
         scsi_req_unref(req->sreq);
     }
     req->sreq = NULL;
+    if (req->has_qsg) {
+        qemu_sglist_destroy(&req->qsg);
+        req->has_qsg = false;
+    }
     req->active = 0;
 }
 
@@ -458,6 +467,82 @@ static int vscsi_preprocess_desc(vscsi_req *req)
     return 0;
 }
 
+/* Limit on the descriptors of an indirect table fetched from the guest */
+#define VSCSI_MAX_SG_DESC       256
+
+/*
+ * Build a scatter/gather list from the SRP descriptors so that the SCSI
+ * device can DMA straight to and from guest memory.  The descriptors are
+ * parsed from a copy because vscsi_preprocess_desc() byte-swaps them in
+ * place later on.  Returning NULL falls back to vscsi_transfer_data().
+ */
+static QEMUSGList *vscsi_get_sg_list(SCSIRequest *sreq)
+{
+    VSCSIState *s = DO_UPCAST(VSCSIState, vdev.qdev, sreq->bus->qbus.parent);
+    vscsi_req *req = sreq->hba_private;
+    struct srp_cmd *cmd = &req->iu.srp.cmd;
+    uint8_t out_fmt = cmd->buf_fmt >> 4;
+    uint8_t in_fmt = cmd->buf_fmt & ((1U << 4) - 1);
+    struct srp_direct_buf desc, *table = NULL, *list;
+    struct srp_indirect_buf ind;
+    int fmt, offset, local, total, i;
+
+    /* Bidirectional commands keep using the bounce buffer */
+    if ((out_fmt == SRP_NO_DATA_DESC) == (in_fmt == SRP_NO_DATA_DESC)) {
+        return NULL;
+    }
+
+    offset = cmd->add_cdb_len & ~3;
+    if (out_fmt != SRP_NO_DATA_DESC) {
+        fmt = out_fmt;
+        local = cmd->data_out_desc_cnt;
+    } else {
+        fmt = in_fmt;
+        local = cmd->data_in_desc_cnt;
+        offset += data_out_desc_size(cmd);
+    }
+
+    switch (fmt) {
+    case SRP_DATA_DESC_DIRECT:
+        memcpy(&desc, cmd->add_data + offset, sizeof(desc));
+        qemu_sglist_init(&req->qsg, 1, s->vdev.dma);
+        qemu_sglist_add(&req->qsg, be64_to_cpu(desc.va),
+                        be32_to_cpu(desc.len));
+        break;
+    case SRP_DATA_DESC_INDIRECT:
+        memcpy(&ind, cmd->add_data + offset, sizeof(ind));
+        total = be32_to_cpu(ind.table_desc.len) /
+            sizeof(struct srp_direct_buf);
+        if (total == 0 || total > VSCSI_MAX_SG_DESC || local > total) {
+            return NULL;
+        }
+        list = (struct srp_direct_buf *)(cmd->add_data + offset +
+                                         sizeof(struct srp_indirect_buf));
+        if (local != total) {
+            table = g_new(struct srp_direct_buf, total);
+            if (spapr_vio_dma_read(&s->vdev, be64_to_cpu(ind.table_desc.va),
+                                   table, total * sizeof(*table))) {
+                g_free(table);
+                return NULL;
+            }
+            list = table;
+        }
+        qemu_sglist_init(&req->qsg, total, s->vdev.dma);
+        for (i = 0; i < total; i++) {
+            memcpy(&desc, &list[i], sizeof(desc));
+            qemu_sglist_add(&req->qsg, be64_to_cpu(desc.va),
+                            be32_to_cpu(desc.len));
+        }
+        g_free(table);
+        break;
+    default:
+        return NULL;
+    }
+
+    req->has_qsg = true;
+    return &req->qsg;
+}
+
 /* Callback to indicate that the SCSI layer has completed a transfer.  */
 static void vscsi_transfer_data(SCSIRequest *sreq, uint32_t len)
 {
@@ -520,6 +605,10 @@ static void vscsi_command_complete(SCSIRequest *sreq, uint32_t status, size_t re
         /* We handle overflows, not underflows for normal commands,
          * but hopefully nobody cares
          */
+        if (req->has_qsg) {
+            /* the SCSI layer did the DMA, vscsi_transfer_data never ran */
+            req->data_len = resid;
+        }
         if (req->writing) {
             res_out = req->data_len;
         } else {
@@ -892,7 +981,8 @@ static const struct SCSIBusInfo vscsi_scsi_info = {
 
     .transfer_data = vscsi_transfer_data,
     .complete = vscsi_command_complete,
-    .cancel = vscsi_request_cancelled
+    .cancel = vscsi_request_cancelled,
+    .get_sg_list = vscsi_get_sg_list,
 };
 
 static void spapr_vscsi_reset(VIOsPAPRDevice *dev)
@@ -1299,6 +1299,7 @@ static int ohci_bus_start(OHCIState *ohci)
         /* TODO: Signal unrecoverable error */
         return 0;
     }
+    qemu_timer_set_name(ohci->eof_timer, "ohci-frame");
 
     DPRINTF("usb-ohci: %s: USB Operational\n", ohci->name);
 
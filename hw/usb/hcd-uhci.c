@@ -1249,6 +1249,7 @@ static int usb_uhci_common_initfn(PCIDevice *dev)
     }
     s->bh = qemu_bh_new(uhci_bh, s);
     s->frame_timer = qemu_new_timer_ns(vm_clock, uhci_frame_timer, s);
+    qemu_timer_set_name(s->frame_timer, "uhci-frame");
     s->num_ports_vmstate = NB_PORTS;
     QTAILQ_INIT(&s->queues);
 
@@ -46,6 +46,9 @@
 
 #define TD_QUEUE 24
 
+/* number of TRBs read from a transfer or command ring at once */
+#define RING_PREFETCH 16
+
 /* Very pessimistic, let's hope it's enough for all cases */
 #define EV_QUEUE (((3*TD_QUEUE)+16)*MAXSLOTS)
 /* Do not deliver ER Full events. NEC's driver does some things not bound
@@ -329,6 +332,11 @@ typedef struct XHCIRing {
     dma_addr_t base;
     dma_addr_t dequeue;
     bool ccs;
+
+    /* TRBs read ahead of the dequeue pointer, see xhci_ring_read() */
+    XHCITRB cache[RING_PREFETCH];
+    dma_addr_t cache_addr;
+    unsigned int cache_len;
 } XHCIRing;
 
 typedef struct XHCIPort {
@@ -402,6 +410,9 @@ struct XHCIEPContext {
     unsigned int interval;
     int64_t mfindex_last;
     QEMUTimer *kick_timer;
+
+    /* doorbell writes for stream 0 of this endpoint */
+    MemoryRegionDoorbell *doorbell;
 };
 
 typedef struct XHCISlot {
@@ -423,6 +434,7 @@ typedef struct XHCIEvent {
 } XHCIEvent;
 
 typedef struct XHCIInterrupter {
+    XHCIState *xhci;
     uint32_t iman;
     uint32_t imod;
     uint32_t erstsz;
@@ -441,6 +453,10 @@ typedef struct XHCIInterrupter {
     unsigned int ev_buffer_put;
     unsigned int ev_buffer_get;
 
+    /* interrupt moderation */
+    bool irq_pending;
+    int64_t imod_last;
+    QEMUTimer *imod_timer;
 } XHCIInterrupter;
 
 struct XHCIState {
@@ -452,6 +468,7 @@ struct XHCIState {
     MemoryRegion mem_oper;
     MemoryRegion mem_runtime;
     MemoryRegion mem_doorbell;
+    MemoryRegionDoorbell *cmd_doorbell;
     const char *name;
     unsigned int devaddr;
 
@@ -743,13 +760,43 @@ static void xhci_msix_update(XHCIState *xhci, int v)
     }
 }
 
-static void xhci_intr_raise(XHCIState *xhci, int v)
+static void xhci_intr_update(XHCIState *xhci, int v)
 {
-    xhci->intr[v].erdp_low |= ERDP_EHB;
-    xhci->intr[v].iman |= IMAN_IP;
+    XHCIInterrupter *intr = &xhci->intr[v];
+    int64_t now, expire;
+
+    if (!intr->irq_pending) {
+        return;
+    }
+
+    /*
+     * While the event handler busy bit is set the driver has not yet
+     * caught up with the event ring, and new events are picked up when it
+     * does.  Re-evaluate once it writes ERDP.
+     */
+    if (intr->erdp_low & ERDP_EHB) {
+        return;
+    }
+
+    /* IMODI counts in units of 250ns */
+    if (intr->imod & 0xffff) {
+        now = qemu_get_clock_ns(vm_clock);
+        expire = intr->imod_last + (intr->imod & 0xffff) * 250;
+        if (now < expire) {
+            if (!qemu_timer_pending(intr->imod_timer)) {
+                qemu_mod_timer(intr->imod_timer, expire);
+            }
+            return;
+        }
+        intr->imod_last = now;
+    }
+    intr->irq_pending = false;
+
+    intr->erdp_low |= ERDP_EHB;
+    intr->iman |= IMAN_IP;
     xhci->usbsts |= USBSTS_EINT;
 
-    if (!(xhci->intr[v].iman & IMAN_IE)) {
+    if (!(intr->iman & IMAN_IE)) {
         return;
     }
 
@@ -775,6 +822,20 @@ static void xhci_intr_raise(XHCIState *xhci, int v)
     }
 }
 
+static void xhci_intr_raise(XHCIState *xhci, int v)
+{
+    xhci->intr[v].irq_pending = true;
+    xhci_intr_update(xhci, v);
+}
+
+static void xhci_imod_timer(void *opaque)
+{
+    XHCIInterrupter *intr = opaque;
+    XHCIState *xhci = intr->xhci;
+
+    xhci_intr_update(xhci, intr - xhci->intr);
+}
+
 static inline int xhci_running(XHCIState *xhci)
 {
     return !(xhci->usbsts & USBSTS_HCH) && !xhci->intr[0].er_full;
@@ -943,12 +1004,59 @@ static void xhci_event(XHCIState *xhci, XHCIEvent *event, int v)
     xhci_intr_raise(xhci, v);
 }
 
+static void xhci_ring_invalidate(XHCIRing *ring)
+{
+    ring->cache_len = 0;
+}
+
 static void xhci_ring_init(XHCIState *xhci, XHCIRing *ring,
                            dma_addr_t base)
 {
     ring->base = base;
     ring->dequeue = base;
     ring->ccs = 1;
+    xhci_ring_invalidate(ring);
+}
+
+/*
+ * Read the TRB at @addr, going through the ring's read-ahead cache.
+ *
+ * The cache is filled with up to RING_PREFETCH TRBs, without crossing a
+ * page boundary.  A cached TRB whose cycle bit says the driver has not
+ * handed it over yet is read again, since the driver may be filling it
+ * right now; TRBs owned by the controller are not modified by the driver
+ * while the ring is running.  The cache is dropped whenever a doorbell
+ * kicks the ring, or the dequeue pointer is moved by a command.
+ */
+static void xhci_ring_read(XHCIState *xhci, XHCIRing *ring, dma_addr_t addr,
+                           bool ccs, XHCITRB *trb)
+{
+    struct {
+        uint64_t parameter;
+        uint32_t status;
+        uint32_t control;
+    } QEMU_PACKED raw[RING_PREFETCH];
+    unsigned int i, idx, len;
+
+    idx = (addr - ring->cache_addr) / TRB_SIZE;
+    if (addr < ring->cache_addr || idx >= ring->cache_len ||
+        (ring->cache[idx].control & TRB_C) != ccs) {
+        len = (0x1000 - (addr & 0xfff)) / TRB_SIZE;
+        len = MAX(MIN(len, RING_PREFETCH), 1);
+        pci_dma_read(&xhci->pci_dev, addr, raw, len * TRB_SIZE);
+        for (i = 0; i < len; i++) {
+            ring->cache[i].parameter = le64_to_cpu(raw[i].parameter);
+            ring->cache[i].status = le32_to_cpu(raw[i].status);
+            ring->cache[i].control = le32_to_cpu(raw[i].control);
+        }
+        ring->cache_addr = addr;
+        ring->cache_len = len;
+        idx = 0;
+    }
+
+    trb->parameter = ring->cache[idx].parameter;
+    trb->status = ring->cache[idx].status;
+    trb->control = ring->cache[idx].control;
 }
 
 static TRBType xhci_ring_fetch(XHCIState *xhci, XHCIRing *ring, XHCITRB *trb,
@@ -956,12 +1064,9 @@ static TRBType xhci_ring_fetch(XHCIState *xhci, XHCIRing *ring, XHCITRB *trb,
 {
     while (1) {
         TRBType type;
-        pci_dma_read(&xhci->pci_dev, ring->dequeue, trb, TRB_SIZE);
+        xhci_ring_read(xhci, ring, ring->dequeue, ring->ccs, trb);
         trb->addr = ring->dequeue;
         trb->ccs = ring->ccs;
-        le64_to_cpus(&trb->parameter);
-        le32_to_cpus(&trb->status);
-        le32_to_cpus(&trb->control);
 
         trace_usb_xhci_fetch_trb(ring->dequeue, trb_name(trb),
                                  trb->parameter, trb->status, trb->control);
@@ -987,7 +1092,7 @@ static TRBType xhci_ring_fetch(XHCIState *xhci, XHCIRing *ring, XHCITRB *trb,
     }
 }
 
-static int xhci_ring_chain_length(XHCIState *xhci, const XHCIRing *ring)
+static int xhci_ring_chain_length(XHCIState *xhci, XHCIRing *ring)
 {
     XHCITRB trb;
     int length = 0;
@@ -998,10 +1103,7 @@ static int xhci_ring_chain_length(XHCIState *xhci, const XHCIRing *ring)
 
     while (1) {
         TRBType type;
-        pci_dma_read(&xhci->pci_dev, dequeue, &trb, TRB_SIZE);
-        le64_to_cpus(&trb.parameter);
-        le32_to_cpus(&trb.status);
-        le32_to_cpus(&trb.control);
+        xhci_ring_read(xhci, ring, dequeue, ccs, &trb);
 
         if ((trb.control & TRB_C) != ccs) {
             return -length;
@@ -1211,6 +1313,7 @@ static TRBCCode xhci_enable_ep(XHCIState *xhci, unsigned int slotid,
     XHCISlot *slot;
     XHCIEPContext *epctx;
     dma_addr_t dequeue;
+    uint64_t db_value;
     int i;
 
     trace_usb_xhci_ep_enable(slotid, epid);
@@ -1227,6 +1330,10 @@ static TRBCCode xhci_enable_ep(XHCIState *xhci, unsigned int slotid,
     epctx->xhci = xhci;
     epctx->slotid = slotid;
     epctx->epid = epid;
+    /* the guest writes the endpoint id to the slot's doorbell */
+    db_value = epid;
+    epctx->doorbell = memory_region_add_doorbell(&xhci->mem_doorbell,
+                                                 slotid * 4, 4, &db_value, 1);
 
     slot->eps[epid-1] = epctx;
 
@@ -1343,9 +1450,11 @@ static TRBCCode xhci_disable_ep(XHCIState *xhci, unsigned int slotid,
         return CC_SUCCESS;
     }
 
-    xhci_ep_nuke_xfers(xhci, slotid, epid);
-
     epctx = slot->eps[epid-1];
+    memory_region_del_doorbell(epctx->doorbell);
+    epctx->doorbell = NULL;
+
+    xhci_ep_nuke_xfers(xhci, slotid, epid);
 
     if (epctx->nr_pstreams) {
         xhci_free_streams(epctx);
@@ -1954,9 +2063,20 @@ static void xhci_kick_ep(XHCIState *xhci, unsigned int slotid,
         xhci_set_ep_state(xhci, epctx, NULL, EP_RUNNING);
     }
     assert(ring->base != 0);
+    xhci_ring_invalidate(ring);
 
     while (1) {
         XHCITransfer *xfer = &epctx->transfers[epctx->next_xfer];
+        if (epctx->nr_pstreams) {
+            /* transfers on different streams complete out of order */
+            for (i = 0; i < TD_QUEUE; i++) {
+                if (!xfer->running_async && !xfer->running_retry) {
+                    break;
+                }
+                epctx->next_xfer = (epctx->next_xfer + 1) % TD_QUEUE;
+                xfer = &epctx->transfers[epctx->next_xfer];
+            }
+        }
         if (xfer->running_async || xfer->running_retry) {
             break;
         }
@@ -2468,6 +2588,7 @@ static void xhci_process_commands(XHCIState *xhci)
     }
 
     xhci->crcr_low |= CRCR_CRR;
+    xhci_ring_invalidate(&xhci->cmd_ring);
 
     while ((type = xhci_ring_fetch(xhci, &xhci->cmd_ring, &trb, &addr))) {
         event.ptr = addr;
@@ -2702,6 +2823,9 @@ static void xhci_reset(DeviceState *dev)
         xhci->intr[i].er_full = 0;
         xhci->intr[i].ev_buffer_put = 0;
         xhci->intr[i].ev_buffer_get = 0;
+        xhci->intr[i].irq_pending = false;
+        xhci->intr[i].imod_last = 0;
+        qemu_del_timer(xhci->intr[i].imod_timer);
     }
 
     xhci->mfindex_start = qemu_get_clock_ns(vm_clock);
@@ -3036,6 +3160,12 @@ static void xhci_runtime_write(void *ptr, hwaddr reg,
     case 0x1c: /* ERDP high */
         intr->erdp_high = val;
         xhci_events_update(xhci, v);
+        if ((xhci_addr64(intr->erdp_low, intr->erdp_high) & ~0xfULL) ==
+            intr->er_start + TRB_SIZE * intr->er_ep_idx) {
+            /* the driver has seen every event written so far */
+            intr->irq_pending = false;
+        }
+        xhci_intr_update(xhci, v);
         break;
     default:
         fprintf(stderr, "xhci_oper_write: reg 0x%x unimplemented\n",
@@ -3276,6 +3406,7 @@ static void usb_xhci_init(XHCIState *xhci, DeviceState *dev)
 
 static int usb_xhci_initfn(struct PCIDevice *dev)
 {
+    const uint64_t cmd_db_value = 0;
     int i, ret;
 
     XHCIState *xhci = DO_UPCAST(XHCIState, pci_dev, dev);
@@ -3301,6 +3432,14 @@ static int usb_xhci_initfn(struct PCIDevice *dev)
     }
 
     xhci->mfwrap_timer = qemu_new_timer_ns(vm_clock, xhci_mfwrap_timer, xhci);
+    qemu_timer_set_name(xhci->mfwrap_timer, "xhci-mfwrap");
+
+    for (i = 0; i < xhci->numintrs; i++) {
+        xhci->intr[i].xhci = xhci;
+        xhci->intr[i].imod_timer = qemu_new_timer_ns(vm_clock,
+                                                     xhci_imod_timer,
+                                                     &xhci->intr[i]);
+    }
 
     xhci->irq = xhci->pci_dev.irq[0];
 
@@ -3318,6 +3457,8 @@ static int usb_xhci_initfn(struct PCIDevice *dev)
     memory_region_add_subregion(&xhci->mem, OFF_OPER,     &xhci->mem_oper);
     memory_region_add_subregion(&xhci->mem, OFF_RUNTIME,  &xhci->mem_runtime);
     memory_region_add_subregion(&xhci->mem, OFF_DOORBELL, &xhci->mem_doorbell);
+    xhci->cmd_doorbell = memory_region_add_doorbell(&xhci->mem_doorbell, 0, 4,
+                                                    &cmd_db_value, 1);
 
     for (i = 0; i < xhci->numports; i++) {
         XHCIPort *port = &xhci->ports[i];
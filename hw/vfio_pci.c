@@ -30,6 +30,7 @@
 #include "qemu/event_notifier.h"
 #include "exec/address-spaces.h"
 #include "sysemu/kvm.h"
+#include "sysemu/ram-reclaim.h"
 #include "exec/memory.h"
 #include "pci/msi.h"
 #include "pci/msix.h"
@@ -562,6 +563,29 @@ static int vfio_enable_vectors(VFIODevice *vdev, bool msix)
     return ret;
 }
 
+/*
+ * Attempt to enable route through KVM irqchip,
+ * default to userspace handling if unavailable.
+ */
+static void vfio_msix_vector_route(VFIOMSIVector *vector, MSIMessage *msg,
+                                   IOHandler *handler)
+{
+    int fd = event_notifier_get_fd(&vector->interrupt);
+
+    vector->virq = msg ? kvm_irqchip_add_msi_route(kvm_state, *msg) : -1;
+    if (vector->virq < 0 ||
+        kvm_irqchip_add_irqfd_notifier(kvm_state, &vector->interrupt,
+                                       vector->virq) < 0) {
+        if (vector->virq >= 0) {
+            kvm_irqchip_release_virq(kvm_state, vector->virq);
+            vector->virq = -1;
+        }
+        qemu_set_fd_handler(fd, handler, NULL, vector);
+    } else {
+        qemu_set_fd_handler(fd, NULL, NULL, NULL);
+    }
+}
+
 static int vfio_msix_vector_do_use(PCIDevice *pdev, unsigned int nr,
                                    MSIMessage *msg, IOHandler *handler)
 {
@@ -574,30 +598,27 @@ static int vfio_msix_vector_do_use(PCIDevice *pdev, unsigned int nr,
             vdev->host.function, nr);
 
     vector = &vdev->msi_vectors[nr];
-    vector->vdev = vdev;
-    vector->use = true;
 
     msix_vector_use(pdev, nr);
 
+    /*
+     * A vector that was released is still connected to its eventfd on
+     * the device side, see vfio_msix_vector_release(); only the KVM route
+     * has to be set up again.
+     */
+    if (vector->use) {
+        vfio_msix_vector_route(vector, msg, handler);
+        return 0;
+    }
+
+    vector->vdev = vdev;
+    vector->use = true;
+
     if (event_notifier_init(&vector->interrupt, 0)) {
         error_report("vfio: Error: event_notifier_init failed");
     }
 
-    /*
-     * Attempt to enable route through KVM irqchip,
-     * default to userspace handling if unavailable.
-     */
-    vector->virq = msg ? kvm_irqchip_add_msi_route(kvm_state, *msg) : -1;
-    if (vector->virq < 0 ||
-        kvm_irqchip_add_irqfd_notifier(kvm_state, &vector->interrupt,
-                                       vector->virq) < 0) {
-        if (vector->virq >= 0) {
-            kvm_irqchip_release_virq(kvm_state, vector->virq);
-            vector->virq = -1;
-        }
-        qemu_set_fd_handler(event_notifier_get_fd(&vector->interrupt),
-                            handler, NULL, vector);
-    }
+    vfio_msix_vector_route(vector, msg, handler);
 
     /*
      * We don't want to have the host allocate all possible MSI vectors
@@ -649,50 +670,29 @@ static void vfio_msix_vector_release(PCIDevice *pdev, unsigned int nr)
 {
     VFIODevice *vdev = DO_UPCAST(VFIODevice, pdev, pdev);
     VFIOMSIVector *vector = &vdev->msi_vectors[nr];
-    int argsz;
-    struct vfio_irq_set *irq_set;
-    int32_t *pfd;
 
     DPRINTF("%s(%04x:%02x:%02x.%x) vector %d released\n", __func__,
             vdev->host.domain, vdev->host.bus, vdev->host.slot,
             vdev->host.function, nr);
 
-    /*
-     * XXX What's the right thing to do here?  This turns off the interrupt
-     * completely, but do we really just want to switch the interrupt to
-     * bouncing through userspace and let msix.c drop it?  Not sure.
-     */
     msix_vector_unuse(pdev, nr);
 
-    argsz = sizeof(*irq_set) + sizeof(*pfd);
-
-    irq_set = g_malloc0(argsz);
-    irq_set->argsz = argsz;
-    irq_set->flags = VFIO_IRQ_SET_DATA_EVENTFD |
-                     VFIO_IRQ_SET_ACTION_TRIGGER;
-    irq_set->index = VFIO_PCI_MSIX_IRQ_INDEX;
-    irq_set->start = nr;
-    irq_set->count = 1;
-    pfd = (int32_t *)&irq_set->data;
-
-    *pfd = -1;
-
-    ioctl(vdev->fd, VFIO_DEVICE_SET_IRQS, irq_set);
-
-    g_free(irq_set);
-
-    if (vector->virq < 0) {
-        qemu_set_fd_handler(event_notifier_get_fd(&vector->interrupt),
-                            NULL, NULL, NULL);
-    } else {
+    /*
+     * Guests mask a vector to change its message, some of them on every
+     * interrupt.  Rather than disconnecting the eventfd from the device,
+     * and connecting a new one when the vector is unmasked, leave it in
+     * place and bounce the interrupts through userspace while the vector
+     * is masked: msix_notify() then sets its pending bit, where the device
+     * would have.
+     */
+    if (vector->virq >= 0) {
         kvm_irqchip_remove_irqfd_notifier(kvm_state, &vector->interrupt,
                                           vector->virq);
         kvm_irqchip_release_virq(kvm_state, vector->virq);
         vector->virq = -1;
     }
-
-    event_notifier_cleanup(&vector->interrupt);
-    vector->use = false;
+    qemu_set_fd_handler(event_notifier_get_fd(&vector->interrupt),
+                        vfio_msi_interrupt, NULL, vector);
 }
 
 static void vfio_enable_msix(VFIODevice *vdev)
@@ -807,6 +807,28 @@ retry:
 
 static void vfio_disable_msi_common(VFIODevice *vdev)
 {
+    int i;
+
+    for (i = 0; i < vdev->nr_vectors; i++) {
+        VFIOMSIVector *vector = &vdev->msi_vectors[i];
+
+        if (!vector->use) {
+            continue;
+        }
+
+        if (vector->virq >= 0) {
+            kvm_irqchip_remove_irqfd_notifier(kvm_state,
+                                              &vector->interrupt, vector->virq);
+            kvm_irqchip_release_virq(kvm_state, vector->virq);
+            vector->virq = -1;
+        } else {
+            qemu_set_fd_handler(event_notifier_get_fd(&vector->interrupt),
+                                NULL, NULL, NULL);
+        }
+
+        event_notifier_cleanup(&vector->interrupt);
+    }
+
     g_free(vdev->msi_vectors);
     vdev->msi_vectors = NULL;
     vdev->nr_vectors = 0;
@@ -831,30 +853,8 @@ static void vfio_disable_msix(VFIODevice *vdev)
 
 static void vfio_disable_msi(VFIODevice *vdev)
 {
-    int i;
-
     vfio_disable_irqindex(vdev, VFIO_PCI_MSI_IRQ_INDEX);
 
-    for (i = 0; i < vdev->nr_vectors; i++) {
-        VFIOMSIVector *vector = &vdev->msi_vectors[i];
-
-        if (!vector->use) {
-            continue;
-        }
-
-        if (vector->virq >= 0) {
-            kvm_irqchip_remove_irqfd_notifier(kvm_state,
-                                              &vector->interrupt, vector->virq);
-            kvm_irqchip_release_virq(kvm_state, vector->virq);
-            vector->virq = -1;
-        } else {
-            qemu_set_fd_handler(event_notifier_get_fd(&vector->interrupt),
-                                NULL, NULL, NULL);
-        }
-
-        event_notifier_cleanup(&vector->interrupt);
-    }
-
     vfio_disable_msi_common(vdev);
 
     DPRINTF("%s(%04x:%02x:%02x.%x)\n", __func__, vdev->host.domain,
@@ -2035,6 +2035,8 @@ static int vfio_initfn(PCIDevice *pdev)
         }
     }
 
+    /* Guest RAM is pinned for the device's DMA */
+    ram_reclaim_inhibit(true);
     return 0;
 
 out_teardown:
@@ -2061,6 +2063,7 @@ static void vfio_exitfn(PCIDevice *pdev)
     vfio_unmap_bars(vdev);
     vfio_put_device(vdev);
     vfio_put_group(group);
+    ram_reclaim_inhibit(false);
 }
 
 static void vfio_pci_reset(DeviceState *dev)
@@ -137,6 +137,7 @@ int isa_vga_mm_init(hwaddr vram_base,
 
     s->vga.ds = graphic_console_init(s->vga.update, s->vga.invalidate,
                                      s->vga.screen_dump, s->vga.text_update, s);
+    vga_display_idle_init(&s->vga);
 
     vga_init_vbe(&s->vga, address_space);
     return 0;
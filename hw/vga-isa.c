@@ -64,6 +64,7 @@ static int vga_initfn(ISADevice *dev)
     memory_region_set_coalescing(vga_io_memory);
     s->ds = graphic_console_init(s->update, s->invalidate,
                                  s->screen_dump, s->text_update, s);
+    vga_display_idle_init(s);
 
     vga_init_vbe(s, isa_address_space(dev));
     /* ROM BIOS */
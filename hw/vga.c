@@ -1621,14 +1621,42 @@ void vga_sync_dirty_bitmap(VGACommonState *s)
     memory_region_sync_dirty_bitmap(&s->vram);
 }
 
+static void vga_update_dirty_log(VGACommonState *s)
+{
+    bool idle = s->ds && s->ds->idle;
+
+    memory_region_set_log(&s->vram, s->dirty_log && !idle, DIRTY_MEMORY_VGA);
+}
+
 void vga_dirty_log_start(VGACommonState *s)
 {
-    memory_region_set_log(&s->vram, true, DIRTY_MEMORY_VGA);
+    s->dirty_log = true;
+    vga_update_dirty_log(s);
 }
 
 void vga_dirty_log_stop(VGACommonState *s)
 {
-    memory_region_set_log(&s->vram, false, DIRTY_MEMORY_VGA);
+    s->dirty_log = false;
+    vga_update_dirty_log(s);
+}
+
+static void vga_display_idle_changed(Notifier *notifier, void *data)
+{
+    VGACommonState *s = container_of(notifier, VGACommonState, display_idle);
+
+    vga_update_dirty_log(s);
+}
+
+/*
+ * Stop logging vram writes while nobody looks at the display.  The console
+ * invalidates the device when the display is used again, and the next
+ * update redraws the whole screen.  Call this once s->ds is set.
+ */
+void vga_display_idle_init(VGACommonState *s)
+{
+    s->display_idle.notify = vga_display_idle_changed;
+    dpy_add_idle_notifier(s->ds, &s->display_idle);
+    vga_update_dirty_log(s);
 }
 
 /*
@@ -2440,7 +2468,8 @@ static void vga_screen_dump(void *opaque, const char *filename, bool cswitch,
 {
     VGACommonState *s = opaque;
 
-    if (cswitch) {
+    /* vram writes are not tracked while the display is idle */
+    if (cswitch || s->ds->idle) {
         vga_invalidate_display(s);
     }
     vga_hw_update();
@@ -170,6 +170,9 @@ typedef struct VGACommonState {
     vga_update_retrace_info_fn update_retrace_info;
     union vga_retrace retrace_info;
     uint8_t is_vbe_vmstate;
+    /* vram dirty logging is wanted, but it is off while the display is idle */
+    bool dirty_log;
+    Notifier display_idle;
 } VGACommonState;
 
 static inline int c6_to_8(int v)
@@ -191,6 +194,7 @@ void vga_common_reset(VGACommonState *s);
 void vga_sync_dirty_bitmap(VGACommonState *s);
 void vga_dirty_log_start(VGACommonState *s);
 void vga_dirty_log_stop(VGACommonState *s);
+void vga_display_idle_init(VGACommonState *s);
 
 extern const VMStateDescription vmstate_vga_common;
 uint32_t vga_ioport_read(void *opaque, uint32_t addr);
@@ -0,0 +1,394 @@
+/*
+ * vhost-user
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+/*
+ * The vhost-user backend speaks the protocol described in
+ * docs/specs/vhost-user.txt over a connected UNIX socket.  Every vhost ioctl
+ * issued by hw/vhost.c is translated into one message; file descriptors
+ * (guest RAM, kick and call eventfds) travel as SCM_RIGHTS ancillary data.
+ */
+
+#include "hw/vhost.h"
+#include "hw/vhost-backend.h"
+#include "exec/cpu-common.h"
+#include "qemu/error-report.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <linux/vhost.h>
+
+#define VHOST_MEMORY_MAX_NREGIONS    8
+
+typedef enum VhostUserRequest {
+    VHOST_USER_NONE = 0,
+    VHOST_USER_GET_FEATURES = 1,
+    VHOST_USER_SET_FEATURES = 2,
+    VHOST_USER_SET_OWNER = 3,
+    VHOST_USER_RESET_OWNER = 4,
+    VHOST_USER_SET_MEM_TABLE = 5,
+    VHOST_USER_SET_LOG_BASE = 6,
+    VHOST_USER_SET_LOG_FD = 7,
+    VHOST_USER_SET_VRING_NUM = 8,
+    VHOST_USER_SET_VRING_ADDR = 9,
+    VHOST_USER_SET_VRING_BASE = 10,
+    VHOST_USER_GET_VRING_BASE = 11,
+    VHOST_USER_SET_VRING_KICK = 12,
+    VHOST_USER_SET_VRING_CALL = 13,
+    VHOST_USER_SET_VRING_ERR = 14,
+    VHOST_USER_MAX
+} VhostUserRequest;
+
+typedef struct VhostUserMemoryRegion {
+    uint64_t guest_phys_addr;
+    uint64_t memory_size;
+    uint64_t userspace_addr;
+    uint64_t mmap_offset;
+} VhostUserMemoryRegion;
+
+typedef struct VhostUserMemory {
+    uint32_t nregions;
+    uint32_t padding;
+    VhostUserMemoryRegion regions[VHOST_MEMORY_MAX_NREGIONS];
+} VhostUserMemory;
+
+typedef struct VhostUserMsg {
+    VhostUserRequest request;
+
+#define VHOST_USER_VERSION_MASK     (0x3)
+#define VHOST_USER_REPLY_MASK       (0x1 << 2)
+    uint32_t flags;
+    uint32_t size; /* the following payload size */
+    union {
+#define VHOST_USER_VRING_IDX_MASK   (0xff)
+#define VHOST_USER_VRING_NOFD_MASK  (0x1 << 8)
+        uint64_t u64;
+        struct vhost_vring_state state;
+        struct vhost_vring_addr addr;
+        VhostUserMemory memory;
+    };
+} QEMU_PACKED VhostUserMsg;
+
+#define VHOST_USER_HDR_SIZE     offsetof(VhostUserMsg, u64)
+#define VHOST_USER_PAYLOAD_SIZE (sizeof(VhostUserMsg) - VHOST_USER_HDR_SIZE)
+
+/* The version of the protocol we support */
+#define VHOST_USER_VERSION    (0x1)
+
+static unsigned long int ioctl_to_vhost_user_request[VHOST_USER_MAX] = {
+    -1,                     /* VHOST_USER_NONE */
+    VHOST_GET_FEATURES,     /* VHOST_USER_GET_FEATURES */
+    VHOST_SET_FEATURES,     /* VHOST_USER_SET_FEATURES */
+    VHOST_SET_OWNER,        /* VHOST_USER_SET_OWNER */
+    VHOST_RESET_OWNER,      /* VHOST_USER_RESET_OWNER */
+    VHOST_SET_MEM_TABLE,    /* VHOST_USER_SET_MEM_TABLE */
+    VHOST_SET_LOG_BASE,     /* VHOST_USER_SET_LOG_BASE */
+    VHOST_SET_LOG_FD,       /* VHOST_USER_SET_LOG_FD */
+    VHOST_SET_VRING_NUM,    /* VHOST_USER_SET_VRING_NUM */
+    VHOST_SET_VRING_ADDR,   /* VHOST_USER_SET_VRING_ADDR */
+    VHOST_SET_VRING_BASE,   /* VHOST_USER_SET_VRING_BASE */
+    VHOST_GET_VRING_BASE,   /* VHOST_USER_GET_VRING_BASE */
+    VHOST_SET_VRING_KICK,   /* VHOST_USER_SET_VRING_KICK */
+    VHOST_SET_VRING_CALL,   /* VHOST_USER_SET_VRING_CALL */
+    VHOST_SET_VRING_ERR     /* VHOST_USER_SET_VRING_ERR */
+};
+
+static VhostUserRequest vhost_user_request_translate(unsigned long int request)
+{
+    VhostUserRequest idx;
+
+    for (idx = 0; idx < VHOST_USER_MAX; idx++) {
+        if (ioctl_to_vhost_user_request[idx] == request) {
+            break;
+        }
+    }
+
+    return (idx == VHOST_USER_MAX) ? VHOST_USER_NONE : idx;
+}
+
+static int vhost_user_fd(struct vhost_dev *dev)
+{
+    return (uintptr_t) dev->opaque;
+}
+
+static int vhost_user_read(struct vhost_dev *dev, VhostUserMsg *msg)
+{
+    int fd = vhost_user_fd(dev);
+    uint8_t *p = (uint8_t *) msg;
+    size_t size = VHOST_USER_HDR_SIZE;
+    size_t done = 0;
+    ssize_t r;
+
+    /* Read the header first, then as much payload as it announces */
+    while (done < size) {
+        r = read(fd, p + done, size - done);
+        if (r < 0 && errno == EINTR) {
+            continue;
+        }
+        if (r <= 0) {
+            error_report("Failed to read msg header from vhost-user socket");
+            goto fail;
+        }
+        done += r;
+        if (done == VHOST_USER_HDR_SIZE && size == VHOST_USER_HDR_SIZE) {
+            if (msg->flags != (VHOST_USER_REPLY_MASK | VHOST_USER_VERSION)) {
+                error_report("Failed to read msg header."
+                             " Flags 0x%x instead of 0x%x.",
+                             msg->flags,
+                             VHOST_USER_REPLY_MASK | VHOST_USER_VERSION);
+                goto fail;
+            }
+            if (msg->size > VHOST_USER_PAYLOAD_SIZE) {
+                error_report("Failed to read msg header."
+                             " Size %d exceeds the maximum %zu.",
+                             msg->size, VHOST_USER_PAYLOAD_SIZE);
+                goto fail;
+            }
+            size += msg->size;
+        }
+    }
+
+    return 0;
+
+fail:
+    errno = EPROTO;
+    return -1;
+}
+
+static int vhost_user_write(struct vhost_dev *dev, VhostUserMsg *msg,
+                            int *fds, int fd_num)
+{
+    int fd = vhost_user_fd(dev);
+    size_t size = VHOST_USER_HDR_SIZE + msg->size;
+    struct iovec iov = {
+        .iov_base = msg,
+        .iov_len = size,
+    };
+    struct msghdr msgh = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+    };
+    char control[CMSG_SPACE(VHOST_MEMORY_MAX_NREGIONS * sizeof(int))];
+    struct cmsghdr *cmsg;
+    ssize_t r;
+
+    assert(fd_num <= VHOST_MEMORY_MAX_NREGIONS);
+
+    if (fd_num) {
+        size_t fdsize = fd_num * sizeof(int);
+
+        memset(control, 0, sizeof(control));
+        msgh.msg_control = control;
+        msgh.msg_controllen = CMSG_SPACE(fdsize);
+
+        cmsg = CMSG_FIRSTHDR(&msgh);
+        cmsg->cmsg_len = CMSG_LEN(fdsize);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        memcpy(CMSG_DATA(cmsg), fds, fdsize);
+    }
+
+    do {
+        r = sendmsg(fd, &msgh, 0);
+    } while (r < 0 && errno == EINTR);
+
+    if (r < 0) {
+        return -1;
+    }
+    if (r != (ssize_t)size) {
+        /* The ancillary data went out with the first byte, so a short
+         * write of the rest is a plain stream write.
+         */
+        if (qemu_write_full(fd, (uint8_t *)msg + r, size - r) != size - r) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int vhost_user_call(struct vhost_dev *dev, unsigned long int request,
+                           void *arg)
+{
+    VhostUserMsg msg;
+    VhostUserRequest msg_request;
+    struct vhost_vring_file *file = 0;
+    bool need_reply = false;
+    int fds[VHOST_MEMORY_MAX_NREGIONS];
+    int i, fd_num = 0;
+
+    assert(dev->vhost_ops->backend_type == VHOST_BACKEND_TYPE_USER);
+
+    msg_request = vhost_user_request_translate(request);
+    msg.request = msg_request;
+    msg.flags = VHOST_USER_VERSION;
+    msg.size = 0;
+
+    switch (msg_request) {
+    case VHOST_USER_GET_FEATURES:
+        need_reply = true;
+        break;
+
+    case VHOST_USER_SET_FEATURES:
+        msg.u64 = *((__u64 *) arg);
+        msg.size = sizeof(msg.u64);
+        break;
+
+    case VHOST_USER_SET_OWNER:
+    case VHOST_USER_RESET_OWNER:
+        break;
+
+    case VHOST_USER_SET_MEM_TABLE: {
+        struct vhost_memory *mem = arg;
+
+        if (mem->nregions > VHOST_MEMORY_MAX_NREGIONS) {
+            error_report("vhost-user supports at most %d memory regions",
+                         VHOST_MEMORY_MAX_NREGIONS);
+            errno = E2BIG;
+            return -1;
+        }
+
+        for (i = 0; i < mem->nregions; ++i) {
+            struct vhost_memory_region *reg = mem->regions + i;
+            ram_addr_t offset;
+            int fd;
+
+            fd = qemu_ram_get_fd((void *)(uintptr_t)reg->userspace_addr,
+                                 &offset);
+            if (fd < 0) {
+                error_report("vhost-user requires guest RAM backed by a "
+                             "shared file (-mem-path with -mem-prealloc)");
+                errno = EINVAL;
+                return -1;
+            }
+            msg.memory.regions[fd_num].userspace_addr = reg->userspace_addr;
+            msg.memory.regions[fd_num].memory_size = reg->memory_size;
+            msg.memory.regions[fd_num].guest_phys_addr = reg->guest_phys_addr;
+            msg.memory.regions[fd_num].mmap_offset = offset;
+            fds[fd_num++] = fd;
+        }
+
+        msg.memory.nregions = fd_num;
+        msg.memory.padding = 0;
+        msg.size = sizeof(msg.memory.nregions) + sizeof(msg.memory.padding) +
+                   fd_num * sizeof(VhostUserMemoryRegion);
+        break;
+    }
+
+    case VHOST_USER_SET_LOG_BASE:
+    case VHOST_USER_SET_LOG_FD:
+        /* Dirty logging is not part of the protocol yet; vhost-user
+         * netdevs register a migration blocker instead.
+         */
+        errno = ENOSYS;
+        return -1;
+
+    case VHOST_USER_SET_VRING_NUM:
+    case VHOST_USER_SET_VRING_BASE:
+        memcpy(&msg.state, arg, sizeof(struct vhost_vring_state));
+        msg.size = sizeof(msg.state);
+        break;
+
+    case VHOST_USER_GET_VRING_BASE:
+        memcpy(&msg.state, arg, sizeof(struct vhost_vring_state));
+        msg.size = sizeof(msg.state);
+        need_reply = true;
+        break;
+
+    case VHOST_USER_SET_VRING_ADDR:
+        memcpy(&msg.addr, arg, sizeof(struct vhost_vring_addr));
+        msg.size = sizeof(msg.addr);
+        break;
+
+    case VHOST_USER_SET_VRING_KICK:
+    case VHOST_USER_SET_VRING_CALL:
+    case VHOST_USER_SET_VRING_ERR:
+        file = arg;
+        msg.u64 = file->index & VHOST_USER_VRING_IDX_MASK;
+        msg.size = sizeof(msg.u64);
+        if (file->fd >= 0) {
+            fds[fd_num++] = file->fd;
+        } else {
+            msg.u64 |= VHOST_USER_VRING_NOFD_MASK;
+        }
+        break;
+
+    default:
+        error_report("vhost-user trying to send unhandled ioctl 0x%lx",
+                     request);
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    if (vhost_user_write(dev, &msg, fds, fd_num) < 0) {
+        return -1;
+    }
+
+    if (need_reply) {
+        if (vhost_user_read(dev, &msg) < 0) {
+            return -1;
+        }
+
+        if (msg_request != msg.request) {
+            error_report("Received unexpected msg type."
+                         " Expected %d received %d", msg_request, msg.request);
+            errno = EPROTO;
+            return -1;
+        }
+
+        switch (msg_request) {
+        case VHOST_USER_GET_FEATURES:
+            if (msg.size != sizeof(msg.u64)) {
+                error_report("Received bad msg size.");
+                errno = EPROTO;
+                return -1;
+            }
+            *((__u64 *) arg) = msg.u64;
+            break;
+        case VHOST_USER_GET_VRING_BASE:
+            if (msg.size != sizeof(msg.state)) {
+                error_report("Received bad msg size.");
+                errno = EPROTO;
+                return -1;
+            }
+            memcpy(arg, &msg.state, sizeof(struct vhost_vring_state));
+            break;
+        default:
+            error_report("Received unexpected msg type.");
+            errno = EPROTO;
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int vhost_user_init(struct vhost_dev *dev, void *opaque)
+{
+    assert(dev->vhost_ops->backend_type == VHOST_BACKEND_TYPE_USER);
+
+    dev->opaque = opaque;
+
+    return 0;
+}
+
+static int vhost_user_cleanup(struct vhost_dev *dev)
+{
+    assert(dev->vhost_ops->backend_type == VHOST_BACKEND_TYPE_USER);
+
+    return close(vhost_user_fd(dev));
+}
+
+const VhostOps user_ops = {
+    .backend_type = VHOST_BACKEND_TYPE_USER,
+    .vhost_call = vhost_user_call,
+    .vhost_backend_init = vhost_user_init,
+    .vhost_backend_cleanup = vhost_user_cleanup
+};
@@ -14,11 +14,16 @@
  */
 
 #include <sys/ioctl.h>
+#include <sched.h>
+#include <dirent.h>
 #include "vhost.h"
 #include "hw/hw.h"
 #include "qemu/range.h"
+#include "qemu/host-utils.h"
 #include <linux/vhost.h>
 #include "exec/address-spaces.h"
+#include "sysemu/cpus.h"
+#include "sysemu/ram-reclaim.h"
 
 static void vhost_dev_sync_region(struct vhost_dev *dev,
                                   MemoryRegionSection *section,
@@ -27,8 +32,8 @@ static void vhost_dev_sync_region(struct vhost_dev *dev,
 {
     uint64_t start = MAX(mfirst, rfirst);
     uint64_t end = MIN(mlast, rlast);
-    vhost_log_chunk_t *from = dev->log + start / VHOST_LOG_CHUNK;
-    vhost_log_chunk_t *to = dev->log + end / VHOST_LOG_CHUNK + 1;
+    vhost_log_chunk_t *from = dev->log->log + start / VHOST_LOG_CHUNK;
+    vhost_log_chunk_t *to = dev->log->log + end / VHOST_LOG_CHUNK + 1;
     uint64_t addr = (start / VHOST_LOG_CHUNK) * VHOST_LOG_CHUNK;
 
     if (end < start) {
@@ -38,26 +43,38 @@ static void vhost_dev_sync_region(struct vhost_dev *dev,
     assert(start / VHOST_LOG_CHUNK < dev->log_size);
 
     for (;from < to; ++from) {
-        vhost_log_chunk_t log;
-        int bit;
+        vhost_log_chunk_t log, mask = ~(vhost_log_chunk_t)0;
+
         /* We first check with non-atomic: much cheaper,
          * and we expect non-dirty to be the common case. */
         if (!*from) {
             addr += VHOST_LOG_CHUNK;
             continue;
         }
+        /* Only take the pages of this range; the rest of the chunk may
+         * belong to another section */
+        if (start > addr) {
+            mask <<= (start - addr) / VHOST_LOG_PAGE;
+        }
+        if (end < addr + VHOST_LOG_CHUNK - 1) {
+            mask &= ~(vhost_log_chunk_t)0 >>
+                (VHOST_LOG_BITS - 1 - (end - addr) / VHOST_LOG_PAGE);
+        }
         /* Data must be read atomically. We don't really
          * need the barrier semantics of __sync
          * builtins, but it's easier to use them than
          * roll our own. */
-        log = __sync_fetch_and_and(from, 0);
-        while ((bit = sizeof(log) > sizeof(int) ?
-                ffsll(log) : ffs(log))) {
-            ram_addr_t ram_addr;
-            bit -= 1;
-            ram_addr = section->offset_within_region + bit * VHOST_LOG_PAGE;
-            memory_region_set_dirty(section->mr, ram_addr, VHOST_LOG_PAGE);
-            log &= ~(0x1ull << bit);
+        log = __sync_fetch_and_and(from, ~mask) & mask;
+        while (log) {
+            int bit = ctzl(log);
+            hwaddr page_addr = addr + bit * VHOST_LOG_PAGE;
+
+            memory_region_set_dirty(section->mr,
+                                    page_addr -
+                                    section->offset_within_address_space +
+                                    section->offset_within_region,
+                                    VHOST_LOG_PAGE);
+            log &= log - 1;
         }
         addr += VHOST_LOG_CHUNK;
     }
@@ -70,9 +87,14 @@ static int vhost_sync_dirty_bitmap(struct vhost_dev *dev,
 {
     int i;
 
-    if (!dev->log_enabled || !dev->started) {
+    if (!dev->log_enabled || !dev->started || section->size == 0) {
         return 0;
     }
+    /* Pages outside the section are not ours to mark or clear */
+    start_addr = MAX(start_addr, section->offset_within_address_space);
+    end_addr = MIN(end_addr,
+                   range_get_last(section->offset_within_address_space,
+                                  section->size));
     for (i = 0; i < dev->mem->nregions; ++i) {
         struct vhost_memory_region *reg = dev->mem->regions + i;
         vhost_dev_sync_region(dev, section, start_addr, end_addr,
@@ -95,7 +117,14 @@ static void vhost_log_sync(MemoryListener *listener,
                                          memory_listener);
     hwaddr start_addr = section->offset_within_address_space;
     hwaddr end_addr = start_addr + section->size;
+    struct vhost_log *log = dev->log;
 
+    /* Every device sees the same memory, so one of those sharing the log
+     * scans it for all */
+    if (!log || (log->syncer && log->syncer != dev)) {
+        return;
+    }
+    log->syncer = dev;
     vhost_sync_dirty_bitmap(dev, section, start_addr, end_addr);
 }
 
@@ -264,24 +293,58 @@ static uint64_t vhost_get_log_size(struct vhost_dev *dev)
     return log_size;
 }
 
-static inline void vhost_dev_log_resize(struct vhost_dev* dev, uint64_t size)
+static struct vhost_log *vhost_log;
+
+static struct vhost_log *vhost_log_get(uint64_t size)
 {
-    vhost_log_chunk_t *log;
-    uint64_t log_base;
-    int r, i;
+    if (!vhost_log || vhost_log->size != size) {
+        vhost_log = g_new0(struct vhost_log, 1);
+        vhost_log->size = size;
+        vhost_log->log = size ? g_malloc0(size * sizeof *vhost_log->log)
+                              : NULL;
+    }
+    vhost_log->refcnt++;
+    return vhost_log;
+}
 
-    log = g_malloc0(size * sizeof *log);
-    log_base = (uint64_t)(unsigned long)log;
-    r = ioctl(dev->control, VHOST_SET_LOG_BASE, &log_base);
-    assert(r >= 0);
-    for (i = 0; i < dev->n_mem_sections; ++i) {
-        /* Sync only the range covered by the old log */
-        vhost_sync_dirty_bitmap(dev, &dev->mem_sections[i], 0,
-                                dev->log_size * VHOST_LOG_CHUNK - 1);
+/* Drop @dev's reference to its log.  The last user of a log syncs it
+ * first if @sync, since the bits set in it would be lost otherwise. */
+static void vhost_log_put(struct vhost_dev *dev, bool sync)
+{
+    struct vhost_log *log = dev->log;
+    int i;
+
+    if (!log) {
+        return;
+    }
+    if (log->syncer == dev) {
+        log->syncer = NULL;
     }
-    if (dev->log) {
-        g_free(dev->log);
+    if (--log->refcnt == 0) {
+        for (i = 0; sync && i < dev->n_mem_sections; ++i) {
+            /* Sync only the range covered by the old log */
+            vhost_sync_dirty_bitmap(dev, &dev->mem_sections[i], 0,
+                                    dev->log_size * VHOST_LOG_CHUNK - 1);
+        }
+        if (vhost_log == log) {
+            vhost_log = NULL;
+        }
+        g_free(log->log);
+        g_free(log);
     }
+    dev->log = NULL;
+    dev->log_size = 0;
+}
+
+static inline void vhost_dev_log_resize(struct vhost_dev* dev, uint64_t size)
+{
+    struct vhost_log *log = vhost_log_get(size);
+    uint64_t log_base = (uint64_t)(unsigned long)log->log;
+    int r;
+
+    r = dev->vhost_ops->vhost_call(dev, VHOST_SET_LOG_BASE, &log_base);
+    assert(r >= 0);
+    vhost_log_put(dev, true);
     dev->log = log;
     dev->log_size = size;
 }
@@ -409,7 +472,7 @@ static void vhost_set_memory(MemoryListener *listener,
     }
 
     if (!dev->log_enabled) {
-        r = ioctl(dev->control, VHOST_SET_MEM_TABLE, dev->mem);
+        r = dev->vhost_ops->vhost_call(dev, VHOST_SET_MEM_TABLE, dev->mem);
         assert(r >= 0);
         return;
     }
@@ -421,7 +484,7 @@ static void vhost_set_memory(MemoryListener *listener,
     if (dev->log_size < log_size) {
         vhost_dev_log_resize(dev, log_size + VHOST_LOG_BUFFER);
     }
-    r = ioctl(dev->control, VHOST_SET_MEM_TABLE, dev->mem);
+    r = dev->vhost_ops->vhost_call(dev, VHOST_SET_MEM_TABLE, dev->mem);
     assert(r >= 0);
     /* To log less, can only decrease log size after table update. */
     if (dev->log_size > log_size + VHOST_LOG_BUFFER) {
@@ -499,7 +562,7 @@ static int vhost_virtqueue_set_addr(struct vhost_dev *dev,
         .log_guest_addr = vq->used_phys,
         .flags = enable_log ? (1 << VHOST_VRING_F_LOG) : 0,
     };
-    int r = ioctl(dev->control, VHOST_SET_VRING_ADDR, &addr);
+    int r = dev->vhost_ops->vhost_call(dev, VHOST_SET_VRING_ADDR, &addr);
     if (r < 0) {
         return -errno;
     }
@@ -513,7 +576,7 @@ static int vhost_dev_set_features(struct vhost_dev *dev, bool enable_log)
     if (enable_log) {
         features |= 0x1 << VHOST_F_LOG_ALL;
     }
-    r = ioctl(dev->control, VHOST_SET_FEATURES, &features);
+    r = dev->vhost_ops->vhost_call(dev, VHOST_SET_FEATURES, &features);
     return r < 0 ? -errno : 0;
 }
 
@@ -561,11 +624,7 @@ static int vhost_migration_log(MemoryListener *listener, int enable)
         if (r < 0) {
             return r;
         }
-        if (dev->log) {
-            g_free(dev->log);
-        }
-        dev->log = NULL;
-        dev->log_size = 0;
+        vhost_log_put(dev, false);
     } else {
         vhost_dev_log_resize(dev, vhost_get_log_size(dev));
         r = vhost_dev_set_log(dev, true);
@@ -628,13 +687,13 @@ static int vhost_virtqueue_start(struct vhost_dev *dev,
     assert(idx >= dev->vq_index && idx < dev->vq_index + dev->nvqs);
 
     vq->num = state.num = virtio_queue_get_num(vdev, idx);
-    r = ioctl(dev->control, VHOST_SET_VRING_NUM, &state);
+    r = dev->vhost_ops->vhost_call(dev, VHOST_SET_VRING_NUM, &state);
     if (r) {
         return -errno;
     }
 
     state.num = virtio_queue_get_last_avail_idx(vdev, idx);
-    r = ioctl(dev->control, VHOST_SET_VRING_BASE, &state);
+    r = dev->vhost_ops->vhost_call(dev, VHOST_SET_VRING_BASE, &state);
     if (r) {
         return -errno;
     }
@@ -676,7 +735,7 @@ static int vhost_virtqueue_start(struct vhost_dev *dev,
     }
 
     file.fd = event_notifier_get_fd(virtio_queue_get_host_notifier(vvq));
-    r = ioctl(dev->control, VHOST_SET_VRING_KICK, &file);
+    r = dev->vhost_ops->vhost_call(dev, VHOST_SET_VRING_KICK, &file);
     if (r) {
         r = -errno;
         goto fail_kick;
@@ -714,7 +773,7 @@ static void vhost_virtqueue_stop(struct vhost_dev *dev,
     };
     int r;
     assert(idx >= dev->vq_index && idx < dev->vq_index + dev->nvqs);
-    r = ioctl(dev->control, VHOST_GET_VRING_BASE, &state);
+    r = dev->vhost_ops->vhost_call(dev, VHOST_GET_VRING_BASE, &state);
     if (r < 0) {
         fprintf(stderr, "vhost VQ %d ring restore failed: %d\n", idx, r);
         fflush(stderr);
@@ -755,7 +814,7 @@ static int vhost_virtqueue_init(struct vhost_dev *dev,
     }
 
     file.fd = event_notifier_get_fd(&vq->masked_notifier);
-    r = ioctl(dev->control, VHOST_SET_VRING_CALL, &file);
+    r = dev->vhost_ops->vhost_call(dev, VHOST_SET_VRING_CALL, &file);
     if (r) {
         r = -errno;
         goto fail_call;
@@ -771,25 +830,136 @@ static void vhost_virtqueue_cleanup(struct vhost_virtqueue *vq)
     event_notifier_cleanup(&vq->masked_notifier);
 }
 
+#define VHOST_MAX_WORKERS 256
+
+/* The kernel names the worker "vhost-<tid>" after the thread that issued
+ * VHOST_SET_OWNER.  Depending on the kernel version it is either a thread of
+ * this process or a kernel thread, so look in both places.
+ */
+static int vhost_list_workers(pid_t *tids, int max)
+{
+    static const char *dirs[] = { "/proc/self/task", "/proc" };
+    char *name = g_strdup_printf("vhost-%d\n", qemu_get_thread_id());
+    char comm[32];
+    int i, n = 0;
+
+    for (i = 0; i < ARRAY_SIZE(dirs) && n < max; i++) {
+        DIR *dir = opendir(dirs[i]);
+        struct dirent *ent;
+
+        if (!dir) {
+            continue;
+        }
+        while (n < max && (ent = readdir(dir))) {
+            char *path;
+            FILE *f;
+
+            if (!qemu_isdigit(ent->d_name[0])) {
+                continue;
+            }
+            path = g_strdup_printf("%s/%s/comm", dirs[i], ent->d_name);
+            f = fopen(path, "r");
+            g_free(path);
+            if (!f) {
+                continue;
+            }
+            if (fgets(comm, sizeof(comm), f) && !strcmp(comm, name)) {
+                tids[n++] = atoi(ent->d_name);
+            }
+            fclose(f);
+        }
+        closedir(dir);
+        if (n) {
+            break;
+        }
+    }
+
+    g_free(name);
+    return n;
+}
+
+/* Return the worker that appeared since vhost_list_workers() returned @old */
+static pid_t vhost_find_worker(const pid_t *old, int n_old)
+{
+    pid_t tids[VHOST_MAX_WORKERS];
+    int i, j, n = vhost_list_workers(tids, ARRAY_SIZE(tids));
+
+    for (i = 0; i < n; i++) {
+        for (j = 0; j < n_old && old[j] != tids[i]; j++) {
+            /* nothing */
+        }
+        if (j == n_old) {
+            return tids[i];
+        }
+    }
+    return 0;
+}
+
+int vhost_dev_set_affinity(struct vhost_dev *hdev, int cpu)
+{
+    cpu_set_t cpus;
+
+    if (!hdev->worker) {
+        return -ENOSYS;
+    }
+    if (cpu < 0 || cpu >= CPU_SETSIZE) {
+        return -EINVAL;
+    }
+
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    if (sched_setaffinity(hdev->worker, sizeof(cpus), &cpus) < 0) {
+        return -errno;
+    }
+    return 0;
+}
+
 int vhost_dev_init(struct vhost_dev *hdev, int devfd, const char *devpath,
-                   bool force)
+                   VhostBackendType backend_type, bool force)
 {
+    pid_t workers[VHOST_MAX_WORKERS];
     uint64_t features;
-    int i, r;
-    if (devfd >= 0) {
-        hdev->control = devfd;
-    } else {
-        hdev->control = open(devpath, O_RDWR);
-        if (hdev->control < 0) {
+    int i, r, n_workers = 0;
+
+    if (vhost_set_backend_type(hdev, backend_type) < 0) {
+        if (devfd >= 0) {
+            close(devfd);
+        }
+        return -EINVAL;
+    }
+
+    if (devfd < 0) {
+        if (backend_type != VHOST_BACKEND_TYPE_KERNEL) {
+            return -EBADF;
+        }
+        devfd = open(devpath, O_RDWR);
+        if (devfd < 0) {
             return -errno;
         }
     }
-    r = ioctl(hdev->control, VHOST_SET_OWNER, NULL);
+
+    r = hdev->vhost_ops->vhost_backend_init(hdev,
+                                            (void *)(uintptr_t)devfd);
+    if (r < 0) {
+        close(devfd);
+        return r;
+    }
+
+    hdev->worker = 0;
+    if (backend_type == VHOST_BACKEND_TYPE_KERNEL) {
+        n_workers = vhost_list_workers(workers, ARRAY_SIZE(workers));
+    }
+
+    r = hdev->vhost_ops->vhost_call(hdev, VHOST_SET_OWNER, NULL);
     if (r < 0) {
         goto fail;
     }
 
-    r = ioctl(hdev->control, VHOST_GET_FEATURES, &features);
+    if (backend_type == VHOST_BACKEND_TYPE_KERNEL) {
+        hdev->worker = vhost_find_worker(workers, n_workers);
+    }
+
+    r = hdev->vhost_ops->vhost_call(hdev, VHOST_GET_FEATURES, &features);
     if (r < 0) {
         goto fail;
     }
@@ -826,6 +996,9 @@ int vhost_dev_init(struct vhost_dev *hdev, int devfd, const char *devpath,
     hdev->started = false;
     memory_listener_register(&hdev->memory_listener, &address_space_memory);
     hdev->force = force;
+    if (hdev->worker) {
+        qemu_register_thread("vhost", hdev->worker);
+    }
     return 0;
 fail_vq:
     while (--i >= 0) {
@@ -833,7 +1006,7 @@ fail_vq:
     }
 fail:
     r = -errno;
-    close(hdev->control);
+    hdev->vhost_ops->vhost_backend_cleanup(hdev);
     return r;
 }
 
@@ -846,7 +1019,10 @@ void vhost_dev_cleanup(struct vhost_dev *hdev)
     memory_listener_unregister(&hdev->memory_listener);
     g_free(hdev->mem);
     g_free(hdev->mem_sections);
-    close(hdev->control);
+    if (hdev->worker) {
+        qemu_unregister_thread(hdev->worker);
+    }
+    hdev->vhost_ops->vhost_backend_cleanup(hdev);
 }
 
 bool vhost_dev_query(struct vhost_dev *hdev, VirtIODevice *vdev)
@@ -944,7 +1120,7 @@ void vhost_virtqueue_mask(struct vhost_dev *hdev, VirtIODevice *vdev, int n,
     } else {
         file.fd = event_notifier_get_fd(virtio_queue_get_guest_notifier(vvq));
     }
-    r = ioctl(hdev->control, VHOST_SET_VRING_CALL, &file);
+    r = hdev->vhost_ops->vhost_call(hdev, VHOST_SET_VRING_CALL, &file);
     assert(r >= 0);
 }
 
@@ -959,7 +1135,7 @@ int vhost_dev_start(struct vhost_dev *hdev, VirtIODevice *vdev)
     if (r < 0) {
         goto fail_features;
     }
-    r = ioctl(hdev->control, VHOST_SET_MEM_TABLE, hdev->mem);
+    r = hdev->vhost_ops->vhost_call(hdev, VHOST_SET_MEM_TABLE, hdev->mem);
     if (r < 0) {
         r = -errno;
         goto fail_mem;
@@ -975,19 +1151,23 @@ int vhost_dev_start(struct vhost_dev *hdev, VirtIODevice *vdev)
     }
 
     if (hdev->log_enabled) {
+        uint64_t log_base;
+
         hdev->log_size = vhost_get_log_size(hdev);
-        hdev->log = hdev->log_size ?
-            g_malloc0(hdev->log_size * sizeof *hdev->log) : NULL;
-        r = ioctl(hdev->control, VHOST_SET_LOG_BASE,
-                  (uint64_t)(unsigned long)hdev->log);
+        hdev->log = vhost_log_get(hdev->log_size);
+        log_base = (uint64_t)(unsigned long)hdev->log->log;
+        r = hdev->vhost_ops->vhost_call(hdev, VHOST_SET_LOG_BASE, &log_base);
         if (r < 0) {
             r = -errno;
             goto fail_log;
         }
     }
 
+    /* The vhost backend writes guest RAM behind our back */
+    ram_reclaim_inhibit(true);
     return 0;
 fail_log:
+    vhost_log_put(hdev, false);
 fail_vq:
     while (--i >= 0) {
         vhost_virtqueue_stop(hdev,
@@ -1020,8 +1200,7 @@ void vhost_dev_stop(struct vhost_dev *hdev, VirtIODevice *vdev)
     }
 
     hdev->started = false;
-    g_free(hdev->log);
-    hdev->log = NULL;
-    hdev->log_size = 0;
+    vhost_log_put(hdev, false);
+    ram_reclaim_inhibit(false);
 }
 
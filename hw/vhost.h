@@ -4,6 +4,7 @@
 #include "hw/hw.h"
 #include "hw/virtio.h"
 #include "exec/memory.h"
+#include "hw/vhost-backend.h"
 
 /* Generic structures common for any vhost based device. */
 struct vhost_virtqueue {
@@ -26,10 +27,24 @@ typedef unsigned long vhost_log_chunk_t;
 #define VHOST_LOG_BITS (8 * sizeof(vhost_log_chunk_t))
 #define VHOST_LOG_CHUNK (VHOST_LOG_PAGE * VHOST_LOG_BITS)
 
+/* The dirty log the backends write, one bit per VHOST_LOG_PAGE of guest
+ * physical memory.  All devices that need a log of the same size, which
+ * is normally all of them since they see the same memory, share one. */
+struct vhost_log {
+    unsigned long long size;    /* in chunks */
+    int refcnt;
+    /* the device whose log_sync scans the log for all of them */
+    struct vhost_dev *syncer;
+    vhost_log_chunk_t *log;
+};
+
 struct vhost_memory;
 struct vhost_dev {
     MemoryListener memory_listener;
-    int control;
+    /* backend private data: the /dev/vhost-* fd for the kernel backend,
+     * the socket state for vhost-user */
+    void *opaque;
+    const VhostOps *vhost_ops;
     struct vhost_memory *mem;
     int n_mem_sections;
     MemoryRegionSection *mem_sections;
@@ -42,13 +57,19 @@ struct vhost_dev {
     unsigned long long backend_features;
     bool started;
     bool log_enabled;
-    vhost_log_chunk_t *log;
+    struct vhost_log *log;
     unsigned long long log_size;
     bool force;
+    /* kernel backend: thread id of the vhost worker, 0 if it was not found */
+    pid_t worker;
 };
 
+/* For VHOST_BACKEND_TYPE_USER, @devfd is the connected vhost-user socket
+ * and @devpath is unused.  In both cases the device owns @devfd from here
+ * on, including on failure.
+ */
 int vhost_dev_init(struct vhost_dev *hdev, int devfd, const char *devpath,
-                   bool force);
+                   VhostBackendType backend_type, bool force);
 void vhost_dev_cleanup(struct vhost_dev *hdev);
 bool vhost_dev_query(struct vhost_dev *hdev, VirtIODevice *vdev);
 int vhost_dev_start(struct vhost_dev *hdev, VirtIODevice *vdev);
@@ -56,6 +77,11 @@ void vhost_dev_stop(struct vhost_dev *hdev, VirtIODevice *vdev);
 int vhost_dev_enable_notifiers(struct vhost_dev *hdev, VirtIODevice *vdev);
 void vhost_dev_disable_notifiers(struct vhost_dev *hdev, VirtIODevice *vdev);
 
+/* Bind the worker thread of a kernel backend to host CPU @cpu.
+ * Returns -ENOSYS if the worker is not known.
+ */
+int vhost_dev_set_affinity(struct vhost_dev *hdev, int cpu);
+
 /* Test and clear masked event pending status.
  * Should be called after unmask to avoid losing events.
  */
@@ -15,6 +15,7 @@
 
 #include "net/net.h"
 #include "net/tap.h"
+#include "net/vhost-user.h"
 
 #include "virtio-net.h"
 #include "vhost_net.h"
@@ -92,7 +93,7 @@ static int vhost_net_get_fd(NetClientState *backend)
 }
 
 struct vhost_net *vhost_net_init(NetClientState *backend, int devfd,
-                                 bool force)
+                                 VhostBackendType backend_type, bool force)
 {
     int r;
     struct vhost_net *net = g_malloc(sizeof *net);
@@ -100,23 +101,32 @@ struct vhost_net *vhost_net_init(NetClientState *backend, int devfd,
         fprintf(stderr, "vhost-net requires backend to be setup\n");
         goto fail;
     }
-    r = vhost_net_get_fd(backend);
-    if (r < 0) {
-        goto fail;
-    }
     net->nc = backend;
-    net->dev.backend_features = tap_has_vnet_hdr(backend) ? 0 :
-        (1 << VHOST_NET_F_VIRTIO_NET_HDR);
-    net->backend = r;
+
+    if (backend_type == VHOST_BACKEND_TYPE_KERNEL) {
+        r = vhost_net_get_fd(backend);
+        if (r < 0) {
+            goto fail;
+        }
+        net->dev.backend_features = tap_has_vnet_hdr(backend) ? 0 :
+            (1 << VHOST_NET_F_VIRTIO_NET_HDR);
+        net->backend = r;
+    } else {
+        /* The vhost-user process owns the host side of the queues */
+        net->dev.backend_features = 0;
+        net->backend = -1;
+    }
 
     net->dev.nvqs = 2;
     net->dev.vqs = net->vqs;
 
-    r = vhost_dev_init(&net->dev, devfd, "/dev/vhost-net", force);
+    r = vhost_dev_init(&net->dev, devfd, "/dev/vhost-net", backend_type,
+                       force);
     if (r < 0) {
         goto fail;
     }
-    if (!tap_has_vnet_hdr_len(backend,
+    if (backend_type == VHOST_BACKEND_TYPE_KERNEL &&
+        !tap_has_vnet_hdr_len(backend,
                               sizeof(struct virtio_net_hdr_mrg_rxbuf))) {
         net->dev.features &= ~(1 << VIRTIO_NET_F_MRG_RXBUF);
     }
@@ -165,11 +175,16 @@ static int vhost_net_start_one(struct vhost_net *net,
         goto fail_start;
     }
 
+    if (net->dev.vhost_ops->backend_type != VHOST_BACKEND_TYPE_KERNEL) {
+        return 0;
+    }
+
     net->nc->info->poll(net->nc, false);
     qemu_set_fd_handler(net->backend, NULL, NULL, NULL);
     file.fd = net->backend;
     for (file.index = 0; file.index < net->dev.nvqs; ++file.index) {
-        r = ioctl(net->dev.control, VHOST_NET_SET_BACKEND, &file);
+        r = net->dev.vhost_ops->vhost_call(&net->dev, VHOST_NET_SET_BACKEND,
+                                           &file);
         if (r < 0) {
             r = -errno;
             goto fail;
@@ -179,7 +194,8 @@ static int vhost_net_start_one(struct vhost_net *net,
 fail:
     file.fd = -1;
     while (file.index-- > 0) {
-        int r = ioctl(net->dev.control, VHOST_NET_SET_BACKEND, &file);
+        int r = net->dev.vhost_ops->vhost_call(&net->dev,
+                                               VHOST_NET_SET_BACKEND, &file);
         assert(r >= 0);
     }
     net->nc->info->poll(net->nc, true);
@@ -199,11 +215,15 @@ static void vhost_net_stop_one(struct vhost_net *net,
         return;
     }
 
-    for (file.index = 0; file.index < net->dev.nvqs; ++file.index) {
-        int r = ioctl(net->dev.control, VHOST_NET_SET_BACKEND, &file);
-        assert(r >= 0);
+    if (net->dev.vhost_ops->backend_type == VHOST_BACKEND_TYPE_KERNEL) {
+        for (file.index = 0; file.index < net->dev.nvqs; ++file.index) {
+            int r = net->dev.vhost_ops->vhost_call(&net->dev,
+                                                   VHOST_NET_SET_BACKEND,
+                                                   &file);
+            assert(r >= 0);
+        }
+        net->nc->info->poll(net->nc, true);
     }
-    net->nc->info->poll(net->nc, true);
     vhost_dev_stop(&net->dev, dev);
     vhost_dev_disable_notifiers(&net->dev, dev);
 }
@@ -220,7 +240,7 @@ int vhost_net_start(VirtIODevice *dev, NetClientState *ncs,
     }
 
     for (i = 0; i < total_queues; i++) {
-        r = vhost_net_start_one(tap_get_vhost_net(ncs[i].peer), dev, i * 2);
+        r = vhost_net_start_one(get_vhost_net(ncs[i].peer), dev, i * 2);
 
         if (r < 0) {
             goto err;
@@ -239,7 +259,7 @@ int vhost_net_start(VirtIODevice *dev, NetClientState *ncs,
 
 err:
     while (--i >= 0) {
-        vhost_net_stop_one(tap_get_vhost_net(ncs[i].peer), dev);
+        vhost_net_stop_one(get_vhost_net(ncs[i].peer), dev);
     }
     return r;
 }
@@ -259,7 +279,7 @@ void vhost_net_stop(VirtIODevice *dev, NetClientState *ncs,
     assert(r >= 0);
 
     for (i = 0; i < total_queues; i++) {
-        vhost_net_stop_one(tap_get_vhost_net(ncs[i].peer), dev);
+        vhost_net_stop_one(get_vhost_net(ncs[i].peer), dev);
     }
 }
 
@@ -279,9 +299,41 @@ void vhost_net_virtqueue_mask(VHostNetState *net, VirtIODevice *dev,
 {
     vhost_virtqueue_mask(&net->dev, dev, idx, mask);
 }
+
+pid_t vhost_net_get_worker(VHostNetState *net)
+{
+    return net->dev.worker;
+}
+
+int vhost_net_set_affinity(VHostNetState *net, int cpu)
+{
+    return vhost_dev_set_affinity(&net->dev, cpu);
+}
+
+VHostNetState *get_vhost_net(NetClientState *nc)
+{
+    VHostNetState *vhost_net = NULL;
+
+    if (!nc) {
+        return NULL;
+    }
+
+    switch (nc->info->type) {
+    case NET_CLIENT_OPTIONS_KIND_TAP:
+        vhost_net = tap_get_vhost_net(nc);
+        break;
+    case NET_CLIENT_OPTIONS_KIND_VHOST_USER:
+        vhost_net = vhost_user_get_vhost_net(nc);
+        break;
+    default:
+        break;
+    }
+
+    return vhost_net;
+}
 #else
 struct vhost_net *vhost_net_init(NetClientState *backend, int devfd,
-                                 bool force)
+                                 VhostBackendType backend_type, bool force)
 {
     error_report("vhost-net support is not compiled in");
     return NULL;
@@ -325,4 +377,19 @@ void vhost_net_virtqueue_mask(VHostNetState *net, VirtIODevice *dev,
                               int idx, bool mask)
 {
 }
+
+pid_t vhost_net_get_worker(VHostNetState *net)
+{
+    return 0;
+}
+
+int vhost_net_set_affinity(VHostNetState *net, int cpu)
+{
+    return -ENOSYS;
+}
+
+VHostNetState *get_vhost_net(NetClientState *nc)
+{
+    return NULL;
+}
 #endif
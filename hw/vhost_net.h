@@ -2,11 +2,13 @@
 #define VHOST_NET_H
 
 #include "net/net.h"
+#include "hw/vhost-backend.h"
 
 struct vhost_net;
 typedef struct vhost_net VHostNetState;
 
-VHostNetState *vhost_net_init(NetClientState *backend, int devfd, bool force);
+VHostNetState *vhost_net_init(NetClientState *backend, int devfd,
+                              VhostBackendType backend_type, bool force);
 
 bool vhost_net_query(VHostNetState *net, VirtIODevice *dev);
 int vhost_net_start(VirtIODevice *dev, NetClientState *ncs, int total_queues);
@@ -20,4 +22,11 @@ void vhost_net_ack_features(VHostNetState *net, unsigned features);
 bool vhost_net_virtqueue_pending(VHostNetState *net, int n);
 void vhost_net_virtqueue_mask(VHostNetState *net, VirtIODevice *dev,
                               int idx, bool mask);
+
+/* The kernel worker thread serving @net, or 0 if unknown */
+pid_t vhost_net_get_worker(VHostNetState *net);
+int vhost_net_set_affinity(VHostNetState *net, int cpu);
+
+/* Return the vhost state of a tap or vhost-user netdev, or NULL */
+VHostNetState *get_vhost_net(NetClientState *nc);
 #endif
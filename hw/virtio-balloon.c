@@ -32,7 +32,7 @@
 typedef struct VirtIOBalloon
 {
     VirtIODevice vdev;
-    VirtQueue *ivq, *dvq, *svq;
+    VirtQueue *ivq, *dvq, *svq, *rvq;
     uint32_t num_pages;
     uint32_t actual;
     uint64_t stats[VIRTIO_BALLOON_S_NR];
@@ -228,6 +228,54 @@ static void virtio_balloon_handle_output(VirtIODevice *vdev, VirtQueue *vq)
     }
 }
 
+/* Free page reporting: each buffer the guest adds to rvq is a free range
+ * of guest physical memory.  Its host memory is given back like that of a
+ * ballooned page, and it is dropped from the pages still to be migrated.
+ * The guest does not reuse the range before the buffer is returned.
+ */
+static void balloon_report_range(hwaddr pa, uint64_t len)
+{
+    while (len) {
+        MemoryRegionSection section;
+        ram_addr_t offset;
+
+        /* FIXME: remove get_system_memory(), but how? */
+        section = memory_region_find(get_system_memory(), pa, len);
+        if (!section.size) {
+            return;
+        }
+        if (memory_region_is_ram(section.mr)) {
+            offset = section.offset_within_region;
+#if defined(__linux__)
+            if (!kvm_enabled() || kvm_has_sync_mmu()) {
+                qemu_madvise(memory_region_get_ram_ptr(section.mr) + offset,
+                             section.size, QEMU_MADV_DONTNEED);
+            }
+#endif
+            cpu_physical_memory_discard_migration_range(
+                section.mr->ram_addr + offset, section.size);
+        }
+        len -= section.offset_within_address_space + section.size - pa;
+        pa = section.offset_within_address_space + section.size;
+    }
+}
+
+static void virtio_balloon_handle_report(VirtIODevice *vdev, VirtQueue *vq)
+{
+    VirtQueueElement elem;
+
+    while (virtqueue_pop(vq, &elem)) {
+        unsigned int i;
+
+        for (i = 0; i < elem.in_num; i++) {
+            balloon_report_range(elem.in_addr[i], elem.in_sg[i].iov_len);
+        }
+
+        virtqueue_push(vq, &elem, 0);
+        virtio_notify(vdev, vq);
+    }
+}
+
 static void virtio_balloon_receive_stats(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIOBalloon *s = DO_UPCAST(VirtIOBalloon, vdev, vdev);
@@ -372,6 +420,7 @@ VirtIODevice *virtio_balloon_init(DeviceState *dev)
     s->ivq = virtio_add_queue(&s->vdev, 128, virtio_balloon_handle_output);
     s->dvq = virtio_add_queue(&s->vdev, 128, virtio_balloon_handle_output);
     s->svq = virtio_add_queue(&s->vdev, 128, virtio_balloon_receive_stats);
+    s->rvq = virtio_add_queue(&s->vdev, 32, virtio_balloon_handle_report);
 
     s->qdev = dev;
     register_savevm(dev, "virtio-balloon", -1, 1,
@@ -29,7 +29,8 @@ typedef struct VirtIOBlock
 {
     VirtIODevice vdev;
     BlockDriverState *bs;
-    VirtQueue *vq;
+    VirtQueue *vq[VIRTIO_PCI_QUEUE_MAX];
+    unsigned int num_queues;
     void *rq;
     QEMUBH *bh;
     BlockConf *conf;
@@ -49,6 +50,7 @@ static VirtIOBlock *to_virtio_blk(VirtIODevice *vdev)
 typedef struct VirtIOBlockReq
 {
     VirtIOBlock *dev;
+    VirtQueue *vq;
     VirtQueueElement elem;
     struct virtio_blk_inhdr *in;
     struct virtio_blk_outhdr *out;
@@ -65,8 +67,8 @@ static void virtio_blk_req_complete(VirtIOBlockReq *req, int status)
     trace_virtio_blk_req_complete(req, status);
 
     stb_p(&req->in->status, status);
-    virtqueue_push(s->vq, &req->elem, req->qiov.size + sizeof(*req->in));
-    virtio_notify(&s->vdev, s->vq);
+    virtqueue_push(req->vq, &req->elem, req->qiov.size + sizeof(*req->in));
+    virtio_notify(&s->vdev, req->vq);
 }
 
 static int virtio_blk_handle_rw_error(VirtIOBlockReq *req, int error,
@@ -129,12 +131,13 @@ static VirtIOBlockReq *virtio_blk_alloc_request(VirtIOBlock *s)
     return req;
 }
 
-static VirtIOBlockReq *virtio_blk_get_request(VirtIOBlock *s)
+static VirtIOBlockReq *virtio_blk_get_request(VirtIOBlock *s, VirtQueue *vq)
 {
     VirtIOBlockReq *req = virtio_blk_alloc_request(s);
 
     if (req != NULL) {
-        if (!virtqueue_pop(s->vq, &req->elem)) {
+        req->vq = vq;
+        if (!virtqueue_pop(vq, &req->elem)) {
             g_free(req);
             return NULL;
         }
@@ -427,11 +430,13 @@ static void virtio_blk_handle_output(VirtIODevice *vdev, VirtQueue *vq)
     }
 #endif
 
-    while ((req = virtio_blk_get_request(s))) {
+    bdrv_io_plug(s->bs);
+    while ((req = virtio_blk_get_request(s, vq))) {
         virtio_blk_handle_request(req, &mrb);
     }
 
     virtio_submit_multiwrite(s->bs, &mrb);
+    bdrv_io_unplug(s->bs);
 
     /*
      * FIXME: Want to check for completions before returning to guest mode,
@@ -453,12 +458,14 @@ static void virtio_blk_dma_restart_bh(void *opaque)
 
     s->rq = NULL;
 
+    bdrv_io_plug(s->bs);
     while (req) {
         virtio_blk_handle_request(req, &mrb);
         req = req->next;
     }
 
     virtio_submit_multiwrite(s->bs, &mrb);
+    bdrv_io_unplug(s->bs);
 }
 
 static void virtio_blk_dma_restart_cb(void *opaque, int running,
@@ -531,7 +538,8 @@ static void virtio_blk_update_config(VirtIODevice *vdev, uint8_t *config)
     blkcfg.physical_block_exp = get_physical_block_exp(s->conf);
     blkcfg.alignment_offset = 0;
     blkcfg.wce = bdrv_enable_write_cache(s->bs);
-    memcpy(config, &blkcfg, sizeof(struct virtio_blk_config));
+    stw_raw(&blkcfg.num_queues, s->num_queues);
+    memcpy(config, &blkcfg, vdev->config_len);
 }
 
 static void virtio_blk_set_config(VirtIODevice *vdev, const uint8_t *config)
@@ -539,7 +547,7 @@ static void virtio_blk_set_config(VirtIODevice *vdev, const uint8_t *config)
     VirtIOBlock *s = to_virtio_blk(vdev);
     struct virtio_blk_config blkcfg;
 
-    memcpy(&blkcfg, config, sizeof(blkcfg));
+    memcpy(&blkcfg, config, vdev->config_len);
     bdrv_set_enable_write_cache(s->bs, blkcfg.wce != 0);
 }
 
@@ -556,6 +564,9 @@ static uint32_t virtio_blk_get_features(VirtIODevice *vdev, uint32_t features)
     if (s->blk->config_wce) {
         features |= (1 << VIRTIO_BLK_F_CONFIG_WCE);
     }
+    if (s->num_queues > 1) {
+        features |= (1 << VIRTIO_BLK_F_MQ);
+    }
     if (bdrv_enable_write_cache(s->bs))
         features |= (1 << VIRTIO_BLK_F_WCE);
 
@@ -595,6 +606,9 @@ static void virtio_blk_save(QEMUFile *f, void *opaque)
     while (req) {
         qemu_put_sbyte(f, 1);
         qemu_put_buffer(f, (unsigned char*)&req->elem, sizeof(req->elem));
+        if (s->num_queues > 1) {
+            qemu_put_be32(f, virtio_get_queue_index(req->vq));
+        }
         req = req->next;
     }
     qemu_put_sbyte(f, 0);
@@ -615,7 +629,17 @@ static int virtio_blk_load(QEMUFile *f, void *opaque, int version_id)
 
     while (qemu_get_sbyte(f)) {
         VirtIOBlockReq *req = virtio_blk_alloc_request(s);
+        unsigned int n = 0;
+
         qemu_get_buffer(f, (unsigned char*)&req->elem, sizeof(req->elem));
+        if (s->num_queues > 1) {
+            n = qemu_get_be32(f);
+            if (n >= s->num_queues) {
+                g_free(req);
+                return -EINVAL;
+            }
+        }
+        req->vq = s->vq[n];
         req->next = s->rq;
         s->rq = req;
 
@@ -643,6 +667,8 @@ VirtIODevice *virtio_blk_init(DeviceState *dev, VirtIOBlkConf *blk)
 {
     VirtIOBlock *s;
     static int virtio_blk_id;
+    size_t config_size;
+    unsigned int i;
 
     if (!blk->conf.bs) {
         error_report("drive property not set");
@@ -658,9 +684,23 @@ VirtIODevice *virtio_blk_init(DeviceState *dev, VirtIOBlkConf *blk)
         return NULL;
     }
 
+    if (blk->num_queues == 0) {
+        blk->num_queues = 1;
+    }
+    if (blk->num_queues > VIRTIO_PCI_QUEUE_MAX) {
+        error_report("num-queues must be at most %d", VIRTIO_PCI_QUEUE_MAX);
+        return NULL;
+    }
+
+    /* Keep the config space of single-queue devices as it was, so that
+     * migration from older versions works */
+    config_size = sizeof(struct virtio_blk_config);
+    if (blk->num_queues == 1) {
+        config_size = offsetof(struct virtio_blk_config, unused);
+    }
+
     s = (VirtIOBlock *)virtio_common_init("virtio-blk", VIRTIO_ID_BLOCK,
-                                          sizeof(struct virtio_blk_config),
-                                          sizeof(VirtIOBlock));
+                                          config_size, sizeof(VirtIOBlock));
 
     s->vdev.get_config = virtio_blk_update_config;
     s->vdev.set_config = virtio_blk_set_config;
@@ -673,7 +713,10 @@ VirtIODevice *virtio_blk_init(DeviceState *dev, VirtIOBlkConf *blk)
     s->rq = NULL;
     s->sector_mask = (s->conf->logical_block_size / BDRV_SECTOR_SIZE) - 1;
 
-    s->vq = virtio_add_queue(&s->vdev, 128, virtio_blk_handle_output);
+    s->num_queues = blk->num_queues;
+    for (i = 0; i < s->num_queues; i++) {
+        s->vq[i] = virtio_add_queue(&s->vdev, 128, virtio_blk_handle_output);
+    }
 #ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
     if (!virtio_blk_data_plane_create(&s->vdev, blk, &s->dataplane)) {
         virtio_cleanup(&s->vdev);
@@ -687,6 +730,7 @@ VirtIODevice *virtio_blk_init(DeviceState *dev, VirtIOBlkConf *blk)
                     virtio_blk_save, virtio_blk_load, s);
     bdrv_set_dev_ops(s->bs, &virtio_block_ops, s);
     bdrv_set_buffer_alignment(s->bs, s->conf->logical_block_size);
+    blkconf_blocksizes(s->conf);
 
     bdrv_iostatus_enable(s->bs);
     add_boot_device_path(s->conf->bootindex, dev, "/disk@0,0");
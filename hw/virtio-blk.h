@@ -34,6 +34,7 @@
 #define VIRTIO_BLK_F_WCE        9       /* write cache enabled */
 #define VIRTIO_BLK_F_TOPOLOGY   10      /* Topology information is available */
 #define VIRTIO_BLK_F_CONFIG_WCE 11      /* write cache configurable */
+#define VIRTIO_BLK_F_MQ         12      /* support more than one vq */
 
 #define VIRTIO_BLK_ID_BYTES     20      /* ID string length */
 
@@ -51,6 +52,8 @@ struct virtio_blk_config
     uint16_t min_io_size;
     uint32_t opt_io_size;
     uint8_t wce;
+    uint8_t unused;
+    uint16_t num_queues;            /* only valid with VIRTIO_BLK_F_MQ */
 } QEMU_PACKED;
 
 /* These two define direction. */
@@ -106,6 +109,9 @@ struct VirtIOBlkConf
     uint32_t scsi;
     uint32_t config_wce;
     uint32_t data_plane;
+    uint32_t num_queues;
+    char *data_plane_cpus;          /* host CPUs for the dataplane threads */
+    uint32_t data_plane_poll_max_ns; /* dataplane busy-wait limit, 0 is off */
 };
 
 #define DEFINE_VIRTIO_BLK_FEATURES(_state, _field) \
@@ -12,19 +12,148 @@
 
 #include "char/char.h"
 #include "qemu/error-report.h"
+#include "migration/migration.h"
+#include "qapi/qmp/qerror.h"
 #include "trace.h"
 #include "virtio-serial.h"
 
+#define VIRTCONSOLE_RING_MIN    (4 * 1024)
+#define VIRTCONSOLE_RING_MAX    (64 * 1024 * 1024)
+
 typedef struct VirtConsole {
     VirtIOSerialPort port;
     CharDriverState *chr;
+
+    /*
+     * Streaming mode: with ring-size set, guest data is copied into this
+     * ring and the guest buffers are returned right away.  The ring is
+     * written out to the backend from a bottom half, so that the data of
+     * many guest buffers leaves in a single writev().
+     */
+    uint32_t ring_size;
+    uint8_t *ring;
+    uint32_t ring_head;
+    uint32_t ring_len;
+    QEMUBH *flush_bh;
+
+    /* waiting for the backend to become writable */
+    bool write_pending;
+    Error *migration_blocker;
 } VirtConsole;
 
+static void chr_write_ready(void *opaque);
+
+/* Ask the backend to call us back once it can take more data */
+static bool wait_writable(VirtConsole *vcon)
+{
+    if (vcon->write_pending) {
+        return true;
+    }
+    if (qemu_chr_fe_notify_writable(vcon->chr, chr_write_ready, vcon) < 0) {
+        return false;
+    }
+    vcon->write_pending = true;
+    return true;
+}
+
+static void ring_flush(VirtConsole *vcon)
+{
+    struct iovec iov[2];
+    uint32_t first;
+    int iovcnt = 1, ret;
+
+    if (!vcon->ring_len || vcon->write_pending) {
+        return;
+    }
+
+    first = MIN(vcon->ring_len, vcon->ring_size - vcon->ring_head);
+    iov[0].iov_base = vcon->ring + vcon->ring_head;
+    iov[0].iov_len = first;
+    if (first < vcon->ring_len) {
+        iov[1].iov_base = vcon->ring;
+        iov[1].iov_len = vcon->ring_len - first;
+        iovcnt = 2;
+    }
+
+    ret = qemu_chr_fe_writev(vcon->chr, iov, iovcnt);
+    trace_virtio_console_ring_flush(vcon->port.id, vcon->ring_len, ret);
+    if (ret == -EAGAIN) {
+        ret = 0;
+    } else if (ret < 0) {
+        /*
+         * The backend is gone for good; the guest was told long ago that
+         * this data was sent, so there is nobody to return it to.
+         */
+        ret = vcon->ring_len;
+    }
+
+    vcon->ring_head = (vcon->ring_head + ret) % vcon->ring_size;
+    vcon->ring_len -= ret;
+    if (!vcon->ring_len) {
+        vcon->ring_head = 0;
+    } else if (!wait_writable(vcon)) {
+        /* no way to be notified, poll from the main loop instead */
+        qemu_bh_schedule(vcon->flush_bh);
+    }
+
+    if (vcon->port.throttled && vcon->ring_len < vcon->ring_size) {
+        virtio_serial_throttle_port(&vcon->port, false);
+    }
+}
+
+static void ring_flush_bh(void *opaque)
+{
+    ring_flush(opaque);
+}
+
+static size_t ring_write(VirtConsole *vcon, const uint8_t *buf, size_t len)
+{
+    size_t done = 0;
+    uint32_t tail, n;
+
+    while (done < len) {
+        if (vcon->ring_len == vcon->ring_size) {
+            /* full: try to make room now rather than stall the guest */
+            ring_flush(vcon);
+            if (vcon->ring_len == vcon->ring_size) {
+                break;
+            }
+        }
+        tail = (vcon->ring_head + vcon->ring_len) % vcon->ring_size;
+        n = MIN(len - done, vcon->ring_size - vcon->ring_len);
+        n = MIN(n, vcon->ring_size - tail);
+        memcpy(vcon->ring + tail, buf + done, n);
+        vcon->ring_len += n;
+        done += n;
+    }
+
+    if (done < len) {
+        /* ring_flush() unthrottles once there is room again */
+        virtio_serial_throttle_port(&vcon->port, true);
+    } else if (!vcon->write_pending) {
+        qemu_bh_schedule(vcon->flush_bh);
+    }
+    return done;
+}
+
+/* Called by the backend once it can accept data again */
+static void chr_write_ready(void *opaque)
+{
+    VirtConsole *vcon = opaque;
+
+    vcon->write_pending = false;
+    if (vcon->ring) {
+        ring_flush(vcon);
+    } else {
+        virtio_serial_throttle_port(&vcon->port, false);
+    }
+}
 
 /* Callback function that's called when the guest sends us data */
 static ssize_t flush_buf(VirtIOSerialPort *port, const uint8_t *buf, size_t len)
 {
     VirtConsole *vcon = DO_UPCAST(VirtConsole, port, port);
+    struct iovec iov;
     ssize_t ret;
 
     if (!vcon->chr) {
@@ -32,23 +161,31 @@ static ssize_t flush_buf(VirtIOSerialPort *port, const uint8_t *buf, size_t len)
         return len;
     }
 
-    ret = qemu_chr_fe_write(vcon->chr, buf, len);
+    if (vcon->ring) {
+        return ring_write(vcon, buf, len);
+    }
+
+    iov.iov_base = (void *)buf;
+    iov.iov_len = len;
+    ret = qemu_chr_fe_writev(vcon->chr, &iov, 1);
     trace_virtio_console_flush_buf(port->id, len, ret);
 
     if (ret < 0) {
         /*
-         * Ideally we'd get a better error code than just -1, but
-         * that's what the chardev interface gives us right now.  If
-         * we had a finer-grained message, like -EPIPE, we could close
-         * this connection.  Absent such error messages, the most we
-         * can do is to return 0 here.
-         *
-         * This will prevent stray -1 values to go to
-         * virtio-serial-bus.c and cause abort()s in
-         * do_flush_queued_data().
+         * Neither -EAGAIN nor a real error may go to virtio-serial-bus.c,
+         * which would abort() in do_flush_queued_data(); report that
+         * nothing was consumed instead.
          */
         ret = 0;
     }
+    if (ret < len && wait_writable(vcon)) {
+        /*
+         * The backend will tell us when it can take more.  Throttle even
+         * consoles then: the guest is not left spinning, and the rest of
+         * this buffer is not dropped.
+         */
+        virtio_serial_throttle_port(port, true);
+    }
     return ret;
 }
 
@@ -116,16 +253,58 @@ static int virtconsole_initfn(VirtIOSerialPort *port)
         return -1;
     }
 
+    if (vcon->ring_size &&
+        (vcon->ring_size < VIRTCONSOLE_RING_MIN ||
+         vcon->ring_size > VIRTCONSOLE_RING_MAX)) {
+        error_report("ring-size must be between %d and %d bytes",
+                     VIRTCONSOLE_RING_MIN, VIRTCONSOLE_RING_MAX);
+        return -1;
+    }
+
     if (vcon->chr) {
         qemu_chr_add_handlers(vcon->chr, chr_can_read, chr_read, chr_event,
                               vcon);
     }
 
+    if (vcon->chr && vcon->ring_size) {
+        vcon->ring = g_malloc(vcon->ring_size);
+        vcon->flush_bh = qemu_bh_new(ring_flush_bh, vcon);
+
+        /* the ring holds data the guest already considers sent */
+        error_set(&vcon->migration_blocker,
+                  QERR_DEVICE_FEATURE_BLOCKS_MIGRATION,
+                  "ring-size", object_get_typename(OBJECT(port)));
+        migrate_add_blocker(vcon->migration_blocker);
+    }
+
+    return 0;
+}
+
+static int virtconsole_exitfn(VirtIOSerialPort *port)
+{
+    VirtConsole *vcon = DO_UPCAST(VirtConsole, port, port);
+
+    if (vcon->chr) {
+        if (vcon->write_pending) {
+            qemu_chr_fe_notify_writable(vcon->chr, NULL, NULL);
+        }
+        qemu_chr_add_handlers(vcon->chr, NULL, NULL, NULL, NULL);
+    }
+
+    if (vcon->ring) {
+        qemu_bh_delete(vcon->flush_bh);
+        g_free(vcon->ring);
+        vcon->ring = NULL;
+        migrate_del_blocker(vcon->migration_blocker);
+        error_free(vcon->migration_blocker);
+    }
+
     return 0;
 }
 
 static Property virtconsole_properties[] = {
     DEFINE_PROP_CHR("chardev", VirtConsole, chr),
+    DEFINE_PROP_UINT32("ring-size", VirtConsole, ring_size, 0),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -136,6 +315,7 @@ static void virtconsole_class_init(ObjectClass *klass, void *data)
 
     k->is_console = true;
     k->init = virtconsole_initfn;
+    k->exit = virtconsole_exitfn;
     k->have_data = flush_buf;
     k->guest_open = guest_open;
     k->guest_close = guest_close;
@@ -151,6 +331,7 @@ static const TypeInfo virtconsole_info = {
 
 static Property virtserialport_properties[] = {
     DEFINE_PROP_CHR("chardev", VirtConsole, chr),
+    DEFINE_PROP_UINT32("ring-size", VirtConsole, ring_size, 0),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -160,6 +341,7 @@ static void virtserialport_class_init(ObjectClass *klass, void *data)
     VirtIOSerialPortClass *k = VIRTIO_SERIAL_PORT_CLASS(klass);
 
     k->init = virtconsole_initfn;
+    k->exit = virtconsole_exitfn;
     k->have_data = flush_buf;
     k->guest_open = guest_open;
     k->guest_close = guest_close;
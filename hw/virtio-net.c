@@ -18,24 +18,70 @@
 #include "net/tap.h"
 #include "qemu/error-report.h"
 #include "qemu/timer.h"
+#include "qapi/visitor.h"
+#include "qom/cpu.h"
+#include "sysemu/sysemu.h"
 #include "virtio-net.h"
 #include "vhost_net.h"
 
+#ifdef CONFIG_LINUX
+#include <sched.h>
+#endif
+
 #define VIRTIO_NET_VM_VERSION    11
 
 #define MAC_TABLE_ENTRIES    64
 #define MAX_VLAN    (1 << 12)   /* Per 802.1Q definition */
 
+/* Ways of draining a TX queue, selected with the "tx" property */
+enum {
+    VIRTIO_NET_TX_BH,       /* flush from a bottom half as soon as kicked */
+    VIRTIO_NET_TX_TIMER,    /* wait tx_timeout for more packets, then flush */
+    VIRTIO_NET_TX_ADAPTIVE, /* pick one of the two per queue at run time */
+};
+
 typedef struct VirtIONetQueue {
     VirtQueue *rx_vq;
     VirtQueue *tx_vq;
     QEMUTimer *tx_timer;
     QEMUBH *tx_bh;
     int tx_waiting;
+    /* Inside a receive batch the used ring is flushed only at its end */
+    bool rx_batch;
+    /* RX buffers popped but not yet used, oldest first */
+    struct {
+        VirtQueueElement *elems;    /* RX_CACHE_DEPTH entries */
+        unsigned int head;
+        unsigned int count;
+        unsigned int used;          /* filled in, not yet flushed */
+        size_t bytes;               /* room in the cached buffers */
+        unsigned int mapped;        /* buffers handed out by rx_map */
+        size_t mapped_bytes;
+    } rx_cache;
+    /* Adaptive mode only: deferring with tx_timer rather than tx_bh */
+    bool tx_batching;
     struct {
-        VirtQueueElement elem;
-        ssize_t len;
+        int64_t window_start;
+        int64_t window_packets;
+        int64_t window_flushes;
+        int64_t rate;           /* packets/s over the last full window */
+        int64_t packets;
+        int64_t flushes;
+        int64_t last_batch;
+        int64_t max_batch;
+        int64_t switches;
+    } tx_stats;
+    /* Packets the peer queued by reference, oldest first.  Their guest
+     * buffers stay mapped until the peer's sent callback returns them. */
+    struct {
+        VirtQueueElement *elems;    /* TX_QUEUE_DEPTH entries */
+        unsigned int head;
+        unsigned int count;
+        bool blocked;               /* flushing stopped on a full ring */
     } async_tx;
+    /* vhost-cpus only: where the queue pair was placed, -1 if inactive */
+    int guest_cpu;
+    int host_cpu;
     struct VirtIONet *n;
 } VirtIONetQueue;
 
@@ -49,10 +95,13 @@ typedef struct VirtIONet
     NICState *nic;
     uint32_t tx_timeout;
     int32_t tx_burst;
+    int tx_mode;
     uint32_t has_vnet_hdr;
     size_t host_hdr_len;
     size_t guest_hdr_len;
     uint8_t has_ufo;
+    bool sw_offload;
+    uint8_t *sw_offload_buf;
     int mergeable_rx_bufs;
     uint8_t promisc;
     uint8_t allmulti;
@@ -74,6 +123,10 @@ typedef struct VirtIONet
     uint16_t max_queues;
     uint16_t curr_queues;
     size_t config_size;
+    /* vhost-cpus: host CPUs for the vhost workers, none means "auto" */
+    bool affinity;
+    int *host_cpus;
+    int num_host_cpus;
 } VirtIONet;
 
 /*
@@ -110,6 +163,13 @@ static int vq2q(int queue_index)
     return queue_index / 2;
 }
 
+/* Whether a kick on this queue arms tx_timer rather than scheduling tx_bh */
+static bool virtio_net_tx_uses_timer(VirtIONetQueue *q)
+{
+    return q->n->tx_mode == VIRTIO_NET_TX_TIMER ||
+           (q->n->tx_mode == VIRTIO_NET_TX_ADAPTIVE && q->tx_batching);
+}
+
 /* TODO
  * - we could suppress RX interrupt if we were so inclined.
  */
@@ -150,19 +210,148 @@ static bool virtio_net_started(VirtIONet *n, uint8_t status)
         (n->status & VIRTIO_NET_S_LINK_UP) && n->vdev.vm_running;
 }
 
-static void virtio_net_vhost_status(VirtIONet *n, uint8_t status)
+static VirtQueueElement *rx_cache_elem(VirtIONetQueue *q, unsigned int i)
 {
-    NetClientState *nc = qemu_get_queue(n->nic);
-    int queues = n->multiqueue ? n->max_queues : 1;
+    return &q->rx_cache.elems[(q->rx_cache.head + i) % RX_CACHE_DEPTH];
+}
 
-    if (!nc->peer) {
-        return;
+/* Pop RX buffers until @n of them are cached; returns how many are */
+static unsigned int rx_cache_fill(VirtIONetQueue *q, unsigned int n)
+{
+    if (!q->rx_cache.elems) {
+        q->rx_cache.elems = g_new(VirtQueueElement, RX_CACHE_DEPTH);
     }
-    if (nc->peer->info->type != NET_CLIENT_OPTIONS_KIND_TAP) {
+
+    n = MIN(n, RX_CACHE_DEPTH);
+    while (q->rx_cache.count < n) {
+        VirtQueueElement *elem = rx_cache_elem(q, q->rx_cache.count);
+
+        if (virtqueue_pop(q->rx_vq, elem) == 0) {
+            break;
+        }
+        if (elem->in_num < 1) {
+            error_report("virtio-net receive queue contains no in buffers");
+            exit(1);
+        }
+        q->rx_cache.count++;
+        q->rx_cache.bytes += iov_size(elem->in_sg, elem->in_num);
+    }
+    return q->rx_cache.count;
+}
+
+/* Fill in the oldest cached buffer, which holds @len bytes now */
+static void rx_cache_use(VirtIONetQueue *q, size_t len)
+{
+    VirtQueueElement *elem = rx_cache_elem(q, 0);
+
+    virtqueue_fill(q->rx_vq, elem, len, q->rx_cache.used++);
+    q->rx_cache.bytes -= iov_size(elem->in_sg, elem->in_num);
+    q->rx_cache.head = (q->rx_cache.head + 1) % RX_CACHE_DEPTH;
+    q->rx_cache.count--;
+}
+
+static void virtio_net_rx_flush(VirtIONetQueue *q)
+{
+    if (q->rx_cache.used) {
+        virtqueue_flush(q->rx_vq, q->rx_cache.used);
+        q->rx_cache.used = 0;
+        virtio_notify(&q->n->vdev, q->rx_vq);
+    }
+}
+
+/* Return the cached buffers to the avail ring, where migration or a vhost
+ * backend will find them */
+static void rx_cache_drop(VirtIONetQueue *q)
+{
+    virtio_net_rx_flush(q);
+    while (q->rx_cache.count) {
+        q->rx_cache.count--;
+        virtqueue_discard(q->rx_vq, rx_cache_elem(q, q->rx_cache.count));
+    }
+    q->rx_cache.bytes = 0;
+}
+
+/* Host CPU for the vhost worker of queue pair @index, which the guest driver
+ * typically services from vCPU @guest_cpu.  Without an explicit list, use
+ * the host CPU that vCPU is pinned to, or else spread the queues over the
+ * CPUs QEMU may run on.
+ */
+static int virtio_net_pick_host_cpu(VirtIONet *n, int index, int guest_cpu)
+{
+#ifdef CONFIG_LINUX
+    CPUState *cpu = qemu_get_cpu(guest_cpu);
+    cpu_set_t cpus;
+    int i, nth;
+
+    if (n->num_host_cpus) {
+        return n->host_cpus[index % n->num_host_cpus];
+    }
+
+    if (cpu && cpu->thread_id &&
+        sched_getaffinity(cpu->thread_id, sizeof(cpus), &cpus) == 0 &&
+        CPU_COUNT(&cpus) == 1) {
+        nth = 0;
+    } else {
+        if (sched_getaffinity(getpid(), sizeof(cpus), &cpus) < 0 ||
+            CPU_COUNT(&cpus) == 0) {
+            return -1;
+        }
+        nth = index % CPU_COUNT(&cpus);
+    }
+
+    for (i = 0; i < CPU_SETSIZE; i++) {
+        if (CPU_ISSET(i, &cpus) && nth-- == 0) {
+            return i;
+        }
+    }
+    return -1;
+#else
+    return n->num_host_cpus ? n->host_cpus[index % n->num_host_cpus] : -1;
+#endif
+}
+
+/* Place the active queue pairs and bind their vhost workers; called
+ * whenever the vhost backend starts or the guest changes curr_queues.
+ */
+static void virtio_net_update_affinity(VirtIONet *n)
+{
+    int i, r;
+
+    if (!n->affinity) {
         return;
     }
 
-    if (!tap_get_vhost_net(nc->peer)) {
+    for (i = 0; i < n->max_queues; i++) {
+        VirtIONetQueue *q = &n->vqs[i];
+        VHostNetState *net;
+
+        if (i >= n->curr_queues) {
+            q->guest_cpu = -1;
+            q->host_cpu = -1;
+            continue;
+        }
+
+        q->guest_cpu = i % smp_cpus;
+        q->host_cpu = virtio_net_pick_host_cpu(n, i, q->guest_cpu);
+
+        net = get_vhost_net(qemu_get_subqueue(n->nic, i)->peer);
+        if (!n->vhost_started || !net || q->host_cpu < 0) {
+            continue;
+        }
+        r = vhost_net_set_affinity(net, q->host_cpu);
+        if (r < 0 && r != -ENOSYS) {
+            error_report("virtio-net queue %d failed to bind vhost worker "
+                         "to host CPU %d: %s", i, q->host_cpu, strerror(-r));
+        }
+    }
+}
+
+static void virtio_net_vhost_status(VirtIONet *n, uint8_t status)
+{
+    NetClientState *nc = qemu_get_queue(n->nic);
+    int queues = n->multiqueue ? n->max_queues : 1;
+
+    if (!get_vhost_net(nc->peer)) {
         return;
     }
 
@@ -171,16 +360,21 @@ static void virtio_net_vhost_status(VirtIONet *n, uint8_t status)
         return;
     }
     if (!n->vhost_started) {
-        int r;
-        if (!vhost_net_query(tap_get_vhost_net(nc->peer), &n->vdev)) {
+        int r, i;
+        if (!vhost_net_query(get_vhost_net(nc->peer), &n->vdev)) {
             return;
         }
+        for (i = 0; i < queues; i++) {
+            rx_cache_drop(&n->vqs[i]);
+        }
         n->vhost_started = 1;
         r = vhost_net_start(&n->vdev, n->nic->ncs, queues);
         if (r < 0) {
             error_report("unable to start vhost net: %d: "
                          "falling back on userspace virtio", -r);
             n->vhost_started = 0;
+        } else {
+            virtio_net_update_affinity(n);
         }
     } else {
         vhost_net_stop(&n->vdev, n->nic->ncs, queues);
@@ -206,12 +400,21 @@ static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
             queue_status = status;
         }
 
+        if (q->async_tx.count && !virtio_net_started(n, queue_status)) {
+            /* Don't hold guest buffers across a stop or reset (they would
+             * be lost by migration); the queued packets are dropped. */
+            qemu_purge_queued_packets(qemu_get_subqueue(n->nic, i));
+        }
+        if (!virtio_net_started(n, queue_status)) {
+            rx_cache_drop(q);
+        }
+
         if (!q->tx_waiting) {
             continue;
         }
 
         if (virtio_net_started(n, queue_status) && !n->vhost_started) {
-            if (q->tx_timer) {
+            if (virtio_net_tx_uses_timer(q)) {
                 qemu_mod_timer(q->tx_timer,
                                qemu_get_clock_ns(vm_clock) + n->tx_timeout);
             } else {
@@ -220,7 +423,8 @@ static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
         } else {
             if (q->tx_timer) {
                 qemu_del_timer(q->tx_timer);
-            } else {
+            }
+            if (q->tx_bh) {
                 qemu_bh_cancel(q->tx_bh);
             }
         }
@@ -358,6 +562,8 @@ static void virtio_net_set_queues(VirtIONet *n)
             assert(!peer_detach(n, i));
         }
     }
+
+    virtio_net_update_affinity(n);
 }
 
 static void virtio_net_set_multiqueue(VirtIONet *n, int multiqueue, int ctrl);
@@ -370,10 +576,13 @@ static uint32_t virtio_net_get_features(VirtIODevice *vdev, uint32_t features)
     features |= (1 << VIRTIO_NET_F_MAC);
 
     if (!peer_has_vnet_hdr(n)) {
-        features &= ~(0x1 << VIRTIO_NET_F_CSUM);
-        features &= ~(0x1 << VIRTIO_NET_F_HOST_TSO4);
-        features &= ~(0x1 << VIRTIO_NET_F_HOST_TSO6);
-        features &= ~(0x1 << VIRTIO_NET_F_HOST_ECN);
+        /* With sw_offload, virtio_net_tx_sw_offload() does the work */
+        if (!n->sw_offload) {
+            features &= ~(0x1 << VIRTIO_NET_F_CSUM);
+            features &= ~(0x1 << VIRTIO_NET_F_HOST_TSO4);
+            features &= ~(0x1 << VIRTIO_NET_F_HOST_TSO6);
+            features &= ~(0x1 << VIRTIO_NET_F_HOST_ECN);
+        }
 
         features &= ~(0x1 << VIRTIO_NET_F_GUEST_CSUM);
         features &= ~(0x1 << VIRTIO_NET_F_GUEST_TSO4);
@@ -386,13 +595,10 @@ static uint32_t virtio_net_get_features(VirtIODevice *vdev, uint32_t features)
         features &= ~(0x1 << VIRTIO_NET_F_HOST_UFO);
     }
 
-    if (!nc->peer || nc->peer->info->type != NET_CLIENT_OPTIONS_KIND_TAP) {
-        return features;
-    }
-    if (!tap_get_vhost_net(nc->peer)) {
+    if (!get_vhost_net(nc->peer)) {
         return features;
     }
-    return vhost_net_get_features(tap_get_vhost_net(nc->peer), features);
+    return vhost_net_get_features(get_vhost_net(nc->peer), features);
 }
 
 static uint32_t virtio_net_bad_features(VirtIODevice *vdev)
@@ -432,13 +638,10 @@ static void virtio_net_set_features(VirtIODevice *vdev, uint32_t features)
     for (i = 0;  i < n->max_queues; i++) {
         NetClientState *nc = qemu_get_subqueue(n->nic, i);
 
-        if (!nc->peer || nc->peer->info->type != NET_CLIENT_OPTIONS_KIND_TAP) {
-            continue;
-        }
-        if (!tap_get_vhost_net(nc->peer)) {
+        if (!get_vhost_net(nc->peer)) {
             continue;
         }
-        vhost_net_ack_features(tap_get_vhost_net(nc->peer), features);
+        vhost_net_ack_features(get_vhost_net(nc->peer), features);
     }
 }
 
@@ -681,21 +884,25 @@ static int virtio_net_can_receive(NetClientState *nc)
     return 1;
 }
 
+static bool rx_buffers_ready(VirtIONetQueue *q, size_t bufsize)
+{
+    if (!q->n->mergeable_rx_bufs) {
+        return q->rx_cache.count || !virtio_queue_empty(q->rx_vq);
+    }
+    return bufsize <= q->rx_cache.bytes ||
+        virtqueue_avail_bytes(q->rx_vq, bufsize - q->rx_cache.bytes, 0);
+}
+
 static int virtio_net_has_buffers(VirtIONetQueue *q, int bufsize)
 {
-    VirtIONet *n = q->n;
-    if (virtio_queue_empty(q->rx_vq) ||
-        (n->mergeable_rx_bufs &&
-         !virtqueue_avail_bytes(q->rx_vq, bufsize, 0))) {
+    if (!rx_buffers_ready(q, bufsize)) {
         virtio_queue_set_notification(q->rx_vq, 1);
 
         /* To avoid a race condition where the guest has made some buffers
          * available after the above check but before notification was
          * enabled, check for available buffers again.
          */
-        if (virtio_queue_empty(q->rx_vq) ||
-            (n->mergeable_rx_bufs &&
-             !virtqueue_avail_bytes(q->rx_vq, bufsize, 0))) {
+        if (!rx_buffers_ready(q, bufsize)) {
             return 0;
         }
     }
@@ -714,18 +921,23 @@ static int virtio_net_has_buffers(VirtIONetQueue *q, int bufsize)
  * checksums.  This is terrible but it's better than hacking the guest
  * kernels.
  *
- * N.B. if we introduce a zero-copy API, this operation is no longer free so
- * we should provide a mechanism to disable it to avoid polluting the host
- * cache.
+ * N.B. the zero-copy receive path checks the headers first and only copies
+ * the packets that need it, since this operation is no longer free there.
  */
-static void work_around_broken_dhclient(struct virtio_net_hdr *hdr,
-                                        uint8_t *buf, size_t size)
+static bool broken_dhclient_packet(const struct virtio_net_hdr *hdr,
+                                   const uint8_t *buf, size_t size)
 {
-    if ((hdr->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) && /* missing csum */
+    return (hdr->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) && /* missing csum */
         (size > 27 && size < 1500) && /* normal sized MTU */
         (buf[12] == 0x08 && buf[13] == 0x00) && /* ethertype == IPv4 */
         (buf[23] == 17) && /* ip.protocol == UDP */
-        (buf[34] == 0 && buf[35] == 67)) { /* udp.srcport == bootps */
+        (buf[34] == 0 && buf[35] == 67); /* udp.srcport == bootps */
+}
+
+static void work_around_broken_dhclient(struct virtio_net_hdr *hdr,
+                                        uint8_t *buf, size_t size)
+{
+    if (broken_dhclient_packet(hdr, buf, size)) {
         net_checksum_calculate(buf, size);
         hdr->flags &= ~VIRTIO_NET_HDR_F_NEEDS_CSUM;
     }
@@ -824,13 +1036,13 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
     offset = i = 0;
 
     while (offset < size) {
-        VirtQueueElement elem;
+        VirtQueueElement *elem;
         int len, total;
-        const struct iovec *sg = elem.in_sg;
+        const struct iovec *sg;
 
         total = 0;
 
-        if (virtqueue_pop(q->rx_vq, &elem) == 0) {
+        if (rx_cache_fill(q, 1) == 0) {
             if (i == 0)
                 return -1;
             error_report("virtio-net unexpected empty queue: "
@@ -840,22 +1052,19 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
                     n->guest_hdr_len, n->host_hdr_len, n->vdev.guest_features);
             exit(1);
         }
-
-        if (elem.in_num < 1) {
-            error_report("virtio-net receive queue contains no in buffers");
-            exit(1);
-        }
+        elem = rx_cache_elem(q, 0);
+        sg = elem->in_sg;
 
         if (i == 0) {
             assert(offset == 0);
             if (n->mergeable_rx_bufs) {
                 mhdr_cnt = iov_copy(mhdr_sg, ARRAY_SIZE(mhdr_sg),
-                                    sg, elem.in_num,
+                                    sg, elem->in_num,
                                     offsetof(typeof(mhdr), num_buffers),
                                     sizeof(mhdr.num_buffers));
             }
 
-            receive_header(n, sg, elem.in_num, buf, size);
+            receive_header(n, sg, elem->in_num, buf, size);
             offset = n->host_hdr_len;
             total += n->guest_hdr_len;
             guest_offset = n->guest_hdr_len;
@@ -864,13 +1073,13 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
         }
 
         /* copy in packet.  ugh */
-        len = iov_from_buf(sg, elem.in_num, guest_offset,
+        len = iov_from_buf(sg, elem->in_num, guest_offset,
                            buf + offset, size - offset);
         total += len;
         offset += len;
         /* If buffers can't be merged, at this point we
          * must have consumed the complete packet.
-         * Otherwise, drop it. */
+         * Otherwise, drop it; the buffer stays cached for the next one. */
         if (!n->mergeable_rx_bufs && offset < size) {
 #if 0
             error_report("virtio-net truncated non-mergeable packet: "
@@ -883,7 +1092,8 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
         }
 
         /* signal other side */
-        virtqueue_fill(q->rx_vq, &elem, total, i++);
+        rx_cache_use(q, total);
+        i++;
     }
 
     if (mhdr_cnt) {
@@ -893,12 +1103,164 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
                      &mhdr.num_buffers, sizeof mhdr.num_buffers);
     }
 
-    virtqueue_flush(q->rx_vq, i);
-    virtio_notify(&n->vdev, q->rx_vq);
+    if (!q->rx_batch) {
+        virtio_net_rx_flush(q);
+    }
+
+    return size;
+}
+
+/* The buffers returned are those of whole cached elements, after the part
+ * of the guest header the peer doesn't supply. */
+static int virtio_net_rx_map(NetClientState *nc, struct iovec *iov, int iovcnt)
+{
+    VirtIONet *n = qemu_get_nic_opaque(nc);
+    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+    size_t skip = n->guest_hdr_len - n->host_hdr_len;
+    unsigned int i, cached;
+    int cnt = 0;
+
+    /* A packet header read into place must be the guest's header */
+    if (n->host_hdr_len && n->host_hdr_len != n->guest_hdr_len) {
+        return 0;
+    }
+    if (!virtio_net_can_receive(nc) || !virtio_net_has_buffers(q, 1)) {
+        return 0;
+    }
+
+    cached = rx_cache_fill(q, n->mergeable_rx_bufs ? RX_CACHE_DEPTH : 1);
+    q->rx_cache.mapped = 0;
+    q->rx_cache.mapped_bytes = 0;
+    for (i = 0; i < cached; i++) {
+        VirtQueueElement *elem = rx_cache_elem(q, i);
+        size_t offset = i ? 0 : skip;
+
+        if (elem->in_num > iovcnt - cnt ||
+            iov_size(elem->in_sg, elem->in_num) <= offset) {
+            break;
+        }
+        cnt += iov_copy(iov + cnt, iovcnt - cnt, elem->in_sg, elem->in_num,
+                        offset, -1);
+        q->rx_cache.mapped++;
+        q->rx_cache.mapped_bytes += iov_size(elem->in_sg, elem->in_num) -
+                                    offset;
+    }
+    return cnt;
+}
+
+/* Copy @size bytes from @offset in @iov to the guest buffer @elem */
+static size_t rx_copy_iov(VirtQueueElement *elem, const struct iovec *iov,
+                          int iovcnt, size_t offset, size_t size)
+{
+    size_t done = 0;
+    int i;
+
+    for (i = 0; i < iovcnt && done < size; i++) {
+        if (offset >= iov[i].iov_len) {
+            offset -= iov[i].iov_len;
+            continue;
+        }
+        done += iov_from_buf(elem->in_sg, elem->in_num, done,
+                             (uint8_t *)iov[i].iov_base + offset,
+                             MIN(iov[i].iov_len - offset, size - done));
+        offset = 0;
+    }
+    return done;
+}
+
+static ssize_t virtio_net_rx_commit(NetClientState *nc,
+                                    const struct iovec *iov, int iovcnt,
+                                    size_t size)
+{
+    VirtIONet *n = qemu_get_nic_opaque(nc);
+    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+    size_t skip = n->guest_hdr_len - n->host_hdr_len;
+    struct iovec mhdr_sg[VIRTQUEUE_MAX_SIZE];
+    struct virtio_net_hdr_mrg_rxbuf mhdr;
+    unsigned mhdr_cnt = 0;
+    /* the headers receive_filter() and the dhclient check look at */
+    uint8_t head[sizeof(struct virtio_net_hdr_mrg_rxbuf) + 36] = { 0 };
+    VirtQueueElement *elem = rx_cache_elem(q, 0);
+    size_t total, i;
+
+    iov_to_buf(iov, iovcnt, 0, head, MIN(size, n->host_hdr_len + 36));
+    if (!receive_filter(n, head, size)) {
+        return size;
+    }
+
+    if (size > q->rx_cache.mapped_bytes) {
+        /* The rest of the packet was read into the peer's own buffer */
+        if (!n->mergeable_rx_bufs) {
+            return size;
+        }
+        if (!virtio_net_has_buffers(q, size + skip)) {
+            return 0;
+        }
+    }
+
+    if (n->has_vnet_hdr &&
+        broken_dhclient_packet((struct virtio_net_hdr *)head,
+                               head + n->host_hdr_len,
+                               size - n->host_hdr_len)) {
+        uint8_t buf[sizeof(struct virtio_net_hdr_mrg_rxbuf) + 1500];
+
+        iov_to_buf(iov, iovcnt, 0, buf, size);
+        work_around_broken_dhclient((struct virtio_net_hdr *)buf,
+                                    buf + n->host_hdr_len,
+                                    size - n->host_hdr_len);
+        iov_from_buf(iov, iovcnt, 0, buf, size);
+    } else if (!n->has_vnet_hdr) {
+        receive_header(n, elem->in_sg, elem->in_num, NULL, 0);
+    }
+
+    if (n->mergeable_rx_bufs) {
+        mhdr_cnt = iov_copy(mhdr_sg, ARRAY_SIZE(mhdr_sg),
+                            elem->in_sg, elem->in_num,
+                            offsetof(typeof(mhdr), num_buffers),
+                            sizeof(mhdr.num_buffers));
+    }
+
+    /* What the guest gets, its header included */
+    total = size + skip;
+    for (i = 0; total; i++) {
+        size_t len;
+
+        if (i < q->rx_cache.mapped) {
+            elem = rx_cache_elem(q, 0);
+            len = MIN(total, iov_size(elem->in_sg, elem->in_num));
+        } else {
+            rx_cache_fill(q, 1);
+            elem = rx_cache_elem(q, 0);
+            len = rx_copy_iov(elem, iov, iovcnt, size - total, total);
+        }
+        rx_cache_use(q, len);
+        total -= len;
+    }
+    q->rx_cache.mapped = 0;
+
+    if (mhdr_cnt) {
+        stw_p(&mhdr.num_buffers, i);
+        iov_from_buf(mhdr_sg, mhdr_cnt, 0,
+                     &mhdr.num_buffers, sizeof mhdr.num_buffers);
+    }
+
+    if (!q->rx_batch) {
+        virtio_net_rx_flush(q);
+    }
 
     return size;
 }
 
+static void virtio_net_receive_batch(NetClientState *nc, bool start)
+{
+    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+
+    q->rx_batch = start;
+    if (!start) {
+        virtio_net_rx_flush(q);
+    }
+}
+
 static int32_t virtio_net_flush_tx(VirtIONetQueue *q);
 
 static void virtio_net_tx_complete(NetClientState *nc, ssize_t len)
@@ -906,20 +1268,87 @@ static void virtio_net_tx_complete(NetClientState *nc, ssize_t len)
     VirtIONet *n = qemu_get_nic_opaque(nc);
     VirtIONetQueue *q = virtio_net_get_subqueue(nc);
 
-    virtqueue_push(q->tx_vq, &q->async_tx.elem, 0);
+    /* The peer completes (or purges) our packets in the order queued */
+    assert(q->async_tx.count > 0);
+    virtqueue_push(q->tx_vq, &q->async_tx.elems[q->async_tx.head], 0);
     virtio_notify(&n->vdev, q->tx_vq);
 
-    q->async_tx.elem.out_num = q->async_tx.len = 0;
+    q->async_tx.head = (q->async_tx.head + 1) % TX_QUEUE_DEPTH;
+    q->async_tx.count--;
+
+    /* Resume once the backlog has drained, so that new packets do not
+     * overtake the ones still queued */
+    if (q->async_tx.count || !q->async_tx.blocked) {
+        return;
+    }
+    q->async_tx.blocked = false;
 
     virtio_queue_set_notification(q->tx_vq, 1);
+    if (!n->vdev.vm_running) {
+        /* Purged on stop; virtio_net_set_status() resumes us later */
+        q->tx_waiting = 1;
+        return;
+    }
     virtio_net_flush_tx(q);
 }
 
+static void virtio_net_tx_segment(void *opaque, const uint8_t *buf, int size)
+{
+    qemu_send_packet(opaque, buf, size);
+}
+
+/* The peer takes no vnet_hdr: do the checksumming and segmentation the
+ * guest left to the device, and send the result as copies.  Returns false
+ * if the packet of @sg needs none of that.
+ */
+static bool virtio_net_tx_sw_offload(VirtIONetQueue *q,
+                                     const struct iovec *sg, unsigned int num)
+{
+    VirtIONet *n = q->n;
+    int queue_index = vq2q(virtio_get_queue_index(q->tx_vq));
+    NetClientState *nc = qemu_get_subqueue(n->nic, queue_index);
+    struct virtio_net_hdr hdr;
+    size_t size;
+    int gso;
+
+    if (iov_to_buf(sg, num, 0, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+        return false;
+    }
+    gso = hdr.gso_type & ~VIRTIO_NET_HDR_GSO_ECN;
+    if (!(hdr.flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) &&
+        gso == VIRTIO_NET_HDR_GSO_NONE) {
+        return false;
+    }
+
+    size = iov_size(sg, num) - n->guest_hdr_len;
+    if (size > VIRTIO_NET_MAX_BUFSIZE) {
+        /* Not a frame any guest driver builds, drop it */
+        return true;
+    }
+    if (!n->sw_offload_buf) {
+        n->sw_offload_buf = g_malloc(VIRTIO_NET_MAX_BUFSIZE);
+    }
+    iov_to_buf(sg, num, n->guest_hdr_len, n->sw_offload_buf, size);
+
+    if ((gso == VIRTIO_NET_HDR_GSO_TCPV4 || gso == VIRTIO_NET_HDR_GSO_TCPV6) &&
+        net_tso_segment(n->sw_offload_buf, size, hdr.gso_size,
+                        virtio_net_tx_segment, nc) >= 0) {
+        return true;
+    }
+
+    if (hdr.flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) {
+        net_checksum_complete(n->sw_offload_buf, size,
+                              hdr.csum_start, hdr.csum_offset);
+    }
+    qemu_send_packet(nc, n->sw_offload_buf, size);
+    return true;
+}
+
 /* TX */
 static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
 {
     VirtIONet *n = q->n;
-    VirtQueueElement elem;
+    VirtQueueElement *elem;
     int32_t num_packets = 0;
     int queue_index = vq2q(virtio_get_queue_index(q->tx_vq));
     if (!(n->vdev.status & VIRTIO_CONFIG_S_DRIVER_OK)) {
@@ -928,22 +1357,47 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
 
     assert(n->vdev.vm_running);
 
-    if (q->async_tx.elem.out_num) {
+    if (q->async_tx.blocked) {
         virtio_queue_set_notification(q->tx_vq, 0);
         return num_packets;
     }
 
-    while (virtqueue_pop(q->tx_vq, &elem)) {
+    if (!q->async_tx.elems) {
+        q->async_tx.elems = g_new(VirtQueueElement, TX_QUEUE_DEPTH);
+    }
+
+    /* Pop straight into the next free slot, so that a packet the peer
+     * queues can be held without copying the element */
+    for (;;) {
         ssize_t ret, len;
-        unsigned int out_num = elem.out_num;
-        struct iovec *out_sg = &elem.out_sg[0];
+        unsigned int out_num;
+        struct iovec *out_sg;
         struct iovec sg[VIRTQUEUE_MAX_SIZE];
 
+        elem = &q->async_tx.elems[(q->async_tx.head + q->async_tx.count) %
+                                  TX_QUEUE_DEPTH];
+        if (!virtqueue_pop(q->tx_vq, elem)) {
+            break;
+        }
+        out_num = elem->out_num;
+        out_sg = &elem->out_sg[0];
+
         if (out_num < 1) {
             error_report("virtio-net header not in first element");
             exit(1);
         }
 
+        if (n->sw_offload && !n->has_vnet_hdr &&
+            virtio_net_tx_sw_offload(q, out_sg, out_num)) {
+            virtqueue_push(q->tx_vq, elem, 0);
+            virtio_notify(&n->vdev, q->tx_vq);
+
+            if (++num_packets >= n->tx_burst) {
+                break;
+            }
+            continue;
+        }
+
         /*
          * If host wants to see the guest header as is, we can
          * pass it on unchanged. Otherwise, copy just the parts
@@ -966,15 +1420,21 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
         ret = qemu_sendv_packet_async(qemu_get_subqueue(n->nic, queue_index),
                                       out_sg, out_num, virtio_net_tx_complete);
         if (ret == 0) {
-            virtio_queue_set_notification(q->tx_vq, 0);
-            q->async_tx.elem = elem;
-            q->async_tx.len  = len;
-            return -EBUSY;
+            /* Queued by reference, virtio_net_tx_complete() pushes it */
+            if (++q->async_tx.count == TX_QUEUE_DEPTH) {
+                virtio_queue_set_notification(q->tx_vq, 0);
+                q->async_tx.blocked = true;
+                return -EBUSY;
+            }
+            if (++num_packets >= n->tx_burst) {
+                break;
+            }
+            continue;
         }
 
         len += ret;
 
-        virtqueue_push(q->tx_vq, &elem, 0);
+        virtqueue_push(q->tx_vq, elem, 0);
         virtio_notify(&n->vdev, q->tx_vq);
 
         if (++num_packets >= n->tx_burst) {
@@ -984,6 +1444,61 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
     return num_packets;
 }
 
+/* Account a flush of @q that returned @ret and, in adaptive mode, decide
+ * how the next kick is handled.  Once per TX_ADAPTIVE_WINDOW the packet
+ * rate is measured: above TX_ADAPTIVE_RATE waiting tx_timeout for more
+ * packets saves guest exits, below half of it (or when the timer flushes
+ * hardly ever find more than one packet) the added latency buys nothing.
+ *
+ * Returns true if the queue switched mode.
+ */
+static bool virtio_net_tx_adapt(VirtIONetQueue *q, int32_t ret)
+{
+    VirtIONet *n = q->n;
+    int64_t now, elapsed;
+    bool batching;
+
+    if (ret < 0) {
+        return false;
+    }
+
+    q->tx_stats.packets += ret;
+    q->tx_stats.flushes++;
+    q->tx_stats.last_batch = ret;
+    q->tx_stats.max_batch = MAX(q->tx_stats.max_batch, ret);
+    q->tx_stats.window_packets += ret;
+    q->tx_stats.window_flushes++;
+
+    now = qemu_get_clock_ns(vm_clock);
+    elapsed = now - q->tx_stats.window_start;
+    if (elapsed < TX_ADAPTIVE_WINDOW) {
+        return false;
+    }
+
+    q->tx_stats.rate = q->tx_stats.window_packets * get_ticks_per_sec() /
+                       elapsed;
+    batching = q->tx_batching;
+    if (n->tx_mode == VIRTIO_NET_TX_ADAPTIVE) {
+        if (!batching) {
+            batching = q->tx_stats.rate >= TX_ADAPTIVE_RATE;
+        } else {
+            batching = q->tx_stats.rate >= TX_ADAPTIVE_RATE / 2 &&
+                       q->tx_stats.window_packets >=
+                       2 * q->tx_stats.window_flushes;
+        }
+    }
+    q->tx_stats.window_start = now;
+    q->tx_stats.window_packets = 0;
+    q->tx_stats.window_flushes = 0;
+
+    if (batching == q->tx_batching) {
+        return false;
+    }
+    q->tx_batching = batching;
+    q->tx_stats.switches++;
+    return true;
+}
+
 static void virtio_net_handle_tx_timer(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIONet *n = to_virtio_net(vdev);
@@ -999,7 +1514,7 @@ static void virtio_net_handle_tx_timer(VirtIODevice *vdev, VirtQueue *vq)
         virtio_queue_set_notification(vq, 1);
         qemu_del_timer(q->tx_timer);
         q->tx_waiting = 0;
-        virtio_net_flush_tx(q);
+        virtio_net_tx_adapt(q, virtio_net_flush_tx(q));
     } else {
         qemu_mod_timer(q->tx_timer,
                        qemu_get_clock_ns(vm_clock) + n->tx_timeout);
@@ -1025,10 +1540,24 @@ static void virtio_net_handle_tx_bh(VirtIODevice *vdev, VirtQueue *vq)
     qemu_bh_schedule(q->tx_bh);
 }
 
+static void virtio_net_handle_tx_adaptive(VirtIODevice *vdev, VirtQueue *vq)
+{
+    VirtIONet *n = to_virtio_net(vdev);
+    VirtIONetQueue *q = &n->vqs[vq2q(virtio_get_queue_index(vq))];
+
+    if (q->tx_batching) {
+        virtio_net_handle_tx_timer(vdev, vq);
+    } else {
+        virtio_net_handle_tx_bh(vdev, vq);
+    }
+}
+
 static void virtio_net_tx_timer(void *opaque)
 {
     VirtIONetQueue *q = opaque;
     VirtIONet *n = q->n;
+    int32_t ret;
+
     assert(n->vdev.vm_running);
 
     q->tx_waiting = 0;
@@ -1038,7 +1567,14 @@ static void virtio_net_tx_timer(void *opaque)
         return;
 
     virtio_queue_set_notification(q->tx_vq, 1);
-    virtio_net_flush_tx(q);
+    ret = virtio_net_flush_tx(q);
+    if (virtio_net_tx_adapt(q, ret) && ret >= n->tx_burst) {
+        /* Back to immediate mode, but don't wait for a kick to drain
+         * what is left in the ring */
+        virtio_queue_set_notification(q->tx_vq, 0);
+        qemu_bh_schedule(q->tx_bh);
+        q->tx_waiting = 1;
+    }
 }
 
 static void virtio_net_tx_bh(void *opaque)
@@ -1060,6 +1596,15 @@ static void virtio_net_tx_bh(void *opaque)
         return; /* Notification re-enable handled by tx_complete */
     }
 
+    /* Switched to batching: leave notification off and let the timer
+     * pick up whatever the guest queues in the meantime */
+    if (virtio_net_tx_adapt(q, ret)) {
+        qemu_mod_timer(q->tx_timer,
+                       qemu_get_clock_ns(vm_clock) + n->tx_timeout);
+        q->tx_waiting = 1;
+        return;
+    }
+
     /* If we flush a full burst of packets, assume there are
      * more coming and immediately reschedule */
     if (ret >= n->tx_burst) {
@@ -1079,6 +1624,141 @@ static void virtio_net_tx_bh(void *opaque)
     }
 }
 
+static void virtio_net_add_tx_queue(VirtIONet *n, VirtIONetQueue *q)
+{
+    switch (n->tx_mode) {
+    case VIRTIO_NET_TX_TIMER:
+        q->tx_vq = virtio_add_queue(&n->vdev, 256, virtio_net_handle_tx_timer);
+        break;
+    case VIRTIO_NET_TX_ADAPTIVE:
+        q->tx_vq = virtio_add_queue(&n->vdev, 256,
+                                    virtio_net_handle_tx_adaptive);
+        break;
+    default:
+        q->tx_vq = virtio_add_queue(&n->vdev, 256, virtio_net_handle_tx_bh);
+        break;
+    }
+
+    /* The timer and bh outlive the virtqueue, which is deleted and added
+     * again whenever the guest toggles multiqueue */
+    if (n->tx_mode != VIRTIO_NET_TX_BH && !q->tx_timer) {
+        q->tx_timer = qemu_new_timer_ns(vm_clock, virtio_net_tx_timer, q);
+    }
+    if (n->tx_mode != VIRTIO_NET_TX_TIMER && !q->tx_bh) {
+        q->tx_bh = qemu_bh_new(virtio_net_tx_bh, q);
+    }
+    q->tx_batching = false;
+    q->tx_stats.window_start = qemu_get_clock_ns(vm_clock);
+}
+
+static const char *virtio_net_tx_mode_names[] = {
+    [VIRTIO_NET_TX_BH] = "bh",
+    [VIRTIO_NET_TX_TIMER] = "timer",
+    [VIRTIO_NET_TX_ADAPTIVE] = "adaptive",
+};
+
+static void virtio_net_get_tx_stats(Object *obj, Visitor *v, void *opaque,
+                                    const char *name, Error **errp)
+{
+    VirtIONet *n = opaque;
+    char *mode = (char *)virtio_net_tx_mode_names[n->tx_mode];
+    int64_t burst = n->tx_burst;
+    int i, queues = n->multiqueue ? n->max_queues : 1;
+
+    visit_start_struct(v, NULL, "tx-stats", name, 0, errp);
+    visit_type_str(v, &mode, "tx", errp);
+    visit_type_int(v, &burst, "tx-burst", errp);
+
+    visit_start_list(v, "queues", errp);
+    for (i = 0; i < queues; i++) {
+        VirtIONetQueue *q = &n->vqs[i];
+        char *current = virtio_net_tx_uses_timer(q) ? (char *)"timer" :
+                                                      (char *)"bh";
+        int64_t index = i, queued;
+
+        visit_start_struct(v, NULL, NULL, NULL, 0, errp);
+        visit_type_int(v, &index, "queue", errp);
+        visit_type_str(v, &current, "mode", errp);
+        visit_type_int(v, &q->tx_stats.rate, "rate", errp);
+        visit_type_int(v, &q->tx_stats.packets, "packets", errp);
+        visit_type_int(v, &q->tx_stats.flushes, "flushes", errp);
+        visit_type_int(v, &q->tx_stats.last_batch, "last-batch", errp);
+        visit_type_int(v, &q->tx_stats.max_batch, "max-batch", errp);
+        visit_type_int(v, &q->tx_stats.switches, "switches", errp);
+        queued = q->async_tx.count;
+        visit_type_int(v, &queued, "queued", errp);
+        visit_end_struct(v, errp);
+    }
+    visit_end_list(v, errp);
+
+    visit_end_struct(v, errp);
+}
+
+static void virtio_net_get_queue_affinity(Object *obj, Visitor *v,
+                                          void *opaque, const char *name,
+                                          Error **errp)
+{
+    VirtIONet *n = opaque;
+    char *mode = !n->affinity ? (char *)"off" :
+                 n->num_host_cpus ? (char *)"list" : (char *)"auto";
+    int i, queues = n->multiqueue ? n->max_queues : 1;
+
+    visit_start_struct(v, NULL, "queue-affinity", name, 0, errp);
+    visit_type_str(v, &mode, "vhost-cpus", errp);
+
+    visit_start_list(v, "queues", errp);
+    for (i = 0; i < queues; i++) {
+        VirtIONetQueue *q = &n->vqs[i];
+        VHostNetState *net = get_vhost_net(qemu_get_subqueue(n->nic, i)->peer);
+        int64_t index = i;
+        int64_t rx_vector = virtio_queue_vector(&n->vdev, i * 2);
+        int64_t tx_vector = virtio_queue_vector(&n->vdev, i * 2 + 1);
+        int64_t guest_cpu = q->guest_cpu, host_cpu = q->host_cpu;
+        int64_t worker = net ? vhost_net_get_worker(net) : 0;
+
+        visit_start_struct(v, NULL, NULL, NULL, 0, errp);
+        visit_type_int(v, &index, "queue", errp);
+        visit_type_int(v, &rx_vector, "rx-vector", errp);
+        visit_type_int(v, &tx_vector, "tx-vector", errp);
+        visit_type_int(v, &guest_cpu, "guest-cpu", errp);
+        visit_type_int(v, &host_cpu, "host-cpu", errp);
+        visit_type_int(v, &worker, "vhost-worker", errp);
+        visit_end_struct(v, errp);
+    }
+    visit_end_list(v, errp);
+
+    visit_end_struct(v, errp);
+}
+
+/* Parse the comma-separated host CPU list of the vhost-cpus property */
+static bool virtio_net_parse_cpus(VirtIONet *n, const char *str)
+{
+    int cpus[MAX_QUEUE_NUM];
+    const char *p = str;
+    char *end;
+    long cpu;
+    int num_cpus = 0;
+
+    while (*p) {
+        if (num_cpus == ARRAY_SIZE(cpus) || !qemu_isdigit(*p)) {
+            return false;
+        }
+        cpu = strtol(p, &end, 10);
+        if (cpu > INT_MAX || (*end && *end != ',')) {
+            return false;
+        }
+        cpus[num_cpus++] = cpu;
+        p = *end ? end + 1 : end;
+    }
+    if (!num_cpus) {
+        return false;
+    }
+
+    n->host_cpus = g_memdup(cpus, num_cpus * sizeof(cpus[0]));
+    n->num_host_cpus = num_cpus;
+    return true;
+}
+
 static void virtio_net_set_multiqueue(VirtIONet *n, int multiqueue, int ctrl)
 {
     VirtIODevice *vdev = &n->vdev;
@@ -1092,20 +1772,9 @@ static void virtio_net_set_multiqueue(VirtIONet *n, int multiqueue, int ctrl)
 
     for (i = 1; i < max; i++) {
         n->vqs[i].rx_vq = virtio_add_queue(vdev, 256, virtio_net_handle_rx);
-        if (n->vqs[i].tx_timer) {
-            n->vqs[i].tx_vq =
-                virtio_add_queue(vdev, 256, virtio_net_handle_tx_timer);
-            n->vqs[i].tx_timer = qemu_new_timer_ns(vm_clock,
-                                                   virtio_net_tx_timer,
-                                                   &n->vqs[i]);
-        } else {
-            n->vqs[i].tx_vq =
-                virtio_add_queue(vdev, 256, virtio_net_handle_tx_bh);
-            n->vqs[i].tx_bh = qemu_bh_new(virtio_net_tx_bh, &n->vqs[i]);
-        }
-
-        n->vqs[i].tx_waiting = 0;
         n->vqs[i].n = n;
+        virtio_net_add_tx_queue(n, &n->vqs[i]);
+        n->vqs[i].tx_waiting = 0;
     }
 
     if (ctrl) {
@@ -1281,6 +1950,9 @@ static NetClientInfo net_virtio_info = {
     .receive = virtio_net_receive,
         .cleanup = virtio_net_cleanup,
     .link_status_changed = virtio_net_set_link_status,
+    .receive_batch = virtio_net_receive_batch,
+    .rx_map = virtio_net_rx_map,
+    .rx_commit = virtio_net_rx_commit,
 };
 
 static bool virtio_net_guest_notifier_pending(VirtIODevice *vdev, int idx)
@@ -1288,7 +1960,7 @@ static bool virtio_net_guest_notifier_pending(VirtIODevice *vdev, int idx)
     VirtIONet *n = to_virtio_net(vdev);
     NetClientState *nc = qemu_get_subqueue(n->nic, vq2q(idx));
     assert(n->vhost_started);
-    return vhost_net_virtqueue_pending(tap_get_vhost_net(nc->peer), idx);
+    return vhost_net_virtqueue_pending(get_vhost_net(nc->peer), idx);
 }
 
 static void virtio_net_guest_notifier_mask(VirtIODevice *vdev, int idx,
@@ -1297,7 +1969,7 @@ static void virtio_net_guest_notifier_mask(VirtIODevice *vdev, int idx,
     VirtIONet *n = to_virtio_net(vdev);
     NetClientState *nc = qemu_get_subqueue(n->nic, vq2q(idx));
     assert(n->vhost_started);
-    vhost_net_virtqueue_mask(tap_get_vhost_net(nc->peer),
+    vhost_net_virtqueue_mask(get_vhost_net(nc->peer),
                              vdev, idx, mask);
 }
 
@@ -1332,23 +2004,37 @@ VirtIODevice *virtio_net_init(DeviceState *dev, NICConf *conf,
     n->vqs[0].n = n;
     n->tx_timeout = net->txtimer;
 
-    if (net->tx && strcmp(net->tx, "timer") && strcmp(net->tx, "bh")) {
-        error_report("virtio-net: "
-                     "Unknown option tx=%s, valid options: \"timer\" \"bh\"",
-                     net->tx);
-        error_report("Defaulting to \"bh\"");
-    }
-
     if (net->tx && !strcmp(net->tx, "timer")) {
-        n->vqs[0].tx_vq = virtio_add_queue(&n->vdev, 256,
-                                           virtio_net_handle_tx_timer);
-        n->vqs[0].tx_timer = qemu_new_timer_ns(vm_clock, virtio_net_tx_timer,
-                                               &n->vqs[0]);
+        n->tx_mode = VIRTIO_NET_TX_TIMER;
+    } else if (net->tx && !strcmp(net->tx, "adaptive")) {
+        n->tx_mode = VIRTIO_NET_TX_ADAPTIVE;
     } else {
-        n->vqs[0].tx_vq = virtio_add_queue(&n->vdev, 256,
-                                           virtio_net_handle_tx_bh);
-        n->vqs[0].tx_bh = qemu_bh_new(virtio_net_tx_bh, &n->vqs[0]);
+        if (net->tx && strcmp(net->tx, "bh")) {
+            error_report("virtio-net: Unknown option tx=%s, valid options: "
+                         "\"timer\" \"bh\" \"adaptive\"", net->tx);
+            error_report("Defaulting to \"bh\"");
+        }
+        n->tx_mode = VIRTIO_NET_TX_BH;
     }
+    n->tx_burst = net->txburst;
+    n->sw_offload = net->sw_offload;
+
+    for (i = 0; i < MAX_QUEUE_NUM; i++) {
+        n->vqs[i].guest_cpu = -1;
+        n->vqs[i].host_cpu = -1;
+    }
+    if (net->vhost_cpus && strcmp(net->vhost_cpus, "off")) {
+        n->affinity = true;
+        if (strcmp(net->vhost_cpus, "auto") &&
+            !virtio_net_parse_cpus(n, net->vhost_cpus)) {
+            error_report("virtio-net: Invalid vhost-cpus=%s, expected "
+                         "\"off\", \"auto\" or a list of host CPUs",
+                         net->vhost_cpus);
+            error_report("Defaulting to \"auto\"");
+        }
+    }
+
+    virtio_net_add_tx_queue(n, &n->vqs[0]);
     n->ctrl_vq = virtio_add_queue(&n->vdev, 64, virtio_net_handle_ctrl);
     qemu_macaddr_default_if_unset(&conf->macaddr);
     memcpy(&n->mac[0], &conf->macaddr, sizeof(n->mac));
@@ -1368,7 +2054,6 @@ VirtIODevice *virtio_net_init(DeviceState *dev, NICConf *conf,
     qemu_format_nic_info_str(qemu_get_queue(n->nic), conf->macaddr.a);
 
     n->vqs[0].tx_waiting = 0;
-    n->tx_burst = net->txburst;
     virtio_net_set_mrg_rx_bufs(n, 0);
     n->promisc = 1; /* for compatibility */
 
@@ -1380,6 +2065,11 @@ VirtIODevice *virtio_net_init(DeviceState *dev, NICConf *conf,
     register_savevm(dev, "virtio-net", -1, VIRTIO_NET_VM_VERSION,
                     virtio_net_save, virtio_net_load, n);
 
+    object_property_add(OBJECT(dev), "tx-stats", "TX statistics",
+                        virtio_net_get_tx_stats, NULL, NULL, n, NULL);
+    object_property_add(OBJECT(dev), "queue-affinity", "queue placement",
+                        virtio_net_get_queue_affinity, NULL, NULL, n, NULL);
+
     add_boot_device_path(conf->bootindex, dev, "/ethernet-phy@0");
 
     return &n->vdev;
@@ -1397,6 +2087,8 @@ void virtio_net_exit(VirtIODevice *vdev)
 
     g_free(n->mac_table.macs);
     g_free(n->vlans);
+    g_free(n->sw_offload_buf);
+    g_free(n->host_cpus);
 
     for (i = 0; i < n->max_queues; i++) {
         VirtIONetQueue *q = &n->vqs[i];
@@ -1407,9 +2099,12 @@ void virtio_net_exit(VirtIODevice *vdev)
         if (q->tx_timer) {
             qemu_del_timer(q->tx_timer);
             qemu_free_timer(q->tx_timer);
-        } else {
+        }
+        if (q->tx_bh) {
             qemu_bh_delete(q->tx_bh);
         }
+        g_free(q->async_tx.elems);
+        g_free(q->rx_cache.elems);
     }
 
     qemu_del_nic(n->nic);
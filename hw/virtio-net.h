@@ -59,11 +59,26 @@
  * and latency. */
 #define TX_BURST 256
 
+/* How many packets of a TX queue the backend may hold by reference when
+ * it cannot keep up; the guest's buffers are not copied meanwhile. */
+#define TX_QUEUE_DEPTH 16
+
+/* How many guest RX buffers a queue pops ahead of time, so that a backend
+ * can read the next packets straight into them. */
+#define RX_CACHE_DEPTH 16
+
+/* tx=adaptive measures each queue's packet rate over this period and
+ * batches with the TX timer above TX_ADAPTIVE_RATE packets per second */
+#define TX_ADAPTIVE_WINDOW 10000000 /* 10 ms */
+#define TX_ADAPTIVE_RATE 20000
+
 typedef struct virtio_net_conf
 {
     uint32_t txtimer;
     int32_t txburst;
     char *tx;
+    char *vhost_cpus;       /* "auto" or host CPUs for the vhost workers */
+    uint32_t sw_offload;    /* offer TX offloads to the guest without vnet_hdr */
 } virtio_net_conf;
 
 /* Maximum packet size we can receive from tap device: header + 64k */
@@ -16,29 +16,16 @@
 #include "virtio-scsi.h"
 #include <hw/scsi.h>
 #include <hw/scsi-defs.h>
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+#include "hw/dataplane/virtio-scsi.h"
+#endif
 
-#define VIRTIO_SCSI_VQ_SIZE     128
 #define VIRTIO_SCSI_CDB_SIZE    32
 #define VIRTIO_SCSI_SENSE_SIZE  96
 #define VIRTIO_SCSI_MAX_CHANNEL 0
 #define VIRTIO_SCSI_MAX_TARGET  255
 #define VIRTIO_SCSI_MAX_LUN     16383
 
-/* Response codes */
-#define VIRTIO_SCSI_S_OK                       0
-#define VIRTIO_SCSI_S_OVERRUN                  1
-#define VIRTIO_SCSI_S_ABORTED                  2
-#define VIRTIO_SCSI_S_BAD_TARGET               3
-#define VIRTIO_SCSI_S_RESET                    4
-#define VIRTIO_SCSI_S_BUSY                     5
-#define VIRTIO_SCSI_S_TRANSPORT_FAILURE        6
-#define VIRTIO_SCSI_S_TARGET_FAILURE           7
-#define VIRTIO_SCSI_S_NEXUS_FAILURE            8
-#define VIRTIO_SCSI_S_FAILURE                  9
-#define VIRTIO_SCSI_S_FUNCTION_SUCCEEDED       10
-#define VIRTIO_SCSI_S_FUNCTION_REJECTED        11
-#define VIRTIO_SCSI_S_INCORRECT_LUN            12
-
 /* Controlq type codes.  */
 #define VIRTIO_SCSI_T_TMF                      0
 #define VIRTIO_SCSI_T_AN_QUERY                 1
@@ -66,26 +53,6 @@
 #define VIRTIO_SCSI_EVT_RESET_RESCAN           1
 #define VIRTIO_SCSI_EVT_RESET_REMOVED          2
 
-/* SCSI command request, followed by data-out */
-typedef struct {
-    uint8_t lun[8];              /* Logical Unit Number */
-    uint64_t tag;                /* Command identifier */
-    uint8_t task_attr;           /* Task attribute */
-    uint8_t prio;
-    uint8_t crn;
-    uint8_t cdb[];
-} QEMU_PACKED VirtIOSCSICmdReq;
-
-/* Response, followed by sense data and data-in */
-typedef struct {
-    uint32_t sense_len;          /* Sense data length */
-    uint32_t resid;              /* Residual bytes in data buffer */
-    uint16_t status_qualifier;   /* Status qualifier */
-    uint8_t status;              /* Command completion status */
-    uint8_t response;            /* Response values */
-    uint8_t sense[];
-} QEMU_PACKED VirtIOSCSICmdResp;
-
 /* Task Management Request */
 typedef struct {
     uint32_t type;
@@ -139,6 +106,9 @@ typedef struct {
     uint32_t cdb_size;
     int resetting;
     bool events_dropped;
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    VirtIOSCSIDataPlane *dataplane;
+#endif
     VirtQueue *ctrl_vq;
     VirtQueue *event_vq;
     VirtQueue *cmd_vqs[0];
@@ -150,6 +120,7 @@ typedef struct VirtIOSCSIReq {
     VirtQueueElement elem;
     QEMUSGList qsgl;
     SCSIRequest *sreq;
+    bool dataplane;                 /* elem was popped by the data plane */
     union {
         char                  *buf;
         VirtIOSCSICmdReq      *cmd;
@@ -165,11 +136,6 @@ typedef struct VirtIOSCSIReq {
     } resp;
 } VirtIOSCSIReq;
 
-static inline int virtio_scsi_get_lun(uint8_t *lun)
-{
-    return ((lun[2] << 8) | lun[3]) & 0x3FFF;
-}
-
 static inline SCSIDevice *virtio_scsi_device_find(VirtIOSCSI *s, uint8_t *lun)
 {
     if (lun[0] != 1) {
@@ -185,14 +151,28 @@ static void virtio_scsi_complete_req(VirtIOSCSIReq *req)
 {
     VirtIOSCSI *s = req->dev;
     VirtQueue *vq = req->vq;
-    virtqueue_push(vq, &req->elem, req->qsgl.size + req->elem.in_sg[0].iov_len);
+    unsigned int len = req->qsgl.size + req->elem.in_sg[0].iov_len;
+    bool dataplane = req->dataplane;
+
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    if (dataplane) {
+        virtio_scsi_data_plane_complete(s->dataplane,
+                                        virtio_queue_get_id(vq) - 2,
+                                        req->elem.index, len);
+    }
+#endif
+    if (!dataplane) {
+        virtqueue_push(vq, &req->elem, len);
+    }
     qemu_sglist_destroy(&req->qsgl);
     if (req->sreq) {
         req->sreq->hba_private = NULL;
         scsi_req_unref(req->sreq);
     }
     g_free(req);
-    virtio_notify(&s->vdev, vq);
+    if (!dataplane) {
+        virtio_notify(&s->vdev, vq);
+    }
 }
 
 static void virtio_scsi_bad_req(void)
@@ -217,6 +197,7 @@ static void virtio_scsi_parse_req(VirtIOSCSI *s, VirtQueue *vq,
     req->vq = vq;
     req->dev = s;
     req->sreq = NULL;
+    req->dataplane = false;
     if (req->elem.out_num) {
         req->req.buf = req->elem.out_sg[0].iov_base;
     }
@@ -467,60 +448,89 @@ static void virtio_scsi_fail_cmd_req(VirtIOSCSIReq *req)
     virtio_scsi_complete_req(req);
 }
 
-static void virtio_scsi_handle_cmd(VirtIODevice *vdev, VirtQueue *vq)
+static void virtio_scsi_handle_cmd_req(VirtIOSCSI *s, VirtIOSCSIReq *req)
 {
-    VirtIOSCSI *s = (VirtIOSCSI *)vdev;
-    VirtIOSCSIReq *req;
+    SCSIDevice *d;
+    int out_size, in_size;
     int n;
 
-    while ((req = virtio_scsi_pop_req(s, vq))) {
-        SCSIDevice *d;
-        int out_size, in_size;
-        if (req->elem.out_num < 1 || req->elem.in_num < 1) {
-            virtio_scsi_bad_req();
-        }
+    if (req->elem.out_num < 1 || req->elem.in_num < 1) {
+        virtio_scsi_bad_req();
+    }
 
-        out_size = req->elem.out_sg[0].iov_len;
-        in_size = req->elem.in_sg[0].iov_len;
-        if (out_size < sizeof(VirtIOSCSICmdReq) + s->cdb_size ||
-            in_size < sizeof(VirtIOSCSICmdResp) + s->sense_size) {
-            virtio_scsi_bad_req();
-        }
+    out_size = req->elem.out_sg[0].iov_len;
+    in_size = req->elem.in_sg[0].iov_len;
+    if (out_size < sizeof(VirtIOSCSICmdReq) + s->cdb_size ||
+        in_size < sizeof(VirtIOSCSICmdResp) + s->sense_size) {
+        virtio_scsi_bad_req();
+    }
 
-        if (req->elem.out_num > 1 && req->elem.in_num > 1) {
-            virtio_scsi_fail_cmd_req(req);
-            continue;
-        }
+    if (req->elem.out_num > 1 && req->elem.in_num > 1) {
+        virtio_scsi_fail_cmd_req(req);
+        return;
+    }
 
-        d = virtio_scsi_device_find(s, req->req.cmd->lun);
-        if (!d) {
-            req->resp.cmd->response = VIRTIO_SCSI_S_BAD_TARGET;
+    d = virtio_scsi_device_find(s, req->req.cmd->lun);
+    if (!d) {
+        req->resp.cmd->response = VIRTIO_SCSI_S_BAD_TARGET;
+        virtio_scsi_complete_req(req);
+        return;
+    }
+    req->sreq = scsi_req_new(d, req->req.cmd->tag,
+                             virtio_scsi_get_lun(req->req.cmd->lun),
+                             req->req.cmd->cdb, req);
+
+    if (req->sreq->cmd.mode != SCSI_XFER_NONE) {
+        int req_mode =
+            (req->elem.in_num > 1 ? SCSI_XFER_FROM_DEV : SCSI_XFER_TO_DEV);
+
+        if (req->sreq->cmd.mode != req_mode ||
+            req->sreq->cmd.xfer > req->qsgl.size) {
+            req->resp.cmd->response = VIRTIO_SCSI_S_OVERRUN;
             virtio_scsi_complete_req(req);
-            continue;
-        }
-        req->sreq = scsi_req_new(d, req->req.cmd->tag,
-                                 virtio_scsi_get_lun(req->req.cmd->lun),
-                                 req->req.cmd->cdb, req);
-
-        if (req->sreq->cmd.mode != SCSI_XFER_NONE) {
-            int req_mode =
-                (req->elem.in_num > 1 ? SCSI_XFER_FROM_DEV : SCSI_XFER_TO_DEV);
-
-            if (req->sreq->cmd.mode != req_mode ||
-                req->sreq->cmd.xfer > req->qsgl.size) {
-                req->resp.cmd->response = VIRTIO_SCSI_S_OVERRUN;
-                virtio_scsi_complete_req(req);
-                continue;
-            }
+            return;
         }
+    }
 
-        n = scsi_req_enqueue(req->sreq);
-        if (n) {
-            scsi_req_continue(req->sreq);
-        }
+    n = scsi_req_enqueue(req->sreq);
+    if (n) {
+        scsi_req_continue(req->sreq);
     }
 }
 
+static void virtio_scsi_handle_cmd(VirtIODevice *vdev, VirtQueue *vq)
+{
+    VirtIOSCSI *s = (VirtIOSCSI *)vdev;
+    VirtIOSCSIReq *req;
+
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    /* Some guests kick before setting VIRTIO_CONFIG_S_DRIVER_OK so start
+     * dataplane here instead of waiting for .set_status().
+     */
+    if (s->dataplane) {
+        virtio_scsi_data_plane_start(s->dataplane);
+        return;
+    }
+#endif
+
+    while ((req = virtio_scsi_pop_req(s, vq))) {
+        virtio_scsi_handle_cmd_req(s, req);
+    }
+}
+
+void virtio_scsi_handle_dataplane_cmd(VirtIODevice *vdev, unsigned int queue,
+                                      VirtQueueElement *elem)
+{
+    VirtIOSCSI *s = (VirtIOSCSI *)vdev;
+    VirtIOSCSIReq *req;
+
+    req = g_malloc(sizeof(*req));
+    memcpy(&req->elem, elem, sizeof(req->elem));
+    virtio_scsi_parse_req(s, s->cmd_vqs[queue], req);
+    req->dataplane = true;
+    virtio_scsi_handle_cmd_req(s, req);
+}
+
 static void virtio_scsi_get_config(VirtIODevice *vdev,
                                    uint8_t *config)
 {
@@ -561,14 +571,35 @@ static uint32_t virtio_scsi_get_features(VirtIODevice *vdev,
     return requested_features;
 }
 
+static void virtio_scsi_set_status(VirtIODevice *vdev, uint8_t status)
+{
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    VirtIOSCSI *s = (VirtIOSCSI *)vdev;
+
+    if (s->dataplane && !(status & (VIRTIO_CONFIG_S_DRIVER |
+                                    VIRTIO_CONFIG_S_DRIVER_OK))) {
+        virtio_scsi_data_plane_stop(s->dataplane);
+    }
+#endif
+}
+
 static void virtio_scsi_reset(VirtIODevice *vdev)
 {
     VirtIOSCSI *s = (VirtIOSCSI *)vdev;
 
+    /* Cancelled requests that came from the data plane still go back to
+     * its vrings, so stop it only afterwards
+     */
     s->resetting++;
     qbus_reset_all(&s->bus.qbus);
     s->resetting--;
 
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    if (s->dataplane) {
+        virtio_scsi_data_plane_stop(s->dataplane);
+    }
+#endif
+
     s->sense_size = VIRTIO_SCSI_SENSE_SIZE;
     s->cdb_size = VIRTIO_SCSI_CDB_SIZE;
     s->events_dropped = false;
@@ -668,6 +699,11 @@ static void virtio_scsi_hotplug(SCSIBus *bus, SCSIDevice *dev)
 {
     VirtIOSCSI *s = container_of(bus, VirtIOSCSI, bus);
 
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    if (s->dataplane) {
+        virtio_scsi_data_plane_add_lun(s->dataplane, dev);
+    }
+#endif
     if ((s->vdev.guest_features >> VIRTIO_SCSI_F_HOTPLUG) & 1) {
         virtio_scsi_push_event(s, dev, VIRTIO_SCSI_T_TRANSPORT_RESET,
                                VIRTIO_SCSI_EVT_RESET_RESCAN);
@@ -678,6 +714,11 @@ static void virtio_scsi_hot_unplug(SCSIBus *bus, SCSIDevice *dev)
 {
     VirtIOSCSI *s = container_of(bus, VirtIOSCSI, bus);
 
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    if (s->dataplane) {
+        virtio_scsi_data_plane_remove_lun(s->dataplane, dev);
+    }
+#endif
     if ((s->vdev.guest_features >> VIRTIO_SCSI_F_HOTPLUG) & 1) {
         virtio_scsi_push_event(s, dev, VIRTIO_SCSI_T_TRANSPORT_RESET,
                                VIRTIO_SCSI_EVT_RESET_REMOVED);
@@ -718,6 +759,7 @@ VirtIODevice *virtio_scsi_init(DeviceState *dev, VirtIOSCSIConf *proxyconf)
     s->vdev.get_config = virtio_scsi_get_config;
     s->vdev.set_config = virtio_scsi_set_config;
     s->vdev.get_features = virtio_scsi_get_features;
+    s->vdev.set_status = virtio_scsi_set_status;
     s->vdev.reset = virtio_scsi_reset;
 
     s->ctrl_vq = virtio_add_queue(&s->vdev, VIRTIO_SCSI_VQ_SIZE,
@@ -730,6 +772,13 @@ VirtIODevice *virtio_scsi_init(DeviceState *dev, VirtIOSCSIConf *proxyconf)
     }
 
     scsi_bus_new(&s->bus, dev, &virtio_scsi_scsi_info);
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    if (!virtio_scsi_data_plane_create(&s->vdev, s->conf, &s->bus,
+                                       &s->dataplane)) {
+        virtio_cleanup(&s->vdev);
+        return NULL;
+    }
+#endif
     if (!dev->hotplugged) {
         scsi_bus_legacy_handle_cmdline(&s->bus);
     }
@@ -743,6 +792,11 @@ VirtIODevice *virtio_scsi_init(DeviceState *dev, VirtIOSCSIConf *proxyconf)
 void virtio_scsi_exit(VirtIODevice *vdev)
 {
     VirtIOSCSI *s = (VirtIOSCSI *)vdev;
+
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    virtio_scsi_data_plane_destroy(s->dataplane);
+    s->dataplane = NULL;
+#endif
     unregister_savevm(s->qdev, "virtio-scsi", s);
     virtio_cleanup(vdev);
 }
@@ -177,15 +177,11 @@ static void do_flush_queued_data(VirtIOSerialPort *port, VirtQueue *vq,
                 abort();
             }
             if (ret == -EAGAIN || (ret >= 0 && ret < buf_size)) {
-		/*
-                 * this is a temporary check until chardevs can signal to
-                 * frontends that they are writable again. This prevents
-                 * the console from going into throttled mode (forever)
-                 * if virtio-console is connected to a pty without a
-                 * listener. Otherwise the guest spins forever.
-                 * We can revert this if
-                 * 1: chardevs can notify frondends
-                 * 2: the guest driver does not spin in these cases
+                /*
+                 * Consoles are not throttled here: a console connected to
+                 * a backend that cannot signal that it is writable again
+                 * would stay throttled forever.  virtio-console throttles
+                 * the port itself when the backend can notify it.
                  */
                 if (!vsc->is_console) {
                     virtio_serial_throttle_port(port, true);
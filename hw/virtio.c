@@ -18,6 +18,8 @@
 #include "virtio.h"
 #include "qemu/atomic.h"
 #include "virtio-bus.h"
+#include "hw/xen.h"
+#include "hw/dataplane/hostmem.h"
 
 /* The alignment to use between consumer and producer parts of vring.
  * x86 pagesize again. */
@@ -64,6 +66,11 @@ struct VirtQueue
     VRing vring;
     hwaddr pa;
     uint16_t last_avail_idx;
+    /* Last avail index read from the guest; until we catch up with it there
+     * is no need to look at the avail index, which the guest keeps writing */
+    uint16_t shadow_avail_idx;
+    /* Our copy of the used index, which only we write */
+    uint16_t used_idx;
     /* Last used index value we have signalled on */
     uint16_t signalled_used;
 
@@ -135,7 +142,8 @@ static inline uint16_t vring_avail_idx(VirtQueue *vq)
 {
     hwaddr pa;
     pa = vq->vring.avail + offsetof(VRingAvail, idx);
-    return lduw_phys(pa);
+    vq->shadow_avail_idx = lduw_phys(pa);
+    return vq->shadow_avail_idx;
 }
 
 static inline uint16_t vring_avail_ring(VirtQueue *vq, int i)
@@ -225,6 +233,9 @@ int virtio_queue_ready(VirtQueue *vq)
 
 int virtio_queue_empty(VirtQueue *vq)
 {
+    if (vq->shadow_avail_idx != vq->last_avail_idx) {
+        return 0;
+    }
     return vring_avail_idx(vq) == vq->last_avail_idx;
 }
 
@@ -252,7 +263,7 @@ void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
                                   elem->out_sg[i].iov_len,
                                   0, elem->out_sg[i].iov_len);
 
-    idx = (idx + vring_used_idx(vq)) % vq->vring.num;
+    idx = (idx + vq->used_idx) % vq->vring.num;
 
     /* Get a pointer to the next entry in the used ring. */
     vring_used_ring_id(vq, idx, elem->index);
@@ -265,9 +276,10 @@ void virtqueue_flush(VirtQueue *vq, unsigned int count)
     /* Make sure buffer is written before we update index. */
     smp_wmb();
     trace_virtqueue_flush(vq, count);
-    old = vring_used_idx(vq);
+    old = vq->used_idx;
     new = old + count;
     vring_used_idx_set(vq, new);
+    vq->used_idx = new;
     vq->inuse -= count;
     if (unlikely((int16_t)(new - vq->signalled_used) < (uint16_t)(new - old)))
         vq->signalled_used_valid = false;
@@ -280,14 +292,39 @@ void virtqueue_push(VirtQueue *vq, const VirtQueueElement *elem,
     virtqueue_flush(vq, 1);
 }
 
+/* Give back the most recently popped element without using it, so that
+ * virtqueue_pop() or a vhost backend finds it again.  Elements must be
+ * discarded in the reverse order they were popped. */
+void virtqueue_discard(VirtQueue *vq, const VirtQueueElement *elem)
+{
+    int i;
+
+    for (i = 0; i < elem->in_num; i++) {
+        cpu_physical_memory_unmap(elem->in_sg[i].iov_base,
+                                  elem->in_sg[i].iov_len, 1, 0);
+    }
+    for (i = 0; i < elem->out_num; i++) {
+        cpu_physical_memory_unmap(elem->out_sg[i].iov_base,
+                                  elem->out_sg[i].iov_len, 0, 0);
+    }
+    vq->last_avail_idx--;
+    vq->inuse--;
+}
+
 static int virtqueue_num_heads(VirtQueue *vq, unsigned int idx)
 {
-    uint16_t num_heads = vring_avail_idx(vq) - idx;
+    uint16_t num_heads = vq->shadow_avail_idx - idx;
+
+    /* Only go back to the guest's avail index once the heads it showed us
+     * last time are used up */
+    if (!num_heads) {
+        num_heads = vring_avail_idx(vq) - idx;
+    }
 
     /* Check it isn't doing very strange things with descriptor numbers. */
     if (num_heads > vq->vring.num) {
         error_report("Guest moved used index from %u to %u",
-                     idx, vring_avail_idx(vq));
+                     idx, vq->shadow_avail_idx);
         exit(1);
     }
     /* On success, callers read a descriptor at vq->last_avail_idx.
@@ -316,19 +353,95 @@ static unsigned int virtqueue_get_head(VirtQueue *vq, unsigned int idx)
     return head;
 }
 
-static unsigned virtqueue_next_desc(hwaddr desc_pa,
-                                    unsigned int i, unsigned int max)
+/* Guest RAM mapping cache for descriptor tables and virtqueue_map_sg().
+ * Lookups happen under the global mutex, so there is only one reader at a
+ * time.
+ */
+static HostMem virtio_hostmem;
+static bool virtio_hostmem_initialized;
+
+static HostMem *virtio_get_hostmem(void)
+{
+    /* Xen maps guest memory through its map cache, always go through
+     * cpu_physical_memory_map() there.
+     */
+    if (!virtio_hostmem_initialized && !xen_enabled()) {
+        hostmem_init(&virtio_hostmem);
+        virtio_hostmem_initialized = true;
+    }
+    return virtio_hostmem_initialized ? &virtio_hostmem : NULL;
+}
+
+/* A descriptor table, direct or indirect.  When the table is in RAM it is
+ * mapped once and descriptors are copied straight out of it, otherwise each
+ * field goes through the address space.
+ */
+typedef struct VRingDescTable {
+    hwaddr pa;
+    const VRingDesc *host;
+} VRingDescTable;
+
+static void vring_desc_table_init(VRingDescTable *table, hwaddr pa,
+                                  unsigned int num)
+{
+    HostMem *hostmem = virtio_get_hostmem();
+
+    table->pa = pa;
+    table->host = NULL;
+    if (hostmem) {
+        table->host = hostmem_lookup(hostmem, pa, num * sizeof(VRingDesc),
+                                     false);
+    }
+}
+
+/* Read descriptor @i into @desc, which is a stable copy: the guest may keep
+ * writing to the table, but every field is only fetched once.
+ */
+static void vring_desc_read(VRingDescTable *table, unsigned int i,
+                            VRingDesc *desc)
+{
+    if (table->host) {
+        VRingDesc d;
+
+        memcpy(&d, &table->host[i], sizeof(d));
+        desc->addr = ldq_p(&d.addr);
+        desc->len = ldl_p(&d.len);
+        desc->flags = lduw_p(&d.flags);
+        desc->next = lduw_p(&d.next);
+    } else {
+        desc->addr = vring_desc_addr(table->pa, i);
+        desc->len = vring_desc_len(table->pa, i);
+        desc->flags = vring_desc_flags(table->pa, i);
+        desc->next = vring_desc_next(table->pa, i);
+    }
+}
+
+/* Switch from the ring's descriptor table to the indirect table in @desc */
+static unsigned int vring_desc_table_indirect(VRingDescTable *table,
+                                              const VRingDesc *desc)
+{
+    unsigned int num;
+
+    if (desc->len == 0 || desc->len % sizeof(VRingDesc)) {
+        error_report("Invalid size for indirect buffer table");
+        exit(1);
+    }
+
+    num = desc->len / sizeof(VRingDesc);
+    vring_desc_table_init(table, desc->addr, num);
+    return num;
+}
+
+static unsigned virtqueue_next_desc(const VRingDesc *desc, unsigned int max)
 {
     unsigned int next;
 
     /* If this descriptor says it doesn't chain, we're done. */
-    if (!(vring_desc_flags(desc_pa, i) & VRING_DESC_F_NEXT))
+    if (!(desc->flags & VRING_DESC_F_NEXT))
         return max;
 
     /* Check they're not leading us off end of descriptors. */
-    next = vring_desc_next(desc_pa, i);
-    /* Make sure compiler knows to grab that: we don't want it changing! */
-    smp_wmb();
+    next = desc->next;
 
     if (next >= max) {
         error_report("Desc next is %u", next);
@@ -350,20 +463,17 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
     total_bufs = in_total = out_total = 0;
     while (virtqueue_num_heads(vq, idx)) {
         unsigned int max, num_bufs, indirect = 0;
-        hwaddr desc_pa;
+        VRingDescTable table;
+        VRingDesc desc;
         int i;
 
         max = vq->vring.num;
         num_bufs = total_bufs;
         i = virtqueue_get_head(vq, idx++);
-        desc_pa = vq->vring.desc;
-
-        if (vring_desc_flags(desc_pa, i) & VRING_DESC_F_INDIRECT) {
-            if (vring_desc_len(desc_pa, i) % sizeof(VRingDesc)) {
-                error_report("Invalid size for indirect buffer table");
-                exit(1);
-            }
+        vring_desc_table_init(&table, vq->vring.desc, max);
+        vring_desc_read(&table, i, &desc);
 
+        if (desc.flags & VRING_DESC_F_INDIRECT) {
             /* If we've got too many, that implies a descriptor loop. */
             if (num_bufs >= max) {
                 error_report("Looped descriptor");
@@ -372,9 +482,9 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
 
             /* loop over the indirect descriptor table */
             indirect = 1;
-            max = vring_desc_len(desc_pa, i) / sizeof(VRingDesc);
+            max = vring_desc_table_indirect(&table, &desc);
             num_bufs = i = 0;
-            desc_pa = vring_desc_addr(desc_pa, i);
+            vring_desc_read(&table, i, &desc);
         }
 
         do {
@@ -384,15 +494,19 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
                 exit(1);
             }
 
-            if (vring_desc_flags(desc_pa, i) & VRING_DESC_F_WRITE) {
-                in_total += vring_desc_len(desc_pa, i);
+            if (desc.flags & VRING_DESC_F_WRITE) {
+                in_total += desc.len;
             } else {
-                out_total += vring_desc_len(desc_pa, i);
+                out_total += desc.len;
             }
             if (in_total >= max_in_bytes && out_total >= max_out_bytes) {
                 goto done;
             }
-        } while ((i = virtqueue_next_desc(desc_pa, i, max)) != max);
+            i = virtqueue_next_desc(&desc, max);
+            if (i != max) {
+                vring_desc_read(&table, i, &desc);
+            }
+        } while (i != max);
 
         if (!indirect)
             total_bufs = num_bufs;
@@ -420,11 +534,21 @@ int virtqueue_avail_bytes(VirtQueue *vq, unsigned int in_bytes,
 void virtqueue_map_sg(struct iovec *sg, hwaddr *addr,
     size_t num_sg, int is_write)
 {
+    HostMem *hostmem = virtio_get_hostmem();
     unsigned int i;
     hwaddr len;
 
     for (i = 0; i < num_sg; i++) {
         len = sg[i].iov_len;
+        if (hostmem) {
+            /* The result is plain RAM, cpu_physical_memory_unmap() takes
+             * care of dirty tracking as usual.
+             */
+            sg[i].iov_base = hostmem_lookup(hostmem, addr[i], len, is_write);
+            if (sg[i].iov_base) {
+                continue;
+            }
+        }
         sg[i].iov_base = cpu_physical_memory_map(addr[i], &len, is_write);
         if (sg[i].iov_base == NULL || len != sg[i].iov_len) {
             error_report("virtio: trying to map MMIO memory");
@@ -436,7 +560,8 @@ void virtqueue_map_sg(struct iovec *sg, hwaddr *addr,
 int virtqueue_pop(VirtQueue *vq, VirtQueueElement *elem)
 {
     unsigned int i, head, max;
-    hwaddr desc_pa = vq->vring.desc;
+    VRingDescTable table;
+    VRingDesc desc;
 
     if (!virtqueue_num_heads(vq, vq->last_avail_idx))
         return 0;
@@ -448,49 +573,51 @@ int virtqueue_pop(VirtQueue *vq, VirtQueueElement *elem)
 
     i = head = virtqueue_get_head(vq, vq->last_avail_idx++);
     if (vq->vdev->guest_features & (1 << VIRTIO_RING_F_EVENT_IDX)) {
-        vring_avail_event(vq, vring_avail_idx(vq));
+        vring_avail_event(vq, vq->shadow_avail_idx);
     }
 
-    if (vring_desc_flags(desc_pa, i) & VRING_DESC_F_INDIRECT) {
-        if (vring_desc_len(desc_pa, i) % sizeof(VRingDesc)) {
-            error_report("Invalid size for indirect buffer table");
-            exit(1);
-        }
-
+    vring_desc_table_init(&table, vq->vring.desc, max);
+    vring_desc_read(&table, i, &desc);
+    if (desc.flags & VRING_DESC_F_INDIRECT) {
         /* loop over the indirect descriptor table */
-        max = vring_desc_len(desc_pa, i) / sizeof(VRingDesc);
-        desc_pa = vring_desc_addr(desc_pa, i);
+        max = vring_desc_table_indirect(&table, &desc);
         i = 0;
+        vring_desc_read(&table, i, &desc);
     }
 
     /* Collect all the descriptors */
     do {
         struct iovec *sg;
 
-        if (vring_desc_flags(desc_pa, i) & VRING_DESC_F_WRITE) {
+        if (desc.flags & VRING_DESC_F_WRITE) {
             if (elem->in_num >= ARRAY_SIZE(elem->in_sg)) {
                 error_report("Too many write descriptors in indirect table");
                 exit(1);
             }
-            elem->in_addr[elem->in_num] = vring_desc_addr(desc_pa, i);
+            elem->in_addr[elem->in_num] = desc.addr;
             sg = &elem->in_sg[elem->in_num++];
         } else {
             if (elem->out_num >= ARRAY_SIZE(elem->out_sg)) {
                 error_report("Too many read descriptors in indirect table");
                 exit(1);
             }
-            elem->out_addr[elem->out_num] = vring_desc_addr(desc_pa, i);
+            elem->out_addr[elem->out_num] = desc.addr;
             sg = &elem->out_sg[elem->out_num++];
         }
 
-        sg->iov_len = vring_desc_len(desc_pa, i);
+        sg->iov_len = desc.len;
 
         /* If we've got too many, that implies a descriptor loop. */
         if ((elem->in_num + elem->out_num) > max) {
             error_report("Looped descriptor");
             exit(1);
         }
-    } while ((i = virtqueue_next_desc(desc_pa, i, max)) != max);
+
+        i = virtqueue_next_desc(&desc, max);
+        if (i != max) {
+            vring_desc_read(&table, i, &desc);
+        }
+    } while (i != max);
 
     /* Now map what we have collected */
     virtqueue_map_sg(elem->in_sg, elem->in_addr, elem->in_num, 1);
@@ -549,6 +676,8 @@ void virtio_reset(void *opaque)
         vdev->vq[i].vring.avail = 0;
         vdev->vq[i].vring.used = 0;
         vdev->vq[i].last_avail_idx = 0;
+        vdev->vq[i].shadow_avail_idx = 0;
+        vdev->vq[i].used_idx = 0;
         vdev->vq[i].pa = 0;
         vdev->vq[i].vector = VIRTIO_NO_VECTOR;
         vdev->vq[i].signalled_used = 0;
@@ -751,7 +880,7 @@ static bool vring_notify(VirtIODevice *vdev, VirtQueue *vq)
     v = vq->signalled_used_valid;
     vq->signalled_used_valid = true;
     old = vq->signalled_used;
-    new = vq->signalled_used = vring_used_idx(vq);
+    new = vq->signalled_used = vq->used_idx;
     return !v || vring_need_event(vring_used_event(vq), new, old);
 }
 
@@ -860,6 +989,7 @@ int virtio_load(VirtIODevice *vdev, QEMUFile *f)
         if (vdev->vq[i].pa) {
             uint16_t nheads;
             virtqueue_init(&vdev->vq[i]);
+            vdev->vq[i].used_idx = vring_used_idx(&vdev->vq[i]);
             nheads = vring_avail_idx(&vdev->vq[i]) - vdev->vq[i].last_avail_idx;
             /* Check it isn't doing very strange things with descriptor numbers. */
             if (nheads > vdev->vq[i].vring.num) {
@@ -1011,9 +1141,18 @@ uint16_t virtio_queue_get_last_avail_idx(VirtIODevice *vdev, int n)
     return vdev->vq[n].last_avail_idx;
 }
 
+/* Take the ring back from another backend, such as vhost, which has
+ * processed it up to @idx
+ */
 void virtio_queue_set_last_avail_idx(VirtIODevice *vdev, int n, uint16_t idx)
 {
-    vdev->vq[n].last_avail_idx = idx;
+    VirtQueue *vq = &vdev->vq[n];
+
+    vq->last_avail_idx = idx;
+    vq->shadow_avail_idx = idx;
+    if (vq->vring.used) {
+        vq->used_idx = vring_used_idx(vq);
+    }
 }
 
 VirtQueue *virtio_get_queue(VirtIODevice *vdev, int n)
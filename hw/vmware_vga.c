@@ -334,8 +334,11 @@ static inline void vmsvga_update_rect(struct vmsvga_state_s *s,
     src = s->vga.vram_ptr + start;
     dst = ds_get_data(s->vga.ds) + start;
 
-    for (line = h; line > 0; line--, src += bypl, dst += bypl) {
-        memcpy(dst, src, width);
+    /* a shared surface already shows the contents of vram */
+    if (!is_buffer_shared(s->vga.ds->surface)) {
+        for (line = h; line > 0; line--, src += bypl, dst += bypl) {
+            memcpy(dst, src, width);
+        }
     }
     dpy_gfx_update(s->vga.ds, x, y, w, h);
 }
@@ -980,11 +983,31 @@ static void vmsvga_bios_write(void *opaque, uint32_t address, uint32_t data)
     printf("%s: what are we supposed to do with (%08x)?\n", __func__, data);
 }
 
+/*
+ * The guest framebuffer has the depth of the host surface and no padding
+ * (SVGA_REG_BYTES_PER_LINE), so the display can use vram directly for the
+ * 16 and 32 bit formats instead of a copy.  The VGA modes may have
+ * replaced the surface in the meantime, so check that it still is ours.
+ */
 static inline void vmsvga_check_size(struct vmsvga_state_s *s)
 {
+    bool share = (s->depth == 32 || s->depth == 16) &&
+                 (uint64_t)s->bypp * s->new_width * s->new_height <=
+                 s->vga.vram_size;
+
     if (s->new_width != ds_get_width(s->vga.ds) ||
-        s->new_height != ds_get_height(s->vga.ds)) {
-        qemu_console_resize(s->vga.ds, s->new_width, s->new_height);
+        s->new_height != ds_get_height(s->vga.ds) ||
+        (share && (!is_buffer_shared(s->vga.ds->surface) ||
+                   ds_get_data(s->vga.ds) != s->vga.vram_ptr))) {
+        if (share) {
+            qemu_free_displaysurface(s->vga.ds);
+            s->vga.ds->surface = qemu_create_displaysurface_from(
+                s->new_width, s->new_height, s->depth,
+                s->bypp * s->new_width, s->vga.vram_ptr, false);
+            dpy_gfx_resize(s->vga.ds);
+        } else {
+            qemu_console_resize(s->vga.ds, s->new_width, s->new_height);
+        }
         s->invalidated = 1;
     }
 }
@@ -1016,8 +1039,10 @@ static void vmsvga_update_display(void *opaque)
     }
     if (s->invalidated || dirty) {
         s->invalidated = 0;
-        memcpy(ds_get_data(s->vga.ds), s->vga.vram_ptr,
-               ds_get_linesize(s->vga.ds) * ds_get_height(s->vga.ds));
+        if (!is_buffer_shared(s->vga.ds->surface)) {
+            memcpy(ds_get_data(s->vga.ds), s->vga.vram_ptr,
+                   ds_get_linesize(s->vga.ds) * ds_get_height(s->vga.ds));
+        }
         dpy_gfx_update(s->vga.ds, 0, 0,
                    ds_get_width(s->vga.ds), ds_get_height(s->vga.ds));
     }
@@ -1160,6 +1185,7 @@ static void vmsvga_init(struct vmsvga_state_s *s,
     vga_common_init(&s->vga);
     vga_init(&s->vga, address_space, io, true);
     vmstate_register(NULL, 0, &vmstate_vga_common, &s->vga);
+    vga_display_idle_init(&s->vga);
     /* Save some values here in case they are changed later.
      * This is suspicious and needs more though why it is needed. */
     s->depth = ds_get_bits_per_pixel(s->vga.ds);
@@ -17,6 +17,7 @@
 #include "qemu-common.h"
 #include "qemu/queue.h"
 #include "qemu/event_notifier.h"
+#include "qemu/thread.h"
 
 typedef struct BlockDriverAIOCB BlockDriverAIOCB;
 typedef void BlockDriverCompletionFunc(void *opaque, int ret);
@@ -38,6 +39,10 @@ void *qemu_aio_get(const AIOCBInfo *aiocb_info, BlockDriverState *bs,
 void qemu_aio_release(void *p);
 
 typedef struct AioHandler AioHandler;
+
+/* rt_clock, vm_clock and host_clock */
+#define AIO_MAX_TIMER_LISTS 3
+
 typedef void QEMUBHFunc(void *opaque);
 typedef void IOHandler(void *opaque);
 
@@ -53,19 +58,41 @@ typedef struct AioContext {
      */
     int walking_handlers;
 
-    /* Anchor of the list of Bottom Halves belonging to the context */
-    struct QEMUBH *first_bh;
+    /* All Bottom Halves belonging to the context.  Any thread may create
+     * them, so the list is protected by bh_lock.
+     */
+    QemuMutex bh_lock;
+    QLIST_HEAD(, QEMUBH) bh_list;
+
+    /* Bottom Halves scheduled or deleted since the last aio_bh_poll(),
+     * newest first.  Other threads push to it without a lock.
+     */
+    struct QEMUBH *bh_queue;
 
-    /* A simple lock used to protect the first_bh list, and ensure that
-     * no callbacks are removed while we're walking and dispatching callbacks.
+    /* Bottom Halves taken from bh_queue that aio_bh_poll() has not run
+     * yet, oldest first.  Only used by the thread that runs the context.
      */
-    int walking_bh;
+    struct QEMUBH *bh_ready;
+    struct QEMUBH **bh_ready_tail;
 
     /* Used for aio_notify.  */
     EventNotifier notifier;
 
     /* GPollFDs for aio_poll() */
     GArray *pollfds;
+
+    /* epoll instance with all handlers, or -1 (see aio-posix.c).  When
+     * it is used the GSource polls epoll_pfd instead of each handler.
+     */
+    int epollfd;
+    GPollFD epoll_pfd;
+
+    /* Thread pool for performing work and receiving completion callbacks */
+    struct ThreadPool *thread_pool;
+
+    /* Timers created with aio_timer_new(), one list per clock */
+    QEMUTimerList *timer_lists[AIO_MAX_TIMER_LISTS];
+    int n_timer_lists;
 } AioContext;
 
 /* Returns 1 if there are still outstanding AIO requests; 0 otherwise */
@@ -133,9 +160,10 @@ int aio_bh_poll(AioContext *ctx);
  * Scheduling a bottom half interrupts the main loop and causes the
  * execution of the callback that was passed to qemu_bh_new.
  *
- * Bottom halves that are scheduled from a bottom half handler are instantly
- * invoked.  This can create an infinite loop if a bottom half handler
- * schedules itself.
+ * Any thread may schedule a bottom half.  Only the bottom halves that are
+ * scheduled are visited by aio_bh_poll().  Those that are scheduled from a
+ * bottom half handler run in the next call to aio_bh_poll().  This can
+ * still create an infinite loop if a bottom half handler schedules itself.
  *
  * @bh: The bottom half to be scheduled.
  */
@@ -158,13 +186,29 @@ void qemu_bh_cancel(QEMUBH *bh);
  *qemu_bh_delete: Cancel execution of a bottom half and free its resources.
  *
  * Deleting a bottom half frees the memory that was allocated for it by
- * qemu_bh_new.  It also implies canceling the bottom half if it was
- * scheduled.
+ * qemu_bh_new, the next time the AioContext polls its bottom halves.  It
+ * also implies canceling the bottom half if it was scheduled.
  *
  * @bh: The bottom half to be deleted.
  */
 void qemu_bh_delete(QEMUBH *bh);
 
+/**
+ * qemu_bh_set_name: Name a bottom half for query-wakeups.
+ *
+ * @bh: The bottom half.
+ * @name: A static string, for example "virtio-net-tx".
+ */
+void qemu_bh_set_name(QEMUBH *bh, const char *name);
+
+/* Prepend the bottom halves of @ctx that woke up the main loop to @list */
+struct WakeupSourceList *aio_bh_wakeup_sources(AioContext *ctx,
+                                               struct WakeupSourceList *list);
+
+/* Prepend the bottom halves of @ctx that have run to @list */
+struct CallbackAccountingList *aio_bh_cpu_accounting(AioContext *ctx,
+    struct CallbackAccountingList *list);
+
 /* Return whether there are any pending callbacks from the GSource
  * attached to the AioContext.
  *
@@ -172,6 +216,13 @@ void qemu_bh_delete(QEMUBH *bh);
  */
 bool aio_pending(AioContext *ctx);
 
+/* Set up and release the host-specific parts of an AioContext.
+ *
+ * These are used internally by aio_context_new() and the GSource.
+ */
+void aio_context_setup(AioContext *ctx);
+void aio_context_cleanup(AioContext *ctx);
+
 /* Progress in completing AIO work to occur.  This can issue new pending
  * aio as a result of executing I/O completion or bh callbacks.
  *
@@ -223,6 +274,9 @@ void aio_set_event_notifier(AioContext *ctx,
  */
 GSource *aio_get_g_source(AioContext *ctx);
 
+/* Return the ThreadPool bound to this AioContext */
+struct ThreadPool *aio_get_thread_pool(AioContext *ctx);
+
 /* Functions to operate on the main QEMU AioContext.  */
 
 bool qemu_aio_wait(void);
@@ -11,6 +11,17 @@
 /* block.c */
 typedef struct BlockDriver BlockDriver;
 typedef struct BlockJob BlockJob;
+typedef struct BdrvDirtyBitmap BdrvDirtyBitmap;
+
+typedef enum {
+    BDRV_REQ_COPY_ON_READ = 0x1,
+    BDRV_REQ_ZERO_WRITE   = 0x2,
+    /* The zeroed range may be deallocated (discarded) if the driver can
+     * guarantee that it still reads back as zeroes.  Only valid together
+     * with BDRV_REQ_ZERO_WRITE.
+     */
+    BDRV_REQ_MAY_UNMAP    = 0x4,
+} BdrvRequestFlags;
 
 typedef struct BlockDriverInfo {
     /* in bytes, 0 if irrelevant */
@@ -85,6 +96,7 @@ typedef struct BlockDevOps {
 #define BDRV_O_CHECK       0x1000  /* open solely for consistency check */
 #define BDRV_O_ALLOW_RDWR  0x2000  /* allow reopen to change from r/o to r/w */
 #define BDRV_O_UNMAP       0x4000  /* execute guest UNMAP/TRIM operations */
+#define BDRV_O_IO_URING    0x8000  /* use io_uring instead of the thread pool */
 
 #define BDRV_O_CACHE_MASK  (BDRV_O_NOCACHE | BDRV_O_CACHE_WB | BDRV_O_NO_FLUSH)
 
@@ -116,9 +128,14 @@ void bdrv_stats_print(Monitor *mon, const QObject *data);
 void bdrv_info_stats(Monitor *mon, QObject **ret_data);
 
 /* disk I/O throttling */
-void bdrv_io_limits_enable(BlockDriverState *bs);
+void bdrv_io_limits_enable(BlockDriverState *bs, const char *group);
 void bdrv_io_limits_disable(BlockDriverState *bs);
-bool bdrv_io_limits_enabled(BlockDriverState *bs);
+void bdrv_io_limits_update_group(BlockDriverState *bs, const char *group);
+
+/* coalescing of adjacent AIO requests */
+#define BDRV_MERGE_DEFAULT_MAX_SECTORS 1024
+void bdrv_set_request_merging(BlockDriverState *bs, bool enable,
+                              int max_sectors, int max_segments);
 
 void bdrv_init(void);
 void bdrv_init_with_whitelist(void);
@@ -149,6 +166,9 @@ void bdrv_reopen_commit(BDRVReopenState *reopen_state);
 void bdrv_reopen_abort(BDRVReopenState *reopen_state);
 void bdrv_close(BlockDriverState *bs);
 void bdrv_add_close_notifier(BlockDriverState *bs, Notifier *notify);
+AioContext *bdrv_get_aio_context(BlockDriverState *bs);
+bool bdrv_can_set_aio_context(BlockDriverState *bs);
+void bdrv_set_aio_context(BlockDriverState *bs, AioContext *new_context);
 int bdrv_attach_dev(BlockDriverState *bs, void *dev);
 void bdrv_attach_dev_nofail(BlockDriverState *bs, void *dev);
 void bdrv_detach_dev(BlockDriverState *bs, void *dev);
@@ -165,6 +185,8 @@ int bdrv_read_unthrottled(BlockDriverState *bs, int64_t sector_num,
                           uint8_t *buf, int nb_sectors);
 int bdrv_write(BlockDriverState *bs, int64_t sector_num,
                const uint8_t *buf, int nb_sectors);
+int bdrv_write_zeroes(BlockDriverState *bs, int64_t sector_num,
+                      int nb_sectors, BdrvRequestFlags flags);
 int bdrv_pread(BlockDriverState *bs, int64_t offset,
                void *buf, int count);
 int bdrv_pwrite(BlockDriverState *bs, int64_t offset,
@@ -182,15 +204,51 @@ int coroutine_fn bdrv_co_writev(BlockDriverState *bs, int64_t sector_num,
  * I/O request like read or write and should have a reasonable size.  This
  * function is not suitable for zeroing the entire image in a single request
  * because it may allocate memory for the entire region.
+ *
+ * With BDRV_REQ_MAY_UNMAP in @flags the driver may deallocate the range
+ * instead of writing zeroes, if it reads back as zeroes afterwards.
  */
 int coroutine_fn bdrv_co_write_zeroes(BlockDriverState *bs, int64_t sector_num,
-    int nb_sectors);
+    int nb_sectors, BdrvRequestFlags flags);
+
+/*
+ * Allocation status returned by bdrv_get_block_status():
+ *
+ * BDRV_BLOCK_DATA: the data is read from bs->file or another file
+ * BDRV_BLOCK_ZERO: the sectors read as zeroes
+ * BDRV_BLOCK_OFFSET_VALID: the sectors are stored as raw data in bs->file,
+ *                          at the offset in the BDRV_BLOCK_OFFSET_MASK bits
+ * BDRV_BLOCK_RAW: used by drivers that pass the request through to
+ *                 bs->file, at the offset they return
+ * BDRV_BLOCK_ALLOCATED: the content comes from this layer, not from the
+ *                       backing file
+ *
+ * Neither DATA nor ZERO means that the sectors are read from the backing
+ * file.  Both DATA and ZERO mean that they read as zeroes but take space
+ * (for example preallocated or unwritten extents).
+ */
+#define BDRV_BLOCK_DATA         0x01
+#define BDRV_BLOCK_ZERO         0x02
+#define BDRV_BLOCK_OFFSET_VALID 0x04
+#define BDRV_BLOCK_RAW          0x08
+#define BDRV_BLOCK_ALLOCATED    0x10
+#define BDRV_BLOCK_OFFSET_MASK  BDRV_SECTOR_MASK
+
+int64_t coroutine_fn bdrv_co_get_block_status(BlockDriverState *bs,
+                                              int64_t sector_num,
+                                              int nb_sectors, int *pnum);
+int64_t bdrv_get_block_status(BlockDriverState *bs, int64_t sector_num,
+                              int nb_sectors, int *pnum);
 int coroutine_fn bdrv_co_is_allocated(BlockDriverState *bs, int64_t sector_num,
     int nb_sectors, int *pnum);
 int coroutine_fn bdrv_co_is_allocated_above(BlockDriverState *top,
                                             BlockDriverState *base,
                                             int64_t sector_num,
                                             int nb_sectors, int *pnum);
+int64_t coroutine_fn bdrv_co_get_block_status_above(BlockDriverState *top,
+                                                    BlockDriverState *base,
+                                                    int64_t sector_num,
+                                                    int nb_sectors, int *pnum);
 BlockDriverState *bdrv_find_backing_image(BlockDriverState *bs,
     const char *backing_file);
 int bdrv_get_backing_file_depth(BlockDriverState *bs);
@@ -223,8 +281,12 @@ typedef struct BdrvCheckResult {
 typedef enum {
     BDRV_FIX_LEAKS    = 1,
     BDRV_FIX_ERRORS   = 2,
+    /* Not a fix: also read back every allocated data cluster */
+    BDRV_CHECK_SCRUB  = 4,
 } BdrvCheckMode;
 
+#define BDRV_FIX_MASK (BDRV_FIX_LEAKS | BDRV_FIX_ERRORS)
+
 int bdrv_check(BlockDriverState *bs, BdrvCheckResult *res, BdrvCheckMode fix);
 
 /* async block I/O */
@@ -241,6 +303,14 @@ BlockDriverAIOCB *bdrv_aio_flush(BlockDriverState *bs,
 BlockDriverAIOCB *bdrv_aio_discard(BlockDriverState *bs,
                                    int64_t sector_num, int nb_sectors,
                                    BlockDriverCompletionFunc *cb, void *opaque);
+BlockDriverAIOCB *bdrv_aio_write_zeroes(BlockDriverState *bs,
+        int64_t sector_num, int nb_sectors, BdrvRequestFlags flags,
+        BlockDriverCompletionFunc *cb, void *opaque);
+BlockDriverAIOCB *bdrv_aio_write_compressed(BlockDriverState *bs,
+                                            int64_t sector_num,
+                                            QEMUIOVector *qiov, int nb_sectors,
+                                            BlockDriverCompletionFunc *cb,
+                                            void *opaque);
 void bdrv_aio_cancel(BlockDriverAIOCB *acb);
 
 typedef struct BlockRequest {
@@ -258,6 +328,11 @@ typedef struct BlockRequest {
 int bdrv_aio_multiwrite(BlockDriverState *bs, BlockRequest *reqs,
     int num_reqs);
 
+/* Requests submitted between the two calls may be sent to the host
+ * together when unplugging.  Calls nest. */
+void bdrv_io_plug(BlockDriverState *bs);
+void bdrv_io_unplug(BlockDriverState *bs);
+
 /* sg packet commands */
 int bdrv_ioctl(BlockDriverState *bs, unsigned long int req, void *buf);
 BlockDriverAIOCB *bdrv_aio_ioctl(BlockDriverState *bs,
@@ -312,8 +387,12 @@ void bdrv_iterate_format(void (*it)(void *opaque, const char *name),
                          void *opaque);
 const char *bdrv_get_device_name(BlockDriverState *bs);
 int bdrv_get_flags(BlockDriverState *bs);
+bool bdrv_can_write_compressed(BlockDriver *drv);
 int bdrv_write_compressed(BlockDriverState *bs, int64_t sector_num,
                           const uint8_t *buf, int nb_sectors);
+int coroutine_fn bdrv_co_write_compressed(BlockDriverState *bs,
+                                          int64_t sector_num, int nb_sectors,
+                                          QEMUIOVector *qiov);
 int bdrv_get_info(BlockDriverState *bs, BlockDriverInfo *bdi);
 void bdrv_round_to_clusters(BlockDriverState *bs,
                             int64_t sector_num, int nb_sectors,
@@ -359,6 +438,7 @@ void bdrv_img_create(const char *filename, const char *fmt,
                      Error **errp, bool quiet);
 
 void bdrv_set_buffer_alignment(BlockDriverState *bs, int align);
+int bdrv_get_request_alignment(BlockDriverState *bs);
 void *qemu_blockalign(BlockDriverState *bs, size_t size);
 bool bdrv_qiov_is_aligned(BlockDriverState *bs, QEMUIOVector *qiov);
 
@@ -368,8 +448,22 @@ int bdrv_get_dirty(BlockDriverState *bs, int64_t sector);
 void bdrv_set_dirty(BlockDriverState *bs, int64_t cur_sector, int nr_sectors);
 void bdrv_reset_dirty(BlockDriverState *bs, int64_t cur_sector, int nr_sectors);
 void bdrv_dirty_iter_init(BlockDriverState *bs, struct HBitmapIter *hbi);
+int64_t bdrv_get_next_dirty(BlockDriverState *bs, int64_t sector);
 int64_t bdrv_get_dirty_count(BlockDriverState *bs);
 
+BdrvDirtyBitmap *bdrv_create_dirty_bitmap(BlockDriverState *bs,
+                                          const char *name,
+                                          int64_t granularity,
+                                          Error **errp);
+void bdrv_release_dirty_bitmap(BlockDriverState *bs, BdrvDirtyBitmap *bitmap);
+BdrvDirtyBitmap *bdrv_find_dirty_bitmap(BlockDriverState *bs,
+                                        const char *name);
+void bdrv_clear_dirty_bitmap(BlockDriverState *bs, BdrvDirtyBitmap *bitmap);
+void bdrv_dirty_bitmap_set(BdrvDirtyBitmap *bitmap, int64_t cur_sector,
+                           int nr_sectors);
+void bdrv_dirty_bitmap_reset(BdrvDirtyBitmap *bitmap, int64_t cur_sector,
+                             int nr_sectors);
+
 void bdrv_enable_copy_on_read(BlockDriverState *bs);
 void bdrv_disable_copy_on_read(BlockDriverState *bs);
 
@@ -401,6 +495,9 @@ typedef struct BlockAcctCookie {
 void bdrv_acct_start(BlockDriverState *bs, BlockAcctCookie *cookie,
         int64_t bytes, enum BlockAcctType type);
 void bdrv_acct_done(BlockDriverState *bs, BlockAcctCookie *cookie);
+void bdrv_set_latency_histogram(BlockDriverState *bs, enum BlockAcctType type,
+                                const uint64_t *boundaries, int nb_boundaries);
+void bdrv_reset_latency_histograms(BlockDriverState *bs);
 
 typedef enum {
     BLKDBG_L1_UPDATE,
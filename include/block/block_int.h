@@ -33,18 +33,13 @@
 #include "qapi/qmp/qerror.h"
 #include "monitor/monitor.h"
 #include "qemu/hbitmap.h"
+#include "qemu/throttle.h"
+#include "qemu/interval-tree.h"
 
 #define BLOCK_FLAG_ENCRYPT          1
 #define BLOCK_FLAG_COMPAT6          4
 #define BLOCK_FLAG_LAZY_REFCOUNTS   8
 
-#define BLOCK_IO_LIMIT_READ     0
-#define BLOCK_IO_LIMIT_WRITE    1
-#define BLOCK_IO_LIMIT_TOTAL    2
-
-#define BLOCK_IO_SLICE_TIME     100000000
-#define NANOSECONDS_PER_SECOND  1000000000.0
-
 #define BLOCK_OPT_SIZE              "size"
 #define BLOCK_OPT_ENCRYPT           "encryption"
 #define BLOCK_OPT_COMPAT6           "compat6"
@@ -59,16 +54,68 @@
 #define BLOCK_OPT_ADAPTER_TYPE      "adapter_type"
 
 typedef struct BdrvTrackedRequest BdrvTrackedRequest;
+typedef struct BdrvMergeAIOCB BdrvMergeAIOCB;
 
-typedef struct BlockIOLimit {
-    int64_t bps[3];
-    int64_t iops[3];
-} BlockIOLimit;
+typedef struct ThrottleGroup ThrottleGroup;
+typedef struct SharedCache SharedCache;
 
-typedef struct BlockIOBaseValue {
-    uint64_t bytes[2];
-    uint64_t ios[2];
-} BlockIOBaseValue;
+/*
+ * A write interceptor sees every write to a BlockDriverState, so that a
+ * block job can keep another image in sync with it.  Both callbacks run in
+ * the coroutine of the request and may yield, which delays the request.
+ */
+typedef struct BdrvWriteOp {
+    int64_t sector_num;
+    int nb_sectors;
+    QEMUIOVector *qiov;         /* NULL for write zeroes */
+    BdrvRequestFlags flags;
+    int ret;                    /* result of the write, for after_write */
+    void *opaque;               /* owned by the interceptor */
+} BdrvWriteOp;
+
+typedef struct BdrvWriteInterceptor BdrvWriteInterceptor;
+struct BdrvWriteInterceptor {
+    /* Called before the write is passed to the driver */
+    void coroutine_fn (*before_write)(BdrvWriteInterceptor *wi,
+                                      BdrvWriteOp *op);
+    /* Called once the write has completed and was marked dirty */
+    void coroutine_fn (*after_write)(BdrvWriteInterceptor *wi,
+                                     BdrvWriteOp *op);
+};
+
+/*
+ * A named dirty bitmap, set by every write to the device.  Unlike the
+ * anonymous bitmap of bdrv_set_dirty_tracking(), several can exist at
+ * the same time and they are only reset by their users.
+ */
+struct BdrvDirtyBitmap {
+    char *name;
+    HBitmap *bitmap;        /* one bit per granularity sectors */
+    bool persistent;        /* stored in the image by the format driver */
+    bool busy;              /* used by a block job, cannot be removed */
+    QLIST_ENTRY(BdrvDirtyBitmap) list;
+};
+
+typedef struct BlockHistogram {
+    int nb_bins;            /* one more than the number of boundaries */
+    uint64_t *boundaries;   /* ascending, bin i ends before boundaries[i] */
+    uint64_t *bins;
+} BlockHistogram;
+
+/*
+ * Request limits of a driver, in sectors, filled in by .bdrv_open or
+ * .bdrv_file_open.  Zero means that there is no limit or no preference.
+ * The generic block layer splits requests that exceed the maximums, and
+ * aligns split discard and write zeroes requests to the given alignment.
+ */
+typedef struct BlockLimits {
+    int max_transfer_length;
+    int opt_transfer_length;
+    int max_discard;
+    int discard_alignment;
+    int max_write_zeroes;
+    int write_zeroes_alignment;
+} BlockLimits;
 
 struct BlockDriver {
     const char *format_name;
@@ -117,11 +164,14 @@ struct BlockDriver {
      * instead.
      */
     int coroutine_fn (*bdrv_co_write_zeroes)(BlockDriverState *bs,
-        int64_t sector_num, int nb_sectors);
+        int64_t sector_num, int nb_sectors, BdrvRequestFlags flags);
     int coroutine_fn (*bdrv_co_discard)(BlockDriverState *bs,
         int64_t sector_num, int nb_sectors);
     int coroutine_fn (*bdrv_co_is_allocated)(BlockDriverState *bs,
         int64_t sector_num, int nb_sectors, int *pnum);
+    /* Like bdrv_co_is_allocated, but returns BDRV_BLOCK_* flags */
+    int64_t coroutine_fn (*bdrv_co_get_block_status)(BlockDriverState *bs,
+        int64_t sector_num, int nb_sectors, int *pnum);
 
     /*
      * Invalidate any cached meta-data.
@@ -147,6 +197,12 @@ struct BlockDriver {
     int64_t (*bdrv_get_allocated_file_size)(BlockDriverState *bs);
     int (*bdrv_write_compressed)(BlockDriverState *bs, int64_t sector_num,
                                  const uint8_t *buf, int nb_sectors);
+    /*
+     * Like .bdrv_write_compressed(), but several requests may be in flight
+     * at the same time.  Drivers implement one of the two.
+     */
+    int coroutine_fn (*bdrv_co_write_compressed)(BlockDriverState *bs,
+        int64_t sector_num, int nb_sectors, QEMUIOVector *qiov);
 
     int (*bdrv_snapshot_create)(BlockDriverState *bs,
                                 QEMUSnapshotInfo *sn_info);
@@ -204,6 +260,27 @@ struct BlockDriver {
      */
     int (*bdrv_has_zero_init)(BlockDriverState *bs);
 
+    /*
+     * Returns true if the persistent dirty bitmaps of @bs can be stored in
+     * the image when it is closed; the driver does so in .bdrv_close().
+     */
+    bool (*bdrv_can_store_dirty_bitmaps)(BlockDriverState *bs);
+
+    /*
+     * Drivers that register fd handlers or event notifiers must move them
+     * to bdrv_get_aio_context(bs) in .bdrv_attach_aio_context() and remove
+     * them in .bdrv_detach_aio_context().  Drivers that rely on main loop
+     * timers or handlers they cannot move set .bdrv_main_context_only.
+     */
+    void (*bdrv_detach_aio_context)(BlockDriverState *bs);
+    void (*bdrv_attach_aio_context)(BlockDriverState *bs,
+                                    AioContext *new_context);
+    bool bdrv_main_context_only;
+
+    /* Batch requests between plug and unplug, see bdrv_io_plug() */
+    void (*bdrv_io_plug)(BlockDriverState *bs);
+    void (*bdrv_io_unplug)(BlockDriverState *bs);
+
     QLIST_ENTRY(BlockDriver) list;
 };
 
@@ -243,31 +320,68 @@ struct BlockDriverState {
 
     NotifierList close_notifiers;
 
+    /* event loop that runs the callbacks of this BlockDriverState */
+    AioContext *aio_context;
+
     /* number of in-flight copy-on-read requests */
     unsigned int copy_on_read_in_flight;
 
-    /* the time for latest disk I/O */
-    int64_t slice_time;
-    int64_t slice_start;
-    int64_t slice_end;
-    BlockIOLimit io_limits;
-    BlockIOBaseValue  io_base;
-    CoQueue      throttled_reqs;
-    QEMUTimer    *block_timer;
+    /* number of in-flight read-modify-write requests */
+    unsigned int serialising_in_flight;
+
+    /* I/O throttling, the limits live in the throttle group */
+    ThrottleGroup *throttle_group;
+    QLIST_ENTRY(BlockDriverState) round_robin;
+    CoQueue      throttled_reqs[2];
+    unsigned int pending_reqs[2];
+    QEMUTimer    *throttle_timers[2];
     bool         io_limits_enabled;
 
     /* I/O stats (display with "info blockstats"). */
     uint64_t nr_bytes[BDRV_MAX_IOTYPE];
     uint64_t nr_ops[BDRV_MAX_IOTYPE];
     uint64_t total_time_ns[BDRV_MAX_IOTYPE];
+    uint64_t nr_merged[BDRV_MAX_IOTYPE];
     uint64_t wr_highest_sector;
 
+    /* latency in ns of each type of request, and the number of requests in
+     * flight sampled whenever one is submitted; allocated on first use */
+    BlockHistogram latency_histogram[BDRV_MAX_IOTYPE];
+    BlockHistogram queue_depth_histogram;
+    unsigned int acct_in_flight;
+
+    /* requests queued for merging, see bdrv_set_request_merging() */
+    bool merge_requests;
+    int merge_max_sectors;
+    int merge_max_segments;
+    unsigned int merge_seq;
+    QEMUBH *merge_bh;
+    QSIMPLEQ_HEAD(, BdrvMergeAIOCB) merge_queue;
+
     /* Whether the disk can expand beyond total_sectors */
     int growable;
 
     /* the memory alignment required for the buffers handled by this driver */
     int buffer_alignment;
 
+    /* the alignment in bytes of the offset and length of requests that the
+     * driver accepts, a multiple of BDRV_SECTOR_SIZE; others go through a
+     * read-modify-write in block.c */
+    int request_alignment;
+
+    /* request limits of the driver */
+    BlockLimits bl;
+
+    /* bytes of the virtual disk that the mapping table cache of the format
+     * driver should cover, set before opening; 0 lets the driver choose */
+    int64_t l2_cache_coverage;
+
+    /* cluster cache shared with other processes, set before opening and
+     * handed down the backing chain; only used while the image is read-only
+     * and shared_cache_key identifies its contents */
+    SharedCache *shared_cache;
+    uint64_t shared_cache_key;
+
     /* do we need to tell the quest if we have a volatile write cache? */
     int enable_write_cache;
 
@@ -278,20 +392,29 @@ struct BlockDriverState {
     BlockDeviceIoStatus iostatus;
     char device_name[32];
     HBitmap *dirty_bitmap;
+    QLIST_HEAD(, BdrvDirtyBitmap) dirty_bitmaps;
     int in_use; /* users other than guest access, eg. block migration */
     QTAILQ_ENTRY(BlockDriverState) list;
 
-    QLIST_HEAD(, BdrvTrackedRequest) tracked_requests;
+    /* in-flight requests by sector range */
+    IntervalTree tracked_requests;
+    /* in-flight zero-length requests, which have no range */
+    unsigned int nr_empty_requests;
+    /* requests that waited for an overlapping one, and for how long */
+    uint64_t nr_serialized;
+    uint64_t serialized_time_ns;
 
     /* long-running background operation */
     BlockJob *job;
 
+    /* see bdrv_set_write_interceptor() */
+    BdrvWriteInterceptor *write_interceptor;
 };
 
 int get_tmp_filename(char *filename, int size);
 
-void bdrv_set_io_limits(BlockDriverState *bs,
-                        BlockIOLimit *io_limits);
+void bdrv_set_io_limits(BlockDriverState *bs, ThrottleConfig *cfg);
+void bdrv_get_io_limits(BlockDriverState *bs, ThrottleConfig *cfg);
 
 #ifdef _WIN32
 int is_windows_drive(const char *filename);
@@ -300,6 +423,33 @@ void bdrv_emit_qmp_error_event(const BlockDriverState *bdrv,
                                enum MonitorEvent ev,
                                BlockErrorAction action, bool is_read);
 
+/*
+ * Install @wi on @bs, or remove the current interceptor if @wi is NULL.
+ * Writes that already called before_write still get their after_write
+ * callback from the old interceptor; the owner has to wait for them before
+ * it frees @wi.
+ */
+void bdrv_set_write_interceptor(BlockDriverState *bs,
+                                BdrvWriteInterceptor *wi);
+
+/*
+ * Reads of metadata or data that a .bdrv_check implementation keeps in
+ * flight while it processes earlier ones.  Reads complete in submission
+ * order from the caller's point of view: bdrv_read_queue_next() waits for
+ * the oldest one.
+ */
+typedef struct BdrvReadQueue BdrvReadQueue;
+
+BdrvReadQueue *bdrv_read_queue_new(BlockDriverState *bs, int depth,
+                                   int max_bytes);
+void bdrv_read_queue_free(BdrvReadQueue *q);
+bool bdrv_read_queue_full(BdrvReadQueue *q);
+bool bdrv_read_queue_empty(BdrvReadQueue *q);
+void bdrv_read_queue_submit(BdrvReadQueue *q, int64_t offset, int bytes,
+                            uint64_t tag);
+int bdrv_read_queue_next(BdrvReadQueue *q, void **buf, int64_t *offset,
+                         uint64_t *tag);
+
 /**
  * stream_start:
  * @bs: Block device to operate on.
@@ -308,6 +458,8 @@ void bdrv_emit_qmp_error_event(const BlockDriverState *bdrv,
  * @base_id: The file name that will be written to @bs as the new
  * backing file if the job completes.  Ignored if @base is %NULL.
  * @speed: The maximum speed, in bytes per second, or 0 for unlimited.
+ * @max_in_flight: The maximum number of chunks copied concurrently, or 0
+ * for the default.
  * @on_error: The action to take upon error.
  * @cb: Completion function for the job.
  * @opaque: Opaque pointer value passed to @cb.
@@ -320,7 +472,8 @@ void bdrv_emit_qmp_error_event(const BlockDriverState *bdrv,
  * @base_id in the written image and to @base in the live BlockDriverState.
  */
 void stream_start(BlockDriverState *bs, BlockDriverState *base,
-                  const char *base_id, int64_t speed, BlockdevOnError on_error,
+                  const char *base_id, int64_t speed, int max_in_flight,
+                  BlockdevOnError on_error,
                   BlockDriverCompletionFunc *cb,
                   void *opaque, Error **errp);
 
@@ -329,6 +482,8 @@ void stream_start(BlockDriverState *bs, BlockDriverState *base,
  * @bs: Top Block device
  * @base: Block device that will be written into, and become the new top
  * @speed: The maximum speed, in bytes per second, or 0 for unlimited.
+ * @max_in_flight: The maximum number of chunks copied concurrently, or 0
+ * for the default.
  * @on_error: The action to take upon error.
  * @cb: Completion function for the job.
  * @opaque: Opaque pointer value passed to @cb.
@@ -336,10 +491,36 @@ void stream_start(BlockDriverState *bs, BlockDriverState *base,
  *
  */
 void commit_start(BlockDriverState *bs, BlockDriverState *base,
-                 BlockDriverState *top, int64_t speed,
+                 BlockDriverState *top, int64_t speed, int max_in_flight,
                  BlockdevOnError on_error, BlockDriverCompletionFunc *cb,
                  void *opaque, Error **errp);
 
+/**
+ * backup_start:
+ * @bs: Block device to back up.
+ * @target: Block device to write to.
+ * @bitmap: The dirty bitmap of @bs whose sectors are copied, or %NULL to
+ * copy the whole device.
+ * @speed: The maximum speed, in bytes per second, or 0 for unlimited.
+ * @on_source_error: The action to take upon error reading from the source.
+ * @on_target_error: The action to take upon error writing to the target.
+ * @cb: Completion function for the job.
+ * @opaque: Opaque pointer value passed to @cb.
+ * @errp: Error object.
+ *
+ * Start a point-in-time backup of @bs: @target receives the contents that
+ * @bs had when the job started, copying old data before guest writes
+ * overwrite it.  With @bitmap, only its dirty sectors are copied and the
+ * bitmap is cleared; if the job fails or is cancelled, they are marked
+ * dirty again.  @target is deleted when the job ends.
+ */
+void backup_start(BlockDriverState *bs, BlockDriverState *target,
+                  BdrvDirtyBitmap *bitmap, int64_t speed,
+                  BlockdevOnError on_source_error,
+                  BlockdevOnError on_target_error,
+                  BlockDriverCompletionFunc *cb, void *opaque,
+                  Error **errp);
+
 /*
  * mirror_start:
  * @bs: Block device to operate on.
@@ -348,6 +529,8 @@ void commit_start(BlockDriverState *bs, BlockDriverState *base,
  * @granularity: The chosen granularity for the dirty bitmap.
  * @buf_size: The amount of data that can be in flight at one time.
  * @mode: Whether to collapse all images in the chain to the target.
+ * @copy_mode: Whether guest writes are copied in the background or
+ * written to @target before they complete.
  * @on_source_error: The action to take upon error reading from the source.
  * @on_target_error: The action to take upon error writing to the target.
  * @cb: Completion function for the job.
@@ -361,7 +544,8 @@ void commit_start(BlockDriverState *bs, BlockDriverState *base,
  */
 void mirror_start(BlockDriverState *bs, BlockDriverState *target,
                   int64_t speed, int64_t granularity, int64_t buf_size,
-                  MirrorSyncMode mode, BlockdevOnError on_source_error,
+                  MirrorSyncMode mode, MirrorCopyMode copy_mode,
+                  BlockdevOnError on_source_error,
                   BlockdevOnError on_target_error,
                   BlockDriverCompletionFunc *cb,
                   void *opaque, Error **errp);
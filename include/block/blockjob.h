@@ -26,6 +26,11 @@
 #define BLOCKJOB_H 1
 
 #include "block/block.h"
+#include "qemu/timer.h"
+#include "qemu/ratelimit.h"
+
+/* Time slice used by the rate limit of block jobs */
+#define BLOCK_JOB_SLICE_TIME 100000000ULL /* ns */
 
 /**
  * BlockJobType:
@@ -39,9 +44,6 @@ typedef struct BlockJobType {
     /** String describing the operation, part of query-block-jobs QMP API */
     const char *job_type;
 
-    /** Optional callback for job types that support setting a speed limit */
-    void (*set_speed)(BlockJob *job, int64_t speed, Error **errp);
-
     /** Optional callback for job types that need to forward I/O status reset */
     void (*iostatus_reset)(BlockJob *job);
 
@@ -52,6 +54,34 @@ typedef struct BlockJobType {
     void (*complete)(BlockJob *job, Error **errp);
 } BlockJobType;
 
+/**
+ * BlockJobSched:
+ *
+ * Scheduling state for background I/O on a BlockDriverState.  The I/O is
+ * limited to a maximum speed and, unless its priority is normal, backs off
+ * while guest requests are queuing up on the device or their latency rises
+ * well above what was seen recently.
+ */
+typedef struct BlockJobSched {
+    RateLimit limit;
+    uint64_t speed;
+    BlockJobPriority priority;
+
+    /* Guest request counters at the start of the current sample */
+    int64_t sample_start_ns;
+    uint64_t sample_ops;
+    uint64_t sample_time_ns;
+
+    /* Average guest latency in the last sample, 0 if there was no request */
+    int64_t latency_ns;
+
+    /* Lowest recent latency; it follows higher latencies only slowly */
+    int64_t baseline_ns;
+
+    /* When the current backoff started, 0 if not backing off */
+    int64_t backoff_start_ns;
+} BlockJobSched;
+
 /**
  * BlockJob:
  *
@@ -103,6 +133,9 @@ struct BlockJob {
     /** Speed that was set with @block_job_set_speed.  */
     int64_t speed;
 
+    /** Rate limit and priority of the job's I/O.  */
+    BlockJobSched sched;
+
     /** The completion function that will be called when the job completes.  */
     BlockDriverCompletionFunc *cb;
 
@@ -143,6 +176,47 @@ void *block_job_create(const BlockJobType *job_type, BlockDriverState *bs,
  */
 void block_job_sleep_ns(BlockJob *job, QEMUClock *clock, int64_t ns);
 
+/**
+ * block_job_throttle:
+ * @job: The job that calls the function.
+ * @n: The number of sectors that the job is about to copy.
+ *
+ * Returns: How many nanoseconds the job should sleep before it submits the
+ * I/O for @n sectors, because of its speed limit or because guest I/O on the
+ * device takes precedence.  The I/O is accounted for the rate limit only
+ * when 0 is returned.  @n can be 0 for requests that are not rate limited.
+ */
+int64_t block_job_throttle(BlockJob *job, uint64_t n);
+
+/**
+ * block_job_sched_init:
+ * @sched: The scheduling state to initialize.
+ * @priority: The priority of the I/O relative to guest I/O.
+ *
+ * Initialize the scheduling state for background I/O that is not issued by
+ * a block job, such as block migration.  There is no speed limit until
+ * block_job_sched_set_speed() is called.
+ */
+void block_job_sched_init(BlockJobSched *sched, BlockJobPriority priority);
+
+/**
+ * block_job_sched_set_speed:
+ * @sched: The scheduling state.
+ * @speed: The maximum speed, in bytes per second, or 0 for unlimited.
+ */
+void block_job_sched_set_speed(BlockJobSched *sched, int64_t speed);
+
+/**
+ * block_job_sched_delay:
+ * @sched: The scheduling state.
+ * @bs: The device whose guest I/O takes precedence.
+ * @n: The number of sectors about to be submitted.
+ *
+ * Like block_job_throttle(), for any user of a #BlockJobSched.
+ */
+int64_t block_job_sched_delay(BlockJobSched *sched, BlockDriverState *bs,
+                              uint64_t n);
+
 /**
  * block_job_completed:
  * @job: The job being completed.
@@ -159,11 +233,19 @@ void block_job_completed(BlockJob *job, int ret);
  * @speed: The new value
  * @errp: Error object.
  *
- * Set a rate-limiting parameter for the job; the actual meaning may
- * vary depending on the job type.
+ * Set the maximum speed of the job, in bytes per second, or 0 for unlimited.
  */
 void block_job_set_speed(BlockJob *job, int64_t speed, Error **errp);
 
+/**
+ * block_job_set_priority:
+ * @job: The job to set the priority for.
+ * @priority: The new value
+ *
+ * Set the priority of the job's I/O relative to guest I/O on the device.
+ */
+void block_job_set_priority(BlockJob *job, BlockJobPriority priority);
+
 /**
  * block_job_cancel:
  * @job: The job to be canceled.
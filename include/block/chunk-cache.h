@@ -0,0 +1,86 @@
+/*
+ * Cache of decompressed chunks for read-only compressed image formats
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#ifndef CHUNK_CACHE_H
+#define CHUNK_CACHE_H 1
+
+#include "block/block_int.h"
+
+#define CHUNK_CACHE_SIZE                (16 * 1024 * 1024)
+#define CHUNK_CACHE_MAX_ENTRIES         16
+#define CHUNK_CACHE_READAHEAD           4       /* chunks in flight */
+
+typedef struct ChunkCache ChunkCache;
+
+/* Read chunk @index of @bs and decompress it into @buf.  Runs in a
+ * coroutine; several loads may run at the same time, so the function must
+ * not use per-image decompression state. */
+typedef int coroutine_fn ChunkCacheLoadFunc(BlockDriverState *bs,
+                                            int64_t index, uint8_t *buf);
+
+/**
+ * chunk_cache_new:
+ * @bs: The image the chunks belong to
+ * @chunk_size: Size of the largest decompressed chunk
+ * @load: Fills a chunk
+ *
+ * The cache keeps up to CHUNK_CACHE_MAX_ENTRIES chunks, fewer if they would
+ * take more than CHUNK_CACHE_SIZE bytes, but at least two.  Buffers are only
+ * allocated as the cache fills up.
+ */
+ChunkCache *chunk_cache_new(BlockDriverState *bs, size_t chunk_size,
+                            ChunkCacheLoadFunc *load);
+
+/**
+ * chunk_cache_free:
+ *
+ * Wait for the readahead still in flight, then free the cache.
+ */
+void chunk_cache_free(ChunkCache *c);
+
+/**
+ * chunk_cache_get:
+ * @c: The cache
+ * @index: The chunk to return
+ * @buf: Returns the decompressed data
+ *
+ * Look up chunk @index, loading it if it is not cached.  Concurrent callers
+ * for the same chunk wait for a single load.  On success the chunk stays
+ * in the cache, with *buf valid, until chunk_cache_put().
+ *
+ * Returns: 0 on success, -errno if the chunk could not be loaded.
+ */
+int coroutine_fn chunk_cache_get(ChunkCache *c, int64_t index,
+                                 const uint8_t **buf);
+
+void chunk_cache_put(ChunkCache *c, const uint8_t *buf);
+
+/**
+ * chunk_cache_readahead:
+ * @c: The cache
+ * @index: The chunk being read
+ * @nb_chunks: Number of chunks in the image
+ *
+ * Call on each read.  Once the reads are found to be sequential, the next
+ * CHUNK_CACHE_READAHEAD chunks are loaded in the background, each in its
+ * own coroutine, so that their decompression overlaps.  Readahead never
+ * evicts a chunk that is being used.
+ */
+void chunk_cache_readahead(ChunkCache *c, int64_t index, int64_t nb_chunks);
+
+/**
+ * chunk_cache_inflate:
+ *
+ * Decompress the zlib stream @in into @out in the thread pool, for use by
+ * load functions.  The stream must decompress to exactly @out_len bytes.
+ *
+ * Returns: 0 on success, -EIO if the data is corrupt.
+ */
+int coroutine_fn chunk_cache_inflate(BlockDriverState *bs,
+                                     const uint8_t *in, size_t in_len,
+                                     uint8_t *out, size_t out_len);
+
+#endif
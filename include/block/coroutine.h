@@ -148,6 +148,10 @@ bool qemu_co_queue_empty(CoQueue *queue);
 typedef struct CoMutex {
     bool locked;
     CoQueue queue;
+
+    /* Statistics, reported by the qemu_co_mutex_* trace events */
+    int64_t locked_at;          /* when the current owner got the lock */
+    uint64_t contended;         /* acquisitions that had to wait */
 } CoMutex;
 
 /**
@@ -158,20 +162,34 @@ void qemu_co_mutex_init(CoMutex *mutex);
 
 /**
  * Locks the mutex. If the lock cannot be taken immediately, control is
- * transferred to the caller of the current coroutine.
+ * transferred to the caller of the current coroutine.  Waiting coroutines
+ * get the mutex in the order in which they asked for it.
  */
 void coroutine_fn qemu_co_mutex_lock(CoMutex *mutex);
 
 /**
- * Unlocks the mutex and schedules the next coroutine that was waiting for this
- * lock to be run.
+ * Unlocks the mutex and hands it over to the next coroutine that was waiting
+ * for this lock, which is scheduled to run.
  */
 void coroutine_fn qemu_co_mutex_unlock(CoMutex *mutex);
 
+/**
+ * Provides a read/write lock that can be used to synchronise coroutines.
+ *
+ * The lock is phase-fair: readers that arrive while a writer holds or waits
+ * for the lock queue up behind it, and all of them get in together when the
+ * writer is done, before the next writer.  Neither side can be starved.
+ */
 typedef struct CoRwlock {
     bool writer;
     int reader;
-    CoQueue queue;
+    int pending_writers;
+    CoQueue rqueue;
+    CoQueue wqueue;
+
+    /* Statistics, reported by the qemu_co_rwlock_* trace events */
+    int64_t locked_at;          /* when the writer or the readers got in */
+    uint64_t contended;         /* acquisitions that had to wait */
 } CoRwlock;
 
 /**
@@ -182,8 +200,8 @@ void qemu_co_rwlock_init(CoRwlock *lock);
 
 /**
  * Read locks the CoRwlock. If the lock cannot be taken immediately because
- * of a parallel writer, control is transferred to the caller of the current
- * coroutine.
+ * of a parallel or waiting writer, control is transferred to the caller of
+ * the current coroutine.
  */
 void qemu_co_rwlock_rdlock(CoRwlock *lock);
 
@@ -28,6 +28,13 @@
 #include "qemu/queue.h"
 #include "block/coroutine.h"
 
+enum {
+    COROUTINE_STACK_SIZE = 1 << 20,
+
+    /* Number of stacks that a thread maps at once */
+    COROUTINE_STACK_BATCH = 16,
+};
+
 typedef enum {
     COROUTINE_YIELD = 1,
     COROUTINE_TERMINATE = 2,
@@ -39,11 +46,15 @@ struct Coroutine {
     Coroutine *caller;
     QSLIST_ENTRY(Coroutine) pool_next;
     QTAILQ_ENTRY(Coroutine) co_queue_next;
+
+    /* Coroutines woken up by this one, entered as soon as it yields */
+    QTAILQ_HEAD(, Coroutine) co_queue_wakeup;
 };
 
 Coroutine *qemu_coroutine_new(void);
 void qemu_coroutine_delete(Coroutine *co);
 CoroutineAction qemu_coroutine_switch(Coroutine *from, Coroutine *to,
                                       CoroutineAction action);
+void coroutine_fn qemu_co_queue_run_restart(Coroutine *co);
 
 #endif
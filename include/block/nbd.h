@@ -23,6 +23,8 @@
 
 #include "qemu-common.h"
 
+#define NBD_REQUEST_SIZE        (4 + 4 + 8 + 8 + 4)
+
 struct nbd_request {
     uint32_t magic;
     uint32_t type;
@@ -35,14 +37,33 @@ struct nbd_reply {
     uint32_t magic;
     uint32_t error;
     uint64_t handle;
+    /* Only for structured reply chunks */
+    uint16_t flags;
+    uint16_t type;
+    uint32_t length;
 } QEMU_PACKED;
 
+/* Filled in by nbd_receive_negotiate() */
+typedef struct NBDExportInfo {
+    bool structured_reply;      /* Server sends structured replies */
+    bool base_allocation;       /* Server supports NBD_CMD_BLOCK_STATUS */
+    uint32_t meta_context_id;   /* Context id of "base:allocation" */
+    uint32_t min_block;         /* Block sizes, 0 if not known */
+    uint32_t opt_block;
+    uint32_t max_block;         /* Largest payload of a request */
+} NBDExportInfo;
+
 #define NBD_FLAG_HAS_FLAGS      (1 << 0)        /* Flags are there */
 #define NBD_FLAG_READ_ONLY      (1 << 1)        /* Device is read-only */
 #define NBD_FLAG_SEND_FLUSH     (1 << 2)        /* Send FLUSH */
 #define NBD_FLAG_SEND_FUA       (1 << 3)        /* Send FUA (Force Unit Access) */
 #define NBD_FLAG_ROTATIONAL     (1 << 4)        /* Use elevator algorithm - rotational media */
 #define NBD_FLAG_SEND_TRIM      (1 << 5)        /* Send TRIM (discard) */
+#define NBD_FLAG_CAN_MULTI_CONN (1 << 8)        /* Multiple connections are safe */
+
+/* Handshake flags sent by the server and by the client */
+#define NBD_FLAG_FIXED_NEWSTYLE   (1 << 0)
+#define NBD_FLAG_C_FIXED_NEWSTYLE (1 << 0)
 
 #define NBD_CMD_MASK_COMMAND	0x0000ffff
 #define NBD_CMD_FLAG_FUA	(1 << 16)
@@ -52,12 +73,31 @@ enum {
     NBD_CMD_WRITE = 1,
     NBD_CMD_DISC = 2,
     NBD_CMD_FLUSH = 3,
-    NBD_CMD_TRIM = 4
+    NBD_CMD_TRIM = 4,
+    NBD_CMD_BLOCK_STATUS = 7
 };
 
+/* Structured reply chunks */
+#define NBD_REPLY_FLAG_DONE             (1 << 0)
+
+#define NBD_REPLY_TYPE_NONE             0
+#define NBD_REPLY_TYPE_OFFSET_DATA      1
+#define NBD_REPLY_TYPE_OFFSET_HOLE      2
+#define NBD_REPLY_TYPE_BLOCK_STATUS     5
+#define NBD_REPLY_TYPE_ERROR            ((1 << 15) + 1)
+#define NBD_REPLY_TYPE_ERROR_OFFSET     ((1 << 15) + 2)
+#define NBD_REPLY_TYPE_IS_ERROR(type)   (((type) & (1 << 15)) != 0)
+
+/* Block status flags of the "base:allocation" metadata context */
+#define NBD_STATE_HOLE  (1 << 0)
+#define NBD_STATE_ZERO  (1 << 1)
+#define NBD_META_BASE_ALLOCATION "base:allocation"
+
 #define NBD_DEFAULT_PORT	10809
 
 #define NBD_BUFFER_SIZE (1024*1024)
+/* Largest payload that the server accepts */
+#define NBD_MAX_BUFFER_SIZE (32*1024*1024)
 
 ssize_t nbd_wr_sync(int fd, void *buffer, size_t size, bool do_read);
 int tcp_socket_outgoing(const char *address, uint16_t port);
@@ -68,10 +108,13 @@ int unix_socket_outgoing(const char *path);
 int unix_socket_incoming(const char *path);
 
 int nbd_receive_negotiate(int csock, const char *name, uint32_t *flags,
-                          off_t *size, size_t *blocksize);
+                          off_t *size, size_t *blocksize,
+                          NBDExportInfo *info);
 int nbd_init(int fd, int csock, uint32_t flags, off_t size, size_t blocksize);
+void nbd_encode_request(uint8_t *buf, struct nbd_request *request);
 ssize_t nbd_send_request(int csock, struct nbd_request *request);
 ssize_t nbd_receive_reply(int csock, struct nbd_reply *reply);
+bool nbd_reply_is_structured(struct nbd_reply *reply);
 int nbd_client(int fd);
 int nbd_disconnect(int fd);
 
@@ -81,6 +124,7 @@ typedef struct NBDClient NBDClient;
 NBDExport *nbd_export_new(BlockDriverState *bs, off_t dev_offset,
                           off_t size, uint32_t nbdflags,
                           void (*close)(NBDExport *));
+void nbd_export_set_max_requests(NBDExport *exp, int max_requests);
 void nbd_export_close(NBDExport *exp);
 void nbd_export_get(NBDExport *exp);
 void nbd_export_put(NBDExport *exp);
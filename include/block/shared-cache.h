@@ -0,0 +1,55 @@
+/*
+ * Cluster cache for read-only images, shared between QEMU processes
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#ifndef SHARED_CACHE_H
+#define SHARED_CACHE_H 1
+
+#include "block/block_int.h"
+
+#define SHARED_CACHE_DEFAULT_SIZE   (256 * 1024 * 1024)
+
+/**
+ * shared_cache_open:
+ * @path: The cache file, preferably on tmpfs
+ * @size: Size of the cache file if it has to be created
+ * @errp: Error object
+ *
+ * Map the cache file at @path, creating and formatting it if it is empty.
+ * An existing cache keeps its geometry and @size is ignored.  Opening the
+ * same path again in one process returns the existing mapping with a new
+ * reference.
+ *
+ * Returns: The cache, or NULL on error.
+ */
+SharedCache *shared_cache_open(const char *path, int64_t size, Error **errp);
+
+SharedCache *shared_cache_ref(SharedCache *c);
+void shared_cache_unref(SharedCache *c);
+
+/**
+ * shared_cache_image_key:
+ * @bs: An opened image
+ *
+ * Compute the key that identifies the contents of @bs in the cache.  The
+ * key covers the format, the identity and modification time of the image
+ * file and the keys of the backing chain, so that every process that opens
+ * the same unmodified chain arrives at the same key.
+ *
+ * Returns: The key, or 0 if @bs cannot be identified reliably.
+ */
+uint64_t shared_cache_image_key(BlockDriverState *bs);
+
+/**
+ * shared_cache_co_readv:
+ *
+ * Read through bs->shared_cache.  Hits are copied from the cache; misses are
+ * read from the driver in whole clusters and added to the cache.
+ */
+int coroutine_fn shared_cache_co_readv(BlockDriverState *bs,
+                                       int64_t sector_num, int nb_sectors,
+                                       QEMUIOVector *qiov);
+
+#endif
@@ -26,9 +26,27 @@
 
 typedef int ThreadPoolFunc(void *opaque);
 
-BlockDriverAIOCB *thread_pool_submit_aio(ThreadPoolFunc *func, void *arg,
+typedef struct ThreadPool ThreadPool;
+
+/* A pool of worker threads whose completions run in @ctx.  Use
+ * aio_get_thread_pool() to get the pool of an AioContext. */
+ThreadPool *thread_pool_new(struct AioContext *ctx);
+void thread_pool_free(ThreadPool *pool);
+
+BlockDriverAIOCB *thread_pool_submit_aio(ThreadPool *pool,
+     ThreadPoolFunc *func, void *arg,
      BlockDriverCompletionFunc *cb, void *opaque);
-int coroutine_fn thread_pool_submit_co(ThreadPoolFunc *func, void *arg);
-void thread_pool_submit(ThreadPoolFunc *func, void *arg);
+int coroutine_fn thread_pool_submit_co(ThreadPool *pool,
+                                       ThreadPoolFunc *func, void *arg);
+void thread_pool_submit(ThreadPool *pool, ThreadPoolFunc *func, void *arg);
+
+/* Keep between @min_threads and @max_threads workers; idle workers above
+ * the minimum exit after @idle_timeout milliseconds. */
+void thread_pool_set_params(ThreadPool *pool, int min_threads,
+                            int max_threads, int idle_timeout);
+
+/* Parameters for the pools that are created from now on. */
+void thread_pool_set_default_params(int min_threads, int max_threads,
+                                    int idle_timeout);
 
 #endif
@@ -0,0 +1,49 @@
+/*
+ * Throttle groups: drives that share one set of I/O limits
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#ifndef THROTTLE_GROUPS_H
+#define THROTTLE_GROUPS_H 1
+
+#include "block/block_int.h"
+
+/**
+ * throttle_group_register_bs:
+ * @bs: The BlockDriverState to throttle
+ * @groupname: The group to join, created if it does not exist yet
+ *
+ * Add @bs to a throttle group.  A newly created group has no limits.
+ */
+void throttle_group_register_bs(BlockDriverState *bs, const char *groupname);
+
+/**
+ * throttle_group_unregister_bs:
+ * @bs: The BlockDriverState to remove from its group
+ *
+ * Requests that are still waiting are restarted without further
+ * throttling.  The group is freed when its last member leaves.
+ */
+void throttle_group_unregister_bs(BlockDriverState *bs);
+
+const char *throttle_group_get_name(BlockDriverState *bs);
+
+/* Configure the limits that all members of the group of @bs share */
+void throttle_group_config(BlockDriverState *bs, ThrottleConfig *cfg);
+void throttle_group_get_config(BlockDriverState *bs, ThrottleConfig *cfg);
+
+/**
+ * throttle_group_co_io_limits_intercept:
+ * @bs: The BlockDriverState issuing the request
+ * @bytes: The size of the request
+ * @is_write: Direction of the request
+ *
+ * Wait until the group has budget for the request and account it.
+ * Members that have requests waiting are served in round-robin order.
+ */
+void coroutine_fn throttle_group_co_io_limits_intercept(BlockDriverState *bs,
+                                                        unsigned int bytes,
+                                                        bool is_write);
+
+#endif
@@ -56,6 +56,10 @@ typedef void IOEventHandler(void *opaque, int event);
 struct CharDriverState {
     void (*init)(struct CharDriverState *s);
     int (*chr_write)(struct CharDriverState *s, const uint8_t *buf, int len);
+    int (*chr_writev)(struct CharDriverState *s, struct iovec *iov,
+                      int iovcnt);
+    int (*chr_notify_writable)(struct CharDriverState *s, IOHandler *cb,
+                               void *opaque);
     void (*chr_update_read_handler)(struct CharDriverState *s);
     int (*chr_ioctl)(struct CharDriverState *s, int cmd, void *arg);
     int (*get_msgfd)(struct CharDriverState *s);
@@ -165,6 +169,34 @@ void qemu_chr_fe_printf(CharDriverState *s, const char *fmt, ...)
  */
 int qemu_chr_fe_write(CharDriverState *s, const uint8_t *buf, int len);
 
+/**
+ * @qemu_chr_fe_writev:
+ *
+ * Write a scatter/gather list to a character backend.  Backends that
+ * support it write as much as they can take without blocking in a single
+ * system call; the others get one qemu_chr_fe_write() per element.
+ *
+ * @iov the data; it is unchanged on return
+ * @iovcnt the number of elements in @iov
+ *
+ * Returns: the number of bytes consumed, which may be less than requested,
+ *          -EAGAIN if the backend can't take any data right now, or another
+ *          negative errno value on failure
+ */
+int qemu_chr_fe_writev(CharDriverState *s, struct iovec *iov, int iovcnt);
+
+/**
+ * @qemu_chr_fe_notify_writable:
+ *
+ * Ask the backend to call @cb once, from the main loop, when it can take
+ * data again after qemu_chr_fe_writev() consumed less than requested.
+ * A new request replaces the pending one; @cb == NULL cancels it.
+ *
+ * Returns: 0 on success, -ENOTSUP if the backend can't tell
+ */
+int qemu_chr_fe_notify_writable(CharDriverState *s, IOHandler *cb,
+                                void *opaque);
+
 /**
  * @qemu_chr_fe_ioctl:
  *
@@ -479,6 +479,8 @@ extern ram_addr_t ram_size;
 
 /* RAM is pre-allocated and passed into qemu_ram_alloc_from_ptr */
 #define RAM_PREALLOC_MASK   (1 << 0)
+/* mapped copy-on-write from -machine ram-template */
+#define RAM_TEMPLATE_MASK   (1 << 1)
 
 typedef struct RAMBlock {
     struct MemoryRegion *mr;
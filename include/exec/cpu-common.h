@@ -55,6 +55,11 @@ void qemu_put_ram_ptr(void *addr);
 /* This should not be used by devices.  */
 int qemu_ram_addr_from_host(void *ptr, ram_addr_t *ram_addr);
 ram_addr_t qemu_ram_addr_from_host_nofail(void *ptr);
+int qemu_ram_get_fd(void *ptr, ram_addr_t *offset);
+/* True if background preallocation has not reached the page at @host and
+ * nobody else touched it, so that it still reads as zeroes.
+ */
+bool qemu_ram_page_unpopulated(void *host);
 void qemu_ram_set_idstr(ram_addr_t addr, const char *name, DeviceState *dev);
 
 void cpu_physical_memory_rw(hwaddr addr, uint8_t *buf,
@@ -78,6 +83,17 @@ void *cpu_register_map_client(void *opaque, void (*callback)(void *opaque));
 
 bool cpu_physical_memory_is_io(hwaddr phys_addr);
 
+void cpu_physical_memory_set_dirty_lebitmap(unsigned long *bitmap,
+                                            ram_addr_t start,
+                                            ram_addr_t pages);
+void cpu_physical_memory_set_dirty_log_page(ram_addr_t addr);
+void cpu_physical_memory_set_migration_bitmap(unsigned long *bitmap,
+                                              ram_addr_t pages,
+                                              uint64_t *dirty_count);
+void cpu_physical_memory_sync_migration_bitmap(void);
+void cpu_physical_memory_discard_migration_range(ram_addr_t start,
+                                                 ram_addr_t length);
+
 /* Coalesced MMIO regions are areas where write operations can be reordered.
  * This usually implies that write operations are side-effect free.  This allows
  * batching which can make a major impact on performance when using
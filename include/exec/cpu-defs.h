@@ -78,6 +78,10 @@ typedef uint64_t target_ulong __attribute__((aligned(TARGET_LONG_ALIGNMENT)));
 #if !defined(CONFIG_USER_ONLY)
 #define CPU_TLB_BITS 8
 #define CPU_TLB_SIZE (1 << CPU_TLB_BITS)
+/* Fully associative, holds the entries most recently evicted from the
+   direct mapped tlb_table */
+#define CPU_VTLB_SIZE 8
+#define CPU_TLB_EMPTY_LONGS (CPU_TLB_SIZE / HOST_LONG_BITS)
 
 #if HOST_LONG_BITS == 32 && TARGET_LONG_BITS == 32
 #define CPU_TLB_ENTRY_BITS 4
@@ -111,8 +115,21 @@ extern int CPUTLBEntry_wrong_size[sizeof(CPUTLBEntry) == (1 << CPU_TLB_ENTRY_BIT
     /* The meaning of the MMU modes is defined in the target code. */   \
     CPUTLBEntry tlb_table[NB_MMU_MODES][CPU_TLB_SIZE];                  \
     hwaddr iotlb[NB_MMU_MODES][CPU_TLB_SIZE];               \
+    CPUTLBEntry tlb_v_table[NB_MMU_MODES][CPU_VTLB_SIZE];               \
+    hwaddr iotlb_v[NB_MMU_MODES][CPU_VTLB_SIZE];                        \
+    /* a set bit means that the tlb_table entry is known to be empty,   \
+       so that tlb_flush() only has to clear the others */              \
+    unsigned long tlb_empty[NB_MMU_MODES][CPU_TLB_EMPTY_LONGS];         \
+    unsigned int vtlb_index;                                            \
     target_ulong tlb_flush_addr;                                        \
-    target_ulong tlb_flush_mask;
+    target_ulong tlb_flush_mask;                                        \
+    /* the dispatch the iotlb entries index into, read under RCU */     \
+    struct AddressSpaceDispatch *memory_dispatch;                       \
+    /* statistics */                                                    \
+    uint64_t tlb_fill_count;                                            \
+    uint64_t tlb_victim_hit_count;                                      \
+    uint64_t tlb_flush_entries;                                         \
+    uint64_t tlb_flush_avoided;
 
 #else
 
@@ -172,6 +189,8 @@ typedef struct CPUWatchpoint {
         icount_decr_u16 u16;                                            \
     } icount_decr;                                                      \
     uint32_t can_do_io; /* nonzero if memory mapped IO is safe.  */     \
+    /* nonzero to leave chained TBs at the next TB entry (MTTCG) */    \
+    uint32_t tcg_exit_req;                                              \
                                                                         \
     /* from this point: preserved by CPU reset */                       \
     /* ice debug support */                                             \
@@ -35,6 +35,7 @@ extern int tlb_flush_count;
 /* exec.c */
 void tb_flush_jmp_cache(CPUArchState *env, target_ulong addr);
 hwaddr memory_region_section_get_iotlb(CPUArchState *env,
+                                                   struct AddressSpaceDispatch *d,
                                                    MemoryRegionSection *section,
                                                    target_ulong vaddr,
                                                    hwaddr paddr,
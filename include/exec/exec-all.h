@@ -76,6 +76,18 @@ void gen_intermediate_code(CPUArchState *env, struct TranslationBlock *tb);
 void gen_intermediate_code_pc(CPUArchState *env, struct TranslationBlock *tb);
 void restore_state_to_opc(CPUArchState *env, struct TranslationBlock *tb,
                           int pc_pos);
+#ifdef TARGET_INSN_EXTRA_WORDS
+/* Targets that define TARGET_INSN_EXTRA_WORDS get a restore table in each
+   TB, and cpu_restore_state() does not need to translate the TB again.
+   Besides gen_opc_pc[], the table keeps that many words of the state that
+   restore_state_to_opc() reads at pc_pos; if there are any, these two
+   functions copy them out of and back into the target's gen_opc_* arrays.
+   tb->size and tb->icount must be set in both translation modes.  */
+#if TARGET_INSN_EXTRA_WORDS > 0
+void gen_opc_get_extra(int pc_pos, target_ulong *extra);
+void gen_opc_set_extra(int pc_pos, const target_ulong *extra);
+#endif
+#endif
 
 void cpu_gen_init(void);
 int cpu_gen_code(CPUArchState *env, struct TranslationBlock *tb,
@@ -87,6 +99,8 @@ void QEMU_NORETURN cpu_io_recompile(CPUArchState *env, uintptr_t retaddr);
 TranslationBlock *tb_gen_code(CPUArchState *env, 
                               target_ulong pc, target_ulong cs_base, int flags,
                               int cflags);
+TranslationBlock *tb_gen_superblock(CPUArchState *env, TranslationBlock *tb);
+void *tb_lookup_ptr(CPUArchState *env);
 void cpu_exec_init(CPUArchState *env);
 void QEMU_NORETURN cpu_loop_exit(CPUArchState *env1);
 int page_unprotect(target_ulong address, uintptr_t pc, void *puc);
@@ -98,6 +112,15 @@ void tb_invalidate_phys_range(tb_page_addr_t start, tb_page_addr_t end,
 /* cputlb.c */
 void tlb_flush_page(CPUArchState *env, target_ulong addr);
 void tlb_flush(CPUArchState *env, int flush_global);
+void tlb_flush_async(CPUArchState *env);
+/* Flush only the MMU modes whose bit is set in IDXMAP, or only the pages
+   of a virtual address range.  They count as avoided full flushes.  */
+void tlb_flush_by_mmuidx(CPUArchState *env, uint16_t idxmap);
+void tlb_flush_page_by_mmuidx(CPUArchState *env, target_ulong addr,
+                              uint16_t idxmap);
+void tlb_flush_range(CPUArchState *env, target_ulong start, target_ulong len);
+void tlb_flush_range_by_mmuidx(CPUArchState *env, target_ulong start,
+                               target_ulong len, uint16_t idxmap);
 void tlb_set_page(CPUArchState *env, target_ulong vaddr,
                   hwaddr paddr, int prot,
                   int mmu_idx, target_ulong size);
@@ -110,13 +133,36 @@ static inline void tlb_flush_page(CPUArchState *env, target_ulong addr)
 static inline void tlb_flush(CPUArchState *env, int flush_global)
 {
 }
+
+static inline void tlb_flush_async(CPUArchState *env)
+{
+}
+
+static inline void tlb_flush_by_mmuidx(CPUArchState *env, uint16_t idxmap)
+{
+}
+
+static inline void tlb_flush_page_by_mmuidx(CPUArchState *env,
+                                            target_ulong addr,
+                                            uint16_t idxmap)
+{
+}
+
+static inline void tlb_flush_range(CPUArchState *env, target_ulong start,
+                                   target_ulong len)
+{
+}
+
+static inline void tlb_flush_range_by_mmuidx(CPUArchState *env,
+                                             target_ulong start,
+                                             target_ulong len,
+                                             uint16_t idxmap)
+{
+}
 #endif
 
 #define CODE_GEN_ALIGN           16 /* must be >= of the size of a icache line */
 
-#define CODE_GEN_PHYS_HASH_BITS     15
-#define CODE_GEN_PHYS_HASH_SIZE     (1 << CODE_GEN_PHYS_HASH_BITS)
-
 /* estimated block size for TB allocation */
 /* XXX: use a per code average code fragment size and modulate it
    according to the host CPU */
@@ -139,13 +185,16 @@ struct TranslationBlock {
     uint64_t flags; /* flags defining in which context the code was generated */
     uint16_t size;      /* size of target code for this block (1 <=
                            size <= TARGET_PAGE_SIZE) */
-    uint16_t cflags;    /* compile flags */
+    uint16_t region;    /* code buffer region holding the block */
+    uint32_t cflags;    /* compile flags */
 #define CF_COUNT_MASK  0x7fff
 #define CF_LAST_IO     0x8000 /* Last insn may be an IO access.  */
+#define CF_INVALID     0x10000 /* removed by tb_phys_invalidate() */
+#define CF_SUPERBLOCK  0x20000 /* frontend may follow direct jumps */
 
     uint8_t *tc_ptr;    /* pointer to the translated code */
-    /* next matching tb for physical address. */
-    struct TranslationBlock *phys_hash_next;
+    /* restore table following the translated code, or NULL */
+    uint8_t *tc_search;
     /* first and second physical page containing code. The lower bit
        of the pointer tells the index in page_next[] */
     struct TranslationBlock *page_next[2];
@@ -166,23 +215,93 @@ struct TranslationBlock {
     struct TranslationBlock *jmp_next[2];
     struct TranslationBlock *jmp_first;
     uint32_t icount;
+    /* executions, counted by frontends that can build superblocks */
+    uint32_t exec_count;
+    /* with -machine tcg-profile: executions, and host ticks spent in the
+       TB and in the helpers that it called */
+    uint64_t prof_count;
+    uint64_t prof_ticks;
+    uint64_t prof_helper_ticks;
 };
 
+/* Executions after which a TB is retranslated as a superblock, 0 if
+   superblocks are disabled */
+extern unsigned int tcg_superblock_threshold;
+
+/* Print the TBs that took the most host ticks with -machine tcg-profile,
+   at most @max of them */
+void dump_tb_profile(FILE *f, fprintf_function cpu_fprintf, int max);
+
+/* Print the code generation counters as one line of key=value pairs,
+   for benchmark scripts */
+void dump_tb_stats(FILE *f, fprintf_function cpu_fprintf);
+
+static inline bool tb_is_hot(TranslationBlock *tb)
+{
+    return tcg_superblock_threshold && tb->cflags == 0 &&
+           tb->exec_count >= tcg_superblock_threshold;
+}
+
 #include "exec/spinlock.h"
+#include "qemu/qht.h"
 
 typedef struct TBContext TBContext;
 
+/* When the code buffer is full, only one of its regions is emptied; the
+   one picked is the least executed since the previous eviction. */
+#define TB_MAX_REGIONS 8
+
+typedef struct TBRegion {
+    uint8_t *code_start;
+    /* no TB may start past this point, a TB can take up to
+       TCG_MAX_OP_SIZE * OPC_BUF_SIZE bytes */
+    uint8_t *code_end;
+    /* end of the generated code, except for the current region where
+       tcg_ctx.code_gen_ptr is used */
+    uint8_t *code_ptr;
+    int first_tb;
+    int nb_tbs;
+    /* TBs entered from cpu_exec(), halved at each eviction */
+    unsigned long exec_count;
+} TBRegion;
+
 struct TBContext {
 
     TranslationBlock *tbs;
-    TranslationBlock *tb_phys_hash[CODE_GEN_PHYS_HASH_SIZE];
+    /* TBs by physical pc, pc and flags; see tb_hash_func() */
+    QHT htable;
     int nb_tbs;
     /* any access to the tbs or the page table must use this lock */
     spinlock_t tb_lock;
 
+    TBRegion regions[TB_MAX_REGIONS];
+    int nb_regions;
+    int cur_region;
+    int tbs_per_region;
+    size_t region_size;
+
     /* statistics */
     int tb_flush_count;
     int tb_phys_invalidate_count;
+    unsigned long tb_lookup_count;
+    unsigned long tb_lookup_hit_count;
+    int tb_evict_count;
+    unsigned long tb_evicted_tbs;
+    int tb_superblock_count;
+    /* TBs entered from cpu_exec() rather than through a chained jump */
+    unsigned long tb_dispatch_count;
+    /* every TB generated so far, including flushed ones */
+    unsigned long tb_gen_count;
+    uint64_t tb_gen_insns;
+    uint64_t tb_gen_host_bytes;
+    /* TB executions and their guest instructions, with tcg_tb_profile */
+    uint64_t tb_prof_exec_count;
+    uint64_t tb_prof_exec_insns;
+    /* time spent in full flushes and evictions, in ns */
+    int64_t tb_flush_time;
+    int64_t tb_flush_time_max;
+    int64_t tb_evict_time;
+    int64_t tb_evict_time_max;
 
     int tb_invalidated_flag;
 };
@@ -202,15 +321,48 @@ static inline unsigned int tb_jmp_cache_hash_func(target_ulong pc)
 	    | (tmp & TB_JMP_ADDR_MASK));
 }
 
-static inline unsigned int tb_phys_hash_func(tb_page_addr_t pc)
+static inline uint32_t tb_hash_func(tb_page_addr_t phys_pc, target_ulong pc,
+                                    uint64_t flags)
 {
-    return (pc >> 2) & (CODE_GEN_PHYS_HASH_SIZE - 1);
+    uint64_t h;
+
+    /* mix the bits with the finalizer of MurmurHash3 */
+    h = (uint64_t)phys_pc ^ ((uint64_t)pc << 20) ^
+        (flags * 0x9e3779b97f4a7c15ULL);
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
 }
 
 void tb_free(TranslationBlock *tb);
 void tb_flush(CPUArchState *env);
 void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr);
 
+#if defined(CONFIG_USER_ONLY)
+static inline void tb_lock(void)
+{
+}
+
+static inline void tb_unlock(void)
+{
+}
+
+static inline void tb_lock_reset(void)
+{
+}
+#else
+/* With multi-threaded TCG, tb_lock serializes the translation,
+   invalidation and chaining of TBs between vCPU threads.  It nests, and
+   tb_lock_reset() drops it after a longjmp back into cpu_exec().  */
+void tb_lock(void);
+void tb_unlock(void);
+void tb_lock_reset(void);
+void tb_flush_if_pending(CPUArchState *env);
+#endif
+
 #if defined(USE_DIRECT_JUMP)
 
 #if defined(CONFIG_TCG_INTERPRETER)
@@ -349,14 +501,18 @@ bool is_tcg_gen_code(uintptr_t pc_ptr);
 
 #if !defined(CONFIG_USER_ONLY)
 
-struct MemoryRegion *iotlb_to_region(hwaddr index);
+struct MemoryRegion *iotlb_to_region(CPUArchState *env, hwaddr index);
 uint64_t io_mem_read(struct MemoryRegion *mr, hwaddr addr,
                      unsigned size);
 void io_mem_write(struct MemoryRegion *mr, hwaddr addr,
                   uint64_t value, unsigned size);
+void notdirty_mem_write_host(CPUArchState *env, ram_addr_t ram_addr,
+                             void *host, uint64_t val, unsigned size);
 
 void tlb_fill(CPUArchState *env1, target_ulong addr, int is_write, int mmu_idx,
               uintptr_t retaddr);
+bool tlb_victim_hit(CPUArchState *env, int mmu_idx, int index,
+                    size_t elt_ofs, target_ulong addr);
 
 #include "exec/softmmu_defs.h"
 
@@ -385,6 +541,24 @@ static inline tb_page_addr_t get_page_addr_code(CPUArchState *env1, target_ulong
 {
     return addr;
 }
+
+/* translate-all.c */
+TranslationBlock *tb_gen_cached(CPUArchState *env, const TranslationBlock *desc,
+                                const uint8_t *code, int code_size,
+                                bool (*relocate)(TranslationBlock *tb,
+                                                 void *opaque),
+                                void *opaque);
+
+/* tb-cache.c */
+void tb_cache_init(const char *dir, uint64_t max_size, const char *cpu_model);
+void tb_cache_map(target_ulong start, target_ulong len, int prot, int fd,
+                  off_t offset);
+void tb_cache_unmap(target_ulong start, target_ulong len);
+void tb_cache_protect(target_ulong start, target_ulong len, int prot);
+TranslationBlock *tb_cache_find(CPUArchState *env, target_ulong pc,
+                                target_ulong cs_base, uint64_t flags);
+void tb_cache_add(TranslationBlock *tb, int code_size);
+void tb_cache_save(void);
 #else
 /* cputlb.c */
 tb_page_addr_t get_page_addr_code(CPUArchState *env1, target_ulong addr);
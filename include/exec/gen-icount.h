@@ -2,16 +2,29 @@
 #define GEN_ICOUNT_H 1
 
 #include "qemu/timer.h"
+#include "sysemu/cpus.h"
 
 /* Helpers for instruction counting code generation.  */
 
 static TCGArg *icount_arg;
 static int icount_label;
+static int exitreq_label;
 
 static inline void gen_icount_start(void)
 {
     TCGv_i32 count;
 
+    if (mttcg_enabled) {
+        /* other threads cannot unchain TBs safely; leave the chain at
+           TB entry when they set tcg_exit_req instead */
+        TCGv_i32 flag = tcg_temp_new_i32();
+
+        exitreq_label = gen_new_label();
+        tcg_gen_ld_i32(flag, cpu_env, offsetof(CPUArchState, tcg_exit_req));
+        tcg_gen_brcondi_i32(TCG_COND_NE, flag, 0, exitreq_label);
+        tcg_temp_free_i32(flag);
+    }
+
     if (!use_icount)
         return;
 
@@ -29,6 +42,10 @@ static inline void gen_icount_start(void)
 
 static void gen_icount_end(TranslationBlock *tb, int num_insns)
 {
+    if (mttcg_enabled) {
+        gen_set_label(exitreq_label);
+        tcg_gen_exit_tb((tcg_target_long)tb + 3);
+    }
     if (use_icount) {
         *icount_arg = num_insns;
         gen_set_label(icount_label);
@@ -36,6 +53,27 @@ static void gen_icount_end(TranslationBlock *tb, int num_insns)
     }
 }
 
+/* For frontends that build superblocks: count the executions of a TB
+   until cpu_exec() finds it hot and calls tb_gen_superblock().  */
+static inline void gen_tb_exec_count(TranslationBlock *tb)
+{
+    TCGv_ptr ptr;
+    TCGv_i32 count;
+
+    /* a retranslation for cpu_restore_state() must generate the same
+       ops, even if the TB was invalidated since */
+    if (!tcg_superblock_threshold || (tb->cflags & ~CF_INVALID) != 0) {
+        return;
+    }
+    ptr = tcg_const_ptr((tcg_target_long)&tb->exec_count);
+    count = tcg_temp_new_i32();
+    tcg_gen_ld_i32(count, ptr, 0);
+    tcg_gen_addi_i32(count, count, 1);
+    tcg_gen_st_i32(count, ptr, 0);
+    tcg_temp_free_i32(count);
+    tcg_temp_free_ptr(ptr);
+}
+
 static inline void gen_io_start(void)
 {
     TCGv_i32 tmp = tcg_const_i32(1);
@@ -68,6 +68,10 @@ struct MemoryRegionOps {
                   unsigned size);
 
     enum device_endian endianness;
+    /* If true, @read and @write do their own locking and may be called
+     * without the iothread lock, e.g. straight from a vCPU thread.
+     */
+    bool thread_safe;
     /* Guest-visible constraints: */
     struct {
         /* If nonzero, specify bounds on access sizes beyond which a machine
@@ -115,6 +119,7 @@ struct MemoryRegionOps {
 
 typedef struct CoalescedMemoryRange CoalescedMemoryRange;
 typedef struct MemoryRegionIoeventfd MemoryRegionIoeventfd;
+typedef struct MemoryRegionDoorbell MemoryRegionDoorbell;
 
 struct MemoryRegion {
     /* All fields are private - violators will be prosecuted */
@@ -136,6 +141,7 @@ struct MemoryRegion {
     bool flush_coalesced_mmio;
     MemoryRegion *alias;
     hwaddr alias_offset;
+    bool aliased; /* Some alias region points here */
     unsigned priority;
     bool may_overlap;
     QTAILQ_HEAD(subregions, MemoryRegion) subregions;
@@ -169,7 +175,24 @@ struct AddressSpace {
     struct FlatView *current_map;
     int ioeventfd_nb;
     struct MemoryRegionIoeventfd *ioeventfds;
+    /* Read with RCU; replaced on every memory map change */
     struct AddressSpaceDispatch *dispatch;
+    /* Being built while a memory map change is committed */
+    struct AddressSpaceDispatch *next_dispatch;
+    struct MemoryListener *dispatch_listener;
+    /* Addresses to render again at the end of the current transaction,
+     * or the whole map if update_all is set
+     */
+    bool update_all;
+    Int128 update_start;
+    Int128 update_end;
+    /* address_space_map() of non-RAM regions, see exec.c */
+    QLIST_HEAD(, BounceBuffer) bounce_buffers;
+    QLIST_HEAD(, MapClient) map_clients;
+    hwaddr bounce_in_use;
+    uint64_t bounce_maps;
+    uint64_t bounce_bytes;
+    uint64_t map_waits;
     QTAILQ_ENTRY(AddressSpace) address_spaces_link;
 };
 
@@ -526,6 +549,7 @@ void memory_region_rom_device_set_readable(MemoryRegion *mr, bool readable);
  * Enabled writes to a region to be queued for later processing. MMIO ->write
  * callbacks may be delayed until a non-coalesced MMIO is issued.
  * Only useful for IO regions.  Roughly similar to write-combining hardware.
+ * With KVM this works for port I/O too, if the host supports coalesced PIO.
  *
  * @mr: the memory region to be write coalesced
  */
@@ -625,6 +649,45 @@ void memory_region_del_eventfd(MemoryRegion *mr,
                                uint64_t data,
                                EventNotifier *e);
 
+/**
+ * memory_region_add_doorbell: Let writes to a doorbell register complete
+ *                             without waiting for the device.
+ *
+ * Where the accelerator supports many ioeventfds, a write of one of
+ * @values to @addr no longer exits to the I/O callback.  It triggers an
+ * eventfd instead, and the main loop replays the write through the
+ * callback later.  Repeated writes of one value may be replayed once.
+ * Other values, and all writes without ioeventfd support, still reach
+ * the callback synchronously, so the device needs no other changes.
+ *
+ * This is only correct for write-only registers whose effect the guest
+ * cannot observe synchronously, for example a ring doorbell.  Pending
+ * writes are replayed before the VM stops.
+ *
+ * Returns %NULL if ioeventfds are not available.
+ *
+ * @mr: the memory region being updated.
+ * @addr: the address of the doorbell within @mr
+ * @size: the size of the writes to the doorbell
+ * @values: the values to complete asynchronously
+ * @nb_values: the number of entries in @values
+ */
+MemoryRegionDoorbell *memory_region_add_doorbell(MemoryRegion *mr,
+                                                 hwaddr addr,
+                                                 unsigned size,
+                                                 const uint64_t *values,
+                                                 unsigned nb_values);
+
+/**
+ * memory_region_del_doorbell: Cancel a doorbell.
+ *
+ * Replays the writes that are still pending and then cancels a doorbell
+ * set up by memory_region_add_doorbell().  @db may be %NULL.
+ *
+ * @db: the doorbell to cancel
+ */
+void memory_region_del_doorbell(MemoryRegionDoorbell *db);
+
 /**
  * memory_region_add_subregion: Add a subregion to a container.
  *
@@ -843,6 +906,20 @@ void address_space_destroy(AddressSpace *as);
 void address_space_rw(AddressSpace *as, hwaddr addr, uint8_t *buf,
                       int len, bool is_write);
 
+/**
+ * address_space_access_thread_safe: check whether an access can be done
+ * without the iothread lock.
+ *
+ * Returns true if [@addr, @addr + @len) lies within a single region whose
+ * #MemoryRegionOps are thread-safe.  The caller must be in an RCU critical
+ * section, and the answer only holds until it leaves it.
+ *
+ * @as: #AddressSpace to be accessed
+ * @addr: address within that address space
+ * @len: length of the access
+ */
+bool address_space_access_thread_safe(AddressSpace *as, hwaddr addr, int len);
+
 /**
  * address_space_write: write to address space.
  *
@@ -867,8 +944,8 @@ void address_space_read(AddressSpace *as, hwaddr addr, uint8_t *buf, int len);
  * May map a subset of the requested range, given by and returned in @plen.
  * May return %NULL if resources needed to perform the mapping are exhausted.
  * Use only for reads OR writes - not for read-modify-write operations.
- * Use cpu_register_map_client() to know when retrying the map operation is
- * likely to succeed.
+ * Use address_space_register_map_client() to know when retrying the map
+ * operation is likely to succeed.
  *
  * @as: #AddressSpace to be accessed
  * @addr: address within that address space
@@ -892,6 +969,17 @@ void *address_space_map(AddressSpace *as, hwaddr addr,
 void address_space_unmap(AddressSpace *as, void *buffer, hwaddr len,
                          int is_write, hwaddr access_len);
 
+/* address_space_register_map_client: call @callback once when mapping
+ * memory of @as is likely to succeed again, because a bounce buffer was
+ * released.
+ *
+ * @as: #AddressSpace where address_space_map() failed
+ * @opaque: passed to @callback
+ * @callback: function to call
+ */
+void *address_space_register_map_client(AddressSpace *as, void *opaque,
+                                        void (*callback)(void *opaque));
+
 
 #endif
 
@@ -64,7 +64,7 @@ static inline DATA_TYPE glue(io_read, SUFFIX)(CPUArchState *env,
                                               uintptr_t retaddr)
 {
     DATA_TYPE res;
-    MemoryRegion *mr = iotlb_to_region(physaddr);
+    MemoryRegion *mr = iotlb_to_region(env, physaddr);
 
     physaddr = (physaddr & TARGET_PAGE_MASK) + addr;
     env->mem_io_pc = retaddr;
@@ -143,7 +143,10 @@ glue(glue(helper_ld, SUFFIX), MMUSUFFIX)(CPUArchState *env, target_ulong addr,
         if ((addr & (DATA_SIZE - 1)) != 0)
             do_unaligned_access(env, addr, READ_ACCESS_TYPE, mmu_idx, retaddr);
 #endif
-        tlb_fill(env, addr, READ_ACCESS_TYPE, mmu_idx, retaddr);
+        if (!tlb_victim_hit(env, mmu_idx, index,
+                            offsetof(CPUTLBEntry, ADDR_READ), addr)) {
+            tlb_fill(env, addr, READ_ACCESS_TYPE, mmu_idx, retaddr);
+        }
         goto redo;
     }
     return res;
@@ -195,7 +198,10 @@ glue(glue(slow_ld, SUFFIX), MMUSUFFIX)(CPUArchState *env,
         }
     } else {
         /* the page is not in the TLB : fill it */
-        tlb_fill(env, addr, READ_ACCESS_TYPE, mmu_idx, retaddr);
+        if (!tlb_victim_hit(env, mmu_idx, index,
+                            offsetof(CPUTLBEntry, ADDR_READ), addr)) {
+            tlb_fill(env, addr, READ_ACCESS_TYPE, mmu_idx, retaddr);
+        }
         goto redo;
     }
     return res;
@@ -213,11 +219,19 @@ static inline void glue(io_write, SUFFIX)(CPUArchState *env,
                                           hwaddr physaddr,
                                           DATA_TYPE val,
                                           target_ulong addr,
+                                          uintptr_t haddr,
                                           uintptr_t retaddr)
 {
-    MemoryRegion *mr = iotlb_to_region(physaddr);
+    MemoryRegion *mr = iotlb_to_region(env, physaddr);
 
     physaddr = (physaddr & TARGET_PAGE_MASK) + addr;
+    if (mr == &io_mem_notdirty) {
+        /* RAM that may hold code: no I/O, and @haddr is valid */
+        env->mem_io_vaddr = addr;
+        env->mem_io_pc = retaddr;
+        notdirty_mem_write_host(env, physaddr, (void *)haddr, val, DATA_SIZE);
+        return;
+    }
     if (mr != &io_mem_ram && mr != &io_mem_rom
         && mr != &io_mem_unassigned
         && mr != &io_mem_notdirty
@@ -259,7 +273,9 @@ void glue(glue(helper_st, SUFFIX), MMUSUFFIX)(CPUArchState *env,
                 goto do_unaligned_access;
             retaddr = GETPC_EXT();
             ioaddr = env->iotlb[mmu_idx][index];
-            glue(io_write, SUFFIX)(env, ioaddr, val, addr, retaddr);
+            glue(io_write, SUFFIX)(env, ioaddr, val, addr,
+                                   addr + env->tlb_table[mmu_idx][index].addend,
+                                   retaddr);
         } else if (((addr & ~TARGET_PAGE_MASK) + DATA_SIZE - 1) >= TARGET_PAGE_SIZE) {
         do_unaligned_access:
             retaddr = GETPC_EXT();
@@ -288,7 +304,10 @@ void glue(glue(helper_st, SUFFIX), MMUSUFFIX)(CPUArchState *env,
         if ((addr & (DATA_SIZE - 1)) != 0)
             do_unaligned_access(env, addr, 1, mmu_idx, retaddr);
 #endif
-        tlb_fill(env, addr, 1, mmu_idx, retaddr);
+        if (!tlb_victim_hit(env, mmu_idx, index,
+                            offsetof(CPUTLBEntry, addr_write), addr)) {
+            tlb_fill(env, addr, 1, mmu_idx, retaddr);
+        }
         goto redo;
     }
 }
@@ -313,7 +332,9 @@ static void glue(glue(slow_st, SUFFIX), MMUSUFFIX)(CPUArchState *env,
             if ((addr & (DATA_SIZE - 1)) != 0)
                 goto do_unaligned_access;
             ioaddr = env->iotlb[mmu_idx][index];
-            glue(io_write, SUFFIX)(env, ioaddr, val, addr, retaddr);
+            glue(io_write, SUFFIX)(env, ioaddr, val, addr,
+                                   addr + env->tlb_table[mmu_idx][index].addend,
+                                   retaddr);
         } else if (((addr & ~TARGET_PAGE_MASK) + DATA_SIZE - 1) >= TARGET_PAGE_SIZE) {
         do_unaligned_access:
             /* XXX: not efficient, but simple */
@@ -338,7 +359,10 @@ static void glue(glue(slow_st, SUFFIX), MMUSUFFIX)(CPUArchState *env,
         }
     } else {
         /* the page is not in the TLB : fill it */
-        tlb_fill(env, addr, 1, mmu_idx, retaddr);
+        if (!tlb_victim_hit(env, mmu_idx, index,
+                            offsetof(CPUTLBEntry, addr_write), addr)) {
+            tlb_fill(env, addr, 1, mmu_idx, retaddr);
+        }
         goto redo;
     }
 }
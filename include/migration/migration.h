@@ -29,6 +29,31 @@ struct MigrationParams {
 
 typedef struct MigrationState MigrationState;
 
+/* A run of outgoing data; either the next @len bytes of the copy buffer
+ * or, when @data is set, memory queued by reference */
+typedef struct MigrationIOSegment {
+    const uint8_t *data;
+    size_t len;
+} MigrationIOSegment;
+
+#define MIGRATION_ITERATIONS_MAX 64
+
+/* What happened between two dirty bitmap syncs.  In the ring buffer of
+ * MigrationState the counters are per iteration; @iteration_base holds
+ * their running totals at the start of the current one. */
+typedef struct MigrationIteration {
+    int64_t start_time;         /* rt_clock, ms */
+    int64_t end_time;
+    uint64_t dirtied_pages;
+    uint64_t sent_pages;
+    uint64_t zero_pages;
+    uint64_t xbzrle_pages;
+    uint64_t xbzrle_cache_hits;
+    int64_t sync_time;          /* us */
+    uint64_t bytes;
+    int64_t blocked_time;       /* us */
+} MigrationIteration;
+
 struct MigrationState
 {
     int64_t bandwidth_limit;
@@ -37,6 +62,19 @@ struct MigrationState
     uint8_t *buffer;
     size_t buffer_size;
     size_t buffer_capacity;
+    MigrationIOSegment *segments;
+    int nr_segments;
+    int segments_capacity;
+    int64_t bytes_copied;
+    int64_t bytes_sent;
+    /* duration in microseconds of the last dirty bitmap sync */
+    int64_t dirty_sync_time;
+    int64_t dirty_sync_count;
+    /* ns spent writing to the transport or sleeping on the rate limit */
+    int64_t blocked_time;
+    MigrationIteration iterations[MIGRATION_ITERATIONS_MAX];
+    uint64_t iteration_count;
+    MigrationIteration iteration_base;
     QemuThread thread;
 
     QEMUFile *file;
@@ -45,6 +83,12 @@ struct MigrationState
     int (*get_error)(MigrationState *s);
     int (*close)(MigrationState *s);
     int (*write)(MigrationState *s, const void *buff, size_t size);
+    /* optional, only transports that provide it get zero-copy pages */
+    ssize_t (*writev)(MigrationState *s, struct iovec *iov, int iovcnt);
+    /* optional, transports that can place RAM pages directly into the
+     * destination's memory; returns @size, -ENOTSUP or -errno */
+    int (*save_page)(MigrationState *s, uint64_t block_offset,
+                     uint64_t offset, int size);
     void *opaque;
     MigrationParams params;
     int64_t total_time;
@@ -54,10 +98,38 @@ struct MigrationState
     int64_t dirty_bytes_rate;
     bool enabled_capabilities[MIGRATION_CAPABILITY_MAX];
     int64_t xbzrle_cache_size;
+    int64_t threads;
+    int64_t compress_level;
+    int64_t block_inflight;
     bool complete;
+    /* post-copy: reverse channel carrying page requests from the
+       destination, read by rp_thread */
+    QEMUFile *return_path;
+    QemuThread rp_thread;
+    bool postcopy_started;
+    int64_t postcopy_requests;
+};
+
+/* Messages sent from the destination to the source on the return path */
+enum MigrationRPMsgType {
+    MIG_RP_MSG_INVALID = 0,
+    MIG_RP_MSG_SHUT,            /* be32 status, destination is done */
+    MIG_RP_MSG_REQ_PAGES,       /* be64 offset, be32 length, idstr */
 };
 
+/* Destination side post-copy state */
+typedef enum {
+    POSTCOPY_INCOMING_NONE = 0,
+    POSTCOPY_INCOMING_ADVISE,      /* source may switch to post-copy */
+    POSTCOPY_INCOMING_LISTENING,   /* RAM arrives through userfaultfd */
+    POSTCOPY_INCOMING_RUNNING,     /* guest running on the destination */
+    POSTCOPY_INCOMING_END,
+} PostcopyState;
+
+PostcopyState postcopy_state_get(void);
+
 void process_incoming_migration(QEMUFile *f);
+void migrate_incoming_start_vm(void);
 
 void qemu_start_incoming_migration(const char *uri, Error **errp);
 
@@ -83,10 +155,22 @@ void fd_start_incoming_migration(const char *path, Error **errp);
 
 void fd_start_outgoing_migration(MigrationState *s, const char *fdname, Error **errp);
 
+void rdma_start_incoming_migration(const char *host_port, Error **errp);
+
+void rdma_start_outgoing_migration(MigrationState *s, const char *host_port, Error **errp);
+
 void migrate_fd_error(MigrationState *s);
 
+/* Close the current iteration after a dirty bitmap sync that found
+ * @dirtied_pages newly dirty pages */
+void migration_iteration_done(MigrationState *s, uint64_t dirtied_pages);
+
 void migrate_fd_connect(MigrationState *s);
 
+void migrate_send_rp_shut(QEMUFile *rp, uint32_t value);
+void migrate_send_rp_req_pages(QEMUFile *rp, const char *idstr,
+                               uint64_t start, uint32_t len);
+
 int migrate_fd_close(MigrationState *s);
 
 void add_migration_state_change_notifier(Notifier *notify);
@@ -99,9 +183,15 @@ MigrationState *migrate_get_current(void);
 uint64_t ram_bytes_remaining(void);
 uint64_t ram_bytes_transferred(void);
 uint64_t ram_bytes_total(void);
+bool ram_precopy_pass_done(void);
+void ram_save_queue_pages(const char *idstr, uint64_t start, uint64_t len);
 
 extern SaveVMHandlers savevm_ram_handlers;
 
+off_t ram_template_state_offset(void);
+int ram_save_template(int fd, QEMUFile *f);
+int ram_load_template(QEMUFile *f);
+
 uint64_t dup_mig_bytes_transferred(void);
 uint64_t dup_mig_pages_transferred(void);
 uint64_t norm_mig_bytes_transferred(void);
@@ -110,6 +200,9 @@ uint64_t xbzrle_mig_bytes_transferred(void);
 uint64_t xbzrle_mig_pages_transferred(void);
 uint64_t xbzrle_mig_pages_overflow(void);
 uint64_t xbzrle_mig_pages_cache_miss(void);
+uint64_t xbzrle_mig_pages_cache_hit(void);
+uint64_t xbzrle_mig_pages_skipped(void);
+MigrationThreadStatsList *ram_mig_thread_stats(void);
 
 /**
  * @migrate_add_blocker - prevent migration from proceeding
@@ -132,5 +225,19 @@ int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen);
 int migrate_use_xbzrle(void);
 int64_t migrate_xbzrle_cache_size(void);
 
+#define MAX_MIGRATE_THREADS 16
+
+bool migrate_use_multi_thread(void);
+int64_t migrate_threads(void);
+bool migrate_use_compress(void);
+bool migrate_auto_converge(void);
+int64_t migrate_compress_level(void);
+bool migrate_use_postcopy(void);
+
+#define MAX_MIGRATE_BLOCK_INFLIGHT 64
+
+bool migrate_zero_blocks(void);
+int64_t migrate_block_inflight(void);
+
 int64_t xbzrle_cache_resize(int64_t new_size);
 #endif
@@ -1,6 +1,6 @@
 /*
  * Page cache for QEMU
- * The cache is base on a hash of the page address
+ * The cache is a set-associative cache based on a hash of the page address
  *
  * Copyright 2012 Red Hat, Inc. and/or its affiliates
  *
@@ -56,6 +56,16 @@ bool cache_is_cached(const PageCache *cache, uint64_t addr);
  */
 uint8_t *get_cached_data(const PageCache *cache, uint64_t addr);
 
+/**
+ * cache_lookup: Get the data cached for an addr and mark it as recently used
+ *
+ * Returns pointer to the data cached or NULL if not cached
+ *
+ * @cache pointer to the PageCache struct
+ * @addr: page addr
+ */
+uint8_t *cache_lookup(PageCache *cache, uint64_t addr);
+
 /**
  * cache_insert: insert the page into the cache. the previous value will be overwritten
  *
@@ -65,6 +75,25 @@ uint8_t *get_cached_data(const PageCache *cache, uint64_t addr);
  */
 void cache_insert(PageCache *cache, uint64_t addr, uint8_t *pdata);
 
+/**
+ * cache_set_skip: flag a cached page so that the next cache_test_and_clear_skip
+ * on it returns %true
+ *
+ * @cache pointer to the PageCache struct
+ * @addr: page address
+ */
+void cache_set_skip(PageCache *cache, uint64_t addr);
+
+/**
+ * cache_test_and_clear_skip: Checks and clears the skip flag of a page
+ *
+ * Returns %true if the page is cached and was flagged
+ *
+ * @cache pointer to the PageCache struct
+ * @addr: page address
+ */
+bool cache_test_and_clear_skip(PageCache *cache, uint64_t addr);
+
 /**
  * cache_resize: resize the page cache. In case of size reduction the extra
  * pages will be freed
@@ -0,0 +1,44 @@
+/*
+ * Post-copy live migration, destination side RAM handling
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef QEMU_POSTCOPY_RAM_H
+#define QEMU_POSTCOPY_RAM_H
+
+#include "exec/cpu-all.h"
+#include "migration/qemu-file.h"
+
+/* Return true if userfaultfd can be used to fault in guest RAM */
+bool postcopy_ram_supported_by_host(void);
+
+/* Allocate the received-page bitmap, called when the source advises
+ * that it may switch to post-copy */
+int postcopy_ram_incoming_init(void);
+
+/* Register guest RAM with userfaultfd and start the thread that turns
+ * faults into page requests on @to_src */
+int postcopy_ram_enable_notify(QEMUFile *to_src);
+
+/* Stop the fault thread, unregister guest RAM and free all state */
+void postcopy_ram_incoming_cleanup(void);
+
+/* Drop pages dirtied on the source after they were sent, so that the
+ * guest faults on them once post-copy is running */
+int postcopy_ram_discard_range(RAMBlock *block, ram_addr_t start,
+                               ram_addr_t length);
+
+/* Record a page written directly during the pre-copy phase */
+void postcopy_ram_page_received(RAMBlock *block, ram_addr_t offset);
+
+/* Buffer the incoming page is decoded into before postcopy_place_page() */
+void *postcopy_get_tmp_page(void);
+
+/* Atomically map the page held in the tmp page at @offset of @block and
+ * wake any vCPU waiting on it */
+int postcopy_place_page(RAMBlock *block, ram_addr_t offset);
+
+#endif
@@ -31,6 +31,31 @@
 typedef int (QEMUFilePutBufferFunc)(void *opaque, const uint8_t *buf,
                                     int64_t pos, int size);
 
+/* Queue a chunk of data for writing without copying it.  The memory stays
+ * referenced until the data has been sent, so it must remain valid for the
+ * lifetime of the file.  Changes made to it meanwhile may or may not be
+ * sent.
+ */
+typedef int (QEMUFilePutBufferAsyncFunc)(void *opaque, const uint8_t *buf,
+                                         int64_t pos, int size);
+
+/* Write a vector of chunks to a file at the given position, as one
+ * operation if the backend can.  The memory need only stay valid for the
+ * duration of the call.  Returns the number of bytes written or a negative
+ * errno.
+ */
+typedef int (QEMUFileWritevBufferFunc)(void *opaque, struct iovec *iov,
+                                       int iovcnt, int64_t pos);
+
+/* Hand a RAM page to the transport to be placed directly into the
+ * destination's memory, outside of the stream.  @block_offset is the
+ * ram_addr of the RAMBlock and @offset the page offset within it.
+ * Returns @size if the page was taken, -ENOTSUP if it must be sent in
+ * the stream, or another negative errno.
+ */
+typedef int (QEMUFileSavePageFunc)(void *opaque, uint64_t block_offset,
+                                   uint64_t offset, int size);
+
 /* Read a chunk of data from a file at the given position.  The pos argument
  * can be ignored if the file is only be used for streaming.  The number of
  * bytes actually read should be returned.
@@ -38,6 +63,13 @@ typedef int (QEMUFilePutBufferFunc)(void *opaque, const uint8_t *buf,
 typedef int (QEMUFileGetBufferFunc)(void *opaque, uint8_t *buf,
                                     int64_t pos, int size);
 
+/* Map the rest of a read-only stream into memory, starting at its current
+ * position, so that it can be parsed in place.  Returns NULL if the stream
+ * cannot be mapped, in which case get_buffer is used.  The mapping must
+ * stay valid until the file is closed.
+ */
+typedef uint8_t *(QEMUFileMapBufferFunc)(void *opaque, size_t *size);
+
 /* Close a file
  *
  * Return negative error number on error, 0 or positive value on success.
@@ -63,14 +95,24 @@ typedef int (QEMUFileRateLimit)(void *opaque);
 typedef int64_t (QEMUFileSetRateLimit)(void *opaque, int64_t new_rate);
 typedef int64_t (QEMUFileGetRateLimit)(void *opaque);
 
+/* Called to open a QEMUFile going in the opposite direction on the same
+ * channel, or NULL if the channel is one-way.
+ */
+typedef QEMUFile *(QEMUFileGetReturnPath)(void *opaque);
+
 typedef struct QEMUFileOps {
     QEMUFilePutBufferFunc *put_buffer;
+    QEMUFilePutBufferAsyncFunc *put_buffer_async;
+    QEMUFileWritevBufferFunc *writev_buffer;
+    QEMUFileSavePageFunc *save_page;
     QEMUFileGetBufferFunc *get_buffer;
+    QEMUFileMapBufferFunc *map_buffer;
     QEMUFileCloseFunc *close;
     QEMUFileGetFD *get_fd;
     QEMUFileRateLimit *rate_limit;
     QEMUFileSetRateLimit *set_rate_limit;
     QEMUFileGetRateLimit *get_rate_limit;
+    QEMUFileGetReturnPath *get_return_path;
 } QEMUFileOps;
 
 QEMUFile *qemu_fopen_ops(void *opaque, const QEMUFileOps *ops);
@@ -80,9 +122,17 @@ QEMUFile *qemu_fopen_socket(int fd);
 QEMUFile *qemu_popen(FILE *popen_file, const char *mode);
 QEMUFile *qemu_popen_cmd(const char *command, const char *mode);
 int qemu_get_fd(QEMUFile *f);
+/* coroutine only; clobbers the handlers for @fd */
+void yield_until_fd_readable(int fd);
+QEMUFile *qemu_file_get_return_path(QEMUFile *f);
+void qemu_file_set_buffer_size(QEMUFile *f, int size);
 int qemu_fclose(QEMUFile *f);
+int qemu_fflush(QEMUFile *f);
 int64_t qemu_ftell(QEMUFile *f);
 void qemu_put_buffer(QEMUFile *f, const uint8_t *buf, int size);
+void qemu_put_buffer_async(QEMUFile *f, const uint8_t *buf, int size);
+bool qemu_save_page(QEMUFile *f, uint64_t block_offset, uint64_t offset,
+                    int size);
 void qemu_put_byte(QEMUFile *f, int v);
 
 static inline void qemu_put_ubyte(QEMUFile *f, unsigned int v)
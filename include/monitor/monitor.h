@@ -6,8 +6,11 @@
 #include "qapi/qmp/qdict.h"
 #include "block/block.h"
 #include "monitor/readline.h"
+#include "qemu/tls.h"
 
-extern Monitor *cur_mon;
+/* QMP commands may run in the monitor thread, each thread has its own */
+DECLARE_TLS(Monitor *, cur_mon);
+#define cur_mon tls_var(cur_mon)
 extern Monitor *default_mon;
 
 /* flags for monitor_init */
@@ -18,6 +21,7 @@ extern Monitor *default_mon;
 
 /* flags for monitor commands */
 #define MONITOR_CMD_ASYNC       0x0001
+#define MONITOR_CMD_THREAD_SAFE 0x0002  /* QMP: may run outside the BQL */
 
 /* QMP events */
 typedef enum MonitorEvent {
@@ -45,6 +49,7 @@ typedef enum MonitorEvent {
     QEVENT_WAKEUP,
     QEVENT_BALLOON_CHANGE,
     QEVENT_SPICE_MIGRATE_COMPLETED,
+    QEVENT_DUMP_COMPLETED,
 
     /* Add to 'monitor_event_names' array in monitor.c when
      * defining new events here */
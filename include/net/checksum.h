@@ -25,5 +25,12 @@ uint16_t net_checksum_finish(uint32_t sum);
 uint16_t net_checksum_tcpudp(uint16_t length, uint16_t proto,
                              uint8_t *addrs, uint8_t *buf);
 void net_checksum_calculate(uint8_t *data, int length);
+void net_checksum_complete(uint8_t *data, int length,
+                           int csum_start, int csum_offset);
+
+/* Software segmentation, for backends that cannot take large frames */
+typedef void NetSegmentOutput(void *opaque, const uint8_t *data, int length);
+int net_tso_segment(const uint8_t *data, int length, int mss,
+                    NetSegmentOutput *output, void *opaque);
 
 #endif /* QEMU_NET_CHECKSUM_H */
@@ -43,6 +43,10 @@ typedef ssize_t (NetReceive)(NetClientState *, const uint8_t *, size_t);
 typedef ssize_t (NetReceiveIOV)(NetClientState *, const struct iovec *, int);
 typedef void (NetCleanup) (NetClientState *);
 typedef void (LinkStatusChanged)(NetClientState *);
+typedef void (NetReceiveBatch)(NetClientState *, bool start);
+typedef int (NetRxMap)(NetClientState *, struct iovec *, int);
+typedef ssize_t (NetRxCommit)(NetClientState *, const struct iovec *, int,
+                              size_t);
 typedef void (NetClientDestructor)(NetClientState *);
 
 typedef struct NetClientInfo {
@@ -55,6 +59,9 @@ typedef struct NetClientInfo {
     NetCleanup *cleanup;
     LinkStatusChanged *link_status_changed;
     NetPoll *poll;
+    NetReceiveBatch *receive_batch;
+    NetRxMap *rx_map;
+    NetRxCommit *rx_commit;
 } NetClientInfo;
 
 struct NetClientState {
@@ -105,10 +112,17 @@ ssize_t qemu_sendv_packet(NetClientState *nc, const struct iovec *iov,
                           int iovcnt);
 ssize_t qemu_sendv_packet_async(NetClientState *nc, const struct iovec *iov,
                                 int iovcnt, NetPacketSent *sent_cb);
+ssize_t qemu_sendv_packet_shared(NetClientState *nc, const struct iovec *iov,
+                                 int iovcnt, NetSharedBuf **shared);
 void qemu_send_packet(NetClientState *nc, const uint8_t *buf, int size);
 ssize_t qemu_send_packet_raw(NetClientState *nc, const uint8_t *buf, int size);
 ssize_t qemu_send_packet_async(NetClientState *nc, const uint8_t *buf,
                                int size, NetPacketSent *sent_cb);
+void qemu_send_batch_begin(NetClientState *nc);
+void qemu_send_batch_end(NetClientState *nc);
+int qemu_peer_rx_map(NetClientState *nc, struct iovec *iov, int iovcnt);
+ssize_t qemu_peer_rx_commit(NetClientState *nc, const struct iovec *iov,
+                            int iovcnt, size_t size);
 void qemu_purge_queued_packets(NetClientState *nc);
 void qemu_flush_queued_packets(NetClientState *nc);
 void qemu_format_nic_info_str(NetClientState *nc, uint8_t macaddr[6]);
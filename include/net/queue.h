@@ -28,6 +28,7 @@
 
 typedef struct NetPacket NetPacket;
 typedef struct NetQueue NetQueue;
+typedef struct NetSharedBuf NetSharedBuf;
 
 typedef void (NetPacketSent) (NetClientState *sender, ssize_t ret);
 
@@ -52,7 +53,21 @@ ssize_t qemu_net_queue_send_iov(NetQueue *queue,
                                 int iovcnt,
                                 NetPacketSent *sent_cb);
 
+/* Like qemu_net_queue_send_iov(), but a packet that has to be queued
+ * references a copy shared by all queues it is fanned out to.  *shared
+ * starts out NULL and is filled in by the first queue that needs it; the
+ * caller drops its reference with qemu_net_shared_buf_unref() when done.
+ */
+ssize_t qemu_net_queue_send_shared(NetQueue *queue,
+                                   NetClientState *sender,
+                                   unsigned flags,
+                                   const struct iovec *iov,
+                                   int iovcnt,
+                                   NetSharedBuf **shared);
+void qemu_net_shared_buf_unref(NetSharedBuf *buf);
+
 void qemu_net_queue_purge(NetQueue *queue, NetClientState *from);
 bool qemu_net_queue_flush(NetQueue *queue);
+bool qemu_net_queue_empty(NetQueue *queue);
 
 #endif /* QEMU_NET_QUEUE_H */
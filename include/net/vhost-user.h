@@ -0,0 +1,17 @@
+/*
+ * vhost-user netdev
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef QEMU_NET_VHOST_USER_H
+#define QEMU_NET_VHOST_USER_H
+
+#include "net/net.h"
+
+struct vhost_net;
+struct vhost_net *vhost_user_get_vhost_net(NetClientState *nc);
+
+#endif /* QEMU_NET_VHOST_USER_H */
@@ -18,18 +18,25 @@
 #include "qemu/queue.h"
 #include <stdint.h>
 
-#define QDICT_BUCKET_MAX 512
+/* The table is allocated on the first insertion and doubled whenever the
+ * dictionary holds more than QDICT_LOAD_MAX entries per bucket. */
+#define QDICT_BUCKET_MIN 8
+#define QDICT_LOAD_MAX   2
 
 typedef struct QDictEntry {
+    /* an interned string, or key_buf */
     char *key;
     QObject *value;
     QLIST_ENTRY(QDictEntry) next;
+    unsigned int hash;
+    char key_buf[];
 } QDictEntry;
 
 typedef struct QDict {
     QObject_HEAD;
     size_t size;
-    QLIST_HEAD(,QDictEntry) table[QDICT_BUCKET_MAX];
+    size_t nbuckets;
+    QLIST_HEAD(,QDictEntry) *table;
 } QDict;
 
 /* Object API */
@@ -78,6 +78,12 @@ typedef struct QObject {
     obj->base.refcnt = 1;               \
     obj->base.type   = qtype_type
 
+/* Node allocation, see qobject.c */
+void *qobject_node_alloc(size_t size);
+void qobject_node_free(void *ptr, size_t size);
+void qobject_cache_begin(void);
+void qobject_cache_end(void);
+
 /**
  * qobject_incref(): Increment QObject's reference count
  */
@@ -14,6 +14,7 @@
 #define QSTRING_H
 
 #include <stdint.h>
+#include <glib.h>
 #include "qapi/qmp/qobject.h"
 
 typedef struct QString {
@@ -26,6 +27,7 @@ typedef struct QString {
 QString *qstring_new(void);
 QString *qstring_from_str(const char *str);
 QString *qstring_from_substr(const char *str, int start, int end);
+QString *qstring_from_gstring(GString *gstr);
 const char *qstring_get_str(const QString *qstring);
 void qstring_append_int(QString *qstring, int64_t value);
 void qstring_append(QString *qstring, const char *str);
@@ -304,6 +304,7 @@ struct qemu_work_item {
     void (*func)(void *data);
     void *data;
     int done;
+    bool free;
 };
 
 #ifdef CONFIG_USER_ONLY
@@ -338,18 +339,26 @@ ssize_t qemu_co_send_recv(int sockfd, void *buf, size_t bytes, bool do_send);
 #define qemu_co_send(sockfd, buf, bytes) \
   qemu_co_send_recv(sockfd, buf, bytes, true)
 
+/* Vectors with up to this many elements need no separate allocation */
+#define QEMU_IOVEC_INLINE 4
+
 typedef struct QEMUIOVector {
     struct iovec *iov;
     int niov;
     int nalloc;
     size_t size;
+    struct iovec local_iov[QEMU_IOVEC_INLINE];
 } QEMUIOVector;
 
 void qemu_iovec_init(QEMUIOVector *qiov, int alloc_hint);
 void qemu_iovec_init_external(QEMUIOVector *qiov, struct iovec *iov, int niov);
+void qemu_iovec_init_slice(QEMUIOVector *qiov, QEMUIOVector *src,
+                           size_t offset, size_t bytes);
 void qemu_iovec_add(QEMUIOVector *qiov, void *base, size_t len);
 void qemu_iovec_concat(QEMUIOVector *dst,
                        QEMUIOVector *src, size_t soffset, size_t sbytes);
+void qemu_iovec_slice(QEMUIOVector *dst,
+                      QEMUIOVector *src, size_t offset, size_t bytes);
 void qemu_iovec_concat_iov(QEMUIOVector *dst,
                            struct iovec *src_iov, unsigned int src_cnt,
                            size_t soffset, size_t sbytes);
@@ -361,8 +370,13 @@ size_t qemu_iovec_from_buf(QEMUIOVector *qiov, size_t offset,
                            const void *buf, size_t bytes);
 size_t qemu_iovec_memset(QEMUIOVector *qiov, size_t offset,
                          int fillc, size_t bytes);
+size_t qemu_iovec_copy_data(QEMUIOVector *dst, size_t doffset,
+                            QEMUIOVector *src, size_t soffset, size_t bytes);
 
 bool buffer_is_zero(const void *buf, size_t len);
+size_t buffer_zero_run(const void *buf, size_t len);
+bool buffer_is_dup(const void *buf, size_t len);
+bool buffer_copy_if_changed(void *dst, const void *src, size_t len);
 
 void qemu_progress_init(int enabled, float min_skip);
 void qemu_progress_end(void);
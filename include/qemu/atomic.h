@@ -64,4 +64,19 @@
 
 #endif
 
+/* Atomic read-modify-write, returning the old value */
+#define atomic_fetch_or(ptr, n)  __sync_fetch_and_or(ptr, n)
+#define atomic_fetch_and(ptr, n) __sync_fetch_and_and(ptr, n)
+#define atomic_fetch_add(ptr, n) __sync_fetch_and_add(ptr, n)
+#define atomic_fetch_sub(ptr, n) __sync_fetch_and_sub(ptr, n)
+
+/* Compare and swap with full barrier semantics, returning the old value */
+#define atomic_cmpxchg(ptr, old, new) __sync_val_compare_and_swap(ptr, old, new)
+
+/* Store @i in *@ptr with full barrier semantics, returning the old value */
+#define atomic_xchg(ptr, i) ({ smp_mb(); __sync_lock_test_and_set(ptr, i); })
+
+/* Read *@ptr exactly once, for values that other threads modify */
+#define atomic_read(ptr) (*(__typeof__(*(ptr)) volatile *)(ptr))
+
 #endif
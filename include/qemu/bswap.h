@@ -469,6 +469,11 @@ static inline unsigned long leul_to_cpu(unsigned long v)
 #endif
 }
 
+static inline unsigned long cpu_to_leul(unsigned long v)
+{
+    return leul_to_cpu(v);
+}
+
 #undef le_bswap
 #undef be_bswap
 #undef le_bswaps
@@ -0,0 +1,20 @@
+/*
+ * Castagnoli CRC32C checksum
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_CRC32C_H
+#define QEMU_CRC32C_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Continue the CRC32C of a buffer.  The caller seeds @crc, usually with
+ * 0xffffffff, and inverts the final result as the format requires.
+ */
+uint32_t crc32c(uint32_t crc, const uint8_t *data, size_t length);
+
+#endif
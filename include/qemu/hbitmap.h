@@ -45,6 +45,9 @@ struct HBitmapIter {
     /* Entry offset into the last-level array of longs.  */
     size_t pos;
 
+    /* First bit of the last level that the iteration does not visit.  */
+    uint64_t end;
+
     /* The currently-active path in the tree.  Each item of cur[i] stores
      * the bits (i.e. the subtrees) yet to be processed under that node.
      */
@@ -117,6 +120,79 @@ void hbitmap_reset(HBitmap *hb, uint64_t start, uint64_t count);
  */
 bool hbitmap_get(const HBitmap *hb, uint64_t item);
 
+/**
+ * hbitmap_merge:
+ * @a: HBitmap to operate on.
+ * @b: HBitmap to merge into @a.
+ *
+ * Set in @a every bit that is set in @b.  The two bitmaps must have
+ * the same size, but they may have different granularities; each group
+ * of bits that is set in @b sets all the groups of @a that it overlaps.
+ *
+ * Return false, without touching @a, if the sizes differ.
+ */
+bool hbitmap_merge(HBitmap *a, const HBitmap *b);
+
+/**
+ * hbitmap_serialization_align:
+ * @hb: HBitmap to operate on.
+ *
+ * Return the alignment, in bits, of the ranges that can be passed to
+ * hbitmap_serialize_part and hbitmap_deserialize_part.  The last range
+ * may end at the end of the bitmap instead.
+ */
+uint64_t hbitmap_serialization_align(const HBitmap *hb);
+
+/**
+ * hbitmap_serialization_size:
+ * @hb: HBitmap to operate on.
+ * @start: First bit of the range (0-based).
+ * @count: Number of bits in the range.
+ *
+ * Return the number of bytes that hbitmap_serialize_part needs to store
+ * the given range.
+ */
+uint64_t hbitmap_serialization_size(const HBitmap *hb,
+                                    uint64_t start, uint64_t count);
+
+/**
+ * hbitmap_serialize_part:
+ * @hb: HBitmap to operate on.
+ * @buf: Buffer of hbitmap_serialization_size() bytes to store the range in.
+ * @start: First bit of the range (0-based).
+ * @count: Number of bits in the range.
+ *
+ * Store a range of the bitmap in @buf, one bit per group of 2^granularity
+ * bits, in little-endian bit order.  The format does not depend on the
+ * host, so the data can be written to disk or sent to another machine.
+ */
+void hbitmap_serialize_part(const HBitmap *hb, uint8_t *buf,
+                            uint64_t start, uint64_t count);
+
+/**
+ * hbitmap_deserialize_part:
+ * @hb: HBitmap to operate on.
+ * @buf: Data stored by hbitmap_serialize_part.
+ * @start: First bit of the range (0-based).
+ * @count: Number of bits in the range.
+ *
+ * Replace a range of the bitmap with data from @buf.  @hb must have the
+ * same granularity as the bitmap that the data came from.  Only the bottom
+ * level is updated; hbitmap_deserialize_finish must be called once all the
+ * ranges have been loaded, and before any other use of @hb.
+ */
+void hbitmap_deserialize_part(HBitmap *hb, const uint8_t *buf,
+                              uint64_t start, uint64_t count);
+
+/**
+ * hbitmap_deserialize_finish:
+ * @hb: HBitmap to operate on.
+ *
+ * Rebuild the upper levels and the count of set bits after a series of
+ * calls to hbitmap_deserialize_part.
+ */
+void hbitmap_deserialize_finish(HBitmap *hb);
+
 /**
  * hbitmap_free:
  * @hb: HBitmap to operate on.
@@ -143,6 +219,24 @@ void hbitmap_free(HBitmap *hb);
  */
 void hbitmap_iter_init(HBitmapIter *hbi, const HBitmap *hb, uint64_t first);
 
+/**
+ * hbitmap_iter_init_range:
+ * @hbi: HBitmapIter to initialize.
+ * @hb: HBitmap to iterate on.
+ * @first: First bit to visit (0-based, must be strictly less than the
+ * size of the bitmap).
+ * @count: Number of bits in the range to visit.
+ *
+ * Like hbitmap_iter_init, but the iteration stops before @first + @count.
+ *
+ * hbitmap_set and hbitmap_reset may run in different threads, as long as
+ * no two threads touch the same groups of bits at the same time.  This
+ * lets several threads each iterate on a disjoint range and reset the bits
+ * they visit, while other threads keep setting bits outside of it.
+ */
+void hbitmap_iter_init_range(HBitmapIter *hbi, const HBitmap *hb,
+                             uint64_t first, uint64_t count);
+
 /* hbitmap_iter_skip_words:
  * @hbi: HBitmapIter to operate on.
  *
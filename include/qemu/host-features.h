@@ -0,0 +1,13 @@
+#ifndef QEMU_HOST_FEATURES_H
+#define QEMU_HOST_FEATURES_H
+
+/* Instruction set extensions of the host CPU, detected at startup and used
+ * to select optimized implementations at run time.  Only the extensions
+ * the compiler can generate code for are ever reported. */
+#define QEMU_HOST_FEATURE_SSE2  (1U << 0)
+#define QEMU_HOST_FEATURE_AVX2  (1U << 1)
+#define QEMU_HOST_FEATURE_AES   (1U << 2)
+
+extern unsigned int qemu_host_features;
+
+#endif
@@ -0,0 +1,90 @@
+/*
+ * Interval tree
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_INTERVAL_TREE_H
+#define QEMU_INTERVAL_TREE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * An AVL tree of closed intervals [start, last], ordered by @start and
+ * augmented with the highest @last of each subtree, so that the intervals
+ * overlapping a range can be found in O(log n).  Nodes are embedded in the
+ * user's structure, as with the lists in qemu/queue.h; several nodes may
+ * cover the same range.
+ */
+typedef struct IntervalTreeNode IntervalTreeNode;
+
+struct IntervalTreeNode {
+    int64_t start;
+    int64_t last;
+    /* private */
+    int64_t subtree_last;
+    IntervalTreeNode *left;
+    IntervalTreeNode *right;
+    int height;
+};
+
+typedef struct IntervalTree {
+    IntervalTreeNode *root;
+} IntervalTree;
+
+#define INTERVAL_TREE_INITIALIZER { NULL }
+
+static inline void interval_tree_init(IntervalTree *tree)
+{
+    tree->root = NULL;
+}
+
+static inline bool interval_tree_empty(IntervalTree *tree)
+{
+    return tree->root == NULL;
+}
+
+/**
+ * interval_tree_insert:
+ * @tree: The tree to insert into
+ * @node: The node to insert, with @start and @last already set
+ */
+void interval_tree_insert(IntervalTree *tree, IntervalTreeNode *node);
+
+/**
+ * interval_tree_remove:
+ * @tree: The tree that contains @node
+ * @node: The node to remove
+ */
+void interval_tree_remove(IntervalTree *tree, IntervalTreeNode *node);
+
+/**
+ * interval_tree_iter_first:
+ * @tree: The tree to search
+ * @start: First point of the range
+ * @last: Last point of the range
+ *
+ * Return the node with the lowest start that overlaps [@start, @last], or
+ * %NULL if there is none.
+ */
+IntervalTreeNode *interval_tree_iter_first(IntervalTree *tree,
+                                           int64_t start, int64_t last);
+
+/**
+ * interval_tree_iter_next:
+ * @tree: The tree to search
+ * @node: A node returned by interval_tree_iter_first or _next
+ * @start: First point of the range
+ * @last: Last point of the range
+ *
+ * Return the next node after @node that overlaps [@start, @last], or
+ * %NULL if there is none.  The tree must not be modified during the walk.
+ */
+IntervalTreeNode *interval_tree_iter_next(IntervalTree *tree,
+                                          IntervalTreeNode *node,
+                                          int64_t start, int64_t last);
+
+#endif
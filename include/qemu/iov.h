@@ -44,6 +44,20 @@ size_t iov_from_buf(const struct iovec *iov, unsigned int iov_cnt,
 size_t iov_to_buf(const struct iovec *iov, const unsigned int iov_cnt,
                   size_t offset, void *buf, size_t bytes);
 
+/**
+ * Copy data between two scatter-gather vectors, like memcpy() would if
+ * they were continuous: `bytes' bytes are copied from `src_iov' starting
+ * at byte `soffset' to `dst_iov' starting at byte `doffset', without
+ * going through a bounce buffer.  The areas must not overlap.  Returns
+ * the number of bytes copied, which is smaller than `bytes' if either
+ * vector ends first.  Both offsets must point to the inside of the
+ * respective iovec.
+ */
+size_t iov_memcpy(const struct iovec *dst_iov, unsigned int dst_cnt,
+                  size_t doffset,
+                  const struct iovec *src_iov, unsigned int src_cnt,
+                  size_t soffset, size_t bytes);
+
 /**
  * Set data bytes pointed out by iovec `iov' of size `iov_cnt' elements,
  * starting at byte offset `start', to value `fillc', repeating it
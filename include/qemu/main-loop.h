@@ -26,6 +26,7 @@
 #define QEMU_MAIN_LOOP_H 1
 
 #include "block/aio.h"
+#include "qemu/tls.h"
 
 #define SIG_IPI SIGUSR1
 
@@ -96,6 +97,75 @@ int main_loop_wait(int nonblocking);
  */
 void qemu_notify_event(void);
 
+/**
+ * qemu_get_aio_context: Return the main loop's AioContext
+ *
+ * Block devices and other users of AioContext that are not bound to another
+ * event loop run their callbacks here.
+ */
+AioContext *qemu_get_aio_context(void);
+
+/* Wakeup accounting for query-wakeups.  main_loop_wait() sets the flag
+ * when it returns from a blocking wait; the first main loop timer or
+ * bottom half that runs afterwards claims the wakeup.  Wakeups that
+ * nobody claims are counted as I/O.
+ */
+extern bool main_loop_wakeup_unclaimed;
+
+static inline bool main_loop_claim_wakeup(void)
+{
+    if (likely(!main_loop_wakeup_unclaimed)) {
+        return false;
+    }
+    main_loop_wakeup_unclaimed = false;
+    return true;
+}
+
+/* CPU accounting for query-cpu-accounting.  Timers, bottom halves and fd
+ * handlers remember the owner that was current in their thread when they
+ * were created, usually the device being realized, and add up the time
+ * spent in their callback.  While a callback runs its owner is current,
+ * so that for example the fd handlers of a connection that a listening
+ * socket accepts are attributed like the listening socket.
+ */
+typedef struct CallbackStats {
+    const char *owner;
+    uint64_t calls;
+    uint64_t time_ns;
+} CallbackStats;
+
+DECLARE_TLS(const char *, callback_owner);
+
+/**
+ * qemu_set_callback_owner: Attribute the callbacks created from now on.
+ *
+ * @owner: A qdev ID or a subsystem name such as "vnc", or %NULL.  The
+ * string is copied.
+ *
+ * Returns the previous owner of the calling thread, for the caller to
+ * restore.
+ */
+const char *qemu_set_callback_owner(const char *owner);
+
+static inline void callback_stats_init(CallbackStats *s)
+{
+    s->owner = tls_var(callback_owner);
+}
+
+/* Called around a callback: callback_stats_begin() saves the current
+ * owner in @owner and returns the start time for callback_stats_end().
+ */
+int64_t callback_stats_begin(CallbackStats *s, const char **owner);
+void callback_stats_end(CallbackStats *s, const char *owner, int64_t start);
+
+/* Prepend an entry for @s to @list, if it has run; takes @name */
+struct CallbackAccountingList *callback_stats_list(
+    struct CallbackAccountingList *list, const CallbackStats *s,
+    const char *kind, char *name);
+
+/* List the main loop timers, bottom halves and fd handlers that have run */
+struct CallbackAccountingList *main_loop_cpu_accounting(void);
+
 #ifdef _WIN32
 /* return TRUE if no sleep should be done afterwards */
 typedef int PollingFunc(void *opaque);
@@ -294,11 +364,27 @@ void qemu_mutex_lock_iothread(void);
  */
 void qemu_mutex_unlock_iothread(void);
 
+/**
+ * qemu_mutex_iothread_locked: Return whether the calling thread holds
+ * the main loop mutex.
+ *
+ * Multi-threaded TCG vCPUs run translated code without the main loop
+ * mutex, and use this to find out whether they must take it around a
+ * device access.
+ *
+ * NOTE: tools currently are single-threaded and qemu_mutex_iothread_locked
+ * always returns true there.
+ */
+bool qemu_mutex_iothread_locked(void);
+
 /* internal interfaces */
 
 void qemu_fd_register(int fd);
 void qemu_iohandler_fill(GArray *pollfds);
 void qemu_iohandler_poll(GArray *pollfds, int rc);
+/* Prepend the fd handlers that have run to @list */
+struct CallbackAccountingList *qemu_iohandler_cpu_accounting(
+    struct CallbackAccountingList *list);
 
 QEMUBH *qemu_bh_new(QEMUBHFunc *cb, void *opaque);
 void qemu_bh_schedule_idle(QEMUBH *bh);
@@ -86,6 +86,10 @@ int qemu_daemon(int nochdir, int noclose);
 void *qemu_memalign(size_t alignment, size_t size);
 void *qemu_vmalloc(size_t size);
 void qemu_vfree(void *ptr);
+#ifndef _WIN32
+void qemu_alloc_stacks(void **stacks, int n, size_t size);
+void qemu_free_stack(void *stack, size_t size);
+#endif
 
 #define QEMU_MADV_INVALID -1
 
@@ -0,0 +1,139 @@
+/*
+ * Resizable hash table with lock-free lookups
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_QHT_H
+#define QEMU_QHT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "qemu/thread.h"
+
+/*
+ * A hash table of pointers, keyed by a 32-bit hash that the user computes.
+ * Each bucket fills one host cache line and holds a few entries; buckets
+ * that overflow are chained.
+ *
+ * qht_lookup() takes no lock and may run concurrently with insertions and
+ * removals, which serialize on a mutex in the table.  A lookup can see an
+ * object that is being removed at the same time, so objects must stay
+ * valid until the user knows that no lookup is in progress.
+ *
+ * With QHT_MODE_AUTO_RESIZE the table doubles when too many buckets had
+ * to be chained.  The old bucket array is kept for lookups that may still
+ * be walking it, and freed by the next qht_reset(), qht_resize() or
+ * qht_destroy(); those three must not run concurrently with qht_lookup().
+ */
+typedef struct QHT QHT;
+typedef struct QHTMap QHTMap;
+
+#define QHT_MODE_AUTO_RESIZE 0x1
+
+struct QHT {
+    QHTMap *map;
+    QemuMutex lock;
+    QHTMap *retired;
+    unsigned int mode;
+};
+
+typedef struct QHTStats {
+    size_t head_buckets;
+    size_t used_head_buckets;
+    size_t entries;
+    /* length in buckets of the chains of used head buckets */
+    double avg_chain;
+    size_t max_chain;
+    /* fraction of the entries of all buckets that are filled */
+    double occupancy;
+} QHTStats;
+
+/* Return true if @obj is the object that @userp describes */
+typedef bool (*qht_lookup_func_t)(const void *obj, const void *userp);
+typedef void (*qht_iter_func_t)(void *obj, uint32_t hash, void *userp);
+
+/**
+ * qht_init:
+ * @ht: The table to initialize
+ * @n_elems: Number of entries the table is sized for
+ * @mode: Zero or QHT_MODE_AUTO_RESIZE
+ */
+void qht_init(QHT *ht, size_t n_elems, unsigned int mode);
+
+/**
+ * qht_destroy:
+ * @ht: The table to free; the objects are not touched
+ */
+void qht_destroy(QHT *ht);
+
+/**
+ * qht_insert:
+ * @ht: The table
+ * @p: The object to insert; must not be %NULL
+ * @hash: Hash of @p
+ *
+ * Returns false if @p already is in the table.
+ */
+bool qht_insert(QHT *ht, void *p, uint32_t hash);
+
+/**
+ * qht_remove:
+ * @ht: The table
+ * @p: The object to remove
+ * @hash: Hash that @p was inserted with
+ *
+ * Returns false if @p was not in the table.
+ */
+bool qht_remove(QHT *ht, const void *p, uint32_t hash);
+
+/**
+ * qht_lookup:
+ * @ht: The table
+ * @func: Called for the objects with a matching hash until it returns true
+ * @userp: Passed to @func
+ * @hash: Hash to look for
+ *
+ * Returns the object that @func accepted, or %NULL.  @func may be called
+ * on an object that is concurrently removed, and several times for the
+ * same one if a writer forces the lookup to be retried.
+ */
+void *qht_lookup(QHT *ht, qht_lookup_func_t func, const void *userp,
+                 uint32_t hash);
+
+/**
+ * qht_reset:
+ * @ht: The table to empty
+ *
+ * Must not run concurrently with qht_lookup().
+ */
+void qht_reset(QHT *ht);
+
+/**
+ * qht_resize:
+ * @ht: The table
+ * @n_elems: Number of entries the table is sized for
+ *
+ * Returns false if the table already had that size.  Must not run
+ * concurrently with qht_lookup().
+ */
+bool qht_resize(QHT *ht, size_t n_elems);
+
+/**
+ * qht_iter:
+ * @ht: The table
+ * @func: Called for each object; it must not modify the table
+ * @userp: Passed to @func
+ */
+void qht_iter(QHT *ht, qht_iter_func_t func, void *userp);
+
+/**
+ * qht_statistics:
+ * @ht: The table
+ * @stats: Filled with the current state of @ht
+ */
+void qht_statistics(QHT *ht, QHTStats *stats);
+
+#endif
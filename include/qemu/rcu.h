@@ -0,0 +1,105 @@
+/*
+ * Read-copy-update
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_RCU_H
+#define QEMU_RCU_H
+
+#include <stdbool.h>
+#include "qemu/atomic.h"
+#include "qemu/queue.h"
+
+/*
+ * Readers bracket their accesses to RCU-protected data with
+ * rcu_read_lock() and rcu_read_unlock(), which never block and may nest.
+ * Pointers to such data are published with atomic_rcu_set() and read
+ * with atomic_rcu_read().
+ *
+ * A writer replaces the data and then either waits in synchronize_rcu()
+ * until every reader that could still see the old copy has left its
+ * critical section, or hands the old copy to call_rcu1().  The callbacks
+ * of call_rcu1() run in a separate thread, with the iothread lock held.
+ *
+ * A thread is registered on its first rcu_read_lock().  On POSIX hosts
+ * it is unregistered when it exits.
+ */
+
+struct rcu_reader_data {
+    /* Copy of rcu_gp_ctr when the outermost critical section began,
+     * 0 outside critical sections.
+     */
+    volatile unsigned long ctr;
+    unsigned int depth;
+    QLIST_ENTRY(rcu_reader_data) node;
+};
+
+extern volatile unsigned long rcu_gp_ctr;
+extern __thread struct rcu_reader_data *rcu_reader;
+
+void rcu_register_thread(void);
+
+static inline void rcu_read_lock(void)
+{
+    struct rcu_reader_data *p = rcu_reader;
+
+    if (!p) {
+        rcu_register_thread();
+        p = rcu_reader;
+    }
+    if (p->depth++ > 0) {
+        return;
+    }
+    p->ctr = rcu_gp_ctr;
+    smp_mb();
+}
+
+static inline void rcu_read_unlock(void)
+{
+    struct rcu_reader_data *p = rcu_reader;
+
+    if (--p->depth > 0) {
+        return;
+    }
+    smp_mb();
+    p->ctr = 0;
+}
+
+/* Publish @v, which the caller has fully initialized, in *@ptr */
+#define atomic_rcu_set(ptr, v) do {                     \
+        smp_wmb();                                      \
+        *(__typeof__(*(ptr)) volatile *)(ptr) = (v);    \
+    } while (0)
+
+#define atomic_rcu_read(ptr) ({                                 \
+        __typeof__(*(ptr)) _val = *(__typeof__(*(ptr)) volatile *)(ptr); \
+        smp_rmb();                                              \
+        _val;                                                   \
+    })
+
+/**
+ * synchronize_rcu:
+ *
+ * Wait until every RCU critical section that was running when the call
+ * started has ended.  Must not be called from inside a critical section.
+ */
+void synchronize_rcu(void);
+
+struct rcu_head;
+typedef void RCUCBFunc(struct rcu_head *head);
+
+struct rcu_head {
+    struct rcu_head *next;
+    RCUCBFunc *func;
+};
+
+/**
+ * call_rcu1:
+ * @head: Embedded in the object to free
+ * @func: Called with @head once no reader can see the object any more
+ */
+void call_rcu1(struct rcu_head *head, RCUCBFunc *func);
+
+#endif
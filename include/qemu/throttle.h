@@ -0,0 +1,74 @@
+/*
+ * Leaky bucket throttling
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_THROTTLE_H
+#define QEMU_THROTTLE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define THROTTLE_NS_PER_SEC 1000000000LL
+
+typedef enum {
+    THROTTLE_BPS_TOTAL,
+    THROTTLE_BPS_READ,
+    THROTTLE_BPS_WRITE,
+    THROTTLE_OPS_TOTAL,
+    THROTTLE_OPS_READ,
+    THROTTLE_OPS_WRITE,
+    BUCKETS_COUNT,
+} BucketType;
+
+/*
+ * The bucket fills with each request (bytes or operations) and leaks at
+ * @avg units per second.  A request may go as long as the bucket holds no
+ * more than @max units, so up to @max units can be issued in a burst
+ * before requests are spread out to the average rate.
+ */
+typedef struct LeakyBucket {
+    double avg;     /* average goal in units per second, 0 = unlimited */
+    double max;     /* burst size in units, 0 = avg / THROTTLE_MAX_DIVISOR */
+    double level;   /* current level in units */
+} LeakyBucket;
+
+/* default burst: what the average rate allows in 100ms */
+#define THROTTLE_MAX_DIVISOR 10
+
+typedef struct ThrottleConfig {
+    LeakyBucket buckets[BUCKETS_COUNT];
+    /* requests larger than this count as several operations, 0 to count
+     * every request as one */
+    uint64_t op_size;
+} ThrottleConfig;
+
+typedef struct ThrottleState {
+    ThrottleConfig cfg;
+    int64_t previous_leak;  /* ns */
+} ThrottleState;
+
+/* bucket level arithmetic, exported for the unit tests */
+void throttle_leak_bucket(LeakyBucket *bkt, int64_t delta_ns);
+int64_t throttle_compute_wait(LeakyBucket *bkt);
+
+void throttle_init(ThrottleState *ts, int64_t now);
+void throttle_config(ThrottleState *ts, ThrottleConfig *cfg, int64_t now);
+void throttle_get_config(ThrottleState *ts, ThrottleConfig *cfg);
+
+bool throttle_enabled(ThrottleConfig *cfg);
+/* total and read/write limits set at the same time */
+bool throttle_conflicting(ThrottleConfig *cfg);
+bool throttle_is_valid(ThrottleConfig *cfg);
+
+/* Leak the buckets up to @now and return how many ns a request in the
+ * given direction has to wait, 0 if it can go right away */
+int64_t throttle_compute_wait_for(ThrottleState *ts, bool is_write,
+                                  int64_t now);
+
+/* Account a request of @size bytes that is being issued */
+void throttle_account(ThrottleState *ts, bool is_write, uint64_t size);
+
+#endif
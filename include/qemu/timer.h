@@ -15,8 +15,8 @@
 #define SCALE_US 1000
 #define SCALE_NS 1
 
-typedef struct QEMUClock QEMUClock;
 typedef void QEMUTimerCB(void *opaque);
+typedef void QEMUTimerListNotifyCB(void *opaque);
 
 /* The real time clock should be used only for stuff which does not
    change the virtual machine state, as it is run even if the virtual
@@ -57,8 +57,58 @@ bool qemu_timer_pending(QEMUTimer *ts);
 bool qemu_timer_expired(QEMUTimer *timer_head, int64_t current_time);
 uint64_t qemu_timer_expire_time_ns(QEMUTimer *ts);
 
+/* Let @ts fire up to @slack (in units of the timer's scale) late.  The
+ * deadline is rounded up to a multiple of @slack, so that timers with the
+ * same slack expire together and cause a single wakeup.  A timer with
+ * slack also fires before its deadline, as soon as it is due, if the
+ * event loop is woken up by something else.
+ */
+void qemu_timer_set_slack(QEMUTimer *ts, int64_t slack);
+
+/* Name @ts for query-wakeups; @name must be a static string */
+void qemu_timer_set_name(QEMUTimer *ts, const char *name);
+/* Prepend the main loop timers that woke up the main loop to @list */
+struct WakeupSourceList *qemu_timer_wakeup_sources(
+    struct WakeupSourceList *list);
+/* Prepend the main loop timers that have run to @list */
+struct CallbackAccountingList *qemu_timer_cpu_accounting(
+    struct CallbackAccountingList *list);
+
+/* Timers created with qemu_new_timer() are run by the main loop.  Other
+ * event loops, such as AioContexts, keep their own lists of timers and
+ * run them with qemu_timer_list_run().  A list and its timers must only
+ * be used from the thread that runs the list.  @notify_cb is called when
+ * a timer becomes the first one to expire, so that the event loop can
+ * recompute its timeout.
+ */
+QEMUTimerList *qemu_timer_list_new(QEMUClock *clock,
+                                   QEMUTimerListNotifyCB *notify_cb,
+                                   void *opaque);
+void qemu_timer_list_free(QEMUTimerList *list);
+QEMUClock *qemu_timer_list_clock(QEMUTimerList *list);
+QEMUTimer *qemu_timer_list_new_timer(QEMUTimerList *list, int scale,
+                                     QEMUTimerCB *cb, void *opaque);
+/* Nanoseconds until the first timer of @list expires, or -1 if none */
+int64_t qemu_timer_list_deadline_ns(QEMUTimerList *list);
+/* Run the expired timers of @list; return true if any was run */
+bool qemu_timer_list_run(QEMUTimerList *list);
+
+/* Create a timer that is run by aio_poll() on @ctx instead of the main
+ * loop.  A pending timer keeps aio_poll() busy until it expires.
+ */
+QEMUTimer *aio_timer_new(AioContext *ctx, QEMUClock *clock, int scale,
+                         QEMUTimerCB *cb, void *opaque);
+/* Nanoseconds until the first timer of @ctx expires, or -1 if none */
+int64_t aio_timer_deadline_ns(AioContext *ctx);
+/* Run the expired timers of @ctx; return true if any was run */
+bool aio_run_timers(AioContext *ctx);
+
 void qemu_run_timers(QEMUClock *clock);
 void qemu_run_all_timers(void);
+/* How long the main loop may sleep in nanoseconds, -1 for no limit */
+int64_t qemu_timer_main_loop_timeout(void);
+/* Like g_poll(), but with a timeout in nanoseconds (-1 to block) */
+int qemu_poll_ns(GPollFD *fds, guint nfds, int64_t timeout);
 void configure_alarms(char const *opt);
 void init_clocks(void);
 int init_timer_alarm(void);
@@ -79,6 +129,25 @@ static inline QEMUTimer *qemu_new_timer_ms(QEMUClock *clock, QEMUTimerCB *cb,
     return qemu_new_timer(clock, SCALE_MS, cb, opaque);
 }
 
+/* Combine two timeouts in nanoseconds, where -1 means infinite */
+static inline int64_t qemu_soonest_timeout(int64_t timeout1, int64_t timeout2)
+{
+    /* -1 converts to UINT64_MAX as unsigned */
+    return ((uint64_t) timeout1 < (uint64_t) timeout2) ? timeout1 : timeout2;
+}
+
+/* Convert a timeout in nanoseconds to a poll() timeout, rounding up */
+static inline int qemu_timeout_ns_to_ms(int64_t ns)
+{
+    int64_t ms;
+
+    if (ns < 0) {
+        return -1;
+    }
+    ms = ns / SCALE_MS + (ns % SCALE_MS != 0);
+    return ms > INT32_MAX ? INT32_MAX : ms;
+}
+
 static inline int64_t qemu_get_clock_ms(QEMUClock *clock)
 {
     return qemu_get_clock_ns(clock) / SCALE_MS;
@@ -59,6 +59,7 @@ typedef struct CPUClass {
 
 struct KVMState;
 struct kvm_run;
+struct kvm_dirty_gfn;
 
 /**
  * CPUState:
@@ -67,13 +68,18 @@ struct kvm_run;
  * @nr_threads: Number of threads within this CPU.
  * @numa_node: NUMA node this CPU is belonging to.
  * @host_tid: Host thread ID.
- * @running: #true if CPU is currently running (usermode).
+ * @running: #true if CPU is currently running (usermode, multi-threaded TCG).
  * @created: Indicates whether the CPU thread has been successfully created.
  * @stop: Indicates a pending stop request.
  * @stopped: Indicates the CPU has been artificially stopped.
  * @env_ptr: Pointer to subclass-specific CPUArchState field.
  * @current_tb: Currently executing TB.
+ * @halt_poll_ns: Current halt polling window of the vCPU thread.
+ * @halt_poll_success: Halt polls that saw the vCPU woken.
+ * @halt_poll_fail: Halt polls that ended in a sleep.
  * @kvm_fd: vCPU file descriptor for KVM.
+ * @kvm_dirty_gfns: Dirty page ring of the vCPU, if KVM has one.
+ * @kvm_fetch_index: Next entry of @kvm_dirty_gfns to collect.
  *
  * State of one CPU core or thread.
  */
@@ -96,6 +102,10 @@ struct CPUState {
     struct QemuCond *halt_cond;
     struct qemu_work_item *queued_work_first, *queued_work_last;
     bool thread_kicked;
+    bool throttle_thread_scheduled;
+    int64_t halt_poll_ns;
+    uint64_t halt_poll_success, halt_poll_success_ns;
+    uint64_t halt_poll_fail, halt_poll_fail_ns;
     bool created;
     bool stop;
     bool stopped;
@@ -108,6 +118,9 @@ struct CPUState {
     bool kvm_vcpu_dirty;
     struct KVMState *kvm_state;
     struct kvm_run *kvm_run;
+    struct kvm_dirty_gfn *kvm_dirty_gfns;
+    uint32_t kvm_fetch_index;
+    struct KVMExitStats *kvm_exit_stats;
 
     /* TODO Move common fields from CPUArchState here. */
     int cpu_index; /* used by alpha TCG */
@@ -180,6 +193,16 @@ bool cpu_is_stopped(CPUState *cpu);
  */
 void run_on_cpu(CPUState *cpu, void (*func)(void *data), void *data);
 
+/**
+ * async_run_on_cpu:
+ * @cpu: The vCPU to run on.
+ * @func: The function to be executed.
+ * @data: Data to pass to the function.
+ *
+ * Schedules the function @func for execution on the vCPU @cpu asynchronously.
+ */
+void async_run_on_cpu(CPUState *cpu, void (*func)(void *data), void *data);
+
 /**
  * qemu_get_cpu:
  * @index: The CPUState@cpu_index value of the CPU to obtain.
@@ -1,6 +1,8 @@
 #ifndef QEMU_CPUS_H
 #define QEMU_CPUS_H
 
+#include "qapi-types.h"
+
 /* cpus.c */
 void qemu_init_cpu_loop(void);
 void resume_all_vcpus(void);
@@ -13,6 +15,47 @@ void cpu_synchronize_all_post_init(void);
 
 void qtest_clock_warp(int64_t dest);
 
+#ifndef CONFIG_USER_ONLY
+/* -machine tcg-threads=multi: one host thread per TCG vCPU */
+extern bool mttcg_enabled;
+#else
+#define mttcg_enabled false
+#endif
+int configure_tcg_threads(const char *mode);
+/* -machine tcg-superblocks=N: retranslate TBs run N times as superblocks */
+int configure_tcg_superblocks(uint64_t threshold);
+/* -machine tcg-opt=pass[,...]: select the TCG optimizer passes */
+int configure_tcg_opt(const char *passes);
+/* -machine tcg-profile=on: count executions and host ticks per TB */
+int configure_tcg_profile(bool enable);
+/* -machine bql-profile=on: histograms of the iothread lock wait and hold
+ * times, by site */
+int configure_bql_profile(bool enable);
+/* Tag what the calling thread does with the iothread lock from now on,
+ * for query-bql; returns the previous site to restore.  May be called
+ * with or without the lock held.
+ */
+BqlSite qemu_bql_set_site(BqlSite site);
+/* -machine halt-poll-ns=N: spin up to N ns in halted vCPU threads */
+int configure_halt_poll(int64_t max_ns);
+void dump_halt_poll_stats(FILE *f, fprintf_function cpu_fprintf);
+
+/* Run with every other MTTCG vCPU outside translated code.  Must be
+ * called with the iothread lock held and outside cpu_exec().
+ */
+void cpu_exclusive_start(void);
+void cpu_exclusive_end(void);
+
+#define CPU_THROTTLE_PCT_MIN 1
+#define CPU_THROTTLE_PCT_MAX 99
+
+/* Throttle all vCPUs down to (100 - percentage)% of their run time,
+ * percentage is clamped to CPU_THROTTLE_PCT_MIN..CPU_THROTTLE_PCT_MAX */
+void cpu_throttle_set(int new_throttle_pct);
+void cpu_throttle_stop(void);
+bool cpu_throttle_active(void);
+int cpu_throttle_get_percentage(void);
+
 #ifndef CONFIG_USER_ONLY
 /* vl.c */
 extern int smp_cores;
@@ -23,6 +66,12 @@ extern int smp_threads;
 #define smp_threads 1
 #endif
 
+/* Threads that are not vCPUs but are listed by query-threads, so that
+ * management can place them with set-thread-affinity
+ */
+void qemu_register_thread(const char *name, int thread_id);
+void qemu_unregister_thread(int thread_id);
+
 void set_numa_modes(void);
 void list_cpus(FILE *f, fprintf_function cpu_fprintf, const char *optarg);
 
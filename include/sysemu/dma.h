@@ -46,6 +46,8 @@ typedef uint64_t dma_addr_t;
 #define DMA_ADDR_BITS 64
 #define DMA_ADDR_FMT "%" PRIx64
 
+/* On entry *len is how much the caller wants to access from @addr; the
+ * translation may cover less, or more, and returns its length in *len. */
 typedef int DMATranslateFunc(DMAContext *dma,
                              dma_addr_t addr,
                              hwaddr *paddr,
@@ -20,6 +20,92 @@ typedef struct ArchDumpInfo {
     int d_class;    /* ELFCLASS32 or ELFCLASS64 */
 } ArchDumpInfo;
 
+/*
+ * The kdump-compressed format of makedumpfile, as read by crash:
+ *
+ *   +------------------------------------------+ block 0
+ *   | DiskDumpHeader64                         |
+ *   +------------------------------------------+ block 1
+ *   | KdumpSubHeader64, ELF notes              |
+ *   +------------------------------------------+ sub_hdr_size blocks later
+ *   | bitmap of the valid pages                |
+ *   | bitmap of the dumped pages               |
+ *   +------------------------------------------+ bitmap_blocks later
+ *   | PageDescriptor of every dumped page      |
+ *   +------------------------------------------+
+ *   | page data                                |
+ *   +------------------------------------------+
+ *
+ * A block is a target page.  All fields are in the byte order of the
+ * guest.
+ */
+#define KDUMP_SIGNATURE             "KDUMP   "
+#define KDUMP_SIG_LEN               (sizeof(KDUMP_SIGNATURE) - 1)
+#define KDUMP_HEADER_VERSION        6
+#define KDUMP_HEADER_BLOCKS         1
+/* makedumpfile's dump level 1: zero pages are left out */
+#define KDUMP_DUMP_LEVEL            1
+
+#define DUMP_DH_COMPRESSED_ZLIB     0x1
+#define DUMP_DH_COMPRESSED_LZO      0x2
+#define DUMP_DH_COMPRESSED_SNAPPY   0x4
+
+typedef struct QEMU_PACKED NewUtsname {
+    char sysname[65];
+    char nodename[65];
+    char release[65];
+    char version[65];
+    char machine[65];
+    char domainname[65];
+} NewUtsname;
+
+typedef struct QEMU_PACKED DiskDumpHeader64 {
+    char signature[KDUMP_SIG_LEN];
+    uint32_t header_version;
+    NewUtsname utsname;
+    /* struct timeval, aligned as the kernel's 64-bit layout has it */
+    char timestamp[22];
+    /* DUMP_DH_COMPRESSED_* */
+    uint32_t status;
+    uint32_t block_size;
+    /* in blocks */
+    uint32_t sub_hdr_size;
+    uint32_t bitmap_blocks;
+    /* obsolete 32-bit copy of max_mapnr_64 */
+    uint32_t max_mapnr;
+    uint32_t total_ram_blocks;
+    uint32_t device_blocks;
+    uint32_t written_blocks;
+    uint32_t current_cpu;
+    uint32_t nr_cpus;
+} DiskDumpHeader64;
+
+typedef struct QEMU_PACKED KdumpSubHeader64 {
+    uint64_t phys_base;
+    uint32_t dump_level;
+    uint32_t split;
+    uint64_t start_pfn;
+    uint64_t end_pfn;
+    uint64_t offset_vmcoreinfo;
+    uint64_t size_vmcoreinfo;
+    uint64_t offset_note;
+    uint64_t size_note;
+    uint64_t offset_eraseinfo;
+    uint64_t size_eraseinfo;
+    uint64_t start_pfn_64;
+    uint64_t end_pfn_64;
+    uint64_t max_mapnr_64;
+} KdumpSubHeader64;
+
+typedef struct QEMU_PACKED PageDescriptor {
+    /* of the page data in the file */
+    uint64_t offset;
+    uint32_t size;
+    /* DUMP_DH_COMPRESSED_*, or 0 if the data is not compressed */
+    uint32_t flags;
+    uint64_t page_flags;
+} PageDescriptor;
+
 typedef int (*write_core_dump_function)(void *buf, size_t size, void *opaque);
 int cpu_write_elf64_note(write_core_dump_function f, CPUArchState *env,
                                                   int cpuid, void *opaque);
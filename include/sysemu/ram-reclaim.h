@@ -0,0 +1,24 @@
+/*
+ * Background reclaim of zero pages in guest RAM
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#ifndef QEMU_RAM_RECLAIM_H
+#define QEMU_RAM_RECLAIM_H 1
+
+#include "qemu-common.h"
+
+#define RAM_RECLAIM_DEFAULT_RATE    (16 * 1024 * 1024)  /* bytes/s */
+
+/**
+ * ram_reclaim_inhibit:
+ *
+ * Stop the scanner while something may write guest RAM behind QEMU's
+ * back (vhost, dataplane, postcopy) or has pinned it (vfio).  Calls nest;
+ * each ram_reclaim_inhibit(true) must be paired with a
+ * ram_reclaim_inhibit(false).  Must be called with the iothread lock held.
+ */
+void ram_reclaim_inhibit(bool inhibit);
+
+#endif
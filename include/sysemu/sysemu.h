@@ -66,7 +66,9 @@ void qemu_remove_exit_notifier(Notifier *notify);
 void qemu_add_machine_init_done_notifier(Notifier *notify);
 
 void do_savevm(Monitor *mon, const QDict *qdict);
+bool savevm_live_in_progress(void);
 int load_vmstate(const char *name);
+int load_template_state(const char *filename);
 void do_delvm(Monitor *mon, const QDict *qdict);
 void do_info_snapshots(Monitor *mon, const QDict *qdict);
 
@@ -77,6 +79,10 @@ int qemu_savevm_state_begin(QEMUFile *f,
                             const MigrationParams *params);
 int qemu_savevm_state_iterate(QEMUFile *f);
 int qemu_savevm_state_complete(QEMUFile *f);
+void qemu_savevm_send_postcopy_advise(QEMUFile *f);
+int qemu_savevm_state_postcopy_start(QEMUFile *f);
+int qemu_savevm_state_postcopy_iterate(QEMUFile *f);
+int qemu_savevm_state_postcopy_complete(QEMUFile *f);
 void qemu_savevm_state_cancel(void);
 uint64_t qemu_savevm_state_pending(QEMUFile *f, uint64_t max_size);
 int qemu_loadvm_state(QEMUFile *f);
@@ -132,6 +138,20 @@ extern int nb_numa_nodes;
 extern uint64_t node_mem[MAX_NODES];
 extern unsigned long *node_cpumask[MAX_NODES];
 
+/* Host memory of each node, see numa_ram_alloc() in exec.c */
+enum {
+    NUMA_POLICY_DEFAULT,
+    NUMA_POLICY_PREFERRED,
+    NUMA_POLICY_BIND,
+    NUMA_POLICY_INTERLEAVE,
+};
+extern const char *node_mem_path[MAX_NODES];
+extern unsigned long *node_host_nodes[MAX_NODES];
+extern int node_host_policy[MAX_NODES];
+/* Host CPUs that run the VCPUs of each node, see set_numa_modes() */
+#define MAX_HOST_CPUMASK_BITS 1024
+extern unsigned long *node_host_cpus[MAX_NODES];
+
 #define MAX_OPTION_ROMS 16
 typedef struct QEMUOptionRom {
     const char *name;
@@ -148,6 +148,7 @@ void cursor_get_mono_image(QEMUCursor *c, int foreground, uint8_t *mask);
 void cursor_get_mono_mask(QEMUCursor *c, int transparent, uint8_t *mask);
 
 struct DisplayChangeListener {
+    /* not interested in updates for now; change it with dpy_set_idle() */
     int idle;
     uint64_t gui_timer_interval;
 
@@ -175,6 +176,9 @@ struct DisplayState {
     struct QEMUTimer *gui_timer;
     bool have_gfx;
     bool have_text;
+    /* all listeners are idle; idle_notifiers are told when this changes */
+    bool idle;
+    NotifierList idle_notifiers;
 
     QLIST_HEAD(, DisplayChangeListener) listeners;
 
@@ -209,11 +213,15 @@ static inline int is_buffer_shared(DisplaySurface *surface)
 }
 
 void gui_setup_refresh(DisplayState *ds);
+void dpy_update_idle(DisplayState *ds);
+void dpy_set_idle(DisplayState *ds, DisplayChangeListener *dcl, bool idle);
+void dpy_add_idle_notifier(DisplayState *ds, Notifier *notifier);
 
 static inline void register_displaychangelistener(DisplayState *ds, DisplayChangeListener *dcl)
 {
     QLIST_INSERT_HEAD(&ds->listeners, dcl, next);
     gui_setup_refresh(ds);
+    dpy_update_idle(ds);
     if (dcl->dpy_gfx_resize) {
         dcl->dpy_gfx_resize(ds);
     }
@@ -224,6 +232,7 @@ static inline void unregister_displaychangelistener(DisplayState *ds,
 {
     QLIST_REMOVE(dcl, next);
     gui_setup_refresh(ds);
+    dpy_update_idle(ds);
 }
 
 static inline void dpy_gfx_update(DisplayState *s, int x, int y, int w, int h)
@@ -82,8 +82,14 @@ struct SimpleSpiceDisplay {
     int32_t num_surfaces;
 
     QXLRect dirty;
+    /* scanlines covered by dpy_gfx_update calls since the last update */
+    unsigned long *dirty_rows;
+    int dirty_rows_height;
     int notify;
 
+    /* the refresh interval grows while the guest does not draw */
+    DisplayChangeListener *dcl;
+
     /*
      * All struct members below this comment can be accessed from
      * both spice server and qemu (iothread) context and any access
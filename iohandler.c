@@ -27,10 +27,14 @@
 #include "qemu/queue.h"
 #include "block/aio.h"
 #include "qemu/main-loop.h"
+#include "qapi-types.h"
 
 #ifndef _WIN32
 #include <sys/wait.h>
 #endif
+#ifdef CONFIG_EPOLL
+#include <sys/epoll.h>
+#endif
 
 typedef struct IOHandlerRecord {
     IOCanReadHandler *fd_read_poll;
@@ -41,11 +45,117 @@ typedef struct IOHandlerRecord {
     int fd;
     int pollfds_idx;
     bool deleted;
+    CallbackStats stats;
+#ifdef CONFIG_EPOLL
+    int epoll_events;       /* G_IO_* events registered with epoll */
+    int epoll_revents;
+    bool no_epoll;          /* epoll refused the fd, e.g. a regular file */
+#endif
 } IOHandlerRecord;
 
 static QLIST_HEAD(, IOHandlerRecord) io_handlers =
     QLIST_HEAD_INITIALIZER(io_handlers);
 
+#ifdef CONFIG_EPOLL
+/* The file descriptors stay registered with an epoll instance, which only
+ * hears about changes to the events of a handler.  The main loop polls
+ * the epoll file descriptor instead of one GPollFD per handler.  Handlers
+ * that epoll refuses are polled directly.
+ */
+
+#define IOHANDLER_EPOLL_MAX_EVENTS 128
+
+static int iohandler_epollfd = -1;
+static bool iohandler_epoll_failed;
+static int iohandler_epoll_idx = -1;
+
+static uint32_t iohandler_epoll_events(int events)
+{
+    return (events & G_IO_IN ? EPOLLIN : 0) |
+           (events & G_IO_OUT ? EPOLLOUT : 0);
+}
+
+static int iohandler_epoll_revents(uint32_t events)
+{
+    return (events & EPOLLIN ? G_IO_IN : 0) |
+           (events & EPOLLOUT ? G_IO_OUT : 0) |
+           (events & EPOLLHUP ? G_IO_HUP : 0) |
+           (events & EPOLLERR ? G_IO_ERR : 0);
+}
+
+/* Register @events for @ioh with epoll.  Returns false if the handler
+ * has to be polled directly.
+ */
+static bool iohandler_epoll_set(IOHandlerRecord *ioh, int events)
+{
+    struct epoll_event event = {
+        .events = iohandler_epoll_events(events),
+        .data.ptr = ioh,
+    };
+    int op, r;
+
+    if (ioh->no_epoll || iohandler_epoll_failed) {
+        return false;
+    }
+    if (iohandler_epollfd < 0) {
+#ifdef CONFIG_EPOLL_CREATE1
+        iohandler_epollfd = epoll_create1(EPOLL_CLOEXEC);
+#else
+        iohandler_epollfd = epoll_create(IOHANDLER_EPOLL_MAX_EVENTS);
+        if (iohandler_epollfd >= 0) {
+            qemu_set_cloexec(iohandler_epollfd);
+        }
+#endif
+        if (iohandler_epollfd < 0) {
+            iohandler_epoll_failed = true;
+            return false;
+        }
+    }
+    if (events == ioh->epoll_events) {
+        return true;
+    }
+
+    if (!ioh->epoll_events) {
+        op = EPOLL_CTL_ADD;
+    } else if (!events) {
+        op = EPOLL_CTL_DEL;
+    } else {
+        op = EPOLL_CTL_MOD;
+    }
+    r = epoll_ctl(iohandler_epollfd, op, ioh->fd, &event);
+    if (r < 0 && op == EPOLL_CTL_MOD && errno == ENOENT) {
+        /* The file descriptor was closed and reopened */
+        r = epoll_ctl(iohandler_epollfd, EPOLL_CTL_ADD, ioh->fd, &event);
+    }
+    if (r < 0 && op != EPOLL_CTL_DEL) {
+        epoll_ctl(iohandler_epollfd, EPOLL_CTL_DEL, ioh->fd, NULL);
+        ioh->epoll_events = 0;
+        ioh->no_epoll = true;
+        return false;
+    }
+    ioh->epoll_events = events;
+    return true;
+}
+
+/* Fetch the ready handlers if the epoll file descriptor was ready */
+static void iohandler_epoll_poll(GArray *pollfds)
+{
+    struct epoll_event events[IOHANDLER_EPOLL_MAX_EVENTS];
+    IOHandlerRecord *ioh;
+    int i, ret;
+
+    if (iohandler_epoll_idx == -1 ||
+        !g_array_index(pollfds, GPollFD, iohandler_epoll_idx).revents) {
+        return;
+    }
+    ret = epoll_wait(iohandler_epollfd, events, IOHANDLER_EPOLL_MAX_EVENTS, 0);
+    for (i = 0; i < ret; i++) {
+        ioh = events[i].data.ptr;
+        ioh->epoll_revents = iohandler_epoll_revents(events[i].events);
+    }
+}
+#endif
+
 
 /* XXX: fd_read_poll should be suppressed, but an API change is
    necessary in the character devices to suppress fd_can_read(). */
@@ -63,6 +173,12 @@ int qemu_set_fd_handler2(int fd,
         QLIST_FOREACH(ioh, &io_handlers, next) {
             if (ioh->fd == fd) {
                 ioh->deleted = 1;
+#ifdef CONFIG_EPOLL
+                /* Unregister right away, the fd may be closed and
+                 * reused before the record is freed.
+                 */
+                iohandler_epoll_set(ioh, 0);
+#endif
                 break;
             }
         }
@@ -72,6 +188,7 @@ int qemu_set_fd_handler2(int fd,
                 goto found;
         }
         ioh = g_malloc0(sizeof(IOHandlerRecord));
+        callback_stats_init(&ioh->stats);
         QLIST_INSERT_HEAD(&io_handlers, ioh, next);
     found:
         ioh->fd = fd;
@@ -97,6 +214,9 @@ int qemu_set_fd_handler(int fd,
 void qemu_iohandler_fill(GArray *pollfds)
 {
     IOHandlerRecord *ioh;
+#ifdef CONFIG_EPOLL
+    bool use_epoll = false;
+#endif
 
     QLIST_FOREACH(ioh, &io_handlers, next) {
         int events = 0;
@@ -111,6 +231,13 @@ void qemu_iohandler_fill(GArray *pollfds)
         if (ioh->fd_write) {
             events |= G_IO_OUT | G_IO_ERR;
         }
+#ifdef CONFIG_EPOLL
+        if (iohandler_epoll_set(ioh, events)) {
+            ioh->pollfds_idx = -1;
+            use_epoll |= events != 0;
+            continue;
+        }
+#endif
         if (events) {
             GPollFD pfd = {
                 .fd = ioh->fd,
@@ -122,6 +249,18 @@ void qemu_iohandler_fill(GArray *pollfds)
             ioh->pollfds_idx = -1;
         }
     }
+
+#ifdef CONFIG_EPOLL
+    iohandler_epoll_idx = -1;
+    if (use_epoll) {
+        GPollFD pfd = {
+            .fd = iohandler_epollfd,
+            .events = G_IO_IN,
+        };
+        iohandler_epoll_idx = pollfds->len;
+        g_array_append_val(pollfds, pfd);
+    }
+#endif
 }
 
 void qemu_iohandler_poll(GArray *pollfds, int ret)
@@ -129,15 +268,29 @@ void qemu_iohandler_poll(GArray *pollfds, int ret)
     if (ret > 0) {
         IOHandlerRecord *pioh, *ioh;
 
+#ifdef CONFIG_EPOLL
+        iohandler_epoll_poll(pollfds);
+#endif
         QLIST_FOREACH_SAFE(ioh, &io_handlers, next, pioh) {
             int revents = 0;
+            const char *owner = NULL;
+            int64_t start = 0;
 
             if (!ioh->deleted && ioh->pollfds_idx != -1) {
                 GPollFD *pfd = &g_array_index(pollfds, GPollFD,
                                               ioh->pollfds_idx);
                 revents = pfd->revents;
             }
+#ifdef CONFIG_EPOLL
+            if (!ioh->deleted) {
+                revents |= ioh->epoll_revents;
+            }
+            ioh->epoll_revents = 0;
+#endif
 
+            if (revents) {
+                start = callback_stats_begin(&ioh->stats, &owner);
+            }
             if (!ioh->deleted && ioh->fd_read &&
                 (revents & (G_IO_IN | G_IO_HUP | G_IO_ERR))) {
                 ioh->fd_read(ioh->opaque);
@@ -146,6 +299,9 @@ void qemu_iohandler_poll(GArray *pollfds, int ret)
                 (revents & (G_IO_OUT | G_IO_ERR))) {
                 ioh->fd_write(ioh->opaque);
             }
+            if (revents) {
+                callback_stats_end(&ioh->stats, owner, start);
+            }
 
             /* Do this last in case read/write handlers marked it for deletion */
             if (ioh->deleted) {
@@ -156,6 +312,20 @@ void qemu_iohandler_poll(GArray *pollfds, int ret)
     }
 }
 
+CallbackAccountingList *qemu_iohandler_cpu_accounting(
+    CallbackAccountingList *list)
+{
+    IOHandlerRecord *ioh;
+
+    QLIST_FOREACH(ioh, &io_handlers, next) {
+        if (!ioh->deleted) {
+            list = callback_stats_list(list, &ioh->stats, "fd",
+                                       g_strdup_printf("fd%d", ioh->fd));
+        }
+    }
+    return list;
+}
+
 /* reaping of zombies.  right now we're not passing the status to
    anyone, but it would be possible to add a callback.  */
 #ifndef _WIN32
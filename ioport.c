@@ -28,6 +28,8 @@
 #include "exec/ioport.h"
 #include "trace.h"
 #include "exec/memory.h"
+#include "sysemu/cpus.h"
+#include "qemu/main-loop.h"
 
 /***********************************************************/
 /* IO Port */
@@ -65,9 +67,20 @@ static uint32_t ioport_read(int index, uint32_t address)
         default_ioport_readl
     };
     IOPortReadFunc *func = ioport_read_table[index][address];
+    bool unlocked = mttcg_enabled && !qemu_mutex_iothread_locked();
+    uint32_t val;
+
     if (!func)
         func = default_func[index];
-    return func(ioport_opaque[address], address);
+    /* multi-threaded TCG vCPUs run without the iothread lock */
+    if (unlocked) {
+        qemu_mutex_lock_iothread();
+    }
+    val = func(ioport_opaque[address], address);
+    if (unlocked) {
+        qemu_mutex_unlock_iothread();
+    }
+    return val;
 }
 
 static void ioport_write(int index, uint32_t address, uint32_t data)
@@ -78,9 +91,17 @@ static void ioport_write(int index, uint32_t address, uint32_t data)
         default_ioport_writel
     };
     IOPortWriteFunc *func = ioport_write_table[index][address];
+    bool unlocked = mttcg_enabled && !qemu_mutex_iothread_locked();
+
     if (!func)
         func = default_func[index];
+    if (unlocked) {
+        qemu_mutex_lock_iothread();
+    }
     func(ioport_opaque[address], address, data);
+    if (unlocked) {
+        qemu_mutex_unlock_iothread();
+    }
 }
 
 static uint32_t default_ioport_readb(void *opaque, uint32_t address)
@@ -33,6 +33,9 @@
 #include "exec/memory.h"
 #include "exec/address-spaces.h"
 #include "qemu/event_notifier.h"
+#include "qemu/rcu.h"
+#include "qemu/timer.h"
+#include "qmp-commands.h"
 
 /* This check must be after config-host.h is included */
 #ifdef CONFIG_EVENTFD
@@ -75,6 +78,7 @@ struct KVMState
     int fd;
     int vmfd;
     int coalesced_mmio;
+    int coalesced_pio;
     struct kvm_coalesced_mmio_ring *coalesced_mmio_ring;
     bool coalesced_flush_in_progress;
     int broken_set_mem_region;
@@ -89,10 +93,15 @@ struct KVMState
     int xsave, xcrs;
     int many_ioeventfds;
     int intx_set_mask;
+    /* entries in the dirty ring of each vcpu, 0 if the bitmap is used */
+    uint32_t dirty_ring_size;
     /* The man page (and posix) say ioctl numbers are signed int, but
      * they're not.  Linux, glibc and *BSD all treat ioctl numbers as
      * unsigned, and treating them as signed here can break things */
     unsigned irq_set_ioctl;
+    /* Sampled MMIO and PIO exits by address, for query-kvm-exits */
+    QemuMutex exit_addrs_lock;
+    GHashTable *exit_addrs;
 #ifdef KVM_CAP_IRQ_ROUTING
     struct kvm_irq_routing *irq_routes;
     int nr_allocated_irq_routes;
@@ -103,6 +112,58 @@ struct KVMState
 #endif
 };
 
+/* Exit statistics for query-kvm-exits.  Every exit is counted by reason;
+ * one MMIO or PIO exit in KVM_EXIT_SAMPLE_PERIOD is also timed and added
+ * to the table of its address.
+ */
+#define KVM_EXIT_REASONS        32
+#define KVM_EXIT_SAMPLE_PERIOD  16
+#define KVM_EXIT_MAX_ADDRS      4096
+
+typedef struct KVMExitStats {
+    /* exit_reason, with the last entry for any reason above the others */
+    uint64_t count[KVM_EXIT_REASONS + 1];
+    /* KVM_RUN returned early because of a signal */
+    uint64_t interrupted;
+    unsigned int countdown;
+    bool sampling;
+} KVMExitStats;
+
+typedef struct KVMExitAddr {
+    uint64_t key;               /* address << 1, | 1 for PIO */
+    uint64_t reads;
+    uint64_t writes;
+    uint64_t time_ns;
+} KVMExitAddr;
+
+static const char * const kvm_exit_reason_names[KVM_EXIT_REASONS] = {
+    [KVM_EXIT_UNKNOWN] = "unknown",
+    [KVM_EXIT_EXCEPTION] = "exception",
+    [KVM_EXIT_IO] = "io",
+    [KVM_EXIT_HYPERCALL] = "hypercall",
+    [KVM_EXIT_DEBUG] = "debug",
+    [KVM_EXIT_HLT] = "hlt",
+    [KVM_EXIT_MMIO] = "mmio",
+    [KVM_EXIT_IRQ_WINDOW_OPEN] = "irq-window-open",
+    [KVM_EXIT_SHUTDOWN] = "shutdown",
+    [KVM_EXIT_FAIL_ENTRY] = "fail-entry",
+    [KVM_EXIT_INTR] = "intr",
+    [KVM_EXIT_SET_TPR] = "set-tpr",
+    [KVM_EXIT_TPR_ACCESS] = "tpr-access",
+    [KVM_EXIT_S390_SIEIC] = "s390-sieic",
+    [KVM_EXIT_S390_RESET] = "s390-reset",
+    [KVM_EXIT_DCR] = "dcr",
+    [KVM_EXIT_NMI] = "nmi",
+    [KVM_EXIT_INTERNAL_ERROR] = "internal-error",
+    [KVM_EXIT_OSI] = "osi",
+    [KVM_EXIT_PAPR_HCALL] = "papr-hcall",
+    [KVM_EXIT_S390_UCONTROL] = "s390-ucontrol",
+    [KVM_EXIT_WATCHDOG] = "watchdog",
+    [KVM_EXIT_S390_TSCH] = "s390-tsch",
+    [KVM_EXIT_EPR] = "epr",
+    [KVM_EXIT_DIRTY_RING_FULL] = "dirty-ring-full",
+};
+
 KVMState *kvm_state;
 bool kvm_kernel_irqchip;
 bool kvm_async_interrupts_allowed;
@@ -231,6 +292,7 @@ int kvm_init_vcpu(CPUState *cpu)
     cpu->kvm_fd = ret;
     cpu->kvm_state = s;
     cpu->kvm_vcpu_dirty = true;
+    cpu->kvm_exit_stats = g_new0(KVMExitStats, 1);
 
     mmap_size = kvm_ioctl(s, KVM_GET_VCPU_MMAP_SIZE, 0);
     if (mmap_size < 0) {
@@ -252,6 +314,22 @@ int kvm_init_vcpu(CPUState *cpu)
             (void *)cpu->kvm_run + s->coalesced_mmio * PAGE_SIZE;
     }
 
+#ifdef KVM_CAP_DIRTY_LOG_RING
+    if (s->dirty_ring_size) {
+        cpu->kvm_dirty_gfns = mmap(NULL, s->dirty_ring_size *
+                                   sizeof(struct kvm_dirty_gfn),
+                                   PROT_READ | PROT_WRITE, MAP_SHARED,
+                                   cpu->kvm_fd,
+                                   getpagesize() * KVM_DIRTY_LOG_PAGE_OFFSET);
+        if (cpu->kvm_dirty_gfns == MAP_FAILED) {
+            ret = -errno;
+            cpu->kvm_dirty_gfns = NULL;
+            DPRINTF("mmap'ing dirty ring failed\n");
+            goto err;
+        }
+    }
+#endif
+
     ret = kvm_arch_init_vcpu(cpu);
     if (ret == 0) {
         qemu_register_reset(kvm_reset_vcpu, cpu);
@@ -367,6 +445,14 @@ static int kvm_get_dirty_pages_log_range(MemoryRegionSection *section,
     unsigned int len = ((section->size / getpagesize()) + HOST_LONG_BITS - 1) / HOST_LONG_BITS;
     unsigned long hpratio = getpagesize() / TARGET_PAGE_SIZE;
 
+    if (hpratio == 1) {
+        cpu_physical_memory_set_dirty_lebitmap(bitmap,
+                                               section->mr->ram_addr +
+                                               section->offset_within_region,
+                                               section->size >> TARGET_PAGE_BITS);
+        return 0;
+    }
+
     /*
      * bitmap-traveling is faster than memory-traveling (for addr...)
      * especially when most of the memory is not dirty.
@@ -388,6 +474,115 @@ static int kvm_get_dirty_pages_log_range(MemoryRegionSection *section,
     return 0;
 }
 
+#ifdef KVM_CAP_DIRTY_LOG_RING
+/* Collect the pages KVM published in the dirty ring of @cpu */
+static uint32_t kvm_dirty_ring_reap_one(KVMState *s, CPUState *cpu)
+{
+    struct kvm_dirty_gfn *gfn;
+    uint32_t count = 0, slot;
+    ram_addr_t offset, ram_addr;
+    KVMSlot *mem;
+    int i;
+
+    for (;;) {
+        gfn = &cpu->kvm_dirty_gfns[cpu->kvm_fetch_index &
+                                   (s->dirty_ring_size - 1)];
+        if (!(atomic_read(&gfn->flags) & KVM_DIRTY_GFN_F_DIRTY)) {
+            break;
+        }
+        /* read the entry only after seeing it published */
+        smp_rmb();
+
+        slot = gfn->slot;
+        offset = gfn->offset * getpagesize();
+        /* entries for slots deleted since are stale, their pages were
+         * collected before the slot went away */
+        if (slot < ARRAY_SIZE(s->slots) &&
+            offset < s->slots[slot].memory_size) {
+            mem = &s->slots[slot];
+            ram_addr = qemu_ram_addr_from_host_nofail(mem->ram + offset);
+            for (i = 0; i < getpagesize(); i += TARGET_PAGE_SIZE) {
+                cpu_physical_memory_set_dirty_log_page(ram_addr + i);
+            }
+        }
+
+        /* hand the entry back only after everything has been read */
+        smp_mb();
+        gfn->flags = KVM_DIRTY_GFN_F_RESET;
+        cpu->kvm_fetch_index++;
+        count++;
+    }
+
+    return count;
+}
+
+/*
+ * The dirty rings list the pages of all slots, so this is O(dirty pages)
+ * however much memory the guest has.  Called with the iothread lock held.
+ */
+static void kvm_dirty_ring_reap(KVMState *s)
+{
+    CPUArchState *env;
+    uint32_t count = 0;
+    int ret;
+
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        CPUState *cpu = ENV_GET_CPU(env);
+
+        if (cpu->kvm_dirty_gfns) {
+            count += kvm_dirty_ring_reap_one(s, cpu);
+        }
+    }
+
+    if (count) {
+        ret = kvm_vm_ioctl(s, KVM_RESET_DIRTY_RINGS);
+        assert(ret >= 0);
+    }
+}
+
+static int kvm_dirty_ring_init(KVMState *s)
+{
+    QemuOptsList *list = qemu_find_opts("machine");
+    struct kvm_enable_cap cap = {};
+    uint64_t entries, bytes;
+    int ret;
+
+    if (QTAILQ_EMPTY(&list->head)) {
+        return 0;
+    }
+    entries = qemu_opt_get_number(QTAILQ_FIRST(&list->head),
+                                  "kvm_dirty_ring", 0);
+    if (!entries) {
+        return 0;
+    }
+    if (entries & (entries - 1) ||
+        entries > UINT32_MAX / sizeof(struct kvm_dirty_gfn)) {
+        fprintf(stderr, "kvm_dirty_ring must be a power of two\n");
+        return -EINVAL;
+    }
+
+    bytes = entries * sizeof(struct kvm_dirty_gfn);
+    ret = kvm_check_extension(s, KVM_CAP_DIRTY_LOG_RING);
+    if (ret <= 0 || bytes > ret) {
+        fprintf(stderr, "kvm: dirty ring of %" PRIu64 " entries not "
+                "supported, using the dirty bitmap\n", entries);
+        return 0;
+    }
+
+    cap.cap = KVM_CAP_DIRTY_LOG_RING;
+    cap.args[0] = bytes;
+    ret = kvm_vm_ioctl(s, KVM_ENABLE_CAP, &cap);
+    if (ret < 0) {
+        fprintf(stderr, "kvm: enabling the dirty ring failed: %s, "
+                "using the dirty bitmap\n", strerror(-ret));
+        return 0;
+    }
+
+    s->dirty_ring_size = entries;
+    return 0;
+}
+#endif
+
 #define ALIGN(x, y)  (((x)+(y)-1) & ~((y)-1))
 
 /**
@@ -409,6 +604,14 @@ static int kvm_physical_sync_dirty_bitmap(MemoryRegionSection *section)
     hwaddr start_addr = section->offset_within_address_space;
     hwaddr end_addr = start_addr + section->size;
 
+#ifdef KVM_CAP_DIRTY_LOG_RING
+    if (s->dirty_ring_size) {
+        /* KVM_GET_DIRTY_LOG is not available, the rings cover all slots */
+        kvm_dirty_ring_reap(s);
+        return 0;
+    }
+#endif
+
     d.dirty_bitmap = NULL;
     while (start_addr < end_addr) {
         mem = kvm_lookup_overlapping_slot(s, start_addr, end_addr);
@@ -488,6 +691,41 @@ static void kvm_uncoalesce_mmio_region(MemoryListener *listener,
     }
 }
 
+/* Port writes go to the same ring, tagged with pio */
+static void kvm_coalesce_pio_region(MemoryListener *listener,
+                                    MemoryRegionSection *section,
+                                    hwaddr start, hwaddr size)
+{
+    KVMState *s = kvm_state;
+
+    if (s->coalesced_pio) {
+        struct kvm_coalesced_mmio_zone zone;
+
+        zone.addr = start;
+        zone.size = size;
+        zone.pio = 1;
+
+        (void)kvm_vm_ioctl(s, KVM_REGISTER_COALESCED_MMIO, &zone);
+    }
+}
+
+static void kvm_uncoalesce_pio_region(MemoryListener *listener,
+                                      MemoryRegionSection *section,
+                                      hwaddr start, hwaddr size)
+{
+    KVMState *s = kvm_state;
+
+    if (s->coalesced_pio) {
+        struct kvm_coalesced_mmio_zone zone;
+
+        zone.addr = start;
+        zone.size = size;
+        zone.pio = 1;
+
+        (void)kvm_vm_ioctl(s, KVM_UNREGISTER_COALESCED_MMIO, &zone);
+    }
+}
+
 int kvm_check_extension(KVMState *s, unsigned int extension)
 {
     int ret;
@@ -823,6 +1061,8 @@ static MemoryListener kvm_memory_listener = {
 static MemoryListener kvm_io_listener = {
     .eventfd_add = kvm_io_ioeventfd_add,
     .eventfd_del = kvm_io_ioeventfd_del,
+    .coalesced_mmio_add = kvm_coalesce_pio_region,
+    .coalesced_mmio_del = kvm_uncoalesce_pio_region,
     .priority = 10,
 };
 
@@ -1259,6 +1499,9 @@ int kvm_init(void)
     int max_vcpus;
 
     s = g_malloc0(sizeof(KVMState));
+    qemu_mutex_init(&s->exit_addrs_lock);
+    s->exit_addrs = g_hash_table_new_full(g_int64_hash, g_int64_equal,
+                                          NULL, g_free);
 
     /*
      * On systems where the kernel can support different base page
@@ -1328,6 +1571,9 @@ int kvm_init(void)
     }
 
     s->coalesced_mmio = kvm_check_extension(s, KVM_CAP_COALESCED_MMIO);
+    /* the ring is shared, coalesced PIO needs it mapped */
+    s->coalesced_pio = s->coalesced_mmio &&
+                       kvm_check_extension(s, KVM_CAP_COALESCED_PIO);
 
     s->broken_set_mem_region = 1;
     ret = kvm_check_extension(s, KVM_CAP_JOIN_MEMORY_REGIONS_WORKS);
@@ -1379,6 +1625,14 @@ int kvm_init(void)
         goto err;
     }
 
+#ifdef KVM_CAP_DIRTY_LOG_RING
+    /* must come before the vcpus are created */
+    ret = kvm_dirty_ring_init(s);
+    if (ret < 0) {
+        goto err;
+    }
+#endif
+
     kvm_state = s;
     memory_listener_register(&kvm_memory_listener, &address_space_memory);
     memory_listener_register(&kvm_io_listener, &address_space_io);
@@ -1467,30 +1721,80 @@ static int kvm_handle_internal_error(CPUArchState *env, struct kvm_run *run)
     return -1;
 }
 
+static bool kvm_coalesced_ring_empty(KVMState *s)
+{
+    struct kvm_coalesced_mmio_ring *ring = s->coalesced_mmio_ring;
+
+    return !ring || ring->first == atomic_read(&ring->last);
+}
+
+static bool kvm_coalesced_ring_half_full(KVMState *s)
+{
+    struct kvm_coalesced_mmio_ring *ring = s->coalesced_mmio_ring;
+    uint32_t used;
+
+    if (!ring) {
+        return false;
+    }
+    used = (atomic_read(&ring->last) + KVM_COALESCED_MMIO_MAX - ring->first) %
+           KVM_COALESCED_MMIO_MAX;
+    return used >= KVM_COALESCED_MMIO_MAX / 2;
+}
+
+/*
+ * The entries are replayed in order under the iothread lock, which is
+ * taken here if the caller runs without it.  An empty ring is detected
+ * without the lock, so that accesses to regions that flush stay cheap.
+ * Entries are consumed in batches up to the producer index read at the
+ * start, and handed back to KVM at once.
+ */
 void kvm_flush_coalesced_mmio_buffer(void)
 {
     KVMState *s = kvm_state;
+    struct kvm_coalesced_mmio_ring *ring = s->coalesced_mmio_ring;
+    struct kvm_coalesced_mmio *ent;
+    bool unlocked;
+    uint32_t first, last;
 
-    if (s->coalesced_flush_in_progress) {
+    if (kvm_coalesced_ring_empty(s)) {
         return;
     }
 
-    s->coalesced_flush_in_progress = true;
-
-    if (s->coalesced_mmio_ring) {
-        struct kvm_coalesced_mmio_ring *ring = s->coalesced_mmio_ring;
-        while (ring->first != ring->last) {
-            struct kvm_coalesced_mmio *ent;
+    unlocked = !qemu_mutex_iothread_locked();
+    if (unlocked) {
+        qemu_mutex_lock_iothread();
+    }
+    if (s->coalesced_flush_in_progress) {
+        goto out;
+    }
 
-            ent = &ring->coalesced_mmio[ring->first];
+    s->coalesced_flush_in_progress = true;
 
-            cpu_physical_memory_write(ent->phys_addr, ent->data, ent->len);
-            smp_wmb();
-            ring->first = (ring->first + 1) % KVM_COALESCED_MMIO_MAX;
+    first = ring->first;
+    while (first != (last = atomic_read(&ring->last))) {
+        /* read the entries only after the index that published them */
+        smp_rmb();
+        while (first != last) {
+            ent = &ring->coalesced_mmio[first];
+            if (s->coalesced_pio && ent->pio) {
+                address_space_rw(&address_space_io, ent->phys_addr,
+                                 ent->data, ent->len, true);
+            } else {
+                cpu_physical_memory_write(ent->phys_addr, ent->data,
+                                          ent->len);
+            }
+            first = (first + 1) % KVM_COALESCED_MMIO_MAX;
         }
+        smp_mb();
+        ring->first = first;
     }
 
     s->coalesced_flush_in_progress = false;
+
+out:
+    if (unlocked) {
+        qemu_mutex_unlock_iothread();
+    }
 }
 
 static void do_kvm_cpu_synchronize_state(void *arg)
@@ -1520,6 +1824,115 @@ void kvm_cpu_synchronize_post_reset(CPUArchState *env)
     cpu->kvm_vcpu_dirty = false;
 }
 
+static void kvm_exit_count(CPUState *cpu, int run_ret)
+{
+    KVMExitStats *st = cpu->kvm_exit_stats;
+    uint32_t reason = cpu->kvm_run->exit_reason;
+
+    if (run_ret < 0) {
+        st->interrupted++;
+        return;
+    }
+    st->count[MIN(reason, KVM_EXIT_REASONS)]++;
+    if ((reason == KVM_EXIT_MMIO || reason == KVM_EXIT_IO) &&
+        ++st->countdown >= KVM_EXIT_SAMPLE_PERIOD) {
+        st->countdown = 0;
+        st->sampling = true;
+    }
+}
+
+/* Returns the start time of a sampled exit's handling, or 0 */
+static int64_t kvm_exit_sample_start(CPUState *cpu)
+{
+    return cpu->kvm_exit_stats->sampling ? get_clock() : 0;
+}
+
+static void kvm_exit_sample_end(CPUState *cpu, int64_t start)
+{
+    KVMState *s = cpu->kvm_state;
+    struct kvm_run *run = cpu->kvm_run;
+    KVMExitAddr *a;
+    uint64_t key;
+    bool write;
+
+    if (!cpu->kvm_exit_stats->sampling) {
+        return;
+    }
+    cpu->kvm_exit_stats->sampling = false;
+
+    if (run->exit_reason == KVM_EXIT_MMIO) {
+        key = run->mmio.phys_addr << 1;
+        write = run->mmio.is_write;
+    } else {
+        key = (uint64_t)run->io.port << 1 | 1;
+        write = run->io.direction == KVM_EXIT_IO_OUT;
+    }
+
+    qemu_mutex_lock(&s->exit_addrs_lock);
+    a = g_hash_table_lookup(s->exit_addrs, &key);
+    if (!a && g_hash_table_size(s->exit_addrs) < KVM_EXIT_MAX_ADDRS) {
+        a = g_new0(KVMExitAddr, 1);
+        a->key = key;
+        g_hash_table_insert(s->exit_addrs, &a->key, a);
+    }
+    if (a) {
+        if (write) {
+            a->writes++;
+        } else {
+            a->reads++;
+        }
+        a->time_ns += get_clock() - start;
+    }
+    qemu_mutex_unlock(&s->exit_addrs_lock);
+}
+
+/*
+ * Complete an MMIO or PIO exit without the iothread lock if it hits a
+ * region with thread-safe MemoryRegionOps.  Returns false if the exit has
+ * to be handled by kvm_cpu_exec() with the lock held.
+ */
+static bool kvm_handle_exit_unlocked(CPUState *cpu)
+{
+    struct kvm_run *run = cpu->kvm_run;
+    bool handled = false;
+    int64_t start;
+    uint8_t *ptr;
+    int i;
+
+    rcu_read_lock();
+    switch (run->exit_reason) {
+    case KVM_EXIT_MMIO:
+        if (address_space_access_thread_safe(&address_space_memory,
+                                             run->mmio.phys_addr,
+                                             run->mmio.len)) {
+            start = kvm_exit_sample_start(cpu);
+            address_space_rw(&address_space_memory, run->mmio.phys_addr,
+                             run->mmio.data, run->mmio.len,
+                             run->mmio.is_write);
+            kvm_exit_sample_end(cpu, start);
+            handled = true;
+        }
+        break;
+    case KVM_EXIT_IO:
+        if (address_space_access_thread_safe(&address_space_io, run->io.port,
+                                             run->io.size)) {
+            start = kvm_exit_sample_start(cpu);
+            ptr = (uint8_t *)run + run->io.data_offset;
+            for (i = 0; i < run->io.count; i++) {
+                address_space_rw(&address_space_io, run->io.port, ptr,
+                                 run->io.size,
+                                 run->io.direction == KVM_EXIT_IO_OUT);
+                ptr += run->io.size;
+            }
+            kvm_exit_sample_end(cpu, start);
+            handled = true;
+        }
+        break;
+    }
+    rcu_read_unlock();
+    return handled;
+}
+
 void kvm_cpu_synchronize_post_init(CPUArchState *env)
 {
     CPUState *cpu = ENV_GET_CPU(env);
@@ -1533,6 +1946,7 @@ int kvm_cpu_exec(CPUArchState *env)
     CPUState *cpu = ENV_GET_CPU(env);
     struct kvm_run *run = cpu->kvm_run;
     int ret, run_ret;
+    int64_t start;
 
     DPRINTF("kvm_cpu_exec()\n");
 
@@ -1559,11 +1973,26 @@ int kvm_cpu_exec(CPUArchState *env)
         }
         qemu_mutex_unlock_iothread();
 
-        run_ret = kvm_vcpu_ioctl(cpu, KVM_RUN, 0);
+        /*
+         * Exits to thread-safe regions are completed right here and the
+         * vCPU goes back in.  Anything that needs the vCPU's attention
+         * kicks it out of KVM_RUN, or sets exit_request, and lands below.
+         */
+        do {
+            run_ret = kvm_vcpu_ioctl(cpu, KVM_RUN, 0);
+            kvm_exit_count(cpu, run_ret);
+        } while (run_ret >= 0 && !cpu->exit_request &&
+                 kvm_handle_exit_unlocked(cpu));
 
         qemu_mutex_lock_iothread();
         kvm_arch_post_run(cpu, run);
 
+        /* Don't let coalesced writes pile up until the ring is full and
+         * every further write exits to userspace */
+        if (kvm_coalesced_ring_half_full(cpu->kvm_state)) {
+            kvm_flush_coalesced_mmio_buffer();
+        }
+
         if (run_ret < 0) {
             if (run_ret == -EINTR || run_ret == -EAGAIN) {
                 DPRINTF("io window exit\n");
@@ -1578,19 +2007,23 @@ int kvm_cpu_exec(CPUArchState *env)
         switch (run->exit_reason) {
         case KVM_EXIT_IO:
             DPRINTF("handle_io\n");
+            start = kvm_exit_sample_start(cpu);
             kvm_handle_io(run->io.port,
                           (uint8_t *)run + run->io.data_offset,
                           run->io.direction,
                           run->io.size,
                           run->io.count);
+            kvm_exit_sample_end(cpu, start);
             ret = 0;
             break;
         case KVM_EXIT_MMIO:
             DPRINTF("handle_mmio\n");
+            start = kvm_exit_sample_start(cpu);
             cpu_physical_memory_rw(run->mmio.phys_addr,
                                    run->mmio.data,
                                    run->mmio.len,
                                    run->mmio.is_write);
+            kvm_exit_sample_end(cpu, start);
             ret = 0;
             break;
         case KVM_EXIT_IRQ_WINDOW_OPEN:
@@ -1610,6 +2043,13 @@ int kvm_cpu_exec(CPUArchState *env)
         case KVM_EXIT_INTERNAL_ERROR:
             ret = kvm_handle_internal_error(env, run);
             break;
+#ifdef KVM_CAP_DIRTY_LOG_RING
+        case KVM_EXIT_DIRTY_RING_FULL:
+            DPRINTF("dirty ring full\n");
+            kvm_dirty_ring_reap(cpu->kvm_state);
+            ret = 0;
+            break;
+#endif
         default:
             DPRINTF("kvm_arch_handle_exit\n");
             ret = kvm_arch_handle_exit(cpu, run);
@@ -1626,6 +2066,123 @@ int kvm_cpu_exec(CPUArchState *env)
     return ret;
 }
 
+static KvmExitCountList *kvm_exit_count_prepend(KvmExitCountList *list,
+                                                const char *reason,
+                                                uint64_t count)
+{
+    KvmExitCountList *entry;
+
+    if (!count) {
+        return list;
+    }
+    entry = g_new0(KvmExitCountList, 1);
+    entry->value = g_new0(KvmExitCount, 1);
+    entry->value->reason = g_strdup(reason);
+    entry->value->count = count;
+    entry->next = list;
+    return entry;
+}
+
+static gint kvm_exit_addr_compare(gconstpointer a, gconstpointer b)
+{
+    const KVMExitAddr *x = *(KVMExitAddr * const *)a;
+    const KVMExitAddr *y = *(KVMExitAddr * const *)b;
+    uint64_t nx = x->reads + x->writes, ny = y->reads + y->writes;
+
+    return nx > ny ? -1 : nx < ny;
+}
+
+static void kvm_exit_addr_copy(gpointer key, gpointer value, gpointer opaque)
+{
+    g_ptr_array_add(opaque, g_memdup(value, sizeof(KVMExitAddr)));
+}
+
+KvmExitInfo *qmp_query_kvm_exits(bool has_top, int64_t top, Error **errp)
+{
+    KVMState *s = kvm_state;
+    KvmExitInfo *info;
+    KvmVcpuExitsList **vcpu_tail;
+    KvmExitAddressList **addr_tail;
+    CPUArchState *env;
+    GPtrArray *addrs;
+    int i;
+
+    if (!kvm_enabled()) {
+        error_setg(errp, "KVM is not enabled");
+        return NULL;
+    }
+    if (!has_top) {
+        top = 10;
+    }
+
+    info = g_new0(KvmExitInfo, 1);
+    info->sample_period = KVM_EXIT_SAMPLE_PERIOD;
+
+    vcpu_tail = &info->vcpus;
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        CPUState *cpu = ENV_GET_CPU(env);
+        KVMExitStats *st = cpu->kvm_exit_stats;
+        KvmVcpuExits *v;
+        char name[32];
+
+        if (!st) {
+            continue;
+        }
+        v = g_new0(KvmVcpuExits, 1);
+        v->cpu = cpu->cpu_index;
+        v->reasons = kvm_exit_count_prepend(NULL, "other",
+                                            st->count[KVM_EXIT_REASONS]);
+        for (i = KVM_EXIT_REASONS - 1; i >= 0; i--) {
+            if (kvm_exit_reason_names[i]) {
+                pstrcpy(name, sizeof(name), kvm_exit_reason_names[i]);
+            } else {
+                snprintf(name, sizeof(name), "reason-%d", i);
+            }
+            v->reasons = kvm_exit_count_prepend(v->reasons, name,
+                                                st->count[i]);
+            v->exits += st->count[i];
+        }
+        v->exits += st->count[KVM_EXIT_REASONS];
+        v->interrupted = st->interrupted;
+
+        *vcpu_tail = g_new0(KvmVcpuExitsList, 1);
+        (*vcpu_tail)->value = v;
+        vcpu_tail = &(*vcpu_tail)->next;
+    }
+
+    addrs = g_ptr_array_new_with_free_func(g_free);
+    qemu_mutex_lock(&s->exit_addrs_lock);
+    g_hash_table_foreach(s->exit_addrs, kvm_exit_addr_copy, addrs);
+    qemu_mutex_unlock(&s->exit_addrs_lock);
+    g_ptr_array_sort(addrs, kvm_exit_addr_compare);
+
+    addr_tail = &info->addresses;
+    for (i = 0; i < addrs->len && i < top; i++) {
+        KVMExitAddr *a = g_ptr_array_index(addrs, i);
+        bool pio = a->key & 1;
+        KvmExitAddress *e = g_new0(KvmExitAddress, 1);
+        MemoryRegionSection section;
+
+        e->space = g_strdup(pio ? "pio" : "mmio");
+        e->addr = a->key >> 1;
+        e->reads = a->reads;
+        e->writes = a->writes;
+        e->avg_ns = a->time_ns / (a->reads + a->writes);
+        section = memory_region_find(pio ? get_system_io()
+                                         : get_system_memory(), e->addr, 1);
+        if (section.mr) {
+            e->has_region = true;
+            e->region = g_strdup(memory_region_name(section.mr));
+        }
+
+        *addr_tail = g_new0(KvmExitAddressList, 1);
+        (*addr_tail)->value = e;
+        addr_tail = &(*addr_tail)->next;
+    }
+    g_ptr_array_free(addrs, TRUE);
+    return info;
+}
+
 int kvm_ioctl(KVMState *s, int type, ...)
 {
     int ret;
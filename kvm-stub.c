@@ -16,6 +16,7 @@
 #include "cpu.h"
 #include "exec/gdbstub.h"
 #include "sysemu/kvm.h"
+#include "qmp-commands.h"
 
 KVMState *kvm_state;
 bool kvm_kernel_irqchip;
@@ -145,3 +146,9 @@ int kvm_irqchip_remove_irqfd_notifier(KVMState *s, EventNotifier *n, int virq)
 {
     return -ENOSYS;
 }
+
+KvmExitInfo *qmp_query_kvm_exits(bool has_top, int64_t top, Error **errp)
+{
+    error_setg(errp, "KVM is not enabled");
+    return NULL;
+}
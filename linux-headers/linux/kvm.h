@@ -170,6 +170,7 @@ struct kvm_pit_config {
 #define KVM_EXIT_WATCHDOG         21
 #define KVM_EXIT_S390_TSCH        22
 #define KVM_EXIT_EPR              23
+#define KVM_EXIT_DIRTY_RING_FULL  31
 
 /* For KVM_EXIT_INTERNAL_ERROR */
 /* Emulate instruction failed. */
@@ -324,13 +325,19 @@ struct kvm_run {
 struct kvm_coalesced_mmio_zone {
 	__u64 addr;
 	__u32 size;
-	__u32 pad;
+	union {
+		__u32 pad;
+		__u32 pio;
+	};
 };
 
 struct kvm_coalesced_mmio {
 	__u64 phys_addr;
 	__u32 len;
-	__u32 pad;
+	union {
+		__u32 pad;
+		__u32 pio;
+	};
 	__u8  data[8];
 };
 
@@ -662,6 +669,9 @@ struct kvm_ppc_smmu_info {
 #define KVM_CAP_PPC_HTAB_FD 84
 #define KVM_CAP_S390_CSS_SUPPORT 85
 #define KVM_CAP_PPC_EPR 86
+#define KVM_CAP_SPAPR_MULTITCE 94
+#define KVM_CAP_COALESCED_PIO 162
+#define KVM_CAP_DIRTY_LOG_RING 192
 
 #ifdef KVM_CAP_IRQ_ROUTING
 
@@ -959,6 +969,8 @@ struct kvm_s390_ucas_mapping {
 #define KVM_SET_ONE_REG		  _IOW(KVMIO,  0xac, struct kvm_one_reg)
 /* VM is being stopped by host */
 #define KVM_KVMCLOCK_CTRL	  _IO(KVMIO,   0xad)
+/* Available with KVM_CAP_DIRTY_LOG_RING */
+#define KVM_RESET_DIRTY_RINGS	  _IO(KVMIO,   0xc7)
 
 #define KVM_DEV_ASSIGN_ENABLE_IOMMU	(1 << 0)
 #define KVM_DEV_ASSIGN_PCI_2_3		(1 << 1)
@@ -1010,4 +1022,24 @@ struct kvm_assigned_msix_entry {
 	__u16 padding[3];
 };
 
+/*
+ * Per-vcpu ring of dirty guest pages, mmap'ed from the vcpu fd at
+ * KVM_DIRTY_LOG_PAGE_OFFSET pages.  KVM sets F_DIRTY on an entry it
+ * publishes; userspace sets F_RESET once the page has been collected
+ * and then calls KVM_RESET_DIRTY_RINGS to hand the entries back.
+ */
+#ifndef KVM_DIRTY_LOG_PAGE_OFFSET
+#define KVM_DIRTY_LOG_PAGE_OFFSET 0
+#endif
+
+#define KVM_DIRTY_GFN_F_DIRTY		(1 << 0)
+#define KVM_DIRTY_GFN_F_RESET		(1 << 1)
+#define KVM_DIRTY_GFN_F_MASK		0x3
+
+struct kvm_dirty_gfn {
+	__u32 flags;
+	__u32 slot;	/* as_id << 16 | slot_id */
+	__u64 offset;
+};
+
 #endif /* __LINUX_KVM_H */
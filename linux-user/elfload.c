@@ -15,6 +15,7 @@
 
 #include "qemu.h"
 #include "disas/disas.h"
+#include "tcg.h"
 
 #ifdef _ARCH_PPC64
 #undef ARCH_DLINFO
@@ -1789,7 +1790,10 @@ static void load_elf_image(const char *image_name, int image_fd,
         info->brk = info->end_code;
     }
 
-    if (qemu_log_enabled()) {
+    /* the symbol table is only used to annotate logs and TB profiles;
+       reading it is a large part of the startup time of short-lived
+       processes */
+    if (qemu_log_enabled() || tcg_tb_profile) {
         load_symbols(ehdr, image_fd, load_bias);
     }
 
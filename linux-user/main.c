@@ -76,6 +76,9 @@ const char *qemu_uname_release = CONFIG_UNAME_RELEASE;
    by remapping the process stack directly at the right place */
 unsigned long guest_stack_size = 8 * 1024 * 1024UL;
 
+static const char *tb_cache_dir;
+static uint64_t tb_cache_size = 256 * 1024 * 1024ULL;
+
 void gemu_log(const char *fmt, ...)
 {
     va_list ap;
@@ -3209,6 +3212,18 @@ static void handle_arg_reserved_va(const char *arg)
 {
     char *p;
     int shift = 0;
+
+    if (!strcmp(arg, "full")) {
+#if HOST_LONG_BITS > TARGET_VIRT_ADDR_SPACE_BITS && \
+    TARGET_VIRT_ADDR_SPACE_BITS <= 32
+        reserved_va = 1ul << TARGET_VIRT_ADDR_SPACE_BITS;
+        return;
+#else
+        fprintf(stderr, "-R full is only supported for 32-bit guests "
+                "on 64-bit hosts\n");
+        exit(1);
+#endif
+    }
     reserved_va = strtoul(arg, &p, 0);
     switch (*p) {
     case 'k':
@@ -3247,6 +3262,43 @@ static void handle_arg_singlestep(const char *arg)
     singlestep = 1;
 }
 
+static void handle_arg_tcg_opt(const char *arg)
+{
+    int mask = tcg_opt_parse(arg);
+
+    if (mask < 0) {
+        tcg_opt_print_passes(stdout);
+        exit(1);
+    }
+    tcg_opt_flags = mask;
+}
+
+static void handle_arg_tb_profile(const char *arg)
+{
+    tcg_tb_profile = true;
+}
+
+static void handle_arg_tb_stats(const char *arg)
+{
+    tcg_tb_stats = true;
+}
+
+static void handle_arg_tb_cache(const char *arg)
+{
+    tb_cache_dir = arg;
+}
+
+static void handle_arg_tb_cache_size(const char *arg)
+{
+    char *end;
+    int64_t size = strtosz_suffix(arg, &end, STRTOSZ_DEFSUFFIX_B);
+
+    if (size <= 0 || *end) {
+        usage();
+    }
+    tb_cache_size = size;
+}
+
 static void handle_arg_strace(const char *arg)
 {
     do_strace = 1;
@@ -3291,7 +3343,8 @@ static const struct qemu_argument arg_table[] = {
     {"B",          "QEMU_GUEST_BASE",  true,  handle_arg_guest_base,
      "address",    "set guest_base address to 'address'"},
     {"R",          "QEMU_RESERVED_VA", true,  handle_arg_reserved_va,
-     "size",       "reserve 'size' bytes for guest virtual address space"},
+     "size",       "reserve 'size' bytes for guest virtual address space "
+     "('full' for all of it)"},
 #endif
     {"d",          "QEMU_LOG",         true,  handle_arg_log,
      "item[,...]", "enable logging of specified items "
@@ -3302,6 +3355,16 @@ static const struct qemu_argument arg_table[] = {
      "pagesize",   "set the host page size to 'pagesize'"},
     {"singlestep", "QEMU_SINGLESTEP",  false, handle_arg_singlestep,
      "",           "run in singlestep mode"},
+    {"tcg-opt",    "QEMU_TCG_OPT",     true,  handle_arg_tcg_opt,
+     "pass[,...]", "select the TCG optimizer passes (default: all)"},
+    {"tb-profile", "QEMU_TB_PROFILE",  false, handle_arg_tb_profile,
+     "",           "print the hottest TBs at exit, write /tmp/perf-PID.map"},
+    {"tb-stats",   "QEMU_TB_STATS",    false, handle_arg_tb_stats,
+     "",           "print code generation statistics at exit"},
+    {"tb-cache",   "QEMU_TB_CACHE",    true,  handle_arg_tb_cache,
+     "dir",        "keep translated code across runs in 'dir'"},
+    {"tb-cache-size", "QEMU_TB_CACHE_SIZE", true, handle_arg_tb_cache_size,
+     "size",       "limit the size of the code cache (default: 256M)"},
     {"strace",     "QEMU_STRACE",      false, handle_arg_strace,
      "",           "log system calls"},
     {"version",    "QEMU_VERSION",     false, handle_arg_version,
@@ -3543,6 +3606,15 @@ int main(int argc, char **argv, char **envp)
 
     thread_env = env;
 
+    if (tb_cache_dir) {
+        if (gdbstub_port || singlestep) {
+            /* breakpoints and single stepping change the translation */
+            fprintf(stderr, "qemu: TB cache disabled while debugging\n");
+        } else {
+            tb_cache_init(tb_cache_dir, tb_cache_size, cpu_model);
+        }
+    }
+
     if (getenv("QEMU_STRACE")) {
         do_strace = 1;
     }
@@ -3569,7 +3641,8 @@ int main(int argc, char **argv, char **envp)
         }
 
         if (reserved_va) {
-            mmap_next_start = reserved_va;
+            /* mmap_next_start is an abi_ulong, -R full would wrap it */
+            mmap_next_start = reserved_va - qemu_host_page_size;
         }
     }
 #endif /* CONFIG_USE_GUEST_BASE */
@@ -140,6 +140,7 @@ int target_mprotect(abi_ulong start, abi_ulong len, int prot)
             goto error;
     }
     page_set_flags(start, start + len, prot | PAGE_VALID);
+    tb_cache_protect(start, len, prot);
     mmap_unlock();
     return 0;
 error:
@@ -223,17 +224,24 @@ static abi_ulong mmap_find_vma_reserved(abi_ulong start, abi_ulong size)
 {
     abi_ulong addr;
     abi_ulong end_addr;
+    unsigned long limit = RESERVED_VA;
     int prot;
     int looped = 0;
 
-    if (size > RESERVED_VA) {
+    /* When the whole guest address space is reserved (-R full), the end
+       of the last page would not fit in an abi_ulong; leave it unused.  */
+    if (limit - 1 == (abi_ulong)-1) {
+        limit -= qemu_host_page_size;
+    }
+    if (size > limit) {
         return (abi_ulong)-1;
     }
 
     size = HOST_PAGE_ALIGN(size);
-    end_addr = start + size;
-    if (end_addr > RESERVED_VA) {
-        end_addr = RESERVED_VA;
+    if ((unsigned long)start + size > limit) {
+        end_addr = limit;
+    } else {
+        end_addr = start + size;
     }
     addr = end_addr - qemu_host_page_size;
 
@@ -242,7 +250,7 @@ static abi_ulong mmap_find_vma_reserved(abi_ulong start, abi_ulong size)
             if (looped) {
                 return (abi_ulong)-1;
             }
-            end_addr = RESERVED_VA;
+            end_addr = limit;
             addr = end_addr - qemu_host_page_size;
             looped = 1;
             continue;
@@ -575,6 +583,7 @@ abi_long target_mmap(abi_ulong start, abi_ulong len, int prot,
     }
  the_end1:
     page_set_flags(start, start + len, prot | PAGE_VALID);
+    tb_cache_map(start, len, prot, flags & MAP_ANONYMOUS ? -1 : fd, offset);
  the_end:
 #ifdef DEBUG_MMAP
     printf("ret=0x" TARGET_ABI_FMT_lx "\n", start);
@@ -687,6 +696,7 @@ int target_munmap(abi_ulong start, abi_ulong len)
     if (ret == 0) {
         page_set_flags(start, start + len, 0);
         tb_invalidate_phys_range(start, start + len, 0);
+        tb_cache_unmap(start, len);
     }
     mmap_unlock();
     return ret;
@@ -764,6 +774,8 @@ abi_long target_mremap(abi_ulong old_addr, abi_ulong old_size,
         prot = page_get_flags(old_addr);
         page_set_flags(old_addr, old_addr + old_size, 0);
         page_set_flags(new_addr, new_addr + new_size, prot | PAGE_VALID);
+        tb_cache_unmap(old_addr, old_size);
+        tb_cache_unmap(new_addr, new_size);
     }
     tb_invalidate_phys_range(new_addr, new_addr + new_size, 0);
     mmap_unlock();
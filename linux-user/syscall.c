@@ -106,6 +106,7 @@ int __clone2(int (*fn)(void *), void *child_stack_base,
 #include "cpu-uname.h"
 
 #include "qemu.h"
+#include "tcg.h"
 
 #if defined(CONFIG_USE_NPTL)
 #define CLONE_NPTL_FLAGS2 (CLONE_SETTLS | \
@@ -4922,6 +4923,9 @@ static int do_futex(target_ulong uaddr, int op, int val, target_ulong timeout,
 #endif
     switch (base_op) {
     case FUTEX_WAIT:
+    case FUTEX_WAIT_BITSET:
+        /* the bitset variant, with an absolute timeout, is what glibc
+           uses for condition variables and timed lock waits */
         if (timeout) {
             pts = &ts;
             target_to_host_timespec(pts, timeout);
@@ -4929,9 +4933,11 @@ static int do_futex(target_ulong uaddr, int op, int val, target_ulong timeout,
             pts = NULL;
         }
         return get_errno(sys_futex(g2h(uaddr), op, tswap32(val),
-                         pts, NULL, 0));
+                         pts, NULL, base_op == FUTEX_WAIT ? 0 : val3));
     case FUTEX_WAKE:
-        return get_errno(sys_futex(g2h(uaddr), op, val, NULL, NULL, 0));
+    case FUTEX_WAKE_BITSET:
+        return get_errno(sys_futex(g2h(uaddr), op, val, NULL, NULL,
+                                   base_op == FUTEX_WAKE ? 0 : val3));
     case FUTEX_FD:
         return get_errno(sys_futex(g2h(uaddr), op, val, NULL, NULL, 0));
     case FUTEX_REQUEUE:
@@ -5230,6 +5236,13 @@ abi_long do_syscall(void *cpu_env, int num, abi_long arg1,
         _mcleanup();
 #endif
         gdb_exit(cpu_env, arg1);
+        tb_cache_save();
+        if (tcg_tb_profile) {
+            dump_tb_profile(stderr, fprintf, 20);
+        }
+        if (tcg_tb_stats) {
+            dump_tb_stats(stderr, fprintf);
+        }
         _exit(arg1);
         ret = 0; /* avoid warning */
         break;
@@ -5420,6 +5433,7 @@ abi_long do_syscall(void *cpu_env, int num, abi_long arg1,
             }
             if (!(p = lock_user_string(arg1)))
                 goto execve_efault;
+            tb_cache_save();
             ret = get_errno(execve(p, argp, envp));
             unlock_user(p, arg1, 0);
 
@@ -7001,6 +7015,13 @@ abi_long do_syscall(void *cpu_env, int num, abi_long arg1,
         _mcleanup();
 #endif
         gdb_exit(cpu_env, arg1);
+        tb_cache_save();
+        if (tcg_tb_profile) {
+            dump_tb_profile(stderr, fprintf, 20);
+        }
+        if (tcg_tb_stats) {
+            dump_tb_stats(stderr, fprintf);
+        }
         ret = get_errno(exit_group(arg1));
         break;
 #endif
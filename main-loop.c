@@ -27,6 +27,7 @@
 #include "slirp/slirp.h"
 #include "qemu/main-loop.h"
 #include "block/aio.h"
+#include "qmp-commands.h"
 
 #ifndef _WIN32
 
@@ -109,6 +110,95 @@ static int qemu_signal_init(void)
 
 static AioContext *qemu_aio_context;
 
+bool main_loop_wakeup_unclaimed;
+static uint64_t main_loop_wakeups;
+static uint64_t main_loop_io_wakeups;
+
+DEFINE_TLS(const char *, callback_owner);
+static CallbackStats glib_stats;
+
+AioContext *qemu_get_aio_context(void)
+{
+    return qemu_aio_context;
+}
+
+WakeupInfo *qmp_query_wakeups(Error **errp)
+{
+    WakeupInfo *info = g_new0(WakeupInfo, 1);
+
+    info->total = main_loop_wakeups;
+    info->io = main_loop_io_wakeups;
+    info->sources = qemu_timer_wakeup_sources(NULL);
+    if (qemu_aio_context) {
+        info->sources = aio_bh_wakeup_sources(qemu_aio_context,
+                                              info->sources);
+    }
+    return info;
+}
+
+const char *qemu_set_callback_owner(const char *owner)
+{
+    const char *old = tls_var(callback_owner);
+
+    /* Owners are never freed, the callbacks may outlive them */
+    tls_var(callback_owner) = owner ? g_intern_string(owner) : NULL;
+    return old;
+}
+
+int64_t callback_stats_begin(CallbackStats *s, const char **owner)
+{
+    *owner = tls_var(callback_owner);
+    tls_var(callback_owner) = s->owner;
+    return get_clock();
+}
+
+void callback_stats_end(CallbackStats *s, const char *owner, int64_t start)
+{
+    s->calls++;
+    s->time_ns += get_clock() - start;
+    tls_var(callback_owner) = owner;
+}
+
+CallbackAccountingList *callback_stats_list(CallbackAccountingList *list,
+                                            const CallbackStats *s,
+                                            const char *kind, char *name)
+{
+    CallbackAccountingList *entry;
+    CallbackAccounting *cb;
+
+    if (!s->calls) {
+        g_free(name);
+        return list;
+    }
+    cb = g_new0(CallbackAccounting, 1);
+    cb->kind = g_strdup(kind);
+    cb->name = name;
+    if (s->owner) {
+        cb->has_owner = true;
+        cb->owner = g_strdup(s->owner);
+    }
+    cb->calls = s->calls;
+    cb->time_ns = s->time_ns;
+
+    entry = g_new0(CallbackAccountingList, 1);
+    entry->value = cb;
+    entry->next = list;
+    return entry;
+}
+
+/* The callbacks of the main loop; the caller adds the lock statistics */
+CallbackAccountingList *main_loop_cpu_accounting(void)
+{
+    CallbackAccountingList *list;
+
+    list = qemu_timer_cpu_accounting(NULL);
+    if (qemu_aio_context) {
+        list = aio_bh_cpu_accounting(qemu_aio_context, list);
+    }
+    list = qemu_iohandler_cpu_accounting(list);
+    return callback_stats_list(list, &glib_stats, "fd", g_strdup("glib"));
+}
+
 void qemu_notify_event(void)
 {
     if (!qemu_aio_context) {
@@ -149,7 +239,7 @@ static int max_priority;
 static int glib_pollfds_idx;
 static int glib_n_poll_fds;
 
-static void glib_pollfds_fill(uint32_t *cur_timeout)
+static void glib_pollfds_fill(int64_t *cur_timeout)
 {
     GMainContext *context = g_main_context_default();
     int timeout = 0;
@@ -168,9 +258,9 @@ static void glib_pollfds_fill(uint32_t *cur_timeout)
                                  glib_n_poll_fds);
     } while (n != glib_n_poll_fds);
 
-    if (timeout >= 0 && timeout < *cur_timeout) {
-        *cur_timeout = timeout;
-    }
+    *cur_timeout = qemu_soonest_timeout(timeout < 0 ? -1 :
+                                        (int64_t)timeout * SCALE_MS,
+                                        *cur_timeout);
 }
 
 static void glib_pollfds_poll(void)
@@ -179,24 +269,30 @@ static void glib_pollfds_poll(void)
     GPollFD *pfds = &g_array_index(gpollfds, GPollFD, glib_pollfds_idx);
 
     if (g_main_context_check(context, max_priority, pfds, glib_n_poll_fds)) {
+        const char *owner;
+        int64_t start = callback_stats_begin(&glib_stats, &owner);
+
         g_main_context_dispatch(context);
+        callback_stats_end(&glib_stats, owner, start);
     }
 }
 
-static int os_host_main_loop_wait(uint32_t timeout)
+static int os_host_main_loop_wait(int64_t timeout)
 {
     int ret;
 
     glib_pollfds_fill(&timeout);
 
-    if (timeout > 0) {
+    if (timeout) {
         qemu_mutex_unlock_iothread();
     }
 
-    ret = g_poll((GPollFD *)gpollfds->data, gpollfds->len, timeout);
+    ret = qemu_poll_ns((GPollFD *)gpollfds->data, gpollfds->len, timeout);
 
-    if (timeout > 0) {
+    if (timeout) {
         qemu_mutex_lock_iothread();
+        main_loop_wakeups++;
+        main_loop_wakeup_unclaimed = true;
     }
 
     glib_pollfds_poll();
@@ -342,7 +438,7 @@ static void pollfds_poll(GArray *pollfds, int nfds, fd_set *rfds,
     }
 }
 
-static int os_host_main_loop_wait(uint32_t timeout)
+static int os_host_main_loop_wait(int64_t timeout)
 {
     GMainContext *context = g_main_context_default();
     GPollFD poll_fds[1024 * 2]; /* this is probably overkill */
@@ -374,13 +470,18 @@ static int os_host_main_loop_wait(uint32_t timeout)
         poll_fds[n_poll_fds + i].events = G_IO_IN;
     }
 
-    if (poll_timeout < 0 || timeout < poll_timeout) {
-        poll_timeout = timeout;
+    if (timeout >= 0 &&
+        (poll_timeout < 0 || qemu_timeout_ns_to_ms(timeout) < poll_timeout)) {
+        poll_timeout = qemu_timeout_ns_to_ms(timeout);
     }
 
     qemu_mutex_unlock_iothread();
     g_poll_ret = g_poll(poll_fds, n_poll_fds + w->num, poll_timeout);
     qemu_mutex_lock_iothread();
+    if (poll_timeout) {
+        main_loop_wakeups++;
+        main_loop_wakeup_unclaimed = true;
+    }
     if (g_poll_ret > 0) {
         for (i = 0; i < w->num; i++) {
             w->revents[i] = poll_fds[n_poll_fds + i].revents;
@@ -422,6 +523,7 @@ int main_loop_wait(int nonblocking)
 {
     int ret;
     uint32_t timeout = UINT32_MAX;
+    int64_t timeout_ns;
 
     if (nonblocking) {
         timeout = 0;
@@ -435,14 +537,33 @@ int main_loop_wait(int nonblocking)
     slirp_pollfds_fill(gpollfds);
 #endif
     qemu_iohandler_fill(gpollfds);
-    ret = os_host_main_loop_wait(timeout);
+
+    if (timeout == UINT32_MAX) {
+        timeout_ns = -1;
+    } else {
+        timeout_ns = (uint64_t)timeout * SCALE_MS;
+    }
+    timeout_ns = qemu_soonest_timeout(timeout_ns,
+                                      qemu_timer_main_loop_timeout());
+    ret = os_host_main_loop_wait(timeout_ns);
     qemu_iohandler_poll(gpollfds, ret);
 #ifdef CONFIG_SLIRP
     slirp_pollfds_poll(gpollfds, (ret < 0));
 #endif
 
+    /* If file descriptors were ready, the timers did not wake us up */
+    if (ret > 0 && main_loop_wakeup_unclaimed) {
+        main_loop_wakeup_unclaimed = false;
+        main_loop_io_wakeups++;
+    }
+
     qemu_run_all_timers();
 
+    if (main_loop_wakeup_unclaimed) {
+        main_loop_wakeup_unclaimed = false;
+        main_loop_io_wakeups++;
+    }
+
     return ret;
 }
 
@@ -18,10 +18,17 @@
 #include "exec/ioport.h"
 #include "qemu/bitops.h"
 #include "sysemu/kvm.h"
+#include "sysemu/cpus.h"
+#include "sysemu/sysemu.h"
+#include "qemu/main-loop.h"
+#include "qemu/rcu.h"
+#include "qemu/event_notifier.h"
 #include <assert.h>
 
 #include "exec/memory-internal.h"
 
+//#define DEBUG_TOPOLOGY_UPDATE
+
 static unsigned memory_region_transaction_depth;
 static bool memory_region_update_pending;
 static bool global_dirty_log = false;
@@ -218,9 +225,12 @@ struct FlatRange {
 };
 
 /* Flattened global view of current active memory hierarchy.  Kept in sorted
- * order.
+ * order.  AddressSpace.current_map is replaced under the iothread lock;
+ * readers without the lock use RCU and the old view is freed after a
+ * grace period.
  */
 struct FlatView {
+    struct rcu_head rcu;
     FlatRange *ranges;
     unsigned nr;
     unsigned nr_allocated;
@@ -268,6 +278,14 @@ static void flatview_destroy(FlatView *view)
     g_free(view->ranges);
 }
 
+static void flatview_free_rcu(struct rcu_head *head)
+{
+    FlatView *view = container_of(head, FlatView, rcu);
+
+    flatview_destroy(view);
+    g_free(view);
+}
+
 static bool can_merge(FlatRange *r1, FlatRange *r2)
 {
     return int128_eq(addrrange_end(r1->addr), r2->addr.start)
@@ -574,6 +592,77 @@ static FlatView generate_memory_topology(MemoryRegion *mr)
     return view;
 }
 
+/* Append the part of @fr that lies within @clip to @view. */
+static void flatview_append_clipped(FlatView *view, FlatRange *fr,
+                                    AddrRange clip)
+{
+    FlatRange tmp = *fr;
+
+    if (!addrrange_intersects(fr->addr, clip)) {
+        return;
+    }
+    tmp.addr = addrrange_intersection(fr->addr, clip);
+    if (!int128_nz(tmp.addr.size)) {
+        return;
+    }
+    tmp.offset_in_region += int128_get64(int128_sub(tmp.addr.start,
+                                                    fr->addr.start));
+    flatview_insert(view, view->nr, &tmp);
+}
+
+/* Like generate_memory_topology(), but only render the addresses in @clip
+ * and take everything else from @old_view.  Subregions that do not
+ * intersect @clip are skipped by render_memory_region(), so a small change
+ * costs a walk down to the regions it touches plus a copy of the ranges.
+ */
+static FlatView generate_memory_topology_range(FlatView *old_view,
+                                               MemoryRegion *mr,
+                                               AddrRange clip)
+{
+    Int128 clip_end = addrrange_end(clip);
+    AddrRange below = addrrange_make(int128_zero(), clip.start);
+    AddrRange above = addrrange_make(clip_end,
+                                     int128_sub(int128_2_64(), clip_end));
+    FlatView view, inner;
+    FlatRange *fr;
+
+    flatview_init(&view);
+    flatview_init(&inner);
+
+    if (mr) {
+        render_memory_region(&inner, mr, int128_zero(), clip, false);
+    }
+
+    FOR_EACH_FLAT_RANGE(fr, old_view) {
+        flatview_append_clipped(&view, fr, below);
+    }
+    FOR_EACH_FLAT_RANGE(fr, &inner) {
+        flatview_insert(&view, view.nr, fr);
+    }
+    FOR_EACH_FLAT_RANGE(fr, old_view) {
+        flatview_append_clipped(&view, fr, above);
+    }
+    flatview_destroy(&inner);
+    flatview_simplify(&view);
+
+    return view;
+}
+
+#ifdef DEBUG_TOPOLOGY_UPDATE
+static void flatview_check(FlatView *view, MemoryRegion *mr)
+{
+    FlatView full = generate_memory_topology(mr);
+    unsigned i;
+
+    assert(full.nr == view->nr);
+    for (i = 0; i < full.nr; i++) {
+        assert(flatrange_equal(&full.ranges[i], &view->ranges[i]));
+        assert(full.ranges[i].dirty_log_mask == view->ranges[i].dirty_log_mask);
+    }
+    flatview_destroy(&full);
+}
+#endif
+
 static void address_space_add_del_ioeventfds(AddressSpace *as,
                                              MemoryRegionIoeventfd *fds_new,
                                              unsigned fds_new_nb,
@@ -717,16 +806,80 @@ static void address_space_update_topology_pass(AddressSpace *as,
 }
 
 
+/* Mark the addresses covered by @mr as changed, in the address space that
+ * contains it.  The extent is computed from the parent chain, so if @mr
+ * or one of its containers is also visible through an alias the whole map
+ * of every address space is rendered again.
+ */
+static void memory_region_changed(MemoryRegion *mr)
+{
+    AddressSpace *as;
+    Int128 size = mr->size;
+    Int128 start = int128_zero();
+    Int128 end;
+
+    memory_region_update_pending = true;
+
+    for (;;) {
+        if (mr->aliased) {
+            QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
+                as->update_all = true;
+            }
+            return;
+        }
+        int128_addto(&start, int128_make64(mr->addr));
+        if (!mr->parent) {
+            break;
+        }
+        mr = mr->parent;
+    }
+    if (int128_ge(start, int128_2_64())) {
+        return;
+    }
+    end = int128_min(int128_add(start, size), int128_2_64());
+
+    QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
+        if (as->root != mr) {
+            continue;
+        }
+        if (!int128_lt(as->update_start, as->update_end)) {
+            as->update_start = start;
+            as->update_end = end;
+        } else {
+            as->update_start = int128_min(as->update_start, start);
+            as->update_end = int128_max(as->update_end, end);
+        }
+    }
+}
+
 static void address_space_update_topology(AddressSpace *as)
 {
-    FlatView old_view = *as->current_map;
-    FlatView new_view = generate_memory_topology(as->root);
+    FlatView *old_view = as->current_map;
+    FlatView *new_view = old_view;
+
+    if (as->update_all) {
+        new_view = g_new(FlatView, 1);
+        *new_view = generate_memory_topology(as->root);
+    } else if (int128_lt(as->update_start, as->update_end)) {
+        new_view = g_new(FlatView, 1);
+        *new_view = generate_memory_topology_range(old_view, as->root,
+            addrrange_make(as->update_start,
+                           int128_sub(as->update_end, as->update_start)));
+    }
+    as->update_all = false;
+    as->update_start = as->update_end = int128_zero();
+#ifdef DEBUG_TOPOLOGY_UPDATE
+    flatview_check(new_view, as->root);
+#endif
 
-    address_space_update_topology_pass(as, old_view, new_view, false);
-    address_space_update_topology_pass(as, old_view, new_view, true);
+    /* Listeners still see every range, unchanged ones as region_nop */
+    address_space_update_topology_pass(as, *old_view, *new_view, false);
+    address_space_update_topology_pass(as, *old_view, *new_view, true);
 
-    *as->current_map = new_view;
-    flatview_destroy(&old_view);
+    if (new_view != old_view) {
+        atomic_rcu_set(&as->current_map, new_view);
+        call_rcu1(&old_view->rcu, flatview_free_rcu);
+    }
     address_space_update_ioeventfds(as);
 }
 
@@ -808,6 +961,7 @@ void memory_region_init(MemoryRegion *mr,
     mr->priority = 0;
     mr->may_overlap = false;
     mr->alias = NULL;
+    mr->aliased = false;
     QTAILQ_INIT(&mr->subregions);
     memset(&mr->subregions_link, 0, sizeof mr->subregions_link);
     QTAILQ_INIT(&mr->coalesced);
@@ -965,6 +1119,8 @@ void memory_region_init_alias(MemoryRegion *mr,
     memory_region_init(mr, name, size);
     mr->alias = orig;
     mr->alias_offset = offset;
+    /* Never cleared, updates to @orig just get slower */
+    orig->aliased = true;
 }
 
 void memory_region_init_rom_device(MemoryRegion *mr,
@@ -1062,7 +1218,9 @@ void memory_region_set_log(MemoryRegion *mr, bool log, unsigned client)
 
     memory_region_transaction_begin();
     mr->dirty_log_mask = (mr->dirty_log_mask & ~mask) | (log * mask);
-    memory_region_update_pending |= mr->enabled;
+    if (mr->enabled) {
+        memory_region_changed(mr);
+    }
     memory_region_transaction_commit();
 }
 
@@ -1116,7 +1274,9 @@ void memory_region_set_readonly(MemoryRegion *mr, bool readonly)
     if (mr->readonly != readonly) {
         memory_region_transaction_begin();
         mr->readonly = readonly;
-        memory_region_update_pending |= mr->enabled;
+        if (mr->enabled) {
+            memory_region_changed(mr);
+        }
         memory_region_transaction_commit();
     }
 }
@@ -1126,7 +1286,9 @@ void memory_region_rom_device_set_readable(MemoryRegion *mr, bool readable)
     if (mr->readable != readable) {
         memory_region_transaction_begin();
         mr->readable = readable;
-        memory_region_update_pending |= mr->enabled;
+        if (mr->enabled) {
+            memory_region_changed(mr);
+        }
         memory_region_transaction_commit();
     }
 }
@@ -1269,7 +1431,9 @@ void memory_region_add_eventfd(MemoryRegion *mr,
     memmove(&mr->ioeventfds[i+1], &mr->ioeventfds[i],
             sizeof(*mr->ioeventfds) * (mr->ioeventfd_nb-1 - i));
     mr->ioeventfds[i] = mrfd;
-    memory_region_update_pending |= mr->enabled;
+    if (mr->enabled) {
+        memory_region_changed(mr);
+    }
     memory_region_transaction_commit();
 }
 
@@ -1302,8 +1466,134 @@ void memory_region_del_eventfd(MemoryRegion *mr,
     --mr->ioeventfd_nb;
     mr->ioeventfds = g_realloc(mr->ioeventfds,
                                   sizeof(*mr->ioeventfds)*mr->ioeventfd_nb + 1);
-    memory_region_update_pending |= mr->enabled;
+    if (mr->enabled) {
+        memory_region_changed(mr);
+    }
+    memory_region_transaction_commit();
+}
+
+typedef struct MemoryRegionDoorbellValue {
+    EventNotifier e;
+    uint64_t value;
+    MemoryRegionDoorbell *db;
+} MemoryRegionDoorbellValue;
+
+struct MemoryRegionDoorbell {
+    MemoryRegion *mr;
+    hwaddr addr;
+    unsigned size;
+    unsigned nb_values;
+    QLIST_ENTRY(MemoryRegionDoorbell) link;
+    MemoryRegionDoorbellValue values[];
+};
+
+static QLIST_HEAD(, MemoryRegionDoorbell) doorbells =
+    QLIST_HEAD_INITIALIZER(doorbells);
+
+static void memory_region_doorbell_replay(MemoryRegionDoorbellValue *v)
+{
+    MemoryRegionDoorbell *db = v->db;
+
+    if (event_notifier_test_and_clear(&v->e)) {
+        io_mem_write(db->mr, db->addr, v->value, db->size);
+    }
+}
+
+static void memory_region_doorbell_read(EventNotifier *e)
+{
+    memory_region_doorbell_replay(container_of(e, MemoryRegionDoorbellValue,
+                                               e));
+}
+
+static void memory_region_doorbell_flush(MemoryRegionDoorbell *db)
+{
+    unsigned i;
+
+    for (i = 0; i < db->nb_values; i++) {
+        memory_region_doorbell_replay(&db->values[i]);
+    }
+}
+
+/* The device state must include every write before it is saved */
+static void memory_region_doorbells_vm_change(void *opaque, int running,
+                                              RunState state)
+{
+    MemoryRegionDoorbell *db;
+
+    if (!running) {
+        QLIST_FOREACH(db, &doorbells, link) {
+            memory_region_doorbell_flush(db);
+        }
+    }
+}
+
+MemoryRegionDoorbell *memory_region_add_doorbell(MemoryRegion *mr,
+                                                 hwaddr addr,
+                                                 unsigned size,
+                                                 const uint64_t *values,
+                                                 unsigned nb_values)
+{
+    static bool vm_change_registered;
+    MemoryRegionDoorbell *db;
+    unsigned i;
+
+    if (!kvm_enabled() || !kvm_has_many_ioeventfds()) {
+        return NULL;
+    }
+    if (!vm_change_registered) {
+        qemu_add_vm_change_state_handler(memory_region_doorbells_vm_change,
+                                         NULL);
+        vm_change_registered = true;
+    }
+
+    db = g_malloc0(sizeof(*db) + nb_values * sizeof(db->values[0]));
+    db->mr = mr;
+    db->addr = addr;
+    db->size = size;
+
+    /* one topology update registers all of them */
+    memory_region_transaction_begin();
+    for (i = 0; i < nb_values; i++) {
+        MemoryRegionDoorbellValue *v = &db->values[db->nb_values];
+
+        if (event_notifier_init(&v->e, 0) < 0) {
+            break;
+        }
+        v->value = values[i];
+        v->db = db;
+        event_notifier_set_handler(&v->e, memory_region_doorbell_read);
+        memory_region_add_eventfd(mr, addr, size, true, v->value, &v->e);
+        db->nb_values++;
+    }
     memory_region_transaction_commit();
+
+    QLIST_INSERT_HEAD(&doorbells, db, link);
+    return db;
+}
+
+void memory_region_del_doorbell(MemoryRegionDoorbell *db)
+{
+    unsigned i;
+
+    if (!db) {
+        return;
+    }
+
+    QLIST_REMOVE(db, link);
+    memory_region_transaction_begin();
+    for (i = 0; i < db->nb_values; i++) {
+        memory_region_del_eventfd(db->mr, db->addr, db->size, true,
+                                  db->values[i].value, &db->values[i].e);
+    }
+    memory_region_transaction_commit();
+
+    /* writes that raced with the removal still have to reach the device */
+    for (i = 0; i < db->nb_values; i++) {
+        event_notifier_set_handler(&db->values[i].e, NULL);
+        memory_region_doorbell_replay(&db->values[i]);
+        event_notifier_cleanup(&db->values[i].e);
+    }
+    g_free(db);
 }
 
 static void memory_region_add_subregion_common(MemoryRegion *mr,
@@ -1346,7 +1636,9 @@ static void memory_region_add_subregion_common(MemoryRegion *mr,
     }
     QTAILQ_INSERT_TAIL(&mr->subregions, subregion, subregions_link);
 done:
-    memory_region_update_pending |= mr->enabled && subregion->enabled;
+    if (mr->enabled && subregion->enabled) {
+        memory_region_changed(subregion);
+    }
     memory_region_transaction_commit();
 }
 
@@ -1375,9 +1667,11 @@ void memory_region_del_subregion(MemoryRegion *mr,
 {
     memory_region_transaction_begin();
     assert(subregion->parent == mr);
+    if (mr->enabled && subregion->enabled) {
+        memory_region_changed(subregion);
+    }
     subregion->parent = NULL;
     QTAILQ_REMOVE(&mr->subregions, subregion, subregions_link);
-    memory_region_update_pending |= mr->enabled && subregion->enabled;
     memory_region_transaction_commit();
 }
 
@@ -1388,7 +1682,7 @@ void memory_region_set_enabled(MemoryRegion *mr, bool enabled)
     }
     memory_region_transaction_begin();
     mr->enabled = enabled;
-    memory_region_update_pending = true;
+    memory_region_changed(mr);
     memory_region_transaction_commit();
 }
 
@@ -1423,7 +1717,9 @@ void memory_region_set_alias_offset(MemoryRegion *mr, hwaddr offset)
 
     memory_region_transaction_begin();
     mr->alias_offset = offset;
-    memory_region_update_pending |= mr->enabled;
+    if (mr->enabled) {
+        memory_region_changed(mr);
+    }
     memory_region_transaction_commit();
 }
 
@@ -1445,26 +1741,34 @@ static int cmp_flatrange_addr(const void *addr_, const void *fr_)
     return 0;
 }
 
-static FlatRange *address_space_lookup(AddressSpace *as, AddrRange addr)
+static FlatRange *flatview_lookup(FlatView *view, AddrRange addr)
 {
-    return bsearch(&addr, as->current_map->ranges, as->current_map->nr,
+    return bsearch(&addr, view->ranges, view->nr,
                    sizeof(FlatRange), cmp_flatrange_addr);
 }
 
+/* May be called without the iothread lock.  The MemoryRegion in the
+ * result is only guaranteed to stay alive while the lock is held.
+ */
 MemoryRegionSection memory_region_find(MemoryRegion *address_space,
                                        hwaddr addr, uint64_t size)
 {
     AddressSpace *as = memory_region_to_address_space(address_space);
     AddrRange range = addrrange_make(int128_make64(addr),
                                      int128_make64(size));
-    FlatRange *fr = address_space_lookup(as, range);
     MemoryRegionSection ret = { .mr = NULL, .size = 0 };
+    FlatView *view;
+    FlatRange *fr;
 
+    rcu_read_lock();
+    view = atomic_rcu_read(&as->current_map);
+    fr = flatview_lookup(view, range);
     if (!fr) {
+        rcu_read_unlock();
         return ret;
     }
 
-    while (fr > as->current_map->ranges
+    while (fr > view->ranges
            && addrrange_intersects(fr[-1].addr, range)) {
         --fr;
     }
@@ -1477,6 +1781,7 @@ MemoryRegionSection memory_region_find(MemoryRegion *address_space,
     ret.size = int128_get64(range.size);
     ret.offset_within_address_space = int128_get64(range.start);
     ret.readonly = fr->readonly;
+    rcu_read_unlock();
     return ret;
 }
 
@@ -1568,6 +1873,14 @@ void address_space_init(AddressSpace *as, MemoryRegion *root)
     as->root = root;
     as->current_map = g_new(FlatView, 1);
     flatview_init(as->current_map);
+    as->update_all = true;
+    as->update_start = as->update_end = int128_zero();
+    QLIST_INIT(&as->bounce_buffers);
+    QLIST_INIT(&as->map_clients);
+    as->bounce_in_use = 0;
+    as->bounce_maps = 0;
+    as->bounce_bytes = 0;
+    as->map_waits = 0;
     QTAILQ_INSERT_TAIL(&address_spaces, as, address_spaces_link);
     as->name = NULL;
     memory_region_transaction_commit();
@@ -1582,19 +1895,40 @@ void address_space_destroy(AddressSpace *as)
     memory_region_transaction_commit();
     QTAILQ_REMOVE(&address_spaces, as, address_spaces_link);
     address_space_destroy_dispatch(as);
-    flatview_destroy(as->current_map);
-    g_free(as->current_map);
+    call_rcu1(&as->current_map->rcu, flatview_free_rcu);
 }
 
+/* Multi-threaded TCG vCPUs, and KVM vCPUs completing an exit on their
+ * own, run without the iothread lock and take it only around accesses
+ * to regions that are not thread-safe.
+ */
 uint64_t io_mem_read(MemoryRegion *mr, hwaddr addr, unsigned size)
 {
-    return memory_region_dispatch_read(mr, addr, size);
+    bool unlocked = !mr->ops->thread_safe && !qemu_mutex_iothread_locked();
+    uint64_t ret;
+
+    if (unlocked) {
+        qemu_mutex_lock_iothread();
+    }
+    ret = memory_region_dispatch_read(mr, addr, size);
+    if (unlocked) {
+        qemu_mutex_unlock_iothread();
+    }
+    return ret;
 }
 
 void io_mem_write(MemoryRegion *mr, hwaddr addr,
                   uint64_t val, unsigned size)
 {
+    bool unlocked = !mr->ops->thread_safe && !qemu_mutex_iothread_locked();
+
+    if (unlocked) {
+        qemu_mutex_lock_iothread();
+    }
     memory_region_dispatch_write(mr, addr, val, size);
+    if (unlocked) {
+        qemu_mutex_unlock_iothread();
+    }
 }
 
 typedef struct MemoryRegionList MemoryRegionList;
@@ -1713,6 +2047,12 @@ void mtree_info(fprintf_function mon_printf, void *f)
         }
         mon_printf(f, "%s\n", as->name);
         mtree_print_mr(mon_printf, f, as->root, 0, 0, &ml_head);
+        if (as->bounce_maps || as->map_waits) {
+            mon_printf(f, "  bounce buffers: %" PRIu64 " maps, %" PRIu64
+                       " bytes, %" PRIu64 " bytes in use, %" PRIu64
+                       " map waits\n", as->bounce_maps, as->bounce_bytes,
+                       (uint64_t)as->bounce_in_use, as->map_waits);
+        }
     }
 
     mon_printf(f, "aliases\n");
@@ -0,0 +1,876 @@
+/*
+ * QEMU live migration over RDMA
+ *
+ * Guest RAM is registered with the HCA on both sides when the connection
+ * is set up.  RAM pages are then written straight into the destination's
+ * memory with RDMA writes, merged into chunks within a RAMBlock, so they
+ * are neither copied into the QEMUFile buffer nor through the kernel's
+ * TCP stack.  The rest of the migration stream (device state and the
+ * headers of pages that are sent in band) travels in SEND messages.
+ *
+ * The queue pair is reliable-connected: a SEND is only delivered after
+ * every RDMA write posted before it has been placed, so the destination
+ * never reads device state that refers to RAM which has not arrived yet.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <netdb.h>
+#include <rdma/rdma_cma.h>
+
+#include "qemu-common.h"
+#include "migration/migration.h"
+#include "migration/qemu-file.h"
+#include "exec/cpu-all.h"
+#include "qemu/main-loop.h"
+#include "block/coroutine.h"
+
+//#define DEBUG_MIGRATION_RDMA
+
+#ifdef DEBUG_MIGRATION_RDMA
+#define DPRINTF(fmt, ...) \
+    do { printf("migration-rdma: " fmt, ## __VA_ARGS__); } while (0)
+#else
+#define DPRINTF(fmt, ...) \
+    do { } while (0)
+#endif
+
+/* size of one control message, header included */
+#define RDMA_CONTROL_SIZE       (64 * 1024)
+#define RDMA_CONTROL_HDR_SIZE   8
+#define RDMA_RECV_BUFFERS       16
+/* send queue depth; RDMA writes and the control SEND share it */
+#define RDMA_SEND_DEPTH         64
+/* contiguous pages of one RAMBlock are merged up to this size */
+#define RDMA_MERGE_MAX          (1024 * 1024)
+#define RDMA_RESOLVE_TIMEOUT_MS 10000
+
+enum {
+    RDMA_CONTROL_QEMU_FILE = 1,     /* migration stream bytes */
+    RDMA_CONTROL_RAM_BLOCKS = 2,    /* destination RAMBlock table */
+};
+
+enum {
+    RDMA_WRID_SEND = 1,
+    RDMA_WRID_WRITE = 2,
+    RDMA_WRID_RECV = 3,             /* receive buffer index in bits 8+ */
+};
+
+typedef struct RDMABlock {
+    const char *idstr;
+    uint8_t *host;
+    uint64_t offset;
+    uint64_t length;
+    struct ibv_mr *mr;
+    uint64_t remote_host;
+    uint32_t remote_rkey;
+    bool remote_valid;
+} RDMABlock;
+
+typedef struct RDMAContext {
+    struct rdma_event_channel *channel;
+    struct rdma_cm_id *listen_id;
+    struct rdma_cm_id *cm_id;
+    struct ibv_pd *pd;
+    struct ibv_comp_channel *comp_channel;
+    struct ibv_cq *cq;
+    bool connected;
+
+    uint8_t *send_buf;
+    struct ibv_mr *send_mr;
+    bool send_busy;
+
+    uint8_t *recv_buf;
+    struct ibv_mr *recv_mr;
+    bool recv_done[RDMA_RECV_BUFFERS];
+    uint32_t recv_len[RDMA_RECV_BUFFERS];
+    int recv_next;
+
+    /* control message being consumed by the incoming QEMUFile */
+    int cur_recv;
+    uint32_t cur_pos;
+    uint32_t cur_len;
+
+    RDMABlock *blocks;
+    int nb_blocks;
+    int last_block;
+
+    /* RDMA write being merged, not posted yet */
+    int pending_block;
+    uint64_t pending_offset;
+    uint64_t pending_len;
+    int nb_writes;
+
+    int error;
+} RDMAContext;
+
+static int qemu_rdma_parse_host_port(const char *host_port, bool passive,
+                                     struct addrinfo **res, Error **errp)
+{
+    struct addrinfo hints = {
+        .ai_family = AF_UNSPEC,
+        .ai_socktype = SOCK_STREAM,
+        .ai_flags = passive ? AI_PASSIVE : 0,
+    };
+    char *host = g_strdup(host_port);
+    char *port = strrchr(host, ':');
+    int ret;
+
+    if (!port) {
+        error_setg(errp, "rdma: expected host:port, got '%s'", host_port);
+        g_free(host);
+        return -EINVAL;
+    }
+    *port++ = 0;
+
+    ret = getaddrinfo(*host ? host : NULL, port, &hints, res);
+    if (ret) {
+        error_setg(errp, "rdma: could not resolve '%s': %s", host_port,
+                   gai_strerror(ret));
+        g_free(host);
+        return -EINVAL;
+    }
+
+    g_free(host);
+    return 0;
+}
+
+static int qemu_rdma_wait_cm_event(RDMAContext *rdma,
+                                   enum rdma_cm_event_type type)
+{
+    struct rdma_cm_event *ev;
+    int ret;
+
+    if (rdma_get_cm_event(rdma->channel, &ev) < 0) {
+        return -errno;
+    }
+
+    ret = ev->event == type ? 0 : -EIO;
+    if (ret < 0) {
+        fprintf(stderr, "rdma: expected %s, got %s\n",
+                rdma_event_str(type), rdma_event_str(ev->event));
+    }
+    rdma_ack_cm_event(ev);
+    return ret;
+}
+
+static int qemu_rdma_post_recv(RDMAContext *rdma, int idx)
+{
+    struct ibv_sge sge = {
+        .addr = (uintptr_t)(rdma->recv_buf + idx * RDMA_CONTROL_SIZE),
+        .length = RDMA_CONTROL_SIZE,
+        .lkey = rdma->recv_mr->lkey,
+    };
+    struct ibv_recv_wr wr = {
+        .wr_id = RDMA_WRID_RECV | (idx << 8),
+        .sg_list = &sge,
+        .num_sge = 1,
+    };
+    struct ibv_recv_wr *bad_wr;
+
+    rdma->recv_done[idx] = false;
+    return ibv_post_recv(rdma->cm_id->qp, &wr, &bad_wr) ? -EIO : 0;
+}
+
+static int qemu_rdma_init_verbs(RDMAContext *rdma, Error **errp)
+{
+    struct ibv_qp_init_attr attr = {
+        .cap = {
+            .max_send_wr = RDMA_SEND_DEPTH,
+            .max_recv_wr = RDMA_RECV_BUFFERS,
+            .max_send_sge = 1,
+            .max_recv_sge = 1,
+        },
+        .qp_type = IBV_QPT_RC,
+    };
+    int i;
+
+    rdma->pd = ibv_alloc_pd(rdma->cm_id->verbs);
+    rdma->comp_channel = rdma->pd ?
+        ibv_create_comp_channel(rdma->cm_id->verbs) : NULL;
+    rdma->cq = rdma->comp_channel ?
+        ibv_create_cq(rdma->cm_id->verbs, RDMA_SEND_DEPTH + RDMA_RECV_BUFFERS,
+                      NULL, rdma->comp_channel, 0) : NULL;
+    if (!rdma->cq) {
+        error_setg(errp, "rdma: could not allocate verbs resources");
+        return -ENOMEM;
+    }
+
+    attr.send_cq = attr.recv_cq = rdma->cq;
+    if (rdma_create_qp(rdma->cm_id, rdma->pd, &attr) < 0) {
+        error_setg(errp, "rdma: could not create queue pair: %s",
+                   strerror(errno));
+        return -errno;
+    }
+
+    rdma->send_buf = qemu_memalign(getpagesize(), RDMA_CONTROL_SIZE);
+    rdma->recv_buf = qemu_memalign(getpagesize(),
+                                   RDMA_CONTROL_SIZE * RDMA_RECV_BUFFERS);
+    rdma->send_mr = ibv_reg_mr(rdma->pd, rdma->send_buf, RDMA_CONTROL_SIZE, 0);
+    rdma->recv_mr = ibv_reg_mr(rdma->pd, rdma->recv_buf,
+                               RDMA_CONTROL_SIZE * RDMA_RECV_BUFFERS,
+                               IBV_ACCESS_LOCAL_WRITE);
+    if (!rdma->send_mr || !rdma->recv_mr) {
+        error_setg(errp, "rdma: could not register control buffers");
+        return -ENOMEM;
+    }
+
+    for (i = 0; i < RDMA_RECV_BUFFERS; i++) {
+        if (qemu_rdma_post_recv(rdma, i) < 0) {
+            error_setg(errp, "rdma: could not post receive buffers");
+            return -EIO;
+        }
+    }
+    rdma->cur_recv = -1;
+    return 0;
+}
+
+/* Pin every RAMBlock; this is done once, migration never re-registers */
+static int qemu_rdma_register_ram(RDMAContext *rdma, int access,
+                                  Error **errp)
+{
+    RAMBlock *block;
+    int i = 0;
+
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        rdma->nb_blocks++;
+    }
+    rdma->blocks = g_malloc0(rdma->nb_blocks * sizeof(RDMABlock));
+
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        RDMABlock *b = &rdma->blocks[i++];
+
+        b->idstr = block->idstr;
+        b->host = block->host;
+        b->offset = block->offset;
+        b->length = block->length;
+        b->mr = ibv_reg_mr(rdma->pd, b->host, b->length, access);
+        if (!b->mr) {
+            error_setg(errp, "rdma: could not register RAM block %s: %s",
+                       block->idstr, strerror(errno));
+            return -errno;
+        }
+        DPRINTF("registered %s, %" PRIu64 " bytes\n", b->idstr, b->length);
+    }
+    return 0;
+}
+
+static void qemu_rdma_cleanup(RDMAContext *rdma)
+{
+    int i;
+
+    if (rdma->connected) {
+        rdma_disconnect(rdma->cm_id);
+    }
+    for (i = 0; i < rdma->nb_blocks; i++) {
+        if (rdma->blocks[i].mr) {
+            ibv_dereg_mr(rdma->blocks[i].mr);
+        }
+    }
+    g_free(rdma->blocks);
+    if (rdma->send_mr) {
+        ibv_dereg_mr(rdma->send_mr);
+    }
+    if (rdma->recv_mr) {
+        ibv_dereg_mr(rdma->recv_mr);
+    }
+    qemu_vfree(rdma->send_buf);
+    qemu_vfree(rdma->recv_buf);
+    if (rdma->cm_id && rdma->cm_id->qp) {
+        rdma_destroy_qp(rdma->cm_id);
+    }
+    if (rdma->cq) {
+        ibv_destroy_cq(rdma->cq);
+    }
+    if (rdma->comp_channel) {
+        ibv_destroy_comp_channel(rdma->comp_channel);
+    }
+    if (rdma->pd) {
+        ibv_dealloc_pd(rdma->pd);
+    }
+    if (rdma->cm_id) {
+        rdma_destroy_id(rdma->cm_id);
+    }
+    if (rdma->listen_id) {
+        rdma_destroy_id(rdma->listen_id);
+    }
+    if (rdma->channel) {
+        rdma_destroy_event_channel(rdma->channel);
+    }
+    g_free(rdma);
+}
+
+static int qemu_rdma_wait_comp_channel(RDMAContext *rdma)
+{
+    struct ibv_cq *cq;
+    void *ctx;
+
+    if (qemu_in_coroutine()) {
+        yield_until_fd_readable(rdma->comp_channel->fd);
+    }
+    if (ibv_get_cq_event(rdma->comp_channel, &cq, &ctx) < 0) {
+        return errno == EAGAIN || errno == EINTR ? 0 : -errno;
+    }
+    ibv_ack_cq_events(cq, 1);
+    return 0;
+}
+
+/* Wait for and process one completion */
+static int qemu_rdma_poll(RDMAContext *rdma)
+{
+    struct ibv_wc wc;
+    int ret;
+
+    for (;;) {
+        ret = ibv_poll_cq(rdma->cq, 1, &wc);
+        if (ret) {
+            break;
+        }
+        if (ibv_req_notify_cq(rdma->cq, 0)) {
+            return -EIO;
+        }
+        /* a completion may have arrived before the CQ was armed */
+        ret = ibv_poll_cq(rdma->cq, 1, &wc);
+        if (ret) {
+            break;
+        }
+        ret = qemu_rdma_wait_comp_channel(rdma);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    if (ret < 0) {
+        return -EIO;
+    }
+    if (wc.status != IBV_WC_SUCCESS) {
+        DPRINTF("work request %" PRIu64 " failed: %s\n", wc.wr_id,
+                ibv_wc_status_str(wc.status));
+        return -EIO;
+    }
+
+    switch (wc.wr_id & 0xff) {
+    case RDMA_WRID_SEND:
+        rdma->send_busy = false;
+        break;
+    case RDMA_WRID_WRITE:
+        rdma->nb_writes--;
+        break;
+    case RDMA_WRID_RECV:
+        rdma->recv_done[wc.wr_id >> 8] = true;
+        rdma->recv_len[wc.wr_id >> 8] = wc.byte_len;
+        break;
+    }
+    return 0;
+}
+
+static int qemu_rdma_send_control(RDMAContext *rdma, uint32_t type,
+                                  const uint8_t *buf, size_t len)
+{
+    struct ibv_sge sge = {
+        .addr = (uintptr_t)rdma->send_buf,
+        .length = RDMA_CONTROL_HDR_SIZE + len,
+        .lkey = rdma->send_mr->lkey,
+    };
+    struct ibv_send_wr wr = {
+        .wr_id = RDMA_WRID_SEND,
+        .opcode = IBV_WR_SEND,
+        .send_flags = IBV_SEND_SIGNALED,
+        .sg_list = &sge,
+        .num_sge = 1,
+    };
+    struct ibv_send_wr *bad_wr;
+    int ret;
+
+    assert(len <= RDMA_CONTROL_SIZE - RDMA_CONTROL_HDR_SIZE);
+
+    while (rdma->send_busy || rdma->nb_writes >= RDMA_SEND_DEPTH) {
+        ret = qemu_rdma_poll(rdma);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    stl_be_p(rdma->send_buf, type);
+    stl_be_p(rdma->send_buf + 4, len);
+    memcpy(rdma->send_buf + RDMA_CONTROL_HDR_SIZE, buf, len);
+
+    if (ibv_post_send(rdma->cm_id->qp, &wr, &bad_wr)) {
+        return -EIO;
+    }
+    rdma->send_busy = true;
+    return 0;
+}
+
+/* Wait for the next control message, returns its receive buffer index */
+static int qemu_rdma_recv_control(RDMAContext *rdma, uint32_t type)
+{
+    int idx = rdma->recv_next;
+    uint8_t *buf = rdma->recv_buf + idx * RDMA_CONTROL_SIZE;
+    int ret;
+
+    while (!rdma->recv_done[idx]) {
+        ret = qemu_rdma_poll(rdma);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    if (rdma->recv_len[idx] < RDMA_CONTROL_HDR_SIZE ||
+        ldl_be_p(buf) != type ||
+        ldl_be_p(buf + 4) != rdma->recv_len[idx] - RDMA_CONTROL_HDR_SIZE) {
+        fprintf(stderr, "rdma: unexpected control message\n");
+        return -EINVAL;
+    }
+
+    rdma->recv_next = (idx + 1) % RDMA_RECV_BUFFERS;
+    return idx;
+}
+
+static int qemu_rdma_write_flush(RDMAContext *rdma)
+{
+    RDMABlock *b;
+    struct ibv_sge sge;
+    struct ibv_send_wr wr = {
+        .wr_id = RDMA_WRID_WRITE,
+        .opcode = IBV_WR_RDMA_WRITE,
+        .send_flags = IBV_SEND_SIGNALED,
+        .sg_list = &sge,
+        .num_sge = 1,
+    };
+    struct ibv_send_wr *bad_wr;
+    int ret;
+
+    if (!rdma->pending_len) {
+        return 0;
+    }
+
+    /* keep a slot free for the control SEND */
+    while (rdma->nb_writes + 1 >= RDMA_SEND_DEPTH) {
+        ret = qemu_rdma_poll(rdma);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    b = &rdma->blocks[rdma->pending_block];
+    sge.addr = (uintptr_t)(b->host + rdma->pending_offset);
+    sge.length = rdma->pending_len;
+    sge.lkey = b->mr->lkey;
+    wr.wr.rdma.remote_addr = b->remote_host + rdma->pending_offset;
+    wr.wr.rdma.rkey = b->remote_rkey;
+
+    if (ibv_post_send(rdma->cm_id->qp, &wr, &bad_wr)) {
+        return -EIO;
+    }
+    rdma->nb_writes++;
+    rdma->pending_len = 0;
+    return 0;
+}
+
+static int qemu_rdma_find_block(RDMAContext *rdma, uint64_t block_offset)
+{
+    int i;
+
+    if (rdma->last_block < rdma->nb_blocks &&
+        rdma->blocks[rdma->last_block].offset == block_offset) {
+        return rdma->last_block;
+    }
+    for (i = 0; i < rdma->nb_blocks; i++) {
+        if (rdma->blocks[i].offset == block_offset) {
+            rdma->last_block = i;
+            return i;
+        }
+    }
+    return -1;
+}
+
+static int qemu_rdma_drain(RDMAContext *rdma)
+{
+    int ret = qemu_rdma_write_flush(rdma);
+
+    while (ret == 0 && (rdma->nb_writes || rdma->send_busy)) {
+        ret = qemu_rdma_poll(rdma);
+    }
+    return ret;
+}
+
+/* Source side */
+
+static int qemu_rdma_exchange_blocks(RDMAContext *rdma, Error **errp)
+{
+    uint8_t *buf, *end;
+    int idx, i, j, nb;
+
+    idx = qemu_rdma_recv_control(rdma, RDMA_CONTROL_RAM_BLOCKS);
+    if (idx < 0) {
+        error_setg(errp, "rdma: did not get the destination's RAM blocks");
+        return idx;
+    }
+    buf = rdma->recv_buf + idx * RDMA_CONTROL_SIZE;
+    end = buf + rdma->recv_len[idx];
+    buf += RDMA_CONTROL_HDR_SIZE;
+
+    nb = ldl_be_p(buf);
+    buf += 4;
+    for (i = 0; i < nb; i++) {
+        uint64_t host, length;
+        uint32_t rkey, idlen;
+
+        if (end - buf < 24) {
+            break;
+        }
+        host = ldq_be_p(buf);
+        length = ldq_be_p(buf + 8);
+        rkey = ldl_be_p(buf + 16);
+        idlen = ldl_be_p(buf + 20);
+        buf += 24;
+        if (end - buf < idlen) {
+            break;
+        }
+
+        for (j = 0; j < rdma->nb_blocks; j++) {
+            RDMABlock *b = &rdma->blocks[j];
+
+            if (strlen(b->idstr) == idlen && !memcmp(b->idstr, buf, idlen)) {
+                if (b->length != length) {
+                    error_setg(errp, "rdma: RAM block %s has a different "
+                               "size on the destination", b->idstr);
+                    return -EINVAL;
+                }
+                b->remote_host = host;
+                b->remote_rkey = rkey;
+                b->remote_valid = true;
+            }
+        }
+        buf += idlen;
+    }
+    qemu_rdma_post_recv(rdma, idx);
+
+    if (i != nb) {
+        error_setg(errp, "rdma: malformed RAM block table");
+        return -EINVAL;
+    }
+    for (j = 0; j < rdma->nb_blocks; j++) {
+        if (!rdma->blocks[j].remote_valid) {
+            error_setg(errp, "rdma: RAM block %s missing on the destination",
+                       rdma->blocks[j].idstr);
+            return -EINVAL;
+        }
+    }
+    return 0;
+}
+
+static int qemu_rdma_connect(RDMAContext *rdma, const char *host_port,
+                             Error **errp)
+{
+    struct rdma_conn_param param = {
+        .retry_count = 7,
+        .rnr_retry_count = 7,
+    };
+    struct addrinfo *res;
+    int ret;
+
+    ret = qemu_rdma_parse_host_port(host_port, false, &res, errp);
+    if (ret < 0) {
+        return ret;
+    }
+
+    rdma->channel = rdma_create_event_channel();
+    if (!rdma->channel ||
+        rdma_create_id(rdma->channel, &rdma->cm_id, NULL, RDMA_PS_TCP) < 0) {
+        error_setg(errp, "rdma: could not create connection id");
+        freeaddrinfo(res);
+        return -EIO;
+    }
+
+    ret = rdma_resolve_addr(rdma->cm_id, NULL, res->ai_addr,
+                            RDMA_RESOLVE_TIMEOUT_MS);
+    freeaddrinfo(res);
+    if (ret < 0 ||
+        qemu_rdma_wait_cm_event(rdma, RDMA_CM_EVENT_ADDR_RESOLVED) < 0 ||
+        rdma_resolve_route(rdma->cm_id, RDMA_RESOLVE_TIMEOUT_MS) < 0 ||
+        qemu_rdma_wait_cm_event(rdma, RDMA_CM_EVENT_ROUTE_RESOLVED) < 0) {
+        error_setg(errp, "rdma: could not resolve a route to %s", host_port);
+        return -EHOSTUNREACH;
+    }
+
+    ret = qemu_rdma_init_verbs(rdma, errp);
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (rdma_connect(rdma->cm_id, &param) < 0 ||
+        qemu_rdma_wait_cm_event(rdma, RDMA_CM_EVENT_ESTABLISHED) < 0) {
+        error_setg(errp, "rdma: could not connect to %s", host_port);
+        return -ECONNREFUSED;
+    }
+    rdma->connected = true;
+
+    ret = qemu_rdma_register_ram(rdma, IBV_ACCESS_LOCAL_WRITE, errp);
+    if (ret < 0) {
+        return ret;
+    }
+    return qemu_rdma_exchange_blocks(rdma, errp);
+}
+
+static int rdma_errno(MigrationState *s)
+{
+    RDMAContext *rdma = s->opaque;
+
+    return rdma->error ? -rdma->error : EIO;
+}
+
+static int rdma_write(MigrationState *s, const void *buf, size_t size)
+{
+    RDMAContext *rdma = s->opaque;
+    size_t len = MIN(size, RDMA_CONTROL_SIZE - RDMA_CONTROL_HDR_SIZE);
+    int ret;
+
+    ret = qemu_rdma_write_flush(rdma);
+    if (ret == 0) {
+        ret = qemu_rdma_send_control(rdma, RDMA_CONTROL_QEMU_FILE, buf, len);
+    }
+    if (ret < 0) {
+        rdma->error = ret;
+        return -1;
+    }
+    return len;
+}
+
+static int rdma_save_page(MigrationState *s, uint64_t block_offset,
+                          uint64_t offset, int size)
+{
+    RDMAContext *rdma = s->opaque;
+    int idx = qemu_rdma_find_block(rdma, block_offset);
+    int ret;
+
+    if (idx < 0 || offset + size > rdma->blocks[idx].length) {
+        /* e.g. hot-added RAM, send it in band */
+        return -ENOTSUP;
+    }
+
+    if (rdma->pending_len && rdma->pending_block == idx &&
+        rdma->pending_offset + rdma->pending_len == offset &&
+        rdma->pending_len + size <= RDMA_MERGE_MAX) {
+        rdma->pending_len += size;
+        return size;
+    }
+
+    ret = qemu_rdma_write_flush(rdma);
+    if (ret < 0) {
+        rdma->error = ret;
+        return ret;
+    }
+    rdma->pending_block = idx;
+    rdma->pending_offset = offset;
+    rdma->pending_len = size;
+    return size;
+}
+
+static int rdma_close(MigrationState *s)
+{
+    RDMAContext *rdma = s->opaque;
+    int ret;
+
+    DPRINTF("rdma_close\n");
+    ret = rdma->error ? rdma->error : qemu_rdma_drain(rdma);
+    qemu_rdma_cleanup(rdma);
+    s->opaque = NULL;
+    return ret;
+}
+
+void rdma_start_outgoing_migration(MigrationState *s, const char *host_port,
+                                   Error **errp)
+{
+    RDMAContext *rdma = g_malloc0(sizeof(*rdma));
+
+    s->fd = -1;
+    if (qemu_rdma_connect(rdma, host_port, errp) < 0) {
+        qemu_rdma_cleanup(rdma);
+        return;
+    }
+
+    s->opaque = rdma;
+    s->get_error = rdma_errno;
+    s->write = rdma_write;
+    s->save_page = rdma_save_page;
+    s->close = rdma_close;
+    s->fd = rdma->comp_channel->fd;
+    migrate_fd_connect(s);
+}
+
+/* Destination side */
+
+static int qemu_rdma_send_blocks(RDMAContext *rdma)
+{
+    uint8_t *buf = g_malloc(RDMA_CONTROL_SIZE - RDMA_CONTROL_HDR_SIZE);
+    uint8_t *p = buf + 4;
+    int i, ret;
+
+    stl_be_p(buf, rdma->nb_blocks);
+    for (i = 0; i < rdma->nb_blocks; i++) {
+        RDMABlock *b = &rdma->blocks[i];
+        size_t idlen = strlen(b->idstr);
+
+        if (p + 24 + idlen > buf + RDMA_CONTROL_SIZE - RDMA_CONTROL_HDR_SIZE) {
+            fprintf(stderr, "rdma: too many RAM blocks\n");
+            g_free(buf);
+            return -E2BIG;
+        }
+        stq_be_p(p, (uintptr_t)b->host);
+        stq_be_p(p + 8, b->length);
+        stl_be_p(p + 16, b->mr->rkey);
+        stl_be_p(p + 20, idlen);
+        memcpy(p + 24, b->idstr, idlen);
+        p += 24 + idlen;
+    }
+
+    ret = qemu_rdma_send_control(rdma, RDMA_CONTROL_RAM_BLOCKS, buf, p - buf);
+    g_free(buf);
+    return ret < 0 ? ret : qemu_rdma_drain(rdma);
+}
+
+static int qemu_rdma_get_fd(void *opaque)
+{
+    RDMAContext *rdma = opaque;
+
+    return rdma->comp_channel->fd;
+}
+
+static int qemu_rdma_get_buffer(void *opaque, uint8_t *buf, int64_t pos,
+                                int size)
+{
+    RDMAContext *rdma = opaque;
+    int len;
+
+    while (rdma->cur_pos == rdma->cur_len) {
+        int idx;
+
+        if (rdma->cur_recv >= 0) {
+            if (qemu_rdma_post_recv(rdma, rdma->cur_recv) < 0) {
+                return -EIO;
+            }
+            rdma->cur_recv = -1;
+        }
+
+        idx = qemu_rdma_recv_control(rdma, RDMA_CONTROL_QEMU_FILE);
+        if (idx < 0) {
+            return idx;
+        }
+        rdma->cur_recv = idx;
+        rdma->cur_pos = RDMA_CONTROL_HDR_SIZE;
+        rdma->cur_len = rdma->recv_len[idx];
+    }
+
+    len = MIN(size, rdma->cur_len - rdma->cur_pos);
+    memcpy(buf, rdma->recv_buf + rdma->cur_recv * RDMA_CONTROL_SIZE +
+           rdma->cur_pos, len);
+    rdma->cur_pos += len;
+    return len;
+}
+
+static int qemu_rdma_close(void *opaque)
+{
+    RDMAContext *rdma = opaque;
+
+    DPRINTF("qemu_rdma_close\n");
+    qemu_rdma_cleanup(rdma);
+    return 0;
+}
+
+static const QEMUFileOps rdma_read_ops = {
+    .get_fd =     qemu_rdma_get_fd,
+    .get_buffer = qemu_rdma_get_buffer,
+    .close =      qemu_rdma_close,
+};
+
+static int qemu_rdma_accept(RDMAContext *rdma)
+{
+    struct rdma_conn_param param = {
+        .rnr_retry_count = 7,
+    };
+    struct rdma_cm_event *ev;
+    Error *local_err = NULL;
+
+    if (rdma_get_cm_event(rdma->channel, &ev) < 0) {
+        return -errno;
+    }
+    if (ev->event != RDMA_CM_EVENT_CONNECT_REQUEST) {
+        rdma_ack_cm_event(ev);
+        return -EIO;
+    }
+    rdma->cm_id = ev->id;
+    rdma_ack_cm_event(ev);
+
+    if (qemu_rdma_init_verbs(rdma, &local_err) < 0 ||
+        qemu_rdma_register_ram(rdma, IBV_ACCESS_LOCAL_WRITE |
+                               IBV_ACCESS_REMOTE_WRITE, &local_err) < 0) {
+        fprintf(stderr, "%s\n", error_get_pretty(local_err));
+        error_free(local_err);
+        return -EIO;
+    }
+
+    if (rdma_accept(rdma->cm_id, &param) < 0 ||
+        qemu_rdma_wait_cm_event(rdma, RDMA_CM_EVENT_ESTABLISHED) < 0) {
+        return -EIO;
+    }
+    rdma->connected = true;
+
+    return qemu_rdma_send_blocks(rdma);
+}
+
+static void rdma_accept_incoming_migration(void *opaque)
+{
+    RDMAContext *rdma = opaque;
+    QEMUFile *f;
+    int ret;
+
+    qemu_set_fd_handler2(rdma->channel->fd, NULL, NULL, NULL, NULL);
+
+    ret = qemu_rdma_accept(rdma);
+    if (ret < 0) {
+        fprintf(stderr, "could not accept RDMA migration connection: %s\n",
+                strerror(-ret));
+        qemu_rdma_cleanup(rdma);
+        return;
+    }
+
+    f = qemu_fopen_ops(rdma, &rdma_read_ops);
+    if (f == NULL) {
+        fprintf(stderr, "could not qemu_fopen RDMA migration connection\n");
+        qemu_rdma_cleanup(rdma);
+        return;
+    }
+
+    process_incoming_migration(f);
+}
+
+void rdma_start_incoming_migration(const char *host_port, Error **errp)
+{
+    RDMAContext *rdma;
+    struct addrinfo *res;
+
+    if (qemu_rdma_parse_host_port(host_port, true, &res, errp) < 0) {
+        return;
+    }
+
+    rdma = g_malloc0(sizeof(*rdma));
+    rdma->channel = rdma_create_event_channel();
+    if (!rdma->channel ||
+        rdma_create_id(rdma->channel, &rdma->listen_id, NULL,
+                       RDMA_PS_TCP) < 0 ||
+        rdma_bind_addr(rdma->listen_id, res->ai_addr) < 0 ||
+        rdma_listen(rdma->listen_id, 1) < 0) {
+        error_setg(errp, "rdma: could not listen on %s: %s", host_port,
+                   strerror(errno));
+        freeaddrinfo(res);
+        qemu_rdma_cleanup(rdma);
+        return;
+    }
+    freeaddrinfo(res);
+
+    qemu_set_fd_handler2(rdma->channel->fd, NULL,
+                         rdma_accept_incoming_migration, NULL, rdma);
+}
@@ -23,6 +23,8 @@
 #include "migration/block.h"
 #include "qemu/thread.h"
 #include "qmp-commands.h"
+#include "sysemu/cpus.h"
+#include "trace.h"
 
 //#define DEBUG_MIGRATION
 
@@ -52,6 +54,12 @@ enum {
 /* Migration XBZRLE default cache size */
 #define DEFAULT_MIGRATE_CACHE_SIZE (64 * 1024 * 1024)
 
+/* Default number of multi-thread migration workers and zlib level */
+#define DEFAULT_MIGRATE_THREADS 4
+/* Reads kept in flight per device by block migration */
+#define DEFAULT_MIGRATE_BLOCK_INFLIGHT 16
+#define DEFAULT_MIGRATE_COMPRESS_LEVEL 1
+
 static NotifierList migration_state_notifiers =
     NOTIFIER_LIST_INITIALIZER(migration_state_notifiers);
 
@@ -65,6 +73,9 @@ MigrationState *migrate_get_current(void)
         .state = MIG_STATE_SETUP,
         .bandwidth_limit = MAX_THROTTLE,
         .xbzrle_cache_size = DEFAULT_MIGRATE_CACHE_SIZE,
+        .threads = DEFAULT_MIGRATE_THREADS,
+        .block_inflight = DEFAULT_MIGRATE_BLOCK_INFLIGHT,
+        .compress_level = DEFAULT_MIGRATE_COMPRESS_LEVEL,
     };
 
     return &current_migration;
@@ -83,6 +94,10 @@ void qemu_start_incoming_migration(const char *uri, Error **errp)
         unix_start_incoming_migration(p, errp);
     else if (strstart(uri, "fd:", &p))
         fd_start_incoming_migration(p, errp);
+#endif
+#ifdef CONFIG_RDMA
+    else if (strstart(uri, "rdma:", &p))
+        rdma_start_incoming_migration(p, errp);
 #endif
     else {
         error_setg(errp, "unknown migration protocol: %s", uri);
@@ -95,14 +110,27 @@ static void process_incoming_migration_co(void *opaque)
     int ret;
 
     ret = qemu_loadvm_state(f);
+    if (ret > 0) {
+        /* post-copy: the guest is running and the listen thread owns f */
+        DPRINTF("post-copy running\n");
+        return;
+    }
     qemu_fclose(f);
     if (ret < 0) {
         fprintf(stderr, "load of migration failed\n");
         exit(0);
     }
-    qemu_announce_self();
     DPRINTF("successfully loaded vm state\n");
 
+    migrate_incoming_start_vm();
+}
+
+/* Called once the device state is loaded; with post-copy RAM may still be
+ * arriving */
+void migrate_incoming_start_vm(void)
+{
+    qemu_announce_self();
+
     bdrv_clear_incoming_migration_all();
     /* Make sure all file formats flush their mutable metadata */
     bdrv_invalidate_cache_all();
@@ -169,6 +197,16 @@ static void get_xbzrle_cache_stats(MigrationInfo *info)
         info->xbzrle_cache->pages = xbzrle_mig_pages_transferred();
         info->xbzrle_cache->cache_miss = xbzrle_mig_pages_cache_miss();
         info->xbzrle_cache->overflow = xbzrle_mig_pages_overflow();
+        info->xbzrle_cache->cache_hit = xbzrle_mig_pages_cache_hit();
+        info->xbzrle_cache->skipped = xbzrle_mig_pages_skipped();
+    }
+}
+
+static void get_thread_stats(MigrationInfo *info)
+{
+    if (migrate_use_multi_thread()) {
+        info->threads = ram_mig_thread_stats();
+        info->has_threads = info->threads != NULL;
     }
 }
 
@@ -183,7 +221,8 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         break;
     case MIG_STATE_ACTIVE:
         info->has_status = true;
-        info->status = g_strdup("active");
+        info->status = g_strdup(s->postcopy_started ? "postcopy-active"
+                                                    : "active");
         info->has_total_time = true;
         info->total_time = qemu_get_clock_ms(rt_clock)
             - s->total_time;
@@ -199,7 +238,18 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         info->ram->normal = norm_mig_pages_transferred();
         info->ram->normal_bytes = norm_mig_bytes_transferred();
         info->ram->dirty_pages_rate = s->dirty_pages_rate;
-
+        if (migrate_use_postcopy()) {
+            info->ram->has_postcopy_requests = true;
+            info->ram->postcopy_requests = s->postcopy_requests;
+        }
+        info->ram->has_sent_bytes = true;
+        info->ram->sent_bytes = s->bytes_sent;
+        info->ram->has_copied_bytes = true;
+        info->ram->copied_bytes = s->bytes_copied;
+        info->ram->has_dirty_sync_count = true;
+        info->ram->dirty_sync_count = s->dirty_sync_count;
+        info->ram->has_dirty_sync_time = true;
+        info->ram->dirty_sync_time = s->dirty_sync_time;
 
         if (blk_mig_active()) {
             info->has_disk = true;
@@ -210,9 +260,16 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         }
 
         get_xbzrle_cache_stats(info);
+        get_thread_stats(info);
+
+        if (cpu_throttle_active()) {
+            info->has_cpu_throttle_percentage = true;
+            info->cpu_throttle_percentage = cpu_throttle_get_percentage();
+        }
         break;
     case MIG_STATE_COMPLETED:
         get_xbzrle_cache_stats(info);
+        get_thread_stats(info);
 
         info->has_status = true;
         info->status = g_strdup("completed");
@@ -228,6 +285,18 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         info->ram->duplicate = dup_mig_pages_transferred();
         info->ram->normal = norm_mig_pages_transferred();
         info->ram->normal_bytes = norm_mig_bytes_transferred();
+        if (migrate_use_postcopy()) {
+            info->ram->has_postcopy_requests = true;
+            info->ram->postcopy_requests = s->postcopy_requests;
+        }
+        info->ram->has_sent_bytes = true;
+        info->ram->sent_bytes = s->bytes_sent;
+        info->ram->has_copied_bytes = true;
+        info->ram->copied_bytes = s->bytes_copied;
+        info->ram->has_dirty_sync_count = true;
+        info->ram->dirty_sync_count = s->dirty_sync_count;
+        info->ram->has_dirty_sync_time = true;
+        info->ram->dirty_sync_time = s->dirty_sync_time;
         break;
     case MIG_STATE_ERROR:
         info->has_status = true;
@@ -260,6 +329,23 @@ void qmp_migrate_set_capabilities(MigrationCapabilityStatusList *params,
 
 /* shared migration helpers */
 
+static void migrate_close_return_path(MigrationState *s)
+{
+    if (!s->return_path) {
+        return;
+    }
+
+    /* When a post-copy migration completes the destination confirms
+       with MIG_RP_MSG_SHUT; in every other case nothing useful can
+       arrive any more, so unblock the reader. */
+    if (!s->postcopy_started || s->state != MIG_STATE_ACTIVE) {
+        shutdown(qemu_get_fd(s->return_path), SHUT_RDWR);
+    }
+    qemu_thread_join(&s->rp_thread);
+    qemu_fclose(s->return_path);
+    s->return_path = NULL;
+}
+
 static int migrate_fd_cleanup(MigrationState *s)
 {
     int ret = 0;
@@ -270,6 +356,8 @@ static int migrate_fd_cleanup(MigrationState *s)
         s->file = NULL;
     }
 
+    migrate_close_return_path(s);
+
     assert(s->fd == -1);
     return ret;
 }
@@ -294,8 +382,8 @@ static void migrate_fd_completed(MigrationState *s)
     notifier_list_notify(&migration_state_notifiers, s);
 }
 
-static ssize_t migrate_fd_put_buffer(MigrationState *s, const void *data,
-                                     size_t size)
+static ssize_t migrate_fd_writev(MigrationState *s, struct iovec *iov,
+                                 int iovcnt)
 {
     ssize_t ret;
 
@@ -304,7 +392,11 @@ static ssize_t migrate_fd_put_buffer(MigrationState *s, const void *data,
     }
 
     do {
-        ret = s->write(s, data, size);
+        if (s->writev) {
+            ret = s->writev(s, iov, iovcnt);
+        } else {
+            ret = s->write(s, iov[0].iov_base, iov[0].iov_len);
+        }
     } while (ret == -1 && ((s->get_error(s)) == EINTR));
 
     if (ret == -1)
@@ -369,6 +461,9 @@ static MigrationState *migrate_init(const MigrationParams *params)
     int64_t bandwidth_limit = s->bandwidth_limit;
     bool enabled_capabilities[MIGRATION_CAPABILITY_MAX];
     int64_t xbzrle_cache_size = s->xbzrle_cache_size;
+    int64_t threads = s->threads;
+    int64_t block_inflight = s->block_inflight;
+    int64_t compress_level = s->compress_level;
 
     memcpy(enabled_capabilities, s->enabled_capabilities,
            sizeof(enabled_capabilities));
@@ -379,6 +474,9 @@ static MigrationState *migrate_init(const MigrationParams *params)
     memcpy(s->enabled_capabilities, enabled_capabilities,
            sizeof(enabled_capabilities));
     s->xbzrle_cache_size = xbzrle_cache_size;
+    s->threads = threads;
+    s->block_inflight = block_inflight;
+    s->compress_level = compress_level;
 
     s->bandwidth_limit = bandwidth_limit;
     s->state = MIG_STATE_SETUP;
@@ -416,6 +514,11 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
         return;
     }
 
+    if (savevm_live_in_progress()) {
+        error_setg(errp, "A live snapshot is being saved");
+        return;
+    }
+
     if (qemu_savevm_state_blocked(errp)) {
         return;
     }
@@ -425,6 +528,12 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
         return;
     }
 
+    if (migrate_use_postcopy() && migrate_use_multi_thread()) {
+        error_setg(errp, "postcopy and multi-thread capabilities cannot "
+                   "be used together");
+        return;
+    }
+
     s = migrate_init(&params);
 
     if (strstart(uri, "tcp:", &p)) {
@@ -436,6 +545,10 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
         unix_start_outgoing_migration(s, p, &local_err);
     } else if (strstart(uri, "fd:", &p)) {
         fd_start_outgoing_migration(s, p, &local_err);
+#endif
+#ifdef CONFIG_RDMA
+    } else if (strstart(uri, "rdma:", &p)) {
+        rdma_start_outgoing_migration(s, p, &local_err);
 #endif
     } else {
         error_set(errp, QERR_INVALID_PARAMETER_VALUE, "uri", "a valid migration protocol");
@@ -451,7 +564,14 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
 
 void qmp_migrate_cancel(Error **errp)
 {
-    migrate_fd_cancel(migrate_get_current());
+    MigrationState *s = migrate_get_current();
+
+    if (s->state == MIG_STATE_ACTIVE && s->postcopy_started) {
+        error_setg(errp, "migration cannot be cancelled once the guest "
+                   "runs on the destination");
+        return;
+    }
+    migrate_fd_cancel(s);
 }
 
 void qmp_migrate_set_cache_size(int64_t value, Error **errp)
@@ -468,6 +588,130 @@ void qmp_migrate_set_cache_size(int64_t value, Error **errp)
     s->xbzrle_cache_size = xbzrle_cache_resize(value);
 }
 
+void qmp_migrate_set_threads(int64_t threads, bool has_compress_level,
+                             int64_t compress_level, Error **errp)
+{
+    MigrationState *s = migrate_get_current();
+
+    if (s->state == MIG_STATE_ACTIVE) {
+        error_set(errp, QERR_MIGRATION_ACTIVE);
+        return;
+    }
+
+    if (threads < 1 || threads > MAX_MIGRATE_THREADS) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "threads",
+                  "a value between 1 and 16");
+        return;
+    }
+
+    if (has_compress_level && (compress_level < 1 || compress_level > 9)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "compress-level",
+                  "a value between 1 and 9");
+        return;
+    }
+
+    s->threads = threads;
+    if (has_compress_level) {
+        s->compress_level = compress_level;
+    }
+}
+
+void qmp_migrate_set_block_inflight(int64_t value, Error **errp)
+{
+    MigrationState *s = migrate_get_current();
+
+    if (s->state == MIG_STATE_ACTIVE) {
+        error_set(errp, QERR_MIGRATION_ACTIVE);
+        return;
+    }
+
+    if (value < 1 || value > MAX_MIGRATE_BLOCK_INFLIGHT) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "value",
+                  "a value between 1 and 64");
+        return;
+    }
+
+    s->block_inflight = value;
+}
+
+void migration_iteration_done(MigrationState *s, uint64_t dirtied_pages)
+{
+    MigrationIteration *base = &s->iteration_base;
+    MigrationIteration now = {
+        .end_time = qemu_get_clock_ms(rt_clock),
+        .sent_pages = norm_mig_pages_transferred(),
+        .zero_pages = dup_mig_pages_transferred(),
+        .xbzrle_pages = xbzrle_mig_pages_transferred(),
+        .xbzrle_cache_hits = xbzrle_mig_pages_cache_hit(),
+        .bytes = s->bytes_sent,
+        .blocked_time = s->blocked_time / 1000,
+    };
+    MigrationIteration *it;
+
+    if (!base->end_time) {
+        /* first sync, nothing has been sent yet */
+        base->end_time = s->total_time;
+    }
+
+    it = &s->iterations[s->iteration_count % MIGRATION_ITERATIONS_MAX];
+    it->start_time = base->end_time;
+    it->end_time = now.end_time;
+    it->dirtied_pages = dirtied_pages;
+    it->sent_pages = now.sent_pages - base->sent_pages;
+    it->zero_pages = now.zero_pages - base->zero_pages;
+    it->xbzrle_pages = now.xbzrle_pages - base->xbzrle_pages;
+    it->xbzrle_cache_hits = now.xbzrle_cache_hits - base->xbzrle_cache_hits;
+    it->sync_time = s->dirty_sync_time;
+    it->bytes = now.bytes - base->bytes;
+    it->blocked_time = now.blocked_time - base->blocked_time;
+
+    trace_migration_iteration(s->iteration_count, it->end_time - it->start_time,
+                              it->dirtied_pages, it->bytes, it->sync_time,
+                              it->blocked_time);
+    trace_migration_iteration_pages(s->iteration_count, it->sent_pages,
+                                    it->zero_pages, it->xbzrle_pages,
+                                    it->xbzrle_cache_hits);
+
+    s->iteration_count++;
+    *base = now;
+}
+
+MigrationIterationInfoList *qmp_query_migrate_iterations(Error **errp)
+{
+    MigrationState *s = migrate_get_current();
+    MigrationIterationInfoList *head = NULL, *entry;
+    uint64_t first = 0, i;
+
+    if (s->iteration_count > MIGRATION_ITERATIONS_MAX) {
+        first = s->iteration_count - MIGRATION_ITERATIONS_MAX;
+    }
+
+    /* build the list backwards so that it comes out oldest first */
+    for (i = s->iteration_count; i-- > first; ) {
+        MigrationIteration *it = &s->iterations[i % MIGRATION_ITERATIONS_MAX];
+        MigrationIterationInfo *info = g_malloc0(sizeof(*info));
+
+        info->iteration = i;
+        info->start_time = it->start_time;
+        info->duration = it->end_time - it->start_time;
+        info->dirtied_pages = it->dirtied_pages;
+        info->sent_pages = it->sent_pages;
+        info->zero_pages = it->zero_pages;
+        info->xbzrle_pages = it->xbzrle_pages;
+        info->xbzrle_cache_hits = it->xbzrle_cache_hits;
+        info->sync_time = it->sync_time;
+        info->bytes = it->bytes;
+        info->blocked_time = it->blocked_time;
+
+        entry = g_malloc0(sizeof(*entry));
+        entry->value = info;
+        entry->next = head;
+        head = entry;
+    }
+
+    return head;
+}
+
 int64_t qmp_query_migrate_cache_size(Error **errp)
 {
     return migrate_xbzrle_cache_size();
@@ -511,32 +755,284 @@ int64_t migrate_xbzrle_cache_size(void)
     return s->xbzrle_cache_size;
 }
 
+bool migrate_use_multi_thread(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_MULTI_THREAD];
+}
+
+int64_t migrate_threads(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->threads;
+}
+
+bool migrate_use_compress(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_COMPRESS];
+}
+
+int64_t migrate_compress_level(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->compress_level;
+}
+
+bool migrate_use_postcopy(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_POSTCOPY];
+}
+
+bool migrate_auto_converge(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_AUTO_CONVERGE];
+}
+
+bool migrate_zero_blocks(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_ZERO_BLOCKS];
+}
+
+int64_t migrate_block_inflight(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->block_inflight;
+}
+
+/* return path support */
+
+static void migrate_send_rp_message(QEMUFile *rp,
+                                    enum MigrationRPMsgType type,
+                                    uint16_t len, const uint8_t *data)
+{
+    qemu_put_be16(rp, type);
+    qemu_put_be16(rp, len);
+    qemu_put_buffer(rp, data, len);
+    qemu_fflush(rp);
+}
+
+void migrate_send_rp_shut(QEMUFile *rp, uint32_t value)
+{
+    uint8_t buf[4];
+
+    stl_be_p(buf, value);
+    migrate_send_rp_message(rp, MIG_RP_MSG_SHUT, sizeof(buf), buf);
+}
+
+void migrate_send_rp_req_pages(QEMUFile *rp, const char *idstr,
+                               uint64_t start, uint32_t len)
+{
+    uint8_t buf[8 + 4 + 1 + 256];
+    size_t idlen = strlen(idstr);
+
+    assert(idlen < 256);
+    stq_be_p(buf, start);
+    stl_be_p(buf + 8, len);
+    buf[12] = idlen;
+    memcpy(buf + 13, idstr, idlen);
+
+    migrate_send_rp_message(rp, MIG_RP_MSG_REQ_PAGES, 13 + idlen, buf);
+}
+
+static void *source_return_path_thread(void *opaque)
+{
+    MigrationState *s = opaque;
+    QEMUFile *rp = s->return_path;
+    uint8_t buf[8 + 4 + 1 + 256];
+    uint16_t type, len;
+    char idstr[256];
+
+    while (true) {
+        type = qemu_get_be16(rp);
+        len = qemu_get_be16(rp);
+        if (qemu_file_get_error(rp) || len > sizeof(buf) ||
+            qemu_get_buffer(rp, buf, len) != len) {
+            break;
+        }
+
+        switch (type) {
+        case MIG_RP_MSG_SHUT:
+            DPRINTF("destination is done, status %u\n",
+                    len == 4 ? ldl_be_p(buf) : 0);
+            return NULL;
+        case MIG_RP_MSG_REQ_PAGES:
+            if (len < 13 || buf[12] != len - 13) {
+                fprintf(stderr, "migration: bad page request\n");
+                return NULL;
+            }
+            memcpy(idstr, buf + 13, buf[12]);
+            idstr[buf[12]] = 0;
+            ram_save_queue_pages(idstr, ldq_be_p(buf), ldl_be_p(buf + 8));
+            s->postcopy_requests++;
+            break;
+        default:
+            DPRINTF("ignoring return path message %d\n", type);
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+static int migrate_open_return_path(MigrationState *s)
+{
+    struct stat st;
+    int fd;
+
+    if (fstat(s->fd, &st) < 0 || !S_ISSOCK(st.st_mode)) {
+        fprintf(stderr, "migration: postcopy needs a socket transport\n");
+        return -ENOTSUP;
+    }
+
+    fd = dup(s->fd);
+    if (fd < 0) {
+        return -errno;
+    }
+
+    s->return_path = qemu_fopen_socket(fd);
+    qemu_thread_create(&s->rp_thread, source_return_path_thread, s,
+                       QEMU_THREAD_JOINABLE);
+    return 0;
+}
+
 /* migration thread support */
 
 
+/* number of segments handed to a single writev */
+#define MIGRATION_IOV_MAX 64
+
+static void buffered_add_segment(MigrationState *s, const uint8_t *data,
+                                 size_t len)
+{
+    MigrationIOSegment *last = NULL;
+
+    if (s->nr_segments) {
+        last = &s->segments[s->nr_segments - 1];
+    }
+
+    if (last && !data && !last->data) {
+        last->len += len;
+        return;
+    }
+    if (last && data && last->data && last->data + last->len == data) {
+        last->len += len;
+        return;
+    }
+
+    if (s->nr_segments == s->segments_capacity) {
+        s->segments_capacity = s->segments_capacity * 2 + MIGRATION_IOV_MAX;
+        s->segments = g_renew(MigrationIOSegment, s->segments,
+                              s->segments_capacity);
+    }
+    s->segments[s->nr_segments].data = data;
+    s->segments[s->nr_segments].len = len;
+    s->nr_segments++;
+}
+
+/* Drop @len sent bytes from the head of the queue */
+static void buffered_consume(MigrationState *s, size_t len)
+{
+    size_t copied = 0;
+    int i = 0;
+
+    while (len) {
+        MigrationIOSegment *seg = &s->segments[i];
+        size_t n = MIN(len, seg->len);
+
+        if (!seg->data) {
+            copied += n;
+        } else {
+            seg->data += n;
+        }
+        seg->len -= n;
+        len -= n;
+        if (seg->len == 0) {
+            i++;
+        }
+    }
+
+    memmove(s->segments, s->segments + i,
+            (s->nr_segments - i) * sizeof(s->segments[0]));
+    s->nr_segments -= i;
+
+    memmove(s->buffer, s->buffer + copied, s->buffer_size - copied);
+    s->buffer_size -= copied;
+}
+
 static ssize_t buffered_flush(MigrationState *s)
 {
+    struct iovec iov[MIGRATION_IOV_MAX];
     size_t offset = 0;
     ssize_t ret = 0;
+    int64_t start;
+
+    DPRINTF("flushing %d segment(s)\n", s->nr_segments);
+
+    while (s->bytes_xfer < s->xfer_limit && s->nr_segments) {
+        size_t budget = s->xfer_limit - s->bytes_xfer;
+        size_t buf_offset = 0;
+        int iovcnt = 0;
+
+        while (iovcnt < s->nr_segments && iovcnt < MIGRATION_IOV_MAX &&
+               budget) {
+            MigrationIOSegment *seg = &s->segments[iovcnt];
+            size_t len = MIN(seg->len, budget);
 
-    DPRINTF("flushing %zu byte(s) of data\n", s->buffer_size);
+            if (seg->data) {
+                iov[iovcnt].iov_base = (void *)seg->data;
+            } else {
+                iov[iovcnt].iov_base = s->buffer + buf_offset;
+                buf_offset += seg->len;
+            }
+            iov[iovcnt].iov_len = len;
+            budget -= len;
+            iovcnt++;
+        }
 
-    while (s->bytes_xfer < s->xfer_limit && offset < s->buffer_size) {
-        size_t to_send = MIN(s->buffer_size - offset, s->xfer_limit - s->bytes_xfer);
-        ret = migrate_fd_put_buffer(s, s->buffer + offset, to_send);
+        start = qemu_get_clock_ns(rt_clock);
+        ret = migrate_fd_writev(s, iov, iovcnt);
+        s->blocked_time += qemu_get_clock_ns(rt_clock) - start;
         if (ret <= 0) {
             DPRINTF("error flushing data, %zd\n", ret);
             break;
-        } else {
-            DPRINTF("flushed %zd byte(s)\n", ret);
-            offset += ret;
-            s->bytes_xfer += ret;
         }
+        DPRINTF("flushed %zd byte(s)\n", ret);
+        buffered_consume(s, ret);
+        offset += ret;
+        s->bytes_xfer += ret;
+        s->bytes_sent += ret;
     }
 
-    DPRINTF("flushed %zu of %zu byte(s)\n", offset, s->buffer_size);
-    memmove(s->buffer, s->buffer + offset, s->buffer_size - offset);
-    s->buffer_size -= offset;
+    DPRINTF("flushed %zu byte(s), %d segment(s) left\n", offset,
+            s->nr_segments);
 
     if (ret < 0) {
         return ret;
@@ -573,10 +1069,81 @@ static int buffered_put_buffer(void *opaque, const uint8_t *buf,
 
     memcpy(s->buffer + s->buffer_size, buf, size);
     s->buffer_size += size;
+    s->bytes_copied += size;
+    buffered_add_segment(s, NULL, size);
+
+    return size;
+}
+
+static int buffered_put_buffer_async(void *opaque, const uint8_t *buf,
+                                     int64_t pos, int size)
+{
+    MigrationState *s = opaque;
+    ssize_t error;
+
+    if (!s->writev) {
+        return buffered_put_buffer(opaque, buf, pos, size);
+    }
+
+    DPRINTF("queueing %d bytes at %" PRId64 "\n", size, pos);
+
+    error = qemu_file_get_error(s->file);
+    if (error) {
+        DPRINTF("flush when error, bailing: %s\n", strerror(-error));
+        return error;
+    }
+
+    if (size <= 0) {
+        return size;
+    }
+
+    buffered_add_segment(s, buf, size);
 
     return size;
 }
 
+static int buffered_save_page(void *opaque, uint64_t block_offset,
+                              uint64_t offset, int size)
+{
+    MigrationState *s = opaque;
+    int64_t xfer_limit = s->xfer_limit;
+    ssize_t error;
+    int ret;
+
+    if (!s->save_page) {
+        return -ENOTSUP;
+    }
+
+    error = qemu_file_get_error(s->file);
+    if (error) {
+        return error;
+    }
+
+    /* everything queued before the page has to reach the transport first,
+     * so that the destination sees the stream in order */
+    s->xfer_limit = INT_MAX;
+    while (s->nr_segments) {
+        error = buffered_flush(s);
+        if (error <= 0) {
+            break;
+        }
+    }
+    s->xfer_limit = xfer_limit;
+    if (error < 0) {
+        return error;
+    }
+    if (s->nr_segments) {
+        return -EIO;
+    }
+
+    ret = s->save_page(s, block_offset, offset, size);
+    if (ret > 0) {
+        s->bytes_xfer += ret;
+        s->bytes_sent += ret;
+    }
+    return ret;
+}
+
 static int buffered_close(void *opaque)
 {
     MigrationState *s = opaque;
@@ -586,7 +1153,7 @@ static int buffered_close(void *opaque)
     DPRINTF("closing\n");
 
     s->xfer_limit = INT_MAX;
-    while (!qemu_file_get_error(s->file) && s->buffer_size) {
+    while (!qemu_file_get_error(s->file) && s->nr_segments) {
         ret = buffered_flush(s);
         if (ret < 0) {
             break;
@@ -634,7 +1201,7 @@ static int buffered_rate_limit(void *opaque)
 static int64_t buffered_set_rate_limit(void *opaque, int64_t new_rate)
 {
     MigrationState *s = opaque;
-    if (qemu_file_get_error(s->file)) {
+    if (qemu_file_get_error(s->file) || s->postcopy_started) {
         goto out;
     }
     if (new_rate > SIZE_MAX) {
@@ -654,6 +1221,42 @@ static int64_t buffered_get_rate_limit(void *opaque)
     return s->xfer_limit;
 }
 
+/*
+ * Stop the guest and let the destination run it, the remaining RAM is
+ * sent in the background or on request.  Called with the iothread lock
+ * held.
+ */
+static int migrate_postcopy_start(MigrationState *s)
+{
+    int old_vm_running = runstate_is_running();
+    int64_t start_time = qemu_get_clock_ms(rt_clock);
+    int ret;
+
+    DPRINTF("switching to post-copy\n");
+    qemu_system_wakeup_request(QEMU_WAKEUP_REASON_OTHER);
+    if (old_vm_running) {
+        vm_stop(RUN_STATE_FINISH_MIGRATE);
+    } else {
+        vm_stop_force_state(RUN_STATE_FINISH_MIGRATE);
+    }
+
+    ret = qemu_savevm_state_postcopy_start(s->file);
+    if (ret < 0) {
+        if (old_vm_running) {
+            vm_start();
+        }
+        return ret;
+    }
+
+    s->postcopy_started = true;
+    s->downtime = qemu_get_clock_ms(rt_clock) - start_time;
+    /* requested pages must not wait for the next rate limit period */
+    s->xfer_limit = INT_MAX;
+    notifier_list_notify(&migration_state_notifiers, s);
+
+    return 0;
+}
+
 static void *buffered_file_thread(void *opaque)
 {
     MigrationState *s = opaque;
@@ -663,6 +1266,7 @@ static void *buffered_file_thread(void *opaque)
     bool last_round = false;
     int ret;
 
+    qemu_bql_set_site(BQL_SITE_MIGRATION);
     qemu_mutex_lock_iothread();
     DPRINTF("beginning savevm\n");
     ret = qemu_savevm_state_begin(s->file, &s->params);
@@ -671,6 +1275,14 @@ static void *buffered_file_thread(void *opaque)
         qemu_mutex_unlock_iothread();
         goto out;
     }
+    if (migrate_use_postcopy()) {
+        ret = migrate_open_return_path(s);
+        if (ret < 0) {
+            qemu_mutex_unlock_iothread();
+            goto out;
+        }
+        qemu_savevm_send_postcopy_advise(s->file);
+    }
     qemu_mutex_unlock_iothread();
 
     while (true) {
@@ -692,11 +1304,27 @@ static void *buffered_file_thread(void *opaque)
             pending_size = qemu_savevm_state_pending(s->file, max_size);
             DPRINTF("pending size %lu max %lu\n", pending_size, max_size);
             if (pending_size && pending_size >= max_size) {
-                ret = qemu_savevm_state_iterate(s->file);
+                if (s->postcopy_started) {
+                    ret = qemu_savevm_state_postcopy_iterate(s->file);
+                } else if (migrate_use_postcopy() && ram_precopy_pass_done()) {
+                    ret = migrate_postcopy_start(s);
+                } else {
+                    ret = qemu_savevm_state_iterate(s->file);
+                }
                 if (ret < 0) {
                     qemu_mutex_unlock_iothread();
                     break;
                 }
+            } else if (s->postcopy_started) {
+                DPRINTF("post-copy done\n");
+                ret = qemu_savevm_state_postcopy_complete(s->file);
+                if (ret < 0) {
+                    qemu_mutex_unlock_iothread();
+                    break;
+                }
+                migrate_fd_completed(s);
+                s->total_time = qemu_get_clock_ms(rt_clock) - s->total_time;
+                last_round = true;
             } else {
                 int old_vm_running = runstate_is_running();
                 int64_t start_time, end_time;
@@ -749,9 +1377,12 @@ static void *buffered_file_thread(void *opaque)
             initial_time = current_time;
         }
         if (!last_round && (s->bytes_xfer >= s->xfer_limit)) {
+            int64_t sleep_start = qemu_get_clock_ns(rt_clock);
+
             /* usleep expects microseconds */
             g_usleep((initial_time + BUFFER_DELAY - current_time)*1000);
             sleep_time += qemu_get_clock_ms(rt_clock) - current_time;
+            s->blocked_time += qemu_get_clock_ns(rt_clock) - sleep_start;
         }
         ret = buffered_flush(s);
         if (ret < 0) {
@@ -764,12 +1395,17 @@ out:
         migrate_fd_error(s);
     }
     g_free(s->buffer);
+    g_free(s->segments);
+    s->segments = NULL;
+    s->nr_segments = s->segments_capacity = 0;
     return NULL;
 }
 
 static const QEMUFileOps buffered_file_ops = {
     .get_fd =         buffered_get_fd,
     .put_buffer =     buffered_put_buffer,
+    .put_buffer_async = buffered_put_buffer_async,
+    .save_page =      buffered_save_page,
     .close =          buffered_close,
     .rate_limit =     buffered_rate_limit,
     .get_rate_limit = buffered_get_rate_limit,
@@ -783,6 +1419,11 @@ void migrate_fd_connect(MigrationState *s)
     s->buffer = NULL;
     s->buffer_size = 0;
     s->buffer_capacity = 0;
+    s->segments = NULL;
+    s->nr_segments = 0;
+    s->segments_capacity = 0;
+    s->bytes_copied = 0;
+    s->bytes_sent = 0;
     /* This is a best 1st approximation. ns to ms */
     s->expected_downtime = max_downtime/1000000;
 
@@ -67,6 +67,7 @@
 #include "qmp-commands.h"
 #include "hmp.h"
 #include "qemu/thread.h"
+#include "sysemu/cpus.h"
 
 /* for pic/irq_info */
 #if defined(TARGET_SPARC)
@@ -166,6 +167,11 @@ typedef struct MonitorControl {
     QObject *id;
     JSONMessageParser parser;
     int command_mode;
+    /* protected by qmp_lock */
+    int pending;        /* requests queued for, or running in, the main loop */
+    int input_len;      /* bytes received but not parsed yet */
+    /* qmp_thread_mon only: the monitor to send responses to */
+    Monitor *reply_to;
 } MonitorControl;
 
 /*
@@ -206,16 +212,75 @@ static QLIST_HEAD(mon_list, Monitor) mon_list;
 static QLIST_HEAD(mon_fdsets, MonFdset) mon_fdsets;
 static int mon_refcount;
 
+/*
+ * QMP input is parsed by the monitor thread.  A request for a command
+ * flagged MONITOR_CMD_THREAD_SAFE runs right there, outside the BQL, unless
+ * an earlier request of the same monitor is still waiting for the main loop;
+ * all others are queued and run from a bottom half in the main loop, a batch
+ * at a time.  Requests sent with "exec-oob" instead of "execute" skip ahead
+ * of the queue.  Responses of commands that ran in the thread are queued as
+ * well and written out by the same bottom half, so that all chardev I/O
+ * stays in the main loop and responses still come in order.
+ */
+typedef struct QMPInput {
+    Monitor *mon;
+    int size;                   /* -1 to restart the parser */
+    QSIMPLEQ_ENTRY(QMPInput) next;
+    uint8_t buf[];
+} QMPInput;
+
+typedef struct QMPRequest {
+    Monitor *mon;
+    QObject *req;               /* NULL if it was not valid JSON */
+    bool oob;
+    QSIMPLEQ_ENTRY(QMPRequest) next;
+} QMPRequest;
+
+typedef struct QMPResponse {
+    Monitor *mon;
+    QString *json;
+    QSIMPLEQ_ENTRY(QMPResponse) next;
+} QMPResponse;
+
+#define QMP_BATCH       8       /* requests per run of the bottom half */
+#define QMP_MAX_PENDING 64      /* requests per monitor before input stops */
+#define QMP_MAX_INPUT   65536   /* unparsed bytes per monitor, likewise */
+#define QMP_READ_SIZE   4096
+
+static QemuMutex qmp_lock;
+static QemuCond qmp_cond;
+static QemuThread qmp_thread;
+static bool qmp_thread_started;
+static QEMUBH *qmp_bh;
+static bool qmp_dispatching;
+static QSIMPLEQ_HEAD(, QMPInput) qmp_input =
+    QSIMPLEQ_HEAD_INITIALIZER(qmp_input);
+static QSIMPLEQ_HEAD(, QMPRequest) qmp_requests =
+    QSIMPLEQ_HEAD_INITIALIZER(qmp_requests);
+static QSIMPLEQ_HEAD(, QMPResponse) qmp_responses =
+    QSIMPLEQ_HEAD_INITIALIZER(qmp_responses);
+static QMPRequest *qmp_oob_last;
+
+/* The monitor thread runs commands as this one, on behalf of the others */
+static MonitorControl qmp_thread_mc;
+static Monitor qmp_thread_mon = {
+    .flags = MONITOR_USE_CONTROL,
+    .mc = &qmp_thread_mc,
+};
+/* The monitor whose input is being parsed */
+static Monitor *qmp_parse_mon;
+
 static mon_cmd_t mon_cmds[];
 static mon_cmd_t info_cmds[];
 
 static const mon_cmd_t qmp_cmds[];
 
-Monitor *cur_mon;
+DEFINE_TLS(Monitor *, cur_mon);
 Monitor *default_mon;
 
 static void monitor_command_cb(Monitor *mon, const char *cmdline,
                                void *opaque);
+static void qmp_queue_response(Monitor *mon, QString *json);
 
 static inline int qmp_cmd_mode(const Monitor *mon)
 {
@@ -373,6 +438,11 @@ static void monitor_json_emitter(Monitor *mon, const QObject *data)
     assert(json != NULL);
 
     qstring_append_chr(json, '\n');
+    if (mon->mc && mon->mc->reply_to) {
+        /* in the monitor thread, leave the chardev to the main loop */
+        qmp_queue_response(mon->mc->reply_to, json);
+        return;
+    }
     monitor_puts(mon, qstring_get_str(json));
 
     QDECREF(json);
@@ -463,6 +533,7 @@ static const char *monitor_event_names[] = {
     [QEVENT_WAKEUP] = "WAKEUP",
     [QEVENT_BALLOON_CHANGE] = "BALLOON_CHANGE",
     [QEVENT_SPICE_MIGRATE_COMPLETED] = "SPICE_MIGRATE_COMPLETED",
+    [QEVENT_DUMP_COMPLETED] = "DUMP_COMPLETED",
 };
 QEMU_BUILD_BUG_ON(ARRAY_SIZE(monitor_event_names) != QEVENT_MAX)
 
@@ -895,6 +966,17 @@ static void do_info_jit(Monitor *mon, const QDict *qdict)
     dump_exec_info((FILE *)mon, monitor_fprintf);
 }
 
+static void do_info_tb_profile(Monitor *mon, const QDict *qdict)
+{
+    dump_tb_profile((FILE *)mon, monitor_fprintf,
+                    qdict_get_try_int(qdict, "count", 20));
+}
+
+static void do_info_halt_poll(Monitor *mon, const QDict *qdict)
+{
+    dump_halt_poll_stats((FILE *)mon, monitor_fprintf);
+}
+
 static void do_info_history(Monitor *mon, const QDict *qdict)
 {
     int i;
@@ -2547,6 +2629,22 @@ static mon_cmd_t info_cmds[] = {
         .help       = "show dynamic compiler info",
         .mhandler.cmd = do_info_jit,
     },
+    {
+        .name       = "tb-profile",
+        .args_type  = "count:i?",
+        .params     = "[count]",
+        .help       = "show the TBs that took the most host time "
+                      "(needs -machine tcg-profile=on)",
+        .mhandler.cmd = do_info_tb_profile,
+    },
+    {
+        .name       = "halt-poll",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show the halt polling window and statistics of "
+                      "each vCPU",
+        .mhandler.cmd = do_info_halt_poll,
+    },
     {
         .name       = "kvm",
         .args_type  = "",
@@ -2554,6 +2652,14 @@ static mon_cmd_t info_cmds[] = {
         .help       = "show KVM information",
         .mhandler.cmd = hmp_info_kvm,
     },
+    {
+        .name       = "kvm-exits",
+        .args_type  = "top:i?",
+        .params     = "[N]",
+        .help       = "show vCPU exits by reason and the N MMIO/PIO "
+                      "addresses causing the most exits",
+        .mhandler.cmd = hmp_info_kvm_exits,
+    },
     {
         .name       = "numa",
         .args_type  = "",
@@ -2582,6 +2688,29 @@ static mon_cmd_t info_cmds[] = {
         .help       = "show profiling information",
         .mhandler.cmd = do_info_profile,
     },
+    {
+        .name       = "wakeups",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show which timers and bottom halves woke up "
+                      "the main loop",
+        .mhandler.cmd = hmp_info_wakeups,
+    },
+    {
+        .name       = "cpu-accounting",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show the time spent in main loop callbacks and "
+                      "holding the iothread lock",
+        .mhandler.cmd = hmp_info_cpu_accounting,
+    },
+    {
+        .name       = "bql",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show iothread lock wait and hold times by site",
+        .mhandler.cmd = hmp_info_bql,
+    },
     {
         .name       = "capture",
         .args_type  = "",
@@ -2686,6 +2815,27 @@ static mon_cmd_t info_cmds[] = {
         .help       = "show current migration xbzrle cache size",
         .mhandler.cmd = hmp_info_migrate_cache_size,
     },
+    {
+        .name       = "migrate_iterations",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show the most recent iterations of migration",
+        .mhandler.cmd = hmp_info_migrate_iterations,
+    },
+    {
+        .name       = "dump",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show the progress of the last guest memory dump",
+        .mhandler.cmd = hmp_info_dump,
+    },
+    {
+        .name       = "savevm",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show the progress of the last live snapshot",
+        .mhandler.cmd = hmp_info_savevm,
+    },
     {
         .name       = "balloon",
         .args_type  = "",
@@ -2693,6 +2843,13 @@ static mon_cmd_t info_cmds[] = {
         .help       = "show balloon information",
         .mhandler.cmd = hmp_info_balloon,
     },
+    {
+        .name       = "ram-reclaim",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show the state of the zero page scanner",
+        .mhandler.cmd = hmp_info_ram_reclaim,
+    },
     {
         .name       = "qtree",
         .args_type  = "",
@@ -3938,6 +4095,7 @@ static void handle_user_command(Monitor *mon, const char *cmdline)
 {
     QDict *qdict;
     const mon_cmd_t *cmd;
+    BqlSite site = qemu_bql_set_site(BQL_SITE_MONITOR);
 
     qdict = qdict_new();
 
@@ -3963,6 +4121,7 @@ static void handle_user_command(Monitor *mon, const char *cmdline)
 
 out:
     QDECREF(qdict);
+    qemu_bql_set_site(site);
 }
 
 static void cmd_completion(const char *name, const char *list)
@@ -4401,8 +4560,8 @@ out:
  * Input object checking rules
  *
  * 1. Input object must be a dict
- * 2. The "execute" key must exist
- * 3. The "execute" key must be a string
+ * 2. Exactly one of the "execute" and "exec-oob" keys must exist
+ * 3. It must be a string
  * 4. If the "arguments" key exists, it must be a dict
  * 5. If the "id" key exists, it can be anything (ie. json-value)
  * 6. Any argument not listed above is considered invalid
@@ -4424,12 +4583,16 @@ static QDict *qmp_check_input_obj(QObject *input_obj)
         const char *arg_name = qdict_entry_key(ent);
         const QObject *arg_obj = qdict_entry_value(ent);
 
-        if (!strcmp(arg_name, "execute")) {
+        if (!strcmp(arg_name, "execute") || !strcmp(arg_name, "exec-oob")) {
             if (qobject_type(arg_obj) != QTYPE_QSTRING) {
-                qerror_report(QERR_QMP_BAD_INPUT_OBJECT_MEMBER, "execute",
+                qerror_report(QERR_QMP_BAD_INPUT_OBJECT_MEMBER, arg_name,
                               "string");
                 return NULL;
             }
+            if (has_exec_key) {
+                qerror_report(QERR_QMP_EXTRA_MEMBER, arg_name);
+                return NULL;
+            }
             has_exec_key = 1;
         } else if (!strcmp(arg_name, "arguments")) {
             if (qobject_type(arg_obj) != QTYPE_QDICT) {
@@ -4458,25 +4621,48 @@ static void qmp_call_cmd(Monitor *mon, const mon_cmd_t *cmd,
 {
     int ret;
     QObject *data = NULL;
+    BqlSite site = qemu_bql_set_site(BQL_SITE_MONITOR);
 
     ret = cmd->mhandler.cmd_new(mon, params, &data);
     handler_audit(mon, cmd, ret);
     monitor_protocol_emitter(mon, data);
     qobject_decref(data);
+    qemu_bql_set_site(site);
+}
+
+/* Return the command named by a request, or NULL; set *@oob for "exec-oob" */
+static const char *qmp_request_name(QObject *req, bool *oob)
+{
+    QDict *dict;
+    const char *name;
+
+    *oob = false;
+    if (!req || qobject_type(req) != QTYPE_QDICT) {
+        return NULL;
+    }
+    dict = qobject_to_qdict(req);
+    name = qdict_get_try_str(dict, "execute");
+    if (!name) {
+        name = qdict_get_try_str(dict, "exec-oob");
+        *oob = name != NULL;
+    }
+    return name;
 }
 
-static void handle_qmp_command(JSONMessageParser *parser, QList *tokens)
+/* Run a parsed request, or report that @obj is NULL; takes ownership */
+static void handle_qmp_command(Monitor *mon, QObject *obj)
 {
     int err;
-    QObject *obj;
     QDict *input, *args;
     const mon_cmd_t *cmd;
     const char *cmd_name;
-    Monitor *mon = cur_mon;
+    bool oob;
 
     args = input = NULL;
 
-    obj = json_parser_parse(tokens, NULL);
+    /* recycle the nodes of the request and the reply */
+    qobject_cache_begin();
+
     if (!obj) {
         // FIXME: should be triggered in json_parser_parse()
         qerror_report(QERR_JSON_PARSING);
@@ -4492,7 +4678,7 @@ static void handle_qmp_command(JSONMessageParser *parser, QList *tokens)
     mon->mc->id = qdict_get(input, "id");
     qobject_incref(mon->mc->id);
 
-    cmd_name = qdict_get_str(input, "execute");
+    cmd_name = qmp_request_name(obj, &oob);
     trace_handle_qmp_command(mon, cmd_name);
     if (invalid_qmp_mode(mon, cmd_name)) {
         qerror_report(QERR_COMMAND_NOT_FOUND, cmd_name);
@@ -4535,20 +4721,285 @@ err_out:
 out:
     QDECREF(input);
     QDECREF(args);
+    qobject_cache_end();
+}
+
+static void qmp_queue_response(Monitor *mon, QString *json)
+{
+    QMPResponse *r = g_new0(QMPResponse, 1);
+
+    r->mon = mon;
+    r->json = json;
+    qemu_mutex_lock(&qmp_lock);
+    QSIMPLEQ_INSERT_TAIL(&qmp_responses, r, next);
+    qemu_mutex_unlock(&qmp_lock);
+    qemu_bh_schedule(qmp_bh);
+}
+
+/* Run a request in the monitor thread, on behalf of @mon */
+static void qmp_thread_dispatch(Monitor *mon, QObject *req)
+{
+    Monitor *old_mon = cur_mon;
+
+    qmp_thread_mon.flags = mon->flags;
+    qmp_thread_mc.command_mode = mon->mc->command_mode;
+    qmp_thread_mc.reply_to = mon;
+    cur_mon = &qmp_thread_mon;
+    handle_qmp_command(&qmp_thread_mon, req);
+    cur_mon = old_mon;
+}
+
+/* Called for each complete JSON value received by qmp_parse_mon */
+static void qmp_parse_cb(JSONMessageParser *parser, GQueue *tokens)
+{
+    Monitor *mon = qmp_parse_mon;
+    QObject *req = json_parser_parse(tokens, NULL);
+    const mon_cmd_t *cmd = NULL;
+    const char *name;
+    QMPRequest *r;
+    bool oob;
+
+    name = qmp_request_name(req, &oob);
+    if (name) {
+        cmd = qmp_find_cmd(name);
+    }
+
+    qemu_mutex_lock(&qmp_lock);
+    if (qmp_thread_started && cmd && (cmd->flags & MONITOR_CMD_THREAD_SAFE) &&
+        (oob || !mon->mc->pending)) {
+        qemu_mutex_unlock(&qmp_lock);
+        qmp_thread_dispatch(mon, req);
+        return;
+    }
+
+    r = g_new0(QMPRequest, 1);
+    r->mon = mon;
+    r->req = req;
+    r->oob = oob;
+    if (!oob) {
+        QSIMPLEQ_INSERT_TAIL(&qmp_requests, r, next);
+    } else if (qmp_oob_last) {
+        /* behind the urgent requests already queued */
+        QSIMPLEQ_INSERT_AFTER(&qmp_requests, qmp_oob_last, r, next);
+        qmp_oob_last = r;
+    } else {
+        QSIMPLEQ_INSERT_HEAD(&qmp_requests, r, next);
+        qmp_oob_last = r;
+    }
+    mon->mc->pending++;
+    qemu_mutex_unlock(&qmp_lock);
+    qemu_bh_schedule(qmp_bh);
+}
+
+static void qmp_flush_responses(void)
+{
+    QMPResponse *r;
+
+    qemu_mutex_lock(&qmp_lock);
+    while ((r = QSIMPLEQ_FIRST(&qmp_responses)) != NULL) {
+        QSIMPLEQ_REMOVE_HEAD(&qmp_responses, next);
+        qemu_mutex_unlock(&qmp_lock);
+        monitor_puts(r->mon, qstring_get_str(r->json));
+        QDECREF(r->json);
+        g_free(r);
+        qemu_mutex_lock(&qmp_lock);
+    }
+    qemu_mutex_unlock(&qmp_lock);
+}
+
+static void monitor_qmp_bh(void *opaque)
+{
+    Monitor *old_mon;
+    QMPRequest *r;
+    bool more;
+    int i;
+
+    /* a command that runs nested event loops must not see the next one;
+     * the outermost invocation picks them up when it is done */
+    if (qmp_dispatching) {
+        return;
+    }
+    qmp_dispatching = true;
+
+    for (i = 0; i < QMP_BATCH; i++) {
+        /* before the next request, so that responses stay in order */
+        qmp_flush_responses();
+
+        qemu_mutex_lock(&qmp_lock);
+        r = QSIMPLEQ_FIRST(&qmp_requests);
+        if (r) {
+            QSIMPLEQ_REMOVE_HEAD(&qmp_requests, next);
+            if (r == qmp_oob_last) {
+                qmp_oob_last = NULL;
+            }
+        }
+        qemu_mutex_unlock(&qmp_lock);
+        if (!r) {
+            break;
+        }
+
+        old_mon = cur_mon;
+        cur_mon = r->mon;
+        handle_qmp_command(r->mon, r->req);
+        cur_mon = old_mon;
+
+        qemu_mutex_lock(&qmp_lock);
+        r->mon->mc->pending--;
+        qemu_mutex_unlock(&qmp_lock);
+        g_free(r);
+    }
+    qmp_flush_responses();
+
+    qemu_mutex_lock(&qmp_lock);
+    more = !QSIMPLEQ_EMPTY(&qmp_requests);
+    qemu_mutex_unlock(&qmp_lock);
+    qmp_dispatching = false;
+
+    /* give the other handlers a chance before the next batch */
+    if (more) {
+        qemu_bh_schedule(qmp_bh);
+    }
+}
+
+static void *monitor_qmp_thread(void *opaque)
+{
+    QMPInput *in;
+
+    qemu_register_thread("monitor", qemu_get_thread_id());
+
+    qemu_mutex_lock(&qmp_lock);
+    for (;;) {
+        in = QSIMPLEQ_FIRST(&qmp_input);
+        if (!in) {
+            qemu_cond_wait(&qmp_cond, &qmp_lock);
+            continue;
+        }
+        QSIMPLEQ_REMOVE_HEAD(&qmp_input, next);
+        if (in->size > 0) {
+            in->mon->mc->input_len -= in->size;
+        }
+        qemu_mutex_unlock(&qmp_lock);
+
+        qmp_parse_mon = in->mon;
+        if (in->size < 0) {
+            json_message_parser_destroy(&in->mon->mc->parser);
+            json_message_parser_init(&in->mon->mc->parser, qmp_parse_cb);
+        } else {
+            json_message_parser_feed(&in->mon->mc->parser,
+                                     (const char *) in->buf, in->size);
+        }
+        g_free(in);
+
+        qemu_mutex_lock(&qmp_lock);
+    }
+
+    return NULL;
+}
+
+static void monitor_qmp_init(void)
+{
+    qemu_mutex_init(&qmp_lock);
+    qemu_cond_init(&qmp_cond);
+    qmp_bh = qemu_bh_new(monitor_qmp_bh, NULL);
+#ifdef __linux__
+    /* cur_mon and the QObject free lists are only really per thread on
+     * Linux (see qemu/tls.h); elsewhere QMP input is handled as before */
+    qemu_thread_create(&qmp_thread, monitor_qmp_thread, NULL,
+                       QEMU_THREAD_DETACHED);
+    qmp_thread_started = true;
+#endif
+}
+
+static void qmp_queue_input(Monitor *mon, const uint8_t *buf, int size)
+{
+    QMPInput *in = g_malloc(sizeof(*in) + MAX(size, 0));
+
+    in->mon = mon;
+    in->size = size;
+    if (size > 0) {
+        memcpy(in->buf, buf, size);
+        mon->mc->input_len += size;
+    }
+    QSIMPLEQ_INSERT_TAIL(&qmp_input, in, next);
+    qemu_cond_signal(&qmp_cond);
+}
+
+/* Forget everything a client that went away had queued */
+static void qmp_reset(Monitor *mon)
+{
+    QMPInput *in, *next_in;
+    QMPRequest *r, *next_r;
+    QMPResponse *rsp, *next_rsp;
+
+    qemu_mutex_lock(&qmp_lock);
+    QSIMPLEQ_FOREACH_SAFE(in, &qmp_input, next, next_in) {
+        if (in->mon == mon) {
+            QSIMPLEQ_REMOVE(&qmp_input, in, QMPInput, next);
+            g_free(in);
+        }
+    }
+    mon->mc->input_len = 0;
+
+    qmp_oob_last = NULL;
+    QSIMPLEQ_FOREACH_SAFE(r, &qmp_requests, next, next_r) {
+        if (r->mon == mon) {
+            QSIMPLEQ_REMOVE(&qmp_requests, r, QMPRequest, next);
+            mon->mc->pending--;
+            qobject_decref(r->req);
+            g_free(r);
+        } else if (r->oob) {
+            qmp_oob_last = r;
+        }
+    }
+
+    QSIMPLEQ_FOREACH_SAFE(rsp, &qmp_responses, next, next_rsp) {
+        if (rsp->mon == mon) {
+            QSIMPLEQ_REMOVE(&qmp_responses, rsp, QMPResponse, next);
+            QDECREF(rsp->json);
+            g_free(rsp);
+        }
+    }
+
+    if (qmp_thread_started) {
+        qmp_queue_input(mon, NULL, -1);
+    }
+    qemu_mutex_unlock(&qmp_lock);
+
+    if (!qmp_thread_started) {
+        json_message_parser_destroy(&mon->mc->parser);
+        json_message_parser_init(&mon->mc->parser, qmp_parse_cb);
+    }
+}
+
+static int monitor_control_can_read(void *opaque)
+{
+    Monitor *mon = opaque;
+    bool full;
+
+    qemu_mutex_lock(&qmp_lock);
+    full = mon->mc->pending >= QMP_MAX_PENDING ||
+           mon->mc->input_len >= QMP_MAX_INPUT;
+    qemu_mutex_unlock(&qmp_lock);
+
+    return full ? 0 : QMP_READ_SIZE;
 }
 
 /**
- * monitor_control_read(): Read and handle QMP input
+ * monitor_control_read(): Read and queue QMP input
  */
 static void monitor_control_read(void *opaque, const uint8_t *buf, int size)
 {
-    Monitor *old_mon = cur_mon;
-
-    cur_mon = opaque;
+    Monitor *mon = opaque;
 
-    json_message_parser_feed(&cur_mon->mc->parser, (const char *) buf, size);
+    if (!qmp_thread_started) {
+        qmp_parse_mon = mon;
+        json_message_parser_feed(&mon->mc->parser, (const char *) buf, size);
+        return;
+    }
 
-    cur_mon = old_mon;
+    qemu_mutex_lock(&qmp_lock);
+    qmp_queue_input(mon, buf, size);
+    qemu_mutex_unlock(&qmp_lock);
 }
 
 static void monitor_read(void *opaque, const uint8_t *buf, int size)
@@ -4619,8 +5070,7 @@ static void monitor_control_event(void *opaque, int event)
         mon_refcount++;
         break;
     case CHR_EVENT_CLOSED:
-        json_message_parser_destroy(&mon->mc->parser);
-        json_message_parser_init(&mon->mc->parser, handle_qmp_command);
+        qmp_reset(mon);
         mon_refcount--;
         monitor_fdsets_cleanup();
         break;
@@ -4721,13 +5171,17 @@ void monitor_init(CharDriverState *chr, int flags)
     }
 
     if (monitor_ctrl_mode(mon)) {
+        if (!qmp_bh) {
+            monitor_qmp_init();
+        }
         mon->mc = g_malloc0(sizeof(MonitorControl));
+        json_message_parser_init(&mon->mc->parser, qmp_parse_cb);
+
         /* Control mode requires special handlers */
-        qemu_chr_add_handlers(chr, monitor_can_read, monitor_control_read,
-                              monitor_control_event, mon);
+        qemu_chr_add_handlers(chr, monitor_control_can_read,
+                              monitor_control_read, monitor_control_event,
+                              mon);
         qemu_chr_fe_set_echo(chr, true);
-
-        json_message_parser_init(&mon->mc->parser, handle_qmp_command);
     } else {
         qemu_chr_add_handlers(chr, monitor_can_read, monitor_read,
                               monitor_event, mon);
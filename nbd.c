@@ -57,12 +57,14 @@
 
 /* This is all part of the "official" NBD API */
 
-#define NBD_REQUEST_SIZE        (4 + 4 + 8 + 8 + 4)
 #define NBD_REPLY_SIZE          (4 + 4 + 8)
+#define NBD_STRUCTURED_REPLY_SIZE (4 + 2 + 2 + 8 + 4)
 #define NBD_REQUEST_MAGIC       0x25609513
 #define NBD_REPLY_MAGIC         0x67446698
+#define NBD_STRUCTURED_REPLY_MAGIC 0x668e33ef
 #define NBD_OPTS_MAGIC          0x49484156454F5054LL
 #define NBD_CLIENT_MAGIC        0x0000420281861253LL
+#define NBD_REP_MAGIC           0x0003e889045565a9LL
 
 #define NBD_SET_SOCK            _IO(0xab, 0)
 #define NBD_SET_BLKSIZE         _IO(0xab, 1)
@@ -76,7 +78,29 @@
 #define NBD_SET_TIMEOUT         _IO(0xab, 9)
 #define NBD_SET_FLAGS           _IO(0xab, 10)
 
-#define NBD_OPT_EXPORT_NAME     (1 << 0)
+#define NBD_OPT_EXPORT_NAME     1
+#define NBD_OPT_ABORT           2
+#define NBD_OPT_INFO            6
+#define NBD_OPT_GO              7
+#define NBD_OPT_STRUCTURED_REPLY 8
+#define NBD_OPT_SET_META_CONTEXT 10
+
+#define NBD_REP_ACK             1
+#define NBD_REP_INFO            3
+#define NBD_REP_META_CONTEXT    4
+#define NBD_REP_ERR_UNSUP       ((1U << 31) | 1)
+#define NBD_REP_ERR_INVALID     ((1U << 31) | 3)
+#define NBD_REP_ERR_UNKNOWN     ((1U << 31) | 6)
+
+#define NBD_INFO_EXPORT         0
+#define NBD_INFO_BLOCK_SIZE     3
+
+/* Requests are handled in units of 512 bytes */
+#define NBD_MIN_BLOCK_SIZE      512
+#define NBD_PREFERRED_BLOCK_SIZE 4096
+
+/* The server only knows one metadata context */
+#define NBD_META_ID_BASE_ALLOCATION 1
 
 /* Definitions for opaque data types */
 
@@ -85,7 +109,8 @@ typedef struct NBDRequest NBDRequest;
 struct NBDRequest {
     QSIMPLEQ_ENTRY(NBDRequest) entry;
     NBDClient *client;
-    uint8_t *data;
+    uint8_t *buffer;    /* NBD_BUFFER_SIZE bytes, kept in the free list */
+    uint8_t *data;      /* buffer, or a larger one for this request only */
 };
 
 struct NBDExport {
@@ -97,6 +122,7 @@ struct NBDExport {
     off_t dev_offset;
     off_t size;
     uint32_t nbdflags;
+    int max_requests;
     QTAILQ_HEAD(, NBDClient) clients;
     QSIMPLEQ_HEAD(, NBDRequest) requests;
     QTAILQ_ENTRY(NBDExport) next;
@@ -109,6 +135,7 @@ struct NBDClient {
     void (*close)(NBDClient *client);
 
     NBDExport *exp;
+    AioContext *ctx;
     int sock;
 
     Coroutine *recv_coroutine;
@@ -119,6 +146,9 @@ struct NBDClient {
     QTAILQ_ENTRY(NBDClient) next;
     int nb_requests;
     bool closing;
+
+    bool structured_reply;
+    bool base_allocation;
 };
 
 /* That's all folks */
@@ -288,59 +318,333 @@ int unix_socket_outgoing(const char *path)
 
 */
 
-static int nbd_receive_options(NBDClient *client)
+static int nbd_send_rep(int csock, uint32_t opt, uint32_t type,
+                        void *data, uint32_t len)
+{
+    uint8_t buf[8 + 4 + 4 + 4];
+
+    /* Option reply:
+        [ 0 ..   7]   NBD_REP_MAGIC
+        [ 8 ..  11]   option
+        [12 ..  15]   reply type (NBD_REP_*)
+        [16 ..  19]   length
+        [20 ..  xx]   data (length bytes)
+     */
+    cpu_to_be64w((uint64_t*)buf, NBD_REP_MAGIC);
+    cpu_to_be32w((uint32_t*)(buf + 8), opt);
+    cpu_to_be32w((uint32_t*)(buf + 12), type);
+    cpu_to_be32w((uint32_t*)(buf + 16), len);
+    if (write_sync(csock, buf, sizeof(buf)) != sizeof(buf)) {
+        LOG("write failed (rep)");
+        return -EINVAL;
+    }
+    if (len && write_sync(csock, data, len) != len) {
+        LOG("write failed (rep data)");
+        return -EINVAL;
+    }
+    return 0;
+}
+
+/* Skip the rest of an option that the server does not parse */
+static int nbd_drop(int csock, uint32_t len)
+{
+    char buf[256];
+
+    while (len > 0) {
+        uint32_t n = MIN(len, sizeof(buf));
+        if (read_sync(csock, buf, n) != n) {
+            LOG("read failed");
+            return -EINVAL;
+        }
+        len -= n;
+    }
+    return 0;
+}
+
+/* Read a length-prefixed string of at most 255 bytes out of an option
+ * whose remaining length is *len.
+ */
+static int nbd_read_option_string(int csock, char *buf, uint32_t *len)
+{
+    uint32_t n;
+
+    if (*len < sizeof(n) || read_sync(csock, &n, sizeof(n)) != sizeof(n)) {
+        return -EINVAL;
+    }
+    *len -= sizeof(n);
+    n = be32_to_cpu(n);
+    if (n > 255 || n > *len || read_sync(csock, buf, n) != n) {
+        return -EINVAL;
+    }
+    *len -= n;
+    buf[n] = '\0';
+    return 0;
+}
+
+static int nbd_negotiate_meta_context(NBDClient *client, uint32_t length)
+{
+    int csock = client->sock;
+    const char *name = NBD_META_BASE_ALLOCATION;
+    uint8_t buf[4 + sizeof(NBD_META_BASE_ALLOCATION) - 1];
+    char query[256];
+    uint32_t nb_queries;
+
+    /* Client sends:
+        [ 0 ..   3]   length of the export name
+        [ 4 ..  xx]   export name
+        [xx .. +3]    number of queries
+        followed by the queries, each a 32-bit length and a string
+     */
+    if (!client->structured_reply) {
+        /* Block status is only sent as a structured reply */
+        if (nbd_drop(csock, length) < 0) {
+            return -EINVAL;
+        }
+        return nbd_send_rep(csock, NBD_OPT_SET_META_CONTEXT,
+                            NBD_REP_ERR_INVALID, NULL, 0);
+    }
+    if (nbd_read_option_string(csock, query, &length) < 0 ||
+        length < sizeof(nb_queries) ||
+        read_sync(csock, &nb_queries, sizeof(nb_queries)) !=
+            sizeof(nb_queries)) {
+        goto invalid;
+    }
+    length -= sizeof(nb_queries);
+    nb_queries = be32_to_cpu(nb_queries);
+
+    client->base_allocation = false;
+    while (nb_queries-- > 0) {
+        if (nbd_read_option_string(csock, query, &length) < 0) {
+            goto invalid;
+        }
+        if (strcmp(query, name) == 0 && !client->base_allocation) {
+            client->base_allocation = true;
+            cpu_to_be32w((uint32_t*)buf, NBD_META_ID_BASE_ALLOCATION);
+            memcpy(buf + 4, name, strlen(name));
+            if (nbd_send_rep(csock, NBD_OPT_SET_META_CONTEXT,
+                             NBD_REP_META_CONTEXT, buf, sizeof(buf)) < 0) {
+                return -EINVAL;
+            }
+        }
+    }
+    if (length != 0) {
+        goto invalid;
+    }
+    return nbd_send_rep(csock, NBD_OPT_SET_META_CONTEXT, NBD_REP_ACK,
+                        NULL, 0);
+
+invalid:
+    /* A malformed option may leave the stream out of sync, give up */
+    LOG("Bad meta context option received");
+    client->base_allocation = false;
+    nbd_send_rep(csock, NBD_OPT_SET_META_CONTEXT, NBD_REP_ERR_INVALID,
+                 NULL, 0);
+    return -EINVAL;
+}
+
+static uint16_t nbd_export_flags(NBDExport *exp)
+{
+    /* All connections to an export go through the same BlockDriverState,
+     * so a flush on any of them covers the writes completed on the others.
+     */
+    const int myflags = (NBD_FLAG_HAS_FLAGS | NBD_FLAG_SEND_TRIM |
+                         NBD_FLAG_SEND_FLUSH | NBD_FLAG_SEND_FUA |
+                         NBD_FLAG_CAN_MULTI_CONN);
+
+    assert ((exp->nbdflags & ~65535) == 0);
+    return exp->nbdflags | myflags;
+}
+
+/* Handle NBD_OPT_INFO and NBD_OPT_GO.  Returns 1 if the client selected
+ * the export with NBD_OPT_GO, 0 if the negotiation goes on.
+ */
+static int nbd_negotiate_info(NBDClient *client, uint32_t opt,
+                              uint32_t length)
 {
     int csock = client->sock;
     char name[256];
-    uint32_t tmp, length;
-    uint64_t magic;
-    int rc;
+    uint8_t buf[2 + 4 + 4 + 4];
+    uint16_t nb_requests, type;
+    NBDExport *exp;
 
     /* Client sends:
-        [ 0 ..   3]   reserved (0)
-        [ 4 ..  11]   NBD_OPTS_MAGIC
-        [12 ..  15]   NBD_OPT_EXPORT_NAME
-        [16 ..  19]   length
-        [20 ..  xx]   export name (length bytes)
+        [ 0 ..   3]   length of the export name
+        [ 4 ..  xx]   export name
+        [xx .. +1]    number of information requests
+        followed by the information types, 16 bits each
+
+       The server always sends NBD_INFO_EXPORT and NBD_INFO_BLOCK_SIZE,
+       so the requests are only checked for consistency.
      */
+    if (nbd_read_option_string(csock, name, &length) < 0 ||
+        length < sizeof(nb_requests) ||
+        read_sync(csock, &nb_requests, sizeof(nb_requests)) !=
+            sizeof(nb_requests)) {
+        LOG("Bad info option received");
+        return -EINVAL;
+    }
+    length -= sizeof(nb_requests);
+    nb_requests = be16_to_cpu(nb_requests);
+    if (length != nb_requests * sizeof(type) || nbd_drop(csock, length) < 0) {
+        LOG("Bad info option received");
+        return -EINVAL;
+    }
 
-    rc = -EINVAL;
-    if (read_sync(csock, &tmp, sizeof(tmp)) != sizeof(tmp)) {
-        LOG("read failed");
-        goto fail;
+    exp = nbd_export_find(name);
+    if (!exp) {
+        return nbd_send_rep(csock, opt, NBD_REP_ERR_UNKNOWN, NULL, 0);
     }
-    TRACE("Checking reserved");
-    if (tmp != 0) {
-        LOG("Bad reserved received");
-        goto fail;
+
+    /* Export information
+        [ 0 ..   1]   NBD_INFO_EXPORT
+        [ 2 ..   9]   size
+        [10 ..  11]   export flags
+     */
+    cpu_to_be16w((uint16_t*)buf, NBD_INFO_EXPORT);
+    cpu_to_be64w((uint64_t*)(buf + 2), exp->size);
+    cpu_to_be16w((uint16_t*)(buf + 10), nbd_export_flags(exp));
+    if (nbd_send_rep(csock, opt, NBD_REP_INFO, buf, 12) < 0) {
+        return -EINVAL;
     }
 
-    if (read_sync(csock, &magic, sizeof(magic)) != sizeof(magic)) {
-        LOG("read failed");
-        goto fail;
+    /* Block size information
+        [ 0 ..   1]   NBD_INFO_BLOCK_SIZE
+        [ 2 ..   5]   minimum block size
+        [ 6 ..   9]   preferred block size
+        [10 ..  13]   maximum payload size
+     */
+    cpu_to_be16w((uint16_t*)buf, NBD_INFO_BLOCK_SIZE);
+    cpu_to_be32w((uint32_t*)(buf + 2), NBD_MIN_BLOCK_SIZE);
+    cpu_to_be32w((uint32_t*)(buf + 6), NBD_PREFERRED_BLOCK_SIZE);
+    cpu_to_be32w((uint32_t*)(buf + 10), NBD_MAX_BUFFER_SIZE);
+    if (nbd_send_rep(csock, opt, NBD_REP_INFO, buf, 14) < 0 ||
+        nbd_send_rep(csock, opt, NBD_REP_ACK, NULL, 0) < 0) {
+        return -EINVAL;
     }
-    TRACE("Checking reserved");
-    if (magic != be64_to_cpu(NBD_OPTS_MAGIC)) {
-        LOG("Bad magic received");
-        goto fail;
+
+    if (opt == NBD_OPT_GO) {
+        client->exp = exp;
+        return 1;
     }
+    return 0;
+}
 
+static int nbd_receive_options(NBDClient *client)
+{
+    int csock = client->sock;
+    char name[256];
+    uint32_t tmp, opt, length;
+    uint64_t magic;
+    bool fixed_newstyle;
+    int rc;
+
+    /* Returns 1 if the negotiation ended with NBD_OPT_GO.
+
+       Client sends:
+        [ 0 ..   3]   client flags
+
+       followed by one or more options:
+        [ 0 ..   7]   NBD_OPTS_MAGIC
+        [ 8 ..  11]   option (NBD_OPT_EXPORT_NAME or NBD_OPT_GO ends the
+                              negotiation)
+        [12 ..  15]   length
+        [16 ..  xx]   data (length bytes)
+
+       Only clients that set NBD_FLAG_C_FIXED_NEWSTYLE may send options
+       other than NBD_OPT_EXPORT_NAME.
+     */
+
+    rc = -EINVAL;
     if (read_sync(csock, &tmp, sizeof(tmp)) != sizeof(tmp)) {
         LOG("read failed");
         goto fail;
     }
-    TRACE("Checking option");
-    if (tmp != be32_to_cpu(NBD_OPT_EXPORT_NAME)) {
-        LOG("Bad option received");
+    TRACE("Checking client flags");
+    tmp = be32_to_cpu(tmp);
+    if (tmp & ~NBD_FLAG_C_FIXED_NEWSTYLE) {
+        LOG("Bad client flags received");
         goto fail;
     }
+    fixed_newstyle = (tmp & NBD_FLAG_C_FIXED_NEWSTYLE) != 0;
 
-    if (read_sync(csock, &length, sizeof(length)) != sizeof(length)) {
-        LOG("read failed");
-        goto fail;
+    for (;;) {
+        if (read_sync(csock, &magic, sizeof(magic)) != sizeof(magic)) {
+            LOG("read failed");
+            goto fail;
+        }
+        TRACE("Checking opts magic");
+        if (magic != be64_to_cpu(NBD_OPTS_MAGIC)) {
+            LOG("Bad magic received");
+            goto fail;
+        }
+
+        if (read_sync(csock, &opt, sizeof(opt)) != sizeof(opt)) {
+            LOG("read failed");
+            goto fail;
+        }
+        opt = be32_to_cpu(opt);
+
+        if (read_sync(csock, &length, sizeof(length)) != sizeof(length)) {
+            LOG("read failed");
+            goto fail;
+        }
+        length = be32_to_cpu(length);
+
+        TRACE("Checking option %" PRIu32, opt);
+        if (opt == NBD_OPT_EXPORT_NAME) {
+            break;
+        }
+        if (!fixed_newstyle) {
+            LOG("Bad option received");
+            goto fail;
+        }
+
+        switch (opt) {
+        case NBD_OPT_INFO:
+        case NBD_OPT_GO:
+            rc = nbd_negotiate_info(client, opt, length);
+            if (rc < 0) {
+                goto fail;
+            }
+            if (rc == 1) {
+                goto found;
+            }
+            rc = -EINVAL;
+            break;
+        case NBD_OPT_STRUCTURED_REPLY:
+            if (length) {
+                if (nbd_drop(csock, length) < 0 ||
+                    nbd_send_rep(csock, opt, NBD_REP_ERR_INVALID,
+                                 NULL, 0) < 0) {
+                    goto fail;
+                }
+                break;
+            }
+            client->structured_reply = true;
+            if (nbd_send_rep(csock, opt, NBD_REP_ACK, NULL, 0) < 0) {
+                goto fail;
+            }
+            break;
+        case NBD_OPT_SET_META_CONTEXT:
+            if (nbd_negotiate_meta_context(client, length) < 0) {
+                goto fail;
+            }
+            break;
+        case NBD_OPT_ABORT:
+            nbd_drop(csock, length);
+            nbd_send_rep(csock, opt, NBD_REP_ACK, NULL, 0);
+            LOG("Client aborted negotiation");
+            goto fail;
+        default:
+            if (nbd_drop(csock, length) < 0 ||
+                nbd_send_rep(csock, opt, NBD_REP_ERR_UNSUP, NULL, 0) < 0) {
+                goto fail;
+            }
+            break;
+        }
     }
+
     TRACE("Checking length");
-    length = be32_to_cpu(length);
     if (length > 255) {
         LOG("Bad length received");
         goto fail;
@@ -356,12 +660,13 @@ static int nbd_receive_options(NBDClient *client)
         LOG("export not found");
         goto fail;
     }
+    rc = 0;
 
+found:
     QTAILQ_INSERT_TAIL(&client->exp->clients, client, next);
     nbd_export_get(client->exp);
 
     TRACE("Option negotiation succeeded.");
-    rc = 0;
 fail:
     return rc;
 }
@@ -371,8 +676,6 @@ static int nbd_send_negotiate(NBDClient *client)
     int csock = client->sock;
     char buf[8 + 8 + 8 + 128];
     int rc;
-    const int myflags = (NBD_FLAG_HAS_FLAGS | NBD_FLAG_SEND_TRIM |
-                         NBD_FLAG_SEND_FLUSH | NBD_FLAG_SEND_FUA);
 
     /* Negotiation header without options:
         [ 0 ..   7]   passwd       ("NBDMAGIC")
@@ -385,7 +688,7 @@ static int nbd_send_negotiate(NBDClient *client)
        Negotiation header with options, part 1:
         [ 0 ..   7]   passwd       ("NBDMAGIC")
         [ 8 ..  15]   magic        (NBD_OPTS_MAGIC)
-        [16 ..  17]   server flags (0)
+        [16 ..  17]   server flags (NBD_FLAG_FIXED_NEWSTYLE)
 
        part 2 (after options are sent):
         [18 ..  25]   size
@@ -403,9 +706,10 @@ static int nbd_send_negotiate(NBDClient *client)
         assert ((client->exp->nbdflags & ~65535) == 0);
         cpu_to_be64w((uint64_t*)(buf + 8), NBD_CLIENT_MAGIC);
         cpu_to_be64w((uint64_t*)(buf + 16), client->exp->size);
-        cpu_to_be16w((uint16_t*)(buf + 26), client->exp->nbdflags | myflags);
+        cpu_to_be16w((uint16_t*)(buf + 26), nbd_export_flags(client->exp));
     } else {
         cpu_to_be64w((uint64_t*)(buf + 8), NBD_OPTS_MAGIC);
+        cpu_to_be16w((uint16_t*)(buf + 16), NBD_FLAG_FIXED_NEWSTYLE);
     }
 
     if (client->exp) {
@@ -424,12 +728,16 @@ static int nbd_send_negotiate(NBDClient *client)
             goto fail;
         }
 
-        assert ((client->exp->nbdflags & ~65535) == 0);
-        cpu_to_be64w((uint64_t*)(buf + 18), client->exp->size);
-        cpu_to_be16w((uint16_t*)(buf + 26), client->exp->nbdflags | myflags);
-        if (write_sync(csock, buf + 18, sizeof(buf) - 18) != sizeof(buf) - 18) {
-            LOG("write failed");
-            goto fail;
+        /* NBD_OPT_GO already sent the size and flags */
+        if (rc == 0) {
+            rc = -EINVAL;
+            cpu_to_be64w((uint64_t*)(buf + 18), client->exp->size);
+            cpu_to_be16w((uint16_t*)(buf + 26), nbd_export_flags(client->exp));
+            if (write_sync(csock, buf + 18, sizeof(buf) - 18) !=
+                sizeof(buf) - 18) {
+                LOG("write failed");
+                goto fail;
+            }
         }
     }
 
@@ -440,8 +748,182 @@ fail:
     return rc;
 }
 
+static int nbd_send_option(int csock, uint32_t opt, void *data, uint32_t len)
+{
+    uint8_t buf[8 + 4 + 4];
+
+    cpu_to_be64w((uint64_t*)buf, NBD_OPTS_MAGIC);
+    cpu_to_be32w((uint32_t*)(buf + 8), opt);
+    cpu_to_be32w((uint32_t*)(buf + 12), len);
+    if (write_sync(csock, buf, sizeof(buf)) != sizeof(buf)) {
+        LOG("write failed (option)");
+        return -EINVAL;
+    }
+    if (len && write_sync(csock, data, len) != len) {
+        LOG("write failed (option data)");
+        return -EINVAL;
+    }
+    return 0;
+}
+
+/* Receive a reply to option @opt.  Up to @size bytes of data are stored in
+ * @data, the rest is skipped.
+ */
+static int nbd_receive_option_reply(int csock, uint32_t opt, uint32_t *type,
+                                    void *data, uint32_t *len, uint32_t size)
+{
+    uint8_t buf[8 + 4 + 4 + 4];
+
+    if (read_sync(csock, buf, sizeof(buf)) != sizeof(buf)) {
+        LOG("read failed (option reply)");
+        return -EINVAL;
+    }
+    if (be64_to_cpup((uint64_t*)buf) != NBD_REP_MAGIC ||
+        be32_to_cpup((uint32_t*)(buf + 8)) != opt) {
+        LOG("Bad option reply received");
+        return -EINVAL;
+    }
+    *type = be32_to_cpup((uint32_t*)(buf + 12));
+    *len = be32_to_cpup((uint32_t*)(buf + 16));
+    if (*len > size) {
+        if (nbd_drop(csock, *len - size) < 0) {
+            return -EINVAL;
+        }
+        *len = size;
+    }
+    if (*len && read_sync(csock, data, *len) != *len) {
+        LOG("read failed (option reply data)");
+        return -EINVAL;
+    }
+    return 0;
+}
+
+/* Ask for structured replies and for the "base:allocation" metadata
+ * context.  Servers that do not know the options just keep using simple
+ * replies.
+ */
+static int nbd_negotiate_structured_reply(int csock, const char *name,
+                                          NBDExportInfo *info)
+{
+    const char *context = NBD_META_BASE_ALLOCATION;
+    uint8_t buf[4 + 255 + 4 + 4 + sizeof(NBD_META_BASE_ALLOCATION)];
+    size_t name_len = strlen(name);
+    size_t context_len = strlen(context);
+    uint32_t type, len;
+    uint8_t *p;
+
+    if (nbd_send_option(csock, NBD_OPT_STRUCTURED_REPLY, NULL, 0) < 0 ||
+        nbd_receive_option_reply(csock, NBD_OPT_STRUCTURED_REPLY, &type,
+                                 buf, &len, sizeof(buf)) < 0) {
+        return -EINVAL;
+    }
+    if (type != NBD_REP_ACK) {
+        return 0;
+    }
+    info->structured_reply = true;
+
+    if (name_len > 255) {
+        return 0;
+    }
+    p = buf;
+    cpu_to_be32w((uint32_t*)p, name_len);
+    memcpy(p + 4, name, name_len);
+    p += 4 + name_len;
+    cpu_to_be32w((uint32_t*)p, 1);
+    cpu_to_be32w((uint32_t*)(p + 4), context_len);
+    memcpy(p + 8, context, context_len);
+    p += 8 + context_len;
+    if (nbd_send_option(csock, NBD_OPT_SET_META_CONTEXT, buf, p - buf) < 0) {
+        return -EINVAL;
+    }
+
+    for (;;) {
+        if (nbd_receive_option_reply(csock, NBD_OPT_SET_META_CONTEXT, &type,
+                                     buf, &len, sizeof(buf)) < 0) {
+            return -EINVAL;
+        }
+        if (type != NBD_REP_META_CONTEXT) {
+            break;
+        }
+        if (len == 4 + context_len && !memcmp(buf + 4, context, context_len)) {
+            info->base_allocation = true;
+            info->meta_context_id = be32_to_cpup((uint32_t*)buf);
+        }
+    }
+    if (type != NBD_REP_ACK) {
+        info->base_allocation = false;
+    }
+    return 0;
+}
+
+/* Select the export with NBD_OPT_GO, which also tells the block sizes.
+ * Returns 1 on success, 0 if the server does not know the option.
+ */
+static int nbd_opt_go(int csock, const char *name, uint32_t *flags,
+                      off_t *size, NBDExportInfo *info)
+{
+    uint8_t buf[4 + 255 + 2 + 2];
+    size_t name_len = strlen(name);
+    uint32_t type, len;
+
+    if (name_len > 255) {
+        return 0;
+    }
+    cpu_to_be32w((uint32_t*)buf, name_len);
+    memcpy(buf + 4, name, name_len);
+    cpu_to_be16w((uint16_t*)(buf + 4 + name_len), 1);
+    cpu_to_be16w((uint16_t*)(buf + 6 + name_len), NBD_INFO_BLOCK_SIZE);
+    if (nbd_send_option(csock, NBD_OPT_GO, buf, 8 + name_len) < 0) {
+        return -EINVAL;
+    }
+
+    for (;;) {
+        if (nbd_receive_option_reply(csock, NBD_OPT_GO, &type,
+                                     buf, &len, sizeof(buf)) < 0) {
+            return -EINVAL;
+        }
+        if (type == NBD_REP_ACK) {
+            break;
+        }
+        if (type == NBD_REP_ERR_UNSUP) {
+            return 0;
+        }
+        if (type != NBD_REP_INFO) {
+            LOG("export not available (error %#" PRIx32 ")", type);
+            return -EINVAL;
+        }
+        if (len < 2) {
+            return -EINVAL;
+        }
+        switch (be16_to_cpup((uint16_t*)buf)) {
+        case NBD_INFO_EXPORT:
+            if (len != 12) {
+                return -EINVAL;
+            }
+            *size = be64_to_cpup((uint64_t*)(buf + 2));
+            *flags = be16_to_cpup((uint16_t*)(buf + 10));
+            break;
+        case NBD_INFO_BLOCK_SIZE:
+            if (len != 14) {
+                return -EINVAL;
+            }
+            info->min_block = be32_to_cpup((uint32_t*)(buf + 2));
+            info->opt_block = be32_to_cpup((uint32_t*)(buf + 6));
+            info->max_block = be32_to_cpup((uint32_t*)(buf + 10));
+            break;
+        default:
+            /* Information that was not asked for */
+            break;
+        }
+    }
+    TRACE("Size is %" PRIu64 ", max payload is %" PRIu32,
+          (uint64_t)*size, info->max_block);
+    return 1;
+}
+
 int nbd_receive_negotiate(int csock, const char *name, uint32_t *flags,
-                          off_t *size, size_t *blocksize)
+                          off_t *size, size_t *blocksize,
+                          NBDExportInfo *info)
 {
     char buf[256];
     uint64_t magic, s;
@@ -486,8 +968,13 @@ int nbd_receive_negotiate(int csock, const char *name, uint32_t *flags,
     magic = be64_to_cpu(magic);
     TRACE("Magic is 0x%" PRIx64, magic);
 
+    if (info) {
+        memset(info, 0, sizeof(*info));
+    }
+
     if (name) {
-        uint32_t reserved = 0;
+        uint16_t server_flags;
+        uint32_t client_flags = 0;
         uint32_t opt;
         uint32_t namesize;
 
@@ -500,13 +987,31 @@ int nbd_receive_negotiate(int csock, const char *name, uint32_t *flags,
             LOG("flags read failed");
             goto fail;
         }
-        *flags = be16_to_cpu(tmp) << 16;
-        /* reserved for future use */
-        if (write_sync(csock, &reserved, sizeof(reserved)) !=
-            sizeof(reserved)) {
-            LOG("write failed (reserved)");
+        server_flags = be16_to_cpu(tmp);
+        if (server_flags & NBD_FLAG_FIXED_NEWSTYLE) {
+            client_flags |= NBD_FLAG_C_FIXED_NEWSTYLE;
+        }
+        client_flags = cpu_to_be32(client_flags);
+        if (write_sync(csock, &client_flags, sizeof(client_flags)) !=
+            sizeof(client_flags)) {
+            LOG("write failed (client flags)");
             goto fail;
         }
+        if (info && (server_flags & NBD_FLAG_FIXED_NEWSTYLE)) {
+            if (nbd_negotiate_structured_reply(csock, name, info) < 0) {
+                goto fail;
+            }
+            rc = nbd_opt_go(csock, name, flags, size, info);
+            if (rc < 0) {
+                rc = -EINVAL;
+                goto fail;
+            }
+            if (rc == 1) {
+                *blocksize = 1024;
+                goto done;
+            }
+            rc = -EINVAL;
+        }
         /* write the export name */
         magic = cpu_to_be64(magic);
         if (write_sync(csock, &magic, sizeof(magic)) != sizeof(magic)) {
@@ -556,12 +1061,14 @@ int nbd_receive_negotiate(int csock, const char *name, uint32_t *flags,
             LOG("read failed (tmp)");
             goto fail;
         }
-        *flags |= be32_to_cpu(tmp);
+        *flags = be16_to_cpu(tmp);
     }
     if (read_sync(csock, &buf, 124) != 124) {
         LOG("read failed (buf)");
         goto fail;
     }
+
+done:
     rc = 0;
 
 fail:
@@ -671,11 +1178,8 @@ int nbd_client(int fd)
 }
 #endif
 
-ssize_t nbd_send_request(int csock, struct nbd_request *request)
+void nbd_encode_request(uint8_t *buf, struct nbd_request *request)
 {
-    uint8_t buf[NBD_REQUEST_SIZE];
-    ssize_t ret;
-
     cpu_to_be32w((uint32_t*)buf, NBD_REQUEST_MAGIC);
     cpu_to_be32w((uint32_t*)(buf + 4), request->type);
     cpu_to_be64w((uint64_t*)(buf + 8), request->handle);
@@ -685,7 +1189,14 @@ ssize_t nbd_send_request(int csock, struct nbd_request *request)
     TRACE("Sending request to client: "
           "{ .from = %" PRIu64", .len = %u, .handle = %" PRIu64", .type=%i}",
           request->from, request->len, request->handle, request->type);
+}
 
+ssize_t nbd_send_request(int csock, struct nbd_request *request)
+{
+    uint8_t buf[NBD_REQUEST_SIZE];
+    ssize_t ret;
+
+    nbd_encode_request(buf, request);
     ret = write_sync(csock, buf, sizeof(buf));
     if (ret < 0) {
         return ret;
@@ -739,29 +1250,72 @@ static ssize_t nbd_receive_request(int csock, struct nbd_request *request)
     return 0;
 }
 
+bool nbd_reply_is_structured(struct nbd_reply *reply)
+{
+    return reply->magic == NBD_STRUCTURED_REPLY_MAGIC;
+}
+
 ssize_t nbd_receive_reply(int csock, struct nbd_reply *reply)
 {
-    uint8_t buf[NBD_REPLY_SIZE];
+    uint8_t buf[NBD_STRUCTURED_REPLY_SIZE];
     uint32_t magic;
     ssize_t ret;
 
-    ret = read_sync(csock, buf, sizeof(buf));
+    ret = read_sync(csock, buf, NBD_REPLY_SIZE);
     if (ret < 0) {
         return ret;
     }
 
-    if (ret != sizeof(buf)) {
+    if (ret != NBD_REPLY_SIZE) {
         LOG("read failed");
         return -EINVAL;
     }
 
+    magic = be32_to_cpup((uint32_t*)buf);
+    reply->magic = magic;
+
+    if (magic == NBD_STRUCTURED_REPLY_MAGIC) {
+        /* Structured reply chunk
+           [ 0 ..  3]    magic   (NBD_STRUCTURED_REPLY_MAGIC)
+           [ 4 ..  5]    flags   (NBD_REPLY_FLAG_DONE on the last chunk)
+           [ 6 ..  7]    type    (NBD_REPLY_TYPE_*)
+           [ 8 .. 15]    handle
+           [16 .. 19]    length of the payload
+         */
+
+        /* The header was sent in one piece, so the rest of it is at most
+         * a few bytes behind.
+         */
+        do {
+            ret = read_sync(csock, buf + NBD_REPLY_SIZE,
+                            NBD_STRUCTURED_REPLY_SIZE - NBD_REPLY_SIZE);
+        } while (ret == -EAGAIN);
+        if (ret < 0) {
+            return ret;
+        }
+        if (ret != NBD_STRUCTURED_REPLY_SIZE - NBD_REPLY_SIZE) {
+            LOG("read failed");
+            return -EINVAL;
+        }
+
+        reply->error  = 0;
+        reply->flags  = be16_to_cpup((uint16_t*)(buf + 4));
+        reply->type   = be16_to_cpup((uint16_t*)(buf + 6));
+        reply->handle = be64_to_cpup((uint64_t*)(buf + 8));
+        reply->length = be32_to_cpup((uint32_t*)(buf + 16));
+
+        TRACE("Got chunk: "
+              "{ .flags = %#x, .type = %d, handle = %" PRIu64", .length = %u }",
+              reply->flags, reply->type, reply->handle, reply->length);
+        return 0;
+    }
+
     /* Reply
        [ 0 ..  3]    magic   (NBD_REPLY_MAGIC)
        [ 4 ..  7]    error   (0 == no error)
        [ 7 .. 15]    handle
      */
 
-    magic = be32_to_cpup((uint32_t*)buf);
     reply->error  = be32_to_cpup((uint32_t*)(buf + 4));
     reply->handle = be64_to_cpup((uint64_t*)(buf + 8));
 
@@ -806,6 +1360,25 @@ static ssize_t nbd_send_reply(int csock, struct nbd_reply *reply)
 
 #define MAX_NBD_REQUESTS 16
 
+static void nbd_read(void *opaque);
+static void nbd_restart_write(void *opaque);
+
+/* The socket is readable when a request is being received, or when a new
+ * request can be started.  Clients are served in the AioContext of the
+ * exported BlockDriverState, which need not be the main loop's.
+ */
+static void nbd_update_fd_handler(NBDClient *client)
+{
+    bool can_read = client->recv_coroutine ||
+                    (!client->closing &&
+                     client->nb_requests < client->exp->max_requests);
+
+    aio_set_fd_handler(client->ctx, client->sock,
+                       can_read ? nbd_read : NULL,
+                       client->send_coroutine ? nbd_restart_write : NULL,
+                       NULL, client);
+}
+
 void nbd_client_get(NBDClient *client)
 {
     client->refcount++;
@@ -819,7 +1392,10 @@ void nbd_client_put(NBDClient *client)
          */
         assert(client->closing);
 
-        qemu_set_fd_handler2(client->sock, NULL, NULL, NULL, NULL);
+        if (client->ctx) {
+            aio_set_fd_handler(client->ctx, client->sock,
+                               NULL, NULL, NULL, NULL);
+        }
         close(client->sock);
         client->sock = -1;
         if (client->exp) {
@@ -837,6 +1413,7 @@ void nbd_client_close(NBDClient *client)
     }
 
     client->closing = true;
+    nbd_update_fd_handler(client);
 
     /* Force requests to finish.  They will drop their own references,
      * then we'll close the socket and free the NBDClient.
@@ -854,27 +1431,34 @@ static NBDRequest *nbd_request_get(NBDClient *client)
     NBDRequest *req;
     NBDExport *exp = client->exp;
 
-    assert(client->nb_requests <= MAX_NBD_REQUESTS - 1);
-    client->nb_requests++;
+    assert(client->nb_requests <= exp->max_requests - 1);
+    if (++client->nb_requests == exp->max_requests) {
+        nbd_update_fd_handler(client);
+    }
 
     if (QSIMPLEQ_EMPTY(&exp->requests)) {
         req = g_malloc0(sizeof(NBDRequest));
-        req->data = qemu_blockalign(exp->bs, NBD_BUFFER_SIZE);
+        req->buffer = qemu_blockalign(exp->bs, NBD_BUFFER_SIZE);
     } else {
         req = QSIMPLEQ_FIRST(&exp->requests);
         QSIMPLEQ_REMOVE_HEAD(&exp->requests, entry);
     }
     nbd_client_get(client);
     req->client = client;
+    req->data = req->buffer;
     return req;
 }
 
 static void nbd_request_put(NBDRequest *req)
 {
     NBDClient *client = req->client;
+
+    if (req->data != req->buffer) {
+        qemu_vfree(req->data);
+    }
     QSIMPLEQ_INSERT_HEAD(&client->exp->requests, req, entry);
-    if (client->nb_requests-- == MAX_NBD_REQUESTS) {
-        qemu_notify_event();
+    if (client->nb_requests-- == client->exp->max_requests) {
+        nbd_update_fd_handler(client);
     }
     nbd_client_put(client);
 }
@@ -890,11 +1474,21 @@ NBDExport *nbd_export_new(BlockDriverState *bs, off_t dev_offset,
     exp->bs = bs;
     exp->dev_offset = dev_offset;
     exp->nbdflags = nbdflags;
+    exp->max_requests = MAX_NBD_REQUESTS;
     exp->size = size == -1 ? bdrv_getlength(bs) : size;
     exp->close = close;
     return exp;
 }
 
+/* Set how many requests each client can have in flight.  Replies are sent
+ * as soon as each request completes, so they can go out of order.
+ */
+void nbd_export_set_max_requests(NBDExport *exp, int max_requests)
+{
+    assert(max_requests > 0);
+    exp->max_requests = max_requests;
+}
+
 NBDExport *nbd_export_find(const char *name)
 {
     NBDExport *exp;
@@ -963,7 +1557,7 @@ void nbd_export_put(NBDExport *exp)
         while (!QSIMPLEQ_EMPTY(&exp->requests)) {
             NBDRequest *first = QSIMPLEQ_FIRST(&exp->requests);
             QSIMPLEQ_REMOVE_HEAD(&exp->requests, entry);
-            qemu_vfree(first->data);
+            qemu_vfree(first->buffer);
             g_free(first);
         }
 
@@ -985,10 +1579,6 @@ void nbd_export_close_all(void)
     }
 }
 
-static int nbd_can_read(void *opaque);
-static void nbd_read(void *opaque);
-static void nbd_restart_write(void *opaque);
-
 static ssize_t nbd_co_send_reply(NBDRequest *req, struct nbd_reply *reply,
                                  int len)
 {
@@ -997,9 +1587,8 @@ static ssize_t nbd_co_send_reply(NBDRequest *req, struct nbd_reply *reply,
     ssize_t rc, ret;
 
     qemu_co_mutex_lock(&client->send_lock);
-    qemu_set_fd_handler2(csock, nbd_can_read, nbd_read,
-                         nbd_restart_write, client);
     client->send_coroutine = qemu_coroutine_self();
+    nbd_update_fd_handler(client);
 
     if (!len) {
         rc = nbd_send_reply(csock, reply);
@@ -1016,11 +1605,199 @@ static ssize_t nbd_co_send_reply(NBDRequest *req, struct nbd_reply *reply,
     }
 
     client->send_coroutine = NULL;
-    qemu_set_fd_handler2(csock, nbd_can_read, nbd_read, NULL, client);
+    nbd_update_fd_handler(client);
+    qemu_co_mutex_unlock(&client->send_lock);
+    return rc;
+}
+
+static ssize_t nbd_co_send_chunk(NBDRequest *req, uint64_t handle,
+                                 uint16_t flags, uint16_t type,
+                                 void *payload, int payload_len,
+                                 void *data, int data_len)
+{
+    NBDClient *client = req->client;
+    int csock = client->sock;
+    uint8_t buf[NBD_STRUCTURED_REPLY_SIZE];
+    struct iovec iov[] = {
+        { .iov_base = buf, .iov_len = sizeof(buf) },
+        { .iov_base = payload, .iov_len = payload_len },
+        { .iov_base = data, .iov_len = data_len },
+    };
+    size_t len = sizeof(buf) + payload_len + data_len;
+    ssize_t rc = 0;
+
+    /* Structured reply chunk
+       [ 0 ..  3]    magic   (NBD_STRUCTURED_REPLY_MAGIC)
+       [ 4 ..  5]    flags   (NBD_REPLY_FLAG_DONE on the last chunk)
+       [ 6 ..  7]    type    (NBD_REPLY_TYPE_*)
+       [ 8 .. 15]    handle
+       [16 .. 19]    length of the payload
+     */
+    cpu_to_be32w((uint32_t*)buf, NBD_STRUCTURED_REPLY_MAGIC);
+    cpu_to_be16w((uint16_t*)(buf + 4), flags);
+    cpu_to_be16w((uint16_t*)(buf + 6), type);
+    cpu_to_be64w((uint64_t*)(buf + 8), handle);
+    cpu_to_be32w((uint32_t*)(buf + 16), payload_len + data_len);
+
+    TRACE("Sending chunk to client: { .flags = %#x, .type = %d, .len = %d }",
+          flags, type, payload_len + data_len);
+
+    qemu_co_mutex_lock(&client->send_lock);
+    client->send_coroutine = qemu_coroutine_self();
+    nbd_update_fd_handler(client);
+
+    if (qemu_co_sendv(csock, iov, ARRAY_SIZE(iov), 0, len) != len) {
+        rc = -EIO;
+    }
+
+    client->send_coroutine = NULL;
+    nbd_update_fd_handler(client);
     qemu_co_mutex_unlock(&client->send_lock);
     return rc;
 }
 
+static ssize_t nbd_co_send_error_chunk(NBDRequest *req, uint64_t handle,
+                                       int error)
+{
+    uint8_t payload[4 + 2];
+
+    /* Error chunk payload
+       [ 0 ..  3]    error
+       [ 4 ..  5]    length of the message (0)
+     */
+    cpu_to_be32w((uint32_t*)payload, error);
+    cpu_to_be16w((uint16_t*)(payload + 4), 0);
+    return nbd_co_send_chunk(req, handle, NBD_REPLY_FLAG_DONE,
+                             NBD_REPLY_TYPE_ERROR, payload, sizeof(payload),
+                             NULL, 0);
+}
+
+/* Reply to NBD_CMD_READ with structured reply chunks.  Ranges that read
+ * as zeroes are neither read nor sent; they go out as hole chunks.  Only
+ * failures to send make this function return an error.
+ */
+static ssize_t nbd_co_send_sparse_read(NBDRequest *req,
+                                       struct nbd_request *request)
+{
+    NBDExport *exp = req->client->exp;
+    int64_t sector_num = (request->from + exp->dev_offset) / 512;
+    int nb_sectors = request->len / 512;
+    uint64_t offset = request->from;
+    uint8_t payload[8 + 4];
+    int64_t status;
+    uint16_t flags;
+    int pnum;
+    ssize_t ret;
+
+    if (nb_sectors == 0) {
+        return nbd_co_send_chunk(req, request->handle, NBD_REPLY_FLAG_DONE,
+                                 NBD_REPLY_TYPE_NONE, NULL, 0, NULL, 0);
+    }
+
+    while (nb_sectors > 0) {
+        status = bdrv_co_get_block_status(exp->bs, sector_num, nb_sectors,
+                                          &pnum);
+        if (status < 0) {
+            LOG("reading block status failed");
+            return nbd_co_send_error_chunk(req, request->handle, -status);
+        }
+        if (pnum <= 0) {
+            status = BDRV_BLOCK_DATA;
+            pnum = nb_sectors;
+        }
+
+        flags = pnum == nb_sectors ? NBD_REPLY_FLAG_DONE : 0;
+        cpu_to_be64w((uint64_t*)payload, offset);
+        if (status & BDRV_BLOCK_ZERO) {
+            TRACE("Sending hole of %d sector(s)", pnum);
+            cpu_to_be32w((uint32_t*)(payload + 8), pnum * 512);
+            ret = nbd_co_send_chunk(req, request->handle, flags,
+                                    NBD_REPLY_TYPE_OFFSET_HOLE,
+                                    payload, 12, NULL, 0);
+        } else {
+            ret = bdrv_read(exp->bs, sector_num, req->data, pnum);
+            if (ret < 0) {
+                LOG("reading from file failed");
+                return nbd_co_send_error_chunk(req, request->handle, -ret);
+            }
+            ret = nbd_co_send_chunk(req, request->handle, flags,
+                                    NBD_REPLY_TYPE_OFFSET_DATA,
+                                    payload, 8, req->data, pnum * 512);
+        }
+        if (ret < 0) {
+            return ret;
+        }
+
+        sector_num += pnum;
+        nb_sectors -= pnum;
+        offset += pnum * 512;
+    }
+    return 0;
+}
+
+/* Reply to NBD_CMD_BLOCK_STATUS with the "base:allocation" context: holes
+ * are ranges that are both unallocated and read as zeroes.  The extents
+ * may cover less than the request if there are too many of them.
+ */
+static ssize_t nbd_co_send_block_status(NBDRequest *req,
+                                        struct nbd_request *request)
+{
+    NBDExport *exp = req->client->exp;
+    int64_t sector_num = (request->from + exp->dev_offset) / 512;
+    int nb_sectors = request->len / 512;
+    uint32_t *extents = (uint32_t *)req->data;
+    int max_extents = (NBD_BUFFER_SIZE - 4) / 8;
+    int nb_extents = 0;
+    uint32_t length, flags;
+    int64_t status;
+    int pnum;
+
+    /* Block status payload
+       [ 0 ..  3]    metadata context id
+       followed by extents, each a 32-bit length and 32-bit flags
+     */
+    cpu_to_be32w(&extents[0], NBD_META_ID_BASE_ALLOCATION);
+    while (nb_sectors > 0) {
+        status = bdrv_co_get_block_status(exp->bs, sector_num, nb_sectors,
+                                          &pnum);
+        if (status < 0) {
+            LOG("reading block status failed");
+            return nbd_co_send_error_chunk(req, request->handle, -status);
+        }
+        if (pnum <= 0) {
+            status = BDRV_BLOCK_DATA;
+            pnum = nb_sectors;
+        }
+
+        flags = 0;
+        if (status & BDRV_BLOCK_ZERO) {
+            flags |= NBD_STATE_ZERO;
+            if (!(status & BDRV_BLOCK_DATA)) {
+                flags |= NBD_STATE_HOLE;
+            }
+        }
+
+        length = pnum * 512;
+        if (nb_extents > 0 &&
+            be32_to_cpu(extents[2 * nb_extents]) == flags) {
+            length += be32_to_cpu(extents[2 * nb_extents - 1]);
+            nb_extents--;
+        } else if (nb_extents == max_extents) {
+            break;
+        }
+        nb_extents++;
+        cpu_to_be32w(&extents[2 * nb_extents - 1], length);
+        cpu_to_be32w(&extents[2 * nb_extents], flags);
+
+        sector_num += pnum;
+        nb_sectors -= pnum;
+    }
+
+    return nbd_co_send_chunk(req, request->handle, NBD_REPLY_FLAG_DONE,
+                             NBD_REPLY_TYPE_BLOCK_STATUS,
+                             req->data, 4 + 8 * nb_extents, NULL, 0);
+}
+
 static ssize_t nbd_co_receive_request(NBDRequest *req, struct nbd_request *request)
 {
     NBDClient *client = req->client;
@@ -1028,6 +1805,7 @@ static ssize_t nbd_co_receive_request(NBDRequest *req, struct nbd_request *reque
     ssize_t rc;
 
     client->recv_coroutine = qemu_coroutine_self();
+    nbd_update_fd_handler(client);
     rc = nbd_receive_request(csock, request);
     if (rc < 0) {
         if (rc != -EAGAIN) {
@@ -1036,9 +1814,11 @@ static ssize_t nbd_co_receive_request(NBDRequest *req, struct nbd_request *reque
         goto out;
     }
 
-    if (request->len > NBD_BUFFER_SIZE) {
+    /* Block status replies do not carry data, only extents */
+    if (request->len > NBD_MAX_BUFFER_SIZE &&
+        (request->type & NBD_CMD_MASK_COMMAND) != NBD_CMD_BLOCK_STATUS) {
         LOG("len (%u) is larger than max len (%u)",
-            request->len, NBD_BUFFER_SIZE);
+            request->len, NBD_MAX_BUFFER_SIZE);
         rc = -EINVAL;
         goto out;
     }
@@ -1052,6 +1832,12 @@ static ssize_t nbd_co_receive_request(NBDRequest *req, struct nbd_request *reque
 
     TRACE("Decoding type");
 
+    if (request->len > NBD_BUFFER_SIZE &&
+        ((request->type & NBD_CMD_MASK_COMMAND) == NBD_CMD_READ ||
+         (request->type & NBD_CMD_MASK_COMMAND) == NBD_CMD_WRITE)) {
+        req->data = qemu_blockalign(client->exp->bs, request->len);
+    }
+
     if ((request->type & NBD_CMD_MASK_COMMAND) == NBD_CMD_WRITE) {
         TRACE("Reading %u byte(s)", request->len);
 
@@ -1065,6 +1851,7 @@ static ssize_t nbd_co_receive_request(NBDRequest *req, struct nbd_request *reque
 
 out:
     client->recv_coroutine = NULL;
+    nbd_update_fd_handler(client);
     return rc;
 }
 
@@ -1121,6 +1908,13 @@ static void nbd_trip(void *opaque)
             }
         }
 
+        if (client->structured_reply) {
+            if (nbd_co_send_sparse_read(req, &request) < 0) {
+                goto out;
+            }
+            break;
+        }
+
         ret = bdrv_read(exp->bs, (request.from + exp->dev_offset) / 512,
                         req->data, request.len / 512);
         if (ret < 0) {
@@ -1193,11 +1987,30 @@ static void nbd_trip(void *opaque)
             goto out;
         }
         break;
+    case NBD_CMD_BLOCK_STATUS:
+        TRACE("Request type is BLOCK_STATUS");
+        if (!client->base_allocation) {
+            goto invalid_request;
+        }
+        if (nbd_co_send_block_status(req, &request) < 0) {
+            goto out;
+        }
+        break;
     default:
         LOG("invalid request type (%u) received", request.type);
     invalid_request:
         reply.error = -EINVAL;
     error_reply:
+        /* Reads must not get a simple reply once structured replies are
+         * negotiated.
+         */
+        if (client->structured_reply &&
+            (request.type & NBD_CMD_MASK_COMMAND) == NBD_CMD_READ) {
+            if (nbd_co_send_error_chunk(req, reply.handle, reply.error) < 0) {
+                goto out;
+            }
+            break;
+        }
         if (nbd_co_send_reply(req, &reply, 0) < 0) {
             goto out;
         }
@@ -1215,13 +2028,6 @@ out:
     nbd_client_close(client);
 }
 
-static int nbd_can_read(void *opaque)
-{
-    NBDClient *client = opaque;
-
-    return client->recv_coroutine || client->nb_requests < MAX_NBD_REQUESTS;
-}
-
 static void nbd_read(void *opaque)
 {
     NBDClient *client = opaque;
@@ -1253,8 +2059,9 @@ NBDClient *nbd_client_new(NBDExport *exp, int csock,
         return NULL;
     }
     client->close = close;
+    client->ctx = bdrv_get_aio_context(client->exp->bs);
     qemu_co_mutex_init(&client->send_lock);
-    qemu_set_fd_handler2(csock, nbd_can_read, nbd_read, NULL, client);
+    nbd_update_fd_handler(client);
 
     if (exp) {
         QTAILQ_INSERT_TAIL(&exp->clients, client, next);
@@ -15,21 +15,32 @@
  *  along with this program; if not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <string.h>
+#include <glib.h>
+#include "qemu/osdep.h"
 #include "net/checksum.h"
 
 #define PROTO_TCP  6
 #define PROTO_UDP 17
 
+#define ETH_P_IP    0x0800
+#define ETH_P_IPV6  0x86dd
+#define ETH_P_VLAN  0x8100
+
+#define TCP_FLAG_FIN 0x01
+#define TCP_FLAG_PSH 0x08
+#define TCP_FLAG_CWR 0x80
+
 uint32_t net_checksum_add(int len, uint8_t *buf)
 {
     uint32_t sum = 0;
     int i;
 
-    for (i = 0; i < len; i++) {
-	if (i & 1)
-	    sum += (uint32_t)buf[i];
-	else
-	    sum += (uint32_t)buf[i] << 8;
+    for (i = 0; i + 1 < len; i += 2) {
+        sum += (uint32_t)buf[i] << 8 | buf[i + 1];
+    }
+    if (len & 1) {
+        sum += (uint32_t)buf[len - 1] << 8;
     }
     return sum;
 }
@@ -83,3 +94,132 @@ void net_checksum_calculate(uint8_t *data, int length)
     data[14+hlen+csum_offset]   = csum >> 8;
     data[14+hlen+csum_offset+1] = csum & 0xff;
 }
+
+/* Fill in a checksum the sender left to the device (virtio's NEEDS_CSUM):
+ * the 16 bit field at csum_start + csum_offset holds the pseudo header sum,
+ * everything from csum_start to the end of the frame is covered.
+ */
+void net_checksum_complete(uint8_t *data, int length,
+                           int csum_start, int csum_offset)
+{
+    uint16_t csum;
+
+    if (csum_start < 0 || csum_offset < 0 ||
+        csum_start + csum_offset + 2 > length) {
+        return;
+    }
+
+    csum = net_checksum_finish(net_checksum_add(length - csum_start,
+                                                data + csum_start));
+    data[csum_start + csum_offset]     = csum >> 8;
+    data[csum_start + csum_offset + 1] = csum & 0xff;
+}
+
+/* Cut a TCP/IP frame into frames with at most mss bytes of payload each and
+ * pass them to output.  IPv4 lengths, ids and header checksums, the IPv6
+ * payload length, TCP sequence numbers, flags and checksums are fixed up.
+ *
+ * Returns the number of frames produced, or -1 if the frame is not TCP
+ * over IPv4 or over IPv6 without extension headers.
+ */
+int net_tso_segment(const uint8_t *data, int length, int mss,
+                    NetSegmentOutput *output, void *opaque)
+{
+    int l3, l4, hdrlen, payload, off, n, count = 0;
+    int proto, ipv6;
+    uint32_t seq, sum;
+    uint16_t ip_id = 0, csum;
+    uint8_t *seg, *ip, *tcp;
+
+    if (length < 14 || mss <= 0) {
+        return -1;
+    }
+    l3 = 14;
+    proto = data[12] << 8 | data[13];
+    if (proto == ETH_P_VLAN) {
+        if (length < 18) {
+            return -1;
+        }
+        l3 = 18;
+        proto = data[16] << 8 | data[17];
+    }
+
+    if (proto == ETH_P_IP) {
+        if (length < l3 + 20 || (data[l3] & 0xf0) != 0x40 ||
+            data[l3 + 9] != PROTO_TCP) {
+            return -1;
+        }
+        ipv6 = 0;
+        l4 = l3 + (data[l3] & 0x0f) * 4;
+        ip_id = data[l3 + 4] << 8 | data[l3 + 5];
+    } else if (proto == ETH_P_IPV6) {
+        if (length < l3 + 40 || data[l3 + 6] != PROTO_TCP) {
+            return -1;
+        }
+        ipv6 = 1;
+        l4 = l3 + 40;
+    } else {
+        return -1;
+    }
+    if (length < l4 + 20) {
+        return -1;
+    }
+    hdrlen = l4 + (data[l4 + 12] >> 4) * 4;
+    if (hdrlen < l4 + 20 || hdrlen > length) {
+        return -1;
+    }
+
+    payload = length - hdrlen;
+    seq = (uint32_t)data[l4 + 4] << 24 | data[l4 + 5] << 16 |
+          data[l4 + 6] << 8 | data[l4 + 7];
+    seg = g_malloc(hdrlen + MIN(mss, payload));
+    ip = seg + l3;
+    tcp = seg + l4;
+
+    off = 0;
+    do {
+        n = MIN(mss, payload - off);
+        memcpy(seg, data, hdrlen);
+        memcpy(seg + hdrlen, data + hdrlen + off, n);
+
+        if (ipv6) {
+            ip[4] = (hdrlen - l4 + n) >> 8;
+            ip[5] = (hdrlen - l4 + n) & 0xff;
+        } else {
+            ip[2] = (hdrlen - l3 + n) >> 8;
+            ip[3] = (hdrlen - l3 + n) & 0xff;
+            ip[4] = (ip_id + count) >> 8;
+            ip[5] = (ip_id + count) & 0xff;
+            ip[10] = ip[11] = 0;
+            csum = net_checksum_finish(net_checksum_add(l4 - l3, ip));
+            ip[10] = csum >> 8;
+            ip[11] = csum & 0xff;
+        }
+
+        tcp[4] = (seq + off) >> 24;
+        tcp[5] = (seq + off) >> 16;
+        tcp[6] = (seq + off) >> 8;
+        tcp[7] = (seq + off);
+        if (off + n < payload) {
+            tcp[13] &= ~(TCP_FLAG_FIN | TCP_FLAG_PSH);
+        }
+        if (off > 0) {
+            tcp[13] &= ~TCP_FLAG_CWR;
+        }
+
+        tcp[16] = tcp[17] = 0;
+        sum = net_checksum_add(hdrlen - l4 + n, tcp);
+        sum += net_checksum_add(ipv6 ? 32 : 8, ipv6 ? ip + 8 : ip + 12);
+        sum += PROTO_TCP + hdrlen - l4 + n;
+        csum = net_checksum_finish(sum);
+        tcp[16] = csum >> 8;
+        tcp[17] = csum & 0xff;
+
+        output(opaque, seg, hdrlen + n);
+        count++;
+        off += n;
+    } while (off < payload);
+
+    g_free(seg);
+    return count;
+}
@@ -17,62 +17,125 @@
 #include "clients.h"
 #include "hub.h"
 #include "qemu/iov.h"
+#include "qemu/timer.h"
 
 /*
  * A hub broadcasts incoming packets to all its ports except the source port.
  * Hubs can be used to provide independent network segments, also confusingly
  * named the QEMU 'vlan' feature.
+ *
+ * A learning hub remembers the port behind each source MAC address, like a
+ * switch, and forwards unicast frames for a known address to that port only.
  */
 
+#define NET_HUB_FDB_SIZE    256         /* direct mapped, power of two */
+#define NET_HUB_FDB_AGE_MS  300000      /* same as the Linux bridge */
+
 typedef struct NetHub NetHub;
+typedef struct NetHubPort NetHubPort;
 
-typedef struct NetHubPort {
+typedef struct NetHubFdbEntry {
+    uint8_t mac[6];
+    NetHubPort *port;
+    int64_t last_seen;
+} NetHubFdbEntry;
+
+struct NetHubPort {
     NetClientState nc;
     QLIST_ENTRY(NetHubPort) next;
     NetHub *hub;
     int id;
-} NetHubPort;
+};
 
 struct NetHub {
     int id;
     QLIST_ENTRY(NetHub) next;
     int num_ports;
     QLIST_HEAD(, NetHubPort) ports;
+    bool learning;
+    NetHubFdbEntry *fdb;
 };
 
 static QLIST_HEAD(, NetHub) hubs = QLIST_HEAD_INITIALIZER(&hubs);
 
-static ssize_t net_hub_receive(NetHub *hub, NetHubPort *source_port,
-                               const uint8_t *buf, size_t len)
+static NetHubFdbEntry *net_hub_fdb_entry(NetHub *hub, const uint8_t *mac)
 {
-    NetHubPort *port;
+    unsigned int h = mac[5] ^ (mac[4] << 3) ^ (mac[3] << 5);
 
-    QLIST_FOREACH(port, &hub->ports, next) {
-        if (port == source_port) {
-            continue;
-        }
+    return &hub->fdb[h & (NET_HUB_FDB_SIZE - 1)];
+}
 
-        qemu_send_packet(&port->nc, buf, len);
+/* Return the only port that should see the frame, or NULL to flood it */
+static NetHubPort *net_hub_fdb_update(NetHub *hub, NetHubPort *source_port,
+                                      const uint8_t *eth)
+{
+    const uint8_t *dst = eth, *src = eth + 6;
+    int64_t now = qemu_get_clock_ms(rt_clock);
+    NetHubFdbEntry *e;
+
+    if (!(src[0] & 1)) {
+        e = net_hub_fdb_entry(hub, src);
+        memcpy(e->mac, src, 6);
+        e->port = source_port;
+        e->last_seen = now;
     }
-    return len;
+
+    if (dst[0] & 1) {
+        return NULL;
+    }
+    e = net_hub_fdb_entry(hub, dst);
+    if (!e->port || memcmp(e->mac, dst, 6) ||
+        now - e->last_seen > NET_HUB_FDB_AGE_MS) {
+        return NULL;
+    }
+    return e->port;
 }
 
 static ssize_t net_hub_receive_iov(NetHub *hub, NetHubPort *source_port,
                                    const struct iovec *iov, int iovcnt)
 {
-    NetHubPort *port;
+    NetHubPort *port, *dest = NULL;
     ssize_t len = iov_size(iov, iovcnt);
+    NetSharedBuf *shared = NULL;
+    uint8_t eth[12];
+
+    if (hub->learning && iov_to_buf(iov, iovcnt, 0, eth, sizeof(eth)) ==
+        sizeof(eth)) {
+        dest = net_hub_fdb_update(hub, source_port, eth);
+        if (dest == source_port) {
+            /* The destination is on the segment the frame came from */
+            return len;
+        }
+    }
 
+    if (dest) {
+        qemu_sendv_packet(&dest->nc, iov, iovcnt);
+        return len;
+    }
+
+    /* Ports that cannot take the frame right now all queue the same copy */
     QLIST_FOREACH(port, &hub->ports, next) {
         if (port == source_port) {
             continue;
         }
 
-        qemu_sendv_packet(&port->nc, iov, iovcnt);
+        qemu_sendv_packet_shared(&port->nc, iov, iovcnt, &shared);
     }
+    qemu_net_shared_buf_unref(shared);
     return len;
 }
 
+static ssize_t net_hub_receive(NetHub *hub, NetHubPort *source_port,
+                               const uint8_t *buf, size_t len)
+{
+    struct iovec iov = {
+        .iov_base = (uint8_t *)buf,
+        .iov_len = len,
+    };
+
+    return net_hub_receive_iov(hub, source_port, &iov, 1);
+}
+
 static NetHub *net_hub_new(int id)
 {
     NetHub *hub;
@@ -81,6 +144,8 @@ static NetHub *net_hub_new(int id)
     hub->id = id;
     hub->num_ports = 0;
     QLIST_INIT(&hub->ports);
+    hub->learning = false;
+    hub->fdb = NULL;
 
     QLIST_INSERT_HEAD(&hubs, hub, next);
 
@@ -125,10 +190,27 @@ static ssize_t net_hub_port_receive_iov(NetClientState *nc,
 static void net_hub_port_cleanup(NetClientState *nc)
 {
     NetHubPort *port = DO_UPCAST(NetHubPort, nc, nc);
+    NetHub *hub = port->hub;
+    int i;
 
+    if (hub->fdb) {
+        for (i = 0; i < NET_HUB_FDB_SIZE; i++) {
+            if (hub->fdb[i].port == port) {
+                hub->fdb[i].port = NULL;
+            }
+        }
+    }
     QLIST_REMOVE(port, next);
 }
 
+static void net_hub_set_learning(NetHub *hub)
+{
+    if (!hub->learning) {
+        hub->fdb = g_new0(NetHubFdbEntry, NET_HUB_FDB_SIZE);
+        hub->learning = true;
+    }
+}
+
 static NetClientInfo net_hub_port_info = {
     .type = NET_CLIENT_OPTIONS_KIND_HUBPORT,
     .size = sizeof(NetHubPort),
@@ -243,7 +325,8 @@ void net_hub_info(Monitor *mon)
     NetHubPort *port;
 
     QLIST_FOREACH(hub, &hubs, next) {
-        monitor_printf(mon, "hub %d\n", hub->id);
+        monitor_printf(mon, "hub %d%s\n", hub->id,
+                       hub->learning ? " (learning)" : "");
         QLIST_FOREACH(port, &hub->ports, next) {
             if (port->nc.peer) {
                 monitor_printf(mon, " \\ ");
@@ -281,6 +364,7 @@ int net_init_hubport(const NetClientOptions *opts, const char *name,
                      NetClientState *peer)
 {
     const NetdevHubPortOptions *hubport;
+    NetClientState *nc;
 
     assert(opts->kind == NET_CLIENT_OPTIONS_KIND_HUBPORT);
     hubport = opts->hubport;
@@ -290,7 +374,10 @@ int net_init_hubport(const NetClientOptions *opts, const char *name,
         return -EINVAL;
     }
 
-    net_hub_add_port(hubport->hubid, name);
+    nc = net_hub_add_port(hubport->hubid, name);
+    if (hubport->has_learning && hubport->learning) {
+        net_hub_set_learning(DO_UPCAST(NetHubPort, nc, nc)->hub);
+    }
     return 0;
 }
 
@@ -32,6 +32,7 @@
 #include "monitor/monitor.h"
 #include "qemu-common.h"
 #include "qemu/sockets.h"
+#include "qemu/main-loop.h"
 #include "qemu/config-file.h"
 #include "qmp-commands.h"
 #include "hw/qdev.h"
@@ -338,6 +339,9 @@ void qemu_del_net_client(NetClientState *nc)
 
         for (i = 0; i < queues; i++) {
             qemu_cleanup_net_client(ncs[i]);
+            /* Nothing will deliver what the NIC queued here any more, and
+             * it may be holding guest buffers for those packets */
+            qemu_net_queue_purge(ncs[i]->send_queue, ncs[i]->peer);
         }
 
         return;
@@ -428,6 +432,63 @@ ssize_t qemu_deliver_packet(NetClientState *sender,
     return ret;
 }
 
+/* Bracket packets that a backend sends back to back.  The receiver may
+ * postpone per-packet work, such as interrupting the guest, until the end
+ * of the batch.
+ */
+void qemu_send_batch_begin(NetClientState *nc)
+{
+    NetClientState *peer = nc->peer;
+
+    if (peer && peer->info->receive_batch) {
+        peer->info->receive_batch(peer, true);
+    }
+}
+
+void qemu_send_batch_end(NetClientState *nc)
+{
+    NetClientState *peer = nc->peer;
+
+    if (peer && peer->info->receive_batch) {
+        peer->info->receive_batch(peer, false);
+    }
+}
+
+/* Zero-copy receive: a backend that has a packet to send may ask its peer
+ * for the buffers the packet will end up in, read it straight into them and
+ * then hand it over with qemu_peer_rx_commit(), which takes the place of
+ * qemu_send_packet().  The buffers must hold the packet just as receive()
+ * would get it; if the returned space is not enough, the backend adds
+ * buffers of its own at the end of @iov for the rest.
+ *
+ * Returns the number of iovecs filled in, 0 if the packet must be sent the
+ * usual way: only a NIC connected directly, with nothing queued for it,
+ * supports this.
+ */
+int qemu_peer_rx_map(NetClientState *nc, struct iovec *iov, int iovcnt)
+{
+    NetClientState *peer = nc->peer;
+
+    if (nc->link_down || !peer || !peer->info->rx_map ||
+        peer->link_down || peer->receive_disabled ||
+        !qemu_net_queue_empty(peer->send_queue)) {
+        return 0;
+    }
+    return peer->info->rx_map(peer, iov, iovcnt);
+}
+
+/* Deliver the @size bytes read into @iov, which starts with the iovecs
+ * that qemu_peer_rx_map() returned.  Like receive(), returns 0 if the peer
+ * has no room for the packet after all; the backend then sends it the
+ * usual way, so that it is queued. */
+ssize_t qemu_peer_rx_commit(NetClientState *nc, const struct iovec *iov,
+                            int iovcnt, size_t size)
+{
+    NetClientState *peer = nc->peer;
+
+    return peer->info->rx_commit(peer, iov, iovcnt, size);
+}
+
 void qemu_purge_queued_packets(NetClientState *nc)
 {
     if (!nc->peer) {
@@ -553,6 +614,26 @@ qemu_sendv_packet(NetClientState *nc, const struct iovec *iov, int iovcnt)
     return qemu_sendv_packet_async(nc, iov, iovcnt, NULL);
 }
 
+/* For senders that pass one packet to several clients, see
+ * qemu_net_queue_send_shared()
+ */
+ssize_t qemu_sendv_packet_shared(NetClientState *sender,
+                                 const struct iovec *iov, int iovcnt,
+                                 NetSharedBuf **shared)
+{
+    NetQueue *queue;
+
+    if (sender->link_down || !sender->peer) {
+        return iov_size(iov, iovcnt);
+    }
+
+    queue = sender->peer->send_queue;
+
+    return qemu_net_queue_send_shared(queue, sender,
+                                      QEMU_NET_PACKET_FLAG_NONE,
+                                      iov, iovcnt, shared);
+}
+
 NetClientState *qemu_find_netdev(const char *id)
 {
     NetClientState *nc;
@@ -723,6 +804,9 @@ static int (* const net_client_init_fun[NET_CLIENT_OPTIONS_KIND_MAX])(
         [NET_CLIENT_OPTIONS_KIND_BRIDGE]    = net_init_bridge,
 #endif
         [NET_CLIENT_OPTIONS_KIND_HUBPORT]   = net_init_hubport,
+#ifdef CONFIG_POSIX
+        [NET_CLIENT_OPTIONS_KIND_VHOST_USER] = net_init_vhost_user,
+#endif
 };
 
 
@@ -753,6 +837,9 @@ static int net_client_init1(const void *object, int is_netdev, Error **errp)
         case NET_CLIENT_OPTIONS_KIND_BRIDGE:
 #endif
         case NET_CLIENT_OPTIONS_KIND_HUBPORT:
+#ifdef CONFIG_POSIX
+        case NET_CLIENT_OPTIONS_KIND_VHOST_USER:
+#endif
             break;
 
         default:
@@ -769,6 +856,8 @@ static int net_client_init1(const void *object, int is_netdev, Error **errp)
 
     if (net_client_init_fun[opts->kind]) {
         NetClientState *peer = NULL;
+        const char *owner;
+        int ret;
 
         /* Do not add to a vlan if it's a -netdev or a nic with a netdev=
          * parameter. */
@@ -778,7 +867,10 @@ static int net_client_init1(const void *object, int is_netdev, Error **errp)
             peer = net_hub_add_port(u.net->has_vlan ? u.net->vlan : 0, NULL);
         }
 
-        if (net_client_init_fun[opts->kind](opts, name, peer) < 0) {
+        owner = qemu_set_callback_owner(name);
+        ret = net_client_init_fun[opts->kind](opts, name, peer);
+        qemu_set_callback_owner(owner);
+        if (ret < 0) {
             /* TODO push error reporting into init() methods */
             error_set(errp, QERR_DEVICE_INIT_FAILED,
                       NetClientOptionsKind_lookup[opts->kind]);
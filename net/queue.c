@@ -23,6 +23,7 @@
 
 #include "net/queue.h"
 #include "qemu/queue.h"
+#include "qemu/iov.h"
 #include "net/net.h"
 
 /* The delivery handler may only return zero if it will call
@@ -30,22 +31,35 @@
  * to deliver packets. It must also call qemu_net_queue_purge() in its
  * cleanup path.
  *
- * If a sent callback is provided to send(), the caller must handle a
- * zero return from the delivery handler by not sending any more packets
- * until we have invoked the callback. Only in that case will we queue
- * the packet.
+ * If a sent callback is provided to send(), a zero return means the
+ * packet was queued by reference: the caller must leave the buffer alone
+ * until the callback has been invoked, which happens exactly once, also
+ * when the packet is purged.  The caller is responsible for bounding how
+ * many packets it has in flight.
  *
- * If a sent callback isn't provided, we just drop the packet to avoid
- * unbounded queueing.
+ * Without a sent callback, a packet that cannot be delivered right away
+ * is copied into the queue.  qemu_net_queue_send_shared() instead makes
+ * one reference counted copy that every queue holding the packet shares.
  */
 
+struct NetSharedBuf {
+    int refcnt;
+    size_t size;
+    uint8_t data[0];
+};
+
 struct NetPacket {
     QTAILQ_ENTRY(NetPacket) entry;
     NetClientState *sender;
     unsigned flags;
     int size;
     NetPacketSent *sent_cb;
-    uint8_t data[0];
+    int iovcnt;                 /* 0 if the payload was copied to data[] */
+    NetSharedBuf *shared;       /* payload in a shared copy */
+    union {
+        struct iovec iov[0];    /* queued by reference */
+        uint8_t data[0];
+    };
 };
 
 struct NetQueue {
@@ -71,35 +85,41 @@ NetQueue *qemu_new_net_queue(void *opaque)
     return queue;
 }
 
-void qemu_del_net_queue(NetQueue *queue)
+static NetSharedBuf *qemu_net_shared_buf_new(const struct iovec *iov,
+                                             int iovcnt)
 {
-    NetPacket *packet, *next;
+    size_t size = iov_size(iov, iovcnt);
+    NetSharedBuf *buf;
 
-    QTAILQ_FOREACH_SAFE(packet, &queue->packets, entry, next) {
-        QTAILQ_REMOVE(&queue->packets, packet, entry);
-        g_free(packet);
+    buf = g_malloc(sizeof(NetSharedBuf) + size);
+    buf->refcnt = 1;
+    buf->size = iov_to_buf(iov, iovcnt, 0, buf->data, size);
+    return buf;
+}
+
+void qemu_net_shared_buf_unref(NetSharedBuf *buf)
+{
+    if (buf && --buf->refcnt == 0) {
+        g_free(buf);
     }
+}
 
-    g_free(queue);
+static void qemu_net_packet_free(NetPacket *packet)
+{
+    qemu_net_shared_buf_unref(packet->shared);
+    g_free(packet);
 }
 
-static void qemu_net_queue_append(NetQueue *queue,
-                                  NetClientState *sender,
-                                  unsigned flags,
-                                  const uint8_t *buf,
-                                  size_t size,
-                                  NetPacketSent *sent_cb)
+void qemu_del_net_queue(NetQueue *queue)
 {
-    NetPacket *packet;
+    NetPacket *packet, *next;
 
-    packet = g_malloc(sizeof(NetPacket) + size);
-    packet->sender = sender;
-    packet->flags = flags;
-    packet->size = size;
-    packet->sent_cb = sent_cb;
-    memcpy(packet->data, buf, size);
+    QTAILQ_FOREACH_SAFE(packet, &queue->packets, entry, next) {
+        QTAILQ_REMOVE(&queue->packets, packet, entry);
+        qemu_net_packet_free(packet);
+    }
 
-    QTAILQ_INSERT_TAIL(&queue->packets, packet, entry);
+    g_free(queue);
 }
 
 static void qemu_net_queue_append_iov(NetQueue *queue,
@@ -117,22 +137,65 @@ static void qemu_net_queue_append_iov(NetQueue *queue,
         max_len += iov[i].iov_len;
     }
 
-    packet = g_malloc(sizeof(NetPacket) + max_len);
+    if (sent_cb && iovcnt > 0) {
+        /* Only the iovec array is copied, the data stays in place */
+        packet = g_malloc(sizeof(NetPacket) + iovcnt * sizeof(struct iovec));
+        memcpy(packet->iov, iov, iovcnt * sizeof(struct iovec));
+        packet->iovcnt = iovcnt;
+        packet->size = max_len;
+    } else {
+        packet = g_malloc(sizeof(NetPacket) + max_len);
+        packet->iovcnt = 0;
+        packet->size = iov_to_buf(iov, iovcnt, 0, packet->data, max_len);
+    }
     packet->sender = sender;
     packet->sent_cb = sent_cb;
     packet->flags = flags;
-    packet->size = 0;
+    packet->shared = NULL;
 
-    for (i = 0; i < iovcnt; i++) {
-        size_t len = iov[i].iov_len;
+    QTAILQ_INSERT_TAIL(&queue->packets, packet, entry);
+}
+
+static void qemu_net_queue_append_shared(NetQueue *queue,
+                                         NetClientState *sender,
+                                         unsigned flags,
+                                         const struct iovec *iov,
+                                         int iovcnt,
+                                         NetSharedBuf **shared)
+{
+    NetPacket *packet;
 
-        memcpy(packet->data + packet->size, iov[i].iov_base, len);
-        packet->size += len;
+    if (!*shared) {
+        *shared = qemu_net_shared_buf_new(iov, iovcnt);
     }
+    (*shared)->refcnt++;
+
+    packet = g_malloc(sizeof(NetPacket));
+    packet->sender = sender;
+    packet->flags = flags;
+    packet->size = (*shared)->size;
+    packet->sent_cb = NULL;
+    packet->iovcnt = 0;
+    packet->shared = *shared;
 
     QTAILQ_INSERT_TAIL(&queue->packets, packet, entry);
 }
 
+static void qemu_net_queue_append(NetQueue *queue,
+                                  NetClientState *sender,
+                                  unsigned flags,
+                                  const uint8_t *buf,
+                                  size_t size,
+                                  NetPacketSent *sent_cb)
+{
+    struct iovec iov = {
+        .iov_base = (uint8_t *)buf,
+        .iov_len = size,
+    };
+
+    qemu_net_queue_append_iov(queue, sender, flags, &iov, 1, sent_cb);
+}
+
 static ssize_t qemu_net_queue_deliver(NetQueue *queue,
                                       NetClientState *sender,
                                       unsigned flags,
@@ -213,18 +276,61 @@ ssize_t qemu_net_queue_send_iov(NetQueue *queue,
     return ret;
 }
 
+ssize_t qemu_net_queue_send_shared(NetQueue *queue,
+                                   NetClientState *sender,
+                                   unsigned flags,
+                                   const struct iovec *iov,
+                                   int iovcnt,
+                                   NetSharedBuf **shared)
+{
+    ssize_t ret;
+
+    if (queue->delivering || !qemu_can_send_packet(sender)) {
+        qemu_net_queue_append_shared(queue, sender, flags, iov, iovcnt,
+                                     shared);
+        return 0;
+    }
+
+    ret = qemu_net_queue_deliver_iov(queue, sender, flags, iov, iovcnt);
+    if (ret == 0) {
+        qemu_net_queue_append_shared(queue, sender, flags, iov, iovcnt,
+                                     shared);
+        return 0;
+    }
+
+    qemu_net_queue_flush(queue);
+
+    return ret;
+}
+
 void qemu_net_queue_purge(NetQueue *queue, NetClientState *from)
 {
+    QTAILQ_HEAD(, NetPacket) purged = QTAILQ_HEAD_INITIALIZER(purged);
     NetPacket *packet, *next;
 
     QTAILQ_FOREACH_SAFE(packet, &queue->packets, entry, next) {
         if (packet->sender == from) {
             QTAILQ_REMOVE(&queue->packets, packet, entry);
-            g_free(packet);
+            QTAILQ_INSERT_TAIL(&purged, packet, entry);
+        }
+    }
+
+    /* Let the sender release the buffers of the dropped packets; it may
+     * send again from the callback, so the queue must be consistent */
+    QTAILQ_FOREACH_SAFE(packet, &purged, entry, next) {
+        if (packet->sent_cb) {
+            packet->sent_cb(packet->sender, 0);
         }
+        qemu_net_packet_free(packet);
     }
 }
 
+/* Would a packet sent now be delivered right away, ahead of no other? */
+bool qemu_net_queue_empty(NetQueue *queue)
+{
+    return !queue->delivering && QTAILQ_EMPTY(&queue->packets);
+}
+
 bool qemu_net_queue_flush(NetQueue *queue)
 {
     while (!QTAILQ_EMPTY(&queue->packets)) {
@@ -234,11 +340,20 @@ bool qemu_net_queue_flush(NetQueue *queue)
         packet = QTAILQ_FIRST(&queue->packets);
         QTAILQ_REMOVE(&queue->packets, packet, entry);
 
-        ret = qemu_net_queue_deliver(queue,
-                                     packet->sender,
-                                     packet->flags,
-                                     packet->data,
-                                     packet->size);
+        if (packet->iovcnt) {
+            ret = qemu_net_queue_deliver_iov(queue,
+                                             packet->sender,
+                                             packet->flags,
+                                             packet->iov,
+                                             packet->iovcnt);
+        } else {
+            ret = qemu_net_queue_deliver(queue,
+                                         packet->sender,
+                                         packet->flags,
+                                         packet->shared ? packet->shared->data
+                                                        : packet->data,
+                                         packet->size);
+        }
         if (ret == 0) {
             QTAILQ_INSERT_HEAD(&queue->packets, packet, entry);
             return false;
@@ -248,7 +363,7 @@ bool qemu_net_queue_flush(NetQueue *queue)
             packet->sent_cb(packet->sender, ret);
         }
 
-        g_free(packet);
+        qemu_net_packet_free(packet);
     }
     return true;
 }
@@ -106,6 +106,17 @@ void slirp_output(void *opaque, const uint8_t *pkt, int pkt_len)
     qemu_send_packet(&s->nc, pkt, pkt_len);
 }
 
+void slirp_output_batch(void *opaque, bool start)
+{
+    SlirpState *s = opaque;
+
+    if (start) {
+        qemu_send_batch_begin(&s->nc);
+    } else {
+        qemu_send_batch_end(&s->nc);
+    }
+}
+
 static ssize_t net_slirp_receive(NetClientState *nc, const uint8_t *buf, size_t size)
 {
     SlirpState *s = DO_UPCAST(SlirpState, nc, nc);
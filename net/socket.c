@@ -45,8 +45,16 @@ typedef struct NetSocketState {
     IOHandler *send_fn;           /* differs between SOCK_STREAM/SOCK_DGRAM */
     bool read_poll;               /* waiting to receive data? */
     bool write_poll;              /* waiting to transmit data? */
+#ifdef CONFIG_RECVMMSG
+    uint8_t *dgram_bufs;          /* NET_SOCKET_RX_BATCH datagram buffers */
+#endif
 } NetSocketState;
 
+#ifdef CONFIG_RECVMMSG
+/* Maximum number of datagrams received per wakeup */
+#define NET_SOCKET_RX_BATCH 32
+#endif
+
 static void net_socket_accept(void *opaque);
 static void net_socket_writable(void *opaque);
 
@@ -219,6 +227,48 @@ static void net_socket_send(void *opaque)
     }
 }
 
+#ifdef CONFIG_RECVMMSG
+/* Receive up to NET_SOCKET_RX_BATCH datagrams with a single system call
+ * and hand them to the peer as one batch */
+static void net_socket_send_dgram(void *opaque)
+{
+    NetSocketState *s = opaque;
+    struct mmsghdr msgs[NET_SOCKET_RX_BATCH];
+    struct iovec iov[NET_SOCKET_RX_BATCH];
+    int i, count;
+
+    if (!s->dgram_bufs) {
+        s->dgram_bufs = g_malloc(NET_SOCKET_RX_BATCH * sizeof(s->buf));
+    }
+
+    memset(msgs, 0, sizeof(msgs));
+    for (i = 0; i < NET_SOCKET_RX_BATCH; i++) {
+        iov[i].iov_base = s->dgram_bufs + i * sizeof(s->buf);
+        iov[i].iov_len = sizeof(s->buf);
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    do {
+        count = recvmmsg(s->fd, msgs, NET_SOCKET_RX_BATCH, MSG_DONTWAIT, NULL);
+    } while (count < 0 && errno == EINTR);
+    if (count <= 0) {
+        return;
+    }
+
+    qemu_send_batch_begin(&s->nc);
+    for (i = 0; i < count; i++) {
+        if (msgs[i].msg_len == 0) {
+            /* end of connection */
+            net_socket_read_poll(s, false);
+            net_socket_write_poll(s, false);
+            break;
+        }
+        qemu_send_packet(&s->nc, iov[i].iov_base, msgs[i].msg_len);
+    }
+    qemu_send_batch_end(&s->nc);
+}
+#else
 static void net_socket_send_dgram(void *opaque)
 {
     NetSocketState *s = opaque;
@@ -235,6 +285,7 @@ static void net_socket_send_dgram(void *opaque)
     }
     qemu_send_packet(&s->nc, s->buf, size);
 }
+#endif
 
 static int net_socket_mcast_create(struct sockaddr_in *mcastaddr, struct in_addr *localaddr)
 {
@@ -331,6 +382,10 @@ static void net_socket_cleanup(NetClientState *nc)
         closesocket(s->listen_fd);
         s->listen_fd = -1;
     }
+#ifdef CONFIG_RECVMMSG
+    g_free(s->dgram_bufs);
+    s->dgram_bufs = NULL;
+#endif
 }
 
 static NetClientInfo net_dgram_socket_info = {
@@ -39,6 +39,7 @@
 #include "sysemu/sysemu.h"
 #include "qemu-common.h"
 #include "qemu/error-report.h"
+#include "qemu/iov.h"
 
 #include "net/tap.h"
 
@@ -49,6 +50,12 @@
  */
 #define TAP_BUFSIZE (4096 + 65536)
 
+/* Maximum number of packets read from the tap fd per wakeup */
+#define TAP_RX_BATCH 64
+
+/* Maximum number of peer buffers a packet is read into directly */
+#define TAP_RX_IOVS 64
+
 typedef struct TAPState {
     NetClientState nc;
     int fd;
@@ -190,29 +197,91 @@ static void tap_send_completed(NetClientState *nc, ssize_t len)
     tap_read_poll(s, true);
 }
 
+/* Read the next packet straight into the peer's buffers, with s->buf
+ * taking whatever does not fit.  Returns false if the peer can't do that,
+ * otherwise sets @size as qemu_send_packet_async() would, or to -1 if
+ * there was nothing to read. */
+static bool tap_send_zerocopy(TAPState *s, int *size)
+{
+#ifndef __sun__
+    struct virtio_net_hdr_mrg_rxbuf hdr;
+    struct iovec iov[TAP_RX_IOVS + 2];
+    int skip = 0, mapped;
+    size_t bytes;
+    ssize_t len;
+
+    /* a header the peer doesn't want is read into a scratch buffer */
+    if (s->host_vnet_hdr_len && !s->using_vnet_hdr) {
+        iov[0].iov_base = &hdr;
+        iov[0].iov_len = s->host_vnet_hdr_len;
+        skip = 1;
+    }
+
+    mapped = qemu_peer_rx_map(&s->nc, iov + skip, TAP_RX_IOVS);
+    if (mapped <= 0) {
+        return false;
+    }
+    bytes = iov_size(iov + skip, mapped);
+    iov[skip + mapped].iov_base = s->buf;
+    iov[skip + mapped].iov_len = sizeof(s->buf) - MIN(bytes, sizeof(s->buf));
+
+    do {
+        len = readv(s->fd, iov, skip + mapped + 1);
+    } while (len < 0 && errno == EINTR);
+    len -= skip ? s->host_vnet_hdr_len : 0;
+    if (len <= 0) {
+        *size = -1;
+        return true;
+    }
+
+    *size = qemu_peer_rx_commit(&s->nc, iov + skip, mapped + 1, len);
+    if (*size == 0) {
+        /* Gather the packet into s->buf, in front of the part already
+         * there; len > bytes, since the peer only refuses a packet it has
+         * to copy from s->buf */
+        memmove(s->buf + bytes, s->buf, len - bytes);
+        iov_to_buf(iov + skip, mapped, 0, s->buf, bytes);
+        *size = qemu_send_packet_async(&s->nc, s->buf, len,
+                                       tap_send_completed);
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
 static void tap_send(void *opaque)
 {
     TAPState *s = opaque;
     int size;
+    int packets = 0;
 
+    /* The tap fd returns one packet per read(), but the guest is only
+     * notified once for everything read in this wakeup */
+    qemu_send_batch_begin(&s->nc);
     do {
         uint8_t *buf = s->buf;
 
-        size = tap_read_packet(s->fd, s->buf, sizeof(s->buf));
-        if (size <= 0) {
-            break;
-        }
+        if (!tap_send_zerocopy(s, &size)) {
+            size = tap_read_packet(s->fd, s->buf, sizeof(s->buf));
+            if (size <= 0) {
+                break;
+            }
 
-        if (s->host_vnet_hdr_len && !s->using_vnet_hdr) {
-            buf  += s->host_vnet_hdr_len;
-            size -= s->host_vnet_hdr_len;
-        }
+            if (s->host_vnet_hdr_len && !s->using_vnet_hdr) {
+                buf  += s->host_vnet_hdr_len;
+                size -= s->host_vnet_hdr_len;
+            }
 
-        size = qemu_send_packet_async(&s->nc, buf, size, tap_send_completed);
+            size = qemu_send_packet_async(&s->nc, buf, size,
+                                          tap_send_completed);
+        }
         if (size == 0) {
             tap_read_poll(s, false);
         }
-    } while (size > 0 && qemu_can_send_packet(&s->nc));
+    } while (size > 0 && ++packets < TAP_RX_BATCH &&
+             qemu_can_send_packet(&s->nc));
+    qemu_send_batch_end(&s->nc);
 }
 
 bool tap_has_ufo(NetClientState *nc)
@@ -638,6 +707,7 @@ static int net_init_tap_one(const NetdevTapOptions *tap, NetClientState *peer,
         }
 
         s->vhost_net = vhost_net_init(&s->nc, vhostfd,
+                                      VHOST_BACKEND_TYPE_KERNEL,
                                       tap->has_vhostforce && tap->vhostforce);
         if (!s->vhost_net) {
             error_report("vhost-net requested but could not be initialized");
@@ -0,0 +1,113 @@
+/*
+ * vhost-user netdev
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+/*
+ * The packets of a vhost-user netdev never go through QEMU: the guest's
+ * virtio-net queues are handed to the process at the other end of the
+ * socket, which reads and writes guest memory directly.
+ */
+
+#include "clients.h"
+#include "net/vhost-user.h"
+#include "hw/vhost_net.h"
+#include "migration/migration.h"
+#include "qapi/qmp/qerror.h"
+#include "qemu/error-report.h"
+#include "qemu/sockets.h"
+
+typedef struct VhostUserState {
+    NetClientState nc;
+    VHostNetState *vhost_net;
+    Error *migration_blocker;
+} VhostUserState;
+
+VHostNetState *vhost_user_get_vhost_net(NetClientState *nc)
+{
+    VhostUserState *s = DO_UPCAST(VhostUserState, nc, nc);
+    assert(nc->info->type == NET_CLIENT_OPTIONS_KIND_VHOST_USER);
+    return s->vhost_net;
+}
+
+static ssize_t vhost_user_receive(NetClientState *nc, const uint8_t *buf,
+                                  size_t size)
+{
+    /* Until the guest driver starts the device there is nowhere to put
+     * the packet; the backend cannot receive anything outside the rings.
+     */
+    return size;
+}
+
+static void vhost_user_cleanup(NetClientState *nc)
+{
+    VhostUserState *s = DO_UPCAST(VhostUserState, nc, nc);
+
+    if (s->vhost_net) {
+        vhost_net_cleanup(s->vhost_net);
+        s->vhost_net = NULL;
+    }
+    if (s->migration_blocker) {
+        migrate_del_blocker(s->migration_blocker);
+        error_free(s->migration_blocker);
+        s->migration_blocker = NULL;
+    }
+}
+
+static NetClientInfo net_vhost_user_info = {
+    .type = NET_CLIENT_OPTIONS_KIND_VHOST_USER,
+    .size = sizeof(VhostUserState),
+    .receive = vhost_user_receive,
+    .cleanup = vhost_user_cleanup,
+};
+
+int net_init_vhost_user(const NetClientOptions *opts, const char *name,
+                        NetClientState *peer)
+{
+    const NetdevVhostUserOptions *vhost_user;
+    NetClientState *nc;
+    VhostUserState *s;
+    Error *err = NULL;
+    int fd;
+
+    assert(opts->kind == NET_CLIENT_OPTIONS_KIND_VHOST_USER);
+    vhost_user = opts->vhost_user;
+
+    if (peer) {
+        error_report("vhost-user requires -netdev, it cannot be put on a vlan");
+        return -1;
+    }
+
+    fd = unix_connect(vhost_user->path, &err);
+    if (fd < 0) {
+        qerror_report_err(err);
+        error_free(err);
+        return -1;
+    }
+
+    nc = qemu_new_net_client(&net_vhost_user_info, peer, "vhost-user", name);
+    snprintf(nc->info_str, sizeof(nc->info_str), "vhost-user to %s",
+             vhost_user->path);
+    s = DO_UPCAST(VhostUserState, nc, nc);
+
+    /* The vhost device owns fd from here on, even on failure */
+    s->vhost_net = vhost_net_init(nc, fd, VHOST_BACKEND_TYPE_USER,
+                                  vhost_user->has_vhostforce &&
+                                  vhost_user->vhostforce);
+    if (!s->vhost_net) {
+        error_report("vhost-user backend %s could not be initialized",
+                     vhost_user->path);
+        qemu_del_net_client(nc);
+        return -1;
+    }
+
+    /* The backend does not log its writes to guest memory */
+    error_set(&s->migration_blocker, QERR_DEVICE_FEATURE_BLOCKS_MIGRATION,
+              "vhost-user", name);
+    migrate_add_blocker(s->migration_blocker);
+
+    return 0;
+}
@@ -1,6 +1,6 @@
 /*
  * Page cache for QEMU
- * The cache is base on a hash of the page address
+ * The cache is a set-associative cache based on a hash of the page address
  *
  * Copyright 2012 Red Hat, Inc. and/or its affiliates
  *
@@ -34,11 +34,20 @@
     do { } while (0)
 #endif
 
+/* Pages are hashed to a set of PAGE_CACHE_WAYS entries; a miss replaces
+ * the coldest entry of its set.  Every lookup makes an entry hotter and
+ * every time it survives an eviction its hotness is halved, so pages that
+ * stopped changing eventually make room for the ones that keep changing.
+ */
+#define PAGE_CACHE_WAYS 4
+
 typedef struct CacheItem CacheItem;
 
 struct CacheItem {
     uint64_t it_addr;
     uint64_t it_age;
+    uint32_t it_hits;
+    bool it_skip;
     uint8_t *it_data;
 };
 
@@ -46,6 +55,8 @@ struct PageCache {
     CacheItem *page_cache;
     unsigned int page_size;
     int64_t max_num_items;
+    int64_t num_sets;
+    unsigned int ways;
     uint64_t max_item_age;
     int64_t num_items;
 };
@@ -72,8 +83,11 @@ PageCache *cache_init(int64_t num_pages, unsigned int page_size)
     cache->num_items = 0;
     cache->max_item_age = 0;
     cache->max_num_items = num_pages;
+    cache->ways = MIN(num_pages, PAGE_CACHE_WAYS);
+    cache->num_sets = num_pages / cache->ways;
 
-    DPRINTF("Setting cache buckets to %" PRId64 "\n", cache->max_num_items);
+    DPRINTF("Setting cache buckets to %" PRId64 " sets of %u\n",
+            cache->num_sets, cache->ways);
 
     cache->page_cache = g_malloc((cache->max_num_items) *
                                  sizeof(*cache->page_cache));
@@ -81,6 +95,8 @@ PageCache *cache_init(int64_t num_pages, unsigned int page_size)
     for (i = 0; i < cache->max_num_items; i++) {
         cache->page_cache[i].it_data = NULL;
         cache->page_cache[i].it_age = 0;
+        cache->page_cache[i].it_hits = 0;
+        cache->page_cache[i].it_skip = false;
         cache->page_cache[i].it_addr = -1;
     }
 
@@ -102,71 +118,156 @@ void cache_fini(PageCache *cache)
     cache->page_cache = NULL;
 }
 
-static size_t cache_get_cache_pos(const PageCache *cache,
-                                  uint64_t address)
+/* first entry of the set @address maps to */
+static CacheItem *cache_get_set(const PageCache *cache, uint64_t address)
 {
-    size_t pos;
+    uint64_t page = address / cache->page_size;
 
-    g_assert(cache->max_num_items);
-    pos = (address / cache->page_size) & (cache->max_num_items - 1);
-    return pos;
+    g_assert(cache->num_sets);
+    /* mix in the high bits so that strided access patterns spread out */
+    page ^= page >> 17;
+    return &cache->page_cache[(page & (cache->num_sets - 1)) * cache->ways];
 }
 
-bool cache_is_cached(const PageCache *cache, uint64_t addr)
+static CacheItem *cache_get_by_addr(const PageCache *cache, uint64_t addr)
 {
-    size_t pos;
+    CacheItem *set;
+    unsigned int i;
 
     g_assert(cache);
     g_assert(cache->page_cache);
 
-    pos = cache_get_cache_pos(cache, addr);
+    set = cache_get_set(cache, addr);
+    for (i = 0; i < cache->ways; i++) {
+        if (set[i].it_data && set[i].it_addr == addr) {
+            return &set[i];
+        }
+    }
+    return NULL;
+}
 
-    return (cache->page_cache[pos].it_addr == addr);
+bool cache_is_cached(const PageCache *cache, uint64_t addr)
+{
+    return cache_get_by_addr(cache, addr) != NULL;
 }
 
-static CacheItem *cache_get_by_addr(const PageCache *cache, uint64_t addr)
+uint8_t *get_cached_data(const PageCache *cache, uint64_t addr)
 {
-    size_t pos;
+    CacheItem *it = cache_get_by_addr(cache, addr);
 
-    g_assert(cache);
-    g_assert(cache->page_cache);
+    return it ? it->it_data : NULL;
+}
 
-    pos = cache_get_cache_pos(cache, addr);
+uint8_t *cache_lookup(PageCache *cache, uint64_t addr)
+{
+    CacheItem *it = cache_get_by_addr(cache, addr);
 
-    return &cache->page_cache[pos];
+    if (!it) {
+        return NULL;
+    }
+    if (it->it_hits < UINT32_MAX) {
+        it->it_hits++;
+    }
+    it->it_age = ++cache->max_item_age;
+    return it->it_data;
 }
 
-uint8_t *get_cached_data(const PageCache *cache, uint64_t addr)
+/* Free slot of the set if there is one, else the least useful entry:
+ * fewest hits, then least recently used.  The others cool down. */
+static CacheItem *cache_find_victim(PageCache *cache, uint64_t addr)
 {
-    return cache_get_by_addr(cache, addr)->it_data;
+    CacheItem *set = cache_get_set(cache, addr);
+    CacheItem *victim = NULL;
+    unsigned int i;
+
+    for (i = 0; i < cache->ways; i++) {
+        CacheItem *it = &set[i];
+
+        if (!it->it_data) {
+            return it;
+        }
+        if (!victim || it->it_hits < victim->it_hits ||
+            (it->it_hits == victim->it_hits && it->it_age < victim->it_age)) {
+            victim = it;
+        }
+    }
+
+    for (i = 0; i < cache->ways; i++) {
+        if (&set[i] != victim) {
+            set[i].it_hits >>= 1;
+        }
+    }
+    return victim;
 }
 
 void cache_insert(PageCache *cache, uint64_t addr, uint8_t *pdata)
 {
-
-    CacheItem *it = NULL;
+    CacheItem *it;
 
     g_assert(cache);
     g_assert(cache->page_cache);
 
-    /* actual update of entry */
     it = cache_get_by_addr(cache, addr);
+    if (!it) {
+        it = cache_find_victim(cache, addr);
+    }
 
     if (!it->it_data) {
         cache->num_items++;
+    } else if (it->it_data != pdata) {
+        g_free(it->it_data);
     }
 
     it->it_data = pdata;
     it->it_age = ++cache->max_item_age;
+    it->it_hits = 0;
+    it->it_skip = false;
     it->it_addr = addr;
 }
 
+void cache_set_skip(PageCache *cache, uint64_t addr)
+{
+    CacheItem *it = cache_get_by_addr(cache, addr);
+
+    if (it) {
+        it->it_skip = true;
+    }
+}
+
+bool cache_test_and_clear_skip(PageCache *cache, uint64_t addr)
+{
+    CacheItem *it = cache_get_by_addr(cache, addr);
+    bool ret = false;
+
+    if (it) {
+        ret = it->it_skip;
+        it->it_skip = false;
+    }
+    return ret;
+}
+
+/* Most hits first, then most recently used */
+static int cache_item_compare(const void *a, const void *b)
+{
+    const CacheItem *it1 = *(CacheItem * const *)a;
+    const CacheItem *it2 = *(CacheItem * const *)b;
+
+    if (it1->it_hits != it2->it_hits) {
+        return it1->it_hits > it2->it_hits ? -1 : 1;
+    }
+    if (it1->it_age != it2->it_age) {
+        return it1->it_age > it2->it_age ? -1 : 1;
+    }
+    return 0;
+}
+
 int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
 {
     PageCache *new_cache;
-    int64_t i;
+    int64_t i, n = 0;
+    unsigned int j;
 
-    CacheItem *old_it, *new_it;
+    CacheItem *old_it, *set, **items;
 
     g_assert(cache);
 
@@ -186,30 +287,36 @@ int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
         return -1;
     }
 
-    /* move all data from old cache */
+    /* move all data from old cache, most useful pages first, so that when
+     * shrinking the least useful pages of each set are dropped */
+    items = g_new(CacheItem *, cache->max_num_items);
     for (i = 0; i < cache->max_num_items; i++) {
-        old_it = &cache->page_cache[i];
-        if (old_it->it_addr != -1) {
-            /* check for collision, if there is, keep MRU page */
-            new_it = cache_get_by_addr(new_cache, old_it->it_addr);
-            if (new_it->it_data) {
-                /* keep the MRU page */
-                if (new_it->it_age >= old_it->it_age) {
-                    g_free(old_it->it_data);
-                } else {
-                    g_free(new_it->it_data);
-                    new_it->it_data = old_it->it_data;
-                    new_it->it_age = old_it->it_age;
-                    new_it->it_addr = old_it->it_addr;
-                }
-            } else {
-                cache_insert(new_cache, old_it->it_addr, old_it->it_data);
-            }
+        if (cache->page_cache[i].it_data) {
+            items[n++] = &cache->page_cache[i];
+        }
+    }
+    qsort(items, n, sizeof(*items), cache_item_compare);
+
+    for (i = 0; i < n; i++) {
+        old_it = items[i];
+        set = cache_get_set(new_cache, old_it->it_addr);
+        for (j = 0; j < new_cache->ways && set[j].it_data; j++) {
+            /* nothing */
+        }
+        if (j < new_cache->ways) {
+            set[j] = *old_it;
+            new_cache->num_items++;
+        } else {
+            g_free(old_it->it_data);
         }
     }
+    g_free(items);
 
+    g_free(cache->page_cache);
     cache->page_cache = new_cache->page_cache;
     cache->max_num_items = new_cache->max_num_items;
+    cache->num_sets = new_cache->num_sets;
+    cache->ways = new_cache->ways;
     cache->num_items = new_cache->num_items;
 
     g_free(new_cache);
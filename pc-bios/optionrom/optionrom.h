@@ -24,6 +24,11 @@
 
 #define BIOS_CFG_IOPORT_CFG	0x510
 #define BIOS_CFG_IOPORT_DATA	0x511
+#define BIOS_CFG_IOPORT_DMA	0x514
+
+/* The DMA interface wants its constants big-endian */
+#define BSWAP32(x)	((((x) >> 24) & 0xff) | (((x) >> 8) & 0xff00) | \
+			 (((x) << 8) & 0xff0000) | (((x) & 0xff) << 24))
 
 /* Break the translation block flow so -d cpu shows us values */
 #define DEBUG_HERE \
@@ -87,6 +92,44 @@
 	*/						\
 	.dc.b		0x67,0xf3,0x6c
 
+/*
+ * Read a blob from the fw_cfg device in one go, through the DMA interface.
+ * Requires _ADDR, _SIZE and _DATA values for the parameter.  The
+ * FWCfgDmaAccess lives on the stack, so SS must be a real mode segment.
+ *
+ * Clobbers:	%eax, %edx, %ecx, %edi
+ */
+#define read_fw_blob_dma(var)				\
+	read_fw		var ## _ADDR;			\
+	mov		%eax, %edi;			\
+	read_fw		var ## _SIZE;			\
+	mov		%eax, %ecx;			\
+	/* FWCfgDmaAccess: address, length, control */	\
+	bswap		%edi;				\
+	pushl		%edi;				\
+	pushl		$0;				\
+	bswap		%ecx;				\
+	pushl		%ecx;				\
+	pushl		$BSWAP32((var ## _DATA << 16) |	\
+				 FW_CFG_DMA_CTL_SELECT |	\
+				 FW_CFG_DMA_CTL_READ);		\
+	/* Its physical address: high half, then low half */	\
+	xor		%eax, %eax;			\
+	mov		%ss, %ax;			\
+	shl		$4, %eax;			\
+	movzwl		%sp, %edx;			\
+	add		%edx, %eax;			\
+	bswap		%eax;				\
+	mov		%eax, %ecx;			\
+	xor		%eax, %eax;			\
+	mov		$BIOS_CFG_IOPORT_DMA, %dx;	\
+	outl		%eax, (%dx);			\
+	mov		%ecx, %eax;			\
+	add		$4, %dx;			\
+	outl		%eax, (%dx);			\
+	/* The transfer is done when outl returns */	\
+	add		$16, %esp
+
 #define OPTION_ROM_START					\
     .code16;						\
     .text;						\
@@ -0,0 +1,379 @@
+/*
+ * Post-copy live migration, destination side RAM handling
+ *
+ * Once the destination is running, guest RAM that has not arrived yet is
+ * left unmapped and registered with userfaultfd.  A fault thread turns
+ * each missing-page fault into a request on the return path; pages that
+ * arrive on the migration stream are mapped atomically with UFFDIO_COPY,
+ * which also wakes the faulting thread.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu-common.h"
+#include "migration/migration.h"
+#include "migration/postcopy-ram.h"
+#include "qemu/bitmap.h"
+#include "qemu/thread.h"
+#include "hw/xen.h"
+#include "sysemu/ram-reclaim.h"
+
+//#define DEBUG_POSTCOPY
+
+#ifdef DEBUG_POSTCOPY
+#define DPRINTF(fmt, ...) \
+    do { fprintf(stdout, "postcopy: " fmt, ## __VA_ARGS__); } while (0)
+#else
+#define DPRINTF(fmt, ...) \
+    do { } while (0)
+#endif
+
+#ifdef CONFIG_USERFAULTFD
+
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/userfaultfd.h>
+
+static int userfault_fd = -1;
+static int quit_pipe[2] = { -1, -1 };
+static QemuThread fault_thread;
+static bool fault_thread_running;
+static QEMUFile *to_src_file;
+/* one bit per target page, indexed by ram_addr */
+static unsigned long *received_map;
+static uint8_t *tmp_page;
+
+static int userfault_open(void)
+{
+    struct uffdio_api api = { .api = UFFD_API };
+    int fd;
+
+    fd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+    if (fd < 0) {
+        fprintf(stderr, "postcopy: userfaultfd not available: %s\n",
+                strerror(errno));
+        return -1;
+    }
+
+    if (ioctl(fd, UFFDIO_API, &api) < 0) {
+        fprintf(stderr, "postcopy: UFFDIO_API failed: %s\n", strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    if ((api.ioctls & UFFD_API_IOCTLS) != UFFD_API_IOCTLS) {
+        fprintf(stderr, "postcopy: missing userfaultfd ioctls\n");
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+bool postcopy_ram_supported_by_host(void)
+{
+    int fd;
+
+    if (xen_enabled()) {
+        fprintf(stderr, "postcopy: not supported with Xen\n");
+        return false;
+    }
+
+    if (getpagesize() != TARGET_PAGE_SIZE) {
+        fprintf(stderr, "postcopy: host page size %d differs from target "
+                "page size %d\n", getpagesize(), TARGET_PAGE_SIZE);
+        return false;
+    }
+
+    fd = userfault_open();
+    if (fd < 0) {
+        return false;
+    }
+    close(fd);
+
+    return true;
+}
+
+int postcopy_ram_incoming_init(void)
+{
+    int64_t ram_pages = last_ram_offset() >> TARGET_PAGE_BITS;
+
+    if (!received_map) {
+        received_map = bitmap_new(ram_pages);
+        tmp_page = qemu_memalign(TARGET_PAGE_SIZE, TARGET_PAGE_SIZE);
+        /* Missing pages must stay missing until the source sends them */
+        ram_reclaim_inhibit(true);
+    }
+
+    return 0;
+}
+
+static RAMBlock *postcopy_find_block(uint8_t *host)
+{
+    RAMBlock *block;
+
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        if (host >= block->host && host < block->host + block->length) {
+            return block;
+        }
+    }
+    return NULL;
+}
+
+static void *postcopy_ram_fault_thread(void *opaque)
+{
+    struct pollfd pfd[2];
+    struct uffd_msg msg;
+
+    pfd[0].fd = userfault_fd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = quit_pipe[0];
+    pfd[1].events = POLLIN;
+
+    while (true) {
+        RAMBlock *block;
+        ram_addr_t offset;
+        uint8_t *host;
+        ssize_t len;
+
+        pfd[0].revents = pfd[1].revents = 0;
+        if (poll(pfd, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "postcopy: fault thread poll: %s\n",
+                    strerror(errno));
+            break;
+        }
+
+        if (pfd[1].revents) {
+            break;
+        }
+
+        len = read(userfault_fd, &msg, sizeof(msg));
+        if (len != sizeof(msg)) {
+            if (len < 0 && (errno == EAGAIN || errno == EINTR)) {
+                continue;
+            }
+            fprintf(stderr, "postcopy: failed to read fault: %s\n",
+                    len < 0 ? strerror(errno) : "short read");
+            break;
+        }
+
+        if (msg.event != UFFD_EVENT_PAGEFAULT) {
+            continue;
+        }
+
+        host = (uint8_t *)(uintptr_t)(msg.arg.pagefault.address &
+                                      TARGET_PAGE_MASK);
+        block = postcopy_find_block(host);
+        if (!block) {
+            fprintf(stderr, "postcopy: fault outside of guest RAM at %p\n",
+                    host);
+            continue;
+        }
+        offset = host - block->host;
+
+        if (test_bit((block->offset + offset) >> TARGET_PAGE_BITS,
+                     received_map)) {
+            /* a zero page the pre-copy phase dropped with madvise */
+            struct uffdio_zeropage zero = {
+                .range = { .start = (uintptr_t)host, .len = TARGET_PAGE_SIZE },
+            };
+
+            if (ioctl(userfault_fd, UFFDIO_ZEROPAGE, &zero) < 0 &&
+                errno != EEXIST) {
+                fprintf(stderr, "postcopy: UFFDIO_ZEROPAGE failed: %s\n",
+                        strerror(errno));
+            }
+            continue;
+        }
+
+        DPRINTF("requesting %s:" RAM_ADDR_FMT "\n", block->idstr, offset);
+        migrate_send_rp_req_pages(to_src_file, block->idstr, offset,
+                                  TARGET_PAGE_SIZE);
+    }
+
+    return NULL;
+}
+
+int postcopy_ram_enable_notify(QEMUFile *to_src)
+{
+    RAMBlock *block;
+
+    userfault_fd = userfault_open();
+    if (userfault_fd < 0) {
+        return -1;
+    }
+
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        struct uffdio_register reg = {
+            .range = { .start = (uintptr_t)block->host, .len = block->length },
+            .mode = UFFDIO_REGISTER_MODE_MISSING,
+        };
+        uint64_t need = (1ULL << _UFFDIO_COPY) | (1ULL << _UFFDIO_ZEROPAGE);
+
+        if (ioctl(userfault_fd, UFFDIO_REGISTER, &reg) < 0) {
+            fprintf(stderr, "postcopy: failed to register %s: %s\n",
+                    block->idstr, strerror(errno));
+            return -1;
+        }
+        if ((reg.ioctls & need) != need) {
+            fprintf(stderr, "postcopy: %s does not support page placement\n",
+                    block->idstr);
+            return -1;
+        }
+    }
+
+    if (qemu_pipe(quit_pipe) < 0) {
+        fprintf(stderr, "postcopy: failed to create pipe: %s\n",
+                strerror(errno));
+        return -1;
+    }
+
+    to_src_file = to_src;
+    qemu_thread_create(&fault_thread, postcopy_ram_fault_thread, NULL,
+                       QEMU_THREAD_JOINABLE);
+    fault_thread_running = true;
+
+    return 0;
+}
+
+void postcopy_ram_incoming_cleanup(void)
+{
+    RAMBlock *block;
+
+    if (fault_thread_running) {
+        char c = 0;
+
+        if (write(quit_pipe[1], &c, 1) != 1) {
+            fprintf(stderr, "postcopy: failed to stop fault thread\n");
+        }
+        qemu_thread_join(&fault_thread);
+        fault_thread_running = false;
+    }
+
+    if (quit_pipe[0] != -1) {
+        close(quit_pipe[0]);
+        close(quit_pipe[1]);
+        quit_pipe[0] = quit_pipe[1] = -1;
+    }
+
+    if (userfault_fd != -1) {
+        QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+            struct uffdio_range range = {
+                .start = (uintptr_t)block->host, .len = block->length,
+            };
+
+            ioctl(userfault_fd, UFFDIO_UNREGISTER, &range);
+        }
+        close(userfault_fd);
+        userfault_fd = -1;
+    }
+
+    to_src_file = NULL;
+    if (received_map) {
+        ram_reclaim_inhibit(false);
+    }
+    g_free(received_map);
+    received_map = NULL;
+    qemu_vfree(tmp_page);
+    tmp_page = NULL;
+}
+
+int postcopy_ram_discard_range(RAMBlock *block, ram_addr_t start,
+                               ram_addr_t length)
+{
+    if (!received_map || start + length > block->length ||
+        (start | length) & ~TARGET_PAGE_MASK) {
+        return -EINVAL;
+    }
+
+    if (qemu_madvise(block->host + start, length, QEMU_MADV_DONTNEED) < 0) {
+        fprintf(stderr, "postcopy: failed to discard %s:" RAM_ADDR_FMT
+                ": %s\n", block->idstr, start, strerror(errno));
+        return -errno;
+    }
+
+    bitmap_clear(received_map, (block->offset + start) >> TARGET_PAGE_BITS,
+                 length >> TARGET_PAGE_BITS);
+    return 0;
+}
+
+void postcopy_ram_page_received(RAMBlock *block, ram_addr_t offset)
+{
+    if (received_map) {
+        set_bit((block->offset + offset) >> TARGET_PAGE_BITS, received_map);
+    }
+}
+
+void *postcopy_get_tmp_page(void)
+{
+    return tmp_page;
+}
+
+int postcopy_place_page(RAMBlock *block, ram_addr_t offset)
+{
+    struct uffdio_copy copy = {
+        .dst = (uintptr_t)(block->host + offset),
+        .src = (uintptr_t)tmp_page,
+        .len = TARGET_PAGE_SIZE,
+    };
+
+    if (ioctl(userfault_fd, UFFDIO_COPY, &copy) < 0 && errno != EEXIST) {
+        fprintf(stderr, "postcopy: failed to place %s:" RAM_ADDR_FMT ": %s\n",
+                block->idstr, offset, strerror(errno));
+        return -errno;
+    }
+
+    set_bit((block->offset + offset) >> TARGET_PAGE_BITS, received_map);
+    return 0;
+}
+
+#else
+
+bool postcopy_ram_supported_by_host(void)
+{
+    fprintf(stderr, "postcopy: userfaultfd not supported on this host\n");
+    return false;
+}
+
+int postcopy_ram_incoming_init(void)
+{
+    return -ENOSYS;
+}
+
+int postcopy_ram_enable_notify(QEMUFile *to_src)
+{
+    return -ENOSYS;
+}
+
+void postcopy_ram_incoming_cleanup(void)
+{
+}
+
+int postcopy_ram_discard_range(RAMBlock *block, ram_addr_t start,
+                               ram_addr_t length)
+{
+    return -ENOSYS;
+}
+
+void postcopy_ram_page_received(RAMBlock *block, ram_addr_t offset)
+{
+}
+
+void *postcopy_get_tmp_page(void)
+{
+    return NULL;
+}
+
+int postcopy_place_page(RAMBlock *block, ram_addr_t offset)
+{
+    return -ENOSYS;
+}
+
+#endif
@@ -120,20 +120,21 @@ QObject *qmp_dispatch(QObject *request)
 {
     Error *err = NULL;
     QObject *ret;
-    QDict *rsp;
+    QDict *rsp = NULL;
 
+    /* nodes freed while the command runs are recycled for the reply */
+    qobject_cache_begin();
     ret = do_qmp_dispatch(request, &err);
 
-    rsp = qdict_new();
     if (err) {
+        rsp = qdict_new();
         qdict_put_obj(rsp, "error", qmp_build_error_object(err));
         error_free(err);
     } else if (ret) {
+        rsp = qdict_new();
         qdict_put_obj(rsp, "return", ret);
-    } else {
-        QDECREF(rsp);
-        return NULL;
     }
+    qobject_cache_end();
 
-    return QOBJECT(rsp);
+    return rsp ? QOBJECT(rsp) : NULL;
 }
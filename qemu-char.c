@@ -26,6 +26,7 @@
 #include "ui/console.h"
 #include "sysemu/sysemu.h"
 #include "qemu/timer.h"
+#include "qemu/iov.h"
 #include "char/char.h"
 #include "hw/usb.h"
 #include "hw/baum.h"
@@ -144,6 +145,36 @@ int qemu_chr_fe_write(CharDriverState *s, const uint8_t *buf, int len)
     return s->chr_write(s, buf, len);
 }
 
+int qemu_chr_fe_writev(CharDriverState *s, struct iovec *iov, int iovcnt)
+{
+    int i, ret, done = 0;
+
+    if (s->chr_writev) {
+        return s->chr_writev(s, iov, iovcnt);
+    }
+
+    for (i = 0; i < iovcnt; i++) {
+        ret = s->chr_write(s, iov[i].iov_base, iov[i].iov_len);
+        if (ret < 0) {
+            return done ? done : -EIO;
+        }
+        done += ret;
+        if (ret < iov[i].iov_len) {
+            break;
+        }
+    }
+    return done;
+}
+
+int qemu_chr_fe_notify_writable(CharDriverState *s, IOHandler *cb,
+                                void *opaque)
+{
+    if (!s->chr_notify_writable) {
+        return -ENOTSUP;
+    }
+    return s->chr_notify_writable(s, cb, opaque);
+}
+
 int qemu_chr_fe_ioctl(CharDriverState *s, int cmd, void *arg)
 {
     if (!s->chr_ioctl)
@@ -547,6 +578,8 @@ static int stdio_nb_clients;
 typedef struct {
     int fd_in, fd_out;
     int max_size;
+    IOHandler *write_cb;
+    void *write_opaque;
 } FDCharDriver;
 
 
@@ -556,6 +589,20 @@ static int fd_chr_write(CharDriverState *chr, const uint8_t *buf, int len)
     return send_all(s->fd_out, buf, len);
 }
 
+static int fd_chr_writev(CharDriverState *chr, struct iovec *iov, int iovcnt)
+{
+    FDCharDriver *s = chr->opaque;
+    ssize_t ret;
+
+    do {
+        ret = writev(s->fd_out, iov, iovcnt);
+    } while (ret < 0 && errno == EINTR);
+    if (ret < 0) {
+        return errno == EWOULDBLOCK ? -EAGAIN : -errno;
+    }
+    return ret;
+}
+
 static int fd_chr_read_poll(void *opaque)
 {
     CharDriverState *chr = opaque;
@@ -589,23 +636,59 @@ static void fd_chr_read(void *opaque)
     }
 }
 
-static void fd_chr_update_read_handler(CharDriverState *chr)
+static void fd_chr_write_ready(void *opaque);
+
+/* fd_in and fd_out may be the same descriptor, which has a single slot */
+static void fd_chr_update_handlers(CharDriverState *chr)
 {
     FDCharDriver *s = chr->opaque;
+    IOHandler *write_ready = s->write_cb ? fd_chr_write_ready : NULL;
 
+    if (s->fd_out >= 0 && s->fd_out != s->fd_in) {
+        qemu_set_fd_handler2(s->fd_out, NULL, NULL, write_ready, chr);
+    }
     if (s->fd_in >= 0) {
         if (display_type == DT_NOGRAPHIC && s->fd_in == 0) {
         } else {
-            qemu_set_fd_handler2(s->fd_in, fd_chr_read_poll,
-                                 fd_chr_read, NULL, chr);
+            qemu_set_fd_handler2(s->fd_in, fd_chr_read_poll, fd_chr_read,
+                                 s->fd_in == s->fd_out ? write_ready : NULL,
+                                 chr);
         }
     }
 }
 
+static void fd_chr_write_ready(void *opaque)
+{
+    CharDriverState *chr = opaque;
+    FDCharDriver *s = chr->opaque;
+    IOHandler *cb = s->write_cb;
+
+    s->write_cb = NULL;
+    fd_chr_update_handlers(chr);
+    cb(s->write_opaque);
+}
+
+static int fd_chr_notify_writable(CharDriverState *chr, IOHandler *cb,
+                                  void *opaque)
+{
+    FDCharDriver *s = chr->opaque;
+
+    if (s->fd_out < 0) {
+        return -ENOTSUP;
+    }
+    s->write_cb = cb;
+    s->write_opaque = opaque;
+    fd_chr_update_handlers(chr);
+    return 0;
+}
+
 static void fd_chr_close(struct CharDriverState *chr)
 {
     FDCharDriver *s = chr->opaque;
 
+    if (s->fd_out >= 0 && s->fd_out != s->fd_in) {
+        qemu_set_fd_handler2(s->fd_out, NULL, NULL, NULL, NULL);
+    }
     if (s->fd_in >= 0) {
         if (display_type == DT_NOGRAPHIC && s->fd_in == 0) {
         } else {
@@ -629,7 +712,9 @@ static CharDriverState *qemu_chr_open_fd(int fd_in, int fd_out)
     s->fd_out = fd_out;
     chr->opaque = s;
     chr->chr_write = fd_chr_write;
-    chr->chr_update_read_handler = fd_chr_update_read_handler;
+    chr->chr_writev = fd_chr_writev;
+    chr->chr_notify_writable = fd_chr_notify_writable;
+    chr->chr_update_read_handler = fd_chr_update_handlers;
     chr->chr_close = fd_chr_close;
 
     qemu_chr_generic_open(chr);
@@ -2151,9 +2236,12 @@ typedef struct {
     int do_nodelay;
     int is_unix;
     int msgfd;
+    IOHandler *write_cb;
+    void *write_opaque;
 } TCPCharDriver;
 
 static void tcp_chr_accept(void *opaque);
+static void tcp_chr_update_handlers(CharDriverState *chr);
 
 static int tcp_chr_write(CharDriverState *chr, const uint8_t *buf, int len)
 {
@@ -2166,6 +2254,59 @@ static int tcp_chr_write(CharDriverState *chr, const uint8_t *buf, int len)
     }
 }
 
+static int tcp_chr_writev(CharDriverState *chr, struct iovec *iov, int iovcnt)
+{
+    TCPCharDriver *s = chr->opaque;
+    size_t len = iov_size(iov, iovcnt);
+    ssize_t ret;
+
+    if (!s->connected) {
+        /* XXX: indicate an error ? */
+        return len;
+    }
+    ret = iov_send(s->fd, iov, iovcnt, 0, len);
+    if (ret < 0) {
+        return errno == EAGAIN || errno == EWOULDBLOCK ? -EAGAIN : -errno;
+    }
+    return ret;
+}
+
+static void tcp_chr_write_ready(void *opaque)
+{
+    CharDriverState *chr = opaque;
+    TCPCharDriver *s = chr->opaque;
+    IOHandler *cb = s->write_cb;
+
+    s->write_cb = NULL;
+    tcp_chr_update_handlers(chr);
+    cb(s->write_opaque);
+}
+
+/* Writes are dropped while disconnected, so report the socket writable */
+static void tcp_chr_flush_write_cb(CharDriverState *chr)
+{
+    TCPCharDriver *s = chr->opaque;
+
+    if (s->write_cb) {
+        tcp_chr_write_ready(chr);
+    }
+}
+
+static int tcp_chr_notify_writable(CharDriverState *chr, IOHandler *cb,
+                                   void *opaque)
+{
+    TCPCharDriver *s = chr->opaque;
+
+    s->write_cb = cb;
+    s->write_opaque = opaque;
+    if (!s->connected) {
+        tcp_chr_flush_write_cb(chr);
+        return 0;
+    }
+    tcp_chr_update_handlers(chr);
+    return 0;
+}
+
 static int tcp_chr_read_poll(void *opaque)
 {
     CharDriverState *chr = opaque;
@@ -2322,6 +2463,7 @@ static void tcp_chr_read(void *opaque)
         closesocket(s->fd);
         s->fd = -1;
         qemu_chr_be_event(chr, CHR_EVENT_CLOSED);
+        tcp_chr_flush_write_cb(chr);
     } else if (size > 0) {
         if (s->do_telnetopt)
             tcp_chr_process_IAC_bytes(chr, s, buf, &size);
@@ -2337,16 +2479,23 @@ CharDriverState *qemu_chr_open_eventfd(int eventfd)
 }
 #endif
 
+static void tcp_chr_update_handlers(CharDriverState *chr)
+{
+    TCPCharDriver *s = chr->opaque;
+
+    if (s->connected && s->fd >= 0) {
+        qemu_set_fd_handler2(s->fd, tcp_chr_read_poll, tcp_chr_read,
+                             s->write_cb ? tcp_chr_write_ready : NULL, chr);
+    }
+}
+
 static void tcp_chr_connect(void *opaque)
 {
     CharDriverState *chr = opaque;
     TCPCharDriver *s = chr->opaque;
 
     s->connected = 1;
-    if (s->fd >= 0) {
-        qemu_set_fd_handler2(s->fd, tcp_chr_read_poll,
-                             tcp_chr_read, NULL, chr);
-    }
+    tcp_chr_update_handlers(chr);
     qemu_chr_generic_open(chr);
 }
 
@@ -2491,6 +2640,8 @@ static CharDriverState *qemu_chr_open_socket_fd(int fd, bool do_nodelay,
 
     chr->opaque = s;
     chr->chr_write = tcp_chr_write;
+    chr->chr_writev = tcp_chr_writev;
+    chr->chr_notify_writable = tcp_chr_notify_writable;
     chr->chr_close = tcp_chr_close;
     chr->get_msgfd = tcp_get_msgfd;
     chr->chr_add_client = tcp_chr_add_client;
@@ -3018,6 +3169,7 @@ CharDriverState *qemu_chr_new_from_opts(QemuOpts *opts,
                                     Error **errp)
 {
     CharDriverState *chr;
+    const char *owner;
     int i;
 
     if (qemu_opts_id(opts) == NULL) {
@@ -3040,7 +3192,9 @@ CharDriverState *qemu_chr_new_from_opts(QemuOpts *opts,
         goto err;
     }
 
+    owner = qemu_set_callback_owner(qemu_opts_id(opts));
     chr = backend_table[i].open(opts);
+    qemu_set_callback_owner(owner);
     if (!chr) {
         error_setg(errp, "chardev: opening backend \"%s\" failed",
                    qemu_opt_get(opts, "backend"));
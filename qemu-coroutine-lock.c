@@ -26,30 +26,26 @@
 #include "block/coroutine.h"
 #include "block/coroutine_int.h"
 #include "qemu/queue.h"
-#include "block/aio.h"
+#include "qemu/timer.h"
 #include "trace.h"
 
-static QTAILQ_HEAD(, Coroutine) unlock_bh_queue =
-    QTAILQ_HEAD_INITIALIZER(unlock_bh_queue);
-static QEMUBH* unlock_bh;
-
-static void qemu_co_queue_next_bh(void *opaque)
+void qemu_co_queue_init(CoQueue *queue)
 {
-    Coroutine *next;
-
-    trace_qemu_co_queue_next_bh();
-    while ((next = QTAILQ_FIRST(&unlock_bh_queue))) {
-        QTAILQ_REMOVE(&unlock_bh_queue, next, co_queue_next);
-        qemu_coroutine_enter(next, NULL);
-    }
+    QTAILQ_INIT(&queue->entries);
 }
 
-void qemu_co_queue_init(CoQueue *queue)
+/* Enter the coroutines that @co woke up, now that it has yielded or
+ * terminated.  This used to be a bottom half in the main loop, but waking
+ * up in the caller's thread is what lets coroutines run in any AioContext.
+ */
+void qemu_co_queue_run_restart(Coroutine *co)
 {
-    QTAILQ_INIT(&queue->entries);
+    Coroutine *next;
 
-    if (!unlock_bh) {
-        unlock_bh = qemu_bh_new(qemu_co_queue_next_bh, NULL);
+    while ((next = QTAILQ_FIRST(&co->co_queue_wakeup))) {
+        QTAILQ_REMOVE(&co->co_queue_wakeup, next, co_queue_next);
+        trace_qemu_co_queue_run_restart(co, next);
+        qemu_coroutine_enter(next, NULL);
     }
 }
 
@@ -76,9 +72,13 @@ bool qemu_co_queue_next(CoQueue *queue)
     next = QTAILQ_FIRST(&queue->entries);
     if (next) {
         QTAILQ_REMOVE(&queue->entries, next, co_queue_next);
-        QTAILQ_INSERT_TAIL(&unlock_bh_queue, next, co_queue_next);
         trace_qemu_co_queue_next(next);
-        qemu_bh_schedule(unlock_bh);
+        if (qemu_in_coroutine()) {
+            Coroutine *self = qemu_coroutine_self();
+            QTAILQ_INSERT_TAIL(&self->co_queue_wakeup, next, co_queue_next);
+        } else {
+            qemu_coroutine_enter(next, NULL);
+        }
     }
 
     return (next != NULL);
@@ -105,29 +105,43 @@ void qemu_co_mutex_init(CoMutex *mutex)
 void coroutine_fn qemu_co_mutex_lock(CoMutex *mutex)
 {
     Coroutine *self = qemu_coroutine_self();
+    int64_t start;
 
     trace_qemu_co_mutex_lock_entry(mutex, self);
 
-    while (mutex->locked) {
+    if (mutex->locked) {
+        /* qemu_co_mutex_unlock hands the mutex over without releasing it,
+         * so it is ours when we are woken up and nobody can barge in.
+         */
+        start = get_clock();
+        mutex->contended++;
         qemu_co_queue_wait(&mutex->queue);
+        assert(mutex->locked);
+        trace_qemu_co_mutex_lock_wait(mutex, self, get_clock() - start,
+                                      mutex->contended);
+    } else {
+        mutex->locked = true;
+        mutex->locked_at = get_clock();
     }
 
-    mutex->locked = true;
-
     trace_qemu_co_mutex_lock_return(mutex, self);
 }
 
 void coroutine_fn qemu_co_mutex_unlock(CoMutex *mutex)
 {
     Coroutine *self = qemu_coroutine_self();
+    int64_t now = get_clock();
 
     trace_qemu_co_mutex_unlock_entry(mutex, self);
 
     assert(mutex->locked == true);
     assert(qemu_in_coroutine());
 
-    mutex->locked = false;
-    qemu_co_queue_next(&mutex->queue);
+    trace_qemu_co_mutex_unlock_hold(mutex, self, now - mutex->locked_at);
+    mutex->locked_at = now;
+    if (!qemu_co_queue_next(&mutex->queue)) {
+        mutex->locked = false;
+    }
 
     trace_qemu_co_mutex_unlock_return(mutex, self);
 }
@@ -135,37 +149,89 @@ void coroutine_fn qemu_co_mutex_unlock(CoMutex *mutex)
 void qemu_co_rwlock_init(CoRwlock *lock)
 {
     memset(lock, 0, sizeof(*lock));
-    qemu_co_queue_init(&lock->queue);
+    qemu_co_queue_init(&lock->rqueue);
+    qemu_co_queue_init(&lock->wqueue);
 }
 
 void qemu_co_rwlock_rdlock(CoRwlock *lock)
 {
-    while (lock->writer) {
-        qemu_co_queue_wait(&lock->queue);
+    Coroutine *self = qemu_coroutine_self();
+    int64_t start;
+
+    if (lock->writer || lock->pending_writers) {
+        /* The writer that unlocks counts us in lock->reader.  */
+        start = get_clock();
+        lock->contended++;
+        qemu_co_queue_wait(&lock->rqueue);
+        assert(!lock->writer && lock->reader > 0);
+        trace_qemu_co_rwlock_rdlock_wait(lock, self, get_clock() - start,
+                                         lock->contended);
+        return;
+    }
+
+    if (lock->reader++ == 0) {
+        lock->locked_at = get_clock();
+    }
+}
+
+/* Hand the lock over to the next writer, if any */
+static void qemu_co_rwlock_wake_writer(CoRwlock *lock)
+{
+    if (qemu_co_queue_next(&lock->wqueue)) {
+        lock->pending_writers--;
+        lock->writer = true;
     }
-    lock->reader++;
 }
 
 void qemu_co_rwlock_unlock(CoRwlock *lock)
 {
+    Coroutine *self = qemu_coroutine_self();
+    int64_t now = get_clock();
+
     assert(qemu_in_coroutine());
     if (lock->writer) {
+        trace_qemu_co_rwlock_unlock_hold(lock, self, true,
+                                         now - lock->locked_at);
         lock->writer = false;
-        qemu_co_queue_restart_all(&lock->queue);
-    } else {
-        lock->reader--;
-        assert(lock->reader >= 0);
-        /* Wakeup only one waiting writer */
+        lock->locked_at = now;
+
+        /* Let in all the readers that queued up behind us first, then
+         * the next writer once they are done.
+         */
+        while (qemu_co_queue_next(&lock->rqueue)) {
+            lock->reader++;
+        }
         if (!lock->reader) {
-            qemu_co_queue_next(&lock->queue);
+            qemu_co_rwlock_wake_writer(lock);
+        }
+    } else {
+        assert(lock->reader > 0);
+        if (--lock->reader == 0) {
+            trace_qemu_co_rwlock_unlock_hold(lock, self, false,
+                                             now - lock->locked_at);
+            lock->locked_at = now;
+            qemu_co_rwlock_wake_writer(lock);
         }
     }
 }
 
 void qemu_co_rwlock_wrlock(CoRwlock *lock)
 {
-    while (lock->writer || lock->reader) {
-        qemu_co_queue_wait(&lock->queue);
+    Coroutine *self = qemu_coroutine_self();
+    int64_t start;
+
+    if (lock->writer || lock->reader) {
+        /* qemu_co_rwlock_unlock sets lock->writer for us.  */
+        start = get_clock();
+        lock->contended++;
+        lock->pending_writers++;
+        qemu_co_queue_wait(&lock->wqueue);
+        assert(lock->writer && !lock->reader);
+        trace_qemu_co_rwlock_wrlock_wait(lock, self, get_clock() - start,
+                                         lock->contended);
+        return;
     }
+
     lock->writer = true;
+    lock->locked_at = get_clock();
 }
@@ -14,55 +14,143 @@
 
 #include "trace.h"
 #include "qemu-common.h"
+#include "qemu/thread.h"
+#include "qemu/atomic.h"
 #include "block/coroutine.h"
 #include "block/coroutine_int.h"
 
 enum {
-    /* Maximum free pool size prevents holding too many freed coroutines */
-    POOL_MAX_SIZE = 64,
+    /* The free pools hold at least this many coroutines ... */
+    POOL_MIN_SIZE = 64,
+
+    /* ... and grow with the number of coroutines in use up to this one */
+    POOL_MAX_SIZE = 1024,
 };
 
-/** Free list to speed up creation */
-static QSLIST_HEAD(, Coroutine) pool = QSLIST_HEAD_INITIALIZER(pool);
-static unsigned int pool_size;
+typedef QSLIST_HEAD(, Coroutine) CoroutinePool;
 
-Coroutine *qemu_coroutine_create(CoroutineEntry *entry)
+/** Free list of each thread, used without locking */
+static __thread CoroutinePool alloc_pool;
+static __thread unsigned int alloc_pool_size;
+
+/** Free list shared by all threads, refills an empty alloc_pool at once */
+static QemuMutex pool_lock;
+static CoroutinePool release_pool = QSLIST_HEAD_INITIALIZER(release_pool);
+static unsigned int release_pool_size;
+
+/* Coroutines that are currently running or waiting.  pool_max_size
+ * follows its peak, so that a burst of requests as deep as the guest's
+ * queues does not create and delete coroutines over and over.
+ */
+static unsigned int coroutines_in_use;
+static unsigned int pool_max_size = POOL_MIN_SIZE;
+
+#ifndef _WIN32
+static pthread_key_t pool_key;
+
+/* Hand the free list of an exiting thread to the others */
+static void coroutine_pool_thread_cleanup(void *opaque)
 {
     Coroutine *co;
 
-    co = QSLIST_FIRST(&pool);
+    qemu_mutex_lock(&pool_lock);
+    while ((co = QSLIST_FIRST(&alloc_pool)) != NULL) {
+        QSLIST_REMOVE_HEAD(&alloc_pool, pool_next);
+        if (release_pool_size < pool_max_size) {
+            QSLIST_INSERT_HEAD(&release_pool, co, pool_next);
+            release_pool_size++;
+        } else {
+            qemu_coroutine_delete(co);
+        }
+    }
+    alloc_pool_size = 0;
+    qemu_mutex_unlock(&pool_lock);
+}
+#endif
+
+Coroutine *qemu_coroutine_create(CoroutineEntry *entry)
+{
+    Coroutine *co;
+    unsigned int in_use;
+
+    co = QSLIST_FIRST(&alloc_pool);
+    if (!co && release_pool_size) {
+        qemu_mutex_lock(&pool_lock);
+        alloc_pool = release_pool;
+        alloc_pool_size = release_pool_size;
+        QSLIST_INIT(&release_pool);
+        release_pool_size = 0;
+        qemu_mutex_unlock(&pool_lock);
+        co = QSLIST_FIRST(&alloc_pool);
+    }
     if (co) {
-        QSLIST_REMOVE_HEAD(&pool, pool_next);
-        pool_size--;
+        QSLIST_REMOVE_HEAD(&alloc_pool, pool_next);
+        alloc_pool_size--;
     } else {
         co = qemu_coroutine_new();
     }
 
+    in_use = atomic_fetch_add(&coroutines_in_use, 1) + 1;
+    if (in_use > pool_max_size && pool_max_size < POOL_MAX_SIZE) {
+        pool_max_size = MIN(in_use, POOL_MAX_SIZE);
+    }
+
     co->entry = entry;
+    QTAILQ_INIT(&co->co_queue_wakeup);
     return co;
 }
 
 static void coroutine_delete(Coroutine *co)
 {
-    if (pool_size < POOL_MAX_SIZE) {
-        QSLIST_INSERT_HEAD(&pool, co, pool_next);
-        co->caller = NULL;
-        pool_size++;
+    atomic_fetch_sub(&coroutines_in_use, 1);
+    co->caller = NULL;
+
+    if (alloc_pool_size < pool_max_size) {
+#ifndef _WIN32
+        if (QSLIST_EMPTY(&alloc_pool)) {
+            pthread_setspecific(pool_key, &alloc_pool);
+        }
+#endif
+        QSLIST_INSERT_HEAD(&alloc_pool, co, pool_next);
+        alloc_pool_size++;
         return;
     }
 
+    qemu_mutex_lock(&pool_lock);
+    if (release_pool_size < pool_max_size) {
+        QSLIST_INSERT_HEAD(&release_pool, co, pool_next);
+        release_pool_size++;
+        qemu_mutex_unlock(&pool_lock);
+        return;
+    }
+    qemu_mutex_unlock(&pool_lock);
+
     qemu_coroutine_delete(co);
 }
 
+static void __attribute__((constructor)) coroutine_pool_init(void)
+{
+    qemu_mutex_init(&pool_lock);
+#ifndef _WIN32
+    pthread_key_create(&pool_key, coroutine_pool_thread_cleanup);
+#endif
+}
+
 static void __attribute__((destructor)) coroutine_cleanup(void)
 {
     Coroutine *co;
     Coroutine *tmp;
 
-    QSLIST_FOREACH_SAFE(co, &pool, pool_next, tmp) {
-        QSLIST_REMOVE_HEAD(&pool, pool_next);
+    QSLIST_FOREACH_SAFE(co, &alloc_pool, pool_next, tmp) {
+        QSLIST_REMOVE_HEAD(&alloc_pool, pool_next);
+        qemu_coroutine_delete(co);
+    }
+    QSLIST_FOREACH_SAFE(co, &release_pool, pool_next, tmp) {
+        QSLIST_REMOVE_HEAD(&release_pool, pool_next);
         qemu_coroutine_delete(co);
     }
+
+    qemu_mutex_destroy(&pool_lock);
 }
 
 static void coroutine_swap(Coroutine *from, Coroutine *to)
@@ -71,6 +159,8 @@ static void coroutine_swap(Coroutine *from, Coroutine *to)
 
     ret = qemu_coroutine_switch(from, to, COROUTINE_YIELD);
 
+    qemu_co_queue_run_restart(to);
+
     switch (ret) {
     case COROUTINE_YIELD:
         return;
@@ -46,6 +46,8 @@ typedef struct img_cmd_t {
 enum {
     OPTION_OUTPUT = 256,
     OPTION_BACKING_CHAIN = 257,
+    OPTION_SCRUB = 258,
+    OPTION_PATTERN = 259,
 };
 
 typedef enum OutputFormat {
@@ -92,6 +94,8 @@ static void help(void)
            "    name=value format. Use -o ? for an overview of the options supported by the\n"
            "    used format\n"
            "  '-c' indicates that target image must be compressed (qcow format only)\n"
+           "  '-m' number of parallel coroutines for convert (1 to 16, default 8)\n"
+           "  '-W' allows convert to write out of order to the target\n"
            "  '-u' enables unsafe rebasing. It is assumed that old and new backing file\n"
            "       match exactly. The image doesn't need a working backing file before\n"
            "       rebasing in this case (useful for renaming the backing file)\n"
@@ -107,6 +111,8 @@ static void help(void)
            "       '-r leaks' repairs only cluster leaks, whereas '-r all' fixes all\n"
            "       kinds of errors, with a higher risk of choosing the wrong fix or\n"
            "       hiding corruption that has already occurred.\n"
+           "  '--scrub' also reads every allocated data cluster and reports those\n"
+           "       that cannot be read\n"
            "\n"
            "Parameters to snapshot subcommand:\n"
            "  'snapshot' is the name of the snapshot to create, apply or delete\n"
@@ -118,7 +124,15 @@ static void help(void)
            "Parameters to compare subcommand:\n"
            "  '-f' first image format\n"
            "  '-F' second image format\n"
-           "  '-s' run in Strict mode - fail on different image size or sector allocation\n";
+           "  '-s' run in Strict mode - fail on different image size or sector allocation\n"
+           "\n"
+           "Parameters to bench subcommand:\n"
+           "  '-c' number of requests to run\n"
+           "  '-d' number of requests in flight (1 to 256, default 8)\n"
+           "  '-s' size of each request in bytes (default 4k)\n"
+           "  '-T' duration in seconds (default 10 unless '-c' is given)\n"
+           "  '-w' percentage of requests that are writes (default 0)\n"
+           "  '--pattern' is 'seq' (default) or 'rand' for the request offsets\n";
 
     printf("%s\nSupported formats:", help_msg);
     bdrv_iterate_format(format_print, NULL);
@@ -526,6 +540,8 @@ static int img_check(int argc, char **argv)
     int flags = BDRV_O_FLAGS | BDRV_O_CHECK;
     ImageCheck *check;
     bool quiet = false;
+    int progress = 0;
+    int scrub = 0;
 
     fmt = NULL;
     output = NULL;
@@ -536,9 +552,10 @@ static int img_check(int argc, char **argv)
             {"format", required_argument, 0, 'f'},
             {"repair", no_argument, 0, 'r'},
             {"output", required_argument, 0, OPTION_OUTPUT},
+            {"scrub", no_argument, 0, OPTION_SCRUB},
             {0, 0, 0, 0}
         };
-        c = getopt_long(argc, argv, "f:hr:q",
+        c = getopt_long(argc, argv, "f:hr:pq",
                         long_options, &option_index);
         if (c == -1) {
             break;
@@ -565,6 +582,12 @@ static int img_check(int argc, char **argv)
         case OPTION_OUTPUT:
             output = optarg;
             break;
+        case OPTION_SCRUB:
+            scrub = BDRV_CHECK_SCRUB;
+            break;
+        case 'p':
+            progress = 1;
+            break;
         case 'q':
             quiet = true;
             break;
@@ -575,6 +598,10 @@ static int img_check(int argc, char **argv)
     }
     filename = argv[optind++];
 
+    if (quiet) {
+        progress = 0;
+    }
+
     if (output && !strcmp(output, "json")) {
         output_format = OFORMAT_JSON;
     } else if (output && !strcmp(output, "human")) {
@@ -590,7 +617,10 @@ static int img_check(int argc, char **argv)
     }
 
     check = g_new0(ImageCheck, 1);
-    ret = collect_image_check(bs, check, filename, fmt, fix);
+    qemu_progress_init(progress, 1.0);
+    qemu_progress_print(0, 100);
+    ret = collect_image_check(bs, check, filename, fmt, fix | scrub);
+    qemu_progress_end();
 
     if (ret == -ENOTSUP) {
         if (output_format == OFORMAT_HUMAN) {
@@ -740,6 +770,11 @@ static int is_allocated_sectors(const uint8_t *buf, int n, int *pnum)
         return 0;
     }
     is_zero = buffer_is_zero(buf, 512);
+    if (is_zero) {
+        /* the whole zero run at once, rounded down to full sectors */
+        *pnum = buffer_zero_run(buf, (size_t)n * 512) / 512;
+        return 0;
+    }
     for(i = 1; i < n; i++) {
         buf += 512;
         if (is_zero != buffer_is_zero(buf, 512)) {
@@ -835,6 +870,53 @@ static int64_t sectors_to_process(int64_t total, int64_t from)
     return MIN(total - from, IO_BUF_SIZE >> BDRV_SECTOR_BITS);
 }
 
+/*
+ * Allocation status of the sectors at @sector_num as they are read from
+ * @bs, that is from the first image of its backing chain that has them.
+ * Returns its BDRV_BLOCK_* flags, or -errno.  Sectors that are in none
+ * of the images, or beyond the end of a backing file, read as zeroes and
+ * get BDRV_BLOCK_ZERO only.
+ *
+ * *@pnum is set as by bdrv_get_block_status().  If @layer is not NULL,
+ * *@layer is set to the image and *@depth to its position in the chain.
+ */
+static int64_t get_block_status_chain(BlockDriverState *bs, int64_t sector_num,
+                                      int nb_sectors, int *pnum,
+                                      BlockDriverState **layer, int *depth)
+{
+    int64_t ret;
+    int d = 0;
+
+    for (;;) {
+        ret = bdrv_get_block_status(bs, sector_num, nb_sectors, pnum);
+        if (ret < 0) {
+            return ret;
+        }
+        if (*pnum == 0) {
+            /* beyond the end of a backing file */
+            *pnum = nb_sectors;
+            ret = BDRV_BLOCK_ZERO;
+            break;
+        }
+        if (ret & BDRV_BLOCK_ALLOCATED) {
+            break;
+        }
+        if (!bs->backing_hd) {
+            ret = BDRV_BLOCK_ZERO;
+            break;
+        }
+        nb_sectors = *pnum;
+        bs = bs->backing_hd;
+        d++;
+    }
+
+    if (layer) {
+        *layer = bs;
+        *depth = d;
+    }
+    return ret;
+}
+
 /*
  * Check if passed sectors are empty (not allocated or contain only 0 bytes)
  *
@@ -883,7 +965,7 @@ static int img_compare(int argc, char **argv)
     int64_t total_sectors1, total_sectors2;
     uint8_t *buf1 = NULL, *buf2 = NULL;
     int pnum1, pnum2;
-    int allocated1, allocated2;
+    int64_t status1, status2;
     int ret = 0; /* return value - 0 Ident, 1 Different, >1 Error */
     bool progress = false, quiet = false, strict = false;
     int64_t total_sectors;
@@ -972,63 +1054,39 @@ static int img_compare(int argc, char **argv)
         if (nb_sectors <= 0) {
             break;
         }
-        allocated1 = bdrv_is_allocated_above(bs1, NULL, sector_num, nb_sectors,
-                                             &pnum1);
-        if (allocated1 < 0) {
+        status1 = get_block_status_chain(bs1, sector_num, nb_sectors, &pnum1,
+                                         NULL, NULL);
+        if (status1 < 0) {
             ret = 3;
             error_report("Sector allocation test failed for %s", filename1);
             goto out;
         }
 
-        allocated2 = bdrv_is_allocated_above(bs2, NULL, sector_num, nb_sectors,
-                                             &pnum2);
-        if (allocated2 < 0) {
+        status2 = get_block_status_chain(bs2, sector_num, nb_sectors, &pnum2,
+                                         NULL, NULL);
+        if (status2 < 0) {
             ret = 3;
             error_report("Sector allocation test failed for %s", filename2);
             goto out;
         }
         nb_sectors = MIN(pnum1, pnum2);
 
-        if (allocated1 == allocated2) {
-            if (allocated1) {
-                ret = bdrv_read(bs1, sector_num, buf1, nb_sectors);
-                if (ret < 0) {
-                    error_report("Error while reading offset %" PRId64 " of %s:"
-                                 " %s", sectors_to_bytes(sector_num), filename1,
-                                 strerror(-ret));
-                    ret = 4;
-                    goto out;
-                }
-                ret = bdrv_read(bs2, sector_num, buf2, nb_sectors);
-                if (ret < 0) {
-                    error_report("Error while reading offset %" PRId64
-                                 " of %s: %s", sectors_to_bytes(sector_num),
-                                 filename2, strerror(-ret));
-                    ret = 4;
-                    goto out;
-                }
-                ret = compare_sectors(buf1, buf2, nb_sectors, &pnum);
-                if (ret || pnum != nb_sectors) {
-                    ret = 1;
-                    qprintf(quiet, "Content mismatch at offset %" PRId64 "!\n",
-                            sectors_to_bytes(
-                                ret ? sector_num : sector_num + pnum));
-                    goto out;
-                }
-            }
-        } else {
-            if (strict) {
-                ret = 1;
-                qprintf(quiet, "Strict mode: Offset %" PRId64
-                        " allocation mismatch!\n",
-                        sectors_to_bytes(sector_num));
-                goto out;
-            }
+        if (strict && (status1 & BDRV_BLOCK_ALLOCATED) !=
+                      (status2 & BDRV_BLOCK_ALLOCATED)) {
+            ret = 1;
+            qprintf(quiet, "Strict mode: Offset %" PRId64
+                    " allocation mismatch!\n",
+                    sectors_to_bytes(sector_num));
+            goto out;
+        }
 
-            if (allocated1) {
+        /* Ranges known to read as zeroes are not read */
+        if ((status1 & BDRV_BLOCK_ZERO) || (status2 & BDRV_BLOCK_ZERO)) {
+            ret = 0;
+            if (!(status1 & BDRV_BLOCK_ZERO)) {
                 ret = check_empty_sectors(bs1, sector_num, nb_sectors,
                                           filename1, buf1, quiet);
-            } else {
+            } else if (!(status2 & BDRV_BLOCK_ZERO)) {
                 ret = check_empty_sectors(bs2, sector_num, nb_sectors,
                                           filename2, buf1, quiet);
             }
@@ -1040,6 +1098,31 @@ static int img_compare(int argc, char **argv)
                 }
                 goto out;
             }
+        } else {
+            ret = bdrv_read(bs1, sector_num, buf1, nb_sectors);
+            if (ret < 0) {
+                error_report("Error while reading offset %" PRId64 " of %s:"
+                             " %s", sectors_to_bytes(sector_num), filename1,
+                             strerror(-ret));
+                ret = 4;
+                goto out;
+            }
+            ret = bdrv_read(bs2, sector_num, buf2, nb_sectors);
+            if (ret < 0) {
+                error_report("Error while reading offset %" PRId64
+                             " of %s: %s", sectors_to_bytes(sector_num),
+                             filename2, strerror(-ret));
+                ret = 4;
+                goto out;
+            }
+            ret = compare_sectors(buf1, buf2, nb_sectors, &pnum);
+            if (ret || pnum != nb_sectors) {
+                ret = 1;
+                qprintf(quiet, "Content mismatch at offset %" PRId64 "!\n",
+                        sectors_to_bytes(
+                            ret ? sector_num : sector_num + pnum));
+                goto out;
+            }
         }
         sector_num += nb_sectors;
         qemu_progress_print(((float) nb_sectors / progress_base)*100, 100);
@@ -1066,9 +1149,9 @@ static int img_compare(int argc, char **argv)
             if (nb_sectors <= 0) {
                 break;
             }
-            ret = bdrv_is_allocated_above(bs_over, NULL, sector_num,
-                                          nb_sectors, &pnum);
-            if (ret < 0) {
+            status1 = get_block_status_chain(bs_over, sector_num, nb_sectors,
+                                             &pnum, NULL, NULL);
+            if (status1 < 0) {
                 ret = 3;
                 error_report("Sector allocation test failed for %s",
                              filename_over);
@@ -1076,7 +1159,7 @@ static int img_compare(int argc, char **argv)
 
             }
             nb_sectors = pnum;
-            if (ret) {
+            if (!(status1 & BDRV_BLOCK_ZERO)) {
                 ret = check_empty_sectors(bs_over, sector_num, nb_sectors,
                                           filename_over, buf1, quiet);
                 if (ret) {
@@ -1108,17 +1191,327 @@ out3:
     return ret;
 }
 
+/* Number of compressed clusters that convert keeps in flight */
+#define COMPRESS_IN_FLIGHT 16
+
+typedef struct CompressedWrite {
+    uint8_t *buf;
+    struct iovec iov;
+    QEMUIOVector qiov;
+    int64_t sector_num;
+    bool in_flight;
+    int ret;
+} CompressedWrite;
+
+static void compressed_write_cb(void *opaque, int ret)
+{
+    CompressedWrite *cw = opaque;
+
+    cw->ret = ret;
+    cw->in_flight = false;
+}
+
+/* Wait for @cw to complete and report its error, if any */
+static int compressed_write_wait(CompressedWrite *cw)
+{
+    int ret;
+
+    while (cw->in_flight) {
+        qemu_aio_wait();
+    }
+    ret = cw->ret;
+    cw->ret = 0;
+    if (ret < 0) {
+        error_report("error while compressing sector %" PRId64
+                     ": %s", cw->sector_num, strerror(-ret));
+    }
+    return ret;
+}
+
+static int compressed_write_wait_all(CompressedWrite *cw)
+{
+    int i, ret = 0;
+
+    for (i = 0; i < COMPRESS_IN_FLIGHT; i++) {
+        if (compressed_write_wait(&cw[i]) < 0) {
+            ret = -1;
+        }
+    }
+    return ret;
+}
+
+/* Number of coroutines, and so of requests in flight, used by convert */
+#define CONVERT_COROUTINES_DEFAULT 8
+#define CONVERT_COROUTINES_MAX     16
+
+typedef struct ImgConvertState {
+    BlockDriverState **src;
+    int src_num;
+    BlockDriverState *target;
+    int64_t total_sectors;
+    bool has_zero_init;
+    /* Unallocated source sectors are left to the target's backing file */
+    bool target_has_backing;
+    int min_sparse;
+    float local_progress;
+
+    /* Next sector to hand out and the source image that contains it */
+    CoMutex lock;
+    int64_t sector_num;
+    int src_cur;
+    int64_t src_cur_offset;
+    uint64_t src_cur_sectors;
+
+    /* Chunks get increasing tickets; with in-order writes, the write of a
+     * chunk only starts after that of the previous ticket has completed */
+    bool wr_in_order;
+    uint64_t next_ticket;
+    uint64_t wr_ticket;
+
+    int num_coroutines;
+    int running_coroutines;
+    Coroutine *co[CONVERT_COROUTINES_MAX];
+    bool waiting[CONVERT_COROUTINES_MAX];
+    uint64_t wait_ticket[CONVERT_COROUTINES_MAX];
+    int ret;
+} ImgConvertState;
+
+typedef struct ImgConvertChunk {
+    int64_t sector_num;
+    int nb_sectors;
+    int src;
+    int64_t src_sector;
+    bool zero;
+    uint64_t ticket;
+} ImgConvertChunk;
+
+/* Hand out the next chunk to copy.  It is at most IO_BUF_SIZE and lies
+ * within a single source image.  Returns false once everything has been
+ * handed out or after an error.
+ */
+static bool coroutine_fn convert_next_chunk(ImgConvertState *s,
+                                            ImgConvertChunk *chunk)
+{
+    bool found = false;
+
+    qemu_co_mutex_lock(&s->lock);
+    while (!s->ret && s->sector_num < s->total_sectors) {
+        int64_t src_sector, status;
+        int n, n1;
+        bool zero;
+
+        while (s->sector_num - s->src_cur_offset >= s->src_cur_sectors) {
+            s->src_cur++;
+            assert(s->src_cur < s->src_num);
+            s->src_cur_offset += s->src_cur_sectors;
+            bdrv_get_geometry(s->src[s->src_cur], &s->src_cur_sectors);
+        }
+
+        src_sector = s->sector_num - s->src_cur_offset;
+        n = MIN(s->total_sectors - s->sector_num, IO_BUF_SIZE / 512);
+        n = MIN(n, s->src_cur_sectors - src_sector);
+
+        if (s->target_has_backing) {
+            /* Copy only the allocated sectors, those that are unallocated
+               are present in both the output's and input's base images. */
+            status = bdrv_co_get_block_status(s->src[s->src_cur], src_sector,
+                                              n, &n1);
+        } else {
+            status = get_block_status_chain(s->src[s->src_cur], src_sector,
+                                            n, &n1, NULL, NULL);
+        }
+        if (status < 0) {
+            error_report("error while reading sector %" PRId64 ": %s",
+                         src_sector, strerror(-status));
+            s->ret = status;
+            break;
+        }
+        if (s->target_has_backing && !(status & BDRV_BLOCK_ALLOCATED)) {
+            s->sector_num += n1;
+            continue;
+        }
+        n = n1;
+
+        /* Zeroes that the sparse detection would skip are not even read */
+        zero = !!(status & BDRV_BLOCK_ZERO);
+        if (zero && s->has_zero_init && !s->target_has_backing &&
+            n >= s->min_sparse) {
+            s->sector_num += n;
+            continue;
+        }
+
+        chunk->sector_num = s->sector_num;
+        chunk->nb_sectors = n;
+        chunk->src = s->src_cur;
+        chunk->src_sector = src_sector;
+        chunk->zero = zero;
+        chunk->ticket = s->next_ticket++;
+        s->sector_num += n;
+        found = true;
+        break;
+    }
+    qemu_co_mutex_unlock(&s->lock);
+    return found;
+}
+
+/* Write a chunk to the target; a NULL @buf stands for zeroes */
+static int coroutine_fn convert_co_write(ImgConvertState *s,
+                                         int64_t sector_num, int nb_sectors,
+                                         uint8_t *buf)
+{
+    QEMUIOVector qiov;
+    struct iovec iov;
+    int n, ret;
+
+    while (nb_sectors > 0) {
+        n = nb_sectors;
+        if (buf && is_allocated_sectors_min(buf, nb_sectors, &n,
+                                            s->min_sparse)) {
+            iov.iov_base = buf;
+            iov.iov_len = n * BDRV_SECTOR_SIZE;
+            qemu_iovec_init_external(&qiov, &iov, 1);
+            ret = bdrv_co_writev(s->target, sector_num, n, &qiov);
+        } else if (!s->has_zero_init || s->target_has_backing) {
+            /* If the output image is being created as a copy on write
+               image, zero sectors must be written because they may differ
+               from the sectors in the base image.
+
+               If the output is to a host device, we also write out
+               sectors that are entirely 0, since whatever data was
+               already there is garbage, not 0s.
+
+               In both cases the target may unmap them as long as they
+               read back as zeroes. */
+            ret = bdrv_co_write_zeroes(s->target, sector_num, n,
+                                       BDRV_REQ_MAY_UNMAP);
+        } else {
+            ret = 0;
+        }
+        if (ret < 0) {
+            error_report("error while writing sector %" PRId64
+                         ": %s", sector_num, strerror(-ret));
+            return ret;
+        }
+        sector_num += n;
+        nb_sectors -= n;
+        if (buf) {
+            buf += n * BDRV_SECTOR_SIZE;
+        }
+    }
+    return 0;
+}
+
+/* Resume the coroutines whose turn to write has come, or all of them
+ * after an error */
+static void coroutine_fn convert_wake_writers(ImgConvertState *s)
+{
+    int i;
+
+    for (i = 0; i < s->num_coroutines; i++) {
+        if (s->waiting[i] && (s->ret || s->wait_ticket[i] == s->wr_ticket)) {
+            s->waiting[i] = false;
+            qemu_coroutine_enter(s->co[i], NULL);
+        }
+    }
+}
+
+static void coroutine_fn convert_co_do_copy(void *opaque)
+{
+    ImgConvertState *s = opaque;
+    ImgConvertChunk chunk;
+    uint8_t *buf;
+    int index;
+
+    for (index = 0; s->co[index] != qemu_coroutine_self(); index++) {
+        /* nothing */
+    }
+    buf = qemu_blockalign(s->target, IO_BUF_SIZE);
+
+    while (convert_next_chunk(s, &chunk)) {
+        QEMUIOVector qiov;
+        struct iovec iov = {
+            .iov_base = buf,
+            .iov_len = chunk.nb_sectors * BDRV_SECTOR_SIZE,
+        };
+        int ret;
+
+        /* Reads are never ordered, so they overlap with the writes of
+         * the other coroutines */
+        if (chunk.zero) {
+            ret = 0;
+        } else {
+            qemu_iovec_init_external(&qiov, &iov, 1);
+            ret = bdrv_co_readv(s->src[chunk.src], chunk.src_sector,
+                                chunk.nb_sectors, &qiov);
+            if (ret < 0) {
+                error_report("error while reading sector %" PRId64 ": %s",
+                             chunk.src_sector, strerror(-ret));
+            }
+        }
+
+        if (s->wr_in_order) {
+            while (!s->ret && s->wr_ticket != chunk.ticket) {
+                s->waiting[index] = true;
+                s->wait_ticket[index] = chunk.ticket;
+                qemu_coroutine_yield();
+            }
+        }
+        if (!ret && !s->ret) {
+            ret = convert_co_write(s, chunk.sector_num, chunk.nb_sectors,
+                                   chunk.zero ? NULL : buf);
+        }
+        if (ret < 0 && !s->ret) {
+            s->ret = ret;
+        }
+        if (s->wr_in_order) {
+            s->wr_ticket = chunk.ticket + 1;
+            convert_wake_writers(s);
+        }
+        qemu_progress_print(s->local_progress, 100);
+    }
+
+    qemu_vfree(buf);
+    s->co[index] = NULL;
+    s->running_coroutines--;
+}
+
+/* Copy all of the source images to the target, with up to
+ * s->num_coroutines reads and writes in flight */
+static int convert_do_copy(ImgConvertState *s)
+{
+    int i;
+
+    qemu_co_mutex_init(&s->lock);
+    bdrv_get_geometry(s->src[0], &s->src_cur_sectors);
+    if (s->total_sectors) {
+        s->local_progress = (float)100 /
+            (s->total_sectors / MIN(s->total_sectors, IO_BUF_SIZE / 512));
+    }
+
+    /* Create them all first, a coroutine looks itself up in s->co */
+    for (i = 0; i < s->num_coroutines; i++) {
+        s->co[i] = qemu_coroutine_create(convert_co_do_copy);
+    }
+    s->running_coroutines = s->num_coroutines;
+    for (i = 0; i < s->num_coroutines; i++) {
+        qemu_coroutine_enter(s->co[i], s);
+    }
+    while (s->running_coroutines) {
+        qemu_aio_wait();
+    }
+    return s->ret;
+}
+
 static int img_convert(int argc, char **argv)
 {
-    int c, ret = 0, n, n1, bs_n, bs_i, compress, cluster_size, cluster_sectors;
-    int progress = 0, flags;
+    int c, ret = 0, n, bs_n, bs_i, compress, cluster_size, cluster_sectors;
+    int progress = 0, flags, i;
     const char *fmt, *out_fmt, *cache, *out_baseimg, *out_filename;
     BlockDriver *drv, *proto_drv;
     BlockDriverState **bs = NULL, *out_bs = NULL;
     int64_t total_sectors, nb_sectors, sector_num, bs_offset;
     uint64_t bs_sectors;
-    uint8_t * buf = NULL;
-    const uint8_t *buf1;
+    CompressedWrite *cw = NULL;
     BlockDriverInfo bdi;
     QEMUOptionParameter *param = NULL, *create_options = NULL;
     QEMUOptionParameter *out_baseimg_param;
@@ -1127,6 +1520,8 @@ static int img_convert(int argc, char **argv)
     float local_progress = 0;
     int min_sparse = 8; /* Need at least 4k of zeros for sparse detection */
     bool quiet = false;
+    int num_coroutines = CONVERT_COROUTINES_DEFAULT;
+    bool wr_in_order = true;
 
     fmt = NULL;
     out_fmt = "raw";
@@ -1134,7 +1529,7 @@ static int img_convert(int argc, char **argv)
     out_baseimg = NULL;
     compress = 0;
     for(;;) {
-        c = getopt(argc, argv, "f:O:B:s:hce6o:pS:t:q");
+        c = getopt(argc, argv, "f:O:B:s:hce6o:pS:t:qm:W");
         if (c == -1) {
             break;
         }
@@ -1191,6 +1586,23 @@ static int img_convert(int argc, char **argv)
         case 'q':
             quiet = true;
             break;
+        case 'm':
+        {
+            char *end;
+
+            errno = 0;
+            num_coroutines = strtol(optarg, &end, 10);
+            if (errno || *end || num_coroutines < 1 ||
+                num_coroutines > CONVERT_COROUTINES_MAX) {
+                error_report("Invalid number of coroutines, it must be "
+                             "between 1 and %d", CONVERT_COROUTINES_MAX);
+                return 1;
+            }
+            break;
+        }
+        case 'W':
+            wr_in_order = false;
+            break;
         }
     }
 
@@ -1198,6 +1610,12 @@ static int img_convert(int argc, char **argv)
         progress = 0;
     }
 
+    if (!wr_in_order && compress) {
+        error_report("Out of order writes and compression cannot be used "
+                     "at the same time");
+        return 1;
+    }
+
     bs_n = argc - optind - 1;
     if (bs_n < 1) {
         help();
@@ -1300,7 +1718,7 @@ static int img_convert(int argc, char **argv)
         QEMUOptionParameter *preallocation =
             get_option_parameter(param, BLOCK_OPT_PREALLOC);
 
-        if (!drv->bdrv_write_compressed) {
+        if (!bdrv_can_write_compressed(drv)) {
             error_report("Compression not supported for this file format");
             ret = -1;
             goto out;
@@ -1355,7 +1773,6 @@ static int img_convert(int argc, char **argv)
     bs_i = 0;
     bs_offset = 0;
     bdrv_get_geometry(bs[0], &bs_sectors);
-    buf = qemu_blockalign(out_bs, IO_BUF_SIZE);
 
     if (compress) {
         ret = bdrv_get_info(out_bs, &bdi);
@@ -1372,13 +1789,19 @@ static int img_convert(int argc, char **argv)
         cluster_sectors = cluster_size >> 9;
         sector_num = 0;
 
+        /* the clusters are compressed in parallel and written in order */
+        cw = g_new0(CompressedWrite, COMPRESS_IN_FLIGHT);
+        for (i = 0; i < COMPRESS_IN_FLIGHT; i++) {
+            cw[i].buf = qemu_blockalign(out_bs, cluster_size);
+        }
+
         nb_sectors = total_sectors;
         if (nb_sectors != 0) {
             local_progress = (float)100 /
                 (nb_sectors / MIN(nb_sectors, cluster_sectors));
         }
 
-        for(;;) {
+        for(i = 0;; i = (i + 1) % COMPRESS_IN_FLIGHT) {
             int64_t bs_num;
             int remainder;
             uint8_t *buf2;
@@ -1391,10 +1814,15 @@ static int img_convert(int argc, char **argv)
             else
                 n = nb_sectors;
 
+            if (compressed_write_wait(&cw[i]) < 0) {
+                ret = -1;
+                goto out;
+            }
+
             bs_num = sector_num - bs_offset;
             assert (bs_num >= 0);
             remainder = n;
-            buf2 = buf;
+            buf2 = cw[i].buf;
             while (remainder > 0) {
                 int nlow;
                 while (bs_num == bs_sectors) {
@@ -1426,118 +1854,55 @@ static int img_convert(int argc, char **argv)
             assert (remainder == 0);
 
             if (n < cluster_sectors) {
-                memset(buf + n * 512, 0, cluster_size - n * 512);
+                memset(cw[i].buf + n * 512, 0, cluster_size - n * 512);
             }
-            if (!buffer_is_zero(buf, cluster_size)) {
-                ret = bdrv_write_compressed(out_bs, sector_num, buf,
-                                            cluster_sectors);
-                if (ret != 0) {
-                    error_report("error while compressing sector %" PRId64
-                                 ": %s", sector_num, strerror(-ret));
-                    goto out;
-                }
+            if (!buffer_is_zero(cw[i].buf, cluster_size)) {
+                cw[i].iov.iov_base = cw[i].buf;
+                cw[i].iov.iov_len = cluster_size;
+                qemu_iovec_init_external(&cw[i].qiov, &cw[i].iov, 1);
+                cw[i].sector_num = sector_num;
+                cw[i].in_flight = true;
+                bdrv_aio_write_compressed(out_bs, sector_num, &cw[i].qiov,
+                                          cluster_sectors,
+                                          compressed_write_cb, &cw[i]);
             }
             sector_num += n;
             qemu_progress_print(local_progress, 100);
         }
+        if (compressed_write_wait_all(cw) < 0) {
+            ret = -1;
+            goto out;
+        }
         /* signal EOF to align */
         bdrv_write_compressed(out_bs, 0, NULL, 0);
     } else {
-        int has_zero_init = bdrv_has_zero_init(out_bs);
-
-        sector_num = 0; // total number of sectors converted so far
-        nb_sectors = total_sectors - sector_num;
-        if (nb_sectors != 0) {
-            local_progress = (float)100 /
-                (nb_sectors / MIN(nb_sectors, IO_BUF_SIZE / 512));
-        }
-
-        for(;;) {
-            nb_sectors = total_sectors - sector_num;
-            if (nb_sectors <= 0) {
-                break;
-            }
-            if (nb_sectors >= (IO_BUF_SIZE / 512)) {
-                n = (IO_BUF_SIZE / 512);
-            } else {
-                n = nb_sectors;
-            }
-
-            while (sector_num - bs_offset >= bs_sectors) {
-                bs_i ++;
-                assert (bs_i < bs_n);
-                bs_offset += bs_sectors;
-                bdrv_get_geometry(bs[bs_i], &bs_sectors);
-                /* printf("changing part: sector_num=%" PRId64 ", bs_i=%d, "
-                  "bs_offset=%" PRId64 ", bs_sectors=%" PRId64 "\n",
-                   sector_num, bs_i, bs_offset, bs_sectors); */
-            }
-
-            if (n > bs_offset + bs_sectors - sector_num) {
-                n = bs_offset + bs_sectors - sector_num;
-            }
-
-            if (has_zero_init) {
-                /* If the output image is being created as a copy on write image,
-                   assume that sectors which are unallocated in the input image
-                   are present in both the output's and input's base images (no
-                   need to copy them). */
-                if (out_baseimg) {
-                    if (!bdrv_is_allocated(bs[bs_i], sector_num - bs_offset,
-                                           n, &n1)) {
-                        sector_num += n1;
-                        continue;
-                    }
-                    /* The next 'n1' sectors are allocated in the input image. Copy
-                       only those as they may be followed by unallocated sectors. */
-                    n = n1;
-                }
-            } else {
-                n1 = n;
-            }
+        ImgConvertState state = {
+            .src = bs,
+            .src_num = bs_n,
+            .target = out_bs,
+            .total_sectors = total_sectors,
+            .has_zero_init = bdrv_has_zero_init(out_bs),
+            .min_sparse = min_sparse,
+            .wr_in_order = wr_in_order,
+            .num_coroutines = num_coroutines,
+        };
 
-            ret = bdrv_read(bs[bs_i], sector_num - bs_offset, buf, n);
-            if (ret < 0) {
-                error_report("error while reading sector %" PRId64 ": %s",
-                             sector_num - bs_offset, strerror(-ret));
-                goto out;
-            }
-            /* NOTE: at the same time we convert, we do not write zero
-               sectors to have a chance to compress the image. Ideally, we
-               should add a specific call to have the info to go faster */
-            buf1 = buf;
-            while (n > 0) {
-                /* If the output image is being created as a copy on write image,
-                   copy all sectors even the ones containing only NUL bytes,
-                   because they may differ from the sectors in the base image.
-
-                   If the output is to a host device, we also write out
-                   sectors that are entirely 0, since whatever data was
-                   already there is garbage, not 0s. */
-                if (!has_zero_init || out_baseimg ||
-                    is_allocated_sectors_min(buf1, n, &n1, min_sparse)) {
-                    ret = bdrv_write(out_bs, sector_num, buf1, n1);
-                    if (ret < 0) {
-                        error_report("error while writing sector %" PRId64
-                                     ": %s", sector_num, strerror(-ret));
-                        goto out;
-                    }
-                }
-                sector_num += n1;
-                n -= n1;
-                buf1 += n1 * 512;
-            }
-            qemu_progress_print(local_progress, 100);
-        }
+        state.target_has_backing = state.has_zero_init && out_baseimg;
+        ret = convert_do_copy(&state);
     }
 out:
     qemu_progress_end();
     free_option_parameters(create_options);
     free_option_parameters(param);
-    qemu_vfree(buf);
     if (out_bs) {
         bdrv_delete(out_bs);
     }
+    if (cw) {
+        for (i = 0; i < COMPRESS_IN_FLIGHT; i++) {
+            qemu_vfree(cw[i].buf);
+        }
+        g_free(cw);
+    }
     if (bs) {
         for (bs_i = 0; bs_i < bs_n; bs_i++) {
             if (bs[bs_i]) {
@@ -1922,6 +2287,176 @@ static int img_info(int argc, char **argv)
     return 0;
 }
 
+typedef struct MapEntry {
+    int64_t flags;
+    int depth;
+    int64_t start;
+    int64_t length;
+    int64_t offset;
+    BlockDriverState *bs;
+} MapEntry;
+
+static int dump_map_entry(OutputFormat output_format, MapEntry *e,
+                          bool last)
+{
+    switch (output_format) {
+    case OFORMAT_HUMAN:
+        /* Only data stored as is in a file can be shown, zeroes and
+         * unallocated areas are left out */
+        if ((e->flags & (BDRV_BLOCK_DATA | BDRV_BLOCK_ZERO)) ==
+            BDRV_BLOCK_DATA) {
+            if (!(e->flags & BDRV_BLOCK_OFFSET_VALID)) {
+                error_report("File contains external, encrypted or "
+                             "compressed clusters.");
+                return -1;
+            }
+            printf("%#-16" PRIx64 "%#-16" PRIx64 "%#-16" PRIx64 "%s\n",
+                   e->start, e->length, e->offset, e->bs->filename);
+        }
+        break;
+    case OFORMAT_JSON:
+        printf("%s{ \"start\": %" PRId64 ", \"length\": %" PRId64 ","
+               " \"depth\": %d, \"zero\": %s, \"data\": %s",
+               e->start == 0 ? "[" : ",\n",
+               e->start, e->length, e->depth,
+               (e->flags & BDRV_BLOCK_ZERO) ? "true" : "false",
+               (e->flags & BDRV_BLOCK_DATA) ? "true" : "false");
+        if (e->flags & BDRV_BLOCK_OFFSET_VALID) {
+            printf(", \"offset\": %" PRId64, e->offset);
+        }
+        printf(" }");
+        if (last) {
+            printf("]\n");
+        }
+        break;
+    }
+    return 0;
+}
+
+/* Whether @next continues @e in the same file and with the same status */
+static bool map_entry_mergeable(MapEntry *e, MapEntry *next)
+{
+    if (e->flags != next->flags || e->depth != next->depth ||
+        e->bs != next->bs) {
+        return false;
+    }
+    return !(e->flags & BDRV_BLOCK_OFFSET_VALID) ||
+           e->offset + e->length == next->offset;
+}
+
+static int img_map(int argc, char **argv)
+{
+    int c;
+    OutputFormat output_format = OFORMAT_HUMAN;
+    BlockDriverState *bs;
+    const char *filename, *fmt, *output;
+    int64_t length;
+    MapEntry curr = { .length = 0 }, next;
+    int ret = 0;
+
+    fmt = NULL;
+    output = NULL;
+    for (;;) {
+        int option_index = 0;
+        static const struct option long_options[] = {
+            {"help", no_argument, 0, 'h'},
+            {"format", required_argument, 0, 'f'},
+            {"output", required_argument, 0, OPTION_OUTPUT},
+            {0, 0, 0, 0}
+        };
+        c = getopt_long(argc, argv, "f:h",
+                        long_options, &option_index);
+        if (c == -1) {
+            break;
+        }
+        switch (c) {
+        case '?':
+        case 'h':
+            help();
+            break;
+        case 'f':
+            fmt = optarg;
+            break;
+        case OPTION_OUTPUT:
+            output = optarg;
+            break;
+        }
+    }
+    if (optind >= argc) {
+        help();
+    }
+    filename = argv[optind++];
+
+    if (output && !strcmp(output, "json")) {
+        output_format = OFORMAT_JSON;
+    } else if (output && !strcmp(output, "human")) {
+        output_format = OFORMAT_HUMAN;
+    } else if (output) {
+        error_report("--output must be used with human or json as argument.");
+        return 1;
+    }
+
+    bs = bdrv_new_open(filename, fmt, BDRV_O_FLAGS, true, false);
+    if (!bs) {
+        return 1;
+    }
+
+    if (output_format == OFORMAT_HUMAN) {
+        printf("%-16s%-16s%-16s%s\n", "Offset", "Length", "Mapped to", "File");
+    }
+
+    length = bdrv_getlength(bs);
+    while (curr.start + curr.length < length) {
+        int64_t sector_num = (curr.start + curr.length) >> BDRV_SECTOR_BITS;
+        int64_t status;
+        int nb_sectors, pnum;
+
+        /* Probe at most 1 GB at a time, the L2 scans of a large image
+         * would take too long otherwise */
+        nb_sectors = MIN(1 << (30 - BDRV_SECTOR_BITS),
+                         (length >> BDRV_SECTOR_BITS) - sector_num);
+        status = get_block_status_chain(bs, sector_num, nb_sectors, &pnum,
+                                        &next.bs, &next.depth);
+        if (status < 0) {
+            error_report("Could not read file metadata: %s", strerror(-status));
+            ret = -1;
+            goto out;
+        }
+
+        next.flags = status & ~BDRV_BLOCK_OFFSET_MASK;
+        next.offset = status & BDRV_BLOCK_OFFSET_MASK;
+        next.start = sector_num << BDRV_SECTOR_BITS;
+        next.length = (int64_t)pnum << BDRV_SECTOR_BITS;
+        if (output_format == OFORMAT_HUMAN &&
+            (next.flags & (BDRV_BLOCK_DATA | BDRV_BLOCK_ZERO)) !=
+            BDRV_BLOCK_DATA) {
+            /* Holes, zeroes and unallocated areas all look the same here */
+            next.flags = BDRV_BLOCK_ZERO;
+            next.offset = 0;
+            next.depth = 0;
+            next.bs = NULL;
+        }
+
+        if (curr.length && map_entry_mergeable(&curr, &next)) {
+            curr.length += next.length;
+            continue;
+        }
+        if (curr.length && dump_map_entry(output_format, &curr, false) < 0) {
+            ret = -1;
+            goto out;
+        }
+        curr = next;
+    }
+
+    if (curr.length) {
+        ret = dump_map_entry(output_format, &curr, true);
+    }
+
+out:
+    bdrv_delete(bs);
+    return ret < 0;
+}
+
 #define SNAPSHOT_LIST   1
 #define SNAPSHOT_CREATE 2
 #define SNAPSHOT_APPLY  3
@@ -2044,6 +2579,26 @@ static int img_snapshot(int argc, char **argv)
     return 0;
 }
 
+/* Read up to *@n sectors, or fill them with zeroes if that is what the
+ * image has there.  *@n is reduced to what was read. */
+static int rebase_read(BlockDriverState *bs, int64_t sector_num, uint8_t *buf,
+                       int *n)
+{
+    int64_t status;
+    int pnum;
+
+    status = get_block_status_chain(bs, sector_num, *n, &pnum, NULL, NULL);
+    if (status < 0) {
+        return status;
+    }
+    *n = pnum;
+    if (status & BDRV_BLOCK_ZERO) {
+        memset(buf, 0, pnum * BDRV_SECTOR_SIZE);
+        return 0;
+    }
+    return bdrv_read(bs, sector_num, buf, pnum);
+}
+
 static int img_rebase(int argc, char **argv)
 {
     BlockDriverState *bs, *bs_old_backing = NULL, *bs_new_backing = NULL;
@@ -2233,7 +2788,7 @@ static int img_rebase(int argc, char **argv)
                     n = old_backing_num_sectors - sector;
                 }
 
-                ret = bdrv_read(bs_old_backing, sector, buf_old, n);
+                ret = rebase_read(bs_old_backing, sector, buf_old, &n);
                 if (ret < 0) {
                     error_report("error while reading from old backing file");
                     goto out;
@@ -2247,7 +2802,7 @@ static int img_rebase(int argc, char **argv)
                     n = new_backing_num_sectors - sector;
                 }
 
-                ret = bdrv_read(bs_new_backing, sector, buf_new, n);
+                ret = rebase_read(bs_new_backing, sector, buf_new, &n);
                 if (ret < 0) {
                     error_report("error while reading from new backing file");
                     goto out;
@@ -2450,6 +3005,374 @@ out:
     return 0;
 }
 
+/* Latencies are kept in a histogram with 32 linear buckets per power of
+ * two, which is within about 3% of the exact value */
+#define BENCH_LAT_SUB_BITS  5
+#define BENCH_LAT_BUCKETS   ((64 - BENCH_LAT_SUB_BITS + 1) << BENCH_LAT_SUB_BITS)
+
+#define BENCH_DEPTH_DEFAULT 8
+#define BENCH_DEPTH_MAX     256
+#define BENCH_TIME_DEFAULT  10
+
+typedef struct BenchLatency {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+    uint64_t buckets[BENCH_LAT_BUCKETS];
+} BenchLatency;
+
+typedef struct BenchState {
+    BlockDriverState *bs;
+    int64_t nb_blocks;
+    int block_sectors;
+    bool random;
+    int write_percent;
+    uint64_t rand_state;
+
+    /* Requests are started until either limit is reached */
+    uint64_t count;
+    int64_t deadline;
+    uint64_t started;
+
+    /* Next block of a sequential run */
+    int64_t next_block;
+
+    int depth;
+    int running;
+    int ret;
+    BenchLatency lat[2];
+} BenchState;
+
+static int bench_lat_bucket(uint64_t ns)
+{
+    int e;
+
+    if (ns < (1 << BENCH_LAT_SUB_BITS)) {
+        return ns;
+    }
+    e = 63 - clz64(ns);
+    return ((e - BENCH_LAT_SUB_BITS + 1) << BENCH_LAT_SUB_BITS) |
+           ((ns >> (e - BENCH_LAT_SUB_BITS)) &
+            ((1 << BENCH_LAT_SUB_BITS) - 1));
+}
+
+/* Smallest latency that falls in bucket @i */
+static uint64_t bench_lat_value(int i)
+{
+    int e;
+
+    if (i < (1 << BENCH_LAT_SUB_BITS)) {
+        return i;
+    }
+    e = (i >> BENCH_LAT_SUB_BITS) + BENCH_LAT_SUB_BITS - 1;
+    return (uint64_t)((1 << BENCH_LAT_SUB_BITS) |
+                      (i & ((1 << BENCH_LAT_SUB_BITS) - 1)))
+           << (e - BENCH_LAT_SUB_BITS);
+}
+
+static void bench_lat_add(BenchLatency *lat, uint64_t ns)
+{
+    if (!lat->count || ns < lat->min) {
+        lat->min = ns;
+    }
+    if (ns > lat->max) {
+        lat->max = ns;
+    }
+    lat->count++;
+    lat->sum += ns;
+    lat->buckets[bench_lat_bucket(ns)]++;
+}
+
+static uint64_t bench_lat_percentile(BenchLatency *lat, double p)
+{
+    uint64_t target = MAX(1, (uint64_t)(p * lat->count + 0.5));
+    uint64_t seen = 0;
+    int i;
+
+    for (i = 0; i < BENCH_LAT_BUCKETS; i++) {
+        seen += lat->buckets[i];
+        if (seen >= target) {
+            return MIN(MAX(bench_lat_value(i), lat->min), lat->max);
+        }
+    }
+    return lat->max;
+}
+
+static void bench_lat_print(const char *name, BenchLatency *lat)
+{
+    static const double p[] = { 0.5, 0.9, 0.99, 0.999 };
+    int i;
+
+    if (!lat->count) {
+        return;
+    }
+    printf("%-8s%10.1f%10.1f", name, lat->min / 1000.0,
+           (double)lat->sum / lat->count / 1000.0);
+    for (i = 0; i < ARRAY_SIZE(p); i++) {
+        printf("%10.1f", bench_lat_percentile(lat, p[i]) / 1000.0);
+    }
+    printf("%10.1f\n", lat->max / 1000.0);
+}
+
+/* xorshift64*, which is plenty for spreading requests over the image */
+static uint64_t bench_rand(BenchState *s)
+{
+    s->rand_state ^= s->rand_state >> 12;
+    s->rand_state ^= s->rand_state << 25;
+    s->rand_state ^= s->rand_state >> 27;
+    return s->rand_state * 2685821657736338717ULL;
+}
+
+/* Pick the block and direction of the next request, or return false
+ * once the request or time limit is reached */
+static bool bench_next_request(BenchState *s, int64_t *block, bool *is_write)
+{
+    if (s->ret || (s->count && s->started >= s->count) ||
+        (s->deadline && get_clock() >= s->deadline)) {
+        return false;
+    }
+    s->started++;
+
+    if (s->random) {
+        *block = bench_rand(s) % s->nb_blocks;
+    } else {
+        *block = s->next_block;
+        s->next_block = (s->next_block + 1) % s->nb_blocks;
+    }
+    *is_write = s->write_percent &&
+                bench_rand(s) % 100 < s->write_percent;
+    return true;
+}
+
+static void coroutine_fn bench_co(void *opaque)
+{
+    BenchState *s = opaque;
+    size_t bytes = s->block_sectors * BDRV_SECTOR_SIZE;
+    uint8_t *buf;
+    int64_t block;
+    bool is_write;
+
+    buf = qemu_blockalign(s->bs, bytes);
+    memset(buf, 0xa5, bytes);
+
+    while (bench_next_request(s, &block, &is_write)) {
+        QEMUIOVector qiov;
+        struct iovec iov = {
+            .iov_base = buf,
+            .iov_len = bytes,
+        };
+        int64_t sector_num = block * s->block_sectors;
+        int64_t start;
+        int ret;
+
+        qemu_iovec_init_external(&qiov, &iov, 1);
+        start = get_clock();
+        if (is_write) {
+            ret = bdrv_co_writev(s->bs, sector_num, s->block_sectors, &qiov);
+        } else {
+            ret = bdrv_co_readv(s->bs, sector_num, s->block_sectors, &qiov);
+        }
+        if (ret < 0) {
+            error_report("error while %s sector %" PRId64 ": %s",
+                         is_write ? "writing" : "reading", sector_num,
+                         strerror(-ret));
+            if (!s->ret) {
+                s->ret = ret;
+            }
+            break;
+        }
+        bench_lat_add(&s->lat[is_write], get_clock() - start);
+    }
+
+    qemu_vfree(buf);
+    s->running--;
+}
+
+static int img_bench(int argc, char **argv)
+{
+    int c, ret, flags, i;
+    const char *filename, *fmt, *cache, *pattern;
+    BlockDriverState *bs = NULL;
+    BenchState *s;
+    int64_t size, start, elapsed;
+    int64_t block_size = 4096;
+    int64_t seconds = 0;
+    uint64_t total;
+    double secs;
+
+    s = g_malloc0(sizeof(*s));
+    s->depth = BENCH_DEPTH_DEFAULT;
+    fmt = NULL;
+    cache = BDRV_DEFAULT_CACHE;
+    pattern = "seq";
+    for (;;) {
+        int option_index = 0;
+        static const struct option long_options[] = {
+            {"help", no_argument, 0, 'h'},
+            {"pattern", required_argument, 0, OPTION_PATTERN},
+            {0, 0, 0, 0}
+        };
+        char *end;
+
+        c = getopt_long(argc, argv, "c:d:f:hs:t:T:w:",
+                        long_options, &option_index);
+        if (c == -1) {
+            break;
+        }
+        switch (c) {
+        case '?':
+        case 'h':
+            help();
+            break;
+        case 'c':
+            errno = 0;
+            s->count = strtoull(optarg, &end, 10);
+            if (errno || *end || !s->count) {
+                error_report("Invalid request count specified");
+                goto fail;
+            }
+            break;
+        case 'd':
+            errno = 0;
+            s->depth = strtol(optarg, &end, 10);
+            if (errno || *end || s->depth < 1 || s->depth > BENCH_DEPTH_MAX) {
+                error_report("Invalid queue depth, it must be between 1 "
+                             "and %d", BENCH_DEPTH_MAX);
+                goto fail;
+            }
+            break;
+        case 'f':
+            fmt = optarg;
+            break;
+        case 's':
+            block_size = strtosz_suffix(optarg, &end, STRTOSZ_DEFSUFFIX_B);
+            if (block_size <= 0 || *end ||
+                block_size % BDRV_SECTOR_SIZE ||
+                block_size > INT_MAX / 2) {
+                error_report("Invalid block size, it must be a multiple "
+                             "of %d bytes", (int)BDRV_SECTOR_SIZE);
+                goto fail;
+            }
+            break;
+        case 't':
+            cache = optarg;
+            break;
+        case 'T':
+            errno = 0;
+            seconds = strtoll(optarg, &end, 10);
+            if (errno || *end || seconds <= 0) {
+                error_report("Invalid duration specified");
+                goto fail;
+            }
+            break;
+        case 'w':
+            errno = 0;
+            s->write_percent = strtol(optarg, &end, 10);
+            if (errno || *end || s->write_percent < 0 ||
+                s->write_percent > 100) {
+                error_report("Invalid write percentage, it must be between "
+                             "0 and 100");
+                goto fail;
+            }
+            break;
+        case OPTION_PATTERN:
+            pattern = optarg;
+            break;
+        }
+    }
+    if (optind >= argc) {
+        help();
+    }
+    filename = argv[optind++];
+
+    if (!strcmp(pattern, "rand")) {
+        s->random = true;
+    } else if (strcmp(pattern, "seq")) {
+        error_report("--pattern must be used with seq or rand as argument.");
+        goto fail;
+    }
+    if (!s->count && !seconds) {
+        seconds = BENCH_TIME_DEFAULT;
+    }
+
+    flags = s->write_percent ? BDRV_O_RDWR : 0;
+    ret = bdrv_parse_cache_flags(cache, &flags);
+    if (ret < 0) {
+        error_report("Invalid cache option: %s", cache);
+        goto fail;
+    }
+
+    bs = bdrv_new_open(filename, fmt, flags, true, false);
+    if (!bs) {
+        goto fail;
+    }
+    size = bdrv_getlength(bs);
+    if (size < block_size) {
+        error_report("Image is smaller than the block size");
+        goto fail;
+    }
+
+    s->bs = bs;
+    s->block_sectors = block_size / BDRV_SECTOR_SIZE;
+    s->nb_blocks = size / block_size;
+    s->rand_state = get_clock() | 1;
+
+    printf("%s %s of %" PRId64 " byte blocks, %d%% writes, queue depth %d, "
+           "cache %s\n", s->random ? "Random" : "Sequential",
+           s->write_percent ? "I/O" : "reads", block_size, s->write_percent,
+           s->depth, cache);
+
+    start = get_clock();
+    if (seconds) {
+        s->deadline = start + seconds * get_ticks_per_sec();
+    }
+    s->running = s->depth;
+    for (i = 0; i < s->depth; i++) {
+        qemu_coroutine_enter(qemu_coroutine_create(bench_co), s);
+    }
+    while (s->running) {
+        qemu_aio_wait();
+    }
+
+    /* With a write back cache, the written data is only safe after the
+     * flush, so it counts towards the elapsed time */
+    if (!s->ret && s->lat[1].count) {
+        s->ret = bdrv_flush(bs);
+        if (s->ret < 0) {
+            error_report("error while flushing: %s", strerror(-s->ret));
+        }
+    }
+    elapsed = get_clock() - start;
+    if (s->ret) {
+        goto fail;
+    }
+
+    total = s->lat[0].count + s->lat[1].count;
+    secs = (double)elapsed / get_ticks_per_sec();
+    printf("Completed %" PRIu64 " requests (%" PRIu64 " reads, %" PRIu64
+           " writes) in %.3f seconds\n",
+           total, s->lat[0].count, s->lat[1].count, secs);
+    printf("IOPS: %.0f, bandwidth: %.2f MiB/s\n", total / secs,
+           total * block_size / secs / (1024 * 1024));
+    printf("\n%-8s%10s%10s%10s%10s%10s%10s%10s\n", "Latency", "min", "avg",
+           "p50", "p90", "p99", "p99.9", "max");
+    bench_lat_print("read", &s->lat[0]);
+    bench_lat_print("write", &s->lat[1]);
+    printf("(microseconds)\n");
+
+    g_free(s);
+    bdrv_delete(bs);
+    return 0;
+
+fail:
+    g_free(s);
+    if (bs) {
+        bdrv_delete(bs);
+    }
+    return 1;
+}
+
 static const img_cmd_t img_cmds[] = {
 #define DEF(option, callback, arg_string)        \
     { option, callback },
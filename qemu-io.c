@@ -224,6 +224,7 @@ typedef struct {
     int64_t offset;
     int count;
     int *total;
+    BdrvRequestFlags flags;
     int ret;
     bool done;
 } CoWriteZeroes;
@@ -233,7 +234,8 @@ static void coroutine_fn co_write_zeroes_entry(void *opaque)
     CoWriteZeroes *data = opaque;
 
     data->ret = bdrv_co_write_zeroes(bs, data->offset / BDRV_SECTOR_SIZE,
-                                     data->count / BDRV_SECTOR_SIZE);
+                                     data->count / BDRV_SECTOR_SIZE,
+                                     data->flags);
     data->done = true;
     if (data->ret < 0) {
         *data->total = data->ret;
@@ -243,13 +245,15 @@ static void coroutine_fn co_write_zeroes_entry(void *opaque)
     *data->total = data->count;
 }
 
-static int do_co_write_zeroes(int64_t offset, int count, int *total)
+static int do_co_write_zeroes(int64_t offset, int count, int *total,
+                              BdrvRequestFlags flags)
 {
     Coroutine *co;
     CoWriteZeroes data = {
         .offset = offset,
         .count  = count,
         .total  = total,
+        .flags  = flags,
         .done   = false,
     };
 
@@ -705,6 +709,7 @@ static void write_help(void)
 " -C, -- report statistics in a machine parsable format\n"
 " -q, -- quiet mode, do not show I/O statistics\n"
 " -z, -- write zeroes using bdrv_co_write_zeroes\n"
+" -u, -- with -z, allow unmapping the zeroed range\n"
 "\n");
 }
 
@@ -716,7 +721,7 @@ static const cmdinfo_t write_cmd = {
     .cfunc      = write_f,
     .argmin     = 2,
     .argmax     = -1,
-    .args       = "[-bcCpqz] [-P pattern ] off len",
+    .args       = "[-bcCpquz] [-P pattern ] off len",
     .oneline    = "writes a number of bytes at a specified offset",
     .help       = write_help,
 };
@@ -725,7 +730,7 @@ static int write_f(int argc, char **argv)
 {
     struct timeval t1, t2;
     int Cflag = 0, pflag = 0, qflag = 0, bflag = 0, Pflag = 0, zflag = 0;
-    int cflag = 0;
+    int cflag = 0, uflag = 0;
     int c, cnt;
     char *buf = NULL;
     int64_t offset;
@@ -734,7 +739,7 @@ static int write_f(int argc, char **argv)
     int total = 0;
     int pattern = 0xcd;
 
-    while ((c = getopt(argc, argv, "bcCpP:qz")) != EOF) {
+    while ((c = getopt(argc, argv, "bcCpP:quz")) != EOF) {
         switch (c) {
         case 'b':
             bflag = 1;
@@ -758,6 +763,9 @@ static int write_f(int argc, char **argv)
         case 'q':
             qflag = 1;
             break;
+        case 'u':
+            uflag = 1;
+            break;
         case 'z':
             zflag = 1;
             break;
@@ -780,6 +788,11 @@ static int write_f(int argc, char **argv)
         return 0;
     }
 
+    if (uflag && !zflag) {
+        printf("-u requires -z to be specified\n");
+        return 0;
+    }
+
     offset = cvtnum(argv[optind]);
     if (offset < 0) {
         printf("non-numeric length argument -- %s\n", argv[optind]);
@@ -817,7 +830,8 @@ static int write_f(int argc, char **argv)
     } else if (bflag) {
         cnt = do_save_vmstate(buf, offset, count, &total);
     } else if (zflag) {
-        cnt = do_co_write_zeroes(offset, count, &total);
+        cnt = do_co_write_zeroes(offset, count, &total,
+                                 uflag ? BDRV_REQ_MAY_UNMAP : 0);
     } else if (cflag) {
         cnt = do_write_compressed(buf, offset, count, &total);
     } else {
@@ -1886,6 +1900,7 @@ static void usage(const char *name)
 "  -g, --growable       allow file to grow (only applies to protocols)\n"
 "  -m, --misalign       misalign allocations for O_DIRECT\n"
 "  -k, --native-aio     use kernel AIO implementation (on Linux only)\n"
+"  -i, --io-uring       use io_uring (on Linux only)\n"
 "  -t, --cache=MODE     use the given cache mode for the image\n"
 "  -T, --trace FILE     enable trace events listed in the given file\n"
 "  -h, --help           display this help and exit\n"
@@ -1899,7 +1914,7 @@ int main(int argc, char **argv)
 {
     int readonly = 0;
     int growable = 0;
-    const char *sopt = "hVc:d:rsnmgkt:T:";
+    const char *sopt = "hVc:d:rsnmgkit:T:";
     const struct option lopt[] = {
         { "help", 0, NULL, 'h' },
         { "version", 0, NULL, 'V' },
@@ -1911,6 +1926,7 @@ int main(int argc, char **argv)
         { "misalign", 0, NULL, 'm' },
         { "growable", 0, NULL, 'g' },
         { "native-aio", 0, NULL, 'k' },
+        { "io-uring", 0, NULL, 'i' },
         { "discard", 1, NULL, 'd' },
         { "cache", 1, NULL, 't' },
         { "trace", 1, NULL, 'T' },
@@ -1951,6 +1967,9 @@ int main(int argc, char **argv)
         case 'k':
             flags |= BDRV_O_NATIVE_AIO;
             break;
+        case 'i':
+            flags |= BDRV_O_IO_URING;
+            break;
         case 't':
             if (bdrv_parse_cache_flags(optarg, &flags) < 0) {
                 error_report("Invalid cache option: %s", optarg);
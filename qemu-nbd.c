@@ -19,6 +19,8 @@
 #include "qemu-common.h"
 #include "block/block.h"
 #include "block/nbd.h"
+#include "qemu/event_notifier.h"
+#include "qemu/thread.h"
 
 #include <stdarg.h>
 #include <stdio.h>
@@ -37,6 +39,8 @@
 #define QEMU_NBD_OPT_CACHE   1
 #define QEMU_NBD_OPT_AIO     2
 #define QEMU_NBD_OPT_DISCARD 3
+#define QEMU_NBD_OPT_QUEUE_DEPTH 4
+#define QEMU_NBD_OPT_IOTHREAD 5
 
 static NBDExport *exp;
 static int verbose;
@@ -46,6 +50,16 @@ static int persistent = 0;
 static enum { RUNNING, TERMINATE, TERMINATING, TERMINATED } state;
 static int shared = 1;
 static int nb_fds;
+static int server_fd = -1;
+
+/* With --iothread, the image, the listening socket and the clients live in
+ * iothread_ctx, which is polled by a thread of its own.  The main loop only
+ * waits for the signal to terminate.
+ */
+static AioContext *iothread_ctx;
+static QemuThread iothread;
+static EventNotifier iothread_notifier;
+static bool iothread_stopping;
 
 static void usage(const char *name)
 {
@@ -63,6 +77,9 @@ static void usage(const char *name)
 "                       (default '"SOCKET_PATH"')\n"
 "  -e, --shared=NUM     device can be shared by NUM clients (default '1')\n"
 "  -t, --persistent     don't exit on the last connection\n"
+"      --queue-depth=NUM\n"
+"                       requests in flight per connection (default '16')\n"
+"      --iothread       serve the device from a dedicated I/O thread\n"
 "  -v, --verbose        display extra debugging information\n"
 "\n"
 "Exposing part of the image:\n"
@@ -81,8 +98,8 @@ static void usage(const char *name)
 "  -s, --snapshot       use snapshot file\n"
 "  -n, --nocache        disable host cache\n"
 "      --cache=MODE     set cache mode (none, writeback, ...)\n"
-#ifdef CONFIG_LINUX_AIO
-"      --aio=MODE       set AIO mode (native or threads)\n"
+#if defined(CONFIG_LINUX_AIO) || defined(CONFIG_LINUX_IO_URING)
+"      --aio=MODE       set AIO mode (native, io_uring or threads)\n"
 #endif
 "\n"
 "Report bugs to <qemu-devel@nongnu.org>\n"
@@ -224,7 +241,7 @@ static void *nbd_client_thread(void *arg)
     }
 
     ret = nbd_receive_negotiate(sock, NULL, &nbdflags,
-                                &size, &blocksize);
+                                &size, &blocksize, NULL);
     if (ret < 0) {
         goto out;
     }
@@ -270,6 +287,67 @@ static int nbd_can_accept(void *opaque)
     return nb_fds < shared;
 }
 
+static void nbd_accept(void *opaque);
+
+/* The main loop asks nbd_can_accept() before every poll, but AioContext
+ * handlers cannot be masked, so in the I/O thread the handler is removed
+ * while the device is fully shared.
+ */
+static void nbd_update_server_fd_handler(void)
+{
+    if (iothread_ctx && !iothread_stopping) {
+        aio_set_fd_handler(iothread_ctx, server_fd,
+                           nbd_can_accept(NULL) ? nbd_accept : NULL,
+                           NULL, NULL, NULL);
+    }
+}
+
+static void iothread_notifier_read(EventNotifier *e)
+{
+    event_notifier_test_and_clear(e);
+}
+
+/* Keep aio_poll() blocking when no request is in flight */
+static int iothread_notifier_flush(EventNotifier *e)
+{
+    return 1;
+}
+
+static void *iothread_run(void *opaque)
+{
+    while (!iothread_stopping) {
+        aio_poll(iothread_ctx, true);
+    }
+    return NULL;
+}
+
+static void iothread_start(BlockDriverState *bs)
+{
+    if (!bdrv_can_set_aio_context(bs)) {
+        errx(EXIT_FAILURE, "'%s' cannot be served from an I/O thread",
+             srcpath);
+    }
+
+    iothread_ctx = aio_context_new();
+    bdrv_set_aio_context(bs, iothread_ctx);
+    if (event_notifier_init(&iothread_notifier, 0) < 0) {
+        errx(EXIT_FAILURE, "Failed to initialize I/O thread notifier");
+    }
+    aio_set_event_notifier(iothread_ctx, &iothread_notifier,
+                           iothread_notifier_read, iothread_notifier_flush);
+    nbd_update_server_fd_handler();
+    qemu_thread_create(&iothread, iothread_run, NULL, QEMU_THREAD_JOINABLE);
+}
+
+/* Take iothread_ctx back, so that the main thread can close the export */
+static void iothread_stop(void)
+{
+    iothread_stopping = true;
+    event_notifier_set(&iothread_notifier);
+    qemu_thread_join(&iothread);
+    aio_set_fd_handler(iothread_ctx, server_fd, NULL, NULL, NULL, NULL);
+}
+
 static void nbd_export_closed(NBDExport *exp)
 {
     assert(state == TERMINATING);
@@ -282,13 +360,13 @@ static void nbd_client_closed(NBDClient *client)
     if (nb_fds == 0 && !persistent && state == RUNNING) {
         state = TERMINATE;
     }
+    nbd_update_server_fd_handler();
     qemu_notify_event();
     nbd_client_put(client);
 }
 
 static void nbd_accept(void *opaque)
 {
-    int server_fd = (uintptr_t) opaque;
     struct sockaddr_in addr;
     socklen_t addr_len = sizeof(addr);
 
@@ -300,6 +378,7 @@ static void nbd_accept(void *opaque)
 
     if (fd >= 0 && nbd_client_new(exp, fd, nbd_client_closed)) {
         nb_fds++;
+        nbd_update_server_fd_handler();
     }
 }
 
@@ -313,6 +392,8 @@ int main(int argc, char **argv)
     char *device = NULL;
     int port = NBD_DEFAULT_PORT;
     off_t fd_size;
+    int queue_depth = 0;
+    bool use_iothread = false;
     const char *sopt = "hVb:o:p:rsnP:c:dvk:e:t";
     struct option lopt[] = {
         { "help", 0, NULL, 'h' },
@@ -328,12 +409,14 @@ int main(int argc, char **argv)
         { "snapshot", 0, NULL, 's' },
         { "nocache", 0, NULL, 'n' },
         { "cache", 1, NULL, QEMU_NBD_OPT_CACHE },
-#ifdef CONFIG_LINUX_AIO
+#if defined(CONFIG_LINUX_AIO) || defined(CONFIG_LINUX_IO_URING)
         { "aio", 1, NULL, QEMU_NBD_OPT_AIO },
 #endif
         { "discard", 1, NULL, QEMU_NBD_OPT_DISCARD },
         { "shared", 1, NULL, 'e' },
         { "persistent", 0, NULL, 't' },
+        { "queue-depth", 1, NULL, QEMU_NBD_OPT_QUEUE_DEPTH },
+        { "iothread", 0, NULL, QEMU_NBD_OPT_IOTHREAD },
         { "verbose", 0, NULL, 'v' },
         { NULL, 0, NULL, 0 }
     };
@@ -347,7 +430,7 @@ int main(int argc, char **argv)
     int fd;
     bool seen_cache = false;
     bool seen_discard = false;
-#ifdef CONFIG_LINUX_AIO
+#if defined(CONFIG_LINUX_AIO) || defined(CONFIG_LINUX_IO_URING)
     bool seen_aio = false;
 #endif
     pthread_t client_thread;
@@ -377,7 +460,7 @@ int main(int argc, char **argv)
                 errx(EXIT_FAILURE, "Invalid cache mode `%s'", optarg);
             }
             break;
-#ifdef CONFIG_LINUX_AIO
+#if defined(CONFIG_LINUX_AIO) || defined(CONFIG_LINUX_IO_URING)
         case QEMU_NBD_OPT_AIO:
             if (seen_aio) {
                 errx(EXIT_FAILURE, "--aio can only be specified once");
@@ -385,6 +468,10 @@ int main(int argc, char **argv)
             seen_aio = true;
             if (!strcmp(optarg, "native")) {
                 flags |= BDRV_O_NATIVE_AIO;
+#ifdef CONFIG_LINUX_IO_URING
+            } else if (!strcmp(optarg, "io_uring")) {
+                flags |= BDRV_O_IO_URING;
+#endif
             } else if (!strcmp(optarg, "threads")) {
                 /* this is the default */
             } else {
@@ -457,6 +544,18 @@ int main(int argc, char **argv)
 	case 't':
 	    persistent = 1;
 	    break;
+        case QEMU_NBD_OPT_QUEUE_DEPTH:
+            queue_depth = strtol(optarg, &end, 0);
+            if (*end) {
+                errx(EXIT_FAILURE, "Invalid queue depth '%s'", optarg);
+            }
+            if (queue_depth < 1) {
+                errx(EXIT_FAILURE, "Queue depth must be greater than 0\n");
+            }
+            break;
+        case QEMU_NBD_OPT_IOTHREAD:
+            use_iothread = true;
+            break;
         case 'v':
             verbose = 1;
             break;
@@ -573,14 +672,17 @@ int main(int argc, char **argv)
     }
 
     exp = nbd_export_new(bs, dev_offset, fd_size, nbdflags, nbd_export_closed);
+    if (queue_depth) {
+        nbd_export_set_max_requests(exp, queue_depth);
+    }
 
     if (sockpath) {
-        fd = unix_socket_incoming(sockpath);
+        server_fd = unix_socket_incoming(sockpath);
     } else {
-        fd = tcp_socket_incoming(bindto, port);
+        server_fd = tcp_socket_incoming(bindto, port);
     }
 
-    if (fd < 0) {
+    if (server_fd < 0) {
         return 1;
     }
 
@@ -597,8 +699,12 @@ int main(int argc, char **argv)
         memset(&client_thread, 0, sizeof(client_thread));
     }
 
-    qemu_set_fd_handler2(fd, nbd_can_accept, nbd_accept, NULL,
-                         (void *)(uintptr_t)fd);
+    if (use_iothread) {
+        iothread_start(bs);
+    } else {
+        qemu_set_fd_handler2(server_fd, nbd_can_accept, nbd_accept, NULL,
+                             NULL);
+    }
 
     /* now when the initialization is (almost) complete, chdir("/")
      * to free any busy filesystems */
@@ -608,8 +714,16 @@ int main(int argc, char **argv)
 
     state = RUNNING;
     do {
-        main_loop_wait(false);
+        if (iothread_ctx && state == TERMINATING) {
+            /* Wait for the requests in flight to release the export */
+            aio_poll(iothread_ctx, true);
+        } else {
+            main_loop_wait(false);
+        }
         if (state == TERMINATE) {
+            if (iothread_ctx) {
+                iothread_stop();
+            }
             state = TERMINATING;
             nbd_export_close(exp);
             nbd_export_put(exp);
@@ -617,6 +731,13 @@ int main(int argc, char **argv)
         }
     } while (state != TERMINATED);
 
+    if (iothread_ctx) {
+        bdrv_set_aio_context(bs, qemu_get_aio_context());
+        aio_set_event_notifier(iothread_ctx, &iothread_notifier, NULL, NULL);
+        event_notifier_cleanup(&iothread_notifier);
+        aio_context_unref(iothread_ctx);
+        iothread_ctx = NULL;
+    }
     bdrv_close(bs);
     if (sockpath) {
         unlink(sockpath);
@@ -34,8 +34,18 @@ DEF("machine", HAS_ARG, QEMU_OPTION_machine, \
     "                supported accelerators are kvm, xen, tcg (default: tcg)\n"
     "                kernel_irqchip=on|off controls accelerated irqchip support\n"
     "                kvm_shadow_mem=size of KVM shadow MMU\n"
+    "                kvm_dirty_ring=n tracks dirty pages with KVM rings of n entries per vCPU (default: 0, use the bitmap)\n"
     "                dump-guest-core=on|off include guest memory in a core dump (default=on)\n"
-    "                mem-merge=on|off controls memory merge support (default: on)\n",
+    "                mem-merge=on|off controls memory merge support (default: on)\n"
+    "                mem-prealloc-background=on|off starts the guest while -mem-prealloc runs (default: off)\n"
+    "                tcg-threads=single|multi runs all TCG vCPUs on one thread or one thread each (default: single)\n"
+    "                tcg-superblocks=n retranslates TBs run n times as superblocks (default: 0, disabled)\n"
+    "                tcg-opt=pass[,...] selects the TCG optimizer passes (default: all)\n"
+    "                tcg-profile=on|off counts executions and host ticks per TB (default: off)\n"
+    "                bql-profile=on|off histograms of iothread lock wait and hold times (default: off)\n"
+    "                halt-poll-ns=n polls up to n ns in halted vCPU threads before sleeping (default: 0)\n"
+    "                xen-mapcache-bucket=size maps guest memory in windows of this size with Xen (default: 1M, 64K on 32-bit hosts)\n"
+    "                ram-template=file starts from the RAM and device state saved in file\n",
     QEMU_ARCH_ALL)
 STEXI
 @item -machine [type=]@var{name}[,prop=@var{value}[,...]]
@@ -52,12 +62,74 @@ to initialize.
 Enables in-kernel irqchip support for the chosen accelerator when available.
 @item kvm_shadow_mem=size
 Defines the size of the KVM shadow MMU.
+@item kvm_dirty_ring=@var{n}
+Track the pages written by the guest with per-vCPU rings of @var{n} entries
+instead of the per-slot dirty bitmap, so that a sync costs in proportion to
+the pages dirtied rather than to the size of the guest.  @var{n} must be a
+power of two.  If the host kernel does not support dirty rings, or not of
+this size, QEMU falls back to the bitmap.  The default is 0, which uses the
+bitmap.
 @item dump-guest-core=on|off
 Include guest memory in a core dump. The default is on.
 @item mem-merge=on|off
 Enables or disables memory merge support. This feature, when supported by
 the host, de-duplicates identical memory pages among VMs instances
 (enabled by default).
+@item mem-prealloc-background=on|off
+With @option{-mem-prealloc}, start the guest without waiting until all
+of its memory is allocated.  The preallocation threads continue in the
+background; their progress is shown by the @code{query-mem-prealloc} QMP
+command.  The default is off.
+@item tcg-threads=single|multi
+With @option{multi}, TCG runs each emulated CPU on its own host thread
+instead of running all of them in turn on a single thread.  This is
+experimental, only supported on x86 Linux hosts and not compatible with
+@option{-icount}.  The default is @option{single}.
+@item tcg-superblocks=@var{n}
+Retranslate translation blocks that ran @var{n} times, following the
+direct jumps they end with, so that the code on both sides of a jump is
+optimized together.  Only the x86 targets build superblocks.  Not
+compatible with @option{-icount}.  The default is 0, which disables it.
+@item tcg-opt=@var{pass}[,...]
+Select the passes of the TCG optimizer: @option{copy}, @option{fold},
+@option{bits}, @option{strength} and @option{dce}, or @option{all} (the
+default) and @option{none}.  Disabling passes is meant for debugging the
+optimizer and for measuring what each pass brings.  Use
+@code{tcg-opt=help} for a description of the passes.
+@item tcg-profile=on|off
+Count the executions of each translation block and the host time spent
+in it and in the helpers that it calls, for @code{info tb-profile}.  The
+host address of the code of each block is also written to
+@file{/tmp/perf-@var{pid}.map}, so that @command{perf} can name it.
+Blocks are not chained to each other in this mode, which makes the
+guest a lot slower.  Not compatible with @option{tcg-threads=multi}.
+@item bql-profile=on|off
+Record how long each thread waits for the iothread lock and how long it
+holds it, as totals and histograms by site: vCPU exits, the main loop,
+the migration thread and monitor commands.  @code{info bql} and the QMP
+command @code{query-bql} show them.
+@item halt-poll-ns=@var{n}
+Let a vCPU thread with nothing to do spin for up to @var{n} nanoseconds
+before it sleeps, so that an interrupt that arrives shortly after the guest
+halts is handled without a wakeup.  The polling window of each vCPU adapts
+to how soon its wakeups come, and @code{info halt-poll} shows it with the
+counts of successful and failed polls.  This applies to TCG and to KVM
+without the in-kernel irqchip; the in-kernel irqchip halts in the kernel,
+which has its own polling.  The default is 0, which disables polling.
+@item xen-mapcache-bucket=@var{size}
+With Xen, QEMU maps guest memory into its address space in windows of
+@var{size} bytes, which are remapped when the guest accesses memory that
+no window covers.  Larger windows mean fewer remaps under heavy I/O;
+@var{size} must be a power of two of at most 1G (16M on 32-bit hosts).
+The default is 1M (64K on 32-bit hosts).
+@item ram-template=@var{file}
+Start from the state saved by the @code{template-save} QMP command instead
+of booting.  Guest RAM is mapped copy-on-write from @var{file}, so that
+pages are only read when the guest touches them and stay shared in the
+page cache among all the VMs started from the same template; only the
+device state is loaded at startup.  The rest of the command line must
+create the same machine as the one that saved the template, with disks
+in the state they had at that time.
 @end table
 ETEXI
 
@@ -95,12 +167,27 @@ specifies the maximum number of hotpluggable CPUs.
 ETEXI
 
 DEF("numa", HAS_ARG, QEMU_OPTION_numa,
-    "-numa node[,mem=size][,cpus=cpu[-cpu]][,nodeid=node]\n", QEMU_ARCH_ALL)
+    "-numa node[,mem=size][,cpus=cpu[-cpu]][,nodeid=node]\n"
+    "          [,mem-path=path][,host-nodes=node[-node]]\n"
+    "          [,policy=default|preferred|bind|interleave]\n"
+    "          [,host-cpus=cpu[-cpu]]\n", QEMU_ARCH_ALL)
 STEXI
 @item -numa @var{opts}
 @findex -numa
 Simulate a multi node NUMA system. If mem and cpus are omitted, resources
 are split equally.
+
+The memory of a node can be placed on the host: @option{mem-path}
+allocates it from a file in @var{path}, like @option{-mem-path} does for
+all RAM, so that each node can use hugepages of a different size.
+@option{host-nodes} and @option{policy} apply the given memory policy for
+those host nodes to the node's memory; @option{policy} defaults to
+@code{bind} when @option{host-nodes} is given.  The sizes of the nodes
+must add up to the RAM size and be multiples of their page size.
+
+@option{host-cpus} restricts the threads of the node's VCPUs to the given
+host CPUs, usually the CPUs of its @option{host-nodes}.  Threads can be
+moved at run time with the @code{set-thread-affinity} QMP command.
 ETEXI
 
 DEF("add-fd", HAS_ARG, QEMU_OPTION_add_fd,
@@ -231,7 +318,10 @@ DEF("mem-prealloc", 0, QEMU_OPTION_mem_prealloc,
 STEXI
 @item -mem-prealloc
 @findex -mem-prealloc
-Preallocate memory when using -mem-path.
+Preallocate memory when using -mem-path or the @option{mem-path} or
+@option{host-nodes} options of -numa.  The memory is touched by one
+thread on each host NUMA node, or on a host with a single node by one
+thread per host CPU, up to 16.
 ETEXI
 #endif
 
@@ -403,9 +493,13 @@ DEF("drive", HAS_ARG, QEMU_OPTION_drive,
     "-drive [file=file][,if=type][,bus=n][,unit=m][,media=d][,index=i]\n"
     "       [,cyls=c,heads=h,secs=s[,trans=t]][,snapshot=on|off]\n"
     "       [,cache=writethrough|writeback|none|directsync|unsafe][,format=f]\n"
-    "       [,serial=s][,addr=A][,id=name][,aio=threads|native]\n"
-    "       [,readonly=on|off][,copy-on-read=on|off]\n"
+    "       [,serial=s][,addr=A][,id=name][,aio=threads|native|io_uring]\n"
+    "       [,readonly=on|off][,copy-on-read=on|off][,merge=on|off]\n"
+    "       [,l2-cache-coverage=size][,shared-cache=file[,shared-cache-size=size]]\n"
     "       [[,bps=b]|[[,bps_rd=r][,bps_wr=w]]][[,iops=i]|[[,iops_rd=r][,iops_wr=w]]\n"
+    "       [[,bps_max=bm]|[[,bps_rd_max=rm][,bps_wr_max=wm]]]\n"
+    "       [[,iops_max=im]|[[,iops_rd_max=irm][,iops_wr_max=iwm]]]\n"
+    "       [,iops_size=is][,group=g]\n"
     "                use 'file' as a drive image\n", QEMU_ARCH_ALL)
 STEXI
 @item -drive @var{option}[,@var{option}[,@var{option}[,...]]]
@@ -439,7 +533,7 @@ These options have the same definition as they have in @option{-hdachs}.
 @item cache=@var{cache}
 @var{cache} is "none", "writeback", "unsafe", "directsync" or "writethrough" and controls how the host cache is used to access block data.
 @item aio=@var{aio}
-@var{aio} is "threads", or "native" and selects between pthread based disk I/O and native Linux AIO.
+@var{aio} is "threads", "native" or "io_uring" and selects between pthread based disk I/O, native Linux AIO and Linux io_uring.  Unlike "native", "io_uring" does not require @option{cache=none}.
 @item discard=@var{discard}
 @var{discard} is one of "ignore" (or "off") or "unmap" (or "on") and controls whether @dfn{discard} (also known as @dfn{trim} or @dfn{unmap}) requests are ignored or passed to the filesystem.  Some machine types may not support discard requests.
 @item format=@var{format}
@@ -461,6 +555,24 @@ Open drive @option{file} as read-only. Guest write attempts will fail.
 @item copy-on-read=@var{copy-on-read}
 @var{copy-on-read} is "on" or "off" and enables whether to copy read backing
 file sectors into the image file.
+@item merge=@var{merge}
+@var{merge} is "on" or "off" and enables whether adjacent requests that the
+guest submits at the same time are merged into larger requests.
+@item l2-cache-coverage=@var{size}
+For qcow2 images, cache enough of the L2 tables in memory to map @var{size}
+bytes of the virtual disk without reading metadata from the image file.  By
+default the cache covers the whole disk, but takes at most 1 MB of memory.
+For VMDK images, the same applies to the grain tables of each sparse extent.
+@item shared-cache=@var{file}
+Cache the data of read-only images, usually the backing files of the drive,
+in @var{file}, which is shared by all QEMU processes that use the same file.
+Guests that run from the same base image then read each of its clusters from
+disk only once.  Put @var{file} on a memory file system such as
+@file{/dev/shm}.  Only images in local files take part, and an image stops
+using the cache as soon as it is written to.
+@item shared-cache-size=@var{size}
+Size of the shared cache file if it does not exist yet.  The default size is
+256 MB; an existing cache keeps its size.
 @end table
 
 By default, the @option{cache=writeback} mode is used. It will report data
@@ -603,12 +715,13 @@ ETEXI
 
 DEF("fsdev", HAS_ARG, QEMU_OPTION_fsdev,
     "-fsdev fsdriver,id=id[,path=path,][security_model={mapped-xattr|mapped-file|passthrough|none}]\n"
-    " [,writeout=immediate][,readonly][,socket=socket|sock_fd=sock_fd]\n",
+    " [,writeout=immediate][,readonly][,socket=socket|sock_fd=sock_fd]\n"
+    " [,threads=n][,attr_timeout=ms]\n",
     QEMU_ARCH_ALL)
 
 STEXI
 
-@item -fsdev @var{fsdriver},id=@var{id},path=@var{path},[security_model=@var{security_model}][,writeout=@var{writeout}][,readonly][,socket=@var{socket}|sock_fd=@var{sock_fd}]
+@item -fsdev @var{fsdriver},id=@var{id},path=@var{path},[security_model=@var{security_model}][,writeout=@var{writeout}][,readonly][,socket=@var{socket}|sock_fd=@var{sock_fd}][,threads=@var{n}][,attr_timeout=@var{ms}]
 @findex -fsdev
 Define a new file system device. Valid options are:
 @table @option
@@ -649,6 +762,15 @@ with virtfs-proxy-helper
 Enables proxy filesystem driver to use passed socket descriptor for
 communicating with virtfs-proxy-helper. Usually a helper like libvirt
 will create socketpair and pass one of the fds as sock_fd
+@item threads=@var{n}
+Run file system operations on a pool of @var{n} worker threads, which
+are listed by the query-threads monitor command so that they can be
+placed with set-thread-affinity. The pool is shared by all exports and
+gets the largest size any of them asks for. By default it grows on demand.
+@item attr_timeout=@var{ms}
+Let the local fsdriver cache file attributes for @var{ms} milliseconds.
+Changes made by the guest are seen immediately; changes made on the host
+may take that long to show up. The default is 0, no caching.
 @end table
 
 -fsdev option is used along with -device driver "virtio-9p-pci".
@@ -665,12 +787,13 @@ ETEXI
 
 DEF("virtfs", HAS_ARG, QEMU_OPTION_virtfs,
     "-virtfs local,path=path,mount_tag=tag,security_model=[mapped-xattr|mapped-file|passthrough|none]\n"
-    "        [,writeout=immediate][,readonly][,socket=socket|sock_fd=sock_fd]\n",
+    "        [,writeout=immediate][,readonly][,socket=socket|sock_fd=sock_fd]\n"
+    "        [,threads=n][,attr_timeout=ms]\n",
     QEMU_ARCH_ALL)
 
 STEXI
 
-@item -virtfs @var{fsdriver}[,path=@var{path}],mount_tag=@var{mount_tag}[,security_model=@var{security_model}][,writeout=@var{writeout}][,readonly][,socket=@var{socket}|sock_fd=@var{sock_fd}]
+@item -virtfs @var{fsdriver}[,path=@var{path}],mount_tag=@var{mount_tag}[,security_model=@var{security_model}][,writeout=@var{writeout}][,readonly][,socket=@var{socket}|sock_fd=@var{sock_fd}][,threads=@var{n}][,attr_timeout=@var{ms}]
 @findex -virtfs
 
 The general form of a Virtual File system pass-through options are:
@@ -712,6 +835,15 @@ will create socketpair and pass one of the fds as sock_fd
 @item sock_fd
 Enables proxy filesystem driver to use passed 'sock_fd' as the socket
 descriptor for interfacing with virtfs-proxy-helper
+@item threads=@var{n}
+Run file system operations on a pool of @var{n} worker threads, which
+are listed by the query-threads monitor command so that they can be
+placed with set-thread-affinity. The pool is shared by all exports and
+gets the largest size any of them asks for. By default it grows on demand.
+@item attr_timeout=@var{ms}
+Let the local fsdriver cache file attributes for @var{ms} milliseconds.
+Changes made by the guest are seen immediately; changes made on the host
+may take that long to show up. The default is 0, no caching.
 @end table
 ETEXI
 
@@ -1393,6 +1525,11 @@ DEF("net", HAS_ARG, QEMU_OPTION_net,
     "                on host and listening for incoming connections on 'socketpath'.\n"
     "                Use group 'groupname' and mode 'octalmode' to change default\n"
     "                ownership and permissions for communication port.\n"
+#endif
+#ifdef CONFIG_POSIX
+    "-netdev vhost-user,id=str,path=socketpath[,vhostforce=on|off]\n"
+    "                connect a virtio-net device to a vhost-user backend\n"
+    "                listening on the UNIX socket 'socketpath'\n"
 #endif
     "-net dump[,vlan=n][,file=f][,len=n]\n"
     "                dump traffic on vlan 'n' to file 'f' (max n bytes per packet)\n"
@@ -1407,6 +1544,9 @@ DEF("netdev", HAS_ARG, QEMU_OPTION_netdev,
     "bridge|"
 #ifdef CONFIG_VDE
     "vde|"
+#endif
+#ifdef CONFIG_POSIX
+    "vhost-user|"
 #endif
     "socket],id=str[,option][,option][,...]\n", QEMU_ARCH_ALL)
 STEXI
@@ -1730,6 +1870,23 @@ vde_switch -F -sock /tmp/myswitch
 qemu-system-i386 linux.img -net nic -net vde,sock=/tmp/myswitch
 @end example
 
+@item -netdev vhost-user,id=@var{id},path=@var{socketpath}[,vhostforce=on|off]
+Hand the queues of a virtio-net device to a backend process listening on the
+UNIX socket @var{socketpath}, using the vhost-user protocol described in
+@file{docs/specs/vhost-user.txt}.  The backend maps guest memory itself, so
+guest RAM must be allocated from a shared file with @option{-mem-path} and
+@option{-mem-prealloc}.  @option{vhostforce=on} uses the backend even for
+guests without MSI-X.  Migration is not supported while a vhost-user netdev
+is present.
+
+Example:
+@example
+qemu-system-x86_64 linux.img -m 1024 \
+                   -mem-path /dev/hugepages -mem-prealloc \
+                   -netdev vhost-user,id=net0,path=/tmp/vhost-user.sock \
+                   -device virtio-net-pci,netdev=net0
+@end example
+
 @item -net dump[,vlan=@var{n}][,file=@var{file}][,len=@var{len}]
 Dump network traffic on VLAN @var{n} to file @var{file} (@file{qemu-vlan0.pcap} by default).
 At most @var{len} bytes (64k by default) per packet are stored. The file format is
@@ -2065,7 +2222,7 @@ ETEXI
 DEF("iscsi", HAS_ARG, QEMU_OPTION_iscsi,
     "-iscsi [user=user][,password=password]\n"
     "       [,header-digest=CRC32C|CR32C-NONE|NONE-CRC32C|NONE\n"
-    "       [,initiator-name=iqn]\n"
+    "       [,initiator-name=iqn][,sessions=n]\n"
     "                iSCSI session parameters\n", QEMU_ARCH_ALL)
 STEXI
 
@@ -2643,7 +2800,9 @@ STEXI
 @item -clock @var{method}
 @findex -clock
 Force the use of the given methods for timer alarm. To see what timers
-are available use @code{-clock help}.
+are available use @code{-clock help}.  The @code{poll} method, the default
+on POSIX hosts, uses no host timer: the main loop sleeps until the next
+timer deadline.
 ETEXI
 
 HXCOMM Options deprecated by -rtc
@@ -2875,6 +3034,20 @@ Enable Seccomp mode 2 system call filter. 'on' will enable syscall filtering and
 disable it.  The default is 'off'.
 ETEXI
 
+DEF("thread-pool", HAS_ARG, QEMU_OPTION_thread_pool, \
+    "-thread-pool [min=n][,max=n][,idle-timeout=ms]\n"
+    "                size of the worker thread pools used for block I/O\n",
+    QEMU_ARCH_ALL)
+STEXI
+@item -thread-pool [min=@var{n}][,max=@var{n}][,idle-timeout=@var{ms}]
+@findex -thread-pool
+Set the size of the worker thread pools that run blocking block I/O, for
+example buffered @option{aio=threads} requests.  Each I/O thread, including
+the main loop, has its own pool.  At most @var{max} threads (default 64) run
+at a time, and idle threads exit after @var{ms} milliseconds (default 10000)
+down to @var{min} threads (default 0).
+ETEXI
+
 DEF("readconfig", HAS_ARG, QEMU_OPTION_readconfig,
     "-readconfig <file>\n", QEMU_ARCH_ALL)
 STEXI
@@ -29,6 +29,8 @@
 #include "hw/hw.h"
 
 #include "qemu/timer.h"
+#include "qemu/thread.h"
+#include "qapi-types.h"
 #ifdef CONFIG_POSIX
 #include <pthread.h>
 #endif
@@ -37,6 +39,10 @@
 #include <mmsystem.h>
 #endif
 
+#ifdef CONFIG_PPOLL
+#include <poll.h>
+#endif
+
 /***********************************************************/
 /* timers */
 
@@ -45,7 +51,10 @@
 #define QEMU_CLOCK_HOST     2
 
 struct QEMUClock {
-    QEMUTimer *active_timers;
+    /* Timers run by the main loop */
+    QEMUTimerList *main_list;
+    /* Every list of this clock, including main_list */
+    QLIST_HEAD(, QEMUTimerList) timer_lists;
 
     NotifierList reset_notifiers;
     int64_t last;
@@ -54,13 +63,58 @@ struct QEMUClock {
     bool enabled;
 };
 
+/* A binary min-heap of pending timers.  Timers with the same key are
+ * ordered by the time they were armed.
+ */
+typedef struct TimerHeap {
+    QEMUTimer **timers;
+    int n;
+    int size;
+    /* Ordered by expire_time and indexed by slack_index, instead of
+     * deadline and heap_index
+     */
+    bool by_expire;
+} TimerHeap;
+
+/* Arming, deleting and testing a timer are O(log n) or better. */
+struct QEMUTimerList {
+    QEMUClock *clock;
+    /* All pending timers, by deadline */
+    TimerHeap heap;
+    /* The pending timers with slack, by expire time.  Those that are due
+     * when the list runs expire together with the others, without waiting
+     * for their deadline.
+     */
+    TimerHeap slack_heap;
+    uint64_t seq;
+    /* Every timer of the list, pending or not, for query-wakeups */
+    QLIST_HEAD(, QEMUTimer) timers;
+
+    /* Called when a timer becomes the first to expire; NULL for the
+     * main loop lists, which rearm the alarm timer instead.
+     */
+    QEMUTimerListNotifyCB *notify_cb;
+    void *notify_opaque;
+    QLIST_ENTRY(QEMUTimerList) list;
+};
+
 struct QEMUTimer {
     int64_t expire_time;	/* in nanoseconds */
-    QEMUClock *clock;
+    int64_t deadline;           /* expire_time rounded up to the slack */
+    int64_t slack;
+    uint64_t seq;
+    QEMUTimerList *timer_list;
     QEMUTimerCB *cb;
     void *opaque;
-    QEMUTimer *next;
+    int heap_index;             /* -1 if the timer is not pending */
+    int slack_index;            /* -1 if not in slack_heap */
     int scale;
+
+    /* Main loop wakeups caused by this timer */
+    const char *name;
+    uint64_t wakeups;
+    CallbackStats stats;
+    QLIST_ENTRY(QEMUTimer) link;
 };
 
 struct qemu_alarm_timer {
@@ -76,34 +130,138 @@ struct qemu_alarm_timer {
 #endif
     bool expired;
     bool pending;
+    /* No host timer: the main loop sleeps until the next deadline */
+    bool polled;
 };
 
 static struct qemu_alarm_timer *alarm_timer;
 
-static bool qemu_timer_expired_ns(QEMUTimer *timer_head, int64_t current_time)
+static bool timer_before(TimerHeap *h, QEMUTimer *a, QEMUTimer *b)
+{
+    int64_t ka = h->by_expire ? a->expire_time : a->deadline;
+    int64_t kb = h->by_expire ? b->expire_time : b->deadline;
+
+    return ka < kb || (ka == kb && a->seq < b->seq);
+}
+
+static int *timer_heap_index(TimerHeap *h, QEMUTimer *ts)
+{
+    return h->by_expire ? &ts->slack_index : &ts->heap_index;
+}
+
+static void timer_heap_set(TimerHeap *h, int i, QEMUTimer *ts)
+{
+    h->timers[i] = ts;
+    *timer_heap_index(h, ts) = i;
+}
+
+static void timer_heap_up(TimerHeap *h, int i)
+{
+    QEMUTimer *ts = h->timers[i];
+
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (!timer_before(h, ts, h->timers[parent])) {
+            break;
+        }
+        timer_heap_set(h, i, h->timers[parent]);
+        i = parent;
+    }
+    timer_heap_set(h, i, ts);
+}
+
+static void timer_heap_down(TimerHeap *h, int i)
+{
+    QEMUTimer *ts = h->timers[i];
+
+    for (;;) {
+        int child = 2 * i + 1;
+        if (child >= h->n) {
+            break;
+        }
+        if (child + 1 < h->n &&
+            timer_before(h, h->timers[child + 1], h->timers[child])) {
+            child++;
+        }
+        if (!timer_before(h, h->timers[child], ts)) {
+            break;
+        }
+        timer_heap_set(h, i, h->timers[child]);
+        i = child;
+    }
+    timer_heap_set(h, i, ts);
+}
+
+static void timer_heap_insert(TimerHeap *h, QEMUTimer *ts)
+{
+    if (h->n == h->size) {
+        h->size = h->size ? h->size * 2 : 16;
+        h->timers = g_renew(QEMUTimer *, h->timers, h->size);
+    }
+    timer_heap_set(h, h->n++, ts);
+    timer_heap_up(h, *timer_heap_index(h, ts));
+}
+
+static void timer_heap_remove(TimerHeap *h, QEMUTimer *ts)
+{
+    int i = *timer_heap_index(h, ts);
+    QEMUTimer *last = h->timers[--h->n];
+
+    *timer_heap_index(h, ts) = -1;
+    if (i < h->n) {
+        timer_heap_set(h, i, last);
+        timer_heap_up(h, i);
+        timer_heap_down(h, *timer_heap_index(h, last));
+    }
+}
+
+static QEMUTimer *timer_heap_first(TimerHeap *h)
+{
+    return h->n ? h->timers[0] : NULL;
+}
+
+static void timer_list_insert(QEMUTimerList *list, QEMUTimer *ts)
+{
+    ts->seq = list->seq++;
+    timer_heap_insert(&list->heap, ts);
+    if (ts->slack > 1) {
+        timer_heap_insert(&list->slack_heap, ts);
+    }
+}
+
+static void timer_list_remove(QEMUTimerList *list, QEMUTimer *ts)
+{
+    timer_heap_remove(&list->heap, ts);
+    if (ts->slack_index >= 0) {
+        timer_heap_remove(&list->slack_heap, ts);
+    }
+}
+
+static QEMUTimer *timer_list_first(QEMUTimerList *list)
 {
-    return timer_head && (timer_head->expire_time <= current_time);
+    return timer_heap_first(&list->heap);
 }
 
 static int64_t qemu_next_alarm_deadline(void)
 {
     int64_t delta = INT64_MAX;
     int64_t rtdelta;
+    QEMUTimer *ts;
 
-    if (!use_icount && vm_clock->enabled && vm_clock->active_timers) {
-        delta = vm_clock->active_timers->expire_time -
-                     qemu_get_clock_ns(vm_clock);
+    ts = timer_list_first(vm_clock->main_list);
+    if (!use_icount && vm_clock->enabled && ts) {
+        delta = ts->deadline - qemu_get_clock_ns(vm_clock);
     }
-    if (host_clock->enabled && host_clock->active_timers) {
-        int64_t hdelta = host_clock->active_timers->expire_time -
-                 qemu_get_clock_ns(host_clock);
+    ts = timer_list_first(host_clock->main_list);
+    if (host_clock->enabled && ts) {
+        int64_t hdelta = ts->deadline - qemu_get_clock_ns(host_clock);
         if (hdelta < delta) {
             delta = hdelta;
         }
     }
-    if (rt_clock->enabled && rt_clock->active_timers) {
-        rtdelta = (rt_clock->active_timers->expire_time -
-                 qemu_get_clock_ns(rt_clock));
+    ts = timer_list_first(rt_clock->main_list);
+    if (rt_clock->enabled && ts) {
+        rtdelta = ts->deadline - qemu_get_clock_ns(rt_clock);
         if (rtdelta < delta) {
             delta = rtdelta;
         }
@@ -135,6 +293,10 @@ static void win32_rearm_timer(struct qemu_alarm_timer *t, int64_t delta);
 
 #else
 
+static int poll_start_timer(struct qemu_alarm_timer *t);
+static void poll_stop_timer(struct qemu_alarm_timer *t);
+static void poll_rearm_timer(struct qemu_alarm_timer *t, int64_t delta);
+
 static int unix_start_timer(struct qemu_alarm_timer *t);
 static void unix_stop_timer(struct qemu_alarm_timer *t);
 static void unix_rearm_timer(struct qemu_alarm_timer *t, int64_t delta);
@@ -151,6 +313,7 @@ static void dynticks_rearm_timer(struct qemu_alarm_timer *t, int64_t delta);
 
 static struct qemu_alarm_timer alarm_timers[] = {
 #ifndef _WIN32
+    {"poll", poll_start_timer, poll_stop_timer, poll_rearm_timer},
 #ifdef __linux__
     {"dynticks", dynticks_start_timer,
      dynticks_stop_timer, dynticks_rearm_timer},
@@ -240,36 +403,48 @@ static QEMUClock *qemu_new_clock(int type)
     clock->enabled = true;
     clock->last = INT64_MIN;
     notifier_list_init(&clock->reset_notifiers);
+    QLIST_INIT(&clock->timer_lists);
+    clock->main_list = qemu_timer_list_new(clock, NULL, NULL);
     return clock;
 }
 
 void qemu_clock_enable(QEMUClock *clock, bool enabled)
 {
+    QEMUTimerList *list;
     bool old = clock->enabled;
     clock->enabled = enabled;
     if (enabled && !old) {
-        qemu_rearm_alarm_timer(alarm_timer);
+        if (alarm_timer) {
+            qemu_rearm_alarm_timer(alarm_timer);
+        }
+        QLIST_FOREACH(list, &clock->timer_lists, list) {
+            if (list->notify_cb) {
+                list->notify_cb(list->notify_opaque);
+            }
+        }
     }
 }
 
 int64_t qemu_clock_has_timers(QEMUClock *clock)
 {
-    return !!clock->active_timers;
+    return !!clock->main_list->heap.n;
 }
 
 int64_t qemu_clock_expired(QEMUClock *clock)
 {
-    return (clock->active_timers &&
-            clock->active_timers->expire_time < qemu_get_clock_ns(clock));
+    QEMUTimer *ts = timer_list_first(clock->main_list);
+
+    return ts && ts->deadline < qemu_get_clock_ns(clock);
 }
 
 int64_t qemu_clock_deadline(QEMUClock *clock)
 {
     /* To avoid problems with overflow limit this to 2^32.  */
     int64_t delta = INT32_MAX;
+    QEMUTimer *ts = timer_list_first(clock->main_list);
 
-    if (clock->active_timers) {
-        delta = clock->active_timers->expire_time - qemu_get_clock_ns(clock);
+    if (ts) {
+        delta = ts->deadline - qemu_get_clock_ns(clock);
     }
     if (delta < 0) {
         delta = 0;
@@ -277,74 +452,190 @@ int64_t qemu_clock_deadline(QEMUClock *clock)
     return delta;
 }
 
-QEMUTimer *qemu_new_timer(QEMUClock *clock, int scale,
-                          QEMUTimerCB *cb, void *opaque)
+QEMUTimerList *qemu_timer_list_new(QEMUClock *clock,
+                                   QEMUTimerListNotifyCB *notify_cb,
+                                   void *opaque)
+{
+    QEMUTimerList *list = g_new0(QEMUTimerList, 1);
+
+    list->clock = clock;
+    list->slack_heap.by_expire = true;
+    QLIST_INIT(&list->timers);
+    list->notify_cb = notify_cb;
+    list->notify_opaque = opaque;
+    QLIST_INSERT_HEAD(&clock->timer_lists, list, list);
+    return list;
+}
+
+void qemu_timer_list_free(QEMUTimerList *list)
+{
+    QEMUTimer *ts;
+
+    while ((ts = timer_list_first(list))) {
+        timer_list_remove(list, ts);
+    }
+    while ((ts = QLIST_FIRST(&list->timers))) {
+        QLIST_REMOVE(ts, link);
+        ts->timer_list = NULL;
+    }
+    QLIST_REMOVE(list, list);
+    g_free(list->heap.timers);
+    g_free(list->slack_heap.timers);
+    g_free(list);
+}
+
+QEMUClock *qemu_timer_list_clock(QEMUTimerList *list)
+{
+    return list->clock;
+}
+
+int64_t qemu_timer_list_deadline_ns(QEMUTimerList *list)
+{
+    QEMUTimer *ts = timer_list_first(list);
+    int64_t delta;
+
+    if (!ts || !list->clock->enabled) {
+        return -1;
+    }
+    delta = ts->deadline - qemu_get_clock_ns(list->clock);
+    return delta < 0 ? 0 : delta;
+}
+
+bool qemu_timer_list_run(QEMUTimerList *list)
+{
+    QEMUTimer *ts;
+    int64_t current_time, start;
+    const char *owner;
+    bool progress = false;
+
+    if (!list->heap.n || !list->clock->enabled) {
+        return false;
+    }
+
+    current_time = qemu_get_clock_ns(list->clock);
+    for (;;) {
+        ts = timer_list_first(list);
+        if (!ts || ts->deadline > current_time) {
+            /* We are awake anyway: run the timers with slack that are due */
+            ts = timer_heap_first(&list->slack_heap);
+            if (!ts || ts->expire_time > current_time) {
+                break;
+            }
+        }
+        /* remove timer from the list before calling the callback */
+        timer_list_remove(list, ts);
+
+        if (!list->notify_cb && main_loop_claim_wakeup()) {
+            ts->wakeups++;
+        }
+
+        /* run the callback (the timer list can be modified) */
+        start = callback_stats_begin(&ts->stats, &owner);
+        ts->cb(ts->opaque);
+        callback_stats_end(&ts->stats, owner, start);
+        progress = true;
+    }
+    return progress;
+}
+
+QEMUTimer *qemu_timer_list_new_timer(QEMUTimerList *list, int scale,
+                                     QEMUTimerCB *cb, void *opaque)
 {
     QEMUTimer *ts;
 
     ts = g_malloc0(sizeof(QEMUTimer));
-    ts->clock = clock;
+    ts->timer_list = list;
     ts->cb = cb;
     ts->opaque = opaque;
     ts->scale = scale;
+    ts->heap_index = -1;
+    ts->slack_index = -1;
+    callback_stats_init(&ts->stats);
+    QLIST_INSERT_HEAD(&list->timers, ts, link);
     return ts;
 }
 
+QEMUTimer *qemu_new_timer(QEMUClock *clock, int scale,
+                          QEMUTimerCB *cb, void *opaque)
+{
+    return qemu_timer_list_new_timer(clock->main_list, scale, cb, opaque);
+}
+
 void qemu_free_timer(QEMUTimer *ts)
 {
+    if (ts->timer_list) {
+        qemu_del_timer(ts);
+        QLIST_REMOVE(ts, link);
+    }
     g_free(ts);
 }
 
 /* stop a timer, but do not dealloc it */
 void qemu_del_timer(QEMUTimer *ts)
 {
-    QEMUTimer **pt, *t;
+    if (ts->heap_index >= 0) {
+        timer_list_remove(ts->timer_list, ts);
+    }
+}
 
-    /* NOTE: this code must be signal safe because
-       qemu_timer_expired() can be called from a signal. */
-    pt = &ts->clock->active_timers;
-    for(;;) {
-        t = *pt;
-        if (!t)
-            break;
-        if (t == ts) {
-            *pt = t->next;
-            break;
-        }
-        pt = &t->next;
+void qemu_timer_set_slack(QEMUTimer *ts, int64_t slack)
+{
+    bool pending = qemu_timer_pending(ts);
+
+    qemu_del_timer(ts);
+    ts->slack = slack * ts->scale;
+    if (pending) {
+        qemu_mod_timer_ns(ts, ts->expire_time);
     }
 }
 
+void qemu_timer_set_name(QEMUTimer *ts, const char *name)
+{
+    ts->name = name;
+}
+
+/* Round @expire_time up to a multiple of the slack, so that timers with
+ * the same slack expire together */
+static int64_t qemu_timer_deadline(QEMUTimer *ts, int64_t expire_time)
+{
+    int64_t rem;
+
+    if (ts->slack <= 1 || expire_time <= 0 ||
+        expire_time > INT64_MAX - ts->slack) {
+        return expire_time;
+    }
+    rem = expire_time % ts->slack;
+    return rem ? expire_time - rem + ts->slack : expire_time;
+}
+
 /* modify the current timer so that it will be fired when current_time
    >= expire_time. The corresponding callback will be called. */
 void qemu_mod_timer_ns(QEMUTimer *ts, int64_t expire_time)
 {
-    QEMUTimer **pt, *t;
-
-    qemu_del_timer(ts);
+    QEMUTimerList *list = ts->timer_list;
+    int64_t deadline = qemu_timer_deadline(ts, expire_time);
 
-    /* add the timer in the sorted list */
-    /* NOTE: this code must be signal safe because
-       qemu_timer_expired() can be called from a signal. */
-    pt = &ts->clock->active_timers;
-    for(;;) {
-        t = *pt;
-        if (!qemu_timer_expired_ns(t, expire_time)) {
-            break;
+    ts->expire_time = expire_time;
+    if (ts->heap_index >= 0) {
+        if (ts->deadline == deadline && ts->slack_index < 0) {
+            return;
         }
-        pt = &t->next;
+        timer_list_remove(list, ts);
     }
-    ts->expire_time = expire_time;
-    ts->next = *pt;
-    *pt = ts;
+    ts->deadline = deadline;
+    timer_list_insert(list, ts);
 
     /* Rearm if necessary  */
-    if (pt == &ts->clock->active_timers) {
+    if (ts->heap_index == 0) {
+        if (list->notify_cb) {
+            list->notify_cb(list->notify_opaque);
+            return;
+        }
         if (!alarm_timer->pending) {
             qemu_rearm_alarm_timer(alarm_timer);
         }
         /* Interrupt execution to force deadline recalculation.  */
-        qemu_clock_warp(ts->clock);
+        qemu_clock_warp(list->clock);
         if (use_icount) {
             qemu_notify_event();
         }
@@ -358,41 +649,81 @@ void qemu_mod_timer(QEMUTimer *ts, int64_t expire_time)
 
 bool qemu_timer_pending(QEMUTimer *ts)
 {
-    QEMUTimer *t;
-    for (t = ts->clock->active_timers; t != NULL; t = t->next) {
-        if (t == ts) {
-            return true;
-        }
-    }
-    return false;
+    return ts->heap_index >= 0;
 }
 
 bool qemu_timer_expired(QEMUTimer *timer_head, int64_t current_time)
 {
-    return qemu_timer_expired_ns(timer_head, current_time * timer_head->scale);
+    return timer_head &&
+           timer_head->expire_time <= current_time * timer_head->scale;
 }
 
-void qemu_run_timers(QEMUClock *clock)
+static const char *qemu_clock_name(QEMUClock *clock)
+{
+    switch (clock->type) {
+    case QEMU_CLOCK_REALTIME:
+        return "rt";
+    case QEMU_CLOCK_VIRTUAL:
+        return "vm";
+    default:
+        return "host";
+    }
+}
+
+WakeupSourceList *qemu_timer_wakeup_sources(WakeupSourceList *list)
 {
+    QEMUClock *clocks[] = { rt_clock, vm_clock, host_clock };
     QEMUTimer *ts;
-    int64_t current_time;
-   
-    if (!clock->enabled)
-        return;
+    int i;
 
-    current_time = qemu_get_clock_ns(clock);
-    for(;;) {
-        ts = clock->active_timers;
-        if (!qemu_timer_expired_ns(ts, current_time)) {
-            break;
+    for (i = 0; i < ARRAY_SIZE(clocks); i++) {
+        QLIST_FOREACH(ts, &clocks[i]->main_list->timers, link) {
+            WakeupSourceList *entry;
+            WakeupSource *source;
+
+            if (!ts->wakeups) {
+                continue;
+            }
+            source = g_new0(WakeupSource, 1);
+            source->kind = g_strdup("timer");
+            source->name = ts->name ? g_strdup(ts->name) :
+                           g_strdup_printf("timer@%p", ts->cb);
+            source->has_clock = true;
+            source->clock = g_strdup(qemu_clock_name(clocks[i]));
+            if (ts->slack > 1) {
+                source->has_slack_ns = true;
+                source->slack_ns = ts->slack;
+            }
+            source->wakeups = ts->wakeups;
+
+            entry = g_new0(WakeupSourceList, 1);
+            entry->value = source;
+            entry->next = list;
+            list = entry;
         }
-        /* remove timer from the list before calling the callback */
-        clock->active_timers = ts->next;
-        ts->next = NULL;
+    }
+    return list;
+}
 
-        /* run the callback (the timer list can be modified) */
-        ts->cb(ts->opaque);
+CallbackAccountingList *qemu_timer_cpu_accounting(CallbackAccountingList *list)
+{
+    QEMUClock *clocks[] = { rt_clock, vm_clock, host_clock };
+    QEMUTimer *ts;
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(clocks); i++) {
+        QLIST_FOREACH(ts, &clocks[i]->main_list->timers, link) {
+            list = callback_stats_list(list, &ts->stats, "timer",
+                                       ts->name ? g_strdup(ts->name) :
+                                       g_strdup_printf("timer@%p", ts->cb));
+        }
     }
+    return list;
+}
+
+void qemu_run_timers(QEMUClock *clock)
+{
+    qemu_timer_list_run(clock->main_list);
 }
 
 int64_t qemu_get_clock_ns(QEMUClock *clock)
@@ -439,6 +770,36 @@ void init_clocks(void)
     }
 }
 
+int64_t qemu_timer_main_loop_timeout(void)
+{
+    int64_t delta;
+
+    if (!alarm_timer || !alarm_timer->polled) {
+        return -1;
+    }
+    delta = qemu_next_alarm_deadline();
+    if (delta == INT64_MAX) {
+        return -1;
+    }
+    return delta < 0 ? 0 : delta;
+}
+
+int qemu_poll_ns(GPollFD *fds, guint nfds, int64_t timeout)
+{
+#ifdef CONFIG_PPOLL
+    struct timespec ts;
+
+    if (timeout < 0) {
+        return ppoll((struct pollfd *)fds, nfds, NULL, NULL);
+    }
+    ts.tv_sec = timeout / 1000000000LL;
+    ts.tv_nsec = timeout % 1000000000LL;
+    return ppoll((struct pollfd *)fds, nfds, &ts, NULL);
+#else
+    return g_poll(fds, nfds, qemu_timeout_ns_to_ms(timeout));
+#endif
+}
+
 uint64_t qemu_timer_expire_time_ns(QEMUTimer *ts)
 {
     return qemu_timer_pending(ts) ? ts->expire_time : -1;
@@ -558,6 +919,30 @@ static void dynticks_rearm_timer(struct qemu_alarm_timer *t,
 
 #if !defined(_WIN32)
 
+static QemuThread main_loop_thread;
+
+static int poll_start_timer(struct qemu_alarm_timer *t)
+{
+    qemu_thread_get_self(&main_loop_thread);
+    t->polled = true;
+    return 0;
+}
+
+static void poll_stop_timer(struct qemu_alarm_timer *t)
+{
+}
+
+static void poll_rearm_timer(struct qemu_alarm_timer *t,
+                             int64_t nearest_delta_ns)
+{
+    /* The main loop computes its timeout right before it sleeps.  Only
+     * a timer armed by another thread can be earlier than that.
+     */
+    if (!qemu_thread_is_self(&main_loop_thread)) {
+        qemu_notify_event();
+    }
+}
+
 static int unix_start_timer(struct qemu_alarm_timer *t)
 {
     struct sigaction act;
@@ -530,8 +530,34 @@ Example:
                                "format": "utf8" } }
 <- {"return": "abcdefgh"}
 
+EQMP
+
+SQMP
+template-save
+-------------
+
+Save guest RAM and the state of all devices to a file, from which new VMs
+start with -machine ram-template=file.  The block devices of the VM are not
+saved by this command.
+
+Arguments:
+
+- "filename": the template file (json-string)
+
+Example:
+
+-> { "execute": "template-save",
+     "arguments": { "filename": "/var/lib/qemu/worker.tmpl" } }
+<- { "return": {} }
+
 EQMP
 
+    {
+        .name       = "template-save",
+        .args_type  = "filename:F",
+        .mhandler.cmd_new = qmp_marshal_input_template_save,
+    },
+
     {
         .name       = "xen-save-devices-state",
         .args_type  = "filename:F",
@@ -658,6 +684,53 @@ Example:
 -> { "execute": "migrate-set-cache-size", "arguments": { "value": 536870912 } }
 <- { "return": {} }
 
+EQMP
+    {
+        .name       = "migrate-set-threads",
+        .args_type  = "threads:i,compress-level:i?",
+        .mhandler.cmd_new = qmp_marshal_input_migrate_set_threads,
+    },
+
+SQMP
+migrate-set-threads
+-------------------
+
+Set the number of worker threads used when the multi-thread capability is
+on, and the zlib level used when the compress capability is on
+
+Arguments:
+
+- "threads": number of worker threads, 1 to 16 (json-int)
+- "compress-level": zlib compression level, 1 to 9 (json-int, optional)
+
+Example:
+
+-> { "execute": "migrate-set-threads", "arguments": { "threads": 8,
+                                                       "compress-level": 1 } }
+<- { "return": {} }
+
+EQMP
+    {
+        .name       = "migrate-set-block-inflight",
+        .args_type  = "value:i",
+        .mhandler.cmd_new = qmp_marshal_input_migrate_set_block_inflight,
+    },
+
+SQMP
+migrate-set-block-inflight
+--------------------------
+
+Set the number of reads block migration keeps in flight on each device
+
+Arguments:
+
+- "value": number of reads per device, 1 to 64 (json-int)
+
+Example:
+
+-> { "execute": "migrate-set-block-inflight", "arguments": { "value": 32 } }
+<- { "return": {} }
+
 EQMP
     {
         .name       = "query-migrate-cache-size",
@@ -679,6 +752,50 @@ Example:
 -> { "execute": "query-migrate-cache-size" }
 <- { "return": 67108864 }
 
+EQMP
+
+    {
+        .name       = "query-migrate-iterations",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_migrate_iterations,
+    },
+
+SQMP
+query-migrate-iterations
+------------------------
+
+Show the most recent iterations (up to 64) of the current or last
+migration, oldest first.  An iteration ends with each sync of the dirty
+bitmap.
+
+Each element of the returned json-array is a json-object with:
+
+- "iteration": iteration number (json-int)
+- "start-time": start of the iteration, in milliseconds (json-int)
+- "duration": length of the iteration, in milliseconds (json-int)
+- "dirtied-pages": pages newly dirty at the end of the iteration (json-int)
+- "sent-pages": pages sent in full (json-int)
+- "zero-pages": uniform pages sent as one byte (json-int)
+- "xbzrle-pages": XBZRLE-encoded pages (json-int)
+- "xbzrle-cache-hits": pages found in the XBZRLE cache (json-int)
+- "sync-time": duration of the closing bitmap sync, in microseconds (json-int)
+- "bytes": bytes written to the transport (json-int)
+- "blocked-time": microseconds spent writing to the transport or waiting
+                  for the bandwidth limit (json-int)
+
+Example:
+
+-> { "execute": "query-migrate-iterations" }
+<- { "return": [
+        { "iteration": 0, "start-time": 92653766, "duration": 12,
+          "dirtied-pages": 0, "sent-pages": 0, "zero-pages": 0,
+          "xbzrle-pages": 0, "xbzrle-cache-hits": 0, "sync-time": 8120,
+          "bytes": 0, "blocked-time": 0 },
+        { "iteration": 1, "start-time": 92653778, "duration": 1825,
+          "dirtied-pages": 4210, "sent-pages": 243213, "zero-pages": 20971,
+          "xbzrle-pages": 0, "xbzrle-cache-hits": 0, "sync-time": 1403,
+          "bytes": 997286163, "blocked-time": 1611205 } ] }
+
 EQMP
 
     {
@@ -765,8 +882,9 @@ EQMP
 
     {
         .name       = "dump-guest-memory",
-        .args_type  = "paging:b,protocol:s,begin:i?,end:i?",
-        .params     = "-p protocol [begin] [length]",
+        .args_type  = "paging:b,protocol:s,begin:i?,end:i?,format:s?,"
+                      "detach:b?",
+        .params     = "-p protocol [begin] [length] [format] [detach]",
         .help       = "dump guest memory to file",
         .user_print = monitor_user_noop,
         .mhandler.cmd_new = qmp_marshal_input_dump_guest_memory,
@@ -787,6 +905,11 @@ Arguments:
            with length together (json-int)
 - "length": the memory size, in bytes. It's optional, and should be specified
             with begin together (json-int)
+- "format": "elf" (the default), "kdump-zlib", "kdump-lzo" or
+            "kdump-snappy". The kdump formats need a seekable file and
+            cannot be combined with paging, begin and length (json-string)
+- "detach": return at once and dump from a separate thread; see query-dump
+            and the DUMP_COMPLETED event (json-bool)
 
 Example:
 
@@ -797,6 +920,89 @@ Notes:
 
 (1) All boolean arguments default to false
 
+EQMP
+
+    {
+        .name       = "savevm-start",
+        .args_type  = "name:s?",
+        .mhandler.cmd_new = qmp_marshal_input_savevm_start,
+    },
+
+SQMP
+savevm-start
+------------
+
+Start an internal snapshot of the whole virtual machine, writing RAM while
+the guest runs.  The guest is only stopped for the last pass over RAM and
+the device state.  Progress is reported by query-savevm.
+
+Arguments:
+
+- "name": tag of the snapshot; an existing snapshot with the same tag or ID
+          is replaced (json-string, optional)
+
+Example:
+
+-> { "execute": "savevm-start", "arguments": { "name": "before-upgrade" } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "query-savevm",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_savevm,
+    },
+
+SQMP
+query-savevm
+------------
+
+Query the progress of the last live snapshot.
+
+Return a json-object with the following information:
+
+- "status": "none", "active", "completed" or "failed" (json-string)
+- "name": tag of the snapshot (json-string, optional)
+- "vmstate-size": bytes of VM state written so far (json-int, optional)
+- "total-time": milliseconds since the start, or that the snapshot took
+                (json-int, optional)
+- "downtime": milliseconds the guest was stopped (json-int, optional)
+- "error": why the snapshot failed (json-string, optional)
+
+Example:
+
+-> { "execute": "query-savevm" }
+<- { "return": { "status": "completed", "name": "before-upgrade",
+                 "vmstate-size": 8925011456, "total-time": 41250,
+                 "downtime": 280 } }
+
+EQMP
+
+    {
+        .name       = "query-dump",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_dump,
+    },
+
+SQMP
+query-dump
+----------
+
+Query the progress of the last guest memory dump.
+
+Return a json-object with the following information:
+
+- "status": "none", "active", "completed" or "failed" (json-string)
+- "completed": bytes of guest memory dumped so far (json-int)
+- "total": bytes of guest memory to dump (json-int)
+
+Example:
+
+-> { "execute": "query-dump" }
+<- { "return": { "status": "active", "completed": 1073741824,
+                 "total": 4294967296 } }
+
 EQMP
 
     {
@@ -878,19 +1084,19 @@ EQMP
 
     {
         .name       = "block-stream",
-        .args_type  = "device:B,base:s?,speed:o?,on-error:s?",
+        .args_type  = "device:B,base:s?,speed:o?,on-error:s?,max-in-flight:i?",
         .mhandler.cmd_new = qmp_marshal_input_block_stream,
     },
 
     {
         .name       = "block-commit",
-        .args_type  = "device:B,base:s?,top:s,speed:o?",
+        .args_type  = "device:B,base:s?,top:s,speed:o?,max-in-flight:i?",
         .mhandler.cmd_new = qmp_marshal_input_block_commit,
     },
 
     {
         .name       = "block-job-set-speed",
-        .args_type  = "device:B,speed:o",
+        .args_type  = "device:B,speed:o,priority:s?",
         .mhandler.cmd_new = qmp_marshal_input_block_job_set_speed,
     },
 
@@ -1006,7 +1212,7 @@ EQMP
         .name       = "drive-mirror",
         .args_type  = "sync:s,device:B,target:s,speed:i?,mode:s?,format:s?,"
                       "on-source-error:s?,on-target-error:s?,"
-                      "granularity:i?,buf-size:i?",
+                      "granularity:i?,buf-size:i?,copy-mode:s?",
         .mhandler.cmd_new = qmp_marshal_input_drive_mirror,
     },
 
@@ -1041,6 +1247,10 @@ Arguments:
   (BlockdevOnError, default 'report')
 - "on-target-error": the action to take on an error on the target
   (BlockdevOnError, default 'report')
+- "copy-mode": "background" to copy guest writes to the target after they
+  reach the source, or "write-blocking" to write them to the target before
+  they complete, so that the job is guaranteed to converge
+  (MirrorCopyMode, default 'background')
 
 The default value of the granularity is the image cluster size clamped
 between 4096 and 65536, if the image format defines one.  If the format
@@ -1056,6 +1266,137 @@ Example:
                                                "format": "qcow2" } }
 <- { "return": {} }
 
+EQMP
+
+    {
+        .name       = "block-dirty-bitmap-add",
+        .args_type  = "device:B,name:s,granularity:i?,persistent:b?",
+        .mhandler.cmd_new = qmp_marshal_input_block_dirty_bitmap_add,
+    },
+
+SQMP
+block-dirty-bitmap-add
+----------------------
+
+Create a named dirty bitmap that records the sectors written to a device.
+A persistent bitmap is stored in the image when the device is closed and
+loaded again when it is opened; only qcow2 images of version 3 support it.
+
+Arguments:
+
+- "device": device name (json-string)
+- "name": name of the new bitmap (json-string)
+- "granularity": bytes covered by each bit, a power of 2 of at least 512
+  (json-int, optional, default 65536)
+- "persistent": store the bitmap in the image (json-bool, optional,
+  default false)
+
+Example:
+
+-> { "execute": "block-dirty-bitmap-add", "arguments": { "device": "ide-hd0",
+                                                         "name": "backup0",
+                                                         "persistent": true } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "block-dirty-bitmap-remove",
+        .args_type  = "device:B,name:s",
+        .mhandler.cmd_new = qmp_marshal_input_block_dirty_bitmap_remove,
+    },
+
+SQMP
+block-dirty-bitmap-remove
+-------------------------
+
+Free a named dirty bitmap.  Fails if a drive-backup job uses it.
+
+Arguments:
+
+- "device": device name (json-string)
+- "name": name of the bitmap (json-string)
+
+Example:
+
+-> { "execute": "block-dirty-bitmap-remove", "arguments": { "device": "ide-hd0",
+                                                            "name": "backup0" } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "block-dirty-bitmap-clear",
+        .args_type  = "device:B,name:s",
+        .mhandler.cmd_new = qmp_marshal_input_block_dirty_bitmap_clear,
+    },
+
+SQMP
+block-dirty-bitmap-clear
+------------------------
+
+Mark all the sectors of a named dirty bitmap as clean.  Fails if a
+drive-backup job uses it.
+
+Arguments:
+
+- "device": device name (json-string)
+- "name": name of the bitmap (json-string)
+
+Example:
+
+-> { "execute": "block-dirty-bitmap-clear", "arguments": { "device": "ide-hd0",
+                                                           "name": "backup0" } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "drive-backup",
+        .args_type  = "device:B,target:s,bitmap:s?,speed:i?,mode:s?,format:s?,"
+                      "on-source-error:s?,on-target-error:s?",
+        .mhandler.cmd_new = qmp_marshal_input_drive_backup,
+    },
+
+SQMP
+drive-backup
+------------
+
+Start a block job that copies the contents of the device at the time of
+the command to a target image.  Guest writes to sectors that were not
+copied yet first copy the old data to the target.
+
+With a dirty bitmap, only the sectors that are dirty in it are copied and
+the bitmap starts over with the writes for the next backup.  If the job
+fails or is cancelled, the sectors of the backup are marked dirty again.
+With mode 'existing', the target is opened with its backing file, normally
+the previous backup; otherwise a new image of the same size as the device
+is created, with the format of the device unless format is given.
+
+Arguments:
+
+- "device": device name to operate on (json-string)
+- "target": name of the target image (json-string)
+- "bitmap": name of the dirty bitmap to back up, the whole device if not
+  given (json-string, optional)
+- "format": format of the target image (json-string, optional)
+- "mode": how the target image should be created (NewImageMode, optional,
+  default 'absolute-paths')
+- "speed": maximum speed of the job, in bytes per second (json-int,
+  optional)
+- "on-source-error": the action to take on an error on the source
+  (BlockdevOnError, default 'report')
+- "on-target-error": the action to take on an error on the target
+  (BlockdevOnError, default 'report')
+
+Example:
+
+-> { "execute": "drive-backup", "arguments": { "device": "ide-hd0",
+                                               "target": "/backup/inc1.qcow2",
+                                               "bitmap": "backup0",
+                                               "mode": "existing" } }
+<- { "return": {} }
+
 EQMP
 
     {
@@ -1312,7 +1653,10 @@ EQMP
 
     {
         .name       = "block_set_io_throttle",
-        .args_type  = "device:B,bps:l,bps_rd:l,bps_wr:l,iops:l,iops_rd:l,iops_wr:l",
+        .args_type  = "device:B,bps:l,bps_rd:l,bps_wr:l,iops:l,iops_rd:l,iops_wr:l,"
+                      "bps_max:l?,bps_rd_max:l?,bps_wr_max:l?,"
+                      "iops_max:l?,iops_rd_max:l?,iops_wr_max:l?,"
+                      "iops_size:l?,group:s?",
         .mhandler.cmd_new = qmp_marshal_input_block_set_io_throttle,
     },
 
@@ -1331,6 +1675,15 @@ Arguments:
 - "iops":  total I/O operations per second(json-int)
 - "iops_rd":  read I/O operations per second(json-int)
 - "iops_wr":  write I/O operations per second(json-int)
+- "bps_max":  total burst size in bytes(json-int, optional)
+- "bps_rd_max":  read burst size in bytes(json-int, optional)
+- "bps_wr_max":  write burst size in bytes(json-int, optional)
+- "iops_max":  total burst size in I/O operations(json-int, optional)
+- "iops_rd_max":  read burst size in I/O operations(json-int, optional)
+- "iops_wr_max":  write burst size in I/O operations(json-int, optional)
+- "iops_size":  I/O size in bytes above which a request counts as several
+                operations(json-int, optional)
+- "group":  throttle group whose limits are shared(json-string, optional)
 
 Example:
 
@@ -1340,7 +1693,66 @@ Example:
                                                "bps_wr": "0",
                                                "iops": "0",
                                                "iops_rd": "0",
-                                               "iops_wr": "0" } }
+                                               "iops_wr": "0",
+                                               "bps_max": "8000000",
+                                               "group": "tenant0" } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "block-latency-histogram-set",
+        .args_type  = "device:B,boundaries:q?,boundaries-read:q?,"
+                      "boundaries-write:q?,boundaries-flush:q?",
+        .mhandler.cmd_new = qmp_marshal_input_block_latency_histogram_set,
+    },
+
+SQMP
+block-latency-histogram-set
+---------------------------
+
+Set the bin boundaries of the latency histograms of a block device.
+
+Arguments:
+
+- "device": device name (json-string)
+- "boundaries": boundaries for all request types, a json-array of
+                json-objects with "ns" (json-array, optional)
+- "boundaries-read": boundaries for reads (json-array, optional)
+- "boundaries-write": boundaries for writes (json-array, optional)
+- "boundaries-flush": boundaries for flushes (json-array, optional)
+
+Without any boundaries, the default log-scale ones are restored.
+
+Example:
+
+-> { "execute": "block-latency-histogram-set",
+     "arguments": { "device": "virtio0",
+                    "boundaries": [ { "ns": 1000000 }, { "ns": 10000000 } ] } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "block-latency-histogram-reset",
+        .args_type  = "device:B",
+        .mhandler.cmd_new = qmp_marshal_input_block_latency_histogram_reset,
+    },
+
+SQMP
+block-latency-histogram-reset
+-----------------------------
+
+Clear the latency and queue depth histograms of a block device.
+
+Arguments:
+
+- "device": device name (json-string)
+
+Example:
+
+-> { "execute": "block-latency-histogram-reset",
+     "arguments": { "device": "virtio0" } }
 <- { "return": {} }
 
 EQMP
@@ -1531,6 +1943,7 @@ EQMP
         .name       = "query-version",
         .args_type  = "",
         .mhandler.cmd_new = qmp_marshal_input_query_version,
+        .flags      = MONITOR_CMD_THREAD_SAFE,
     },
 
 SQMP
@@ -1568,6 +1981,7 @@ EQMP
         .name       = "query-commands",
         .args_type  = "",
         .mhandler.cmd_new = qmp_marshal_input_query_commands,
+        .flags      = MONITOR_CMD_THREAD_SAFE,
     },
 
 SQMP
@@ -1605,6 +2019,7 @@ EQMP
         .name       = "query-events",
         .args_type  = "",
         .mhandler.cmd_new = qmp_marshal_input_query_events,
+        .flags      = MONITOR_CMD_THREAD_SAFE,
     },
 
 SQMP
@@ -1681,6 +2096,14 @@ Each json-object contain the following:
          - "iops": limit total I/O operations per second (json-int)
          - "iops_rd": limit read operations per second (json-int)
          - "iops_wr": limit write operations per second (json-int)
+         - "bps_max": total burst size in bytes (json-int, optional)
+         - "bps_rd_max": read burst size in bytes (json-int, optional)
+         - "bps_wr_max": write burst size in bytes (json-int, optional)
+         - "iops_max": total burst size in operations (json-int, optional)
+         - "iops_rd_max": read burst size in operations (json-int, optional)
+         - "iops_wr_max": write burst size in operations (json-int, optional)
+         - "iops_size": I/O size counted as one operation (json-int, optional)
+         - "group": throttle group of the device (json-string, optional)
 
 - "io-status": I/O operation status, only present if the device supports it
                and the VM is configured to stop on errors. It's always reset
@@ -1765,6 +2188,23 @@ Each json-object contain the following:
     - "flush_total_time_ns": total time spend on cache flushes in nano-seconds (json-int)
     - "wr_highest_offset": Highest offset of a sector written since the
                            BlockDriverState has been opened (json-int)
+    - "serialized_operations": requests that waited for an overlapping
+                               request (json-int)
+    - "serialized_total_time_ns": total time spent waiting for overlapping
+                                  requests in nano-seconds (json-int)
+    - "rd_merged": read requests merged into another one (json-int)
+    - "wr_merged": write requests merged into another one (json-int)
+    - "in_flight": requests submitted by the device that have not completed
+                   yet (json-int)
+    - "rd_latency_histogram": read latency in nano-seconds, a json-array of
+                              json-objects with "start" and "count"
+                              (json-array, optional)
+    - "wr_latency_histogram": write latency, same format (json-array,
+                              optional)
+    - "flush_latency_histogram": flush latency, same format (json-array,
+                                 optional)
+    - "queue_depth_histogram": requests in flight sampled at submission,
+                               same format (json-array, optional)
 - "parent": Contains recursively the statistics of the underlying
             protocol (e.g. the host file for a qcow2 image). If there is
             no underlying protocol, this field is omitted
@@ -1903,6 +2343,63 @@ EQMP
         .mhandler.cmd_new = qmp_marshal_input_query_cpus,
     },
 
+SQMP
+query-threads
+-------------
+
+Show the host threads that can be placed with set-thread-affinity.
+
+Return a json-array of json-objects, which contain:
+
+- "name": "vcpu<N>" for a VCPU, otherwise what the thread serves (json-string)
+- "thread-id": ID of the host thread (json-int)
+- "numa-node": guest NUMA node of a VCPU, if NUMA is configured (json-int,
+  optional)
+
+Example:
+
+-> { "execute": "query-threads" }
+<- { "return": [ { "name": "vcpu0", "thread-id": 3134, "numa-node": 0 },
+                 { "name": "vcpu1", "thread-id": 3135, "numa-node": 1 },
+                 { "name": "virtio-blk/virtio0/queue0", "thread-id": 3140 },
+                 { "name": "vhost", "thread-id": 3141 } ] }
+
+EQMP
+
+    {
+        .name       = "query-threads",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_threads,
+    },
+
+SQMP
+set-thread-affinity
+-------------------
+
+Restrict a thread listed by query-threads to a set of host CPUs.
+
+Arguments:
+
+- "thread-id": ID of the host thread (json-int)
+- "cpus": host CPUs the thread may run on (json-array of json-object)
+    - "cpu": number of the host CPU (json-int)
+
+Example:
+
+-> { "execute": "set-thread-affinity",
+     "arguments": { "thread-id": 3135,
+                    "cpus": [ { "cpu": 8 }, { "cpu": 9 },
+                              { "cpu": 10 }, { "cpu": 11 } ] } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "set-thread-affinity",
+        .args_type  = "thread-id:i,cpus:q",
+        .mhandler.cmd_new = qmp_marshal_input_set_thread_affinity,
+    },
+
 SQMP
 query-pci
 ---------
@@ -2142,6 +2639,376 @@ EQMP
         .name       = "query-kvm",
         .args_type  = "",
         .mhandler.cmd_new = qmp_marshal_input_query_kvm,
+        .flags      = MONITOR_CMD_THREAD_SAFE,
+    },
+
+SQMP
+query-wakeups
+-------------
+
+Show which timers and bottom halves woke up the main loop.
+
+Return a json-object with the following information:
+
+- "total": number of times the main loop woke up from a blocking wait
+           (json-int)
+- "io": wakeups not caused by a timer or bottom half (json-int)
+- "sources": json-array of json-objects with the following information:
+    - "kind": "timer" or "bh" (json-string)
+    - "name": name of the timer or bottom half, or address of its
+              callback (json-string)
+    - "clock": "rt", "vm" or "host", for timers (json-string, optional)
+    - "slack-ns": how late the timer may fire (json-int, optional)
+    - "wakeups": number of wakeups it caused (json-int)
+
+Example:
+
+-> { "execute": "query-wakeups" }
+<- { "return": { "total": 1520, "io": 312,
+                 "sources": [ { "kind": "timer", "name": "rtc-update",
+                                "clock": "host", "wakeups": 1100 },
+                              { "kind": "bh", "name": "bh@0x7f3c1e2d40",
+                                "wakeups": 108 } ] } }
+
+EQMP
+
+    {
+        .name       = "query-wakeups",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_wakeups,
+    },
+
+SQMP
+query-cpu-accounting
+--------------------
+
+Show the time spent in each timer, bottom half and fd handler of the main
+loop, and how long each thread waited for and held the iothread lock.
+
+Return a json-object with the following information:
+
+- "callbacks": json-array of json-objects with the following information:
+    - "kind": "fd", "timer" or "bh" (json-string)
+    - "name": name of the timer or bottom half, "fdN" for an fd handler,
+              "glib" for the GLib sources, or address of the callback
+              (json-string)
+    - "owner": qdev ID or type of the device that created the callback,
+               or the subsystem (json-string, optional)
+    - "calls": number of times the callback ran (json-int)
+    - "time-ns": time spent in the callback (json-int)
+- "threads": json-array of json-objects with the following information:
+    - "thread-id": host thread ID (json-int)
+    - "name": "main", "vcpuN" or the name from query-threads
+              (json-string, optional)
+    - "acquisitions": number of times the thread took the lock (json-int)
+    - "wait-ns": time spent waiting for the lock (json-int)
+    - "hold-ns": time the lock was held (json-int)
+
+Example:
+
+-> { "execute": "query-cpu-accounting" }
+<- { "return": { "callbacks": [ { "kind": "bh", "name": "virtio-net-tx",
+                                  "owner": "net0", "calls": 81230,
+                                  "time-ns": 2843120500 },
+                                { "kind": "fd", "name": "fd23",
+                                  "owner": "vnc", "calls": 5210,
+                                  "time-ns": 912000310 } ],
+                 "threads": [ { "thread-id": 4821, "name": "vcpu0",
+                                "acquisitions": 1203344,
+                                "wait-ns": 523100200,
+                                "hold-ns": 3120004100 },
+                              { "thread-id": 4817, "name": "main",
+                                "acquisitions": 98230,
+                                "wait-ns": 210300400,
+                                "hold-ns": 4810203300 } ] } }
+
+EQMP
+
+    {
+        .name       = "query-cpu-accounting",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_cpu_accounting,
+    },
+
+SQMP
+query-bql
+---------
+
+Show how long the iothread lock was waited for and held at each site.
+The figures are only collected with -machine bql-profile=on.
+
+Return a json-object with the following information:
+
+- "enabled": whether bql-profile is on (json-bool)
+- "sites": json-array of json-objects with the following information:
+    - "site": "other", "vcpu", "main-loop", "migration" or "monitor"
+              (json-string)
+    - "acquisitions": number of times the lock was taken (json-int)
+    - "wait-ns": total time spent waiting for the lock (json-int)
+    - "max-wait-ns": longest wait (json-int)
+    - "wait-histogram": waits by duration (json-array of json-object)
+        - "count": number of waits in the bucket (json-int)
+    - "holds": number of times the lock was held (json-int)
+    - "hold-ns": total time the lock was held (json-int)
+    - "max-hold-ns": longest hold (json-int)
+    - "hold-histogram": holds by duration (json-array of json-object)
+        - "count": number of holds in the bucket (json-int)
+
+The histograms have 24 buckets: times below 1 us, then from 2^(n-1) to
+2^n us for bucket n; the last bucket also counts longer times.
+
+Example:
+
+-> { "execute": "query-bql" }
+<- { "return": { "enabled": true,
+                 "sites": [ { "site": "vcpu", "acquisitions": 1203344,
+                              "wait-ns": 523100200, "max-wait-ns": 4210300,
+                              "wait-histogram": [ { "count": 1190021 },
+                                                  { "count": 8123 }, ... ],
+                              "holds": 1203344, "hold-ns": 3120004100,
+                              "max-hold-ns": 912300,
+                              "hold-histogram": [ { "count": 302114 },
+                                                  { "count": 610387 }, ... ] },
+                            { "site": "main-loop", ... } ] } }
+
+EQMP
+
+    {
+        .name       = "query-bql",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_bql,
+    },
+
+SQMP
+query-kvm-exits
+---------------
+
+Show the exits of each vCPU to QEMU by reason, and the MMIO and PIO
+addresses that cause the most of them.  Every exit is counted; one MMIO or
+PIO exit in "sample-period" is also timed and recorded by address.
+
+Arguments:
+
+- "top": how many addresses to list, 10 by default (json-int, optional)
+
+Return a json-object with the following information:
+
+- "sample-period": one MMIO or PIO exit in that many is sampled (json-int)
+- "vcpus": json-array of json-objects with the following information:
+    - "cpu": index of the vCPU (json-int)
+    - "exits": total number of exits (json-int)
+    - "interrupted": times KVM_RUN was interrupted by a signal (json-int)
+    - "reasons": json-array of json-objects with "reason" (json-string)
+                 and "count" (json-int)
+- "addresses": json-array of json-objects with the following information:
+    - "space": "mmio" or "pio" (json-string)
+    - "addr": guest physical address or I/O port (json-int)
+    - "region": name of the MemoryRegion there (json-string, optional)
+    - "reads": sampled reads (json-int)
+    - "writes": sampled writes (json-int)
+    - "avg-ns": average handling time of a sampled exit (json-int)
+
+Example:
+
+-> { "execute": "query-kvm-exits", "arguments": { "top": 2 } }
+<- { "return": { "sample-period": 16,
+                 "vcpus": [ { "cpu": 0, "exits": 902113, "interrupted": 310,
+                              "reasons": [ { "reason": "io", "count": 512330 },
+                                           { "reason": "mmio",
+                                             "count": 389783 } ] } ],
+                 "addresses": [ { "space": "pio", "addr": 49232,
+                                  "region": "virtio-pci", "reads": 0,
+                                  "writes": 31210, "avg-ns": 2310 },
+                                { "space": "mmio", "addr": 4276092928,
+                                  "region": "kvm-apic-msi", "reads": 0,
+                                  "writes": 20113, "avg-ns": 950 } ] } }
+
+EQMP
+
+    {
+        .name       = "query-kvm-exits",
+        .args_type  = "top:i?",
+        .mhandler.cmd_new = qmp_marshal_input_query_kvm_exits,
+    },
+
+SQMP
+query-mem-prealloc
+------------------
+
+Show the progress of guest RAM preallocation (-mem-prealloc).
+
+Return a json-object with the following information:
+
+- "active": true while preallocation threads are running (json-bool)
+- "threads": number of preallocation threads still running (json-int)
+- "total": bytes to preallocate (json-int)
+- "done": bytes preallocated so far (json-int)
+
+Example:
+
+-> { "execute": "query-mem-prealloc" }
+<- { "return": { "active": true, "threads": 2,
+                 "total": 549755813888, "done": 137438953472 } }
+
+EQMP
+
+    {
+        .name       = "query-mem-prealloc",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_mem_prealloc,
+    },
+
+SQMP
+ram-reclaim-set
+---------------
+
+Start or stop the background scanner that gives zero pages of guest RAM
+back to the host with MADV_DONTNEED.  The scanner stays idle during
+migration and while vhost, virtio-blk dataplane or vfio devices are
+active.
+
+Arguments:
+
+- "enable": whether the scanner runs (json-bool)
+- "rate": bytes of guest RAM scanned per second (json-int, optional)
+
+Example:
+
+-> { "execute": "ram-reclaim-set",
+     "arguments": { "enable": true, "rate": 33554432 } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "ram-reclaim-set",
+        .args_type  = "enable:b,rate:i?",
+        .mhandler.cmd_new = qmp_marshal_input_ram_reclaim_set,
+    },
+
+SQMP
+query-ram-reclaim
+-----------------
+
+Show the state and statistics of the zero page scanner.
+
+Return a json-object with the following information:
+
+- "enabled": whether the scanner runs (json-bool)
+- "rate": bytes of guest RAM scanned per second (json-int)
+- "inhibited": true while a device keeps the scanner idle (json-bool)
+- "passes": complete passes over guest RAM (json-int)
+- "scanned": bytes of guest RAM visited (json-int)
+- "reclaimed": bytes of zero pages given back to the host (json-int)
+- "pauses": number of times the vCPUs were stopped (json-int)
+
+Example:
+
+-> { "execute": "query-ram-reclaim" }
+<- { "return": { "enabled": true, "rate": 16777216, "inhibited": false,
+                 "passes": 3, "scanned": 12884901888,
+                 "reclaimed": 1610612736, "pauses": 412 } }
+
+EQMP
+
+    {
+        .name       = "query-ram-reclaim",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_ram_reclaim,
+    },
+
+SQMP
+query-trace-events
+------------------
+
+Show the state and the in-process counters of trace events.
+
+Arguments:
+
+- "name": glob pattern of the events to show (json-string, optional)
+
+Return a json-array of json-objects with the following information:
+
+- "name": event name (json-string)
+- "state": whether the trace backend records the event (json-bool)
+- "stats": whether the event is counted in-process (json-bool)
+- "count": number of hits counted (json-int)
+- "latency": for the end event of a pair (json-object, optional)
+    - "start": the start event of the pair (json-string)
+    - "count": number of intervals measured (json-int)
+    - "min-ns", "max-ns", "total-ns": shortest, longest and total
+      interval in nanoseconds (json-int)
+
+Example:
+
+-> { "execute": "query-trace-events",
+     "arguments": { "name": "virtio_blk_*" } }
+<- { "return": [ { "name": "virtio_blk_rw_complete", "state": false,
+                   "stats": true, "count": 10412,
+                   "latency": { "start": "virtio_blk_handle_write",
+                                "count": 10400, "min-ns": 41200,
+                                "max-ns": 8812003, "total-ns": 1077463210 } },
+                 ... ] }
+
+EQMP
+
+    {
+        .name       = "query-trace-events",
+        .args_type  = "name:s?",
+        .mhandler.cmd_new = qmp_marshal_input_query_trace_events,
+    },
+
+SQMP
+trace-event-set-state
+---------------------
+
+Enable or disable the trace events matching a glob pattern.
+
+Arguments:
+
+- "name": glob pattern of the events (json-string)
+- "enable": whether the trace backend records the events (json-bool)
+- "stats": whether the events are counted in-process (json-bool, optional)
+
+Example:
+
+-> { "execute": "trace-event-set-state",
+     "arguments": { "name": "bdrv_aio_*", "enable": false, "stats": true } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "trace-event-set-state",
+        .args_type  = "name:s,enable:b,stats:b?",
+        .mhandler.cmd_new = qmp_marshal_input_trace_event_set_state,
+    },
+
+SQMP
+trace-event-set-latency
+-----------------------
+
+Measure the latency between two trace events, matched by their first
+argument.  Counting is enabled for both events.
+
+Arguments:
+
+- "start": the event that starts the interval (json-string)
+- "end": the event that ends the interval (json-string)
+
+Example:
+
+-> { "execute": "trace-event-set-latency",
+     "arguments": { "start": "virtio_blk_handle_write",
+                    "end": "virtio_blk_rw_complete" } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "trace-event-set-latency",
+        .args_type  = "start:s,end:s",
+        .mhandler.cmd_new = qmp_marshal_input_trace_event_set_latency,
     },
 
 SQMP
@@ -2262,6 +3129,8 @@ Clients are described by a json-object, each one contain the following:
 - "service": client's port number (json-string)
 - "x509_dname": TLS dname (json-string, optional)
 - "sasl_username": SASL username (json-string, optional)
+- "encode-time": time spent encoding updates in milliseconds (json-int,
+                 optional)
 
 Example:
 
@@ -2277,7 +3146,8 @@ Example:
             {
                "host":"127.0.0.1",
                "service":"50401",
-               "family":"ipv4"
+               "family":"ipv4",
+               "encode-time":1452
             }
          ]
       }
@@ -2390,6 +3260,7 @@ EQMP
         .name       = "query-name",
         .args_type  = "",
         .mhandler.cmd_new = qmp_marshal_input_query_name,
+        .flags      = MONITOR_CMD_THREAD_SAFE,
     },
 
 SQMP
@@ -2413,6 +3284,7 @@ EQMP
         .name       = "query-uuid",
         .args_type  = "",
         .mhandler.cmd_new = qmp_marshal_input_query_uuid,
+        .flags      = MONITOR_CMD_THREAD_SAFE,
     },
 
 SQMP
@@ -2428,7 +3300,8 @@ block migration status.
 The main json-object contains the following:
 
 - "status": migration status (json-string)
-     - Possible values: "active", "completed", "failed", "cancelled"
+     - Possible values: "active", "postcopy-active", "completed", "failed",
+       "cancelled"
 - "total-time": total amount of ms since migration started.  If
                 migration has ended, it returns the total migration
 		 time (json-int)
@@ -2445,6 +3318,16 @@ The main json-object contains the following:
          - "duplicate": number of duplicated pages (json-int)
          - "normal" : number of normal pages transferred (json-int)
          - "normal-bytes" : number of normal bytes transferred (json-int)
+         - "postcopy-requests" : number of pages requested by the
+           destination, only present if postcopy is enabled (json-int)
+         - "sent-bytes": amount of bytes written to the migration
+           channel (json-int)
+         - "copied-bytes": amount of those bytes that were copied into the
+           migration buffer rather than sent from guest memory (json-int)
+         - "dirty-sync-count": number of dirty bitmap synchronizations
+           (json-int)
+         - "dirty-sync-time": duration of the last dirty bitmap
+           synchronization in microseconds (json-int)
 - "disk": only present if "status" is "active" and it is a block migration,
   it is a json-object with the following disk information (in bytes):
          - "transferred": amount transferred (json-int)
@@ -2457,6 +3340,18 @@ The main json-object contains the following:
          - "pages": number of XBZRLE compressed pages
          - "cache-miss": number of cache misses
          - "overflow": number of XBZRLE overflows
+         - "cache-hit": number of cache hits
+         - "skipped": number of cached pages sent uncompressed because
+           their previous delta was too large
+- "threads": only present if the multi-thread capability is on.
+  It is a json-array of json-objects, one per worker thread:
+         - "id": worker index (json-int)
+         - "pages": pages sent by this worker (json-int)
+         - "bytes": bytes produced by this worker (json-int)
+         - "busy-time": ms spent encoding pages (json-int)
+         - "throughput": bytes produced per second of busy time (json-int)
+- "cpu-throttle-percentage": only present while auto-converge is throttling
+  the guest, percentage of vCPU time taken away (json-int)
 Examples:
 
 1. Before the first migration
@@ -2552,7 +3447,9 @@ Examples:
             "bytes":20971520,
             "pages":2444343,
             "cache-miss":2244,
-            "overflow":34434
+            "overflow":34434,
+            "cache-hit":2442099,
+            "skipped":512
          }
       }
    }
@@ -2572,6 +3469,11 @@ migrate-set-capabilities
 Enable/Disable migration capabilities
 
 - "xbzrle": xbzrle support
+- "multi-thread": encode RAM pages in several worker threads
+- "compress": zlib-compress RAM pages
+- "postcopy": start the guest on the destination after one pass over RAM
+- "auto-converge": throttle the vCPUs if migration does not converge
+- "zero-blocks": send zero chunks of block migration as a marker
 
 Arguments:
 
@@ -2596,6 +3498,11 @@ Query current migration capabilities
 
 - "capabilities": migration capabilities state
          - "xbzrle" : XBZRLE state (json-bool)
+         - "multi-thread" : multi-thread state (json-bool)
+         - "compress" : compress state (json-bool)
+         - "postcopy" : postcopy state (json-bool)
+         - "auto-converge" : auto-converge state (json-bool)
+         - "zero-blocks" : zero-blocks state (json-bool)
 
 Arguments:
 
@@ -24,6 +24,8 @@
 #include "hw/qdev.h"
 #include "sysemu/blockdev.h"
 #include "qom/qom-qobject.h"
+#include "trace.h"
+#include "trace/control.h"
 
 NameInfo *qmp_query_name(Error **errp)
 {
@@ -520,3 +522,71 @@ void qmp_add_client(const char *protocol, const char *fdname,
     error_setg(errp, "protocol '%s' is invalid", protocol);
     close(fd);
 }
+
+TraceEventInfoList *qmp_query_trace_events(bool has_name, const char *name,
+                                           Error **errp)
+{
+    TraceEventInfoList *head = NULL, **p_next = &head;
+    TraceEvent *ev, *start;
+    uint64_t count, min_ns, max_ns, total_ns;
+    int i;
+
+    for (i = 0; i < NR_TRACE_EVENTS; i++) {
+        TraceEventInfoList *info;
+
+        ev = &trace_list[i];
+        if (has_name && !g_pattern_match_simple(name, ev->tp_name)) {
+            continue;
+        }
+
+        info = g_malloc0(sizeof(*info));
+        info->value = g_malloc0(sizeof(*info->value));
+        info->value->name = g_strdup(ev->tp_name);
+        info->value->state = ev->state;
+        info->value->stats = ev->stats;
+        info->value->count = ev->count;
+        if (trace_event_get_latency(ev, &start, &count, &min_ns, &max_ns,
+                                    &total_ns)) {
+            info->value->has_latency = true;
+            info->value->latency = g_malloc0(sizeof(*info->value->latency));
+            info->value->latency->start = g_strdup(start->tp_name);
+            info->value->latency->count = count;
+            info->value->latency->min_ns = min_ns;
+            info->value->latency->max_ns = max_ns;
+            info->value->latency->total_ns = total_ns;
+        }
+
+        *p_next = info;
+        p_next = &info->next;
+    }
+
+    return head;
+}
+
+void qmp_trace_event_set_state(const char *name, bool enable,
+                               bool has_stats, bool stats, Error **errp)
+{
+    if (!trace_event_set_state(name, enable)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "name",
+                  "a pattern matching trace events");
+        return;
+    }
+    if (has_stats) {
+        trace_event_set_stats(name, stats);
+    }
+}
+
+void qmp_trace_event_set_latency(const char *start, const char *end,
+                                 Error **errp)
+{
+    int ret = trace_event_set_latency(start, end);
+
+    if (ret == -ENOENT) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE,
+                  trace_event_find(start) ? "end" : "start",
+                  "the name of a trace event");
+    } else if (ret == -EBUSY) {
+        error_setg(errp, "trace events '%s' and '%s' cannot be paired; an "
+                   "event can only be part of one pair", start, end);
+    }
+}
@@ -272,10 +272,22 @@ void json_lexer_init(JSONLexer *lexer, JSONLexerEmitter func)
 {
     lexer->emit = func;
     lexer->state = IN_START;
-    lexer->token = qstring_new();
+    lexer->token = g_string_sized_new(64);
     lexer->x = lexer->y = 0;
 }
 
+/* Do not let a single token grow to an arbitrarily large size,
+ * this is a security consideration.
+ */
+static void json_lexer_check_token_size(JSONLexer *lexer)
+{
+    if (lexer->token->len > MAX_TOKEN_SIZE) {
+        lexer->emit(lexer, lexer->token, lexer->state, lexer->x, lexer->y);
+        g_string_truncate(lexer->token, 0);
+        lexer->state = IN_START;
+    }
+}
+
 static int json_lexer_feed_char(JSONLexer *lexer, char ch, bool flush)
 {
     int char_consumed, new_state;
@@ -290,7 +302,7 @@ static int json_lexer_feed_char(JSONLexer *lexer, char ch, bool flush)
         new_state = json_lexer[lexer->state][(uint8_t)ch];
         char_consumed = !TERMINAL_NEEDED_LOOKAHEAD(lexer->state, new_state);
         if (char_consumed) {
-            qstring_append_chr(lexer->token, ch);
+            g_string_append_c(lexer->token, ch);
         }
 
         switch (new_state) {
@@ -303,8 +315,7 @@ static int json_lexer_feed_char(JSONLexer *lexer, char ch, bool flush)
             lexer->emit(lexer, lexer->token, new_state, lexer->x, lexer->y);
             /* fall through */
         case JSON_SKIP:
-            QDECREF(lexer->token);
-            lexer->token = qstring_new();
+            g_string_truncate(lexer->token, 0);
             new_state = IN_START;
             break;
         case IN_ERROR:
@@ -322,8 +333,7 @@ static int json_lexer_feed_char(JSONLexer *lexer, char ch, bool flush)
              * induce an error/flush state.
              */
             lexer->emit(lexer, lexer->token, JSON_ERROR, lexer->x, lexer->y);
-            QDECREF(lexer->token);
-            lexer->token = qstring_new();
+            g_string_truncate(lexer->token, 0);
             new_state = IN_START;
             lexer->state = new_state;
             return 0;
@@ -333,30 +343,44 @@ static int json_lexer_feed_char(JSONLexer *lexer, char ch, bool flush)
         lexer->state = new_state;
     } while (!char_consumed && !flush);
 
-    /* Do not let a single token grow to an arbitrarily large size,
-     * this is a security consideration.
-     */
-    if (lexer->token->length > MAX_TOKEN_SIZE) {
-        lexer->emit(lexer, lexer->token, lexer->state, lexer->x, lexer->y);
-        QDECREF(lexer->token);
-        lexer->token = qstring_new();
-        lexer->state = IN_START;
-    }
+    json_lexer_check_token_size(lexer);
 
     return 0;
 }
 
 int json_lexer_feed(JSONLexer *lexer, const char *buffer, size_t size)
 {
-    size_t i;
+    size_t i = 0;
 
-    for (i = 0; i < size; i++) {
+    while (i < size) {
+        const uint8_t *next = json_lexer[lexer->state];
+        size_t end = i;
         int err;
 
+        /* The body of a string, number or keyword loops on one state;
+         * take such runs in one go instead of a character at a time.
+         * A transition to the same state never needs lookahead, and
+         * newlines are left to json_lexer_feed_char() for the geometry.
+         */
+        if (lexer->state != IN_START) {
+            while (end < size && buffer[end] != '\n' &&
+                   next[(uint8_t)buffer[end]] == lexer->state) {
+                end++;
+            }
+        }
+        if (end > i) {
+            g_string_append_len(lexer->token, buffer + i, end - i);
+            lexer->x += end - i;
+            i = end;
+            json_lexer_check_token_size(lexer);
+            continue;
+        }
+
         err = json_lexer_feed_char(lexer, buffer[i], false);
         if (err < 0) {
             return err;
         }
+        i++;
     }
 
     return 0;
@@ -369,5 +393,5 @@ int json_lexer_flush(JSONLexer *lexer)
 
 void json_lexer_destroy(JSONLexer *lexer)
 {
-    QDECREF(lexer->token);
+    g_string_free(lexer->token, true);
 }
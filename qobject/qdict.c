@@ -35,7 +35,10 @@ QDict *qdict_new(void)
 {
     QDict *qdict;
 
-    qdict = g_malloc0(sizeof(*qdict));
+    qdict = qobject_node_alloc(sizeof(*qdict));
+    qdict->size = 0;
+    qdict->nbuckets = 0;
+    qdict->table = NULL;
     QOBJECT_INIT(qdict, &qdict_type);
 
     return qdict;
@@ -68,20 +71,117 @@ static unsigned int tdb_hash(const char *name)
     return (1103515243 * value + 12345);
 }
 
+/*
+ * Keys that QMP requests, replies and events use over and over.  Entries
+ * with these keys point to the string here instead of carrying a copy.
+ */
+static const char *const qdict_common_keys[] = {
+    /* protocol */
+    "execute", "arguments", "id", "return", "error", "class", "desc",
+    "event", "data", "timestamp", "seconds", "microseconds",
+    /* common members */
+    "device", "type", "name", "value", "node-name", "filename", "status",
+    /* query-blockstats */
+    "stats", "parent", "rd_bytes", "wr_bytes", "rd_operations",
+    "wr_operations", "flush_operations", "flush_total_time_ns",
+    "wr_total_time_ns", "rd_total_time_ns", "wr_highest_offset",
+    "rd_merged", "wr_merged", "in_flight",
+    /* query-cpus */
+    "CPU", "current", "halted", "pc", "nip", "npc", "PC", "thread_id",
+};
+
+#define QDICT_INTERN_SLOTS 128
+
+static const char *qdict_interned[QDICT_INTERN_SLOTS];
+
+static gpointer qdict_intern_init(gpointer unused)
+{
+    int i;
+
+    QEMU_BUILD_BUG_ON(ARRAY_SIZE(qdict_common_keys) >= QDICT_INTERN_SLOTS / 2);
+    for (i = 0; i < ARRAY_SIZE(qdict_common_keys); i++) {
+        unsigned int slot = tdb_hash(qdict_common_keys[i]);
+
+        while (qdict_interned[slot % QDICT_INTERN_SLOTS]) {
+            slot++;
+        }
+        qdict_interned[slot % QDICT_INTERN_SLOTS] = qdict_common_keys[i];
+    }
+    return NULL;
+}
+
+static const char *qdict_intern(const char *key, unsigned int hash)
+{
+    static GOnce once = G_ONCE_INIT;
+    const char *found;
+
+    g_once(&once, qdict_intern_init, NULL);
+    while ((found = qdict_interned[hash % QDICT_INTERN_SLOTS])) {
+        if (!strcmp(found, key)) {
+            return found;
+        }
+        hash++;
+    }
+    return NULL;
+}
+
+static size_t entry_size(const QDictEntry *entry)
+{
+    if (entry->key != entry->key_buf) {
+        return sizeof(*entry);
+    }
+    return sizeof(*entry) + strlen(entry->key) + 1;
+}
+
 /**
- * alloc_entry(): allocate a new QDictEntry
+ * alloc_entry(): allocate a new QDictEntry, with the key in the same
+ * allocation unless it is interned
  */
-static QDictEntry *alloc_entry(const char *key, QObject *value)
+static QDictEntry *alloc_entry(const char *key, unsigned int hash,
+                               QObject *value)
 {
+    const char *interned = qdict_intern(key, hash);
     QDictEntry *entry;
 
-    entry = g_malloc0(sizeof(*entry));
-    entry->key = g_strdup(key);
+    if (interned) {
+        entry = qobject_node_alloc(sizeof(*entry));
+        entry->key = (char *)interned;
+    } else {
+        size_t len = strlen(key) + 1;
+
+        entry = qobject_node_alloc(sizeof(*entry) + len);
+        memcpy(entry->key_buf, key, len);
+        entry->key = entry->key_buf;
+    }
     entry->value = value;
+    entry->hash = hash;
 
     return entry;
 }
 
+/**
+ * qdict_resize(): Move the entries to a table of @nbuckets buckets
+ */
+static void qdict_resize(QDict *qdict, size_t nbuckets)
+{
+    QLIST_HEAD(,QDictEntry) *table;
+    size_t i;
+
+    table = g_malloc0(nbuckets * sizeof(*table));
+    for (i = 0; i < qdict->nbuckets; i++) {
+        QDictEntry *entry = QLIST_FIRST(&qdict->table[i]);
+        while (entry) {
+            QDictEntry *tmp = QLIST_NEXT(entry, next);
+            QLIST_REMOVE(entry, next);
+            QLIST_INSERT_HEAD(&table[entry->hash % nbuckets], entry, next);
+            entry = tmp;
+        }
+    }
+    g_free(qdict->table);
+    qdict->table = (void *)table;
+    qdict->nbuckets = nbuckets;
+}
+
 /**
  * qdict_entry_value(): Return qdict entry value
  *
@@ -107,12 +207,16 @@ const char *qdict_entry_key(const QDictEntry *entry)
  * qdict_find(): List lookup function
  */
 static QDictEntry *qdict_find(const QDict *qdict,
-                              const char *key, unsigned int bucket)
+                              const char *key, unsigned int hash)
 {
     QDictEntry *entry;
 
-    QLIST_FOREACH(entry, &qdict->table[bucket], next)
-        if (!strcmp(entry->key, key))
+    if (!qdict->nbuckets) {
+        return NULL;
+    }
+
+    QLIST_FOREACH(entry, &qdict->table[hash % qdict->nbuckets], next)
+        if (entry->hash == hash && !strcmp(entry->key, key))
             return entry;
 
     return NULL;
@@ -131,19 +235,23 @@ static QDictEntry *qdict_find(const QDict *qdict,
  */
 void qdict_put_obj(QDict *qdict, const char *key, QObject *value)
 {
-    unsigned int bucket;
+    unsigned int hash;
     QDictEntry *entry;
 
-    bucket = tdb_hash(key) % QDICT_BUCKET_MAX;
-    entry = qdict_find(qdict, key, bucket);
+    hash = tdb_hash(key);
+    entry = qdict_find(qdict, key, hash);
     if (entry) {
         /* replace key's value */
         qobject_decref(entry->value);
         entry->value = value;
     } else {
+        if (qdict->size >= qdict->nbuckets * QDICT_LOAD_MAX) {
+            qdict_resize(qdict, MAX(qdict->nbuckets * 2, QDICT_BUCKET_MIN));
+        }
+
         /* allocate a new entry */
-        entry = alloc_entry(key, value);
-        QLIST_INSERT_HEAD(&qdict->table[bucket], entry, next);
+        entry = alloc_entry(key, hash, value);
+        QLIST_INSERT_HEAD(&qdict->table[hash % qdict->nbuckets], entry, next);
         qdict->size++;
     }
 }
@@ -158,7 +266,7 @@ QObject *qdict_get(const QDict *qdict, const char *key)
 {
     QDictEntry *entry;
 
-    entry = qdict_find(qdict, key, tdb_hash(key) % QDICT_BUCKET_MAX);
+    entry = qdict_find(qdict, key, tdb_hash(key));
     return (entry == NULL ? NULL : entry->value);
 }
 
@@ -169,8 +277,7 @@ QObject *qdict_get(const QDict *qdict, const char *key)
  */
 int qdict_haskey(const QDict *qdict, const char *key)
 {
-    unsigned int bucket = tdb_hash(key) % QDICT_BUCKET_MAX;
-    return (qdict_find(qdict, key, bucket) == NULL ? 0 : 1);
+    return (qdict_find(qdict, key, tdb_hash(key)) == NULL ? 0 : 1);
 }
 
 /**
@@ -354,20 +461,20 @@ void qdict_iter(const QDict *qdict,
                 void (*iter)(const char *key, QObject *obj, void *opaque),
                 void *opaque)
 {
-    int i;
+    size_t i;
     QDictEntry *entry;
 
-    for (i = 0; i < QDICT_BUCKET_MAX; i++) {
+    for (i = 0; i < qdict->nbuckets; i++) {
         QLIST_FOREACH(entry, &qdict->table[i], next)
             iter(entry->key, entry->value, opaque);
     }
 }
 
-static QDictEntry *qdict_next_entry(const QDict *qdict, int first_bucket)
+static QDictEntry *qdict_next_entry(const QDict *qdict, size_t first_bucket)
 {
-    int i;
+    size_t i;
 
-    for (i = first_bucket; i < QDICT_BUCKET_MAX; i++) {
+    for (i = first_bucket; i < qdict->nbuckets; i++) {
         if (!QLIST_EMPTY(&qdict->table[i])) {
             return QLIST_FIRST(&qdict->table[i]);
         }
@@ -393,8 +500,7 @@ const QDictEntry *qdict_next(const QDict *qdict, const QDictEntry *entry)
 
     ret = QLIST_NEXT(entry, next);
     if (!ret) {
-        unsigned int bucket = tdb_hash(entry->key) % QDICT_BUCKET_MAX;
-        ret = qdict_next_entry(qdict, bucket + 1);
+        ret = qdict_next_entry(qdict, entry->hash % qdict->nbuckets + 1);
     }
 
     return ret;
@@ -410,8 +516,7 @@ static void qentry_destroy(QDictEntry *e)
     assert(e->value != NULL);
 
     qobject_decref(e->value);
-    g_free(e->key);
-    g_free(e);
+    qobject_node_free(e, entry_size(e));
 }
 
 /**
@@ -423,7 +528,7 @@ void qdict_del(QDict *qdict, const char *key)
 {
     QDictEntry *entry;
 
-    entry = qdict_find(qdict, key, tdb_hash(key) % QDICT_BUCKET_MAX);
+    entry = qdict_find(qdict, key, tdb_hash(key));
     if (entry) {
         QLIST_REMOVE(entry, next);
         qentry_destroy(entry);
@@ -436,13 +541,13 @@ void qdict_del(QDict *qdict, const char *key)
  */
 static void qdict_destroy_obj(QObject *obj)
 {
-    int i;
+    size_t i;
     QDict *qdict;
 
     assert(obj != NULL);
     qdict = qobject_to_qdict(obj);
 
-    for (i = 0; i < QDICT_BUCKET_MAX; i++) {
+    for (i = 0; i < qdict->nbuckets; i++) {
         QDictEntry *entry = QLIST_FIRST(&qdict->table[i]);
         while (entry) {
             QDictEntry *tmp = QLIST_NEXT(entry, next);
@@ -452,5 +557,6 @@ static void qdict_destroy_obj(QObject *obj)
         }
     }
 
-    g_free(qdict);
+    g_free(qdict->table);
+    qobject_node_free(qdict, sizeof(*qdict));
 }
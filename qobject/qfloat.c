@@ -31,7 +31,7 @@ QFloat *qfloat_from_double(double value)
 {
     QFloat *qf;
 
-    qf = g_malloc(sizeof(*qf));
+    qf = qobject_node_alloc(sizeof(*qf));
     qf->value = value;
     QOBJECT_INIT(qf, &qfloat_type);
 
@@ -64,5 +64,5 @@ QFloat *qobject_to_qfloat(const QObject *obj)
 static void qfloat_destroy_obj(QObject *obj)
 {
     assert(obj != NULL);
-    g_free(qobject_to_qfloat(obj));
+    qobject_node_free(qobject_to_qfloat(obj), sizeof(QFloat));
 }
@@ -28,7 +28,7 @@ typedef struct JSONParsingState
     QObject *result;
 } JSONParsingState;
 
-static void parse_json(JSONMessageParser *parser, QList *tokens)
+static void parse_json(JSONMessageParser *parser, GQueue *tokens)
 {
     JSONParsingState *s = container_of(parser, JSONParsingState, parser);
     s->result = json_parser_parse(tokens, s->ap);
@@ -75,31 +75,106 @@ typedef struct ToJsonIterState
     int indent;
     int pretty;
     int count;
-    QString *str;
+    GString *str;
 } ToJsonIterState;
 
-static void to_json(const QObject *obj, QString *str, int pretty, int indent);
+static void to_json(const QObject *obj, GString *str, int pretty, int indent);
+
+static void to_json_indent(GString *str, int indent)
+{
+    int j;
+
+    g_string_append_c(str, '\n');
+    for (j = 0 ; j < indent ; j++)
+        g_string_append(str, "    ");
+}
+
+static void to_json_str(const char *ptr, GString *str)
+{
+    g_string_append_c(str, '"');
+    while (*ptr) {
+        const char *run = ptr;
+
+        /* plain ASCII needs no escaping, copy it in one go */
+        while ((uint8_t)*ptr >= 0x20 && (uint8_t)*ptr < 0x80 &&
+               *ptr != '\"' && *ptr != '\\') {
+            ptr++;
+        }
+        if (ptr != run) {
+            g_string_append_len(str, run, ptr - run);
+            continue;
+        }
+
+        if ((ptr[0] & 0xE0) == 0xE0 &&
+            (ptr[1] & 0x80) && (ptr[2] & 0x80)) {
+            uint16_t wchar;
+
+            wchar  = (ptr[0] & 0x0F) << 12;
+            wchar |= (ptr[1] & 0x3F) << 6;
+            wchar |= (ptr[2] & 0x3F);
+            ptr += 2;
+
+            g_string_append_printf(str, "\\u%04X", wchar);
+        } else if ((ptr[0] & 0xE0) == 0xC0 && (ptr[1] & 0x80)) {
+            uint16_t wchar;
+
+            wchar  = (ptr[0] & 0x1F) << 6;
+            wchar |= (ptr[1] & 0x3F);
+            ptr++;
+
+            g_string_append_printf(str, "\\u%04X", wchar);
+        } else switch (ptr[0]) {
+            case '\"':
+                g_string_append(str, "\\\"");
+                break;
+            case '\\':
+                g_string_append(str, "\\\\");
+                break;
+            case '\b':
+                g_string_append(str, "\\b");
+                break;
+            case '\f':
+                g_string_append(str, "\\f");
+                break;
+            case '\n':
+                g_string_append(str, "\\n");
+                break;
+            case '\r':
+                g_string_append(str, "\\r");
+                break;
+            case '\t':
+                g_string_append(str, "\\t");
+                break;
+            default: {
+                if (ptr[0] <= 0x1F) {
+                    char escape[7];
+                    snprintf(escape, sizeof(escape), "\\u%04X", ptr[0]);
+                    g_string_append(str, escape);
+                } else {
+                    g_string_append_c(str, ptr[0]);
+                }
+                break;
+            }
+            }
+        ptr++;
+    }
+    g_string_append_c(str, '"');
+}
 
 static void to_json_dict_iter(const char *key, QObject *obj, void *opaque)
 {
     ToJsonIterState *s = opaque;
-    QString *qkey;
-    int j;
 
     if (s->count)
-        qstring_append(s->str, ", ");
+        g_string_append(s->str, ", ");
 
     if (s->pretty) {
-        qstring_append(s->str, "\n");
-        for (j = 0 ; j < s->indent ; j++)
-            qstring_append(s->str, "    ");
+        to_json_indent(s->str, s->indent);
     }
 
-    qkey = qstring_from_str(key);
-    to_json(QOBJECT(qkey), s->str, s->pretty, s->indent);
-    QDECREF(qkey);
+    to_json_str(key, s->str);
 
-    qstring_append(s->str, ": ");
+    g_string_append(s->str, ": ");
     to_json(obj, s->str, s->pretty, s->indent);
     s->count++;
 }
@@ -107,98 +182,31 @@ static void to_json_dict_iter(const char *key, QObject *obj, void *opaque)
 static void to_json_list_iter(QObject *obj, void *opaque)
 {
     ToJsonIterState *s = opaque;
-    int j;
 
     if (s->count)
-        qstring_append(s->str, ", ");
+        g_string_append(s->str, ", ");
 
     if (s->pretty) {
-        qstring_append(s->str, "\n");
-        for (j = 0 ; j < s->indent ; j++)
-            qstring_append(s->str, "    ");
+        to_json_indent(s->str, s->indent);
     }
 
     to_json(obj, s->str, s->pretty, s->indent);
     s->count++;
 }
 
-static void to_json(const QObject *obj, QString *str, int pretty, int indent)
+static void to_json(const QObject *obj, GString *str, int pretty, int indent)
 {
     switch (qobject_type(obj)) {
     case QTYPE_QINT: {
         QInt *val = qobject_to_qint(obj);
-        char buffer[1024];
 
-        snprintf(buffer, sizeof(buffer), "%" PRId64, qint_get_int(val));
-        qstring_append(str, buffer);
+        g_string_append_printf(str, "%" PRId64, qint_get_int(val));
         break;
     }
     case QTYPE_QSTRING: {
         QString *val = qobject_to_qstring(obj);
-        const char *ptr;
-
-        ptr = qstring_get_str(val);
-        qstring_append(str, "\"");
-        while (*ptr) {
-            if ((ptr[0] & 0xE0) == 0xE0 &&
-                (ptr[1] & 0x80) && (ptr[2] & 0x80)) {
-                uint16_t wchar;
-                char escape[7];
-
-                wchar  = (ptr[0] & 0x0F) << 12;
-                wchar |= (ptr[1] & 0x3F) << 6;
-                wchar |= (ptr[2] & 0x3F);
-                ptr += 2;
-
-                snprintf(escape, sizeof(escape), "\\u%04X", wchar);
-                qstring_append(str, escape);
-            } else if ((ptr[0] & 0xE0) == 0xC0 && (ptr[1] & 0x80)) {
-                uint16_t wchar;
-                char escape[7];
-
-                wchar  = (ptr[0] & 0x1F) << 6;
-                wchar |= (ptr[1] & 0x3F);
-                ptr++;
-
-                snprintf(escape, sizeof(escape), "\\u%04X", wchar);
-                qstring_append(str, escape);
-            } else switch (ptr[0]) {
-                case '\"':
-                    qstring_append(str, "\\\"");
-                    break;
-                case '\\':
-                    qstring_append(str, "\\\\");
-                    break;
-                case '\b':
-                    qstring_append(str, "\\b");
-                    break;
-                case '\f':
-                    qstring_append(str, "\\f");
-                    break;
-                case '\n':
-                    qstring_append(str, "\\n");
-                    break;
-                case '\r':
-                    qstring_append(str, "\\r");
-                    break;
-                case '\t':
-                    qstring_append(str, "\\t");
-                    break;
-                default: {
-                    if (ptr[0] <= 0x1F) {
-                        char escape[7];
-                        snprintf(escape, sizeof(escape), "\\u%04X", ptr[0]);
-                        qstring_append(str, escape);
-                    } else {
-                        char buf[2] = { ptr[0], 0 };
-                        qstring_append(str, buf);
-                    }
-                    break;
-                }
-                }
-            ptr++;
-        }
-        qstring_append(str, "\"");
+
+        to_json_str(qstring_get_str(val), str);
         break;
     }
     case QTYPE_QDICT: {
@@ -209,15 +217,12 @@ static void to_json(const QObject *obj, QString *str, int pretty, int indent)
         s.str = str;
         s.indent = indent + 1;
         s.pretty = pretty;
-        qstring_append(str, "{");
+        g_string_append_c(str, '{');
         qdict_iter(val, to_json_dict_iter, &s);
         if (pretty) {
-            int j;
-            qstring_append(str, "\n");
-            for (j = 0 ; j < indent ; j++)
-                qstring_append(str, "    ");
+            to_json_indent(str, indent);
         }
-        qstring_append(str, "}");
+        g_string_append_c(str, '}');
         break;
     }
     case QTYPE_QLIST: {
@@ -228,15 +233,12 @@ static void to_json(const QObject *obj, QString *str, int pretty, int indent)
         s.str = str;
         s.indent = indent + 1;
         s.pretty = pretty;
-        qstring_append(str, "[");
+        g_string_append_c(str, '[');
         qlist_iter(val, (void *)to_json_list_iter, &s);
         if (pretty) {
-            int j;
-            qstring_append(str, "\n");
-            for (j = 0 ; j < indent ; j++)
-                qstring_append(str, "    ");
+            to_json_indent(str, indent);
         }
-        qstring_append(str, "]");
+        g_string_append_c(str, ']');
         break;
     }
     case QTYPE_QFLOAT: {
@@ -255,16 +257,16 @@ static void to_json(const QObject *obj, QString *str, int pretty, int indent)
             buffer[len] = 0;
         }
         
-        qstring_append(str, buffer);
+        g_string_append(str, buffer);
         break;
     }
     case QTYPE_QBOOL: {
         QBool *val = qobject_to_qbool(obj);
 
         if (qbool_get_int(val)) {
-            qstring_append(str, "true");
+            g_string_append(str, "true");
         } else {
-            qstring_append(str, "false");
+            g_string_append(str, "false");
         }
         break;
     }
@@ -275,20 +277,22 @@ static void to_json(const QObject *obj, QString *str, int pretty, int indent)
     }
 }
 
+/* The output is built in a GString in one pass and handed over to the
+ * returned QString without another copy. */
 QString *qobject_to_json(const QObject *obj)
 {
-    QString *str = qstring_new();
+    GString *str = g_string_sized_new(256);
 
     to_json(obj, str, 0, 0);
 
-    return str;
+    return qstring_from_gstring(str);
 }
 
 QString *qobject_to_json_pretty(const QObject *obj)
 {
-    QString *str = qstring_new();
+    GString *str = g_string_sized_new(256);
 
     to_json(obj, str, 1, 0);
 
-    return str;
+    return qstring_from_gstring(str);
 }
@@ -0,0 +1,131 @@
+/*
+ * QObject node allocation
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2.1 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ */
+
+#include "qapi/qmp/qobject.h"
+#include "qemu-common.h"
+#include "qemu/tls.h"
+
+/*
+ * Handling a QMP command builds and tears down trees of thousands of small
+ * nodes: the parsed request, the visitor output and the reply.  While a
+ * command is being handled, freed nodes are kept on per-size free lists and
+ * handed out again instead of going back to malloc; once it is done, the
+ * lists are cut back to what the next command is likely to use.
+ *
+ * Nodes are plain g_malloc() blocks of their size class, so they may outlive
+ * the command, be freed with g_free(), or be freed outside of it.  The lists
+ * are per thread, since the monitor thread handles some commands outside the
+ * global mutex; a node freed by another thread simply lands on that thread's
+ * lists.  The reference counts are not thread-safe, so a QObject may only be
+ * handed over from one thread to another, not shared.
+ */
+
+#define QOBJECT_CACHE_CLASSES   3
+#define QOBJECT_CACHE_MIN_SHIFT 5       /* 32, 64 and 128 bytes */
+#define QOBJECT_CACHE_MAX       4096    /* nodes per class during a command */
+#define QOBJECT_CACHE_KEEP      256     /* nodes per class between commands */
+
+typedef struct QObjectFreeNode {
+    struct QObjectFreeNode *next;
+} QObjectFreeNode;
+
+typedef struct QObjectCache {
+    QObjectFreeNode *head;
+    int count;
+} QObjectCache;
+
+static DEFINE_TLS(QObjectCache[QOBJECT_CACHE_CLASSES], qobject_cache);
+static DEFINE_TLS(int, qobject_cache_depth);
+
+static int qobject_cache_class(size_t size)
+{
+    int i;
+
+    for (i = 0; i < QOBJECT_CACHE_CLASSES; i++) {
+        if (size <= (1 << (QOBJECT_CACHE_MIN_SHIFT + i))) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * qobject_node_alloc(): Allocate @size bytes for a QObject or one of its
+ * entries; the memory must be released with qobject_node_free() and the
+ * same @size, or with g_free()
+ */
+void *qobject_node_alloc(size_t size)
+{
+    int i = qobject_cache_class(size);
+    QObjectCache *c;
+    QObjectFreeNode *node;
+
+    if (i < 0) {
+        return g_malloc(size);
+    }
+
+    c = &tls_var(qobject_cache)[i];
+    node = tls_var(qobject_cache_depth) ? c->head : NULL;
+    if (node) {
+        c->head = node->next;
+        c->count--;
+        return node;
+    }
+    return g_malloc(1 << (QOBJECT_CACHE_MIN_SHIFT + i));
+}
+
+void qobject_node_free(void *ptr, size_t size)
+{
+    int i = qobject_cache_class(size);
+    QObjectCache *c = i < 0 ? NULL : &tls_var(qobject_cache)[i];
+    QObjectFreeNode *node = ptr;
+
+    if (!c || !tls_var(qobject_cache_depth) ||
+        c->count >= QOBJECT_CACHE_MAX) {
+        g_free(ptr);
+        return;
+    }
+
+    node->next = c->head;
+    c->head = node;
+    c->count++;
+}
+
+/**
+ * qobject_cache_begin(): Start recycling freed nodes, for the duration of
+ * a QMP command
+ */
+void qobject_cache_begin(void)
+{
+    tls_var(qobject_cache_depth)++;
+}
+
+/**
+ * qobject_cache_end(): Stop recycling freed nodes and release the ones
+ * that are not likely to be needed by the next command
+ */
+void qobject_cache_end(void)
+{
+    int i;
+
+    assert(tls_var(qobject_cache_depth) > 0);
+    if (--tls_var(qobject_cache_depth)) {
+        return;
+    }
+
+    for (i = 0; i < QOBJECT_CACHE_CLASSES; i++) {
+        QObjectCache *c = &tls_var(qobject_cache)[i];
+
+        while (c->count > QOBJECT_CACHE_KEEP) {
+            QObjectFreeNode *node = c->head;
+
+            c->head = node->next;
+            c->count--;
+            g_free(node);
+        }
+    }
+}
@@ -40,7 +40,7 @@ QString *qstring_from_substr(const char *str, int start, int end)
 {
     QString *qstring;
 
-    qstring = g_malloc(sizeof(*qstring));
+    qstring = qobject_node_alloc(sizeof(*qstring));
 
     qstring->length = end - start + 1;
     qstring->capacity = qstring->length;
@@ -64,6 +64,27 @@ QString *qstring_from_str(const char *str)
     return qstring_from_substr(str, 0, strlen(str) - 1);
 }
 
+/**
+ * qstring_from_gstring(): Create a new QString that takes over the buffer
+ * of @gstr, which is freed
+ *
+ * Return strong reference.
+ */
+QString *qstring_from_gstring(GString *gstr)
+{
+    QString *qstring;
+
+    qstring = qobject_node_alloc(sizeof(*qstring));
+
+    qstring->length = gstr->len;
+    qstring->capacity = gstr->allocated_len - 1;
+    qstring->string = g_string_free(gstr, false);
+
+    QOBJECT_INIT(qstring, &qstring_type);
+
+    return qstring;
+}
+
 static void capacity_increase(QString *qstring, size_t len)
 {
     if (qstring->capacity < (qstring->length + len)) {
@@ -137,5 +158,5 @@ static void qstring_destroy_obj(QObject *obj)
     assert(obj != NULL);
     qs = qobject_to_qstring(obj);
     g_free(qs->string);
-    g_free(qs);
+    qobject_node_free(qs, sizeof(*qs));
 }
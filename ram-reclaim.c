@@ -0,0 +1,354 @@
+/*
+ * Background reclaim of zero pages in guest RAM
+ *
+ * ksmd merges zero pages too, but it converges slowly on hosts that run
+ * many guests.  This scanner walks guest RAM at a limited rate, looks for
+ * pages that are all zeroes and gives them back to the host with
+ * MADV_DONTNEED; the next read maps the host's zero page and the next
+ * write allocates a fresh one, so the guest sees no difference.
+ *
+ * Pages are checked twice: once while the guest runs, to pick candidates
+ * cheaply, and again with the vCPUs stopped and block I/O drained, right
+ * before they are released, so that no write can slip in between.
+ *
+ * Everything runs in the main loop with the iothread lock held.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <sys/mman.h>
+#include "config.h"
+#include "cpu.h"
+#include "exec/cpu-all.h"
+#include "qemu/bitmap.h"
+#include "qemu/timer.h"
+#include "qemu/error-report.h"
+#include "sysemu/sysemu.h"
+#include "sysemu/cpus.h"
+#include "sysemu/kvm.h"
+#include "sysemu/ram-reclaim.h"
+#include "block/block.h"
+#include "migration/migration.h"
+#include "hw/xen.h"
+#include "qapi/qmp/qerror.h"
+#include "qmp-commands.h"
+
+#define RAM_RECLAIM_INTERVAL_MS     100
+#define RAM_RECLAIM_BATCH           1024    /* pages re-checked per pause */
+#define RAM_RECLAIM_MINCORE         64      /* host pages per mincore() */
+
+typedef struct RamReclaimPage {
+    uint8_t *host;
+    ram_addr_t addr;
+} RamReclaimPage;
+
+typedef struct RamReclaimState {
+    bool enabled;
+    int64_t rate;                   /* bytes scanned per second */
+    int inhibit;
+    QEMUTimer *timer;
+    size_t page_size;               /* unit of scanning and of madvise() */
+    ram_addr_t next;                /* where the scan continues */
+
+    /* One bit per target page, set while a released page has not been
+     * seen written, so that pages the guest only read are not released
+     * and counted again.  Rebuilt when RAM blocks come or go. */
+    unsigned long *dropped;
+    uint32_t version;               /* ram_list.version of the above */
+
+    int nb_candidates;
+    RamReclaimPage candidates[RAM_RECLAIM_BATCH];
+
+    uint64_t passes;
+    uint64_t scanned;
+    uint64_t reclaimed;
+    uint64_t pauses;
+} RamReclaimState;
+
+static RamReclaimState reclaim = {
+    .rate = RAM_RECLAIM_DEFAULT_RATE,
+};
+
+void ram_reclaim_inhibit(bool inhibit)
+{
+    if (inhibit) {
+        reclaim.inhibit++;
+        /* The candidates may be written as soon as we return */
+        reclaim.nb_candidates = 0;
+    } else {
+        assert(reclaim.inhibit > 0);
+        reclaim.inhibit--;
+    }
+}
+
+static bool ram_reclaim_block_eligible(RAMBlock *block)
+{
+    /* Memory provided by a device may not be ours to drop */
+    if (!block->host || (block->flags & RAM_PREALLOC_MASK)) {
+        return false;
+    }
+#if defined(__linux__) && !defined(TARGET_S390X)
+    /* Dropping a page of a file mapping (-mem-path, a RAM template) would
+     * bring back the file contents instead of zeroes */
+    if (block->fd > 0) {
+        return false;
+    }
+#endif
+    return true;
+}
+
+/* Return the eligible block that holds @addr or comes next above it */
+static RAMBlock *ram_reclaim_find_block(ram_addr_t addr)
+{
+    RAMBlock *block, *found = NULL;
+
+    /* ram_list.blocks is sorted by size, not by offset */
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        if (!ram_reclaim_block_eligible(block) ||
+            block->offset + block->length <= addr) {
+            continue;
+        }
+        if (!found || block->offset < found->offset) {
+            found = block;
+        }
+    }
+    return found;
+}
+
+static void ram_reclaim_check_page(RAMBlock *block, ram_addr_t off)
+{
+    ram_addr_t addr = block->offset + off;
+    unsigned long page = addr >> TARGET_PAGE_BITS;
+    RamReclaimPage *c;
+
+    if (!buffer_is_zero(block->host + off, reclaim.page_size)) {
+        clear_bit(page, reclaim.dropped);
+        return;
+    }
+    if (test_bit(page, reclaim.dropped)) {
+        return;
+    }
+
+    c = &reclaim.candidates[reclaim.nb_candidates++];
+    c->host = block->host + off;
+    c->addr = addr;
+}
+
+/*
+ * Release the candidates that are still zero.  Contiguous pages go in one
+ * madvise() call.
+ */
+static void ram_reclaim_flush(void)
+{
+    size_t ps = reclaim.page_size;
+    int n = reclaim.nb_candidates;
+    bool running;
+    int i, j, k;
+
+    reclaim.nb_candidates = 0;
+    if (n == 0) {
+        return;
+    }
+
+    /* Nothing may write the pages between the check and the madvise():
+     * stop the vCPUs and wait for DMA from the block layer's threads */
+    running = runstate_is_running();
+    if (running) {
+        pause_all_vcpus();
+        reclaim.pauses++;
+    }
+    bdrv_drain_all();
+
+    for (i = 0; i < n; i = MAX(j, i + 1)) {
+        RamReclaimPage *first = &reclaim.candidates[i];
+
+        for (j = i; j < n; j++) {
+            RamReclaimPage *c = &reclaim.candidates[j];
+
+            if (c->host != first->host + (j - i) * ps ||
+                c->addr != first->addr + (j - i) * ps ||
+                !buffer_is_zero(c->host, ps)) {
+                break;
+            }
+        }
+        if (j == i) {
+            /* Written since the scan */
+            continue;
+        }
+
+        if (qemu_madvise(first->host, (j - i) * ps, QEMU_MADV_DONTNEED) < 0) {
+            /* E.g. guest RAM is locked with -realtime mlock=on */
+            error_report("ram-reclaim: madvise failed: %s, disabling",
+                         strerror(errno));
+            reclaim.enabled = false;
+            qemu_del_timer(reclaim.timer);
+            break;
+        }
+        for (k = i; k < j; k++) {
+            set_bit(reclaim.candidates[k].addr >> TARGET_PAGE_BITS,
+                    reclaim.dropped);
+        }
+        reclaim.reclaimed += (j - i) * ps;
+    }
+
+    if (running) {
+        resume_all_vcpus();
+    }
+}
+
+/*
+ * Scan up to @budget bytes from reclaim.next, stopping early if the batch
+ * of candidates fills up.  Returns the number of bytes visited, or 0 at
+ * the end of guest RAM.
+ */
+static int64_t ram_reclaim_scan(int64_t budget)
+{
+    size_t ps = reclaim.page_size;
+    RAMBlock *block;
+    ram_addr_t start, off, end, lim;
+#ifdef __linux__
+    size_t hps = getpagesize();
+    unsigned char vec[RAM_RECLAIM_MINCORE];
+    ram_addr_t vec_start = 0, vec_end = 0;
+#endif
+
+    block = ram_reclaim_find_block(reclaim.next);
+    if (!block) {
+        return 0;
+    }
+
+    /* A tail smaller than a host page cannot be released on its own */
+    lim = block->length & ~(ram_addr_t)(ps - 1);
+    start = QEMU_ALIGN_UP(MAX(reclaim.next, block->offset) - block->offset,
+                          ps);
+    end = MIN(lim, start + QEMU_ALIGN_UP(budget, ps));
+
+    for (off = start; off < end &&
+         reclaim.nb_candidates < RAM_RECLAIM_BATCH; off += ps) {
+#ifdef __linux__
+        /* Do not bring swapped out pages back just to look at them */
+        if (off >= vec_end) {
+            vec_start = off;
+            vec_end = MIN(end, off + RAM_RECLAIM_MINCORE * hps / ps * ps);
+            if (mincore(block->host + vec_start, vec_end - vec_start,
+                        vec) < 0) {
+                memset(vec, 1, sizeof(vec));
+            }
+        }
+        if (!(vec[(off - vec_start) / hps] & 1)) {
+            continue;
+        }
+#endif
+        ram_reclaim_check_page(block, off);
+    }
+
+    reclaim.next = block->offset + (off >= lim ? block->length : off);
+    reclaim.scanned += off - start;
+    return MAX(off - start, 1);
+}
+
+static void ram_reclaim_reset(void)
+{
+    g_free(reclaim.dropped);
+    reclaim.dropped = bitmap_new(last_ram_offset() >> TARGET_PAGE_BITS);
+    reclaim.version = ram_list.version;
+    reclaim.nb_candidates = 0;
+}
+
+static void ram_reclaim_tick(void *opaque)
+{
+    int64_t budget = reclaim.rate * RAM_RECLAIM_INTERVAL_MS / 1000;
+    int64_t done;
+
+    qemu_mod_timer(reclaim.timer,
+                   qemu_get_clock_ms(rt_clock) + RAM_RECLAIM_INTERVAL_MS);
+
+    /* Leave guest RAM alone while it is being migrated */
+    if (reclaim.inhibit > 0 ||
+        migration_is_active(migrate_get_current()) ||
+        !(runstate_is_running() || runstate_check(RUN_STATE_PAUSED))) {
+        reclaim.nb_candidates = 0;
+        return;
+    }
+
+    if (reclaim.version != ram_list.version || !reclaim.dropped) {
+        ram_reclaim_reset();
+    }
+
+    while (budget > 0 && reclaim.enabled) {
+        done = ram_reclaim_scan(budget);
+        if (done == 0) {
+            /* End of a pass */
+            ram_reclaim_flush();
+            if (reclaim.next == 0) {
+                break;      /* no eligible RAM at all */
+            }
+            reclaim.next = 0;
+            reclaim.passes++;
+            continue;
+        }
+        budget -= done;
+        if (reclaim.nb_candidates == RAM_RECLAIM_BATCH) {
+            ram_reclaim_flush();
+        }
+    }
+}
+
+void qmp_ram_reclaim_set(bool enable, bool has_rate, int64_t rate,
+                         Error **errp)
+{
+    if (has_rate && rate <= 0) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "rate",
+                  "a positive number of bytes per second");
+        return;
+    }
+
+    if (enable && !reclaim.enabled) {
+        if (QEMU_MADV_DONTNEED == QEMU_MADV_INVALID) {
+            error_set(errp, QERR_UNSUPPORTED);
+            return;
+        }
+        if (kvm_enabled() && !kvm_has_sync_mmu()) {
+            error_set(errp, QERR_KVM_MISSING_CAP, "synchronous MMU",
+                      "ram-reclaim");
+            return;
+        }
+        if (xen_enabled()) {
+            error_set(errp, QERR_FEATURE_DISABLED, "ram-reclaim");
+            return;
+        }
+    }
+
+    if (has_rate) {
+        reclaim.rate = rate;
+    }
+
+    if (enable && !reclaim.enabled) {
+        reclaim.page_size = MAX(TARGET_PAGE_SIZE, getpagesize());
+        if (!reclaim.timer) {
+            reclaim.timer = qemu_new_timer_ms(rt_clock, ram_reclaim_tick,
+                                              NULL);
+        }
+        qemu_mod_timer(reclaim.timer,
+                       qemu_get_clock_ms(rt_clock) + RAM_RECLAIM_INTERVAL_MS);
+    } else if (!enable && reclaim.enabled) {
+        qemu_del_timer(reclaim.timer);
+        reclaim.nb_candidates = 0;
+    }
+    reclaim.enabled = enable;
+}
+
+RamReclaimInfo *qmp_query_ram_reclaim(Error **errp)
+{
+    RamReclaimInfo *info = g_new0(RamReclaimInfo, 1);
+
+    info->enabled = reclaim.enabled;
+    info->rate = reclaim.rate;
+    info->inhibited = reclaim.inhibit > 0;
+    info->passes = reclaim.passes;
+    info->scanned = reclaim.scanned;
+    info->reclaimed = reclaim.reclaimed;
+    info->pauses = reclaim.pauses;
+    return info;
+}
@@ -23,6 +23,9 @@
  */
 
 #include "config-host.h"
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
 #include "qemu-common.h"
 #include "hw/hw.h"
 #include "hw/qdev.h"
@@ -32,13 +35,16 @@
 #include "qemu/timer.h"
 #include "audio/audio.h"
 #include "migration/migration.h"
+#include "migration/postcopy-ram.h"
 #include "qemu/sockets.h"
 #include "qemu/queue.h"
 #include "sysemu/cpus.h"
 #include "exec/memory.h"
+#include "hw/xen.h"
 #include "qmp-commands.h"
 #include "trace.h"
 #include "qemu/bitops.h"
+#include "qemu/iov.h"
 
 #define SELF_ANNOUNCE_ROUNDS 5
 
@@ -113,6 +119,11 @@ void qemu_announce_self(void)
 /* savevm/loadvm support */
 
 #define IO_BUF_SIZE 32768
+#define MAX_IOV_SIZE MIN(IOV_MAX, 64)
+/* with writev_buffer, blobs at least this large are not copied */
+#define IO_DIRECT_MIN 8192
+/* how much of a mapped stream is exposed as the buffer at a time */
+#define IO_MAP_WINDOW (256 * 1024 * 1024)
 
 struct QEMUFile {
     const QEMUFileOps *ops;
@@ -123,7 +134,19 @@ struct QEMUFile {
                            when reading */
     int buf_index;
     int buf_size; /* 0 when writing */
-    uint8_t buf[IO_BUF_SIZE];
+    int buf_capacity;
+    uint8_t *buf;
+
+    /* with writev_buffer, the pending output: pieces of buf and blobs
+     * written in place */
+    struct iovec iov[MAX_IOV_SIZE];
+    int iovcnt;
+    int iov_bytes;
+
+    /* the rest of the input stream, if the backend could map it; buf is
+     * then a window into it */
+    uint8_t *map;
+    size_t map_size;
 
     int last_error;
 };
@@ -132,6 +155,8 @@ typedef struct QEMUFileStdio
 {
     FILE *stdio_file;
     QEMUFile *file;
+    void *map;
+    size_t map_len;
 } QEMUFileStdio;
 
 typedef struct QEMUFileSocket
@@ -157,7 +182,7 @@ static void fd_coroutine_enter(void *opaque)
  *
  * Note that this function clobbers the handlers for the file descriptor.
  */
-static void coroutine_fn yield_until_fd_readable(int fd)
+void coroutine_fn yield_until_fd_readable(int fd)
 {
     FDYieldUntilData data;
 
@@ -198,6 +223,47 @@ static int socket_get_buffer(void *opaque, uint8_t *buf, int64_t pos, int size)
     return len;
 }
 
+static int socket_put_buffer(void *opaque, const uint8_t *buf,
+                             int64_t pos, int size)
+{
+    QEMUFileSocket *s = opaque;
+    ssize_t len;
+    int done = 0;
+
+    while (done < size) {
+        len = send(s->fd, (const void *)(buf + done), size - done, 0);
+        if (len == -1) {
+            if (socket_error() == EINTR) {
+                continue;
+            }
+            return -socket_error();
+        }
+        done += len;
+    }
+    return done;
+}
+
+static int socket_writev_buffer(void *opaque, struct iovec *iov, int iovcnt,
+                                int64_t pos)
+{
+    QEMUFileSocket *s = opaque;
+    size_t size = iov_size(iov, iovcnt);
+    size_t done = 0;
+    ssize_t len;
+
+    while (done < size) {
+        len = iov_send(s->fd, iov, iovcnt, done, size - done);
+        if (len == -1) {
+            if (socket_error() == EINTR) {
+                continue;
+            }
+            return -socket_error();
+        }
+        done += len;
+    }
+    return done;
+}
+
 static int socket_close(void *opaque)
 {
     QEMUFileSocket *s = opaque;
@@ -206,6 +272,33 @@ static int socket_close(void *opaque)
     return 0;
 }
 
+static const QEMUFileOps socket_write_ops = {
+    .get_fd =        socket_get_fd,
+    .put_buffer =    socket_put_buffer,
+    .writev_buffer = socket_writev_buffer,
+    .close =         socket_close
+};
+
+/* The reverse direction shares the connection but not the descriptor, so
+ * that either side can be closed on its own. */
+static QEMUFile *socket_get_return_path(void *opaque)
+{
+    QEMUFileSocket *s = opaque;
+    QEMUFileSocket *rp;
+    int fd;
+
+    fd = dup(s->fd);
+    if (fd == -1) {
+        return NULL;
+    }
+    socket_set_block(fd);
+
+    rp = g_malloc0(sizeof(QEMUFileSocket));
+    rp->fd = fd;
+    rp->file = qemu_fopen_ops(rp, &socket_write_ops);
+    return rp->file;
+}
+
 static int stdio_get_fd(void *opaque)
 {
     QEMUFileStdio *s = opaque;
@@ -219,6 +312,22 @@ static int stdio_put_buffer(void *opaque, const uint8_t *buf, int64_t pos, int s
     return fwrite(buf, 1, size, s->stdio_file);
 }
 
+static int stdio_writev_buffer(void *opaque, struct iovec *iov, int iovcnt,
+                               int64_t pos)
+{
+    QEMUFileStdio *s = opaque;
+    int i, done = 0;
+
+    for (i = 0; i < iovcnt; i++) {
+        if (fwrite(iov[i].iov_base, 1, iov[i].iov_len, s->stdio_file) !=
+            iov[i].iov_len) {
+            return -EIO;
+        }
+        done += iov[i].iov_len;
+    }
+    return done;
+}
+
 static int stdio_get_buffer(void *opaque, uint8_t *buf, int64_t pos, int size)
 {
     QEMUFileStdio *s = opaque;
@@ -252,10 +361,54 @@ static int stdio_pclose(void *opaque)
     return ret;
 }
 
+/* Regular files are parsed in place instead of being read into the buffer.
+ * Nothing has been read through stdio yet, so the descriptor's offset is
+ * the start of the stream. */
+static uint8_t *stdio_map_buffer(void *opaque, size_t *size)
+{
+#ifndef _WIN32
+    QEMUFileStdio *s = opaque;
+    int fd = fileno(s->stdio_file);
+    struct stat st;
+    off_t pos, start;
+    void *p;
+
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        return NULL;
+    }
+    pos = lseek(fd, 0, SEEK_CUR);
+    if (pos < 0 || pos >= st.st_size ||
+        (uint64_t)st.st_size > SIZE_MAX) {
+        return NULL;
+    }
+
+    start = pos & ~((off_t)getpagesize() - 1);
+    p = mmap(NULL, st.st_size - start, PROT_READ, MAP_PRIVATE, fd, start);
+    if (p == MAP_FAILED) {
+        return NULL;
+    }
+#ifdef MADV_SEQUENTIAL
+    madvise(p, st.st_size - start, MADV_SEQUENTIAL);
+#endif
+    s->map = p;
+    s->map_len = st.st_size - start;
+
+    *size = st.st_size - pos;
+    return (uint8_t *)p + (pos - start);
+#else
+    return NULL;
+#endif
+}
+
 static int stdio_fclose(void *opaque)
 {
     QEMUFileStdio *s = opaque;
     int ret = 0;
+#ifndef _WIN32
+    if (s->map) {
+        munmap(s->map, s->map_len);
+    }
+#endif
     if (fclose(s->stdio_file) == EOF) {
         ret = -errno;
     }
@@ -270,9 +423,10 @@ static const QEMUFileOps stdio_pipe_read_ops = {
 };
 
 static const QEMUFileOps stdio_pipe_write_ops = {
-    .get_fd =     stdio_get_fd,
-    .put_buffer = stdio_put_buffer,
-    .close =      stdio_pclose
+    .get_fd =        stdio_get_fd,
+    .put_buffer =    stdio_put_buffer,
+    .writev_buffer = stdio_writev_buffer,
+    .close =         stdio_pclose
 };
 
 QEMUFile *qemu_popen(FILE *stdio_file, const char *mode)
@@ -311,13 +465,15 @@ QEMUFile *qemu_popen_cmd(const char *command, const char *mode)
 static const QEMUFileOps stdio_file_read_ops = {
     .get_fd =     stdio_get_fd,
     .get_buffer = stdio_get_buffer,
+    .map_buffer = stdio_map_buffer,
     .close =      stdio_fclose
 };
 
 static const QEMUFileOps stdio_file_write_ops = {
-    .get_fd =     stdio_get_fd,
-    .put_buffer = stdio_put_buffer,
-    .close =      stdio_fclose
+    .get_fd =        stdio_get_fd,
+    .put_buffer =    stdio_put_buffer,
+    .writev_buffer = stdio_writev_buffer,
+    .close =         stdio_fclose
 };
 
 QEMUFile *qemu_fdopen(int fd, const char *mode)
@@ -349,9 +505,10 @@ fail:
 }
 
 static const QEMUFileOps socket_read_ops = {
-    .get_fd =     socket_get_fd,
-    .get_buffer = socket_get_buffer,
-    .close =      socket_close
+    .get_fd =          socket_get_fd,
+    .get_buffer =      socket_get_buffer,
+    .close =           socket_close,
+    .get_return_path = socket_get_return_path,
 };
 
 QEMUFile *qemu_fopen_socket(int fd)
@@ -418,13 +575,71 @@ static const QEMUFileOps bdrv_write_ops = {
     .close =      bdrv_fclose
 };
 
+/* Every flush is a separate image write, so batch more of the stream; the
+ * size is a multiple of the sector size to keep the writes aligned. */
+#define BDRV_IO_BUF_SIZE (1024 * 1024)
+
 static QEMUFile *qemu_fopen_bdrv(BlockDriverState *bs, int is_writable)
 {
-    if (is_writable)
-        return qemu_fopen_ops(bs, &bdrv_write_ops);
-    return qemu_fopen_ops(bs, &bdrv_read_ops);
+    QEMUFile *f;
+
+    if (is_writable) {
+        f = qemu_fopen_ops(bs, &bdrv_write_ops);
+    } else {
+        f = qemu_fopen_ops(bs, &bdrv_read_ops);
+    }
+    qemu_file_set_buffer_size(f, BDRV_IO_BUF_SIZE);
+    return f;
+}
+
+/* In-memory files, used to package device state for post-copy */
+typedef struct QEMUFileBuffer {
+    uint8_t *data;
+    size_t size;
+    size_t capacity;
+} QEMUFileBuffer;
+
+static int buf_put_buffer(void *opaque, const uint8_t *buf,
+                          int64_t pos, int size)
+{
+    QEMUFileBuffer *b = opaque;
+
+    if (b->size + size > b->capacity) {
+        b->capacity = MAX(b->capacity * 2, b->size + size);
+        b->data = g_realloc(b->data, b->capacity);
+    }
+    memcpy(b->data + b->size, buf, size);
+    b->size += size;
+    return size;
+}
+
+static int buf_get_buffer(void *opaque, uint8_t *buf, int64_t pos, int size)
+{
+    QEMUFileBuffer *b = opaque;
+
+    if (pos >= b->size) {
+        return 0;
+    }
+    size = MIN(size, b->size - pos);
+    memcpy(buf, b->data + pos, size);
+    return size;
+}
+
+static int buf_close(void *opaque)
+{
+    return 0;
 }
 
+static const QEMUFileOps buf_write_ops = {
+    .put_buffer = buf_put_buffer,
+    .close =      buf_close
+};
+
+static const QEMUFileOps buf_read_ops = {
+    .get_buffer = buf_get_buffer,
+    .close =      buf_close
+};
+
 QEMUFile *qemu_fopen_ops(void *opaque, const QEMUFileOps *ops)
 {
     QEMUFile *f;
@@ -435,6 +650,16 @@ QEMUFile *qemu_fopen_ops(void *opaque, const QEMUFileOps *ops)
     f->ops = ops;
     f->is_write = 0;
 
+    if (ops->map_buffer) {
+        f->map = ops->map_buffer(opaque, &f->map_size);
+    }
+    if (f->map) {
+        f->buf = f->map;
+    } else {
+        f->buf_capacity = IO_BUF_SIZE;
+        f->buf = g_malloc(f->buf_capacity);
+    }
+
     return f;
 }
 
@@ -453,10 +678,24 @@ static void qemu_file_set_error(QEMUFile *f, int ret)
 /** Flushes QEMUFile buffer
  *
  */
-static int qemu_fflush(QEMUFile *f)
+int qemu_fflush(QEMUFile *f)
 {
     int ret = 0;
 
+    if (f->ops->writev_buffer) {
+        if (f->is_write && f->iovcnt > 0) {
+            ret = f->ops->writev_buffer(f->opaque, f->iov, f->iovcnt,
+                                        f->buf_offset);
+            if (ret >= 0) {
+                f->buf_offset += f->iov_bytes;
+            }
+        }
+        f->buf_index = 0;
+        f->iovcnt = 0;
+        f->iov_bytes = 0;
+        return ret;
+    }
+
     if (!f->ops->put_buffer)
         return 0;
 
@@ -470,17 +709,40 @@ static int qemu_fflush(QEMUFile *f)
     return ret;
 }
 
-static void qemu_fill_buffer(QEMUFile *f)
+/* Moves the window over a mapped stream up to the read position */
+static void qemu_fill_mapped_buffer(QEMUFile *f)
 {
+    size_t pos = f->buf - f->map + f->buf_index;
+    int pending = f->buf_size - f->buf_index;
     int len;
-    int pending;
 
-    if (!f->ops->get_buffer)
+    len = MIN(f->map_size - pos, IO_MAP_WINDOW);
+    if (len <= pending) {
+        qemu_file_set_error(f, -EIO);
         return;
+    }
+    f->buf = f->map + pos;
+    f->buf_index = 0;
+    f->buf_size = len;
+    f->buf_offset = pos + len;
+}
+
+static void qemu_fill_buffer(QEMUFile *f)
+{
+    int len;
+    int pending;
 
     if (f->is_write)
         abort();
 
+    if (f->map) {
+        qemu_fill_mapped_buffer(f);
+        return;
+    }
+
+    if (!f->ops->get_buffer)
+        return;
+
     pending = f->buf_size - f->buf_index;
     if (pending > 0) {
         memmove(f->buf, f->buf + f->buf_index, pending);
@@ -489,7 +751,7 @@ static void qemu_fill_buffer(QEMUFile *f)
     f->buf_size = pending;
 
     len = f->ops->get_buffer(f->opaque, f->buf + pending, f->buf_offset,
-                        IO_BUF_SIZE - pending);
+                        f->buf_capacity - pending);
     if (len > 0) {
         f->buf_size += len;
         f->buf_offset += len;
@@ -507,6 +769,45 @@ int qemu_get_fd(QEMUFile *f)
     return -1;
 }
 
+QEMUFile *qemu_file_get_return_path(QEMUFile *f)
+{
+    if (f->ops->get_return_path) {
+        return f->ops->get_return_path(f->opaque);
+    }
+    return NULL;
+}
+
+/* Resizes the buffer; data that is already buffered is kept, so this can be
+ * called at any time.  Has no effect on mapped streams. */
+void qemu_file_set_buffer_size(QEMUFile *f, int size)
+{
+    uint8_t *buf;
+    int pending;
+
+    if (f->map) {
+        return;
+    }
+
+    if (f->is_write) {
+        int ret = qemu_fflush(f);
+        if (ret < 0) {
+            qemu_file_set_error(f, ret);
+        }
+    }
+
+    pending = f->buf_size - f->buf_index;
+    size = MAX(size, pending);
+    buf = g_malloc(size);
+    if (pending > 0) {
+        memcpy(buf, f->buf + f->buf_index, pending);
+    }
+    g_free(f->buf);
+    f->buf = buf;
+    f->buf_capacity = size;
+    f->buf_index = 0;
+    f->buf_size = pending;
+}
+
 /** Closes the file
  *
  * Returns negative error value if any error happened on previous operations or
@@ -532,10 +833,30 @@ int qemu_fclose(QEMUFile *f)
     if (f->last_error) {
         ret = f->last_error;
     }
+    if (!f->map) {
+        g_free(f->buf);
+    }
     g_free(f);
     return ret;
 }
 
+/* Queues @size bytes at @buf for writev_buffer, merging them with the
+ * previous piece if they follow it.  Returns true if the vector is full. */
+static bool add_to_iovec(QEMUFile *f, const uint8_t *buf, int size)
+{
+    struct iovec *last = f->iovcnt > 0 ? &f->iov[f->iovcnt - 1] : NULL;
+
+    if (last && (uint8_t *)last->iov_base + last->iov_len == buf) {
+        last->iov_len += size;
+    } else {
+        f->iov[f->iovcnt].iov_base = (uint8_t *)buf;
+        f->iov[f->iovcnt].iov_len = size;
+        f->iovcnt++;
+    }
+    f->iov_bytes += size;
+    return f->iovcnt >= MAX_IOV_SIZE;
+}
+
 void qemu_put_buffer(QEMUFile *f, const uint8_t *buf, int size)
 {
     int l;
@@ -550,16 +871,34 @@ void qemu_put_buffer(QEMUFile *f, const uint8_t *buf, int size)
         abort();
     }
 
+    if (f->ops->writev_buffer && size >= IO_DIRECT_MIN) {
+        int ret;
+
+        /* @buf is only valid for this call, so it is written right away */
+        f->is_write = 1;
+        add_to_iovec(f, buf, size);
+        ret = qemu_fflush(f);
+        if (ret < 0) {
+            qemu_file_set_error(f, ret);
+        }
+        return;
+    }
+
     while (size > 0) {
-        l = IO_BUF_SIZE - f->buf_index;
+        bool full = false;
+
+        l = f->buf_capacity - f->buf_index;
         if (l > size)
             l = size;
         memcpy(f->buf + f->buf_index, buf, l);
         f->is_write = 1;
+        if (f->ops->writev_buffer) {
+            full = add_to_iovec(f, f->buf + f->buf_index, l);
+        }
         f->buf_index += l;
         buf += l;
         size -= l;
-        if (f->buf_index >= IO_BUF_SIZE) {
+        if (full || f->buf_index >= f->buf_capacity) {
             int ret = qemu_fflush(f);
             if (ret < 0) {
                 qemu_file_set_error(f, ret);
@@ -569,8 +908,83 @@ void qemu_put_buffer(QEMUFile *f, const uint8_t *buf, int size)
     }
 }
 
+/* Like qemu_put_buffer(), but the backend may keep a reference to @buf
+ * instead of copying it; see QEMUFilePutBufferAsyncFunc */
+void qemu_put_buffer_async(QEMUFile *f, const uint8_t *buf, int size)
+{
+    int ret;
+
+    if (!f->ops->put_buffer_async && !f->ops->writev_buffer) {
+        qemu_put_buffer(f, buf, size);
+        return;
+    }
+
+    if (f->last_error) {
+        return;
+    }
+
+    if (f->is_write == 0 && f->buf_index > 0) {
+        fprintf(stderr,
+                "Attempted to write to buffer while read buffer is not empty\n");
+        abort();
+    }
+
+    if (!f->ops->put_buffer_async) {
+        /* @buf outlives the file, so it can wait for the next flush */
+        f->is_write = 1;
+        if (add_to_iovec(f, buf, size)) {
+            ret = qemu_fflush(f);
+            if (ret < 0) {
+                qemu_file_set_error(f, ret);
+            }
+        }
+        return;
+    }
+
+    /* preserve ordering with the bytes buffered so far */
+    f->is_write = 1;
+    ret = qemu_fflush(f);
+    if (ret >= 0) {
+        ret = f->ops->put_buffer_async(f->opaque, buf, f->buf_offset, size);
+    }
+    if (ret < 0) {
+        qemu_file_set_error(f, ret);
+        return;
+    }
+    f->buf_offset += size;
+}
+
+/* Returns true if the transport took the page, see QEMUFileSavePageFunc;
+ * errors are recorded in @f */
+bool qemu_save_page(QEMUFile *f, uint64_t block_offset, uint64_t offset,
+                    int size)
+{
+    int ret;
+
+    if (!f->ops->save_page || f->last_error) {
+        return false;
+    }
+
+    /* the page must not overtake what is buffered for the stream */
+    f->is_write = 1;
+    ret = qemu_fflush(f);
+    if (ret >= 0) {
+        ret = f->ops->save_page(f->opaque, block_offset, offset, size);
+    }
+    if (ret == -ENOTSUP) {
+        return false;
+    }
+    if (ret < 0) {
+        qemu_file_set_error(f, ret);
+        return false;
+    }
+    return true;
+}
+
 void qemu_put_byte(QEMUFile *f, int v)
 {
+    bool full = false;
+
     if (f->last_error) {
         return;
     }
@@ -581,9 +995,13 @@ void qemu_put_byte(QEMUFile *f, int v)
         abort();
     }
 
-    f->buf[f->buf_index++] = v;
+    f->buf[f->buf_index] = v;
     f->is_write = 1;
-    if (f->buf_index >= IO_BUF_SIZE) {
+    if (f->ops->writev_buffer) {
+        full = add_to_iovec(f, f->buf + f->buf_index, 1);
+    }
+    f->buf_index++;
+    if (full || f->buf_index >= f->buf_capacity) {
         int ret = qemu_fflush(f);
         if (ret < 0) {
             qemu_file_set_error(f, ret);
@@ -676,7 +1094,9 @@ int qemu_get_byte(QEMUFile *f)
 int64_t qemu_ftell(QEMUFile *f)
 {
     /* buf_offset excludes buffer for writing but includes it for reading */
-    if (f->is_write) {
+    if (f->is_write && f->ops->writev_buffer) {
+        return f->buf_offset + f->iov_bytes;
+    } else if (f->is_write) {
         return f->buf_offset + f->buf_index;
     } else {
         return f->buf_offset - f->buf_size + f->buf_index;
@@ -709,50 +1129,56 @@ int64_t qemu_file_set_rate_limit(QEMUFile *f, int64_t new_rate)
     return 0;
 }
 
+/* The fixed-size fields go through the buffer in one piece rather than
+ * byte by byte; bytes missing at the end of the stream read as zero, as
+ * they do for qemu_get_byte(). */
+
 void qemu_put_be16(QEMUFile *f, unsigned int v)
 {
-    qemu_put_byte(f, v >> 8);
-    qemu_put_byte(f, v);
+    uint8_t buf[2];
+
+    stw_be_p(buf, v);
+    qemu_put_buffer(f, buf, sizeof(buf));
 }
 
 void qemu_put_be32(QEMUFile *f, unsigned int v)
 {
-    qemu_put_byte(f, v >> 24);
-    qemu_put_byte(f, v >> 16);
-    qemu_put_byte(f, v >> 8);
-    qemu_put_byte(f, v);
+    uint8_t buf[4];
+
+    stl_be_p(buf, v);
+    qemu_put_buffer(f, buf, sizeof(buf));
 }
 
 void qemu_put_be64(QEMUFile *f, uint64_t v)
 {
-    qemu_put_be32(f, v >> 32);
-    qemu_put_be32(f, v);
+    uint8_t buf[8];
+
+    stq_be_p(buf, v);
+    qemu_put_buffer(f, buf, sizeof(buf));
 }
 
 unsigned int qemu_get_be16(QEMUFile *f)
 {
-    unsigned int v;
-    v = qemu_get_byte(f) << 8;
-    v |= qemu_get_byte(f);
-    return v;
+    uint8_t buf[2] = { 0 };
+
+    qemu_get_buffer(f, buf, sizeof(buf));
+    return lduw_be_p(buf);
 }
 
 unsigned int qemu_get_be32(QEMUFile *f)
 {
-    unsigned int v;
-    v = qemu_get_byte(f) << 24;
-    v |= qemu_get_byte(f) << 16;
-    v |= qemu_get_byte(f) << 8;
-    v |= qemu_get_byte(f);
-    return v;
+    uint8_t buf[4] = { 0 };
+
+    qemu_get_buffer(f, buf, sizeof(buf));
+    return (uint32_t)ldl_be_p(buf);
 }
 
 uint64_t qemu_get_be64(QEMUFile *f)
 {
-    uint64_t v;
-    v = (uint64_t)qemu_get_be32(f) << 32;
-    v |= qemu_get_be32(f);
-    return v;
+    uint8_t buf[8] = { 0 };
+
+    qemu_get_buffer(f, buf, sizeof(buf));
+    return ldq_be_p(buf);
 }
 
 
@@ -1566,6 +1992,7 @@ static void vmstate_save(QEMUFile *f, SaveStateEntry *se)
 #define QEMU_VM_SECTION_END          0x03
 #define QEMU_VM_SECTION_FULL         0x04
 #define QEMU_VM_SUBSECTION           0x05
+#define QEMU_VM_COMMAND              0x06
 
 bool qemu_savevm_state_blocked(Error **errp)
 {
@@ -1634,13 +2061,32 @@ int qemu_savevm_state_begin(QEMUFile *f,
 
 }
 
-/*
- * this function has three return values:
- *   negative: there was one error, and we have -errno.
- *   0 : We haven't finished, caller have to go again
- *   1 : We have finished, we can go to complete phase
- */
-int qemu_savevm_state_iterate(QEMUFile *f)
+/* Commands carried in the migration stream, outside of any section */
+enum qemu_vm_cmd {
+    MIG_CMD_INVALID = 0,
+    MIG_CMD_POSTCOPY_ADVISE,   /* source may switch to post-copy */
+    MIG_CMD_POSTCOPY_LISTEN,   /* RAM keeps arriving from now on */
+    MIG_CMD_POSTCOPY_RUN,      /* start the guest */
+    MIG_CMD_PACKAGED,          /* be32 length, then a nested stream */
+};
+
+static void qemu_savevm_command_send(QEMUFile *f, enum qemu_vm_cmd command,
+                                     uint16_t len, const uint8_t *data)
+{
+    qemu_put_byte(f, QEMU_VM_COMMAND);
+    qemu_put_be16(f, command);
+    qemu_put_be16(f, len);
+    if (len) {
+        qemu_put_buffer(f, data, len);
+    }
+}
+
+void qemu_savevm_send_postcopy_advise(QEMUFile *f)
+{
+    qemu_savevm_command_send(f, MIG_CMD_POSTCOPY_ADVISE, 0, NULL);
+}
+
+static int savevm_state_iterate(QEMUFile *f, bool postcopy)
 {
     SaveStateEntry *se;
     int ret = 1;
@@ -1649,6 +2095,9 @@ int qemu_savevm_state_iterate(QEMUFile *f)
         if (!se->ops || !se->ops->save_live_iterate) {
             continue;
         }
+        if (postcopy && !se->ops->save_postcopy_start) {
+            continue;
+        }
         if (se->ops && se->ops->is_active) {
             if (!se->ops->is_active(se->opaque)) {
                 continue;
@@ -1683,17 +2132,38 @@ int qemu_savevm_state_iterate(QEMUFile *f)
     return ret;
 }
 
-int qemu_savevm_state_complete(QEMUFile *f)
+/*
+ * this function has three return values:
+ *   negative: there was one error, and we have -errno.
+ *   0 : We haven't finished, caller have to go again
+ *   1 : We have finished, we can go to complete phase
+ */
+int qemu_savevm_state_iterate(QEMUFile *f)
+{
+    return savevm_state_iterate(f, false);
+}
+
+/* Same as qemu_savevm_state_iterate(), once post-copy has started only the
+ * sections that support it are still iterated */
+int qemu_savevm_state_postcopy_iterate(QEMUFile *f)
+{
+    return savevm_state_iterate(f, true);
+}
+
+/* Writes the complete stage of the live sections; with @postcopy false
+ * the sections that do not support post-copy, otherwise the ones that do */
+static int savevm_state_complete_live(QEMUFile *f, bool postcopy)
 {
     SaveStateEntry *se;
     int ret;
 
-    cpu_synchronize_all_states();
-
     QTAILQ_FOREACH(se, &savevm_handlers, entry) {
         if (!se->ops || !se->ops->save_live_complete) {
             continue;
         }
+        if (postcopy != !!se->ops->save_postcopy_start) {
+            continue;
+        }
         if (se->ops && se->ops->is_active) {
             if (!se->ops->is_active(se->opaque)) {
                 continue;
@@ -1710,6 +2180,12 @@ int qemu_savevm_state_complete(QEMUFile *f)
             return ret;
         }
     }
+    return 0;
+}
+
+static void savevm_state_full(QEMUFile *f)
+{
+    SaveStateEntry *se;
 
     QTAILQ_FOREACH(se, &savevm_handlers, entry) {
         int len;
@@ -1733,6 +2209,92 @@ int qemu_savevm_state_complete(QEMUFile *f)
         vmstate_save(f, se);
         trace_savevm_section_end(se->section_id);
     }
+}
+
+int qemu_savevm_state_complete(QEMUFile *f)
+{
+    int ret;
+
+    cpu_synchronize_all_states();
+
+    ret = savevm_state_complete_live(f, false);
+    if (ret < 0) {
+        return ret;
+    }
+    ret = savevm_state_complete_live(f, true);
+    if (ret < 0) {
+        return ret;
+    }
+
+    savevm_state_full(f);
+
+    qemu_put_byte(f, QEMU_VM_EOF);
+
+    return qemu_file_get_error(f);
+}
+
+/*
+ * Switch to post-copy, called with the guest stopped.  Sections that cannot
+ * continue afterwards are completed, post-copy sections get to tell the
+ * destination what it has to fetch again, and the device state is sent as
+ * a single package together with the commands that start the guest.  The
+ * destination reads the package in one go, so it can keep pulling RAM from
+ * the main stream while loading devices.
+ */
+int qemu_savevm_state_postcopy_start(QEMUFile *f)
+{
+    QEMUFileBuffer pkg = { 0 };
+    QEMUFile *pf;
+    SaveStateEntry *se;
+    uint8_t be_len[4];
+    int ret;
+
+    cpu_synchronize_all_states();
+
+    ret = savevm_state_complete_live(f, false);
+    if (ret < 0) {
+        return ret;
+    }
+
+    QTAILQ_FOREACH(se, &savevm_handlers, entry) {
+        if (!se->ops || !se->ops->save_postcopy_start) {
+            continue;
+        }
+        if (se->ops->is_active && !se->ops->is_active(se->opaque)) {
+            continue;
+        }
+        qemu_put_byte(f, QEMU_VM_SECTION_PART);
+        qemu_put_be32(f, se->section_id);
+
+        ret = se->ops->save_postcopy_start(f, se->opaque);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    pf = qemu_fopen_ops(&pkg, &buf_write_ops);
+    qemu_savevm_command_send(pf, MIG_CMD_POSTCOPY_LISTEN, 0, NULL);
+    savevm_state_full(pf);
+    qemu_savevm_command_send(pf, MIG_CMD_POSTCOPY_RUN, 0, NULL);
+    qemu_put_byte(pf, QEMU_VM_EOF);
+    qemu_fclose(pf);
+
+    stl_be_p(be_len, pkg.size);
+    qemu_savevm_command_send(f, MIG_CMD_PACKAGED, sizeof(be_len), be_len);
+    qemu_put_buffer(f, pkg.data, pkg.size);
+    g_free(pkg.data);
+
+    return qemu_file_get_error(f);
+}
+
+int qemu_savevm_state_postcopy_complete(QEMUFile *f)
+{
+    int ret;
+
+    ret = savevm_state_complete_live(f, true);
+    if (ret < 0) {
+        return ret;
+    }
 
     qemu_put_byte(f, QEMU_VM_EOF);
 
@@ -1941,30 +2503,182 @@ typedef struct LoadStateEntry {
     int version_id;
 } LoadStateEntry;
 
-int qemu_loadvm_state(QEMUFile *f)
+typedef QLIST_HEAD(, LoadStateEntry) LoadStateList;
+
+/* Returned by the command handlers when the rest of the main stream is
+ * read by the post-copy listen thread */
+#define LOADVM_QUIT 1
+
+static struct {
+    PostcopyState postcopy_state;
+    QEMUFile *from_src_file;
+    QEMUFile *to_src_file;
+    LoadStateList *handlers;
+    QemuThread listen_thread;
+} incoming;
+
+PostcopyState postcopy_state_get(void)
+{
+    return incoming.postcopy_state;
+}
+
+static void loadvm_free_handlers(LoadStateList *handlers)
 {
-    QLIST_HEAD(, LoadStateEntry) loadvm_handlers =
-        QLIST_HEAD_INITIALIZER(loadvm_handlers);
     LoadStateEntry *le, *new_le;
-    uint8_t section_type;
-    unsigned int v;
+
+    QLIST_FOREACH_SAFE(le, handlers, entry, new_le) {
+        QLIST_REMOVE(le, entry);
+        g_free(le);
+    }
+}
+
+static int qemu_loadvm_state_main(QEMUFile *f, LoadStateList *handlers);
+
+/* Reads the RAM still coming from the source while the guest runs.  Guest
+ * memory accesses may be blocked on these pages, so this must not wait for
+ * the iothread lock. */
+static void *postcopy_listen_thread(void *opaque)
+{
+    QEMUFile *f = incoming.from_src_file;
     int ret;
 
-    if (qemu_savevm_state_blocked(NULL)) {
+    ret = qemu_loadvm_state_main(f, incoming.handlers);
+    if (ret == 0) {
+        ret = qemu_file_get_error(f);
+    }
+    if (ret < 0) {
+        /* the guest is already running here, there is no way back */
+        fprintf(stderr, "postcopy: load of migration failed: %s\n",
+                strerror(-ret));
+        exit(EXIT_FAILURE);
+    }
+
+    postcopy_ram_incoming_cleanup();
+    incoming.postcopy_state = POSTCOPY_INCOMING_END;
+
+    migrate_send_rp_shut(incoming.to_src_file, 0);
+    qemu_fclose(incoming.to_src_file);
+    incoming.to_src_file = NULL;
+    qemu_fclose(f);
+    incoming.from_src_file = NULL;
+
+    loadvm_free_handlers(incoming.handlers);
+    g_free(incoming.handlers);
+    incoming.handlers = NULL;
+
+    return NULL;
+}
+
+static int loadvm_postcopy_listen(void)
+{
+    QEMUFile *f = incoming.from_src_file;
+
+    if (incoming.postcopy_state != POSTCOPY_INCOMING_ADVISE) {
+        fprintf(stderr, "postcopy: listen without advise\n");
         return -EINVAL;
     }
 
-    v = qemu_get_be32(f);
-    if (v != QEMU_VM_FILE_MAGIC)
+    incoming.to_src_file = qemu_file_get_return_path(f);
+    if (!incoming.to_src_file) {
+        fprintf(stderr, "postcopy: migration channel has no return path\n");
         return -EINVAL;
+    }
 
-    v = qemu_get_be32(f);
-    if (v == QEMU_VM_FILE_VERSION_COMPAT) {
-        fprintf(stderr, "SaveVM v2 format is obsolete and don't work anymore\n");
-        return -ENOTSUP;
+    if (postcopy_ram_enable_notify(incoming.to_src_file) < 0) {
+        return -EINVAL;
     }
-    if (v != QEMU_VM_FILE_VERSION)
-        return -ENOTSUP;
+
+    /* the listen thread is not a coroutine, it waits on the socket */
+    socket_set_block(qemu_get_fd(f));
+    incoming.postcopy_state = POSTCOPY_INCOMING_LISTENING;
+    qemu_thread_create(&incoming.listen_thread, postcopy_listen_thread,
+                       NULL, QEMU_THREAD_DETACHED);
+    return 0;
+}
+
+static int loadvm_postcopy_run(void)
+{
+    if (incoming.postcopy_state != POSTCOPY_INCOMING_LISTENING) {
+        fprintf(stderr, "postcopy: run without listen\n");
+        return -EINVAL;
+    }
+
+    cpu_synchronize_all_post_init();
+    incoming.postcopy_state = POSTCOPY_INCOMING_RUNNING;
+    migrate_incoming_start_vm();
+    return 0;
+}
+
+static int loadvm_handle_packaged(QEMUFile *f)
+{
+    QEMUFileBuffer pkg = { 0 };
+    LoadStateList handlers = QLIST_HEAD_INITIALIZER(handlers);
+    QEMUFile *pf;
+    int ret;
+
+    pkg.size = qemu_get_be32(f);
+    pkg.data = g_malloc(pkg.size);
+    if (qemu_get_buffer(f, pkg.data, pkg.size) != pkg.size) {
+        g_free(pkg.data);
+        return -EINVAL;
+    }
+
+    pf = qemu_fopen_ops(&pkg, &buf_read_ops);
+    ret = qemu_loadvm_state_main(pf, &handlers);
+    if (ret == 0) {
+        ret = qemu_file_get_error(pf);
+    }
+    qemu_fclose(pf);
+    loadvm_free_handlers(&handlers);
+    g_free(pkg.data);
+
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (incoming.postcopy_state >= POSTCOPY_INCOMING_LISTENING) {
+        return LOADVM_QUIT;
+    }
+    return 0;
+}
+
+static int loadvm_process_command(QEMUFile *f)
+{
+    uint16_t command, len;
+
+    command = qemu_get_be16(f);
+    len = qemu_get_be16(f);
+
+    switch (command) {
+    case MIG_CMD_POSTCOPY_ADVISE:
+        if (incoming.postcopy_state != POSTCOPY_INCOMING_NONE ||
+            !postcopy_ram_supported_by_host() ||
+            postcopy_ram_incoming_init() < 0) {
+            return -EINVAL;
+        }
+        incoming.postcopy_state = POSTCOPY_INCOMING_ADVISE;
+        return 0;
+    case MIG_CMD_POSTCOPY_LISTEN:
+        return loadvm_postcopy_listen();
+    case MIG_CMD_POSTCOPY_RUN:
+        return loadvm_postcopy_run();
+    case MIG_CMD_PACKAGED:
+        if (len != 4) {
+            return -EINVAL;
+        }
+        return loadvm_handle_packaged(f);
+    default:
+        fprintf(stderr, "Unknown savevm command %d (len %d)\n",
+                command, len);
+        return -EINVAL;
+    }
+}
+
+static int qemu_loadvm_state_main(QEMUFile *f, LoadStateList *handlers)
+{
+    LoadStateEntry *le;
+    uint8_t section_type;
+    int ret = 0;
 
     while ((section_type = qemu_get_byte(f)) != QEMU_VM_EOF) {
         uint32_t instance_id, version_id, section_id;
@@ -1987,16 +2701,14 @@ int qemu_loadvm_state(QEMUFile *f)
             se = find_se(idstr, instance_id);
             if (se == NULL) {
                 fprintf(stderr, "Unknown savevm section or instance '%s' %d\n", idstr, instance_id);
-                ret = -EINVAL;
-                goto out;
+                return -EINVAL;
             }
 
             /* Validate version */
             if (version_id > se->version_id) {
                 fprintf(stderr, "savevm: unsupported version %d for '%s' v%d\n",
                         version_id, idstr, se->version_id);
-                ret = -EINVAL;
-                goto out;
+                return -EINVAL;
             }
 
             /* Add entry */
@@ -2005,52 +2717,99 @@ int qemu_loadvm_state(QEMUFile *f)
             le->se = se;
             le->section_id = section_id;
             le->version_id = version_id;
-            QLIST_INSERT_HEAD(&loadvm_handlers, le, entry);
+            QLIST_INSERT_HEAD(handlers, le, entry);
 
             ret = vmstate_load(f, le->se, le->version_id);
             if (ret < 0) {
                 fprintf(stderr, "qemu: warning: error while loading state for instance 0x%x of device '%s'\n",
                         instance_id, idstr);
-                goto out;
+                return ret;
             }
             break;
         case QEMU_VM_SECTION_PART:
         case QEMU_VM_SECTION_END:
             section_id = qemu_get_be32(f);
 
-            QLIST_FOREACH(le, &loadvm_handlers, entry) {
+            QLIST_FOREACH(le, handlers, entry) {
                 if (le->section_id == section_id) {
                     break;
                 }
             }
             if (le == NULL) {
                 fprintf(stderr, "Unknown savevm section %d\n", section_id);
-                ret = -EINVAL;
-                goto out;
+                return -EINVAL;
             }
 
             ret = vmstate_load(f, le->se, le->version_id);
             if (ret < 0) {
                 fprintf(stderr, "qemu: warning: error while loading state section id %d\n",
                         section_id);
-                goto out;
+                return ret;
+            }
+            break;
+        case QEMU_VM_COMMAND:
+            ret = loadvm_process_command(f);
+            if (ret != 0) {
+                return ret;
             }
             break;
         default:
             fprintf(stderr, "Unknown savevm section type %d\n", section_type);
-            ret = -EINVAL;
-            goto out;
+            return -EINVAL;
         }
     }
 
-    cpu_synchronize_all_post_init();
+    return 0;
+}
 
-    ret = 0;
+/*
+ * Returns 1 if the guest was started in post-copy mode; the rest of @f is
+ * then read by the listen thread, which also closes it.
+ */
+int qemu_loadvm_state(QEMUFile *f)
+{
+    LoadStateList *handlers;
+    unsigned int v;
+    int ret;
 
-out:
-    QLIST_FOREACH_SAFE(le, &loadvm_handlers, entry, new_le) {
-        QLIST_REMOVE(le, entry);
-        g_free(le);
+    if (qemu_savevm_state_blocked(NULL)) {
+        return -EINVAL;
+    }
+
+    v = qemu_get_be32(f);
+    if (v != QEMU_VM_FILE_MAGIC)
+        return -EINVAL;
+
+    v = qemu_get_be32(f);
+    if (v == QEMU_VM_FILE_VERSION_COMPAT) {
+        fprintf(stderr, "SaveVM v2 format is obsolete and don't work anymore\n");
+        return -ENOTSUP;
+    }
+    if (v != QEMU_VM_FILE_VERSION)
+        return -ENOTSUP;
+
+    handlers = g_malloc0(sizeof(*handlers));
+    incoming.from_src_file = f;
+    incoming.handlers = handlers;
+
+    ret = qemu_loadvm_state_main(f, handlers);
+    if (ret == LOADVM_QUIT) {
+        return 1;
+    }
+
+    if (ret == 0) {
+        cpu_synchronize_all_post_init();
+    }
+
+    loadvm_free_handlers(handlers);
+    g_free(handlers);
+    incoming.handlers = NULL;
+    incoming.from_src_file = NULL;
+
+    if (incoming.postcopy_state != POSTCOPY_INCOMING_NONE) {
+        /* advised, but the source completed without switching */
+        postcopy_ram_incoming_cleanup();
+        incoming.postcopy_state = POSTCOPY_INCOMING_NONE;
     }
 
     if (ret == 0) {
@@ -2085,7 +2844,7 @@ static int bdrv_snapshot_find(BlockDriverState *bs, QEMUSnapshotInfo *sn_info,
 /*
  * Deletes snapshots of a given name in all opened images.
  */
-static int del_existing_snapshots(Monitor *mon, const char *name)
+static int del_existing_snapshots(const char *name, Error **errp)
 {
     BlockDriverState *bs;
     QEMUSnapshotInfo sn1, *snapshot = &sn1;
@@ -2098,9 +2857,8 @@ static int del_existing_snapshots(Monitor *mon, const char *name)
         {
             ret = bdrv_snapshot_delete(bs, name);
             if (ret < 0) {
-                monitor_printf(mon,
-                               "Error while deleting snapshot on '%s'\n",
-                               bdrv_get_device_name(bs));
+                error_setg(errp, "Error while deleting snapshot on '%s'",
+                           bdrv_get_device_name(bs));
                 return -1;
             }
         }
@@ -2109,19 +2867,14 @@ static int del_existing_snapshots(Monitor *mon, const char *name)
     return 0;
 }
 
-void do_savevm(Monitor *mon, const QDict *qdict)
+/*
+ * Checks that every writable device can take a snapshot, and returns the
+ * one that holds the VM state.
+ */
+static BlockDriverState *savevm_check_devices(Error **errp)
 {
-    BlockDriverState *bs, *bs1;
-    QEMUSnapshotInfo sn1, *sn = &sn1, old_sn1, *old_sn = &old_sn1;
-    int ret;
-    QEMUFile *f;
-    int saved_vm_running;
-    uint64_t vm_state_size;
-    qemu_timeval tv;
-    struct tm tm;
-    const char *name = qdict_get_try_str(qdict, "name");
+    BlockDriverState *bs;
 
-    /* Verify if there is a device that doesn't support snapshots and is writable */
     bs = NULL;
     while ((bs = bdrv_next(bs))) {
 
@@ -2130,20 +2883,27 @@ void do_savevm(Monitor *mon, const QDict *qdict)
         }
 
         if (!bdrv_can_snapshot(bs)) {
-            monitor_printf(mon, "Device '%s' is writable but does not support snapshots.\n",
-                               bdrv_get_device_name(bs));
-            return;
+            error_setg(errp, "Device '%s' is writable but does not support "
+                       "snapshots.", bdrv_get_device_name(bs));
+            return NULL;
         }
     }
 
     bs = bdrv_snapshots();
     if (!bs) {
-        monitor_printf(mon, "No block device can accept snapshots\n");
-        return;
+        error_setg(errp, "No block device can accept snapshots");
     }
+    return bs;
+}
 
-    saved_vm_running = runstate_is_running();
-    vm_stop(RUN_STATE_SAVE_VM);
+/* Fill in the name and the times of a new snapshot */
+static void savevm_init_snapshot(BlockDriverState *bs, QEMUSnapshotInfo *sn,
+                                 const char *name)
+{
+    QEMUSnapshotInfo old_sn1, *old_sn = &old_sn1;
+    qemu_timeval tv;
+    struct tm tm;
+    int ret;
 
     memset(sn, 0, sizeof(*sn));
 
@@ -2166,9 +2926,285 @@ void do_savevm(Monitor *mon, const QDict *qdict)
         localtime_r((const time_t *)&tv.tv_sec, &tm);
         strftime(sn->name, sizeof(sn->name), "vm-%Y%m%d%H%M%S", &tm);
     }
+}
+
+/* Create the snapshots, with the VM state size only in @bs */
+static void savevm_create_snapshots(BlockDriverState *bs,
+                                    QEMUSnapshotInfo *sn,
+                                    uint64_t vm_state_size)
+{
+    BlockDriverState *bs1;
+    int ret;
+
+    bs1 = NULL;
+    while ((bs1 = bdrv_next(bs1))) {
+        if (bdrv_can_snapshot(bs1)) {
+            /* Write VM state size only to the image that contains the state */
+            sn->vm_state_size = (bs == bs1 ? vm_state_size : 0);
+            ret = bdrv_snapshot_create(bs1, sn);
+            if (ret < 0) {
+                error_report("Error while creating snapshot on '%s'",
+                             bdrv_get_device_name(bs1));
+            }
+        }
+    }
+}
+
+/*
+ * Live snapshots write RAM while the guest runs, with the iterative
+ * migration code and dirty logging, from a bottom half of the main loop
+ * (the block layer needs the BQL).  The guest is only stopped for the last
+ * pass over RAM and the device state.
+ */
+
+/* give up converging once this many times the RAM size has been written */
+#define SAVEVM_LIVE_MAX_PASSES  3
+
+typedef struct SaveVMLiveState {
+    SavevmStatus status;
+    QEMUFile *file;
+    BlockDriverState *bs;
+    QEMUSnapshotInfo sn;
+    QEMUBH *bh;
+    bool saved_vm_running;
+    int64_t start_time;
+    int64_t round_time;
+    int64_t round_pos;
+    uint64_t max_size;
+    int64_t total_time;
+    int64_t downtime;
+    int64_t vm_state_size;
+    char *error;
+} SaveVMLiveState;
+
+static SaveVMLiveState savevm_live;
+
+bool savevm_live_in_progress(void)
+{
+    return savevm_live.status == SAVEVM_STATUS_ACTIVE;
+}
+
+static void savevm_live_cleanup(SaveVMLiveState *s, int ret)
+{
+    if (s->file) {
+        qemu_fclose(s->file);
+        s->file = NULL;
+    }
+    qemu_bh_delete(s->bh);
+    s->bh = NULL;
+
+    if (ret < 0) {
+        qemu_savevm_state_cancel();
+        if (!s->error) {
+            s->error = g_strdup_printf("Error %d while writing VM", ret);
+        }
+        error_report("savevm: %s", s->error);
+        s->status = SAVEVM_STATUS_FAILED;
+    } else {
+        s->status = SAVEVM_STATUS_COMPLETED;
+    }
+    s->total_time = qemu_get_clock_ms(rt_clock) - s->start_time;
+
+    if (s->saved_vm_running && !runstate_is_running()) {
+        vm_start();
+    }
+}
+
+static int savevm_live_complete(SaveVMLiveState *s)
+{
+    int64_t stop_time = qemu_get_clock_ms(rt_clock);
+    int ret;
+
+    s->saved_vm_running = runstate_is_running();
+    vm_stop(RUN_STATE_SAVE_VM);
+    s->sn.vm_clock_nsec = qemu_get_clock_ns(vm_clock);
+
+    ret = qemu_savevm_state_complete(s->file);
+    s->vm_state_size = qemu_ftell(s->file);
+    if (ret == 0) {
+        ret = qemu_fclose(s->file);
+    } else {
+        qemu_fclose(s->file);
+    }
+    s->file = NULL;
+    if (ret < 0) {
+        return ret;
+    }
+
+    savevm_create_snapshots(s->bs, &s->sn, s->vm_state_size);
+    s->downtime = qemu_get_clock_ms(rt_clock) - stop_time;
+    return 0;
+}
+
+static void savevm_live_bh(void *opaque)
+{
+    SaveVMLiveState *s = opaque;
+    int64_t now, pos;
+    uint64_t pending;
+    int ret;
+
+    ret = qemu_savevm_state_iterate(s->file);
+    if (ret < 0) {
+        savevm_live_cleanup(s, ret);
+        return;
+    }
+
+    /* re-estimate how much can be written within the allowed downtime */
+    now = qemu_get_clock_ms(rt_clock);
+    pos = qemu_ftell(s->file);
+    if (now > s->round_time + 100) {
+        s->max_size = (pos - s->round_pos) / (now - s->round_time) *
+                      migrate_max_downtime() / 1000000;
+        s->round_time = now;
+        s->round_pos = pos;
+    }
+
+    pending = qemu_savevm_state_pending(s->file, s->max_size);
+    if (pending <= s->max_size ||
+        pos > (int64_t)(SAVEVM_LIVE_MAX_PASSES * ram_bytes_total())) {
+        ret = savevm_live_complete(s);
+        savevm_live_cleanup(s, ret);
+        return;
+    }
+
+    /* let the guest and the rest of the main loop run */
+    qemu_bh_schedule(s->bh);
+}
+
+void qmp_savevm_start(bool has_name, const char *name, Error **errp)
+{
+    SaveVMLiveState *s = &savevm_live;
+    Error *local_err = NULL;
+    MigrationParams params = {
+        .blk = 0,
+        .shared = 0
+    };
+    BlockDriverState *bs;
+    int ret;
+
+    if (savevm_live_in_progress()) {
+        error_setg(errp, "A live snapshot is already being saved");
+        return;
+    }
+    if (migration_is_active(migrate_get_current())) {
+        error_set(errp, QERR_MIGRATION_ACTIVE);
+        return;
+    }
+    if (qemu_savevm_state_blocked(errp)) {
+        return;
+    }
+
+    bs = savevm_check_devices(errp);
+    if (!bs) {
+        return;
+    }
+
+    g_free(s->error);
+    memset(s, 0, sizeof(*s));
+    s->bs = bs;
+    savevm_init_snapshot(bs, &s->sn, has_name ? name : NULL);
 
     /* Delete old snapshots of the same name */
-    if (name && del_existing_snapshots(mon, name) < 0) {
+    if (has_name && del_existing_snapshots(name, &local_err) < 0) {
+        error_propagate(errp, local_err);
+        return;
+    }
+
+    s->file = qemu_fopen_bdrv(bs, 1);
+    if (!s->file) {
+        error_setg(errp, "Could not open VM state file");
+        return;
+    }
+
+    ret = qemu_savevm_state_begin(s->file, &params);
+    if (ret < 0) {
+        qemu_fclose(s->file);
+        s->file = NULL;
+        error_setg(errp, "Error %d while writing VM", ret);
+        return;
+    }
+
+    s->status = SAVEVM_STATUS_ACTIVE;
+    s->start_time = s->round_time = qemu_get_clock_ms(rt_clock);
+    s->round_pos = qemu_ftell(s->file);
+    s->bh = qemu_bh_new(savevm_live_bh, s);
+    qemu_bh_schedule(s->bh);
+}
+
+SaveVMInfo *qmp_query_savevm(Error **errp)
+{
+    SaveVMLiveState *s = &savevm_live;
+    SaveVMInfo *info = g_new0(SaveVMInfo, 1);
+
+    info->status = s->status;
+    if (s->status == SAVEVM_STATUS_NONE) {
+        return info;
+    }
+
+    info->has_name = true;
+    info->name = g_strdup(s->sn.name);
+    info->has_vmstate_size = true;
+    if (s->status == SAVEVM_STATUS_ACTIVE) {
+        info->vmstate_size = qemu_ftell(s->file);
+        info->has_total_time = true;
+        info->total_time = qemu_get_clock_ms(rt_clock) - s->start_time;
+        return info;
+    }
+
+    info->vmstate_size = s->vm_state_size;
+    info->has_total_time = true;
+    info->total_time = s->total_time;
+    if (s->status == SAVEVM_STATUS_COMPLETED) {
+        info->has_downtime = true;
+        info->downtime = s->downtime;
+    } else if (s->error) {
+        info->has_error = true;
+        info->error = g_strdup(s->error);
+    }
+    return info;
+}
+
+void do_savevm(Monitor *mon, const QDict *qdict)
+{
+    BlockDriverState *bs;
+    QEMUSnapshotInfo sn1, *sn = &sn1;
+    int ret;
+    QEMUFile *f;
+    int saved_vm_running;
+    uint64_t vm_state_size;
+    const char *name = qdict_get_try_str(qdict, "name");
+    Error *local_err = NULL;
+
+    if (qdict_get_try_bool(qdict, "live", 0)) {
+        qmp_savevm_start(!!name, name, &local_err);
+        if (error_is_set(&local_err)) {
+            monitor_printf(mon, "%s\n", error_get_pretty(local_err));
+            error_free(local_err);
+        }
+        return;
+    }
+
+    if (savevm_live_in_progress()) {
+        monitor_printf(mon, "A live snapshot is being saved\n");
+        return;
+    }
+
+    bs = savevm_check_devices(&local_err);
+    if (!bs) {
+        monitor_printf(mon, "%s\n", error_get_pretty(local_err));
+        error_free(local_err);
+        return;
+    }
+
+    saved_vm_running = runstate_is_running();
+    vm_stop(RUN_STATE_SAVE_VM);
+
+    savevm_init_snapshot(bs, sn, name);
+
+    /* Delete old snapshots of the same name */
+    if (name && del_existing_snapshots(name, &local_err) < 0) {
+        monitor_printf(mon, "%s\n", error_get_pretty(local_err));
+        error_free(local_err);
         goto the_end;
     }
 
@@ -2187,19 +3223,7 @@ void do_savevm(Monitor *mon, const QDict *qdict)
     }
 
     /* create the snapshots */
-
-    bs1 = NULL;
-    while ((bs1 = bdrv_next(bs1))) {
-        if (bdrv_can_snapshot(bs1)) {
-            /* Write VM state size only to the image that contains the state */
-            sn->vm_state_size = (bs == bs1 ? vm_state_size : 0);
-            ret = bdrv_snapshot_create(bs1, sn);
-            if (ret < 0) {
-                monitor_printf(mon, "Error while creating snapshot on '%s'\n",
-                               bdrv_get_device_name(bs1));
-            }
-        }
-    }
+    savevm_create_snapshots(bs, sn, vm_state_size);
 
  the_end:
     if (saved_vm_running)
@@ -2231,6 +3255,80 @@ void qmp_xen_save_devices_state(const char *filename, Error **errp)
         vm_start();
 }
 
+void qmp_template_save(const char *filename, Error **errp)
+{
+    QEMUFile *f;
+    int saved_vm_running;
+    int fd, ret;
+
+    if (xen_enabled()) {
+        error_set(errp, QERR_UNSUPPORTED);
+        return;
+    }
+
+    saved_vm_running = runstate_is_running();
+    vm_stop(RUN_STATE_SAVE_VM);
+
+    fd = qemu_open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0600);
+    if (fd < 0 || lseek(fd, ram_template_state_offset(), SEEK_SET) < 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        error_set(errp, QERR_OPEN_FILE_FAILED, filename);
+        goto the_end;
+    }
+    f = qemu_fdopen(fd, "wb");
+    if (!f) {
+        close(fd);
+        error_set(errp, QERR_OPEN_FILE_FAILED, filename);
+        goto the_end;
+    }
+    ret = ram_save_template(fd, f);
+    if (ret == 0) {
+        ret = qemu_save_device_state(f);
+    }
+    qemu_fclose(f);
+    if (ret < 0) {
+        error_set(errp, QERR_IO_ERROR);
+    }
+
+ the_end:
+    if (saved_vm_running)
+        vm_start();
+}
+
+/* Load the device state of -machine ram-template, whose RAM is mapped */
+int load_template_state(const char *filename)
+{
+    QEMUFile *f;
+    int fd, ret;
+
+    fd = qemu_open(filename, O_RDONLY | O_BINARY);
+    if (fd < 0 || lseek(fd, ram_template_state_offset(), SEEK_SET) < 0) {
+        error_report("Could not open RAM template '%s'", filename);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -EINVAL;
+    }
+    f = qemu_fdopen(fd, "rb");
+    if (!f) {
+        close(fd);
+        return -EINVAL;
+    }
+
+    ret = ram_load_template(f);
+    if (ret == 0) {
+        ret = qemu_loadvm_state(f);
+    }
+    qemu_fclose(f);
+    if (ret < 0) {
+        error_report("Error %d while loading RAM template '%s'", ret,
+                     filename);
+    }
+    return ret;
+}
+
 int load_vmstate(const char *name)
 {
     BlockDriverState *bs, *bs_vm_state;
@@ -2238,6 +3336,11 @@ int load_vmstate(const char *name)
     QEMUFile *f;
     int ret;
 
+    if (savevm_live_in_progress()) {
+        error_report("A live snapshot is being saved");
+        return -EBUSY;
+    }
+
     bs_vm_state = bdrv_snapshots();
     if (!bs_vm_state) {
         error_report("No block device supports snapshots");
@@ -32,7 +32,7 @@ def error_opt(msg = None):
     format_descr = "\n".join([ "    %-15s %s" % (n, d)
                                for n,d in tracetool.format.get_list() ])
     error_write("""\
-Usage: %(script)s --format=<format> --backend=<backend> [<options>]
+Usage: %(script)s --format=<format> --backend=<backend>[,<backend>...] [<options>]
 
 Backends:
 %(backends)s
@@ -112,10 +112,13 @@ def main(args):
         error_opt("backend not set")
 
     if check_backend:
-        if tracetool.backend.exists(arg_backend):
-            sys.exit(0)
-        else:
+        backends = arg_backend.split(",")
+        if "nop" in backends and len(backends) > 1:
             sys.exit(1)
+        for backend in backends:
+            if not tracetool.backend.exists(backend):
+                sys.exit(1)
+        sys.exit(0)
 
     if arg_format == "stap":
         if binary is None:
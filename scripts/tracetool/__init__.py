@@ -226,7 +226,7 @@ def generate(fevents, format, backend,
     format : str
         Output format name.
     backend : str
-        Output backend name.
+        Output backend name, or a comma-separated list of backend names.
     binary : str or None
         See tracetool.backend.dtrace.BINARY.
     probe_prefix : str or None
@@ -242,14 +242,20 @@ def generate(fevents, format, backend,
     if not tracetool.format.exists(mformat):
         raise TracetoolError("unknown format: %s" % format)
 
-    backend = str(backend)
-    if len(backend) is 0:
+    backends = [ b.replace("-", "_") for b in str(backend).split(",") ]
+    if "" in backends:
         raise TracetoolError("backend not set")
-    mbackend = backend.replace("-", "_")
-    if not tracetool.backend.exists(mbackend):
-        raise TracetoolError("unknown backend: %s" % backend)
-
-    if not tracetool.backend.compatible(mbackend, mformat):
+    for mbackend in backends:
+        if not tracetool.backend.exists(mbackend):
+            raise TracetoolError("unknown backend: %s" % mbackend)
+    if "nop" in backends and len(backends) > 1:
+        raise TracetoolError("backend 'nop' cannot be combined with others")
+
+    # backends that do not support a format simply have nothing to add to it
+    # (e.g. the .d file only describes the DTrace probes)
+    backends = [ b for b in backends
+                 if tracetool.backend.compatible(b, mformat) ]
+    if len(backends) == 0:
         raise TracetoolError("backend '%s' not compatible with format '%s'" %
                              (backend, format))
 
@@ -259,16 +265,20 @@ def generate(fevents, format, backend,
 
     events = _read_events(fevents)
 
-    if backend == "nop":
+    if backends == [ "nop" ]:
         ( e.properies.add("disable") for e in events )
 
+    if tracetool.format.generate_events(mformat, events, backends):
+        return
+
     tracetool.format.generate_begin(mformat, events)
     tracetool.backend.generate("nop", format,
                                [ e
                                  for e in events
                                  if "disable" in e.properties ])
-    tracetool.backend.generate(backend, format,
-                               [ e
-                                 for e in events
-                                 if "disable" not in e.properties ])
+    for mbackend in backends:
+        tracetool.backend.generate(mbackend, format,
+                                   [ e
+                                     for e in events
+                                     if "disable" not in e.properties ])
     tracetool.format.generate_end(mformat, events)
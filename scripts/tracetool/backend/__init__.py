@@ -20,13 +20,25 @@ All backends must generate their contents through the 'tracetool.out' routine.
 Backend functions
 -----------------
 
-======== =======================================================================
-Function Description
-======== =======================================================================
-<format> Called to generate the format- and backend-specific code for each of
-         the specified events. If the function does not exist, the backend is
-         considered not compatible with the given format.
-======== =======================================================================
+All the following functions are optional.
+
+=========== ====================================================================
+Function    Description
+=========== ====================================================================
+h_begin     Called with the list of events to generate the backend-specific
+            declarations of the .h file.
+h_event     Called for each event to generate the statements of its tracing
+            routine; the routines of all selected backends are combined into
+            one.  The backend is compatible with the 'h' format if it exists.
+<format>    Called to generate the format- and backend-specific code for each of
+            the specified events, for any other format.  If the function does not
+            exist, the backend is considered not compatible with the given
+            format.
+=========== ====================================================================
+
+Several backends can be selected at once, as a comma-separated list; their
+code is generated one after the other.  Backend 'nop' cannot be combined with
+others.
 """
 
 __author__     = "Lluís Vilanova <vilanova@ac.upc.edu>"
@@ -88,14 +100,25 @@ def compatible(backend, format):
     if backend == "nop":
         return True
     else:
+        if format == "h":
+            format = "h_event"
         func = tracetool.try_import("tracetool.backend." + backend,
                                     format, None)[1]
         return func is not None
 
 
-def _empty(events):
+def _empty(*args):
     pass
 
+def call(backend, name, *args):
+    """Call the given function of a backend, if it exists."""
+    backend = backend.replace("-", "_")
+    if backend == "nop":
+        return
+    func = tracetool.try_import("tracetool.backend." + backend,
+                                name, _empty)[1]
+    func(*args)
+
 def generate(backend, format, events):
     """Generate the per-event output for the given (backend, format) pair."""
     if not compatible(backend, format):
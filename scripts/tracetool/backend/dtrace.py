@@ -36,19 +36,15 @@ def c(events):
     pass
 
 
-def h(events):
-    out('#include "trace/generated-tracers-dtrace.h"',
-        '')
+def h_begin(events):
+    out('#include "trace/generated-tracers-dtrace.h"')
 
-    for e in events:
-        out('static inline void trace_%(name)s(%(args)s) {',
-            '    QEMU_%(uppername)s(%(argnames)s);',
-            '}',
-            name = e.name,
-            args = e.args,
-            uppername = e.name.upper(),
-            argnames = ", ".join(e.args.names()),
-            )
+
+def h_event(e):
+    out('    QEMU_%(uppername)s(%(argnames)s);',
+        uppername = e.name.upper(),
+        argnames = ", ".join(e.args.names()),
+        )
 
 
 def d(events):
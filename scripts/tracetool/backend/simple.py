@@ -23,21 +23,11 @@ def is_string(arg):
         return False
 
 def c(events):
-    out('#include "trace.h"',
-        '#include "trace/simple.h"',
-        '',
-        'TraceEvent trace_list[] = {')
-
-    for e in events:
-        out('{.tp_name = "%(name)s", .state=0},',
-            name = e.name,
-            )
-
-    out('};',
+    out('#include "trace/simple.h"',
         '')
 
-    for num, event in enumerate(events):
-        out('void trace_%(name)s(%(args)s)',
+    for event in events:
+        out('void _simple_trace_%(name)s(%(args)s)',
             '{',
             '    TraceBufferRecord rec;',
             name = event.name,
@@ -59,14 +49,10 @@ def c(events):
 
 
         out('',
-            '    if (!trace_list[%(event_id)s].state) {',
-            '        return;',
-            '    }',
-            '',
             '    if (trace_record_start(&rec, %(event_id)s, %(size_str)s)) {',
             '        return; /* Trace Buffer Full, Event Dropped ! */',
             '    }',
-            event_id = num,
+            event_id = "TRACE_" + event.name.upper(),
             size_str = sizestr,
             )
 
@@ -93,15 +79,23 @@ def c(events):
             '')
 
 
-def h(events):
+def h_begin(events):
     out('#include "trace/simple.h"',
         '')
 
     for event in events:
-        out('void trace_%(name)s(%(args)s);',
+        out('void _simple_trace_%(name)s(%(args)s);',
             name = event.name,
             args = event.args,
             )
     out('')
-    out('#define NR_TRACE_EVENTS %d' % len(events))
-    out('extern TraceEvent trace_list[NR_TRACE_EVENTS];')
+
+
+def h_event(event):
+    out('    if (trace_event_get_state(TRACE_%(id)s)) {',
+        '        _simple_trace_%(name)s(%(argnames)s);',
+        '    }',
+        id = event.name.upper(),
+        name = event.name,
+        argnames = ", ".join(event.args.names()),
+        )
@@ -17,40 +17,21 @@ from tracetool import out
 
 
 def c(events):
-    out('#include "trace.h"',
-        '',
-        'TraceEvent trace_list[] = {')
-
-    for e in events:
-        out('{.tp_name = "%(name)s", .state=0},',
-            name = e.name,
-            )
-
-    out('};')
-
-def h(events):
-    out('#include <stdio.h>',
-        '#include "trace/stderr.h"',
-        '',
-        'extern TraceEvent trace_list[];')
-
-    for num, e in enumerate(events):
-        argnames = ", ".join(e.args.names())
-        if len(e.args) > 0:
-            argnames = ", " + argnames
-
-        out('static inline void trace_%(name)s(%(args)s)',
-            '{',
-            '    if (trace_list[%(event_num)s].state != 0) {',
-            '        fprintf(stderr, "%(name)s " %(fmt)s "\\n" %(argnames)s);',
-            '    }',
-            '}',
-            name = e.name,
-            args = e.args,
-            event_num = num,
-            fmt = e.fmt,
-            argnames = argnames,
-            )
-
-    out('',
-        '#define NR_TRACE_EVENTS %d' % len(events))
+    pass
+
+def h_begin(events):
+    out('#include <stdio.h>')
+
+def h_event(e):
+    argnames = ", ".join(e.args.names())
+    if len(e.args) > 0:
+        argnames = ", " + argnames
+
+    out('    if (trace_event_get_state(TRACE_%(id)s)) {',
+        '        fprintf(stderr, "%(name)s " %(fmt)s "\\n" %(argnames)s);',
+        '    }',
+        id = e.name.upper(),
+        name = e.name,
+        fmt = e.fmt,
+        argnames = argnames,
+        )
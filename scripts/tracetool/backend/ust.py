@@ -65,7 +65,7 @@ def c(events):
     out('}')
 
 
-def h(events):
+def h_begin(events):
     out('#include <ust/tracepoint.h>',
         '#undef mutex_lock',
         '#undef mutex_unlock',
@@ -75,7 +75,6 @@ def h(events):
     for e in events:
         if len(e.args) > 0:
             out('DECLARE_TRACE(ust_%(name)s, TP_PROTO(%(args)s), TP_ARGS(%(argnames)s));',
-                '#define trace_%(name)s trace_ust_%(name)s',
                 name = e.name,
                 args = e.args,
                 argnames = ", ".join(e.args.names()),
@@ -83,8 +82,14 @@ def h(events):
 
         else:
             out('_DECLARE_TRACEPOINT_NOARGS(ust_%(name)s);',
-                '#define trace_%(name)s trace_ust_%(name)s',
                 name = e.name,
                 )
 
     out()
+
+
+def h_event(e):
+    out('    trace_ust_%(name)s(%(argnames)s);',
+        name = e.name,
+        argnames = ", ".join(e.args.names()),
+        )
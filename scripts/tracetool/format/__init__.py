@@ -30,6 +30,9 @@ begin    Called to generate the format-specific file header.
 end      Called to generate the format-specific file footer.
 nop      Called to generate the per-event contents when the event is disabled or
          the selected backend is 'nop'.
+generate Called with the events and the list of selected backends to generate
+         the whole file, instead of the functions above; for formats that
+         combine the output of several backends per event.
 ======== =======================================================================
 """
 
@@ -101,3 +104,19 @@ def generate_end(name, events):
     func = tracetool.try_import("tracetool.format." + name,
                                 "end", _empty)[1]
     func(events)
+
+def generate_events(name, events, backends):
+    """Generate the whole format-specific file, if the format can.
+
+    Returns whether the format has its own 'generate' function.
+    """
+    if not exists(name):
+        raise ValueError("unknown format: %s" % name)
+
+    name = name.replace("-", "_")
+    func = tracetool.try_import("tracetool.format." + name,
+                                "generate", None)[1]
+    if func is None:
+        return False
+    func(events, backends)
+    return True
@@ -17,4 +17,18 @@ from tracetool import out
 
 
 def begin(events):
-    out('/* This file is autogenerated by tracetool, do not edit. */')
+    out('/* This file is autogenerated by tracetool, do not edit. */',
+        '',
+        '#include "trace.h"',
+        '',
+        'TraceEvent trace_list[] = {')
+
+    for e in events:
+        if "disable" in e.properties:
+            continue
+        out('{.tp_name = "%(name)s", .state=0},',
+            name = e.name,
+            )
+
+    out('};',
+        '')
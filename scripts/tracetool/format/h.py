@@ -13,6 +13,7 @@ __maintainer__ = "Stefan Hajnoczi"
 __email__      = "stefanha@linux.vnet.ibm.com"
 
 
+import tracetool.backend
 from tracetool import out
 
 
@@ -22,7 +23,8 @@ def begin(events):
         '#ifndef TRACE__GENERATED_TRACERS_H',
         '#define TRACE__GENERATED_TRACERS_H',
         '',
-        '#include "qemu-common.h"')
+        '#include "qemu-common.h"',
+        '#include "trace/control.h"')
 
 def end(events):
     for e in events:
@@ -43,3 +45,52 @@ def nop(events):
             name = e.name,
             args = e.args,
             )
+
+def _stats_key(e):
+    """The argument that pairs an event with the one that completes it."""
+    if len(e.args) == 0:
+        return "0"
+    type_, name = list(e.args)[0]
+    if type_.endswith('*'):
+        return "(uint64_t)(uintptr_t)%s" % name
+    return "(uint64_t)%s" % name
+
+def generate(events, backends):
+    begin(events)
+
+    enabled = [ e for e in events if "disable" not in e.properties ]
+    if backends == [ "nop" ]:
+        enabled = []
+
+    if len(enabled) > 0:
+        out('',
+            'enum {')
+        for e in enabled:
+            out('    TRACE_%s,' % e.name.upper())
+        out('};')
+    out('',
+        '#define NR_TRACE_EVENTS %d' % len(enabled))
+
+    for backend in backends:
+        tracetool.backend.call(backend, "h_begin", enabled)
+
+    nop([ e for e in events if e not in enabled ])
+
+    for e in enabled:
+        out('',
+            'static inline void trace_%(name)s(%(args)s)',
+            '{',
+            '    if (unlikely(trace_event_get_stats(TRACE_%(id)s))) {',
+            '        trace_event_count(TRACE_%(id)s, %(key)s);',
+            '    }',
+            name = e.name,
+            args = e.args,
+            id = e.name.upper(),
+            key = _stats_key(e),
+            )
+        for backend in backends:
+            tracetool.backend.call(backend, "h_event", e)
+        out('}')
+
+    out('')
+    end(events)
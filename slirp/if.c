@@ -51,6 +51,7 @@ if_output(struct socket *so, struct mbuf *ifm)
 	Slirp *slirp = ifm->slirp;
 	struct mbuf *ifq;
 	int on_fastq = 1;
+	bool on_batchq = true;
 
 	DEBUG_CALL("if_output");
 	DEBUG_ARG("so = %lx", (long)so);
@@ -71,22 +72,31 @@ if_output(struct socket *so, struct mbuf *ifm)
 	 * This can include an interactive session, which should go on fastq,
 	 * but gets too greedy... hence it'll be downgraded from fastq to batchq.
 	 * We mustn't put this packet back on the fastq (or we'll send it out of order)
-	 * XXX add cache here?
+	 * Sockets remember their session, only packets without one search.
 	 */
-	for (ifq = slirp->if_batchq.ifq_prev; ifq != &slirp->if_batchq;
-	     ifq = ifq->ifq_prev) {
-		if (so == ifq->ifq_so) {
-			/* A match! */
+	if (so) {
+		if (so->so_batchq) {
 			ifm->ifq_so = so;
-			ifs_insque(ifm, ifq->ifs_prev);
+			ifs_insque(ifm, so->so_batchq->ifs_prev);
 			goto diddit;
 		}
+	} else {
+		for (ifq = slirp->if_batchq.ifq_prev; ifq != &slirp->if_batchq;
+		     ifq = ifq->ifq_prev) {
+			if (ifq->ifq_so == NULL) {
+				/* A match! */
+				ifm->ifq_so = NULL;
+				ifs_insque(ifm, ifq->ifs_prev);
+				goto diddit;
+			}
+		}
 	}
 
 	/* No match, check which queue to put it on */
 	if (so && (so->so_iptos & IPTOS_LOWDELAY)) {
 		ifq = slirp->if_fastq.ifq_prev;
 		on_fastq = 1;
+		on_batchq = false;
 		/*
 		 * Check if this packet is a part of the last
 		 * packet's session
@@ -108,6 +118,9 @@ if_output(struct socket *so, struct mbuf *ifm)
 	ifm->ifq_so = so;
 	ifs_init(ifm);
 	insque(ifm, ifq);
+	if (so && on_batchq) {
+		so->so_batchq = ifm;
+	}
 
 diddit:
 	if (so) {
@@ -129,14 +142,18 @@ diddit:
 
 			/* ...And insert in the new.  That'll teach ya! */
 			insque(ifm->ifs_next, &slirp->if_batchq);
+			so->so_batchq = ifm->ifs_next;
 		}
 	}
 
 #ifndef FULL_BOLT
 	/*
-	 * This prevents us from malloc()ing too many mbufs
+	 * This prevents us from malloc()ing too many mbufs; inside a batch
+	 * (see slirp_input), up to IF_BATCH packets go out in one if_start().
 	 */
-	if_start(ifm->slirp);
+	if (!slirp->if_defer || ++slirp->if_deferred >= IF_BATCH) {
+		if_start(ifm->slirp);
+	}
 #endif
 }
 
@@ -155,7 +172,7 @@ diddit:
 void if_start(Slirp *slirp)
 {
     uint64_t now = qemu_get_clock_ns(rt_clock);
-    bool from_batchq, next_from_batchq;
+    bool from_batchq, next_from_batchq, batch;
     struct mbuf *ifm, *ifm_next, *ifqt;
 
     DEBUG_CALL("if_start");
@@ -164,6 +181,7 @@ void if_start(Slirp *slirp)
         return;
     }
     slirp->if_start_busy = true;
+    slirp->if_deferred = 0;
 
     if (slirp->if_fastq.ifq_next != &slirp->if_fastq) {
         ifm_next = slirp->if_fastq.ifq_next;
@@ -176,6 +194,10 @@ void if_start(Slirp *slirp)
         ifm_next = NULL;
     }
 
+    batch = ifm_next != NULL;
+    if (batch) {
+        slirp_output_batch(slirp->opaque, true);
+    }
     while (ifm_next) {
         ifm = ifm_next;
         from_batchq = next_from_batchq;
@@ -212,6 +234,9 @@ void if_start(Slirp *slirp)
 
             insque(next, ifqt);
             ifs_remque(ifm);
+            if (from_batchq && ifm->ifq_so) {
+                ifm->ifq_so->so_batchq = next;
+            }
 
             if (!from_batchq) {
                 /* Next packet in fastq is from the same session */
@@ -222,6 +247,8 @@ void if_start(Slirp *slirp)
                  * only one on batchq */
                 slirp->next_m = ifm_next = next;
             }
+        } else if (from_batchq && ifm->ifq_so) {
+            ifm->ifq_so->so_batchq = NULL;
         }
 
         /* Update so_queued */
@@ -232,6 +259,9 @@ void if_start(Slirp *slirp)
 
         m_free(ifm);
     }
+    if (batch) {
+        slirp_output_batch(slirp->opaque, false);
+    }
 
     slirp->if_start_busy = false;
 }
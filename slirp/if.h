@@ -13,6 +13,9 @@
 #define IF_AUTOCOMP	0x04	/* Autodetect (default) */
 #define IF_NOCIDCOMP	0x08	/* CID compression */
 
+/* Packets if_output queues before sending, while the caller batches */
+#define IF_BATCH 64
+
 #define IF_MTU 1500
 #define IF_MRU 1500
 #define	IF_COMP IF_AUTOCOMP	/* Flags for compression */
@@ -25,6 +25,8 @@ void slirp_input(Slirp *slirp, const uint8_t *pkt, int pkt_len);
 
 /* you must provide the following functions: */
 void slirp_output(void *opaque, const uint8_t *pkt, int pkt_len);
+/* brackets the slirp_output() calls of one pass over the send queues */
+void slirp_output_batch(void *opaque, bool start);
 
 int slirp_add_hostfwd(Slirp *slirp, int is_udp,
                       struct in_addr host_addr, int host_port,
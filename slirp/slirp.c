@@ -26,6 +26,9 @@
 #include "char/char.h"
 #include "slirp.h"
 #include "hw/hw.h"
+#ifdef CONFIG_EPOLL
+#include <sys/epoll.h>
+#endif
 
 /* host loopback address */
 struct in_addr loopback_addr;
@@ -233,6 +236,15 @@ Slirp *slirp_init(int restricted, struct in_addr vnetwork,
 
     slirp->opaque = opaque;
 
+#ifdef CONFIG_EPOLL
+    slirp->epoll_fd = epoll_create(64);
+    if (slirp->epoll_fd != -1) {
+        qemu_set_cloexec(slirp->epoll_fd);
+    }
+#else
+    slirp->epoll_fd = -1;
+#endif
+
     register_savevm(NULL, "slirp", 0, 3,
                     slirp_state_save, slirp_state_load, slirp);
 
@@ -250,6 +262,10 @@ void slirp_cleanup(Slirp *slirp)
     ip_cleanup(slirp);
     m_cleanup(slirp);
 
+    if (slirp->epoll_fd != -1) {
+        close(slirp->epoll_fd);
+    }
+
     g_free(slirp->vdnssearch);
     g_free(slirp->tftp_prefix);
     g_free(slirp->bootp_filename);
@@ -259,6 +275,122 @@ void slirp_cleanup(Slirp *slirp)
 #define CONN_CANFSEND(so) (((so)->so_state & (SS_FCANTSENDMORE|SS_ISFCONNECTED)) == SS_ISFCONNECTED)
 #define CONN_CANFRCV(so) (((so)->so_state & (SS_FCANTRCVMORE|SS_ISFCONNECTED)) == SS_ISFCONNECTED)
 
+/*
+ * Where epoll is available, each Slirp instance keeps its sockets in an
+ * epoll set that is only updated when what a socket waits for changes,
+ * and only the epoll descriptor goes into the main loop's poll array.
+ * Otherwise, or if a socket cannot be added, it is polled directly.
+ */
+#ifdef CONFIG_EPOLL
+static int slirp_to_epoll(int events)
+{
+    return (events & G_IO_IN ? EPOLLIN : 0) |
+           (events & G_IO_PRI ? EPOLLPRI : 0) |
+           (events & G_IO_OUT ? EPOLLOUT : 0) |
+           (events & G_IO_ERR ? EPOLLERR : 0) |
+           (events & G_IO_HUP ? EPOLLHUP : 0);
+}
+
+static int slirp_from_epoll(int events)
+{
+    return (events & EPOLLIN ? G_IO_IN : 0) |
+           (events & EPOLLPRI ? G_IO_PRI : 0) |
+           (events & EPOLLOUT ? G_IO_OUT : 0) |
+           (events & EPOLLERR ? G_IO_ERR : 0) |
+           (events & EPOLLHUP ? G_IO_HUP : 0);
+}
+
+static bool slirp_epoll_update(Slirp *slirp, struct socket *so, int events)
+{
+    struct epoll_event ev;
+    int op;
+
+    if (so->so_epoll_fd != -1 && (so->so_epoll_fd != so->s || !events)) {
+        slirp_poll_remove(so);
+    }
+    if (!events) {
+        return true;
+    }
+    if (so->so_epoll_fd == so->s && so->so_epoll_events == events) {
+        return true;
+    }
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = slirp_to_epoll(events);
+    ev.data.ptr = so;
+    op = so->so_epoll_fd == -1 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+    if (epoll_ctl(slirp->epoll_fd, op, so->s, &ev) < 0) {
+        slirp_poll_remove(so);
+        return false;
+    }
+    so->so_epoll_fd = so->s;
+    so->so_epoll_events = events;
+    return true;
+}
+
+static void slirp_epoll_wait(Slirp *slirp)
+{
+    struct epoll_event evs[64];
+    int i, n;
+
+    do {
+        n = epoll_wait(slirp->epoll_fd, evs, ARRAY_SIZE(evs), 0);
+        for (i = 0; i < n; i++) {
+            struct socket *so = evs[i].data.ptr;
+
+            so->so_revents = slirp_from_epoll(evs[i].events);
+        }
+    } while (n == ARRAY_SIZE(evs));
+}
+#endif
+
+void slirp_poll_remove(struct socket *so)
+{
+#ifdef CONFIG_EPOLL
+    struct epoll_event ev;
+
+    if (so->so_epoll_fd == -1) {
+        return;
+    }
+    /* A descriptor other than so->s was closed already, which dropped it */
+    if (so->so_epoll_fd == so->s) {
+        memset(&ev, 0, sizeof(ev));
+        epoll_ctl(so->slirp->epoll_fd, EPOLL_CTL_DEL, so->s, &ev);
+    }
+    so->so_epoll_fd = -1;
+    so->so_epoll_events = 0;
+#endif
+}
+
+/* Wait for @events on the socket in this iteration; 0 stops waiting */
+static void slirp_poll_add(Slirp *slirp, GArray *pollfds, struct socket *so,
+                           int events)
+{
+    GPollFD pfd = {
+        .fd = so->s,
+        .events = events,
+    };
+
+#ifdef CONFIG_EPOLL
+    if (slirp->epoll_fd != -1 && slirp_epoll_update(slirp, so, events)) {
+        return;
+    }
+#endif
+    if (events) {
+        so->pollfds_idx = pollfds->len;
+        g_array_append_val(pollfds, pfd);
+    }
+}
+
+static int slirp_poll_revents(GArray *pollfds, struct socket *so)
+{
+    if (so->pollfds_idx != -1) {
+        return g_array_index(pollfds, GPollFD, so->pollfds_idx).revents;
+    }
+    return so->so_revents;
+}
+
+
 void slirp_update_timeout(uint32_t *timeout)
 {
     if (!QTAILQ_EMPTY(&slirp_instances)) {
@@ -288,6 +420,16 @@ void slirp_pollfds_fill(GArray *pollfds)
         do_slowtimo |= ((slirp->tcb.so_next != &slirp->tcb) ||
                 (&slirp->ipq.ip_link != slirp->ipq.ip_link.next));
 
+        slirp->epoll_pollfds_idx = -1;
+        if (slirp->epoll_fd != -1) {
+            GPollFD pfd = {
+                .fd = slirp->epoll_fd,
+                .events = G_IO_IN,
+            };
+            slirp->epoll_pollfds_idx = pollfds->len;
+            g_array_append_val(pollfds, pfd);
+        }
+
         for (so = slirp->tcb.so_next; so != &slirp->tcb;
                 so = so_next) {
             int events = 0;
@@ -295,6 +437,7 @@ void slirp_pollfds_fill(GArray *pollfds)
             so_next = so->so_next;
 
             so->pollfds_idx = -1;
+            so->so_revents = 0;
 
             /*
              * See if we need a tcp_fasttimo
@@ -308,6 +451,7 @@ void slirp_pollfds_fill(GArray *pollfds)
              * newly socreated() sockets etc. Don't want to select these.
              */
             if (so->so_state & SS_NOFDREF || so->s == -1) {
+                slirp_poll_add(slirp, pollfds, so, 0);
                 continue;
             }
 
@@ -315,12 +459,8 @@ void slirp_pollfds_fill(GArray *pollfds)
              * Set for reading sockets which are accepting
              */
             if (so->so_state & SS_FACCEPTCONN) {
-                GPollFD pfd = {
-                    .fd = so->s,
-                    .events = G_IO_IN | G_IO_HUP | G_IO_ERR,
-                };
-                so->pollfds_idx = pollfds->len;
-                g_array_append_val(pollfds, pfd);
+                slirp_poll_add(slirp, pollfds, so,
+                               G_IO_IN | G_IO_HUP | G_IO_ERR);
                 continue;
             }
 
@@ -328,12 +468,7 @@ void slirp_pollfds_fill(GArray *pollfds)
              * Set for writing sockets which are connecting
              */
             if (so->so_state & SS_ISFCONNECTING) {
-                GPollFD pfd = {
-                    .fd = so->s,
-                    .events = G_IO_OUT | G_IO_ERR,
-                };
-                so->pollfds_idx = pollfds->len;
-                g_array_append_val(pollfds, pfd);
+                slirp_poll_add(slirp, pollfds, so, G_IO_OUT | G_IO_ERR);
                 continue;
             }
 
@@ -354,14 +489,7 @@ void slirp_pollfds_fill(GArray *pollfds)
                 events |= G_IO_IN | G_IO_HUP | G_IO_ERR | G_IO_PRI;
             }
 
-            if (events) {
-                GPollFD pfd = {
-                    .fd = so->s,
-                    .events = events,
-                };
-                so->pollfds_idx = pollfds->len;
-                g_array_append_val(pollfds, pfd);
-            }
+            slirp_poll_add(slirp, pollfds, so, events);
         }
 
         /*
@@ -372,6 +500,7 @@ void slirp_pollfds_fill(GArray *pollfds)
             so_next = so->so_next;
 
             so->pollfds_idx = -1;
+            so->so_revents = 0;
 
             /*
              * See if it's timed out
@@ -396,12 +525,10 @@ void slirp_pollfds_fill(GArray *pollfds)
              * (XXX <= 4 ?)
              */
             if ((so->so_state & SS_ISFCONNECTED) && so->so_queued <= 4) {
-                GPollFD pfd = {
-                    .fd = so->s,
-                    .events = G_IO_IN | G_IO_HUP | G_IO_ERR,
-                };
-                so->pollfds_idx = pollfds->len;
-                g_array_append_val(pollfds, pfd);
+                slirp_poll_add(slirp, pollfds, so,
+                               G_IO_IN | G_IO_HUP | G_IO_ERR);
+            } else {
+                slirp_poll_add(slirp, pollfds, so, 0);
             }
         }
 
@@ -413,6 +540,7 @@ void slirp_pollfds_fill(GArray *pollfds)
             so_next = so->so_next;
 
             so->pollfds_idx = -1;
+            so->so_revents = 0;
 
             /*
              * See if it's timed out
@@ -427,12 +555,10 @@ void slirp_pollfds_fill(GArray *pollfds)
             }
 
             if (so->so_state & SS_ISFCONNECTED) {
-                GPollFD pfd = {
-                    .fd = so->s,
-                    .events = G_IO_IN | G_IO_HUP | G_IO_ERR,
-                };
-                so->pollfds_idx = pollfds->len;
-                g_array_append_val(pollfds, pfd);
+                slirp_poll_add(slirp, pollfds, so,
+                               G_IO_IN | G_IO_HUP | G_IO_ERR);
+            } else {
+                slirp_poll_add(slirp, pollfds, so, 0);
             }
         }
     }
@@ -451,6 +577,8 @@ void slirp_pollfds_poll(GArray *pollfds, int select_error)
     curtime = qemu_get_clock_ms(rt_clock);
 
     QTAILQ_FOREACH(slirp, &slirp_instances, entry) {
+        slirp->if_defer++;
+
         /*
          * See if anything has timed out
          */
@@ -467,6 +595,13 @@ void slirp_pollfds_poll(GArray *pollfds, int select_error)
         /*
          * Check sockets
          */
+#ifdef CONFIG_EPOLL
+        if (!select_error && slirp->epoll_pollfds_idx != -1 &&
+            (g_array_index(pollfds, GPollFD,
+                           slirp->epoll_pollfds_idx).revents & G_IO_IN)) {
+            slirp_epoll_wait(slirp);
+        }
+#endif
         if (!select_error) {
             /*
              * Check TCP sockets
@@ -477,11 +612,7 @@ void slirp_pollfds_poll(GArray *pollfds, int select_error)
 
                 so_next = so->so_next;
 
-                revents = 0;
-                if (so->pollfds_idx != -1) {
-                    revents = g_array_index(pollfds, GPollFD,
-                                            so->pollfds_idx).revents;
-                }
+                revents = slirp_poll_revents(pollfds, so);
 
                 if (so->so_state & SS_NOFDREF || so->s == -1) {
                     continue;
@@ -608,11 +739,7 @@ void slirp_pollfds_poll(GArray *pollfds, int select_error)
 
                 so_next = so->so_next;
 
-                revents = 0;
-                if (so->pollfds_idx != -1) {
-                    revents = g_array_index(pollfds, GPollFD,
-                            so->pollfds_idx).revents;
-                }
+                revents = slirp_poll_revents(pollfds, so);
 
                 if (so->s != -1 &&
                     (revents & (G_IO_IN | G_IO_HUP | G_IO_ERR))) {
@@ -629,11 +756,7 @@ void slirp_pollfds_poll(GArray *pollfds, int select_error)
 
                     so_next = so->so_next;
 
-                    revents = 0;
-                    if (so->pollfds_idx != -1) {
-                        revents = g_array_index(pollfds, GPollFD,
-                                                so->pollfds_idx).revents;
-                    }
+                    revents = slirp_poll_revents(pollfds, so);
 
                     if (so->s != -1 &&
                         (revents & (G_IO_IN | G_IO_HUP | G_IO_ERR))) {
@@ -642,6 +765,7 @@ void slirp_pollfds_poll(GArray *pollfds, int select_error)
             }
         }
 
+        slirp->if_defer--;
         if_start(slirp);
     }
 }
@@ -732,7 +856,12 @@ void slirp_input(Slirp *slirp, const uint8_t *pkt, int pkt_len)
         m->m_data += 2 + ETH_HLEN;
         m->m_len -= 2 + ETH_HLEN;
 
+        /* Replies generated while handling one packet go out together */
+        slirp->if_defer++;
         ip_input(m);
+        if (--slirp->if_defer == 0 && slirp->if_deferred) {
+            if_start(slirp);
+        }
         break;
     default:
         break;
@@ -818,7 +947,7 @@ int slirp_remove_hostfwd(Slirp *slirp, int is_udp, struct in_addr host_addr,
             getsockname(so->s, (struct sockaddr *)&addr, &addr_len) == 0 &&
             addr.sin_addr.s_addr == host_addr.s_addr &&
             addr.sin_port == port) {
-            close(so->s);
+            soclose(so);
             sofree(so);
             return 0;
         }
@@ -1114,6 +1243,7 @@ static int slirp_socket_load(QEMUFile *f, struct socket *so)
     so->so_emu = qemu_get_byte(f);
     so->so_type = qemu_get_byte(f);
     so->so_state = qemu_get_be32(f);
+    sohash_insert(&so->slirp->tcb_hash, so);
     if (slirp_sbuf_load(f, &so->so_rcv) < 0)
         return -ENOMEM;
     if (slirp_sbuf_load(f, &so->so_snd) < 0)
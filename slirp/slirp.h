@@ -226,6 +226,8 @@ struct Slirp {
     struct mbuf if_batchq;  /* queue for non-interactive data */
     struct mbuf *next_m;    /* pointer to next mbuf to output */
     bool if_start_busy;     /* avoid if_start recursion */
+    int if_defer;           /* if_output leaves if_start to the caller */
+    int if_deferred;        /* packets queued since the last if_start */
 
     /* ip states */
     struct ipq ipq;         /* ip reass. queue */
@@ -239,12 +241,14 @@ struct Slirp {
 
     /* tcp states */
     struct socket tcb;
+    struct sohash tcb_hash; /* by local and foreign address */
     struct socket *tcp_last_so;
     tcp_seq tcp_iss;        /* tcp initial send seq # */
     uint32_t tcp_now;       /* for RFC 1323 timestamps */
 
     /* udp states */
     struct socket udb;
+    struct sohash udb_hash; /* by local address */
     struct socket *udp_last_so;
 
     /* icmp states */
@@ -257,6 +261,10 @@ struct Slirp {
 
     ArpTable arp_table;
 
+    /* sockets being polled, see slirp_poll_add() */
+    int epoll_fd;
+    int epoll_pollfds_idx;
+
     void *opaque;
 };
 
@@ -295,6 +303,9 @@ void lprint(const char *, ...) GCC_FMT_ATTR(1, 2);
 #define SO_OPTIONS DO_KEEPALIVE
 #define TCP_MAXIDLE (TCPTV_KEEPCNT * TCPTV_KEEPINTVL)
 
+/* slirp.c */
+void slirp_poll_remove(struct socket *so);
+
 /* dnssearch.c */
 int translate_dnssearch(Slirp *s, const char ** names);
 
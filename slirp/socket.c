@@ -15,24 +15,79 @@
 static void sofcantrcvmore(struct socket *so);
 static void sofcantsendmore(struct socket *so);
 
+static unsigned int
+sohash_index(struct sohash *sh, struct in_addr laddr, u_int lport,
+             struct in_addr faddr, u_int fport)
+{
+	uint32_t h = laddr.s_addr ^ (lport << 16);
+
+	if (sh->sh_foreign) {
+		h = h * 0x9e3779b1 ^ faddr.s_addr ^ fport;
+	}
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	return h & (SO_HASH_SIZE - 1);
+}
+
+void
+sohash_init(struct sohash *sh, int foreign)
+{
+	memset(sh->sh_buckets, 0, sizeof(sh->sh_buckets));
+	sh->sh_foreign = foreign;
+}
+
+/*
+ * (Re)hash a socket after its addresses changed.
+ * Like the lists, a bucket returns the most recently hashed socket first.
+ */
+void
+sohash_insert(struct sohash *sh, struct socket *so)
+{
+	sohash_remove(so);
+	so->so_hash_idx = sohash_index(sh, so->so_laddr, so->so_lport,
+	                               so->so_faddr, so->so_fport);
+	so->so_hash_next = sh->sh_buckets[so->so_hash_idx];
+	sh->sh_buckets[so->so_hash_idx] = so;
+	so->so_hash = sh;
+}
+
+void
+sohash_remove(struct socket *so)
+{
+	struct socket **p;
+
+	if (!so->so_hash) {
+		return;
+	}
+	for (p = &so->so_hash->sh_buckets[so->so_hash_idx]; *p;
+	     p = &(*p)->so_hash_next) {
+		if (*p == so) {
+			*p = so->so_hash_next;
+			break;
+		}
+	}
+	so->so_hash = NULL;
+	so->so_hash_next = NULL;
+}
+
 struct socket *
-solookup(struct socket *head, struct in_addr laddr, u_int lport,
+solookup(struct sohash *sh, struct in_addr laddr, u_int lport,
          struct in_addr faddr, u_int fport)
 {
 	struct socket *so;
 
-	for (so = head->so_next; so != head; so = so->so_next) {
+	so = sh->sh_buckets[sohash_index(sh, laddr, lport, faddr, fport)];
+	for (; so; so = so->so_hash_next) {
 		if (so->so_lport == lport &&
 		    so->so_laddr.s_addr == laddr.s_addr &&
-		    so->so_faddr.s_addr == faddr.s_addr &&
-		    so->so_fport == fport)
+		    (!sh->sh_foreign ||
+		     (so->so_faddr.s_addr == faddr.s_addr &&
+		      so->so_fport == fport)))
 		   break;
 	}
 
-	if (so == head)
-	   return (struct socket *)NULL;
 	return so;
-
 }
 
 /*
@@ -52,6 +107,7 @@ socreate(Slirp *slirp)
     so->s = -1;
     so->slirp = slirp;
     so->pollfds_idx = -1;
+    so->so_epoll_fd = -1;
   }
   return(so);
 }
@@ -59,6 +115,26 @@ socreate(Slirp *slirp)
 /*
  * remque and free a socket, clobber cache
  */
+/*
+ * Detach packets still waiting in an interface queue from their socket,
+ * they are sent as if the socket had none
+ */
+static void
+soqfree(struct socket *so, struct mbuf *ifq_head)
+{
+  struct mbuf *ifq, *ifm;
+
+  for (ifq = ifq_head->ifq_next; ifq != ifq_head; ifq = ifq->ifq_next) {
+      if (ifq->ifq_so != so) {
+          continue;
+      }
+      ifq->ifq_so = NULL;
+      for (ifm = ifq->ifs_next; ifm != ifq; ifm = ifm->ifs_next) {
+          ifm->ifq_so = NULL;
+      }
+  }
+}
+
 void
 sofree(struct socket *so)
 {
@@ -77,12 +153,29 @@ sofree(struct socket *so)
   }
   m_free(so->so_m);
 
+  if (so->so_queued) {
+      soqfree(so, &slirp->if_fastq);
+      soqfree(so, &slirp->if_batchq);
+  }
+  sohash_remove(so);
+  slirp_poll_remove(so);
   if(so->so_next && so->so_prev)
     remque(so);  /* crashes if so is not in a queue */
 
   free(so);
 }
 
+/*
+ * Close the host socket; it is dropped from the poll set first so that a
+ * descriptor shared with a child process cannot keep reporting events
+ */
+void
+soclose(struct socket *so)
+{
+  slirp_poll_remove(so);
+  closesocket(so->s);
+}
+
 size_t sopreprbuf(struct socket *so, struct iovec *iov, int *np)
 {
 	int n, lss, total;
@@ -650,6 +743,7 @@ tcp_listen(Slirp *slirp, uint32_t haddr, u_int hport, uint32_t laddr,
 	   so->so_faddr = slirp->vhost_addr;
 	else
 	   so->so_faddr = addr.sin_addr;
+	sohash_insert(&slirp->tcb_hash, so);
 
 	so->s = s;
 	return so;
@@ -11,6 +11,16 @@
 #define SO_EXPIRE 240000
 #define SO_EXPIREFAST 10000
 
+#define SO_HASH_SIZE 4096	/* Buckets per socket hash, power of 2 */
+
+/*
+ * Sockets of a list (tcb, udb) hashed by the addresses they match
+ */
+struct sohash {
+  struct socket *sh_buckets[SO_HASH_SIZE];
+  int sh_foreign;		/* Key includes so_faddr and so_fport */
+};
+
 /*
  * Our socket structure
  */
@@ -21,6 +31,13 @@ struct socket {
   int s;                           /* The actual socket */
 
   int pollfds_idx;                 /* GPollFD GArray index */
+  int so_epoll_fd;                 /* Descriptor in slirp->epoll_fd, or -1 */
+  int so_epoll_events;             /* Events it is registered for */
+  int so_revents;                  /* Events returned by epoll_wait */
+
+  struct sohash *so_hash;	   /* Hash the socket is in, or NULL */
+  struct socket *so_hash_next;	   /* Next socket in the same bucket */
+  unsigned int so_hash_idx;	   /* Bucket index */
 
   Slirp *slirp;			   /* managing slirp instance */
 
@@ -49,6 +66,7 @@ struct socket {
   int	so_nqueued;		/* Number of packets queued in a row
 				 * Used to determine when to "downgrade" a session
 					 * from fastq to batchq */
+  struct mbuf *so_batchq;	/* First packet of our session on if_batchq */
 
   struct sbuf so_rcv;		/* Receive buffer */
   struct sbuf so_snd;		/* Send buffer */
@@ -76,9 +94,13 @@ struct socket {
 #define SS_HOSTFWD		0x1000	/* Socket describes host->guest forwarding */
 #define SS_INCOMING		0x2000	/* Connection was initiated by a host on the internet */
 
-struct socket * solookup(struct socket *, struct in_addr, u_int, struct in_addr, u_int);
+void sohash_init(struct sohash *, int);
+void sohash_insert(struct sohash *, struct socket *);
+void sohash_remove(struct socket *);
+struct socket * solookup(struct sohash *, struct in_addr, u_int, struct in_addr, u_int);
 struct socket * socreate(Slirp *);
 void sofree(struct socket *);
+void soclose(struct socket *);
 int soread(struct socket *);
 void sorecvoob(struct socket *);
 int sosendoob(struct socket *);
@@ -52,6 +52,7 @@ tcp_init(Slirp *slirp)
 {
     slirp->tcp_iss = 1;		/* wrong */
     slirp->tcb.so_next = slirp->tcb.so_prev = &slirp->tcb;
+    sohash_init(&slirp->tcb_hash, 1);
     slirp->tcp_last_so = &slirp->tcb;
 }
 
@@ -264,7 +265,7 @@ tcp_close(struct tcpcb *tp)
 	/* clobber input socket cache if we're closing the cached connection */
 	if (so == slirp->tcp_last_so)
 		slirp->tcp_last_so = &slirp->tcb;
-	closesocket(so->s);
+	soclose(so);
 	sbfree(&so->so_rcv);
 	sbfree(&so->so_snd);
 	sofree(so);
@@ -440,10 +441,11 @@ tcp_connect(struct socket *inso)
             (loopback_addr.s_addr & loopback_mask)) {
             so->so_faddr = slirp->vhost_addr;
         }
+	sohash_insert(&slirp->tcb_hash, so);
 
 	/* Close the accept() socket, set right state */
 	if (inso->so_state & SS_FACCEPTONCE) {
-		closesocket(so->s); /* If we only accept once, close the accept() socket */
+		soclose(so); /* If we only accept once, close the accept() socket */
 		so->so_state = SS_NOFDREF; /* Don't select it yet, even though we have an FD */
 					   /* if it's not FACCEPTONCE, it's already NOFDREF */
 	}
@@ -47,6 +47,7 @@ void
 udp_init(Slirp *slirp)
 {
     slirp->udb.so_next = slirp->udb.so_prev = &slirp->udb;
+    sohash_init(&slirp->udb_hash, 0);
     slirp->udp_last_so = &slirp->udb;
 }
 
@@ -154,19 +155,9 @@ udp_input(register struct mbuf *m, int iphlen)
 	so = slirp->udp_last_so;
 	if (so->so_lport != uh->uh_sport ||
 	    so->so_laddr.s_addr != ip->ip_src.s_addr) {
-		struct socket *tmp;
-
-		for (tmp = slirp->udb.so_next; tmp != &slirp->udb;
-		     tmp = tmp->so_next) {
-			if (tmp->so_lport == uh->uh_sport &&
-			    tmp->so_laddr.s_addr == ip->ip_src.s_addr) {
-				so = tmp;
-				break;
-			}
-		}
-		if (tmp == &slirp->udb) {
-		  so = NULL;
-		} else {
+		so = solookup(&slirp->udb_hash, ip->ip_src, uh->uh_sport,
+			      ip->ip_dst, uh->uh_dport);
+		if (so) {
 		  slirp->udp_last_so = so;
 		}
 	}
@@ -192,6 +183,7 @@ udp_input(register struct mbuf *m, int iphlen)
 	   */
 	  so->so_laddr = ip->ip_src;
 	  so->so_lport = uh->uh_sport;
+	  sohash_insert(&slirp->udb_hash, so);
 
 	  if ((so->so_iptos = udp_tos(so)) == 0)
 	    so->so_iptos = ip->ip_tos;
@@ -322,7 +314,7 @@ udp_attach(struct socket *so)
 void
 udp_detach(struct socket *so)
 {
-	closesocket(so->s);
+	soclose(so);
 	sofree(so);
 }
 
@@ -384,6 +376,7 @@ udp_listen(Slirp *slirp, uint32_t haddr, u_int hport, uint32_t laddr,
 	}
 	so->so_lport = lport;
 	so->so_laddr.s_addr = laddr;
+	sohash_insert(&slirp->udb_hash, so);
 	if (flags != SS_FACCEPTONCE)
 	   so->so_expire = 0;
 
@@ -8,3 +8,8 @@ void qemu_mutex_lock_iothread(void)
 void qemu_mutex_unlock_iothread(void)
 {
 }
+
+bool qemu_mutex_iothread_locked(void)
+{
+    return true;
+}
@@ -33,6 +33,9 @@
 
 #define TARGET_HAS_ICE 1
 
+/* gen_opc_condexec_bits[] goes in the restore table */
+#define TARGET_INSN_EXTRA_WORDS 1
+
 #define EXCP_UDEF            1   /* undefined instruction */
 #define EXCP_SWI             2   /* software interrupt */
 #define EXCP_PREFETCH_ABORT  3
@@ -12,6 +12,16 @@ static inline int get_phys_addr(CPUARMState *env, uint32_t address,
                                 target_ulong *page_size);
 #endif
 
+/* Return true if extended addresses are enabled, ie this is an
+ * LPAE implementation and we are using the long-descriptor translation
+ * table format because the TTBCR EAE bit is set.
+ */
+static inline bool extended_addresses_enabled(CPUARMState *env)
+{
+    return arm_feature(env, ARM_FEATURE_LPAE)
+        && (env->cp15.c2_control & (1 << 31));
+}
+
 static int vfp_gdb_get_reg(CPUARMState *env, uint8_t *buf, int reg)
 {
     int nregs;
@@ -115,7 +125,16 @@ static int tlbimva_write(CPUARMState *env, const ARMCPRegInfo *ri,
 static int tlbiasid_write(CPUARMState *env, const ARMCPRegInfo *ri,
                           uint64_t value)
 {
-    /* Invalidate by ASID (TLBIASID) */
+    /* Invalidate by ASID (TLBIASID).  Changing the ASID flushes the
+     * TLB, so with the short-descriptor format it only holds entries
+     * for the current ASID and global ones, which TLBIASID leaves alone.
+     * Nothing needs to go unless the current ASID is named.
+     */
+    if (!extended_addresses_enabled(env) &&
+        (value & 0xff) != (env->cp15.c13_context & 0xff)) {
+        tlb_flush_by_mmuidx(env, 0);
+        return 0;
+    }
     tlb_flush(env, value == 0);
     return 0;
 }
@@ -505,16 +524,6 @@ static int par_write(CPUARMState *env, const ARMCPRegInfo *ri, uint64_t value)
 #ifndef CONFIG_USER_ONLY
 /* get_phys_addr() isn't present for user-mode-only targets */
 
-/* Return true if extended addresses are enabled, ie this is an
- * LPAE implementation and we are using the long-descriptor translation
- * table format because the TTBCR EAE bit is set.
- */
-static inline bool extended_addresses_enabled(CPUARMState *env)
-{
-    return arm_feature(env, ARM_FEATURE_LPAE)
-        && (env->cp15.c2_control & (1 << 31));
-}
-
 static int ats_write(CPUARMState *env, const ARMCPRegInfo *ri, uint64_t value)
 {
     hwaddr phys_addr;
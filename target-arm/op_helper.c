@@ -223,6 +223,11 @@ void HELPER(wfi)(CPUARMState *env)
     cpu_loop_exit(env);
 }
 
+void *HELPER(lookup_tb_ptr)(CPUARMState *env)
+{
+    return tb_lookup_ptr(env);
+}
+
 void HELPER(exception)(CPUARMState *env, uint32_t excp)
 {
     env->exception_index = excp;
@@ -807,7 +807,9 @@ static inline void gen_bx_im(DisasContext *s, uint32_t addr)
 /* Set PC and Thumb state from var.  var is marked as dead.  */
 static inline void gen_bx(DisasContext *s, TCGv var)
 {
-    s->is_jmp = DISAS_UPDATE;
+    /* the Thumb bit is part of the TB flags, so the next TB can be
+       looked up with the new state without leaving the generated code */
+    s->is_jmp = DISAS_JUMP;
     tcg_gen_andi_i32(cpu_R[15], var, ~1);
     tcg_gen_andi_i32(var, var, 1);
     store_cpu_field(var, thumb);
@@ -4476,6 +4478,43 @@ static const uint8_t neon_2rm_sizes[] = {
     [NEON_2RM_VCVT_UF] = 0x4,
 };
 
+/* Translate the Q forms of VAND, VBIC, VORR, VEOR, VADD and VSUB as one
+   vec128 op.  Returns false if the insn needs the per-element code.  */
+static bool gen_neon_3reg_vec128(int op, int u, int size,
+                                 int rd, int rn, int rm)
+{
+    TCGVecOp vop;
+
+    switch (op) {
+    case NEON_3R_LOGIC:
+        switch ((u << 2) | size) {
+        case 0: /* VAND */
+            vop = TCG_VEC_AND;
+            break;
+        case 1: /* VBIC */
+            vop = TCG_VEC_ANDC;
+            break;
+        case 2: /* VORR */
+            vop = TCG_VEC_OR;
+            break;
+        case 4: /* VEOR */
+            vop = TCG_VEC_XOR;
+            break;
+        default:
+            return false;
+        }
+        break;
+    case NEON_3R_VADD_VSUB:
+        vop = (u ? TCG_VEC_SUB8 : TCG_VEC_ADD8) + size;
+        break;
+    default:
+        return false;
+    }
+    tcg_gen_vec128(vop, cpu_env, vfp_reg_offset(1, rd),
+                   vfp_reg_offset(1, rn), vfp_reg_offset(1, rm));
+    return true;
+}
+
 /* Translate a NEON data processing instruction.  Return nonzero if the
    instruction is invalid.
    We process data in a mixture of 32-bit and 64-bit chunks.
@@ -4517,6 +4556,9 @@ static int disas_neon_data_insn(CPUARMState * env, DisasContext *s, uint32_t ins
         if (q && ((rd | rn | rm) & 1)) {
             return 1;
         }
+        if (q && gen_neon_3reg_vec128(op, u, size, rd, rn, rm)) {
+            return 0;
+        }
         if (size == 3 && op != NEON_3R_LOGIC) {
             /* 64-bit element instructions. */
             for (pass = 0; pass < (q ? 2 : 1); pass++) {
@@ -9986,8 +10028,18 @@ static inline void gen_intermediate_code_internal(CPUARMState *env,
         case DISAS_NEXT:
             gen_goto_tb(dc, 1, dc->pc);
             break;
-        default:
         case DISAS_JUMP:
+            /* only the pc changed, look up the next TB right away */
+            if (TCG_TARGET_HAS_goto_ptr) {
+                TCGv_ptr ptr = tcg_temp_new_ptr();
+
+                gen_helper_lookup_tb_ptr(ptr, cpu_env);
+                tcg_gen_goto_ptr(ptr);
+                tcg_temp_free_ptr(ptr);
+                break;
+            }
+            /* fall through */
+        default:
         case DISAS_UPDATE:
             /* indicate that the hash table must be used to find the next TB */
             tcg_gen_exit_tb(0);
@@ -10028,10 +10080,9 @@ done_generating:
         lj++;
         while (lj <= j)
             tcg_ctx.gen_opc_instr_start[lj++] = 0;
-    } else {
-        tb->size = dc->pc - pc_start;
-        tb->icount = num_insns;
     }
+    tb->size = dc->pc - pc_start;
+    tb->icount = num_insns;
 }
 
 void gen_intermediate_code(CPUARMState *env, TranslationBlock *tb)
@@ -10091,6 +10142,16 @@ void cpu_dump_state(CPUARMState *env, FILE *f, fprintf_function cpu_fprintf,
     }
 }
 
+void gen_opc_get_extra(int pc_pos, target_ulong *extra)
+{
+    extra[0] = gen_opc_condexec_bits[pc_pos];
+}
+
+void gen_opc_set_extra(int pc_pos, const target_ulong *extra)
+{
+    gen_opc_condexec_bits[pc_pos] = extra[0];
+}
+
 void restore_state_to_opc(CPUARMState *env, TranslationBlock *tb, int pc_pos)
 {
     env->regs[15] = tcg_ctx.gen_opc_pc[pc_pos];
@@ -36,6 +36,9 @@
 
 #define TARGET_HAS_ICE 1
 
+/* gen_opc_cc_op[] goes in the restore table */
+#define TARGET_INSN_EXTRA_WORDS 1
+
 #ifdef TARGET_X86_64
 #define ELF_MACHINE	EM_X86_64
 #else
@@ -805,6 +808,8 @@ typedef struct CPUX86State {
     uint64_t wall_clock_msr;
     uint64_t async_pf_en_msr;
     uint64_t pv_eoi_en_msr;
+    /* PV EOI flag set in guest memory by the userspace APIC */
+    bool pv_eoi_pending;
 
     uint64_t tsc;
     uint64_t tsc_adjust;
@@ -1755,6 +1755,58 @@ int kvm_arch_get_registers(CPUState *cs)
     return 0;
 }
 
+static uint64_t kvm_get_pv_eoi_en(X86CPU *cpu)
+{
+    struct {
+        struct kvm_msrs info;
+        struct kvm_msr_entry entries[1];
+    } msr_data;
+
+    msr_data.info.nmsrs = 1;
+    msr_data.entries[0].index = MSR_KVM_PV_EOI_EN;
+    if (kvm_vcpu_ioctl(CPU(cpu), KVM_GET_MSRS, &msr_data) != 1) {
+        return 0;
+    }
+    return msr_data.entries[0].data;
+}
+
+/*
+ * Without the in-kernel irqchip KVM still keeps the PV EOI MSR, but the
+ * flag in guest memory has to be handled here.  It is armed right after an
+ * interrupt is injected, so that the guest can skip the EOI exit, and
+ * checked in kvm_arch_post_run.
+ */
+static void kvm_pv_eoi_arm(X86CPU *cpu)
+{
+    CPUX86State *env = &cpu->env;
+    uint64_t msr;
+
+    if (!has_msr_pv_eoi_en || !apic_pv_eoi_possible(env->apic_state)) {
+        return;
+    }
+    msr = kvm_get_pv_eoi_en(cpu);
+    env->pv_eoi_en_msr = msr;
+    if (!(msr & KVM_MSR_ENABLED)) {
+        return;
+    }
+    stb_phys(msr & ~(uint64_t)KVM_MSR_ENABLED, KVM_PV_EOI_ENABLED);
+    env->pv_eoi_pending = true;
+}
+
+static void kvm_pv_eoi_sync(X86CPU *cpu)
+{
+    CPUX86State *env = &cpu->env;
+    hwaddr addr = env->pv_eoi_en_msr & ~(uint64_t)KVM_MSR_ENABLED;
+
+    env->pv_eoi_pending = false;
+    if (ldub_phys(addr) & KVM_PV_EOI_ENABLED) {
+        /* not acknowledged yet, the guest will write the EOI register */
+        stb_phys(addr, KVM_PV_EOI_DISABLED);
+    } else {
+        apic_pv_eoi(env->apic_state);
+    }
+}
+
 void kvm_arch_pre_run(CPUState *cpu, struct kvm_run *run)
 {
     X86CPU *x86_cpu = X86_CPU(cpu);
@@ -1799,6 +1851,9 @@ void kvm_arch_pre_run(CPUState *cpu, struct kvm_run *run)
                             "KVM: injection failed, interrupt lost (%s)\n",
                             strerror(-ret));
                 }
+                if (ret == 0) {
+                    kvm_pv_eoi_arm(x86_cpu);
+                }
             }
         }
 
@@ -1827,6 +1882,9 @@ void kvm_arch_post_run(CPUState *cpu, struct kvm_run *run)
     } else {
         env->eflags &= ~IF_MASK;
     }
+    if (env->pv_eoi_pending) {
+        kvm_pv_eoi_sync(x86_cpu);
+    }
     cpu_set_apic_tpr(env->apic_state, run->cr8);
     cpu_set_apic_base(env->apic_state, run->apic_base);
 }
@@ -116,6 +116,11 @@ void helper_single_step(CPUX86State *env)
     raise_exception(env, EXCP01_DB);
 }
 
+void *helper_lookup_tb_ptr(CPUX86State *env)
+{
+    return tb_lookup_ptr(env);
+}
+
 void helper_cpuid(CPUX86State *env)
 {
     uint32_t eax, ebx, ecx, edx;
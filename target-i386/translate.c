@@ -121,8 +121,12 @@ typedef struct DisasContext {
     int cpuid_ext2_features;
     int cpuid_ext3_features;
     int cpuid_7_0_ebx_features;
+    int sb_jumps; /* direct jumps followed in this superblock */
 } DisasContext;
 
+/* Limit superblocks to a few blocks, they also stop at the page end */
+#define MAX_SUPERBLOCK_JUMPS 4
+
 static void gen_eob(DisasContext *s);
 static void gen_jmp(DisasContext *s, target_ulong eip);
 static void gen_jmp_tb(DisasContext *s, target_ulong eip, int tb_num);
@@ -2803,7 +2807,9 @@ static void gen_debug(DisasContext *s, target_ulong cur_eip)
 
 /* generate a generic end of block. Trace exception is also generated
    if needed */
-static void gen_eob(DisasContext *s)
+/* End the TB.  With @jr the next TB is looked up from the generated code,
+   if there is nothing that cpu_exec() needs to do in between.  */
+static void gen_eob_worker(DisasContext *s, bool jr)
 {
     gen_update_cc_op(s);
     if (s->tb->flags & HF_INHIBIT_IRQ_MASK) {
@@ -2816,12 +2822,29 @@ static void gen_eob(DisasContext *s)
         gen_helper_debug(cpu_env);
     } else if (s->tf) {
         gen_helper_single_step(cpu_env);
+    } else if (jr && s->jmp_opt && TCG_TARGET_HAS_goto_ptr) {
+        TCGv_ptr ptr = tcg_temp_new_ptr();
+
+        gen_helper_lookup_tb_ptr(ptr, cpu_env);
+        tcg_gen_goto_ptr(ptr);
+        tcg_temp_free_ptr(ptr);
     } else {
         tcg_gen_exit_tb(0);
     }
     s->is_jmp = DISAS_TB_JUMP;
 }
 
+static void gen_eob(DisasContext *s)
+{
+    gen_eob_worker(s, false);
+}
+
+/* End the TB after an indirect jump; only eip was changed */
+static void gen_jr(DisasContext *s)
+{
+    gen_eob_worker(s, true);
+}
+
 /* generate a jump to eip. No segment change must happen before as a
    direct call to the next block may occur */
 static void gen_jmp_tb(DisasContext *s, target_ulong eip, int tb_num)
@@ -2842,6 +2865,25 @@ static void gen_jmp(DisasContext *s, target_ulong eip)
     gen_jmp_tb(s, eip, 0);
 }
 
+/* In a superblock, go on translating at the target of a direct jump
+   instead of ending the TB, so that the ops on both sides are optimized
+   together.  Only forward targets in the first page are followed: the TB
+   then still covers [tb->pc, tb->pc + tb->size) for the code
+   modification checks.  Returns false if a normal jump is needed.  */
+static bool gen_follow_jmp(DisasContext *s, target_ulong eip)
+{
+    target_ulong pc = s->cs_base + eip;
+
+    if (!(s->tb->cflags & CF_SUPERBLOCK) || !s->jmp_opt ||
+        s->sb_jumps >= MAX_SUPERBLOCK_JUMPS || pc <= s->pc ||
+        (pc & TARGET_PAGE_MASK) != (s->tb->pc & TARGET_PAGE_MASK)) {
+        return false;
+    }
+    s->sb_jumps++;
+    s->pc = pc;
+    return true;
+}
+
 static inline void gen_ldq_env_A0(int idx, int offset)
 {
     int mem_index = (idx >> 2) - 1;
@@ -2878,10 +2920,7 @@ static inline void gen_sto_env_A0(int idx, int offset)
 
 static inline void gen_op_movo(int d_offset, int s_offset)
 {
-    tcg_gen_ld_i64(cpu_tmp1_i64, cpu_env, s_offset);
-    tcg_gen_st_i64(cpu_tmp1_i64, cpu_env, d_offset);
-    tcg_gen_ld_i64(cpu_tmp1_i64, cpu_env, s_offset + 8);
-    tcg_gen_st_i64(cpu_tmp1_i64, cpu_env, d_offset + 8);
+    tcg_gen_vec128(TCG_VEC_MOV, cpu_env, d_offset, s_offset, 0);
 }
 
 static inline void gen_op_movq(int d_offset, int s_offset)
@@ -3222,6 +3261,66 @@ static const struct SSEOpHelper_eppi sse_op_table7[256] = {
     [0x63] = SSE42_OP(pcmpistri),
 };
 
+/* Emit the whole-register SSE2 logical and integer add/sub operations
+   as one vec128 op instead of a helper call.  Returns false for anything
+   else.  b1 is the prefix index, as in sse_op_table1.  */
+static bool gen_sse_vec128(int b, int b1, int op1_offset, int op2_offset)
+{
+    TCGVecOp op;
+
+    if (b1 != 1 && !(b1 == 0 && b >= 0x54 && b <= 0x57)) {
+        return false;
+    }
+    switch (b) {
+    case 0x54: /* andps, andpd */
+    case 0xdb: /* pand */
+        op = TCG_VEC_AND;
+        break;
+    case 0x55: /* andnps, andnpd */
+    case 0xdf: /* pandn */
+        /* dest = ~dest & src */
+        tcg_gen_vec128(TCG_VEC_ANDC, cpu_env, op1_offset,
+                       op2_offset, op1_offset);
+        return true;
+    case 0x56: /* orps, orpd */
+    case 0xeb: /* por */
+        op = TCG_VEC_OR;
+        break;
+    case 0x57: /* xorps, xorpd */
+    case 0xef: /* pxor */
+        op = TCG_VEC_XOR;
+        break;
+    case 0xfc: /* paddb */
+        op = TCG_VEC_ADD8;
+        break;
+    case 0xfd: /* paddw */
+        op = TCG_VEC_ADD16;
+        break;
+    case 0xfe: /* paddd */
+        op = TCG_VEC_ADD32;
+        break;
+    case 0xd4: /* paddq */
+        op = TCG_VEC_ADD64;
+        break;
+    case 0xf8: /* psubb */
+        op = TCG_VEC_SUB8;
+        break;
+    case 0xf9: /* psubw */
+        op = TCG_VEC_SUB16;
+        break;
+    case 0xfa: /* psubd */
+        op = TCG_VEC_SUB32;
+        break;
+    case 0xfb: /* psubq */
+        op = TCG_VEC_SUB64;
+        break;
+    default:
+        return false;
+    }
+    tcg_gen_vec128(op, cpu_env, op1_offset, op1_offset, op2_offset);
+    return true;
+}
+
 static void gen_sse(CPUX86State *env, DisasContext *s, int b,
                     target_ulong pc_start, int rex_r)
 {
@@ -4598,6 +4697,14 @@ static void gen_sse(CPUX86State *env, DisasContext *s, int b,
         case 0x70: /* pshufx insn */
         case 0xc6: /* pshufx insn */
             val = cpu_ldub_code(env, s->pc++);
+#ifndef HOST_WORDS_BIGENDIAN
+            if (b == 0x70 && b1 == 1) {
+                /* pshufd; the lanes of XMMReg are in memory order */
+                tcg_gen_vec128(TCG_VEC_SHUF32, cpu_env, op1_offset,
+                               op2_offset, val);
+                break;
+            }
+#endif
             tcg_gen_addi_ptr(cpu_ptr0, cpu_env, op1_offset);
             tcg_gen_addi_ptr(cpu_ptr1, cpu_env, op2_offset);
             /* XXX: introduce a new table? */
@@ -4638,6 +4745,9 @@ static void gen_sse(CPUX86State *env, DisasContext *s, int b,
             sse_fn_eppt(cpu_env, cpu_ptr0, cpu_ptr1, cpu_A0);
             break;
         default:
+            if (is_xmm && gen_sse_vec128(b, b1, op1_offset, op2_offset)) {
+                break;
+            }
             tcg_gen_addi_ptr(cpu_ptr0, cpu_env, op1_offset);
             tcg_gen_addi_ptr(cpu_ptr1, cpu_env, op2_offset);
             sse_fn_epp(cpu_env, cpu_ptr0, cpu_ptr1);
@@ -5201,7 +5311,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
             gen_movtl_T1_im(next_eip);
             gen_push_T1(s);
             gen_op_jmp_T0();
-            gen_eob(s);
+            gen_jr(s);
             break;
         case 3: /* lcall Ev */
             gen_op_ld_T1_A0(ot + s->mem_index);
@@ -5227,7 +5337,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
             if (s->dflag == 0)
                 gen_op_andl_T0_ffff();
             gen_op_jmp_T0();
-            gen_eob(s);
+            gen_jr(s);
             break;
         case 5: /* ljmp Ev */
             gen_op_ld_T1_A0(ot + s->mem_index);
@@ -6728,7 +6838,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
         if (s->dflag == 0)
             gen_op_andl_T0_ffff();
         gen_op_jmp_T0();
-        gen_eob(s);
+        gen_jr(s);
         break;
     case 0xc3: /* ret */
         gen_pop_T0(s);
@@ -6736,7 +6846,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
         if (s->dflag == 0)
             gen_op_andl_T0_ffff();
         gen_op_jmp_T0();
-        gen_eob(s);
+        gen_jr(s);
         break;
     case 0xca: /* lret im */
         val = cpu_ldsw_code(env, s->pc);
@@ -6804,7 +6914,9 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
                 tval &= 0xffffffff;
             gen_movtl_T0_im(next_eip);
             gen_push_T0(s);
-            gen_jmp(s, tval);
+            if (!gen_follow_jmp(s, tval)) {
+                gen_jmp(s, tval);
+            }
         }
         break;
     case 0x9a: /* lcall im */
@@ -6831,7 +6943,9 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
             tval &= 0xffff;
         else if(!CODE64(s))
             tval &= 0xffffffff;
-        gen_jmp(s, tval);
+        if (!gen_follow_jmp(s, tval)) {
+            gen_jmp(s, tval);
+        }
         break;
     case 0xea: /* ljmp im */
         {
@@ -6852,7 +6966,9 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
         tval += s->pc - s->cs_base;
         if (s->dflag == 0)
             tval &= 0xffff;
-        gen_jmp(s, tval);
+        if (!gen_follow_jmp(s, tval)) {
+            gen_jmp(s, tval);
+        }
         break;
     case 0x70 ... 0x7f: /* jcc Jb */
         tval = (int8_t)insn_get(env, s, OT_BYTE);
@@ -8274,6 +8390,7 @@ static inline void gen_intermediate_code_internal(CPUX86State *env,
     dc->cs_base = cs_base;
     dc->tb = tb;
     dc->popl_esp_hack = 0;
+    dc->sb_jumps = 0;
     /* select memory access functions */
     dc->mem_index = 0;
     if (flags & HF_SOFTMMU_MASK) {
@@ -8325,6 +8442,7 @@ static inline void gen_intermediate_code_internal(CPUX86State *env,
         max_insns = CF_COUNT_MASK;
 
     gen_icount_start();
+    gen_tb_exec_count(tb);
     for(;;) {
         if (unlikely(!QTAILQ_EMPTY(&env->breakpoints))) {
             QTAILQ_FOREACH(bp, &env->breakpoints, entry) {
@@ -8408,10 +8526,8 @@ static inline void gen_intermediate_code_internal(CPUX86State *env,
     }
 #endif
 
-    if (!search_pc) {
-        tb->size = pc_ptr - pc_start;
-        tb->icount = num_insns;
-    }
+    tb->size = pc_ptr - pc_start;
+    tb->icount = num_insns;
 }
 
 void gen_intermediate_code(CPUX86State *env, TranslationBlock *tb)
@@ -8424,6 +8540,16 @@ void gen_intermediate_code_pc(CPUX86State *env, TranslationBlock *tb)
     gen_intermediate_code_internal(env, tb, 1);
 }
 
+void gen_opc_get_extra(int pc_pos, target_ulong *extra)
+{
+    extra[0] = gen_opc_cc_op[pc_pos];
+}
+
+void gen_opc_set_extra(int pc_pos, const target_ulong *extra)
+{
+    gen_opc_cc_op[pc_pos] = extra[0];
+}
+
 void restore_state_to_opc(CPUX86State *env, TranslationBlock *tb, int pc_pos)
 {
     int cc_op;
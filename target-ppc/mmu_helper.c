@@ -750,11 +750,14 @@ void helper_slbie(CPUPPCState *env, target_ulong addr)
     if (slb->esid & SLB_ESID_V) {
         slb->esid &= ~SLB_ESID_V;
 
-        /* XXX: given the fact that segment size is 256 MB or 1TB,
-         *      and we still don't have a tlb_flush_mask(env, n, mask)
-         *      in QEMU, we just invalidate all TLBs
-         */
-        tlb_flush(env, 1);
+        /* Only the translations of the segment go away */
+        if ((slb->vsid & SLB_VSID_B) == SLB_VSID_B_1T) {
+            tlb_flush_range(env, slb->esid & SEGMENT_MASK_1T,
+                            1ULL << SEGMENT_SHIFT_1T);
+        } else {
+            tlb_flush_range(env, slb->esid & SEGMENT_MASK_256M,
+                            1ULL << SEGMENT_SHIFT_256M);
+        }
     }
 }
 
@@ -2130,19 +2133,27 @@ int cpu_ppc_handle_mmu_fault(CPUPPCState *env, target_ulong address, int rw,
 /* BATs management */
 #if !defined(FLUSH_ALL_TLBS)
 static inline void do_invalidate_BAT(CPUPPCState *env, target_ulong BATu,
-                                     target_ulong mask)
+                                     target_ulong mask, uint16_t idxmap)
 {
-    target_ulong base, end, page;
+    target_ulong base, end;
 
     base = BATu & ~0x0001FFFF;
     end = base + mask + 0x00020000;
     LOG_BATS("Flush BAT from " TARGET_FMT_lx " to " TARGET_FMT_lx " ("
              TARGET_FMT_lx ")\n", base, end, mask);
-    for (page = base; page != end; page += TARGET_PAGE_SIZE) {
-        tlb_flush_page(env, page);
-    }
+    tlb_flush_range_by_mmuidx(env, base, end - base, idxmap);
     LOG_BATS("Flush done\n");
 }
+
+/* The MMU modes that an upper BAT of the non-601 models translates for:
+ * Vs covers supervisor and hypervisor state, Vp problem state.
+ */
+static inline uint16_t BATu_mmuidx(target_ulong BATu)
+{
+    return (BATu & 0x2 ? (1 << 1) | (1 << 2) : 0) | (BATu & 0x1 ? 1 << 0 : 0);
+}
+
+#define BAT_601_MMUIDX ((1 << NB_MMU_MODES) - 1)
 #endif
 
 static inline void dump_store_bat(CPUPPCState *env, char ID, int ul, int nr,
@@ -2160,7 +2171,8 @@ void helper_store_ibatu(CPUPPCState *env, uint32_t nr, target_ulong value)
     if (env->IBAT[0][nr] != value) {
         mask = (value << 15) & 0x0FFE0000UL;
 #if !defined(FLUSH_ALL_TLBS)
-        do_invalidate_BAT(env, env->IBAT[0][nr], mask);
+        do_invalidate_BAT(env, env->IBAT[0][nr], mask,
+                          BATu_mmuidx(env->IBAT[0][nr]));
 #endif
         /* When storing valid upper BAT, mask BEPI and BRPN
          * and invalidate all TLBs covered by this BAT
@@ -2171,7 +2183,8 @@ void helper_store_ibatu(CPUPPCState *env, uint32_t nr, target_ulong value)
         env->IBAT[1][nr] = (env->IBAT[1][nr] & 0x0000007B) |
             (env->IBAT[1][nr] & ~0x0001FFFF & ~mask);
 #if !defined(FLUSH_ALL_TLBS)
-        do_invalidate_BAT(env, env->IBAT[0][nr], mask);
+        do_invalidate_BAT(env, env->IBAT[0][nr], mask,
+                          BATu_mmuidx(env->IBAT[0][nr]));
 #else
         tlb_flush(env, 1);
 #endif
@@ -2195,7 +2208,8 @@ void helper_store_dbatu(CPUPPCState *env, uint32_t nr, target_ulong value)
          */
         mask = (value << 15) & 0x0FFE0000UL;
 #if !defined(FLUSH_ALL_TLBS)
-        do_invalidate_BAT(env, env->DBAT[0][nr], mask);
+        do_invalidate_BAT(env, env->DBAT[0][nr], mask,
+                          BATu_mmuidx(env->DBAT[0][nr]));
 #endif
         mask = (value << 15) & 0x0FFE0000UL;
         env->DBAT[0][nr] = (value & 0x00001FFFUL) |
@@ -2203,7 +2217,8 @@ void helper_store_dbatu(CPUPPCState *env, uint32_t nr, target_ulong value)
         env->DBAT[1][nr] = (env->DBAT[1][nr] & 0x0000007B) |
             (env->DBAT[1][nr] & ~0x0001FFFF & ~mask);
 #if !defined(FLUSH_ALL_TLBS)
-        do_invalidate_BAT(env, env->DBAT[0][nr], mask);
+        do_invalidate_BAT(env, env->DBAT[0][nr], mask,
+                          BATu_mmuidx(env->DBAT[0][nr]));
 #else
         tlb_flush(env, 1);
 #endif
@@ -2232,7 +2247,7 @@ void helper_store_601_batu(CPUPPCState *env, uint32_t nr, target_ulong value)
         if (env->IBAT[1][nr] & 0x40) {
             /* Invalidate BAT only if it is valid */
 #if !defined(FLUSH_ALL_TLBS)
-            do_invalidate_BAT(env, env->IBAT[0][nr], mask);
+            do_invalidate_BAT(env, env->IBAT[0][nr], mask, BAT_601_MMUIDX);
 #else
             do_inval = 1;
 #endif
@@ -2245,7 +2260,7 @@ void helper_store_601_batu(CPUPPCState *env, uint32_t nr, target_ulong value)
         env->DBAT[0][nr] = env->IBAT[0][nr];
         if (env->IBAT[1][nr] & 0x40) {
 #if !defined(FLUSH_ALL_TLBS)
-            do_invalidate_BAT(env, env->IBAT[0][nr], mask);
+            do_invalidate_BAT(env, env->IBAT[0][nr], mask, BAT_601_MMUIDX);
 #else
             do_inval = 1;
 #endif
@@ -2274,7 +2289,7 @@ void helper_store_601_batl(CPUPPCState *env, uint32_t nr, target_ulong value)
         if (env->IBAT[1][nr] & 0x40) {
 #if !defined(FLUSH_ALL_TLBS)
             mask = (env->IBAT[1][nr] << 17) & 0x0FFE0000UL;
-            do_invalidate_BAT(env, env->IBAT[0][nr], mask);
+            do_invalidate_BAT(env, env->IBAT[0][nr], mask, BAT_601_MMUIDX);
 #else
             do_inval = 1;
 #endif
@@ -2282,7 +2297,7 @@ void helper_store_601_batl(CPUPPCState *env, uint32_t nr, target_ulong value)
         if (value & 0x40) {
 #if !defined(FLUSH_ALL_TLBS)
             mask = (value << 17) & 0x0FFE0000UL;
-            do_invalidate_BAT(env, env->IBAT[0][nr], mask);
+            do_invalidate_BAT(env, env->IBAT[0][nr], mask, BAT_601_MMUIDX);
 #else
             do_inval = 1;
 #endif
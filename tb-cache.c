@@ -0,0 +1,613 @@
+/*
+ * Translation cache kept across runs of the user mode emulators
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+/*
+ * The code translated from the read-only executable mappings of files
+ * is kept in a directory, one file per mapping.  The name of the file
+ * is a hash of the mapped content, of the file offset and guest address
+ * of the mapping and of the QEMU binary, so a program or library that
+ * changed simply misses.  The header of the file must also match the
+ * settings that the code depends on, such as GUEST_BASE.
+ *
+ * The TCG backend records the host addresses that it puts in the code
+ * (see TCGContext.code_relocatable) and they are patched when the code
+ * is installed again.  TBs that use other host addresses, superblocks
+ * and the TBs of a mapping that becomes writable are not cached.
+ *
+ * A file is written back when its mapping goes away and when the
+ * program exits or executes another one.  The least recently used files
+ * are then removed until the directory is below its size limit.
+ */
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <dirent.h>
+#include <glib.h>
+
+#include "config.h"
+#include "qemu-common.h"
+#include "cpu.h"
+#include "tcg.h"
+#include "qemu.h"
+#include "qemu/queue.h"
+
+#if TCG_TARGET_HAS_code_relocs && defined(USE_DIRECT_JUMP)
+
+#define TB_CACHE_MAGIC "QEMUTBC1"
+
+/* what a relocation is relative to */
+enum {
+    TB_CACHE_PROLOGUE,  /* tcg_ctx.code_gen_prologue */
+    TB_CACHE_TB,        /* the TranslationBlock, for exit_tb */
+    TB_CACHE_HOST,      /* the QEMU binary, such as the address of a helper */
+};
+
+typedef struct TBCacheHeader {
+    char magic[8];
+    uint64_t config;
+    uint64_t start;
+    uint64_t len;
+    uint32_t nb_entries;
+    uint32_t pad;
+} TBCacheHeader;
+
+/* followed by nb_relocs TBCacheReloc and code_size bytes of code */
+typedef struct TBCacheEntry {
+    uint64_t flags;
+    uint64_t cs_base;
+    uint32_t pc_offset;     /* from the start of the mapping */
+    uint32_t code_size;
+    uint32_t icount;
+    uint16_t size;
+    uint16_t nb_relocs;
+    uint16_t tb_next_offset[2];
+    uint16_t tb_jmp_offset[2];
+} TBCacheEntry;
+
+typedef struct TBCacheReloc {
+    int64_t addend;
+    uint32_t offset;
+    uint8_t type;
+    uint8_t kind;
+    uint16_t pad;
+} TBCacheReloc;
+
+typedef struct TBCacheRegion {
+    /* address and hashed length of the mapping */
+    target_ulong base;
+    target_ulong len;
+    /* the part of it that is still mapped */
+    target_ulong start;
+    target_ulong end;
+    char *path;
+    bool loaded;
+    bool dirty;
+    /* TBCacheEntry, both key and value */
+    GHashTable *entries;
+    QTAILQ_ENTRY(TBCacheRegion) next;
+} TBCacheRegion;
+
+static char *tb_cache_dir;
+static uint64_t tb_cache_max_size;
+/* identifies the QEMU binary and the CPU model */
+static uint64_t tb_cache_id;
+static QTAILQ_HEAD(, TBCacheRegion) tb_cache_regions =
+    QTAILQ_HEAD_INITIALIZER(tb_cache_regions);
+
+static uint64_t tb_cache_hash(uint64_t h, const void *buf, size_t len)
+{
+    const uint8_t *p = buf;
+    uint64_t w;
+
+    /* FNV-1a, a word at a time */
+    for (; len >= 8; p += 8, len -= 8) {
+        memcpy(&w, p, 8);
+        h = (h ^ w) * 0x100000001b3ULL;
+    }
+    for (; len; p++, len--) {
+        h = (h ^ *p) * 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static uint64_t tb_cache_hash64(uint64_t h, uint64_t val)
+{
+    return tb_cache_hash(h, &val, sizeof(val));
+}
+
+static uintptr_t tb_cache_host_anchor(void)
+{
+    return (uintptr_t)tb_cache_init;
+}
+
+/* The settings that are only known once the prologue is generated */
+static uint64_t tb_cache_config(void)
+{
+    uint64_t h = tb_cache_id;
+
+    h = tb_cache_hash64(h, GUEST_BASE);
+    h = tb_cache_hash64(h, tcg_ctx.code_config);
+    h = tb_cache_hash64(h, tcg_opt_flags);
+    h = tb_cache_hash64(h, tcg_tb_profile);
+    return h;
+}
+
+static guint tb_cache_entry_hash(gconstpointer key)
+{
+    const TBCacheEntry *e = key;
+
+    return e->pc_offset * 0x9e3779b1u ^ (guint)e->flags;
+}
+
+static gboolean tb_cache_entry_equal(gconstpointer a, gconstpointer b)
+{
+    const TBCacheEntry *e1 = a, *e2 = b;
+
+    return e1->pc_offset == e2->pc_offset && e1->flags == e2->flags &&
+           e1->cs_base == e2->cs_base;
+}
+
+static size_t tb_cache_entry_size(const TBCacheEntry *e)
+{
+    return sizeof(*e) + e->nb_relocs * sizeof(TBCacheReloc) + e->code_size;
+}
+
+static TBCacheRegion *tb_cache_find_region(target_ulong pc, target_ulong size)
+{
+    TBCacheRegion *r;
+
+    QTAILQ_FOREACH(r, &tb_cache_regions, next) {
+        if (pc >= r->start && pc + size <= r->end) {
+            return r;
+        }
+    }
+    return NULL;
+}
+
+static void tb_cache_load(TBCacheRegion *r)
+{
+    TBCacheHeader *hdr;
+    gchar *buf;
+    gsize len, pos;
+    uint32_t i;
+
+    r->loaded = true;
+    if (!g_file_get_contents(r->path, &buf, &len, NULL)) {
+        return;
+    }
+    hdr = (TBCacheHeader *)buf;
+    if (len < sizeof(*hdr) || memcmp(hdr->magic, TB_CACHE_MAGIC, 8) ||
+        hdr->config != tb_cache_config() || hdr->start != r->base ||
+        hdr->len != r->len) {
+        g_free(buf);
+        return;
+    }
+
+    pos = sizeof(*hdr);
+    for (i = 0; i < hdr->nb_entries; i++) {
+        TBCacheEntry *e = (TBCacheEntry *)(buf + pos);
+        size_t size;
+
+        if (len - pos < sizeof(*e)) {
+            break;
+        }
+        size = tb_cache_entry_size(e);
+        if (len - pos < size) {
+            break;
+        }
+        e = g_memdup(e, size);
+        g_hash_table_insert(r->entries, e, e);
+        pos += size;
+    }
+    g_free(buf);
+
+    /* mark the file as recently used for tb_cache_evict() */
+    utimes(r->path, NULL);
+}
+
+static void tb_cache_write_entry(gpointer key, gpointer value, gpointer opaque)
+{
+    TBCacheEntry *e = value;
+    FILE *f = opaque;
+
+    fwrite(e, tb_cache_entry_size(e), 1, f);
+}
+
+static void tb_cache_write(TBCacheRegion *r)
+{
+    TBCacheHeader hdr;
+    char *tmp;
+    FILE *f;
+    int err;
+
+    if (!r->dirty) {
+        return;
+    }
+    r->dirty = false;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, TB_CACHE_MAGIC, 8);
+    hdr.config = tb_cache_config();
+    hdr.start = r->base;
+    hdr.len = r->len;
+    hdr.nb_entries = g_hash_table_size(r->entries);
+
+    /* write a temporary file and rename it, so that another process
+       never reads a partial file */
+    tmp = g_strdup_printf("%s.%d", r->path, (int)getpid());
+    f = fopen(tmp, "wb");
+    if (!f) {
+        g_free(tmp);
+        return;
+    }
+    fwrite(&hdr, sizeof(hdr), 1, f);
+    g_hash_table_foreach(r->entries, tb_cache_write_entry, f);
+    err = ferror(f);
+    if (fclose(f) || err || rename(tmp, r->path) < 0) {
+        unlink(tmp);
+    }
+    g_free(tmp);
+}
+
+typedef struct TBCacheFile {
+    char *path;
+    time_t mtime;
+    off_t size;
+} TBCacheFile;
+
+static int tb_cache_file_cmp(const void *a, const void *b)
+{
+    const TBCacheFile *f1 = a, *f2 = b;
+
+    return f1->mtime < f2->mtime ? -1 : f1->mtime > f2->mtime;
+}
+
+/* Remove the least recently used files while the cache is too large */
+static void tb_cache_evict(void)
+{
+    GArray *files = g_array_new(FALSE, FALSE, sizeof(TBCacheFile));
+    uint64_t total = 0;
+    struct dirent *de;
+    struct stat st;
+    DIR *dir;
+    guint i;
+
+    dir = opendir(tb_cache_dir);
+    if (!dir) {
+        g_array_free(files, TRUE);
+        return;
+    }
+    while ((de = readdir(dir)) != NULL) {
+        TBCacheFile f;
+
+        if (strlen(de->d_name) != 16 ||
+            strspn(de->d_name, "0123456789abcdef") != 16) {
+            continue;
+        }
+        f.path = g_strdup_printf("%s/%s", tb_cache_dir, de->d_name);
+        if (stat(f.path, &st) < 0 || !S_ISREG(st.st_mode)) {
+            g_free(f.path);
+            continue;
+        }
+        f.mtime = st.st_mtime;
+        f.size = st.st_size;
+        total += f.size;
+        g_array_append_val(files, f);
+    }
+    closedir(dir);
+
+    qsort(files->data, files->len, sizeof(TBCacheFile), tb_cache_file_cmp);
+    for (i = 0; i < files->len; i++) {
+        TBCacheFile *f = &g_array_index(files, TBCacheFile, i);
+
+        if (total > tb_cache_max_size && unlink(f->path) == 0) {
+            total -= f->size;
+        }
+        g_free(f->path);
+    }
+    g_array_free(files, TRUE);
+}
+
+void tb_cache_init(const char *dir, uint64_t max_size, const char *cpu_model)
+{
+    struct stat st;
+    uint64_t h = 0xcbf29ce484222325ULL;
+
+    if (mkdir(dir, 0700) < 0 && errno != EEXIST) {
+        fprintf(stderr, "qemu: cannot create TB cache directory %s: %s\n",
+                dir, strerror(errno));
+        return;
+    }
+    if (stat("/proc/self/exe", &st) < 0) {
+        fprintf(stderr, "qemu: TB cache disabled, cannot stat the QEMU "
+                "binary: %s\n", strerror(errno));
+        return;
+    }
+    h = tb_cache_hash64(h, st.st_dev);
+    h = tb_cache_hash64(h, st.st_ino);
+    h = tb_cache_hash64(h, st.st_size);
+    h = tb_cache_hash64(h, st.st_mtime);
+    h = tb_cache_hash(h, cpu_model, strlen(cpu_model));
+
+    tb_cache_id = h;
+    tb_cache_dir = g_strdup(dir);
+    tb_cache_max_size = max_size;
+    tcg_ctx.code_relocatable = true;
+}
+
+void tb_cache_map(target_ulong start, target_ulong len, int prot, int fd,
+                  off_t offset)
+{
+    TBCacheRegion *r;
+    struct stat st;
+    uint64_t h;
+
+    if (!tb_cache_dir) {
+        return;
+    }
+    tb_cache_unmap(start, len);
+    if (fd < 0 || (prot & (PROT_READ | PROT_WRITE | PROT_EXEC)) !=
+        (PROT_READ | PROT_EXEC)) {
+        return;
+    }
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || offset >= st.st_size) {
+        return;
+    }
+    /* the part past the end of the file is not hashed, nor cached */
+    len = MIN(len, st.st_size - offset);
+    if (len > UINT32_MAX) {
+        return;
+    }
+
+    h = tb_cache_hash(tb_cache_id, g2h(start), len);
+    h = tb_cache_hash64(h, offset);
+    h = tb_cache_hash64(h, start);
+    h = tb_cache_hash64(h, len);
+
+    r = g_new0(TBCacheRegion, 1);
+    r->base = r->start = start;
+    r->len = len;
+    r->end = start + len;
+    r->path = g_strdup_printf("%s/%016" PRIx64, tb_cache_dir, h);
+    r->entries = g_hash_table_new_full(tb_cache_entry_hash,
+                                       tb_cache_entry_equal, NULL, g_free);
+    QTAILQ_INSERT_TAIL(&tb_cache_regions, r, next);
+}
+
+static void tb_cache_free_region(TBCacheRegion *r)
+{
+    tb_cache_write(r);
+    QTAILQ_REMOVE(&tb_cache_regions, r, next);
+    g_hash_table_destroy(r->entries);
+    g_free(r->path);
+    g_free(r);
+}
+
+void tb_cache_unmap(target_ulong start, target_ulong len)
+{
+    target_ulong end = start + len;
+    TBCacheRegion *r, *next;
+
+    QTAILQ_FOREACH_SAFE(r, &tb_cache_regions, next, next) {
+        if (end <= r->start || r->end <= start) {
+            continue;
+        }
+        /* dynamic loaders map a whole library and then replace the parts
+           past its text, so keep what is left of the mapping */
+        if (start > r->start) {
+            r->end = start;
+        } else if (end < r->end) {
+            r->start = end;
+        } else {
+            tb_cache_free_region(r);
+        }
+    }
+}
+
+void tb_cache_protect(target_ulong start, target_ulong len, int prot)
+{
+    TBCacheRegion *r, *next;
+
+    if (!(prot & PROT_WRITE)) {
+        return;
+    }
+    /* the content may change; what was cached so far is written back */
+    QTAILQ_FOREACH_SAFE(r, &tb_cache_regions, next, next) {
+        if (r->start < start + len && start < r->end) {
+            tb_cache_free_region(r);
+        }
+    }
+}
+
+static bool tb_cache_relocate(TranslationBlock *tb, void *opaque)
+{
+    TBCacheEntry *e = opaque;
+    TBCacheReloc *rel = (TBCacheReloc *)(e + 1);
+    tcg_target_long value;
+    int i;
+
+    for (i = 0; i < e->nb_relocs; i++, rel++) {
+        switch (rel->kind) {
+        case TB_CACHE_PROLOGUE:
+            value = (uintptr_t)tcg_ctx.code_gen_prologue + rel->addend;
+            break;
+        case TB_CACHE_TB:
+            value = (uintptr_t)tb + rel->addend;
+            break;
+        default:
+            value = tb_cache_host_anchor() + rel->addend;
+            break;
+        }
+        if (!tcg_patch_code_reloc(tb->tc_ptr + rel->offset, rel->type,
+                                  value)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+TranslationBlock *tb_cache_find(CPUArchState *env, target_ulong pc,
+                                target_ulong cs_base, uint64_t flags)
+{
+    TranslationBlock desc, *tb = NULL;
+    TBCacheRegion *r;
+    TBCacheEntry key, *e;
+
+    if (!tb_cache_dir) {
+        return NULL;
+    }
+    mmap_lock();
+    r = tb_cache_find_region(pc, 1);
+    if (!r) {
+        goto out;
+    }
+    if (!r->loaded) {
+        tb_cache_load(r);
+    }
+    memset(&key, 0, sizeof(key));
+    key.pc_offset = pc - r->base;
+    key.flags = flags;
+    key.cs_base = cs_base;
+    e = g_hash_table_lookup(r->entries, &key);
+    if (!e || pc + e->size > r->end) {
+        goto out;
+    }
+
+    memset(&desc, 0, sizeof(desc));
+    desc.pc = pc;
+    desc.cs_base = cs_base;
+    desc.flags = flags;
+    desc.size = e->size;
+    desc.icount = e->icount;
+    memcpy(desc.tb_next_offset, e->tb_next_offset, sizeof(e->tb_next_offset));
+    memcpy(desc.tb_jmp_offset, e->tb_jmp_offset, sizeof(e->tb_jmp_offset));
+    tb = tb_gen_cached(env, &desc,
+                       (uint8_t *)(e + 1) + e->nb_relocs * sizeof(TBCacheReloc),
+                       e->code_size, tb_cache_relocate, e);
+out:
+    mmap_unlock();
+    return tb;
+}
+
+void tb_cache_add(TranslationBlock *tb, int code_size)
+{
+    TCGContext *s = &tcg_ctx;
+    uintptr_t buf_start = (uintptr_t)s->code_gen_buffer;
+    TBCacheRegion *r;
+    TBCacheEntry key, *e;
+    TBCacheReloc *rel;
+    int i;
+
+    if (!tb_cache_dir || tb->cflags || s->code_uncacheable) {
+        return;
+    }
+    mmap_lock();
+    r = tb_cache_find_region(tb->pc, tb->size);
+    if (!r) {
+        goto out;
+    }
+    if (!r->loaded) {
+        tb_cache_load(r);
+    }
+    memset(&key, 0, sizeof(key));
+    key.pc_offset = tb->pc - r->base;
+    key.flags = tb->flags;
+    key.cs_base = tb->cs_base;
+    if (g_hash_table_lookup(r->entries, &key)) {
+        goto out;
+    }
+
+    e = g_malloc(sizeof(*e) + s->nb_code_relocs * sizeof(*rel) + code_size);
+    *e = key;
+    e->code_size = code_size;
+    e->icount = tb->icount;
+    e->size = tb->size;
+    e->nb_relocs = s->nb_code_relocs;
+    memcpy(e->tb_next_offset, tb->tb_next_offset, sizeof(e->tb_next_offset));
+    memcpy(e->tb_jmp_offset, tb->tb_jmp_offset, sizeof(e->tb_jmp_offset));
+
+    rel = (TBCacheReloc *)(e + 1);
+    for (i = 0; i < s->nb_code_relocs; i++, rel++) {
+        uintptr_t value = s->code_relocs[i].value;
+
+        memset(rel, 0, sizeof(*rel));
+        rel->offset = s->code_relocs[i].offset;
+        rel->type = s->code_relocs[i].type;
+        if (value - (uintptr_t)tb < 4) {
+            rel->kind = TB_CACHE_TB;
+            rel->addend = value - (uintptr_t)tb;
+        } else if (value - (uintptr_t)s->code_gen_prologue < 1024) {
+            /* see code_gen_alloc() for the size of the prologue */
+            rel->kind = TB_CACHE_PROLOGUE;
+            rel->addend = value - (uintptr_t)s->code_gen_prologue;
+        } else if (value - buf_start < s->code_gen_buffer_size) {
+            /* another TB, it may go away */
+            g_free(e);
+            goto out;
+        } else {
+            rel->kind = TB_CACHE_HOST;
+            rel->addend = value - tb_cache_host_anchor();
+        }
+    }
+    /* the jumps were reset by tb_link_page(), they are relative to tc_ptr */
+    memcpy(rel, tb->tc_ptr, code_size);
+    g_hash_table_insert(r->entries, e, e);
+    r->dirty = true;
+out:
+    mmap_unlock();
+}
+
+void tb_cache_save(void)
+{
+    TBCacheRegion *r;
+
+    if (!tb_cache_dir) {
+        return;
+    }
+    mmap_lock();
+    QTAILQ_FOREACH(r, &tb_cache_regions, next) {
+        tb_cache_write(r);
+    }
+    tb_cache_evict();
+    mmap_unlock();
+}
+
+#else
+
+void tb_cache_init(const char *dir, uint64_t max_size, const char *cpu_model)
+{
+    fprintf(stderr, "qemu: the TB cache is not supported on this host\n");
+}
+
+void tb_cache_map(target_ulong start, target_ulong len, int prot, int fd,
+                  off_t offset)
+{
+}
+
+void tb_cache_unmap(target_ulong start, target_ulong len)
+{
+}
+
+void tb_cache_protect(target_ulong start, target_ulong len, int prot)
+{
+}
+
+TranslationBlock *tb_cache_find(CPUArchState *env, target_ulong pc,
+                                target_ulong cs_base, uint64_t flags)
+{
+    return NULL;
+}
+
+void tb_cache_add(TranslationBlock *tb, int code_size)
+{
+}
+
+void tb_cache_save(void)
+{
+}
+
+#endif
@@ -1097,6 +1097,28 @@ static inline void tcg_out_arg_stacktidy(TCGContext *s, TCGReg argreg)
 
 #endif
 
+#ifndef CONFIG_SOFTMMU
+/* Holds GUEST_BASE if it is not a valid ALU immediate; loaded and
+   reserved by the prologue.  */
+#define TCG_GUEST_BASE_REG TCG_REG_R11
+
+/* Return the register holding the host address for guest address
+   ADDR_REG, adding GUEST_BASE into TMP with a single insn if needed.  */
+static int tcg_out_guest_base(TCGContext *s, int tmp, int addr_reg)
+{
+    if (!GUEST_BASE) {
+        return addr_reg;
+    }
+    if (check_fit_imm(GUEST_BASE)) {
+        tcg_out_dat_rI(s, COND_AL, ARITH_ADD, tmp, addr_reg, GUEST_BASE, 1);
+    } else {
+        tcg_out_dat_reg(s, COND_AL, ARITH_ADD, tmp, addr_reg,
+                        TCG_GUEST_BASE_REG, SHIFT_IMM_LSL(0));
+    }
+    return tmp;
+}
+#endif
+
 #define TLB_SHIFT	(CPU_TLB_ENTRY_BITS + CPU_TLB_BITS)
 
 static inline void tcg_out_qemu_ld(TCGContext *s, const TCGArg *args, int opc)
@@ -1249,21 +1271,7 @@ static inline void tcg_out_qemu_ld(TCGContext *s, const TCGArg *args, int opc)
 
     reloc_pc24(label_ptr, (tcg_target_long)s->code_ptr);
 #else /* !CONFIG_SOFTMMU */
-    if (GUEST_BASE) {
-        uint32_t offset = GUEST_BASE;
-        int i;
-        int rot;
-
-        while (offset) {
-            i = ctz32(offset) & ~1;
-            rot = ((32 - i) << 7) & 0xf00;
-
-            tcg_out_dat_imm(s, COND_AL, ARITH_ADD, TCG_REG_R8, addr_reg,
-                            ((offset >> i) & 0xff) | rot);
-            addr_reg = TCG_REG_R8;
-            offset &= ~(0xff << i);
-        }
-    }
+    addr_reg = tcg_out_guest_base(s, TCG_REG_R8, addr_reg);
     switch (opc) {
     case 0:
         tcg_out_ld8_12(s, COND_AL, data_reg, addr_reg, 0);
@@ -1448,21 +1456,7 @@ static inline void tcg_out_qemu_st(TCGContext *s, const TCGArg *args, int opc)
 
     reloc_pc24(label_ptr, (tcg_target_long)s->code_ptr);
 #else /* !CONFIG_SOFTMMU */
-    if (GUEST_BASE) {
-        uint32_t offset = GUEST_BASE;
-        int i;
-        int rot;
-
-        while (offset) {
-            i = ctz32(offset) & ~1;
-            rot = ((32 - i) << 7) & 0xf00;
-
-            tcg_out_dat_imm(s, COND_AL, ARITH_ADD, TCG_REG_R1, addr_reg,
-                            ((offset >> i) & 0xff) | rot);
-            addr_reg = TCG_REG_R1;
-            offset &= ~(0xff << i);
-        }
-    }
+    addr_reg = tcg_out_guest_base(s, TCG_REG_R1, addr_reg);
     switch (opc) {
     case 0:
         tcg_out_st8_12(s, COND_AL, data_reg, addr_reg, 0);
@@ -1921,6 +1915,13 @@ static void tcg_target_qemu_prologue(TCGContext *s)
     /* stmdb sp!, { r4 - r12, lr } */
     tcg_out32(s, (COND_AL << 28) | 0x092d5ff0);
 
+#ifndef CONFIG_SOFTMMU
+    if (GUEST_BASE && !check_fit_imm(GUEST_BASE)) {
+        tcg_out_movi32(s, COND_AL, TCG_GUEST_BASE_REG, GUEST_BASE);
+        tcg_regset_set_reg(s->reserved_regs, TCG_GUEST_BASE_REG);
+    }
+#endif
+
     tcg_out_mov(s, TCG_TYPE_PTR, TCG_AREG0, tcg_target_call_iarg_regs[0]);
 
     tcg_out_bx(s, COND_AL, tcg_target_call_iarg_regs[1]);
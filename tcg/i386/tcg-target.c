@@ -135,6 +135,32 @@ static void patch_reloc(uint8_t *code_ptr, int type,
     }
 }
 
+bool tcg_patch_code_reloc(uint8_t *ptr, int type, tcg_target_long value)
+{
+    tcg_target_long disp = value - (tcg_target_long)ptr - 4;
+
+    switch (type) {
+    case TCG_CODE_REL32:
+        if (disp != (int32_t)disp) {
+            return false;
+        }
+        *(uint32_t *)ptr = disp;
+        return true;
+    case TCG_CODE_ABS_FAR:
+        /* tcg_out_branch() emits a direct branch when the displacement
+           from the start of the movabs fits */
+        if (disp + 1 == (int32_t)(disp + 1)) {
+            return false;
+        }
+        /* fall through */
+    case TCG_CODE_ABS:
+        *(tcg_target_long *)ptr = value;
+        return true;
+    default:
+        tcg_abort();
+    }
+}
+
 /* parse target specific constraints */
 static int target_parse_constraint(TCGArgConstraint *ct, const char **pct_str)
 {
@@ -294,6 +320,22 @@ static inline int tcg_target_const_match(tcg_target_long val,
 #define OPC_TESTL	(0x85)
 #define OPC_XCHG_ax_r32	(0x90)
 
+#define OPC_MOVUPS_VxWx	(0x10 | P_EXT)
+#define OPC_MOVUPS_WxVx	(0x11 | P_EXT)
+#define OPC_PSHUFD	(0x70 | P_EXT | P_DATA16)
+#define OPC_PADDQ	(0xd4 | P_EXT | P_DATA16)
+#define OPC_PAND	(0xdb | P_EXT | P_DATA16)
+#define OPC_PANDN	(0xdf | P_EXT | P_DATA16)
+#define OPC_POR		(0xeb | P_EXT | P_DATA16)
+#define OPC_PXOR	(0xef | P_EXT | P_DATA16)
+#define OPC_PSUBB	(0xf8 | P_EXT | P_DATA16)
+#define OPC_PSUBW	(0xf9 | P_EXT | P_DATA16)
+#define OPC_PSUBD	(0xfa | P_EXT | P_DATA16)
+#define OPC_PSUBQ	(0xfb | P_EXT | P_DATA16)
+#define OPC_PADDB	(0xfc | P_EXT | P_DATA16)
+#define OPC_PADDW	(0xfd | P_EXT | P_DATA16)
+#define OPC_PADDD	(0xfe | P_EXT | P_DATA16)
+
 #define OPC_GRP3_Ev	(0xf7)
 #define OPC_GRP5	(0xff)
 
@@ -557,6 +599,19 @@ static void tcg_out_movi(TCGContext *s, TCGType type,
     }
 }
 
+/* A movi of a host address that keeps the same size whatever the value,
+   for s->code_relocatable */
+static void tcg_out_movi_reloc(TCGContext *s, TCGReg ret, int type,
+                               tcg_target_long arg)
+{
+    tcg_out_opc(s, OPC_MOVL_Iv + P_REXW + LOWREGMASK(ret), 0, ret, 0);
+    tcg_code_reloc(s, type, arg);
+    tcg_out32(s, arg);
+    if (TCG_TARGET_REG_BITS == 64) {
+        tcg_out32(s, arg >> 31 >> 1);
+    }
+}
+
 static inline void tcg_out_pushi(TCGContext *s, tcg_target_long val)
 {
     if (val == (int8_t)val) {
@@ -981,7 +1036,14 @@ static void tcg_out_branch(TCGContext *s, int call, tcg_target_long dest)
 
     if (disp == (int32_t)disp) {
         tcg_out_opc(s, call ? OPC_CALL_Jz : OPC_JMP_long, 0, 0, 0);
+        if (s->code_relocatable) {
+            tcg_code_reloc(s, TCG_CODE_REL32, dest);
+        }
         tcg_out32(s, disp);
+    } else if (s->code_relocatable) {
+        tcg_out_movi_reloc(s, TCG_REG_R10, TCG_CODE_ABS_FAR, dest);
+        tcg_out_modrm(s, OPC_GRP5,
+                      call ? EXT5_CALLN_Ev : EXT5_JMPN_Ev, TCG_REG_R10);
     } else {
         tcg_out_movi(s, TCG_TYPE_PTR, TCG_REG_R10, dest);
         tcg_out_modrm(s, OPC_GRP5,
@@ -1129,6 +1191,14 @@ static inline void setup_guest_base_seg(void)
 static inline void setup_guest_base_seg(void) { }
 #endif /* SOFTMMU */
 
+/* Holds a GUEST_BASE that neither fits in a displacement nor could be
+   put in a segment base; see tcg_target_qemu_prologue.  */
+#if TCG_TARGET_REG_BITS == 64
+# define TCG_GUEST_BASE_REG TCG_REG_R12
+#else
+# define TCG_GUEST_BASE_REG TCG_REG_EBP
+#endif
+
 static void tcg_out_qemu_ld_direct(TCGContext *s, int datalo, int datahi,
                                    int base, tcg_target_long ofs, int seg,
                                    int sizeop)
@@ -1269,8 +1339,9 @@ static void tcg_out_qemu_ld(TCGContext *s, const TCGArg *args,
             seg = guest_base_flags;
             offset = 0;
         } else if (TCG_TARGET_REG_BITS == 64 && offset != GUEST_BASE) {
-            tcg_out_movi(s, TCG_TYPE_I64, TCG_REG_L1, GUEST_BASE);
-            tgen_arithr(s, ARITH_ADD + P_REXW, TCG_REG_L1, base);
+            /* lea (base, TCG_GUEST_BASE_REG), L1 */
+            tcg_out_modrm_sib_offset(s, OPC_LEA + P_REXW, TCG_REG_L1, base,
+                                     TCG_GUEST_BASE_REG, 0, 0);
             base = TCG_REG_L1;
             offset = 0;
         }
@@ -1396,8 +1467,9 @@ static void tcg_out_qemu_st(TCGContext *s, const TCGArg *args,
             seg = guest_base_flags;
             offset = 0;
         } else if (TCG_TARGET_REG_BITS == 64 && offset != GUEST_BASE) {
-            tcg_out_movi(s, TCG_TYPE_I64, TCG_REG_L1, GUEST_BASE);
-            tgen_arithr(s, ARITH_ADD + P_REXW, TCG_REG_L1, base);
+            /* lea (base, TCG_GUEST_BASE_REG), L1 */
+            tcg_out_modrm_sib_offset(s, OPC_LEA + P_REXW, TCG_REG_L1, base,
+                                     TCG_GUEST_BASE_REG, 0, 0);
             base = TCG_REG_L1;
             offset = 0;
         }
@@ -1662,6 +1734,53 @@ void tcg_out_tb_finalize(TCGContext *s)
 }
 #endif  /* CONFIG_SOFTMMU */
 
+#if TCG_TARGET_HAS_vec128
+/* TCG allocates no SSE registers, so %xmm0 and %xmm1 are free scratch;
+   both are call-clobbered on every x86-64 ABI.  The operands are not
+   known to be 16-byte aligned, which the SSE memory forms require, so
+   they are moved in and out with movups.  */
+static void tcg_out_vec128(TCGContext *s, TCGReg base, TCGArg op,
+                           tcg_target_long dofs, tcg_target_long aofs,
+                           tcg_target_long bofs)
+{
+    static const int vec_opc[] = {
+        [TCG_VEC_AND] = OPC_PAND,
+        [TCG_VEC_OR] = OPC_POR,
+        [TCG_VEC_XOR] = OPC_PXOR,
+        [TCG_VEC_ADD8] = OPC_PADDB,
+        [TCG_VEC_ADD16] = OPC_PADDW,
+        [TCG_VEC_ADD32] = OPC_PADDD,
+        [TCG_VEC_ADD64] = OPC_PADDQ,
+        [TCG_VEC_SUB8] = OPC_PSUBB,
+        [TCG_VEC_SUB16] = OPC_PSUBW,
+        [TCG_VEC_SUB32] = OPC_PSUBD,
+        [TCG_VEC_SUB64] = OPC_PSUBQ,
+    };
+    int res = 0;
+
+    tcg_out_modrm_offset(s, OPC_MOVUPS_VxWx, 0, base, aofs);
+    switch (op) {
+    case TCG_VEC_MOV:
+        break;
+    case TCG_VEC_SHUF32:
+        tcg_out_modrm(s, OPC_PSHUFD, 0, 0);
+        tcg_out8(s, bofs);
+        break;
+    case TCG_VEC_ANDC:
+        /* pandn complements its destination */
+        tcg_out_modrm_offset(s, OPC_MOVUPS_VxWx, 1, base, bofs);
+        tcg_out_modrm(s, OPC_PANDN, 1, 0);
+        res = 1;
+        break;
+    default:
+        tcg_out_modrm_offset(s, OPC_MOVUPS_VxWx, 1, base, bofs);
+        tcg_out_modrm(s, vec_opc[op], 0, 1);
+        break;
+    }
+    tcg_out_modrm_offset(s, OPC_MOVUPS_WxVx, res, base, dofs);
+}
+#endif
+
 static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
                               const TCGArg *args, const int *const_args)
 {
@@ -1679,12 +1798,21 @@ static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
 
     switch(opc) {
     case INDEX_op_exit_tb:
-        tcg_out_movi(s, TCG_TYPE_PTR, TCG_REG_EAX, args[0]);
+        if (s->code_relocatable && args[0]) {
+            tcg_out_movi_reloc(s, TCG_REG_EAX, TCG_CODE_ABS, args[0]);
+        } else {
+            tcg_out_movi(s, TCG_TYPE_PTR, TCG_REG_EAX, args[0]);
+        }
         tcg_out_jmp(s, (tcg_target_long) tb_ret_addr);
         break;
     case INDEX_op_goto_tb:
         if (s->tb_jmp_offset) {
-            /* direct jump method */
+            /* direct jump method; align the displacement so that
+               tb_set_jmp_target1 patches it atomically while other
+               vCPU threads may be executing it */
+            while (((tcg_target_long)s->code_ptr + 1) & 3) {
+                tcg_out8(s, 0x90); /* nop */
+            }
             tcg_out8(s, OPC_JMP_long); /* jmp im */
             s->tb_jmp_offset[args[0]] = s->code_ptr - s->code_buf;
             tcg_out32(s, 0);
@@ -1695,6 +1823,10 @@ static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
         }
         s->tb_next_offset[args[0]] = s->code_ptr - s->code_buf;
         break;
+    case INDEX_op_goto_ptr:
+        /* jmp *reg */
+        tcg_out_modrm(s, OPC_GRP5, EXT5_JMPN_Ev, args[0]);
+        break;
     case INDEX_op_call:
         if (const_args[0]) {
             tcg_out_calli(s, args[0]);
@@ -2007,6 +2139,12 @@ static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
         break;
 #endif
 
+#if TCG_TARGET_HAS_vec128
+    case INDEX_op_vec128:
+        tcg_out_vec128(s, args[0], args[1], args[2], args[3], args[4]);
+        break;
+#endif
+
     OP_32_64(deposit):
         if (args[3] == 0 && args[4] == 8) {
             /* load bits 0..7 */
@@ -2033,6 +2171,7 @@ static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
 static const TCGTargetOpDef x86_op_defs[] = {
     { INDEX_op_exit_tb, { } },
     { INDEX_op_goto_tb, { } },
+    { INDEX_op_goto_ptr, { "r" } },
     { INDEX_op_call, { "ri" } },
     { INDEX_op_br, { } },
     { INDEX_op_mov_i32, { "r", "r" } },
@@ -2137,6 +2276,7 @@ static const TCGTargetOpDef x86_op_defs[] = {
     { INDEX_op_ext32u_i64, { "r", "r" } },
 
     { INDEX_op_deposit_i64, { "Q", "0", "Q" } },
+    { INDEX_op_vec128, { "r" } },
     { INDEX_op_movcond_i64, { "r", "r", "re", "r", "0" } },
 
     { INDEX_op_mulu2_i64, { "a", "d", "a", "r" } },
@@ -2238,6 +2378,21 @@ static void tcg_target_qemu_prologue(TCGContext *s)
         tcg_out_push(s, tcg_target_callee_save_regs[i]);
     }
 
+#if !defined(CONFIG_SOFTMMU)
+    /* Try to set up a segment register to point to GUEST_BASE.  If that
+       fails and GUEST_BASE is too large for a displacement, keep it in a
+       register so that guest accesses need one lea, not movabs and add.  */
+    if (GUEST_BASE) {
+        setup_guest_base_seg();
+        if (TCG_TARGET_REG_BITS == 64 && !guest_base_flags
+            && GUEST_BASE != (int32_t)GUEST_BASE) {
+            tcg_out_movi(s, TCG_TYPE_PTR, TCG_GUEST_BASE_REG, GUEST_BASE);
+            tcg_regset_set_reg(s->reserved_regs, TCG_GUEST_BASE_REG);
+        }
+    }
+    s->code_config |= guest_base_flags;
+#endif
+
 #if TCG_TARGET_REG_BITS == 32
     tcg_out_ld(s, TCG_TYPE_PTR, TCG_AREG0, TCG_REG_ESP,
                (ARRAY_SIZE(tcg_target_callee_save_regs) + 1) * 4);
@@ -2253,6 +2408,10 @@ static void tcg_target_qemu_prologue(TCGContext *s)
     tcg_out_modrm(s, OPC_GRP5, EXT5_JMPN_Ev, tcg_target_call_iarg_regs[1]);
 #endif
 
+    /* goto_ptr to here leaves the TB like exit_tb(0) */
+    s->code_gen_epilogue = s->code_ptr;
+    tcg_out_movi(s, TCG_TYPE_PTR, TCG_REG_EAX, 0);
+
     /* TB epilogue */
     tb_ret_addr = s->code_ptr;
 
@@ -2262,13 +2421,6 @@ static void tcg_target_qemu_prologue(TCGContext *s)
         tcg_out_pop(s, tcg_target_callee_save_regs[i]);
     }
     tcg_out_opc(s, OPC_RET, 0, 0, 0);
-
-#if !defined(CONFIG_SOFTMMU)
-    /* Try to set up a segment register to point to GUEST_BASE.  */
-    if (GUEST_BASE) {
-        setup_guest_base_seg();
-    }
-#endif
 }
 
 static void tcg_target_init(TCGContext *s)
@@ -2282,6 +2434,7 @@ static void tcg_target_init(TCGContext *s)
         have_cmov = (__get_cpuid(1, &a, &b, &c, &d) && (d & bit_CMOV));
     }
 #endif
+    s->code_config = have_cmov;
 
 #if !defined(CONFIG_USER_ONLY)
     /* fail safe */
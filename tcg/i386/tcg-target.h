@@ -122,8 +122,13 @@ typedef enum {
 #define TCG_TARGET_HAS_sub2_i64         1
 #define TCG_TARGET_HAS_mulu2_i64        1
 #define TCG_TARGET_HAS_muls2_i64        1
+/* SSE2 is part of x86-64 */
+#define TCG_TARGET_HAS_vec128           1
 #endif
 
+#define TCG_TARGET_HAS_code_relocs      1
+#define TCG_TARGET_HAS_goto_ptr         1
+
 #define TCG_TARGET_deposit_i32_valid(ofs, len) \
     (((ofs) == 0 && (len) == 8) || ((ofs) == 8 && (len) == 8) || \
      ((ofs) == 0 && (len) == 16))
@@ -47,10 +47,75 @@ struct tcg_temp_info {
     uint16_t next_copy;
     tcg_target_ulong val;
     tcg_target_ulong mask;
+    /* the value is the sign extension of its low SEXT bits; 64 if unknown */
+    uint8_t sext;
 };
 
 static struct tcg_temp_info temps[TCG_MAX_TEMPS];
 
+unsigned int tcg_opt_flags = TCG_OPT_ALL;
+
+static const struct {
+    const char *name;
+    unsigned int mask;
+    const char *help;
+} tcg_opt_passes[] = {
+    { "copy", TCG_OPT_COPY,
+      "copy and constant propagation, also past conditional branches" },
+    { "fold", TCG_OPT_FOLD,
+      "constant folding and algebraic simplification" },
+    { "bits", TCG_OPT_BITS,
+      "known-zero bits and sign extension tracking" },
+    { "strength", TCG_OPT_STRENGTH,
+      "multiplications by constants to shifts, adds and negations" },
+    { "dce", TCG_OPT_DCE,
+      "removal of ops that follow a jump or exit_tb" },
+};
+
+int tcg_opt_parse(const char *str)
+{
+    const char *p, *end;
+    int i, mask = 0;
+
+    if (!strcmp(str, "all")) {
+        return TCG_OPT_ALL;
+    }
+    if (!strcmp(str, "none")) {
+        return 0;
+    }
+    for (p = str; ; p = end + 1) {
+        end = strchr(p, ',');
+        if (!end) {
+            end = p + strlen(p);
+        }
+        for (i = 0; i < ARRAY_SIZE(tcg_opt_passes); i++) {
+            if (strlen(tcg_opt_passes[i].name) == end - p &&
+                !memcmp(tcg_opt_passes[i].name, p, end - p)) {
+                mask |= tcg_opt_passes[i].mask;
+                break;
+            }
+        }
+        if (i == ARRAY_SIZE(tcg_opt_passes)) {
+            return -1;
+        }
+        if (*end == '\0') {
+            break;
+        }
+    }
+    return mask;
+}
+
+void tcg_opt_print_passes(FILE *f)
+{
+    int i;
+
+    fprintf(f, "TCG optimizer passes (all, none, or a comma separated list):\n");
+    for (i = 0; i < ARRAY_SIZE(tcg_opt_passes); i++) {
+        fprintf(f, "%-10s %s\n", tcg_opt_passes[i].name,
+                tcg_opt_passes[i].help);
+    }
+}
+
 /* Reset TEMP's state to TCG_TEMP_UNDEF.  If TEMP only had one copy, remove
    the copy flag from the left temp.  */
 static void reset_temp(TCGArg temp)
@@ -65,6 +130,7 @@ static void reset_temp(TCGArg temp)
     }
     temps[temp].state = TCG_TEMP_UNDEF;
     temps[temp].mask = -1;
+    temps[temp].sext = 64;
 }
 
 /* Reset all temporaries, given that there are NB_TEMPS of them.  */
@@ -74,9 +140,30 @@ static void reset_all_temps(int nb_temps)
     for (i = 0; i < nb_temps; i++) {
         temps[i].state = TCG_TEMP_UNDEF;
         temps[i].mask = -1;
+        temps[i].sext = 64;
+    }
+}
+
+/* A conditional branch ends the basic block, but the ops that follow it
+   are only reached by falling through, so what we know about globals and
+   local temps still holds there.  Normal temps die at the branch.  */
+static void reset_temps_cond_branch(TCGContext *s)
+{
+    int i;
+
+    for (i = s->nb_globals; i < s->nb_temps; i++) {
+        if (!s->temps[i].temp_local) {
+            reset_temp(i);
+        }
     }
 }
 
+static bool temp_matches_op(TCGContext *s, TCGOpcode op, TCGArg temp)
+{
+    return s->temps[temp].type ==
+        (tcg_op_defs[op].flags & TCG_OPF_64BIT ? TCG_TYPE_I64 : TCG_TYPE_I32);
+}
+
 static int op_bits(TCGOpcode op)
 {
     const TCGOpDef *def = &tcg_op_defs[op];
@@ -156,6 +243,10 @@ static void tcg_opt_gen_mov(TCGContext *s, TCGArg *gen_args,
     assert(temps[src].state != TCG_TEMP_CONST);
 
     if (s->temps[src].type == s->temps[dst].type) {
+        temps[dst].sext = temps[src].sext;
+    }
+    if ((tcg_opt_flags & TCG_OPT_COPY)
+        && s->temps[src].type == s->temps[dst].type) {
         if (temps[src].state != TCG_TEMP_COPY) {
             temps[src].state = TCG_TEMP_COPY;
             temps[src].next_copy = src;
@@ -175,8 +266,10 @@ static void tcg_opt_gen_mov(TCGContext *s, TCGArg *gen_args,
 static void tcg_opt_gen_movi(TCGArg *gen_args, TCGArg dst, TCGArg val)
 {
     reset_temp(dst);
-    temps[dst].state = TCG_TEMP_CONST;
-    temps[dst].val = val;
+    if (tcg_opt_flags & TCG_OPT_FOLD) {
+        temps[dst].state = TCG_TEMP_CONST;
+        temps[dst].val = val;
+    }
     temps[dst].mask = val;
     gen_args[0] = dst;
     gen_args[1] = val;
@@ -483,8 +576,8 @@ static bool swap_commutative2(TCGArg *p1, TCGArg *p2)
 static TCGArg *tcg_constant_folding(TCGContext *s, uint16_t *tcg_opc_ptr,
                                     TCGArg *args, TCGOpDef *tcg_op_defs)
 {
-    int i, nb_ops, op_index, nb_temps, nb_globals, nb_call_args;
-    tcg_target_ulong mask, affected;
+    int i, nb_ops, op_index, nb_temps, nb_globals, nb_call_args, sext;
+    tcg_target_ulong mask, partmask, affected;
     TCGOpcode op;
     const TCGOpDef *def;
     TCGArg *gen_args;
@@ -628,11 +721,17 @@ static TCGArg *tcg_constant_folding(TCGContext *s, uint16_t *tcg_opc_ptr,
             break;
         }
 
-        /* Simplify using known-zero bits */
+        /* Simplify using known-zero bits and known sign extensions */
         mask = -1;
         affected = -1;
-        switch (op) {
+        sext = 64;
+        switch (tcg_opt_flags & TCG_OPT_BITS ? op : INDEX_op_nop) {
         CASE_OP_32_64(ext8s):
+            sext = 8;
+            if (temps[args[1]].sext <= 8 && temp_matches_op(s, op, args[1])) {
+                affected = 0;
+                break;
+            }
             if ((temps[args[1]].mask & 0x80) != 0) {
                 break;
             }
@@ -640,6 +739,11 @@ static TCGArg *tcg_constant_folding(TCGContext *s, uint16_t *tcg_opc_ptr,
             mask = 0xff;
             goto and_const;
         CASE_OP_32_64(ext16s):
+            sext = 16;
+            if (temps[args[1]].sext <= 16 && temp_matches_op(s, op, args[1])) {
+                affected = 0;
+                break;
+            }
             if ((temps[args[1]].mask & 0x8000) != 0) {
                 break;
             }
@@ -647,6 +751,11 @@ static TCGArg *tcg_constant_folding(TCGContext *s, uint16_t *tcg_opc_ptr,
             mask = 0xffff;
             goto and_const;
         case INDEX_op_ext32s_i64:
+            sext = 32;
+            if (temps[args[1]].sext <= 32 && temp_matches_op(s, op, args[1])) {
+                affected = 0;
+                break;
+            }
             if ((temps[args[1]].mask & 0x80000000) != 0) {
                 break;
             }
@@ -665,20 +774,17 @@ static TCGArg *tcg_constant_folding(TCGContext *s, uint16_t *tcg_opc_ptr,
 
         CASE_OP_32_64(sar):
             if (temps[args[2]].state == TCG_TEMP_CONST) {
-                mask = ((tcg_target_long)temps[args[1]].mask
-                        >> temps[args[2]].val);
+                tmp = temps[args[2]].val & (op_bits(op) - 1);
+                mask = do_constant_folding(op, temps[args[1]].mask, tmp);
+                sext = op_bits(op) - tmp;
             }
             break;
 
         CASE_OP_32_64(shr):
-            if (temps[args[2]].state == TCG_TEMP_CONST) {
-                mask = temps[args[1]].mask >> temps[args[2]].val;
-            }
-            break;
-
         CASE_OP_32_64(shl):
             if (temps[args[2]].state == TCG_TEMP_CONST) {
-                mask = temps[args[1]].mask << temps[args[2]].val;
+                tmp = temps[args[2]].val & (op_bits(op) - 1);
+                mask = do_constant_folding(op, temps[args[1]].mask, tmp);
             }
             break;
 
@@ -710,7 +816,17 @@ static TCGArg *tcg_constant_folding(TCGContext *s, uint16_t *tcg_opc_ptr,
             break;
         }
 
-        if (mask == 0) {
+        /* 32-bit ops only define the low half of a 64-bit host register.
+           The tests below can ignore the high bits, but what we remember
+           about the result must say that they are unknown.  */
+        partmask = mask;
+        if (!(def->flags & TCG_OPF_64BIT)) {
+            mask |= ~(tcg_target_ulong)0xffffffffu;
+            partmask &= 0xffffffffu;
+            affected &= 0xffffffffu;
+        }
+
+        if (partmask == 0) {
             assert(def->nb_oargs == 1);
             s->gen_opc_buf[op_index] = op_to_movi(op);
             tcg_opt_gen_movi(gen_args, args[0], 0);
@@ -752,6 +868,58 @@ static TCGArg *tcg_constant_folding(TCGContext *s, uint16_t *tcg_opc_ptr,
             break;
         }
 
+        /* Strength reduction: "mul r, a, 1 => mov r, a",
+           "mul r, a, 2 => add r, a, a" and "mul r, a, -1 => neg r, a".
+           Powers of two are turned into shifts by tcg_gen_muli_*.  */
+        switch (tcg_opt_flags & TCG_OPT_STRENGTH ? op : INDEX_op_nop) {
+        CASE_OP_32_64(mul):
+            if (temps[args[1]].state == TCG_TEMP_CONST
+                || temps[args[2]].state != TCG_TEMP_CONST) {
+                break;
+            }
+            tmp = temps[args[2]].val;
+            if (op_bits(op) == 32) {
+                tmp = (int32_t)tmp;
+            }
+            if (tmp == 1) {
+                if (temps_are_copies(args[0], args[1])) {
+                    s->gen_opc_buf[op_index] = INDEX_op_nop;
+                } else {
+                    s->gen_opc_buf[op_index] = op_to_mov(op);
+                    tcg_opt_gen_mov(s, gen_args, args[0], args[1]);
+                    gen_args += 2;
+                }
+                args += 3;
+                continue;
+            }
+            if (tmp == 2) {
+                s->gen_opc_buf[op_index] = op == INDEX_op_mul_i32 ?
+                    INDEX_op_add_i32 : INDEX_op_add_i64;
+                reset_temp(args[0]);
+                gen_args[0] = args[0];
+                gen_args[1] = args[1];
+                gen_args[2] = args[1];
+                args += 3;
+                gen_args += 3;
+                continue;
+            }
+            if (tmp == (TCGArg)-1
+                && (op == INDEX_op_mul_i32 ? TCG_TARGET_HAS_neg_i32
+                    : TCG_TARGET_HAS_neg_i64)) {
+                s->gen_opc_buf[op_index] = op == INDEX_op_mul_i32 ?
+                    INDEX_op_neg_i32 : INDEX_op_neg_i64;
+                reset_temp(args[0]);
+                gen_args[0] = args[0];
+                gen_args[1] = args[1];
+                args += 3;
+                gen_args += 2;
+                continue;
+            }
+            break;
+        default:
+            break;
+        }
+
         /* Simplify expression for "op r, a, a => mov r, a" cases */
         switch (op) {
         CASE_OP_32_64(or):
@@ -811,6 +979,15 @@ static TCGArg *tcg_constant_folding(TCGContext *s, uint16_t *tcg_opc_ptr,
             args[1] = temps[args[1]].val;
             /* fallthrough */
         CASE_OP_32_64(movi):
+            /* Storing again the value that a global already holds, as
+               frontends do with their lazily computed condition codes,
+               is a no-op.  */
+            if (temps[args[0]].state == TCG_TEMP_CONST
+                && temps[args[0]].val == args[1]) {
+                s->gen_opc_buf[op_index] = INDEX_op_nop;
+                args += 2;
+                break;
+            }
             tcg_opt_gen_movi(gen_args, args[0], args[1]);
             gen_args += 2;
             args += 2;
@@ -1062,13 +1239,27 @@ static TCGArg *tcg_constant_folding(TCGContext *s, uint16_t *tcg_opc_ptr,
                to compute the operation result) so no propagation is done.
                We trash everything if the operation is the end of a basic
                block, otherwise we only trash the output args.  "mask" is
-               the non-zero bits mask for the first output arg.  */
+               the non-zero bits mask for the first output arg, and "sext"
+               the sign extension it is known to have.  */
             if (def->flags & TCG_OPF_BB_END) {
-                reset_all_temps(nb_temps);
+                if ((tcg_opt_flags & TCG_OPT_COPY)
+                    && (op == INDEX_op_brcond_i32
+                        || op == INDEX_op_brcond_i64
+                        || op == INDEX_op_brcond2_i32)) {
+                    reset_temps_cond_branch(s);
+                } else {
+                    reset_all_temps(nb_temps);
+                }
             } else {
                 for (i = 0; i < def->nb_oargs; i++) {
                     reset_temp(args[i]);
                 }
+                if (def->nb_oargs == 1) {
+                    temps[args[0]].mask = mask;
+                    if (temp_matches_op(s, op, args[0])) {
+                        temps[args[0]].sext = sext;
+                    }
+                }
             }
             for (i = 0; i < def->nb_args; i++) {
                 gen_args[i] = args[i];
@@ -1082,10 +1273,69 @@ static TCGArg *tcg_constant_folding(TCGContext *s, uint16_t *tcg_opc_ptr,
     return gen_args;
 }
 
+/* set a nop for an operation using 'nb_args' */
+static void tcg_opt_set_nop(uint16_t *opc_ptr, TCGArg *args, int nb_args)
+{
+    if (nb_args == 0) {
+        *opc_ptr = INDEX_op_nop;
+    } else {
+        *opc_ptr = INDEX_op_nopn;
+        args[0] = nb_args;
+        args[nb_args - 1] = nb_args;
+    }
+}
+
+/* Remove the ops that follow a "br", "exit_tb" or "goto_ptr" up to the next
+   label, which folded conditional branches leave behind, and a "br" to the
+   label that follows it.  */
+static void tcg_dead_code(TCGContext *s, uint16_t *tcg_opc_ptr, TCGArg *args,
+                          TCGOpDef *tcg_op_defs)
+{
+    int op_index, nb_ops, nb_args;
+    uint16_t *br_opc = NULL;
+    TCGArg *br_args = NULL;
+    bool dead = false;
+    TCGOpcode op;
+
+    nb_ops = tcg_opc_ptr - s->gen_opc_buf;
+    for (op_index = 0; op_index < nb_ops; op_index++, args += nb_args) {
+        op = s->gen_opc_buf[op_index];
+        if (op == INDEX_op_call) {
+            nb_args = (args[0] >> 16) + (args[0] & 0xffff) + 3;
+        } else if (op == INDEX_op_nopn) {
+            nb_args = args[0];
+        } else {
+            nb_args = tcg_op_defs[op].nb_args;
+        }
+
+        if (op == INDEX_op_set_label) {
+            if (br_opc && br_args[0] == args[0]) {
+                tcg_opt_set_nop(br_opc, br_args, 1);
+            }
+            br_opc = NULL;
+            dead = false;
+        } else if (dead) {
+            tcg_opt_set_nop(&s->gen_opc_buf[op_index], args, nb_args);
+        } else if (op == INDEX_op_br || op == INDEX_op_exit_tb ||
+                   op == INDEX_op_goto_ptr) {
+            if (op == INDEX_op_br) {
+                br_opc = &s->gen_opc_buf[op_index];
+                br_args = args;
+            }
+            dead = true;
+        } else if (op != INDEX_op_nop) {
+            br_opc = NULL;
+        }
+    }
+}
+
 TCGArg *tcg_optimize(TCGContext *s, uint16_t *tcg_opc_ptr,
         TCGArg *args, TCGOpDef *tcg_op_defs)
 {
     TCGArg *res;
     res = tcg_constant_folding(s, tcg_opc_ptr, args, tcg_op_defs);
+    if (tcg_opt_flags & TCG_OPT_DCE) {
+        tcg_dead_code(s, tcg_opc_ptr, args, tcg_op_defs);
+    }
     return res;
 }
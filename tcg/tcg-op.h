@@ -22,6 +22,7 @@
  * THE SOFTWARE.
  */
 #include "tcg.h"
+#include "qemu/host-utils.h"
 
 int gen_new_label(void);
 
@@ -394,7 +395,7 @@ static inline void tcg_gen_helperN(void *func, int flags, int sizemask,
                                    TCGArg ret, int nargs, TCGArg *args)
 {
     TCGv_ptr fn;
-    fn = tcg_const_ptr(func);
+    fn = tcg_const_func_ptr(func);
     tcg_gen_callN(&tcg_ctx, fn, flags, sizemask, ret,
                   nargs, args);
     tcg_temp_free_ptr(fn);
@@ -410,7 +411,7 @@ static inline void tcg_gen_helper32(void *func, int sizemask, TCGv_i32 ret,
 {
     TCGv_ptr fn;
     TCGArg args[2];
-    fn = tcg_const_ptr(func);
+    fn = tcg_const_func_ptr(func);
     args[0] = GET_TCGV_I32(a);
     args[1] = GET_TCGV_I32(b);
     tcg_gen_callN(&tcg_ctx, fn,
@@ -424,7 +425,7 @@ static inline void tcg_gen_helper64(void *func, int sizemask, TCGv_i64 ret,
 {
     TCGv_ptr fn;
     TCGArg args[2];
-    fn = tcg_const_ptr(func);
+    fn = tcg_const_func_ptr(func);
     args[0] = GET_TCGV_I64(a);
     args[1] = GET_TCGV_I64(b);
     tcg_gen_callN(&tcg_ctx, fn,
@@ -705,9 +706,14 @@ static inline void tcg_gen_mul_i32(TCGv_i32 ret, TCGv_i32 arg1, TCGv_i32 arg2)
 
 static inline void tcg_gen_muli_i32(TCGv_i32 ret, TCGv_i32 arg1, int32_t arg2)
 {
-    TCGv_i32 t0 = tcg_const_i32(arg2);
-    tcg_gen_mul_i32(ret, arg1, t0);
-    tcg_temp_free_i32(t0);
+    if ((tcg_opt_flags & TCG_OPT_STRENGTH) && arg2 > 0
+        && is_power_of_2(arg2)) {
+        tcg_gen_shli_i32(ret, arg1, ctz32(arg2));
+    } else {
+        TCGv_i32 t0 = tcg_const_i32(arg2);
+        tcg_gen_mul_i32(ret, arg1, t0);
+        tcg_temp_free_i32(t0);
+    }
 }
 
 static inline void tcg_gen_div_i32(TCGv_i32 ret, TCGv_i32 arg1, TCGv_i32 arg2)
@@ -1469,9 +1475,14 @@ static inline void tcg_gen_setcondi_i64(TCGCond cond, TCGv_i64 ret,
 
 static inline void tcg_gen_muli_i64(TCGv_i64 ret, TCGv_i64 arg1, int64_t arg2)
 {
-    TCGv_i64 t0 = tcg_const_i64(arg2);
-    tcg_gen_mul_i64(ret, arg1, t0);
-    tcg_temp_free_i64(t0);
+    if ((tcg_opt_flags & TCG_OPT_STRENGTH) && arg2 > 0
+        && is_power_of_2(arg2)) {
+        tcg_gen_shli_i64(ret, arg1, ctz64(arg2));
+    } else {
+        TCGv_i64 t0 = tcg_const_i64(arg2);
+        tcg_gen_mul_i64(ret, arg1, t0);
+        tcg_temp_free_i64(t0);
+    }
 }
 
 
@@ -2530,6 +2541,113 @@ static inline void tcg_gen_muls2_i64(TCGv_i64 rl, TCGv_i64 rh,
     }
 }
 
+/* Lane-wise add or subtract of 64-bit words.  H has the top bit of each
+   lane set; masking it off the inputs keeps carries and borrows from
+   crossing into the next lane, and the top bits are fixed up after.  */
+static inline void tcg_gen_vec_addsub_i64(TCGv_i64 ret, TCGv_i64 a,
+                                          TCGv_i64 b, uint64_t h, bool sub)
+{
+    TCGv_i64 t0 = tcg_temp_new_i64();
+    TCGv_i64 t1 = tcg_temp_new_i64();
+    TCGv_i64 t2 = tcg_temp_new_i64();
+
+    if (sub) {
+        /* ((a | H) - (b & ~H)) ^ ((a ^ ~b) & H) */
+        tcg_gen_ori_i64(t0, a, h);
+        tcg_gen_andi_i64(t1, b, ~h);
+        tcg_gen_eqv_i64(t2, a, b);
+        tcg_gen_sub_i64(ret, t0, t1);
+    } else {
+        /* ((a & ~H) + (b & ~H)) ^ ((a ^ b) & H) */
+        tcg_gen_andi_i64(t0, a, ~h);
+        tcg_gen_andi_i64(t1, b, ~h);
+        tcg_gen_xor_i64(t2, a, b);
+        tcg_gen_add_i64(ret, t0, t1);
+    }
+    tcg_gen_andi_i64(t2, t2, h);
+    tcg_gen_xor_i64(ret, ret, t2);
+    tcg_temp_free_i64(t0);
+    tcg_temp_free_i64(t1);
+    tcg_temp_free_i64(t2);
+}
+
+/* 128-bit vector operation on memory at BASE + ofs; see tcg/README.  */
+static inline void tcg_gen_vec128(TCGVecOp op, TCGv_ptr base, TCGArg dofs,
+                                  TCGArg aofs, TCGArg bofs)
+{
+    static const uint64_t lane_top[4] = {
+        0x8080808080808080ull, 0x8000800080008000ull,
+        0x8000000080000000ull, 0x8000000000000000ull,
+    };
+    TCGv_i64 a, b;
+    int i;
+
+    if (TCG_TARGET_HAS_vec128) {
+        *tcg_ctx.gen_opc_ptr++ = INDEX_op_vec128;
+        *tcg_ctx.gen_opparam_ptr++ = GET_TCGV_PTR(base);
+        *tcg_ctx.gen_opparam_ptr++ = op;
+        *tcg_ctx.gen_opparam_ptr++ = dofs;
+        *tcg_ctx.gen_opparam_ptr++ = aofs;
+        *tcg_ctx.gen_opparam_ptr++ = bofs;
+        return;
+    }
+
+    if (op == TCG_VEC_SHUF32) {
+        TCGv_i32 t[4];
+
+        /* All lanes are read before any is written, DOFS may be AOFS.  */
+        for (i = 0; i < 4; i++) {
+            t[i] = tcg_temp_new_i32();
+            tcg_gen_ld_i32(t[i], base, aofs + ((bofs >> (2 * i)) & 3) * 4);
+        }
+        for (i = 0; i < 4; i++) {
+            tcg_gen_st_i32(t[i], base, dofs + i * 4);
+            tcg_temp_free_i32(t[i]);
+        }
+        return;
+    }
+
+    a = tcg_temp_new_i64();
+    b = tcg_temp_new_i64();
+    for (i = 0; i < 16; i += 8) {
+        tcg_gen_ld_i64(a, base, aofs + i);
+        if (op != TCG_VEC_MOV) {
+            tcg_gen_ld_i64(b, base, bofs + i);
+        }
+        switch (op) {
+        case TCG_VEC_AND:
+            tcg_gen_and_i64(a, a, b);
+            break;
+        case TCG_VEC_OR:
+            tcg_gen_or_i64(a, a, b);
+            break;
+        case TCG_VEC_XOR:
+            tcg_gen_xor_i64(a, a, b);
+            break;
+        case TCG_VEC_ANDC:
+            tcg_gen_andc_i64(a, a, b);
+            break;
+        case TCG_VEC_ADD64:
+            tcg_gen_add_i64(a, a, b);
+            break;
+        case TCG_VEC_SUB64:
+            tcg_gen_sub_i64(a, a, b);
+            break;
+        case TCG_VEC_ADD8 ... TCG_VEC_ADD32:
+            tcg_gen_vec_addsub_i64(a, a, b, lane_top[op - TCG_VEC_ADD8], false);
+            break;
+        case TCG_VEC_SUB8 ... TCG_VEC_SUB32:
+            tcg_gen_vec_addsub_i64(a, a, b, lane_top[op - TCG_VEC_SUB8], true);
+            break;
+        default:
+            break;
+        }
+        tcg_gen_st_i64(a, base, dofs + i);
+    }
+    tcg_temp_free_i64(a);
+    tcg_temp_free_i64(b);
+}
+
 /***************************************/
 /* QEMU specific operations. Their type depend on the QEMU CPU
    type. */
@@ -2592,6 +2710,15 @@ static inline void tcg_gen_goto_tb(unsigned idx)
     tcg_gen_op1i(INDEX_op_goto_tb, idx);
 }
 
+/* Jump to the host code at @ptr, which is either a TB or
+   tcg_ctx.code_gen_epilogue.  */
+static inline void tcg_gen_goto_ptr(TCGv_ptr ptr)
+{
+    tcg_debug_assert(TCG_TARGET_HAS_goto_ptr);
+    *tcg_ctx.gen_opc_ptr++ = INDEX_op_goto_ptr;
+    *tcg_ctx.gen_opparam_ptr++ = GET_TCGV_PTR(ptr);
+}
+
 #if TCG_TARGET_REG_BITS == 32
 static inline void tcg_gen_qemu_ld8u(TCGv ret, TCGv addr, int mem_index)
 {
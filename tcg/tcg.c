@@ -296,6 +296,12 @@ void tcg_func_start(TCGContext *s)
     s->gen_opc_ptr = s->gen_opc_buf;
     s->gen_opparam_ptr = s->gen_opparam_buf;
 
+    s->code_uncacheable = false;
+    s->nb_code_relocs = 0;
+    if (s->code_relocatable) {
+        s->code_relocs = tcg_malloc(sizeof(TCGCodeReloc) * TCG_MAX_CODE_RELOCS);
+    }
+
 #if defined(CONFIG_QEMU_LDST_OPTIMIZATION) && defined(CONFIG_SOFTMMU)
     /* Initialize qemu_ld/st labels to assist code generation at the end of TB
        for TLB miss cases at the end of TB */
@@ -305,6 +311,20 @@ void tcg_func_start(TCGContext *s)
 #endif
 }
 
+void tcg_code_reloc(TCGContext *s, int type, tcg_target_long value)
+{
+    TCGCodeReloc *r;
+
+    if (s->nb_code_relocs >= TCG_MAX_CODE_RELOCS) {
+        s->code_uncacheable = true;
+        return;
+    }
+    r = &s->code_relocs[s->nb_code_relocs++];
+    r->offset = s->code_ptr - s->code_buf;
+    r->type = type;
+    r->value = value;
+}
+
 static inline void tcg_temp_alloc(TCGContext *s, int n)
 {
     if (n > TCG_MAX_TEMPS)
@@ -612,8 +632,9 @@ void tcg_register_helper(void *func, const char *name)
 /* Note: we convert the 64 bit args to 32 bit and do some alignment
    and endian swap. Maybe it would be better to do the alignment
    and endian swap in tcg_reg_alloc_call(). */
-void tcg_gen_callN(TCGContext *s, TCGv_ptr func, unsigned int flags,
-                   int sizemask, TCGArg ret, int nargs, TCGArg *args)
+static void tcg_gen_call_internal(TCGContext *s, TCGv_ptr func,
+                                  unsigned int flags, int sizemask,
+                                  TCGArg ret, int nargs, TCGArg *args)
 {
     int i;
     int real_args;
@@ -716,6 +737,44 @@ void tcg_gen_callN(TCGContext *s, TCGv_ptr func, unsigned int flags,
 #endif /* TCG_TARGET_EXTEND_ARGS */
 }
 
+bool tcg_tb_profile;
+bool tcg_tb_stats;
+int64_t tcg_helper_ticks;
+static int64_t tcg_helper_start;
+
+static void tcg_profile_helper_start(void)
+{
+    tcg_helper_start = cpu_get_real_ticks();
+}
+
+static void tcg_profile_helper_end(void)
+{
+    tcg_helper_ticks += cpu_get_real_ticks() - tcg_helper_start;
+}
+
+static void tcg_gen_profile_hook(TCGContext *s, void (*hook)(void))
+{
+    TCGv_ptr fn = tcg_const_func_ptr(hook);
+
+    tcg_gen_call_internal(s, fn, TCG_CALL_NO_RWG, 0, TCG_CALL_DUMMY_ARG,
+                          0, NULL);
+    tcg_temp_free_ptr(fn);
+}
+
+void tcg_gen_callN(TCGContext *s, TCGv_ptr func, unsigned int flags,
+                   int sizemask, TCGArg ret, int nargs, TCGArg *args)
+{
+    /* calls without side effects are cheap, and may be removed by the
+       liveness pass while the hooks around them would stay */
+    if (tcg_tb_profile && !(flags & TCG_CALL_NO_SIDE_EFFECTS)) {
+        tcg_gen_profile_hook(s, tcg_profile_helper_start);
+        tcg_gen_call_internal(s, func, flags, sizemask, ret, nargs, args);
+        tcg_gen_profile_hook(s, tcg_profile_helper_end);
+    } else {
+        tcg_gen_call_internal(s, func, flags, sizemask, ret, nargs, args);
+    }
+}
+
 #if TCG_TARGET_REG_BITS == 32
 void tcg_gen_shifti_i64(TCGv_i64 ret, TCGv_i64 arg1,
                         int c, int right, int arith)
@@ -791,6 +850,8 @@ static void tcg_reg_alloc_start(TCGContext *s)
     for(i = 0; i < TCG_TARGET_NB_REGS; i++) {
         s->reg_to_temp[i] = -1;
     }
+    s->temp_load_count = 0;
+    s->temp_store_count = 0;
 }
 
 static char *tcg_get_arg_str_idx(TCGContext *s, char *buf, int buf_size,
@@ -1172,6 +1233,22 @@ void tcg_add_target_add_op_defs(const TCGTargetOpDef *tdefs)
 #endif
 }
 
+/* conditional branches are the basic block ends that fall through */
+static inline bool tcg_op_is_cond_branch(TCGOpcode opc)
+{
+    switch (opc) {
+    case INDEX_op_brcond_i32:
+#if TCG_TARGET_REG_BITS == 64
+    case INDEX_op_brcond_i64:
+#else
+    case INDEX_op_brcond2_i32:
+#endif
+        return true;
+    default:
+        return false;
+    }
+}
+
 #ifdef USE_LIVENESS_ANALYSIS
 
 /* set a nop for an operation using 'nb_args' */
@@ -1211,6 +1288,21 @@ static inline void tcg_la_bb_end(TCGContext *s, uint8_t *dead_temps,
     }
 }
 
+/* liveness analysis: conditional branch.  The branch target starts a
+   basic block, so globals must be in memory; but the fall-through path
+   can go on using them from the host registers they already are in.  */
+static inline void tcg_la_cond_branch(TCGContext *s, uint8_t *dead_temps,
+                                      uint8_t *mem_temps)
+{
+    int i;
+
+    memset(dead_temps + s->nb_globals, 1, s->nb_temps - s->nb_globals);
+    memset(mem_temps, 1, s->nb_globals);
+    for(i = s->nb_globals; i < s->nb_temps; i++) {
+        mem_temps[i] = s->temps[i].temp_local;
+    }
+}
+
 /* Liveness analysis : update the opc_dead_args array to tell if a
    given input arguments is dead. Instructions updating dead
    temporaries are removed. */
@@ -1424,7 +1516,9 @@ static void tcg_liveness_analysis(TCGContext *s)
                 }
 
                 /* if end of basic block, update */
-                if (def->flags & TCG_OPF_BB_END) {
+                if (tcg_op_is_cond_branch(op)) {
+                    tcg_la_cond_branch(s, dead_temps, mem_temps);
+                } else if (def->flags & TCG_OPF_BB_END) {
                     tcg_la_bb_end(s, dead_temps, mem_temps);
                 } else if (def->flags & TCG_OPF_SIDE_EFFECTS) {
                     /* globals should be synced to memory */
@@ -1572,6 +1666,7 @@ static inline void tcg_reg_sync(TCGContext *s, int reg)
             temp_allocate_frame(s, temp);
         }
         tcg_out_st(s, ts->type, reg, ts->mem_reg, ts->mem_offset);
+        s->temp_store_count++;
     }
     ts->mem_coherent = 1;
 }
@@ -1604,7 +1699,17 @@ static int tcg_reg_alloc(TCGContext *s, TCGRegSet reg1, TCGRegSet reg2)
             return reg;
     }
 
-    /* XXX: do better spill choice */
+    /* then registers whose value is already in memory, so that spilling
+       them costs no store */
+    for(i = 0; i < ARRAY_SIZE(tcg_target_reg_alloc_order); i++) {
+        reg = tcg_target_reg_alloc_order[i];
+        if (tcg_regset_test_reg(reg_ct, reg) &&
+            s->temps[s->reg_to_temp[reg]].mem_coherent) {
+            tcg_reg_free(s, reg);
+            return reg;
+        }
+    }
+
     for(i = 0; i < ARRAY_SIZE(tcg_target_reg_alloc_order); i++) {
         reg = tcg_target_reg_alloc_order[i];
         if (tcg_regset_test_reg(reg_ct, reg)) {
@@ -1731,6 +1836,27 @@ static void tcg_reg_alloc_bb_end(TCGContext *s, TCGRegSet allocated_regs)
     save_globals(s, allocated_regs);
 }
 
+/* at a conditional branch, the globals are in memory for the branch
+   target, but the liveness analysis lets the fall-through path keep
+   using the registers that hold them. */
+static void tcg_reg_alloc_cond_branch(TCGContext *s, TCGRegSet allocated_regs)
+{
+#ifdef USE_LIVENESS_ANALYSIS
+    int i;
+
+    for(i = s->nb_globals; i < s->nb_temps; i++) {
+        if (s->temps[i].temp_local) {
+            temp_save(s, i, allocated_regs);
+        } else {
+            assert(s->temps[i].val_type == TEMP_VAL_DEAD);
+        }
+    }
+    sync_globals(s, allocated_regs);
+#else
+    tcg_reg_alloc_bb_end(s, allocated_regs);
+#endif
+}
+
 #define IS_DEAD_ARG(n) ((dead_args >> (n)) & 1)
 #define NEED_SYNC_ARG(n) ((sync_args >> (n)) & 1)
 
@@ -1785,6 +1911,7 @@ static void tcg_reg_alloc_mov(TCGContext *s, const TCGOpDef *def,
         ts->reg = tcg_reg_alloc(s, arg_ct->u.regs, allocated_regs);
         if (ts->val_type == TEMP_VAL_MEM) {
             tcg_out_ld(s, ts->type, ts->reg, ts->mem_reg, ts->mem_offset);
+            s->temp_load_count++;
             ts->mem_coherent = 1;
         } else if (ts->val_type == TEMP_VAL_CONST) {
             tcg_out_movi(s, ts->type, ts->reg, ts->val);
@@ -1803,6 +1930,7 @@ static void tcg_reg_alloc_mov(TCGContext *s, const TCGOpDef *def,
             temp_allocate_frame(s, args[0]);
         }
         tcg_out_st(s, ots->type, ts->reg, ots->mem_reg, ots->mem_offset);
+        s->temp_store_count++;
         if (IS_DEAD_ARG(1)) {
             temp_dead(s, args[1]);
         }
@@ -1874,6 +2002,7 @@ static void tcg_reg_alloc_op(TCGContext *s,
         if (ts->val_type == TEMP_VAL_MEM) {
             reg = tcg_reg_alloc(s, arg_ct->u.regs, allocated_regs);
             tcg_out_ld(s, ts->type, reg, ts->mem_reg, ts->mem_offset);
+            s->temp_load_count++;
             ts->val_type = TEMP_VAL_REG;
             ts->reg = reg;
             ts->mem_coherent = 1;
@@ -1933,7 +2062,9 @@ static void tcg_reg_alloc_op(TCGContext *s,
         }
     }
 
-    if (def->flags & TCG_OPF_BB_END) {
+    if (tcg_op_is_cond_branch(opc)) {
+        tcg_reg_alloc_cond_branch(s, allocated_regs);
+    } else if (def->flags & TCG_OPF_BB_END) {
         tcg_reg_alloc_bb_end(s, allocated_regs);
     } else {
         if (def->flags & TCG_OPF_CALL_CLOBBER) {
@@ -2061,6 +2192,7 @@ static int tcg_reg_alloc_call(TCGContext *s, const TCGOpDef *def,
                                     s->reserved_regs);
                 /* XXX: not correct if reading values from the stack */
                 tcg_out_ld(s, ts->type, reg, ts->mem_reg, ts->mem_offset);
+                s->temp_load_count++;
                 tcg_out_st(s, ts->type, reg, TCG_REG_CALL_STACK, stack_offset);
             } else if (ts->val_type == TEMP_VAL_CONST) {
                 reg = tcg_reg_alloc(s, tcg_target_available_regs[ts->type], 
@@ -2091,6 +2223,7 @@ static int tcg_reg_alloc_call(TCGContext *s, const TCGOpDef *def,
                 }
             } else if (ts->val_type == TEMP_VAL_MEM) {
                 tcg_out_ld(s, ts->type, reg, ts->mem_reg, ts->mem_offset);
+                s->temp_load_count++;
             } else if (ts->val_type == TEMP_VAL_CONST) {
                 /* XXX: sign extend ? */
                 tcg_out_movi(s, ts->type, reg, ts->val);
@@ -2110,6 +2243,7 @@ static int tcg_reg_alloc_call(TCGContext *s, const TCGOpDef *def,
     if (ts->val_type == TEMP_VAL_MEM) {
         reg = tcg_reg_alloc(s, arg_ct->u.regs, allocated_regs);
         tcg_out_ld(s, ts->type, reg, ts->mem_reg, ts->mem_offset);
+        s->temp_load_count++;
         func_arg = reg;
         tcg_regset_set_reg(allocated_regs, reg);
     } else if (ts->val_type == TEMP_VAL_REG) {
@@ -2127,6 +2261,7 @@ static int tcg_reg_alloc_call(TCGContext *s, const TCGOpDef *def,
         } else {
             reg = tcg_reg_alloc(s, arg_ct->u.regs, allocated_regs);
             tcg_out_movi(s, ts->type, reg, func_addr);
+            s->code_uncacheable = true;
             func_arg = reg;
             tcg_regset_set_reg(allocated_regs, reg);
         }
@@ -2262,6 +2397,7 @@ static inline int tcg_gen_code_common(TCGContext *s, uint8_t *gen_code_buf,
 
     for(;;) {
         opc = s->gen_opc_buf[op_index];
+        s->gen_opc_code_off[op_index] = s->code_ptr - gen_code_buf;
 #ifdef CONFIG_PROFILER
         tcg_table_op_count[opc]++;
 #endif
@@ -2355,6 +2491,14 @@ int tcg_gen_code(TCGContext *s, uint8_t *gen_code_buf)
 
     tcg_gen_code_common(s, gen_code_buf, -1);
 
+#ifdef DEBUG_DISAS
+    if (unlikely(qemu_loglevel_mask(CPU_LOG_TB_OP_OPT))) {
+        qemu_log("host code size %td bytes, %d temp loads, %d temp stores\n\n",
+                 s->code_ptr - gen_code_buf, s->temp_load_count,
+                 s->temp_store_count);
+    }
+#endif
+
     /* flush instruction cache */
     flush_icache_range((tcg_target_ulong)gen_code_buf,
                        (tcg_target_ulong)s->code_ptr);
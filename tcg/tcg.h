@@ -90,6 +90,22 @@ typedef uint64_t TCGRegSet;
 #define TCG_TARGET_HAS_mulu2_i32        1
 #endif
 
+#ifndef TCG_TARGET_HAS_vec128
+#define TCG_TARGET_HAS_vec128           0
+#endif
+
+/* The backend can record the host addresses that it puts in the code,
+   see TCGContext.code_relocatable.  */
+#ifndef TCG_TARGET_HAS_code_relocs
+#define TCG_TARGET_HAS_code_relocs      0
+#endif
+
+/* The backend can jump to a host address held in a register; it then
+   sets TCGContext.code_gen_epilogue.  */
+#ifndef TCG_TARGET_HAS_goto_ptr
+#define TCG_TARGET_HAS_goto_ptr         0
+#endif
+
 #ifndef TCG_TARGET_deposit_i32_valid
 #define TCG_TARGET_deposit_i32_valid(ofs, len) 1
 #endif
@@ -325,6 +341,25 @@ typedef enum {
     TCG_COND_GTU    = 8 | 4 | 0 | 1,
 } TCGCond;
 
+/* Operations of vec128.  The lane size is in the name; logical
+   operations work on the whole vector.  */
+typedef enum {
+    TCG_VEC_MOV,
+    TCG_VEC_AND,
+    TCG_VEC_OR,
+    TCG_VEC_XOR,
+    TCG_VEC_ANDC,   /* a & ~b */
+    TCG_VEC_ADD8,
+    TCG_VEC_ADD16,
+    TCG_VEC_ADD32,
+    TCG_VEC_ADD64,
+    TCG_VEC_SUB8,
+    TCG_VEC_SUB16,
+    TCG_VEC_SUB32,
+    TCG_VEC_SUB64,
+    TCG_VEC_SHUF32, /* bofs is the lane selector */
+} TCGVecOp;
+
 /* Invert the sense of the comparison.  */
 static inline TCGCond tcg_invert_cond(TCGCond c)
 {
@@ -397,6 +432,23 @@ typedef struct TCGHelperInfo {
 
 typedef struct TCGContext TCGContext;
 
+/* A host address in the generated code of a TB, so that the code can be
+   copied elsewhere and patched with tcg_patch_code_reloc() */
+#define TCG_MAX_CODE_RELOCS 256
+
+enum {
+    TCG_CODE_REL32,   /* 32-bit displacement from the end of the field */
+    TCG_CODE_ABS,     /* pointer-sized absolute address */
+    TCG_CODE_ABS_FAR, /* absolute address of a branch that did not fit
+                         in a TCG_CODE_REL32 */
+};
+
+typedef struct TCGCodeReloc {
+    uint32_t offset;    /* of the field from the start of the code */
+    int type;
+    tcg_target_long value;
+} TCGCodeReloc;
+
 struct TCGContext {
     uint8_t *pool_cur, *pool_end;
     TCGPool *pool_first, *pool_current, *pool_first_large;
@@ -430,6 +482,17 @@ struct TCGContext {
     int frame_reg;
 
     uint8_t *code_ptr;
+
+    /* with code_relocatable set, the backend emits host addresses in a
+       fixed form and records them in code_relocs.  code_uncacheable is
+       set for TBs that use host addresses it cannot record, such as
+       the constants of tcg_const_ptr().  */
+    bool code_relocatable;
+    bool code_uncacheable;
+    int nb_code_relocs;
+    TCGCodeReloc *code_relocs;
+    /* host features and settings that the generated code depends on */
+    uint32_t code_config;
     TCGTemp temps[TCG_MAX_TEMPS]; /* globals first, temps after */
 
     TCGHelperInfo *helpers;
@@ -437,6 +500,11 @@ struct TCGContext {
     int allocated_helpers;
     int helpers_sorted;
 
+    /* temps loaded from and stored to memory by the register allocator
+       in the current TB, reported with -d op_opt */
+    int temp_load_count;
+    int temp_store_count;
+
 #ifdef CONFIG_PROFILER
     /* profiling info */
     int64_t tb_count1;
@@ -469,10 +537,14 @@ struct TCGContext {
     target_ulong gen_opc_pc[OPC_BUF_SIZE];
     uint16_t gen_opc_icount[OPC_BUF_SIZE];
     uint8_t gen_opc_instr_start[OPC_BUF_SIZE];
+    /* offset in the host code where each op starts, set by tcg_gen_code() */
+    uint32_t gen_opc_code_off[OPC_BUF_SIZE];
 
     /* Code generation */
     int code_gen_max_blocks;
     uint8_t *code_gen_prologue;
+    /* epilogue that returns 0 to cpu_exec(), for goto_ptr */
+    uint8_t *code_gen_epilogue;
     uint8_t *code_gen_buffer;
     size_t code_gen_buffer_size;
     /* threshold to flush the translated code buffer */
@@ -519,6 +591,15 @@ void tcg_func_start(TCGContext *s);
 int tcg_gen_code(TCGContext *s, uint8_t *gen_code_buf);
 int tcg_gen_code_search_pc(TCGContext *s, uint8_t *gen_code_buf, long offset);
 
+/* Record the host address @value of a field at s->code_ptr */
+void tcg_code_reloc(TCGContext *s, int type, tcg_target_long value);
+#if TCG_TARGET_HAS_code_relocs
+/* Store @value in the field at @ptr of code that was generated at
+   another address.  Return false if the backend would have used another
+   instruction at @ptr, the code must not be used then.  */
+bool tcg_patch_code_reloc(uint8_t *ptr, int type, tcg_target_long value);
+#endif
+
 void tcg_set_frame(TCGContext *s, int reg,
                    tcg_target_long start, tcg_target_long size);
 
@@ -637,7 +718,10 @@ void tcg_add_target_add_op_defs(const TCGTargetOpDef *tdefs);
 #define TCGV_NAT_TO_PTR(n) MAKE_TCGV_PTR(GET_TCGV_I32(n))
 #define TCGV_PTR_TO_NAT(n) MAKE_TCGV_I32(GET_TCGV_PTR(n))
 
-#define tcg_const_ptr(V) TCGV_NAT_TO_PTR(tcg_const_i32((tcg_target_long)(V)))
+#define tcg_const_ptr(V) \
+    (tcg_ctx.code_uncacheable = true, tcg_const_func_ptr(V))
+#define tcg_const_func_ptr(V) \
+    TCGV_NAT_TO_PTR(tcg_const_i32((tcg_target_long)(V)))
 #define tcg_global_reg_new_ptr(R, N) \
     TCGV_NAT_TO_PTR(tcg_global_reg_new_i32((R), (N)))
 #define tcg_global_mem_new_ptr(R, O, N) \
@@ -648,7 +732,10 @@ void tcg_add_target_add_op_defs(const TCGTargetOpDef *tdefs);
 #define TCGV_NAT_TO_PTR(n) MAKE_TCGV_PTR(GET_TCGV_I64(n))
 #define TCGV_PTR_TO_NAT(n) MAKE_TCGV_I64(GET_TCGV_PTR(n))
 
-#define tcg_const_ptr(V) TCGV_NAT_TO_PTR(tcg_const_i64((tcg_target_long)(V)))
+#define tcg_const_ptr(V) \
+    (tcg_ctx.code_uncacheable = true, tcg_const_func_ptr(V))
+#define tcg_const_func_ptr(V) \
+    TCGV_NAT_TO_PTR(tcg_const_i64((tcg_target_long)(V)))
 #define tcg_global_reg_new_ptr(R, N) \
     TCGV_NAT_TO_PTR(tcg_global_reg_new_i64((R), (N)))
 #define tcg_global_mem_new_ptr(R, O, N) \
@@ -666,6 +753,30 @@ void tcg_gen_shifti_i64(TCGv_i64 ret, TCGv_i64 arg1,
 TCGArg *tcg_optimize(TCGContext *s, uint16_t *tcg_opc_ptr, TCGArg *args,
                      TCGOpDef *tcg_op_def);
 
+/* Optimizer passes, all enabled by default */
+#define TCG_OPT_COPY     0x01 /* copy propagation */
+#define TCG_OPT_FOLD     0x02 /* constant folding, algebraic simplification */
+#define TCG_OPT_BITS     0x04 /* known-zero bits and sign extension tracking */
+#define TCG_OPT_STRENGTH 0x08 /* multiplications to shifts and adds */
+#define TCG_OPT_DCE      0x10 /* removal of unreachable ops */
+#define TCG_OPT_ALL      0x1f
+
+extern unsigned int tcg_opt_flags;
+
+/* Parse a comma separated list of pass names, "all" or "none", and
+   return the matching TCG_OPT_* mask, or -1 if @str is invalid. */
+int tcg_opt_parse(const char *str);
+void tcg_opt_print_passes(FILE *f);
+
+/* Set for -machine tcg-profile, before any code is generated: the calls
+   to helpers are then bracketed so that tcg_helper_ticks accumulates
+   the host ticks spent in them.  */
+extern bool tcg_tb_profile;
+extern int64_t tcg_helper_ticks;
+
+/* Set for -tb-stats in user mode: dump_tb_stats() is printed at exit */
+extern bool tcg_tb_stats;
+
 /* only used for debugging purposes */
 void tcg_register_helper(void *func, const char *name);
 const char *tcg_helper_get_name(TCGContext *s, void *func);
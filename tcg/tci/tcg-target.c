@@ -498,6 +498,70 @@ static void tci_out_label(TCGContext *s, TCGArg arg)
     }
 }
 
+/* Ops that tci_end_op() may fuse into a superinstruction */
+static uint8_t *tci_last_op[2];
+
+static bool tci_is_label(TCGContext *s, uint8_t *code_ptr)
+{
+    int i;
+
+    for (i = 0; i < s->nb_labels; i++) {
+        if (s->labels[i].has_value &&
+            s->labels[i].u.value == (tcg_target_long)code_ptr) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Turn ld, add and st that directly follow each other into one op, which
+   tci.c runs without dispatching in between.  The three ops stay as they
+   are after the header of the first one, so that the offsets in the TB
+   do not change; nothing may jump to the second or the third op.  */
+static bool tci_fuse_ld_add_st(TCGContext *s, uint8_t *st)
+{
+    uint8_t *ld = tci_last_op[1];
+    uint8_t *add = tci_last_op[0];
+    int fused;
+
+    if (st[0] == INDEX_op_st_i32) {
+        fused = TCI_OP_ld_add_st_i32;
+        if (!ld || ld[0] != INDEX_op_ld_i32 || add[0] != INDEX_op_add_i32) {
+            return false;
+        }
+#if TCG_TARGET_REG_BITS == 64
+    } else if (st[0] == INDEX_op_st_i64) {
+        fused = TCI_OP_ld_add_st_i64;
+        if (!ld || ld[0] != INDEX_op_ld_i64 || add[0] != INDEX_op_add_i64) {
+            return false;
+        }
+#endif
+    } else {
+        return false;
+    }
+    /* ld and add stay from the previous TB until two ops were emitted */
+    if (ld < s->code_buf || ld + ld[1] != add || add + add[1] != st ||
+        s->code_ptr - ld > UINT8_MAX ||
+        tci_is_label(s, add) || tci_is_label(s, st)) {
+        return false;
+    }
+    ld[0] = fused;
+    ld[1] = s->code_ptr - ld;
+    return true;
+}
+
+/* Finish the op that starts at @code_ptr. */
+static void tci_end_op(TCGContext *s, uint8_t *code_ptr)
+{
+    code_ptr[1] = s->code_ptr - code_ptr;
+    if (tci_fuse_ld_add_st(s, code_ptr)) {
+        tci_last_op[0] = tci_last_op[1] = NULL;
+    } else {
+        tci_last_op[1] = tci_last_op[0];
+        tci_last_op[0] = code_ptr;
+    }
+}
+
 static void tcg_out_ld(TCGContext *s, TCGType type, TCGReg ret, TCGReg arg1,
                        tcg_target_long arg2)
 {
@@ -519,7 +583,7 @@ static void tcg_out_ld(TCGContext *s, TCGType type, TCGReg ret, TCGReg arg1,
         TODO();
 #endif
     }
-    old_code_ptr[1] = s->code_ptr - old_code_ptr;
+    tci_end_op(s, old_code_ptr);
 }
 
 static void tcg_out_mov(TCGContext *s, TCGType type, TCGReg ret, TCGReg arg)
@@ -533,7 +597,7 @@ static void tcg_out_mov(TCGContext *s, TCGType type, TCGReg ret, TCGReg arg)
 #endif
     tcg_out_r(s, ret);
     tcg_out_r(s, arg);
-    old_code_ptr[1] = s->code_ptr - old_code_ptr;
+    tci_end_op(s, old_code_ptr);
 }
 
 static void tcg_out_movi(TCGContext *s, TCGType type,
@@ -555,7 +619,7 @@ static void tcg_out_movi(TCGContext *s, TCGType type,
         TODO();
 #endif
     }
-    old_code_ptr[1] = s->code_ptr - old_code_ptr;
+    tci_end_op(s, old_code_ptr);
 }
 
 static void tcg_out_op(TCGContext *s, TCGOpcode opc, const TCGArg *args,
@@ -716,7 +780,12 @@ static void tcg_out_op(TCGContext *s, TCGOpcode opc, const TCGArg *args,
         break;
     case INDEX_op_brcond_i64:
         tcg_out_r(s, args[0]);
-        tcg_out_ri64(s, const_args[1], args[1]);
+        if (const_args[1]) {
+            old_code_ptr[0] = TCI_OP_brcondi_i64;
+            tcg_out64(s, args[1]);
+        } else {
+            tcg_out_r(s, args[1]);
+        }
         tcg_out8(s, args[2]);           /* condition */
         tci_out_label(s, args[3]);
         break;
@@ -782,7 +851,12 @@ static void tcg_out_op(TCGContext *s, TCGOpcode opc, const TCGArg *args,
 #endif
     case INDEX_op_brcond_i32:
         tcg_out_r(s, args[0]);
-        tcg_out_ri32(s, const_args[1], args[1]);
+        if (const_args[1]) {
+            old_code_ptr[0] = TCI_OP_brcondi_i32;
+            tcg_out32(s, args[1]);
+        } else {
+            tcg_out_r(s, args[1]);
+        }
         tcg_out8(s, args[2]);           /* condition */
         tci_out_label(s, args[3]);
         break;
@@ -849,7 +923,7 @@ static void tcg_out_op(TCGContext *s, TCGOpcode opc, const TCGArg *args,
         fprintf(stderr, "Missing: %s\n", tcg_op_defs[opc].name);
         tcg_abort();
     }
-    old_code_ptr[1] = s->code_ptr - old_code_ptr;
+    tci_end_op(s, old_code_ptr);
 }
 
 static void tcg_out_st(TCGContext *s, TCGType type, TCGReg arg, TCGReg arg1,
@@ -872,7 +946,7 @@ static void tcg_out_st(TCGContext *s, TCGType type, TCGReg arg, TCGReg arg1,
         TODO();
 #endif
     }
-    old_code_ptr[1] = s->code_ptr - old_code_ptr;
+    tci_end_op(s, old_code_ptr);
 }
 
 /* Test if a constant matches the constraint. */
@@ -892,8 +966,9 @@ static void tcg_target_init(TCGContext *s)
     }
 #endif
 
-    /* The current code uses uint8_t for tcg operations. */
-    assert(ARRAY_SIZE(tcg_op_defs) <= UINT8_MAX);
+    /* The current code uses uint8_t for tcg operations, and the values
+       from TCI_OP_FIRST for superinstructions. */
+    assert(ARRAY_SIZE(tcg_op_defs) <= TCI_OP_FIRST);
 
     /* Registers available for 32 bit operations. */
     tcg_regset_set32(tcg_target_available_regs[TCG_TYPE_I32], 0,
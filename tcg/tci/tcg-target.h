@@ -160,6 +160,16 @@ typedef enum {
     TCG_CONST = UINT8_MAX
 } TCGReg;
 
+/* Superinstructions of the interpreter; tcg/tci/tcg-target.c emits them
+   instead of some op sequences.  They use opcodes after the TCG ops.  */
+enum {
+    TCI_OP_FIRST = 0xf0,
+    TCI_OP_brcondi_i32 = TCI_OP_FIRST,  /* brcond_i32 with a constant */
+    TCI_OP_brcondi_i64,
+    TCI_OP_ld_add_st_i32,               /* ld_i32, add_i32, st_i32 */
+    TCI_OP_ld_add_st_i64,
+};
+
 void tci_disas(uint8_t opc);
 
 tcg_target_ulong tcg_qemu_tb_exec(CPUArchState *env, uint8_t *tb_ptr);
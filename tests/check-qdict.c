@@ -49,14 +49,15 @@ static void qdict_put_obj_test(void)
     qdict_put_obj(qdict, "", QOBJECT(qint_from_int(num)));
 
     g_assert(qdict_size(qdict) == 1);
-    ent = QLIST_FIRST(&qdict->table[12345 % QDICT_BUCKET_MAX]);
+    ent = QLIST_FIRST(&qdict->table[12345 % qdict->nbuckets]);
+    g_assert(ent->hash == 12345);
     qi = qobject_to_qint(ent->value);
     g_assert(qint_get_int(qi) == num);
 
     // destroy doesn't exit yet
     QDECREF(qi);
-    g_free(ent->key);
     g_free(ent);
+    g_free(qdict->table);
     g_free(qdict);
 }
 
@@ -227,6 +228,39 @@ static void qdict_iterapi_test(void)
     QDECREF(tests_dict);
 }
 
+static void qdict_resize_test(void)
+{
+    int i;
+    char key[32];
+    QDict *tests_dict = qdict_new();
+
+    for (i = 0; i < 1000; i++) {
+        snprintf(key, sizeof(key), "key%d", i);
+        qdict_put(tests_dict, key, qint_from_int(i));
+    }
+    /* interned keys live in the same table */
+    qdict_put(tests_dict, "device", qint_from_int(-1));
+
+    g_assert(qdict_size(tests_dict) == 1001);
+    g_assert(tests_dict->nbuckets * QDICT_LOAD_MAX >= qdict_size(tests_dict));
+
+    for (i = 0; i < 1000; i++) {
+        snprintf(key, sizeof(key), "key%d", i);
+        g_assert(qdict_get_int(tests_dict, key) == i);
+    }
+    g_assert(qdict_get_int(tests_dict, "device") == -1);
+
+    for (i = 0; i < 1000; i += 2) {
+        snprintf(key, sizeof(key), "key%d", i);
+        qdict_del(tests_dict, key);
+    }
+    g_assert(qdict_size(tests_dict) == 501);
+    g_assert(qdict_haskey(tests_dict, "key1") == 1);
+    g_assert(qdict_haskey(tests_dict, "key2") == 0);
+
+    QDECREF(tests_dict);
+}
+
 /*
  * Errors test-cases
  */
@@ -365,6 +399,7 @@ int main(int argc, char **argv)
     g_test_add_func("/public/del", qdict_del_test);
     g_test_add_func("/public/to_qdict", qobject_to_qdict_test);
     g_test_add_func("/public/iterapi", qdict_iterapi_test);
+    g_test_add_func("/public/resize", qdict_resize_test);
 
     g_test_add_func("/errors/put_exists", qdict_put_exists_test);
     g_test_add_func("/errors/get_not_exists", qdict_get_not_exists_test);
@@ -1405,6 +1405,71 @@ static void unterminated_literal(void)
     g_assert(obj == NULL);
 }
 
+/*
+ * A reply shaped like query-blockstats for @ndev devices, serialized, parsed
+ * back and freed the way the monitor handles a command
+ */
+static QDict *perf_build_reply(int ndev)
+{
+    QList *list = qlist_new();
+    QDict *rsp = qdict_new();
+    char name[32];
+    int i;
+
+    for (i = 0; i < ndev; i++) {
+        QDict *dev = qdict_new();
+        QDict *stats = qdict_new();
+
+        qdict_put(stats, "rd_bytes", qint_from_int(i * 4096LL));
+        qdict_put(stats, "wr_bytes", qint_from_int(i * 8192LL));
+        qdict_put(stats, "rd_operations", qint_from_int(i));
+        qdict_put(stats, "wr_operations", qint_from_int(2 * i));
+        qdict_put(stats, "flush_operations", qint_from_int(3 * i));
+        qdict_put(stats, "wr_total_time_ns", qint_from_int(1000000LL * i));
+        qdict_put(stats, "rd_total_time_ns", qint_from_int(2000000LL * i));
+        qdict_put(stats, "flush_total_time_ns", qint_from_int(30000LL * i));
+        qdict_put(stats, "wr_highest_offset", qint_from_int(1LL << 30));
+
+        snprintf(name, sizeof(name), "virtio%d", i);
+        qdict_put(dev, "device", qstring_from_str(name));
+        qdict_put(dev, "stats", stats);
+        qlist_append(list, dev);
+    }
+    qdict_put(rsp, "return", list);
+    qdict_put(rsp, "id", qstring_from_str("libvirt-42"));
+
+    return rsp;
+}
+
+static void perf_qmp_roundtrip(void)
+{
+    const int iterations = 2000;
+    QDict *rsp;
+    QString *str;
+    QObject *obj;
+    double elapsed;
+    int i;
+
+    g_test_timer_start();
+    for (i = 0; i < iterations; i++) {
+        qobject_cache_begin();
+        rsp = perf_build_reply(32);
+        str = qobject_to_json(QOBJECT(rsp));
+        QDECREF(rsp);
+
+        obj = qobject_from_json(qstring_get_str(str));
+        g_assert(obj != NULL);
+        g_assert(qobject_type(obj) == QTYPE_QDICT);
+        QDECREF(str);
+        qobject_decref(obj);
+        qobject_cache_end();
+    }
+    elapsed = g_test_timer_elapsed();
+
+    g_test_message("QMP round trip: %.2f us per reply",
+                   elapsed * 1e6 / iterations);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -1441,5 +1506,9 @@ int main(int argc, char **argv)
     g_test_add_func("/errors/invalid_dict_comma", invalid_dict_comma);
     g_test_add_func("/errors/unterminated/literal", unterminated_literal);
 
+    if (g_test_perf()) {
+        g_test_add_func("/perf/qmp-roundtrip", perf_qmp_roundtrip);
+    }
+
     return g_test_run();
 }
@@ -30,11 +30,15 @@
 
 #include "qemu/compiler.h"
 #include "qemu/osdep.h"
+#include "qapi/qmp/qjson.h"
 
 #define MAX_IRQ 256
 
 QTestState *global_qtest;
 
+/* Tells apart the sockets of several QEMUs started by one test */
+static int qtest_instance;
+
 struct QTestState
 {
     int fd;
@@ -88,7 +92,7 @@ static int socket_accept(int sock)
     return ret;
 }
 
-static pid_t qtest_qemu_pid(QTestState *s)
+pid_t qtest_qemu_pid(QTestState *s)
 {
     FILE *f;
     char buffer[1024];
@@ -118,9 +122,13 @@ QTestState *qtest_init(const char *extra_args)
 
     s = g_malloc(sizeof(*s));
 
-    s->socket_path = g_strdup_printf("/tmp/qtest-%d.sock", getpid());
-    s->qmp_socket_path = g_strdup_printf("/tmp/qtest-%d.qmp", getpid());
-    pid_file = g_strdup_printf("/tmp/qtest-%d.pid", getpid());
+    s->socket_path = g_strdup_printf("/tmp/qtest-%d-%d.sock", getpid(),
+                                     qtest_instance);
+    s->qmp_socket_path = g_strdup_printf("/tmp/qtest-%d-%d.qmp", getpid(),
+                                         qtest_instance);
+    pid_file = g_strdup_printf("/tmp/qtest-%d-%d.pid", getpid(),
+                               qtest_instance);
+    qtest_instance++;
 
     sock = init_socket(s->socket_path);
     qmpsock = init_socket(s->qmp_socket_path);
@@ -290,16 +298,15 @@ redo:
     return words;
 }
 
-void qtest_qmpv(QTestState *s, const char *fmt, va_list ap)
+/* Read one JSON object from the QMP socket */
+static QDict *qtest_qmp_receive(QTestState *s)
 {
-    bool has_reply = false;
+    GString *json = g_string_new("");
+    bool in_string = false, escape = false;
     int nesting = 0;
+    QObject *obj;
 
-    /* Send QMP request */
-    socket_sendf(s->qmp_fd, fmt, ap);
-
-    /* Receive reply */
-    while (!has_reply || nesting > 0) {
+    for (;;) {
         ssize_t len;
         char c;
 
@@ -313,16 +320,62 @@ void qtest_qmpv(QTestState *s, const char *fmt, va_list ap)
             exit(1);
         }
 
-        switch (c) {
-        case '{':
+        if (!nesting && c != '{') {
+            continue;
+        }
+        g_string_append_c(json, c);
+
+        if (escape) {
+            escape = false;
+        } else if (in_string) {
+            escape = c == '\\';
+            in_string = c != '"';
+        } else if (c == '"') {
+            in_string = true;
+        } else if (c == '{') {
             nesting++;
-            has_reply = true;
-            break;
-        case '}':
-            nesting--;
+        } else if (c == '}' && --nesting == 0) {
             break;
         }
     }
+
+    obj = qobject_from_json(json->str);
+    g_assert(obj != NULL && qobject_type(obj) == QTYPE_QDICT);
+    g_string_free(json, TRUE);
+    return qobject_to_qdict(obj);
+}
+
+QDict *qtest_qmpv_response(QTestState *s, const char *fmt, va_list ap)
+{
+    QDict *rsp;
+
+    /* Send QMP request */
+    socket_sendf(s->qmp_fd, fmt, ap);
+
+    /* Receive reply, skipping the events that come before it */
+    for (;;) {
+        rsp = qtest_qmp_receive(s);
+        if (!qdict_haskey(rsp, "event")) {
+            return rsp;
+        }
+        QDECREF(rsp);
+    }
+}
+
+QDict *qtest_qmp_response(QTestState *s, const char *fmt, ...)
+{
+    va_list ap;
+    QDict *rsp;
+
+    va_start(ap, fmt);
+    rsp = qtest_qmpv_response(s, fmt, ap);
+    va_end(ap);
+    return rsp;
+}
+
+void qtest_qmpv(QTestState *s, const char *fmt, va_list ap)
+{
+    QDECREF(qtest_qmpv_response(s, fmt, ap));
 }
 
 void qtest_qmp(QTestState *s, const char *fmt, ...)
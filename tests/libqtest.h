@@ -21,6 +21,7 @@
 #include <stdbool.h>
 #include <stdarg.h>
 #include <sys/types.h>
+#include "qapi/qmp/qdict.h"
 
 typedef struct QTestState QTestState;
 
@@ -42,6 +43,14 @@ QTestState *qtest_init(const char *extra_args);
  */
 void qtest_quit(QTestState *s);
 
+/**
+ * qtest_qemu_pid:
+ * @s: #QTestState instance to operate on.
+ *
+ * Returns: the process ID of the QEMU process, or -1 if it is not known.
+ */
+pid_t qtest_qemu_pid(QTestState *s);
+
 /**
  * qtest_qmp:
  * @s: #QTestState instance to operate on.
@@ -61,6 +70,27 @@ void qtest_qmp(QTestState *s, const char *fmt, ...);
  */
 void qtest_qmpv(QTestState *s, const char *fmt, va_list ap);
 
+/**
+ * qtest_qmp_response:
+ * @s: #QTestState instance to operate on.
+ * @fmt...: QMP message to send to qemu
+ *
+ * Sends a QMP message to QEMU and returns the reply, which has either a
+ * "return" or an "error" member.  Events that arrive before the reply are
+ * dropped, as qtest_qmp() does.  The caller must QDECREF() the reply.
+ */
+QDict *qtest_qmp_response(QTestState *s, const char *fmt, ...);
+
+/**
+ * qtest_qmpv_response:
+ * @s: #QTestState instance to operate on.
+ * @fmt: QMP message to send to QEMU
+ * @ap: QMP message arguments
+ *
+ * Sends a QMP message to QEMU and returns the reply.
+ */
+QDict *qtest_qmpv_response(QTestState *s, const char *fmt, va_list ap);
+
 /**
  * qtest_get_irq:
  * @s: #QTestState instance to operate on.
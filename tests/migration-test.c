@@ -0,0 +1,357 @@
+/*
+ * QTest testcase and benchmark for live migration
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+/*
+ * A source and a destination QEMU are started side by side and RAM is
+ * migrated over a unix: or tcp: socket.  There are no vCPUs running with
+ * the qtest accelerator, so the test itself plays the guest: it dirties a
+ * working set of pages through the qtest protocol, at a fixed rate and in
+ * one of several patterns, until the migration completes.
+ *
+ * With "-m perf" every pattern is migrated with each set of capabilities,
+ * and the total time, downtime, bytes sent, and the share of pages sent as
+ * zero pages or as XBZRLE deltas are reported, one key=value line per run.
+ */
+
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "qemu-common.h"
+#include "libqtest.h"
+
+#define MIG_RAM_MB              128
+#define MIG_BASE                (16 << 20)      /* above the legacy holes */
+#define MIG_PAGE_SIZE           4096
+#define MIG_SPEED               (1ULL << 30)    /* bytes per second */
+#define MIG_POLL_US             10000
+#define MIG_DIRTY_SECONDS       10              /* then the "guest" idles */
+#define MIG_TIMEOUT_SECONDS     120
+
+typedef enum MigDirtyKind {
+    DIRTY_NONE,
+    DIRTY_WORD,         /* change one word, a small XBZRLE delta */
+    DIRTY_PAGE,         /* rewrite the page with random data */
+    DIRTY_ZERO,         /* clear the page again */
+} MigDirtyKind;
+
+typedef struct MigPattern {
+    const char *name;
+    MigDirtyKind kind;
+    bool random;
+} MigPattern;
+
+static const MigPattern patterns[] = {
+    { "idle",        DIRTY_NONE, false },
+    { "word-seq",    DIRTY_WORD, false },
+    { "word-rand",   DIRTY_WORD, true },
+    { "page-rand",   DIRTY_PAGE, true },
+    { "zero-rand",   DIRTY_ZERO, true },
+};
+
+/* Comma-separated MigrationCapability names */
+static const char *capability_sets[] = {
+    "",
+    "xbzrle",
+    "multi-thread",
+    "compress",
+    "xbzrle,multi-thread",
+};
+
+typedef struct MigResult {
+    int64_t total_ms;
+    int64_t downtime_ms;
+    int64_t transferred;
+    int64_t duplicate;
+    int64_t normal;
+    int64_t xbzrle_pages;
+    double dirty_rate;
+    bool converged;
+} MigResult;
+
+typedef struct MigBench {
+    QTestState *src, *dst;
+    char *uri;
+    char *socket_path;
+    int64_t nb_pages;
+    int64_t next_page;
+    uint64_t generation;
+    uint64_t rand_state;
+} MigBench;
+
+/* xorshift64*, good enough to pick pages and fill them */
+static uint64_t mig_rand(MigBench *b)
+{
+    b->rand_state ^= b->rand_state >> 12;
+    b->rand_state ^= b->rand_state << 25;
+    b->rand_state ^= b->rand_state >> 27;
+    return b->rand_state * 2685821657736338717ULL;
+}
+
+static void mig_set_capabilities(QTestState *s, const char *caps)
+{
+    GString *list = g_string_new("");
+    gchar **names = g_strsplit(caps, ",", 0);
+    int i;
+
+    for (i = 0; names[i]; i++) {
+        if (*names[i]) {
+            g_string_append_printf(list, "%s{ 'capability': '%s', "
+                                   "'state': true }",
+                                   list->len ? ", " : "", names[i]);
+        }
+    }
+    if (list->len) {
+        qtest_qmp(s, "{ 'execute': 'migrate-set-capabilities', "
+                  "'arguments': { 'capabilities': [ %s ] } }", list->str);
+    }
+    g_strfreev(names);
+    g_string_free(list, TRUE);
+}
+
+static void mig_start(MigBench *b, const char *transport, const char *caps,
+                      int64_t nb_pages)
+{
+    gchar *args;
+    int64_t i;
+
+    memset(b, 0, sizeof(*b));
+    if (!strcmp(transport, "tcp")) {
+        b->uri = g_strdup_printf("tcp:127.0.0.1:%d",
+                                 20000 + getpid() % 20000);
+    } else {
+        b->socket_path = g_strdup_printf("/tmp/migration-test-%d.sock",
+                                         getpid());
+        b->uri = g_strdup_printf("unix:%s", b->socket_path);
+    }
+
+    /* The destination listens by the time it answers QMP */
+    args = g_strdup_printf("-m %d -incoming %s", MIG_RAM_MB, b->uri);
+    b->dst = qtest_init(args);
+    g_free(args);
+    args = g_strdup_printf("-m %d", MIG_RAM_MB);
+    b->src = qtest_init(args);
+    g_free(args);
+
+    mig_set_capabilities(b->src, caps);
+    mig_set_capabilities(b->dst, caps);
+    qtest_qmp(b->src, "{ 'execute': 'migrate_set_speed', "
+              "'arguments': { 'value': %" PRIu64 " } }",
+              (uint64_t)MIG_SPEED);
+
+    /* Give every page of the working set some contents of its own, so
+     * that it is not sent as a zero page */
+    b->nb_pages = nb_pages;
+    b->rand_state = 0x2545f4914f6cdd1dULL;
+    for (i = 0; i < nb_pages; i++) {
+        qtest_writeq(b->src, MIG_BASE + i * MIG_PAGE_SIZE, i + 1);
+    }
+}
+
+static void mig_end(MigBench *b)
+{
+    qtest_quit(b->src);
+    qtest_quit(b->dst);
+    if (b->socket_path) {
+        unlink(b->socket_path);
+    }
+    g_free(b->socket_path);
+    g_free(b->uri);
+}
+
+static void mig_dirty(MigBench *b, const MigPattern *p, int64_t pages)
+{
+    uint64_t buf[MIG_PAGE_SIZE / sizeof(uint64_t)];
+    int64_t i;
+    int j;
+
+    for (i = 0; i < pages; i++) {
+        int64_t page = p->random ? mig_rand(b) % b->nb_pages
+                                 : b->next_page++ % b->nb_pages;
+        uint64_t addr = MIG_BASE + page * MIG_PAGE_SIZE;
+
+        switch (p->kind) {
+        case DIRTY_NONE:
+            return;
+        case DIRTY_WORD:
+            qtest_writeq(b->src, addr, ++b->generation);
+            break;
+        case DIRTY_PAGE:
+            for (j = 0; j < ARRAY_SIZE(buf); j++) {
+                buf[j] = mig_rand(b);
+            }
+            qtest_memwrite(b->src, addr, buf, sizeof(buf));
+            break;
+        case DIRTY_ZERO:
+            qtest_writeq(b->src, addr, 0);
+            break;
+        }
+    }
+}
+
+/* Return true and fill in @r once the migration has completed */
+static bool mig_poll(MigBench *b, MigResult *r)
+{
+    QDict *rsp, *info, *ram;
+    const char *status;
+
+    rsp = qtest_qmp_response(b->src, "{ 'execute': 'query-migrate' }");
+    g_assert(qdict_haskey(rsp, "return"));
+    info = qdict_get_qdict(rsp, "return");
+    status = qdict_get_try_str(info, "status");
+    g_assert(status != NULL);
+    g_assert_cmpstr(status, !=, "failed");
+    if (strcmp(status, "completed")) {
+        QDECREF(rsp);
+        return false;
+    }
+
+    ram = qdict_get_qdict(info, "ram");
+    r->total_ms = qdict_get_try_int(info, "total-time", -1);
+    r->downtime_ms = qdict_get_try_int(info, "downtime", -1);
+    r->transferred = qdict_get_int(ram, "transferred");
+    r->duplicate = qdict_get_int(ram, "duplicate");
+    r->normal = qdict_get_int(ram, "normal");
+    if (qdict_haskey(info, "xbzrle-cache")) {
+        r->xbzrle_pages = qdict_get_int(qdict_get_qdict(info, "xbzrle-cache"),
+                                        "pages");
+    }
+    QDECREF(rsp);
+    return true;
+}
+
+/* Migrate while dirtying @rate pages per second, for at most
+ * MIG_DIRTY_SECONDS */
+static void mig_run(MigBench *b, const MigPattern *p, int64_t rate,
+                    MigResult *r)
+{
+    GTimer *timer = g_timer_new();
+    int64_t dirtied = 0;
+    double elapsed = 0, dirty_time = 0;
+
+    memset(r, 0, sizeof(*r));
+    qtest_qmp(b->src, "{ 'execute': 'migrate', "
+              "'arguments': { 'uri': '%s' } }", b->uri);
+
+    while (!mig_poll(b, r)) {
+        elapsed = g_timer_elapsed(timer, NULL);
+        g_assert_cmpfloat(elapsed, <, MIG_TIMEOUT_SECONDS);
+
+        if (p->kind != DIRTY_NONE && elapsed < MIG_DIRTY_SECONDS) {
+            int64_t target = rate * elapsed;
+
+            mig_dirty(b, p, target - dirtied);
+            dirtied = target;
+            dirty_time = elapsed;
+        }
+        g_usleep(MIG_POLL_US);
+    }
+
+    r->converged = p->kind == DIRTY_NONE || elapsed < MIG_DIRTY_SECONDS;
+    r->dirty_rate = dirty_time ? dirtied / dirty_time : 0;
+    g_timer_destroy(timer);
+}
+
+static void mig_check_dest(MigBench *b)
+{
+    int64_t i;
+
+    for (i = 0; i < b->nb_pages; i++) {
+        uint64_t addr = MIG_BASE + i * MIG_PAGE_SIZE;
+
+        g_assert_cmphex(qtest_readq(b->dst, addr), ==,
+                        qtest_readq(b->src, addr));
+    }
+}
+
+static void test_migrate(const char *transport)
+{
+    MigBench b;
+    MigResult r;
+
+    mig_start(&b, transport, "", 2048);
+    mig_run(&b, &patterns[2], 2000, &r);
+    g_assert(r.transferred > 0);
+    mig_check_dest(&b);
+    mig_end(&b);
+}
+
+static void test_migrate_unix(void)
+{
+    test_migrate("unix");
+}
+
+static void test_migrate_tcp(void)
+{
+    test_migrate("tcp");
+}
+
+static void run_perf(const char *transport)
+{
+    static const int64_t rates[] = { 1000, 10000 };
+    int i, j, k;
+
+    for (i = 0; i < ARRAY_SIZE(capability_sets); i++) {
+        for (j = 0; j < ARRAY_SIZE(patterns); j++) {
+            for (k = 0; k < ARRAY_SIZE(rates); k++) {
+                const MigPattern *p = &patterns[j];
+                int64_t pages;
+                MigBench b;
+                MigResult r;
+
+                if (p->kind == DIRTY_NONE && k) {
+                    continue;
+                }
+
+                /* 64 MiB working set */
+                mig_start(&b, transport, capability_sets[i], 16384);
+                mig_run(&b, p, rates[k], &r);
+                mig_check_dest(&b);
+                mig_end(&b);
+
+                pages = r.duplicate + r.normal + r.xbzrle_pages;
+                g_test_minimized_result(r.downtime_ms,
+                    "transport=%s caps=%s pattern=%s dirty-rate=%.0f "
+                    "total-ms=%" PRId64 " downtime-ms=%" PRId64 " "
+                    "bytes=%" PRId64 " zero-ratio=%.3f xbzrle-ratio=%.3f "
+                    "converged=%s",
+                    transport, *capability_sets[i] ? capability_sets[i]
+                                                   : "none",
+                    p->name, r.dirty_rate, r.total_ms, r.downtime_ms,
+                    r.transferred,
+                    pages ? (double)r.duplicate / pages : 0,
+                    pages ? (double)r.xbzrle_pages / pages : 0,
+                    r.converged ? "yes" : "no");
+            }
+        }
+    }
+}
+
+static void test_migrate_unix_perf(void)
+{
+    run_perf("unix");
+}
+
+static void test_migrate_tcp_perf(void)
+{
+    run_perf("tcp");
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    qtest_add_func("migration/unix", test_migrate_unix);
+    qtest_add_func("migration/tcp", test_migrate_tcp);
+    if (g_test_perf()) {
+        qtest_add_func("migration/unix-perf", test_migrate_unix_perf);
+        qtest_add_func("migration/tcp-perf", test_migrate_tcp_perf);
+    }
+
+    return g_test_run();
+}
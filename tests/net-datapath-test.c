@@ -0,0 +1,409 @@
+/*
+ * QTest testcase for the NIC to NIC datapath through a net hub
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+/*
+ * A virtio-net-pci and an e1000 are the only ports of hub 0, so every frame
+ * one of them transmits is received by the other: virtio-net TX, the hub
+ * and the net queues, then e1000 RX (and the other way around).  The rings
+ * are set up once and reused, a batch of BATCH frames costs only a handful
+ * of qtest commands, so with "-m perf" the figures are dominated by QEMU's
+ * own per-packet work.  They are reported as packets per second and as
+ * nanoseconds of QEMU CPU time per packet, for several frame sizes.
+ */
+
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "qemu-common.h"
+#include "libqtest.h"
+
+#define VNET_DEVFN              (4 << 3)
+#define E1000_DEVFN             (5 << 3)
+#define VNET_IO_BASE            0xc000
+#define E1000_MMIO_BASE         0xe0000000
+
+#define VIRTIO_PCI_GUEST_FEATURES 4
+#define VIRTIO_PCI_QUEUE_PFN      8
+#define VIRTIO_PCI_QUEUE_NUM      12
+#define VIRTIO_PCI_QUEUE_SEL      14
+#define VIRTIO_PCI_QUEUE_NOTIFY   16
+#define VIRTIO_PCI_STATUS         18
+
+#define VRING_DESC_F_WRITE      2
+#define VNET_HDR_LEN            10
+#define VNET_RX_QUEUE           0
+#define VNET_TX_QUEUE           1
+
+#define E1000_RCTL              0x0100
+#define E1000_TCTL              0x0400
+#define E1000_RDBAL             0x2800
+#define E1000_RDLEN             0x2808
+#define E1000_RDH               0x2810
+#define E1000_RDT               0x2818
+#define E1000_TDBAL             0x3800
+#define E1000_TDLEN             0x3808
+#define E1000_TDH               0x3810
+#define E1000_TDT               0x3818
+#define E1000_RCTL_EN           0x00000002
+#define E1000_RCTL_UPE          0x00000008
+#define E1000_RCTL_MPE          0x00000010
+#define E1000_RCTL_BAM          0x00008000
+#define E1000_RCTL_SECRC        0x04000000
+#define E1000_TCTL_EN           0x00000002
+#define E1000_TCTL_PSP          0x00000008
+#define E1000_TXD_CMD_EOP       0x01000000
+#define E1000_TXD_CMD_IFCS      0x02000000
+#define E1000_TXD_CMD_RS        0x08000000
+#define E1000_RING_SIZE         256
+
+/* Guest physical memory layout */
+#define VNET_RX_RING            0x100000
+#define VNET_TX_RING            0x110000
+#define VNET_RX_BUF             0x200000
+#define VNET_TX_BUF             0x300000
+#define E1000_RX_RING           0x400000
+#define E1000_TX_RING           0x410000
+#define E1000_RX_BUF            0x500000
+#define E1000_TX_BUF            0x600000
+#define BUF_SIZE                2048
+
+#define BATCH                   128
+#define PERF_SECONDS            3.0
+
+typedef struct {
+    unsigned int num;
+    uint64_t avail;
+    uint64_t used;
+    uint16_t avail_idx;
+} TestVirtQueue;
+
+typedef struct {
+    TestVirtQueue rx, tx;
+    uint32_t e1000_rdh, e1000_tdt;
+} TestState;
+
+static const int frame_sizes[] = { 64, 512, 1514 };
+
+static uint32_t pci_config_addr(int devfn, uint8_t reg)
+{
+    return 0x80000000 | (devfn << 8) | (reg & ~3);
+}
+
+static uint16_t pci_config_readw(int devfn, uint8_t reg)
+{
+    outl(0xcf8, pci_config_addr(devfn, reg));
+    return inw(0xcfc + (reg & 2));
+}
+
+static void pci_config_writew(int devfn, uint8_t reg, uint16_t val)
+{
+    outl(0xcf8, pci_config_addr(devfn, reg));
+    outw(0xcfc + (reg & 2), val);
+}
+
+static void pci_config_writel(int devfn, uint8_t reg, uint32_t val)
+{
+    outl(0xcf8, pci_config_addr(devfn, reg));
+    outl(0xcfc, val);
+}
+
+static void e1000_writel(uint32_t reg, uint32_t val)
+{
+    writel(E1000_MMIO_BASE + reg, val);
+}
+
+static uint32_t e1000_readl(uint32_t reg)
+{
+    return readl(E1000_MMIO_BASE + reg);
+}
+
+static void build_frame(uint8_t *frame, int size)
+{
+    static const uint8_t src[6] = { 0x52, 0x54, 0x00, 0xaa, 0xbb, 0xcc };
+    int i;
+
+    memset(frame, 0xff, 6);
+    memcpy(frame + 6, src, 6);
+    frame[12] = 0x88;                   /* local experimental ethertype */
+    frame[13] = 0xb5;
+    for (i = 14; i < size; i++) {
+        frame[i] = i;
+    }
+}
+
+/* Map queue @index at @ring, descriptor i pointing to buffer i of @buf */
+static void vq_init(TestVirtQueue *vq, int index, uint64_t ring, uint64_t buf,
+                    uint32_t len, uint16_t flags)
+{
+    uint8_t *p;
+    size_t size;
+    unsigned int i;
+
+    outw(VNET_IO_BASE + VIRTIO_PCI_QUEUE_SEL, index);
+    vq->num = inw(VNET_IO_BASE + VIRTIO_PCI_QUEUE_NUM);
+    g_assert_cmpint(vq->num, >=, 2 * BATCH);
+    vq->avail = ring + vq->num * 16;
+    vq->used = (vq->avail + 4 + vq->num * 2 + 2 + 4095) & ~4095ULL;
+    vq->avail_idx = 0;
+
+    size = vq->used + 4 + vq->num * 8 + 2 - ring;
+    p = g_malloc0(size);
+    for (i = 0; i < vq->num; i++) {
+        stq_le_p(p + i * 16, buf + i * BUF_SIZE);
+        stl_le_p(p + i * 16 + 8, len);
+        stw_le_p(p + i * 16 + 12, flags);
+        /* Ring slot i always offers descriptor i */
+        stw_le_p(p + vq->avail - ring + 4 + i * 2, i);
+    }
+    memwrite(ring, p, size);
+    g_free(p);
+
+    outl(VNET_IO_BASE + VIRTIO_PCI_QUEUE_PFN, ring >> 12);
+}
+
+static void vq_kick(TestVirtQueue *vq, int index, unsigned int count)
+{
+    vq->avail_idx += count;
+    writew(vq->avail + 2, vq->avail_idx);
+    outw(VNET_IO_BASE + VIRTIO_PCI_QUEUE_NOTIFY, index);
+}
+
+static void vq_wait_used(TestVirtQueue *vq, uint16_t idx)
+{
+    while (readw(vq->used + 2) != idx) {
+        /* qtest commands run in QEMU's main loop, which lets the BH run */
+    }
+}
+
+static void e1000_init_ring(uint64_t ring, uint64_t buf, uint32_t lower)
+{
+    uint8_t *p = g_malloc0(E1000_RING_SIZE * 16);
+    int i;
+
+    for (i = 0; i < E1000_RING_SIZE; i++) {
+        stq_le_p(p + i * 16, buf + i * BUF_SIZE);
+        stl_le_p(p + i * 16 + 8, lower);
+    }
+    memwrite(ring, p, E1000_RING_SIZE * 16);
+    g_free(p);
+}
+
+static void test_start(TestState *s, int frame_size)
+{
+    uint8_t frame[BUF_SIZE];
+    int i;
+
+    qtest_start("-netdev hubport,id=p0,hubid=0 "
+                "-device virtio-net-pci,netdev=p0,addr=04.0,vectors=0 "
+                "-netdev hubport,id=p1,hubid=0 "
+                "-device e1000,netdev=p1,addr=05.0");
+
+    /* virtio-net: I/O BAR, no features, RX buffers all posted */
+    g_assert_cmphex(pci_config_readw(VNET_DEVFN, 0x00), ==, 0x1af4);
+    g_assert_cmphex(pci_config_readw(VNET_DEVFN, 0x02), ==, 0x1000);
+    pci_config_writel(VNET_DEVFN, 0x10, VNET_IO_BASE | 1);
+    pci_config_writew(VNET_DEVFN, 0x04,
+                      pci_config_readw(VNET_DEVFN, 0x04) | 0x5);
+    outb(VNET_IO_BASE + VIRTIO_PCI_STATUS, 0);
+    outb(VNET_IO_BASE + VIRTIO_PCI_STATUS, 1 | 2);
+    outl(VNET_IO_BASE + VIRTIO_PCI_GUEST_FEATURES, 0);
+    vq_init(&s->rx, VNET_RX_QUEUE, VNET_RX_RING, VNET_RX_BUF, BUF_SIZE,
+            VRING_DESC_F_WRITE);
+    vq_init(&s->tx, VNET_TX_QUEUE, VNET_TX_RING, VNET_TX_BUF,
+            VNET_HDR_LEN + frame_size, 0);
+    outb(VNET_IO_BASE + VIRTIO_PCI_STATUS, 1 | 2 | 4);
+    vq_kick(&s->rx, VNET_RX_QUEUE, s->rx.num);
+
+    /* e1000: memory BAR, both rings, RX ring all owned by the device */
+    g_assert_cmphex(pci_config_readw(E1000_DEVFN, 0x00), ==, 0x8086);
+    pci_config_writel(E1000_DEVFN, 0x10, E1000_MMIO_BASE);
+    pci_config_writew(E1000_DEVFN, 0x04,
+                      pci_config_readw(E1000_DEVFN, 0x04) | 0x6);
+    e1000_init_ring(E1000_RX_RING, E1000_RX_BUF, 0);
+    e1000_init_ring(E1000_TX_RING, E1000_TX_BUF, frame_size |
+                    E1000_TXD_CMD_EOP | E1000_TXD_CMD_IFCS | E1000_TXD_CMD_RS);
+    e1000_writel(E1000_RDBAL, E1000_RX_RING);
+    e1000_writel(E1000_RDLEN, E1000_RING_SIZE * 16);
+    e1000_writel(E1000_RDH, 0);
+    e1000_writel(E1000_RDT, E1000_RING_SIZE - 1);
+    e1000_writel(E1000_RCTL, E1000_RCTL_EN | E1000_RCTL_UPE | E1000_RCTL_MPE |
+                 E1000_RCTL_BAM | E1000_RCTL_SECRC);
+    e1000_writel(E1000_TDBAL, E1000_TX_RING);
+    e1000_writel(E1000_TDLEN, E1000_RING_SIZE * 16);
+    e1000_writel(E1000_TDH, 0);
+    e1000_writel(E1000_TDT, 0);
+    e1000_writel(E1000_TCTL, E1000_TCTL_EN | E1000_TCTL_PSP);
+    s->e1000_rdh = 0;
+    s->e1000_tdt = 0;
+
+    /* The same frame in every TX buffer of both devices */
+    memset(frame, 0, VNET_HDR_LEN);
+    build_frame(frame + VNET_HDR_LEN, frame_size);
+    for (i = 0; i < s->tx.num; i++) {
+        memwrite(VNET_TX_BUF + i * BUF_SIZE, frame, VNET_HDR_LEN + frame_size);
+    }
+    for (i = 0; i < E1000_RING_SIZE; i++) {
+        memwrite(E1000_TX_BUF + i * BUF_SIZE, frame + VNET_HDR_LEN,
+                 frame_size);
+    }
+}
+
+/* BATCH frames from virtio-net to e1000 */
+static void run_virtio_to_e1000(TestState *s)
+{
+    uint32_t rdh = (s->e1000_rdh + BATCH) % E1000_RING_SIZE;
+
+    vq_kick(&s->tx, VNET_TX_QUEUE, BATCH);
+    while (e1000_readl(E1000_RDH) != rdh) {
+        /* wait for the hub to hand the frames over */
+    }
+    vq_wait_used(&s->tx, s->tx.avail_idx);
+
+    s->e1000_rdh = rdh;
+    e1000_writel(E1000_RDT, (rdh + E1000_RING_SIZE - 1) % E1000_RING_SIZE);
+}
+
+/* BATCH frames from e1000 to virtio-net */
+static void run_e1000_to_virtio(TestState *s)
+{
+    uint16_t used = s->rx.avail_idx - s->rx.num + BATCH;
+
+    s->e1000_tdt = (s->e1000_tdt + BATCH) % E1000_RING_SIZE;
+    e1000_writel(E1000_TDT, s->e1000_tdt);
+    vq_wait_used(&s->rx, used);
+
+    /* Give the buffers back */
+    vq_kick(&s->rx, VNET_RX_QUEUE, BATCH);
+}
+
+static void check_frame(uint64_t addr, int size)
+{
+    uint8_t *expected = g_malloc(size), *actual = g_malloc(size);
+
+    build_frame(expected, size);
+    memread(addr, actual, size);
+    g_assert(memcmp(expected, actual, size) == 0);
+    g_free(expected);
+    g_free(actual);
+}
+
+static void test_virtio_to_e1000(void)
+{
+    TestState s;
+
+    test_start(&s, 512);
+    run_virtio_to_e1000(&s);
+
+    g_assert_cmpint(readw(E1000_RX_RING + 8), ==, 512);
+    g_assert_cmpint(readb(E1000_RX_RING + 12) & 1, ==, 1);
+    check_frame(E1000_RX_BUF, 512);
+    check_frame(E1000_RX_BUF + (BATCH - 1) * BUF_SIZE, 512);
+
+    qtest_quit(global_qtest);
+}
+
+static void test_e1000_to_virtio(void)
+{
+    TestState s;
+
+    test_start(&s, 512);
+    run_e1000_to_virtio(&s);
+
+    /* used.ring[0].len covers the virtio-net header */
+    g_assert_cmpint(readl(s.rx.used + 4 + 4), ==, VNET_HDR_LEN + 512);
+    check_frame(VNET_RX_BUF + VNET_HDR_LEN, 512);
+    check_frame(VNET_RX_BUF + (BATCH - 1) * BUF_SIZE + VNET_HDR_LEN, 512);
+
+    qtest_quit(global_qtest);
+}
+
+/* utime + stime of the QEMU process, in seconds */
+static double qemu_cpu_time(void)
+{
+    char path[64], buf[1024], *p;
+    unsigned long utime, stime;
+    FILE *f;
+    int ret;
+
+    snprintf(path, sizeof(path), "/proc/%d/stat",
+             (int)qtest_qemu_pid(global_qtest));
+    f = fopen(path, "r");
+    if (!f) {
+        return 0;
+    }
+    p = fgets(buf, sizeof(buf), f);
+    fclose(f);
+    if (!p || !(p = strrchr(buf, ')'))) {
+        return 0;
+    }
+    /* Fields 14 and 15, counting from the pid */
+    ret = sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+                 &utime, &stime);
+    if (ret != 2) {
+        return 0;
+    }
+    return (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+static void run_perf(const char *name, void (*run)(TestState *s))
+{
+    unsigned int i;
+
+    for (i = 0; i < ARRAY_SIZE(frame_sizes); i++) {
+        TestState s;
+        unsigned long packets = 0;
+        double duration, cpu;
+
+        test_start(&s, frame_sizes[i]);
+        run(&s);                        /* warm up */
+
+        cpu = qemu_cpu_time();
+        g_test_timer_start();
+        do {
+            run(&s);
+            packets += BATCH;
+            duration = g_test_timer_elapsed();
+        } while (duration < PERF_SECONDS);
+        cpu = qemu_cpu_time() - cpu;
+
+        g_test_maximized_result(packets / duration,
+                                "%s %d bytes: %.0f packets/s, "
+                                "%.0f ns QEMU CPU per packet",
+                                name, frame_sizes[i], packets / duration,
+                                cpu * 1e9 / packets);
+
+        qtest_quit(global_qtest);
+    }
+}
+
+static void test_virtio_to_e1000_perf(void)
+{
+    run_perf("virtio-net -> e1000", run_virtio_to_e1000);
+}
+
+static void test_e1000_to_virtio_perf(void)
+{
+    run_perf("e1000 -> virtio-net", run_e1000_to_virtio);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    qtest_add_func("net/datapath/virtio-e1000", test_virtio_to_e1000);
+    qtest_add_func("net/datapath/e1000-virtio", test_e1000_to_virtio);
+    if (g_test_perf()) {
+        qtest_add_func("net/datapath/virtio-e1000-perf",
+                       test_virtio_to_e1000_perf);
+        qtest_add_func("net/datapath/e1000-virtio-perf",
+                       test_e1000_to_virtio_perf);
+    }
+
+    return g_test_run();
+}
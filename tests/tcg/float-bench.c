@@ -0,0 +1,117 @@
+/*
+ *  Floating point speed test - runs a mix of single and double precision
+ *  add, sub, mul, div and sqrt kernels, the kind found in scientific test
+ *  suites, and prints a checksum of each result followed by the time spent.
+ *
+ *  Built for i386 with SSE2 arithmetic so that the guest operations go
+ *  through softfloat's float32/float64 code rather than floatx80.  The
+ *  'speed-float' make target runs it natively and under QEMU; the checksums
+ *  must be identical with and without --enable-hardfloat.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <sys/time.h>
+
+#define N 512
+
+static double da[N], db[N], dc[N];
+static float fa[N], fb[N], fc[N];
+
+static uint64_t checksum(const void *p, size_t len)
+{
+    const unsigned char *c = p;
+    uint64_t h = 1469598103934665603ULL;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        h = (h ^ c[i]) * 1099511628211ULL;
+    }
+    return h;
+}
+
+static double now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void init(void)
+{
+    int i;
+
+    for (i = 0; i < N; i++) {
+        da[i] = 1.0 + i / 3.0;
+        db[i] = 2.0 - i / 7.0;
+        dc[i] = 0.0;
+        fa[i] = da[i];
+        fb[i] = db[i];
+        fc[i] = 0.0f;
+    }
+}
+
+/* dense dot products and vector updates */
+static void bench_double(int iter)
+{
+    int i, j;
+
+    for (j = 0; j < iter; j++) {
+        for (i = 0; i < N; i++) {
+            dc[i] = dc[i] * 0.5 + da[i] * db[i] - da[i] / (db[i] + 3.0);
+        }
+    }
+}
+
+static void bench_float(int iter)
+{
+    int i, j;
+
+    for (j = 0; j < iter; j++) {
+        for (i = 0; i < N; i++) {
+            fc[i] = fc[i] * 0.5f + fa[i] * fb[i] - fa[i] / (fb[i] + 3.0f);
+        }
+    }
+}
+
+/* norms, as in iterative solvers */
+static void bench_sqrt(int iter)
+{
+    int i, j;
+
+    for (j = 0; j < iter; j++) {
+        for (i = 0; i < N; i++) {
+            dc[i] = sqrt(dc[i] * dc[i] + da[i]);
+            fc[i] = sqrtf(fc[i] * fc[i] + fa[i]);
+        }
+    }
+}
+
+static void run(const char *name, void (*fn)(int), int iter)
+{
+    double t = now();
+
+    fn(iter);
+    t = now() - t;
+    printf("%-8s %016llx %016llx\n", name,
+           (unsigned long long)checksum(dc, sizeof(dc)),
+           (unsigned long long)checksum(fc, sizeof(fc)));
+    fprintf(stderr, "%-8s %.3f s, %.1f Mop/s\n", name, t,
+            (double)iter * N * 5 / t / 1e6);
+}
+
+int main(int argc, char **argv)
+{
+    init();
+    run("double", bench_double, 20000);
+    run("float", bench_float, 20000);
+    run("sqrt", bench_sqrt, 10000);
+    return 0;
+}
@@ -0,0 +1,152 @@
+/*
+ *  TCG benchmark kernels
+ *
+ *  Each kernel exercises one kind of guest code: plain integer loops, block
+ *  copies, floating point, unpredictable branches and indirect calls, or
+ *  system calls.  "tcg-bench KERNEL" runs one of them and prints a checksum
+ *  so that the work cannot be optimized away; tcg-bench.sh runs them all
+ *  under QEMU and reports the code generation figures.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#define ITER 2000000
+
+static volatile uint32_t sink;
+
+/* arithmetic, shifts and a well predicted loop branch */
+static uint32_t bench_int(void)
+{
+    uint32_t a = 1, b = 2, c = 3;
+    int i;
+
+    for (i = 0; i < ITER * 10; i++) {
+        a += b ^ (c >> 3);
+        b = (b << 1) | (a & 1);
+        c = c * 33 + a;
+    }
+    return a ^ b ^ c;
+}
+
+static uint32_t bench_memcpy(void)
+{
+    static uint8_t src[65536], dst[65536];
+    uint32_t sum = 0;
+    int i;
+
+    for (i = 0; i < sizeof(src); i++) {
+        src[i] = i * 7;
+    }
+    for (i = 0; i < ITER / 500; i++) {
+        memcpy(dst, src + (i & 255), sizeof(dst) - 256);
+        memmove(src + 1, src, 4096);
+        sum += dst[i & 4095];
+    }
+    return sum;
+}
+
+static uint32_t bench_fp(void)
+{
+    double x = 1.0, y = 0.5;
+    float f = 1.0f;
+    int i;
+
+    for (i = 0; i < ITER; i++) {
+        x = x * 1.0000001 + y / (x + 3.0);
+        y = y * 0.9999999 - x * 1e-9;
+        f = f * 0.5f + (float)y;
+    }
+    return (uint32_t)(x * 1000) ^ (uint32_t)(f * 1000);
+}
+
+static uint32_t op_add(uint32_t a) { return a + 3; }
+static uint32_t op_xor(uint32_t a) { return a ^ 0x5a5a; }
+static uint32_t op_rot(uint32_t a) { return (a << 5) | (a >> 27); }
+static uint32_t op_mul(uint32_t a) { return a * 9; }
+
+/* data dependent branches, a switch and calls through a pointer, so that
+   most TBs end with a jump to a computed address */
+static uint32_t bench_branch(void)
+{
+    static uint32_t (* const ops[])(uint32_t) = {
+        op_add, op_xor, op_rot, op_mul,
+    };
+    uint32_t x = 12345, acc = 0;
+    int i;
+
+    for (i = 0; i < ITER * 2; i++) {
+        x = x * 1103515245 + 12345;
+        if (x & 0x10000) {
+            acc += x >> 7;
+        } else {
+            acc -= x >> 9;
+        }
+        switch ((x >> 20) & 7) {
+        case 0: acc ^= 1; break;
+        case 1: acc += 7; break;
+        case 2: acc = (acc << 1) | 1; break;
+        case 3: acc -= x; break;
+        case 5: acc ^= x >> 3; break;
+        default: break;
+        }
+        acc = ops[(x >> 24) & 3](acc);
+    }
+    return acc;
+}
+
+/* mostly time spent going in and out of the syscall emulation */
+static uint32_t bench_syscall(void)
+{
+    char buf[64];
+    uint32_t sum = 0;
+    int fd, i;
+
+    fd = open("/dev/null", O_WRONLY);
+    if (fd < 0) {
+        perror("/dev/null");
+        exit(1);
+    }
+    memset(buf, 'x', sizeof(buf));
+    for (i = 0; i < ITER / 10; i++) {
+        sum += getppid();
+        if (write(fd, buf, sizeof(buf)) != sizeof(buf)) {
+            perror("write");
+            exit(1);
+        }
+    }
+    close(fd);
+    return sum != 0;
+}
+
+static const struct {
+    const char *name;
+    uint32_t (*fn)(void);
+} kernels[] = {
+    { "int", bench_int },
+    { "memcpy", bench_memcpy },
+    { "fp", bench_fp },
+    { "branch", bench_branch },
+    { "syscall", bench_syscall },
+};
+
+int main(int argc, char **argv)
+{
+    int i;
+
+    for (i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++) {
+        if (argc < 2 || !strcmp(argv[1], kernels[i].name)) {
+            sink = kernels[i].fn();
+            printf("%-8s %08x\n", kernels[i].name, sink);
+        }
+    }
+    return 0;
+}
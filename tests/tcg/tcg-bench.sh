@@ -0,0 +1,61 @@
+#!/bin/sh
+#
+# Run the tcg-bench kernels under a linux-user QEMU and print, for each
+# one, a line of key=value pairs:
+#
+#   seconds              wall clock time of the run
+#   insns-per-sec        guest instructions executed per second
+#   host-bytes-per-insn  host code generated per guest instruction translated
+#   chain-rate           share of TB executions reached by a chained jump
+#   flushes, evictions   of the code buffer
+#
+# The timed run uses -tb-stats.  Instructions and TB executions can only be
+# counted with -tb-profile, which turns off chaining, so a second, untimed
+# run provides them.
+#
+# Usage: tcg-bench.sh QEMU BENCH [KERNEL...]
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+
+if [ $# -lt 2 ]; then
+    echo "Usage: $0 QEMU BENCH [KERNEL...]" >&2
+    exit 1
+fi
+qemu=$1
+bench=$2
+shift 2
+kernels=${*:-int memcpy fp branch syscall}
+tmp=/tmp/tcg-bench-$$
+
+trap 'rm -f $tmp.time $tmp.prof' 0 1 2 3 15
+
+# stat KEY FILE: value of KEY in the tb-stats line of FILE
+stat()
+{
+    sed -n "s/^tb-stats:.* $1=\([^ ]*\).*/\1/p" $2
+}
+
+for k in $kernels; do
+    start=$(date +%s.%N)
+    $qemu -tb-stats $bench $k > /dev/null 2> $tmp.time || exit 1
+    end=$(date +%s.%N)
+    $qemu -tb-profile -tb-stats $bench $k > /dev/null 2> $tmp.prof || exit 1
+
+    awk -v k=$k -v secs=$(echo "$end $start" | awk '{ print $1 - $2 }') \
+        -v insns=$(stat executed-insns $tmp.prof) \
+        -v tbs=$(stat executed-tbs $tmp.prof) \
+        -v dispatches=$(stat dispatches $tmp.time) \
+        -v bpi=$(stat host-bytes-per-insn $tmp.time) \
+        -v flushes=$(stat flushes $tmp.time) \
+        -v evictions=$(stat evictions $tmp.time) '
+        BEGIN {
+            chain = tbs > dispatches ? 1 - dispatches / tbs : 0
+            printf "kernel=%s seconds=%.3f insns-per-sec=%.0f " \
+                   "host-bytes-per-insn=%s chain-rate=%.3f flushes=%d " \
+                   "evictions=%d\n", k, secs, secs ? insns / secs : 0,
+                   bpi, chain, flushes, evictions
+        }'
+done
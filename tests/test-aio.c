@@ -12,6 +12,9 @@
 
 #include <glib.h>
 #include "block/aio.h"
+#include "qemu/timer.h"
+#include "qemu/thread.h"
+#include "qemu/atomic.h"
 
 AioContext *ctx;
 
@@ -211,6 +214,57 @@ static void test_bh_delete_from_cb_many(void)
     g_assert(data4.bh == NULL);
 }
 
+/* Every thread creates bottom halves that delete themselves when run */
+
+#define BH_THREADS       4
+#define BH_PER_THREAD 1000
+
+static int bh_thread_runs;
+
+static void bh_thread_cb(void *opaque)
+{
+    QEMUBH **bh = opaque;
+
+    atomic_fetch_add(&bh_thread_runs, 1);
+    qemu_bh_delete(*bh);
+    g_free(bh);
+}
+
+static void *bh_schedule_thread(void *opaque)
+{
+    int i;
+
+    for (i = 0; i < BH_PER_THREAD; i++) {
+        QEMUBH **bh = g_new(QEMUBH *, 1);
+
+        *bh = aio_bh_new(ctx, bh_thread_cb, bh);
+        qemu_bh_schedule(*bh);
+    }
+    return NULL;
+}
+
+static void test_bh_schedule_threads(void)
+{
+    QemuThread threads[BH_THREADS];
+    int i;
+
+    bh_thread_runs = 0;
+    for (i = 0; i < BH_THREADS; i++) {
+        qemu_thread_create(&threads[i], bh_schedule_thread, NULL,
+                           QEMU_THREAD_JOINABLE);
+    }
+    while (atomic_read(&bh_thread_runs) < BH_THREADS * BH_PER_THREAD) {
+        aio_poll(ctx, true);
+    }
+    for (i = 0; i < BH_THREADS; i++) {
+        qemu_thread_join(&threads[i]);
+    }
+    g_assert_cmpint(bh_thread_runs, ==, BH_THREADS * BH_PER_THREAD);
+
+    /* The deleted bottom halves are freed and nothing else is pending */
+    g_assert(!aio_poll(ctx, false));
+}
+
 static void test_bh_flush(void)
 {
     BHTestData data = { .n = 0 };
@@ -340,6 +394,207 @@ static void test_wait_event_notifier_noflush(void)
     event_notifier_cleanup(&data.e);
 }
 
+/* Many event notifiers, as with a guest that has many disks.  Each
+ * iteration sets one of them, so the cost is dominated by waiting on all
+ * of them.  Run with "-m perf" for a longer, timed run.
+ */
+#define MANY_FDS 512
+
+static void test_many_event_notifiers(void)
+{
+    EventNotifierTestData *data = g_new0(EventNotifierTestData, MANY_FDS);
+    int iterations = g_test_perf() ? 100000 : 2000;
+    gint64 start, elapsed;
+    int i, j;
+
+    for (i = 0; i < MANY_FDS; i++) {
+        data[i].active = iterations + 1;
+        event_notifier_init(&data[i].e, false);
+        aio_set_event_notifier(ctx, &data[i].e, event_ready_cb,
+                               event_active_cb);
+    }
+    g_assert(aio_poll(ctx, false));
+
+    start = g_get_monotonic_time();
+    for (i = 0; i < iterations; i++) {
+        j = (i * 7) % MANY_FDS;
+        event_notifier_set(&data[j].e);
+        g_assert(aio_poll(ctx, false));
+        g_assert_cmpint(data[j].n, ==, i / MANY_FDS + 1);
+    }
+    elapsed = g_get_monotonic_time() - start;
+    if (g_test_perf()) {
+        g_test_message("%d fds: %.0f ns per aio_poll()", MANY_FDS,
+                       (double)elapsed * 1000 / iterations);
+    }
+
+    for (i = 0; i < MANY_FDS; i++) {
+        aio_set_event_notifier(ctx, &data[i].e, NULL, NULL);
+        event_notifier_cleanup(&data[i].e);
+    }
+    g_free(data);
+    g_assert(!aio_poll(ctx, false));
+}
+
+/* Timers */
+
+typedef struct {
+    QEMUTimer *timer;
+    int64_t ns;
+    int64_t expire;
+    int n;
+    int max;
+} TimerTestData;
+
+static void timer_test_cb(void *opaque)
+{
+    TimerTestData *data = opaque;
+    int64_t now = qemu_get_clock_ns(rt_clock);
+
+    g_assert_cmpint(now, >=, data->expire);
+    if (++data->n < data->max) {
+        data->expire = now + data->ns;
+        qemu_mod_timer_ns(data->timer, data->expire);
+    }
+}
+
+static void test_timer_schedule(void)
+{
+    TimerTestData data = { .ns = SCALE_MS * 10, .max = 2 };
+
+    data.timer = aio_timer_new(ctx, rt_clock, SCALE_NS, timer_test_cb, &data);
+    data.expire = qemu_get_clock_ns(rt_clock) + data.ns;
+    qemu_mod_timer_ns(data.timer, data.expire);
+
+    /* A pending timer is outstanding work */
+    g_assert(aio_poll(ctx, false));
+    g_assert_cmpint(data.n, ==, 0);
+
+    g_assert(aio_poll(ctx, true));
+    g_assert_cmpint(data.n, ==, 1);
+    while (data.n < 2) {
+        g_assert(aio_poll(ctx, true));
+    }
+    g_assert(!qemu_timer_pending(data.timer));
+    wait_for_aio();
+    g_assert(!aio_poll(ctx, false));
+    qemu_free_timer(data.timer);
+}
+
+/* Many timers, armed in random order, some of them re-armed or deleted */
+#define MANY_TIMERS 200
+
+static int64_t timer_order_last;
+static int timer_order_n;
+
+static void timer_order_cb(void *opaque)
+{
+    TimerTestData *data = opaque;
+
+    g_assert_cmpint(data->expire, >=, timer_order_last);
+    g_assert_cmpint(qemu_get_clock_ns(rt_clock), >=, data->expire);
+    timer_order_last = data->expire;
+    data->n++;
+    timer_order_n++;
+}
+
+static void test_timer_order(void)
+{
+    TimerTestData *data = g_new0(TimerTestData, MANY_TIMERS);
+    int64_t base = qemu_get_clock_ns(rt_clock) + SCALE_MS * 5;
+    int i, expected = 0;
+
+    timer_order_last = 0;
+    timer_order_n = 0;
+    for (i = 0; i < MANY_TIMERS; i++) {
+        data[i].timer = aio_timer_new(ctx, rt_clock, SCALE_NS,
+                                      timer_order_cb, &data[i]);
+        data[i].expire = base + (i * 7919 % MANY_TIMERS) * SCALE_US * 10;
+        qemu_mod_timer_ns(data[i].timer, data[i].expire);
+        g_assert(qemu_timer_pending(data[i].timer));
+    }
+    for (i = 0; i < MANY_TIMERS; i += 3) {
+        qemu_del_timer(data[i].timer);
+        g_assert(!qemu_timer_pending(data[i].timer));
+    }
+    for (i = 1; i < MANY_TIMERS; i += 3) {
+        data[i].expire = base + (i * 31 % MANY_TIMERS) * SCALE_US * 10 + 1;
+        qemu_mod_timer_ns(data[i].timer, data[i].expire);
+        g_assert_cmpint(qemu_timer_expire_time_ns(data[i].timer), ==,
+                        data[i].expire);
+    }
+    for (i = 0; i < MANY_TIMERS; i++) {
+        expected += qemu_timer_pending(data[i].timer);
+    }
+
+    while (timer_order_n < expected) {
+        g_assert(aio_poll(ctx, true));
+    }
+    g_assert(!aio_poll(ctx, false));
+
+    for (i = 0; i < MANY_TIMERS; i++) {
+        g_assert_cmpint(data[i].n, ==, i % 3 != 0);
+        qemu_free_timer(data[i].timer);
+    }
+    g_free(data);
+}
+
+/* Timers with the same slack that expire close together fire together */
+static void test_timer_slack(void)
+{
+    TimerTestData data[2] = { { .max = 1 }, { .max = 1 } };
+    int64_t base = qemu_get_clock_ns(rt_clock) + SCALE_MS * 5;
+    int i;
+
+    base -= base % SCALE_MS;
+    for (i = 0; i < 2; i++) {
+        data[i].timer = aio_timer_new(ctx, rt_clock, SCALE_NS,
+                                      timer_test_cb, &data[i]);
+        qemu_timer_set_slack(data[i].timer, SCALE_MS);
+        data[i].expire = base + SCALE_US * (100 + 500 * i);
+        qemu_mod_timer_ns(data[i].timer, data[i].expire);
+        g_assert_cmpint(qemu_timer_expire_time_ns(data[i].timer), ==,
+                        data[i].expire);
+    }
+
+    while (!data[0].n && !data[1].n) {
+        g_assert(aio_poll(ctx, true));
+    }
+    g_assert_cmpint(data[0].n, ==, 1);
+    g_assert_cmpint(data[1].n, ==, 1);
+    g_assert_cmpint(qemu_get_clock_ns(rt_clock), >=, base + SCALE_MS);
+    g_assert(!aio_poll(ctx, false));
+
+    for (i = 0; i < 2; i++) {
+        qemu_free_timer(data[i].timer);
+    }
+}
+
+/* A timer with slack that is due runs when another timer wakes us up */
+static void test_timer_slack_piggyback(void)
+{
+    TimerTestData low = { .max = 1 }, high = { .max = 1 };
+    int64_t now = qemu_get_clock_ns(rt_clock);
+
+    low.timer = aio_timer_new(ctx, rt_clock, SCALE_NS, timer_test_cb, &low);
+    qemu_timer_set_slack(low.timer, SCALE_MS * 1000);
+    low.expire = now + SCALE_MS;
+    qemu_mod_timer_ns(low.timer, low.expire);
+
+    high.timer = aio_timer_new(ctx, rt_clock, SCALE_NS, timer_test_cb, &high);
+    high.expire = now + SCALE_MS * 3;
+    qemu_mod_timer_ns(high.timer, high.expire);
+
+    while (!high.n) {
+        g_assert(aio_poll(ctx, true));
+    }
+    g_assert_cmpint(low.n, ==, 1);
+    g_assert(!aio_poll(ctx, false));
+
+    qemu_free_timer(low.timer);
+    qemu_free_timer(high.timer);
+}
+
 /* Now the same tests, using the context as a GSource.  They are
  * very similar to the ones above, with g_main_context_iteration
  * replacing aio_poll.  However:
@@ -622,12 +877,32 @@ static void test_source_wait_event_notifier_noflush(void)
     event_notifier_cleanup(&data.e);
 }
 
+static void test_source_timer_schedule(void)
+{
+    TimerTestData data = { .ns = SCALE_MS * 10, .max = 2 };
+
+    data.timer = aio_timer_new(ctx, rt_clock, SCALE_NS, timer_test_cb, &data);
+    data.expire = qemu_get_clock_ns(rt_clock) + data.ns;
+    qemu_mod_timer_ns(data.timer, data.expire);
+
+    while (g_main_context_iteration(NULL, false));
+    g_assert_cmpint(data.n, ==, 0);
+
+    while (data.n < 2) {
+        g_main_context_iteration(NULL, true);
+    }
+    g_assert(!qemu_timer_pending(data.timer));
+    while (g_main_context_iteration(NULL, false));
+    qemu_free_timer(data.timer);
+}
+
 /* End of tests.  */
 
 int main(int argc, char **argv)
 {
     GSource *src;
 
+    init_clocks();
     ctx = aio_context_new();
     src = aio_get_g_source(ctx);
     g_source_attach(src, NULL);
@@ -644,10 +919,16 @@ int main(int argc, char **argv)
     g_test_add_func("/aio/bh/callback-delete/one",  test_bh_delete_from_cb);
     g_test_add_func("/aio/bh/callback-delete/many", test_bh_delete_from_cb_many);
     g_test_add_func("/aio/bh/flush",                test_bh_flush);
+    g_test_add_func("/aio/bh/schedule-threads",     test_bh_schedule_threads);
     g_test_add_func("/aio/event/add-remove",        test_set_event_notifier);
     g_test_add_func("/aio/event/wait",              test_wait_event_notifier);
     g_test_add_func("/aio/event/wait/no-flush-cb",  test_wait_event_notifier_noflush);
     g_test_add_func("/aio/event/flush",             test_flush_event_notifier);
+    g_test_add_func("/aio/event/many",              test_many_event_notifiers);
+    g_test_add_func("/aio/timer/schedule",          test_timer_schedule);
+    g_test_add_func("/aio/timer/order",             test_timer_order);
+    g_test_add_func("/aio/timer/slack",             test_timer_slack);
+    g_test_add_func("/aio/timer/slack/piggyback",   test_timer_slack_piggyback);
 
     g_test_add_func("/aio-gsource/notify",                  test_source_notify);
     g_test_add_func("/aio-gsource/flush",                   test_source_flush);
@@ -662,5 +943,6 @@ int main(int argc, char **argv)
     g_test_add_func("/aio-gsource/event/wait",              test_source_wait_event_notifier);
     g_test_add_func("/aio-gsource/event/wait/no-flush-cb",  test_source_wait_event_notifier_noflush);
     g_test_add_func("/aio-gsource/event/flush",             test_source_flush_event_notifier);
+    g_test_add_func("/aio-gsource/timer/schedule",          test_source_timer_schedule);
     return g_test_run();
 }
@@ -13,6 +13,129 @@
 
 #include <glib.h>
 #include "block/coroutine.h"
+#include "qemu/thread.h"
+
+/*
+ * Check that the coroutine locks are fair
+ */
+
+static CoMutex test_mutex;
+static CoRwlock test_rwlock;
+static int lock_order[8];
+static int lock_order_len;
+
+static void lock_record(int id)
+{
+    g_assert_cmpint(lock_order_len, <, G_N_ELEMENTS(lock_order));
+    lock_order[lock_order_len++] = id;
+}
+
+/* Take the mutex, yield, then release it and try to take it right back */
+static void coroutine_fn mutex_relocker(void *opaque)
+{
+    int id = (intptr_t)opaque;
+
+    qemu_co_mutex_lock(&test_mutex);
+    lock_record(id);
+    qemu_coroutine_yield();
+    qemu_co_mutex_unlock(&test_mutex);
+
+    qemu_co_mutex_lock(&test_mutex);
+    lock_record(id);
+    qemu_co_mutex_unlock(&test_mutex);
+}
+
+static void coroutine_fn mutex_locker(void *opaque)
+{
+    int id = (intptr_t)opaque;
+
+    qemu_co_mutex_lock(&test_mutex);
+    lock_record(id);
+    qemu_co_mutex_unlock(&test_mutex);
+}
+
+static void test_co_mutex_fair(void)
+{
+    Coroutine *co;
+
+    qemu_co_mutex_init(&test_mutex);
+    lock_order_len = 0;
+
+    co = qemu_coroutine_create(mutex_relocker);
+    qemu_coroutine_enter(co, (void *)(intptr_t)1);
+    qemu_coroutine_enter(qemu_coroutine_create(mutex_locker),
+                         (void *)(intptr_t)2);
+    qemu_coroutine_enter(qemu_coroutine_create(mutex_locker),
+                         (void *)(intptr_t)3);
+    g_assert_cmpint(lock_order_len, ==, 1);
+
+    /* the first coroutine must queue up behind the other two */
+    qemu_coroutine_enter(co, NULL);
+    g_assert_cmpint(lock_order_len, ==, 4);
+    g_assert_cmpint(lock_order[1], ==, 2);
+    g_assert_cmpint(lock_order[2], ==, 3);
+    g_assert_cmpint(lock_order[3], ==, 1);
+    g_assert(!test_mutex.locked);
+    g_assert_cmpint(test_mutex.contended, ==, 3);
+}
+
+/* Take the lock as a reader (odd id) or a writer (even id) and yield */
+static void coroutine_fn rwlock_holder(void *opaque)
+{
+    int id = (intptr_t)opaque;
+
+    if (id & 1) {
+        qemu_co_rwlock_rdlock(&test_rwlock);
+    } else {
+        qemu_co_rwlock_wrlock(&test_rwlock);
+    }
+    lock_record(id);
+    qemu_coroutine_yield();
+    qemu_co_rwlock_unlock(&test_rwlock);
+}
+
+static void coroutine_fn rwlock_reader(void *opaque)
+{
+    qemu_co_rwlock_rdlock(&test_rwlock);
+    lock_record((intptr_t)opaque);
+    qemu_co_rwlock_unlock(&test_rwlock);
+}
+
+static void test_co_rwlock_fair(void)
+{
+    Coroutine *r1, *w2, *w4;
+
+    qemu_co_rwlock_init(&test_rwlock);
+    lock_order_len = 0;
+
+    r1 = qemu_coroutine_create(rwlock_holder);
+    w2 = qemu_coroutine_create(rwlock_holder);
+    w4 = qemu_coroutine_create(rwlock_holder);
+    qemu_coroutine_enter(r1, (void *)(intptr_t)1);
+    qemu_coroutine_enter(w2, (void *)(intptr_t)2);
+
+    /* a reader must not overtake the waiting writer... */
+    qemu_coroutine_enter(qemu_coroutine_create(rwlock_reader),
+                         (void *)(intptr_t)3);
+    g_assert_cmpint(lock_order_len, ==, 1);
+
+    qemu_coroutine_enter(r1, NULL);
+    g_assert_cmpint(lock_order_len, ==, 2);
+    g_assert_cmpint(lock_order[1], ==, 2);
+
+    /* ...but it goes before a writer that came after it */
+    qemu_coroutine_enter(w4, (void *)(intptr_t)4);
+    qemu_coroutine_enter(w2, NULL);
+    g_assert_cmpint(lock_order_len, ==, 4);
+    g_assert_cmpint(lock_order[2], ==, 3);
+    g_assert_cmpint(lock_order[3], ==, 4);
+
+    qemu_coroutine_enter(w4, NULL);
+    g_assert(!test_rwlock.writer);
+    g_assert_cmpint(test_rwlock.reader, ==, 0);
+    g_assert_cmpint(test_rwlock.pending_writers, ==, 0);
+    g_assert_cmpint(test_rwlock.contended, ==, 3);
+}
 
 /*
  * Check that qemu_in_coroutine() works
@@ -150,6 +273,65 @@ static void test_lifecycle(void)
     g_assert(done); /* expect done to be true (second time) */
 }
 
+/*
+ * Check that coroutines can be created and freed in several threads at
+ * once, with more of them in flight than the initial pool size
+ */
+
+#define N_THREADS 4
+#define QUEUE_DEPTH 256
+
+static void coroutine_fn yield_once(void *opaque)
+{
+    unsigned int *done = opaque;
+
+    qemu_coroutine_yield();
+    (*done)++;
+}
+
+static void *burst_thread(void *opaque)
+{
+    unsigned int rounds = *(unsigned int *)opaque;
+    Coroutine *coroutines[QUEUE_DEPTH];
+    unsigned int done;
+    unsigned int i, j;
+
+    for (i = 0; i < rounds; i++) {
+        done = 0;
+        for (j = 0; j < QUEUE_DEPTH; j++) {
+            coroutines[j] = qemu_coroutine_create(yield_once);
+            qemu_coroutine_enter(coroutines[j], &done);
+        }
+        for (j = 0; j < QUEUE_DEPTH; j++) {
+            qemu_coroutine_enter(coroutines[j], NULL);
+        }
+        g_assert_cmpint(done, ==, QUEUE_DEPTH);
+    }
+    return NULL;
+}
+
+static void run_burst_threads(unsigned int rounds)
+{
+    QemuThread threads[N_THREADS];
+    unsigned int i;
+
+    for (i = 0; i < N_THREADS; i++) {
+        qemu_thread_create(&threads[i], burst_thread, &rounds,
+                           QEMU_THREAD_JOINABLE);
+    }
+    for (i = 0; i < N_THREADS; i++) {
+        qemu_thread_join(&threads[i]);
+    }
+}
+
+static void test_threads(void)
+{
+    run_burst_threads(20);
+
+    /* The pools of the exited threads are reused here */
+    run_burst_threads(1);
+}
+
 /*
  * Lifecycle benchmark
  */
@@ -177,6 +359,50 @@ static void perf_lifecycle(void)
     g_test_message("Lifecycle %u iterations: %f s\n", max, duration);
 }
 
+static void perf_lifecycle_threads(void)
+{
+    unsigned int rounds = 1000;
+    double duration;
+
+    g_test_timer_start();
+    run_burst_threads(rounds);
+    duration = g_test_timer_elapsed();
+
+    g_test_message("Lifecycle %u threads x %u iterations of %u coroutines: "
+                   "%f s\n", N_THREADS, rounds, QUEUE_DEPTH, duration);
+}
+
+static void coroutine_fn yield_loop(void *opaque)
+{
+    unsigned int *counter = opaque;
+
+    while ((*counter) > 0) {
+        (*counter)--;
+        qemu_coroutine_yield();
+    }
+}
+
+static void perf_yield(void)
+{
+    unsigned int i, maxcycles;
+    double duration;
+    Coroutine *coroutine;
+
+    maxcycles = 10000000;
+    i = maxcycles;
+    coroutine = qemu_coroutine_create(yield_loop);
+
+    g_test_timer_start();
+    while (i > 0) {
+        qemu_coroutine_enter(coroutine, &i);
+    }
+    duration = g_test_timer_elapsed();
+
+    /* Each iteration switches into the coroutine and back */
+    g_test_message("Yield %u iterations: %f s, %f ns per switch\n",
+                   maxcycles, duration, duration * 1e9 / (2.0 * maxcycles));
+}
+
 static void perf_nesting(void)
 {
     unsigned int i, maxcycles, maxnesting;
@@ -211,9 +437,14 @@ int main(int argc, char **argv)
     g_test_add_func("/basic/nesting", test_nesting);
     g_test_add_func("/basic/self", test_self);
     g_test_add_func("/basic/in_coroutine", test_in_coroutine);
+    g_test_add_func("/basic/threads", test_threads);
+    g_test_add_func("/locking/co-mutex/fair", test_co_mutex_fair);
+    g_test_add_func("/locking/co-rwlock/fair", test_co_rwlock_fair);
     if (g_test_perf()) {
         g_test_add_func("/perf/lifecycle", perf_lifecycle);
+        g_test_add_func("/perf/lifecycle-threads", perf_lifecycle_threads);
         g_test_add_func("/perf/nesting", perf_nesting);
+        g_test_add_func("/perf/yield", perf_yield);
     }
     return g_test_run();
 }
@@ -30,7 +30,10 @@
 #include <string.h>
 
 #include "qemu-common.h"
+#include "qemu/bitops.h"
+#include "qemu/host-features.h"
 
+#define PAGE_SIZE 4096
 
 static void test_parse_uint_null(void)
 {
@@ -226,10 +229,124 @@ static void test_parse_uint_full_correct(void)
     g_assert_cmpint(i, ==, 123);
 }
 
+static const unsigned int kernel_features[] = {
+    0,
+    QEMU_HOST_FEATURE_SSE2,
+    QEMU_HOST_FEATURE_SSE2 | QEMU_HOST_FEATURE_AVX2,
+};
+
+static unsigned int host_features;
+
+static bool select_kernel(int k)
+{
+    if ((kernel_features[k] & host_features) != kernel_features[k]) {
+        return false;
+    }
+    qemu_host_features = kernel_features[k];
+    return true;
+}
+
+static void test_buffer_zero_run(void)
+{
+    uint8_t *buf = g_malloc0(2 * PAGE_SIZE + 1);
+    size_t start, len, i;
+    int k;
+
+    for (k = 0; k < ARRAY_SIZE(kernel_features); k++) {
+        if (!select_kernel(k)) {
+            continue;
+        }
+        /* unaligned starts and lengths around the 64-byte block size */
+        for (start = 0; start < 64; start += 7) {
+            for (len = 0; len <= 2 * PAGE_SIZE - start; len += 61) {
+                g_assert_cmpint(buffer_zero_run(buf + start, len), ==, len);
+            }
+        }
+        for (i = 0; i < 2 * PAGE_SIZE; i += 59) {
+            buf[i] = 1;
+            for (start = 0; start <= i && start < 64; start += 13) {
+                g_assert_cmpint(buffer_zero_run(buf + start,
+                                                2 * PAGE_SIZE - start),
+                                ==, i - start);
+            }
+            g_assert_cmpint(buffer_zero_run(buf, i), ==, i);
+            g_assert(!buffer_is_zero(buf, 2 * PAGE_SIZE));
+            buf[i] = 0;
+        }
+        g_assert(buffer_is_zero(buf, 2 * PAGE_SIZE));
+    }
+    qemu_host_features = host_features;
+
+    g_free(buf);
+}
+
+static void test_find_next_bit_sparse(void)
+{
+    unsigned long nbits = 64 * PAGE_SIZE;
+    unsigned long *bitmap = g_malloc0(BITS_TO_LONGS(nbits) * sizeof(long));
+    unsigned long bits[] = { 0, 1, 63, 64, 700, 4095, 4096, 12345, nbits - 1 };
+    unsigned long i, offset;
+
+    g_assert_cmpint(find_next_bit(bitmap, nbits, 0), ==, nbits);
+    for (i = 0; i < ARRAY_SIZE(bits); i++) {
+        set_bit(bits[i], bitmap);
+    }
+    offset = 0;
+    for (i = 0; i < ARRAY_SIZE(bits); i++) {
+        offset = find_next_bit(bitmap, nbits, offset);
+        g_assert_cmpint(offset, ==, bits[i]);
+        offset++;
+    }
+    g_assert_cmpint(find_next_bit(bitmap, nbits, offset), ==, nbits);
+    g_assert_cmpint(find_next_bit(bitmap, nbits - 1, 12346), ==, nbits - 1);
+
+    g_free(bitmap);
+}
+
+static void perf_buffer_is_zero(void)
+{
+    size_t size = 1024 * PAGE_SIZE;
+    uint8_t *buf = g_malloc0(size);
+    unsigned long nbits = size * BITS_PER_BYTE;
+    unsigned int i, k, maxcycles = 1000;
+    double duration;
+
+    for (k = 0; k < ARRAY_SIZE(kernel_features); k++) {
+        if (!select_kernel(k)) {
+            continue;
+        }
+        g_test_timer_start();
+        for (i = 0; i < maxcycles; i++) {
+            buffer_is_zero(buf, size);
+        }
+        duration = g_test_timer_elapsed();
+        g_test_message("is_zero features %#x: %f GB/s, %f pages/s",
+                       kernel_features[k],
+                       (double)maxcycles * size / duration / 1e9,
+                       (double)maxcycles * (size / PAGE_SIZE) / duration);
+
+        /* the same memory as a clean dirty bitmap, one bit per page */
+        g_test_timer_start();
+        for (i = 0; i < maxcycles; i++) {
+            find_next_bit((unsigned long *)buf, nbits, 0);
+        }
+        duration = g_test_timer_elapsed();
+        g_test_message("find_next_bit features %#x: %f GB/s, %f pages/s",
+                       kernel_features[k],
+                       (double)maxcycles * size / duration / 1e9,
+                       (double)maxcycles * nbits / duration);
+    }
+    qemu_host_features = host_features;
+
+    g_free(buf);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
 
+    host_features = qemu_host_features;
+
     g_test_add_func("/cutils/parse_uint/null", test_parse_uint_null);
     g_test_add_func("/cutils/parse_uint/empty", test_parse_uint_empty);
     g_test_add_func("/cutils/parse_uint/whitespace",
@@ -246,6 +363,11 @@ int main(int argc, char **argv)
                     test_parse_uint_full_trailing);
     g_test_add_func("/cutils/parse_uint_full/correct",
                     test_parse_uint_full_correct);
+    g_test_add_func("/cutils/buffer_zero_run", test_buffer_zero_run);
+    g_test_add_func("/cutils/find_next_bit/sparse", test_find_next_bit_sparse);
+    if (g_test_perf()) {
+        g_test_add_func("/cutils/perf/buffer_is_zero", perf_buffer_is_zero);
+    }
 
     return g_test_run();
 }
@@ -12,6 +12,7 @@
 #include <glib.h>
 #include <stdarg.h>
 #include "qemu/hbitmap.h"
+#include "qemu/thread.h"
 
 #define LOG_BITS_PER_LONG          (BITS_PER_LONG == 32 ? 5 : 6)
 
@@ -369,6 +370,299 @@ static void test_hbitmap_iter_granularity(TestHBitmapData *data,
     g_assert_cmpint(hbitmap_iter_next(&hbi), <, 0);
 }
 
+static void test_hbitmap_iter_range(TestHBitmapData *data,
+                                    const void *unused)
+{
+    HBitmapIter hbi;
+
+    hbitmap_test_init(data, L3, 0);
+    hbitmap_test_set(data, 0, 1);
+    hbitmap_test_set(data, L1 - 1, 2);
+    hbitmap_test_set(data, L2 + 5, 1);
+    hbitmap_test_set(data, L3 - 1, 1);
+
+    hbitmap_iter_init_range(&hbi, data->hb, 0, L1);
+    g_assert_cmpint(hbitmap_iter_next(&hbi), ==, 0);
+    g_assert_cmpint(hbitmap_iter_next(&hbi), ==, L1 - 1);
+    g_assert_cmpint(hbitmap_iter_next(&hbi), <, 0);
+
+    /* the range ends in the middle of a word */
+    hbitmap_iter_init_range(&hbi, data->hb, 1, L2 + 4);
+    g_assert_cmpint(hbitmap_iter_next(&hbi), ==, L1 - 1);
+    g_assert_cmpint(hbitmap_iter_next(&hbi), ==, L1);
+    g_assert_cmpint(hbitmap_iter_next(&hbi), <, 0);
+
+    hbitmap_iter_init_range(&hbi, data->hb, L2 + 5, L3);
+    g_assert_cmpint(hbitmap_iter_next(&hbi), ==, L2 + 5);
+    g_assert_cmpint(hbitmap_iter_next(&hbi), ==, L3 - 1);
+    g_assert_cmpint(hbitmap_iter_next(&hbi), <, 0);
+}
+
+/* Store the HBitmap in parts of @chunk bits and load it back into a bitmap
+ * that starts out full, then check it against the shadow bitmap.
+ */
+static void hbitmap_test_serialize_range(TestHBitmapData *data,
+                                         uint64_t chunk)
+{
+    HBitmap *hb = hbitmap_alloc(data->size, data->granularity);
+    uint64_t start, count, size;
+    uint8_t *buf;
+
+    hbitmap_set(hb, 0, data->size);
+    for (start = 0; start < data->size; start += chunk) {
+        count = MIN(chunk, data->size - start);
+        size = hbitmap_serialization_size(data->hb, start, count);
+        buf = g_malloc(size);
+        hbitmap_serialize_part(data->hb, buf, start, count);
+        hbitmap_deserialize_part(hb, buf, start, count);
+        g_free(buf);
+    }
+    hbitmap_deserialize_finish(hb);
+
+    hbitmap_free(data->hb);
+    data->hb = hb;
+    hbitmap_test_check(data, 0);
+}
+
+static void test_hbitmap_serialize(TestHBitmapData *data,
+                                   const void *unused)
+{
+    uint64_t align;
+
+    hbitmap_test_init(data, L3 - 177, 0);
+    align = hbitmap_serialization_align(data->hb);
+    g_assert_cmpint(align, ==, 64);
+    g_assert_cmpint(hbitmap_serialization_size(data->hb, 0, 64), ==, 8);
+    g_assert_cmpint(hbitmap_serialization_size(data->hb, 0, 65), ==, 16);
+
+    hbitmap_test_serialize_range(data, L3);
+    hbitmap_test_set(data, 0, 1);
+    hbitmap_test_set(data, 63, 3);
+    hbitmap_test_set(data, L2 - 7, L1 + 13);
+    hbitmap_test_set(data, L3 - 178, 1);
+    hbitmap_test_serialize_range(data, 64);
+    hbitmap_test_serialize_range(data, 3 * 64);
+    hbitmap_test_serialize_range(data, L3);
+}
+
+static void test_hbitmap_serialize_granularity(TestHBitmapData *data,
+                                               const void *unused)
+{
+    hbitmap_test_init(data, L2 + 3, 2);
+    g_assert_cmpint(hbitmap_serialization_align(data->hb), ==, 256);
+    g_assert_cmpint(hbitmap_serialization_size(data->hb, 0, L2 + 3), ==,
+                    (L2 / 4 / 64 + 1) * 8);
+
+    hbitmap_test_set(data, 4, 1);
+    hbitmap_test_set(data, 256, 1);
+    hbitmap_test_set(data, L2, 1);
+    hbitmap_test_serialize_range(data, 256);
+    hbitmap_test_serialize_range(data, L2 + 3);
+}
+
+static void test_hbitmap_merge(TestHBitmapData *data,
+                               const void *unused)
+{
+    HBitmap *a, *b;
+
+    hbitmap_test_init(data, L3, 0);
+    a = hbitmap_alloc(L3, 0);
+    hbitmap_set(a, 0, 7);
+    hbitmap_set(a, L3 - 1, 1);
+    b = hbitmap_alloc(L3, 0);
+    hbitmap_set(b, 5, 10);
+    hbitmap_set(b, L2, L1);
+    g_assert(hbitmap_merge(a, b));
+    hbitmap_free(b);
+
+    hbitmap_test_set(data, 0, 7);
+    hbitmap_test_set(data, 5, 10);
+    hbitmap_test_set(data, L2, L1);
+    hbitmap_test_set(data, L3 - 1, 1);
+    hbitmap_free(data->hb);
+    data->hb = a;
+    hbitmap_test_check(data, 0);
+    g_assert_cmpint(hbitmap_count(data->hb), ==, 15 + L1 + 1);
+
+    b = hbitmap_alloc(L3 - 1, 0);
+    g_assert(!hbitmap_merge(data->hb, b));
+    hbitmap_free(b);
+}
+
+static void test_hbitmap_merge_granularity(TestHBitmapData *data,
+                                           const void *unused)
+{
+    HBitmap *a, *b;
+
+    /* a coarser source sets whole groups of its own granularity */
+    hbitmap_test_init(data, L2 + 5, 0);
+    a = hbitmap_alloc(L2 + 5, 0);
+    b = hbitmap_alloc(L2 + 5, 4);
+    hbitmap_set(b, 17, 1);
+    hbitmap_set(b, 40, 30);
+    hbitmap_set(b, L2 + 4, 1);
+    g_assert(hbitmap_merge(a, b));
+    hbitmap_free(b);
+
+    hbitmap_test_set(data, 16, 16);
+    hbitmap_test_set(data, 32, 48);
+    hbitmap_test_set(data, L2, 5);
+    hbitmap_free(data->hb);
+    data->hb = a;
+    hbitmap_test_check(data, 0);
+
+    /* a finer source is rounded up to the groups of the destination */
+    b = hbitmap_alloc(L2 + 5, 0);
+    hbitmap_set(b, 200, 1);
+    hbitmap_free(data->hb);
+    data->hb = hbitmap_alloc(L2 + 5, 3);
+    g_assert(hbitmap_merge(data->hb, b));
+    g_assert_cmpint(hbitmap_count(data->hb), ==, 8);
+    g_assert(hbitmap_get(data->hb, 207));
+    g_assert(!hbitmap_get(data->hb, 208));
+    hbitmap_free(b);
+}
+
+#define HBITMAP_TEST_THREADS 4
+
+typedef struct TestHBitmapThread {
+    HBitmap  *hb;
+    uint64_t  start;
+    uint64_t  count;
+} TestHBitmapThread;
+
+/* Set random bits in our own range, then visit and reset them all.  */
+static void *hbitmap_test_thread(void *opaque)
+{
+    TestHBitmapThread *t = opaque;
+    GRand *rand = g_rand_new_with_seed(t->start);
+    HBitmapIter hbi;
+    int64_t next;
+    int i, j, n;
+
+    for (i = 0; i < 200; i++) {
+        for (j = 0; j < 64; j++) {
+            hbitmap_set(t->hb,
+                        t->start + g_rand_int_range(rand, 0, t->count), 1);
+        }
+
+        n = 0;
+        hbitmap_iter_init_range(&hbi, t->hb, t->start, t->count);
+        while ((next = hbitmap_iter_next(&hbi)) >= 0) {
+            g_assert_cmpint(next, >=, t->start);
+            g_assert_cmpint(next, <, t->start + t->count);
+            hbitmap_reset(t->hb, next, 1);
+            n++;
+        }
+        g_assert_cmpint(n, >, 0);
+    }
+
+    g_rand_free(rand);
+    return NULL;
+}
+
+static void test_hbitmap_iter_threads(TestHBitmapData *data,
+                                      const void *unused)
+{
+    QemuThread threads[HBITMAP_TEST_THREADS];
+    TestHBitmapThread t[HBITMAP_TEST_THREADS];
+    HBitmapIter hbi;
+    int i;
+
+    /* ranges that do not start or end on a word boundary */
+    hbitmap_test_init(data, L3, 0);
+    for (i = 0; i < HBITMAP_TEST_THREADS; i++) {
+        t[i].hb = data->hb;
+        t[i].start = i * (L3 / HBITMAP_TEST_THREADS) + i;
+        t[i].count = L3 / HBITMAP_TEST_THREADS - 2 * i - 1;
+        qemu_thread_create(&threads[i], hbitmap_test_thread, &t[i],
+                           QEMU_THREAD_JOINABLE);
+    }
+    for (i = 0; i < HBITMAP_TEST_THREADS; i++) {
+        qemu_thread_join(&threads[i]);
+    }
+
+    g_assert(hbitmap_empty(data->hb));
+    hbitmap_iter_init(&hbi, data->hb, 0);
+    g_assert_cmpint(hbitmap_iter_next(&hbi), <, 0);
+}
+
+static void hbitmap_perf_report(const char *what, uint64_t bits,
+                                double duration)
+{
+    g_test_message("%s: %" PRIu64 " bits in %f s, %f Gbit/s",
+                   what, bits, duration, bits / duration / 1e9);
+}
+
+static void test_hbitmap_perf(TestHBitmapData *data,
+                              const void *unused)
+{
+    uint64_t size = 1ULL << 30, count, i;
+    HBitmap *hb, *hb2;
+    HBitmapIter hbi;
+    uint8_t *buf;
+    double duration;
+
+    /* one bit per sector of a 512 GiB disk */
+    hb = hbitmap_alloc(size, 0);
+
+    g_test_timer_start();
+    for (i = 0; i < size; i += 4096) {
+        hbitmap_set(hb, i, 1);
+    }
+    duration = g_test_timer_elapsed();
+    hbitmap_perf_report("set, sparse", size / 4096, duration);
+
+    g_test_timer_start();
+    count = 0;
+    hbitmap_iter_init(&hbi, hb, 0);
+    while (hbitmap_iter_next(&hbi) >= 0) {
+        count++;
+    }
+    duration = g_test_timer_elapsed();
+    g_assert_cmpint(count, ==, size / 4096);
+    hbitmap_perf_report("iterate, sparse", size, duration);
+
+    buf = g_malloc(hbitmap_serialization_size(hb, 0, size));
+    g_test_timer_start();
+    hbitmap_serialize_part(hb, buf, 0, size);
+    duration = g_test_timer_elapsed();
+    hbitmap_perf_report("serialize", size, duration);
+
+    hb2 = hbitmap_alloc(size, 0);
+    g_test_timer_start();
+    hbitmap_deserialize_part(hb2, buf, 0, size);
+    hbitmap_deserialize_finish(hb2);
+    duration = g_test_timer_elapsed();
+    hbitmap_perf_report("deserialize", size, duration);
+    g_free(buf);
+
+    g_test_timer_start();
+    hbitmap_set(hb2, 0, size);
+    duration = g_test_timer_elapsed();
+    hbitmap_perf_report("set, dense", size, duration);
+
+    g_test_timer_start();
+    hbitmap_merge(hb, hb2);
+    duration = g_test_timer_elapsed();
+    hbitmap_perf_report("merge", size, duration);
+    hbitmap_free(hb2);
+
+    hb2 = hbitmap_alloc(size, 7);
+    hbitmap_set(hb2, 0, size);
+    g_test_timer_start();
+    hbitmap_merge(hb2, hb);
+    duration = g_test_timer_elapsed();
+    hbitmap_perf_report("merge, granularity 0 into 7", size, duration);
+    hbitmap_free(hb2);
+
+    g_test_timer_start();
+    hbitmap_reset(hb, 0, size);
+    duration = g_test_timer_elapsed();
+    hbitmap_perf_report("reset, dense", size, duration);
+    hbitmap_free(hb);
+}
+
 static void hbitmap_test_add(const char *testpath,
                                    void (*test_func)(TestHBitmapData *data, const void *user_data))
 {
@@ -395,6 +689,17 @@ int main(int argc, char **argv)
     hbitmap_test_add("/hbitmap/reset/empty", test_hbitmap_reset_empty);
     hbitmap_test_add("/hbitmap/reset/general", test_hbitmap_reset);
     hbitmap_test_add("/hbitmap/granularity", test_hbitmap_granularity);
+    hbitmap_test_add("/hbitmap/iter/range", test_hbitmap_iter_range);
+    hbitmap_test_add("/hbitmap/iter/threads", test_hbitmap_iter_threads);
+    hbitmap_test_add("/hbitmap/serialize/basic", test_hbitmap_serialize);
+    hbitmap_test_add("/hbitmap/serialize/granularity",
+                     test_hbitmap_serialize_granularity);
+    hbitmap_test_add("/hbitmap/merge/basic", test_hbitmap_merge);
+    hbitmap_test_add("/hbitmap/merge/granularity",
+                     test_hbitmap_merge_granularity);
+    if (g_test_perf()) {
+        hbitmap_test_add("/hbitmap/perf", test_hbitmap_perf);
+    }
     g_test_run();
 
     return 0;
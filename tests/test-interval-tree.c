@@ -0,0 +1,196 @@
+/*
+ * Interval tree unit-tests.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include <string.h>
+#include "qemu/interval-tree.h"
+
+#define N_NODES 512
+
+static IntervalTreeNode nodes[N_NODES];
+static bool in_tree[N_NODES];
+
+static bool overlaps(IntervalTreeNode *n, int64_t start, int64_t last)
+{
+    return n->start <= last && n->last >= start;
+}
+
+static int check_subtree(IntervalTreeNode *n, int64_t *max_last)
+{
+    int64_t l_last = INT64_MIN, r_last = INT64_MIN;
+    int lh, rh;
+
+    if (!n) {
+        *max_last = INT64_MIN;
+        return 0;
+    }
+
+    lh = check_subtree(n->left, &l_last);
+    rh = check_subtree(n->right, &r_last);
+    g_assert_cmpint(lh - rh, <=, 1);
+    g_assert_cmpint(rh - lh, <=, 1);
+    g_assert_cmpint(n->height, ==, 1 + (lh > rh ? lh : rh));
+    if (n->left) {
+        g_assert_cmpint(n->left->start, <=, n->start);
+    }
+    if (n->right) {
+        g_assert_cmpint(n->right->start, >=, n->start);
+    }
+
+    *max_last = n->last;
+    if (l_last > *max_last) {
+        *max_last = l_last;
+    }
+    if (r_last > *max_last) {
+        *max_last = r_last;
+    }
+    g_assert_cmpint(n->subtree_last, ==, *max_last);
+    return n->height;
+}
+
+/* Compare an iteration over [start, last] with a linear scan */
+static void check_query(IntervalTree *tree, int64_t start, int64_t last)
+{
+    IntervalTreeNode *n;
+    int found = 0, expected = 0;
+    int64_t prev_start = INT64_MIN;
+    int i;
+
+    for (i = 0; i < N_NODES; i++) {
+        if (in_tree[i] && overlaps(&nodes[i], start, last)) {
+            expected++;
+        }
+    }
+
+    for (n = interval_tree_iter_first(tree, start, last); n;
+         n = interval_tree_iter_next(tree, n, start, last)) {
+        g_assert(in_tree[n - nodes]);
+        g_assert(overlaps(n, start, last));
+        g_assert_cmpint(n->start, >=, prev_start);
+        prev_start = n->start;
+        found++;
+    }
+
+    g_assert_cmpint(found, ==, expected);
+}
+
+static void test_interval_tree_empty(void)
+{
+    IntervalTree tree = INTERVAL_TREE_INITIALIZER;
+
+    g_assert(interval_tree_empty(&tree));
+    g_assert(interval_tree_iter_first(&tree, 0, INT64_MAX) == NULL);
+}
+
+static void test_interval_tree_basic(void)
+{
+    IntervalTree tree;
+    IntervalTreeNode a = { .start = 0, .last = 9 };
+    IntervalTreeNode b = { .start = 20, .last = 29 };
+    IntervalTreeNode c = { .start = 5, .last = 24 };
+
+    interval_tree_init(&tree);
+    interval_tree_insert(&tree, &a);
+    interval_tree_insert(&tree, &b);
+    interval_tree_insert(&tree, &c);
+
+    g_assert(interval_tree_iter_first(&tree, 10, 19) == &c);
+    g_assert(interval_tree_iter_next(&tree, &c, 10, 19) == NULL);
+    g_assert(interval_tree_iter_first(&tree, 30, 40) == NULL);
+    g_assert(interval_tree_iter_first(&tree, 9, 20) == &a);
+    g_assert(interval_tree_iter_next(&tree, &a, 9, 20) == &c);
+    g_assert(interval_tree_iter_next(&tree, &c, 9, 20) == &b);
+
+    interval_tree_remove(&tree, &c);
+    g_assert(interval_tree_iter_first(&tree, 10, 19) == NULL);
+    interval_tree_remove(&tree, &a);
+    interval_tree_remove(&tree, &b);
+    g_assert(interval_tree_empty(&tree));
+}
+
+static void test_interval_tree_duplicates(void)
+{
+    IntervalTree tree;
+    IntervalTreeNode dup[8];
+    IntervalTreeNode *n;
+    int i, count = 0;
+
+    interval_tree_init(&tree);
+    for (i = 0; i < 8; i++) {
+        dup[i].start = 100;
+        dup[i].last = 107;
+        interval_tree_insert(&tree, &dup[i]);
+    }
+
+    for (n = interval_tree_iter_first(&tree, 107, 107); n;
+         n = interval_tree_iter_next(&tree, n, 107, 107)) {
+        count++;
+    }
+    g_assert_cmpint(count, ==, 8);
+
+    /* each node can be removed on its own */
+    for (i = 7; i >= 0; i -= 2) {
+        interval_tree_remove(&tree, &dup[i]);
+    }
+    count = 0;
+    for (n = interval_tree_iter_first(&tree, 0, 1000); n;
+         n = interval_tree_iter_next(&tree, n, 0, 1000)) {
+        g_assert((n - dup) % 2 == 0);
+        count++;
+    }
+    g_assert_cmpint(count, ==, 4);
+}
+
+static void test_interval_tree_random(void)
+{
+    IntervalTree tree;
+    int64_t max_last;
+    int i, j;
+
+    interval_tree_init(&tree);
+    memset(in_tree, 0, sizeof(in_tree));
+
+    for (i = 0; i < 8 * N_NODES; i++) {
+        j = g_test_rand_int_range(0, N_NODES);
+        if (in_tree[j]) {
+            interval_tree_remove(&tree, &nodes[j]);
+            in_tree[j] = false;
+        } else {
+            nodes[j].start = g_test_rand_int_range(0, 4096);
+            nodes[j].last = nodes[j].start + g_test_rand_int_range(0, 128);
+            interval_tree_insert(&tree, &nodes[j]);
+            in_tree[j] = true;
+        }
+
+        if (i % 64 == 0) {
+            int64_t start = g_test_rand_int_range(0, 4096);
+
+            check_subtree(tree.root, &max_last);
+            check_query(&tree, start, start + g_test_rand_int_range(0, 256));
+        }
+    }
+
+    for (j = 0; j < N_NODES; j++) {
+        if (in_tree[j]) {
+            interval_tree_remove(&tree, &nodes[j]);
+        }
+    }
+    g_assert(interval_tree_empty(&tree));
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/interval-tree/empty", test_interval_tree_empty);
+    g_test_add_func("/interval-tree/basic", test_interval_tree_basic);
+    g_test_add_func("/interval-tree/duplicates",
+                    test_interval_tree_duplicates);
+    g_test_add_func("/interval-tree/random", test_interval_tree_random);
+    g_test_run();
+
+    return 0;
+}
@@ -398,6 +398,123 @@ static void test_discard_back(void)
     iov_free(iov, iov_cnt);
 }
 
+static void test_memcpy(void)
+{
+    struct iovec *src, *dst;
+    unsigned src_cnt, dst_cnt;
+    size_t src_size, dst_size, soffset, doffset, bytes, ret, i;
+    unsigned char *sbuf, *dbuf, *expect;
+    int t;
+
+    for (t = 0; t < 100; t++) {
+        iov_random(&src, &src_cnt);
+        iov_random(&dst, &dst_cnt);
+        src_size = iov_size(src, src_cnt);
+        dst_size = iov_size(dst, dst_cnt);
+
+        sbuf = g_malloc(src_size);
+        for (i = 0; i < src_size; i++) {
+            sbuf[i] = i & 255;
+        }
+        iov_from_buf(src, src_cnt, 0, sbuf, src_size);
+        iov_memset(dst, dst_cnt, 0, 0xff, dst_size);
+
+        soffset = g_test_rand_int_range(0, src_size + 1);
+        doffset = g_test_rand_int_range(0, dst_size + 1);
+        bytes = g_test_rand_int_range(0, src_size + dst_size);
+        ret = iov_memcpy(dst, dst_cnt, doffset, src, src_cnt, soffset, bytes);
+        g_assert(ret == MIN(bytes, MIN(src_size - soffset,
+                                       dst_size - doffset)));
+
+        expect = g_malloc(dst_size);
+        memset(expect, 0xff, dst_size);
+        memcpy(expect + doffset, sbuf + soffset, ret);
+        dbuf = g_malloc(dst_size);
+        iov_to_buf(dst, dst_cnt, 0, dbuf, dst_size);
+        g_assert(memcmp(dbuf, expect, dst_size) == 0);
+
+        g_free(sbuf);
+        g_free(dbuf);
+        g_free(expect);
+        iov_free(src, src_cnt);
+        iov_free(dst, dst_cnt);
+    }
+}
+
+static void test_slice(void)
+{
+    struct iovec *iov;
+    unsigned iov_cnt;
+    QEMUIOVector src, dst;
+    size_t size, offset, bytes, i;
+    unsigned char *buf, *out;
+    int t;
+
+    for (t = 0; t < 100; t++) {
+        iov_random(&iov, &iov_cnt);
+        qemu_iovec_init_external(&src, iov, iov_cnt);
+        size = src.size;
+        buf = g_malloc(size);
+        for (i = 0; i < size; i++) {
+            buf[i] = i & 255;
+        }
+        qemu_iovec_from_buf(&src, 0, buf, size);
+
+        offset = g_test_rand_int_range(0, size + 1);
+        bytes = g_test_rand_int_range(0, size - offset + 1);
+        qemu_iovec_init_slice(&dst, &src, offset, bytes);
+        g_assert(dst.size == bytes);
+        for (i = 0; i < dst.niov; i++) {
+            g_assert(dst.iov[i].iov_len > 0);
+        }
+
+        /* the slice aliases the buffers of src */
+        out = g_malloc(bytes + 1);
+        g_assert(qemu_iovec_to_buf(&dst, 0, out, bytes) == bytes);
+        g_assert(memcmp(out, buf + offset, bytes) == 0);
+        qemu_iovec_memset(&dst, 0, 0xff, bytes);
+        g_assert(qemu_iovec_to_buf(&src, offset, out, bytes) == bytes);
+        for (i = 0; i < bytes; i++) {
+            g_assert(out[i] == 0xff);
+        }
+
+        /* slicing again reuses the storage of dst */
+        qemu_iovec_slice(&dst, &src, 0, size);
+        g_assert(dst.size == size && dst.niov == iov_cnt);
+
+        qemu_iovec_destroy(&dst);
+        g_free(out);
+        g_free(buf);
+        iov_free(iov, iov_cnt);
+    }
+}
+
+static void test_inline(void)
+{
+    QEMUIOVector qiov;
+    char buf[QEMU_IOVEC_INLINE * 2];
+    int i;
+
+    qemu_iovec_init(&qiov, QEMU_IOVEC_INLINE);
+    g_assert(qiov.iov == qiov.local_iov);
+    for (i = 0; i < QEMU_IOVEC_INLINE; i++) {
+        qemu_iovec_add(&qiov, buf + i, 1);
+    }
+    g_assert(qiov.iov == qiov.local_iov);
+
+    /* growing moves the vector out of line, keeping its contents */
+    for (; i < ARRAY_SIZE(buf); i++) {
+        qemu_iovec_add(&qiov, buf + i, 1);
+    }
+    g_assert(qiov.iov != qiov.local_iov);
+    g_assert(qiov.niov == ARRAY_SIZE(buf));
+    g_assert(qiov.size == ARRAY_SIZE(buf));
+    for (i = 0; i < ARRAY_SIZE(buf); i++) {
+        g_assert(qiov.iov[i].iov_base == buf + i);
+    }
+    qemu_iovec_destroy(&qiov);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -406,5 +523,8 @@ int main(int argc, char **argv)
     g_test_add_func("/basic/iov/io", test_io);
     g_test_add_func("/basic/iov/discard-front", test_discard_front);
     g_test_add_func("/basic/iov/discard-back", test_discard_back);
+    g_test_add_func("/basic/iov/memcpy", test_memcpy);
+    g_test_add_func("/basic/iov/slice", test_slice);
+    g_test_add_func("/basic/iov/inline", test_inline);
     return g_test_run();
 }
@@ -0,0 +1,142 @@
+/*
+ * Test software checksum offload and TCP segmentation
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include <string.h>
+#include "qemu/osdep.h"
+#include "net/checksum.h"
+
+#define ETH_HLEN    14
+#define IP_HLEN     20
+#define TCP_HLEN    20
+#define HDR_LEN     (ETH_HLEN + IP_HLEN + TCP_HLEN)
+
+static void build_frame(uint8_t *frame, int payload)
+{
+    uint8_t *ip = frame + ETH_HLEN, *tcp = ip + IP_HLEN;
+    int i;
+
+    memset(frame, 0, HDR_LEN);
+    memset(frame, 0x52, 12);
+    frame[12] = 0x08;                       /* IPv4 */
+    ip[0] = 0x45;
+    ip[2] = (IP_HLEN + TCP_HLEN + payload) >> 8;
+    ip[3] = (IP_HLEN + TCP_HLEN + payload) & 0xff;
+    ip[4] = 0x12;                           /* id 0x1234 */
+    ip[5] = 0x34;
+    ip[8] = 64;
+    ip[9] = 6;                              /* TCP */
+    ip[12] = 10; ip[15] = 2;                /* 10.0.0.2 -> 10.0.0.1 */
+    ip[16] = 10; ip[19] = 1;
+    tcp[0] = 0x12;                          /* ports */
+    tcp[3] = 80;
+    tcp[4] = 0xff; tcp[5] = 0xff;           /* seq 0xffffff00, wraps */
+    tcp[6] = 0xff; tcp[7] = 0x00;
+    tcp[12] = (TCP_HLEN / 4) << 4;
+    tcp[13] = 0x80 | 0x18 | 0x01;           /* CWR, PSH, ACK, FIN */
+    for (i = 0; i < payload; i++) {
+        frame[HDR_LEN + i] = i * 7;
+    }
+}
+
+/* Returns 0 if the TCP checksum of an IPv4 frame verifies */
+static uint16_t tcp_verify(uint8_t *frame, int length)
+{
+    uint8_t *ip = frame + ETH_HLEN;
+    uint32_t sum;
+
+    sum = net_checksum_add(length - ETH_HLEN - IP_HLEN, ip + IP_HLEN);
+    sum += net_checksum_add(8, ip + 12);
+    sum += 6 + length - ETH_HLEN - IP_HLEN;
+    return net_checksum_finish(sum);
+}
+
+typedef struct {
+    int count;
+    int payload;
+    uint8_t frame[2048];
+} SegmentState;
+
+static void check_segment(void *opaque, const uint8_t *data, int length)
+{
+    SegmentState *s = opaque;
+    uint8_t *frame = s->frame, *ip = frame + ETH_HLEN, *tcp = ip + IP_HLEN;
+    int n = length - HDR_LEN, off = s->count * 1000, i;
+    uint32_t seq;
+
+    g_assert_cmpint(length, <=, sizeof(s->frame));
+    memcpy(frame, data, length);
+
+    g_assert_cmpint(n, ==, MIN(1000, s->payload - off));
+    g_assert_cmpint(ip[2] << 8 | ip[3], ==, length - ETH_HLEN);
+    g_assert_cmpint(ip[4] << 8 | ip[5], ==, 0x1234 + s->count);
+    g_assert_cmpint(net_checksum_finish(net_checksum_add(IP_HLEN, ip)), ==, 0);
+    g_assert_cmpint(tcp_verify(frame, length), ==, 0);
+
+    seq = (uint32_t)tcp[4] << 24 | tcp[5] << 16 | tcp[6] << 8 | tcp[7];
+    g_assert_cmphex(seq, ==, 0xffffff00u + off);
+    g_assert_cmpint(!!(tcp[13] & 0x80), ==, s->count == 0);
+    g_assert_cmpint(!!(tcp[13] & 0x09), ==, off + n == s->payload);
+    g_assert_cmpint(tcp[13] & 0x10, ==, 0x10);
+
+    for (i = 0; i < n; i++) {
+        g_assert_cmpint(frame[HDR_LEN + i], ==, (uint8_t)((off + i) * 7));
+    }
+    s->count++;
+}
+
+static void test_tso(void)
+{
+    static uint8_t frame[HDR_LEN + 2500];
+    SegmentState s = { .payload = 2500 };
+
+    build_frame(frame, s.payload);
+    g_assert_cmpint(net_tso_segment(frame, sizeof(frame), 1000,
+                                    check_segment, &s), ==, 3);
+    g_assert_cmpint(s.count, ==, 3);
+}
+
+static void test_tso_not_tcp(void)
+{
+    static uint8_t frame[HDR_LEN + 100];
+    SegmentState s = { .payload = 100 };
+
+    build_frame(frame, s.payload);
+    frame[ETH_HLEN + 9] = 17;
+    g_assert_cmpint(net_tso_segment(frame, sizeof(frame), 1000,
+                                    check_segment, &s), ==, -1);
+    g_assert_cmpint(s.count, ==, 0);
+}
+
+static void test_complete(void)
+{
+    static uint8_t frame[HDR_LEN + 999], expected[HDR_LEN + 999];
+    uint8_t *tcp = frame + ETH_HLEN + IP_HLEN;
+    uint32_t sum;
+
+    build_frame(frame, 999);
+    memcpy(expected, frame, sizeof(frame));
+    net_checksum_calculate(expected, sizeof(expected));
+
+    /* What a guest leaves for the device: the folded pseudo header sum */
+    sum = net_checksum_add(8, frame + ETH_HLEN + 12) + 6 + TCP_HLEN + 999;
+    sum = (uint16_t)~net_checksum_finish(sum);
+    tcp[16] = sum >> 8;
+    tcp[17] = sum & 0xff;
+
+    net_checksum_complete(frame, sizeof(frame), ETH_HLEN + IP_HLEN, 16);
+    g_assert(memcmp(frame, expected, sizeof(frame)) == 0);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/net/checksum/complete", test_complete);
+    g_test_add_func("/net/tso/ipv4", test_tso);
+    g_test_add_func("/net/tso/not-tcp", test_tso_not_tcp);
+    return g_test_run();
+}
@@ -0,0 +1,223 @@
+/*
+ * QHT unit-tests.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include <string.h>
+#include "qemu-common.h"
+#include "qemu/qht.h"
+
+#define N_ITEMS 4096
+
+static uint32_t items[N_ITEMS];
+static bool in_table[N_ITEMS];
+
+static bool is_equal(const void *obj, const void *userp)
+{
+    return obj == userp;
+}
+
+/* a poor hash on purpose, so that the chains get long */
+static uint32_t hash_of(int i, uint32_t mask)
+{
+    return (uint32_t)i & mask;
+}
+
+static void check_lookups(QHT *ht, uint32_t mask)
+{
+    int i;
+
+    for (i = 0; i < N_ITEMS; i++) {
+        void *p = qht_lookup(ht, is_equal, &items[i], hash_of(i, mask));
+
+        g_assert(p == (in_table[i] ? &items[i] : NULL));
+    }
+}
+
+static void count_item(void *obj, uint32_t hash, void *userp)
+{
+    int i = (uint32_t *)obj - items;
+
+    g_assert(in_table[i]);
+    (*(size_t *)userp)++;
+}
+
+static size_t count_in_table(void)
+{
+    size_t n = 0;
+    int i;
+
+    for (i = 0; i < N_ITEMS; i++) {
+        n += in_table[i];
+    }
+    return n;
+}
+
+static void check_iter_and_stats(QHT *ht)
+{
+    QHTStats stats;
+    size_t n = 0;
+
+    qht_iter(ht, count_item, &n);
+    g_assert_cmpint(n, ==, count_in_table());
+    qht_statistics(ht, &stats);
+    g_assert_cmpint(stats.entries, ==, n);
+    g_assert_cmpint(stats.used_head_buckets, <=, stats.head_buckets);
+    g_assert(stats.occupancy >= 0 && stats.occupancy <= 1);
+    if (n) {
+        g_assert(stats.avg_chain >= 1);
+        g_assert_cmpint(stats.max_chain, >=, 1);
+    }
+}
+
+static void test_qht_basic(void)
+{
+    QHT ht;
+    int i;
+
+    memset(in_table, 0, sizeof(in_table));
+    qht_init(&ht, 64, 0);
+    for (i = 0; i < N_ITEMS; i++) {
+        g_assert(qht_insert(&ht, &items[i], hash_of(i, 0xff)));
+        in_table[i] = true;
+    }
+    g_assert(!qht_insert(&ht, &items[0], hash_of(0, 0xff)));
+    check_lookups(&ht, 0xff);
+    check_iter_and_stats(&ht);
+
+    for (i = 0; i < N_ITEMS; i += 2) {
+        g_assert(qht_remove(&ht, &items[i], hash_of(i, 0xff)));
+        in_table[i] = false;
+    }
+    g_assert(!qht_remove(&ht, &items[0], hash_of(0, 0xff)));
+    check_lookups(&ht, 0xff);
+    check_iter_and_stats(&ht);
+
+    qht_reset(&ht);
+    memset(in_table, 0, sizeof(in_table));
+    check_lookups(&ht, 0xff);
+    check_iter_and_stats(&ht);
+    qht_destroy(&ht);
+}
+
+static void test_qht_resize(void)
+{
+    QHTStats stats;
+    size_t head_buckets;
+    QHT ht;
+    int i;
+
+    memset(in_table, 0, sizeof(in_table));
+    qht_init(&ht, 16, QHT_MODE_AUTO_RESIZE);
+    qht_statistics(&ht, &stats);
+    head_buckets = stats.head_buckets;
+    for (i = 0; i < N_ITEMS; i++) {
+        qht_insert(&ht, &items[i], hash_of(i, ~0));
+        in_table[i] = true;
+    }
+    qht_statistics(&ht, &stats);
+    g_assert_cmpint(stats.head_buckets, >, head_buckets);
+    check_lookups(&ht, ~0);
+    check_iter_and_stats(&ht);
+
+    g_assert(qht_resize(&ht, 4));
+    qht_statistics(&ht, &stats);
+    g_assert_cmpint(stats.head_buckets, ==, 1);
+    g_assert(!qht_resize(&ht, 4));
+    check_lookups(&ht, ~0);
+    check_iter_and_stats(&ht);
+    qht_destroy(&ht);
+}
+
+static void test_qht_random(void)
+{
+    QHT ht;
+    int i, j;
+
+    memset(in_table, 0, sizeof(in_table));
+    qht_init(&ht, 128, QHT_MODE_AUTO_RESIZE);
+    for (i = 0; i < 64; i++) {
+        for (j = 0; j < 256; j++) {
+            int k = g_test_rand_int_range(0, N_ITEMS);
+
+            if (in_table[k]) {
+                g_assert(qht_remove(&ht, &items[k], hash_of(k, 0x3ff)));
+            } else {
+                g_assert(qht_insert(&ht, &items[k], hash_of(k, 0x3ff)));
+            }
+            in_table[k] = !in_table[k];
+        }
+        check_lookups(&ht, 0x3ff);
+    }
+    check_iter_and_stats(&ht);
+    qht_destroy(&ht);
+}
+
+/* The first half of the items stays in the table while a writer inserts
+ * and removes the second half, growing the table; lookups of the first
+ * half must never fail.
+ */
+typedef struct {
+    QHT *ht;
+    volatile bool stop;
+    unsigned long lookups;
+} ReaderState;
+
+static void *reader_thread(void *opaque)
+{
+    ReaderState *s = opaque;
+    int i = 0;
+
+    while (!s->stop) {
+        void *p = qht_lookup(s->ht, is_equal, &items[i], hash_of(i, 0x7ff));
+
+        g_assert(p == &items[i]);
+        s->lookups++;
+        i = (i + 1) % (N_ITEMS / 2);
+    }
+    return NULL;
+}
+
+static void test_qht_concurrent(void)
+{
+    ReaderState s;
+    QemuThread thread;
+    QHT ht;
+    int i, j;
+
+    qht_init(&ht, 16, QHT_MODE_AUTO_RESIZE);
+    for (i = 0; i < N_ITEMS / 2; i++) {
+        qht_insert(&ht, &items[i], hash_of(i, 0x7ff));
+    }
+
+    s.ht = &ht;
+    s.stop = false;
+    s.lookups = 0;
+    qemu_thread_create(&thread, reader_thread, &s, QEMU_THREAD_JOINABLE);
+    for (j = 0; j < 16; j++) {
+        for (i = N_ITEMS / 2; i < N_ITEMS; i++) {
+            qht_insert(&ht, &items[i], hash_of(i, 0x7ff));
+        }
+        for (i = N_ITEMS / 2; i < N_ITEMS; i++) {
+            qht_remove(&ht, &items[i], hash_of(i, 0x7ff));
+        }
+    }
+    s.stop = true;
+    qemu_thread_join(&thread);
+    qht_destroy(&ht);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/qht/basic", test_qht_basic);
+    g_test_add_func("/qht/resize", test_qht_resize);
+    g_test_add_func("/qht/random", test_qht_random);
+    g_test_add_func("/qht/concurrent", test_qht_concurrent);
+    g_test_run();
+
+    return 0;
+}
@@ -0,0 +1,136 @@
+/*
+ * RCU unit-tests.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include "qemu-common.h"
+#include "qemu/rcu.h"
+#include "qemu/thread.h"
+
+#define N_READERS 4
+#define N_UPDATES 2000
+#define MAGIC 0x5eed5eed
+
+typedef struct Foo {
+    struct rcu_head rcu;
+    unsigned int magic;
+    unsigned int gen;
+} Foo;
+
+static Foo *volatile current;
+static volatile bool stop;
+static volatile int freed;
+
+static Foo *foo_new(unsigned int gen)
+{
+    Foo *foo = g_new0(Foo, 1);
+
+    foo->magic = MAGIC;
+    foo->gen = gen;
+    return foo;
+}
+
+/* Like g_free(), but a reader that still uses the object sees it */
+static void foo_free(Foo *foo)
+{
+    foo->magic = 0;
+    g_free(foo);
+}
+
+static void *reader_thread(void *opaque)
+{
+    unsigned long *reads = opaque;
+    unsigned int last = 0;
+
+    while (!stop) {
+        Foo *foo;
+
+        rcu_read_lock();
+        foo = atomic_rcu_read(&current);
+        g_assert_cmpint(foo->magic, ==, MAGIC);
+        g_assert_cmpint(foo->gen, >=, last);
+        last = foo->gen;
+        /* nested sections are part of the outer one */
+        rcu_read_lock();
+        g_assert(foo->magic == MAGIC);
+        rcu_read_unlock();
+        g_assert(foo->magic == MAGIC);
+        rcu_read_unlock();
+        (*reads)++;
+    }
+    return NULL;
+}
+
+static void test_rcu_synchronize(void)
+{
+    QemuThread threads[N_READERS];
+    unsigned long reads[N_READERS] = { 0 };
+    unsigned int i;
+
+    current = foo_new(0);
+    stop = false;
+    for (i = 0; i < N_READERS; i++) {
+        qemu_thread_create(&threads[i], reader_thread, &reads[i],
+                           QEMU_THREAD_JOINABLE);
+    }
+    for (i = 1; i <= N_UPDATES; i++) {
+        Foo *old = current;
+
+        atomic_rcu_set(&current, foo_new(i));
+        synchronize_rcu();
+        foo_free(old);
+    }
+    stop = true;
+    for (i = 0; i < N_READERS; i++) {
+        qemu_thread_join(&threads[i]);
+    }
+    foo_free(current);
+}
+
+static void foo_free_rcu(struct rcu_head *head)
+{
+    foo_free(container_of(head, Foo, rcu));
+    freed++;
+}
+
+static void test_rcu_call(void)
+{
+    QemuThread threads[N_READERS];
+    unsigned long reads[N_READERS] = { 0 };
+    unsigned int i;
+
+    current = foo_new(0);
+    stop = false;
+    freed = 0;
+    for (i = 0; i < N_READERS; i++) {
+        qemu_thread_create(&threads[i], reader_thread, &reads[i],
+                           QEMU_THREAD_JOINABLE);
+    }
+    for (i = 1; i <= N_UPDATES; i++) {
+        Foo *old = current;
+
+        atomic_rcu_set(&current, foo_new(i));
+        call_rcu1(&old->rcu, foo_free_rcu);
+    }
+    while (freed < N_UPDATES) {
+        g_usleep(1000);
+    }
+    stop = true;
+    for (i = 0; i < N_READERS; i++) {
+        qemu_thread_join(&threads[i]);
+    }
+    foo_free(current);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/rcu/synchronize", test_rcu_synchronize);
+    g_test_add_func("/rcu/call", test_rcu_call);
+    g_test_run();
+
+    return 0;
+}
@@ -4,6 +4,8 @@
 #include "block/thread-pool.h"
 #include "block/block.h"
 
+static AioContext *ctx;
+static ThreadPool *pool;
 static int active;
 
 typedef struct {
@@ -38,19 +40,10 @@ static void done_cb(void *opaque, int ret)
     active--;
 }
 
-/* A non-blocking poll of the main AIO context (we cannot use aio_poll
- * because we do not know the AioContext).
- */
-static void qemu_aio_wait_nonblocking(void)
-{
-    qemu_notify_event();
-    qemu_aio_wait();
-}
-
 /* Wait until all aio and bh activity has finished */
 static void qemu_aio_wait_all(void)
 {
-    while (qemu_aio_wait()) {
+    while (aio_poll(ctx, true)) {
         /* Do nothing */
     }
 }
@@ -58,7 +51,7 @@ static void qemu_aio_wait_all(void)
 static void test_submit(void)
 {
     WorkerTestData data = { .n = 0 };
-    thread_pool_submit(worker_cb, &data);
+    thread_pool_submit(pool, worker_cb, &data);
     qemu_aio_wait_all();
     g_assert_cmpint(data.n, ==, 1);
 }
@@ -66,7 +59,7 @@ static void test_submit(void)
 static void test_submit_aio(void)
 {
     WorkerTestData data = { .n = 0, .ret = -EINPROGRESS };
-    data.aiocb = thread_pool_submit_aio(worker_cb, &data, done_cb, &data);
+    data.aiocb = thread_pool_submit_aio(pool, worker_cb, &data, done_cb, &data);
 
     /* The callbacks are not called until after the first wait.  */
     active = 1;
@@ -84,7 +77,7 @@ static void co_test_cb(void *opaque)
     active = 1;
     data->n = 0;
     data->ret = -EINPROGRESS;
-    thread_pool_submit_co(worker_cb, data);
+    thread_pool_submit_co(pool, worker_cb, data);
 
     /* The test continues in test_submit_co, after qemu_coroutine_enter... */
 
@@ -126,12 +119,12 @@ static void test_submit_many(void)
     for (i = 0; i < 100; i++) {
         data[i].n = 0;
         data[i].ret = -EINPROGRESS;
-        thread_pool_submit_aio(worker_cb, &data[i], done_cb, &data[i]);
+        thread_pool_submit_aio(pool, worker_cb, &data[i], done_cb, &data[i]);
     }
 
     active = 100;
     while (active > 0) {
-        qemu_aio_wait();
+        aio_poll(ctx, true);
     }
     for (i = 0; i < 100; i++) {
         g_assert_cmpint(data[i].n, ==, 1);
@@ -154,7 +147,7 @@ static void test_cancel(void)
     for (i = 0; i < 100; i++) {
         data[i].n = 0;
         data[i].ret = -EINPROGRESS;
-        data[i].aiocb = thread_pool_submit_aio(long_cb, &data[i],
+        data[i].aiocb = thread_pool_submit_aio(pool, long_cb, &data[i],
                                                done_cb, &data[i]);
     }
 
@@ -162,7 +155,7 @@ static void test_cancel(void)
      * run, but do not waste too much time...
      */
     active = 100;
-    qemu_aio_wait_nonblocking();
+    aio_poll(ctx, false);
 
     /* Wait some time for the threads to start, with some sanity
      * testing on the behavior of the scheduler...
@@ -206,13 +199,81 @@ static void test_cancel(void)
     }
 }
 
+typedef struct {
+    int submitted;
+    int completed;
+    int in_flight;
+} PerfTestData;
+
+static int perf_cb(void *opaque)
+{
+    return 0;
+}
+
+static void perf_done_cb(void *opaque, int ret)
+{
+    PerfTestData *data = opaque;
+    data->completed++;
+    data->in_flight--;
+}
+
+/* Throughput of short requests with a given number of worker threads and
+ * a given queue depth, to check how the pool scales.
+ */
+static void test_perf(int nthreads, int depth)
+{
+    AioContext *perf_ctx = aio_context_new();
+    ThreadPool *perf_pool = aio_get_thread_pool(perf_ctx);
+    PerfTestData data = { 0 };
+    const int total = 200000;
+    double duration;
+
+    thread_pool_set_params(perf_pool, nthreads, nthreads, 10000);
+
+    g_test_timer_start();
+    while (data.completed < total) {
+        while (data.in_flight < depth && data.submitted < total) {
+            thread_pool_submit_aio(perf_pool, perf_cb, NULL,
+                                   perf_done_cb, &data);
+            data.submitted++;
+            data.in_flight++;
+        }
+        aio_poll(perf_ctx, true);
+    }
+    duration = g_test_timer_elapsed();
+
+    g_test_maximized_result(total / duration,
+                            "%d threads, depth %d: %.0f requests/s",
+                            nthreads, depth, total / duration);
+    aio_context_unref(perf_ctx);
+}
+
+static void test_perf_1(void)
+{
+    test_perf(1, 64);
+}
+
+static void test_perf_4(void)
+{
+    test_perf(4, 64);
+}
+
+static void test_perf_16(void)
+{
+    test_perf(16, 256);
+}
+
+static void test_perf_64(void)
+{
+    test_perf(64, 1024);
+}
+
 int main(int argc, char **argv)
 {
-    /* These should be removed once each AioContext has its thread pool.
-     * The test should create its own AioContext.
-     */
-    qemu_init_main_loop();
-    bdrv_init();
+    int ret;
+
+    ctx = aio_context_new();
+    pool = aio_get_thread_pool(ctx);
 
     g_test_init(&argc, &argv, NULL);
     g_test_add_func("/thread-pool/submit", test_submit);
@@ -220,5 +281,15 @@ int main(int argc, char **argv)
     g_test_add_func("/thread-pool/submit-co", test_submit_co);
     g_test_add_func("/thread-pool/submit-many", test_submit_many);
     g_test_add_func("/thread-pool/cancel", test_cancel);
-    return g_test_run();
+    if (g_test_perf()) {
+        g_test_add_func("/thread-pool/perf/1-thread", test_perf_1);
+        g_test_add_func("/thread-pool/perf/4-threads", test_perf_4);
+        g_test_add_func("/thread-pool/perf/16-threads", test_perf_16);
+        g_test_add_func("/thread-pool/perf/64-threads", test_perf_64);
+    }
+
+    ret = g_test_run();
+
+    aio_context_unref(ctx);
+    return ret;
 }
@@ -0,0 +1,199 @@
+/*
+ * Leaky bucket throttling unit-tests.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include "qemu/throttle.h"
+
+static void test_leak_bucket(void)
+{
+    LeakyBucket bkt = { .avg = 150, .max = 15, .level = 1.5 };
+
+    /* a tenth of a second leaks 15 units, the bucket cannot go negative */
+    throttle_leak_bucket(&bkt, THROTTLE_NS_PER_SEC / 10);
+    g_assert(bkt.level == 0);
+
+    bkt.level = 30;
+    throttle_leak_bucket(&bkt, THROTTLE_NS_PER_SEC / 10);
+    g_assert(bkt.level == 15);
+
+    /* nothing leaks from an unlimited bucket */
+    bkt.avg = 0;
+    throttle_leak_bucket(&bkt, THROTTLE_NS_PER_SEC);
+    g_assert(bkt.level == 15);
+}
+
+static void test_compute_wait(void)
+{
+    LeakyBucket bkt;
+
+    /* unlimited bucket */
+    bkt.avg = 0;
+    bkt.max = 15;
+    bkt.level = 1000;
+    g_assert_cmpint(throttle_compute_wait(&bkt), ==, 0);
+
+    /* below the burst size */
+    bkt.avg = 10;
+    bkt.max = 15;
+    bkt.level = 15;
+    g_assert_cmpint(throttle_compute_wait(&bkt), ==, 0);
+
+    /* 5 units above the burst size at 10 units per second */
+    bkt.level = 20;
+    g_assert_cmpint(throttle_compute_wait(&bkt), ==, THROTTLE_NS_PER_SEC / 2);
+
+    /* without a burst size the bucket holds a tenth of a second */
+    bkt.max = 0;
+    bkt.level = 2;
+    g_assert_cmpint(throttle_compute_wait(&bkt), ==, THROTTLE_NS_PER_SEC / 10);
+}
+
+static void test_config(void)
+{
+    ThrottleState ts;
+    ThrottleConfig cfg, out;
+
+    memset(&cfg, 0, sizeof(cfg));
+    throttle_init(&ts, 0);
+    g_assert(!throttle_enabled(&ts.cfg));
+
+    cfg.buckets[THROTTLE_BPS_READ].avg = 1000;
+    cfg.buckets[THROTTLE_BPS_READ].level = 500;
+    cfg.op_size = 4096;
+    throttle_config(&ts, &cfg, 0);
+    g_assert(throttle_enabled(&ts.cfg));
+
+    /* the levels are reset, everything else is kept */
+    throttle_get_config(&ts, &out);
+    g_assert(out.buckets[THROTTLE_BPS_READ].avg == 1000);
+    g_assert(out.buckets[THROTTLE_BPS_READ].level == 0);
+    g_assert_cmpint(out.op_size, ==, 4096);
+}
+
+static void test_is_valid(void)
+{
+    ThrottleConfig cfg;
+
+    memset(&cfg, 0, sizeof(cfg));
+    g_assert(throttle_is_valid(&cfg));
+
+    cfg.buckets[THROTTLE_OPS_WRITE].avg = 100;
+    cfg.buckets[THROTTLE_OPS_WRITE].max = 1000;
+    g_assert(throttle_is_valid(&cfg));
+
+    cfg.buckets[THROTTLE_OPS_WRITE].avg = -1;
+    g_assert(!throttle_is_valid(&cfg));
+
+    /* a burst needs an average rate to drain it */
+    cfg.buckets[THROTTLE_OPS_WRITE].avg = 0;
+    g_assert(!throttle_is_valid(&cfg));
+}
+
+static void test_conflicting(void)
+{
+    ThrottleConfig cfg;
+
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.buckets[THROTTLE_BPS_READ].avg = 1;
+    cfg.buckets[THROTTLE_BPS_WRITE].avg = 1;
+    cfg.buckets[THROTTLE_OPS_TOTAL].avg = 1;
+    g_assert(!throttle_conflicting(&cfg));
+
+    cfg.buckets[THROTTLE_BPS_TOTAL].avg = 1;
+    g_assert(throttle_conflicting(&cfg));
+
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.buckets[THROTTLE_OPS_TOTAL].max = 1;
+    cfg.buckets[THROTTLE_OPS_READ].max = 1;
+    g_assert(throttle_conflicting(&cfg));
+}
+
+static void test_burst(void)
+{
+    ThrottleState ts;
+    ThrottleConfig cfg;
+    int64_t now = THROTTLE_NS_PER_SEC;
+    int i;
+
+    /* 100 iops with bursts of 50 */
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.buckets[THROTTLE_OPS_TOTAL].avg = 100;
+    cfg.buckets[THROTTLE_OPS_TOTAL].max = 50;
+    throttle_init(&ts, now);
+    throttle_config(&ts, &cfg, now);
+
+    /* the first 51 requests go right away, the next one has to wait */
+    for (i = 0; i < 51; i++) {
+        g_assert_cmpint(throttle_compute_wait_for(&ts, i & 1, now), ==, 0);
+        throttle_account(&ts, i & 1, 512);
+    }
+    g_assert_cmpint(throttle_compute_wait_for(&ts, false, now), ==,
+                    THROTTLE_NS_PER_SEC / 100);
+
+    /* after 10ms one request has leaked out */
+    now += THROTTLE_NS_PER_SEC / 100;
+    g_assert_cmpint(throttle_compute_wait_for(&ts, false, now), ==, 0);
+}
+
+static void test_direction(void)
+{
+    ThrottleState ts;
+    ThrottleConfig cfg;
+
+    /* writes are limited, reads are not */
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.buckets[THROTTLE_BPS_WRITE].avg = 1000;
+    throttle_init(&ts, 0);
+    throttle_config(&ts, &cfg, 0);
+
+    throttle_account(&ts, true, 1100);
+    g_assert_cmpint(throttle_compute_wait_for(&ts, true, 0), ==,
+                    THROTTLE_NS_PER_SEC);
+    g_assert_cmpint(throttle_compute_wait_for(&ts, false, 0), ==, 0);
+}
+
+static void test_op_size(void)
+{
+    ThrottleState ts;
+    ThrottleConfig cfg;
+
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.buckets[THROTTLE_OPS_READ].avg = 10;
+    cfg.op_size = 4096;
+    throttle_init(&ts, 0);
+    throttle_config(&ts, &cfg, 0);
+
+    /* small requests count as one operation */
+    throttle_account(&ts, false, 512);
+    g_assert(ts.cfg.buckets[THROTTLE_OPS_READ].level == 1);
+
+    /* a 16k request counts as four */
+    throttle_account(&ts, false, 16384);
+    g_assert(ts.cfg.buckets[THROTTLE_OPS_READ].level == 5);
+
+    /* without op_size every request is one operation */
+    cfg.op_size = 0;
+    throttle_config(&ts, &cfg, 0);
+    throttle_account(&ts, false, 16384);
+    g_assert(ts.cfg.buckets[THROTTLE_OPS_READ].level == 1);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/throttle/leak_bucket", test_leak_bucket);
+    g_test_add_func("/throttle/compute_wait", test_compute_wait);
+    g_test_add_func("/throttle/config", test_config);
+    g_test_add_func("/throttle/is_valid", test_is_valid);
+    g_test_add_func("/throttle/conflicting", test_conflicting);
+    g_test_add_func("/throttle/burst", test_burst);
+    g_test_add_func("/throttle/direction", test_direction);
+    g_test_add_func("/throttle/op_size", test_op_size);
+    g_test_run();
+
+    return 0;
+}
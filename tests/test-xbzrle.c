@@ -19,6 +19,8 @@
 #include <assert.h>
 #include "qemu-common.h"
 #include "include/migration/migration.h"
+#include "include/migration/page_cache.h"
+#include "qemu/host-features.h"
 
 #define PAGE_SIZE 4096
 
@@ -179,10 +181,229 @@ static void test_encode_decode(void)
     }
 }
 
+/* Feature masks selecting each encoder and buffer_is_dup implementation */
+static const unsigned int kernel_features[] = {
+    0,
+    QEMU_HOST_FEATURE_SSE2,
+    QEMU_HOST_FEATURE_SSE2 | QEMU_HOST_FEATURE_AVX2,
+};
+
+static unsigned int host_features;
+
+static bool select_kernel(int k)
+{
+    if ((kernel_features[k] & host_features) != kernel_features[k]) {
+        return false;
+    }
+    qemu_host_features = kernel_features[k];
+    return true;
+}
+
+static void test_encode_kernels(void)
+{
+    uint8_t *old = g_malloc0(PAGE_SIZE);
+    uint8_t *new = g_malloc0(PAGE_SIZE);
+    uint8_t *ref = g_malloc(PAGE_SIZE);
+    uint8_t *out = g_malloc(PAGE_SIZE);
+    int i, j, k, ref_len, len, dlen;
+
+    for (i = 0; i < 2000; i++) {
+        int runs = g_test_rand_int_range(0, 64);
+
+        memcpy(new, old, PAGE_SIZE);
+        for (j = 0; j < runs; j++) {
+            int start = g_test_rand_int_range(0, PAGE_SIZE);
+            int n = g_test_rand_int_range(1, 64);
+
+            while (n-- && start < PAGE_SIZE) {
+                new[start++] ^= g_test_rand_int_range(1, 256);
+            }
+        }
+        dlen = g_test_rand_int_range(PAGE_SIZE / 8, PAGE_SIZE);
+
+        qemu_host_features = 0;
+        ref_len = xbzrle_encode_buffer(old, new, PAGE_SIZE, ref, dlen);
+
+        for (k = 1; k < ARRAY_SIZE(kernel_features); k++) {
+            if (!select_kernel(k)) {
+                continue;
+            }
+            len = xbzrle_encode_buffer(old, new, PAGE_SIZE, out, dlen);
+            g_assert_cmpint(len, ==, ref_len);
+            if (len > 0) {
+                g_assert(memcmp(ref, out, len) == 0);
+            }
+        }
+        memcpy(old, new, PAGE_SIZE);
+    }
+    qemu_host_features = host_features;
+
+    g_free(old);
+    g_free(new);
+    g_free(ref);
+    g_free(out);
+}
+
+static void test_buffer_is_dup(void)
+{
+    uint8_t *buf = g_malloc(PAGE_SIZE);
+    int i, k;
+
+    for (k = 0; k < ARRAY_SIZE(kernel_features); k++) {
+        if (!select_kernel(k)) {
+            continue;
+        }
+        memset(buf, 0x5a, PAGE_SIZE);
+        g_assert(buffer_is_dup(buf, PAGE_SIZE));
+        for (i = 0; i < PAGE_SIZE; i += 61) {
+            buf[i] = 0x5b;
+            g_assert(!buffer_is_dup(buf, PAGE_SIZE));
+            buf[i] = 0x5a;
+        }
+        buf[PAGE_SIZE - 1] = 0;
+        g_assert(!buffer_is_dup(buf, PAGE_SIZE));
+    }
+    qemu_host_features = host_features;
+
+    g_free(buf);
+}
+
+static void perf_encode(void)
+{
+    uint8_t *old = g_malloc0(PAGE_SIZE);
+    uint8_t *new = g_malloc0(PAGE_SIZE);
+    uint8_t *out = g_malloc(PAGE_SIZE);
+    unsigned int i, k, maxcycles = 100000;
+    double duration;
+
+    /* a sparse update, the common case for XBZRLE */
+    for (i = 0; i < PAGE_SIZE; i += 512) {
+        new[i] = 1;
+    }
+
+    for (k = 0; k < ARRAY_SIZE(kernel_features); k++) {
+        if (!select_kernel(k)) {
+            continue;
+        }
+        g_test_timer_start();
+        for (i = 0; i < maxcycles; i++) {
+            xbzrle_encode_buffer(old, new, PAGE_SIZE, out, PAGE_SIZE);
+        }
+        duration = g_test_timer_elapsed();
+        g_test_message("encode features %#x: %u pages in %f s, %f GB/s",
+                       kernel_features[k], maxcycles, duration,
+                       (double)maxcycles * PAGE_SIZE / duration / 1e9);
+
+        g_test_timer_start();
+        for (i = 0; i < maxcycles; i++) {
+            buffer_is_dup(old, PAGE_SIZE);
+        }
+        duration = g_test_timer_elapsed();
+        g_test_message("is_dup features %#x: %u pages in %f s, %f GB/s",
+                       kernel_features[k], maxcycles, duration,
+                       (double)maxcycles * PAGE_SIZE / duration / 1e9);
+    }
+    qemu_host_features = host_features;
+
+    g_free(old);
+    g_free(new);
+    g_free(out);
+}
+
+static void test_page_cache_lru(void)
+{
+    /* four pages make a single set */
+    PageCache *cache = cache_init(4, PAGE_SIZE);
+    uint64_t i;
+
+    g_assert(cache);
+    for (i = 0; i < 4; i++) {
+        cache_insert(cache, i * PAGE_SIZE, g_malloc0(PAGE_SIZE));
+    }
+    for (i = 0; i < 4; i++) {
+        g_assert(cache_is_cached(cache, i * PAGE_SIZE));
+    }
+
+    /* a hot page survives, the coldest and oldest one goes */
+    g_assert(cache_lookup(cache, 0));
+    g_assert(cache_lookup(cache, 0));
+    cache_insert(cache, 4 * PAGE_SIZE, g_malloc0(PAGE_SIZE));
+    g_assert(cache_is_cached(cache, 0));
+    g_assert(!cache_is_cached(cache, PAGE_SIZE));
+    g_assert(cache_is_cached(cache, 4 * PAGE_SIZE));
+    g_assert(get_cached_data(cache, PAGE_SIZE) == NULL);
+    g_assert(cache_lookup(cache, PAGE_SIZE) == NULL);
+
+    /* replacing an entry's data keeps it cached once */
+    cache_insert(cache, 2 * PAGE_SIZE, g_malloc0(PAGE_SIZE));
+    g_assert(cache_is_cached(cache, 3 * PAGE_SIZE));
+    g_assert(cache_is_cached(cache, 4 * PAGE_SIZE));
+
+    cache_fini(cache);
+    g_free(cache);
+}
+
+static void test_page_cache_skip(void)
+{
+    PageCache *cache = cache_init(64, PAGE_SIZE);
+
+    cache_insert(cache, PAGE_SIZE, g_malloc0(PAGE_SIZE));
+    g_assert(!cache_test_and_clear_skip(cache, PAGE_SIZE));
+    cache_set_skip(cache, PAGE_SIZE);
+    g_assert(cache_test_and_clear_skip(cache, PAGE_SIZE));
+    g_assert(!cache_test_and_clear_skip(cache, PAGE_SIZE));
+
+    /* not cached, nothing to flag */
+    cache_set_skip(cache, 2 * PAGE_SIZE);
+    g_assert(!cache_test_and_clear_skip(cache, 2 * PAGE_SIZE));
+
+    cache_fini(cache);
+    g_free(cache);
+}
+
+static void test_page_cache_resize(void)
+{
+    PageCache *cache = cache_init(64, PAGE_SIZE);
+    uint64_t i;
+    int cached = 0;
+
+    for (i = 0; i < 16; i++) {
+        uint8_t *data = g_malloc(PAGE_SIZE);
+
+        memset(data, i, PAGE_SIZE);
+        cache_insert(cache, i * PAGE_SIZE, data);
+    }
+
+    g_assert_cmpint(cache_resize(cache, 256), ==, 256);
+    for (i = 0; i < 16; i++) {
+        uint8_t *data = get_cached_data(cache, i * PAGE_SIZE);
+
+        g_assert(data);
+        g_assert_cmpint(data[PAGE_SIZE - 1], ==, i);
+    }
+
+    /* shrinking drops pages but keeps the remaining ones intact */
+    g_assert_cmpint(cache_resize(cache, 8), ==, 8);
+    for (i = 0; i < 16; i++) {
+        uint8_t *data = get_cached_data(cache, i * PAGE_SIZE);
+
+        if (data) {
+            g_assert_cmpint(data[0], ==, i);
+            cached++;
+        }
+    }
+    g_assert_cmpint(cached, <=, 8);
+    g_assert_cmpint(cached, >, 0);
+
+    cache_fini(cache);
+    g_free(cache);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
     g_test_rand_int();
+    host_features = qemu_host_features;
     g_test_add_func("/xbzrle/uleb", test_uleb);
     g_test_add_func("/xbzrle/encode_decode_zero", test_encode_decode_zero);
     g_test_add_func("/xbzrle/encode_decode_unchanged",
@@ -191,6 +412,14 @@ int main(int argc, char **argv)
     g_test_add_func("/xbzrle/encode_decode_overflow",
                     test_encode_decode_overflow);
     g_test_add_func("/xbzrle/encode_decode", test_encode_decode);
+    g_test_add_func("/xbzrle/encode_kernels", test_encode_kernels);
+    g_test_add_func("/xbzrle/buffer_is_dup", test_buffer_is_dup);
+    g_test_add_func("/xbzrle/page_cache/lru", test_page_cache_lru);
+    g_test_add_func("/xbzrle/page_cache/skip", test_page_cache_skip);
+    g_test_add_func("/xbzrle/page_cache/resize", test_page_cache_resize);
+    if (g_test_perf()) {
+        g_test_add_func("/xbzrle/perf/encode", perf_encode);
+    }
 
     return g_test_run();
 }
@@ -0,0 +1,256 @@
+/*
+ * QTest testcase for the virtqueue_pop() path of virtio-blk-pci
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+/*
+ * The requests are VIRTIO_BLK_T_GET_ID, which virtio-blk completes without
+ * doing any I/O, so the time spent is dominated by popping and mapping
+ * 64-segment indirect descriptor chains.  Run with "-m perf" to measure
+ * pops per second.
+ */
+
+#include <glib.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "qemu-common.h"
+#include "libqtest.h"
+
+#define PCI_DEVFN               (4 << 3)
+#define PCI_IO_BASE             0xc000
+
+#define VIRTIO_PCI_HOST_FEATURES  0
+#define VIRTIO_PCI_GUEST_FEATURES 4
+#define VIRTIO_PCI_QUEUE_PFN      8
+#define VIRTIO_PCI_QUEUE_NUM      12
+#define VIRTIO_PCI_QUEUE_SEL      14
+#define VIRTIO_PCI_QUEUE_NOTIFY   16
+#define VIRTIO_PCI_STATUS         18
+
+#define VIRTIO_RING_F_INDIRECT_DESC 28
+#define VRING_DESC_F_NEXT       1
+#define VRING_DESC_F_WRITE      2
+#define VRING_DESC_F_INDIRECT   4
+
+#define VIRTIO_BLK_T_GET_ID     8
+#define VIRTIO_BLK_ID_BYTES     20
+
+/* Guest physical memory layout */
+#define RING_ADDR               0x100000
+#define TABLE_ADDR              0x200000
+#define HEADER_ADDR             0x400000
+#define STATUS_ADDR             0x480000
+#define DATA_ADDR               0x500000
+
+#define SEGMENTS                64
+#define TABLE_SIZE              ((SEGMENTS + 2) * 16)
+
+typedef struct {
+    unsigned int num;
+    uint64_t avail;
+    uint64_t used;
+    uint16_t avail_idx;
+} TestVirtQueue;
+
+static uint32_t pci_config_addr(uint8_t reg)
+{
+    return 0x80000000 | (PCI_DEVFN << 8) | (reg & ~3);
+}
+
+static uint16_t pci_config_readw(uint8_t reg)
+{
+    outl(0xcf8, pci_config_addr(reg));
+    return inw(0xcfc + (reg & 2));
+}
+
+static void pci_config_writew(uint8_t reg, uint16_t val)
+{
+    outl(0xcf8, pci_config_addr(reg));
+    outw(0xcfc + (reg & 2), val);
+}
+
+static void pci_config_writel(uint8_t reg, uint32_t val)
+{
+    outl(0xcf8, pci_config_addr(reg));
+    outl(0xcfc, val);
+}
+
+static void put_desc(uint8_t *p, uint64_t addr, uint32_t len, uint16_t flags,
+                     uint16_t next)
+{
+    stq_le_p(p, addr);
+    stl_le_p(p + 8, len);
+    stw_le_p(p + 12, flags);
+    stw_le_p(p + 14, next);
+}
+
+static void virtio_blk_init(TestVirtQueue *vq)
+{
+    uint32_t features;
+    uint8_t *buf;
+    unsigned int i, j;
+
+    g_assert_cmphex(pci_config_readw(0x00), ==, 0x1af4);
+    g_assert_cmphex(pci_config_readw(0x02), ==, 0x1001);
+
+    /* I/O BAR and bus master */
+    pci_config_writel(0x10, PCI_IO_BASE | 1);
+    pci_config_writew(0x04, pci_config_readw(0x04) | 0x5);
+
+    outb(PCI_IO_BASE + VIRTIO_PCI_STATUS, 0);
+    outb(PCI_IO_BASE + VIRTIO_PCI_STATUS, 1 | 2);
+    features = inl(PCI_IO_BASE + VIRTIO_PCI_HOST_FEATURES);
+    g_assert(features & (1u << VIRTIO_RING_F_INDIRECT_DESC));
+    outl(PCI_IO_BASE + VIRTIO_PCI_GUEST_FEATURES,
+         1u << VIRTIO_RING_F_INDIRECT_DESC);
+
+    outw(PCI_IO_BASE + VIRTIO_PCI_QUEUE_SEL, 0);
+    vq->num = inw(PCI_IO_BASE + VIRTIO_PCI_QUEUE_NUM);
+    g_assert_cmpint(vq->num, >, 0);
+    vq->avail = RING_ADDR + vq->num * 16;
+    vq->used = (vq->avail + 4 + vq->num * 2 + 2 + 4095) & ~4095ULL;
+    vq->avail_idx = 0;
+
+    buf = g_malloc0(vq->used + 4 + vq->num * 8 + 2 - RING_ADDR);
+    for (i = 0; i < vq->num; i++) {
+        put_desc(buf + i * 16, TABLE_ADDR + i * TABLE_SIZE, TABLE_SIZE,
+                 VRING_DESC_F_INDIRECT, 0);
+    }
+    memwrite(RING_ADDR, buf, vq->used + 4 + vq->num * 8 + 2 - RING_ADDR);
+    g_free(buf);
+
+    /* One indirect table per ring entry: header, data segments, status */
+    buf = g_malloc0(TABLE_SIZE);
+    for (i = 0; i < vq->num; i++) {
+        put_desc(buf, HEADER_ADDR + i * 16, 16, VRING_DESC_F_NEXT, 1);
+        for (j = 0; j < SEGMENTS; j++) {
+            put_desc(buf + (j + 1) * 16, DATA_ADDR + j * 512, 512,
+                     VRING_DESC_F_WRITE | VRING_DESC_F_NEXT, j + 2);
+        }
+        put_desc(buf + (SEGMENTS + 1) * 16, STATUS_ADDR + i, 1,
+                 VRING_DESC_F_WRITE, 0);
+        memwrite(TABLE_ADDR + i * TABLE_SIZE, buf, TABLE_SIZE);
+
+        writel(HEADER_ADDR + i * 16, VIRTIO_BLK_T_GET_ID);
+    }
+    g_free(buf);
+
+    outl(PCI_IO_BASE + VIRTIO_PCI_QUEUE_PFN, RING_ADDR >> 12);
+    outb(PCI_IO_BASE + VIRTIO_PCI_STATUS, 1 | 2 | 4);
+}
+
+/* Submit every ring entry once and wait for all of them to complete */
+static void virtio_blk_run_ring(TestVirtQueue *vq)
+{
+    uint8_t *ring = g_malloc(vq->num * 2);
+    unsigned int i;
+
+    for (i = 0; i < vq->num; i++) {
+        stw_le_p(ring + ((vq->avail_idx + i) % vq->num) * 2, i);
+    }
+    memwrite(vq->avail + 4, ring, vq->num * 2);
+    g_free(ring);
+
+    vq->avail_idx += vq->num;
+    writew(vq->avail + 2, vq->avail_idx);
+    outw(PCI_IO_BASE + VIRTIO_PCI_QUEUE_NOTIFY, 0);
+
+    while (readw(vq->used + 2) != vq->avail_idx) {
+        /* The requests complete synchronously, this hardly ever loops */
+    }
+}
+
+static char *create_test_img(void)
+{
+    char *template = strdup("/tmp/qtest.XXXXXX");
+    int fd, ret;
+
+    fd = mkstemp(template);
+    g_assert(fd >= 0);
+    ret = ftruncate(fd, 1024 * 1024);
+    g_assert(ret == 0);
+    close(fd);
+    return template;
+}
+
+static void test_start(const char *img)
+{
+    char *args;
+
+    args = g_strdup_printf("-drive if=none,id=drive0,file=%s,format=raw "
+                           "-device virtio-blk-pci,drive=drive0,"
+                           "serial=virtio-blk-test,addr=04.0,vectors=0",
+                           img);
+    qtest_start(args);
+    g_free(args);
+}
+
+static void test_pop(void)
+{
+    char *img = create_test_img();
+    TestVirtQueue vq;
+    char id[VIRTIO_BLK_ID_BYTES];
+    unsigned int i;
+
+    test_start(img);
+    virtio_blk_init(&vq);
+
+    memset(id, 0xff, sizeof(id));
+    memwrite(DATA_ADDR, id, sizeof(id));
+    for (i = 0; i < vq.num; i++) {
+        writeb(STATUS_ADDR + i, 0xff);
+    }
+
+    virtio_blk_run_ring(&vq);
+
+    for (i = 0; i < vq.num; i++) {
+        g_assert_cmpint(readb(STATUS_ADDR + i), ==, 0);
+    }
+    memread(DATA_ADDR, id, sizeof(id));
+    g_assert(strncmp(id, "virtio-blk-test", sizeof(id)) == 0);
+
+    qtest_quit(global_qtest);
+    unlink(img);
+    free(img);
+}
+
+static void test_pop_perf(void)
+{
+    char *img = create_test_img();
+    TestVirtQueue vq;
+    unsigned int rounds = 0;
+    double duration;
+
+    test_start(img);
+    virtio_blk_init(&vq);
+
+    g_test_timer_start();
+    do {
+        virtio_blk_run_ring(&vq);
+        rounds++;
+        duration = g_test_timer_elapsed();
+    } while (duration < 5.0);
+
+    g_test_maximized_result(rounds * vq.num / duration,
+                            "%.0f pops/s (%d segments per request)",
+                            rounds * vq.num / duration, SEGMENTS);
+
+    qtest_quit(global_qtest);
+    unlink(img);
+    free(img);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    qtest_add_func("virtio/blk/pci/pop", test_pop);
+    if (g_test_perf()) {
+        qtest_add_func("virtio/blk/pci/pop-perf", test_pop_perf);
+    }
+
+    return g_test_run();
+}
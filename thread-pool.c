@@ -18,86 +18,187 @@
 #include "qemu/queue.h"
 #include "qemu/thread.h"
 #include "qemu/osdep.h"
+#include "qemu/atomic.h"
 #include "block/coroutine.h"
 #include "trace.h"
 #include "block/block_int.h"
 #include "qemu/event_notifier.h"
 #include "block/thread-pool.h"
 
-static void do_spawn_thread(void);
+/* Number of request queues in a pool.  Each worker has a home queue that it
+ * serves first, and steals from the others when its own is empty.  Queues
+ * are not owned by a single thread, so a worker can exit without having
+ * to hand over the requests that are waiting in its queue.
+ */
+#define THREAD_POOL_QUEUES 8
+
+static void do_spawn_thread(ThreadPool *pool);
 
 typedef struct ThreadPoolElement ThreadPoolElement;
+typedef struct ThreadPoolQueue ThreadPoolQueue;
 
 enum ThreadState {
     THREAD_QUEUED,
     THREAD_ACTIVE,
     THREAD_DONE,
-    THREAD_CANCELED,
 };
 
 struct ThreadPoolElement {
     BlockDriverAIOCB common;
+    ThreadPool *pool;
+    ThreadPoolQueue *queue;
     ThreadPoolFunc *func;
     void *arg;
 
-    /* Moving state out of THREAD_QUEUED is protected by lock.  After
+    /* Moving state out of THREAD_QUEUED is protected by queue->lock.  After
      * that, only the worker thread can write to it.  Reads and writes
      * of state and ret are ordered with memory barriers.
      */
     enum ThreadState state;
     int ret;
 
-    /* Access to this list is protected by lock.  */
+    /* Access to this list is protected by queue->lock.  */
     QTAILQ_ENTRY(ThreadPoolElement) reqs;
 
-    /* Access to this list is protected by the global mutex.  */
+    /* Pushed by the worker thread onto pool->completed.  */
+    ThreadPoolElement *next_completed;
+
+    /* Access to these lists is protected by the thread that runs the
+     * pool's AioContext.  */
+    QSIMPLEQ_ENTRY(ThreadPoolElement) done;
     QLIST_ENTRY(ThreadPoolElement) all;
 };
 
-static EventNotifier notifier;
-static QemuMutex lock;
-static QemuCond check_cancel;
-static QemuSemaphore sem;
-static int max_threads = 64;
-static QEMUBH *new_thread_bh;
-
-/* The following variables are protected by the global mutex.  */
-static QLIST_HEAD(, ThreadPoolElement) head;
-
-/* The following variables are protected by lock.  */
-static QTAILQ_HEAD(, ThreadPoolElement) request_list;
-static int cur_threads;
-static int idle_threads;
-static int new_threads;     /* backlog of threads we need to create */
-static int pending_threads; /* threads created but not running yet */
-static int pending_cancellations; /* whether we need a cond_broadcast */
-
-static void *worker_thread(void *unused)
+struct ThreadPoolQueue {
+    QemuMutex lock;
+    QTAILQ_HEAD(, ThreadPoolElement) request_list;
+};
+
+struct ThreadPool {
+    EventNotifier notifier;
+    AioContext *ctx;
+    QemuMutex lock;
+    QemuCond check_cancel;
+    QemuCond worker_stopped;
+    QemuSemaphore sem;      /* one count per queued request */
+    QEMUBH *new_thread_bh;
+    ThreadPoolQueue queues[THREAD_POOL_QUEUES];
+
+    /* Completed requests, pushed by the workers without taking any lock.
+     * The AioContext takes the whole list at once.  */
+    ThreadPoolElement *completed;
+
+    /* Updated with atomic operations.  */
+    int idle_threads;
+    int pending_cancellations; /* whether we need a cond_broadcast */
+    int next_home;
+
+    /* The following variables are only accessed from the thread that runs
+     * the pool's AioContext.  */
+    QLIST_HEAD(, ThreadPoolElement) head;
+    QSIMPLEQ_HEAD(, ThreadPoolElement) done_list;
+    unsigned int next_queue;
+
+    /* The following variables are protected by lock.  */
+    int min_threads;
+    int max_threads;
+    int idle_timeout;    /* in milliseconds */
+    int cur_threads;
+    int new_threads;     /* backlog of threads we need to create */
+    int pending_threads; /* threads created but not running yet */
+    bool stopping;
+};
+
+static int default_min_threads = 0;
+static int default_max_threads = 64;
+static int default_idle_timeout = 10000;
+
+/* Take a request from the worker's home queue, or steal one from another
+ * queue.  The caller owns one count of pool->sem, so a request is there;
+ * it may just take more than one pass to find it.
+ */
+static ThreadPoolElement *thread_pool_dequeue(ThreadPool *pool, int home)
 {
-    qemu_mutex_lock(&lock);
-    pending_threads--;
-    do_spawn_thread();
+    ThreadPoolElement *req;
+    int i;
+
+    for (;;) {
+        for (i = 0; i < THREAD_POOL_QUEUES; i++) {
+            ThreadPoolQueue *q = &pool->queues[(home + i) % THREAD_POOL_QUEUES];
+
+            /* Unlocked peek, rechecked below.  */
+            if (QTAILQ_EMPTY(&q->request_list)) {
+                continue;
+            }
+
+            qemu_mutex_lock(&q->lock);
+            req = QTAILQ_FIRST(&q->request_list);
+            if (req) {
+                QTAILQ_REMOVE(&q->request_list, req, reqs);
+                req->state = THREAD_ACTIVE;
+            }
+            qemu_mutex_unlock(&q->lock);
+            if (req) {
+                return req;
+            }
+        }
+    }
+}
 
-    while (1) {
+static void thread_pool_push_completed(ThreadPool *pool, ThreadPoolElement *req)
+{
+    ThreadPoolElement *old;
+
+    do {
+        old = pool->completed;
+        req->next_completed = old;
+    } while (atomic_cmpxchg(&pool->completed, old, req) != old);
+
+    /* Only the first completion of a batch needs to kick the AioContext.  */
+    if (!old) {
+        event_notifier_set(&pool->notifier);
+    }
+}
+
+static void *worker_thread(void *opaque)
+{
+    ThreadPool *pool = opaque;
+    int home;
+
+    home = atomic_fetch_add(&pool->next_home, 1) % THREAD_POOL_QUEUES;
+
+    qemu_mutex_lock(&pool->lock);
+    pool->pending_threads--;
+    do_spawn_thread(pool);
+    qemu_mutex_unlock(&pool->lock);
+
+    while (!pool->stopping) {
         ThreadPoolElement *req;
         int ret;
 
-        do {
-            idle_threads++;
-            qemu_mutex_unlock(&lock);
-            ret = qemu_sem_timedwait(&sem, 10000);
-            qemu_mutex_lock(&lock);
-            idle_threads--;
-        } while (ret == -1 && !QTAILQ_EMPTY(&request_list));
-        if (ret == -1) {
+        atomic_fetch_add(&pool->idle_threads, 1);
+        ret = qemu_sem_timedwait(&pool->sem, pool->idle_timeout);
+        atomic_fetch_sub(&pool->idle_threads, 1);
+        if (pool->stopping) {
             break;
         }
+        if (ret == -1) {
+            bool exit_thread;
+
+            qemu_mutex_lock(&pool->lock);
+            exit_thread = pool->cur_threads > pool->min_threads;
+            if (exit_thread) {
+                pool->cur_threads--;
+                qemu_cond_signal(&pool->worker_stopped);
+            }
+            qemu_mutex_unlock(&pool->lock);
+            if (exit_thread) {
+                return NULL;
+            }
+            continue;
+        }
 
-        req = QTAILQ_FIRST(&request_list);
-        QTAILQ_REMOVE(&request_list, req, reqs);
-        req->state = THREAD_ACTIVE;
-        qemu_mutex_unlock(&lock);
-
+        req = thread_pool_dequeue(pool, home);
         ret = req->func(req->arg);
 
         req->ret = ret;
@@ -105,115 +206,143 @@ static void *worker_thread(void *unused)
         smp_wmb();
         req->state = THREAD_DONE;
 
-        qemu_mutex_lock(&lock);
-        if (pending_cancellations) {
-            qemu_cond_broadcast(&check_cancel);
+        /* Write state before reading pending_cancellations.  */
+        smp_mb();
+        if (pool->pending_cancellations) {
+            qemu_mutex_lock(&pool->lock);
+            qemu_cond_broadcast(&pool->check_cancel);
+            qemu_mutex_unlock(&pool->lock);
         }
 
-        event_notifier_set(&notifier);
+        thread_pool_push_completed(pool, req);
     }
 
-    cur_threads--;
-    qemu_mutex_unlock(&lock);
+    qemu_mutex_lock(&pool->lock);
+    pool->cur_threads--;
+    qemu_cond_signal(&pool->worker_stopped);
+    qemu_mutex_unlock(&pool->lock);
     return NULL;
 }
 
-static void do_spawn_thread(void)
+static void do_spawn_thread(ThreadPool *pool)
 {
     QemuThread t;
 
     /* Runs with lock taken.  */
-    if (!new_threads) {
+    if (!pool->new_threads) {
         return;
     }
 
-    new_threads--;
-    pending_threads++;
+    pool->new_threads--;
+    pool->pending_threads++;
 
-    qemu_thread_create(&t, worker_thread, NULL, QEMU_THREAD_DETACHED);
+    qemu_thread_create(&t, worker_thread, pool, QEMU_THREAD_DETACHED);
 }
 
 static void spawn_thread_bh_fn(void *opaque)
 {
-    qemu_mutex_lock(&lock);
-    do_spawn_thread();
-    qemu_mutex_unlock(&lock);
+    ThreadPool *pool = opaque;
+
+    qemu_mutex_lock(&pool->lock);
+    do_spawn_thread(pool);
+    qemu_mutex_unlock(&pool->lock);
 }
 
-static void spawn_thread(void)
+static void spawn_thread(ThreadPool *pool)
 {
-    cur_threads++;
-    new_threads++;
+    pool->cur_threads++;
+    pool->new_threads++;
     /* If there are threads being created, they will spawn new workers, so
      * we don't spend time creating many threads in a loop holding a mutex or
      * starving the current vcpu.
      *
-     * If there are no idle threads, ask the main thread to create one, so we
-     * inherit the correct affinity instead of the vcpu affinity.
+     * If there are no idle threads, ask the thread that runs the pool's
+     * AioContext to create one, so we inherit the correct affinity instead
+     * of the vcpu affinity.
      */
-    if (!pending_threads) {
-        qemu_bh_schedule(new_thread_bh);
+    if (!pool->pending_threads) {
+        qemu_bh_schedule(pool->new_thread_bh);
     }
 }
 
 static void event_notifier_ready(EventNotifier *notifier)
 {
-    ThreadPoolElement *elem, *next;
+    ThreadPool *pool = container_of(notifier, ThreadPool, notifier);
+    QSIMPLEQ_HEAD(, ThreadPoolElement) batch;
+    ThreadPoolElement *elem, *old;
+    bool kicked = false;
 
     event_notifier_test_and_clear(notifier);
-restart:
-    QLIST_FOREACH_SAFE(elem, &head, all, next) {
-        if (elem->state != THREAD_CANCELED && elem->state != THREAD_DONE) {
-            continue;
-        }
-        if (elem->state == THREAD_DONE) {
-            trace_thread_pool_complete(elem, elem->common.opaque, elem->ret);
-        }
-        if (elem->state == THREAD_DONE && elem->common.cb) {
-            QLIST_REMOVE(elem, all);
+
+    do {
+        old = pool->completed;
+    } while (atomic_cmpxchg(&pool->completed, old, NULL) != old);
+
+    /* The workers push in LIFO order, complete requests oldest first.  */
+    QSIMPLEQ_INIT(&batch);
+    for (elem = old; elem; elem = elem->next_completed) {
+        QSIMPLEQ_INSERT_HEAD(&batch, elem, done);
+    }
+    QSIMPLEQ_CONCAT(&pool->done_list, &batch);
+
+    while ((elem = QSIMPLEQ_FIRST(&pool->done_list)) != NULL) {
+        QSIMPLEQ_REMOVE_HEAD(&pool->done_list, done);
+        QLIST_REMOVE(elem, all);
+        trace_thread_pool_complete(pool, elem, elem->common.opaque,
+                                   elem->ret);
+        if (elem->common.cb) {
+            /* The callback may run a nested aio_poll(), make sure that it
+             * wakes up for the requests that are still in done_list.
+             */
+            if (!kicked && !QSIMPLEQ_EMPTY(&pool->done_list)) {
+                event_notifier_set(notifier);
+                kicked = true;
+            }
             /* Read state before ret.  */
             smp_rmb();
             elem->common.cb(elem->common.opaque, elem->ret);
-            qemu_aio_release(elem);
-            goto restart;
-        } else {
-            /* remove the request */
-            QLIST_REMOVE(elem, all);
-            qemu_aio_release(elem);
         }
+        qemu_aio_release(elem);
     }
 }
 
 static int thread_pool_active(EventNotifier *notifier)
 {
-    return !QLIST_EMPTY(&head);
+    ThreadPool *pool = container_of(notifier, ThreadPool, notifier);
+    return !QLIST_EMPTY(&pool->head);
 }
 
 static void thread_pool_cancel(BlockDriverAIOCB *acb)
 {
     ThreadPoolElement *elem = (ThreadPoolElement *)acb;
+    ThreadPool *pool = elem->pool;
+    ThreadPoolQueue *q = elem->queue;
 
     trace_thread_pool_cancel(elem, elem->common.opaque);
 
-    qemu_mutex_lock(&lock);
+    qemu_mutex_lock(&q->lock);
     if (elem->state == THREAD_QUEUED &&
         /* No thread has yet started working on elem. we can try to "steal"
          * the item from the worker if we can get a signal from the
          * semaphore.  Because this is non-blocking, we can do it with
          * the lock taken and ensure that elem will remain THREAD_QUEUED.
          */
-        qemu_sem_timedwait(&sem, 0) == 0) {
-        QTAILQ_REMOVE(&request_list, elem, reqs);
-        elem->state = THREAD_CANCELED;
-        event_notifier_set(&notifier);
-    } else {
-        pending_cancellations++;
-        while (elem->state != THREAD_CANCELED && elem->state != THREAD_DONE) {
-            qemu_cond_wait(&check_cancel, &lock);
-        }
-        pending_cancellations--;
+        qemu_sem_timedwait(&pool->sem, 0) == 0) {
+        QTAILQ_REMOVE(&q->request_list, elem, reqs);
+        qemu_mutex_unlock(&q->lock);
+        QLIST_REMOVE(elem, all);
+        qemu_aio_release(elem);
+        return;
     }
-    qemu_mutex_unlock(&lock);
+    qemu_mutex_unlock(&q->lock);
+
+    qemu_mutex_lock(&pool->lock);
+    atomic_fetch_add(&pool->pending_cancellations, 1);
+    while (elem->state != THREAD_DONE) {
+        qemu_cond_wait(&pool->check_cancel, &pool->lock);
+    }
+    atomic_fetch_sub(&pool->pending_cancellations, 1);
+    qemu_mutex_unlock(&pool->lock);
 }
 
 static const AIOCBInfo thread_pool_aiocb_info = {
@@ -221,27 +350,41 @@ static const AIOCBInfo thread_pool_aiocb_info = {
     .cancel             = thread_pool_cancel,
 };
 
-BlockDriverAIOCB *thread_pool_submit_aio(ThreadPoolFunc *func, void *arg,
+BlockDriverAIOCB *thread_pool_submit_aio(ThreadPool *pool,
+        ThreadPoolFunc *func, void *arg,
         BlockDriverCompletionFunc *cb, void *opaque)
 {
     ThreadPoolElement *req;
+    ThreadPoolQueue *q;
 
     req = qemu_aio_get(&thread_pool_aiocb_info, NULL, cb, opaque);
     req->func = func;
     req->arg = arg;
     req->state = THREAD_QUEUED;
+    req->pool = pool;
 
-    QLIST_INSERT_HEAD(&head, req, all);
+    QLIST_INSERT_HEAD(&pool->head, req, all);
 
-    trace_thread_pool_submit(req, arg);
+    trace_thread_pool_submit(pool, req, arg);
 
-    qemu_mutex_lock(&lock);
-    if (idle_threads == 0 && cur_threads < max_threads) {
-        spawn_thread();
+    /* Unlocked check, so that the pool lock is only taken when the pool
+     * needs to grow.
+     */
+    if (pool->idle_threads == 0 && pool->cur_threads < pool->max_threads) {
+        qemu_mutex_lock(&pool->lock);
+        if (pool->cur_threads < pool->max_threads) {
+            spawn_thread(pool);
+        }
+        qemu_mutex_unlock(&pool->lock);
     }
-    QTAILQ_INSERT_TAIL(&request_list, req, reqs);
-    qemu_mutex_unlock(&lock);
-    qemu_sem_post(&sem);
+
+    /* Spread requests over the queues in round-robin order.  */
+    q = &pool->queues[pool->next_queue++ % THREAD_POOL_QUEUES];
+    req->queue = q;
+    qemu_mutex_lock(&q->lock);
+    QTAILQ_INSERT_TAIL(&q->request_list, req, reqs);
+    qemu_mutex_unlock(&q->lock);
+    qemu_sem_post(&pool->sem);
     return &req->common;
 }
 
@@ -258,32 +401,109 @@ static void thread_pool_co_cb(void *opaque, int ret)
     qemu_coroutine_enter(co->co, NULL);
 }
 
-int coroutine_fn thread_pool_submit_co(ThreadPoolFunc *func, void *arg)
+int coroutine_fn thread_pool_submit_co(ThreadPool *pool, ThreadPoolFunc *func,
+                                       void *arg)
 {
     ThreadPoolCo tpc = { .co = qemu_coroutine_self(), .ret = -EINPROGRESS };
     assert(qemu_in_coroutine());
-    thread_pool_submit_aio(func, arg, thread_pool_co_cb, &tpc);
+    thread_pool_submit_aio(pool, func, arg, thread_pool_co_cb, &tpc);
     qemu_coroutine_yield();
     return tpc.ret;
 }
 
-void thread_pool_submit(ThreadPoolFunc *func, void *arg)
+void thread_pool_submit(ThreadPool *pool, ThreadPoolFunc *func, void *arg)
+{
+    thread_pool_submit_aio(pool, func, arg, NULL, NULL);
+}
+
+void thread_pool_set_params(ThreadPool *pool, int min_threads,
+                            int max_threads, int idle_timeout)
+{
+    assert(min_threads >= 0 && min_threads <= max_threads && max_threads > 0);
+    assert(idle_timeout > 0);
+
+    qemu_mutex_lock(&pool->lock);
+    pool->min_threads = min_threads;
+    pool->max_threads = max_threads;
+    pool->idle_timeout = idle_timeout;
+    while (pool->cur_threads < pool->min_threads) {
+        spawn_thread(pool);
+    }
+    qemu_mutex_unlock(&pool->lock);
+}
+
+void thread_pool_set_default_params(int min_threads, int max_threads,
+                                    int idle_timeout)
 {
-    thread_pool_submit_aio(func, arg, NULL, NULL);
+    assert(min_threads >= 0 && min_threads <= max_threads && max_threads > 0);
+    assert(idle_timeout > 0);
+
+    default_min_threads = min_threads;
+    default_max_threads = max_threads;
+    default_idle_timeout = idle_timeout;
 }
 
-static void thread_pool_init(void)
+ThreadPool *thread_pool_new(AioContext *ctx)
 {
-    QLIST_INIT(&head);
-    event_notifier_init(&notifier, false);
-    qemu_mutex_init(&lock);
-    qemu_cond_init(&check_cancel);
-    qemu_sem_init(&sem, 0);
-    qemu_aio_set_event_notifier(&notifier, event_notifier_ready,
-                                thread_pool_active);
-
-    QTAILQ_INIT(&request_list);
-    new_thread_bh = qemu_bh_new(spawn_thread_bh_fn, NULL);
+    ThreadPool *pool = g_new0(ThreadPool, 1);
+    int i;
+
+    pool->ctx = ctx;
+    QLIST_INIT(&pool->head);
+    QSIMPLEQ_INIT(&pool->done_list);
+    event_notifier_init(&pool->notifier, false);
+    qemu_mutex_init(&pool->lock);
+    qemu_cond_init(&pool->check_cancel);
+    qemu_cond_init(&pool->worker_stopped);
+    qemu_sem_init(&pool->sem, 0);
+    aio_set_event_notifier(ctx, &pool->notifier, event_notifier_ready,
+                           thread_pool_active);
+
+    for (i = 0; i < THREAD_POOL_QUEUES; i++) {
+        qemu_mutex_init(&pool->queues[i].lock);
+        QTAILQ_INIT(&pool->queues[i].request_list);
+    }
+    pool->new_thread_bh = aio_bh_new(ctx, spawn_thread_bh_fn, pool);
+
+    thread_pool_set_params(pool, default_min_threads, default_max_threads,
+                           default_idle_timeout);
+    return pool;
 }
 
-block_init(thread_pool_init)
+void thread_pool_free(ThreadPool *pool)
+{
+    int i;
+
+    if (!pool) {
+        return;
+    }
+
+    assert(QLIST_EMPTY(&pool->head));
+
+    qemu_mutex_lock(&pool->lock);
+
+    /* Stop new threads from spawning */
+    qemu_bh_delete(pool->new_thread_bh);
+    pool->cur_threads -= pool->new_threads;
+    pool->new_threads = 0;
+
+    /* Wait for worker threads to terminate */
+    pool->stopping = true;
+    while (pool->cur_threads > 0) {
+        qemu_sem_post(&pool->sem);
+        qemu_cond_wait(&pool->worker_stopped, &pool->lock);
+    }
+
+    qemu_mutex_unlock(&pool->lock);
+
+    aio_set_event_notifier(pool->ctx, &pool->notifier, NULL, NULL);
+    for (i = 0; i < THREAD_POOL_QUEUES; i++) {
+        qemu_mutex_destroy(&pool->queues[i].lock);
+    }
+    qemu_sem_destroy(&pool->sem);
+    qemu_cond_destroy(&pool->check_cancel);
+    qemu_cond_destroy(&pool->worker_stopped);
+    qemu_mutex_destroy(&pool->lock);
+    event_notifier_cleanup(&pool->notifier);
+    g_free(pool);
+}
@@ -7,7 +7,181 @@
  * the COPYING file in the top-level directory.
  */
 
+#include "trace.h"
 #include "trace/control.h"
+#include "qemu/atomic.h"
+#include "qemu/timer.h"
+
+/*
+ * Latency of paired events, e.g. the submission and the completion of a
+ * request, matched by their first argument.  Starts are remembered in a small
+ * hash table; if it is full, the oldest entries in a chain are overwritten
+ * and those requests are not measured.
+ */
+#define TRACE_LATENCY_SLOTS 1024
+#define TRACE_LATENCY_PROBES 8
+
+struct TraceLatency {
+    TraceEventID start;
+    GStaticMutex lock;
+    struct {
+        uint64_t key;
+        int64_t timestamp_ns;   /* 0 if the slot is free */
+    } slots[TRACE_LATENCY_SLOTS];
+    uint64_t count;
+    uint64_t min_ns;
+    uint64_t max_ns;
+    uint64_t total_ns;
+};
+
+TraceEvent *trace_event_find(const char *name)
+{
+    int i;
+
+    for (i = 0; i < NR_TRACE_EVENTS; i++) {
+        if (!strcmp(trace_list[i].tp_name, name)) {
+            return &trace_list[i];
+        }
+    }
+    return NULL;
+}
+
+void trace_print_events(FILE *stream, fprintf_function stream_printf)
+{
+    int i;
+
+    for (i = 0; i < NR_TRACE_EVENTS; i++) {
+        stream_printf(stream, "%s [Event ID %d] : state %u",
+                      trace_list[i].tp_name, i, trace_list[i].state);
+        if (trace_list[i].stats) {
+            stream_printf(stream, ", count %lu", trace_list[i].count);
+        }
+        stream_printf(stream, "\n");
+    }
+}
+
+bool trace_event_set_state(const char *pattern, bool state)
+{
+    int i;
+    bool matched = false;
+
+    for (i = 0; i < NR_TRACE_EVENTS; i++) {
+        if (g_pattern_match_simple(pattern, trace_list[i].tp_name)) {
+            trace_list[i].state = state;
+            matched = true;
+        }
+    }
+    return matched;
+}
+
+bool trace_event_set_stats(const char *pattern, bool stats)
+{
+    int i;
+    bool matched = false;
+
+    for (i = 0; i < NR_TRACE_EVENTS; i++) {
+        if (g_pattern_match_simple(pattern, trace_list[i].tp_name)) {
+            trace_list[i].stats = stats;
+            matched = true;
+        }
+    }
+    return matched;
+}
+
+int trace_event_set_latency(const char *start, const char *end)
+{
+    TraceEvent *ev_start = trace_event_find(start);
+    TraceEvent *ev_end = trace_event_find(end);
+    TraceLatency *lat;
+
+    if (!ev_start || !ev_end) {
+        return -ENOENT;
+    }
+    if (ev_start == ev_end || ev_start->latency || ev_end->latency) {
+        return -EBUSY;
+    }
+
+    /* never freed, tracing routines may be looking at it at any time */
+    lat = g_malloc0(sizeof(*lat));
+    g_static_mutex_init(&lat->lock);
+    lat->start = ev_start - trace_list;
+    lat->min_ns = UINT64_MAX;
+    smp_wmb();
+
+    ev_start->latency = lat;
+    ev_end->latency = lat;
+    ev_start->stats = true;
+    ev_end->stats = true;
+    return 0;
+}
+
+bool trace_event_get_latency(TraceEvent *ev, TraceEvent **start,
+                             uint64_t *count, uint64_t *min_ns,
+                             uint64_t *max_ns, uint64_t *total_ns)
+{
+    TraceLatency *lat = ev->latency;
+
+    if (!lat || ev == &trace_list[lat->start]) {
+        return false;
+    }
+
+    g_static_mutex_lock(&lat->lock);
+    *start = &trace_list[lat->start];
+    *count = lat->count;
+    *min_ns = lat->count ? lat->min_ns : 0;
+    *max_ns = lat->max_ns;
+    *total_ns = lat->total_ns;
+    g_static_mutex_unlock(&lat->lock);
+    return true;
+}
+
+static void trace_latency_update(TraceLatency *lat, bool start, uint64_t key)
+{
+    int64_t now = get_clock();
+    unsigned int home, slot, i;
+    uint64_t delta;
+
+    home = (key * 0x9e3779b97f4a7c15ULL) >> 54;    /* 10 bits */
+    QEMU_BUILD_BUG_ON(TRACE_LATENCY_SLOTS != 1 << 10);
+
+    g_static_mutex_lock(&lat->lock);
+    for (i = 0; i < TRACE_LATENCY_PROBES; i++) {
+        slot = (home + i) % TRACE_LATENCY_SLOTS;
+        if (lat->slots[slot].timestamp_ns && lat->slots[slot].key == key) {
+            break;
+        }
+        if (start && !lat->slots[slot].timestamp_ns) {
+            break;
+        }
+    }
+
+    if (start) {
+        if (i == TRACE_LATENCY_PROBES) {
+            slot = home;
+        }
+        lat->slots[slot].key = key;
+        lat->slots[slot].timestamp_ns = now;
+    } else if (i < TRACE_LATENCY_PROBES) {
+        delta = now - lat->slots[slot].timestamp_ns;
+        lat->slots[slot].timestamp_ns = 0;
+        lat->count++;
+        lat->total_ns += delta;
+        lat->min_ns = MIN(lat->min_ns, delta);
+        lat->max_ns = MAX(lat->max_ns, delta);
+    }
+    g_static_mutex_unlock(&lat->lock);
+}
+
+void trace_event_count(TraceEventID id, uint64_t key)
+{
+    TraceEvent *ev = &trace_list[id];
+    TraceLatency *lat = ev->latency;
+
+    atomic_fetch_add(&ev->count, 1);
+    if (lat) {
+        trace_latency_update(lat, id == lat->start, key);
+    }
+}
 
 
 void trace_backend_init_events(const char *fname)
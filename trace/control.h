@@ -13,13 +13,61 @@
 #include "qemu-common.h"
 
 
+typedef uint64_t TraceEventID;
+
+typedef struct TraceLatency TraceLatency;
+
+typedef struct {
+    const char *tp_name;
+    bool state;                 /* recorded by the backend */
+    bool stats;                 /* counted in-process */
+    unsigned long count;
+    TraceLatency *latency;      /* pair this event starts or ends */
+} TraceEvent;
+
+extern TraceEvent trace_list[];
+
+#define trace_event_get_state(id) (trace_list[id].state)
+#define trace_event_get_stats(id) (trace_list[id].stats)
+
 /** Print the state of all events. */
 void trace_print_events(FILE *stream, fprintf_function stream_printf);
-/** Set the state of an event.
+/** Set the state of the events matching a glob pattern.
+ *
+ * @return Whether any event matched.
+ */
+bool trace_event_set_state(const char *pattern, bool state);
+/** Enable or disable the counters of the events matching a glob pattern.
+ *
+ * @return Whether any event matched.
+ */
+bool trace_event_set_stats(const char *pattern, bool stats);
+/** Measure the latency between two events, matched by their first argument.
+ *
+ * Counting is enabled for both events.  An event can only be part of one
+ * pair.
+ *
+ * @return 0, -ENOENT if an event does not exist, or -EBUSY if one is
+ *         already part of a pair.
+ */
+int trace_event_set_latency(const char *start, const char *end);
+/** Count an event whose counters are enabled; called by the tracing routines.
+ *
+ * @key The first argument of the event.
+ */
+void trace_event_count(TraceEventID id, uint64_t key);
+/** Look up an event by name.
+ *
+ * @return The event, or NULL if it does not exist.
+ */
+TraceEvent *trace_event_find(const char *name);
+/** Get the latency statistics of the pair an event is part of.
  *
- * @return Whether the state changed.
+ * @return Whether the event is part of a pair.
  */
-bool trace_event_set_state(const char *name, bool state);
+bool trace_event_get_latency(TraceEvent *ev, TraceEvent **start,
+                             uint64_t *count, uint64_t *min_ns,
+                             uint64_t *max_ns, uint64_t *total_ns);
 
 
 /** Initialize the tracing backend.
@@ -17,6 +17,7 @@
 #include <pthread.h>
 #endif
 #include "qemu/timer.h"
+#include "qemu/tls.h"
 #include "trace.h"
 #include "trace/control.h"
 
@@ -32,12 +33,12 @@
 /** Records were dropped event ID */
 #define DROPPED_EVENT_ID (~(uint64_t)0 - 1)
 
-/** Trace record is valid */
-#define TRACE_RECORD_VALID ((uint64_t)1 << 63)
-
 /*
- * Trace records are written out by a dedicated thread.  The thread waits for
- * records to become available, writes them out, and then waits again.
+ * Each thread that emits trace events gets its own ring buffer, so that
+ * recording an event touches only memory owned by that thread: the thread
+ * is the only writer of its ring's head and the writeout thread is the only
+ * writer of its tail.  The writeout thread drains all rings, merging their
+ * records by timestamp, and waits for records to become available again.
  */
 static GStaticMutex trace_lock = G_STATIC_MUTEX_INIT;
 
@@ -56,14 +57,44 @@ static bool trace_available;
 static bool trace_writeout_enabled;
 
 enum {
-    TRACE_BUF_LEN = 4096 * 64,
-    TRACE_BUF_FLUSH_THRESHOLD = TRACE_BUF_LEN / 4,
+    TRACE_RING_LEN = 4096 * 16,     /* per thread, must be a power of two */
+    TRACE_RING_FLUSH_THRESHOLD = TRACE_RING_LEN / 4,
+    TRACE_CACHELINE = 64,
 };
 
-uint8_t trace_buf[TRACE_BUF_LEN];
-static volatile gint trace_idx;
-static unsigned int writeout_idx;
-static volatile gint dropped_events;
+typedef struct TraceRing {
+    /* written by the owning thread */
+    volatile gint head;
+    volatile gint dropped;
+    int busy;
+    uint8_t pad1[TRACE_CACHELINE - 3 * sizeof(gint)];
+
+    /* written by the writeout thread */
+    volatile gint tail;
+    unsigned int snapshot;
+    uint8_t pad2[TRACE_CACHELINE - 2 * sizeof(gint)];
+
+    volatile gint owned;
+    struct TraceRing *next;
+    uint8_t buf[TRACE_RING_LEN];
+} TraceRing;
+
+/* All rings ever created; rings of exited threads are reused */
+static TraceRing *volatile trace_rings;
+
+#ifdef __linux__
+static DEFINE_TLS(TraceRing *, trace_ring);
+#endif
+#ifdef _WIN32
+static DWORD trace_ring_tls = TLS_OUT_OF_INDEXES; /* rings are not reused */
+#else
+static pthread_key_t trace_ring_key;    /* releases the ring at thread exit */
+#endif
+
+/* Set by the first thread to kick the writeout thread, until it wakes up */
+static volatile gint trace_kick_pending;
+
+static uint64_t dropped_events_total;
 static FILE *trace_fp;
 static char *trace_file_name;
 
@@ -83,53 +114,87 @@ typedef struct {
 } TraceLogHeader;
 
 
-static void read_from_buffer(unsigned int idx, void *dataptr, size_t size);
-static unsigned int write_to_buffer(unsigned int idx, void *dataptr, size_t size);
+static void read_from_ring(TraceRing *ring, unsigned int idx,
+                           void *dataptr, size_t size)
+{
+    unsigned int off = idx & (TRACE_RING_LEN - 1);
+    size_t len = MIN(size, TRACE_RING_LEN - off);
+
+    memcpy(dataptr, ring->buf + off, len);
+    memcpy((uint8_t *)dataptr + len, ring->buf, size - len);
+}
 
-static void clear_buffer_range(unsigned int idx, size_t len)
+static unsigned int write_to_ring(TraceRing *ring, unsigned int idx,
+                                  const void *dataptr, size_t size)
 {
-    uint32_t num = 0;
-    while (num < len) {
-        if (idx >= TRACE_BUF_LEN) {
-            idx = idx % TRACE_BUF_LEN;
-        }
-        trace_buf[idx++] = 0;
-        num++;
-    }
+    unsigned int off = idx & (TRACE_RING_LEN - 1);
+    size_t len = MIN(size, TRACE_RING_LEN - off);
+
+    memcpy(ring->buf + off, dataptr, len);
+    memcpy(ring->buf, (const uint8_t *)dataptr + len, size - len);
+    return idx + size; /* most callers wants to know where to write next */
+}
+
+#ifndef _WIN32
+static void trace_ring_release(void *opaque)
+{
+    TraceRing *ring = opaque;
+
+    g_atomic_int_set(&ring->owned, 0);
 }
+#endif
+
 /**
- * Read a trace record from the trace buffer
- *
- * @idx         Trace buffer index
- * @record      Trace record to fill
+ * Give the calling thread a ring, reusing one left by an exited thread
  *
- * Returns false if the record is not valid.
+ * Don't use g_malloc here, it can recurse into the tracer.
  */
-static bool get_trace_record(unsigned int idx, TraceRecord **recordptr)
+static TraceRing *trace_ring_attach(void)
 {
-    uint64_t event_flag = 0;
-    TraceRecord record;
-    /* read the event flag to see if its a valid record */
-    read_from_buffer(idx, &record, sizeof(event_flag));
+    TraceRing *ring, *head;
 
-    if (!(record.event & TRACE_RECORD_VALID)) {
-        return false;
+    for (ring = trace_rings; ring; ring = ring->next) {
+        if (g_atomic_int_compare_and_exchange(&ring->owned, 0, 1)) {
+            break;
+        }
     }
 
-    smp_rmb(); /* read memory barrier before accessing record */
-    /* read the record header to know record length */
-    read_from_buffer(idx, &record, sizeof(TraceRecord));
-    *recordptr = malloc(record.length); /* dont use g_malloc, can deadlock when traced */
-    /* make a copy of record to avoid being overwritten */
-    read_from_buffer(idx, *recordptr, record.length);
-    smp_rmb(); /* memory barrier before clearing valid flag */
-    (*recordptr)->event &= ~TRACE_RECORD_VALID;
-    /* clear the trace buffer range for consumed record otherwise any byte
-     * with its MSB set may be considered as a valid event id when the writer
-     * thread crosses this range of buffer again.
-     */
-    clear_buffer_range(idx, record.length);
-    return true;
+    if (!ring) {
+        ring = calloc(1, sizeof(*ring));
+        if (!ring) {
+            return NULL;
+        }
+        ring->owned = 1;
+        do {
+            head = g_atomic_pointer_get(&trace_rings);
+            ring->next = head;
+        } while (!g_atomic_pointer_compare_and_exchange(
+                     (volatile gpointer *)&trace_rings, head, ring));
+    }
+
+#ifdef __linux__
+    tls_var(trace_ring) = ring;
+#endif
+#ifdef _WIN32
+    TlsSetValue(trace_ring_tls, ring);
+#else
+    pthread_setspecific(trace_ring_key, ring);
+#endif
+    return ring;
+}
+
+static inline TraceRing *trace_ring_get(void)
+{
+    TraceRing *ring;
+
+#if defined(__linux__)
+    ring = tls_var(trace_ring);
+#elif defined(_WIN32)
+    ring = TlsGetValue(trace_ring_tls);
+#else
+    ring = pthread_getspecific(trace_ring_key);
+#endif
+    return ring ? ring : trace_ring_attach();
 }
 
 /**
@@ -162,40 +227,96 @@ static void wait_for_trace_records_available(void)
     g_static_mutex_unlock(&trace_lock);
 }
 
-static gpointer writeout_thread(gpointer opaque)
+/*
+ * Emit a single record for the events that all threads dropped since the
+ * last pass, so that a storm of dropped events costs one record per pass.
+ */
+static void write_dropped_events(void)
 {
-    TraceRecord *recordptr;
     union {
         TraceRecord rec;
         uint8_t bytes[sizeof(TraceRecord) + sizeof(uint64_t)];
     } dropped;
-    unsigned int idx = 0;
-    int dropped_count;
+    uint64_t count = 0;
+    TraceRing *ring;
+    int n;
     size_t unused __attribute__ ((unused));
 
-    for (;;) {
-        wait_for_trace_records_available();
+    for (ring = trace_rings; ring; ring = ring->next) {
+        do {
+            n = g_atomic_int_get(&ring->dropped);
+        } while (n && !g_atomic_int_compare_and_exchange(&ring->dropped,
+                                                         n, 0));
+        count += n;
+    }
+    if (!count) {
+        return;
+    }
+
+    dropped_events_total += count;
+    dropped.rec.event = DROPPED_EVENT_ID;
+    dropped.rec.timestamp_ns = get_clock();
+    dropped.rec.length = sizeof(TraceRecord) + sizeof(uint64_t);
+    dropped.rec.reserved = 0;
+    dropped.rec.arguments[0] = count;
+    unused = fwrite(&dropped.rec, dropped.rec.length, 1, trace_fp);
+}
 
-        if (g_atomic_int_get(&dropped_events)) {
-            dropped.rec.event = DROPPED_EVENT_ID,
-            dropped.rec.timestamp_ns = get_clock();
-            dropped.rec.length = sizeof(TraceRecord) + sizeof(uint64_t),
-            dropped.rec.reserved = 0;
-            do {
-                dropped_count = g_atomic_int_get(&dropped_events);
-            } while (!g_atomic_int_compare_and_exchange(&dropped_events,
-                                                        dropped_count, 0));
-            dropped.rec.arguments[0] = dropped_count;
-            unused = fwrite(&dropped.rec, dropped.rec.length, 1, trace_fp);
+/*
+ * Write out the records that were complete when the pass started, oldest
+ * first.  Each ring is in timestamp order already, so this only has to pick
+ * the ring whose next record is the oldest.
+ */
+static void write_ring_records(void)
+{
+    static uint8_t *recbuf;
+    static size_t recbuf_len;
+    TraceRecord hdr, best_hdr;
+    TraceRing *ring, *best;
+    size_t unused __attribute__ ((unused));
+
+    for (ring = trace_rings; ring; ring = ring->next) {
+        ring->snapshot = g_atomic_int_get(&ring->head);
+    }
+    smp_rmb(); /* read memory barrier before accessing records */
+
+    for (;;) {
+        best = NULL;
+        for (ring = trace_rings; ring; ring = ring->next) {
+            if (ring->tail == ring->snapshot) {
+                continue;
+            }
+            read_from_ring(ring, ring->tail, &hdr, sizeof(hdr));
+            if (!best || hdr.timestamp_ns < best_hdr.timestamp_ns) {
+                best = ring;
+                best_hdr = hdr;
+            }
+        }
+        if (!best) {
+            break;
         }
 
-        while (get_trace_record(idx, &recordptr)) {
-            unused = fwrite(recordptr, recordptr->length, 1, trace_fp);
-            writeout_idx += recordptr->length;
-            free(recordptr); /* dont use g_free, can deadlock when traced */
-            idx = writeout_idx % TRACE_BUF_LEN;
+        if (best_hdr.length > recbuf_len) {
+            /* dont use g_realloc, can deadlock when traced */
+            recbuf = realloc(recbuf, best_hdr.length);
+            recbuf_len = best_hdr.length;
         }
+        read_from_ring(best, best->tail, recbuf, best_hdr.length);
+        unused = fwrite(recbuf, best_hdr.length, 1, trace_fp);
+
+        smp_mb(); /* finish reading before the producer may overwrite */
+        g_atomic_int_set(&best->tail, best->tail + best_hdr.length);
+    }
+}
 
+static gpointer writeout_thread(gpointer opaque)
+{
+    for (;;) {
+        wait_for_trace_records_available();
+        g_atomic_int_set(&trace_kick_pending, 0);
+
+        write_dropped_events();
+        write_ring_records();
         fflush(trace_fp);
     }
     return NULL;
@@ -203,82 +324,62 @@ static gpointer writeout_thread(gpointer opaque)
 
 void trace_record_write_u64(TraceBufferRecord *rec, uint64_t val)
 {
-    rec->rec_off = write_to_buffer(rec->rec_off, &val, sizeof(uint64_t));
+    rec->rec_off = write_to_ring(rec->ring, rec->rec_off, &val, sizeof(val));
 }
 
 void trace_record_write_str(TraceBufferRecord *rec, const char *s, uint32_t slen)
 {
     /* Write string length first */
-    rec->rec_off = write_to_buffer(rec->rec_off, &slen, sizeof(slen));
+    rec->rec_off = write_to_ring(rec->ring, rec->rec_off, &slen, sizeof(slen));
     /* Write actual string now */
-    rec->rec_off = write_to_buffer(rec->rec_off, (void*)s, slen);
+    rec->rec_off = write_to_ring(rec->ring, rec->rec_off, s, slen);
 }
 
 int trace_record_start(TraceBufferRecord *rec, TraceEventID event, size_t datasize)
 {
-    unsigned int idx, rec_off, old_idx, new_idx;
-    uint32_t rec_len = sizeof(TraceRecord) + datasize;
-    uint64_t timestamp_ns = get_clock();
-
-    do {
-        old_idx = g_atomic_int_get(&trace_idx);
-        smp_rmb();
-        new_idx = old_idx + rec_len;
-
-        if (new_idx - writeout_idx > TRACE_BUF_LEN) {
-            /* Trace Buffer Full, Event dropped ! */
-            g_atomic_int_inc(&dropped_events);
-            return -ENOSPC;
-        }
-    } while (!g_atomic_int_compare_and_exchange(&trace_idx, old_idx, new_idx));
-
-    idx = old_idx % TRACE_BUF_LEN;
+    TraceRing *ring = trace_ring_get();
+    TraceRecord hdr;
+    unsigned int head;
 
-    rec_off = idx;
-    rec_off = write_to_buffer(rec_off, &event, sizeof(event));
-    rec_off = write_to_buffer(rec_off, &timestamp_ns, sizeof(timestamp_ns));
-    rec_off = write_to_buffer(rec_off, &rec_len, sizeof(rec_len));
+    if (!ring) {
+        return -ENOMEM;
+    }
+    if (ring->busy) {
+        /* an event traced while this thread was recording one */
+        g_atomic_int_inc(&ring->dropped);
+        return -EBUSY;
+    }
 
-    rec->tbuf_idx = idx;
-    rec->rec_off  = (idx + sizeof(TraceRecord)) % TRACE_BUF_LEN;
-    return 0;
-}
+    hdr.event = event;
+    hdr.timestamp_ns = get_clock();
+    hdr.length = sizeof(TraceRecord) + datasize;
+    hdr.reserved = 0;
 
-static void read_from_buffer(unsigned int idx, void *dataptr, size_t size)
-{
-    uint8_t *data_ptr = dataptr;
-    uint32_t x = 0;
-    while (x < size) {
-        if (idx >= TRACE_BUF_LEN) {
-            idx = idx % TRACE_BUF_LEN;
-        }
-        data_ptr[x++] = trace_buf[idx++];
+    head = ring->head;
+    if (head + hdr.length - g_atomic_int_get(&ring->tail) > TRACE_RING_LEN) {
+        /* Trace Buffer Full, Event dropped ! */
+        g_atomic_int_inc(&ring->dropped);
+        return -ENOSPC;
     }
-}
+    ring->busy = 1;
 
-static unsigned int write_to_buffer(unsigned int idx, void *dataptr, size_t size)
-{
-    uint8_t *data_ptr = dataptr;
-    uint32_t x = 0;
-    while (x < size) {
-        if (idx >= TRACE_BUF_LEN) {
-            idx = idx % TRACE_BUF_LEN;
-        }
-        trace_buf[idx++] = data_ptr[x++];
-    }
-    return idx; /* most callers wants to know where to write next */
+    rec->ring = ring;
+    rec->tbuf_idx = head;
+    rec->rec_off = write_to_ring(ring, head, &hdr, sizeof(hdr));
+    return 0;
 }
 
 void trace_record_finish(TraceBufferRecord *rec)
 {
-    TraceRecord record;
-    read_from_buffer(rec->tbuf_idx, &record, sizeof(TraceRecord));
-    smp_wmb(); /* write barrier before marking as valid */
-    record.event |= TRACE_RECORD_VALID;
-    write_to_buffer(rec->tbuf_idx, &record, sizeof(TraceRecord));
-
-    if (((unsigned int)g_atomic_int_get(&trace_idx) - writeout_idx)
-        > TRACE_BUF_FLUSH_THRESHOLD) {
+    TraceRing *ring = rec->ring;
+
+    smp_wmb(); /* write barrier before publishing the record */
+    g_atomic_int_set(&ring->head, rec->rec_off);
+    ring->busy = 0;
+
+    if (rec->rec_off - g_atomic_int_get(&ring->tail) >
+        TRACE_RING_FLUSH_THRESHOLD &&
+        g_atomic_int_compare_and_exchange(&trace_kick_pending, 0, 1)) {
         flush_trace_file(false);
     }
 }
@@ -348,6 +449,10 @@ void st_print_trace_file_status(FILE *stream, int (*stream_printf)(FILE *stream,
 {
     stream_printf(stream, "Trace file \"%s\" %s.\n",
                   trace_file_name, trace_fp ? "on" : "off");
+    if (dropped_events_total) {
+        stream_printf(stream, "%" PRIu64 " events dropped.\n",
+                      dropped_events_total);
+    }
 }
 
 void st_flush_trace_buffer(void)
@@ -355,44 +460,6 @@ void st_flush_trace_buffer(void)
     flush_trace_file(true);
 }
 
-void trace_print_events(FILE *stream, fprintf_function stream_printf)
-{
-    unsigned int i;
-
-    for (i = 0; i < NR_TRACE_EVENTS; i++) {
-        stream_printf(stream, "%s [Event ID %u] : state %u\n",
-                      trace_list[i].tp_name, i, trace_list[i].state);
-    }
-}
-
-bool trace_event_set_state(const char *name, bool state)
-{
-    unsigned int i;
-    unsigned int len;
-    bool wildcard = false;
-    bool matched = false;
-
-    len = strlen(name);
-    if (len > 0 && name[len - 1] == '*') {
-        wildcard = true;
-        len -= 1;
-    }
-    for (i = 0; i < NR_TRACE_EVENTS; i++) {
-        if (wildcard) {
-            if (!strncmp(trace_list[i].tp_name, name, len)) {
-                trace_list[i].state = state;
-                matched = true;
-            }
-            continue;
-        }
-        if (!strcmp(trace_list[i].tp_name, name)) {
-            trace_list[i].state = state;
-            return true;
-        }
-    }
-    return matched;
-}
-
 /* Helper function to create a thread with signals blocked.  Use glib's
  * portable threads since QEMU abstractions cannot be used due to reentrancy in
  * the tracer.  Also note the signal masking on POSIX hosts so that the thread
@@ -439,6 +506,12 @@ bool trace_backend_init(const char *events, const char *file)
     trace_empty_cond = g_cond_new();
 #endif
 
+#ifdef _WIN32
+    trace_ring_tls = TlsAlloc();
+#else
+    pthread_key_create(&trace_ring_key, trace_ring_release);
+#endif
+
     thread = trace_thread_create(writeout_thread);
     if (!thread) {
         fprintf(stderr, "warning: unable to initialize simple trace backend\n");
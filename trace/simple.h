@@ -15,12 +15,7 @@
 #include <stdbool.h>
 #include <stdio.h>
 
-typedef uint64_t TraceEventID;
-
-typedef struct {
-    const char *tp_name;
-    bool state;
-} TraceEvent;
+#include "trace/control.h"
 
 void st_print_trace_file_status(FILE *stream, fprintf_function stream_printf);
 void st_set_trace_file_enabled(bool enable);
@@ -28,6 +23,7 @@ bool st_set_trace_file(const char *file);
 void st_flush_trace_buffer(void);
 
 typedef struct {
+    struct TraceRing *ring;     /* of the calling thread */
     unsigned int tbuf_idx;
     unsigned int rec_off;
 } TraceBufferRecord;
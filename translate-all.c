@@ -38,6 +38,10 @@
 #include "qemu/timer.h"
 #include "exec/memory.h"
 #include "exec/address-spaces.h"
+#include "qemu/atomic.h"
+#include "qemu/tls.h"
+#include "qemu/thread.h"
+#include "sysemu/cpus.h"
 #if defined(CONFIG_USER_ONLY)
 #include "qemu.h"
 #if defined(__FreeBSD__) || defined(__FreeBSD_kernel__)
@@ -58,6 +62,7 @@
 #endif
 
 #include "exec/cputlb.h"
+#include "qemu/rcu.h"
 #include "translate-all.h"
 
 //#define DEBUG_TB_INVALIDATE
@@ -121,10 +126,25 @@ static void *l1_map[V_L1_SIZE];
 /* code generation context */
 TCGContext tcg_ctx;
 
+unsigned int tcg_superblock_threshold;
+
 static void tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc,
                          tb_page_addr_t phys_page2);
 static TranslationBlock *tb_find_pc(uintptr_t tc_ptr);
 
+#if !defined(CONFIG_USER_ONLY)
+static QemuMutex tb_mutex;
+static DEFINE_TLS(int, tb_lock_depth);
+/* a vCPU asked for a flush or ran out of code buffer while the others
+   may still be executing from it; the work is done by its thread outside
+   cpu_exec() */
+static bool tb_flush_pending;
+static bool tb_evict_pending;
+#endif
+
+static void tb_phys_invalidate_1(TranslationBlock *tb,
+                                 tb_page_addr_t page_addr);
+
 void cpu_gen_init(void)
 {
     tcg_context_init(&tcg_ctx); 
@@ -152,7 +172,12 @@ int cpu_gen_code(CPUArchState *env, TranslationBlock *tb, int *gen_code_size_ptr
 #endif
     tcg_func_start(s);
 
+#ifdef TARGET_INSN_EXTRA_WORDS
+    /* the gen_opc_* arrays are needed for the restore table */
+    gen_intermediate_code_pc(env, tb);
+#else
     gen_intermediate_code(env, tb);
+#endif
 
     /* generate machine code */
     gen_code_buf = tb->tc_ptr;
@@ -191,6 +216,199 @@ int cpu_gen_code(CPUArchState *env, TranslationBlock *tb, int *gen_code_size_ptr
     return 0;
 }
 
+#ifdef TARGET_INSN_EXTRA_WORDS
+/* Restore tables.  tb_gen_code() appends to the host code of each TB a
+   table of its guest instructions, so that the guest state for a host pc
+   can be found without translating the TB again.  The table starts with
+   the number of instructions and the size of the host code that they
+   cover.  Then for each instruction come the offset of its host code, its
+   gen_opc_icount[] and its gen_opc_pc[] and extra words, each as the
+   difference from the previous instruction; the first one is relative
+   to 0 and tb->pc.  Numbers are LEB128 encoded.  */
+
+#define TB_INSN_WORDS (1 + TARGET_INSN_EXTRA_WORDS)
+/* worst case for one instruction, and for the two header numbers */
+#define TB_RESTORE_INSN_MAX (5 + 3 + 10 * TB_INSN_WORDS)
+#define TB_RESTORE_HEADER_MAX 10
+
+static uint8_t *encode_uleb128(uint8_t *p, uint64_t val)
+{
+    do {
+        uint8_t byte = val & 0x7f;
+
+        val >>= 7;
+        *p++ = byte | (val ? 0x80 : 0);
+    } while (val);
+    return p;
+}
+
+static uint8_t *encode_sleb128(uint8_t *p, int64_t val)
+{
+    bool more;
+
+    do {
+        uint8_t byte = val & 0x7f;
+
+        val >>= 7;
+        more = !((val == 0 && !(byte & 0x40)) ||
+                 (val == -1 && (byte & 0x40)));
+        *p++ = byte | (more ? 0x80 : 0);
+    } while (more);
+    return p;
+}
+
+static uint64_t decode_uleb128(const uint8_t **pp)
+{
+    const uint8_t *p = *pp;
+    uint64_t val = 0;
+    int shift = 0;
+    uint8_t byte;
+
+    do {
+        byte = *p++;
+        val |= (uint64_t)(byte & 0x7f) << shift;
+        shift += 7;
+    } while (byte & 0x80);
+    *pp = p;
+    return val;
+}
+
+static int64_t decode_sleb128(const uint8_t **pp)
+{
+    const uint8_t *p = *pp;
+    uint64_t val = 0;
+    int shift = 0;
+    uint8_t byte;
+
+    do {
+        byte = *p++;
+        val |= (uint64_t)(byte & 0x7f) << shift;
+        shift += 7;
+    } while (byte & 0x80);
+    if (shift < 64 && (byte & 0x40)) {
+        val |= -((uint64_t)1 << shift);
+    }
+    *pp = p;
+    return val;
+}
+
+static void tb_get_insn_words(int j, target_ulong *data)
+{
+    data[0] = tcg_ctx.gen_opc_pc[j];
+#if TARGET_INSN_EXTRA_WORDS > 0
+    gen_opc_get_extra(j, data + 1);
+#endif
+}
+
+/* Write the restore table of @tb after its @code_size bytes of host code,
+   from the state left by cpu_gen_code().  Return the size of the table,
+   or 0 if it does not fit in the code buffer.  */
+static int tb_encode_search(TranslationBlock *tb, int code_size)
+{
+    TCGContext *s = &tcg_ctx;
+    int nb_ops = s->gen_opc_ptr - s->gen_opc_buf;
+    target_ulong prev[TB_INSN_WORDS], data[TB_INSN_WORDS];
+    uint32_t prev_off = 0;
+    uint16_t prev_icount = 0;
+    uint8_t *p;
+    int i, j, n = 0;
+
+    for (j = 0; j < nb_ops; j++) {
+        n += s->gen_opc_instr_start[j];
+    }
+    /* tb_alloc() leaves that much room after the start of the TB */
+    if (code_size + TB_RESTORE_HEADER_MAX + n * TB_RESTORE_INSN_MAX >
+        TCG_MAX_OP_SIZE * OPC_BUF_SIZE) {
+        tb->tc_search = NULL;
+        return 0;
+    }
+
+    p = tb->tc_search = tb->tc_ptr + code_size;
+    p = encode_uleb128(p, n);
+    /* the INDEX_op_end op is at nb_ops */
+    p = encode_uleb128(p, s->gen_opc_code_off[nb_ops]);
+    memset(prev, 0, sizeof(prev));
+    prev[0] = tb->pc;
+    for (j = 0; j < nb_ops; j++) {
+        if (!s->gen_opc_instr_start[j]) {
+            continue;
+        }
+        tb_get_insn_words(j, data);
+        p = encode_uleb128(p, s->gen_opc_code_off[j] - prev_off);
+        p = encode_uleb128(p, (uint16_t)(s->gen_opc_icount[j] - prev_icount));
+        for (i = 0; i < TB_INSN_WORDS; i++) {
+            p = encode_sleb128(p, (target_long)(data[i] - prev[i]));
+            prev[i] = data[i];
+        }
+        prev_off = s->gen_opc_code_off[j];
+        prev_icount = s->gen_opc_icount[j];
+    }
+    return p - tb->tc_search;
+}
+
+/* Look up the instruction of @tb whose host code includes @offset.
+   Return false if there is none.  */
+static bool tb_decode_search(TranslationBlock *tb, uintptr_t offset,
+                             target_ulong *data, uint16_t *icount)
+{
+    const uint8_t *p = tb->tc_search;
+    uint32_t n, end, off = 0;
+    bool found = false;
+    int i;
+
+    n = decode_uleb128(&p);
+    end = decode_uleb128(&p);
+    if (offset >= end) {
+        return false;
+    }
+    memset(data, 0, TB_INSN_WORDS * sizeof(target_ulong));
+    data[0] = tb->pc;
+    *icount = 0;
+    while (n--) {
+        off += decode_uleb128(&p);
+        if (off > offset) {
+            break;
+        }
+        *icount += decode_uleb128(&p);
+        for (i = 0; i < TB_INSN_WORDS; i++) {
+            data[i] += decode_sleb128(&p);
+        }
+        found = true;
+    }
+    return found;
+}
+
+static int cpu_restore_state_from_search(TranslationBlock *tb,
+                                         CPUArchState *env,
+                                         uintptr_t searched_pc)
+{
+    TCGContext *s = &tcg_ctx;
+    target_ulong data[TB_INSN_WORDS];
+    uint16_t icount;
+
+    if (searched_pc < (uintptr_t)tb->tc_ptr ||
+        !tb_decode_search(tb, searched_pc - (uintptr_t)tb->tc_ptr,
+                          data, &icount)) {
+        return -1;
+    }
+    if (use_icount) {
+        /* Reset the cycle counter to the start of the block, then
+           advance it to the instruction.  */
+        env->icount_decr.u16.low += tb->icount - icount;
+        /* Clear the IO flag.  */
+        env->can_do_io = 0;
+    }
+    /* hand the state to restore_state_to_opc() in slot 0 */
+    s->gen_opc_instr_start[0] = 1;
+    s->gen_opc_pc[0] = data[0];
+#if TARGET_INSN_EXTRA_WORDS > 0
+    gen_opc_set_extra(0, data + 1);
+#endif
+    restore_state_to_opc(env, tb, 0);
+    return 0;
+}
+#endif
+
 /* The cpu state corresponding to 'searched_pc' is restored.
  */
 static int cpu_restore_state_from_tb(TranslationBlock *tb, CPUArchState *env,
@@ -205,6 +423,16 @@ static int cpu_restore_state_from_tb(TranslationBlock *tb, CPUArchState *env,
 
 #ifdef CONFIG_PROFILER
     ti = profile_getclock();
+#endif
+#ifdef TARGET_INSN_EXTRA_WORDS
+    if (tb->tc_search) {
+        j = cpu_restore_state_from_search(tb, env, searched_pc);
+#ifdef CONFIG_PROFILER
+        s->restore_time += profile_getclock() - ti;
+        s->restore_count++;
+#endif
+        return j;
+    }
 #endif
     tcg_func_start(s);
 
@@ -373,6 +601,11 @@ static void page_init(void)
 #endif
 }
 
+/* Levels of the page descriptor tree are never freed, and a new level is
+   published with a compare-and-swap, so lookups take no lock: threads of
+   a guest process look up pages while another one is in a syscall that
+   maps memory.  The PageDesc contents are still protected by mmap_lock
+   (and tb_lock for the TB lists).  */
 static PageDesc *page_find_alloc(tb_page_addr_t index, int alloc)
 {
     PageDesc *pd;
@@ -386,9 +619,11 @@ static PageDesc *page_find_alloc(tb_page_addr_t index, int alloc)
         P = mmap(NULL, SIZE, PROT_READ | PROT_WRITE,    \
                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);   \
     } while (0)
+# define FREE(P, SIZE) munmap(P, SIZE)
 #else
 # define ALLOC(P, SIZE) \
     do { P = g_malloc0(SIZE); } while (0)
+# define FREE(P, SIZE) g_free(P)
 #endif
 
     /* Level 1.  Always allocated.  */
@@ -396,29 +631,43 @@ static PageDesc *page_find_alloc(tb_page_addr_t index, int alloc)
 
     /* Level 2..N-1.  */
     for (i = V_L1_SHIFT / L2_BITS - 1; i > 0; i--) {
-        void **p = *lp;
+        void **p = atomic_rcu_read(lp);
 
         if (p == NULL) {
+            void **old;
+
             if (!alloc) {
                 return NULL;
             }
             ALLOC(p, sizeof(void *) * L2_SIZE);
-            *lp = p;
+            old = atomic_cmpxchg(lp, NULL, p);
+            if (unlikely(old)) {
+                /* another thread got there first */
+                FREE(p, sizeof(void *) * L2_SIZE);
+                p = old;
+            }
         }
 
         lp = p + ((index >> (i * L2_BITS)) & (L2_SIZE - 1));
     }
 
-    pd = *lp;
+    pd = atomic_rcu_read(lp);
     if (pd == NULL) {
+        PageDesc *old;
+
         if (!alloc) {
             return NULL;
         }
         ALLOC(pd, sizeof(PageDesc) * L2_SIZE);
-        *lp = pd;
+        old = atomic_cmpxchg(lp, NULL, pd);
+        if (unlikely(old)) {
+            FREE(pd, sizeof(PageDesc) * L2_SIZE);
+            pd = old;
+        }
     }
 
 #undef ALLOC
+#undef FREE
 
     return pd + (index & (L2_SIZE - 1));
 }
@@ -553,6 +802,64 @@ static inline void *alloc_code_gen_buffer(void)
 }
 #endif /* USE_STATIC_CODE_GEN_BUFFER, USE_MMAP */
 
+/* Reset all regions to empty and start filling the first one. */
+static void tb_regions_reset(void)
+{
+    TBContext *s = &tcg_ctx.tb_ctx;
+    int i;
+
+    for (i = 0; i < s->nb_regions; i++) {
+        s->regions[i].code_ptr = s->regions[i].code_start;
+        s->regions[i].nb_tbs = 0;
+        s->regions[i].exec_count = 0;
+    }
+    s->nb_tbs = 0;
+    s->cur_region = 0;
+    tcg_ctx.code_gen_ptr = s->regions[0].code_start;
+}
+
+/* Split the buffer in regions that each are large compared to the room
+   kept free at their end for the biggest possible TB. */
+static void tb_regions_init(void)
+{
+    TBContext *s = &tcg_ctx.tb_ctx;
+    size_t slack = TCG_MAX_OP_SIZE * OPC_BUF_SIZE;
+    int i, n;
+
+    n = MIN(TB_MAX_REGIONS, tcg_ctx.code_gen_buffer_size / (8 * slack));
+    n = MAX(n, 1);
+    s->nb_regions = n;
+    s->region_size = (tcg_ctx.code_gen_buffer_size / n) &
+        ~(size_t)(CODE_GEN_ALIGN - 1);
+    s->tbs_per_region = tcg_ctx.code_gen_max_blocks / n;
+    for (i = 0; i < n; i++) {
+        TBRegion *r = &s->regions[i];
+        size_t end = (i == n - 1) ? tcg_ctx.code_gen_buffer_size
+                                  : (i + 1) * s->region_size;
+
+        r->code_start = tcg_ctx.code_gen_buffer + i * s->region_size;
+        r->code_end = tcg_ctx.code_gen_buffer + end - slack;
+        r->first_tb = i * s->tbs_per_region;
+    }
+    tb_regions_reset();
+}
+
+/* Bytes of generated code in the whole buffer */
+static inline size_t tb_code_size(void)
+{
+    TBContext *s = &tcg_ctx.tb_ctx;
+    size_t size = 0;
+    int i;
+
+    for (i = 0; i < s->nb_regions; i++) {
+        uint8_t *end = i == s->cur_region ? tcg_ctx.code_gen_ptr
+                                          : s->regions[i].code_ptr;
+
+        size += end - s->regions[i].code_start;
+    }
+    return size;
+}
+
 static inline void code_gen_alloc(size_t tb_size)
 {
     tcg_ctx.code_gen_buffer_size = size_code_gen_buffer(tb_size);
@@ -580,6 +887,11 @@ static inline void code_gen_alloc(size_t tb_size)
             CODE_GEN_AVG_BLOCK_SIZE;
     tcg_ctx.tb_ctx.tbs =
             g_malloc(tcg_ctx.code_gen_max_blocks * sizeof(TranslationBlock));
+    /* most of the TBs that fit in the buffer are never looked up at the
+       same time; start smaller and let the table grow */
+    qht_init(&tcg_ctx.tb_ctx.htable, tcg_ctx.code_gen_max_blocks / 4,
+             QHT_MODE_AUTO_RESIZE);
+    tb_regions_init();
 }
 
 /* Must be called before using the QEMU cpus. 'tb_size' is the size
@@ -589,9 +901,11 @@ void tcg_exec_init(unsigned long tb_size)
 {
     cpu_gen_init();
     code_gen_alloc(tb_size);
-    tcg_ctx.code_gen_ptr = tcg_ctx.code_gen_buffer;
     tcg_register_jit(tcg_ctx.code_gen_buffer, tcg_ctx.code_gen_buffer_size);
     page_init();
+#if !defined(CONFIG_USER_ONLY)
+    qemu_mutex_init(&tb_mutex);
+#endif
 #if !defined(CONFIG_USER_ONLY) || !defined(CONFIG_USE_GUEST_BASE)
     /* There's no guest base to take into account, so go ahead and
        initialize the prologue now.  */
@@ -604,32 +918,75 @@ bool tcg_enabled(void)
     return tcg_ctx.code_gen_buffer != NULL;
 }
 
-/* Allocate a new translation block. Flush the translation buffer if
-   too many translation blocks or too much generated code. */
+#if !defined(CONFIG_USER_ONLY)
+void tb_lock(void)
+{
+    if (!mttcg_enabled) {
+        return;
+    }
+    if (tls_var(tb_lock_depth)++ == 0) {
+        qemu_mutex_lock(&tb_mutex);
+    }
+}
+
+void tb_unlock(void)
+{
+    if (!mttcg_enabled) {
+        return;
+    }
+    assert(tls_var(tb_lock_depth) > 0);
+    if (--tls_var(tb_lock_depth) == 0) {
+        qemu_mutex_unlock(&tb_mutex);
+    }
+}
+
+void tb_lock_reset(void)
+{
+    if (tls_var(tb_lock_depth)) {
+        tls_var(tb_lock_depth) = 0;
+        qemu_mutex_unlock(&tb_mutex);
+    }
+}
+#endif
+
+/* Allocate a new translation block in the current region.  Return NULL
+   if the region has too many translation blocks or too much generated
+   code; tb_evict() must then make room.  */
 static TranslationBlock *tb_alloc(target_ulong pc)
 {
+    TBContext *s = &tcg_ctx.tb_ctx;
+    TBRegion *r = &s->regions[s->cur_region];
     TranslationBlock *tb;
 
-    if (tcg_ctx.tb_ctx.nb_tbs >= tcg_ctx.code_gen_max_blocks ||
-        (tcg_ctx.code_gen_ptr - tcg_ctx.code_gen_buffer) >=
-         tcg_ctx.code_gen_buffer_max_size) {
+    if (r->nb_tbs >= s->tbs_per_region ||
+        tcg_ctx.code_gen_ptr >= r->code_end) {
         return NULL;
     }
-    tb = &tcg_ctx.tb_ctx.tbs[tcg_ctx.tb_ctx.nb_tbs++];
+    tb = &s->tbs[r->first_tb + r->nb_tbs++];
+    s->nb_tbs++;
     tb->pc = pc;
     tb->cflags = 0;
+    tb->region = s->cur_region;
+    tb->tc_search = NULL;
+    tb->exec_count = 0;
+    tb->prof_count = 0;
+    tb->prof_ticks = 0;
+    tb->prof_helper_ticks = 0;
     return tb;
 }
 
 void tb_free(TranslationBlock *tb)
 {
+    TBContext *s = &tcg_ctx.tb_ctx;
+    TBRegion *r = &s->regions[s->cur_region];
+
     /* In practice this is mostly used for single use temporary TB
        Ignore the hard cases and just back up if this TB happens to
        be the last one generated.  */
-    if (tcg_ctx.tb_ctx.nb_tbs > 0 &&
-            tb == &tcg_ctx.tb_ctx.tbs[tcg_ctx.tb_ctx.nb_tbs - 1]) {
+    if (r->nb_tbs > 0 && tb == &s->tbs[r->first_tb + r->nb_tbs - 1]) {
         tcg_ctx.code_gen_ptr = tb->tc_ptr;
-        tcg_ctx.tb_ctx.nb_tbs--;
+        r->nb_tbs--;
+        s->nb_tbs--;
     }
 }
 
@@ -675,94 +1032,219 @@ static void page_flush_tb(void)
     }
 }
 
+static void tb_account_time(int64_t start, int64_t *total, int64_t *max)
+{
+    int64_t t = get_clock() - start;
+
+    *total += t;
+    if (t > *max) {
+        *max = t;
+    }
+}
+
+static void tb_check_overflow(CPUArchState *env1)
+{
+    TBContext *s = &tcg_ctx.tb_ctx;
+    TBRegion *r = &s->regions[s->cur_region];
+    uint8_t *end = s->cur_region == s->nb_regions - 1 ?
+        tcg_ctx.code_gen_buffer + tcg_ctx.code_gen_buffer_size :
+        s->regions[s->cur_region + 1].code_start;
+
+    if (tcg_ctx.code_gen_ptr > end) {
+        cpu_abort(env1, "Internal error: code buffer overflow\n");
+    }
+    r->code_ptr = tcg_ctx.code_gen_ptr;
+}
+
 /* flush all the translation blocks */
-/* XXX: tb_flush is currently not thread safe */
-void tb_flush(CPUArchState *env1)
+static void do_tb_flush(CPUArchState *env1)
 {
     CPUArchState *env;
+    int64_t start = get_clock();
 
 #if defined(DEBUG_FLUSH)
     printf("qemu: flush code_size=%ld nb_tbs=%d avg_tb_size=%ld\n",
-           (unsigned long)(tcg_ctx.code_gen_ptr - tcg_ctx.code_gen_buffer),
+           (unsigned long)tb_code_size(),
            tcg_ctx.tb_ctx.nb_tbs, tcg_ctx.tb_ctx.nb_tbs > 0 ?
-           ((unsigned long)(tcg_ctx.code_gen_ptr - tcg_ctx.code_gen_buffer)) /
-           tcg_ctx.tb_ctx.nb_tbs : 0);
+           ((unsigned long)tb_code_size()) / tcg_ctx.tb_ctx.nb_tbs : 0);
 #endif
-    if ((unsigned long)(tcg_ctx.code_gen_ptr - tcg_ctx.code_gen_buffer)
-        > tcg_ctx.code_gen_buffer_size) {
-        cpu_abort(env1, "Internal error: code buffer overflow\n");
-    }
-    tcg_ctx.tb_ctx.nb_tbs = 0;
+    tb_check_overflow(env1);
 
     for (env = first_cpu; env != NULL; env = env->next_cpu) {
         memset(env->tb_jmp_cache, 0, TB_JMP_CACHE_SIZE * sizeof(void *));
     }
 
-    memset(tcg_ctx.tb_ctx.tb_phys_hash, 0,
-            CODE_GEN_PHYS_HASH_SIZE * sizeof(void *));
+    qht_reset(&tcg_ctx.tb_ctx.htable);
     page_flush_tb();
 
-    tcg_ctx.code_gen_ptr = tcg_ctx.code_gen_buffer;
+    tb_regions_reset();
     /* XXX: flush processor icache at this point if cache flush is
        expensive */
     tcg_ctx.tb_ctx.tb_flush_count++;
+    tb_account_time(start, &tcg_ctx.tb_ctx.tb_flush_time,
+                    &tcg_ctx.tb_ctx.tb_flush_time_max);
 }
 
-#ifdef DEBUG_TB_CHECK
+/* The region to recycle is the least executed one.  Ties go to the one
+   filled the longest ago, which is the next one in ring order as long as
+   the regions are recycled in order.  */
+static int tb_pick_region(void)
+{
+    TBContext *s = &tcg_ctx.tb_ctx;
+    int i, r, victim = -1;
+
+    for (i = 1; i < s->nb_regions; i++) {
+        r = (s->cur_region + i) % s->nb_regions;
+        if (victim < 0 ||
+            s->regions[r].exec_count < s->regions[victim].exec_count) {
+            victim = r;
+        }
+    }
+    return victim;
+}
 
-static void tb_invalidate_check(target_ulong address)
+/* Empty one region of the code buffer and make it the current one */
+static void do_tb_evict(CPUArchState *env1)
 {
-    TranslationBlock *tb;
+    TBContext *s = &tcg_ctx.tb_ctx;
+    TBRegion *r;
+    int64_t start;
     int i;
 
-    address &= TARGET_PAGE_MASK;
-    for (i = 0; i < CODE_GEN_PHYS_HASH_SIZE; i++) {
-        for (tb = tb_ctx.tb_phys_hash[i]; tb != NULL; tb = tb->phys_hash_next) {
-            if (!(address + TARGET_PAGE_SIZE <= tb->pc ||
-                  address >= tb->pc + tb->size)) {
-                printf("ERROR invalidate: address=" TARGET_FMT_lx
-                       " PC=%08lx size=%04x\n",
-                       address, (long)tb->pc, tb->size);
-            }
+    if (s->nb_regions == 1) {
+        do_tb_flush(env1);
+        return;
+    }
+
+    start = get_clock();
+    tb_check_overflow(env1);
+    r = &s->regions[tb_pick_region()];
+    for (i = 0; i < r->nb_tbs; i++) {
+        TranslationBlock *tb = &s->tbs[r->first_tb + i];
+
+        if (!(tb->cflags & CF_INVALID)) {
+            tb_phys_invalidate_1(tb, -1);
         }
     }
+    s->nb_tbs -= r->nb_tbs;
+    s->tb_evicted_tbs += r->nb_tbs;
+    r->nb_tbs = 0;
+    r->code_ptr = r->code_start;
+
+    /* let old executions fade out */
+    for (i = 0; i < s->nb_regions; i++) {
+        s->regions[i].exec_count /= 2;
+    }
+    r->exec_count = 0;
+
+    s->cur_region = r - s->regions;
+    tcg_ctx.code_gen_ptr = r->code_start;
+    s->tb_evict_count++;
+    tb_account_time(start, &s->tb_evict_time, &s->tb_evict_time_max);
 }
 
-/* verify that all the pages have correct rights for code */
-static void tb_page_check(void)
+/* XXX: tb_flush is not thread safe in user mode */
+void tb_flush(CPUArchState *env1)
 {
-    TranslationBlock *tb;
-    int i, flags1, flags2;
-
-    for (i = 0; i < CODE_GEN_PHYS_HASH_SIZE; i++) {
-        for (tb = tcg_ctx.tb_ctx.tb_phys_hash[i]; tb != NULL;
-                tb = tb->phys_hash_next) {
-            flags1 = page_get_flags(tb->pc);
-            flags2 = page_get_flags(tb->pc + tb->size - 1);
-            if ((flags1 & PAGE_WRITE) || (flags2 & PAGE_WRITE)) {
-                printf("ERROR page flags: PC=%08lx size=%04x f1=%x f2=%x\n",
-                       (long)tb->pc, tb->size, flags1, flags2);
-            }
+#if !defined(CONFIG_USER_ONLY)
+    if (mttcg_enabled) {
+        if (cpu_single_env) {
+            /* other vCPUs may be executing code from the buffer */
+            tb_flush_pending = true;
+            cpu_exit(cpu_single_env);
+            return;
         }
+        cpu_exclusive_start();
+        tb_lock();
+        tb_flush_pending = false;
+        do_tb_flush(env1);
+        tb_unlock();
+        cpu_exclusive_end();
+        return;
     }
+#endif
+    do_tb_flush(env1);
 }
 
+/* Make room in the code buffer for tb_alloc() */
+static void tb_evict(CPUArchState *env1)
+{
+#if !defined(CONFIG_USER_ONLY)
+    if (mttcg_enabled) {
+        if (cpu_single_env) {
+            /* same as tb_flush(), the region may be in use elsewhere */
+            tb_evict_pending = true;
+            cpu_exit(cpu_single_env);
+            return;
+        }
+        cpu_exclusive_start();
+        tb_lock();
+        /* another vCPU may have made room already */
+        if (tb_evict_pending) {
+            tb_evict_pending = false;
+            do_tb_evict(env1);
+        }
+        tb_unlock();
+        cpu_exclusive_end();
+        return;
+    }
 #endif
+    do_tb_evict(env1);
+}
 
-static inline void tb_hash_remove(TranslationBlock **ptb, TranslationBlock *tb)
+#if !defined(CONFIG_USER_ONLY)
+void tb_flush_if_pending(CPUArchState *env)
 {
-    TranslationBlock *tb1;
+    if (tb_flush_pending) {
+        tb_flush(env);
+    } else if (tb_evict_pending) {
+        tb_evict(env);
+    }
+}
+#endif
 
-    for (;;) {
-        tb1 = *ptb;
-        if (tb1 == tb) {
-            *ptb = tb1->phys_hash_next;
-            break;
-        }
-        ptb = &tb1->phys_hash_next;
+#ifdef DEBUG_TB_CHECK
+
+static void do_tb_invalidate_check(void *p, uint32_t hash, void *userp)
+{
+    TranslationBlock *tb = p;
+    target_ulong address = *(target_ulong *)userp;
+
+    if (!(address + TARGET_PAGE_SIZE <= tb->pc ||
+          address >= tb->pc + tb->size)) {
+        printf("ERROR invalidate: address=" TARGET_FMT_lx
+               " PC=%08lx size=%04x\n",
+               address, (long)tb->pc, tb->size);
+    }
+}
+
+static void tb_invalidate_check(target_ulong address)
+{
+    address &= TARGET_PAGE_MASK;
+    qht_iter(&tcg_ctx.tb_ctx.htable, do_tb_invalidate_check, &address);
+}
+
+static void do_tb_page_check(void *p, uint32_t hash, void *userp)
+{
+    TranslationBlock *tb = p;
+    int flags1, flags2;
+
+    flags1 = page_get_flags(tb->pc);
+    flags2 = page_get_flags(tb->pc + tb->size - 1);
+    if ((flags1 & PAGE_WRITE) || (flags2 & PAGE_WRITE)) {
+        printf("ERROR page flags: PC=%08lx size=%04x f1=%x f2=%x\n",
+               (long)tb->pc, tb->size, flags1, flags2);
     }
 }
 
+/* verify that all the pages have correct rights for code */
+static void tb_page_check(void)
+{
+    qht_iter(&tcg_ctx.tb_ctx.htable, do_tb_page_check, NULL);
+}
+
+#endif
+
 static inline void tb_page_remove(TranslationBlock **ptb, TranslationBlock *tb)
 {
     TranslationBlock *tb1;
@@ -816,8 +1298,8 @@ static inline void tb_reset_jump(TranslationBlock *tb, int n)
     tb_set_jmp_target(tb, n, (uintptr_t)(tb->tc_ptr + tb->tb_next_offset[n]));
 }
 
-/* invalidate one TB */
-void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
+static void tb_phys_invalidate_1(TranslationBlock *tb,
+                                 tb_page_addr_t page_addr)
 {
     CPUArchState *env;
     PageDesc *p;
@@ -827,8 +1309,8 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
 
     /* remove the TB from the hash list */
     phys_pc = tb->page_addr[0] + (tb->pc & ~TARGET_PAGE_MASK);
-    h = tb_phys_hash_func(phys_pc);
-    tb_hash_remove(&tcg_ctx.tb_ctx.tb_phys_hash[h], tb);
+    qht_remove(&tcg_ctx.tb_ctx.htable, tb,
+               tb_hash_func(phys_pc, tb->pc, tb->flags));
 
     /* remove the TB from the page list */
     if (tb->page_addr[0] != page_addr) {
@@ -870,7 +1352,13 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
         tb1 = tb2;
     }
     tb->jmp_first = (TranslationBlock *)((uintptr_t)tb | 2); /* fail safe */
+    tb->cflags |= CF_INVALID;
+}
 
+/* invalidate one TB */
+void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
+{
+    tb_phys_invalidate_1(tb, page_addr);
     tcg_ctx.tb_ctx.tb_phys_invalidate_count++;
 }
 
@@ -930,6 +1418,27 @@ static void build_page_bitmap(PageDesc *p)
     }
 }
 
+/* With -machine tcg-profile, tell host profilers such as perf where the
+   code of each TB is, in the format of /tmp/perf-PID.map files.  */
+static void tb_perf_map_add(TranslationBlock *tb, int code_size)
+{
+    static FILE *perf_map;
+
+    if (!perf_map) {
+        char *path = g_strdup_printf("/tmp/perf-%d.map", (int)getpid());
+
+        perf_map = fopen(path, "w");
+        g_free(path);
+        if (!perf_map) {
+            return;
+        }
+        /* the process may well not exit cleanly */
+        setvbuf(perf_map, NULL, _IOLBF, 0);
+    }
+    fprintf(perf_map, "%" PRIxPTR " %x guest:" TARGET_FMT_lx " %s\n",
+            (uintptr_t)tb->tc_ptr, code_size, tb->pc, lookup_symbol(tb->pc));
+}
+
 TranslationBlock *tb_gen_code(CPUArchState *env,
                               target_ulong pc, target_ulong cs_base,
                               int flags, int cflags)
@@ -938,13 +1447,23 @@ TranslationBlock *tb_gen_code(CPUArchState *env,
     uint8_t *tc_ptr;
     tb_page_addr_t phys_pc, phys_page2;
     target_ulong virt_page2;
-    int code_gen_size;
+    int code_gen_size, search_size = 0;
 
+    tb_lock();
     phys_pc = get_page_addr_code(env, pc);
     tb = tb_alloc(pc);
     if (!tb) {
-        /* flush must be done */
-        tb_flush(env);
+#if !defined(CONFIG_USER_ONLY)
+        if (mttcg_enabled) {
+            /* tb_evict only schedules the eviction, retry once it is
+               done */
+            tb_evict(env);
+            env->exception_index = EXCP_INTERRUPT;
+            cpu_loop_exit(env);
+        }
+#endif
+        /* eviction must be done */
+        tb_evict(env);
         /* cannot fail at this point */
         tb = tb_alloc(pc);
         /* Don't forget to invalidate previous TB info.  */
@@ -956,8 +1475,12 @@ TranslationBlock *tb_gen_code(CPUArchState *env,
     tb->flags = flags;
     tb->cflags = cflags;
     cpu_gen_code(env, tb, &code_gen_size);
+#ifdef TARGET_INSN_EXTRA_WORDS
+    search_size = tb_encode_search(tb, code_gen_size);
+#endif
     tcg_ctx.code_gen_ptr = (void *)(((uintptr_t)tcg_ctx.code_gen_ptr +
-            code_gen_size + CODE_GEN_ALIGN - 1) & ~(CODE_GEN_ALIGN - 1));
+            code_gen_size + search_size + CODE_GEN_ALIGN - 1) &
+            ~(CODE_GEN_ALIGN - 1));
 
     /* check next page if needed */
     virt_page2 = (pc + tb->size - 1) & TARGET_PAGE_MASK;
@@ -966,9 +1489,174 @@ TranslationBlock *tb_gen_code(CPUArchState *env,
         phys_page2 = get_page_addr_code(env, virt_page2);
     }
     tb_link_page(tb, phys_pc, phys_page2);
+#if defined(CONFIG_USER_ONLY)
+    tb_cache_add(tb, code_gen_size);
+#endif
+    tcg_ctx.tb_ctx.tb_gen_count++;
+    tcg_ctx.tb_ctx.tb_gen_insns += tb->icount;
+    tcg_ctx.tb_ctx.tb_gen_host_bytes += code_gen_size;
+    if (tcg_tb_profile) {
+        tb_perf_map_add(tb, code_gen_size);
+    }
+    tb_unlock();
     return tb;
 }
 
+#if defined(CONFIG_USER_ONLY)
+/* Like tb_gen_code(), but copy the host code of an earlier run, which
+   @relocate patches for its new address.  @desc gives the guest state
+   and the jump offsets of the block.  Return NULL if the code buffer is
+   full or the code cannot be relocated; the caller translates then.  */
+TranslationBlock *tb_gen_cached(CPUArchState *env, const TranslationBlock *desc,
+                                const uint8_t *code, int code_size,
+                                bool (*relocate)(TranslationBlock *tb,
+                                                 void *opaque),
+                                void *opaque)
+{
+    TranslationBlock *tb;
+    tb_page_addr_t phys_pc, phys_page2;
+    target_ulong virt_page2;
+
+    tb_lock();
+    tb = tb_alloc(desc->pc);
+    if (!tb) {
+        tb_unlock();
+        return NULL;
+    }
+    tb->tc_ptr = tcg_ctx.code_gen_ptr;
+    tb->cs_base = desc->cs_base;
+    tb->flags = desc->flags;
+    tb->size = desc->size;
+    tb->icount = desc->icount;
+    memcpy(tb->tb_next_offset, desc->tb_next_offset,
+           sizeof(tb->tb_next_offset));
+#ifdef USE_DIRECT_JUMP
+    memcpy(tb->tb_jmp_offset, desc->tb_jmp_offset, sizeof(tb->tb_jmp_offset));
+#endif
+    memcpy(tb->tc_ptr, code, code_size);
+    if (!relocate(tb, opaque)) {
+        tb_free(tb);
+        tb_unlock();
+        return NULL;
+    }
+    flush_icache_range((uintptr_t)tb->tc_ptr,
+                       (uintptr_t)tb->tc_ptr + code_size);
+    tcg_ctx.code_gen_ptr = (void *)(((uintptr_t)tcg_ctx.code_gen_ptr +
+            code_size + CODE_GEN_ALIGN - 1) & ~(CODE_GEN_ALIGN - 1));
+
+    phys_pc = get_page_addr_code(env, tb->pc);
+    virt_page2 = (tb->pc + tb->size - 1) & TARGET_PAGE_MASK;
+    phys_page2 = -1;
+    if ((tb->pc & TARGET_PAGE_MASK) != virt_page2) {
+        phys_page2 = get_page_addr_code(env, virt_page2);
+    }
+    tb_link_page(tb, phys_pc, phys_page2);
+    tcg_ctx.tb_ctx.tb_gen_count++;
+    tcg_ctx.tb_ctx.tb_gen_insns += tb->icount;
+    tcg_ctx.tb_ctx.tb_gen_host_bytes += code_size;
+    if (tcg_tb_profile) {
+        tb_perf_map_add(tb, code_size);
+    }
+    tb_unlock();
+    return tb;
+}
+#endif
+
+/* Retranslate a hot TB so that the frontend can follow its direct jumps
+   and optimize across them.  The old TB stays in the code buffer until
+   its region is recycled, so a vCPU that is still running it is not
+   disturbed.  */
+TranslationBlock *tb_gen_superblock(CPUArchState *env, TranslationBlock *tb)
+{
+    target_ulong pc = tb->pc;
+    target_ulong cs_base = tb->cs_base;
+    uint64_t flags = tb->flags;
+
+    tb_lock();
+    tb_phys_invalidate_1(tb, -1);
+    tb = tb_gen_code(env, pc, cs_base, flags, CF_SUPERBLOCK);
+    env->tb_jmp_cache[tb_jmp_cache_hash_func(pc)] = tb;
+    tcg_ctx.tb_ctx.tb_superblock_count++;
+    tb_unlock();
+    return tb;
+}
+
+static int tb_profile_cmp(const void *a, const void *b)
+{
+    const TranslationBlock *tb1 = *(TranslationBlock **)a;
+    const TranslationBlock *tb2 = *(TranslationBlock **)b;
+
+    return tb1->prof_ticks > tb2->prof_ticks ? -1 :
+           tb1->prof_ticks < tb2->prof_ticks;
+}
+
+void dump_tb_profile(FILE *f, fprintf_function cpu_fprintf, int max)
+{
+    TBContext *s = &tcg_ctx.tb_ctx;
+    TranslationBlock **tbs, *tb;
+    uint64_t ticks = 0, helper_ticks = 0;
+    int i, j, n = 0;
+
+    if (!tcg_tb_profile) {
+        cpu_fprintf(f, "TB profiling is disabled, "
+                    "use -machine tcg-profile=on\n");
+        return;
+    }
+
+    tb_lock();
+    tbs = g_new(TranslationBlock *, s->nb_tbs);
+    for (i = 0; i < s->nb_regions; i++) {
+        for (j = 0; j < s->regions[i].nb_tbs; j++) {
+            tb = &s->tbs[s->regions[i].first_tb + j];
+            if (tb->prof_count && !(tb->cflags & CF_INVALID)) {
+                tbs[n++] = tb;
+                ticks += tb->prof_ticks;
+                helper_ticks += tb->prof_helper_ticks;
+            }
+        }
+    }
+    qsort(tbs, n, sizeof(*tbs), tb_profile_cmp);
+
+    cpu_fprintf(f, "%" PRIu64 " host ticks in %d TBs, %0.1f%% in helpers "
+                "(TBs flushed since are not counted)\n", ticks, n,
+                ticks ? (double)helper_ticks / ticks * 100 : 0);
+    cpu_fprintf(f, "%-18s %12s %14s %7s %8s %-18s %s\n", "guest PC",
+                "executions", "ticks", "total", "helpers", "host code",
+                "symbol");
+    for (i = 0; i < n && i < max; i++) {
+        tb = tbs[i];
+        cpu_fprintf(f, "0x" TARGET_FMT_lx " %12" PRIu64 " %14" PRIu64
+                    " %6.1f%% %7.1f%% %-18p %s\n", tb->pc, tb->prof_count,
+                    tb->prof_ticks,
+                    ticks ? (double)tb->prof_ticks / ticks * 100 : 0,
+                    tb->prof_ticks ?
+                    (double)tb->prof_helper_ticks / tb->prof_ticks * 100 : 0,
+                    tb->tc_ptr, lookup_symbol(tb->pc));
+    }
+    g_free(tbs);
+    tb_unlock();
+}
+
+void dump_tb_stats(FILE *f, fprintf_function cpu_fprintf)
+{
+    TBContext *s = &tcg_ctx.tb_ctx;
+
+    cpu_fprintf(f, "tb-stats: translated-tbs=%lu translated-insns=%" PRIu64
+                " host-bytes=%" PRIu64 " host-bytes-per-insn=%0.2f"
+                " dispatches=%lu flushes=%d evictions=%d invalidates=%d",
+                s->tb_gen_count, s->tb_gen_insns, s->tb_gen_host_bytes,
+                s->tb_gen_insns ?
+                (double)s->tb_gen_host_bytes / s->tb_gen_insns : 0,
+                s->tb_dispatch_count, s->tb_flush_count, s->tb_evict_count,
+                s->tb_phys_invalidate_count);
+    if (tcg_tb_profile) {
+        /* nothing is chained then, so every execution is counted */
+        cpu_fprintf(f, " executed-tbs=%" PRIu64 " executed-insns=%" PRIu64,
+                    s->tb_prof_exec_count, s->tb_prof_exec_insns);
+    }
+    cpu_fprintf(f, "\n");
+}
+
 /*
  * Invalidate all TBs which intersect with the target physical address range
  * [start;end[. NOTE: start and end may refer to *different* physical pages.
@@ -1011,8 +1699,10 @@ void tb_invalidate_phys_page_range(tb_page_addr_t start, tb_page_addr_t end,
     int current_flags = 0;
 #endif /* TARGET_HAS_PRECISE_SMC */
 
+    tb_lock();
     p = page_find(start >> TARGET_PAGE_BITS);
     if (!p) {
+        tb_unlock();
         return;
     }
     if (!p->code_bitmap &&
@@ -1103,6 +1793,7 @@ void tb_invalidate_phys_page_range(tb_page_addr_t start, tb_page_addr_t end,
         cpu_resume_from_signal(env, NULL);
     }
 #endif
+    tb_unlock();
 }
 
 /* len must be <= 8 and start must be a multiple of len */
@@ -1120,8 +1811,10 @@ void tb_invalidate_phys_page_fast(tb_page_addr_t start, int len)
                   (intptr_t)cpu_single_env->segs[R_CS].base);
     }
 #endif
+    tb_lock();
     p = page_find(start >> TARGET_PAGE_BITS);
     if (!p) {
+        tb_unlock();
         return;
     }
     if (p->code_bitmap) {
@@ -1134,6 +1827,7 @@ void tb_invalidate_phys_page_fast(tb_page_addr_t start, int len)
     do_invalidate:
         tb_invalidate_phys_page_range(start, start + len, 1);
     }
+    tb_unlock();
 }
 
 #if !defined(CONFIG_SOFTMMU)
@@ -1266,18 +1960,9 @@ static inline void tb_alloc_page(TranslationBlock *tb,
 static void tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc,
                          tb_page_addr_t phys_page2)
 {
-    unsigned int h;
-    TranslationBlock **ptb;
-
     /* Grab the mmap lock to stop another thread invalidating this TB
        before we are done.  */
     mmap_lock();
-    /* add in the physical hash table */
-    h = tb_phys_hash_func(phys_pc);
-    ptb = &tcg_ctx.tb_ctx.tb_phys_hash[h];
-    tb->phys_hash_next = *ptb;
-    *ptb = tb;
-
     /* add in the page list */
     tb_alloc_page(tb, 0, phys_pc & TARGET_PAGE_MASK);
     if (phys_page2 != -1) {
@@ -1298,6 +1983,11 @@ static void tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc,
         tb_reset_jump(tb, 1);
     }
 
+    /* add in the hash table last: lookups do not take tb_lock, so the TB
+       must be complete before it can be found */
+    qht_insert(&tcg_ctx.tb_ctx.htable, tb,
+               tb_hash_func(phys_pc, tb->pc, tb->flags));
+
 #ifdef DEBUG_TB_CHECK
     tb_page_check();
 #endif
@@ -1318,25 +2008,32 @@ bool is_tcg_gen_code(uintptr_t tc_ptr)
 
 /* find the TB 'tb' such that tb[0].tc_ptr <= tc_ptr <
    tb[1].tc_ptr. Return NULL if not found */
-static TranslationBlock *tb_find_pc(uintptr_t tc_ptr)
+static TranslationBlock *tb_find_pc_locked(uintptr_t tc_ptr)
 {
-    int m_min, m_max, m;
+    TBContext *s = &tcg_ctx.tb_ctx;
+    int m_min, m_max, m, i;
     uintptr_t v;
     TranslationBlock *tb;
+    TBRegion *r;
+    uint8_t *end;
 
-    if (tcg_ctx.tb_ctx.nb_tbs <= 0) {
+    if (tc_ptr < (uintptr_t)tcg_ctx.code_gen_buffer) {
         return NULL;
     }
-    if (tc_ptr < (uintptr_t)tcg_ctx.code_gen_buffer ||
-        tc_ptr >= (uintptr_t)tcg_ctx.code_gen_ptr) {
+    /* the TBs of a region are sorted by tc_ptr */
+    i = MIN((tc_ptr - (uintptr_t)tcg_ctx.code_gen_buffer) / s->region_size,
+            s->nb_regions - 1);
+    r = &s->regions[i];
+    end = i == s->cur_region ? tcg_ctx.code_gen_ptr : r->code_ptr;
+    if (r->nb_tbs <= 0 || tc_ptr >= (uintptr_t)end) {
         return NULL;
     }
     /* binary search (cf Knuth) */
-    m_min = 0;
-    m_max = tcg_ctx.tb_ctx.nb_tbs - 1;
+    m_min = r->first_tb;
+    m_max = r->first_tb + r->nb_tbs - 1;
     while (m_min <= m_max) {
         m = (m_min + m_max) >> 1;
-        tb = &tcg_ctx.tb_ctx.tbs[m];
+        tb = &s->tbs[m];
         v = (uintptr_t)tb->tc_ptr;
         if (v == tc_ptr) {
             return tb;
@@ -1349,6 +2046,16 @@ static TranslationBlock *tb_find_pc(uintptr_t tc_ptr)
     return &tcg_ctx.tb_ctx.tbs[m_max];
 }
 
+static TranslationBlock *tb_find_pc(uintptr_t tc_ptr)
+{
+    TranslationBlock *tb;
+
+    tb_lock();
+    tb = tb_find_pc_locked(tc_ptr);
+    tb_unlock();
+    return tb;
+}
+
 static void tb_reset_jump_recursive(TranslationBlock *tb);
 
 static inline void tb_reset_jump_recursive2(TranslationBlock *tb, int n)
@@ -1404,14 +2111,17 @@ void tb_invalidate_phys_addr(hwaddr addr)
     ram_addr_t ram_addr;
     MemoryRegionSection *section;
 
-    section = phys_page_find(address_space_memory.dispatch,
+    rcu_read_lock();
+    section = phys_page_find(atomic_rcu_read(&address_space_memory.dispatch),
                              addr >> TARGET_PAGE_BITS);
     if (!(memory_region_is_ram(section->mr)
           || (section->mr->rom_device && section->mr->readable))) {
+        rcu_read_unlock();
         return;
     }
     ram_addr = (memory_region_get_ram_addr(section->mr) & TARGET_PAGE_MASK)
         + memory_region_section_addr(section, addr);
+    rcu_read_unlock();
     tb_invalidate_phys_page_range(ram_addr, ram_addr + 1, 0);
 }
 #endif /* TARGET_HAS_ICE && !defined(CONFIG_USER_ONLY) */
@@ -1425,6 +2135,17 @@ void cpu_unlink_tb(CPUState *cpu)
     TranslationBlock *tb;
     static spinlock_t interrupt_lock = SPIN_LOCK_UNLOCKED;
 
+#if !defined(CONFIG_USER_ONLY)
+    if (mttcg_enabled) {
+        /* The TB chain may be executing or being patched on another
+           thread: do not unlink it, the cpu leaves at the next TB
+           entry instead.  */
+        smp_wmb();
+        ((CPUArchState *)cpu->env_ptr)->tcg_exit_req = 1;
+        return;
+    }
+#endif
+
     spin_lock(&interrupt_lock);
     tb = cpu->current_tb;
     /* if the cpu is currently executing code, we must unlink it and
@@ -1440,6 +2161,7 @@ void tb_check_watchpoint(CPUArchState *env)
 {
     TranslationBlock *tb;
 
+    tb_lock();
     tb = tb_find_pc(env->mem_io_pc);
     if (!tb) {
         cpu_abort(env, "check_watchpoint: could not find TB for pc=%p",
@@ -1447,6 +2169,7 @@ void tb_check_watchpoint(CPUArchState *env)
     }
     cpu_restore_state_from_tb(tb, env, env->mem_io_pc);
     tb_phys_invalidate(tb, -1);
+    tb_unlock();
 }
 
 #ifndef CONFIG_USER_ONLY
@@ -1558,49 +2281,55 @@ void tb_flush_jmp_cache(CPUArchState *env, target_ulong addr)
 
 void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
 {
-    int i, target_code_size, max_target_code_size;
+    TBContext *s = &tcg_ctx.tb_ctx;
+    int i, j, target_code_size, max_target_code_size;
     int direct_jmp_count, direct_jmp2_count, cross_page;
     TranslationBlock *tb;
+    QHTStats hst;
+    size_t code_size;
+    uint64_t tlb_fill_count, tlb_victim_hit_count, tlb_flush_entries;
+    uint64_t tlb_flush_avoided;
+    CPUArchState *env;
 
     target_code_size = 0;
     max_target_code_size = 0;
     cross_page = 0;
     direct_jmp_count = 0;
     direct_jmp2_count = 0;
-    for (i = 0; i < tcg_ctx.tb_ctx.nb_tbs; i++) {
-        tb = &tcg_ctx.tb_ctx.tbs[i];
-        target_code_size += tb->size;
-        if (tb->size > max_target_code_size) {
-            max_target_code_size = tb->size;
-        }
-        if (tb->page_addr[1] != -1) {
-            cross_page++;
-        }
-        if (tb->tb_next_offset[0] != 0xffff) {
-            direct_jmp_count++;
-            if (tb->tb_next_offset[1] != 0xffff) {
-                direct_jmp2_count++;
+    for (i = 0; i < s->nb_regions; i++) {
+        for (j = 0; j < s->regions[i].nb_tbs; j++) {
+            tb = &s->tbs[s->regions[i].first_tb + j];
+            target_code_size += tb->size;
+            if (tb->size > max_target_code_size) {
+                max_target_code_size = tb->size;
+            }
+            if (tb->page_addr[1] != -1) {
+                cross_page++;
+            }
+            if (tb->tb_next_offset[0] != 0xffff) {
+                direct_jmp_count++;
+                if (tb->tb_next_offset[1] != 0xffff) {
+                    direct_jmp2_count++;
+                }
             }
         }
     }
+    code_size = tb_code_size();
     /* XXX: avoid using doubles ? */
     cpu_fprintf(f, "Translation buffer state:\n");
-    cpu_fprintf(f, "gen code size       %td/%zd\n",
-                tcg_ctx.code_gen_ptr - tcg_ctx.code_gen_buffer,
-                tcg_ctx.code_gen_buffer_max_size);
+    cpu_fprintf(f, "gen code size       %zd/%zd\n",
+                code_size, tcg_ctx.code_gen_buffer_max_size);
+    cpu_fprintf(f, "code regions        %d x %zd bytes (current %d)\n",
+                s->nb_regions, s->region_size, s->cur_region);
     cpu_fprintf(f, "TB count            %d/%d\n",
             tcg_ctx.tb_ctx.nb_tbs, tcg_ctx.code_gen_max_blocks);
     cpu_fprintf(f, "TB avg target size  %d max=%d bytes\n",
             tcg_ctx.tb_ctx.nb_tbs ? target_code_size /
                     tcg_ctx.tb_ctx.nb_tbs : 0,
             max_target_code_size);
-    cpu_fprintf(f, "TB avg host size    %td bytes (expansion ratio: %0.1f)\n",
-            tcg_ctx.tb_ctx.nb_tbs ? (tcg_ctx.code_gen_ptr -
-                                     tcg_ctx.code_gen_buffer) /
-                                     tcg_ctx.tb_ctx.nb_tbs : 0,
-                target_code_size ? (double) (tcg_ctx.code_gen_ptr -
-                                             tcg_ctx.code_gen_buffer) /
-                                             target_code_size : 0);
+    cpu_fprintf(f, "TB avg host size    %zd bytes (expansion ratio: %0.1f)\n",
+            tcg_ctx.tb_ctx.nb_tbs ? code_size / tcg_ctx.tb_ctx.nb_tbs : 0,
+            target_code_size ? (double) code_size / target_code_size : 0);
     cpu_fprintf(f, "cross page TB count %d (%d%%)\n", cross_page,
             tcg_ctx.tb_ctx.nb_tbs ? (cross_page * 100) /
                                     tcg_ctx.tb_ctx.nb_tbs : 0);
@@ -1611,12 +2340,52 @@ void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
                 direct_jmp2_count,
                 tcg_ctx.tb_ctx.nb_tbs ? (direct_jmp2_count * 100) /
                         tcg_ctx.tb_ctx.nb_tbs : 0);
+
+    qht_statistics(&tcg_ctx.tb_ctx.htable, &hst);
+    cpu_fprintf(f, "TB hash buckets     %zu/%zu (%0.1f%% head buckets used)\n",
+                hst.used_head_buckets, hst.head_buckets,
+                hst.head_buckets ?
+                (double)hst.used_head_buckets / hst.head_buckets * 100 : 0);
+    cpu_fprintf(f, "TB hash occupancy   %0.1f%% of bucket entries\n",
+                hst.occupancy * 100);
+    cpu_fprintf(f, "TB hash avg chain   %0.3f buckets (max=%zu)\n",
+                hst.avg_chain, hst.max_chain);
+    cpu_fprintf(f, "TB lookup hit rate  %lu/%lu (%0.1f%%)\n",
+                tcg_ctx.tb_ctx.tb_lookup_hit_count,
+                tcg_ctx.tb_ctx.tb_lookup_count,
+                tcg_ctx.tb_ctx.tb_lookup_count ?
+                (double)tcg_ctx.tb_ctx.tb_lookup_hit_count /
+                tcg_ctx.tb_ctx.tb_lookup_count * 100 : 0);
     cpu_fprintf(f, "\nStatistics:\n");
-    cpu_fprintf(f, "TB flush count      %d\n", tcg_ctx.tb_ctx.tb_flush_count);
+    cpu_fprintf(f, "TB flush count      %d (stall avg=%" PRId64
+                " max=%" PRId64 " us)\n", s->tb_flush_count,
+                s->tb_flush_count ?
+                s->tb_flush_time / s->tb_flush_count / 1000 : 0,
+                s->tb_flush_time_max / 1000);
+    cpu_fprintf(f, "TB region evictions %d (%lu TBs, stall avg=%" PRId64
+                " max=%" PRId64 " us)\n", s->tb_evict_count,
+                s->tb_evicted_tbs, s->tb_evict_count ?
+                s->tb_evict_time / s->tb_evict_count / 1000 : 0,
+                s->tb_evict_time_max / 1000);
     cpu_fprintf(f, "TB invalidate count %d\n",
             tcg_ctx.tb_ctx.tb_phys_invalidate_count);
-    cpu_fprintf(f, "TLB flush count     %d\n", tlb_flush_count);
+    cpu_fprintf(f, "superblock count    %d (threshold %u)\n",
+                s->tb_superblock_count, tcg_superblock_threshold);
+    tlb_fill_count = tlb_victim_hit_count = tlb_flush_entries = 0;
+    tlb_flush_avoided = 0;
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        tlb_flush_avoided += env->tlb_flush_avoided;
+        tlb_fill_count += env->tlb_fill_count;
+        tlb_victim_hit_count += env->tlb_victim_hit_count;
+        tlb_flush_entries += env->tlb_flush_entries;
+    }
+    cpu_fprintf(f, "TLB flush count     %d (%" PRIu64 " entries cleared)\n",
+                tlb_flush_count, tlb_flush_entries);
+    cpu_fprintf(f, "TLB partial flushes %" PRIu64 "\n", tlb_flush_avoided);
+    cpu_fprintf(f, "TLB refills         %" PRIu64 " (victim TLB hits %" PRIu64
+                ")\n", tlb_fill_count, tlb_victim_hit_count);
     tcg_dump_info(f, cpu_fprintf);
+    dump_tb_stats(f, cpu_fprintf);
 }
 
 #else /* CONFIG_USER_ONLY */
@@ -1774,19 +2543,25 @@ void page_set_flags(target_ulong start, target_ulong end, int flags)
         flags |= PAGE_WRITE_ORG;
     }
 
-    for (addr = start, len = end - start;
-         len != 0;
-         len -= TARGET_PAGE_SIZE, addr += TARGET_PAGE_SIZE) {
-        PageDesc *p = page_find_alloc(addr >> TARGET_PAGE_BITS, 1);
-
-        /* If the write protection bit is set, then we invalidate
-           the code inside.  */
-        if (!(p->flags & PAGE_WRITE) &&
-            (flags & PAGE_WRITE) &&
-            p->first_tb) {
-            tb_invalidate_phys_page(addr, 0, NULL);
+    for (addr = start, len = end - start; len != 0; ) {
+        tb_page_addr_t index = addr >> TARGET_PAGE_BITS;
+        PageDesc *p = page_find_alloc(index, 1);
+        unsigned int n;
+
+        /* mappings are usually many pages long: set the descriptors of a
+           leaf of the page table in one go, see page_check_range() */
+        for (n = L2_SIZE - (index & (L2_SIZE - 1));
+             n != 0 && len != 0;
+             n--, p++, len -= TARGET_PAGE_SIZE, addr += TARGET_PAGE_SIZE) {
+            /* If the write protection bit is set, then we invalidate
+               the code inside.  */
+            if (!(p->flags & PAGE_WRITE) &&
+                (flags & PAGE_WRITE) &&
+                p->first_tb) {
+                tb_invalidate_phys_page(addr, 0, NULL);
+            }
+            p->flags = flags;
         }
-        p->flags = flags;
     }
 }
 
@@ -1815,32 +2590,40 @@ int page_check_range(target_ulong start, target_ulong len, int flags)
     end = TARGET_PAGE_ALIGN(start + len);
     start = start & TARGET_PAGE_MASK;
 
-    for (addr = start, len = end - start;
-         len != 0;
-         len -= TARGET_PAGE_SIZE, addr += TARGET_PAGE_SIZE) {
-        p = page_find(addr >> TARGET_PAGE_BITS);
+    for (addr = start, len = end - start; len != 0; ) {
+        tb_page_addr_t index = addr >> TARGET_PAGE_BITS;
+        unsigned int n;
+
+        p = page_find(index);
         if (!p) {
             return -1;
         }
-        if (!(p->flags & PAGE_VALID)) {
-            return -1;
-        }
+        /* This is called for every buffer passed to a syscall; walk the
+           descriptors of a leaf of the page table without going through
+           page_find() again for each page.  */
+        for (n = L2_SIZE - (index & (L2_SIZE - 1));
+             n != 0 && len != 0;
+             n--, p++, len -= TARGET_PAGE_SIZE, addr += TARGET_PAGE_SIZE) {
+            if (!(p->flags & PAGE_VALID)) {
+                return -1;
+            }
 
-        if ((flags & PAGE_READ) && !(p->flags & PAGE_READ)) {
-            return -1;
-        }
-        if (flags & PAGE_WRITE) {
-            if (!(p->flags & PAGE_WRITE_ORG)) {
+            if ((flags & PAGE_READ) && !(p->flags & PAGE_READ)) {
                 return -1;
             }
-            /* unprotect the page if it was put read-only because it
-               contains translated code */
-            if (!(p->flags & PAGE_WRITE)) {
-                if (!page_unprotect(addr, 0, NULL)) {
+            if (flags & PAGE_WRITE) {
+                if (!(p->flags & PAGE_WRITE_ORG)) {
                     return -1;
                 }
+                /* unprotect the page if it was put read-only because it
+                   contains translated code */
+                if (!(p->flags & PAGE_WRITE)) {
+                    if (!page_unprotect(addr, 0, NULL)) {
+                        return -1;
+                    }
+                }
+                return 0;
             }
-            return 0;
         }
     }
     return 0;
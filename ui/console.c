@@ -1385,6 +1385,8 @@ static void dumb_display_init(void)
         height = active_console->g_height;
     }
     ds->surface = qemu_create_displaysurface(ds, width, height);
+    ds->idle = true;
+    notifier_list_init(&ds->idle_notifiers);
     register_displaystate(ds);
 }
 
@@ -1401,6 +1403,46 @@ void register_displaystate(DisplayState *ds)
     *s = ds;
 }
 
+/*
+ * A display is idle when none of its listeners wants updates, e.g. a VNC
+ * server without clients.  Graphic devices can then stop tracking what
+ * the guest draws; when it stops being idle, the next update redraws
+ * everything.
+ */
+void dpy_update_idle(DisplayState *ds)
+{
+    DisplayChangeListener *dcl;
+    QemuConsole *s;
+    bool idle = true;
+
+    QLIST_FOREACH(dcl, &ds->listeners, next) {
+        if (!dcl->idle) {
+            idle = false;
+        }
+    }
+    if (idle == ds->idle) {
+        return;
+    }
+
+    ds->idle = idle;
+    notifier_list_notify(&ds->idle_notifiers, ds);
+    s = get_graphic_console(ds);
+    if (!idle && s && s->hw_invalidate) {
+        s->hw_invalidate(s->hw);
+    }
+}
+
+void dpy_set_idle(DisplayState *ds, DisplayChangeListener *dcl, bool idle)
+{
+    dcl->idle = idle;
+    dpy_update_idle(ds);
+}
+
+void dpy_add_idle_notifier(DisplayState *ds, Notifier *notifier)
+{
+    notifier_list_add(&ds->idle_notifiers, notifier);
+}
+
 DisplayState *get_displaystate(void)
 {
     if (!display_state) {
@@ -1420,6 +1462,8 @@ DisplayState *graphic_console_init(vga_hw_update_ptr update,
 
     ds = (DisplayState *) g_malloc0(sizeof(DisplayState));
     ds->surface = qemu_create_displaysurface(ds, 640, 480);
+    ds->idle = true;
+    notifier_list_init(&ds->idle_notifiers);
 
     s = new_console(ds, GRAPHIC_CONSOLE);
     if (s == NULL) {
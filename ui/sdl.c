@@ -744,11 +744,11 @@ static void handle_activation(DisplayState *ds, SDL_Event *ev)
         if (ev->active.gain) {
             /* Back to default interval */
             dcl->gui_timer_interval = 0;
-            dcl->idle = 0;
+            dpy_set_idle(ds, dcl, false);
         } else {
             /* Sleeping interval */
             dcl->gui_timer_interval = 500;
-            dcl->idle = 1;
+            dpy_set_idle(ds, dcl, true);
         }
     }
 }
@@ -21,6 +21,7 @@
 #include "qemu/queue.h"
 #include "monitor/monitor.h"
 #include "ui/console.h"
+#include "qemu/bitmap.h"
 #include "sysemu/sysemu.h"
 #include "trace.h"
 
@@ -28,6 +29,9 @@
 
 static int debug = 0;
 
+#define SPICE_REFRESH_INTERVAL_INC  50
+#define SPICE_REFRESH_INTERVAL_MAX  500
+
 static void GCC_FMT_ATTR(2, 3) dprint(int level, const char *fmt, ...)
 {
     va_list args;
@@ -237,14 +241,17 @@ static void qemu_spice_create_update(SimpleSpiceDisplay *ssd)
     guest = ds_get_data(ssd->ds);
     mirror = (void *)pixman_image_get_data(ssd->mirror);
     for (y = ssd->dirty.top; y < ssd->dirty.bottom; y++) {
+        /* scanlines that were not updated need not be compared */
+        bool row_dirty = !ssd->dirty_rows || test_bit(y, ssd->dirty_rows);
+
         yoff = y * ds_get_linesize(ssd->ds);
         for (x = ssd->dirty.left; x < ssd->dirty.right; x += blksize) {
             xoff = x * bpp;
             blk = x / blksize;
             bw = MIN(blksize, ssd->dirty.right - x);
-            if (memcmp(guest + yoff + xoff,
-                       mirror + yoff + xoff,
-                       bw * bpp) == 0) {
+            if (!row_dirty || memcmp(guest + yoff + xoff,
+                                     mirror + yoff + xoff,
+                                     bw * bpp) == 0) {
                 if (dirty_top[blk] != -1) {
                     QXLRect update = {
                         .top    = dirty_top[blk],
@@ -278,6 +285,9 @@ static void qemu_spice_create_update(SimpleSpiceDisplay *ssd)
         }
     }
 
+    if (ssd->dirty_rows) {
+        bitmap_zero(ssd->dirty_rows, ssd->dirty_rows_height);
+    }
     memset(&ssd->dirty, 0, sizeof(ssd->dirty));
 }
 
@@ -365,6 +375,19 @@ void qemu_spice_display_update(SimpleSpiceDisplay *ssd,
         ssd->notify++;
     }
     qemu_spice_rect_union(&ssd->dirty, &update_area);
+
+    if (ssd->dirty_rows_height != ds_get_height(ssd->ds)) {
+        g_free(ssd->dirty_rows);
+        ssd->dirty_rows_height = ds_get_height(ssd->ds);
+        ssd->dirty_rows = bitmap_new(ssd->dirty_rows_height);
+        /* rows updated before are unknown, compare all of them */
+        bitmap_set(ssd->dirty_rows, 0, ssd->dirty_rows_height);
+    }
+    y = MAX(y, 0);
+    h = MIN(y + h, ssd->dirty_rows_height) - y;
+    if (h > 0) {
+        bitmap_set(ssd->dirty_rows, y, h);
+    }
 }
 
 void qemu_spice_display_resize(SimpleSpiceDisplay *ssd)
@@ -374,6 +397,9 @@ void qemu_spice_display_resize(SimpleSpiceDisplay *ssd)
     dprint(1, "%s:\n", __FUNCTION__);
 
     memset(&ssd->dirty, 0, sizeof(ssd->dirty));
+    g_free(ssd->dirty_rows);
+    ssd->dirty_rows = NULL;
+    ssd->dirty_rows_height = 0;
     if (ssd->surface) {
         pixman_image_unref(ssd->surface);
         ssd->surface = NULL;
@@ -408,12 +434,40 @@ void qemu_spice_cursor_refresh_unlocked(SimpleSpiceDisplay *ssd)
     }
 }
 
+/*
+ * Like VNC, poll less often while the guest does not draw, and go back to
+ * the default interval as soon as it does.
+ */
+static void qemu_spice_display_adapt_refresh(SimpleSpiceDisplay *ssd,
+                                             bool active)
+{
+    DisplayChangeListener *dcl = ssd->dcl;
+
+    if (!dcl) {
+        return;
+    }
+    if (active) {
+        dcl->gui_timer_interval = 0;
+    } else if (dcl->gui_timer_interval == 0) {
+        dcl->gui_timer_interval = GUI_REFRESH_INTERVAL;
+    } else {
+        dcl->gui_timer_interval = MIN(dcl->gui_timer_interval +
+                                      SPICE_REFRESH_INTERVAL_INC,
+                                      SPICE_REFRESH_INTERVAL_MAX);
+    }
+}
+
 void qemu_spice_display_refresh(SimpleSpiceDisplay *ssd)
 {
+    bool active;
+
     dprint(3, "%s:\n", __func__);
     vga_hw_update();
 
+    active = !qemu_spice_rect_is_empty(&ssd->dirty);
+
     qemu_mutex_lock(&ssd->lock);
+    active |= ssd->cursor || ssd->mouse_x != -1;
     if (QTAILQ_EMPTY(&ssd->updates)) {
         qemu_spice_create_update(ssd);
         ssd->notify++;
@@ -426,6 +480,8 @@ void qemu_spice_display_refresh(SimpleSpiceDisplay *ssd)
         qemu_spice_wakeup(ssd);
         dprint(2, "%s: notify\n", __FUNCTION__);
     }
+
+    qemu_spice_display_adapt_refresh(ssd, active);
 }
 
 /* spice display interface callbacks */
@@ -615,5 +671,6 @@ void qemu_spice_display_init(DisplayState *ds)
 
     qemu_spice_create_host_memslot(&sdpy);
     qemu_spice_create_host_primary(&sdpy);
+    sdpy.dcl = &display_listener;
     register_displaychangelistener(ds, &display_listener);
 }
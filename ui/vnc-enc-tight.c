@@ -1419,6 +1419,12 @@ static int send_sub_rect_nojpeg(VncState *vs, int x, int y, int w, int h,
 }
 
 #ifdef CONFIG_VNC_JPEG
+/* The JPEG quality the client asked for, lowered while it lags behind */
+static int tight_jpeg_level(VncState *vs)
+{
+    return MIN(vs->tight.quality, vs->lossy_quality);
+}
+
 static int send_sub_rect_jpeg(VncState *vs, int x, int y, int w, int h,
                               int bg, int fg, int colors,
                               VncPalette *palette, bool force)
@@ -1428,7 +1434,7 @@ static int send_sub_rect_jpeg(VncState *vs, int x, int y, int w, int h,
     if (colors == 0) {
         if (force || (tight_jpeg_conf[vs->tight.quality].jpeg_full &&
                       tight_detect_smooth_image(vs, w, h))) {
-            int quality = tight_conf[vs->tight.quality].jpeg_quality;
+            int quality = tight_conf[tight_jpeg_level(vs)].jpeg_quality;
 
             ret = send_jpeg_rect(vs, x, y, w, h, quality);
         } else {
@@ -1442,7 +1448,7 @@ static int send_sub_rect_jpeg(VncState *vs, int x, int y, int w, int h,
         if (force || (colors > 96 &&
                       tight_jpeg_conf[vs->tight.quality].jpeg_idx &&
                       tight_detect_smooth_image(vs, w, h))) {
-            int quality = tight_conf[vs->tight.quality].jpeg_quality;
+            int quality = tight_conf[tight_jpeg_level(vs)].jpeg_quality;
 
             ret = send_jpeg_rect(vs, x, y, w, h, quality);
         } else {
@@ -29,6 +29,7 @@
 #include "vnc.h"
 #include "vnc-jobs.h"
 #include "qemu/sockets.h"
+#include "qemu/timer.h"
 
 /*
  * Locking:
@@ -37,32 +38,49 @@
  * - jobs queue lock: for each operation on the queue (push, pop, isEmpty?)
  * - VncDisplay global lock: mainly used for framebuffer updates to avoid
  *                      screen corruption if the framebuffer is updated
- *                      while the worker is doing something.
+ *                      while a worker is doing something.
  * - VncState::output lock: used to make sure the output buffer is not corrupted
  *                          if two threads try to write on it at the same time
  *
- * While the VNC worker thread is working, the VncDisplay global lock is held
- * to avoid screen corruption (this does not block vnc_refresh() because it
- * uses trylock()) but the output lock is not held because the thread works on
- * its own output buffer.
- * When the encoding job is done, the worker thread will hold the output lock
- * and copy its output buffer in vs->output.
+ * Several worker threads encode jobs at the same time.  While they are
+ * working, they are counted in VncDisplay::encoders instead of holding the
+ * VncDisplay lock, so that they can read the server surface together; the
+ * lock is only held to change the counter.  vnc_refresh() still uses
+ * trylock() and treats a nonzero count as a busy lock.  The workers do not
+ * hold the output lock because each of them works on its own output buffer.
+ * When an encoding job is done, the worker holds the output lock and copies
+ * its output buffer in vs->jobs_buffer.
+ *
+ * Jobs of one client are encoded in order, one at a time, because most
+ * encodings keep compression state across updates.  A job for a client that
+ * uses a stateless encoding (raw or hextile) is split into parts when other
+ * workers are idle; the parts are encoded in parallel and put back together
+ * in order by the worker that finishes last.
  */
 
+#define VNC_JOB_MIN_PART_RECTS  4
+
+typedef struct VncJobQueue VncJobQueue;
+
+typedef struct VncWorker {
+    VncJobQueue *queue;
+    QemuThread thread;
+    Buffer buffer;
+} VncWorker;
+
 struct VncJobQueue {
     QemuCond cond;
     QemuMutex mutex;
-    QemuThread thread;
-    Buffer buffer;
+    VncWorker workers[VNC_MAX_WORKERS];
+    int n_workers;
+    int running;                /* worker threads that have not exited */
+    int idle;                   /* workers waiting for a job */
     bool exit;
     QTAILQ_HEAD(, VncJob) jobs;
 };
 
-typedef struct VncJobQueue VncJobQueue;
-
 /*
- * We use a single global queue, but most of the functions are
- * already reentrant, so we can easily add more than one encoding thread
+ * We use a single global queue, serviced by a pool of worker threads
  */
 static VncJobQueue *queue;
 
@@ -102,11 +120,22 @@ int vnc_job_add_rect(VncJob *job, int x, int y, int w, int h)
     return 1;
 }
 
+static void vnc_job_free(VncJob *job)
+{
+    VncRectEntry *entry, *tmp;
+
+    QLIST_FOREACH_SAFE(entry, &job->rectangles, next, tmp) {
+        g_free(entry);
+    }
+    buffer_free(&job->output);
+    g_free(job);
+}
+
 void vnc_job_push(VncJob *job)
 {
     vnc_lock_queue(queue);
     if (queue->exit || QLIST_EMPTY(&job->rectangles)) {
-        g_free(job);
+        vnc_job_free(job);
     } else {
         QTAILQ_INSERT_TAIL(&queue->jobs, job, next);
         qemu_cond_broadcast(&queue->cond);
@@ -136,14 +165,16 @@ bool vnc_has_job(VncState *vs)
     return ret;
 }
 
+/* Jobs that a worker has started are left to finish */
 void vnc_jobs_clear(VncState *vs)
 {
     VncJob *job, *tmp;
 
     vnc_lock_queue(queue);
     QTAILQ_FOREACH_SAFE(job, &queue->jobs, next, tmp) {
-        if (job->vs == vs || !vs) {
+        if ((job->vs == vs || !vs) && !job->running && !job->parent) {
             QTAILQ_REMOVE(&queue->jobs, job, next);
+            vnc_job_free(job);
         }
     }
     vnc_unlock_queue(queue);
@@ -167,6 +198,9 @@ void vnc_jobs_consume_buffer(VncState *vs)
     if (vs->jobs_buffer.offset) {
         vnc_write(vs, vs->jobs_buffer.buffer, vs->jobs_buffer.offset);
         buffer_reset(&vs->jobs_buffer);
+        if (!vs->update_sent_ns) {
+            vs->update_sent_ns = get_clock();
+        }
     }
     flush = vs->csock != -1 && vs->abort != true;
     vnc_unlock_output(vs);
@@ -179,13 +213,15 @@ void vnc_jobs_consume_buffer(VncState *vs)
 /*
  * Copy data for local use
  */
-static void vnc_async_encoding_start(VncState *orig, VncState *local)
+static void vnc_async_encoding_start(VncState *orig, VncState *local,
+                                     Buffer *buffer)
 {
     local->vnc_encoding = orig->vnc_encoding;
     local->features = orig->features;
     local->ds = orig->ds;
     local->vd = orig->vd;
     local->lossy_rect = orig->lossy_rect;
+    local->lossy_quality = orig->lossy_quality;
     local->write_pixels = orig->write_pixels;
     local->client_pf = orig->client_pf;
     local->client_be = orig->client_be;
@@ -193,7 +229,7 @@ static void vnc_async_encoding_start(VncState *orig, VncState *local)
     local->zlib = orig->zlib;
     local->hextile = orig->hextile;
     local->zrle = orig->zrle;
-    local->output =  queue->buffer;
+    local->output = *buffer;
     local->csock = -1; /* Don't do any network work on this thread */
 
     buffer_reset(&local->output);
@@ -206,88 +242,242 @@ static void vnc_async_encoding_end(VncState *orig, VncState *local)
     orig->hextile = local->hextile;
     orig->zrle = local->zrle;
     orig->lossy_rect = local->lossy_rect;
+}
 
-    queue->buffer = local->output;
+static bool vnc_encoding_is_stateless(VncState *vs)
+{
+    return vs->vnc_encoding == VNC_ENCODING_RAW ||
+           vs->vnc_encoding == VNC_ENCODING_HEXTILE;
 }
 
-static int vnc_worker_thread_loop(VncJobQueue *queue)
+/*
+ * The first job of each client in the queue may be started if it is not
+ * running yet; the parts of a split job may always be started.
+ */
+static VncJob *vnc_queue_next_job_locked(VncJobQueue *queue)
 {
-    VncJob *job;
-    VncRectEntry *entry, *tmp;
-    VncState vs;
-    int n_rectangles;
-    int saved_offset;
+    VncJob *job, *prev;
 
-    vnc_lock_queue(queue);
-    while (QTAILQ_EMPTY(&queue->jobs) && !queue->exit) {
-        qemu_cond_wait(&queue->cond, &queue->mutex);
+    QTAILQ_FOREACH(job, &queue->jobs, next) {
+        if (job->running) {
+            continue;
+        }
+        if (job->parent) {
+            return job;
+        }
+        for (prev = QTAILQ_FIRST(&queue->jobs); prev != job;
+             prev = QTAILQ_NEXT(prev, next)) {
+            if (prev->vs == job->vs) {
+                break;
+            }
+        }
+        if (prev == job) {
+            return job;
+        }
     }
-    /* Here job can only be NULL if queue->exit is true */
-    job = QTAILQ_FIRST(&queue->jobs);
-    vnc_unlock_queue(queue);
+    return NULL;
+}
 
-    if (queue->exit) {
-        return -1;
-    }
+/* Hand out the rectangles of @job to as many parts as there are idle workers */
+static void vnc_job_split_locked(VncJobQueue *queue, VncJob *job)
+{
+    VncRectEntry *entry, *tmp;
+    int n_rects = 0, n_parts, per_part, i = 0;
 
-    vnc_lock_output(job->vs);
-    if (job->vs->csock == -1 || job->vs->abort == true) {
-        vnc_unlock_output(job->vs);
-        goto disconnected;
+    if (!vnc_encoding_is_stateless(job->vs) || !queue->idle) {
+        return;
+    }
+    QLIST_FOREACH(entry, &job->rectangles, next) {
+        n_rects++;
+    }
+    n_parts = MIN(MIN(queue->idle + 1, VNC_MAX_WORKERS),
+                  n_rects / VNC_JOB_MIN_PART_RECTS);
+    if (n_parts < 2) {
+        return;
     }
-    vnc_unlock_output(job->vs);
 
-    /* Make a local copy of vs and switch output buffers */
-    vnc_async_encoding_start(job->vs, &vs);
+    per_part = DIV_ROUND_UP(n_rects, n_parts);
+    job->parts[0] = job;
+    job->n_parts = 1;
+    QLIST_FOREACH_SAFE(entry, &job->rectangles, next, tmp) {
+        if (i++ < per_part) {
+            continue;
+        }
+        if ((i - 1) % per_part == 0) {
+            VncJob *part = g_malloc0(sizeof(VncJob));
+
+            part->vs = job->vs;
+            part->parent = job;
+            QLIST_INIT(&part->rectangles);
+            QTAILQ_INSERT_AFTER(&queue->jobs, job->parts[job->n_parts - 1],
+                                part, next);
+            job->parts[job->n_parts++] = part;
+        }
+        QLIST_REMOVE(entry, next);
+        QLIST_INSERT_HEAD(&job->parts[job->n_parts - 1]->rectangles, entry,
+                          next);
+    }
+    job->parts_pending = job->n_parts;
+    qemu_cond_broadcast(&queue->cond);
+}
 
-    /* Start sending rectangles */
-    n_rectangles = 0;
-    vnc_write_u8(&vs, VNC_MSG_SERVER_FRAMEBUFFER_UPDATE);
-    vnc_write_u8(&vs, 0);
-    saved_offset = vs.output.offset;
-    vnc_write_u16(&vs, 0);
+/* Encode the rectangles of @job into local->output; returns their number */
+static int vnc_job_encode(VncJob *job, VncState *local)
+{
+    VncRectEntry *entry, *tmp;
+    int n_rectangles = 0;
 
-    vnc_lock_display(job->vs->vd);
+    vnc_lock_display_shared(job->vs->vd);
     QLIST_FOREACH_SAFE(entry, &job->rectangles, next, tmp) {
         int n;
 
-        if (job->vs->csock == -1) {
-            vnc_unlock_display(job->vs->vd);
-            goto disconnected;
+        QLIST_REMOVE(entry, next);
+        if (job->vs->csock != -1) {
+            n = vnc_send_framebuffer_update(local, entry->rect.x,
+                                            entry->rect.y, entry->rect.w,
+                                            entry->rect.h);
+            if (n >= 0) {
+                n_rectangles += n;
+            }
         }
+        g_free(entry);
+    }
+    vnc_unlock_display_shared(job->vs->vd);
+    return n_rectangles;
+}
+
+/* Called with the output lock held */
+static void vnc_job_output(VncState *vs, int n_rectangles, Buffer **data,
+                           int n_data)
+{
+    uint8_t header[4] = {
+        VNC_MSG_SERVER_FRAMEBUFFER_UPDATE, 0,
+        (n_rectangles >> 8) & 0xFF, n_rectangles & 0xFF,
+    };
+    size_t len = sizeof(header);
+    int i;
+
+    for (i = 0; i < n_data; i++) {
+        len += data[i]->offset;
+    }
+    buffer_reserve(&vs->jobs_buffer, len);
+    buffer_append(&vs->jobs_buffer, header, sizeof(header));
+    for (i = 0; i < n_data; i++) {
+        buffer_append(&vs->jobs_buffer, data[i]->buffer, data[i]->offset);
+    }
+    qemu_bh_schedule(vs->bh);
+}
 
-        n = vnc_send_framebuffer_update(&vs, entry->rect.x, entry->rect.y,
-                                        entry->rect.w, entry->rect.h);
+static void vnc_job_done(VncJobQueue *queue, VncJob *job)
+{
+    vnc_lock_queue(queue);
+    QTAILQ_REMOVE(&queue->jobs, job, next);
+    vnc_unlock_queue(queue);
+    qemu_cond_broadcast(&queue->cond);
+    vnc_job_free(job);
+}
 
-        if (n >= 0) {
-            n_rectangles += n;
-        }
-        g_free(entry);
+/*
+ * A part of a split job is done.  The worker that completes the last part
+ * sends the parts in order and frees them.
+ */
+static void vnc_job_part_done(VncJobQueue *queue, VncJob *part)
+{
+    VncJob *job = part->parent ? part->parent : part;
+    VncState *vs = job->vs;
+    Buffer *data[VNC_MAX_WORKERS];
+    int i, n_rectangles = 0;
+    bool last;
+
+    vnc_lock_queue(queue);
+    last = --job->parts_pending == 0;
+    vnc_unlock_queue(queue);
+    if (!last) {
+        return;
     }
-    vnc_unlock_display(job->vs->vd);
 
-    /* Put n_rectangles at the beginning of the message */
-    vs.output.buffer[saved_offset] = (n_rectangles >> 8) & 0xFF;
-    vs.output.buffer[saved_offset + 1] = n_rectangles & 0xFF;
+    for (i = 0; i < job->n_parts; i++) {
+        n_rectangles += job->parts[i]->n_rectangles;
+        data[i] = &job->parts[i]->output;
+    }
 
-    vnc_lock_output(job->vs);
-    if (job->vs->csock != -1) {
-        buffer_reserve(&job->vs->jobs_buffer, vs.output.offset);
-        buffer_append(&job->vs->jobs_buffer, vs.output.buffer,
-                      vs.output.offset);
-        /* Copy persistent encoding data */
-        vnc_async_encoding_end(job->vs, &vs);
+    vnc_lock_output(vs);
+    if (vs->csock != -1 && vs->abort != true) {
+        vs->encode_time_ns += job->encode_time_ns;
+        vnc_job_output(vs, n_rectangles, data, job->n_parts);
+    }
+    vnc_unlock_output(vs);
 
-	qemu_bh_schedule(job->vs->bh);
+    for (i = job->n_parts - 1; i > 0; i--) {
+        vnc_job_done(queue, job->parts[i]);
+    }
+    vnc_job_done(queue, job);
+}
+
+static int vnc_worker_thread_loop(VncWorker *worker)
+{
+    VncJobQueue *queue = worker->queue;
+    VncJob *job, *parent;
+    VncState vs;
+    Buffer *data;
+    int64_t start;
+    bool disconnected;
+
+    vnc_lock_queue(queue);
+    queue->idle++;
+    /* Jobs left after vnc_jobs_clear() are already running, finish them */
+    while (!(job = vnc_queue_next_job_locked(queue)) && !queue->exit) {
+        qemu_cond_wait(&queue->cond, &queue->mutex);
+    }
+    queue->idle--;
+    if (!job) {
+        vnc_unlock_queue(queue);
+        return -1;
+    }
+    job->running = true;
+    if (!job->parent) {
+        vnc_job_split_locked(queue, job);
     }
+    parent = job->parent ? job->parent : job;
+    vnc_unlock_queue(queue);
+
+    vnc_lock_output(job->vs);
+    disconnected = job->vs->csock == -1 || job->vs->abort == true;
     vnc_unlock_output(job->vs);
 
-disconnected:
+    start = get_clock();
+    if (!disconnected) {
+        /* Make a local copy of vs and switch output buffers */
+        vnc_async_encoding_start(job->vs, &vs, &worker->buffer);
+        job->n_rectangles = vnc_job_encode(job, &vs);
+        worker->buffer = vs.output;
+    } else {
+        buffer_reset(&worker->buffer);
+    }
+
     vnc_lock_queue(queue);
-    QTAILQ_REMOVE(&queue->jobs, job, next);
+    parent->encode_time_ns += get_clock() - start;
     vnc_unlock_queue(queue);
-    qemu_cond_broadcast(&queue->cond);
-    g_free(job);
+
+    if (parent->n_parts) {
+        buffer_reserve(&job->output, worker->buffer.offset);
+        buffer_append(&job->output, worker->buffer.buffer,
+                      worker->buffer.offset);
+        vnc_job_part_done(queue, job);
+        return 0;
+    }
+
+    vnc_lock_output(job->vs);
+    if (job->vs->csock != -1 && !disconnected) {
+        data = &worker->buffer;
+        job->vs->encode_time_ns += job->encode_time_ns;
+        vnc_job_output(job->vs, job->n_rectangles, &data, 1);
+        /* Copy persistent encoding data */
+        vnc_async_encoding_end(job->vs, &vs);
+    }
+    vnc_unlock_output(job->vs);
+
+    vnc_job_done(queue, job);
     return 0;
 }
 
@@ -303,21 +493,34 @@ static VncJobQueue *vnc_queue_init(void)
 
 static void vnc_queue_clear(VncJobQueue *q)
 {
+    int i;
+
     qemu_cond_destroy(&queue->cond);
     qemu_mutex_destroy(&queue->mutex);
-    buffer_free(&queue->buffer);
+    for (i = 0; i < q->n_workers; i++) {
+        buffer_free(&q->workers[i].buffer);
+    }
     g_free(q);
     queue = NULL; /* Unset global queue */
 }
 
 static void *vnc_worker_thread(void *arg)
 {
-    VncJobQueue *queue = arg;
+    VncWorker *worker = arg;
+    VncJobQueue *queue = worker->queue;
+    bool last;
 
-    qemu_thread_get_self(&queue->thread);
+    qemu_thread_get_self(&worker->thread);
 
-    while (!vnc_worker_thread_loop(queue)) ;
-    vnc_queue_clear(queue);
+    while (!vnc_worker_thread_loop(worker)) ;
+
+    /* The last worker to exit frees the queue */
+    vnc_lock_queue(queue);
+    last = --queue->running == 0;
+    vnc_unlock_queue(queue);
+    if (last) {
+        vnc_queue_clear(queue);
+    }
     return NULL;
 }
 
@@ -326,16 +529,33 @@ static bool vnc_worker_thread_running(void)
     return queue; /* Check global queue */
 }
 
+static int vnc_worker_count(void)
+{
+    int n = 1;
+
+#ifdef _SC_NPROCESSORS_ONLN
+    n = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    return MAX(1, MIN(n, VNC_MAX_WORKERS));
+}
+
 void vnc_start_worker_thread(void)
 {
     VncJobQueue *q;
+    int i;
 
     if (vnc_worker_thread_running())
         return ;
 
     q = vnc_queue_init();
-    qemu_thread_create(&q->thread, vnc_worker_thread, q, QEMU_THREAD_DETACHED);
+    q->n_workers = vnc_worker_count();
+    q->running = q->n_workers;
     queue = q; /* Set global queue */
+    for (i = 0; i < q->n_workers; i++) {
+        q->workers[i].queue = q;
+        qemu_thread_create(&q->workers[i].thread, vnc_worker_thread,
+                           &q->workers[i], QEMU_THREAD_DETACHED);
+    }
 }
 
 void vnc_stop_worker_thread(void)
@@ -343,7 +563,7 @@ void vnc_stop_worker_thread(void)
     if (!vnc_worker_thread_running())
         return ;
 
-    /* Remove all jobs and wake up the thread */
+    /* Remove all jobs and wake up the threads */
     vnc_lock_queue(queue);
     queue->exit = true;
     vnc_unlock_queue(queue);
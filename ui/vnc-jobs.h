@@ -45,7 +45,14 @@ void vnc_stop_worker_thread(void);
 /* Locks */
 static inline int vnc_trylock_display(VncDisplay *vd)
 {
-    return qemu_mutex_trylock(&vd->mutex);
+    if (qemu_mutex_trylock(&vd->mutex)) {
+        return -EBUSY;
+    }
+    if (vd->encoders) {
+        qemu_mutex_unlock(&vd->mutex);
+        return -EBUSY;
+    }
+    return 0;
 }
 
 static inline void vnc_lock_display(VncDisplay *vd)
@@ -58,6 +65,21 @@ static inline void vnc_unlock_display(VncDisplay *vd)
     qemu_mutex_unlock(&vd->mutex);
 }
 
+/* Worker threads share the display while they encode */
+static inline void vnc_lock_display_shared(VncDisplay *vd)
+{
+    qemu_mutex_lock(&vd->mutex);
+    vd->encoders++;
+    qemu_mutex_unlock(&vd->mutex);
+}
+
+static inline void vnc_unlock_display_shared(VncDisplay *vd)
+{
+    qemu_mutex_lock(&vd->mutex);
+    vd->encoders--;
+    qemu_mutex_unlock(&vd->mutex);
+}
+
 static inline void vnc_lock_output(VncState *vs)
 {
     qemu_mutex_lock(&vs->output_mutex);
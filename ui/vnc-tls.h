@@ -33,6 +33,9 @@
 
 #include "qemu/acl.h"
 
+/* largest plaintext payload of a single TLS record */
+#define VNC_TLS_RECORD_SIZE 16384
+
 enum {
     VNC_WIREMODE_CLEAR,
     VNC_WIREMODE_TLS,
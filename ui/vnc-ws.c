@@ -80,19 +80,41 @@ long vnc_client_read_ws(VncState *vs)
 
 long vnc_client_write_ws(VncState *vs)
 {
+    struct iovec iov[2];
+    int iovcnt = 0;
+    size_t header_part;
     long ret;
+
     VNC_DEBUG("Write WS: Pending output %p size %zd offset %zd\n",
               vs->output.buffer, vs->output.capacity, vs->output.offset);
-    vncws_encode_frame(&vs->ws_output, vs->output.buffer, vs->output.offset);
-    buffer_reset(&vs->output);
-    ret = vnc_client_write_buf(vs, vs->ws_output.buffer, vs->ws_output.offset);
-    if (!ret) {
-        return 0;
+    if (!vs->ws_payload) {
+        /* frame everything that is pending; it is sent from output as is */
+        vs->ws_payload = vs->output.offset;
+        vs->ws_header_len = vncws_encode_header(vs->ws_header,
+                                                vs->ws_payload);
+        vs->ws_header_sent = 0;
+    }
+
+    if (vs->ws_header_sent < vs->ws_header_len) {
+        iov[iovcnt].iov_base = vs->ws_header + vs->ws_header_sent;
+        iov[iovcnt].iov_len = vs->ws_header_len - vs->ws_header_sent;
+        iovcnt++;
+    }
+    iov[iovcnt].iov_base = vs->output.buffer;
+    iov[iovcnt].iov_len = vs->ws_payload;
+    iovcnt++;
+
+    ret = vnc_client_write_iov(vs, iov, iovcnt);
+    if (ret <= 0) {
+        return ret;
     }
 
-    buffer_advance(&vs->ws_output, ret);
+    header_part = MIN(ret, vs->ws_header_len - vs->ws_header_sent);
+    vs->ws_header_sent += header_part;
+    buffer_advance(&vs->output, ret - header_part);
+    vs->ws_payload -= ret - header_part;
 
-    if (vs->ws_output.offset == 0) {
+    if (vs->output.offset == 0) {
         qemu_set_fd_handler2(vs->csock, NULL, vnc_client_read, NULL, vs);
     }
 
@@ -177,37 +199,24 @@ void vncws_process_handshake(VncState *vs, uint8_t *line, size_t size)
     g_free(key);
 }
 
-void vncws_encode_frame(Buffer *output, const void *payload,
-        const size_t payload_size)
+size_t vncws_encode_header(uint8_t *buf, size_t payload_size)
 {
-    size_t header_size = 0;
     unsigned char opcode = WS_OPCODE_BINARY_FRAME;
-    union {
-        char buf[WS_HEAD_MAX_LEN];
-        WsHeader ws;
-    } header;
-
-    if (!payload_size) {
-        return;
-    }
+    WsHeader *header = (WsHeader *)buf;
 
-    header.ws.b0 = 0x80 | (opcode & 0x0f);
+    header->b0 = 0x80 | (opcode & 0x0f);
     if (payload_size <= 125) {
-        header.ws.b1 = (uint8_t)payload_size;
-        header_size = 2;
+        header->b1 = (uint8_t)payload_size;
+        return 2;
     } else if (payload_size < 65536) {
-        header.ws.b1 = 0x7e;
-        header.ws.u.s16.l16 = cpu_to_be16((uint16_t)payload_size);
-        header_size = 4;
+        header->b1 = 0x7e;
+        header->u.s16.l16 = cpu_to_be16((uint16_t)payload_size);
+        return 4;
     } else {
-        header.ws.b1 = 0x7f;
-        header.ws.u.s64.l64 = cpu_to_be64(payload_size);
-        header_size = 10;
+        header->b1 = 0x7f;
+        header->u.s64.l64 = cpu_to_be64(payload_size);
+        return 10;
     }
-
-    buffer_reserve(output, header_size + payload_size);
-    buffer_append(output, header.buf, header_size);
-    buffer_append(output, payload, payload_size);
 }
 
 int vncws_decode_frame(Buffer *input, uint8_t **payload,
@@ -78,8 +78,7 @@ void vncws_handshake_read(void *opaque);
 long vnc_client_write_ws(VncState *vs);
 long vnc_client_read_ws(VncState *vs);
 void vncws_process_handshake(VncState *vs, uint8_t *line, size_t size);
-void vncws_encode_frame(Buffer *output, const void *payload,
-            const size_t payload_size);
+size_t vncws_encode_header(uint8_t *buf, size_t payload_size);
 int vncws_decode_frame(Buffer *input, uint8_t **payload,
                                size_t *payload_size, size_t *frame_size);
 
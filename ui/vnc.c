@@ -30,6 +30,7 @@
 #include "qemu/sockets.h"
 #include "qemu/timer.h"
 #include "qemu/acl.h"
+#include "qemu/iov.h"
 #include "qapi/qmp/types.h"
 #include "qmp-commands.h"
 #include "qemu/osdep.h"
@@ -37,9 +38,19 @@
 #define VNC_REFRESH_INTERVAL_BASE 30
 #define VNC_REFRESH_INTERVAL_INC  50
 #define VNC_REFRESH_INTERVAL_MAX  2000
+#define VNC_REFRESH_SLACK         10
 static const struct timeval VNC_REFRESH_STATS = { 0, 500000 };
 static const struct timeval VNC_REFRESH_LOSSY = { 2, 0 };
 
+/* Tiles updated at least this often (in Hz) are considered video */
+#define VNC_VIDEO_FREQ            10
+#define VNC_VIDEO_MIN_TILES       4
+
+/* Update round trip times the lossy quality is adapted to, in ms */
+#define VNC_RTT_SLOW_MS           150
+#define VNC_RTT_FAST_MS           50
+#define VNC_LOSSY_ADAPT_MS        1000
+
 #include "vnc_keysym.h"
 #include "d3des.h"
 
@@ -300,7 +311,7 @@ static void vnc_qmp_event(VncState *vs, MonitorEvent event)
     qobject_decref(data);
 }
 
-static VncClientInfo *qmp_query_vnc_client(const VncState *client)
+static VncClientInfo *qmp_query_vnc_client(VncState *client)
 {
     struct sockaddr_storage sa;
     socklen_t salen = sizeof(sa);
@@ -337,6 +348,11 @@ static VncClientInfo *qmp_query_vnc_client(const VncState *client)
     }
 #endif
 
+    info->has_encode_time = true;
+    vnc_lock_output(client);
+    info->encode_time = client->encode_time_ns / SCALE_MS;
+    vnc_unlock_output(client);
+
     return info;
 }
 
@@ -418,6 +434,43 @@ out_error:
 */
 
 static int vnc_update_client(VncState *vs, int has_dirty);
+/*
+ * Send the video region of the screen as a single rectangle if part of it
+ * is dirty, so that tight compresses it as one lossy image instead of many
+ * small rectangles that are too small for JPEG.
+ */
+static int vnc_update_video_region_client(VncState *vs, VncJob *job,
+                                          int width, int height)
+{
+    VncDisplay *vd = vs->vd;
+    int x = vd->guest.video.x, w = vd->guest.video.w;
+    int y = vd->guest.video.y, h = vd->guest.video.h;
+    int i;
+    bool dirty = false;
+
+    if (vd->non_adaptive || !w || vs->vnc_encoding != VNC_ENCODING_TIGHT ||
+        vs->tight.quality == (uint8_t)-1) {
+        return 0;
+    }
+
+    w = MIN(x + w, width / 16 * 16) - x;
+    h = MIN(y + h, height) - y;
+    if (w <= 0 || h <= 0) {
+        return 0;
+    }
+
+    for (i = y; i < y + h; i++) {
+        if (find_next_bit(vs->dirty[i], (x + w) / 16, x / 16) < (x + w) / 16) {
+            dirty = true;
+            bitmap_clear(vs->dirty[i], x / 16, w / 16);
+        }
+    }
+    if (!dirty) {
+        return 0;
+    }
+    return vnc_job_add_rect(job, x, y, w, h);
+}
+
 static int vnc_update_client_sync(VncState *vs, int has_dirty);
 static void vnc_disconnect_start(VncState *vs);
 static void vnc_init_timer(VncDisplay *vd);
@@ -432,7 +485,6 @@ static int vnc_refresh_server_surface(VncDisplay *vd);
 
 static void vnc_dpy_update(DisplayState *ds, int x, int y, int w, int h)
 {
-    int i;
     VncDisplay *vd = ds->opaque;
     struct VncSurface *s = &vd->guest;
     int width = ds_get_width(ds);
@@ -452,9 +504,14 @@ static void vnc_dpy_update(DisplayState *ds, int x, int y, int w, int h)
     w = MIN(x + w, width) - x;
     h = MIN(h, height);
 
-    for (; y < h; y++)
-        for (i = 0; i < w; i += 16)
-            set_bit((x + i) / 16, s->dirty[y]);
+    if (w <= 0 || y >= h) {
+        return;
+    }
+
+    bitmap_set(s->dirty_rows, y, h - y);
+    for (; y < h; y++) {
+        bitmap_set(s->dirty[y], x / 16, DIV_ROUND_UP(w, 16));
+    }
 }
 
 void vnc_framebuffer_update(VncState *vs, int x, int y, int w, int h,
@@ -596,6 +653,7 @@ static void vnc_dpy_resize(DisplayState *ds)
     vd->guest.fb = pixman_image_ref(ds->surface->image);
     vd->guest.format = ds->surface->format;
     memset(vd->guest.dirty, 0xFF, sizeof(vd->guest.dirty));
+    memset(vd->guest.dirty_rows, 0xFF, sizeof(vd->guest.dirty_rows));
 
     QTAILQ_FOREACH(vs, &vd->clients, next) {
         vnc_colordepth(vs);
@@ -857,13 +915,10 @@ static int find_and_clear_dirty_height(struct VncState *vs,
     int h;
 
     for (h = 1; h < (height - y); h++) {
-        int tmp_x;
         if (!test_bit(last_x, vs->dirty[y + h])) {
             break;
         }
-        for (tmp_x = last_x; tmp_x < x; tmp_x++) {
-            clear_bit(tmp_x, vs->dirty[y + h]);
-        }
+        bitmap_clear(vs->dirty[y + h], last_x, x - last_x);
     }
 
     return h;
@@ -904,27 +959,23 @@ static int vnc_update_client(VncState *vs, int has_dirty)
         width = MIN(pixman_image_get_width(vd->server), vs->client_width);
         height = MIN(pixman_image_get_height(vd->server), vs->client_height);
 
+        n += vnc_update_video_region_client(vs, job, width, height);
+
         for (y = 0; y < height; y++) {
-            int x;
-            int last_x = -1;
-            for (x = 0; x < width / 16; x++) {
-                if (test_and_clear_bit(x, vs->dirty[y])) {
-                    if (last_x == -1) {
-                        last_x = x;
-                    }
-                } else {
-                    if (last_x != -1) {
-                        int h = find_and_clear_dirty_height(vs, y, last_x, x,
-                                                            height);
+            int x = 0, last_x;
 
-                        n += vnc_job_add_rect(job, last_x * 16, y,
-                                              (x - last_x) * 16, h);
-                    }
-                    last_x = -1;
+            /* Look for runs of dirty cells a word at a time */
+            while (1) {
+                int h;
+
+                last_x = find_next_bit(vs->dirty[y], width / 16, x);
+                if (last_x >= width / 16) {
+                    break;
                 }
-            }
-            if (last_x != -1) {
-                int h = find_and_clear_dirty_height(vs, y, last_x, x, height);
+                x = find_next_zero_bit(vs->dirty[y], width / 16, last_x);
+                bitmap_clear(vs->dirty[y], last_x, x - last_x);
+
+                h = find_and_clear_dirty_height(vs, y, last_x, x, height);
                 n += vnc_job_add_rect(job, last_x * 16, y,
                                       (x - last_x) * 16, h);
             }
@@ -1035,7 +1086,6 @@ void vnc_disconnect_finish(VncState *vs)
     buffer_free(&vs->output);
 #ifdef CONFIG_VNC_WS
     buffer_free(&vs->ws_input);
-    buffer_free(&vs->ws_output);
 #endif /* CONFIG_VNC_WS */
 
     qobject_decref(vs->info);
@@ -1059,7 +1109,7 @@ void vnc_disconnect_finish(VncState *vs)
     }
 
     if (QTAILQ_EMPTY(&vs->vd->clients)) {
-        dcl->idle = 1;
+        dpy_set_idle(vs->ds, dcl, true);
     }
 
     vnc_remove_timer(vs->vd);
@@ -1148,6 +1198,42 @@ long vnc_client_write_buf(VncState *vs, const uint8_t *data, size_t datalen)
     return vnc_client_io_error(vs, ret, socket_error());
 }
 
+/*
+ * Like vnc_client_write_buf(), but gathers the data from @iovcnt
+ * buffers, so that callers which frame the output need not copy it
+ * behind their header first.  Plain sockets get a single sendmsg().
+ * TLS records cannot be gathered, so as much data as fits in one
+ * record is staged and handed to GNUTLS in a single write; passing
+ * the header on its own would cost a record per frame header.
+ *
+ * Returns the number of bytes written, counted across the buffers
+ * in order, or -1 on error, in which case the client is disconnected.
+ */
+long vnc_client_write_iov(VncState *vs, struct iovec *iov, int iovcnt)
+{
+    long ret;
+#ifdef CONFIG_VNC_TLS
+    if (vs->tls.session) {
+        uint8_t record[VNC_TLS_RECORD_SIZE];
+        size_t len = 0, n;
+        int i;
+
+        if (iovcnt == 1 || iov[0].iov_len >= sizeof(record)) {
+            return vnc_client_write_buf(vs, iov[0].iov_base, iov[0].iov_len);
+        }
+        for (i = 0; i < iovcnt && len < sizeof(record); i++) {
+            n = MIN(iov[i].iov_len, sizeof(record) - len);
+            memcpy(record + len, iov[i].iov_base, n);
+            len += n;
+        }
+        return vnc_client_write_buf(vs, record, len);
+    }
+#endif /* CONFIG_VNC_TLS */
+    ret = iov_send(vs->csock, iov, iovcnt, 0, iov_size(iov, iovcnt));
+    VNC_DEBUG("Wrote wire iov %d -> %ld\n", iovcnt, ret);
+    return vnc_client_io_error(vs, ret, socket_error());
+}
+
 
 /*
  * Called to write buffered data to the client socket, when not
@@ -1223,11 +1309,7 @@ void vnc_client_write(void *opaque)
     VncState *vs = opaque;
 
     vnc_lock_output(vs);
-    if (vs->output.offset
-#ifdef CONFIG_VNC_WS
-            || vs->ws_output.offset
-#endif
-            ) {
+    if (vs->output.offset) {
         vnc_client_write_locked(opaque);
     } else if (vs->csock != -1) {
         qemu_set_fd_handler2(vs->csock, NULL, vnc_client_read, NULL, vs);
@@ -1406,11 +1488,7 @@ void vnc_write_u8(VncState *vs, uint8_t value)
 void vnc_flush(VncState *vs)
 {
     vnc_lock_output(vs);
-    if (vs->csock != -1 && (vs->output.offset
-#ifdef CONFIG_VNC_WS
-                || vs->ws_output.offset
-#endif
-                )) {
+    if (vs->csock != -1 && vs->output.offset) {
         vnc_client_write_locked(vs);
     }
     vnc_unlock_output(vs);
@@ -1766,6 +1844,42 @@ static void ext_key_event(VncState *vs, int down,
         do_key_event(vs, down, keycode, sym);
 }
 
+/*
+ * Clients ask for the next incremental update once they have processed the
+ * previous one, so the time in between tells how fast the link and the
+ * client keep up.  The JPEG quality is lowered while they lag behind, and
+ * raised again up to what the client asked for when they catch up.
+ */
+static void vnc_update_answered(VncState *vs)
+{
+    int64_t now = get_clock();
+    int64_t rtt_ms;
+
+    if (!vs->update_sent_ns) {
+        return;
+    }
+    if (vs->update_rtt_ns) {
+        vs->update_rtt_ns = (vs->update_rtt_ns * 7 +
+                             (now - vs->update_sent_ns)) / 8;
+    } else {
+        vs->update_rtt_ns = now - vs->update_sent_ns;
+    }
+    vs->update_sent_ns = 0;
+
+    if (vs->vd->non_adaptive ||
+        now - vs->lossy_quality_ns < VNC_LOSSY_ADAPT_MS * SCALE_MS) {
+        return;
+    }
+    rtt_ms = vs->update_rtt_ns / SCALE_MS;
+    if (rtt_ms > VNC_RTT_SLOW_MS && vs->lossy_quality > 0) {
+        vs->lossy_quality--;
+        vs->lossy_quality_ns = now;
+    } else if (rtt_ms < VNC_RTT_FAST_MS && vs->lossy_quality < 9) {
+        vs->lossy_quality++;
+        vs->lossy_quality_ns = now;
+    }
+}
+
 static void framebuffer_update_request(VncState *vs, int incremental,
                                        int x_position, int y_position,
                                        int w, int h)
@@ -1779,6 +1893,9 @@ static void framebuffer_update_request(VncState *vs, int incremental,
         h = ds_get_height(vs->ds) - y_position;
 
     vs->need_update = 1;
+    if (incremental) {
+        vnc_update_answered(vs);
+    }
     if (!incremental) {
         vs->force_update = 1;
         for (i = 0; i < h; i++) {
@@ -2480,6 +2597,39 @@ static int vnc_refresh_lossy_rect(VncDisplay *vd, int x, int y)
     return has_dirty;
 }
 
+/*
+ * Find the area of the screen that plays video: the bounding box of the
+ * tiles updated at video frequency, if they cover at least half of it.
+ */
+static void vnc_update_video_region(VncDisplay *vd, int width, int height)
+{
+    int x, y, tiles = 0;
+    int x1 = width, y1 = height, x2 = 0, y2 = 0;
+
+    for (y = 0; y < height; y += VNC_STAT_RECT) {
+        for (x = 0; x < width; x += VNC_STAT_RECT) {
+            if (vnc_stat_rect(vd, x, y)->freq < VNC_VIDEO_FREQ) {
+                continue;
+            }
+            tiles++;
+            x1 = MIN(x1, x);
+            y1 = MIN(y1, y);
+            x2 = MAX(x2, x + VNC_STAT_RECT);
+            y2 = MAX(y2, y + VNC_STAT_RECT);
+        }
+    }
+
+    vd->guest.video.w = 0;
+    if (tiles < VNC_VIDEO_MIN_TILES ||
+        tiles * 2 * VNC_STAT_RECT * VNC_STAT_RECT < (x2 - x1) * (y2 - y1)) {
+        return;
+    }
+    vd->guest.video.x = x1;
+    vd->guest.video.y = y1;
+    vd->guest.video.w = MIN(x2, width / 16 * 16) - x1;
+    vd->guest.video.h = MIN(y2, height) - y1;
+}
+
 static int vnc_update_stats(VncDisplay *vd,  struct timeval * tv)
 {
     int width = pixman_image_get_width(vd->guest.fb);
@@ -2532,6 +2682,8 @@ static int vnc_update_stats(VncDisplay *vd,  struct timeval * tv)
             rect->freq = 1. / rect->freq;
         }
     }
+
+    vnc_update_video_region(vd, width, height);
     return has_dirty;
 }
 
@@ -2576,8 +2728,9 @@ static int vnc_refresh_server_surface(VncDisplay *vd)
     int width = pixman_image_get_width(vd->guest.fb);
     int height = pixman_image_get_height(vd->guest.fb);
     int y;
-    uint8_t *guest_row;
-    uint8_t *server_row;
+    uint8_t *guest_data;
+    uint8_t *server_data;
+    int guest_stride, server_stride;
     int cmp_bytes;
     VncState *vs;
     int has_dirty = 0;
@@ -2603,39 +2756,44 @@ static int vnc_refresh_server_surface(VncDisplay *vd)
         int width = pixman_image_get_width(vd->server);
         tmpbuf = qemu_pixman_linebuf_create(VNC_SERVER_FB_FORMAT, width);
     }
-    guest_row = (uint8_t *)pixman_image_get_data(vd->guest.fb);
-    server_row = (uint8_t *)pixman_image_get_data(vd->server);
-    for (y = 0; y < height; y++) {
-        if (!bitmap_empty(vd->guest.dirty[y], VNC_DIRTY_BITS)) {
-            int x;
-            uint8_t *guest_ptr;
-            uint8_t *server_ptr;
-
-            if (vd->guest.format != VNC_SERVER_FB_FORMAT) {
-                qemu_pixman_linebuf_fill(tmpbuf, vd->guest.fb, width, 0, y);
-                guest_ptr = (uint8_t *)pixman_image_get_data(tmpbuf);
-            } else {
-                guest_ptr = guest_row;
-            }
-            server_ptr = server_row;
+    guest_data = (uint8_t *)pixman_image_get_data(vd->guest.fb);
+    server_data = (uint8_t *)pixman_image_get_data(vd->server);
+    guest_stride = pixman_image_get_stride(vd->guest.fb);
+    server_stride = pixman_image_get_stride(vd->server);
 
-            for (x = 0; x + 15 < width;
-                    x += 16, guest_ptr += cmp_bytes, server_ptr += cmp_bytes) {
-                if (!test_and_clear_bit((x / 16), vd->guest.dirty[y]))
-                    continue;
-                if (memcmp(server_ptr, guest_ptr, cmp_bytes) == 0)
-                    continue;
-                memcpy(server_ptr, guest_ptr, cmp_bytes);
-                if (!vd->non_adaptive)
-                    vnc_rect_updated(vd, x, y, &tv);
-                QTAILQ_FOREACH(vs, &vd->clients, next) {
-                    set_bit((x / 16), vs->dirty[y]);
-                }
-                has_dirty++;
+    /* Rows that the guest did not touch are skipped without looking at them */
+    for (y = find_first_bit(vd->guest.dirty_rows, height); y < height;
+         y = find_next_bit(vd->guest.dirty_rows, height, y + 1)) {
+        int x;
+        uint8_t *guest_ptr;
+        uint8_t *server_ptr;
+
+        clear_bit(y, vd->guest.dirty_rows);
+
+        if (vd->guest.format != VNC_SERVER_FB_FORMAT) {
+            qemu_pixman_linebuf_fill(tmpbuf, vd->guest.fb, width, 0, y);
+            guest_ptr = (uint8_t *)pixman_image_get_data(tmpbuf);
+        } else {
+            guest_ptr = guest_data + y * guest_stride;
+        }
+        server_ptr = server_data + y * server_stride;
+
+        for (x = find_first_bit(vd->guest.dirty[y], width / 16);
+             x < width / 16;
+             x = find_next_bit(vd->guest.dirty[y], width / 16, x + 1)) {
+            clear_bit(x, vd->guest.dirty[y]);
+            if (!buffer_copy_if_changed(server_ptr + x * cmp_bytes,
+                                        guest_ptr + x * cmp_bytes,
+                                        cmp_bytes)) {
+                continue;
+            }
+            if (!vd->non_adaptive)
+                vnc_rect_updated(vd, x * 16, y, &tv);
+            QTAILQ_FOREACH(vs, &vd->clients, next) {
+                set_bit(x, vs->dirty[y]);
             }
+            has_dirty++;
         }
-        guest_row  += pixman_image_get_stride(vd->guest.fb);
-        server_row += pixman_image_get_stride(vd->server);
     }
     qemu_pixman_image_unref(tmpbuf);
     return has_dirty;
@@ -2686,6 +2844,8 @@ static void vnc_init_timer(VncDisplay *vd)
     vd->timer_interval = VNC_REFRESH_INTERVAL_BASE;
     if (vd->timer == NULL && !QTAILQ_EMPTY(&vd->clients)) {
         vd->timer = qemu_new_timer_ms(rt_clock, vnc_refresh, vd);
+        qemu_timer_set_name(vd->timer, "vnc-refresh");
+        qemu_timer_set_slack(vd->timer, VNC_REFRESH_SLACK);
         vnc_dpy_resize(vd->ds);
         vnc_refresh(vd);
     }
@@ -2723,9 +2883,10 @@ static void vnc_connect(VncDisplay *vd, int csock, int skipauth, bool websocket)
     for (i = 0; i < VNC_STAT_ROWS; ++i) {
         vs->lossy_rect[i] = g_malloc0(VNC_STAT_COLS * sizeof (uint8_t));
     }
+    vs->lossy_quality = 9;
 
     VNC_DEBUG("New client on socket %d\n", csock);
-    dcl->idle = 0;
+    dpy_set_idle(vd->ds, dcl, false);
     socket_set_nonblock(vs->csock);
 #ifdef CONFIG_VNC_WS
     if (websocket) {
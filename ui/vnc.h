@@ -119,7 +119,13 @@ struct VncSurface
 {
     struct timeval last_freq_check;
     DECLARE_BITMAP(dirty[VNC_MAX_HEIGHT], VNC_MAX_WIDTH / 16);
+    /* rows with at least one bit set in dirty[] */
+    DECLARE_BITMAP(dirty_rows, VNC_MAX_HEIGHT);
     VncRectStat stats[VNC_STAT_ROWS][VNC_STAT_COLS];
+    /* bounding box of the tiles that change like video, w == 0 if none */
+    struct {
+        int x, y, w, h;
+    } video;
     pixman_image_t *fb;
     pixman_format_code_t format;
 };
@@ -154,6 +160,7 @@ struct VncDisplay
     kbd_layout_t *kbd_layout;
     int lock_key_sync;
     QemuMutex mutex;
+    int encoders;               /* worker threads reading the surface */
 
     QEMUCursor *cursor;
     int cursor_msize;
@@ -235,12 +242,26 @@ struct VncRectEntry
     QLIST_ENTRY(VncRectEntry) next;
 };
 
+/* Maximum number of encoding threads, and of parts a job is split into */
+#define VNC_MAX_WORKERS 4
+
 struct VncJob
 {
     VncState *vs;
 
     QLIST_HEAD(, VncRectEntry) rectangles;
     QTAILQ_ENTRY(VncJob) next;
+
+    bool running;
+    int n_rectangles;
+    Buffer output;              /* encoded rectangles, if the job is split */
+    int64_t encode_time_ns;
+
+    /* A split job lists its parts, including itself as parts[0] */
+    VncJob *parent;
+    VncJob *parts[VNC_MAX_WORKERS];
+    int n_parts;
+    int parts_pending;
 };
 
 struct VncState
@@ -251,6 +272,12 @@ struct VncState
     DECLARE_BITMAP(dirty[VNC_MAX_HEIGHT], VNC_DIRTY_BITS);
     uint8_t **lossy_rect; /* Not an Array to avoid costly memcpy in
                            * vnc-jobs-async.c */
+    /* Highest JPEG quality level, lowered while the client is slow to
+     * ask for more updates */
+    uint8_t lossy_quality;
+    int64_t update_sent_ns;     /* last update not yet answered, or 0 */
+    int64_t update_rtt_ns;      /* smoothed update round trip time */
+    int64_t lossy_quality_ns;   /* last change of lossy_quality */
 
     VncDisplay *vd;
     int need_update;
@@ -288,7 +315,11 @@ struct VncState
     Buffer input;
 #ifdef CONFIG_VNC_WS
     Buffer ws_input;
-    Buffer ws_output;
+    /* frame being sent: its header, then ws_payload bytes of output */
+    uint8_t ws_header[WS_HEAD_MAX_LEN];
+    size_t ws_header_len;
+    size_t ws_header_sent;
+    size_t ws_payload;
 #endif
     /* current output mode information */
     VncWritePixels *write_pixels;
@@ -310,6 +341,7 @@ struct VncState
     QemuMutex output_mutex;
     QEMUBH *bh;
     Buffer jobs_buffer;
+    int64_t encode_time_ns;     /* protected by output_mutex */
 
     /* Encoding specific, if you add something here, don't forget to
      *  update vnc_async_encoding_start()
@@ -501,6 +533,7 @@ void vnc_client_write(void *opaque);
 
 long vnc_client_read_buf(VncState *vs, uint8_t *data, size_t datalen);
 long vnc_client_write_buf(VncState *vs, const uint8_t *data, size_t datalen);
+long vnc_client_write_iov(VncState *vs, struct iovec *iov, int iovcnt);
 
 /* Protocol I/O functions */
 void vnc_write(VncState *vs, const void *data, size_t len);
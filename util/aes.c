@@ -28,6 +28,7 @@
  * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 #include "qemu-common.h"
+#include "qemu/host-features.h"
 #include "block/aes.h"
 
 #ifndef NDEBUG
@@ -1262,6 +1263,139 @@ void AES_decrypt(const unsigned char *in, unsigned char *out,
 
 #endif /* AES_ASM */
 
+/*
+ * Hardware AES.  The round keys in AES_KEY are big-endian words, as the
+ * table-driven code wants them; the instructions take each round key as
+ * 16 bytes in memory order.  The decryption schedule built by
+ * AES_set_decrypt_key() is already in the "equivalent inverse cipher" form
+ * that AESDEC/AESD expect.  Only whole blocks are handled here.
+ */
+#if (defined(CONFIG_AVX2_OPT) && (defined(__i386__) || defined(__x86_64__))) \
+    || defined(__ARM_FEATURE_CRYPTO)
+static void aes_key_to_bytes(const AES_KEY *key, uint8_t *rk)
+{
+    int i;
+
+    for (i = 0; i < 4 * (key->rounds + 1); i++) {
+        stl_be_p(rk + 4 * i, key->rd_key[i]);
+    }
+}
+#endif
+
+#if defined(CONFIG_AVX2_OPT) && (defined(__i386__) || defined(__x86_64__))
+#include <wmmintrin.h>
+
+static void __attribute__((target("aes,sse2")))
+aes_cbc_encrypt_aesni(const unsigned char *in, unsigned char *out,
+                      unsigned long len, const AES_KEY *key,
+                      unsigned char *ivec, int enc)
+{
+    uint8_t rk[(AES_MAXNR + 1) * AES_BLOCK_SIZE];
+    __m128i k[AES_MAXNR + 1];
+    __m128i iv, b0, b1, b2, b3, c0, c1, c2, c3;
+    int nr = key->rounds, i;
+
+    aes_key_to_bytes(key, rk);
+    for (i = 0; i <= nr; i++) {
+        k[i] = _mm_loadu_si128((__m128i *)(rk + i * AES_BLOCK_SIZE));
+    }
+    iv = _mm_loadu_si128((__m128i *)ivec);
+
+    if (enc) {
+        /* each block depends on the previous ciphertext */
+        for (; len; len -= 16, in += 16, out += 16) {
+            b0 = _mm_xor_si128(_mm_loadu_si128((__m128i *)in), iv);
+            b0 = _mm_xor_si128(b0, k[0]);
+            for (i = 1; i < nr; i++) {
+                b0 = _mm_aesenc_si128(b0, k[i]);
+            }
+            iv = _mm_aesenclast_si128(b0, k[nr]);
+            _mm_storeu_si128((__m128i *)out, iv);
+        }
+    } else {
+        /* decryption is independent per block, keep four in flight */
+        for (; len >= 64; len -= 64, in += 64, out += 64) {
+            c0 = _mm_loadu_si128((__m128i *)in);
+            c1 = _mm_loadu_si128((__m128i *)(in + 16));
+            c2 = _mm_loadu_si128((__m128i *)(in + 32));
+            c3 = _mm_loadu_si128((__m128i *)(in + 48));
+            b0 = _mm_xor_si128(c0, k[0]);
+            b1 = _mm_xor_si128(c1, k[0]);
+            b2 = _mm_xor_si128(c2, k[0]);
+            b3 = _mm_xor_si128(c3, k[0]);
+            for (i = 1; i < nr; i++) {
+                b0 = _mm_aesdec_si128(b0, k[i]);
+                b1 = _mm_aesdec_si128(b1, k[i]);
+                b2 = _mm_aesdec_si128(b2, k[i]);
+                b3 = _mm_aesdec_si128(b3, k[i]);
+            }
+            b0 = _mm_aesdeclast_si128(b0, k[nr]);
+            b1 = _mm_aesdeclast_si128(b1, k[nr]);
+            b2 = _mm_aesdeclast_si128(b2, k[nr]);
+            b3 = _mm_aesdeclast_si128(b3, k[nr]);
+            _mm_storeu_si128((__m128i *)out, _mm_xor_si128(b0, iv));
+            _mm_storeu_si128((__m128i *)(out + 16), _mm_xor_si128(b1, c0));
+            _mm_storeu_si128((__m128i *)(out + 32), _mm_xor_si128(b2, c1));
+            _mm_storeu_si128((__m128i *)(out + 48), _mm_xor_si128(b3, c2));
+            iv = c3;
+        }
+        for (; len; len -= 16, in += 16, out += 16) {
+            c0 = _mm_loadu_si128((__m128i *)in);
+            b0 = _mm_xor_si128(c0, k[0]);
+            for (i = 1; i < nr; i++) {
+                b0 = _mm_aesdec_si128(b0, k[i]);
+            }
+            b0 = _mm_aesdeclast_si128(b0, k[nr]);
+            _mm_storeu_si128((__m128i *)out, _mm_xor_si128(b0, iv));
+            iv = c0;
+        }
+    }
+    _mm_storeu_si128((__m128i *)ivec, iv);
+}
+#endif
+
+#ifdef __ARM_FEATURE_CRYPTO
+#include <arm_neon.h>
+
+static void aes_cbc_encrypt_armv8(const unsigned char *in, unsigned char *out,
+                                  unsigned long len, const AES_KEY *key,
+                                  unsigned char *ivec, int enc)
+{
+    uint8_t rk[(AES_MAXNR + 1) * AES_BLOCK_SIZE];
+    uint8x16_t k[AES_MAXNR + 1];
+    uint8x16_t iv, b, c;
+    int nr = key->rounds, i;
+
+    aes_key_to_bytes(key, rk);
+    for (i = 0; i <= nr; i++) {
+        k[i] = vld1q_u8(rk + i * AES_BLOCK_SIZE);
+    }
+    iv = vld1q_u8(ivec);
+
+    /* AESE/AESD add the round key first, so the last one is a plain XOR */
+    for (; len; len -= 16, in += 16, out += 16) {
+        c = vld1q_u8(in);
+        if (enc) {
+            b = veorq_u8(c, iv);
+            for (i = 0; i < nr - 1; i++) {
+                b = vaesmcq_u8(vaeseq_u8(b, k[i]));
+            }
+            iv = veorq_u8(vaeseq_u8(b, k[nr - 1]), k[nr]);
+            vst1q_u8(out, iv);
+        } else {
+            b = c;
+            for (i = 0; i < nr - 1; i++) {
+                b = vaesimcq_u8(vaesdq_u8(b, k[i]));
+            }
+            b = veorq_u8(vaesdq_u8(b, k[nr - 1]), k[nr]);
+            vst1q_u8(out, veorq_u8(b, iv));
+            iv = c;
+        }
+    }
+    vst1q_u8(ivec, iv);
+}
+#endif
+
 void AES_cbc_encrypt(const unsigned char *in, unsigned char *out,
 		     const unsigned long length, const AES_KEY *key,
 		     unsigned char *ivec, const int enc)
@@ -1273,6 +1407,19 @@ void AES_cbc_encrypt(const unsigned char *in, unsigned char *out,
 
 	assert(in && out && key && ivec);
 
+	if (len % AES_BLOCK_SIZE == 0) {
+#if defined(CONFIG_AVX2_OPT) && (defined(__i386__) || defined(__x86_64__))
+		if (qemu_host_features & QEMU_HOST_FEATURE_AES) {
+			aes_cbc_encrypt_aesni(in, out, len, key, ivec, enc);
+			return;
+		}
+#endif
+#ifdef __ARM_FEATURE_CRYPTO
+		aes_cbc_encrypt_armv8(in, out, len, key, ivec, enc);
+		return;
+#endif
+	}
+
 	if (enc) {
 		while (len >= AES_BLOCK_SIZE) {
 			for(n=0; n < AES_BLOCK_SIZE; ++n)
@@ -40,11 +40,10 @@ int slow_bitmap_empty(const unsigned long *bitmap, int bits)
 {
     int k, lim = bits/BITS_PER_LONG;
 
-    for (k = 0; k < lim; ++k) {
-        if (bitmap[k]) {
-            return 0;
-        }
+    if (buffer_zero_run(bitmap, lim * sizeof(long)) != lim * sizeof(long)) {
+        return 0;
     }
+    k = lim;
     if (bits % BITS_PER_LONG) {
         if (bitmap[k] & BITMAP_LAST_WORD_MASK(bits)) {
             return 0;
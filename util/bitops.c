@@ -11,6 +11,7 @@
  * 2 of the License, or (at your option) any later version.
  */
 
+#include "qemu-common.h"
 #include "qemu/bitops.h"
 
 #define BITOP_WORD(nr)		((nr) / BITS_PER_LONG)
@@ -42,6 +43,16 @@ unsigned long find_next_bit(const unsigned long *addr, unsigned long size,
         size -= BITS_PER_LONG;
         result += BITS_PER_LONG;
     }
+    /* Sparse bitmaps have long runs of zero words; skip them in bulk */
+    if (size >= 8 * BITS_PER_LONG && !*p) {
+        unsigned long words = buffer_zero_run(p, BITOP_WORD(size) *
+                                              sizeof(unsigned long)) /
+                              sizeof(unsigned long);
+
+        p += words;
+        result += words * BITS_PER_LONG;
+        size -= words * BITS_PER_LONG;
+    }
     while (size & ~(BITS_PER_LONG-1)) {
         if ((tmp = *(p++))) {
             goto found_middle;
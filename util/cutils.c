@@ -27,6 +27,31 @@
 
 #include "qemu/sockets.h"
 #include "qemu/iov.h"
+#include "qemu/host-features.h"
+
+#ifdef __ALTIVEC__
+#include <altivec.h>
+#define VECTYPE        vector unsigned char
+#define SPLAT(p)       vec_splat(vec_ld(0, p), 0)
+#define ALL_EQ(v1, v2) vec_all_eq(v1, v2)
+/* altivec.h may redefine the bool macro as vector type.
+ * Reset it to POSIX semantics. */
+#undef bool
+#define bool _Bool
+#elif defined __SSE2__
+#include <emmintrin.h>
+#define VECTYPE        __m128i
+#define SPLAT(p)       _mm_set1_epi8(*(p))
+#define ALL_EQ(v1, v2) (_mm_movemask_epi8(_mm_cmpeq_epi8(v1, v2)) == 0xFFFF)
+#else
+#define VECTYPE        unsigned long
+#define SPLAT(p)       (*(p) * (~0UL / 255))
+#define ALL_EQ(v1, v2) ((v1) == (v2))
+#endif
+
+#ifdef CONFIG_AVX2_OPT
+#include <immintrin.h>
+#endif
 
 void strpadcpy(char *buf, int buf_size, const char *str, char pad)
 {
@@ -143,33 +168,174 @@ int qemu_fdatasync(int fd)
 }
 
 /*
- * Checks if a buffer is all zeroes
- *
- * Attention! The len must be a multiple of 4 * sizeof(long) due to
- * restriction of optimizations in this function.
+ * The zero scanners below look at 64 bytes at a time and return the offset of
+ * the first 64-byte block that contains a nonzero byte, or @len.  @len must
+ * be a multiple of 64.
  */
-bool buffer_is_zero(const void *buf, size_t len)
+#define BUFFER_ZERO_BLOCK 64
+
+static size_t buffer_zero_blocks_generic(const void *buf, size_t len)
 {
     /*
      * Use long as the biggest available internal data type that fits into the
      * CPU register and unroll the loop to smooth out the effect of memory
      * latency.
      */
+    const long *data = buf;
+    size_t i, j;
+
+    for (i = 0; i < len / sizeof(long);
+         i += BUFFER_ZERO_BLOCK / sizeof(long)) {
+        long acc = 0;
+
+        for (j = 0; j < BUFFER_ZERO_BLOCK / sizeof(long); j++) {
+            acc |= data[i + j];
+        }
+        if (acc) {
+            break;
+        }
+    }
+
+    return i * sizeof(long);
+}
 
+#if defined(__ARM_NEON__) || defined(__aarch64__)
+#include <arm_neon.h>
+
+static size_t buffer_zero_blocks_neon(const void *buf, size_t len)
+{
+    const uint8_t *p = buf;
     size_t i;
-    long d0, d1, d2, d3;
-    const long * const data = buf;
 
+    for (i = 0; i < len; i += BUFFER_ZERO_BLOCK) {
+        uint8x16_t acc = vorrq_u8(vorrq_u8(vld1q_u8(p + i),
+                                           vld1q_u8(p + i + 16)),
+                                  vorrq_u8(vld1q_u8(p + i + 32),
+                                           vld1q_u8(p + i + 48)));
+        uint64x2_t acc64 = vreinterpretq_u64_u8(acc);
+
+        if (vgetq_lane_u64(acc64, 0) | vgetq_lane_u64(acc64, 1)) {
+            break;
+        }
+    }
+
+    return i;
+}
+#endif
+
+#ifdef CONFIG_AVX2_OPT
+static size_t __attribute__((target("sse2")))
+buffer_zero_blocks_sse2(const void *buf, size_t len)
+{
+    const __m128i *p = buf;
+    __m128i zero = _mm_setzero_si128();
+    size_t i;
+
+    for (i = 0; i < len / sizeof(__m128i); i += 4) {
+        __m128i acc = _mm_or_si128(_mm_or_si128(_mm_loadu_si128(p + i),
+                                                _mm_loadu_si128(p + i + 1)),
+                                   _mm_or_si128(_mm_loadu_si128(p + i + 2),
+                                                _mm_loadu_si128(p + i + 3)));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, zero)) != 0xFFFF) {
+            break;
+        }
+    }
+
+    return i * sizeof(__m128i);
+}
+
+static size_t __attribute__((target("avx2")))
+buffer_zero_blocks_avx2(const void *buf, size_t len)
+{
+    const __m256i *p = buf;
+    size_t i;
+
+    for (i = 0; i < len / sizeof(__m256i); i += 2) {
+        __m256i acc = _mm256_or_si256(_mm256_loadu_si256(p + i),
+                                      _mm256_loadu_si256(p + i + 1));
+        if (!_mm256_testz_si256(acc, acc)) {
+            break;
+        }
+    }
+
+    return i * sizeof(__m256i);
+}
+#endif
+
+static size_t buffer_zero_blocks(const void *buf, size_t len)
+{
+#ifdef CONFIG_AVX2_OPT
+    if (qemu_host_features & QEMU_HOST_FEATURE_AVX2) {
+        return buffer_zero_blocks_avx2(buf, len);
+    }
+    if (qemu_host_features & QEMU_HOST_FEATURE_SSE2) {
+        return buffer_zero_blocks_sse2(buf, len);
+    }
+#endif
+#if defined(__ARM_NEON__) || defined(__aarch64__)
+    return buffer_zero_blocks_neon(buf, len);
+#else
+    return buffer_zero_blocks_generic(buf, len);
+#endif
+}
+
+/*
+ * Returns the number of zero bytes at the start of a buffer, i.e. the offset
+ * of its first nonzero byte, or @len if it is all zeroes
+ */
+size_t buffer_zero_run(const void *buf, size_t len)
+{
+    const uint8_t *p = buf;
+    size_t n;
+
+    n = buffer_zero_blocks(buf, len & ~(size_t)(BUFFER_ZERO_BLOCK - 1));
+    while (n < len && !p[n]) {
+        n++;
+    }
+    return n;
+}
+
+/*
+ * Checks if a buffer is all zeroes
+ *
+ * Attention! The len must be a multiple of 4 * sizeof(long) due to
+ * restriction of optimizations in this function.
+ */
+bool buffer_is_zero(const void *buf, size_t len)
+{
     assert(len % (4 * sizeof(long)) == 0);
-    len /= sizeof(long);
 
-    for (i = 0; i < len; i += 4) {
-        d0 = data[i + 0];
-        d1 = data[i + 1];
-        d2 = data[i + 2];
-        d3 = data[i + 3];
+    return buffer_zero_run(buf, len) == len;
+}
+
+static bool buffer_is_dup_vec(const void *buf, size_t len)
+{
+    VECTYPE *p = (VECTYPE *)buf;
+    VECTYPE val = SPLAT((uint8_t *)buf);
+    size_t i;
+
+    for (i = 0; i < len / sizeof(VECTYPE); i++) {
+        if (!ALL_EQ(val, p[i])) {
+            return false;
+        }
+    }
+
+    return true;
+}
 
-        if (d0 || d1 || d2 || d3) {
+#ifdef CONFIG_AVX2_OPT
+static bool __attribute__((target("sse2")))
+buffer_is_dup_sse2(const void *buf, size_t len)
+{
+    const __m128i *p = buf;
+    __m128i val = _mm_set1_epi8(*(const uint8_t *)buf);
+    size_t i;
+
+    for (i = 0; i < len / sizeof(__m128i); i += 2) {
+        __m128i eq = _mm_and_si128(_mm_cmpeq_epi8(_mm_loadu_si128(p + i), val),
+                                   _mm_cmpeq_epi8(_mm_loadu_si128(p + i + 1),
+                                                  val));
+        if (_mm_movemask_epi8(eq) != 0xFFFF) {
             return false;
         }
     }
@@ -177,6 +343,123 @@ bool buffer_is_zero(const void *buf, size_t len)
     return true;
 }
 
+static bool __attribute__((target("avx2")))
+buffer_is_dup_avx2(const void *buf, size_t len)
+{
+    const __m256i *p = buf;
+    __m256i val = _mm256_set1_epi8(*(const uint8_t *)buf);
+    size_t i;
+
+    for (i = 0; i < len / sizeof(__m256i); i++) {
+        __m256i eq = _mm256_cmpeq_epi8(_mm256_loadu_si256(p + i), val);
+        if (_mm256_movemask_epi8(eq) != -1) {
+            return false;
+        }
+    }
+
+    return true;
+}
+#endif
+
+/*
+ * Checks if every byte of a buffer is equal to the first one
+ *
+ * Attention! The len must be a multiple of 32 due to restriction of
+ * optimizations in this function.
+ */
+bool buffer_is_dup(const void *buf, size_t len)
+{
+    assert(len % 32 == 0);
+
+#ifdef CONFIG_AVX2_OPT
+    if (qemu_host_features & QEMU_HOST_FEATURE_AVX2) {
+        return buffer_is_dup_avx2(buf, len);
+    }
+    if (qemu_host_features & QEMU_HOST_FEATURE_SSE2) {
+        return buffer_is_dup_sse2(buf, len);
+    }
+#endif
+    return buffer_is_dup_vec(buf, len);
+}
+
+static bool buffer_copy_if_changed_generic(void *dst, const void *src,
+                                           size_t len)
+{
+    if (memcmp(dst, src, len) == 0) {
+        return false;
+    }
+    memcpy(dst, src, len);
+    return true;
+}
+
+#ifdef CONFIG_AVX2_OPT
+static bool __attribute__((target("sse2")))
+buffer_copy_if_changed_sse2(void *dst, const void *src, size_t len)
+{
+    __m128i *d = dst;
+    const __m128i *s = src;
+    bool changed = false;
+    size_t i;
+
+    for (i = 0; i < len / sizeof(__m128i); i += 2) {
+        __m128i s0 = _mm_loadu_si128(s + i);
+        __m128i s1 = _mm_loadu_si128(s + i + 1);
+        __m128i eq = _mm_and_si128(_mm_cmpeq_epi8(s0, _mm_loadu_si128(d + i)),
+                                   _mm_cmpeq_epi8(s1,
+                                                  _mm_loadu_si128(d + i + 1)));
+        if (_mm_movemask_epi8(eq) != 0xFFFF) {
+            _mm_storeu_si128(d + i, s0);
+            _mm_storeu_si128(d + i + 1, s1);
+            changed = true;
+        }
+    }
+
+    return changed;
+}
+
+static bool __attribute__((target("avx2")))
+buffer_copy_if_changed_avx2(void *dst, const void *src, size_t len)
+{
+    __m256i *d = dst;
+    const __m256i *s = src;
+    bool changed = false;
+    size_t i;
+
+    for (i = 0; i < len / sizeof(__m256i); i++) {
+        __m256i s0 = _mm256_loadu_si256(s + i);
+        __m256i eq = _mm256_cmpeq_epi8(s0, _mm256_loadu_si256(d + i));
+        if (_mm256_movemask_epi8(eq) != -1) {
+            _mm256_storeu_si256(d + i, s0);
+            changed = true;
+        }
+    }
+
+    return changed;
+}
+#endif
+
+/*
+ * Copies a buffer over another one unless they already hold the same data.
+ * Returns true if the buffers were different.
+ *
+ * Attention! The len must be a multiple of 32 due to restriction of
+ * optimizations in this function.
+ */
+bool buffer_copy_if_changed(void *dst, const void *src, size_t len)
+{
+    assert(len % 32 == 0);
+
+#ifdef CONFIG_AVX2_OPT
+    if (qemu_host_features & QEMU_HOST_FEATURE_AVX2) {
+        return buffer_copy_if_changed_avx2(dst, src, len);
+    }
+    if (qemu_host_features & QEMU_HOST_FEATURE_SSE2) {
+        return buffer_copy_if_changed_sse2(dst, src, len);
+    }
+#endif
+    return buffer_copy_if_changed_generic(dst, src, len);
+}
+
 #ifndef _WIN32
 /* Sets a specific flag */
 int fcntl_setfl(int fd, int flag)
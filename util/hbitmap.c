@@ -15,6 +15,8 @@
 #include "qemu/osdep.h"
 #include "qemu/hbitmap.h"
 #include "qemu/host-utils.h"
+#include "qemu/atomic.h"
+#include "qemu/bswap.h"
 #include "trace.h"
 
 /* HBitmaps provides an array of bits.  The bits are stored as usual in an
@@ -52,9 +54,20 @@
  * extremely sparse, this is also O(m + m/W + m/W^2 + ...), so the amortized
  * cost of advancing from one bit to the next is usually constant (worst case
  * O(logB n) as in the non-amortized complexity).
+ *
+ * Words are updated with atomic operations, so that threads working on
+ * disjoint ranges can set and reset bits at the same time even though the
+ * words of the upper levels (and the words at the edges of each range) are
+ * shared.  A word that becomes zero is checked again after its bit has been
+ * cleared in the upper level, because another thread may have set one of its
+ * bits in the meanwhile.  Iterators tolerate upper levels that are briefly out
+ * of date, and skip subtrees that turned out to be empty.
  */
 
 struct HBitmap {
+    /* Size of the bitmap, as requested in hbitmap_alloc.  */
+    uint64_t orig_size;
+
     /* Number of total bits in the bottom level.  */
     uint64_t size;
 
@@ -90,6 +103,9 @@ struct HBitmap {
      * bitmap will still allocate HBITMAP_LEVELS arrays.
      */
     unsigned long *levels[HBITMAP_LEVELS];
+
+    /* Number of words in each level.  */
+    size_t sizes[HBITMAP_LEVELS];
 };
 
 static inline int popcountl(unsigned long l)
@@ -97,6 +113,23 @@ static inline int popcountl(unsigned long l)
     return BITS_PER_LONG == 32 ? ctpop32(l) : ctpop64(l);
 }
 
+/* Drop the bits of the last-level word at pos that lie past the end of
+ * the iteration.
+ */
+static inline unsigned long hbitmap_iter_trim(const HBitmapIter *hbi,
+                                              size_t pos, unsigned long cur)
+{
+    uint64_t start = (uint64_t)pos << BITS_PER_LEVEL;
+
+    if (start >= hbi->end) {
+        return 0;
+    }
+    if (hbi->end - start < BITS_PER_LONG) {
+        cur &= (1UL << (hbi->end - start)) - 1;
+    }
+    return cur;
+}
+
 /* Advance hbi to the next nonzero word and return it.  hbi->pos
  * is updated.  Returns zero if we reach the end of the bitmap.
  */
@@ -107,6 +140,7 @@ unsigned long hbitmap_iter_skip_words(HBitmapIter *hbi)
     unsigned i = HBITMAP_LEVELS - 1;
 
     unsigned long cur;
+retry:
     do {
         cur = hbi->cur[--i];
         pos >>= BITS_PER_LEVEL;
@@ -130,14 +164,21 @@ unsigned long hbitmap_iter_skip_words(HBitmapIter *hbi)
         pos = (pos << BITS_PER_LEVEL) + ctzl(cur);
         hbi->cur[i] = cur & (cur - 1);
 
-        /* Set up next level for iteration.  */
-        cur = hb->levels[i + 1][pos];
+        /* Set up next level for iteration.  The word can be zero if
+         * another thread reset its bits after we read this level; go
+         * back up and look for the next subtree.
+         */
+        cur = atomic_read(&hb->levels[i + 1][pos]);
+        if (cur == 0) {
+            i++;
+            goto retry;
+        }
     }
 
     hbi->pos = pos;
+    cur = hbitmap_iter_trim(hbi, pos, cur);
     trace_hbitmap_iter_skip_words(hbi->hb, hbi, pos, cur);
 
-    assert(cur);
     return cur;
 }
 
@@ -151,6 +192,7 @@ void hbitmap_iter_init(HBitmapIter *hbi, const HBitmap *hb, uint64_t first)
     assert(pos < hb->size);
     hbi->pos = pos >> BITS_PER_LEVEL;
     hbi->granularity = hb->granularity;
+    hbi->end = hb->size;
 
     for (i = HBITMAP_LEVELS; i-- > 0; ) {
         bit = pos & (BITS_PER_LONG - 1);
@@ -168,6 +210,18 @@ void hbitmap_iter_init(HBitmapIter *hbi, const HBitmap *hb, uint64_t first)
     }
 }
 
+void hbitmap_iter_init_range(HBitmapIter *hbi, const HBitmap *hb,
+                             uint64_t first, uint64_t count)
+{
+    uint64_t end = first + count;
+
+    hbitmap_iter_init(hbi, hb, first);
+    end = (end + (1ULL << hb->granularity) - 1) >> hb->granularity;
+    hbi->end = MIN(end, hb->size);
+    hbi->cur[HBITMAP_LEVELS - 1] =
+        hbitmap_iter_trim(hbi, hbi->pos, hbi->cur[HBITMAP_LEVELS - 1]);
+}
+
 bool hbitmap_empty(const HBitmap *hb)
 {
     return hb->count == 0;
@@ -226,8 +280,7 @@ static inline bool hb_set_elem(unsigned long *elem, uint64_t start, uint64_t las
 
     mask = 2UL << (last & (BITS_PER_LONG - 1));
     mask -= 1UL << (start & (BITS_PER_LONG - 1));
-    changed = (*elem == 0);
-    *elem |= mask;
+    changed = (atomic_fetch_or(elem, mask) == 0);
     return changed;
 }
 
@@ -275,7 +328,7 @@ void hbitmap_set(HBitmap *hb, uint64_t start, uint64_t count)
     last >>= hb->granularity;
     count = last - start + 1;
 
-    hb->count += count - hb_count_between(hb, start, last);
+    atomic_fetch_add(&hb->count, count - hb_count_between(hb, start, last));
     hb_set_between(hb, HBITMAP_LEVELS - 1, start, last);
 }
 
@@ -284,17 +337,15 @@ void hbitmap_set(HBitmap *hb, uint64_t start, uint64_t count)
  */
 static inline bool hb_reset_elem(unsigned long *elem, uint64_t start, uint64_t last)
 {
-    unsigned long mask;
-    bool blanked;
+    unsigned long mask, old;
 
     assert((last >> BITS_PER_LEVEL) == (start >> BITS_PER_LEVEL));
     assert(start <= last);
 
     mask = 2UL << (last & (BITS_PER_LONG - 1));
     mask -= 1UL << (start & (BITS_PER_LONG - 1));
-    blanked = *elem != 0 && ((*elem & ~mask) == 0);
-    *elem &= ~mask;
-    return blanked;
+    old = atomic_fetch_and(elem, ~mask);
+    return old != 0 && ((old & ~mask) == 0);
 }
 
 /* The recursive workhorse (the depth is limited to HBITMAP_LEVELS)... */
@@ -302,6 +353,7 @@ static void hb_reset_between(HBitmap *hb, int level, uint64_t start, uint64_t la
 {
     size_t pos = start >> BITS_PER_LEVEL;
     size_t lastpos = last >> BITS_PER_LEVEL;
+    size_t firstword = pos, lastword = lastpos;
     bool changed = false;
     size_t i;
 
@@ -340,6 +392,18 @@ static void hb_reset_between(HBitmap *hb, int level, uint64_t start, uint64_t la
 
     if (level > 0 && changed) {
         hb_reset_between(hb, level - 1, pos, lastpos);
+
+        /* The words at the edges may be shared with a range that another
+         * thread is setting; if they were filled again while we cleared
+         * their bits in the upper level, set those bits back.
+         */
+        if (pos == firstword && atomic_read(&hb->levels[level][firstword])) {
+            hb_set_between(hb, level - 1, firstword, firstword);
+        }
+        if (lastpos == lastword && lastword != firstword &&
+            atomic_read(&hb->levels[level][lastword])) {
+            hb_set_between(hb, level - 1, lastword, lastword);
+        }
     }
 }
 
@@ -354,7 +418,7 @@ void hbitmap_reset(HBitmap *hb, uint64_t start, uint64_t count)
     start >>= hb->granularity;
     last >>= hb->granularity;
 
-    hb->count -= hb_count_between(hb, start, last);
+    atomic_fetch_sub(&hb->count, hb_count_between(hb, start, last));
     hb_reset_between(hb, HBITMAP_LEVELS - 1, start, last);
 }
 
@@ -367,6 +431,159 @@ bool hbitmap_get(const HBitmap *hb, uint64_t item)
     return (hb->levels[HBITMAP_LEVELS - 1][pos >> BITS_PER_LEVEL] & bit) != 0;
 }
 
+bool hbitmap_merge(HBitmap *a, const HBitmap *b)
+{
+    uint64_t group, run_start, run_end, count;
+    HBitmapIter hbi;
+    int64_t item;
+    unsigned i;
+    size_t j;
+
+    if (a->orig_size != b->orig_size) {
+        return false;
+    }
+    if (hbitmap_empty(b)) {
+        return true;
+    }
+
+    if (a->granularity == b->granularity) {
+        /* Same layout: OR each level, the sentinel included.  */
+        for (i = 0; i < HBITMAP_LEVELS; i++) {
+            for (j = 0; j < a->sizes[i]; j++) {
+                a->levels[i][j] |= b->levels[i][j];
+            }
+        }
+        count = 0;
+        for (j = 0; j < a->sizes[HBITMAP_LEVELS - 1]; j++) {
+            count += popcountl(a->levels[HBITMAP_LEVELS - 1][j]);
+        }
+        a->count = count;
+        return true;
+    }
+
+    /* Set each run of groups that are set in b, rounded to a's groups.  */
+    group = 1ULL << b->granularity;
+    run_start = run_end = 0;
+    hbitmap_iter_init(&hbi, b, 0);
+    while ((item = hbitmap_iter_next(&hbi)) >= 0) {
+        if (item != run_end) {
+            if (run_end > run_start) {
+                hbitmap_set(a, run_start, run_end - run_start);
+            }
+            run_start = item;
+        }
+        run_end = MIN(item + group, a->orig_size);
+    }
+    if (run_end > run_start) {
+        hbitmap_set(a, run_start, run_end - run_start);
+    }
+    return true;
+}
+
+uint64_t hbitmap_serialization_align(const HBitmap *hb)
+{
+    /* Ranges map to whole 64-bit words of the bottom level, on 32-bit
+     * and 64-bit hosts alike.
+     */
+    assert(hb->granularity < 58);
+    return 64ULL << hb->granularity;
+}
+
+/* Find the words of the bottom level that hold a range of bits.  */
+static void serialization_chunk(const HBitmap *hb,
+                                uint64_t start, uint64_t count,
+                                unsigned long **first_el, size_t *el_count)
+{
+    uint64_t align = hbitmap_serialization_align(hb);
+    uint64_t last = start + count - 1;
+
+    assert((start & (align - 1)) == 0);
+    assert((count & (align - 1)) == 0 || start + count == hb->orig_size);
+    assert(count && start + count <= hb->orig_size);
+
+    start = (start >> hb->granularity) >> BITS_PER_LEVEL;
+    last = (last >> hb->granularity) >> BITS_PER_LEVEL;
+    *first_el = &hb->levels[HBITMAP_LEVELS - 1][start];
+    *el_count = last - start + 1;
+}
+
+uint64_t hbitmap_serialization_size(const HBitmap *hb,
+                                    uint64_t start, uint64_t count)
+{
+    uint64_t first, last;
+
+    if (count == 0) {
+        return 0;
+    }
+    first = start >> hb->granularity;
+    last = (start + count - 1) >> hb->granularity;
+    return DIV_ROUND_UP(last - first + 1, 64) * 8;
+}
+
+void hbitmap_serialize_part(const HBitmap *hb, uint8_t *buf,
+                            uint64_t start, uint64_t count)
+{
+    uint64_t size = hbitmap_serialization_size(hb, start, count);
+    unsigned long *cur, el;
+    size_t i, n;
+
+    if (count == 0) {
+        return;
+    }
+    serialization_chunk(hb, start, count, &cur, &n);
+    for (i = 0; i < n; i++) {
+        el = cpu_to_leul(cur[i]);
+        memcpy(buf + i * sizeof(el), &el, sizeof(el));
+    }
+
+    /* 32-bit hosts may end the bitmap in the middle of a 64-bit word.  */
+    memset(buf + n * sizeof(el), 0, size - n * sizeof(el));
+}
+
+void hbitmap_deserialize_part(HBitmap *hb, const uint8_t *buf,
+                              uint64_t start, uint64_t count)
+{
+    unsigned long *cur, el;
+    size_t i, n;
+
+    if (count == 0) {
+        return;
+    }
+    serialization_chunk(hb, start, count, &cur, &n);
+    for (i = 0; i < n; i++) {
+        memcpy(&el, buf + i * sizeof(el), sizeof(el));
+        cur[i] = leul_to_cpu(el);
+    }
+
+    /* Never load bits past the end of the bitmap.  */
+    if (start + count == hb->orig_size && (hb->size & (BITS_PER_LONG - 1))) {
+        cur[n - 1] &= (1UL << (hb->size & (BITS_PER_LONG - 1))) - 1;
+    }
+}
+
+void hbitmap_deserialize_finish(HBitmap *hb)
+{
+    uint64_t count = 0;
+    unsigned i;
+    size_t j;
+
+    for (j = 0; j < hb->sizes[HBITMAP_LEVELS - 1]; j++) {
+        count += popcountl(hb->levels[HBITMAP_LEVELS - 1][j]);
+    }
+    hb->count = count;
+
+    for (i = HBITMAP_LEVELS - 1; i-- > 0; ) {
+        memset(hb->levels[i], 0, hb->sizes[i] * sizeof(unsigned long));
+        for (j = 0; j < hb->sizes[i + 1]; j++) {
+            if (hb->levels[i + 1][j]) {
+                hb->levels[i][j >> BITS_PER_LEVEL] |=
+                    1UL << (j & (BITS_PER_LONG - 1));
+            }
+        }
+    }
+    hb->levels[0][0] |= 1UL << (BITS_PER_LONG - 1);
+}
+
 void hbitmap_free(HBitmap *hb)
 {
     unsigned i;
@@ -379,16 +596,19 @@ void hbitmap_free(HBitmap *hb)
 HBitmap *hbitmap_alloc(uint64_t size, int granularity)
 {
     HBitmap *hb = g_malloc0(sizeof (struct HBitmap));
+    uint64_t orig_size = size;
     unsigned i;
 
     assert(granularity >= 0 && granularity < 64);
     size = (size + (1ULL << granularity) - 1) >> granularity;
     assert(size <= ((uint64_t)1 << HBITMAP_LOG_MAX_SIZE));
 
+    hb->orig_size = orig_size;
     hb->size = size;
     hb->granularity = granularity;
     for (i = HBITMAP_LEVELS; i-- > 0; ) {
         size = MAX((size + BITS_PER_LONG - 1) >> BITS_PER_LEVEL, 1);
+        hb->sizes[i] = size;
         hb->levels[i] = g_malloc0(size * sizeof(unsigned long));
     }
 
@@ -0,0 +1,61 @@
+/*
+ * Host CPU feature detection
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu-common.h"
+#include "qemu/host-features.h"
+
+unsigned int qemu_host_features;
+
+#if defined(CONFIG_AVX2_OPT) && (defined(__i386__) || defined(__x86_64__))
+#include <cpuid.h>
+
+#ifndef bit_AES
+#define bit_AES     (1 << 25)
+#endif
+#ifndef bit_OSXSAVE
+#define bit_OSXSAVE (1 << 27)
+#endif
+#ifndef bit_AVX
+#define bit_AVX     (1 << 28)
+#endif
+#ifndef bit_AVX2
+#define bit_AVX2    (1 << 5)
+#endif
+
+/* XCR0 bits for the SSE and AVX register state */
+#define XCR0_SSE_AVX 6
+
+static void __attribute__((constructor)) x86_init_host_features(void)
+{
+    unsigned int a, b, c, d;
+    unsigned int xcr0_lo, xcr0_hi;
+
+    if (!__get_cpuid(1, &a, &b, &c, &d)) {
+        return;
+    }
+
+    if (d & bit_SSE2) {
+        qemu_host_features |= QEMU_HOST_FEATURE_SSE2;
+    }
+    if ((d & bit_SSE2) && (c & bit_AES)) {
+        qemu_host_features |= QEMU_HOST_FEATURE_AES;
+    }
+
+    /* AVX2 also needs the OS to save the YMM registers on context switch */
+    if (!(c & bit_OSXSAVE) || !(c & bit_AVX) || __get_cpuid_max(0, NULL) < 7) {
+        return;
+    }
+    asm("xgetbv" : "=a" (xcr0_lo), "=d" (xcr0_hi) : "c" (0));
+    if ((xcr0_lo & XCR0_SSE_AVX) != XCR0_SSE_AVX) {
+        return;
+    }
+
+    __cpuid_count(7, 0, a, b, c, d);
+    if (b & bit_AVX2) {
+        qemu_host_features |= QEMU_HOST_FEATURE_AVX2;
+    }
+}
+#endif
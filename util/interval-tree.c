@@ -0,0 +1,191 @@
+/*
+ * Interval tree
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <assert.h>
+#include "qemu/interval-tree.h"
+
+static int node_height(IntervalTreeNode *n)
+{
+    return n ? n->height : 0;
+}
+
+static void node_update(IntervalTreeNode *n)
+{
+    int lh = node_height(n->left);
+    int rh = node_height(n->right);
+
+    n->height = 1 + (lh > rh ? lh : rh);
+    n->subtree_last = n->last;
+    if (n->left && n->left->subtree_last > n->subtree_last) {
+        n->subtree_last = n->left->subtree_last;
+    }
+    if (n->right && n->right->subtree_last > n->subtree_last) {
+        n->subtree_last = n->right->subtree_last;
+    }
+}
+
+/* Nodes with the same start are ordered by address, so that every node
+ * has a unique position and can be found again for removal. */
+static int node_cmp(IntervalTreeNode *a, IntervalTreeNode *b)
+{
+    if (a->start != b->start) {
+        return a->start < b->start ? -1 : 1;
+    }
+    if (a == b) {
+        return 0;
+    }
+    return (uintptr_t)a < (uintptr_t)b ? -1 : 1;
+}
+
+static IntervalTreeNode *rotate_right(IntervalTreeNode *n)
+{
+    IntervalTreeNode *l = n->left;
+
+    n->left = l->right;
+    l->right = n;
+    node_update(n);
+    node_update(l);
+    return l;
+}
+
+static IntervalTreeNode *rotate_left(IntervalTreeNode *n)
+{
+    IntervalTreeNode *r = n->right;
+
+    n->right = r->left;
+    r->left = n;
+    node_update(n);
+    node_update(r);
+    return r;
+}
+
+static IntervalTreeNode *rebalance(IntervalTreeNode *n)
+{
+    int balance;
+
+    node_update(n);
+    balance = node_height(n->left) - node_height(n->right);
+
+    if (balance > 1) {
+        if (node_height(n->left->left) < node_height(n->left->right)) {
+            n->left = rotate_left(n->left);
+        }
+        return rotate_right(n);
+    }
+    if (balance < -1) {
+        if (node_height(n->right->right) < node_height(n->right->left)) {
+            n->right = rotate_right(n->right);
+        }
+        return rotate_left(n);
+    }
+    return n;
+}
+
+static IntervalTreeNode *insert_node(IntervalTreeNode *n,
+                                     IntervalTreeNode *node)
+{
+    if (!n) {
+        node->left = node->right = NULL;
+        node_update(node);
+        return node;
+    }
+
+    if (node_cmp(node, n) < 0) {
+        n->left = insert_node(n->left, node);
+    } else {
+        n->right = insert_node(n->right, node);
+    }
+    return rebalance(n);
+}
+
+static IntervalTreeNode *remove_min(IntervalTreeNode *n,
+                                    IntervalTreeNode **min)
+{
+    if (!n->left) {
+        *min = n;
+        return n->right;
+    }
+    n->left = remove_min(n->left, min);
+    return rebalance(n);
+}
+
+static IntervalTreeNode *remove_node(IntervalTreeNode *n,
+                                     IntervalTreeNode *node)
+{
+    IntervalTreeNode *min, *right;
+    int cmp;
+
+    assert(n);
+    cmp = node_cmp(node, n);
+    if (cmp < 0) {
+        n->left = remove_node(n->left, node);
+    } else if (cmp > 0) {
+        n->right = remove_node(n->right, node);
+    } else {
+        if (!n->right) {
+            return n->left;
+        }
+        right = remove_min(n->right, &min);
+        min->left = n->left;
+        min->right = right;
+        n = min;
+    }
+    return rebalance(n);
+}
+
+void interval_tree_insert(IntervalTree *tree, IntervalTreeNode *node)
+{
+    assert(node->start <= node->last);
+    tree->root = insert_node(tree->root, node);
+}
+
+void interval_tree_remove(IntervalTree *tree, IntervalTreeNode *node)
+{
+    tree->root = remove_node(tree->root, node);
+}
+
+/* Return the lowest node of the subtree that overlaps [start, last] and
+ * sorts after @after, or any overlapping node if @after is NULL. */
+static IntervalTreeNode *search(IntervalTreeNode *n, int64_t start,
+                                int64_t last, IntervalTreeNode *after)
+{
+    IntervalTreeNode *found;
+
+    if (!n || n->subtree_last < start) {
+        return NULL;
+    }
+
+    /* if @n comes before @after, so does its left subtree */
+    if (!after || node_cmp(n, after) > 0) {
+        found = search(n->left, start, last, after);
+        if (found) {
+            return found;
+        }
+        if (n->start <= last && n->last >= start) {
+            return n;
+        }
+    }
+
+    /* everything on the right starts after @n */
+    if (n->start > last) {
+        return NULL;
+    }
+    return search(n->right, start, last, after);
+}
+
+IntervalTreeNode *interval_tree_iter_first(IntervalTree *tree,
+                                           int64_t start, int64_t last)
+{
+    return search(tree->root, start, last, NULL);
+}
+
+IntervalTreeNode *interval_tree_iter_next(IntervalTree *tree,
+                                          IntervalTreeNode *node,
+                                          int64_t start, int64_t last)
+{
+    return search(tree->root, start, last, node);
+}
@@ -83,6 +83,46 @@ size_t iov_memset(const struct iovec *iov, const unsigned int iov_cnt,
     return done;
 }
 
+size_t iov_memcpy(const struct iovec *dst_iov, unsigned int dst_cnt,
+                  size_t doffset,
+                  const struct iovec *src_iov, unsigned int src_cnt,
+                  size_t soffset, size_t bytes)
+{
+    size_t done = 0;
+    unsigned int i = 0, j = 0;
+
+    /* find the starting element on both sides */
+    while (i < dst_cnt && doffset >= dst_iov[i].iov_len) {
+        doffset -= dst_iov[i++].iov_len;
+    }
+    while (j < src_cnt && soffset >= src_iov[j].iov_len) {
+        soffset -= src_iov[j++].iov_len;
+    }
+
+    while (done < bytes && i < dst_cnt && j < src_cnt) {
+        size_t len = MIN(dst_iov[i].iov_len - doffset,
+                         src_iov[j].iov_len - soffset);
+
+        len = MIN(len, bytes - done);
+        memcpy(dst_iov[i].iov_base + doffset,
+               src_iov[j].iov_base + soffset, len);
+        done += len;
+        doffset += len;
+        soffset += len;
+        if (doffset == dst_iov[i].iov_len) {
+            doffset = 0;
+            i++;
+        }
+        if (soffset == src_iov[j].iov_len) {
+            soffset = 0;
+            j++;
+        }
+    }
+    assert(doffset == 0 || i < dst_cnt);
+    assert(soffset == 0 || j < src_cnt);
+    return done;
+}
+
 size_t iov_size(const struct iovec *iov, const unsigned int iov_cnt)
 {
     size_t len;
@@ -254,11 +294,21 @@ unsigned iov_copy(struct iovec *dst_iov, unsigned int dst_iov_cnt,
 
 /* io vectors */
 
+/*
+ * Vectors of up to QEMU_IOVEC_INLINE elements live in qiov->local_iov, so
+ * the common init/add/destroy cycle of a block request does not go to the
+ * allocator at all.  Such a QEMUIOVector must not be copied by value.
+ */
 void qemu_iovec_init(QEMUIOVector *qiov, int alloc_hint)
 {
-    qiov->iov = g_malloc(alloc_hint * sizeof(struct iovec));
+    if (alloc_hint <= QEMU_IOVEC_INLINE) {
+        qiov->iov = qiov->local_iov;
+        qiov->nalloc = QEMU_IOVEC_INLINE;
+    } else {
+        qiov->iov = g_malloc(alloc_hint * sizeof(struct iovec));
+        qiov->nalloc = alloc_hint;
+    }
     qiov->niov = 0;
-    qiov->nalloc = alloc_hint;
     qiov->size = 0;
 }
 
@@ -274,13 +324,26 @@ void qemu_iovec_init_external(QEMUIOVector *qiov, struct iovec *iov, int niov)
         qiov->size += iov[i].iov_len;
 }
 
+static void qemu_iovec_reserve(QEMUIOVector *qiov, int nalloc)
+{
+    if (nalloc <= qiov->nalloc) {
+        return;
+    }
+    if (qiov->iov == qiov->local_iov) {
+        qiov->iov = g_malloc(nalloc * sizeof(struct iovec));
+        memcpy(qiov->iov, qiov->local_iov, qiov->niov * sizeof(struct iovec));
+    } else {
+        qiov->iov = g_realloc(qiov->iov, nalloc * sizeof(struct iovec));
+    }
+    qiov->nalloc = nalloc;
+}
+
 void qemu_iovec_add(QEMUIOVector *qiov, void *base, size_t len)
 {
     assert(qiov->nalloc != -1);
 
     if (qiov->niov == qiov->nalloc) {
-        qiov->nalloc = 2 * qiov->nalloc + 1;
-        qiov->iov = g_realloc(qiov->iov, qiov->nalloc * sizeof(struct iovec));
+        qemu_iovec_reserve(qiov, 2 * qiov->nalloc + 1);
     }
     qiov->iov[qiov->niov].iov_base = base;
     qiov->iov[qiov->niov].iov_len = len;
@@ -338,12 +401,69 @@ void qemu_iovec_concat(QEMUIOVector *dst,
     qemu_iovec_concat_iov(dst, src->iov, src->niov, soffset, sbytes);
 }
 
+/*
+ * Make dst describe `bytes' bytes of src starting at `offset', replacing
+ * whatever dst held before.  Like qemu_iovec_concat(), only the vector
+ * elements are copied, never the data; unlike it, dst is grown at most
+ * once, to exactly the number of elements the range spans.  dst and src
+ * must be different vectors.
+ */
+void qemu_iovec_slice(QEMUIOVector *dst,
+                      QEMUIOVector *src, size_t offset, size_t bytes)
+{
+    int i, first;
+    size_t len;
+
+    assert(dst->nalloc != -1);
+    assert(offset + bytes <= src->size);
+
+    qemu_iovec_reset(dst);
+    if (!bytes) {
+        return;
+    }
+
+    for (i = 0; offset >= src->iov[i].iov_len; i++) {
+        offset -= src->iov[i].iov_len;
+    }
+    first = i;
+    len = src->iov[i].iov_len - offset;
+    while (len < bytes) {
+        len += src->iov[++i].iov_len;
+    }
+    qemu_iovec_reserve(dst, i - first + 1);
+
+    for (i = first; bytes; i++) {
+        len = MIN(src->iov[i].iov_len - offset, bytes);
+        dst->iov[dst->niov].iov_base = src->iov[i].iov_base + offset;
+        dst->iov[dst->niov].iov_len = len;
+        dst->niov++;
+        dst->size += len;
+        bytes -= len;
+        offset = 0;
+    }
+}
+
+/*
+ * Initialise qiov as a view of `bytes' bytes of src starting at `offset'.
+ * This does not allocate if the range spans at most QEMU_IOVEC_INLINE
+ * elements of src.  qiov must be released with qemu_iovec_destroy() and
+ * must not outlive the buffers of src.
+ */
+void qemu_iovec_init_slice(QEMUIOVector *qiov, QEMUIOVector *src,
+                           size_t offset, size_t bytes)
+{
+    qemu_iovec_init(qiov, 0);
+    qemu_iovec_slice(qiov, src, offset, bytes);
+}
+
 void qemu_iovec_destroy(QEMUIOVector *qiov)
 {
     assert(qiov->nalloc != -1);
 
     qemu_iovec_reset(qiov);
-    g_free(qiov->iov);
+    if (qiov->iov != qiov->local_iov) {
+        g_free(qiov->iov);
+    }
     qiov->nalloc = 0;
     qiov->iov = NULL;
 }
@@ -374,6 +494,13 @@ size_t qemu_iovec_memset(QEMUIOVector *qiov, size_t offset,
     return iov_memset(qiov->iov, qiov->niov, offset, fillc, bytes);
 }
 
+size_t qemu_iovec_copy_data(QEMUIOVector *dst, size_t doffset,
+                            QEMUIOVector *src, size_t soffset, size_t bytes)
+{
+    return iov_memcpy(dst->iov, dst->niov, doffset,
+                      src->iov, src->niov, soffset, bytes);
+}
+
 size_t iov_discard_front(struct iovec **iov, unsigned int *iov_cnt,
                          size_t bytes)
 {
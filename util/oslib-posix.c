@@ -61,6 +61,7 @@ static int running_on_valgrind = -1;
 #ifdef CONFIG_LINUX
 #include <sys/syscall.h>
 #endif
+#include <sys/mman.h>
 
 int qemu_get_thread_id(void)
 {
@@ -134,6 +135,44 @@ void qemu_vfree(void *ptr)
     free(ptr);
 }
 
+/* Each stack is preceded by an inaccessible guard page, so that an
+ * overflow faults instead of corrupting the neighbouring stack.  All
+ * stacks of a batch come from a single mapping, but every stack can be
+ * unmapped on its own with qemu_free_stack().
+ */
+void qemu_alloc_stacks(void **stacks, int n, size_t size)
+{
+    size_t pagesize = getpagesize();
+    size_t stride;
+    char *ptr;
+    int i;
+
+    size = (size + pagesize - 1) & ~(pagesize - 1);
+    stride = size + pagesize;
+    ptr = mmap(NULL, stride * n, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED) {
+        fprintf(stderr, "Failed to allocate %d stacks: %s\n",
+                n, strerror(errno));
+        abort();
+    }
+    for (i = 0; i < n; i++) {
+        if (mprotect(ptr, pagesize, PROT_NONE) != 0) {
+            abort();
+        }
+        stacks[i] = ptr + pagesize;
+        ptr += stride;
+    }
+}
+
+void qemu_free_stack(void *stack, size_t size)
+{
+    size_t pagesize = getpagesize();
+
+    size = (size + pagesize - 1) & ~(pagesize - 1);
+    munmap((char *)stack - pagesize, size + pagesize);
+}
+
 void socket_set_block(int fd)
 {
     int f;
@@ -114,7 +114,9 @@ void qemu_progress_init(int enabled, float min_skip)
 
 void qemu_progress_end(void)
 {
-    state.end();
+    if (state.end) {
+        state.end();
+    }
 }
 
 /*
@@ -132,6 +134,11 @@ void qemu_progress_print(float delta, int max)
 {
     float current;
 
+    /* Block drivers report progress even when no tool has set it up */
+    if (!state.print) {
+        return;
+    }
+
     if (max == 0) {
         current = delta;
     } else {
@@ -0,0 +1,435 @@
+/*
+ * Resizable hash table with lock-free lookups
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <assert.h>
+#include <string.h>
+#include "qemu-common.h"
+#include "qemu/atomic.h"
+#include "qemu/qht.h"
+
+#define QHT_BUCKET_ALIGN 64
+
+/* as many entries as fit in a cache line next to the other fields */
+#if HOST_LONG_BITS == 32
+#define QHT_BUCKET_ENTRIES 6
+#else
+#define QHT_BUCKET_ENTRIES 4
+#endif
+
+/* grow once more than 1/8 of the head buckets had to be chained */
+#define QHT_ADDED_BUCKETS_THRESHOLD_DIV 8
+
+typedef struct QHTBucket QHTBucket;
+
+/*
+ * Entries are packed: a NULL pointer is followed by NULL pointers only,
+ * in this bucket and the rest of the chain.  Writers bump the sequence
+ * of the head bucket around every change to its chain; lookups retry if
+ * the sequence changed under them.
+ */
+struct QHTBucket {
+    unsigned int sequence;
+    uint32_t hashes[QHT_BUCKET_ENTRIES];
+    void *pointers[QHT_BUCKET_ENTRIES];
+    QHTBucket *next;
+} __attribute__((aligned(QHT_BUCKET_ALIGN)));
+
+struct QHTMap {
+    QHTBucket *buckets;
+    size_t n_buckets;
+    size_t n_added_buckets;
+    size_t n_added_buckets_threshold;
+    QHTMap *next_retired;
+};
+
+#define qht_read(x) (*(volatile __typeof__(x) *)&(x))
+#define qht_set(x, v) (*(volatile __typeof__(x) *)&(x) = (v))
+
+static unsigned int seq_read_begin(QHTBucket *b)
+{
+    unsigned int seq;
+
+    while ((seq = qht_read(b->sequence)) & 1) {
+        /* a writer is modifying the chain */
+    }
+    smp_rmb();
+    return seq;
+}
+
+static bool seq_read_retry(QHTBucket *b, unsigned int seq)
+{
+    smp_rmb();
+    return qht_read(b->sequence) != seq;
+}
+
+static void seq_write_begin(QHTBucket *b)
+{
+    qht_set(b->sequence, b->sequence + 1);
+    smp_wmb();
+}
+
+static void seq_write_end(QHTBucket *b)
+{
+    smp_wmb();
+    qht_set(b->sequence, b->sequence + 1);
+}
+
+static size_t qht_elems_to_buckets(size_t n_elems)
+{
+    size_t n = 1;
+
+    while (n * QHT_BUCKET_ENTRIES < n_elems) {
+        n <<= 1;
+    }
+    return n;
+}
+
+static QHTMap *qht_map_create(size_t n_buckets)
+{
+    QHTMap *map = g_new0(QHTMap, 1);
+
+    map->n_buckets = n_buckets;
+    map->n_added_buckets_threshold =
+        MAX(n_buckets / QHT_ADDED_BUCKETS_THRESHOLD_DIV, 1);
+    map->buckets = qemu_memalign(QHT_BUCKET_ALIGN,
+                                 n_buckets * sizeof(QHTBucket));
+    memset(map->buckets, 0, n_buckets * sizeof(QHTBucket));
+    return map;
+}
+
+static void qht_map_free_chains(QHTMap *map)
+{
+    size_t i;
+
+    for (i = 0; i < map->n_buckets; i++) {
+        QHTBucket *b = map->buckets[i].next;
+
+        while (b) {
+            QHTBucket *next = b->next;
+
+            qemu_vfree(b);
+            b = next;
+        }
+    }
+}
+
+static void qht_map_destroy(QHTMap *map)
+{
+    qht_map_free_chains(map);
+    qemu_vfree(map->buckets);
+    g_free(map);
+}
+
+static void qht_free_retired(QHT *ht)
+{
+    while (ht->retired) {
+        QHTMap *map = ht->retired;
+
+        ht->retired = map->next_retired;
+        qht_map_destroy(map);
+    }
+}
+
+static inline QHTBucket *qht_map_head(QHTMap *map, uint32_t hash)
+{
+    return &map->buckets[hash & (map->n_buckets - 1)];
+}
+
+void qht_init(QHT *ht, size_t n_elems, unsigned int mode)
+{
+    ht->map = qht_map_create(qht_elems_to_buckets(n_elems));
+    ht->retired = NULL;
+    ht->mode = mode;
+    qemu_mutex_init(&ht->lock);
+}
+
+void qht_destroy(QHT *ht)
+{
+    qht_free_retired(ht);
+    qht_map_destroy(ht->map);
+    ht->map = NULL;
+    qemu_mutex_destroy(&ht->lock);
+}
+
+static void *qht_chain_lookup(QHTBucket *b, qht_lookup_func_t func,
+                              const void *userp, uint32_t hash)
+{
+    int i;
+
+    do {
+        for (i = 0; i < QHT_BUCKET_ENTRIES; i++) {
+            void *p = qht_read(b->pointers[i]);
+
+            if (p == NULL) {
+                return NULL;
+            }
+            if (qht_read(b->hashes[i]) == hash && func(p, userp)) {
+                return p;
+            }
+        }
+        b = qht_read(b->next);
+    } while (b);
+    return NULL;
+}
+
+void *qht_lookup(QHT *ht, qht_lookup_func_t func, const void *userp,
+                 uint32_t hash)
+{
+    QHTMap *map;
+    QHTBucket *head;
+    unsigned int seq;
+    void *ret;
+
+    do {
+        map = qht_read(ht->map);
+        smp_rmb();
+        head = qht_map_head(map, hash);
+        seq = seq_read_begin(head);
+        ret = qht_chain_lookup(head, func, userp, hash);
+    } while (seq_read_retry(head, seq) || map != qht_read(ht->map));
+    return ret;
+}
+
+/* Add an entry to a chain; called with ht->lock held */
+static void qht_chain_add(QHTMap *map, QHTBucket *head, void *p,
+                          uint32_t hash)
+{
+    QHTBucket *b = head, *prev = NULL;
+    int i;
+
+    for (; b; prev = b, b = b->next) {
+        for (i = 0; i < QHT_BUCKET_ENTRIES; i++) {
+            if (b->pointers[i] == NULL) {
+                qht_set(b->hashes[i], hash);
+                smp_wmb();
+                qht_set(b->pointers[i], p);
+                return;
+            }
+        }
+    }
+
+    b = qemu_memalign(QHT_BUCKET_ALIGN, sizeof(*b));
+    memset(b, 0, sizeof(*b));
+    b->hashes[0] = hash;
+    b->pointers[0] = p;
+    smp_wmb();
+    qht_set(prev->next, b);
+    map->n_added_buckets++;
+}
+
+static bool qht_chain_find(QHTBucket *b, const void *p, QHTBucket **pb,
+                           int *pi)
+{
+    int i;
+
+    for (; b; b = b->next) {
+        for (i = 0; i < QHT_BUCKET_ENTRIES; i++) {
+            if (b->pointers[i] == NULL) {
+                return false;
+            }
+            if (b->pointers[i] == p) {
+                *pb = b;
+                *pi = i;
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+/* Move every entry of @old to @new, which is not visible to lookups yet */
+static void qht_map_copy(QHTMap *new, QHTMap *old)
+{
+    size_t i;
+    int j;
+
+    for (i = 0; i < old->n_buckets; i++) {
+        QHTBucket *b;
+
+        for (b = &old->buckets[i]; b; b = b->next) {
+            for (j = 0; j < QHT_BUCKET_ENTRIES && b->pointers[j]; j++) {
+                qht_chain_add(new, qht_map_head(new, b->hashes[j]),
+                              b->pointers[j], b->hashes[j]);
+            }
+        }
+    }
+}
+
+/* Publish a map with the contents of the current one; ht->lock held */
+static QHTMap *qht_replace_map(QHT *ht, size_t n_buckets)
+{
+    QHTMap *old = ht->map;
+    QHTMap *new = qht_map_create(n_buckets);
+
+    qht_map_copy(new, old);
+    smp_wmb();
+    qht_set(ht->map, new);
+    return old;
+}
+
+bool qht_insert(QHT *ht, void *p, uint32_t hash)
+{
+    QHTMap *map;
+    QHTBucket *head, *b;
+    int i;
+
+    assert(p);
+    qemu_mutex_lock(&ht->lock);
+    map = ht->map;
+    head = qht_map_head(map, hash);
+    if (qht_chain_find(head, p, &b, &i)) {
+        qemu_mutex_unlock(&ht->lock);
+        return false;
+    }
+
+    seq_write_begin(head);
+    qht_chain_add(map, head, p, hash);
+    seq_write_end(head);
+
+    if ((ht->mode & QHT_MODE_AUTO_RESIZE) &&
+        map->n_added_buckets > map->n_added_buckets_threshold) {
+        /* lookups may still walk the old map, keep it until a reset */
+        map = qht_replace_map(ht, map->n_buckets * 2);
+        map->next_retired = ht->retired;
+        ht->retired = map;
+    }
+    qemu_mutex_unlock(&ht->lock);
+    return true;
+}
+
+bool qht_remove(QHT *ht, const void *p, uint32_t hash)
+{
+    QHTBucket *head, *b, *last;
+    int i, last_i;
+
+    qemu_mutex_lock(&ht->lock);
+    head = qht_map_head(ht->map, hash);
+    if (!qht_chain_find(head, p, &b, &i)) {
+        qemu_mutex_unlock(&ht->lock);
+        return false;
+    }
+
+    /* find the last entry of the chain and move it into the hole */
+    last = b;
+    last_i = i;
+    for (;;) {
+        if (last_i + 1 < QHT_BUCKET_ENTRIES) {
+            if (last->pointers[last_i + 1] == NULL) {
+                break;
+            }
+            last_i++;
+        } else if (last->next && last->next->pointers[0]) {
+            last = last->next;
+            last_i = 0;
+        } else {
+            break;
+        }
+    }
+
+    seq_write_begin(head);
+    if (last != b || last_i != i) {
+        qht_set(b->hashes[i], last->hashes[last_i]);
+        qht_set(b->pointers[i], last->pointers[last_i]);
+    }
+    qht_set(last->pointers[last_i], NULL);
+    seq_write_end(head);
+
+    qemu_mutex_unlock(&ht->lock);
+    return true;
+}
+
+void qht_reset(QHT *ht)
+{
+    QHTMap *map;
+
+    qemu_mutex_lock(&ht->lock);
+    qht_free_retired(ht);
+    map = ht->map;
+    qht_map_free_chains(map);
+    memset(map->buckets, 0, map->n_buckets * sizeof(QHTBucket));
+    map->n_added_buckets = 0;
+    qemu_mutex_unlock(&ht->lock);
+}
+
+bool qht_resize(QHT *ht, size_t n_elems)
+{
+    size_t n_buckets = qht_elems_to_buckets(n_elems);
+    QHTMap *old;
+
+    qemu_mutex_lock(&ht->lock);
+    if (n_buckets == ht->map->n_buckets) {
+        qemu_mutex_unlock(&ht->lock);
+        return false;
+    }
+    old = qht_replace_map(ht, n_buckets);
+    qht_map_destroy(old);
+    qht_free_retired(ht);
+    qemu_mutex_unlock(&ht->lock);
+    return true;
+}
+
+void qht_iter(QHT *ht, qht_iter_func_t func, void *userp)
+{
+    QHTMap *map;
+    size_t i;
+    int j;
+
+    qemu_mutex_lock(&ht->lock);
+    map = ht->map;
+    for (i = 0; i < map->n_buckets; i++) {
+        QHTBucket *b;
+
+        for (b = &map->buckets[i]; b; b = b->next) {
+            for (j = 0; j < QHT_BUCKET_ENTRIES && b->pointers[j]; j++) {
+                func(b->pointers[j], b->hashes[j], userp);
+            }
+        }
+    }
+    qemu_mutex_unlock(&ht->lock);
+}
+
+void qht_statistics(QHT *ht, QHTStats *stats)
+{
+    QHTMap *map;
+    size_t i, total_buckets, chain_sum = 0;
+    int j;
+
+    memset(stats, 0, sizeof(*stats));
+    qemu_mutex_lock(&ht->lock);
+    map = ht->map;
+    stats->head_buckets = map->n_buckets;
+    total_buckets = map->n_buckets;
+    for (i = 0; i < map->n_buckets; i++) {
+        QHTBucket *b;
+        size_t chain = 0;
+
+        for (b = &map->buckets[i]; b; b = b->next) {
+            if (b != &map->buckets[i]) {
+                total_buckets++;
+            }
+            if (!b->pointers[0]) {
+                continue;
+            }
+            chain++;
+            for (j = 0; j < QHT_BUCKET_ENTRIES && b->pointers[j]; j++) {
+                stats->entries++;
+            }
+        }
+        if (chain) {
+            stats->used_head_buckets++;
+            chain_sum += chain;
+            stats->max_chain = MAX(stats->max_chain, chain);
+        }
+    }
+    qemu_mutex_unlock(&ht->lock);
+
+    if (stats->used_head_buckets) {
+        stats->avg_chain = (double)chain_sum / stats->used_head_buckets;
+    }
+    stats->occupancy = (double)stats->entries /
+                       (total_buckets * QHT_BUCKET_ENTRIES);
+}
@@ -0,0 +1,180 @@
+/*
+ * Read-copy-update
+ *
+ * The grace period detection follows the "memory barrier" flavor of
+ * liburcu: each reader publishes a snapshot of a global counter while it
+ * is inside a critical section, and a writer advances the counter and
+ * waits until no reader holds an older snapshot.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include <assert.h>
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+#include "qemu-common.h"
+#include "qemu/rcu.h"
+#include "qemu/thread.h"
+#include "qemu/main-loop.h"
+
+/* The low bit is always set, so that a snapshot is never 0 */
+#define RCU_GP_LOCKED 1UL
+#define RCU_GP_CTR    2UL
+
+volatile unsigned long rcu_gp_ctr = RCU_GP_LOCKED;
+__thread struct rcu_reader_data *rcu_reader;
+
+/* Protects the registry and serializes synchronize_rcu() */
+static QemuMutex rcu_registry_lock;
+static QemuMutex rcu_sync_lock;
+static QLIST_HEAD(, rcu_reader_data) registry =
+    QLIST_HEAD_INITIALIZER(registry);
+
+#ifndef _WIN32
+static pthread_key_t rcu_key;
+
+static void rcu_unregister_thread(void *opaque)
+{
+    struct rcu_reader_data *p = opaque;
+
+    qemu_mutex_lock(&rcu_registry_lock);
+    QLIST_REMOVE(p, node);
+    qemu_mutex_unlock(&rcu_registry_lock);
+    g_free(p);
+}
+#endif
+
+void rcu_register_thread(void)
+{
+    struct rcu_reader_data *p = g_new0(struct rcu_reader_data, 1);
+
+    assert(!rcu_reader);
+    qemu_mutex_lock(&rcu_registry_lock);
+    QLIST_INSERT_HEAD(&registry, p, node);
+    qemu_mutex_unlock(&rcu_registry_lock);
+#ifndef _WIN32
+    pthread_setspecific(rcu_key, p);
+#endif
+    rcu_reader = p;
+}
+
+static bool rcu_reader_is_old(struct rcu_reader_data *p)
+{
+    unsigned long ctr = p->ctr;
+
+    return ctr && ctr != rcu_gp_ctr;
+}
+
+static void wait_for_readers(void)
+{
+    struct rcu_reader_data *p;
+    unsigned int tries = 0;
+    bool busy;
+
+    for (;;) {
+        busy = false;
+        qemu_mutex_lock(&rcu_registry_lock);
+        QLIST_FOREACH(p, &registry, node) {
+            if (rcu_reader_is_old(p)) {
+                busy = true;
+                break;
+            }
+        }
+        qemu_mutex_unlock(&rcu_registry_lock);
+        if (!busy) {
+            return;
+        }
+        /* Critical sections are short; sleep longer once one is not */
+        g_usleep(++tries < 100 ? 10 : 1000);
+    }
+}
+
+void synchronize_rcu(void)
+{
+    assert(!rcu_reader || !rcu_reader->depth);
+
+    qemu_mutex_lock(&rcu_sync_lock);
+    smp_mb();
+    if (sizeof(rcu_gp_ctr) < 8) {
+        /* A 32-bit counter could wrap while a reader sleeps with an old
+         * snapshot.  Flip between two phases instead and wait for the
+         * readers of each.
+         */
+        rcu_gp_ctr ^= RCU_GP_CTR;
+        smp_mb();
+        wait_for_readers();
+        rcu_gp_ctr ^= RCU_GP_CTR;
+    } else {
+        rcu_gp_ctr += RCU_GP_CTR;
+    }
+    smp_mb();
+    wait_for_readers();
+    smp_mb();
+    qemu_mutex_unlock(&rcu_sync_lock);
+}
+
+/* Callbacks queued by call_rcu1() and run by call_rcu_thread() */
+static QemuMutex rcu_call_lock;
+static QemuCond rcu_call_cond;
+static struct rcu_head *rcu_call_head;
+static struct rcu_head **rcu_call_tail = &rcu_call_head;
+static bool rcu_call_started;
+static QemuThread rcu_call_thread;
+
+static void *call_rcu_thread(void *opaque)
+{
+    struct rcu_head *list, *next;
+
+    for (;;) {
+        qemu_mutex_lock(&rcu_call_lock);
+        while (!rcu_call_head) {
+            qemu_cond_wait(&rcu_call_cond, &rcu_call_lock);
+        }
+        list = rcu_call_head;
+        rcu_call_head = NULL;
+        rcu_call_tail = &rcu_call_head;
+        qemu_mutex_unlock(&rcu_call_lock);
+
+        /* Everything queued so far shares one grace period */
+        synchronize_rcu();
+
+        qemu_mutex_lock_iothread();
+        for (; list; list = next) {
+            next = list->next;
+            list->func(list);
+        }
+        qemu_mutex_unlock_iothread();
+    }
+    return NULL;
+}
+
+void call_rcu1(struct rcu_head *head, RCUCBFunc *func)
+{
+    head->func = func;
+    head->next = NULL;
+
+    qemu_mutex_lock(&rcu_call_lock);
+    *rcu_call_tail = head;
+    rcu_call_tail = &head->next;
+    if (!rcu_call_started) {
+        rcu_call_started = true;
+        qemu_thread_create(&rcu_call_thread, call_rcu_thread, NULL,
+                           QEMU_THREAD_DETACHED);
+    }
+    qemu_cond_signal(&rcu_call_cond);
+    qemu_mutex_unlock(&rcu_call_lock);
+}
+
+static void __attribute__((constructor)) rcu_init(void)
+{
+    qemu_mutex_init(&rcu_registry_lock);
+    qemu_mutex_init(&rcu_sync_lock);
+    qemu_mutex_init(&rcu_call_lock);
+    qemu_cond_init(&rcu_call_cond);
+#ifndef _WIN32
+    pthread_key_create(&rcu_key, rcu_unregister_thread);
+#endif
+}
@@ -0,0 +1,162 @@
+/*
+ * Leaky bucket throttling
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <string.h>
+#include "qemu/throttle.h"
+
+/* Buckets that apply to requests in each direction */
+static const BucketType bucket_types[2][4] = {
+    { THROTTLE_BPS_TOTAL, THROTTLE_BPS_READ,
+      THROTTLE_OPS_TOTAL, THROTTLE_OPS_READ },
+    { THROTTLE_BPS_TOTAL, THROTTLE_BPS_WRITE,
+      THROTTLE_OPS_TOTAL, THROTTLE_OPS_WRITE },
+};
+
+static double throttle_bucket_max(LeakyBucket *bkt)
+{
+    return bkt->max ? bkt->max : bkt->avg / THROTTLE_MAX_DIVISOR;
+}
+
+void throttle_leak_bucket(LeakyBucket *bkt, int64_t delta_ns)
+{
+    double leak = bkt->avg * (double)delta_ns / THROTTLE_NS_PER_SEC;
+
+    bkt->level = leak < bkt->level ? bkt->level - leak : 0;
+}
+
+int64_t throttle_compute_wait(LeakyBucket *bkt)
+{
+    double extra;
+
+    if (!bkt->avg) {
+        return 0;
+    }
+
+    extra = bkt->level - throttle_bucket_max(bkt);
+    if (extra <= 0) {
+        return 0;
+    }
+
+    return extra * THROTTLE_NS_PER_SEC / bkt->avg;
+}
+
+static void throttle_do_leak(ThrottleState *ts, int64_t now)
+{
+    int64_t delta_ns = now - ts->previous_leak;
+    int i;
+
+    if (delta_ns <= 0) {
+        return;
+    }
+
+    ts->previous_leak = now;
+    for (i = 0; i < BUCKETS_COUNT; i++) {
+        throttle_leak_bucket(&ts->cfg.buckets[i], delta_ns);
+    }
+}
+
+void throttle_init(ThrottleState *ts, int64_t now)
+{
+    memset(ts, 0, sizeof(*ts));
+    ts->previous_leak = now;
+}
+
+void throttle_config(ThrottleState *ts, ThrottleConfig *cfg, int64_t now)
+{
+    int i;
+
+    ts->cfg = *cfg;
+    for (i = 0; i < BUCKETS_COUNT; i++) {
+        ts->cfg.buckets[i].level = 0;
+    }
+    ts->previous_leak = now;
+}
+
+void throttle_get_config(ThrottleState *ts, ThrottleConfig *cfg)
+{
+    *cfg = ts->cfg;
+}
+
+bool throttle_enabled(ThrottleConfig *cfg)
+{
+    int i;
+
+    for (i = 0; i < BUCKETS_COUNT; i++) {
+        if (cfg->buckets[i].avg > 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool throttle_conflicting(ThrottleConfig *cfg)
+{
+    LeakyBucket *b = cfg->buckets;
+
+    return (b[THROTTLE_BPS_TOTAL].avg &&
+            (b[THROTTLE_BPS_READ].avg || b[THROTTLE_BPS_WRITE].avg)) ||
+           (b[THROTTLE_OPS_TOTAL].avg &&
+            (b[THROTTLE_OPS_READ].avg || b[THROTTLE_OPS_WRITE].avg)) ||
+           (b[THROTTLE_BPS_TOTAL].max &&
+            (b[THROTTLE_BPS_READ].max || b[THROTTLE_BPS_WRITE].max)) ||
+           (b[THROTTLE_OPS_TOTAL].max &&
+            (b[THROTTLE_OPS_READ].max || b[THROTTLE_OPS_WRITE].max));
+}
+
+bool throttle_is_valid(ThrottleConfig *cfg)
+{
+    int i;
+
+    for (i = 0; i < BUCKETS_COUNT; i++) {
+        LeakyBucket *bkt = &cfg->buckets[i];
+
+        if (bkt->avg < 0 || bkt->max < 0) {
+            return false;
+        }
+        /* a burst without an average has nothing to refill it */
+        if (bkt->max && !bkt->avg) {
+            return false;
+        }
+    }
+    return true;
+}
+
+int64_t throttle_compute_wait_for(ThrottleState *ts, bool is_write,
+                                  int64_t now)
+{
+    int64_t wait, max_wait = 0;
+    int i;
+
+    throttle_do_leak(ts, now);
+
+    for (i = 0; i < 4; i++) {
+        wait = throttle_compute_wait(&ts->cfg.buckets[bucket_types[is_write][i]]);
+        if (wait > max_wait) {
+            max_wait = wait;
+        }
+    }
+    return max_wait;
+}
+
+void throttle_account(ThrottleState *ts, bool is_write, uint64_t size)
+{
+    double units = 1.0;
+
+    if (ts->cfg.op_size && size > ts->cfg.op_size) {
+        units = (double)size / ts->cfg.op_size;
+    }
+
+    ts->cfg.buckets[THROTTLE_BPS_TOTAL].level += size;
+    ts->cfg.buckets[THROTTLE_OPS_TOTAL].level += units;
+    if (is_write) {
+        ts->cfg.buckets[THROTTLE_BPS_WRITE].level += size;
+        ts->cfg.buckets[THROTTLE_OPS_WRITE].level += units;
+    } else {
+        ts->cfg.buckets[THROTTLE_BPS_READ].level += size;
+        ts->cfg.buckets[THROTTLE_OPS_READ].level += units;
+    }
+}
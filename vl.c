@@ -137,6 +137,7 @@ int main(int argc, char **argv)
 #include "char/char.h"
 #include "qemu/cache-utils.h"
 #include "sysemu/blockdev.h"
+#include "block/thread-pool.h"
 #include "hw/block-common.h"
 #include "migration/block.h"
 #include "sysemu/dma.h"
@@ -251,6 +252,10 @@ static QTAILQ_HEAD(, FWBootEntry) fw_boot_order =
 int nb_numa_nodes;
 uint64_t node_mem[MAX_NODES];
 unsigned long *node_cpumask[MAX_NODES];
+const char *node_mem_path[MAX_NODES];
+unsigned long *node_host_nodes[MAX_NODES];
+int node_host_policy[MAX_NODES];
+unsigned long *node_host_cpus[MAX_NODES];
 
 uint8_t qemu_uuid[16];
 
@@ -333,6 +338,24 @@ static QemuOptsList qemu_sandbox_opts = {
     },
 };
 
+static QemuOptsList qemu_thread_pool_opts = {
+    .name = "thread-pool",
+    .head = QTAILQ_HEAD_INITIALIZER(qemu_thread_pool_opts.head),
+    .desc = {
+        {
+            .name = "min",
+            .type = QEMU_OPT_NUMBER,
+        },{
+            .name = "max",
+            .type = QEMU_OPT_NUMBER,
+        },{
+            .name = "idle-timeout",
+            .type = QEMU_OPT_NUMBER,
+        },
+        { /* end of list */ }
+    },
+};
+
 static QemuOptsList qemu_trace_opts = {
     .name = "trace",
     .implied_opt_name = "trace",
@@ -387,6 +410,10 @@ static QemuOptsList qemu_machine_opts = {
             .name = "kvm_shadow_mem",
             .type = QEMU_OPT_SIZE,
             .help = "KVM shadow MMU size",
+        }, {
+            .name = "kvm_dirty_ring",
+            .type = QEMU_OPT_NUMBER,
+            .help = "entries in the KVM dirty page ring of each vcpu",
         }, {
             .name = "kernel",
             .type = QEMU_OPT_STRING,
@@ -423,10 +450,46 @@ static QemuOptsList qemu_machine_opts = {
             .name = "mem-merge",
             .type = QEMU_OPT_BOOL,
             .help = "enable/disable memory merge support",
+        },{
+            .name = "mem-prealloc-background",
+            .type = QEMU_OPT_BOOL,
+            .help = "preallocate guest memory while the guest runs",
         },{
             .name = "usb",
             .type = QEMU_OPT_BOOL,
             .help = "Set on/off to enable/disable usb",
+        },{
+            .name = "tcg-threads",
+            .type = QEMU_OPT_STRING,
+            .help = "run TCG vCPUs on a single thread or one thread each",
+        },{
+            .name = "tcg-superblocks",
+            .type = QEMU_OPT_NUMBER,
+            .help = "executions after which a TB is retranslated as a superblock",
+        },{
+            .name = "tcg-opt",
+            .type = QEMU_OPT_STRING,
+            .help = "TCG optimizer passes to run ('tcg-opt=help' for a list)",
+        },{
+            .name = "tcg-profile",
+            .type = QEMU_OPT_BOOL,
+            .help = "count executions and host ticks of each TB",
+        },{
+            .name = "bql-profile",
+            .type = QEMU_OPT_BOOL,
+            .help = "histograms of iothread lock wait and hold times",
+        },{
+            .name = "halt-poll-ns",
+            .type = QEMU_OPT_NUMBER,
+            .help = "longest time a halted vCPU thread polls before sleeping",
+        }, {
+            .name = "xen-mapcache-bucket",
+            .type = QEMU_OPT_SIZE,
+            .help = "size of the windows in which Xen guest memory is mapped",
+        }, {
+            .name = "ram-template",
+            .type = QEMU_OPT_STRING,
+            .help = "start from a template saved with template-save",
         },
         { /* End of list */ }
     },
@@ -980,6 +1043,28 @@ static int parse_sandbox(QemuOpts *opts, void *opaque)
     return 0;
 }
 
+static int parse_thread_pool(QemuOpts *opts, void *opaque)
+{
+    uint64_t min_threads = qemu_opt_get_number(opts, "min", 0);
+    uint64_t max_threads = qemu_opt_get_number(opts, "max", 64);
+    uint64_t idle_timeout = qemu_opt_get_number(opts, "idle-timeout", 10000);
+
+    if (max_threads == 0 || max_threads > INT_MAX || min_threads > max_threads) {
+        qerror_report(ERROR_CLASS_GENERIC_ERROR,
+                      "thread pool size must satisfy 0 <= min <= max, max > 0");
+        return -1;
+    }
+    if (idle_timeout == 0 || idle_timeout > INT_MAX) {
+        qerror_report(ERROR_CLASS_GENERIC_ERROR,
+                      "thread pool idle-timeout must be a positive number "
+                      "of milliseconds");
+        return -1;
+    }
+
+    thread_pool_set_default_params(min_threads, max_threads, idle_timeout);
+    return 0;
+}
+
 /*********QEMU USB setting******/
 bool usb_enabled(bool default_usb)
 {
@@ -1288,6 +1373,66 @@ error:
     exit(1);
 }
 
+static void numa_node_parse_host_nodes(int nodenr, const char *nodes)
+{
+    char *endptr;
+    unsigned long long value, endvalue;
+
+    if (parse_uint(nodes, &value, &endptr, 10) < 0) {
+        goto error;
+    }
+    if (*endptr == '-') {
+        if (parse_uint_full(endptr + 1, &endvalue, 10) < 0) {
+            goto error;
+        }
+    } else if (*endptr == '\0') {
+        endvalue = value;
+    } else {
+        goto error;
+    }
+
+    if (endvalue < value || endvalue >= MAX_NODES) {
+        goto error;
+    }
+
+    bitmap_set(node_host_nodes[nodenr], value, endvalue-value+1);
+    return;
+
+error:
+    fprintf(stderr, "qemu: Invalid NUMA host node range: %s\n", nodes);
+    exit(1);
+}
+
+static void numa_node_parse_host_cpus(int nodenr, const char *cpus)
+{
+    char *endptr;
+    unsigned long long value, endvalue;
+
+    if (parse_uint(cpus, &value, &endptr, 10) < 0) {
+        goto error;
+    }
+    if (*endptr == '-') {
+        if (parse_uint_full(endptr + 1, &endvalue, 10) < 0) {
+            goto error;
+        }
+    } else if (*endptr == '\0') {
+        endvalue = value;
+    } else {
+        goto error;
+    }
+
+    if (endvalue < value || endvalue >= MAX_HOST_CPUMASK_BITS) {
+        goto error;
+    }
+
+    bitmap_set(node_host_cpus[nodenr], value, endvalue-value+1);
+    return;
+
+error:
+    fprintf(stderr, "qemu: Invalid NUMA host CPU range: %s\n", cpus);
+    exit(1);
+}
+
 static void numa_add(const char *optarg)
 {
     char option[128];
@@ -1333,6 +1478,49 @@ static void numa_add(const char *optarg)
         if (get_param_value(option, 128, "cpus", optarg) != 0) {
             numa_node_parse_cpus(nodenr, option);
         }
+        if (get_param_value(option, 128, "mem-path", optarg) != 0) {
+            node_mem_path[nodenr] = g_strdup(option);
+        }
+        if (get_param_value(option, 128, "host-nodes", optarg) != 0) {
+            numa_node_parse_host_nodes(nodenr, option);
+        }
+        if (get_param_value(option, 128, "host-cpus", optarg) != 0) {
+#ifdef CONFIG_LINUX
+            numa_node_parse_host_cpus(nodenr, option);
+#else
+            fprintf(stderr, "qemu: NUMA host CPU binding is not supported "
+                    "on this host\n");
+            exit(1);
+#endif
+        }
+        if (get_param_value(option, 128, "policy", optarg) != 0) {
+            if (!strcmp(option, "default")) {
+                node_host_policy[nodenr] = NUMA_POLICY_DEFAULT;
+            } else if (!strcmp(option, "preferred")) {
+                node_host_policy[nodenr] = NUMA_POLICY_PREFERRED;
+            } else if (!strcmp(option, "bind")) {
+                node_host_policy[nodenr] = NUMA_POLICY_BIND;
+            } else if (!strcmp(option, "interleave")) {
+                node_host_policy[nodenr] = NUMA_POLICY_INTERLEAVE;
+            } else {
+                fprintf(stderr, "qemu: invalid NUMA policy: %s\n", option);
+                exit(1);
+            }
+        } else if (!bitmap_empty(node_host_nodes[nodenr], MAX_NODES)) {
+            node_host_policy[nodenr] = NUMA_POLICY_BIND;
+        }
+        if (node_host_policy[nodenr] != NUMA_POLICY_DEFAULT) {
+#ifdef CONFIG_NUMA
+            if (bitmap_empty(node_host_nodes[nodenr], MAX_NODES)) {
+                fprintf(stderr, "qemu: NUMA policy needs host-nodes\n");
+                exit(1);
+            }
+#else
+            fprintf(stderr, "qemu: NUMA host binding is not supported "
+                    "on this host\n");
+            exit(1);
+#endif
+        }
         nb_numa_nodes++;
     } else {
         fprintf(stderr, "Invalid -numa option: %s\n", option);
@@ -1591,16 +1779,26 @@ MachineInfoList *qmp_query_machines(Error **errp)
 
 static void gui_update(void *opaque)
 {
-    uint64_t interval = GUI_REFRESH_INTERVAL;
+    uint64_t interval = 0;
     DisplayState *ds = opaque;
     DisplayChangeListener *dcl;
 
     dpy_refresh(ds);
 
+    /*
+     * Refresh as often as the most demanding listener wants; listeners
+     * that do not say use the default interval.
+     */
     QLIST_FOREACH(dcl, &ds->listeners, next) {
-        if (dcl->gui_timer_interval &&
-            dcl->gui_timer_interval < interval)
-            interval = dcl->gui_timer_interval;
+        uint64_t dcl_interval = dcl->gui_timer_interval ?
+                                dcl->gui_timer_interval : GUI_REFRESH_INTERVAL;
+
+        if (dcl->dpy_refresh && (!interval || dcl_interval < interval)) {
+            interval = dcl_interval;
+        }
+    }
+    if (!interval) {
+        interval = GUI_REFRESH_INTERVAL;
     }
     qemu_mod_timer(ds->gui_timer, interval + qemu_get_clock_ms(rt_clock));
 }
@@ -1994,6 +2192,8 @@ static void main_loop(void)
 #ifdef CONFIG_PROFILER
     int64_t ti;
 #endif
+
+    qemu_bql_set_site(BQL_SITE_MAIN_LOOP);
     do {
         nonblocking = !kvm_enabled() && last_io > 0;
 #ifdef CONFIG_PROFILER
@@ -2736,6 +2936,17 @@ static const QEMUOption *lookup_opt(int argc, char **argv,
     return popt;
 }
 
+/* Report how long each phase of startup took, see trace-events */
+static int64_t startup_phase_start;
+
+static void startup_phase_done(const char *phase)
+{
+    int64_t now = get_clock();
+
+    trace_vl_startup_phase(phase, now - startup_phase_start);
+    startup_phase_start = now;
+}
+
 static gpointer malloc_and_trace(gsize n_bytes)
 {
     void *ptr = malloc(n_bytes);
@@ -2810,6 +3021,7 @@ int main(int argc, char **argv, char **envp)
     const char *icount_option = NULL;
     const char *initrd_filename;
     const char *kernel_filename, *kernel_cmdline;
+    const char *ram_template = NULL;
     char boot_devices[33] = "";
     DisplayState *ds;
     int cyls, heads, secs, translation;
@@ -2866,9 +3078,11 @@ int main(int argc, char **argv, char **envp)
     qemu_add_opts(&qemu_machine_opts);
     qemu_add_opts(&qemu_boot_opts);
     qemu_add_opts(&qemu_sandbox_opts);
+    qemu_add_opts(&qemu_thread_pool_opts);
     qemu_add_opts(&qemu_add_fd_opts);
     qemu_add_opts(&qemu_object_opts);
 
+    startup_phase_start = get_clock();
     runstate_init();
 
     init_clocks();
@@ -2890,6 +3104,8 @@ int main(int argc, char **argv, char **envp)
     for (i = 0; i < MAX_NODES; i++) {
         node_mem[i] = 0;
         node_cpumask[i] = bitmap_new(MAX_CPUMASK_BITS);
+        node_host_nodes[i] = bitmap_new(MAX_NODES);
+        node_host_cpus[i] = bitmap_new(MAX_HOST_CPUMASK_BITS);
     }
 
     nb_numa_nodes = 0;
@@ -3351,6 +3567,7 @@ int main(int argc, char **argv, char **envp)
                 QemuOpts *fsdev;
                 QemuOpts *device;
                 const char *writeout, *sock_fd, *socket;
+                const char *threads, *attr_timeout;
 
                 olist = qemu_find_opts("virtfs");
                 if (!olist) {
@@ -3398,6 +3615,14 @@ int main(int argc, char **argv, char **envp)
                 if (sock_fd) {
                     qemu_opt_set(fsdev, "sock_fd", sock_fd);
                 }
+                threads = qemu_opt_get(opts, "threads");
+                if (threads) {
+                    qemu_opt_set(fsdev, "threads", threads);
+                }
+                attr_timeout = qemu_opt_get(opts, "attr_timeout");
+                if (attr_timeout) {
+                    qemu_opt_set(fsdev, "attr_timeout", attr_timeout);
+                }
 
                 qemu_opt_set_bool(fsdev, "readonly",
                                 qemu_opt_get_bool(opts, "readonly", 0));
@@ -3797,6 +4022,12 @@ int main(int argc, char **argv, char **envp)
                     exit(1);
                 }
                 break;
+            case QEMU_OPTION_thread_pool:
+                opts = qemu_opts_parse(qemu_find_opts("thread-pool"), optarg, 0);
+                if (!opts) {
+                    exit(1);
+                }
+                break;
             case QEMU_OPTION_add_fd:
 #ifndef _WIN32
                 opts = qemu_opts_parse(qemu_find_opts("add-fd"), optarg, 0);
@@ -3822,6 +4053,11 @@ int main(int argc, char **argv, char **envp)
     }
     loc_set_none();
 
+    if (qemu_opts_foreach(qemu_find_opts("thread-pool"), parse_thread_pool,
+                          NULL, 1)) {
+        exit(1);
+    }
+
     if (qemu_init_main_loop()) {
         fprintf(stderr, "qemu_init_main_loop failed\n");
         exit(1);
@@ -4053,13 +4289,16 @@ int main(int argc, char **argv, char **envp)
         exit(0);
     }
 
+    startup_phase_done("options");
     configure_accelerator();
+    startup_phase_done("accel");
 
     machine_opts = qemu_opts_find(qemu_find_opts("machine"), 0);
     if (machine_opts) {
         kernel_filename = qemu_opt_get(machine_opts, "kernel");
         initrd_filename = qemu_opt_get(machine_opts, "initrd");
         kernel_cmdline = qemu_opt_get(machine_opts, "append");
+        ram_template = qemu_opt_get(machine_opts, "ram-template");
     } else {
         kernel_filename = initrd_filename = kernel_cmdline = NULL;
     }
@@ -4101,6 +4340,37 @@ int main(int argc, char **argv, char **envp)
     }
     configure_icount(icount_option);
 
+    if (configure_tcg_threads(machine_opts ?
+                              qemu_opt_get(machine_opts, "tcg-threads") :
+                              NULL) < 0) {
+        exit(1);
+    }
+    if (configure_tcg_superblocks(machine_opts ?
+                                  qemu_opt_get_number(machine_opts,
+                                                      "tcg-superblocks", 0) :
+                                  0) < 0) {
+        exit(1);
+    }
+    if (configure_tcg_opt(machine_opts ?
+                          qemu_opt_get(machine_opts, "tcg-opt") : NULL) < 0) {
+        exit(1);
+    }
+    if (configure_tcg_profile(machine_opts ?
+                              qemu_opt_get_bool(machine_opts, "tcg-profile",
+                                                false) : false) < 0) {
+        exit(1);
+    }
+    if (configure_bql_profile(machine_opts ?
+                              qemu_opt_get_bool(machine_opts, "bql-profile",
+                                                false) : false) < 0) {
+        exit(1);
+    }
+    if (configure_halt_poll(machine_opts ?
+                            qemu_opt_get_number(machine_opts, "halt-poll-ns",
+                                                0) : 0) < 0) {
+        exit(1);
+    }
+
     /* clean up network at qemu process termination */
     atexit(&net_cleanup);
 
@@ -4138,6 +4408,7 @@ int main(int argc, char **argv, char **envp)
                   CDROM_OPTS);
     default_drive(default_floppy, snapshot, IF_FLOPPY, 0, FD_OPTS);
     default_drive(default_sdcard, snapshot, IF_SD, 0, SD_OPTS);
+    startup_phase_done("drives");
 
     register_savevm_live(NULL, "ram", 0, 4, &savevm_ram_handlers, NULL);
 
@@ -4232,6 +4503,7 @@ int main(int argc, char **argv, char **envp)
                                  .initrd_filename = initrd_filename,
                                  .cpu_model = cpu_model };
     machine->init(&args);
+    startup_phase_done("machine");
 
     cpu_synchronize_all_post_init();
 
@@ -4248,6 +4520,7 @@ int main(int argc, char **argv, char **envp)
     /* init generic devices */
     if (qemu_opts_foreach(qemu_find_opts("device"), device_init_func, NULL, 1) != 0)
         exit(1);
+    startup_phase_done("devices");
 
     net_check_clients();
 
@@ -4288,8 +4561,11 @@ int main(int argc, char **argv, char **envp)
     /* init remote displays */
     if (vnc_display) {
         Error *local_err = NULL;
+        const char *owner = qemu_set_callback_owner("vnc");
+
         vnc_display_init(ds);
         vnc_display_open(ds, vnc_display, &local_err);
+        qemu_set_callback_owner(owner);
         if (local_err != NULL) {
             fprintf(stderr, "Failed to start VNC server on `%s': %s\n",
                     vnc_display, error_get_pretty(local_err));
@@ -4321,14 +4597,23 @@ int main(int argc, char **argv, char **envp)
         fprintf(stderr, "rom loading failed\n");
         exit(1);
     }
+    startup_phase_done("roms");
 
     /* TODO: once all bus devices are qdevified, this should be done
      * when bus is created by qdev.c */
     qemu_register_reset(qbus_reset_all_fn, sysbus_get_default());
     qemu_run_machine_init_done_notifiers();
 
+    if (ram_template) {
+        /* guest memory already holds what the ROMs put there */
+        rom_set_ram_preloaded();
+    }
     qemu_system_reset(VMRESET_SILENT);
-    if (loadvm) {
+    if (ram_template) {
+        if (load_template_state(ram_template) < 0) {
+            exit(1);
+        }
+    } else if (loadvm) {
         if (load_vmstate(loadvm) < 0) {
             autostart = 0;
         }
@@ -4347,6 +4632,7 @@ int main(int argc, char **argv, char **envp)
     }
 
     os_setup_post();
+    startup_phase_done("reset");
 
     resume_all_vcpus();
     main_loop();
@@ -12,6 +12,149 @@
  */
 #include "qemu-common.h"
 #include "include/migration/migration.h"
+#include "qemu/host-utils.h"
+#include "qemu/host-features.h"
+
+#ifdef CONFIG_AVX2_OPT
+#include <immintrin.h>
+#endif
+
+/*
+ * Run scanners: starting at index i, return the index of the first byte
+ * below slen where old_buf and new_buf differ (end of a zero run) or are
+ * equal (end of a non-zero run).  Return slen if there is no such byte.
+ */
+static inline int zrun_end_long(uint8_t *old_buf, uint8_t *new_buf,
+                                int i, int slen)
+{
+    long res;
+
+    /* not aligned to sizeof(long) */
+    res = (slen - i) % sizeof(long);
+    while (res && old_buf[i] == new_buf[i]) {
+        i++;
+        res--;
+    }
+
+    /* word at a time for speed */
+    if (!res) {
+        while (i < slen &&
+               (*(long *)(old_buf + i)) == (*(long *)(new_buf + i))) {
+            i += sizeof(long);
+        }
+
+        /* go over the rest */
+        while (i < slen && old_buf[i] == new_buf[i]) {
+            i++;
+        }
+    }
+
+    return i;
+}
+
+static inline int nzrun_end_long(uint8_t *old_buf, uint8_t *new_buf,
+                                 int i, int slen)
+{
+    long res, xor;
+
+    /* not aligned to sizeof(long) */
+    res = (slen - i) % sizeof(long);
+    while (res && old_buf[i] != new_buf[i]) {
+        i++;
+        res--;
+    }
+
+    /* word at a time for speed, use of 32-bit long okay */
+    if (!res) {
+        /* truncation to 32-bit long okay */
+        long mask = (long)0x0101010101010101ULL;
+        while (i < slen) {
+            xor = *(long *)(old_buf + i) ^ *(long *)(new_buf + i);
+            if ((xor - mask) & ~xor & (mask << 7)) {
+                /* found the end of an nzrun within the current long */
+                while (old_buf[i] != new_buf[i]) {
+                    i++;
+                }
+                break;
+            } else {
+                i += sizeof(long);
+            }
+        }
+    }
+
+    return i;
+}
+
+#ifdef CONFIG_AVX2_OPT
+/* movemask of the byte-wise comparison has bit n set if byte n is equal;
+ * a zero run ends at the first clear bit, a non-zero run at the first set
+ * bit.  The tail that does not fill a vector is handled by the long
+ * scanners. */
+static inline __attribute__((target("sse2")))
+int zrun_end_sse2(uint8_t *old_buf, uint8_t *new_buf, int i, int slen)
+{
+    while (i + 16 <= slen) {
+        __m128i eq = _mm_cmpeq_epi8(_mm_loadu_si128((__m128i *)(old_buf + i)),
+                                    _mm_loadu_si128((__m128i *)(new_buf + i)));
+        unsigned int mask = _mm_movemask_epi8(eq) ^ 0xFFFF;
+        if (mask) {
+            return i + ctz32(mask);
+        }
+        i += 16;
+    }
+    return zrun_end_long(old_buf, new_buf, i, slen);
+}
+
+static inline __attribute__((target("sse2")))
+int nzrun_end_sse2(uint8_t *old_buf, uint8_t *new_buf, int i, int slen)
+{
+    while (i + 16 <= slen) {
+        __m128i eq = _mm_cmpeq_epi8(_mm_loadu_si128((__m128i *)(old_buf + i)),
+                                    _mm_loadu_si128((__m128i *)(new_buf + i)));
+        unsigned int mask = _mm_movemask_epi8(eq);
+        if (mask) {
+            return i + ctz32(mask);
+        }
+        i += 16;
+    }
+    return nzrun_end_long(old_buf, new_buf, i, slen);
+}
+
+static inline __attribute__((target("avx2")))
+int zrun_end_avx2(uint8_t *old_buf, uint8_t *new_buf, int i, int slen)
+{
+    while (i + 32 <= slen) {
+        __m256i eq = _mm256_cmpeq_epi8(
+            _mm256_loadu_si256((__m256i *)(old_buf + i)),
+            _mm256_loadu_si256((__m256i *)(new_buf + i)));
+        uint32_t mask = ~(uint32_t)_mm256_movemask_epi8(eq);
+        if (mask) {
+            return i + ctz32(mask);
+        }
+        i += 32;
+    }
+    return zrun_end_long(old_buf, new_buf, i, slen);
+}
+
+static inline __attribute__((target("avx2")))
+int nzrun_end_avx2(uint8_t *old_buf, uint8_t *new_buf, int i, int slen)
+{
+    while (i + 32 <= slen) {
+        __m256i eq = _mm256_cmpeq_epi8(
+            _mm256_loadu_si256((__m256i *)(old_buf + i)),
+            _mm256_loadu_si256((__m256i *)(new_buf + i)));
+        uint32_t mask = _mm256_movemask_epi8(eq);
+        if (mask) {
+            return i + ctz32(mask);
+        }
+        i += 32;
+    }
+    return nzrun_end_long(old_buf, new_buf, i, slen);
+}
+#endif
+
+typedef int (XBZRLEScanFunc)(uint8_t *old_buf, uint8_t *new_buf,
+                             int i, int slen);
 
 /*
   page = zrun nzrun
@@ -23,13 +166,13 @@
 
   length = uleb128 encoded integer
  */
-int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
-                         uint8_t *dst, int dlen)
+static inline int xbzrle_encode(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                                uint8_t *dst, int dlen,
+                                XBZRLEScanFunc *zrun_end,
+                                XBZRLEScanFunc *nzrun_end)
 {
     uint32_t zrun_len = 0, nzrun_len = 0;
-    int d = 0, i = 0;
-    long res, xor;
-    uint8_t *nzrun_start = NULL;
+    int d = 0, i = 0, j;
 
     g_assert(!(((uintptr_t)old_buf | (uintptr_t)new_buf | slen) %
                sizeof(long)));
@@ -40,28 +183,9 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
             return -1;
         }
 
-        /* not aligned to sizeof(long) */
-        res = (slen - i) % sizeof(long);
-        while (res && old_buf[i] == new_buf[i]) {
-            zrun_len++;
-            i++;
-            res--;
-        }
-
-        /* word at a time for speed */
-        if (!res) {
-            while (i < slen &&
-                   (*(long *)(old_buf + i)) == (*(long *)(new_buf + i))) {
-                i += sizeof(long);
-                zrun_len += sizeof(long);
-            }
-
-            /* go over the rest */
-            while (i < slen && old_buf[i] == new_buf[i]) {
-                zrun_len++;
-                i++;
-            }
-        }
+        j = zrun_end(old_buf, new_buf, i, slen);
+        zrun_len = j - i;
+        i = j;
 
         /* buffer unchanged */
         if (zrun_len == slen) {
@@ -75,54 +199,66 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
 
         d += uleb128_encode_small(dst + d, zrun_len);
 
-        zrun_len = 0;
-        nzrun_start = new_buf + i;
-
         /* overflow */
         if (d + 2 > dlen) {
             return -1;
         }
-        /* not aligned to sizeof(long) */
-        res = (slen - i) % sizeof(long);
-        while (res && old_buf[i] != new_buf[i]) {
-            i++;
-            nzrun_len++;
-            res--;
-        }
-
-        /* word at a time for speed, use of 32-bit long okay */
-        if (!res) {
-            /* truncation to 32-bit long okay */
-            long mask = (long)0x0101010101010101ULL;
-            while (i < slen) {
-                xor = *(long *)(old_buf + i) ^ *(long *)(new_buf + i);
-                if ((xor - mask) & ~xor & (mask << 7)) {
-                    /* found the end of an nzrun within the current long */
-                    while (old_buf[i] != new_buf[i]) {
-                        nzrun_len++;
-                        i++;
-                    }
-                    break;
-                } else {
-                    i += sizeof(long);
-                    nzrun_len += sizeof(long);
-                }
-            }
-        }
+
+        j = nzrun_end(old_buf, new_buf, i, slen);
+        nzrun_len = j - i;
 
         d += uleb128_encode_small(dst + d, nzrun_len);
         /* overflow */
         if (d + nzrun_len > dlen) {
             return -1;
         }
-        memcpy(dst + d, nzrun_start, nzrun_len);
+        memcpy(dst + d, new_buf + i, nzrun_len);
         d += nzrun_len;
-        nzrun_len = 0;
+        i = j;
     }
 
     return d;
 }
 
+static int xbzrle_encode_long(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                              uint8_t *dst, int dlen)
+{
+    return xbzrle_encode(old_buf, new_buf, slen, dst, dlen,
+                         zrun_end_long, nzrun_end_long);
+}
+
+#ifdef CONFIG_AVX2_OPT
+static int __attribute__((target("sse2")))
+xbzrle_encode_sse2(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                   uint8_t *dst, int dlen)
+{
+    return xbzrle_encode(old_buf, new_buf, slen, dst, dlen,
+                         zrun_end_sse2, nzrun_end_sse2);
+}
+
+static int __attribute__((target("avx2")))
+xbzrle_encode_avx2(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                   uint8_t *dst, int dlen)
+{
+    return xbzrle_encode(old_buf, new_buf, slen, dst, dlen,
+                         zrun_end_avx2, nzrun_end_avx2);
+}
+#endif
+
+int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                         uint8_t *dst, int dlen)
+{
+#ifdef CONFIG_AVX2_OPT
+    if (qemu_host_features & QEMU_HOST_FEATURE_AVX2) {
+        return xbzrle_encode_avx2(old_buf, new_buf, slen, dst, dlen);
+    }
+    if (qemu_host_features & QEMU_HOST_FEATURE_SSE2) {
+        return xbzrle_encode_sse2(old_buf, new_buf, slen, dst, dlen);
+    }
+#endif
+    return xbzrle_encode_long(old_buf, new_buf, slen, dst, dlen);
+}
+
 int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen)
 {
     int i = 0, d = 0;
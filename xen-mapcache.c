@@ -15,6 +15,8 @@
 #include "hw/xen_backend.h"
 #include "sysemu/blockdev.h"
 #include "qemu/bitmap.h"
+#include "qemu/config-file.h"
+#include "qemu/thread.h"
 
 #include <xen/hvm/params.h>
 #include <sys/mman.h>
@@ -33,14 +35,20 @@
 #  define DPRINTF(fmt, ...) do { } while (0)
 #endif
 
+/* The bucket size can be raised with -machine xen-mapcache-bucket=size;
+ * with 1GB buckets the whole RAM of most guests is mapped by a few dozen
+ * buckets that are never remapped.
+ */
 #if defined(__i386__)
-#  define MCACHE_BUCKET_SHIFT 16
+#  define MCACHE_BUCKET_SHIFT     16
+#  define MCACHE_MAX_BUCKET_SHIFT 24
 #  define MCACHE_MAX_SIZE     (1UL<<31) /* 2GB Cap */
 #elif defined(__x86_64__)
-#  define MCACHE_BUCKET_SHIFT 20
+#  define MCACHE_BUCKET_SHIFT     20
+#  define MCACHE_MAX_BUCKET_SHIFT 30
 #  define MCACHE_MAX_SIZE     (1UL<<35) /* 32GB Cap */
 #endif
-#define MCACHE_BUCKET_SIZE (1UL << MCACHE_BUCKET_SHIFT)
+#define MCACHE_BUCKET_SIZE (1UL << mapcache->mcache_bucket_shift)
 
 /* This is the size of the virtual address space reserve to QEMU that will not
  * be use by MapCache.
@@ -49,8 +57,9 @@
  */
 #define NON_MCACHE_MEMORY_SIZE (80 * 1024 * 1024)
 
-#define mapcache_lock()   ((void)0)
-#define mapcache_unlock() ((void)0)
+/* Dataplane threads map guest memory without the global mutex */
+#define mapcache_lock()   qemu_mutex_lock(&mapcache->lock)
+#define mapcache_unlock() qemu_mutex_unlock(&mapcache->lock)
 
 typedef struct MapCacheEntry {
     hwaddr paddr_index;
@@ -81,6 +90,7 @@ typedef struct MapCache {
 
     phys_offset_to_gaddr_t phys_offset_to_gaddr;
     void *opaque;
+    QemuMutex lock;
 } MapCache;
 
 static MapCache *mapcache;
@@ -94,6 +104,25 @@ static inline int test_bits(int nr, int size, const unsigned long *addr)
         return 0;
 }
 
+static unsigned int xen_map_cache_bucket_shift(void)
+{
+    QemuOpts *opts = qemu_opts_find(qemu_find_opts("machine"), NULL);
+    uint64_t size;
+
+    size = opts ? qemu_opt_get_size(opts, "xen-mapcache-bucket", 0) : 0;
+    if (!size) {
+        return MCACHE_BUCKET_SHIFT;
+    }
+    if (!is_power_of_2(size) || size < XC_PAGE_SIZE ||
+        size > (1ULL << MCACHE_MAX_BUCKET_SHIFT)) {
+        fprintf(stderr, "xen-mapcache-bucket must be a power of two"
+                " between %luK and %luM\n", (unsigned long)XC_PAGE_SIZE >> 10,
+                (1UL << MCACHE_MAX_BUCKET_SHIFT) >> 20);
+        exit(1);
+    }
+    return ctz64(size);
+}
+
 void xen_map_cache_init(phys_offset_to_gaddr_t f, void *opaque)
 {
     unsigned long size;
@@ -103,6 +132,8 @@ void xen_map_cache_init(phys_offset_to_gaddr_t f, void *opaque)
 
     mapcache->phys_offset_to_gaddr = f;
     mapcache->opaque = opaque;
+    mapcache->mcache_bucket_shift = xen_map_cache_bucket_shift();
+    qemu_mutex_init(&mapcache->lock);
 
     QTAILQ_INIT(&mapcache->locked_entries);
     mapcache->last_address_index = -1;
@@ -131,8 +162,8 @@ void xen_map_cache_init(phys_offset_to_gaddr_t f, void *opaque)
 
     mapcache->nr_buckets =
         (((mapcache->max_mcache_size >> XC_PAGE_SHIFT) +
-          (1UL << (MCACHE_BUCKET_SHIFT - XC_PAGE_SHIFT)) - 1) >>
-         (MCACHE_BUCKET_SHIFT - XC_PAGE_SHIFT));
+          (1UL << (mapcache->mcache_bucket_shift - XC_PAGE_SHIFT)) - 1) >>
+         (mapcache->mcache_bucket_shift - XC_PAGE_SHIFT));
 
     size = mapcache->nr_buckets * sizeof (MapCacheEntry);
     size = (size + XC_PAGE_SIZE - 1) & ~(XC_PAGE_SIZE - 1);
@@ -168,7 +199,8 @@ static void xen_remap_bucket(MapCacheEntry *entry,
     }
 
     for (i = 0; i < nb_pfn; i++) {
-        pfns[i] = (address_index << (MCACHE_BUCKET_SHIFT-XC_PAGE_SHIFT)) + i;
+        pfns[i] = (address_index <<
+                   (mapcache->mcache_bucket_shift - XC_PAGE_SHIFT)) + i;
     }
 
     vaddr_base = xc_map_foreign_bulk(xen_xc, xen_domid, PROT_READ|PROT_WRITE,
@@ -195,8 +227,8 @@ static void xen_remap_bucket(MapCacheEntry *entry,
     g_free(err);
 }
 
-uint8_t *xen_map_cache(hwaddr phys_addr, hwaddr size,
-                       uint8_t lock)
+static uint8_t *xen_map_cache_unlocked(hwaddr phys_addr, hwaddr size,
+                                       uint8_t lock)
 {
     MapCacheEntry *entry, *pentry = NULL;
     hwaddr address_index;
@@ -205,7 +237,7 @@ uint8_t *xen_map_cache(hwaddr phys_addr, hwaddr size,
     bool translated = false;
 
 tryagain:
-    address_index  = phys_addr >> MCACHE_BUCKET_SHIFT;
+    address_index  = phys_addr >> mapcache->mcache_bucket_shift;
     address_offset = phys_addr & (MCACHE_BUCKET_SIZE - 1);
 
     trace_xen_map_cache(phys_addr);
@@ -274,14 +306,27 @@ tryagain:
     return mapcache->last_address_vaddr + address_offset;
 }
 
+uint8_t *xen_map_cache(hwaddr phys_addr, hwaddr size,
+                       uint8_t lock)
+{
+    uint8_t *p;
+
+    mapcache_lock();
+    p = xen_map_cache_unlocked(phys_addr, size, lock);
+    mapcache_unlock();
+    return p;
+}
+
 ram_addr_t xen_ram_addr_from_mapcache(void *ptr)
 {
     MapCacheEntry *entry = NULL;
     MapCacheRev *reventry;
     hwaddr paddr_index;
     hwaddr size;
+    ram_addr_t raddr;
     int found = 0;
 
+    mapcache_lock();
     QTAILQ_FOREACH(reventry, &mapcache->locked_entries, next) {
         if (reventry->vaddr_req == ptr) {
             paddr_index = reventry->paddr_index;
@@ -306,13 +351,16 @@ ram_addr_t xen_ram_addr_from_mapcache(void *ptr)
     }
     if (!entry) {
         DPRINTF("Trying to find address %p that is not in the mapcache!\n", ptr);
-        return 0;
+        raddr = 0;
+    } else {
+        raddr = (reventry->paddr_index << mapcache->mcache_bucket_shift) +
+            ((unsigned long) ptr - (unsigned long) entry->vaddr_base);
     }
-    return (reventry->paddr_index << MCACHE_BUCKET_SHIFT) +
-        ((unsigned long) ptr - (unsigned long) entry->vaddr_base);
+    mapcache_unlock();
+    return raddr;
 }
 
-void xen_invalidate_map_cache_entry(uint8_t *buffer)
+static void xen_invalidate_map_cache_entry_unlocked(uint8_t *buffer)
 {
     MapCacheEntry *entry = NULL, *pentry = NULL;
     MapCacheRev *reventry;
@@ -366,6 +414,13 @@ void xen_invalidate_map_cache_entry(uint8_t *buffer)
     g_free(entry);
 }
 
+void xen_invalidate_map_cache_entry(uint8_t *buffer)
+{
+    mapcache_lock();
+    xen_invalidate_map_cache_entry_unlocked(buffer);
+    mapcache_unlock();
+}
+
 void xen_invalidate_map_cache(void)
 {
     unsigned long i;